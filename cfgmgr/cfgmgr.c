@@ -28,6 +28,7 @@
 #include "LibSha256.h"
 #include "cfgmgr.h"
 #include "../ddraw/resource.h"
+#include "../common/version.h"
 #include <tchar.h>
 #include <math.h>
 #include <float.h>
@@ -47,12 +48,14 @@ static const TCHAR regkeyprofiles[] = _T("Software\\DXGL\\Profiles_x64\\");
 static const TCHAR profilesname[] = _T("Profiles_x64\\");
 static const TCHAR configversion[] = _T("Configuration Version x64");
 static const TCHAR regkeyprofilesmigrated[] = _T("Software\\DXGL\\ProfilesMigrated_x64\\");
+static const TCHAR regkeyconfigcache[] = _T("Software\\DXGL\\ConfigCache_x64");
 #else
 static const TCHAR regkeyglobal[] = _T("Software\\DXGL\\Global");
 static const TCHAR regkeyprofiles[] = _T("Software\\DXGL\\Profiles\\");
 static const TCHAR profilesname[] = _T("Profiles\\");
 static const TCHAR configversion[] = _T("Configuration Version");
 static const TCHAR regkeyprofilesmigrated[] = _T("Software\\DXGL\\ProfilesMigrated\\");
+static const TCHAR regkeyconfigcache[] = _T("Software\\DXGL\\ConfigCache");
 #endif
 static const TCHAR regkeybase[] = _T("Software\\DXGL\\");
 static const TCHAR regkeydxgl[] = _T("Software\\DXGL");
@@ -71,6 +74,20 @@ DXGLCFG defaultmask;
 
 static int ini_currentsection = 0;
 static int ini_depth = 0;
+static BOOL ini_include = FALSE;  // Set when an INI file includes another file
+
+// Increment when the cache layout or the way settings are merged changes
+#define CFGCACHE_VERSION 1
+
+// Merged configuration of a profile, stored as one binary value per profile
+// under regkeyconfigcache so GetCurrentConfig can skip reading each setting.
+typedef struct CFGCACHE
+{
+	DWORD version;
+	DWORD size;  // sizeof(DXGLCFG)
+	BYTE stamp[32];  // SHA-256 of the sources the configuration was read from
+	DXGLCFG cfg;
+} CFGCACHE;
 
 void _tchartowchar(WCHAR *dest, TCHAR *src, int length)
 {
@@ -691,6 +708,8 @@ void ReadSettings(HKEY hKey, DXGLCFG *cfg, DXGLCFG *mask, BOOL global, BOOL dll,
 	cfg->LowColorRendering = ReadDWORD(hKey, cfg->LowColorRendering, &cfgmask->LowColorRendering, _T("LowColorRendering"));
 	cfg->EnableDithering = ReadDWORD(hKey, cfg->EnableDithering, &cfgmask->EnableDithering, _T("EnableDithering"));
 	cfg->LimitTextureFormats = ReadDWORD(hKey, cfg->LimitTextureFormats, &cfgmask->LimitTextureFormats, _T("LimitTextureFormats"));
+	cfg->RenderScale = ReadDWORD(hKey, cfg->RenderScale, &cfgmask->RenderScale, _T("RenderScale"));
+	cfg->ColorKeyAlpha = ReadBool(hKey, cfg->ColorKeyAlpha, &cfgmask->ColorKeyAlpha, _T("ColorKeyAlpha"));
 	cfg->VertexBufferSize = ReadDWORD(hKey, cfg->VertexBufferSize, &cfgmask->VertexBufferSize, _T("VertexBufferSize"));
 	cfg->IndexBufferSize = ReadDWORD(hKey, cfg->IndexBufferSize, &cfgmask->IndexBufferSize, _T("IndexBufferSize"));
 	cfg->UnpackBufferSize = ReadDWORD(hKey, cfg->UnpackBufferSize, &cfgmask->UnpackBufferSize, _T("UnpackBufferSize"));
@@ -717,6 +736,8 @@ void ReadSettings(HKEY hKey, DXGLCFG *cfg, DXGLCFG *mask, BOOL global, BOOL dll,
 	cfg->vsync = ReadDWORD(hKey,cfg->vsync,&cfgmask->vsync,_T("VSync"));
 	cfg->TextureFormat = ReadDWORD(hKey,cfg->TextureFormat,&cfgmask->TextureFormat,_T("TextureFormat"));
 	cfg->TexUpload = ReadDWORD(hKey,cfg->TexUpload,&cfgmask->TexUpload,_T("TexUpload"));
+	cfg->RenderBackend = ReadDWORD(hKey, cfg->RenderBackend, &cfgmask->RenderBackend, _T("RenderBackend"));
+	cfg->BindlessTextures = ReadBool(hKey, cfg->BindlessTextures, &cfgmask->BindlessTextures, _T("BindlessTextures"));
 	cfg->SingleBufferDevice = ReadBool(hKey,cfg->SingleBufferDevice,&cfgmask->SingleBufferDevice,_T("SingleBufferDevice"));
 	cfg->WindowPosition = ReadDWORD(hKey, cfg->WindowPosition, &cfgmask->WindowPosition, _T("WindowPosition"));
 	cfg->RememberWindowSize = ReadBool(hKey, cfg->RememberWindowSize, &cfgmask->RememberWindowSize, _T("RememberWindowSize"));
@@ -726,6 +747,35 @@ void ReadSettings(HKEY hKey, DXGLCFG *cfg, DXGLCFG *mask, BOOL global, BOOL dll,
 	cfg->WindowHeight = ReadDWORD(hKey, cfg->WindowHeight, &cfgmask->WindowHeight, _T("WindowHeight"));
 	cfg->WindowMaximized = ReadDWORD(hKey, cfg->WindowMaximized, &cfgmask->WindowMaximized, _T("WindowMaximized"));
 	cfg->CaptureMouse = ReadDWORD(hKey, cfg->CaptureMouse, &cfgmask->CaptureMouse, _T("CaptureMouse"));
+	cfg->ShaderCache = ReadBool(hKey, cfg->ShaderCache, &cfgmask->ShaderCache, _T("ShaderCache"));
+	cfg->CapsCache = ReadBool(hKey, cfg->CapsCache, &cfgmask->CapsCache, _T("CapsCache"));
+	cfg->ShaderPreload = ReadBool(hKey, cfg->ShaderPreload, &cfgmask->ShaderPreload, _T("ShaderPreload"));
+	cfg->ShaderCompileMode = ReadDWORD(hKey, cfg->ShaderCompileMode, &cfgmask->ShaderCompileMode, _T("ShaderCompileMode"));
+	cfg->AsyncReadback = ReadBool(hKey, cfg->AsyncReadback, &cfgmask->AsyncReadback, _T("AsyncReadback"));
+	cfg->PersistentDC = ReadBool(hKey, cfg->PersistentDC, &cfgmask->PersistentDC, _T("PersistentDC"));
+	cfg->PointerValidation = ReadDWORD(hKey, cfg->PointerValidation, &cfgmask->PointerValidation, _T("PointerValidation"));
+	cfg->FormatConversion = ReadDWORD(hKey, cfg->FormatConversion, &cfgmask->FormatConversion, _T("FormatConversion"));
+	cfg->TexturePoolSize = ReadDWORD(hKey, cfg->TexturePoolSize, &cfgmask->TexturePoolSize, _T("TexturePoolSize"));
+	cfg->BltCoalescing = ReadBool(hKey, cfg->BltCoalescing, &cfgmask->BltCoalescing, _T("BltCoalescing"));
+	cfg->TextureAtlasSize = ReadDWORD(hKey, cfg->TextureAtlasSize, &cfgmask->TextureAtlasSize, _T("TextureAtlasSize"));
+	cfg->TextureMemoryBudget = ReadDWORD(hKey, cfg->TextureMemoryBudget, &cfgmask->TextureMemoryBudget, _T("TextureMemoryBudget"));
+	cfg->CompressTextures = ReadBool(hKey, cfg->CompressTextures, &cfgmask->CompressTextures, _T("CompressTextures"));
+	cfg->TextureUploadBudget = ReadDWORD(hKey, cfg->TextureUploadBudget, &cfgmask->TextureUploadBudget, _T("TextureUploadBudget"));
+	cfg->StreamMipmaps = ReadBool(hKey, cfg->StreamMipmaps, &cfgmask->StreamMipmaps, _T("StreamMipmaps"));
+	cfg->AdaptiveVsync = ReadBool(hKey, cfg->AdaptiveVsync, &cfgmask->AdaptiveVsync, _T("AdaptiveVsync"));
+	cfg->MaxFramesInFlight = ReadDWORD(hKey, cfg->MaxFramesInFlight, &cfgmask->MaxFramesInFlight, _T("MaxFramesInFlight"));
+	cfg->PresentQueueDepth = ReadDWORD(hKey, cfg->PresentQueueDepth, &cfgmask->PresentQueueDepth, _T("PresentQueueDepth"));
+	cfg->FlipModelPresent = ReadBool(hKey, cfg->FlipModelPresent, &cfgmask->FlipModelPresent, _T("FlipModelPresent"));
+	cfg->DwmVsync = ReadBool(hKey, cfg->DwmVsync, &cfgmask->DwmVsync, _T("DwmVsync"));
+	cfg->FrameLimit = ReadDWORD(hKey, cfg->FrameLimit, &cfgmask->FrameLimit, _T("FrameLimit"));
+	cfg->VBlankSource = ReadDWORD(hKey, cfg->VBlankSource, &cfgmask->VBlankSource, _T("VBlankSource"));
+	cfg->ThreadTask = ReadDWORD(hKey, cfg->ThreadTask, &cfgmask->ThreadTask, _T("ThreadTask"));
+	cfg->ThreadPriority = ReadDWORD(hKey, cfg->ThreadPriority, &cfgmask->ThreadPriority, _T("ThreadPriority"));
+	cfg->RendererAffinity = ReadDWORD(hKey, cfg->RendererAffinity, &cfgmask->RendererAffinity, _T("RendererAffinity"));
+	cfg->LargePages = ReadBool(hKey, cfg->LargePages, &cfgmask->LargePages, _T("LargePages"));
+	cfg->ScreenshotKey = ReadDWORD(hKey, cfg->ScreenshotKey, &cfgmask->ScreenshotKey, _T("ScreenshotKey"));
+	cfg->RecordKey = ReadDWORD(hKey, cfg->RecordKey, &cfgmask->RecordKey, _T("RecordKey"));
+	cfg->CaptureSource = ReadDWORD(hKey, cfg->CaptureSource, &cfgmask->CaptureSource, _T("CaptureSource"));
 	ReadWindowPos(hKey, cfg, cfgmask);
 	cfg->Windows8Detected = ReadBool(hKey,cfg->Windows8Detected,&cfgmask->Windows8Detected,_T("Windows8Detected"));
 	cfg->DPIScale = ReadDWORD(hKey,cfg->DPIScale,&cfgmask->DPIScale,_T("DPIScale"));
@@ -742,9 +792,18 @@ void ReadSettings(HKEY hKey, DXGLCFG *cfg, DXGLCFG *mask, BOOL global, BOOL dll,
 	cfg->DebugBlendDestColorKey = ReadBool(hKey, cfg->DebugBlendDestColorKey, &cfgmask->DebugBlendDestColorKey, _T("DebugBlendDestColorKey"));
 	cfg->DebugNoMouseHooks = ReadBool(hKey, cfg->DebugNoMouseHooks, &cfgmask->DebugNoMouseHooks, _T("DebugNoMouseHooks"));
 	cfg->DebugNoPaletteRedraw = ReadBool(hKey, cfg->DebugNoPaletteRedraw, &cfgmask->DebugNoPaletteRedraw, _T("DebugNoPaletteRedraw"));
+	cfg->DebugMarkers = ReadBool(hKey, cfg->DebugMarkers, &cfgmask->DebugMarkers, _T("DebugMarkers"));
+	cfg->DebugView = ReadDWORD(hKey, cfg->DebugView, &cfgmask->DebugView, _T("DebugView"));
 	cfg->DebugMaxGLVersionMajor = ReadDWORD(hKey, cfg->DebugMaxGLVersionMajor, &cfgmask->DebugMaxGLVersionMajor, _T("DebugMaxGLVersionMajor"));
 	cfg->DebugMaxGLVersionMinor = ReadDWORD(hKey, cfg->DebugMaxGLVersionMinor, &cfgmask->DebugMaxGLVersionMinor, _T("DebugMaxGLVersionMinor"));
 	cfg->DebugTraceLevel = ReadDWORD(hKey, cfg->DebugTraceLevel, &cfgmask->DebugTraceLevel, _T("DebugTraceLevel"));
+	cfg->DebugTraceBinary = ReadBool(hKey, cfg->DebugTraceBinary, &cfgmask->DebugTraceBinary, _T("DebugTraceBinary"));
+	cfg->DebugTimeline = ReadBool(hKey, cfg->DebugTimeline, &cfgmask->DebugTimeline, _T("DebugTimeline"));
+	cfg->DebugShaderTiming = ReadBool(hKey, cfg->DebugShaderTiming, &cfgmask->DebugShaderTiming, _T("DebugShaderTiming"));
+	cfg->DebugSurfaceProfile = ReadBool(hKey, cfg->DebugSurfaceProfile, &cfgmask->DebugSurfaceProfile, _T("DebugSurfaceProfile"));
+	cfg->DebugLatency = ReadBool(hKey, cfg->DebugLatency, &cfgmask->DebugLatency, _T("DebugLatency"));
+	cfg->DebugCapture = ReadBool(hKey, cfg->DebugCapture, &cfgmask->DebugCapture, _T("DebugCapture"));
+	cfg->DebugStutterThreshold = ReadDWORD(hKey, cfg->DebugStutterThreshold, &cfgmask->DebugStutterThreshold, _T("DebugStutterThreshold"));
 	cfg->HackCrop640480to640400 = ReadBool(hKey, cfg->HackCrop640480to640400, &cfgmask->HackCrop640480to640400, _T("HackCrop640480to640400"));
 	cfg->HackAutoExpandViewport = ReadDWORDWithObsolete(hKey, cfg->HackAutoExpandViewport, &cfgmask->HackAutoExpandViewport, _T("HackAutoExpandViewport"),
 		1, _T("HackAutoScale512448to640480"));
@@ -754,6 +813,7 @@ void ReadSettings(HKEY hKey, DXGLCFG *cfg, DXGLCFG *mask, BOOL global, BOOL dll,
 	cfg->HackSetCursor = ReadBool(hKey, cfg->HackSetCursor, &cfgmask->HackSetCursor, _T("HackSetCursor"));
 	cfg->HackPaletteDelay = ReadDWORD(hKey, cfg->HackPaletteDelay, &cfgmask->HackPaletteDelay, _T("HackPaletteDelay"));
 	cfg->HackPaletteVsync = ReadBool(hKey, cfg->HackPaletteVsync, &cfgmask->HackPaletteVsync, _T("HackPaletteVsync"));
+	cfg->HackWriteWatch = ReadBool(hKey, cfg->HackWriteWatch, &cfgmask->HackWriteWatch, _T("HackWriteWatch"));
 	if(!global && dll)
 	{
 		sizeout = 0;
@@ -873,6 +933,8 @@ void WriteSettings(HKEY hKey, const DXGLCFG *cfg, const DXGLCFG *mask)
 	WriteDWORD(hKey, cfg->LowColorRendering, cfgmask->LowColorRendering, _T("LowColorRendering"));
 	WriteDWORD(hKey, cfg->EnableDithering, cfgmask->EnableDithering, _T("EnableDithering"));
 	WriteDWORD(hKey, cfg->LimitTextureFormats, cfgmask->LimitTextureFormats, _T("LimitTextureFormats"));
+	WriteDWORD(hKey, cfg->RenderScale, cfgmask->RenderScale, _T("RenderScale"));
+	WriteBool(hKey, cfg->ColorKeyAlpha, cfgmask->ColorKeyAlpha, _T("ColorKeyAlpha"));
 	WriteDWORD(hKey, cfg->VertexBufferSize, cfgmask->VertexBufferSize, _T("VertexBufferSize"));
 	WriteDWORD(hKey, cfg->IndexBufferSize, cfgmask->IndexBufferSize, _T("IndexBufferSize"));
 	WriteDWORD(hKey, cfg->UnpackBufferSize, cfgmask->UnpackBufferSize, _T("UnpackBufferSize"));
@@ -897,6 +959,8 @@ void WriteSettings(HKEY hKey, const DXGLCFG *cfg, const DXGLCFG *mask)
 	WriteDWORD(hKey,cfg->vsync,cfgmask->vsync,_T("VSync"));
 	WriteDWORD(hKey,cfg->TextureFormat,cfgmask->TextureFormat,_T("TextureFormat"));
 	WriteDWORD(hKey,cfg->TexUpload,cfgmask->TexUpload,_T("TexUpload"));
+	WriteDWORD(hKey, cfg->RenderBackend, cfgmask->RenderBackend, _T("RenderBackend"));
+	WriteBool(hKey, cfg->BindlessTextures, cfgmask->BindlessTextures, _T("BindlessTextures"));
 	WriteBool(hKey,cfg->SingleBufferDevice,cfgmask->SingleBufferDevice,_T("SingleBufferDevice"));
 	WriteDWORD(hKey, cfg->WindowPosition, cfgmask->WindowPosition, _T("WindowPosition"));
 	WriteBool(hKey, cfg->RememberWindowSize, cfgmask->RememberWindowSize, _T("RememberWindowSize"));
@@ -908,6 +972,35 @@ void WriteSettings(HKEY hKey, const DXGLCFG *cfg, const DXGLCFG *mask)
 	WriteDWORD(hKey, cfg->WindowHeight, cfgmask->WindowHeight, _T("WindowHeight"));
 	WriteDWORD(hKey, cfg->WindowMaximized, cfgmask->WindowMaximized, _T("WindowMaximized"));
 	WriteDWORD(hKey, cfg->CaptureMouse, cfgmask->CaptureMouse, _T("CaptureMouse"));
+	WriteBool(hKey, cfg->ShaderCache, cfgmask->ShaderCache, _T("ShaderCache"));
+	WriteBool(hKey, cfg->CapsCache, cfgmask->CapsCache, _T("CapsCache"));
+	WriteBool(hKey, cfg->ShaderPreload, cfgmask->ShaderPreload, _T("ShaderPreload"));
+	WriteDWORD(hKey, cfg->ShaderCompileMode, cfgmask->ShaderCompileMode, _T("ShaderCompileMode"));
+	WriteBool(hKey, cfg->AsyncReadback, cfgmask->AsyncReadback, _T("AsyncReadback"));
+	WriteBool(hKey, cfg->PersistentDC, cfgmask->PersistentDC, _T("PersistentDC"));
+	WriteDWORD(hKey, cfg->PointerValidation, cfgmask->PointerValidation, _T("PointerValidation"));
+	WriteDWORD(hKey, cfg->FormatConversion, cfgmask->FormatConversion, _T("FormatConversion"));
+	WriteDWORD(hKey, cfg->TexturePoolSize, cfgmask->TexturePoolSize, _T("TexturePoolSize"));
+	WriteBool(hKey, cfg->BltCoalescing, cfgmask->BltCoalescing, _T("BltCoalescing"));
+	WriteDWORD(hKey, cfg->TextureAtlasSize, cfgmask->TextureAtlasSize, _T("TextureAtlasSize"));
+	WriteDWORD(hKey, cfg->TextureMemoryBudget, cfgmask->TextureMemoryBudget, _T("TextureMemoryBudget"));
+	WriteBool(hKey, cfg->CompressTextures, cfgmask->CompressTextures, _T("CompressTextures"));
+	WriteDWORD(hKey, cfg->TextureUploadBudget, cfgmask->TextureUploadBudget, _T("TextureUploadBudget"));
+	WriteBool(hKey, cfg->StreamMipmaps, cfgmask->StreamMipmaps, _T("StreamMipmaps"));
+	WriteBool(hKey, cfg->AdaptiveVsync, cfgmask->AdaptiveVsync, _T("AdaptiveVsync"));
+	WriteDWORD(hKey, cfg->MaxFramesInFlight, cfgmask->MaxFramesInFlight, _T("MaxFramesInFlight"));
+	WriteDWORD(hKey, cfg->PresentQueueDepth, cfgmask->PresentQueueDepth, _T("PresentQueueDepth"));
+	WriteBool(hKey, cfg->FlipModelPresent, cfgmask->FlipModelPresent, _T("FlipModelPresent"));
+	WriteBool(hKey, cfg->DwmVsync, cfgmask->DwmVsync, _T("DwmVsync"));
+	WriteDWORD(hKey, cfg->FrameLimit, cfgmask->FrameLimit, _T("FrameLimit"));
+	WriteDWORD(hKey, cfg->VBlankSource, cfgmask->VBlankSource, _T("VBlankSource"));
+	WriteDWORD(hKey, cfg->ThreadTask, cfgmask->ThreadTask, _T("ThreadTask"));
+	WriteDWORD(hKey, cfg->ThreadPriority, cfgmask->ThreadPriority, _T("ThreadPriority"));
+	WriteDWORD(hKey, cfg->RendererAffinity, cfgmask->RendererAffinity, _T("RendererAffinity"));
+	WriteBool(hKey, cfg->LargePages, cfgmask->LargePages, _T("LargePages"));
+	WriteDWORD(hKey, cfg->ScreenshotKey, cfgmask->ScreenshotKey, _T("ScreenshotKey"));
+	WriteDWORD(hKey, cfg->RecordKey, cfgmask->RecordKey, _T("RecordKey"));
+	WriteDWORD(hKey, cfg->CaptureSource, cfgmask->CaptureSource, _T("CaptureSource"));
 	WriteBool(hKey,cfg->Windows8Detected,cfgmask->Windows8Detected,_T("Windows8Detected"));
 	WriteDWORD(hKey,cfg->DPIScale,cfgmask->DPIScale,_T("DPIScale"));
 	WriteFloat(hKey, cfg->aspect, cfgmask->aspect, _T("ScreenAspect"));
@@ -923,9 +1016,18 @@ void WriteSettings(HKEY hKey, const DXGLCFG *cfg, const DXGLCFG *mask)
 	WriteBool(hKey, cfg->DebugBlendDestColorKey, cfgmask->DebugBlendDestColorKey, _T("DebugBlendDestColorKey"));
 	WriteBool(hKey, cfg->DebugNoMouseHooks, cfgmask->DebugNoMouseHooks, _T("DebugNoMouseHooks"));
 	WriteBool(hKey, cfg->DebugNoPaletteRedraw, cfgmask->DebugNoPaletteRedraw, _T("DebugNoPaletteRedraw"));
+	WriteBool(hKey, cfg->DebugMarkers, cfgmask->DebugMarkers, _T("DebugMarkers"));
+	WriteDWORD(hKey, cfg->DebugView, cfgmask->DebugView, _T("DebugView"));
 	WriteDWORD(hKey, cfg->DebugMaxGLVersionMajor, cfgmask->DebugMaxGLVersionMajor, _T("DebugMaxGLVersionMajor"));
 	WriteDWORD(hKey, cfg->DebugMaxGLVersionMinor, cfgmask->DebugMaxGLVersionMinor, _T("DebugMaxGLVersionMinor"));
 	WriteDWORD(hKey, cfg->DebugTraceLevel, cfgmask->DebugTraceLevel, _T("DebugTraceLevel"));
+	WriteBool(hKey, cfg->DebugTraceBinary, cfgmask->DebugTraceBinary, _T("DebugTraceBinary"));
+	WriteBool(hKey, cfg->DebugTimeline, cfgmask->DebugTimeline, _T("DebugTimeline"));
+	WriteBool(hKey, cfg->DebugShaderTiming, cfgmask->DebugShaderTiming, _T("DebugShaderTiming"));
+	WriteBool(hKey, cfg->DebugSurfaceProfile, cfgmask->DebugSurfaceProfile, _T("DebugSurfaceProfile"));
+	WriteBool(hKey, cfg->DebugLatency, cfgmask->DebugLatency, _T("DebugLatency"));
+	WriteBool(hKey, cfg->DebugCapture, cfgmask->DebugCapture, _T("DebugCapture"));
+	WriteDWORD(hKey, cfg->DebugStutterThreshold, cfgmask->DebugStutterThreshold, _T("DebugStutterThreshold"));
 	WriteBool(hKey, cfg->HackCrop640480to640400, cfgmask->HackCrop640480to640400, _T("HackCrop640480to640400"));
 	WriteDWORDDeleteObsolete(hKey, cfg->HackAutoExpandViewport, cfgmask->HackAutoExpandViewport, _T("HackAutoExpandViewport"),
 		1, _T("HackAutoScale512448to640480"));
@@ -935,6 +1037,7 @@ void WriteSettings(HKEY hKey, const DXGLCFG *cfg, const DXGLCFG *mask)
 	WriteBool(hKey, cfg->HackSetCursor, cfgmask->HackSetCursor, _T("HackSetCursor"));
 	WriteDWORD(hKey, cfg->HackPaletteDelay, cfgmask->HackPaletteDelay, _T("HackPaletteDelay"));
 	WriteDWORD(hKey, cfg->HackPaletteVsync, cfgmask->HackPaletteVsync, _T("HackPaletteVsync"));
+	WriteBool(hKey, cfg->HackWriteWatch, cfgmask->HackWriteWatch, _T("HackWriteWatch"));
 }
 
 TCHAR newregname[MAX_PATH+65];
@@ -1051,6 +1154,34 @@ void GetDefaultConfig(DXGLCFG *cfg)
 	cfg->WindowHeight = 480;
 	cfg->HackPaletteDelay = 30;
 	cfg->LimitTextureFormats = 1;
+	cfg->RenderScale = 1;
+	cfg->ShaderCache = TRUE;
+	cfg->CapsCache = TRUE;
+	cfg->ShaderPreload = TRUE;
+	cfg->AsyncReadback = TRUE;
+	cfg->PersistentDC = TRUE;
+	cfg->TexturePoolSize = 32768;
+	cfg->BltCoalescing = TRUE;
+	cfg->TextureAtlasSize = 0;
+	cfg->TextureMemoryBudget = 0;
+	cfg->CompressTextures = FALSE;
+	cfg->TextureUploadBudget = 4096;
+	cfg->StreamMipmaps = FALSE;
+	cfg->AdaptiveVsync = FALSE;
+	cfg->MaxFramesInFlight = 0;
+	cfg->PresentQueueDepth = 0;
+	cfg->FlipModelPresent = FALSE;
+	cfg->DwmVsync = FALSE;
+	cfg->FrameLimit = 0;
+	cfg->VBlankSource = 0;
+	cfg->ThreadTask = 1;
+	cfg->ThreadPriority = 0;
+	cfg->RendererAffinity = 0;
+	cfg->LargePages = FALSE;
+	cfg->ScreenshotKey = 0;
+	cfg->RecordKey = 0;
+	cfg->CaptureSource = 0;
+	cfg->DebugStutterThreshold = 200;
 	if (!cfg->Windows8Detected)
 	{
 		osver.dwOSVersionInfoSize = sizeof(OSVERSIONINFO);
@@ -1128,6 +1259,7 @@ int ReadINICallback(DXGLCFG *cfg, const char *section, const char *name,
 #endif
 	if (!_stricmp(name, "Include"))
 	{
+		ini_include = TRUE;
 		ini_depth++;
 		if(ini_depth <= 16)
 		{
@@ -1234,11 +1366,15 @@ int ReadINICallback(DXGLCFG *cfg, const char *section, const char *name,
 			if (!_stricmp(name, "LowColorRendering")) cfg->LowColorRendering = INIIntValue(value);
 			if (!_stricmp(name, "EnableDithering")) cfg->EnableDithering = INIIntValue(value);
 			if (!_stricmp(name, "LimitTextureFormats")) cfg->LimitTextureFormats = INIIntValue(value);
+			if (!_stricmp(name, "RenderScale")) cfg->RenderScale = INIIntValue(value);
+			if (!_stricmp(name, "ColorKeyAlpha")) cfg->ColorKeyAlpha = INIBoolValue(value);
 		}
 		if (!_stricmp(section, "advanced"))
 		{
 			if (!_stricmp(name, "TextureFormat")) cfg->TextureFormat = INIIntValue(value);
 			if (!_stricmp(name, "TexUpload")) cfg->TexUpload = INIIntValue(value);
+			if (!_stricmp(name, "RenderBackend")) cfg->RenderBackend = INIIntValue(value);
+			if (!_stricmp(name, "BindlessTextures")) cfg->BindlessTextures = INIBoolValue(value);
 			if (!_stricmp(name, "WindowPosition")) cfg->WindowPosition = INIIntValue(value);
 			if (!_stricmp(name, "RememberWindowSize")) cfg->RememberWindowSize = INIBoolValue(value);
 			if (!_stricmp(name, "RememberWindowPosition")) cfg->RememberWindowPosition = INIBoolValue(value);
@@ -1249,6 +1385,35 @@ int ReadINICallback(DXGLCFG *cfg, const char *section, const char *name,
 			if (!_stricmp(name, "WindowHeight")) cfg->WindowHeight = INIIntValue(value);
 			if (!_stricmp(name, "WindowMaximized")) cfg->WindowMaximized = INIBoolValue(value);
 			if (!_stricmp(name, "CaptureMouse")) cfg->CaptureMouse = INIBoolValue(value);
+			if (!_stricmp(name, "ShaderCache")) cfg->ShaderCache = INIBoolValue(value);
+			if (!_stricmp(name, "CapsCache")) cfg->CapsCache = INIBoolValue(value);
+			if (!_stricmp(name, "ShaderPreload")) cfg->ShaderPreload = INIBoolValue(value);
+			if (!_stricmp(name, "ShaderCompileMode")) cfg->ShaderCompileMode = INIIntValue(value);
+			if (!_stricmp(name, "AsyncReadback")) cfg->AsyncReadback = INIBoolValue(value);
+			if (!_stricmp(name, "PersistentDC")) cfg->PersistentDC = INIBoolValue(value);
+			if (!_stricmp(name, "PointerValidation")) cfg->PointerValidation = INIIntValue(value);
+			if (!_stricmp(name, "FormatConversion")) cfg->FormatConversion = INIIntValue(value);
+			if (!_stricmp(name, "TexturePoolSize")) cfg->TexturePoolSize = INIIntValue(value);
+			if (!_stricmp(name, "BltCoalescing")) cfg->BltCoalescing = INIBoolValue(value);
+			if (!_stricmp(name, "TextureAtlasSize")) cfg->TextureAtlasSize = INIIntValue(value);
+			if (!_stricmp(name, "TextureMemoryBudget")) cfg->TextureMemoryBudget = INIIntValue(value);
+			if (!_stricmp(name, "CompressTextures")) cfg->CompressTextures = INIBoolValue(value);
+			if (!_stricmp(name, "TextureUploadBudget")) cfg->TextureUploadBudget = INIIntValue(value);
+			if (!_stricmp(name, "StreamMipmaps")) cfg->StreamMipmaps = INIBoolValue(value);
+			if (!_stricmp(name, "AdaptiveVsync")) cfg->AdaptiveVsync = INIBoolValue(value);
+			if (!_stricmp(name, "MaxFramesInFlight")) cfg->MaxFramesInFlight = INIIntValue(value);
+			if (!_stricmp(name, "PresentQueueDepth")) cfg->PresentQueueDepth = INIIntValue(value);
+			if (!_stricmp(name, "FlipModelPresent")) cfg->FlipModelPresent = INIBoolValue(value);
+			if (!_stricmp(name, "DwmVsync")) cfg->DwmVsync = INIBoolValue(value);
+			if (!_stricmp(name, "FrameLimit")) cfg->FrameLimit = INIIntValue(value);
+			if (!_stricmp(name, "VBlankSource")) cfg->VBlankSource = INIIntValue(value);
+			if (!_stricmp(name, "ThreadTask")) cfg->ThreadTask = INIIntValue(value);
+			if (!_stricmp(name, "ThreadPriority")) cfg->ThreadPriority = INIIntValue(value);
+			if (!_stricmp(name, "RendererAffinity")) cfg->RendererAffinity = INIIntValue(value);
+			if (!_stricmp(name, "LargePages")) cfg->LargePages = INIBoolValue(value);
+			if (!_stricmp(name, "ScreenshotKey")) cfg->ScreenshotKey = INIIntValue(value);
+			if (!_stricmp(name, "RecordKey")) cfg->RecordKey = INIIntValue(value);
+			if (!_stricmp(name, "CaptureSource")) cfg->CaptureSource = INIIntValue(value);
 		}
 		if (!_stricmp(section, "debug"))
 		{
@@ -1264,9 +1429,18 @@ int ReadINICallback(DXGLCFG *cfg, const char *section, const char *name,
 			if (!_stricmp(name, "DebugBlendDestColorKey")) cfg->DebugBlendDestColorKey = INIBoolValue(value);
 			if (!_stricmp(name, "DebugNoMouseHooks")) cfg->DebugNoMouseHooks = INIBoolValue(value);
 			if (!_stricmp(name, "DebugNoPaletteRedraw")) cfg->DebugNoPaletteRedraw = INIBoolValue(value);
+			if (!_stricmp(name, "DebugMarkers")) cfg->DebugMarkers = INIBoolValue(value);
+			if (!_stricmp(name, "DebugView")) cfg->DebugView = INIIntValue(value);
 			if (!_stricmp(name, "DebugMaxGLVersionMajor")) cfg->DebugMaxGLVersionMajor = INIIntValue(value);
 			if (!_stricmp(name, "DebugMaxGLVersionMinor")) cfg->DebugMaxGLVersionMinor = INIIntValue(value);
 			if (!_stricmp(name, "DebugTraceLevel")) cfg->DebugTraceLevel = INIIntValue(value);
+			if (!_stricmp(name, "DebugTraceBinary")) cfg->DebugTraceBinary = INIBoolValue(value);
+			if (!_stricmp(name, "DebugTimeline")) cfg->DebugTimeline = INIBoolValue(value);
+			if (!_stricmp(name, "DebugShaderTiming")) cfg->DebugShaderTiming = INIBoolValue(value);
+			if (!_stricmp(name, "DebugSurfaceProfile")) cfg->DebugSurfaceProfile = INIBoolValue(value);
+			if (!_stricmp(name, "DebugLatency")) cfg->DebugLatency = INIBoolValue(value);
+			if (!_stricmp(name, "DebugCapture")) cfg->DebugCapture = INIBoolValue(value);
+			if (!_stricmp(name, "DebugStutterThreshold")) cfg->DebugStutterThreshold = INIIntValue(value);
 		}
 		if (!_stricmp(section, "hacks"))
 		{
@@ -1279,6 +1453,7 @@ int ReadINICallback(DXGLCFG *cfg, const char *section, const char *name,
 			if (!_stricmp(name, "HackSetCursor")) cfg->HackSetCursor = INIBoolValue(value);
 			if (!_stricmp(name, "HackPaletteDelay")) cfg->HackPaletteDelay = INIIntValue(value);
 			if (!_stricmp(name, "HackPaletteVsync")) cfg->HackPaletteVsync = INIBoolValue(value);
+			if (!_stricmp(name, "HackWriteWatch")) cfg->HackWriteWatch = INIBoolValue(value);
 			if (!_stricmp(name, "VertexBufferSize")) cfg->VertexBufferSize = INIIntValue(value);
 			if (!_stricmp(name, "IndexBufferSize")) cfg->IndexBufferSize = INIIntValue(value);
 			if (!_stricmp(name, "UnpackBufferSize")) cfg->UnpackBufferSize = INIIntValue(value);
@@ -1676,9 +1851,13 @@ DWORD WriteINI(DXGLCFG *cfg, DXGLCFG *mask, LPCTSTR path, HWND hWnd)
 	INIWriteInt(file, "LowColorRendering", cfg->LowColorRendering, mask->LowColorRendering, INISECTION_D3D);
 	INIWriteInt(file, "EnableDithering", cfg->EnableDithering, mask->EnableDithering, INISECTION_D3D);
 	INIWriteInt(file, "LimitTextureFormats", cfg->LimitTextureFormats, mask->LimitTextureFormats, INISECTION_D3D);
+	INIWriteInt(file, "RenderScale", cfg->RenderScale, mask->RenderScale, INISECTION_D3D);
+	INIWriteBool(file, "ColorKeyAlpha", cfg->ColorKeyAlpha, mask->ColorKeyAlpha, INISECTION_D3D);
 	// [advanced]
 	INIWriteInt(file, "TextureFormat", cfg->TextureFormat, mask->TextureFormat, INISECTION_ADVANCED);
 	INIWriteInt(file, "TexUpload", cfg->TexUpload, mask->TexUpload, INISECTION_ADVANCED);
+	INIWriteInt(file, "RenderBackend", cfg->RenderBackend, mask->RenderBackend, INISECTION_ADVANCED);
+	INIWriteBool(file, "BindlessTextures", cfg->BindlessTextures, mask->BindlessTextures, INISECTION_ADVANCED);
 	INIWriteInt(file, "WindowPosition", cfg->WindowPosition, mask->WindowPosition, INISECTION_ADVANCED);
 	INIWriteBool(file, "RememberWindowSize", cfg->RememberWindowSize, mask->RememberWindowSize, INISECTION_ADVANCED);
 	INIWriteBool(file, "RememberWindowPosition", cfg->RememberWindowPosition, mask->RememberWindowPosition, INISECTION_ADVANCED);
@@ -1689,6 +1868,35 @@ DWORD WriteINI(DXGLCFG *cfg, DXGLCFG *mask, LPCTSTR path, HWND hWnd)
 	INIWriteInt(file, "WindowHeight", cfg->WindowHeight, mask->WindowHeight, INISECTION_ADVANCED);
 	INIWriteBool(file, "WindowMaximized", cfg->WindowMaximized, mask->WindowMaximized, INISECTION_ADVANCED);
 	INIWriteBool(file, "CaptureMouse", cfg->CaptureMouse, mask->CaptureMouse, INISECTION_ADVANCED);
+	INIWriteBool(file, "ShaderCache", cfg->ShaderCache, mask->ShaderCache, INISECTION_ADVANCED);
+	INIWriteBool(file, "CapsCache", cfg->CapsCache, mask->CapsCache, INISECTION_ADVANCED);
+	INIWriteBool(file, "ShaderPreload", cfg->ShaderPreload, mask->ShaderPreload, INISECTION_ADVANCED);
+	INIWriteInt(file, "ShaderCompileMode", cfg->ShaderCompileMode, mask->ShaderCompileMode, INISECTION_ADVANCED);
+	INIWriteBool(file, "AsyncReadback", cfg->AsyncReadback, mask->AsyncReadback, INISECTION_ADVANCED);
+	INIWriteBool(file, "PersistentDC", cfg->PersistentDC, mask->PersistentDC, INISECTION_ADVANCED);
+	INIWriteInt(file, "PointerValidation", cfg->PointerValidation, mask->PointerValidation, INISECTION_ADVANCED);
+	INIWriteInt(file, "FormatConversion", cfg->FormatConversion, mask->FormatConversion, INISECTION_ADVANCED);
+	INIWriteInt(file, "TexturePoolSize", cfg->TexturePoolSize, mask->TexturePoolSize, INISECTION_ADVANCED);
+	INIWriteBool(file, "BltCoalescing", cfg->BltCoalescing, mask->BltCoalescing, INISECTION_ADVANCED);
+	INIWriteInt(file, "TextureAtlasSize", cfg->TextureAtlasSize, mask->TextureAtlasSize, INISECTION_ADVANCED);
+	INIWriteInt(file, "TextureMemoryBudget", cfg->TextureMemoryBudget, mask->TextureMemoryBudget, INISECTION_ADVANCED);
+	INIWriteBool(file, "CompressTextures", cfg->CompressTextures, mask->CompressTextures, INISECTION_ADVANCED);
+	INIWriteInt(file, "TextureUploadBudget", cfg->TextureUploadBudget, mask->TextureUploadBudget, INISECTION_ADVANCED);
+	INIWriteBool(file, "StreamMipmaps", cfg->StreamMipmaps, mask->StreamMipmaps, INISECTION_ADVANCED);
+	INIWriteBool(file, "AdaptiveVsync", cfg->AdaptiveVsync, mask->AdaptiveVsync, INISECTION_ADVANCED);
+	INIWriteInt(file, "MaxFramesInFlight", cfg->MaxFramesInFlight, mask->MaxFramesInFlight, INISECTION_ADVANCED);
+	INIWriteInt(file, "PresentQueueDepth", cfg->PresentQueueDepth, mask->PresentQueueDepth, INISECTION_ADVANCED);
+	INIWriteBool(file, "FlipModelPresent", cfg->FlipModelPresent, mask->FlipModelPresent, INISECTION_ADVANCED);
+	INIWriteBool(file, "DwmVsync", cfg->DwmVsync, mask->DwmVsync, INISECTION_ADVANCED);
+	INIWriteInt(file, "FrameLimit", cfg->FrameLimit, mask->FrameLimit, INISECTION_ADVANCED);
+	INIWriteInt(file, "VBlankSource", cfg->VBlankSource, mask->VBlankSource, INISECTION_ADVANCED);
+	INIWriteInt(file, "ThreadTask", cfg->ThreadTask, mask->ThreadTask, INISECTION_ADVANCED);
+	INIWriteInt(file, "ThreadPriority", cfg->ThreadPriority, mask->ThreadPriority, INISECTION_ADVANCED);
+	INIWriteInt(file, "RendererAffinity", cfg->RendererAffinity, mask->RendererAffinity, INISECTION_ADVANCED);
+	INIWriteBool(file, "LargePages", cfg->LargePages, mask->LargePages, INISECTION_ADVANCED);
+	INIWriteInt(file, "ScreenshotKey", cfg->ScreenshotKey, mask->ScreenshotKey, INISECTION_ADVANCED);
+	INIWriteInt(file, "RecordKey", cfg->RecordKey, mask->RecordKey, INISECTION_ADVANCED);
+	INIWriteInt(file, "CaptureSource", cfg->CaptureSource, mask->CaptureSource, INISECTION_ADVANCED);
 	// [debug]
 	INIWriteBool(file, "DebugNoExtFramebuffer", cfg->DebugNoExtFramebuffer, mask->DebugNoExtFramebuffer, INISECTION_DEBUG);
 	INIWriteBool(file, "DebugNoArbFramebuffer", cfg->DebugNoArbFramebuffer, mask->DebugNoArbFramebuffer, INISECTION_DEBUG);
@@ -1702,9 +1910,18 @@ DWORD WriteINI(DXGLCFG *cfg, DXGLCFG *mask, LPCTSTR path, HWND hWnd)
 	INIWriteBool(file, "DebugBlendDestColorKey", cfg->DebugBlendDestColorKey, mask->DebugBlendDestColorKey, INISECTION_DEBUG);
 	INIWriteBool(file, "DebugNoMouseHooks", cfg->DebugNoMouseHooks, mask->DebugNoMouseHooks, INISECTION_DEBUG);
 	INIWriteBool(file, "DebugNoPaletteRedraw", cfg->DebugNoPaletteRedraw, mask->DebugNoPaletteRedraw, INISECTION_DEBUG);
+	INIWriteBool(file, "DebugMarkers", cfg->DebugMarkers, mask->DebugMarkers, INISECTION_DEBUG);
+	INIWriteInt(file, "DebugView", cfg->DebugView, mask->DebugView, INISECTION_DEBUG);
 	INIWriteBool(file, "DebugMaxGLVersionMajor", cfg->DebugMaxGLVersionMajor, mask->DebugMaxGLVersionMajor, INISECTION_DEBUG);
 	INIWriteBool(file, "DebugMaxGLVersionMinor", cfg->DebugMaxGLVersionMinor, mask->DebugMaxGLVersionMinor, INISECTION_DEBUG);
 	INIWriteBool(file, "DebugTraceLevel", cfg->DebugTraceLevel, mask->DebugTraceLevel, INISECTION_DEBUG);
+	INIWriteBool(file, "DebugTraceBinary", cfg->DebugTraceBinary, mask->DebugTraceBinary, INISECTION_DEBUG);
+	INIWriteBool(file, "DebugTimeline", cfg->DebugTimeline, mask->DebugTimeline, INISECTION_DEBUG);
+	INIWriteBool(file, "DebugShaderTiming", cfg->DebugShaderTiming, mask->DebugShaderTiming, INISECTION_DEBUG);
+	INIWriteBool(file, "DebugSurfaceProfile", cfg->DebugSurfaceProfile, mask->DebugSurfaceProfile, INISECTION_DEBUG);
+	INIWriteBool(file, "DebugLatency", cfg->DebugLatency, mask->DebugLatency, INISECTION_DEBUG);
+	INIWriteBool(file, "DebugCapture", cfg->DebugCapture, mask->DebugCapture, INISECTION_DEBUG);
+	INIWriteInt(file, "DebugStutterThreshold", cfg->DebugStutterThreshold, mask->DebugStutterThreshold, INISECTION_DEBUG);
 	// [hacks]
 	INIWriteBool(file, "HackCrop640480to640400", cfg->HackCrop640480to640400, mask->HackCrop640480to640400, INISECTION_HACKS);
 	INIWriteInt(file, "HackAutoExpandViewport", cfg->HackAutoExpandViewport, mask->HackAutoExpandViewport, INISECTION_HACKS);
@@ -1714,6 +1931,7 @@ DWORD WriteINI(DXGLCFG *cfg, DXGLCFG *mask, LPCTSTR path, HWND hWnd)
 	INIWriteBool(file, "HackSetCursor", cfg->HackSetCursor, mask->HackSetCursor, INISECTION_HACKS);
 	INIWriteInt(file, "HackPaletteDelay", cfg->HackPaletteDelay, mask->HackPaletteDelay, INISECTION_HACKS);
 	INIWriteBool(file, "HackPaletteVsync", cfg->HackPaletteVsync, mask->HackPaletteVsync, INISECTION_HACKS);
+	INIWriteBool(file, "HackWriteWatch", cfg->HackWriteWatch, mask->HackWriteWatch, INISECTION_HACKS);
 	INIWriteInt(file, "VertexBufferSize", cfg->VertexBufferSize, mask->VertexBufferSize, INISECTION_HACKS);
 	INIWriteInt(file, "IndexBufferSize", cfg->IndexBufferSize, mask->IndexBufferSize, INISECTION_HACKS);
 	INIWriteInt(file, "UnpackBufferSize", cfg->UnpackBufferSize, mask->UnpackBufferSize, INISECTION_HACKS);
@@ -1723,6 +1941,111 @@ DWORD WriteINI(DXGLCFG *cfg, DXGLCFG *mask, LPCTSTR path, HWND hWnd)
 	return ERROR_SUCCESS;
 }
 
+static void AddKeyToStamp(Sha256Context *context, LPCTSTR key)
+{
+	HKEY hKey;
+	FILETIME lastwrite;
+	ZeroMemory(&lastwrite, sizeof(FILETIME));
+	if (RegOpenKeyEx(HKEY_CURRENT_USER, key, 0, KEY_READ, &hKey) == ERROR_SUCCESS)
+	{
+		RegQueryInfoKey(hKey, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, &lastwrite);
+		RegCloseKey(hKey);
+	}
+	Sha256Update(context, &lastwrite, sizeof(FILETIME));
+}
+
+static void AddFileToStamp(Sha256Context *context, LPCTSTR path)
+{
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	if (!GetFileAttributesEx(path, GetFileExInfoStandard, &attributes))
+		ZeroMemory(&attributes, sizeof(WIN32_FILE_ATTRIBUTE_DATA));
+	Sha256Update(context, &attributes.ftLastWriteTime, sizeof(FILETIME));
+	Sha256Update(context, &attributes.nFileSizeHigh, sizeof(DWORD));
+	Sha256Update(context, &attributes.nFileSizeLow, sizeof(DWORD));
+}
+
+/**
+  * Hashes the last write times of everything GetCurrentConfig reads settings
+  * from, so a cached configuration can be checked without reading it again.
+  * @param regkey
+  *  Registry key of the profile
+  * @param stamp
+  *  Pointer to receive the hash
+  */
+static void GetConfigStamp(LPCTSTR regkey, SHA256_HASH *stamp)
+{
+	Sha256Context context;
+	TCHAR inipath[MAX_PATH + 10];
+	DWORD header[2] = { CFGCACHE_VERSION, sizeof(DXGLCFG) };
+	Sha256Initialise(&context);
+	Sha256Update(&context, header, sizeof(header));
+	Sha256Update(&context, DXGLVERSTRING, (uint32_t)strlen(DXGLVERSTRING));
+	AddKeyToStamp(&context, regkeyglobal);
+	AddKeyToStamp(&context, regkey);
+	GetModuleFileName(NULL, inipath, MAX_PATH);
+	GetDirFromPath(inipath);
+	_tcscat(inipath, _T("\\dxgl.cfg"));
+	AddFileToStamp(&context, inipath);
+	GetDirFromPath(inipath);
+	_tcscat(inipath, _T("\\dxgl.ini"));
+	AddFileToStamp(&context, inipath);
+	Sha256Finalise(&context, stamp);
+}
+
+/**
+  * Loads the merged configuration of a profile from the configuration cache.
+  * @param name
+  *  Name of the profile
+  * @param stamp
+  *  Hash from GetConfigStamp that the cached configuration must match
+  * @param cfg
+  *  Pointer to receive the configuration
+  * @return
+  *  TRUE if the cached configuration is current, FALSE otherwise.
+  */
+static BOOL ReadConfigCache(LPCTSTR name, const SHA256_HASH *stamp, DXGLCFG *cfg)
+{
+	HKEY hKey;
+	CFGCACHE *cache;
+	DWORD type;
+	DWORD size = sizeof(CFGCACHE);
+	BOOL ret = FALSE;
+	if (RegOpenKeyEx(HKEY_CURRENT_USER, regkeyconfigcache, 0, KEY_READ, &hKey) != ERROR_SUCCESS) return FALSE;
+	cache = (CFGCACHE*)malloc(sizeof(CFGCACHE));
+	if (cache)
+	{
+		if ((RegQueryValueEx(hKey, name, NULL, &type, (LPBYTE)cache, &size) == ERROR_SUCCESS) &&
+			(type == REG_BINARY) && (size == sizeof(CFGCACHE)) && (cache->version == CFGCACHE_VERSION) &&
+			(cache->size == sizeof(DXGLCFG)) && !memcmp(cache->stamp, stamp->bytes, 32))
+		{
+			memcpy(cfg, &cache->cfg, sizeof(DXGLCFG));
+			ret = TRUE;
+		}
+		free(cache);
+	}
+	RegCloseKey(hKey);
+	return ret;
+}
+
+static void WriteConfigCache(LPCTSTR name, const SHA256_HASH *stamp, const DXGLCFG *cfg)
+{
+	HKEY hKey;
+	CFGCACHE *cache;
+	if (RegCreateKeyEx(HKEY_CURRENT_USER, regkeyconfigcache, 0, NULL, 0, KEY_SET_VALUE, NULL, &hKey, NULL)
+		!= ERROR_SUCCESS) return;
+	cache = (CFGCACHE*)malloc(sizeof(CFGCACHE));
+	if (cache)
+	{
+		cache->version = CFGCACHE_VERSION;
+		cache->size = sizeof(DXGLCFG);
+		memcpy(cache->stamp, stamp->bytes, 32);
+		memcpy(&cache->cfg, cfg, sizeof(DXGLCFG));
+		RegSetValueEx(hKey, name, 0, REG_BINARY, (LPBYTE)cache, sizeof(CFGCACHE));
+		free(cache);
+	}
+	RegCloseKey(hKey);
+}
+
 void GetCurrentConfig(DXGLCFG *cfg, BOOL initial)
 {
 	HKEY hKey;
@@ -1732,6 +2055,9 @@ void GetCurrentConfig(DXGLCFG *cfg, BOOL initial)
 	TCHAR filename[MAX_PATH+1];
 	WCHAR filename2[MAX_PATH+1];
 	TCHAR regkey[MAX_PATH + 80];
+	LPCTSTR profile;
+	SHA256_HASH stamp;
+	SHA256_HASH stamp2;
 	size_t i;
 	BOOL DPIAwarePM = FALSE;
 	HMODULE hSHCore = NULL;
@@ -1760,27 +2086,48 @@ void GetCurrentConfig(DXGLCFG *cfg, BOOL initial)
 	}
 	sha256string[256 / 4] = 0;
 	_tcscat(regkey, sha256string);
-	GetGlobalConfig(cfg, initial);
-	_tcscpy(cfg->regkey, regkey);
-	ReadINI(cfg);
-	if (cfg->OverrideDefaults)
+	profile = &regkey[_tcslen(regkeybase) + _tcslen(profilesname)];
+	GetConfigStamp(regkey, &stamp);
+	if (!ReadConfigCache(profile, &stamp, cfg))
 	{
-		GetDefaultConfig(cfg);
+		ini_include = FALSE;
+		GetGlobalConfig(cfg, initial);
+		_tcscpy(cfg->regkey, regkey);
 		ReadINI(cfg);
-	}
-	if (initial || cfg->NoWriteRegistry) RegOpenKeyEx(HKEY_CURRENT_USER, cfg->regkey, 0, KEY_READ, &hKey);
-	else
-	{
-		RegCreateKeyEx(HKEY_CURRENT_USER, regkeyglobal, 0, NULL, 0, KEY_ALL_ACCESS, NULL, &hKey, NULL);
-		if (hKey) RegCloseKey(hKey);
-		RegCreateKeyEx(HKEY_CURRENT_USER, cfg->regkey, 0, NULL, 0, KEY_ALL_ACCESS, NULL, &hKey, NULL);
-	}
-	if (hKey)
-	{
-		ReadSettings(hKey, cfg, NULL, FALSE, TRUE, NULL);
-		RegCloseKey(hKey);
+		if (cfg->OverrideDefaults)
+		{
+			GetDefaultConfig(cfg);
+			ReadINI(cfg);
+		}
+		hKey = NULL;
+		if (initial || cfg->NoWriteRegistry) RegOpenKeyEx(HKEY_CURRENT_USER, cfg->regkey, 0, KEY_READ, &hKey);
+		else
+		{
+			RegCreateKeyEx(HKEY_CURRENT_USER, regkeyglobal, 0, NULL, 0, KEY_ALL_ACCESS, NULL, &hKey, NULL);
+			if (hKey) RegCloseKey(hKey);
+			RegCreateKeyEx(HKEY_CURRENT_USER, cfg->regkey, 0, NULL, 0, KEY_ALL_ACCESS, NULL, &hKey, NULL);
+		}
+		if (hKey)
+		{
+			ReadSettings(hKey, cfg, NULL, FALSE, TRUE, NULL);
+			RegCloseKey(hKey);
+		}
+		// Only cache if nothing changed while reading, and files pulled in with
+		// Include can't be tracked by the stamp.
+		if (!cfg->NoWriteRegistry && !ini_include)
+		{
+			GetConfigStamp(regkey, &stamp2);
+			if (!memcmp(stamp.bytes, stamp2.bytes, 32)) WriteConfigCache(profile, &stamp, cfg);
+		}
 	}
 	hKey = NULL;
+	// Shader cache lives under %LOCALAPPDATA%\DXGL\ShaderCache\<exe>-<hash>
+	i = GetEnvironmentVariable(_T("LOCALAPPDATA"), cfg->shadercachepath, MAX_PATH - 80);
+	if (!i || (i >= MAX_PATH - 80)) GetTempPath(MAX_PATH - 80, cfg->shadercachepath);
+	i = _tcslen(cfg->shadercachepath);
+	if (i && (cfg->shadercachepath[i - 1] == 92)) cfg->shadercachepath[i - 1] = 0;
+	_tcscat(cfg->shadercachepath, _T("\\DXGL\\ShaderCache\\"));
+	_tcsncat(cfg->shadercachepath, profile, MAX_PATH - _tcslen(cfg->shadercachepath));
 	if (cfg->DPIScale == 2)	AddCompatFlag(_T("HIGHDPIAWARE"));
 	else DelCompatFlag(_T("HIGHDPIAWARE"),initial);
 	if (initial)
@@ -71,10 +71,14 @@ typedef struct
 	DWORD LowColorRendering;
 	DWORD EnableDithering;
 	DWORD LimitTextureFormats;
+	DWORD RenderScale;
+	BOOL ColorKeyAlpha;
 	// [advanced]
 	DWORD vsync;
 	DWORD TextureFormat;
 	DWORD TexUpload;
+	DWORD RenderBackend;
+	BOOL BindlessTextures;
 	BOOL SingleBufferDevice;
 	DWORD WindowPosition;
 	BOOL RememberWindowSize;
@@ -86,6 +90,35 @@ typedef struct
 	DWORD WindowHeight;
 	BOOL WindowMaximized;
 	BOOL CaptureMouse;
+	BOOL ShaderCache;
+	BOOL CapsCache;
+	BOOL ShaderPreload;
+	DWORD ShaderCompileMode;
+	BOOL AsyncReadback;
+	BOOL PersistentDC;
+	DWORD PointerValidation;
+	DWORD FormatConversion;
+	DWORD TexturePoolSize;
+	BOOL BltCoalescing;
+	DWORD TextureAtlasSize;
+	DWORD TextureMemoryBudget;
+	BOOL CompressTextures;
+	DWORD TextureUploadBudget;
+	BOOL StreamMipmaps;
+	BOOL AdaptiveVsync;
+	DWORD MaxFramesInFlight;
+	DWORD PresentQueueDepth;
+	BOOL FlipModelPresent;
+	BOOL DwmVsync;
+	DWORD FrameLimit;
+	DWORD VBlankSource;
+	DWORD ThreadTask;
+	DWORD ThreadPriority;
+	DWORD RendererAffinity;
+	BOOL LargePages;
+	DWORD ScreenshotKey;
+	DWORD RecordKey;
+	DWORD CaptureSource;
 	// [debug]
 	BOOL DebugNoExtFramebuffer;
 	BOOL DebugNoArbFramebuffer;
@@ -99,9 +132,18 @@ typedef struct
 	BOOL DebugBlendDestColorKey;
 	BOOL DebugNoMouseHooks;
 	BOOL DebugNoPaletteRedraw;
+	BOOL DebugMarkers;
+	DWORD DebugView;
 	DWORD DebugMaxGLVersionMajor;
 	DWORD DebugMaxGLVersionMinor;
 	DWORD DebugTraceLevel;
+	BOOL DebugTraceBinary;
+	BOOL DebugTimeline;
+	BOOL DebugShaderTiming;
+	BOOL DebugSurfaceProfile;
+	BOOL DebugLatency;
+	BOOL DebugCapture;
+	DWORD DebugStutterThreshold;
 	// [hacks]
 	BOOL HackCrop640480to640400;
 	DWORD HackAutoExpandViewport;
@@ -111,6 +153,7 @@ typedef struct
 	BOOL HackSetCursor;
 	DWORD HackPaletteDelay;
 	BOOL HackPaletteVsync;
+	BOOL HackWriteWatch;
 	DWORD VertexBufferSize;
 	DWORD IndexBufferSize;
 	DWORD UnpackBufferSize;
@@ -121,6 +164,8 @@ typedef struct
 	BOOL ParsedAddColorDepths;
 	BOOL ParsedAddModes;
 	TCHAR regkey[MAX_PATH + 80];
+	// Per-profile directory for the shader program binary cache
+	TCHAR shadercachepath[MAX_PATH + 1];
 	// For parsing .ini file
 	TCHAR inipath[MAX_PATH];
 	// System information
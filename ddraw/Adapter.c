@@ -0,0 +1,134 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#include "common.h"
+#include "Adapter.h"
+
+typedef struct ADAPTERLIST
+{
+	ADAPTER *adapters;
+	DWORD count;
+	DWORD max;
+} ADAPTERLIST;
+
+/**
+  * Fills an adapter structure from a monitor handle, looking up the display
+  * adapter by the GDI device name of the monitor.
+  * @param monitor
+  *  Handle to the monitor
+  * @param adapter
+  *  Pointer to the structure to fill
+  */
+static void Adapter_Fill(HMONITOR monitor, ADAPTER *adapter)
+{
+	MONITORINFOEXW info;
+	DISPLAY_DEVICEW dev;
+	DWORD i;
+	ZeroMemory(adapter, sizeof(ADAPTER));
+	adapter->monitor = monitor;
+	info.cbSize = sizeof(MONITORINFOEXW);
+	if (!GetMonitorInfoW(monitor, (LPMONITORINFO)&info)) return;
+	adapter->rect = info.rcMonitor;
+	adapter->primary = (info.dwFlags & MONITORINFOF_PRIMARY) ? TRUE : FALSE;
+	wcsncpy(adapter->device, info.szDevice, 31);
+	dev.cb = sizeof(DISPLAY_DEVICEW);
+	for (i = 0; EnumDisplayDevicesW(NULL, i, &dev, 0); i++)
+	{
+		if (wcscmp(dev.DeviceName, info.szDevice)) continue;
+		wcsncpy(adapter->description, dev.DeviceString, 127);
+		break;
+	}
+}
+
+static BOOL CALLBACK Adapter_EnumProc(HMONITOR monitor, HDC hdc, LPRECT rect, LPARAM param)
+{
+	ADAPTERLIST *list = (ADAPTERLIST*)param;
+	if (list->count >= list->max) return FALSE;
+	Adapter_Fill(monitor, &list->adapters[list->count++]);
+	return TRUE;
+}
+
+/**
+  * Lists the monitors attached to the desktop in the order DirectDraw
+  * enumerates them.  The GUID of the n-th entry has n + 1 in the low byte.
+  * @param adapters
+  *  Array receiving the monitors
+  * @param max
+  *  Number of entries in the array
+  * @return
+  *  Number of monitors stored in the array
+  */
+DWORD Adapter_Enum(ADAPTER *adapters, DWORD max)
+{
+	ADAPTERLIST list;
+	list.adapters = adapters;
+	list.count = 0;
+	list.max = max;
+	EnumDisplayMonitors(NULL, NULL, Adapter_EnumProc, (LPARAM)&list);
+	return list.count;
+}
+
+/**
+  * Finds the monitor selected by a DirectDraw GUID.
+  * @param index
+  *  Low byte of the GUID, 0 for the primary display driver
+  * @param adapter
+  *  Pointer to the structure receiving the monitor, which is the primary
+  *  monitor if index does not name an attached monitor
+  */
+void Adapter_Get(DWORD index, ADAPTER *adapter)
+{
+	ADAPTER *adapters;
+	DWORD count;
+	POINT origin = { 0, 0 };
+	if (index)
+	{
+		adapters = (ADAPTER*)malloc(ADAPTER_MAX * sizeof(ADAPTER));
+		if (adapters)
+		{
+			count = Adapter_Enum(adapters, ADAPTER_MAX);
+			if (index <= count)
+			{
+				memcpy(adapter, &adapters[index - 1], sizeof(ADAPTER));
+				free(adapters);
+				return;
+			}
+			free(adapters);
+		}
+	}
+	Adapter_Fill(MonitorFromPoint(origin, MONITOR_DEFAULTTOPRIMARY), adapter);
+}
+
+/**
+  * Moves a window onto a monitor so it is presented by the GPU driving that
+  * monitor.  The window keeps its size and is left alone if it is already
+  * on the monitor.
+  * @param hWnd
+  *  Window to move
+  * @param adapter
+  *  Monitor to move the window to
+  * @return
+  *  TRUE if the window was moved
+  */
+BOOL Adapter_MoveWindow(HWND hWnd, const ADAPTER *adapter)
+{
+	if (!hWnd || !adapter->monitor) return FALSE;
+	if (MonitorFromWindow(hWnd, MONITOR_DEFAULTTONEAREST) == adapter->monitor) return FALSE;
+	SetWindowPos(hWnd, NULL, adapter->rect.left, adapter->rect.top, 0, 0,
+		SWP_NOSIZE | SWP_NOZORDER | SWP_NOACTIVATE | SWP_NOOWNERZORDER);
+	return TRUE;
+}
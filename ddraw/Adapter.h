@@ -0,0 +1,47 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#pragma once
+#ifndef _ADAPTER_H
+#define _ADAPTER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Largest number of monitors enumerated, DirectDraw GUIDs number them in the low byte
+#define ADAPTER_MAX 255
+
+// Monitor a DirectDraw object renders to and the display adapter driving it
+typedef struct ADAPTER
+{
+	HMONITOR monitor;
+	RECT rect;  // Monitor rectangle in virtual screen coordinates
+	WCHAR device[32];  // GDI display device name, such as \\.\DISPLAY2
+	WCHAR description[128];  // Name of the display adapter driving the monitor
+	BOOL primary;
+} ADAPTER;
+
+DWORD Adapter_Enum(ADAPTER *adapters, DWORD max);
+void Adapter_Get(DWORD index, ADAPTER *adapter);
+BOOL Adapter_MoveWindow(HWND hWnd, const ADAPTER *adapter);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_ADAPTER_H
@@ -0,0 +1,366 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#include "common.h"
+#include <limits.h>
+#include "BlockCompress.h"
+
+// Shift and width in bits of a channel of a pixel format
+typedef struct BLOCKCHANNEL
+{
+	DWORD shift;
+	DWORD max;  // Largest value of the channel after shifting, 0 if absent
+} BLOCKCHANNEL;
+
+static void BlockCompress_GetChannel(DWORD mask, BLOCKCHANNEL *channel)
+{
+	channel->shift = 0;
+	channel->max = 0;
+	if (!mask) return;
+	while (!(mask & 1))
+	{
+		mask >>= 1;
+		channel->shift++;
+	}
+	channel->max = mask;
+}
+
+static BYTE BlockCompress_Expand(DWORD pixel, const BLOCKCHANNEL *channel)
+{
+	if (!channel->max) return 255;
+	return (BYTE)(((((pixel >> channel->shift) & channel->max) * 255) + (channel->max / 2)) / channel->max);
+}
+
+/**
+  * Reads a 4x4 block of texels as 8-bit RGBA, repeating the last row and
+  * column for blocks that extend past the edge of the level.
+  */
+static void BlockCompress_Fetch(const BYTE *src, LONG pitch, DWORD width, DWORD height, DWORD bx, DWORD by,
+	DWORD bytes, const BLOCKCHANNEL *channels, BYTE texels[16][4])
+{
+	const BYTE *ptr;
+	DWORD pixel;
+	DWORD x, y;
+	int i = 0;
+	for (y = 0; y < 4; y++)
+	{
+		for (x = 0; x < 4; x++)
+		{
+			ptr = src + (min(by + y, height - 1) * pitch) + (min(bx + x, width - 1) * bytes);
+			if (bytes == 2) pixel = *(const WORD*)ptr;
+			else if (bytes == 3) pixel = ptr[0] | (ptr[1] << 8) | (ptr[2] << 16);
+			else pixel = *(const DWORD*)ptr;
+			texels[i][0] = BlockCompress_Expand(pixel, &channels[0]);
+			texels[i][1] = BlockCompress_Expand(pixel, &channels[1]);
+			texels[i][2] = BlockCompress_Expand(pixel, &channels[2]);
+			texels[i][3] = BlockCompress_Expand(pixel, &channels[3]);
+			i++;
+		}
+	}
+}
+
+static WORD BlockCompress_To565(const int *color)
+{
+	return (WORD)(((color[0] >> 3) << 11) | ((color[1] >> 2) << 5) | (color[2] >> 3));
+}
+
+static void BlockCompress_From565(WORD color, int *out)
+{
+	out[0] = (color >> 11) & 31;
+	out[1] = (color >> 5) & 63;
+	out[2] = color & 31;
+	out[0] = (out[0] << 3) | (out[0] >> 2);
+	out[1] = (out[1] << 2) | (out[1] >> 4);
+	out[2] = (out[2] << 3) | (out[2] >> 2);
+}
+
+/**
+  * Encodes the colors of a block with endpoints on the corners of its
+  * bounding box, inset slightly so the interpolated colors cover the block.
+  */
+static void BlockCompress_EncodeColor(BYTE texels[16][4], BYTE *dest)
+{
+	int low[3] = { 255, 255, 255 };
+	int high[3] = { 0, 0, 0 };
+	int palette[4][3];
+	int inset, distance, best, bestdistance, d;
+	WORD c0, c1;
+	DWORD indices = 0;
+	int i, j, c;
+	for (i = 0; i < 16; i++)
+	{
+		for (c = 0; c < 3; c++)
+		{
+			if (texels[i][c] < low[c]) low[c] = texels[i][c];
+			if (texels[i][c] > high[c]) high[c] = texels[i][c];
+		}
+	}
+	for (c = 0; c < 3; c++)
+	{
+		inset = (high[c] - low[c]) >> 4;
+		low[c] += inset;
+		high[c] -= inset;
+	}
+	// Each channel of the high endpoint is at least that of the low one, so c0 >= c1
+	c0 = BlockCompress_To565(high);
+	c1 = BlockCompress_To565(low);
+	if (c0 != c1)
+	{
+		BlockCompress_From565(c0, palette[0]);
+		BlockCompress_From565(c1, palette[1]);
+		for (c = 0; c < 3; c++)
+		{
+			palette[2][c] = ((2 * palette[0][c]) + palette[1][c]) / 3;
+			palette[3][c] = (palette[0][c] + (2 * palette[1][c])) / 3;
+		}
+		for (i = 0; i < 16; i++)
+		{
+			best = 0;
+			bestdistance = INT_MAX;
+			for (j = 0; j < 4; j++)
+			{
+				distance = 0;
+				for (c = 0; c < 3; c++)
+				{
+					d = texels[i][c] - palette[j][c];
+					distance += d * d;
+				}
+				if (distance < bestdistance)
+				{
+					best = j;
+					bestdistance = distance;
+				}
+			}
+			indices |= (DWORD)best << (2 * i);
+		}
+	}
+	dest[0] = (BYTE)c0;
+	dest[1] = (BYTE)(c0 >> 8);
+	dest[2] = (BYTE)c1;
+	dest[3] = (BYTE)(c1 >> 8);
+	dest[4] = (BYTE)indices;
+	dest[5] = (BYTE)(indices >> 8);
+	dest[6] = (BYTE)(indices >> 16);
+	dest[7] = (BYTE)(indices >> 24);
+}
+
+/**
+  * Encodes the alphas of a block in the eight value mode of BC3.
+  */
+static void BlockCompress_EncodeAlpha(BYTE texels[16][4], BYTE *dest)
+{
+	int low = 255;
+	int high = 0;
+	int palette[8];
+	int distance, best, bestdistance;
+	unsigned __int64 indices = 0;
+	int i, j;
+	for (i = 0; i < 16; i++)
+	{
+		if (texels[i][3] < low) low = texels[i][3];
+		if (texels[i][3] > high) high = texels[i][3];
+	}
+	if (high != low)
+	{
+		palette[0] = high;
+		palette[1] = low;
+		for (j = 1; j < 7; j++)
+			palette[j + 1] = (((7 - j) * high) + (j * low)) / 7;
+		for (i = 0; i < 16; i++)
+		{
+			best = 0;
+			bestdistance = INT_MAX;
+			for (j = 0; j < 8; j++)
+			{
+				distance = abs(texels[i][3] - palette[j]);
+				if (distance < bestdistance)
+				{
+					best = j;
+					bestdistance = distance;
+				}
+			}
+			indices |= (unsigned __int64)best << (3 * i);
+		}
+	}
+	dest[0] = (BYTE)high;
+	dest[1] = (BYTE)low;
+	for (i = 0; i < 6; i++)
+		dest[i + 2] = (BYTE)(indices >> (8 * i));
+}
+
+/**
+  * Checks whether surfaces of a pixel format can be block compressed.
+  * @param format
+  *  Pixel format of the surface
+  * @return
+  *  TRUE for 16, 24 and 32-bit RGB formats
+  */
+BOOL BlockCompress_CanEncode(const DDPIXELFORMAT *format)
+{
+	if (!(format->dwFlags & DDPF_RGB)) return FALSE;
+	if (format->dwFlags & (DDPF_PALETTEINDEXED1 | DDPF_PALETTEINDEXED2 | DDPF_PALETTEINDEXED4 |
+		DDPF_PALETTEINDEXED8 | DDPF_FOURCC | DDPF_ZBUFFER | DDPF_STENCILBUFFER)) return FALSE;
+	return (format->dwRGBBitCount == 16) || (format->dwRGBBitCount == 24) || (format->dwRGBBitCount == 32);
+}
+
+/**
+  * Gets the size of a level compressed to BC1 or BC3.
+  * @param width,height
+  *  Size of the level in texels
+  * @param alpha
+  *  TRUE for BC3, FALSE for BC1
+  * @return
+  *  Size of the compressed level in bytes
+  */
+GLsizei BlockCompress_Size(DWORD width, DWORD height, BOOL alpha)
+{
+	return (GLsizei)(((width + 3) / 4) * ((height + 3) / 4) * (alpha ? 16 : 8));
+}
+
+/**
+  * Compresses a level to BC1 or BC3.
+  * @param src
+  *  Pointer to the texels of the level
+  * @param pitch
+  *  Distance in bytes between rows of the level
+  * @param width,height
+  *  Size of the level in texels
+  * @param format
+  *  Pixel format of the level, checked with BlockCompress_CanEncode
+  * @param alpha
+  *  TRUE to compress to BC3, FALSE to compress to BC1 without transparency
+  * @param dest
+  *  Pointer to BlockCompress_Size bytes to receive the blocks
+  */
+void BlockCompress_Encode(const BYTE *src, LONG pitch, DWORD width, DWORD height,
+	const DDPIXELFORMAT *format, BOOL alpha, BYTE *dest)
+{
+	BLOCKCHANNEL channels[4];
+	BYTE texels[16][4];
+	DWORD bytes = format->dwRGBBitCount / 8;
+	DWORD x, y;
+	BlockCompress_GetChannel(format->dwRBitMask, &channels[0]);
+	BlockCompress_GetChannel(format->dwGBitMask, &channels[1]);
+	BlockCompress_GetChannel(format->dwBBitMask, &channels[2]);
+	BlockCompress_GetChannel((format->dwFlags & DDPF_ALPHAPIXELS) ? format->dwRGBAlphaBitMask : 0, &channels[3]);
+	for (y = 0; y < height; y += 4)
+	{
+		for (x = 0; x < width; x += 4)
+		{
+			BlockCompress_Fetch(src, pitch, width, height, x, y, bytes, channels, texels);
+			if (alpha)
+			{
+				BlockCompress_EncodeAlpha(texels, dest);
+				dest += 8;
+			}
+			BlockCompress_EncodeColor(texels, dest);
+			dest += 8;
+		}
+	}
+}
+
+static DWORD WINAPI BlockCompress_Worker(LPVOID param)
+{
+	BlockCompressJob *job = (BlockCompressJob*)param;
+	int i;
+	for (i = 0; i < job->levels; i++)
+	{
+		job->blocksize[i] = BlockCompress_Size(job->width[i], job->height[i], job->alpha);
+		job->blocks[i] = (BYTE*)malloc(job->blocksize[i]);
+		if (!job->blocks[i])
+		{
+			job->failed = TRUE;
+			break;
+		}
+		BlockCompress_Encode(job->source[i], job->pitch[i], job->width[i], job->height[i],
+			&job->format, job->alpha, job->blocks[i]);
+		job->size += job->blocksize[i];
+		free(job->source[i]);
+		job->source[i] = NULL;
+	}
+	InterlockedExchange(&job->done, TRUE);
+	return 0;
+}
+
+/**
+  * Copies the levels of a texture and compresses them on the system thread
+  * pool.  Must be called on the renderer thread.
+  * @param texture
+  *  Texture with all of its levels in their buffers
+  * @param writes
+  *  Upload count of the texture, kept in the job to tell whether the texture
+  *  changed while it was being compressed
+  * @return
+  *  New job, or NULL if it could not be started
+  */
+BlockCompressJob *BlockCompress_Start(glTexture *texture, DWORD writes)
+{
+	BlockCompressJob *job = (BlockCompressJob*)malloc(sizeof(BlockCompressJob));
+	MIPLEVEL *mip;
+	int i;
+	if (!job) return NULL;
+	ZeroMemory(job, sizeof(BlockCompressJob));
+	job->texture = texture;
+	job->writes = writes;
+	job->format = texture->levels[0].ddsd.ddpfPixelFormat;
+	job->alpha = (job->format.dwFlags & DDPF_ALPHAPIXELS) && job->format.dwRGBAlphaBitMask;
+	job->levels = texture->miplevel;
+	for (i = 0; i < job->levels; i++)
+	{
+		mip = &texture->levels[i];
+		job->width[i] = mip->ddsd.dwWidth;
+		job->height[i] = mip->ddsd.dwHeight;
+		job->pitch[i] = mip->ddsd.lPitch;
+		// The application may lock the surface while it is being compressed
+		job->source[i] = (BYTE*)malloc(mip->ddsd.lPitch * mip->ddsd.dwHeight);
+		if (!mip->buffer || !job->source[i])
+		{
+			BlockCompress_Free(job);
+			return NULL;
+		}
+		memcpy(job->source[i], mip->buffer, mip->ddsd.lPitch * mip->ddsd.dwHeight);
+	}
+	if (!QueueUserWorkItem(BlockCompress_Worker, job, WT_EXECUTELONGFUNCTION))
+		BlockCompress_Worker(job);
+	return job;
+}
+
+/**
+  * Waits for a job to finish.
+  * @param job
+  *  Job started with BlockCompress_Start
+  */
+void BlockCompress_Wait(BlockCompressJob *job)
+{
+	while (!job->done) Sleep(1);
+}
+
+/**
+  * Frees a finished job and its compressed levels.
+  * @param job
+  *  Job started with BlockCompress_Start
+  */
+void BlockCompress_Free(BlockCompressJob *job)
+{
+	int i;
+	for (i = 0; i < 17; i++)
+	{
+		if (job->source[i]) free(job->source[i]);
+		if (job->blocks[i]) free(job->blocks[i]);
+	}
+	free(job);
+}
@@ -0,0 +1,60 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#pragma once
+#ifndef _BLOCKCOMPRESS_H
+#define _BLOCKCOMPRESS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Textures with fewer texels in their top level are not worth compressing
+#define BLOCKCOMPRESS_MINTEXELS 65536
+
+// Copy of a texture's levels compressed to BC1 or BC3 on a worker thread
+typedef struct BlockCompressJob
+{
+	struct glTexture *texture;  // Texture being compressed, NULL if it was destroyed meanwhile
+	DWORD writes;  // Upload count of the texture when its levels were copied
+	DDPIXELFORMAT format;
+	BOOL alpha;  // Compressed to BC3 if TRUE, otherwise to BC1
+	int levels;
+	DWORD width[17];
+	DWORD height[17];
+	LONG pitch[17];
+	BYTE *source[17];  // Copies of the level buffers, freed once compressed
+	BYTE *blocks[17];
+	GLsizei blocksize[17];
+	GLsizeiptr size;  // Total size of the compressed levels
+	volatile LONG done;
+	BOOL failed;
+} BlockCompressJob;
+
+BOOL BlockCompress_CanEncode(const DDPIXELFORMAT *format);
+GLsizei BlockCompress_Size(DWORD width, DWORD height, BOOL alpha);
+void BlockCompress_Encode(const BYTE *src, LONG pitch, DWORD width, DWORD height,
+	const DDPIXELFORMAT *format, BOOL alpha, BYTE *dest);
+BlockCompressJob *BlockCompress_Start(struct glTexture *texture, DWORD writes);
+void BlockCompress_Wait(BlockCompressJob *job);
+void BlockCompress_Free(BlockCompressJob *job);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_BLOCKCOMPRESS_H
@@ -33,7 +33,9 @@ void BufferObject_Create(BufferObject **out, glExtensions *ext, struct glUtil *u
 	buffer->util = util;
 	buffer->size = 0;
 	glUtil_AddRef(util);
-	ext->glGenBuffers(1, &buffer->buffer);
+	// Created names can be used with direct state access before they are bound
+	if (ext->glCreateBuffers) ext->glCreateBuffers(1, &buffer->buffer);
+	else ext->glGenBuffers(1, &buffer->buffer);
 	*out = buffer;
 }
 
@@ -70,6 +72,15 @@ void BufferObject_SetData(BufferObject *This, GLenum target, GLsizeiptr size, GL
 		This->ext->glBufferData(target, size, data, usage);
 		glUtil_UndoBindBuffer(This->util, target);
 	/*}*/
+	This->size = (GLsizei)size;
+}
+
+void BufferObject_SetStorage(BufferObject *This, GLenum target, GLsizeiptr size, GLvoid *data, GLbitfield flags)
+{
+	glUtil_BindBuffer(This->util, This, target);
+	This->ext->glBufferStorage(target, size, data, flags);
+	glUtil_UndoBindBuffer(This->util, target);
+	This->size = (GLsizei)size;
 }
 
 void BufferObject_Bind(BufferObject *This, GLenum target)
@@ -100,6 +111,14 @@ void *BufferObject_Map(BufferObject *This, GLenum target, GLenum access)
 	/*}*/
 	return ptr;
 }
+void *BufferObject_MapRange(BufferObject *This, GLenum target, GLintptr offset, GLsizeiptr length, GLbitfield access)
+{
+	void *ptr;
+	glUtil_BindBuffer(This->util, This, target);
+	ptr = This->ext->glMapBufferRange(target, offset, length, access);
+	glUtil_UndoBindBuffer(This->util, target);
+	return ptr;
+}
 GLboolean BufferObject_Unmap(BufferObject *This, GLenum target)
 {
 	GLboolean ret;
@@ -29,9 +29,11 @@ void BufferObject_Create(BufferObject **out, glExtensions *ext, struct glUtil *u
 void BufferObject_AddRef(BufferObject *This);
 void BufferObject_Release(BufferObject *This);
 void BufferObject_SetData(BufferObject *This, GLenum target, GLsizeiptr size, GLvoid *data, GLenum usage);
+void BufferObject_SetStorage(BufferObject *This, GLenum target, GLsizeiptr size, GLvoid *data, GLbitfield flags);
 void BufferObject_Bind(BufferObject *This, GLenum target);
 void BufferObject_Unbind(BufferObject *This, GLenum target);
 void *BufferObject_Map(BufferObject *This, GLenum target, GLenum access);
+void *BufferObject_MapRange(BufferObject *This, GLenum target, GLintptr offset, GLsizeiptr length, GLbitfield access);
 GLboolean BufferObject_Unmap(BufferObject *This, GLenum target);
 
 #ifdef __cplusplus
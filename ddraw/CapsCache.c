@@ -0,0 +1,445 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#include "common.h"
+#include "CapsCache.h"
+#include "util.h"
+#include "../common/version.h"
+
+extern DXGLCFG dxglcfg;
+
+// Refuse implausibly large records so a corrupt file can't exhaust memory
+#define CAPSCACHE_MAXRECORD 1048576
+
+static const char signaturebase[] = "DXGL " DXGLVERSTRING " caps";
+
+static struct
+{
+	BOOL loaded;
+	BYTE signature[32];
+	TCHAR filename[MAX_PATH + 16];
+	BYTE key[CAPSCACHE_TYPES][32];
+	BYTE *data[CAPSCACHE_TYPES];
+	DWORD length[CAPSCACHE_TYPES];
+} capscache;
+static DWORD capscachelock = 0;
+
+/**
+  * Adds the primary display adapter, its driver version and its monitor to
+  * a hash.
+  * @param sha_context
+  *  Pointer to SHA-256 context to update
+  * @param monitor
+  *  TRUE to hash the monitor attached to the adapter, FALSE to hash the
+  *  adapter and driver
+  */
+static void CapsCache_HashDisplay(Sha256Context *sha_context, BOOL monitor)
+{
+	DISPLAY_DEVICEA dev;
+	DISPLAY_DEVICEA mon;
+	HKEY hKey;
+	char version[64];
+	DWORD size;
+	DWORD i;
+	const char *key;
+	ZeroMemory(&dev, sizeof(DISPLAY_DEVICEA));
+	dev.cb = sizeof(DISPLAY_DEVICEA);
+	for (i = 0; EnumDisplayDevicesA(NULL, i, &dev, 0); i++)
+		if (dev.StateFlags & DISPLAY_DEVICE_PRIMARY_DEVICE) break;
+	if (!(dev.StateFlags & DISPLAY_DEVICE_PRIMARY_DEVICE)) return;
+	if (monitor)
+	{
+		ZeroMemory(&mon, sizeof(DISPLAY_DEVICEA));
+		mon.cb = sizeof(DISPLAY_DEVICEA);
+		if (EnumDisplayDevicesA(dev.DeviceName, 0, &mon, 0))
+			Sha256Update(sha_context, mon.DeviceID, (uint32_t)strlen(mon.DeviceID));
+		return;
+	}
+	Sha256Update(sha_context, dev.DeviceString, (uint32_t)strlen(dev.DeviceString));
+	Sha256Update(sha_context, dev.DeviceID, (uint32_t)strlen(dev.DeviceID));
+	// DeviceKey is a kernel path, \Registry\Machine\<key>
+	key = dev.DeviceKey;
+	if (!_strnicmp(key, "\\Registry\\Machine\\", 18)) key += 18;
+	if (RegOpenKeyExA(HKEY_LOCAL_MACHINE, key, 0, KEY_READ, &hKey) == ERROR_SUCCESS)
+	{
+		size = sizeof(version) - 1;
+		ZeroMemory(version, sizeof(version));
+		if (RegQueryValueExA(hKey, "DriverVersion", NULL, NULL, (LPBYTE)version, &size) == ERROR_SUCCESS)
+			Sha256Update(sha_context, version, (uint32_t)strlen(version));
+		RegCloseKey(hKey);
+	}
+}
+
+/**
+  * Computes the key for the settings a cache record depends on.
+  * @param type
+  *  CAPSCACHE_* record type
+  * @param key
+  *  Pointer to 32 bytes to receive the key
+  */
+static void CapsCache_MakeKey(DWORD type, BYTE *key)
+{
+	Sha256Context sha_context;
+	SHA256_HASH sha256;
+	DWORD values[16];
+	float sizes[2];
+	Sha256Initialise(&sha_context);
+	Sha256Update(&sha_context, &type, sizeof(DWORD));
+	if (type == CAPSCACHE_GLCAPS)
+	{
+		// Settings that hide extensions or limit the context version
+		values[0] = dxglcfg.DebugNoExtFramebuffer;
+		values[1] = dxglcfg.DebugNoArbFramebuffer;
+		values[2] = dxglcfg.DebugNoES2Compatibility;
+		values[3] = dxglcfg.DebugNoExtDirectStateAccess;
+		values[4] = dxglcfg.DebugNoArbDirectStateAccess;
+		values[5] = dxglcfg.DebugNoSamplerObjects;
+		values[6] = dxglcfg.DebugNoGpuShader4;
+		values[7] = dxglcfg.DebugNoGLSL130;
+		values[8] = dxglcfg.DebugMaxGLVersionMajor;
+		values[9] = dxglcfg.DebugMaxGLVersionMinor;
+		Sha256Update(&sha_context, values, 10 * sizeof(DWORD));
+	}
+	else if (type == CAPSCACHE_TUNING)
+	{
+		// Settings that change the buffers being measured
+		values[0] = dxglcfg.UnpackBufferSize;
+		Sha256Update(&sha_context, values, sizeof(DWORD));
+	}
+	else
+	{
+		// Settings used to build the display mode list
+		values[0] = dxglcfg.scaler;
+		values[1] = dxglcfg.primaryscale;
+		values[2] = dxglcfg.AddColorDepths;
+		values[3] = dxglcfg.AddModes;
+		values[4] = dxglcfg.SortModes;
+		values[5] = dxglcfg.HackNoTVRefresh;
+		sizes[0] = dxglcfg.postsizex;
+		sizes[1] = dxglcfg.postsizey;
+		Sha256Update(&sha_context, values, 6 * sizeof(DWORD));
+		Sha256Update(&sha_context, sizes, 2 * sizeof(float));
+		CapsCache_HashDisplay(&sha_context, TRUE);
+	}
+	Sha256Finalise(&sha_context, &sha256);
+	memcpy(key, sha256.bytes, 32);
+}
+
+/**
+  * Reads the records of the cache file into memory.  A file written by
+  * another DXGL build, display adapter or driver version is ignored.
+  */
+static void CapsCache_ReadFile()
+{
+	HANDLE file;
+	CAPSCACHEHEADER header;
+	CAPSCACHERECORD record;
+	DWORD bytesread;
+	BYTE *data;
+	file = CreateFile(capscache.filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return;
+	if (ReadFile(file, &header, sizeof(CAPSCACHEHEADER), &bytesread, NULL)
+		&& (bytesread == sizeof(CAPSCACHEHEADER)) && (header.magic == CAPSCACHE_MAGIC)
+		&& (header.fileversion == CAPSCACHE_FILEVERSION) && !memcmp(header.signature, capscache.signature, 32))
+	{
+		while (ReadFile(file, &record, sizeof(CAPSCACHERECORD), &bytesread, NULL)
+			&& (bytesread == sizeof(CAPSCACHERECORD)))
+		{
+			if ((record.type >= CAPSCACHE_TYPES) || !record.length || (record.length > CAPSCACHE_MAXRECORD)) break;
+			data = (BYTE*)malloc(record.length);
+			if (!data) break;
+			if (!ReadFile(file, data, record.length, &bytesread, NULL) || (bytesread != record.length))
+			{
+				free(data);
+				break;
+			}
+			if (capscache.data[record.type]) free(capscache.data[record.type]);
+			capscache.data[record.type] = data;
+			capscache.length[record.type] = record.length;
+			memcpy(capscache.key[record.type], record.key, 32);
+		}
+	}
+	CloseHandle(file);
+}
+
+static void CapsCache_CreateDirectory(const TCHAR *filename)
+{
+	TCHAR path[MAX_PATH + 16];
+	size_t i;
+	_tcscpy(path, filename);
+	for (i = 1; path[i]; i++)
+	{
+		if (path[i] == 92)
+		{
+			path[i] = 0;
+			CreateDirectory(path, NULL);
+			path[i] = 92;
+		}
+	}
+}
+
+/**
+  * Replaces the cache file with the records held in memory.
+  */
+static void CapsCache_WriteFile()
+{
+	HANDLE file;
+	CAPSCACHEHEADER header;
+	CAPSCACHERECORD record;
+	DWORD byteswritten;
+	DWORD i;
+	file = CreateFile(capscache.filename, GENERIC_WRITE, 0, NULL,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		CapsCache_CreateDirectory(capscache.filename);
+		file = CreateFile(capscache.filename, GENERIC_WRITE, 0, NULL,
+			CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE) return;
+	}
+	header.magic = CAPSCACHE_MAGIC;
+	header.fileversion = CAPSCACHE_FILEVERSION;
+	memcpy(header.signature, capscache.signature, 32);
+	WriteFile(file, &header, sizeof(CAPSCACHEHEADER), &byteswritten, NULL);
+	for (i = 0; i < CAPSCACHE_TYPES; i++)
+	{
+		if (!capscache.data[i]) continue;
+		record.type = i;
+		record.length = capscache.length[i];
+		memcpy(record.key, capscache.key[i], 32);
+		WriteFile(file, &record, sizeof(CAPSCACHERECORD), &byteswritten, NULL);
+		WriteFile(file, capscache.data[i], capscache.length[i], &byteswritten, NULL);
+	}
+	CloseHandle(file);
+}
+
+/**
+  * Loads the cache file the first time the cache is used.  Must be called
+  * with the cache lock held.
+  */
+static void CapsCache_Load()
+{
+	Sha256Context sha_context;
+	SHA256_HASH sha256;
+	if (capscache.loaded) return;
+	capscache.loaded = TRUE;
+	if (!dxglcfg.CapsCache || !dxglcfg.shadercachepath[0]) return;
+	Sha256Initialise(&sha_context);
+	Sha256Update(&sha_context, signaturebase, (uint32_t)strlen(signaturebase));
+	CapsCache_HashDisplay(&sha_context, FALSE);
+	Sha256Finalise(&sha_context, &sha256);
+	memcpy(capscache.signature, sha256.bytes, 32);
+	_tcscpy(capscache.filename, dxglcfg.shadercachepath);
+	_tcscat(capscache.filename, _T("\\caps.bin"));
+	CapsCache_ReadFile();
+}
+
+/**
+  * Gets a copy of a cached record if it was stored with the current settings.
+  * @param type
+  *  CAPSCACHE_* record type
+  * @param length
+  *  Pointer to receive the length of the record
+  * @return
+  *  Copy of the record allocated with malloc, or NULL if it is not cached.
+  */
+static BYTE *CapsCache_Get(DWORD type, DWORD *length)
+{
+	BYTE key[32];
+	BYTE *data = NULL;
+	CapsCache_MakeKey(type, key);
+	EnterSpinlock(&capscachelock);
+	CapsCache_Load();
+	if (capscache.data[type] && !memcmp(capscache.key[type], key, 32))
+	{
+		data = (BYTE*)malloc(capscache.length[type]);
+		if (data)
+		{
+			memcpy(data, capscache.data[type], capscache.length[type]);
+			*length = capscache.length[type];
+		}
+	}
+	ExitSpinlock(&capscachelock);
+	return data;
+}
+
+/**
+  * Stores a record in memory, and in the cache file if it changed.
+  * @param type
+  *  CAPSCACHE_* record type
+  * @param data
+  *  Pointer to the record, allocated with malloc.  The cache takes ownership.
+  * @param length
+  *  Length of the record
+  */
+static void CapsCache_Store(DWORD type, BYTE *data, DWORD length)
+{
+	BYTE key[32];
+	CapsCache_MakeKey(type, key);
+	EnterSpinlock(&capscachelock);
+	CapsCache_Load();
+	if (capscache.data[type] && (capscache.length[type] == length) &&
+		!memcmp(capscache.key[type], key, 32) && !memcmp(capscache.data[type], data, length))
+	{
+		ExitSpinlock(&capscachelock);
+		free(data);
+		return;
+	}
+	if (capscache.data[type]) free(capscache.data[type]);
+	capscache.data[type] = data;
+	capscache.length[type] = length;
+	memcpy(capscache.key[type], key, 32);
+	if (capscache.filename[0]) CapsCache_WriteFile();
+	ExitSpinlock(&capscachelock);
+}
+
+/**
+  * Gets the OpenGL capabilities found by a previous renderer, in this process
+  * or a previous run on the same display adapter and driver.
+  * @param caps
+  *  Pointer to a GLCAPS structure to receive the capabilities
+  * @return
+  *  TRUE if the capabilities were cached, FALSE if a renderer must probe them.
+  */
+BOOL CapsCache_GetGLCaps(GLCAPS *caps)
+{
+	DWORD length = 0;
+	BYTE *data = CapsCache_Get(CAPSCACHE_GLCAPS, &length);
+	if (!data) return FALSE;
+	if (length != sizeof(GLCAPS))
+	{
+		free(data);
+		return FALSE;
+	}
+	memcpy(caps, data, sizeof(GLCAPS));
+	free(data);
+	return TRUE;
+}
+
+/**
+  * Stores the OpenGL capabilities found by a renderer.
+  * @param caps
+  *  Pointer to the capabilities of the renderer
+  */
+void CapsCache_StoreGLCaps(const GLCAPS *caps)
+{
+	BYTE *data = (BYTE*)malloc(sizeof(GLCAPS));
+	if (!data) return;
+	memcpy(data, caps, sizeof(GLCAPS));
+	CapsCache_Store(CAPSCACHE_GLCAPS, data, sizeof(GLCAPS));
+}
+
+/**
+  * Gets a display mode list built by a previous enumeration.
+  * @param type
+  *  CAPSCACHE_MODES1 or CAPSCACHE_MODES2
+  * @param modes
+  *  Pointer to receive the mode list, allocated with malloc
+  * @param count
+  *  Pointer to receive the number of modes in the list
+  * @return
+  *  TRUE if the mode list was cached, FALSE if it must be built.
+  */
+BOOL CapsCache_GetModes(DWORD type, DEVMODE **modes, DWORD *count)
+{
+	DWORD length = 0;
+	DWORD i;
+	CAPSCACHEMODE *cached = (CAPSCACHEMODE*)CapsCache_Get(type, &length);
+	if (!cached) return FALSE;
+	*count = length / sizeof(CAPSCACHEMODE);
+	*modes = (DEVMODE*)malloc(*count * sizeof(DEVMODE));
+	if (!*modes)
+	{
+		free(cached);
+		return FALSE;
+	}
+	ZeroMemory(*modes, *count * sizeof(DEVMODE));
+	for (i = 0; i < *count; i++)
+	{
+		(*modes)[i].dmSize = sizeof(DEVMODE);
+		(*modes)[i].dmFields = DM_PELSWIDTH | DM_PELSHEIGHT | DM_BITSPERPEL | DM_DISPLAYFREQUENCY;
+		(*modes)[i].dmPelsWidth = cached[i].width;
+		(*modes)[i].dmPelsHeight = cached[i].height;
+		(*modes)[i].dmBitsPerPel = cached[i].bpp;
+		(*modes)[i].dmDisplayFrequency = cached[i].frequency;
+	}
+	free(cached);
+	return TRUE;
+}
+
+/**
+  * Stores a finished display mode list.
+  * @param type
+  *  CAPSCACHE_MODES1 or CAPSCACHE_MODES2
+  * @param modes
+  *  Pointer to the sorted mode list
+  * @param count
+  *  Number of modes in the list
+  */
+void CapsCache_StoreModes(DWORD type, const DEVMODE *modes, DWORD count)
+{
+	CAPSCACHEMODE *cached;
+	DWORD i;
+	if (!count) return;
+	cached = (CAPSCACHEMODE*)malloc(count * sizeof(CAPSCACHEMODE));
+	if (!cached) return;
+	for (i = 0; i < count; i++)
+	{
+		cached[i].width = modes[i].dmPelsWidth;
+		cached[i].height = modes[i].dmPelsHeight;
+		cached[i].bpp = modes[i].dmBitsPerPel;
+		cached[i].frequency = modes[i].dmDisplayFrequency;
+	}
+	CapsCache_Store(type, (BYTE*)cached, count * sizeof(CAPSCACHEMODE));
+}
+
+/**
+  * Gets the texture upload method measured by a previous renderer on the same
+  * display adapter and driver.
+  * @param tuning
+  *  Pointer to a CAPSCACHETUNING structure to receive the measurements
+  * @return
+  *  TRUE if the measurements were cached, FALSE if a renderer must take them.
+  */
+BOOL CapsCache_GetTuning(CAPSCACHETUNING *tuning)
+{
+	DWORD length = 0;
+	BYTE *data = CapsCache_Get(CAPSCACHE_TUNING, &length);
+	if (!data) return FALSE;
+	if (length != sizeof(CAPSCACHETUNING))
+	{
+		free(data);
+		return FALSE;
+	}
+	memcpy(tuning, data, sizeof(CAPSCACHETUNING));
+	free(data);
+	return TRUE;
+}
+
+/**
+  * Stores the texture upload method measured by a renderer.
+  * @param tuning
+  *  Pointer to the measurements
+  */
+void CapsCache_StoreTuning(const CAPSCACHETUNING *tuning)
+{
+	BYTE *data = (BYTE*)malloc(sizeof(CAPSCACHETUNING));
+	if (!data) return;
+	memcpy(data, tuning, sizeof(CAPSCACHETUNING));
+	CapsCache_Store(CAPSCACHE_TUNING, data, sizeof(CAPSCACHETUNING));
+}
@@ -0,0 +1,76 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#pragma once
+#ifndef _CAPSCACHE_H
+#define _CAPSCACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CAPSCACHE_GLCAPS 0
+#define CAPSCACHE_MODES1 1  // Display modes for IDirectDraw through IDirectDraw4
+#define CAPSCACHE_MODES2 2  // Display modes for IDirectDraw7
+#define CAPSCACHE_TUNING 3  // Upload methods measured on the adapter
+#define CAPSCACHE_TYPES 4
+
+// Magic number at the start of the cache file, 'DXCC'
+#define CAPSCACHE_MAGIC 0x43435844
+// Increment when the layout of the header, records or GLCAPS changes
+#define CAPSCACHE_FILEVERSION 1
+
+typedef struct CAPSCACHEHEADER
+{
+	DWORD magic;
+	DWORD fileversion;
+	BYTE signature[32];  // SHA-256 of the DXGL build, display adapter and driver version
+} CAPSCACHEHEADER;
+
+// Each record is followed by length bytes of data
+typedef struct CAPSCACHERECORD
+{
+	DWORD type;
+	DWORD length;
+	BYTE key[32];  // SHA-256 of the settings the data depends on
+} CAPSCACHERECORD;
+
+typedef struct CAPSCACHEMODE
+{
+	DWORD width;
+	DWORD height;
+	DWORD bpp;
+	DWORD frequency;
+} CAPSCACHEMODE;
+
+typedef struct CAPSCACHETUNING
+{
+	DWORD texupload;  // TexUpload value that was fastest, 1 or 2
+} CAPSCACHETUNING;
+
+BOOL CapsCache_GetGLCaps(GLCAPS *caps);
+void CapsCache_StoreGLCaps(const GLCAPS *caps);
+BOOL CapsCache_GetModes(DWORD type, DEVMODE **modes, DWORD *count);
+void CapsCache_StoreModes(DWORD type, const DEVMODE *modes, DWORD count);
+BOOL CapsCache_GetTuning(CAPSCACHETUNING *tuning);
+void CapsCache_StoreTuning(const CAPSCACHETUNING *tuning);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_CAPSCACHE_H
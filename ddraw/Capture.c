@@ -0,0 +1,729 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#include "common.h"
+#include "BufferObject.h"
+#include "timer.h"
+#include "glRenderer.h"
+#include "glTexture.h"
+#include "Capture.h"
+
+/**
+  * Writes the buffered records to the file.
+  * @param capture
+  *  Pointer to Capture structure
+  */
+static void Capture_FlushBuffer(Capture *capture)
+{
+	DWORD written;
+	if (!capture->bufferused) return;
+	if (!WriteFile(capture->file, capture->buffer, capture->bufferused, &written, NULL) ||
+		(written != capture->bufferused)) capture->failed = TRUE;
+	capture->bufferused = 0;
+}
+
+/**
+  * Adds bytes to the file through the buffer.  Data too large for the buffer
+  * is written directly.
+  * @param capture
+  *  Pointer to Capture structure
+  * @param data
+  *  Data to write
+  * @param size
+  *  Size of the data in bytes
+  */
+static void Capture_Write(Capture *capture, const void *data, DWORD size)
+{
+	DWORD written;
+	if (capture->failed || !size) return;
+	if (capture->bufferused + size > CAPTURE_BUFFERSIZE) Capture_FlushBuffer(capture);
+	capture->written += size;
+	if (size >= CAPTURE_BUFFERSIZE)
+	{
+		if (!WriteFile(capture->file, data, size, &written, NULL) || (written != size)) capture->failed = TRUE;
+		return;
+	}
+	memcpy(capture->buffer + capture->bufferused, data, size);
+	capture->bufferused += size;
+}
+
+/**
+  * Writes a record to the file right away.  Used for records that later
+  * commands depend on, which must come before the command being run.
+  * @param capture
+  *  Pointer to Capture structure
+  * @param type
+  *  Record type
+  * @param data
+  *  Data of the record
+  * @param size
+  *  Size of the data in bytes
+  */
+static void Capture_WriteRecord(Capture *capture, DWORD type, const void *data, DWORD size)
+{
+	CaptureRecord record;
+	record.type = type;
+	record.size = size;
+	Capture_Write(capture, &record, sizeof(CaptureRecord));
+	Capture_Write(capture, data, size);
+}
+
+/**
+  * Adds a record of the command being run.  It is written once the command
+  * has ended, after the uploads the command does on its own.
+  * @param capture
+  *  Pointer to Capture structure
+  * @param type
+  *  Record type
+  * @param data
+  *  Data of the record, may be NULL if size is 0
+  * @param size
+  *  Size of the data in bytes
+  */
+static void Capture_AddRecord(Capture *capture, DWORD type, const void *data, DWORD size)
+{
+	CaptureRecord record;
+	BYTE *pending;
+	DWORD max;
+	if (capture->failed) return;
+	if (capture->pendingused + sizeof(CaptureRecord) + size > capture->pendingmax)
+	{
+		max = capture->pendingmax * 2;
+		while (capture->pendingused + sizeof(CaptureRecord) + size > max) max *= 2;
+		pending = (BYTE*)realloc(capture->pending, max);
+		if (!pending)
+		{
+			capture->failed = TRUE;
+			return;
+		}
+		capture->pending = pending;
+		capture->pendingmax = max;
+	}
+	record.type = type;
+	record.size = size;
+	memcpy(capture->pending + capture->pendingused, &record, sizeof(CaptureRecord));
+	capture->pendingused += sizeof(CaptureRecord);
+	if (size) memcpy(capture->pending + capture->pendingused, data, size);
+	capture->pendingused += size;
+}
+
+/**
+  * Doubles the size of the blob hash table.
+  * @param capture
+  *  Pointer to Capture structure
+  * @return
+  *  TRUE if the table was grown
+  */
+static BOOL Capture_GrowBlobs(Capture *capture)
+{
+	CaptureBlob *blobs;
+	DWORD max = capture->blobmax * 2;
+	DWORD slot;
+	DWORD i;
+	blobs = (CaptureBlob*)malloc(max * sizeof(CaptureBlob));
+	if (!blobs) return FALSE;
+	ZeroMemory(blobs, max * sizeof(CaptureBlob));
+	for (i = 0; i < capture->blobmax; i++)
+	{
+		if (!capture->blobs[i].id) continue;
+		slot = (DWORD)capture->blobs[i].hash & (max - 1);
+		while (blobs[slot].id) slot = (slot + 1) & (max - 1);
+		blobs[slot] = capture->blobs[i];
+	}
+	free(capture->blobs);
+	capture->blobs = blobs;
+	capture->blobmax = max;
+	return TRUE;
+}
+
+/**
+  * Gets the blob ID of a block of data, writing the data to the file if it
+  * was not written before.
+  * @param capture
+  *  Pointer to Capture structure
+  * @param data
+  *  Data to store
+  * @param size
+  *  Size of the data in bytes
+  * @return
+  *  Blob ID of the data, or 0 if there is no data or it could not be stored
+  */
+static DWORD Capture_Blob(Capture *capture, const void *data, DWORD size)
+{
+	const BYTE *bytes = (const BYTE*)data;
+	unsigned __int64 hash = 0xCBF29CE484222325ui64;
+	CaptureBlob *blob;
+	DWORD slot;
+	DWORD i;
+	if (!data || !size || capture->failed) return 0;
+	for (i = 0; i < size; i++)
+		hash = (hash ^ bytes[i]) * 0x100000001B3ui64;
+	// Keep the table at most half full so lookups stay short
+	if (((capture->blobcount + 1) * 2 > capture->blobmax) && !Capture_GrowBlobs(capture))
+	{
+		capture->failed = TRUE;
+		return 0;
+	}
+	slot = (DWORD)hash & (capture->blobmax - 1);
+	while (capture->blobs[slot].id)
+	{
+		blob = &capture->blobs[slot];
+		if ((blob->hash == hash) && (blob->size == size))
+		{
+			capture->deduplicated += size;
+			return blob->id;
+		}
+		slot = (slot + 1) & (capture->blobmax - 1);
+	}
+	blob = &capture->blobs[slot];
+	blob->hash = hash;
+	blob->size = size;
+	blob->id = ++capture->blobcount;
+	Capture_WriteRecord(capture, CAPTURE_BLOB, data, size);
+	return blob->id;
+}
+
+/**
+  * Gets the ID of a texture used by a command, recording its palette and
+  * clip stencil first if they changed since it was last used.
+  * @param capture
+  *  Pointer to Capture structure
+  * @param texture
+  *  Texture used by the command, may be NULL
+  * @return
+  *  ID of the texture, or 0 if it is NULL or was created by the renderer
+  *  itself
+  */
+static DWORD Capture_TextureID(Capture *capture, glTexture *texture)
+{
+	CaptureLinks *links;
+	CaptureLink link;
+	if (!texture || !texture->captureid) return 0;
+	links = &capture->links[texture->captureid];
+	link.texture = texture->captureid;
+	link.palette = texture->palette ? texture->palette->captureid : 0;
+	link.stencil = texture->stencil ? texture->stencil->captureid : 0;
+	if ((links->palette != link.palette) || (links->stencil != link.stencil))
+	{
+		Capture_AddRecord(capture, CAPTURE_LINK, &link, sizeof(CaptureLink));
+		links->palette = link.palette;
+		links->stencil = link.stencil;
+	}
+	return texture->captureid;
+}
+
+/**
+  * Replaces the textures of a blt with their IDs.
+  * @param capture
+  *  Pointer to Capture structure
+  * @param cmd
+  *  Copy of the blt to change
+  */
+static void Capture_MapBlt(Capture *capture, BltCommand *cmd)
+{
+	cmd->dest = CAPTURE_ID(Capture_TextureID(capture, cmd->dest));
+	cmd->src = CAPTURE_ID(Capture_TextureID(capture, cmd->src));
+	cmd->zdest = CAPTURE_ID(Capture_TextureID(capture, cmd->zdest));
+	cmd->zsrc = CAPTURE_ID(Capture_TextureID(capture, cmd->zsrc));
+	cmd->alphadest = CAPTURE_ID(Capture_TextureID(capture, cmd->alphadest));
+	cmd->alphasrc = CAPTURE_ID(Capture_TextureID(capture, cmd->alphasrc));
+	cmd->pattern = CAPTURE_ID(Capture_TextureID(capture, cmd->pattern));
+}
+
+/**
+  * Creates dxgl-capture.dxc in the directory of the executable and starts
+  * recording.
+  * @param capture
+  *  Pointer to Capture structure to initialize
+  * @return
+  *  TRUE if the file was created
+  */
+BOOL Capture_Init(Capture *capture)
+{
+	TCHAR path[MAX_PATH + 1];
+	TCHAR *path_truncate;
+	CaptureHeader header;
+	ZeroMemory(capture, sizeof(Capture));
+	GetModuleFileName(NULL, path, MAX_PATH);
+	path[MAX_PATH] = 0;
+	path_truncate = _tcsrchr(path, _T('\\'));
+	if (path_truncate) *(path_truncate + 1) = 0;
+	_tcscat(path, _T("dxgl-capture.dxc"));
+	capture->buffer = (BYTE*)malloc(CAPTURE_BUFFERSIZE);
+	capture->pendingmax = 65536;
+	capture->pending = (BYTE*)malloc(capture->pendingmax);
+	capture->blobmax = 4096;
+	capture->blobs = (CaptureBlob*)malloc(capture->blobmax * sizeof(CaptureBlob));
+	capture->linkmax = 1024;
+	capture->links = (CaptureLinks*)malloc(capture->linkmax * sizeof(CaptureLinks));
+	if (!capture->buffer || !capture->pending || !capture->blobs || !capture->links)
+	{
+		free(capture->buffer);
+		free(capture->pending);
+		free(capture->blobs);
+		free(capture->links);
+		return FALSE;
+	}
+	ZeroMemory(capture->blobs, capture->blobmax * sizeof(CaptureBlob));
+	capture->file = CreateFile(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (capture->file == INVALID_HANDLE_VALUE)
+	{
+		free(capture->buffer);
+		free(capture->pending);
+		free(capture->blobs);
+		free(capture->links);
+		return FALSE;
+	}
+	header.magic = CAPTURE_MAGIC;
+	header.version = CAPTURE_VERSION;
+	header.pointersize = sizeof(void*);
+	header.reserved = 0;
+	Capture_Write(capture, &header, sizeof(CaptureHeader));
+	return TRUE;
+}
+
+/**
+  * Writes the outstanding records and closes the file.
+  * @param capture
+  *  Pointer to Capture structure
+  */
+void Capture_Delete(Capture *capture)
+{
+	char str[256];
+	Capture_EndCommand(capture);
+	Capture_FlushBuffer(capture);
+	CloseHandle(capture->file);
+	capture->file = INVALID_HANDLE_VALUE;
+	sprintf(str, "Capture: %u frames, %u textures, %u blobs, %I64u bytes written, %I64u bytes deduplicated%s\n",
+		capture->frames, capture->texturecount, capture->blobcount, capture->written, capture->deduplicated,
+		capture->failed ? ", stopped early" : "");
+	TRACE_STRING(str);
+	free(capture->buffer);
+	free(capture->pending);
+	free(capture->blobs);
+	free(capture->links);
+	free(capture->vertexbuffers);
+	capture->buffer = capture->pending = NULL;
+	capture->blobs = NULL;
+	capture->links = NULL;
+	capture->vertexbuffers = NULL;
+}
+
+/**
+  * Writes the records of the command that has just been run.  Must be called
+  * after every command.
+  * @param capture
+  *  Pointer to Capture structure
+  */
+void Capture_EndCommand(Capture *capture)
+{
+	if (!capture->pendingused) return;
+	Capture_Write(capture, capture->pending, capture->pendingused);
+	capture->pendingused = 0;
+}
+
+/**
+  * Records the display mode a primary surface is created in, if it changed.
+  * @param capture
+  *  Pointer to Capture structure
+  * @param width,height,bpp,refresh
+  *  Display mode of the primary surface
+  * @param fullscreen
+  *  TRUE if the application runs in fullscreen mode
+  */
+void Capture_SetMode(Capture *capture, DWORD width, DWORD height, DWORD bpp, DWORD refresh, BOOL fullscreen)
+{
+	CaptureMode mode;
+	mode.width = width;
+	mode.height = height;
+	mode.bpp = bpp;
+	mode.refresh = refresh;
+	mode.fullscreen = fullscreen;
+	if (!memcmp(&mode, &capture->mode, sizeof(CaptureMode))) return;
+	capture->mode = mode;
+	Capture_WriteRecord(capture, CAPTURE_MODE, &mode, sizeof(CaptureMode));
+}
+
+/**
+  * Gives a new texture an ID and records its surface description.
+  * @param capture
+  *  Pointer to Capture structure
+  * @param texture
+  *  Texture that has been created
+  */
+void Capture_MakeTexture(Capture *capture, glTexture *texture)
+{
+	CaptureTexture record;
+	CaptureLinks *links;
+	DWORD max;
+	if (capture->failed) return;
+	if (capture->texturecount + 1 >= capture->linkmax)
+	{
+		max = capture->linkmax * 2;
+		links = (CaptureLinks*)realloc(capture->links, max * sizeof(CaptureLinks));
+		if (!links)
+		{
+			capture->failed = TRUE;
+			return;
+		}
+		capture->links = links;
+		capture->linkmax = max;
+	}
+	texture->captureid = ++capture->texturecount;
+	ZeroMemory(&capture->links[texture->captureid], sizeof(CaptureLinks));
+	record.texture = texture->captureid;
+	record.target = texture->target;
+	record.ddsd = texture->levels[0].ddsd;
+	record.ddsd.dwFlags |= DDSD_PIXELFORMAT;
+	Capture_WriteRecord(capture, CAPTURE_TEXTURE, &record, sizeof(CaptureTexture));
+}
+
+/**
+  * Records the deletion of a texture.
+  * @param capture
+  *  Pointer to Capture structure
+  * @param texture
+  *  Texture being deleted
+  */
+void Capture_DeleteTexture(Capture *capture, glTexture *texture)
+{
+	DWORD id = texture->captureid;
+	if (id) Capture_AddRecord(capture, OP_DELETETEX, &id, sizeof(DWORD));
+}
+
+/**
+  * Records the contents of a texture level as it is uploaded.
+  * @param capture
+  *  Pointer to Capture structure
+  * @param texture
+  *  Texture being uploaded
+  * @param level
+  *  Mipmap level being uploaded
+  */
+void Capture_Upload(Capture *capture, glTexture *texture, GLint level)
+{
+	CaptureUpload record;
+	if (capture->failed || !texture->captureid || !texture->levels[level].buffer) return;
+	record.texture = texture->captureid;
+	record.level = level;
+	record.blob = Capture_Blob(capture, texture->levels[level].buffer, glTexture__LevelSize(texture, level));
+	if (record.blob) Capture_WriteRecord(capture, CAPTURE_UPLOAD, &record, sizeof(CaptureUpload));
+}
+
+/**
+  * Records a read back of a texture level.
+  * @param capture
+  *  Pointer to Capture structure
+  * @param texture
+  *  Texture being read back
+  * @param level
+  *  Mipmap level being read back
+  */
+void Capture_Download(Capture *capture, glTexture *texture, GLint level)
+{
+	CaptureLevel record;
+	record.texture = Capture_TextureID(capture, texture);
+	record.level = level;
+	if (record.texture) Capture_AddRecord(capture, OP_DOWNLOAD, &record, sizeof(CaptureLevel));
+}
+
+/**
+  * Records a blt.
+  * @param capture
+  *  Pointer to Capture structure
+  * @param cmd
+  *  Blt being run
+  */
+void Capture_Blt(Capture *capture, const BltCommand *cmd)
+{
+	BltCommand blt = *cmd;
+	Capture_MapBlt(capture, &blt);
+	if (blt.dest) Capture_AddRecord(capture, OP_BLT, &blt, sizeof(BltCommand));
+}
+
+/**
+  * Records a depth fill.
+  * @param capture
+  *  Pointer to Capture structure
+  * @param cmd
+  *  Blt describing the fill
+  * @param parent
+  *  Texture of the surface the depth buffer is attached to
+  * @param parentlevel
+  *  Mipmap level of the parent surface
+  */
+void Capture_DepthFill(Capture *capture, const BltCommand *cmd, glTexture *parent, GLint parentlevel)
+{
+	CaptureDepthFill record;
+	record.blt = *cmd;
+	Capture_MapBlt(capture, &record.blt);
+	record.parent = Capture_TextureID(capture, parent);
+	record.parentlevel = parentlevel;
+	if (record.blt.dest) Capture_AddRecord(capture, OP_DEPTHFILL, &record, sizeof(CaptureDepthFill));
+}
+
+/**
+  * Records a clear.
+  * @param capture
+  *  Pointer to Capture structure
+  * @param cmd
+  *  Clear being run
+  */
+void Capture_Clear(Capture *capture, const ClearCommand *cmd)
+{
+	ClearCommand clear = *cmd;
+	clear.target = CAPTURE_ID(Capture_TextureID(capture, cmd->target));
+	clear.zbuffer = CAPTURE_ID(Capture_TextureID(capture, cmd->zbuffer));
+	clear.lpRects = CAPTURE_ID(Capture_Blob(capture, cmd->lpRects, cmd->dwCount * sizeof(D3DRECT)));
+	Capture_AddRecord(capture, OP_CLEAR, &clear, sizeof(ClearCommand));
+}
+
+/**
+  * Gets the ID of a vertex buffer, recording its contents if the
+  * application wrote to it since it was last drawn from.
+  * @param capture
+  *  Pointer to Capture structure
+  * @param buffer
+  *  Vertex buffer drawn from
+  * @return
+  *  ID of the vertex buffer, or 0 if it could not be recorded
+  */
+static DWORD Capture_VertexBuffer(Capture *capture, VertexBuffer *buffer)
+{
+	CaptureVertexBuffer record;
+	VertexBuffer **buffers;
+	DWORD max;
+	DWORD i;
+	BOOL added = FALSE;
+	for (i = 0; i < capture->vertexbuffercount; i++)
+		if (capture->vertexbuffers[i] == buffer) break;
+	if (i == capture->vertexbuffercount)
+	{
+		if (capture->vertexbuffercount >= capture->vertexbuffermax)
+		{
+			max = capture->vertexbuffermax ? capture->vertexbuffermax * 2 : 64;
+			buffers = (VertexBuffer**)realloc(capture->vertexbuffers, max * sizeof(VertexBuffer*));
+			if (!buffers)
+			{
+				capture->failed = TRUE;
+				return 0;
+			}
+			capture->vertexbuffers = buffers;
+			capture->vertexbuffermax = max;
+		}
+		capture->vertexbuffers[capture->vertexbuffercount++] = buffer;
+		added = TRUE;
+	}
+	// A buffer allocated where a deleted one was is dirty, so it is recorded again
+	if (buffer->dirty || added)
+	{
+		record.buffer = i + 1;
+		record.size = buffer->size;
+		record.blob = Capture_Blob(capture, buffer->data, buffer->size);
+		record.isstatic = buffer->isstatic;
+		Capture_AddRecord(capture, CAPTURE_VERTEXBUFFER, &record, sizeof(CaptureVertexBuffer));
+	}
+	return i + 1;
+}
+
+/**
+  * Records a draw.
+  * @param capture
+  *  Pointer to Capture structure
+  * @param target
+  *  Textures and mip levels of the render target
+  * @param mode
+  *  OpenGL primitive drawing mode
+  * @param fvf
+  *  Flexible vertex format of the vertices
+  * @param vertices
+  *  Interleaved vertices, pointing into the data of buffer if it is not NULL
+  * @param stride
+  *  Size of a vertex in bytes
+  * @param buffer
+  *  Vertex buffer drawn from, or NULL if drawn from vertices
+  * @param count
+  *  Number of vertices
+  * @param indices
+  *  Vertex indices, or NULL if not indexed
+  * @param indexcount
+  *  Number of vertex indices
+  * @param flags
+  *  Draw flags
+  */
+void Capture_DrawPrimitives(Capture *capture, const RenderTarget *target, GLenum mode, DWORD fvf, const BYTE *vertices,
+	DWORD stride, VertexBuffer *buffer, DWORD count, const WORD *indices, DWORD indexcount, DWORD flags)
+{
+	CaptureDraw record;
+	if (capture->failed) return;
+	record.target = *target;
+	record.target.target = CAPTURE_ID(Capture_TextureID(capture, target->target));
+	record.target.zbuffer = CAPTURE_ID(Capture_TextureID(capture, target->zbuffer));
+	record.mode = mode;
+	record.fvf = fvf;
+	if (buffer)
+	{
+		record.buffer = Capture_VertexBuffer(capture, buffer);
+		record.vertices = (DWORD)(vertices - buffer->data);
+	}
+	else
+	{
+		record.buffer = 0;
+		record.vertices = Capture_Blob(capture, vertices, stride * count);
+	}
+	record.count = count;
+	record.indices = indices ? Capture_Blob(capture, indices, indexcount * sizeof(WORD)) : 0;
+	record.indexcount = indexcount;
+	record.flags = flags;
+	if (!record.target.target || (!record.buffer && !record.vertices)) return;
+	Capture_AddRecord(capture, OP_DRAWPRIMITIVES, &record, sizeof(CaptureDraw));
+}
+
+/**
+  * Records a screen update, which ends a frame of the capture.
+  * @param capture
+  *  Pointer to Capture structure
+  * @param texture
+  *  Texture drawn to the screen
+  * @param paltex
+  *  Palette texture of 8-bit modes
+  * @param vsync
+  *  Vertical sync count
+  * @param previous
+  *  Texture used as the primary before a flip
+  * @param settime
+  *  TRUE to set the last draw time for palette redraw delays
+  */
+void Capture_DrawScreen(Capture *capture, glTexture *texture, glTexture *paltex, GLint vsync, glTexture *previous, BOOL settime)
+{
+	CaptureDrawScreen record;
+	record.texture = Capture_TextureID(capture, texture);
+	record.paltex = Capture_TextureID(capture, paltex);
+	record.vsync = vsync;
+	record.previous = Capture_TextureID(capture, previous);
+	record.settime = settime;
+	if (!record.texture) return;
+	Capture_AddRecord(capture, OP_DRAWSCREEN, &record, sizeof(CaptureDrawScreen));
+	capture->frames++;
+}
+
+/**
+  * Records the setup of Direct3D rendering.
+  * @param capture
+  *  Pointer to Capture structure
+  * @param zbuffer
+  *  Nonzero if a Z buffer is present
+  * @param x,y
+  *  Size of the initial viewport
+  */
+void Capture_InitD3D(Capture *capture, int zbuffer, int x, int y)
+{
+	CaptureInitD3D record;
+	record.zbuffer = zbuffer;
+	record.x = x;
+	record.y = y;
+	Capture_AddRecord(capture, OP_INITD3D, &record, sizeof(CaptureInitD3D));
+}
+
+/**
+  * Records a texture becoming or stopping being part of the primary.
+  * @param capture
+  *  Pointer to Capture structure
+  * @param texture
+  *  Texture that changes
+  * @param parent
+  *  Primary texture
+  * @param primary
+  *  Nonzero if the texture becomes part of the primary
+  */
+void Capture_MakeTexturePrimary(Capture *capture, glTexture *texture, glTexture *parent, DWORD primary)
+{
+	CaptureTexturePrimary record;
+	record.texture = Capture_TextureID(capture, texture);
+	record.parent = Capture_TextureID(capture, parent);
+	record.primary = primary;
+	if (record.texture) Capture_AddRecord(capture, OP_MAKETEXTUREPRIMARY, &record, sizeof(CaptureTexturePrimary));
+}
+
+/**
+  * Records a flush of the OpenGL command stream.
+  * @param capture
+  *  Pointer to Capture structure
+  */
+void Capture_Flush(Capture *capture)
+{
+	Capture_AddRecord(capture, OP_FLUSH, NULL, 0);
+}
+
+/**
+  * Records a command from the command ring.  Overlays, freed pointers and
+  * debugger breaks are not recorded; queued uploads are recorded when the
+  * upload is done.
+  * @param capture
+  *  Pointer to Capture structure
+  * @param cmd
+  *  Command being run
+  */
+void Capture_Command(Capture *capture, const QueueCmd *cmd)
+{
+	QueueCmd copy;
+	DWORD id;
+	switch (cmd->opcode)
+	{
+	case OP_BLT:
+		Capture_Blt(capture, &cmd->args.blt);
+		break;
+	case OP_SETRENDERSTATE:
+	case OP_SETTEXTURESTAGESTATE:
+	case OP_SETTRANSFORM:
+	case OP_SETMATERIAL:
+	case OP_SETLIGHT:
+	case OP_REMOVELIGHT:
+	case OP_SETD3DVIEWPORT:
+	case OP_APPLYSTATEDELTA:
+	case OP_SETGAMMARAMP:
+		Capture_AddRecord(capture, cmd->opcode, &cmd->args, cmd->size - FIELD_OFFSET(QueueCmd, args));
+		break;
+	case OP_SETTEXTURE:
+		copy.args.texture.stage = cmd->args.texture.stage;
+		copy.args.texture.texture = CAPTURE_ID(Capture_TextureID(capture, cmd->args.texture.texture));
+		if (cmd->args.texture.texture && !copy.args.texture.texture) break;
+		Capture_AddRecord(capture, OP_SETTEXTURE, &copy.args, sizeof(copy.args.texture));
+		break;
+	case OP_SETTEXTURECOLORKEY:
+		copy.args.colorkey = cmd->args.colorkey;
+		copy.args.colorkey.texture = CAPTURE_ID(Capture_TextureID(capture, cmd->args.colorkey.texture));
+		if (!copy.args.colorkey.texture) break;
+		Capture_AddRecord(capture, OP_SETTEXTURECOLORKEY, &copy.args, sizeof(copy.args.colorkey));
+		break;
+	case OP_UPDATEPALETTE:
+		copy.args.palette.texture = CAPTURE_ID(Capture_TextureID(capture, cmd->args.palette.texture));
+		copy.args.palette.start = cmd->args.palette.start;
+		copy.args.palette.count = cmd->args.palette.count;
+		memcpy(copy.args.palette.entries, cmd->args.palette.entries, cmd->args.palette.count * sizeof(DWORD));
+		if (!copy.args.palette.texture) break;
+		Capture_AddRecord(capture, OP_UPDATEPALETTE, &copy.args, FIELD_OFFSET(QueueCmd, args.palette.entries) -
+			FIELD_OFFSET(QueueCmd, args) + (cmd->args.palette.count * sizeof(DWORD)));
+		break;
+	case OP_PRELOADTEXTURE:
+		id = Capture_TextureID(capture, (glTexture*)cmd->args.ptr);
+		if (id) Capture_AddRecord(capture, OP_PRELOADTEXTURE, &id, sizeof(DWORD));
+		break;
+	default:
+		break;
+	}
+}
@@ -0,0 +1,238 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#pragma once
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// "DXGC" at the start of a capture file
+#define CAPTURE_MAGIC 0x43475844
+// Changes whenever the layout of a record changes
+#define CAPTURE_VERSION 1
+// Bytes of records held before they are written to the file
+#define CAPTURE_BUFFERSIZE 1048576
+
+// Record types that are not renderer opcodes
+#define CAPTURE_BLOB 0x100  // Data used by later records, numbered from 1 in file order
+#define CAPTURE_TEXTURE 0x101  // CaptureTexture
+#define CAPTURE_UPLOAD 0x102  // CaptureUpload
+#define CAPTURE_LINK 0x103  // CaptureLink
+#define CAPTURE_MODE 0x104  // CaptureMode
+#define CAPTURE_VERTEXBUFFER 0x105  // CaptureVertexBuffer
+
+// Texture ID or blob ID stored in place of a pointer in a renderer structure
+#define CAPTURE_ID(id) ((void*)(DWORD_PTR)(id))
+
+// A capture file is a CaptureHeader followed by records, each a
+// CaptureRecord followed by size bytes.  Commands are recorded as the
+// renderer thread runs them, with the renderer opcode as the type:
+//  OP_BLT: BltCommand
+//  OP_DEPTHFILL: CaptureDepthFill
+//  OP_CLEAR: ClearCommand, lpRects is a blob of D3DRECTs
+//  OP_DRAWPRIMITIVES: CaptureDraw
+//  OP_DRAWSCREEN: CaptureDrawScreen
+//  OP_INITD3D: CaptureInitD3D
+//  OP_MAKETEXTUREPRIMARY: CaptureTexturePrimary
+//  OP_DOWNLOAD: CaptureLevel
+//  OP_DELETETEX, OP_PRELOADTEXTURE: DWORD texture ID
+//  OP_FLUSH: no data
+//  Other state commands: the arguments of the command ring entry
+// Texture pointers in these structures hold texture IDs.  The structures
+// are the renderer's own, so a capture can only be played back by a DXGL
+// build with the same pointer size and structure layout.
+
+typedef struct CaptureHeader
+{
+	DWORD magic;
+	DWORD version;
+	DWORD pointersize;
+	DWORD reserved;
+} CaptureHeader;
+
+typedef struct CaptureRecord
+{
+	DWORD type;
+	DWORD size;
+} CaptureRecord;
+
+// Texture created; IDs count up from 1 and are not reused
+typedef struct CaptureTexture
+{
+	DWORD texture;
+	GLenum target;
+	DDSURFACEDESC2 ddsd;  // Always has a pixel format, so it does not depend on the display mode
+} CaptureTexture;
+
+// Contents of a texture level uploaded from its buffer
+typedef struct CaptureUpload
+{
+	DWORD texture;
+	GLint level;
+	DWORD blob;
+} CaptureUpload;
+
+// Palette and clip stencil of a texture, recorded before a command uses it
+// if they changed
+typedef struct CaptureLink
+{
+	DWORD texture;
+	DWORD palette;
+	DWORD stencil;
+} CaptureLink;
+
+// Display mode set before a primary surface was created
+typedef struct CaptureMode
+{
+	DWORD width;
+	DWORD height;
+	DWORD bpp;
+	DWORD refresh;
+	BOOL fullscreen;
+} CaptureMode;
+
+// Contents of a vertex buffer written by the application
+typedef struct CaptureVertexBuffer
+{
+	DWORD buffer;  // IDs count up from 1
+	DWORD size;
+	DWORD blob;
+	BOOL isstatic;
+} CaptureVertexBuffer;
+
+typedef struct CaptureLevel
+{
+	DWORD texture;
+	GLint level;
+} CaptureLevel;
+
+typedef struct CaptureDepthFill
+{
+	BltCommand blt;
+	DWORD parent;
+	GLint parentlevel;
+} CaptureDepthFill;
+
+typedef struct CaptureDraw
+{
+	RenderTarget target;
+	GLenum mode;
+	DWORD fvf;
+	DWORD buffer;  // Vertex buffer ID, 0 if drawn from the vertices blob
+	DWORD vertices;  // Blob of interleaved vertices, or byte offset into the vertex buffer
+	DWORD count;
+	DWORD indices;  // Blob of 16-bit indices, 0 if not indexed
+	DWORD indexcount;
+	DWORD flags;
+} CaptureDraw;
+
+typedef struct CaptureDrawScreen
+{
+	DWORD texture;
+	DWORD paltex;
+	GLint vsync;
+	DWORD previous;
+	BOOL settime;
+} CaptureDrawScreen;
+
+typedef struct CaptureInitD3D
+{
+	int zbuffer;
+	int x;
+	int y;
+} CaptureInitD3D;
+
+typedef struct CaptureTexturePrimary
+{
+	DWORD texture;
+	DWORD parent;
+	DWORD primary;
+} CaptureTexturePrimary;
+
+// Entry of the blob hash table
+typedef struct CaptureBlob
+{
+	unsigned __int64 hash;
+	DWORD size;
+	DWORD id;  // 0 if the entry is unused
+} CaptureBlob;
+
+// Palette and clip stencil last recorded for a texture
+typedef struct CaptureLinks
+{
+	DWORD palette;
+	DWORD stencil;
+} CaptureLinks;
+
+/** @brief Recorder of the renderer command stream
+  * Commands are written to dxgl-capture.dxc with the texture, vertex and
+  * index data they use.  Identical data is written once and referenced by
+  * its blob ID afterwards.  Must only be used from the renderer thread.
+  */
+typedef struct Capture
+{
+	HANDLE file;
+	BYTE *buffer;
+	DWORD bufferused;
+	BYTE *pending;  // Records of the command being run, written after the uploads it does
+	DWORD pendingused;
+	DWORD pendingmax;
+	CaptureBlob *blobs;  // Hash table of the blobs written
+	DWORD blobmax;
+	DWORD blobcount;
+	CaptureLinks *links;  // Indexed by texture ID
+	DWORD linkmax;
+	DWORD texturecount;
+	VertexBuffer **vertexbuffers;  // Index + 1 is the vertex buffer ID
+	DWORD vertexbuffercount;
+	DWORD vertexbuffermax;
+	CaptureMode mode;
+	DWORD frames;
+	unsigned __int64 written;  // Bytes written to the file
+	unsigned __int64 deduplicated;  // Bytes of blobs not written again
+	BOOL failed;  // Set when a write or allocation failed, nothing more is recorded
+} Capture;
+
+struct QueueCmd;
+
+BOOL Capture_Init(Capture *capture);
+void Capture_Delete(Capture *capture);
+void Capture_EndCommand(Capture *capture);
+void Capture_SetMode(Capture *capture, DWORD width, DWORD height, DWORD bpp, DWORD refresh, BOOL fullscreen);
+void Capture_MakeTexture(Capture *capture, glTexture *texture);
+void Capture_DeleteTexture(Capture *capture, glTexture *texture);
+void Capture_Upload(Capture *capture, glTexture *texture, GLint level);
+void Capture_Download(Capture *capture, glTexture *texture, GLint level);
+void Capture_Blt(Capture *capture, const BltCommand *cmd);
+void Capture_DepthFill(Capture *capture, const BltCommand *cmd, glTexture *parent, GLint parentlevel);
+void Capture_Clear(Capture *capture, const ClearCommand *cmd);
+void Capture_DrawPrimitives(Capture *capture, const RenderTarget *target, GLenum mode, DWORD fvf, const BYTE *vertices,
+	DWORD stride, VertexBuffer *buffer, DWORD count, const WORD *indices, DWORD indexcount, DWORD flags);
+void Capture_DrawScreen(Capture *capture, glTexture *texture, glTexture *paltex, GLint vsync, glTexture *previous, BOOL settime);
+void Capture_InitD3D(Capture *capture, int zbuffer, int x, int y);
+void Capture_MakeTexturePrimary(Capture *capture, glTexture *texture, glTexture *parent, DWORD primary);
+void Capture_Flush(Capture *capture);
+void Capture_Command(Capture *capture, const struct QueueCmd *cmd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_CAPTURE_H
@@ -0,0 +1,320 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+// Built without common.h, the Direct3D 11 headers clash with the DirectDraw
+// headers and need a newer Windows version.
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glad.h>
+#include "include/GL/wglext.h"
+#include "DXGIOutput.h"
+
+// The Windows 10 SDK is needed for the tearing flags, older compilers only
+// get the stubs at the end of the file.
+#if _MSC_VER >= 1900
+#define COBJMACROS
+#include <initguid.h>
+#include <d3d11.h>
+#include <dxgi1_5.h>
+
+struct DXGIOutput
+{
+	HMODULE d3d11;
+	ID3D11Device *device;
+	ID3D11DeviceContext *context;
+	IDXGISwapChain1 *swapchain;
+	ID3D11Texture2D *shared;  // Drawn to by OpenGL, copied to the back buffer
+	HANDLE interop;  // Direct3D device opened for OpenGL
+	HANDLE object;  // shared registered with OpenGL
+	GLuint texture;  // OpenGL name of shared
+	DWORD width;
+	DWORD height;
+	UINT flags;  // Flags the swap chain was created with
+	BOOL tearing;  // Frames without vsync may tear
+	BOOL locked;  // OpenGL owns shared
+	PFNWGLDXOPENDEVICENVPROC wglDXOpenDeviceNV;
+	PFNWGLDXCLOSEDEVICENVPROC wglDXCloseDeviceNV;
+	PFNWGLDXREGISTEROBJECTNVPROC wglDXRegisterObjectNV;
+	PFNWGLDXUNREGISTEROBJECTNVPROC wglDXUnregisterObjectNV;
+	PFNWGLDXLOCKOBJECTSNVPROC wglDXLockObjectsNV;
+	PFNWGLDXUNLOCKOBJECTSNVPROC wglDXUnlockObjectsNV;
+};
+
+/**
+  * Loads the WGL_NV_DX_interop2 entry points for the current context.
+  * @param output
+  *  Pointer to DXGIOutput structure
+  * @return
+  *  TRUE if the driver supports WGL_NV_DX_interop2
+  */
+static BOOL DXGIOutput_LoadInterop(DXGIOutput *output)
+{
+	const char *(APIENTRY *wglGetExtensionsStringARB)(HDC hdc);
+	const char *extensions;
+	wglGetExtensionsStringARB = (const char *(APIENTRY *)(HDC))wglGetProcAddress("wglGetExtensionsStringARB");
+	if (!wglGetExtensionsStringARB) return FALSE;
+	extensions = wglGetExtensionsStringARB(wglGetCurrentDC());
+	if (!extensions || !strstr(extensions, "WGL_NV_DX_interop2")) return FALSE;
+	output->wglDXOpenDeviceNV = (PFNWGLDXOPENDEVICENVPROC)wglGetProcAddress("wglDXOpenDeviceNV");
+	output->wglDXCloseDeviceNV = (PFNWGLDXCLOSEDEVICENVPROC)wglGetProcAddress("wglDXCloseDeviceNV");
+	output->wglDXRegisterObjectNV = (PFNWGLDXREGISTEROBJECTNVPROC)wglGetProcAddress("wglDXRegisterObjectNV");
+	output->wglDXUnregisterObjectNV = (PFNWGLDXUNREGISTEROBJECTNVPROC)wglGetProcAddress("wglDXUnregisterObjectNV");
+	output->wglDXLockObjectsNV = (PFNWGLDXLOCKOBJECTSNVPROC)wglGetProcAddress("wglDXLockObjectsNV");
+	output->wglDXUnlockObjectsNV = (PFNWGLDXUNLOCKOBJECTSNVPROC)wglGetProcAddress("wglDXUnlockObjectsNV");
+	return output->wglDXOpenDeviceNV && output->wglDXCloseDeviceNV && output->wglDXRegisterObjectNV &&
+		output->wglDXUnregisterObjectNV && output->wglDXLockObjectsNV && output->wglDXUnlockObjectsNV;
+}
+
+/**
+  * Creates the swap chain of a window.  Tries the flip discard model of
+  * Windows 10 first and falls back to flip sequential of Windows 8.
+  * @param output
+  *  Pointer to DXGIOutput structure with the device created
+  * @param hWnd
+  *  Window to present to
+  * @return
+  *  TRUE if the swap chain was created
+  */
+static BOOL DXGIOutput_CreateSwapChain(DXGIOutput *output, HWND hWnd)
+{
+	IDXGIDevice *dxgidevice = NULL;
+	IDXGIAdapter *adapter = NULL;
+	IDXGIFactory2 *factory = NULL;
+	IDXGIFactory5 *factory5 = NULL;
+	DXGI_SWAP_CHAIN_DESC1 desc;
+	BOOL allowtearing = FALSE;
+	HRESULT error;
+	if (FAILED(ID3D11Device_QueryInterface(output->device, &IID_IDXGIDevice, (void**)&dxgidevice))) return FALSE;
+	error = IDXGIDevice_GetAdapter(dxgidevice, &adapter);
+	IDXGIDevice_Release(dxgidevice);
+	if (FAILED(error)) return FALSE;
+	error = IDXGIAdapter_GetParent(adapter, &IID_IDXGIFactory2, (void**)&factory);
+	IDXGIAdapter_Release(adapter);
+	if (FAILED(error)) return FALSE;
+	if (SUCCEEDED(IDXGIFactory2_QueryInterface(factory, &IID_IDXGIFactory5, (void**)&factory5)))
+	{
+		if (FAILED(IDXGIFactory5_CheckFeatureSupport(factory5, DXGI_FEATURE_PRESENT_ALLOW_TEARING,
+			&allowtearing, sizeof(BOOL)))) allowtearing = FALSE;
+		IDXGIFactory5_Release(factory5);
+	}
+	output->tearing = allowtearing;
+	output->flags = allowtearing ? DXGI_SWAP_CHAIN_FLAG_ALLOW_TEARING : 0;
+	ZeroMemory(&desc, sizeof(DXGI_SWAP_CHAIN_DESC1));
+	desc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+	desc.SampleDesc.Count = 1;
+	desc.BufferUsage = DXGI_USAGE_RENDER_TARGET_OUTPUT;
+	desc.BufferCount = 2;
+	desc.Scaling = DXGI_SCALING_NONE;
+	desc.SwapEffect = DXGI_SWAP_EFFECT_FLIP_DISCARD;
+	desc.AlphaMode = DXGI_ALPHA_MODE_IGNORE;
+	desc.Flags = output->flags;
+	error = IDXGIFactory2_CreateSwapChainForHwnd(factory, (IUnknown*)output->device, hWnd, &desc,
+		NULL, NULL, &output->swapchain);
+	if (FAILED(error))
+	{
+		desc.SwapEffect = DXGI_SWAP_EFFECT_FLIP_SEQUENTIAL;
+		desc.Flags = output->flags = 0;
+		output->tearing = FALSE;
+		error = IDXGIFactory2_CreateSwapChainForHwnd(factory, (IUnknown*)output->device, hWnd, &desc,
+			NULL, NULL, &output->swapchain);
+	}
+	// DXGL switches between windowed and full screen itself
+	if (SUCCEEDED(error)) IDXGIFactory2_MakeWindowAssociation(factory, hWnd, DXGI_MWA_NO_ALT_ENTER);
+	IDXGIFactory2_Release(factory);
+	return SUCCEEDED(error);
+}
+
+/**
+  * Creates a Direct3D 11 device and a flip model swap chain for a window and
+  * opens the device for OpenGL.  Must be called with the OpenGL context that
+  * draws the frames current.
+  * @param hWnd
+  *  Window to present to
+  * @return
+  *  New DXGIOutput object, or NULL if Direct3D 11 or WGL_NV_DX_interop2 isn't
+  *  available.
+  */
+DXGIOutput *DXGIOutput_Create(HWND hWnd)
+{
+	PFN_D3D11_CREATE_DEVICE pD3D11CreateDevice;
+	DXGIOutput *output = (DXGIOutput*)malloc(sizeof(DXGIOutput));
+	if (!output) return NULL;
+	ZeroMemory(output, sizeof(DXGIOutput));
+	if (!DXGIOutput_LoadInterop(output))
+	{
+		free(output);
+		return NULL;
+	}
+	output->d3d11 = LoadLibraryA("d3d11.dll");
+	if (!output->d3d11)
+	{
+		free(output);
+		return NULL;
+	}
+	pD3D11CreateDevice = (PFN_D3D11_CREATE_DEVICE)GetProcAddress(output->d3d11, "D3D11CreateDevice");
+	if (!pD3D11CreateDevice || FAILED(pD3D11CreateDevice(NULL, D3D_DRIVER_TYPE_HARDWARE, NULL,
+		D3D11_CREATE_DEVICE_BGRA_SUPPORT, NULL, 0, D3D11_SDK_VERSION, &output->device, NULL, &output->context)))
+	{
+		DXGIOutput_Delete(output);
+		return NULL;
+	}
+	if (!DXGIOutput_CreateSwapChain(output, hWnd))
+	{
+		DXGIOutput_Delete(output);
+		return NULL;
+	}
+	output->interop = output->wglDXOpenDeviceNV(output->device);
+	if (!output->interop)
+	{
+		DXGIOutput_Delete(output);
+		return NULL;
+	}
+	return output;
+}
+
+/**
+  * Releases the shared texture and its OpenGL name.
+  * @param output
+  *  Pointer to DXGIOutput structure
+  */
+static void DXGIOutput_ReleaseShared(DXGIOutput *output)
+{
+	if (output->locked) output->wglDXUnlockObjectsNV(output->interop, 1, &output->object);
+	output->locked = FALSE;
+	if (output->object) output->wglDXUnregisterObjectNV(output->interop, output->object);
+	output->object = NULL;
+	if (output->texture) glDeleteTextures(1, &output->texture);
+	output->texture = 0;
+	if (output->shared) ID3D11Texture2D_Release(output->shared);
+	output->shared = NULL;
+	output->width = output->height = 0;
+}
+
+/**
+  * Destroys a DXGIOutput object.  Must be called with the OpenGL context it
+  * was created with current.
+  * @param output
+  *  Pointer to DXGIOutput object
+  */
+void DXGIOutput_Delete(DXGIOutput *output)
+{
+	DXGIOutput_ReleaseShared(output);
+	if (output->interop) output->wglDXCloseDeviceNV(output->interop);
+	if (output->swapchain) IDXGISwapChain1_Release(output->swapchain);
+	if (output->context) ID3D11DeviceContext_Release(output->context);
+	if (output->device) ID3D11Device_Release(output->device);
+	if (output->d3d11) FreeLibrary(output->d3d11);
+	free(output);
+}
+
+/**
+  * Gets the texture to draw the next frame into.  The swap chain and the
+  * shared texture are resized if the size of the frame changed.
+  * @param output
+  *  Pointer to DXGIOutput object
+  * @param width,height
+  *  Size of the frame
+  * @return
+  *  OpenGL name of the texture, with the first row at the top of the window,
+  *  or 0 if the frame can't be presented.
+  */
+GLuint DXGIOutput_BeginFrame(DXGIOutput *output, DWORD width, DWORD height)
+{
+	D3D11_TEXTURE2D_DESC desc;
+	if (!width || !height) return 0;
+	if ((width != output->width) || (height != output->height))
+	{
+		DXGIOutput_ReleaseShared(output);
+		if (FAILED(IDXGISwapChain1_ResizeBuffers(output->swapchain, 0, width, height,
+			DXGI_FORMAT_UNKNOWN, output->flags))) return 0;
+		ZeroMemory(&desc, sizeof(D3D11_TEXTURE2D_DESC));
+		desc.Width = width;
+		desc.Height = height;
+		desc.MipLevels = 1;
+		desc.ArraySize = 1;
+		desc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+		desc.SampleDesc.Count = 1;
+		desc.Usage = D3D11_USAGE_DEFAULT;
+		desc.BindFlags = D3D11_BIND_RENDER_TARGET | D3D11_BIND_SHADER_RESOURCE;
+		if (FAILED(ID3D11Device_CreateTexture2D(output->device, &desc, NULL, &output->shared))) return 0;
+		glGenTextures(1, &output->texture);
+		output->object = output->wglDXRegisterObjectNV(output->interop, output->shared, output->texture,
+			GL_TEXTURE_2D, WGL_ACCESS_WRITE_DISCARD_NV);
+		if (!output->object)
+		{
+			DXGIOutput_ReleaseShared(output);
+			return 0;
+		}
+		output->width = width;
+		output->height = height;
+	}
+	if (!output->wglDXLockObjectsNV(output->interop, 1, &output->object)) return 0;
+	output->locked = TRUE;
+	return output->texture;
+}
+
+/**
+  * Hands the frame drawn since DXGIOutput_BeginFrame back to Direct3D and
+  * presents it.
+  * @param output
+  *  Pointer to DXGIOutput object
+  * @param swap
+  *  Swap interval, negative for adaptive vsync, which presents with vsync
+  * @return
+  *  TRUE if the frame was presented
+  */
+BOOL DXGIOutput_EndFrame(DXGIOutput *output, int swap)
+{
+	ID3D11Texture2D *backbuffer;
+	UINT interval = (swap < 0) ? -swap : swap;
+	UINT flags = 0;
+	if (!output->locked) return FALSE;
+	output->wglDXUnlockObjectsNV(output->interop, 1, &output->object);
+	output->locked = FALSE;
+	if (FAILED(IDXGISwapChain1_GetBuffer(output->swapchain, 0, &IID_ID3D11Texture2D, (void**)&backbuffer)))
+		return FALSE;
+	ID3D11DeviceContext_CopyResource(output->context, (ID3D11Resource*)backbuffer, (ID3D11Resource*)output->shared);
+	ID3D11Texture2D_Release(backbuffer);
+	// Frames without vsync are shown at once, even if the window is flipped independently
+	if (!interval && output->tearing) flags = DXGI_PRESENT_ALLOW_TEARING;
+	return SUCCEEDED(IDXGISwapChain1_Present(output->swapchain, interval, flags));
+}
+
+#else
+
+DXGIOutput *DXGIOutput_Create(HWND hWnd)
+{
+	return NULL;
+}
+
+void DXGIOutput_Delete(DXGIOutput *output)
+{
+}
+
+GLuint DXGIOutput_BeginFrame(DXGIOutput *output, DWORD width, DWORD height)
+{
+	return 0;
+}
+
+BOOL DXGIOutput_EndFrame(DXGIOutput *output, int swap)
+{
+	return FALSE;
+}
+
+#endif
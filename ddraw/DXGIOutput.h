@@ -0,0 +1,42 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#pragma once
+#ifndef _DXGIOUTPUT_H
+#define _DXGIOUTPUT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Shows frames through a Direct3D 11 flip model swap chain on a window.
+   OpenGL writes each frame into a texture shared with Direct3D through
+   WGL_NV_DX_interop2, which is copied to the back buffer and presented.
+   The structure is only defined in DXGIOutput.c so the Direct3D headers
+   aren't needed elsewhere. */
+typedef struct DXGIOutput DXGIOutput;
+
+DXGIOutput *DXGIOutput_Create(HWND hWnd);
+void DXGIOutput_Delete(DXGIOutput *output);
+GLuint DXGIOutput_BeginFrame(DXGIOutput *output, DWORD width, DWORD height);
+BOOL DXGIOutput_EndFrame(DXGIOutput *output, int swap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_DXGIOUTPUT_H
@@ -0,0 +1,120 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#include "common.h"
+#include <dwmapi.h>
+#include "DwmSync.h"
+
+// Frames between checks of the composition state, which can change while running on Windows Vista and 7
+#define DWMSYNC_CHECKFRAMES 60
+
+/**
+  * Loads dwmapi.dll for pacing windowed frames by the desktop compositor.
+  * dwmapi.dll is loaded at run time since it isn't in Windows XP.
+  * @param sync
+  *  Pointer to DwmSync structure to initialize
+  * @return
+  *  TRUE if the compositor can be waited for, FALSE before Windows Vista
+  */
+BOOL DwmSync_Init(DwmSync *sync)
+{
+	ZeroMemory(sync, sizeof(DwmSync));
+	sync->dwmapi = LoadLibrary(_T("dwmapi.dll"));
+	if (!sync->dwmapi) return FALSE;
+	sync->pDwmIsCompositionEnabled = (HRESULT(WINAPI*)(BOOL*))GetProcAddress(sync->dwmapi, "DwmIsCompositionEnabled");
+	sync->pDwmFlush = (HRESULT(WINAPI*)())GetProcAddress(sync->dwmapi, "DwmFlush");
+	sync->pDwmGetCompositionTimingInfo = (HRESULT(WINAPI*)(HWND, DWM_TIMING_INFO*))GetProcAddress(sync->dwmapi,
+		"DwmGetCompositionTimingInfo");
+	if (!sync->pDwmIsCompositionEnabled || !sync->pDwmFlush)
+	{
+		DwmSync_Delete(sync);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+  * Unloads dwmapi.dll.
+  * @param sync
+  *  Pointer to DwmSync structure initialized by DwmSync_Init
+  */
+void DwmSync_Delete(DwmSync *sync)
+{
+	if (sync->dwmapi) FreeLibrary(sync->dwmapi);
+	ZeroMemory(sync, sizeof(DwmSync));
+}
+
+/**
+  * Checks if the desktop compositor is showing the windows, refreshing the
+  * composition state and refresh period every DWMSYNC_CHECKFRAMES calls.
+  * @param sync
+  *  Pointer to DwmSync structure
+  * @return
+  *  TRUE if frames should be paced with DwmSync_Wait
+  */
+BOOL DwmSync_Composited(DwmSync *sync)
+{
+	DWM_TIMING_INFO timing;
+	BOOL enabled = FALSE;
+	if (sync->checkframe)
+	{
+		sync->checkframe--;
+		return sync->composited;
+	}
+	sync->checkframe = DWMSYNC_CHECKFRAMES;
+	sync->composited = SUCCEEDED(sync->pDwmIsCompositionEnabled(&enabled)) && enabled;
+	sync->period = 0;
+	if (sync->composited && sync->pDwmGetCompositionTimingInfo)
+	{
+		ZeroMemory(&timing, sizeof(DWM_TIMING_INFO));
+		timing.cbSize = sizeof(DWM_TIMING_INFO);
+		if (SUCCEEDED(sync->pDwmGetCompositionTimingInfo(NULL, &timing)))
+			sync->period = (LONGLONG)timing.qpcRefreshPeriod;
+	}
+	return sync->composited;
+}
+
+/**
+  * Waits for the compositor to show the frame that was just swapped.  If the
+  * compositor can't be waited for, the wait runs to the next refresh by the
+  * compositor's timing instead.
+  * @param sync
+  *  Pointer to DwmSync structure
+  * @param interval
+  *  Number of compositor refreshes to wait, 0 to not wait
+  */
+void DwmSync_Wait(DwmSync *sync, int interval)
+{
+	DWM_TIMING_INFO timing;
+	LARGE_INTEGER now, frequency;
+	LONGLONG next;
+	int i;
+	for (i = 0; i < interval; i++)
+		if (FAILED(sync->pDwmFlush())) break;
+	if ((i == interval) || !sync->period) return;
+	// Composition was turned off or the desktop switched; check again next frame
+	sync->checkframe = 0;
+	ZeroMemory(&timing, sizeof(DWM_TIMING_INFO));
+	timing.cbSize = sizeof(DWM_TIMING_INFO);
+	if (FAILED(sync->pDwmGetCompositionTimingInfo(NULL, &timing))) return;
+	QueryPerformanceCounter(&now);
+	QueryPerformanceFrequency(&frequency);
+	next = (LONGLONG)timing.qpcVBlank;
+	if (next <= now.QuadPart) next += (((now.QuadPart - next) / sync->period) + 1) * sync->period;
+	next += sync->period * (interval - i - 1);
+	Sleep((DWORD)(((next - now.QuadPart) * 1000) / frequency.QuadPart));
+}
@@ -0,0 +1,52 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#pragma once
+#ifndef _DWMSYNC_H
+#define _DWMSYNC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @brief Windowed vertical sync paced by the desktop compositor
+  * While the compositor is running it shows the window once per refresh, so
+  * a swap interval either does nothing or adds a refresh of latency on top
+  * of the compositor.  Frames are instead swapped without an interval and
+  * followed by DwmFlush, which returns after the compositor's next pass.
+  */
+typedef struct DwmSync
+{
+	HMODULE dwmapi;
+	HRESULT(WINAPI *pDwmIsCompositionEnabled)(BOOL *pfEnabled);
+	HRESULT(WINAPI *pDwmFlush)();
+	HRESULT(WINAPI *pDwmGetCompositionTimingInfo)(HWND hwnd, struct _DWM_TIMING_INFO *pTimingInfo);
+	BOOL composited;  // Composition state when last checked
+	DWORD checkframe;  // Frames until composition is checked again
+	LONGLONG period;  // Compositor refresh period in performance counter ticks, 0 if unknown
+} DwmSync;
+
+BOOL DwmSync_Init(DwmSync *sync);
+void DwmSync_Delete(DwmSync *sync);
+BOOL DwmSync_Composited(DwmSync *sync);
+void DwmSync_Wait(DwmSync *sync, int interval);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_DWMSYNC_H
@@ -0,0 +1,173 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#include "common.h"
+#include "FrameArena.h"
+
+static size_t FrameArena__AlignUp(size_t size)
+{
+	return (size + FRAMEARENA_ALIGN - 1) & ~(size_t)(FRAMEARENA_ALIGN - 1);
+}
+
+// The header is padded so the first allocation of a block is aligned
+#define FRAMEARENA_HEADER FrameArena__AlignUp(sizeof(FrameArenaBlock))
+
+static BYTE *FrameArena__Base(FrameArenaBlock *block)
+{
+	return (BYTE*)block + FRAMEARENA_HEADER;
+}
+
+static FrameArenaBlock *FrameArena__NewBlock(size_t size)
+{
+	FrameArenaBlock *block = (FrameArenaBlock*)malloc(FRAMEARENA_HEADER + size);
+	if (!block) return NULL;
+	block->next = NULL;
+	block->size = size;
+	block->used = 0;
+	return block;
+}
+
+/**
+  * Initializes an empty arena.  No memory is allocated until the first
+  * call to FrameArena_Alloc.
+  * @param arena
+  *  Pointer to arena to initialize
+  * @param blocksize
+  *  Bytes to reserve for the first block
+  */
+void FrameArena_Init(FrameArena *arena, size_t blocksize)
+{
+	ZeroMemory(arena, sizeof(FrameArena));
+	arena->blocksize = FrameArena__AlignUp(blocksize);
+}
+
+/**
+  * Frees all memory held by an arena.  Pointers handed out by the arena
+  * become invalid.
+  * @param arena
+  *  Pointer to arena to delete
+  */
+void FrameArena_Delete(FrameArena *arena)
+{
+	FrameArenaBlock *block = arena->first;
+	FrameArenaBlock *next;
+	char str[128];
+	sprintf(str, "Frame arena: %u KB reserved, peak %u KB, %u frames overflowed\n",
+		(DWORD)(arena->blocksize / 1024), (DWORD)(arena->peak / 1024), arena->overflows);
+	TRACE_STRING(str);
+	while (block)
+	{
+		next = block->next;
+		free(block);
+		block = next;
+	}
+	ZeroMemory(arena, sizeof(FrameArena));
+}
+
+/**
+  * Allocates memory that stays valid until the next FrameArena_Reset.
+  * @param arena
+  *  Pointer to arena to allocate from
+  * @param size
+  *  Bytes to allocate
+  * @return
+  *  Pointer aligned to FRAMEARENA_ALIGN bytes, or NULL if out of memory
+  */
+void *FrameArena_Alloc(FrameArena *arena, size_t size)
+{
+	FrameArenaBlock *block = arena->current;
+	BYTE *ptr;
+	size = FrameArena__AlignUp(size ? size : 1);
+	if (!block || (block->size - block->used < size))
+	{
+		// Continue with the next block kept from an earlier frame if it fits
+		if (block && block->next && (block->next->size >= size)) block = block->next;
+		else
+		{
+			FrameArenaBlock *newblock = FrameArena__NewBlock(max(size, arena->blocksize));
+			if (!newblock) return NULL;
+			if (block)
+			{
+				newblock->next = block->next;
+				block->next = newblock;
+			}
+			else
+			{
+				newblock->next = arena->first;
+				arena->first = newblock;
+			}
+			block = newblock;
+		}
+		block->used = 0;
+		arena->current = block;
+	}
+	ptr = FrameArena__Base(block) + block->used;
+	block->used += size;
+	arena->framepeak += size;
+	return ptr;
+}
+
+/**
+  * Gives back the most recent allocation of an arena so the space can be
+  * reused before the next reset.  Does nothing if ptr was not the most
+  * recent allocation.
+  * @param arena
+  *  Pointer to arena the memory was allocated from
+  * @param ptr
+  *  Pointer returned by the last call to FrameArena_Alloc
+  */
+void FrameArena_Rewind(FrameArena *arena, void *ptr)
+{
+	FrameArenaBlock *block = arena->current;
+	size_t offset;
+	if (!block || !ptr || ((BYTE*)ptr < FrameArena__Base(block))) return;
+	offset = (BYTE*)ptr - FrameArena__Base(block);
+	if (offset >= block->used) return;
+	arena->framepeak -= block->used - offset;
+	block->used = offset;
+}
+
+/**
+  * Discards every allocation made since the last reset.  If the frame
+  * needed more than one block, the blocks are replaced with a single one
+  * big enough for the whole frame, so a steady workload stays in one
+  * block.
+  * @param arena
+  *  Pointer to arena to reset
+  */
+void FrameArena_Reset(FrameArena *arena)
+{
+	FrameArenaBlock *block;
+	FrameArenaBlock *next;
+	if (arena->framepeak > arena->peak) arena->peak = arena->framepeak;
+	if (arena->first && arena->first->next && (arena->current != arena->first))
+	{
+		arena->overflows++;
+		block = arena->first;
+		while (block)
+		{
+			next = block->next;
+			free(block);
+			block = next;
+		}
+		arena->blocksize = FrameArena__AlignUp(arena->framepeak + (arena->framepeak / 4));
+		arena->first = FrameArena__NewBlock(arena->blocksize);
+	}
+	if (arena->first) arena->first->used = 0;
+	arena->current = arena->first;
+	arena->framepeak = 0;
+}
@@ -0,0 +1,59 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#pragma once
+#ifndef _FRAMEARENA_H
+#define _FRAMEARENA_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FRAMEARENA_ALIGN 8  // Matches the alignment of malloc on 32-bit Windows
+
+// Block of arena memory, the usable space follows the header
+typedef struct FrameArenaBlock
+{
+	struct FrameArenaBlock *next;
+	size_t size;  // Usable bytes after the header
+	size_t used;
+} FrameArenaBlock;
+
+// Linear allocator for data that only lives until the end of the frame.
+// Allocations are never freed one by one; FrameArena_Reset discards all
+// of them at once.
+typedef struct FrameArena
+{
+	FrameArenaBlock *first;
+	FrameArenaBlock *current;
+	size_t blocksize;  // Size of the first block, later blocks are at least this big
+	size_t framepeak;  // Bytes allocated since the last reset
+	size_t peak;  // Most bytes allocated in one frame
+	DWORD overflows;  // Frames that needed more than one block
+} FrameArena;
+
+void FrameArena_Init(FrameArena *arena, size_t blocksize);
+void FrameArena_Delete(FrameArena *arena);
+void *FrameArena_Alloc(FrameArena *arena, size_t size);
+void FrameArena_Rewind(FrameArena *arena, void *ptr);
+void FrameArena_Reset(FrameArena *arena);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_FRAMEARENA_H
@@ -0,0 +1,294 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#include "common.h"
+#include "BufferObject.h"
+#include "FrameCapture.h"
+#define STBI_WRITE_NO_STDIO
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+// Frame waiting for a worker thread to write it
+typedef struct FrameCaptureJob
+{
+	BYTE *pixels;  // BGRA rows
+	DWORD width;
+	DWORD height;
+	BOOL flipped;
+	TCHAR screenshot[MAX_PATH + 64];  // Empty if the frame isn't a screenshot
+	TCHAR record[MAX_PATH + 96];  // Empty if the frame isn't recorded
+	volatile LONG *jobs;
+} FrameCaptureJob;
+
+// Set by the window procedure hook, read when the next frame is presented
+static volatile LONG screenshotrequests = 0;
+static volatile LONG recordrequests = 0;
+
+/**
+  * Asks for a screenshot of the next frame.  May be called from any thread.
+  */
+void FrameCapture_RequestScreenshot()
+{
+	InterlockedIncrement(&screenshotrequests);
+}
+
+/**
+  * Starts or stops recording from the next frame.  May be called from any
+  * thread.
+  */
+void FrameCapture_ToggleRecording()
+{
+	InterlockedIncrement(&recordrequests);
+}
+
+static void FrameCapture_WriteFunc(void *context, void *data, int size)
+{
+	DWORD written;
+	WriteFile((HANDLE)context, data, size, &written, NULL);
+}
+
+static void FrameCapture_WriteFile(const TCHAR *filename, const BYTE *rgb, DWORD width, DWORD height, BOOL png)
+{
+	HANDLE file = CreateFile(filename, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return;
+	if (png) stbi_write_png_to_func(FrameCapture_WriteFunc, file, width, height, 3, rgb, width * 3);
+	else stbi_write_tga_to_func(FrameCapture_WriteFunc, file, width, height, 3, rgb);
+	CloseHandle(file);
+}
+
+static DWORD WINAPI FrameCapture_Worker(LPVOID param)
+{
+	FrameCaptureJob *job = (FrameCaptureJob*)param;
+	BYTE *rgb = (BYTE*)malloc(job->width * job->height * 3);
+	const BYTE *src;
+	BYTE *dest;
+	DWORD x, y;
+	if (rgb)
+	{
+		dest = rgb;
+		for (y = 0; y < job->height; y++)
+		{
+			src = job->pixels + ((job->flipped ? job->height - 1 - y : y) * job->width * 4);
+			for (x = 0; x < job->width; x++)
+			{
+				dest[0] = src[2];
+				dest[1] = src[1];
+				dest[2] = src[0];
+				dest += 3;
+				src += 4;
+			}
+		}
+		if (job->screenshot[0]) FrameCapture_WriteFile(job->screenshot, rgb, job->width, job->height, TRUE);
+		if (job->record[0]) FrameCapture_WriteFile(job->record, rgb, job->width, job->height, FALSE);
+		free(rgb);
+	}
+	InterlockedDecrement(job->jobs);
+	free(job->pixels);
+	free(job);
+	return 0;
+}
+
+/**
+  * Writes the current local time to a string for file and folder names.
+  */
+static void FrameCapture_TimeString(TCHAR *str)
+{
+	SYSTEMTIME time;
+	GetLocalTime(&time);
+	_stprintf(str, _T("%04u%02u%02u-%02u%02u%02u-%03u"), time.wYear, time.wMonth, time.wDay,
+		time.wHour, time.wMinute, time.wSecond, time.wMilliseconds);
+}
+
+/**
+  * Initializes frame capture.
+  * @param capture
+  *  Pointer to FrameCapture structure to initialize
+  * @param ext
+  *  Pointer to glExtensions structure of the renderer
+  * @param util
+  *  Pointer to glUtil structure of the renderer
+  * @return
+  *  TRUE if frames can be read back asynchronously
+  */
+BOOL FrameCapture_Init(FrameCapture *capture, glExtensions *ext, glUtil *util)
+{
+	TCHAR *path_truncate;
+	ZeroMemory(capture, sizeof(FrameCapture));
+	if (!ext->GLEXT_ARB_sync) return FALSE;
+	capture->ext = ext;
+	capture->util = util;
+	GetModuleFileName(NULL, capture->path, MAX_PATH);
+	capture->path[MAX_PATH] = 0;
+	path_truncate = _tcsrchr(capture->path, _T('\\'));
+	if (path_truncate) *(path_truncate + 1) = 0;
+	// Requests made before the renderer started are dropped
+	InterlockedExchange(&screenshotrequests, 0);
+	InterlockedExchange(&recordrequests, 0);
+	return TRUE;
+}
+
+/**
+  * Writes the frames still being read back, waits for the worker threads and
+  * frees the pixel buffers.
+  * @param capture
+  *  Pointer to FrameCapture structure
+  */
+void FrameCapture_Delete(FrameCapture *capture)
+{
+	char str[256];
+	int i;
+	FrameCapture_Poll(capture, TRUE);
+	while (capture->jobs) Sleep(1);
+	for (i = 0; i < FRAMECAPTURE_SLOTS; i++)
+		if (capture->slots[i].pbo) BufferObject_Release(capture->slots[i].pbo);
+	sprintf(str, "Frame capture: %u screenshots, %u frames recorded, %u dropped\n",
+		capture->screenshots, capture->recorded, capture->dropped);
+	TRACE_STRING(str);
+}
+
+/**
+  * Picks up the requests made since the last frame.  Called before a frame
+  * is presented.
+  * @param capture
+  *  Pointer to FrameCapture structure
+  * @return
+  *  TRUE if the frame should be read with FrameCapture_Read
+  */
+BOOL FrameCapture_Begin(FrameCapture *capture)
+{
+	TCHAR time[32];
+	if (InterlockedExchange(&recordrequests, 0) & 1)
+	{
+		capture->recording = !capture->recording;
+		if (capture->recording)
+		{
+			FrameCapture_TimeString(time);
+			_stprintf(capture->recordpath, _T("%sdxgl-recording-%s"), capture->path, time);
+			if (!CreateDirectory(capture->recordpath, NULL)) capture->recording = FALSE;
+			capture->frame = 0;
+		}
+	}
+	capture->screenshot = InterlockedExchange(&screenshotrequests, 0) ? TRUE : FALSE;
+	return capture->screenshot || capture->recording;
+}
+
+/**
+  * Starts reading back the frame from the bound read framebuffer.
+  * @param capture
+  *  Pointer to FrameCapture structure
+  * @param width,height
+  *  Size of the frame
+  * @param flipped
+  *  TRUE if the rows of the framebuffer are stored bottom to top
+  */
+void FrameCapture_Read(FrameCapture *capture, DWORD width, DWORD height, BOOL flipped)
+{
+	FrameCaptureSlot *slot = &capture->slots[capture->next];
+	GLint packalign;
+	if (!width || !height) return;
+	// All slots are still waiting for the GPU
+	if (slot->fence)
+	{
+		if (capture->screenshot) FrameCapture_RequestScreenshot();
+		if (capture->recording) capture->dropped++;
+		return;
+	}
+	if (!slot->pbo) BufferObject_Create(&slot->pbo, capture->ext, capture->util);
+	if (!slot->pbo) return;
+	if ((GLsizei)(width * height * 4) > slot->pbo->size)
+		BufferObject_SetData(slot->pbo, GL_PIXEL_PACK_BUFFER, width * height * 4, NULL, GL_STREAM_READ);
+	BufferObject_Bind(slot->pbo, GL_PIXEL_PACK_BUFFER);
+	glGetIntegerv(GL_PACK_ALIGNMENT, &packalign);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glReadPixels(0, 0, width, height, GL_BGRA, GL_UNSIGNED_BYTE, 0);
+	glPixelStorei(GL_PACK_ALIGNMENT, packalign);
+	BufferObject_Unbind(slot->pbo, GL_PIXEL_PACK_BUFFER);
+	slot->fence = capture->ext->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	slot->width = width;
+	slot->height = height;
+	slot->flipped = flipped;
+	slot->screenshot = capture->screenshot;
+	slot->record = capture->recording;
+	slot->frame = capture->frame;
+	if (capture->recording) capture->frame++;
+	capture->next = (capture->next + 1) % FRAMECAPTURE_SLOTS;
+}
+
+/**
+  * Hands the frames the GPU has finished reading back to worker threads.
+  * @param capture
+  *  Pointer to FrameCapture structure
+  * @param wait
+  *  TRUE to wait for all frames being read back
+  */
+void FrameCapture_Poll(FrameCapture *capture, BOOL wait)
+{
+	FrameCaptureSlot *slot;
+	FrameCaptureJob *job;
+	TCHAR time[32];
+	void *data;
+	GLenum status;
+	int i;
+	for (i = 0; i < FRAMECAPTURE_SLOTS; i++)
+	{
+		slot = &capture->slots[i];
+		if (!slot->fence) continue;
+		status = capture->ext->glClientWaitSync(slot->fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+			wait ? GL_TIMEOUT_IGNORED : 0);
+		if ((status != GL_ALREADY_SIGNALED) && (status != GL_CONDITION_SATISFIED)) continue;
+		capture->ext->glDeleteSync(slot->fence);
+		slot->fence = NULL;
+		// Recorded frames are dropped rather than let the workers fall behind
+		if (slot->record && !slot->screenshot && (capture->jobs >= FRAMECAPTURE_MAXJOBS))
+		{
+			capture->dropped++;
+			continue;
+		}
+		job = (FrameCaptureJob*)malloc(sizeof(FrameCaptureJob));
+		if (!job) continue;
+		ZeroMemory(job, sizeof(FrameCaptureJob));
+		job->pixels = (BYTE*)malloc(slot->width * slot->height * 4);
+		data = BufferObject_Map(slot->pbo, GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+		if (!job->pixels || !data)
+		{
+			if (data) BufferObject_Unmap(slot->pbo, GL_PIXEL_PACK_BUFFER);
+			free(job->pixels);
+			free(job);
+			continue;
+		}
+		memcpy(job->pixels, data, slot->width * slot->height * 4);
+		BufferObject_Unmap(slot->pbo, GL_PIXEL_PACK_BUFFER);
+		job->width = slot->width;
+		job->height = slot->height;
+		job->flipped = slot->flipped;
+		job->jobs = &capture->jobs;
+		if (slot->screenshot)
+		{
+			FrameCapture_TimeString(time);
+			_stprintf(job->screenshot, _T("%sdxgl-screenshot-%s.png"), capture->path, time);
+			capture->screenshots++;
+		}
+		if (slot->record)
+		{
+			_stprintf(job->record, _T("%s\\frame%06u.tga"), capture->recordpath, slot->frame);
+			capture->recorded++;
+		}
+		InterlockedIncrement(&capture->jobs);
+		if (!QueueUserWorkItem(FrameCapture_Worker, job, WT_EXECUTELONGFUNCTION))
+			FrameCapture_Worker(job);
+	}
+}
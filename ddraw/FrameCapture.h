@@ -0,0 +1,79 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#pragma once
+#ifndef _FRAMECAPTURE_H
+#define _FRAMECAPTURE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Frames read back at once, each is mapped once its fence signals
+#define FRAMECAPTURE_SLOTS 3
+// Frames waiting to be encoded before recorded frames are dropped
+#define FRAMECAPTURE_MAXJOBS 8
+
+typedef struct FrameCaptureSlot
+{
+	struct BufferObject *pbo;
+	GLsync fence;  // NULL if the slot is free
+	DWORD width;
+	DWORD height;
+	BOOL flipped;  // Rows were read bottom to top
+	BOOL screenshot;
+	BOOL record;
+	DWORD frame;  // Number of the recorded frame
+} FrameCaptureSlot;
+
+/** @brief Screenshots and recordings taken from the present path
+  * Frames are read into a ring of pixel buffers and handed to the system
+  * thread pool to be written once the GPU is done, so capturing doesn't wait
+  * for the readback.  Screenshots are written as PNG files and recordings as
+  * numbered TGA files in a folder of their own, next to the executable.
+  */
+typedef struct FrameCapture
+{
+	glExtensions *ext;
+	struct glUtil *util;
+	FrameCaptureSlot slots[FRAMECAPTURE_SLOTS];
+	int next;
+	BOOL screenshot;  // Screenshot requested for the frame being presented
+	BOOL recording;
+	DWORD frame;
+	TCHAR path[MAX_PATH + 1];  // Directory of the executable
+	TCHAR recordpath[MAX_PATH + 64];  // Folder of the current recording
+	volatile LONG jobs;  // Frames being written
+	// Statistics, written to the trace log when the capture is deleted
+	DWORD screenshots;
+	DWORD recorded;
+	DWORD dropped;
+} FrameCapture;
+
+void FrameCapture_RequestScreenshot();
+void FrameCapture_ToggleRecording();
+BOOL FrameCapture_Init(FrameCapture *capture, glExtensions *ext, struct glUtil *util);
+void FrameCapture_Delete(FrameCapture *capture);
+BOOL FrameCapture_Begin(FrameCapture *capture);
+void FrameCapture_Read(FrameCapture *capture, DWORD width, DWORD height, BOOL flipped);
+void FrameCapture_Poll(FrameCapture *capture, BOOL wait);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_FRAMECAPTURE_H
@@ -0,0 +1,216 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#include "common.h"
+#include "LatencyMeter.h"
+
+// Input of the next frame: 0 if none was read since the last present, 1 while
+// inputtime is being written, 2 once it is set and 3 while it is being taken
+static volatile LONG inputstate = 0;
+static LONGLONG inputtime = 0;
+
+/**
+  * Marks the time the application read input, if none was read since the
+  * last present.  Called by the cursor and window hooks from any thread.
+  */
+void LatencyMeter_MarkInput()
+{
+	LARGE_INTEGER counter;
+	if (!dxglcfg.DebugLatency) return;
+	if (InterlockedCompareExchange(&inputstate, 1, 0) != 0) return;
+	QueryPerformanceCounter(&counter);
+	inputtime = counter.QuadPart;
+	InterlockedExchange(&inputstate, 2);
+}
+
+/**
+  * Opens dxgl-latency.csv in the directory of the executable and starts
+  * measuring.  Must be called from the thread that owns the OpenGL context.
+  * @param meter
+  *  Pointer to LatencyMeter structure to initialize
+  * @param ext
+  *  OpenGL extensions of the context
+  * @return
+  *  TRUE if fences are available and the file was created
+  */
+BOOL LatencyMeter_Init(LatencyMeter *meter, glExtensions *ext)
+{
+	static const char header[] = "Frame,Input to present (ms),Input to swap (ms),Input to GPU (ms)\r\n";
+	TCHAR path[MAX_PATH + 1];
+	TCHAR *path_truncate;
+	LARGE_INTEGER counter;
+	DWORD written;
+	int i;
+	ZeroMemory(meter, sizeof(LatencyMeter));
+	if (!ext->GLEXT_ARB_sync) return FALSE;
+	GetModuleFileName(NULL, path, MAX_PATH);
+	path[MAX_PATH] = 0;
+	path_truncate = _tcsrchr(path, _T('\\'));
+	if (path_truncate) *(path_truncate + 1) = 0;
+	_tcscat(path, _T("dxgl-latency.csv"));
+	meter->file = CreateFile(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (meter->file == INVALID_HANDLE_VALUE) return FALSE;
+	WriteFile(meter->file, header, sizeof(header) - 1, &written, NULL);
+	meter->ext = ext;
+	QueryPerformanceFrequency(&counter);
+	meter->frequency = counter.QuadPart;
+	if (ext->GLEXT_ARB_timer_query)
+	{
+		for (i = 0; i < LATENCYMETER_FRAMES; i++)
+			ext->glGenQueries(1, &meter->frames[i].query);
+		glGetInteger64v(GL_TIMESTAMP, &meter->gpustart);
+	}
+	QueryPerformanceCounter(&counter);
+	meter->cpustart = counter.QuadPart;
+	// Input read before the renderer started belongs to no frame
+	InterlockedExchange(&inputstate, 0);
+	return TRUE;
+}
+
+/**
+  * Waits for the frames in flight, writes the statistics to the trace log and
+  * closes the file.  Must be called from the thread that owns the OpenGL
+  * context.
+  * @param meter
+  *  Pointer to LatencyMeter structure
+  */
+void LatencyMeter_Delete(LatencyMeter *meter)
+{
+	char str[256];
+	int i;
+	LatencyMeter_Poll(meter, TRUE);
+	for (i = 0; i < LATENCYMETER_FRAMES; i++)
+		if (meter->frames[i].query) meter->ext->glDeleteQueries(1, &meter->frames[i].query);
+	CloseHandle(meter->file);
+	if (!meter->count) return;
+	sprintf(str, "Input latency over %u frames (%u not measured): present %.2f ms (max %.2f), swap %.2f ms "
+		"(max %.2f), GPU %.2f ms (max %.2f)\n", meter->count, meter->dropped,
+		meter->total[LATENCYMETER_PRESENT] / (double)meter->count, meter->max[LATENCYMETER_PRESENT],
+		meter->total[LATENCYMETER_SWAP] / (double)meter->count, meter->max[LATENCYMETER_SWAP],
+		meter->total[LATENCYMETER_GPU] / (double)meter->count, meter->max[LATENCYMETER_GPU]);
+	TRACE_STRING(str);
+}
+
+/**
+  * Marks the time the application presented a frame and takes the input read
+  * for it.  Called by the thread calling the renderer, before the frame is
+  * handed to the renderer thread.
+  * @param meter
+  *  Pointer to LatencyMeter structure
+  */
+void LatencyMeter_Present(LatencyMeter *meter)
+{
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	meter->present = counter.QuadPart;
+	if (InterlockedCompareExchange(&inputstate, 3, 2) == 2)
+	{
+		meter->input = inputtime;
+		InterlockedExchange(&inputstate, 0);
+	}
+	else meter->input = 0;
+}
+
+/**
+  * Ends the measurement of a frame on the CPU and places a fence after it.
+  * Called by the renderer thread after SwapBuffers returns.  Frames the
+  * application didn't present, or read no input for, are not measured.
+  * @param meter
+  *  Pointer to LatencyMeter structure
+  * @param frame
+  *  Number of the frame
+  */
+void LatencyMeter_EndFrame(LatencyMeter *meter, DWORD frame)
+{
+	LatencyMeterFrame *slot;
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	LatencyMeter_Poll(meter, FALSE);
+	if (!meter->present || !meter->input)
+	{
+		meter->present = 0;
+		return;
+	}
+	slot = &meter->frames[meter->write];
+	if (slot->fence) meter->dropped++;
+	else
+	{
+		slot->frame = frame;
+		slot->input = meter->input;
+		slot->present = meter->present;
+		slot->swap = counter.QuadPart;
+		if (slot->query) glQueryCounter(slot->query, GL_TIMESTAMP);
+		slot->fence = meter->ext->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		meter->write = (meter->write + 1) % LATENCYMETER_FRAMES;
+	}
+	meter->present = 0;
+	meter->input = 0;
+}
+
+/**
+  * Adds the frames the GPU has finished to the file and the statistics.
+  * @param meter
+  *  Pointer to LatencyMeter structure
+  * @param wait
+  *  TRUE to wait for all frames in flight
+  */
+void LatencyMeter_Poll(LatencyMeter *meter, BOOL wait)
+{
+	LatencyMeterFrame *slot;
+	LARGE_INTEGER counter;
+	GLuint64 timestamp;
+	LONGLONG done;
+	GLenum status;
+	double span[LATENCYMETER_SPANS];
+	char line[128];
+	int length;
+	DWORD written;
+	int i;
+	while (meter->frames[meter->read].fence)
+	{
+		slot = &meter->frames[meter->read];
+		status = meter->ext->glClientWaitSync(slot->fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+			wait ? GL_TIMEOUT_IGNORED : 0);
+		if ((status != GL_ALREADY_SIGNALED) && (status != GL_CONDITION_SATISFIED)) break;
+		QueryPerformanceCounter(&counter);
+		meter->ext->glDeleteSync(slot->fence);
+		slot->fence = NULL;
+		meter->read = (meter->read + 1) % LATENCYMETER_FRAMES;
+		done = counter.QuadPart;
+		if (slot->query)
+		{
+			// The timestamp is ready once the fence after it has signaled
+			meter->ext->glGetQueryObjectui64v(slot->query, GL_QUERY_RESULT, &timestamp);
+			done = meter->cpustart + (LONGLONG)((double)((GLint64)timestamp - meter->gpustart)
+				* (double)meter->frequency / 1000000000.0);
+			if (done < slot->swap) done = slot->swap;
+		}
+		span[LATENCYMETER_PRESENT] = (double)(slot->present - slot->input) * 1000.0 / (double)meter->frequency;
+		span[LATENCYMETER_SWAP] = (double)(slot->swap - slot->input) * 1000.0 / (double)meter->frequency;
+		span[LATENCYMETER_GPU] = (double)(done - slot->input) * 1000.0 / (double)meter->frequency;
+		for (i = 0; i < LATENCYMETER_SPANS; i++)
+		{
+			meter->total[i] += span[i];
+			if (span[i] > meter->max[i]) meter->max[i] = span[i];
+		}
+		meter->count++;
+		meter->last = (DWORD)(span[LATENCYMETER_GPU] * 1000.0);
+		length = _snprintf(line, 127, "%u,%.3f,%.3f,%.3f\r\n", slot->frame, span[LATENCYMETER_PRESENT],
+			span[LATENCYMETER_SWAP], span[LATENCYMETER_GPU]);
+		if (length > 0) WriteFile(meter->file, line, length, &written, NULL);
+	}
+}
@@ -0,0 +1,84 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#pragma once
+#ifndef _LATENCYMETER_H
+#define _LATENCYMETER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Presented frames whose GPU work may be in flight at once
+#define LATENCYMETER_FRAMES 8
+
+// Spans measured from the input of a frame
+#define LATENCYMETER_PRESENT 0  // To Flip or Blt to the primary
+#define LATENCYMETER_SWAP 1  // To the return of SwapBuffers
+#define LATENCYMETER_GPU 2  // To the GPU finishing the frame
+#define LATENCYMETER_SPANS 3
+
+typedef struct LatencyMeterFrame
+{
+	GLsync fence;  // NULL if the slot is free
+	GLuint query;  // GL_TIMESTAMP after the frame, 0 without GL_ARB_timer_query
+	DWORD frame;
+	LONGLONG input;  // Performance counter when the input of the frame was read
+	LONGLONG present;  // When the application presented the frame
+	LONGLONG swap;  // When SwapBuffers returned
+} LatencyMeterFrame;
+
+/** @brief Input-to-screen latency of presented frames
+  * Input is timestamped by the cursor and window hooks, presents by the
+  * calling thread and swaps by the renderer thread.  A fence after each swap
+  * tells when the GPU finished the frame; with GL_ARB_timer_query the time is
+  * taken from a GPU timestamp, otherwise it is the time the fence was first
+  * seen signaled.  Each frame is written to dxgl-latency.csv.
+  */
+typedef struct LatencyMeter
+{
+	glExtensions *ext;
+	LatencyMeterFrame frames[LATENCYMETER_FRAMES];
+	DWORD read;  // Oldest frame in flight
+	DWORD write;  // Next free slot
+	LONGLONG frequency;
+	LONGLONG cpustart;  // Performance counter at gpustart
+	GLint64 gpustart;  // GL_TIMESTAMP when the meter was started
+	// Set by LatencyMeter_Present and taken by LatencyMeter_EndFrame
+	LONGLONG input;
+	LONGLONG present;
+	HANDLE file;
+	DWORD last;  // Input to GPU latency of the last finished frame, in microseconds
+	// Statistics, written to the trace log when the meter is deleted
+	DWORD count;
+	DWORD dropped;  // Presented frames not measured because all slots were in flight
+	double total[LATENCYMETER_SPANS];  // Milliseconds
+	double max[LATENCYMETER_SPANS];
+} LatencyMeter;
+
+void LatencyMeter_MarkInput();
+BOOL LatencyMeter_Init(LatencyMeter *meter, glExtensions *ext);
+void LatencyMeter_Delete(LatencyMeter *meter);
+void LatencyMeter_Present(LatencyMeter *meter);
+void LatencyMeter_EndFrame(LatencyMeter *meter, DWORD frame);
+void LatencyMeter_Poll(LatencyMeter *meter, BOOL wait);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_LATENCYMETER_H
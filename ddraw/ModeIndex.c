@@ -0,0 +1,362 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#include "common.h"
+#include "ModeIndex.h"
+#include "util.h"
+
+static DRIVERMODES drivermodes;
+static DWORD drivermodeslock = 0;
+
+static DWORD ModeIndex_Hash(DWORD width, DWORD height, DWORD bpp, DWORD frequency)
+{
+	unsigned __int64 hash = ((unsigned __int64)width << 32) | height;
+	hash = (hash ^ ((unsigned __int64)bpp << 48) ^ ((unsigned __int64)frequency << 16)) * 0x9E3779B97F4A7C15ULL;
+	return (DWORD)(hash >> 32);
+}
+
+/**
+  * Finds the slot of a mode in a hash table, or the empty slot it would go in.
+  */
+static MODEINDEXENTRY *ModeIndex_Slot(MODEINDEXENTRY *table, DWORD hashmask,
+	DWORD width, DWORD height, DWORD bpp, DWORD frequency)
+{
+	DWORD slot = ModeIndex_Hash(width, height, bpp, frequency) & hashmask;
+	while (table[slot].bpp)
+	{
+		if ((table[slot].width == width) && (table[slot].height == height) &&
+			(table[slot].bpp == bpp) && (table[slot].frequency == frequency)) break;
+		slot = (slot + 1) & hashmask;
+	}
+	return &table[slot];
+}
+
+/**
+  * Doubles the size of the hash tables so at least one more mode fits.
+  * @param index
+  *  Pointer to MODEINDEX structure
+  * @return
+  *  TRUE if there is room for another mode, FALSE if out of memory.
+  */
+static BOOL ModeIndex_Grow(MODEINDEX *index)
+{
+	MODEINDEXENTRY *exact;
+	MODEINDEXENTRY *norefresh;
+	DWORD hashmask;
+	DWORD i;
+	if ((index->count * 2) <= index->hashmask) return TRUE;
+	hashmask = (index->hashmask * 2) + 1;
+	exact = (MODEINDEXENTRY*)malloc((hashmask + 1) * sizeof(MODEINDEXENTRY));
+	if (!exact) return FALSE;
+	norefresh = (MODEINDEXENTRY*)malloc((hashmask + 1) * sizeof(MODEINDEXENTRY));
+	if (!norefresh)
+	{
+		free(exact);
+		return FALSE;
+	}
+	ZeroMemory(exact, (hashmask + 1) * sizeof(MODEINDEXENTRY));
+	ZeroMemory(norefresh, (hashmask + 1) * sizeof(MODEINDEXENTRY));
+	for (i = 0; i <= index->hashmask; i++)
+	{
+		if (index->exact[i].bpp)
+			*ModeIndex_Slot(exact, hashmask, index->exact[i].width, index->exact[i].height,
+				index->exact[i].bpp, index->exact[i].frequency) = index->exact[i];
+		if (index->norefresh[i].bpp)
+			*ModeIndex_Slot(norefresh, hashmask, index->norefresh[i].width, index->norefresh[i].height,
+				index->norefresh[i].bpp, 0) = index->norefresh[i];
+	}
+	free(index->exact);
+	free(index->norefresh);
+	index->exact = exact;
+	index->norefresh = norefresh;
+	index->hashmask = hashmask;
+	return TRUE;
+}
+
+/**
+  * Initializes an empty display mode index.
+  * @param index
+  *  Pointer to MODEINDEX structure to initialize
+  * @param capacity
+  *  Number of modes expected, the index grows if more are inserted
+  * @return
+  *  TRUE if the index was initialized, FALSE if out of memory.
+  */
+BOOL ModeIndex_Init(MODEINDEX *index, DWORD capacity)
+{
+	DWORD size = 64;
+	ZeroMemory(index, sizeof(MODEINDEX));
+	while (size < (capacity * 2)) size *= 2;
+	index->exact = (MODEINDEXENTRY*)malloc(size * sizeof(MODEINDEXENTRY));
+	index->norefresh = (MODEINDEXENTRY*)malloc(size * sizeof(MODEINDEXENTRY));
+	if (!index->exact || !index->norefresh)
+	{
+		ModeIndex_Delete(index);
+		return FALSE;
+	}
+	ZeroMemory(index->exact, size * sizeof(MODEINDEXENTRY));
+	ZeroMemory(index->norefresh, size * sizeof(MODEINDEXENTRY));
+	index->hashmask = size - 1;
+	return TRUE;
+}
+
+/**
+  * Frees the hash tables of a display mode index.
+  * @param index
+  *  Pointer to MODEINDEX structure
+  */
+void ModeIndex_Delete(MODEINDEX *index)
+{
+	if (index->exact) free(index->exact);
+	if (index->norefresh) free(index->norefresh);
+	ZeroMemory(index, sizeof(MODEINDEX));
+}
+
+/**
+  * Adds a display mode to an index.
+  * @param index
+  *  Pointer to MODEINDEX structure
+  * @param mode
+  *  Mode to add
+  * @return
+  *  TRUE if the mode was added, FALSE if it was already in the index or
+  *  out of memory.
+  */
+BOOL ModeIndex_Insert(MODEINDEX *index, const DEVMODE *mode)
+{
+	MODEINDEXENTRY *entry;
+	if (!index->exact || !mode->dmBitsPerPel || !ModeIndex_Grow(index)) return FALSE;
+	entry = ModeIndex_Slot(index->exact, index->hashmask, mode->dmPelsWidth, mode->dmPelsHeight,
+		mode->dmBitsPerPel, mode->dmDisplayFrequency);
+	if (entry->bpp) return FALSE;
+	entry->width = mode->dmPelsWidth;
+	entry->height = mode->dmPelsHeight;
+	entry->bpp = mode->dmBitsPerPel;
+	entry->frequency = mode->dmDisplayFrequency;
+	index->count++;
+	entry = ModeIndex_Slot(index->norefresh, index->hashmask, mode->dmPelsWidth, mode->dmPelsHeight,
+		mode->dmBitsPerPel, 0);
+	if (!entry->bpp)
+	{
+		entry->width = mode->dmPelsWidth;
+		entry->height = mode->dmPelsHeight;
+		entry->bpp = mode->dmBitsPerPel;
+		entry->frequency = 0;
+		index->norefreshcount++;
+	}
+	if (mode->dmBitsPerPel < 64) index->bpps |= 1ULL << mode->dmBitsPerPel;
+	return TRUE;
+}
+
+/**
+  * Checks if a display mode with the same size, bpp and refresh rate is in
+  * an index.
+  * @param index
+  *  Pointer to MODEINDEX structure
+  * @param mode
+  *  Mode to look up
+  */
+BOOL ModeIndex_Find(const MODEINDEX *index, const DEVMODE *mode)
+{
+	if (!index->exact || !mode->dmBitsPerPel) return FALSE;
+	return ModeIndex_Slot(index->exact, index->hashmask, mode->dmPelsWidth, mode->dmPelsHeight,
+		mode->dmBitsPerPel, mode->dmDisplayFrequency)->bpp != 0;
+}
+
+/**
+  * Checks if a display mode with the same size and bpp is in an index, at
+  * any refresh rate.
+  * @param index
+  *  Pointer to MODEINDEX structure
+  * @param mode
+  *  Mode to look up
+  */
+BOOL ModeIndex_FindNoRefresh(const MODEINDEX *index, const DEVMODE *mode)
+{
+	if (!index->norefresh || !mode->dmBitsPerPel) return FALSE;
+	return ModeIndex_Slot(index->norefresh, index->hashmask, mode->dmPelsWidth, mode->dmPelsHeight,
+		mode->dmBitsPerPel, 0)->bpp != 0;
+}
+
+/**
+  * Checks if any display mode in an index has the given bits per pixel.
+  * @param index
+  *  Pointer to MODEINDEX structure
+  * @param bpp
+  *  Bits per pixel to look for
+  */
+BOOL ModeIndex_HasBPP(const MODEINDEX *index, DWORD bpp)
+{
+	if (bpp >= 64) return FALSE;
+	return (index->bpps & (1ULL << bpp)) != 0;
+}
+
+static unsigned __int64 ModeIndex_SortKey(const DEVMODE *mode)
+{
+	return (mode->dmDisplayFrequency & 0xFFFF) |
+		((unsigned __int64)(mode->dmPelsWidth & 0xFFFF) << 32) |
+		((unsigned __int64)(mode->dmPelsHeight & 0xFFFF) << 48) |
+		((unsigned __int64)(mode->dmBitsPerPel & 0xFFFF) << 16);
+}
+
+static int __cdecl ModeIndex_Compare(const void *mode1, const void *mode2)
+{
+	unsigned __int64 key1 = ModeIndex_SortKey((const DEVMODE*)mode1);
+	unsigned __int64 key2 = ModeIndex_SortKey((const DEVMODE*)mode2);
+	if (key1 < key2) return -1;
+	else if (key1 > key2) return 1;
+	else return 0;
+}
+
+static void ModeIndex_GetMonitor(char *monitor)
+{
+	DISPLAY_DEVICEA dev;
+	DISPLAY_DEVICEA mon;
+	DWORD i;
+	monitor[0] = 0;
+	ZeroMemory(&dev, sizeof(DISPLAY_DEVICEA));
+	dev.cb = sizeof(DISPLAY_DEVICEA);
+	for (i = 0; EnumDisplayDevicesA(NULL, i, &dev, 0); i++)
+		if (dev.StateFlags & DISPLAY_DEVICE_PRIMARY_DEVICE) break;
+	if (!(dev.StateFlags & DISPLAY_DEVICE_PRIMARY_DEVICE)) return;
+	ZeroMemory(&mon, sizeof(DISPLAY_DEVICEA));
+	mon.cb = sizeof(DISPLAY_DEVICEA);
+	if (EnumDisplayDevicesA(dev.DeviceName, 0, &mon, 0))
+	{
+		strncpy(monitor, mon.DeviceID, 127);
+		monitor[127] = 0;
+	}
+}
+
+static void ModeIndex_FreeDriverModes()
+{
+	if (drivermodes.modes) free(drivermodes.modes);
+	if (drivermodes.sorted) free(drivermodes.sorted);
+	ModeIndex_Delete(&drivermodes.index);
+	ZeroMemory(&drivermodes, sizeof(DRIVERMODES));
+}
+
+/**
+  * Enumerates the modes of the display driver into the shared list.
+  * @return
+  *  TRUE if the list was built, FALSE if out of memory.
+  */
+static BOOL ModeIndex_BuildDriverModes()
+{
+	DEVMODE mode;
+	DEVMODE *tmp;
+	DWORD modemax = 128;
+	DWORD i;
+	ModeIndex_FreeDriverModes();
+	ModeIndex_GetMonitor(drivermodes.monitor);
+	drivermodes.modes = (DEVMODE*)malloc(modemax * sizeof(DEVMODE));
+	if (!drivermodes.modes || !ModeIndex_Init(&drivermodes.index, modemax))
+	{
+		ModeIndex_FreeDriverModes();
+		return FALSE;
+	}
+	ZeroMemory(&mode, sizeof(DEVMODE));
+	mode.dmSize = sizeof(DEVMODE);
+	for (i = 0; EnumDisplaySettings(NULL, i, &mode); i++)
+	{
+		if (!ModeIndex_Insert(&drivermodes.index, &mode)) continue;
+		if (drivermodes.count >= modemax)
+		{
+			modemax += 128;
+			tmp = (DEVMODE*)realloc(drivermodes.modes, modemax * sizeof(DEVMODE));
+			if (!tmp)
+			{
+				ModeIndex_FreeDriverModes();
+				return FALSE;
+			}
+			drivermodes.modes = tmp;
+		}
+		drivermodes.modes[drivermodes.count++] = mode;
+	}
+	drivermodes.sorted = (DEVMODE*)malloc((drivermodes.count ? drivermodes.count : 1) * sizeof(DEVMODE));
+	if (!drivermodes.sorted)
+	{
+		ModeIndex_FreeDriverModes();
+		return FALSE;
+	}
+	memcpy(drivermodes.sorted, drivermodes.modes, drivermodes.count * sizeof(DEVMODE));
+	qsort(drivermodes.sorted, drivermodes.count, sizeof(DEVMODE), ModeIndex_Compare);
+	return TRUE;
+}
+
+/**
+  * Gets the modes of the display driver for the primary adapter.  The list
+  * is enumerated once and kept until a different monitor is attached.  The
+  * list stays locked until ModeIndex_ReleaseDriverModes is called, even if
+  * this function fails.
+  * @return
+  *  Pointer to the mode list, or NULL if out of memory.
+  */
+const DRIVERMODES *ModeIndex_GetDriverModes()
+{
+	char monitor[128];
+	EnterSpinlock(&drivermodeslock);
+	ModeIndex_GetMonitor(monitor);
+	if (drivermodes.modes && !strcmp(monitor, drivermodes.monitor)) return &drivermodes;
+	if (!ModeIndex_BuildDriverModes()) return NULL;
+	return &drivermodes;
+}
+
+/**
+  * Unlocks the list returned by ModeIndex_GetDriverModes.
+  */
+void ModeIndex_ReleaseDriverModes()
+{
+	ExitSpinlock(&drivermodeslock);
+}
+
+/**
+  * Finds the smallest driver mode with the same bits per pixel that is at
+  * least as large as the requested mode.
+  * @param list
+  *  Pointer to the list returned by ModeIndex_GetDriverModes
+  * @param in
+  *  Requested mode
+  * @param out
+  *  Pointer to receive the closest mode
+  * @return
+  *  TRUE if a mode was found, FALSE if no mode is large enough.
+  */
+BOOL ModeIndex_FindClosest(const DRIVERMODES *list, const DEVMODE *in, DEVMODE *out)
+{
+	DWORD low = 0;
+	DWORD high = list->count;
+	DWORD mid;
+	DWORD i;
+	// Modes are sorted by height first, so skip the shorter ones
+	while (low < high)
+	{
+		mid = (low + high) / 2;
+		if (list->sorted[mid].dmPelsHeight < in->dmPelsHeight) low = mid + 1;
+		else high = mid;
+	}
+	for (i = low; i < list->count; i++)
+	{
+		if ((list->sorted[i].dmBitsPerPel == in->dmBitsPerPel) &&
+			(list->sorted[i].dmPelsWidth >= in->dmPelsWidth))
+		{
+			*out = list->sorted[i];
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
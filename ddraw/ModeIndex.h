@@ -0,0 +1,71 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#pragma once
+#ifndef _MODEINDEX_H
+#define _MODEINDEX_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Hash table slot, bpp is 0 if the slot is empty
+typedef struct MODEINDEXENTRY
+{
+	DWORD width;
+	DWORD height;
+	DWORD bpp;
+	DWORD frequency;
+} MODEINDEXENTRY;
+
+// Set of display modes with hashed lookup by (width, height, bpp, refresh)
+// and by (width, height, bpp) with any refresh rate
+typedef struct MODEINDEX
+{
+	MODEINDEXENTRY *exact;
+	MODEINDEXENTRY *norefresh;
+	DWORD hashmask;
+	DWORD count;
+	DWORD norefreshcount;
+	unsigned __int64 bpps;  // Bit n is set if a mode with n bits per pixel is present
+} MODEINDEX;
+
+// Sorted list of the modes reported by the display driver for one adapter
+typedef struct DRIVERMODES
+{
+	DEVMODE *modes;  // In the order reported by the driver, without duplicates
+	DEVMODE *sorted;  // Sorted by height, width, bpp and refresh rate
+	DWORD count;
+	MODEINDEX index;
+	char monitor[128];  // Device ID of the monitor the list was built for
+} DRIVERMODES;
+
+BOOL ModeIndex_Init(MODEINDEX *index, DWORD capacity);
+void ModeIndex_Delete(MODEINDEX *index);
+BOOL ModeIndex_Insert(MODEINDEX *index, const DEVMODE *mode);
+BOOL ModeIndex_Find(const MODEINDEX *index, const DEVMODE *mode);
+BOOL ModeIndex_FindNoRefresh(const MODEINDEX *index, const DEVMODE *mode);
+BOOL ModeIndex_HasBPP(const MODEINDEX *index, DWORD bpp);
+const DRIVERMODES *ModeIndex_GetDriverModes();
+void ModeIndex_ReleaseDriverModes();
+BOOL ModeIndex_FindClosest(const DRIVERMODES *list, const DEVMODE *in, DEVMODE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_MODEINDEX_H
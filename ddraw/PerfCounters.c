@@ -0,0 +1,139 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#include "common.h"
+#include "PerfCounters.h"
+
+/**
+  * Initializes the performance counters and publishes them in shared memory
+  * named after the current process.  If the memory can't be created or is
+  * already used by another renderer in the process, the counters are only
+  * available through PerfCounters_Get.
+  * @param perf
+  *  Pointer to PerfCounters structure
+  */
+void PerfCounters_Init(PerfCounters *perf)
+{
+	TCHAR name[64];
+	LARGE_INTEGER counter;
+	ZeroMemory(perf, sizeof(PerfCounters));
+	QueryPerformanceFrequency(&counter);
+	perf->frequency = counter.QuadPart;
+	QueryPerformanceCounter(&counter);
+	perf->lastpresent = counter.QuadPart;
+	perf->shared = &perf->local;
+	_sntprintf(name, 63, DXGLPERF_SHAREDNAME, GetCurrentProcessId());
+	name[63] = 0;
+	perf->mapping = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(DXGL_PERFSHARED), name);
+	if (perf->mapping && (GetLastError() == ERROR_ALREADY_EXISTS))
+	{
+		CloseHandle(perf->mapping);
+		perf->mapping = NULL;
+	}
+	if (perf->mapping)
+	{
+		perf->shared = (DXGL_PERFSHARED*)MapViewOfFile(perf->mapping, FILE_MAP_WRITE, 0, 0, sizeof(DXGL_PERFSHARED));
+		if (!perf->shared)
+		{
+			CloseHandle(perf->mapping);
+			perf->mapping = NULL;
+			perf->shared = &perf->local;
+		}
+	}
+	ZeroMemory(perf->shared, sizeof(DXGL_PERFSHARED));
+	perf->shared->dwSize = sizeof(DXGL_PERFSHARED);
+	perf->shared->dwVersion = DXGLPERF_VERSION;
+	perf->shared->last.dwSize = sizeof(DXGL_PERFCOUNTERS);
+}
+
+/**
+  * Releases the shared memory of the performance counters.
+  * @param perf
+  *  Pointer to PerfCounters structure
+  */
+void PerfCounters_Delete(PerfCounters *perf)
+{
+	if (perf->mapping)
+	{
+		UnmapViewOfFile(perf->shared);
+		CloseHandle(perf->mapping);
+		perf->mapping = NULL;
+	}
+	perf->shared = &perf->local;
+}
+
+/**
+  * Counts a wait of a calling thread for the render thread.  May be called
+  * from any thread.
+  * @param perf
+  *  Pointer to PerfCounters structure
+  * @param ticks
+  *  Time spent waiting, in performance counter ticks
+  */
+void PerfCounters_AddWait(PerfCounters *perf, LONGLONG ticks)
+{
+	InterlockedIncrement(&perf->handoffs);
+	InterlockedExchangeAdd(&perf->handoffwait, (LONG)((ticks * 1000000) / perf->frequency));
+}
+
+/**
+  * Publishes the counters of the frame that was just presented and starts
+  * counting the next one.  Called by the render thread after the counters
+  * kept by other modules have been added to perf->frame.
+  * @param perf
+  *  Pointer to PerfCounters structure
+  * @param presentstart
+  *  Performance counter when drawing of the primary started
+  */
+void PerfCounters_EndFrame(PerfCounters *perf, LONGLONG presentstart)
+{
+	LARGE_INTEGER counter;
+	DWORD frame;
+	QueryPerformanceCounter(&counter);
+	perf->frame.dwSize = sizeof(DXGL_PERFCOUNTERS);
+	perf->frame.dwFrame++;
+	perf->frame.dwFrameTime = (DWORD)(((counter.QuadPart - perf->lastpresent) * 1000000) / perf->frequency);
+	perf->frame.dwPresentTime = (DWORD)(((counter.QuadPart - presentstart) * 1000000) / perf->frequency);
+	perf->frame.dwCommands = InterlockedExchange(&perf->commands, 0);
+	perf->frame.dwHandoffs = InterlockedExchange(&perf->handoffs, 0);
+	perf->frame.dwHandoffWait = InterlockedExchange(&perf->handoffwait, 0);
+	perf->lastpresent = counter.QuadPart;
+	InterlockedIncrement(&perf->shared->sequence);
+	memcpy(&perf->shared->last, &perf->frame, sizeof(DXGL_PERFCOUNTERS));
+	InterlockedIncrement(&perf->shared->sequence);
+	frame = perf->frame.dwFrame;
+	ZeroMemory(&perf->frame, sizeof(DXGL_PERFCOUNTERS));
+	perf->frame.dwFrame = frame;
+}
+
+/**
+  * Copies the counters of the last presented frame.  May be called from any
+  * thread.
+  * @param perf
+  *  Pointer to PerfCounters structure
+  * @param counters
+  *  Structure to receive the counters
+  */
+void PerfCounters_Get(PerfCounters *perf, DXGL_PERFCOUNTERS *counters)
+{
+	LONG sequence;
+	do
+	{
+		sequence = InterlockedCompareExchange(&perf->shared->sequence, 0, 0);
+		memcpy(counters, &perf->shared->last, sizeof(DXGL_PERFCOUNTERS));
+	} while ((sequence & 1) || (InterlockedCompareExchange(&perf->shared->sequence, 0, 0) != sequence));
+}
@@ -0,0 +1,102 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#pragma once
+#ifndef _PERFCOUNTERS_H
+#define _PERFCOUNTERS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// IDirect3DDevice7::GetInfo ID returning a DXGL_PERFCOUNTERS structure ('DXGL')
+#define D3DDEVINFOID_DXGLPERF 0x4C475844
+// Name of the shared memory holding a DXGL_PERFSHARED structure, formatted with the process ID
+#define DXGLPERF_SHAREDNAME _T("DXGLPerfCounters%u")
+#define DXGLPERF_VERSION 2
+
+// Counters of the last completed frame.  Times are in microseconds.
+typedef struct DXGL_PERFCOUNTERS
+{
+	DWORD dwSize;
+	DWORD dwFrame;  // Frames presented since the renderer was created
+	DWORD dwFrameTime;  // Time from the previous present to this one
+	DWORD dwPresentTime;  // Time spent drawing and swapping the primary
+	DWORD dwCommands;  // Commands queued for the render thread
+	DWORD dwHandoffs;  // Times a calling thread waited for the render thread
+	DWORD dwHandoffWait;  // Time calling threads spent waiting for the render thread
+	DWORD dwDraws;  // Direct3D draw calls
+	DWORD dwBlts;  // Blts drawn, including those in batches
+	DWORD dwShaderSwitches;
+	DWORD dwShaderCompiles;
+	DWORD dwFBOSwitches;
+	DWORD dwReadbackStalls;  // Texture downloads that waited for the GPU
+	DWORD dwUploads;  // Texture levels uploaded
+	DWORD dwUploadBytes;
+	DWORD dwDownloadBytes;
+	DWORD dwTexturesSet;
+	DWORD dwPreloads;
+	DWORD dwTextureCreates;
+	DWORD dwTextureDeletes;
+	DWORD dwEvictions;
+	DWORD dwRestores;
+	DWORD dwResidentBytes;  // Video memory of textures that may be evicted, at the end of the frame
+	DWORD dwInputLatency;  // Input to GPU completion of the last measured frame if DebugLatency is set, otherwise 0
+} DXGL_PERFCOUNTERS;
+
+// Layout of the shared memory.  sequence is odd while the counters are being
+// written; a reader copies last and retries if sequence changed or was odd.
+typedef struct DXGL_PERFSHARED
+{
+	DWORD dwSize;
+	DWORD dwVersion;
+	volatile LONG sequence;
+	DWORD reserved;
+	DXGL_PERFCOUNTERS last;
+} DXGL_PERFSHARED;
+
+typedef struct PerfCounters
+{
+	DXGL_PERFCOUNTERS frame;  // Counted by the render thread during the current frame
+	// Counted by calling threads, taken by the render thread at the end of each frame
+	volatile LONG commands;
+	volatile LONG handoffs;
+	volatile LONG handoffwait;
+	LONGLONG frequency;
+	LONGLONG lastpresent;  // Performance counter at the end of the previous frame
+	HANDLE mapping;  // NULL if the counters are kept in local
+	DXGL_PERFSHARED *shared;  // Mapped view or local
+	DXGL_PERFSHARED local;
+	// Totals of the counters kept by other modules at the end of the previous frame
+	DWORD lastswitches;
+	DWORD lastcompiles;
+	DWORD lastfboswitches;
+	DWORD lastevictions;
+	DWORD lastrestores;
+} PerfCounters;
+
+void PerfCounters_Init(PerfCounters *perf);
+void PerfCounters_Delete(PerfCounters *perf);
+void PerfCounters_AddWait(PerfCounters *perf, LONGLONG ticks);
+void PerfCounters_EndFrame(PerfCounters *perf, LONGLONG presentstart);
+void PerfCounters_Get(PerfCounters *perf, DXGL_PERFCOUNTERS *counters);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_PERFCOUNTERS_H
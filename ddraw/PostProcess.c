@@ -0,0 +1,359 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#include "common.h"
+#include "BufferObject.h"
+#include "timer.h"
+#include "glRenderer.h"
+#include "glTexture.h"
+#include "glUtil.h"
+#include "ShaderManager.h"
+#include "PostProcess.h"
+
+static const DDSURFACEDESC2 ddsdpass =
+{
+	sizeof(DDSURFACEDESC2),
+	DDSD_WIDTH | DDSD_HEIGHT | DDSD_CAPS | DDSD_PIXELFORMAT,
+	0,
+	0,
+	0,
+	0,
+	0,
+	0,
+	0,
+	NULL,
+	{ 0,0 },
+	{ 0,0 },
+	{ 0,0 },
+	{ 0,0 },
+	{
+		sizeof(DDPIXELFORMAT),
+		DDPF_RGB,
+		0,
+		32,
+		0xFF,
+		0xFF00,
+		0xFF0000,
+		0
+	},
+	{
+		DDSCAPS_TEXTURE,
+		0,
+		0,
+		0
+	},
+	0,
+};
+
+static const GLushort passindices[4] = { 0,1,2,3 };
+
+/**
+  * Initializes an empty post process chain.
+  * @param chain
+  *  Pointer to PostProcess structure
+  * @param renderer
+  *  Renderer the chain draws with
+  */
+void PostProcess_Init(PostProcess *chain, struct glRenderer *renderer)
+{
+	ZeroMemory(chain, sizeof(PostProcess));
+	chain->renderer = renderer;
+}
+
+/**
+  * Releases the texture and query of a pass and writes its GPU time to the
+  * trace log.
+  * @param chain
+  *  Pointer to PostProcess structure
+  * @param pass
+  *  Pass to release
+  * @param name
+  *  Name of the pass in the trace log
+  */
+static void PostProcess_ReleasePass(PostProcess *chain, PostProcessPass *pass, const char *name)
+{
+	char str[128];
+	if (pass->samples)
+	{
+		sprintf(str, "%s: %u frames, %.3f ms average\n", name,
+			pass->samples, ((double)pass->time / (double)pass->samples) / 1000000.0);
+		TRACE_STRING(str);
+	}
+	if (pass->query) chain->renderer->ext->glDeleteQueries(1, &pass->query);
+	if (pass->target.initialized) glTexture_Release(&pass->target, TRUE);
+	ZeroMemory(pass, sizeof(PostProcessPass));
+}
+
+/**
+  * Releases the textures and queries of all passes.
+  * @param chain
+  *  Pointer to PostProcess structure
+  */
+static void PostProcess_Clear(PostProcess *chain)
+{
+	char name[32];
+	int i;
+	for (i = 0; i < chain->passcount; i++)
+	{
+		sprintf(name, "Post process pass %d", i);
+		PostProcess_ReleasePass(chain, &chain->passes[i], name);
+	}
+	chain->passcount = 0;
+}
+
+/**
+  * Deletes the passes of a post process chain.  The structure itself is not
+  * freed.
+  * @param chain
+  *  Pointer to PostProcess structure
+  */
+void PostProcess_Delete(PostProcess *chain)
+{
+	char str[64];
+	PostProcess_Clear(chain);
+	PostProcess_ReleasePass(chain, &chain->debug, "Debug view");
+	sprintf(str, "Post process chain: built %u times\n", chain->builds);
+	TRACE_STRING(str);
+}
+
+/**
+  * Sets up a pass and creates its output texture.
+  * @param chain
+  *  Pointer to PostProcess structure
+  * @param pass
+  *  Pass to set up
+  * @param progtype
+  *  Shader program to draw the pass with
+  * @param paletted
+  *  TRUE if the pass reads its input through the palette
+  * @param filter
+  *  Filter used to read the input of the pass
+  * @param width,height
+  *  Size of the output of the pass
+  * @return
+  *  TRUE if the output texture was created
+  */
+static BOOL PostProcess_InitPass(PostProcess *chain, PostProcessPass *pass, int progtype, BOOL paletted,
+	GLint filter, DWORD width, DWORD height)
+{
+	DDSURFACEDESC2 ddsd;
+	pass->progtype = progtype;
+	pass->paletted = paletted;
+	pass->filter = filter;
+	memcpy(&ddsd, &ddsdpass, sizeof(DDSURFACEDESC2));
+	ddsd.dwWidth = width;
+	ddsd.lPitch = width * 4;
+	ddsd.dwHeight = height;
+	if (FAILED(glTexture_Create(&ddsd, &pass->target, chain->renderer, TRUE, 0))) return FALSE;
+	pass->target.freeonrelease = FALSE;
+	glUtil_InitFBO(chain->renderer->util, &pass->target.levels[0].fbo);
+	if (chain->renderer->ext->GLEXT_ARB_timer_query)
+		chain->renderer->ext->glGenQueries(1, &pass->query);
+	return TRUE;
+}
+
+/**
+  * Adds a pass to the chain and creates its output texture.
+  * @param chain
+  *  Pointer to PostProcess structure
+  * @param progtype
+  *  Shader program to draw the pass with
+  * @param paletted
+  *  TRUE if the pass reads its input through the palette
+  * @param filter
+  *  Filter used to read the input of the pass
+  * @param width,height
+  *  Size of the output of the pass
+  */
+static void PostProcess_AddPass(PostProcess *chain, int progtype, BOOL paletted, GLint filter, DWORD width, DWORD height)
+{
+	if (chain->passcount >= POSTPROCESS_MAXPASSES) return;
+	if (PostProcess_InitPass(chain, &chain->passes[chain->passcount], progtype, paletted, filter, width, height))
+		chain->passcount++;
+}
+
+/**
+  * Builds the passes needed for the current scaling settings.  Nothing is
+  * done if the chain was already built for the same parameters, so the pass
+  * textures are only resized when the display mode or settings change.
+  * @param chain
+  *  Pointer to PostProcess structure
+  * @param width,height
+  *  Size of the primary surface
+  * @param paletted
+  *  TRUE if the primary surface is 8-bit paletted
+  * @param scalex,scaley
+  *  Scale of the primary before the final draw to the screen
+  */
+void PostProcess_Build(PostProcess *chain, DWORD width, DWORD height, BOOL paletted, float scalex, float scaley)
+{
+	DWORD scaledwidth, scaledheight;
+	if (chain->built && (chain->width == width) && (chain->height == height) &&
+		(chain->paletted == paletted) && (chain->scalex == scalex) && (chain->scaley == scaley))
+		return;
+	PostProcess_Clear(chain);
+	chain->width = width;
+	chain->height = height;
+	chain->paletted = paletted;
+	chain->scalex = scalex;
+	chain->scaley = scaley;
+	chain->built = TRUE;
+	chain->builds++;
+	scaledwidth = (DWORD)((float)width * scalex);
+	scaledheight = (DWORD)((float)height * scaley);
+	if (paletted)
+	{
+		// Filtering reads colors, so convert the palette indices first
+		if (dxglcfg.scalingfilter || (scalex != 1.0f) || (scaley != 1.0f))
+			PostProcess_AddPass(chain, PROG_PAL256, TRUE, GL_NEAREST, scaledwidth, scaledheight);
+	}
+	else if ((scalex != 1.0f) || (scaley != 1.0f))
+		PostProcess_AddPass(chain, PROG_TEXTURE, FALSE,
+			(dxglcfg.postfilter == 1) ? GL_LINEAR : GL_NEAREST, scaledwidth, scaledheight);
+}
+
+/**
+  * Adds the GPU time of the last finished frame of a pass to its totals.
+  * @param chain
+  *  Pointer to PostProcess structure
+  * @param pass
+  *  Pass to collect the time of
+  */
+static void PostProcess_CollectTime(PostProcess *chain, PostProcessPass *pass)
+{
+	GLint available = 0;
+	GLuint64 time;
+	if (!pass->querypending) return;
+	chain->renderer->ext->glGetQueryObjectiv(pass->query, GL_QUERY_RESULT_AVAILABLE, &available);
+	if (!available) return;
+	chain->renderer->ext->glGetQueryObjectui64v(pass->query, GL_QUERY_RESULT, &time);
+	pass->time += time;
+	pass->samples++;
+	pass->querypending = FALSE;
+}
+
+/**
+  * Draws one pass of the chain.
+  * @param chain
+  *  Pointer to PostProcess structure
+  * @param pass
+  *  Pass to draw
+  * @param input
+  *  Texture read by the pass
+  * @param paltex
+  *  Palette texture, for paletted passes
+  */
+static void PostProcess_DrawPass(PostProcess *chain, PostProcessPass *pass, glTexture *input, glTexture *paltex)
+{
+	struct glRenderer *renderer = chain->renderer;
+	SHADER *shader;
+	BltVertex *vertices = renderer->bltvertices;
+	GLfloat width = (GLfloat)pass->target.levels[0].ddsd.dwWidth;
+	GLfloat height = (GLfloat)pass->target.levels[0].ddsd.dwHeight;
+	BOOL timed;
+	PostProcess_CollectTime(chain, pass);
+	timed = pass->query && !pass->querypending;
+	if (timed) renderer->ext->glBeginQuery(GL_TIME_ELAPSED, pass->query);
+	glUtil_SetFBOSurface(renderer->util, &pass->target, NULL, 0, 0, TRUE);
+	ShaderManager_SetShader(renderer->shaders, pass->progtype, NULL, 0);
+	shader = &renderer->shaders->shaders[pass->progtype];
+	glUtil_SetActiveTexture(renderer->util, 8);
+	glUtil_SetTexture(renderer->util, 8, input);
+	glTexture__SetFilter(input, 8, pass->filter, pass->filter, renderer);
+	renderer->ext->glUniform1i(shader->tex0, 8);
+	if (pass->paletted)
+	{
+		glUtil_SetTexture(renderer->util, 9, paltex);
+		renderer->ext->glUniform1i(shader->pal, 9);
+	}
+	renderer->ext->glUniform4f(shader->view, 0.0f, width, 0.0f, height);
+	glUtil_SetViewport(renderer->util, 0, 0, (GLsizei)width, (GLsizei)height);
+	glUtil_SetScissor(renderer->util, FALSE, 0, 0, 0, 0);
+	// The pass covers its whole output, so it is not cleared first
+	vertices[0].s = vertices[0].t = vertices[1].t = vertices[2].s = 1.;
+	vertices[1].s = vertices[2].t = vertices[3].s = vertices[3].t = 0.;
+	vertices[0].y = vertices[1].y = vertices[1].x = vertices[3].x = 0.;
+	vertices[0].x = vertices[2].x = width;
+	vertices[2].y = vertices[3].y = height;
+	glUtil_EnableArray(renderer->util, shader->pos, TRUE);
+	renderer->ext->glVertexAttribPointer(shader->pos, 2, GL_FLOAT, GL_FALSE, sizeof(BltVertex), &vertices[0].x);
+	glUtil_EnableArray(renderer->util, shader->texcoord, TRUE);
+	renderer->ext->glVertexAttribPointer(shader->texcoord, 2, GL_FLOAT, GL_FALSE, sizeof(BltVertex), &vertices[0].s);
+	glUtil_SetCull(renderer->util, D3DCULL_NONE);
+	glUtil_SetPolyMode(renderer->util, D3DFILL_SOLID);
+	renderer->ext->glDrawRangeElements(GL_TRIANGLE_STRIP, 0, 3, 4, GL_UNSIGNED_SHORT, passindices);
+	if (timed)
+	{
+		renderer->ext->glEndQuery(GL_TIME_ELAPSED);
+		pass->querypending = TRUE;
+	}
+}
+
+/**
+  * Draws all passes of the chain, each reading the output of the one before.
+  * @param chain
+  *  Pointer to PostProcess structure
+  * @param texture
+  *  Primary surface texture read by the first pass
+  * @param paltex
+  *  Palette texture of the primary surface
+  * @return
+  *  Output of the last pass, or texture if the chain has no passes
+  */
+glTexture *PostProcess_Run(PostProcess *chain, glTexture *texture, glTexture *paltex)
+{
+	int i;
+	if (!chain->passcount) return texture;
+	for (i = 0; i < chain->passcount; i++)
+	{
+		PostProcess_DrawPass(chain, &chain->passes[i], texture, paltex);
+		texture = &chain->passes[i].target;
+	}
+	glUtil_SetFBO(chain->renderer->util, NULL);
+	return texture;
+}
+
+/**
+  * Draws the debug view selected by the DebugView setting into its own
+  * texture.  The texture is only recreated if the size of the depth buffer
+  * changes, and the programs are built with the other shaders, so nothing is
+  * compiled here.
+  * @param chain
+  *  Pointer to PostProcess structure
+  * @param depth
+  *  Depth buffer to visualize, or NULL if no 3D scene was drawn
+  * @return
+  *  Output of the debug view, or NULL if the view is disabled or unavailable
+  */
+glTexture *PostProcess_RunDebug(PostProcess *chain, glTexture *depth)
+{
+	PostProcessPass *pass = &chain->debug;
+	int progtype;
+	if (!depth || !dxglcfg.DebugView) return NULL;
+	progtype = (dxglcfg.DebugView == 2) ? PROG_DEBUGSSAO : PROG_DEBUGDEPTH;
+	if (!ShaderManager_GetBuiltin(chain->renderer->shaders, progtype)->prog) return NULL;
+	if (pass->target.initialized && ((pass->progtype != progtype) ||
+		(pass->target.levels[0].ddsd.dwWidth != depth->levels[0].ddsd.dwWidth) ||
+		(pass->target.levels[0].ddsd.dwHeight != depth->levels[0].ddsd.dwHeight)))
+		PostProcess_ReleasePass(chain, pass, "Debug view");
+	if (!pass->target.initialized && !PostProcess_InitPass(chain, pass, progtype, FALSE, GL_NEAREST,
+		depth->levels[0].ddsd.dwWidth, depth->levels[0].ddsd.dwHeight))
+		return NULL;
+	PostProcess_DrawPass(chain, pass, depth, NULL);
+	glUtil_SetFBO(chain->renderer->util, NULL);
+	return &pass->target;
+}
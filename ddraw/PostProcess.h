@@ -0,0 +1,74 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#pragma once
+#ifndef _POSTPROCESS_H
+#define _POSTPROCESS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define POSTPROCESS_MAXPASSES 4
+
+struct glRenderer;
+
+// One pass of the post process chain, drawn into its own texture
+typedef struct PostProcessPass
+{
+	int progtype;  // Shader program the pass is drawn with
+	BOOL paletted;  // TRUE if the pass reads its input through the palette
+	GLint filter;  // Filter used to read the input of the pass
+	glTexture target;  // Output of the pass, kept until the chain is rebuilt
+	// GPU time of the pass, written to the trace log when the chain is deleted
+	GLuint query;
+	BOOL querypending;
+	GLuint64 time;
+	DWORD samples;
+} PostProcessPass;
+
+/* Ordered passes drawn between the primary surface and the final draw to the
+   screen.  The chain is only rebuilt if the primary size, palette use or
+   scaling settings change. */
+typedef struct PostProcess
+{
+	struct glRenderer *renderer;
+	PostProcessPass passes[POSTPROCESS_MAXPASSES];
+	int passcount;
+	// Parameters the passes were built for
+	DWORD width;
+	DWORD height;
+	BOOL paletted;
+	float scalex;
+	float scaley;
+	BOOL built;
+	DWORD builds;  // Number of times the chain was rebuilt
+	// Debug view of the depth buffer, drawn instead of the primary if enabled
+	PostProcessPass debug;
+} PostProcess;
+
+void PostProcess_Init(PostProcess *chain, struct glRenderer *renderer);
+void PostProcess_Delete(PostProcess *chain);
+void PostProcess_Build(PostProcess *chain, DWORD width, DWORD height, BOOL paletted, float scalex, float scaley);
+glTexture *PostProcess_Run(PostProcess *chain, glTexture *texture, glTexture *paltex);
+glTexture *PostProcess_RunDebug(PostProcess *chain, glTexture *depth);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_POSTPROCESS_H
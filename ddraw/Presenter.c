@@ -0,0 +1,362 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#include "common.h"
+#include "BufferObject.h"
+#include "timer.h"
+#include "glRenderer.h"
+#include "glTexture.h"
+#include "glUtil.h"
+#include "Presenter.h"
+
+static const DDSURFACEDESC2 ddsdframe =
+{
+	sizeof(DDSURFACEDESC2),
+	DDSD_WIDTH | DDSD_HEIGHT | DDSD_CAPS | DDSD_PIXELFORMAT,
+	0,
+	0,
+	0,
+	0,
+	0,
+	0,
+	0,
+	NULL,
+	{ 0,0 },
+	{ 0,0 },
+	{ 0,0 },
+	{ 0,0 },
+	{
+		sizeof(DDPIXELFORMAT),
+		DDPF_RGB,
+		0,
+		32,
+		0xFF,
+		0xFF00,
+		0xFF0000,
+		0
+	},
+	{
+		DDSCAPS_TEXTURE,
+		0,
+		0,
+		0
+	},
+	0,
+};
+
+/**
+  * Draws a queued frame to the window and swaps it to the screen.  Runs on
+  * the presenter thread.
+  * @param presenter
+  *  Pointer to Presenter structure
+  * @param slot
+  *  Slot holding the frame
+  */
+static void Presenter_Show(Presenter *presenter, PresentSlot *slot)
+{
+	glExtensions *ext = presenter->ext;
+	GLint width = slot->texture.levels[0].ddsd.dwWidth;
+	GLint height = slot->texture.levels[0].ddsd.dwHeight;
+	// The GPU orders the read after the renderer's drawing, the thread doesn't wait
+	ext->glWaitSync(slot->drawn, 0, GL_TIMEOUT_IGNORED);
+	ext->glDeleteSync(slot->drawn);
+	slot->drawn = NULL;
+	if (slot->swap != presenter->swap)
+	{
+		ext->wglSwapIntervalEXT(slot->swap);
+		presenter->swap = slot->swap;
+	}
+	if (!slot->readfbo) ext->glGenFramebuffers(1, &slot->readfbo);
+	ext->glBindFramebuffer(GL_READ_FRAMEBUFFER, slot->readfbo);
+	// The renderer recreates the texture when the window is resized
+	ext->glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, slot->texture.id, 0);
+	ext->glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+	ext->glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	SwapBuffers(presenter->hDC);
+	slot->shown = ext->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	glFlush();
+}
+
+static DWORD WINAPI Presenter_ThreadProc(LPVOID param)
+{
+	Presenter *presenter = (Presenter*)param;
+	PresentSlot *slot;
+	int i;
+	wglMakeCurrent(presenter->hDC, presenter->hRC);
+	while (1)
+	{
+		WaitForSingleObject(presenter->wake, INFINITE);
+		while (1)
+		{
+			EnterCriticalSection(&presenter->cs);
+			slot = NULL;
+			for (i = 0; i < PRESENTER_SLOTS; i++)
+			{
+				if (presenter->slots[i].state != PRESENTSLOT_QUEUED) continue;
+				if (!slot || ((LONG)(presenter->slots[i].sequence - slot->sequence) < 0))
+					slot = &presenter->slots[i];
+			}
+			if (slot) slot->state = PRESENTSLOT_SHOWING;
+			else SetEvent(presenter->idle);
+			LeaveCriticalSection(&presenter->cs);
+			if (!slot) break;
+			Presenter_Show(presenter, slot);
+			EnterCriticalSection(&presenter->cs);
+			slot->state = PRESENTSLOT_FREE;
+			presenter->presented++;
+			LeaveCriticalSection(&presenter->cs);
+		}
+		if (!presenter->running) break;
+	}
+	for (i = 0; i < PRESENTER_SLOTS; i++)
+	{
+		if (presenter->slots[i].readfbo) presenter->ext->glDeleteFramebuffers(1, &presenter->slots[i].readfbo);
+		presenter->slots[i].readfbo = 0;
+	}
+	wglMakeCurrent(NULL, NULL);
+	return 0;
+}
+
+/**
+  * Starts showing frames from a thread of its own.  Must be called on the
+  * renderer thread with the renderer context current on the window.
+  * @param presenter
+  *  Pointer to Presenter structure to initialize
+  * @param renderer
+  *  Renderer composing the frames
+  * @param depth
+  *  Maximum number of frames waiting to be shown, from 1 to PRESENTER_MAXDEPTH
+  * @return
+  *  TRUE if the presenter thread was started.
+  */
+BOOL Presenter_Init(Presenter *presenter, struct glRenderer *renderer, DWORD depth)
+{
+	glExtensions *ext = renderer->ext;
+	PFNWGLCREATECONTEXTATTRIBSARBPROC wglCreateContextAttribsARB;
+	int attribs[7];
+	ZeroMemory(presenter, sizeof(Presenter));
+	presenter->renderer = renderer;
+	presenter->ext = ext;
+	presenter->drawing = -1;
+	presenter->swap = -2;
+	presenter->depth = max(1, min(depth, PRESENTER_MAXDEPTH));
+	if (!ext->GLEXT_ARB_framebuffer_object || !ext->glBlitFramebuffer || !ext->GLEXT_ARB_sync) return FALSE;
+	presenter->hDC = renderer->hDC;
+	wglCreateContextAttribsARB = (PFNWGLCREATECONTEXTATTRIBSARBPROC)wglGetProcAddress("wglCreateContextAttribsARB");
+	if (wglCreateContextAttribsARB)
+	{
+		attribs[0] = WGL_CONTEXT_MAJOR_VERSION_ARB;
+		attribs[1] = ext->glver_major;
+		attribs[2] = WGL_CONTEXT_MINOR_VERSION_ARB;
+		attribs[3] = ext->glver_minor;
+		attribs[4] = WGL_CONTEXT_PROFILE_MASK_ARB;
+		attribs[5] = WGL_CONTEXT_COMPATIBILITY_PROFILE_BIT_ARB;
+		attribs[6] = 0;
+		presenter->hRC = wglCreateContextAttribsARB(presenter->hDC, renderer->hRC, attribs);
+	}
+	if (!presenter->hRC)
+	{
+		presenter->hRC = wglCreateContext(presenter->hDC);
+		if (presenter->hRC && !wglShareLists(renderer->hRC, presenter->hRC))
+		{
+			wglDeleteContext(presenter->hRC);
+			presenter->hRC = NULL;
+		}
+	}
+	if (!presenter->hRC) return FALSE;
+	InitializeCriticalSection(&presenter->cs);
+	presenter->wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+	presenter->idle = CreateEvent(NULL, TRUE, TRUE, NULL);
+	presenter->running = TRUE;
+	presenter->thread = CreateThread(NULL, 0, Presenter_ThreadProc, presenter, 0, NULL);
+	if (!presenter->thread)
+	{
+		presenter->running = FALSE;
+		Presenter_Delete(presenter);
+		return FALSE;
+	}
+	SetThreadPriority(presenter->thread, THREAD_PRIORITY_ABOVE_NORMAL);
+	return TRUE;
+}
+
+/**
+  * Shows the frames still queued, stops the presenter thread and releases
+  * the frame textures.  Must be called on the renderer thread.
+  * @param presenter
+  *  Pointer to Presenter structure
+  */
+void Presenter_Delete(Presenter *presenter)
+{
+	char str[128];
+	int i;
+	if (presenter->thread)
+	{
+		presenter->running = FALSE;
+		SetEvent(presenter->wake);
+		WaitForSingleObject(presenter->thread, INFINITE);
+		CloseHandle(presenter->thread);
+		presenter->thread = NULL;
+		sprintf(str, "Presenter: %u frames shown, %u dropped\n", presenter->presented, presenter->dropped);
+		TRACE_STRING(str);
+	}
+	if (presenter->wake)
+	{
+		CloseHandle(presenter->wake);
+		CloseHandle(presenter->idle);
+		DeleteCriticalSection(&presenter->cs);
+		presenter->wake = NULL;
+		presenter->idle = NULL;
+	}
+	for (i = 0; i < PRESENTER_SLOTS; i++)
+	{
+		if (presenter->slots[i].drawn) presenter->ext->glDeleteSync(presenter->slots[i].drawn);
+		if (presenter->slots[i].shown) presenter->ext->glDeleteSync(presenter->slots[i].shown);
+		if (presenter->slots[i].texture.initialized) glTexture_Release(&presenter->slots[i].texture, TRUE);
+		ZeroMemory(&presenter->slots[i], sizeof(PresentSlot));
+	}
+	if (presenter->hRC) wglDeleteContext(presenter->hRC);
+	presenter->hRC = NULL;
+	presenter->hDC = NULL;
+}
+
+/**
+  * Picks a free slot for the renderer to compose the next frame into and
+  * binds its framebuffer.  The texture of the slot is recreated if the size
+  * of the window changed.
+  * @param presenter
+  *  Pointer to Presenter structure
+  * @param width,height
+  *  Size of the window
+  * @return
+  *  TRUE if the frame can be composed, FALSE to draw to the window directly.
+  */
+BOOL Presenter_BeginFrame(Presenter *presenter, DWORD width, DWORD height)
+{
+	struct glRenderer *renderer = presenter->renderer;
+	PresentSlot *slot;
+	DDSURFACEDESC2 ddsd;
+	int i;
+	if (!width || !height) return FALSE;
+	EnterCriticalSection(&presenter->cs);
+	// With depth + 2 slots one is always free
+	for (i = 0; i < PRESENTER_SLOTS; i++)
+		if (presenter->slots[i].state == PRESENTSLOT_FREE) break;
+	if (i < PRESENTER_SLOTS) presenter->slots[i].state = PRESENTSLOT_DRAWING;
+	LeaveCriticalSection(&presenter->cs);
+	if (i >= PRESENTER_SLOTS) return FALSE;
+	slot = &presenter->slots[i];
+	if (slot->shown)
+	{
+		presenter->ext->glWaitSync(slot->shown, 0, GL_TIMEOUT_IGNORED);
+		presenter->ext->glDeleteSync(slot->shown);
+		slot->shown = NULL;
+	}
+	if (slot->texture.initialized && ((slot->texture.levels[0].ddsd.dwWidth != width) ||
+		(slot->texture.levels[0].ddsd.dwHeight != height)))
+		glTexture_Release(&slot->texture, TRUE);
+	if (!slot->texture.initialized)
+	{
+		memcpy(&ddsd, &ddsdframe, sizeof(DDSURFACEDESC2));
+		ddsd.dwWidth = width;
+		ddsd.lPitch = width * 4;
+		ddsd.dwHeight = height;
+		if (FAILED(glTexture_Create(&ddsd, &slot->texture, renderer, TRUE, 0)))
+		{
+			ZeroMemory(&slot->texture, sizeof(glTexture));
+			slot->state = PRESENTSLOT_FREE;
+			return FALSE;
+		}
+		slot->texture.freeonrelease = FALSE;
+		glUtil_InitFBO(renderer->util, &slot->texture.levels[0].fbo);
+	}
+	if (glUtil_SetFBOSurface(renderer->util, &slot->texture, NULL, 0, 0, TRUE) != GL_FRAMEBUFFER_COMPLETE)
+	{
+		glUtil_SetFBO(renderer->util, NULL);
+		slot->state = PRESENTSLOT_FREE;
+		return FALSE;
+	}
+	presenter->drawing = i;
+	return TRUE;
+}
+
+/**
+  * Gets the framebuffer of the frame being composed.
+  * @param presenter
+  *  Pointer to Presenter structure
+  * @return
+  *  Framebuffer to draw to instead of the window, or NULL if no frame is
+  *  being composed.
+  */
+FBO *Presenter_GetFBO(Presenter *presenter)
+{
+	if (presenter->drawing < 0) return NULL;
+	return &presenter->slots[presenter->drawing].texture.levels[0].fbo;
+}
+
+/**
+  * Queues the composed frame to be shown.  If depth frames are already
+  * waiting, the oldest of them is dropped.
+  * @param presenter
+  *  Pointer to Presenter structure
+  * @param swap
+  *  Swap interval to show the frame with
+  */
+void Presenter_EndFrame(Presenter *presenter, int swap)
+{
+	PresentSlot *slot;
+	PresentSlot *oldest = NULL;
+	DWORD queued = 0;
+	int i;
+	if (presenter->drawing < 0) return;
+	slot = &presenter->slots[presenter->drawing];
+	presenter->drawing = -1;
+	slot->drawn = presenter->ext->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	// The presenter context only sees commands that were flushed
+	glFlush();
+	slot->swap = swap;
+	EnterCriticalSection(&presenter->cs);
+	for (i = 0; i < PRESENTER_SLOTS; i++)
+	{
+		if (presenter->slots[i].state != PRESENTSLOT_QUEUED) continue;
+		queued++;
+		if (!oldest || ((LONG)(presenter->slots[i].sequence - oldest->sequence) < 0))
+			oldest = &presenter->slots[i];
+	}
+	if (queued >= presenter->depth)
+	{
+		presenter->ext->glDeleteSync(oldest->drawn);
+		oldest->drawn = NULL;
+		oldest->state = PRESENTSLOT_FREE;
+		presenter->dropped++;
+	}
+	slot->sequence = presenter->sequence++;
+	slot->state = PRESENTSLOT_QUEUED;
+	ResetEvent(presenter->idle);
+	LeaveCriticalSection(&presenter->cs);
+	SetEvent(presenter->wake);
+}
+
+/**
+  * Waits until all queued frames have been shown, so the renderer can draw
+  * to the window and swap it itself.
+  * @param presenter
+  *  Pointer to Presenter structure
+  */
+void Presenter_Wait(Presenter *presenter)
+{
+	if (presenter->thread) WaitForSingleObject(presenter->idle, INFINITE);
+}
@@ -0,0 +1,85 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#pragma once
+#ifndef _PRESENTER_H
+#define _PRESENTER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct glRenderer;
+
+// Largest number of composed frames that can wait to be shown
+#define PRESENTER_MAXDEPTH 3
+// One frame being shown and one being composed besides the queued ones
+#define PRESENTER_SLOTS (PRESENTER_MAXDEPTH + 2)
+
+#define PRESENTSLOT_FREE 0  // Renderer may compose the next frame into the slot
+#define PRESENTSLOT_DRAWING 1  // Renderer is composing a frame into the slot
+#define PRESENTSLOT_QUEUED 2  // Frame is waiting to be shown
+#define PRESENTSLOT_SHOWING 3  // Presenter thread is drawing the frame to the window
+
+// Composed frame handed from the renderer to the presenter thread
+typedef struct PresentSlot
+{
+	glTexture texture;  // Frame the renderer composed, the size of the window
+	GLuint readfbo;  // Framebuffer of the presenter context reading the texture
+	GLsync drawn;  // Fence after the renderer composed the frame
+	GLsync shown;  // Fence after the presenter read the frame
+	int swap;  // Swap interval to show the frame with
+	DWORD state;
+	DWORD sequence;  // Order the frame was queued in
+} PresentSlot;
+
+/* Shows the frames composed by the renderer from a thread of its own, with a
+   context sharing objects with the renderer context.  The renderer thread
+   never waits for SwapBuffers, and if the queue is full the oldest waiting
+   frame is dropped. */
+typedef struct Presenter
+{
+	struct glRenderer *renderer;
+	glExtensions *ext;
+	HDC hDC;
+	HGLRC hRC;
+	HANDLE thread;
+	HANDLE wake;
+	HANDLE idle;  // Set while no frame is queued or being shown
+	CRITICAL_SECTION cs;
+	PresentSlot slots[PRESENTER_SLOTS];
+	DWORD depth;  // Maximum number of queued frames
+	DWORD sequence;
+	int drawing;  // Slot being composed by the renderer, -1 if none
+	int swap;  // Swap interval set on the presenter context
+	DWORD presented;
+	DWORD dropped;
+	volatile BOOL running;
+} Presenter;
+
+BOOL Presenter_Init(Presenter *presenter, struct glRenderer *renderer, DWORD depth);
+void Presenter_Delete(Presenter *presenter);
+BOOL Presenter_BeginFrame(Presenter *presenter, DWORD width, DWORD height);
+FBO *Presenter_GetFBO(Presenter *presenter);
+void Presenter_EndFrame(Presenter *presenter, int swap);
+void Presenter_Wait(Presenter *presenter);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_PRESENTER_H
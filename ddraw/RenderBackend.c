@@ -0,0 +1,173 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#include "common.h"
+#include "BufferObject.h"
+#include "timer.h"
+#include "glRenderer.h"
+#include "RenderBackend.h"
+
+// Minimum GL_MAX_VERTEX_ATTRIB_BINDINGS and GL_MAX_VERTEX_ATTRIB_RELATIVE_OFFSET
+#define RENDERBACKEND_MAXBINDINGS 16
+#define RENDERBACKEND_MAXRELATIVEOFFSET 2047
+
+static const GLbitfield persistentflags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+/**
+  * Allocates a stream buffer with persistently mapped storage if
+  * GL_ARB_buffer_storage is available, otherwise with glBufferData.
+  */
+static GLbyte *RenderBackend_Legacy_InitStreamBuffer(glExtensions *ext, BufferObject *buffer, GLenum target, GLsizeiptr size)
+{
+	if (!ext->GLEXT_ARB_buffer_storage)
+	{
+		BufferObject_SetData(buffer, target, size, NULL, GL_STREAM_DRAW);
+		return NULL;
+	}
+	BufferObject_SetStorage(buffer, target, size, NULL, persistentflags);
+	return (GLbyte*)BufferObject_MapRange(buffer, target, 0, size, persistentflags);
+}
+
+/**
+  * Builds a vertex array object by binding it and pointing the attributes at
+  * the buffer bound to GL_ARRAY_BUFFER.
+  */
+static GLuint RenderBackend_Legacy_CreateVertexArray(glExtensions *ext, const VertexArrayKey *key, BufferObject *indices)
+{
+	GLuint vao;
+	int i;
+	ext->glGenVertexArrays(1, &vao);
+	ext->glBindVertexArray(vao);
+	BufferObject_Bind(key->buffer, GL_ARRAY_BUFFER);
+	for (i = 0; i < 18; i++)
+	{
+		if (key->location[i] == -1) continue;
+		ext->glEnableVertexAttribArray(key->location[i]);
+		if ((i == 8) || (i == 9)) // Diffuse and specular colors
+			ext->glVertexAttribPointer(key->location[i], 4, GL_UNSIGNED_BYTE, GL_TRUE,
+				key->stride[i], (const GLvoid*)key->offset[i]);
+		else ext->glVertexAttribPointer(key->location[i], key->size[i], GL_FLOAT, GL_FALSE,
+			key->stride[i], (const GLvoid*)key->offset[i]);
+	}
+	BufferObject_Unbind(key->buffer, GL_ARRAY_BUFFER);
+	// Indexed draws always stream their indices into the same buffer
+	BufferObject_Bind(indices, GL_ELEMENT_ARRAY_BUFFER);
+	return vao;
+}
+
+/**
+  * Allocates a stream buffer with immutable, persistently mapped storage
+  * through direct state access.
+  */
+static GLbyte *RenderBackend_GL45_InitStreamBuffer(glExtensions *ext, BufferObject *buffer, GLenum target, GLsizeiptr size)
+{
+	ext->glNamedBufferStorage(buffer->buffer, size, NULL, persistentflags);
+	buffer->size = (GLsizei)size;
+	return (GLbyte*)ext->glMapNamedBufferRange(buffer->buffer, 0, size, persistentflags);
+}
+
+/**
+  * Builds a vertex array object with direct state access.  Attributes with
+  * the same stride share a vertex buffer binding that starts at the first of
+  * them.  Layouts that need more bindings or larger relative offsets than
+  * every driver supports are built by the legacy backend.
+  */
+static GLuint RenderBackend_GL45_CreateVertexArray(glExtensions *ext, const VertexArrayKey *key, BufferObject *indices)
+{
+	GLsizei stride[RENDERBACKEND_MAXBINDINGS];
+	GLintptr start[RENDERBACKEND_MAXBINDINGS];
+	int binding[18];
+	int bindings = 0;
+	GLuint vao;
+	int i, j;
+	for (i = 0; i < 18; i++)
+	{
+		if (key->location[i] == -1) continue;
+		for (j = 0; j < bindings; j++)
+			if (stride[j] == key->stride[i]) break;
+		if (j == bindings)
+		{
+			if (bindings == RENDERBACKEND_MAXBINDINGS)
+				return RenderBackend_Legacy_CreateVertexArray(ext, key, indices);
+			stride[j] = key->stride[i];
+			start[j] = key->offset[i];
+			bindings++;
+		}
+		if (key->offset[i] < start[j]) start[j] = key->offset[i];
+		binding[i] = j;
+	}
+	for (i = 0; i < 18; i++)
+	{
+		if (key->location[i] == -1) continue;
+		if ((key->offset[i] - start[binding[i]]) > RENDERBACKEND_MAXRELATIVEOFFSET)
+			return RenderBackend_Legacy_CreateVertexArray(ext, key, indices);
+	}
+	ext->glCreateVertexArrays(1, &vao);
+	for (j = 0; j < bindings; j++)
+		ext->glVertexArrayVertexBuffer(vao, j, key->buffer->buffer, start[j], stride[j]);
+	for (i = 0; i < 18; i++)
+	{
+		if (key->location[i] == -1) continue;
+		if ((i == 8) || (i == 9)) // Diffuse and specular colors
+			ext->glVertexArrayAttribFormat(vao, key->location[i], 4, GL_UNSIGNED_BYTE, GL_TRUE,
+				(GLuint)(key->offset[i] - start[binding[i]]));
+		else ext->glVertexArrayAttribFormat(vao, key->location[i], key->size[i], GL_FLOAT, GL_FALSE,
+			(GLuint)(key->offset[i] - start[binding[i]]));
+		ext->glVertexArrayAttribBinding(vao, key->location[i], binding[i]);
+		ext->glEnableVertexArrayAttrib(vao, key->location[i]);
+	}
+	ext->glVertexArrayElementBuffer(vao, indices->buffer);
+	ext->glBindVertexArray(vao);
+	return vao;
+}
+
+static const RenderBackend backend_legacy =
+{
+	"legacy",
+	RenderBackend_Legacy_InitStreamBuffer,
+	RenderBackend_Legacy_CreateVertexArray
+};
+
+static const RenderBackend backend_gl45 =
+{
+	"OpenGL 4.5",
+	RenderBackend_GL45_InitStreamBuffer,
+	RenderBackend_GL45_CreateVertexArray
+};
+
+/**
+  * Selects the backend for a context.
+  * @param ext
+  *  OpenGL extensions of the context
+  * @param setting
+  *  Value of the RenderBackend setting
+  * @return
+  *  The OpenGL 4.5 backend if it was not disabled and the driver supports
+  *  direct state access, immutable buffer storage and vertex array objects,
+  *  otherwise the legacy backend
+  */
+const RenderBackend *RenderBackend_Select(glExtensions *ext, DWORD setting)
+{
+	if (setting == RENDERBACKEND_LEGACY) return &backend_legacy;
+	if (!ext->GLEXT_ARB_direct_state_access || !ext->GLEXT_ARB_buffer_storage || !ext->GLEXT_ARB_vertex_array_object)
+		return &backend_legacy;
+	if (!ext->glCreateBuffers || !ext->glNamedBufferStorage || !ext->glMapNamedBufferRange ||
+		!ext->glCreateVertexArrays || !ext->glEnableVertexArrayAttrib || !ext->glVertexArrayAttribFormat ||
+		!ext->glVertexArrayAttribBinding || !ext->glVertexArrayVertexBuffer || !ext->glVertexArrayElementBuffer)
+		return &backend_legacy;
+	return &backend_gl45;
+}
@@ -0,0 +1,58 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#pragma once
+#ifndef _RENDERBACKEND_H
+#define _RENDERBACKEND_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Values of the RenderBackend setting
+#define RENDERBACKEND_AUTO 0
+#define RENDERBACKEND_LEGACY 1
+#define RENDERBACKEND_GL45 2
+
+struct VertexArrayKey;
+
+/** @brief Stream buffer and vertex array object creation for a context
+  * Only covers allocating the storage of the renderer's stream buffers and
+  * building its cached vertex array objects.  The opcode handlers in
+  * glRenderer.cpp still make their own OpenGL calls for draws, blts, clears,
+  * readback and presentation.
+  * The legacy backend binds objects to edit them and works on every OpenGL
+  * version DXGL supports.  The OpenGL 4.5 backend creates and edits objects
+  * with direct state access, so it never disturbs the bindings glUtil tracks,
+  * and always uses immutable, persistently mapped storage for stream buffers.
+  */
+typedef struct RenderBackend
+{
+	const char *name;
+	// Allocates the storage of a stream buffer, returns its persistent mapping or NULL
+	GLbyte *(*InitStreamBuffer)(glExtensions *ext, BufferObject *buffer, GLenum target, GLsizeiptr size);
+	// Creates and binds a vertex array object for a layout, with indices as its element buffer
+	GLuint (*CreateVertexArray)(glExtensions *ext, const struct VertexArrayKey *key, BufferObject *indices);
+} RenderBackend;
+
+const RenderBackend *RenderBackend_Select(glExtensions *ext, DWORD setting);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_RENDERBACKEND_H
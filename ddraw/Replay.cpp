@@ -0,0 +1,652 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#include "common.h"
+#include "BufferObject.h"
+#include "glTexture.h"
+#include "glUtil.h"
+#include "timer.h"
+#include "glDirectDraw.h"
+#include "glRenderer.h"
+#include "ddraw.h"
+#include "glDirect3D.h"
+#include "glDirect3DVertexBuffer.h"
+#include "Capture.h"
+#include "Replay.h"
+
+typedef struct ReplayBlob
+{
+	const BYTE *data;
+	DWORD size;
+} ReplayBlob;
+
+// Objects of a capture being played back, indexed by their IDs
+typedef struct ReplayState
+{
+	glDirectDraw7 *ddraw;
+	HWND hWnd;
+	ReplayBlob *blobs;  // Blob ID - 1, points into the file
+	DWORD blobcount;
+	DWORD blobmax;
+	glTexture **textures;
+	DWORD texturecount;  // Highest texture ID created
+	DWORD texturemax;
+	VertexBuffer **vertexbuffers;
+	DWORD vertexbuffercount;  // Highest vertex buffer ID recorded
+	DWORD vertexbuffermax;
+	DWORD frames;
+	BOOL quit;
+} ReplayState;
+
+static LRESULT CALLBACK Replay_WndProc(HWND hWnd, UINT Msg, WPARAM wParam, LPARAM lParam)
+{
+	if ((Msg == WM_KEYDOWN) && (wParam == VK_ESCAPE))
+	{
+		DestroyWindow(hWnd);
+		return 0;
+	}
+	return DefWindowProcA(hWnd, Msg, wParam, lParam);
+}
+
+/**
+  * Makes sure an array indexed by ID can hold an ID.
+  * @param array
+  *  Pointer to the array pointer
+  * @param max
+  *  Pointer to the number of entries of the array
+  * @param id
+  *  ID to hold
+  * @param entrysize
+  *  Size of an entry in bytes
+  * @return
+  *  TRUE if the array is large enough
+  */
+static BOOL Replay_Reserve(void **array, DWORD *max, DWORD id, size_t entrysize)
+{
+	DWORD newmax;
+	void *ptr;
+	if (id < *max) return TRUE;
+	newmax = *max ? *max : 256;
+	while (newmax <= id) newmax *= 2;
+	ptr = realloc(*array, newmax * entrysize);
+	if (!ptr) return FALSE;
+	ZeroMemory((BYTE*)ptr + (*max * entrysize), (newmax - *max) * entrysize);
+	*array = ptr;
+	*max = newmax;
+	return TRUE;
+}
+
+/**
+  * Checks that a record holds all of its structure, a truncated or corrupt
+  * capture may end records early.
+  * @param type
+  *  Record type
+  * @param data
+  *  Data of the record
+  * @param size
+  *  Size of the data in bytes
+  * @return
+  *  TRUE if the record can be played back
+  */
+static BOOL Replay_CheckSize(DWORD type, const BYTE *data, DWORD size)
+{
+	const QueueCmd *cmd = NULL;  // Only used for the sizes of the command arguments
+	const StateDelta *delta = (const StateDelta*)data;
+	DWORD offset;
+	unsigned __int64 count;
+	switch (type)
+	{
+	case CAPTURE_TEXTURE: return size >= sizeof(CaptureTexture);
+	case CAPTURE_UPLOAD: return size >= sizeof(CaptureUpload);
+	case CAPTURE_LINK: return size >= sizeof(CaptureLink);
+	case CAPTURE_MODE: return size >= sizeof(CaptureMode);
+	case CAPTURE_VERTEXBUFFER: return size >= sizeof(CaptureVertexBuffer);
+	case OP_BLT: return size >= sizeof(cmd->args.blt);
+	case OP_DEPTHFILL: return size >= sizeof(CaptureDepthFill);
+	case OP_CLEAR: return size >= sizeof(ClearCommand);
+	case OP_DRAWPRIMITIVES: return size >= sizeof(CaptureDraw);
+	case OP_DRAWSCREEN: return size >= sizeof(CaptureDrawScreen);
+	case OP_INITD3D: return size >= sizeof(CaptureInitD3D);
+	case OP_MAKETEXTUREPRIMARY: return size >= sizeof(CaptureTexturePrimary);
+	case OP_DOWNLOAD: return size >= sizeof(CaptureLevel);
+	case OP_DELETETEX:
+	case OP_PRELOADTEXTURE: return size >= sizeof(DWORD);
+	case OP_SETGAMMARAMP: return size >= sizeof(cmd->args.gamma);
+	case OP_SETRENDERSTATE: return size >= sizeof(cmd->args.renderstate);
+	case OP_SETTEXTURE: return size >= sizeof(cmd->args.texture);
+	case OP_SETTEXTURESTAGESTATE: return size >= sizeof(cmd->args.texturestagestate);
+	case OP_SETTRANSFORM: return size >= sizeof(cmd->args.transform);
+	case OP_SETMATERIAL: return size >= sizeof(cmd->args.material);
+	case OP_SETLIGHT: return size >= sizeof(cmd->args.light);
+	case OP_REMOVELIGHT: return size >= sizeof(cmd->args.removelight);
+	case OP_SETD3DVIEWPORT: return size >= sizeof(cmd->args.viewport);
+	case OP_SETTEXTURECOLORKEY: return size >= sizeof(cmd->args.colorkey);
+	case OP_UPDATEPALETTE:
+		// Only the entries being set are recorded
+		offset = FIELD_OFFSET(QueueCmd, args.palette.entries) - FIELD_OFFSET(QueueCmd, args);
+		if (size < offset) return FALSE;
+		count = *(const DWORD*)(data + FIELD_OFFSET(QueueCmd, args.palette.count) - FIELD_OFFSET(QueueCmd, args));
+		return (count <= 256) && (size >= offset + (count * sizeof(DWORD)));
+	case OP_APPLYSTATEDELTA:
+		if (size < FIELD_OFFSET(StateDelta, data)) return FALSE;
+		count = (2 * (unsigned __int64)delta->renderstatecount) + (3 * (unsigned __int64)delta->texturestagecount) +
+			(17 * (unsigned __int64)delta->transformcount);
+		return (count <= STATEDELTA_MAXSIZE - 3) && (size >= FIELD_OFFSET(StateDelta, data) + (count * sizeof(DWORD)));
+	default:
+		return TRUE;
+	}
+}
+
+/**
+  * Looks up a texture by its ID.
+  * @return
+  *  The texture, or NULL if the ID is 0 or unknown
+  */
+static glTexture *Replay_Texture(ReplayState *state, DWORD_PTR id)
+{
+	if (!id || (id >= state->texturemax)) return NULL;
+	return state->textures[id];
+}
+
+/**
+  * Looks up a blob by its ID.
+  * @return
+  *  The blob, or NULL if the ID is 0 or unknown
+  */
+static const ReplayBlob *Replay_Blob(ReplayState *state, DWORD_PTR id)
+{
+	if (!id || (id > state->blobcount)) return NULL;
+	return &state->blobs[id - 1];
+}
+
+/**
+  * Looks up the data of a blob by its ID.
+  * @return
+  *  Pointer to the data, or NULL if the ID is 0 or unknown
+  */
+static const BYTE *Replay_BlobData(ReplayState *state, DWORD_PTR id)
+{
+	const ReplayBlob *blob = Replay_Blob(state, id);
+	return blob ? blob->data : NULL;
+}
+
+/**
+  * Replaces the texture IDs of a recorded blt with the textures.
+  */
+static void Replay_MapBlt(ReplayState *state, BltCommand *cmd)
+{
+	cmd->dest = Replay_Texture(state, (DWORD_PTR)cmd->dest);
+	cmd->src = Replay_Texture(state, (DWORD_PTR)cmd->src);
+	cmd->zdest = Replay_Texture(state, (DWORD_PTR)cmd->zdest);
+	cmd->zsrc = Replay_Texture(state, (DWORD_PTR)cmd->zsrc);
+	cmd->alphadest = Replay_Texture(state, (DWORD_PTR)cmd->alphadest);
+	cmd->alphasrc = Replay_Texture(state, (DWORD_PTR)cmd->alphasrc);
+	cmd->pattern = Replay_Texture(state, (DWORD_PTR)cmd->pattern);
+}
+
+/**
+  * Sets up the display mode a primary surface was created in.
+  */
+static void Replay_SetMode(ReplayState *state, const CaptureMode *mode)
+{
+	RECT r;
+	if (mode->fullscreen)
+	{
+		glDirectDraw7_SetCooperativeLevel(state->ddraw, state->hWnd, DDSCL_EXCLUSIVE | DDSCL_FULLSCREEN);
+		glDirectDraw7_SetDisplayMode(state->ddraw, mode->width, mode->height, mode->bpp, mode->refresh, 0);
+		return;
+	}
+	r.left = r.top = 0;
+	r.right = mode->width;
+	r.bottom = mode->height;
+	AdjustWindowRect(&r, WS_OVERLAPPEDWINDOW, FALSE);
+	SetWindowPos(state->hWnd, NULL, 0, 0, r.right - r.left, r.bottom - r.top, SWP_NOMOVE | SWP_NOZORDER);
+}
+
+/**
+  * Loads the contents of a texture level the way an application does, by
+  * locking and unlocking it.
+  */
+static void Replay_Upload(ReplayState *state, const CaptureUpload *upload)
+{
+	glTexture *texture = Replay_Texture(state, upload->texture);
+	const ReplayBlob *blob = Replay_Blob(state, upload->blob);
+	DDSURFACEDESC2 ddsd;
+	DWORD size;
+	if (!texture || !blob) return;
+	if (glTexture_Lock(texture, upload->level, NULL, &ddsd, DDLOCK_WRITEONLY | DDLOCK_DISCARDCONTENTS, FALSE) != DD_OK)
+		return;
+	size = glTexture__LevelSize(texture, upload->level);
+	if (size > blob->size) size = blob->size;
+	memcpy(ddsd.lpSurface, blob->data, size);
+	glTexture_Unlock(texture, upload->level, NULL, FALSE);
+}
+
+/**
+  * Replaces the contents of a vertex buffer, creating it if it is new.
+  */
+static void Replay_VertexBuffer(ReplayState *state, const CaptureVertexBuffer *record)
+{
+	VertexBuffer *buffer;
+	const ReplayBlob *blob = Replay_Blob(state, record->blob);
+	unsigned char *ptr;
+	// IDs count up from 1, a larger jump comes from a corrupt capture
+	if (!record->buffer || (record->buffer > state->vertexbuffercount + 1)) return;
+	if (!Replay_Reserve((void**)&state->vertexbuffers, &state->vertexbuffermax, record->buffer, sizeof(VertexBuffer*)))
+		return;
+	if (record->buffer > state->vertexbuffercount) state->vertexbuffercount = record->buffer;
+	buffer = state->vertexbuffers[record->buffer];
+	if (!buffer)
+	{
+		buffer = (VertexBuffer*)malloc(sizeof(VertexBuffer));
+		if (!buffer) return;
+		ZeroMemory(buffer, sizeof(VertexBuffer));
+		state->vertexbuffers[record->buffer] = buffer;
+	}
+	if (buffer->size != record->size)
+	{
+		// A new buffer was created at the address of a deleted one
+		if (buffer->vbo) glRenderer_ReleaseBuffer(state->ddraw->renderer, buffer->vbo);
+		buffer->vbo = NULL;
+		glRenderer_Sync(state->ddraw->renderer);
+		ptr = (unsigned char*)realloc(buffer->data, record->size);
+		if (!ptr) return;
+		buffer->data = ptr;
+		buffer->size = record->size;
+	}
+	else glRenderer_Sync(state->ddraw->renderer);
+	if (blob) memcpy(buffer->data, blob->data, (blob->size < record->size) ? blob->size : record->size);
+	buffer->isstatic = record->isstatic;
+	buffer->nooverwrite = FALSE;
+	buffer->dirty = TRUE;
+}
+
+/**
+  * Draws recorded primitives.
+  */
+static void Replay_DrawPrimitives(ReplayState *state, const CaptureDraw *draw)
+{
+	RenderTarget target = draw->target;
+	VertexBuffer *buffer = NULL;
+	const ReplayBlob *blob;
+	BYTE *vertices;
+	unsigned __int64 size = (unsigned __int64)draw->count * glDirect3DVertexBuffer7_GetVertexSize(draw->fvf);
+	target.target = Replay_Texture(state, (DWORD_PTR)draw->target.target);
+	target.zbuffer = Replay_Texture(state, (DWORD_PTR)draw->target.zbuffer);
+	if (!target.target) return;
+	if (draw->buffer)
+	{
+		if (draw->buffer >= state->vertexbuffermax) return;
+		buffer = state->vertexbuffers[draw->buffer];
+		if (!buffer || !buffer->data) return;
+		// A truncated or corrupt capture may point past the end of the buffer
+		if (((unsigned __int64)draw->vertices + size) > buffer->size) return;
+		vertices = buffer->data + draw->vertices;
+	}
+	else
+	{
+		blob = Replay_Blob(state, draw->vertices);
+		if (!blob || (size > blob->size)) return;
+		vertices = (BYTE*)blob->data;
+	}
+	if (draw->indices)
+	{
+		blob = Replay_Blob(state, draw->indices);
+		if (!blob || (((unsigned __int64)draw->indexcount * sizeof(WORD)) > blob->size)) return;
+	}
+	glRenderer_DrawPrimitives(state->ddraw->renderer, &target, draw->mode, draw->fvf, vertices, buffer, FALSE, draw->count,
+		(LPWORD)Replay_BlobData(state, draw->indices), draw->indexcount, draw->flags);
+}
+
+/**
+  * Releases the textures and vertex buffers of a pass through the capture.
+  */
+static void Replay_Release(ReplayState *state)
+{
+	DWORD i;
+	for (i = 0; i < state->texturemax; i++)
+	{
+		if (state->textures[i]) glTexture_Release(state->textures[i], FALSE);
+		state->textures[i] = NULL;
+	}
+	for (i = 0; i < state->vertexbuffermax; i++)
+	{
+		if (!state->vertexbuffers[i]) continue;
+		if (state->vertexbuffers[i]->vbo)
+			glRenderer_ReleaseBuffer(state->ddraw->renderer, state->vertexbuffers[i]->vbo);
+		if (state->vertexbuffers[i]->ibo)
+			glRenderer_ReleaseBuffer(state->ddraw->renderer, state->vertexbuffers[i]->ibo);
+	}
+	if (state->ddraw->renderer) glRenderer_Sync(state->ddraw->renderer);
+	for (i = 0; i < state->vertexbuffermax; i++)
+	{
+		if (!state->vertexbuffers[i]) continue;
+		free(state->vertexbuffers[i]->data);
+		free(state->vertexbuffers[i]->indexcache);
+		free(state->vertexbuffers[i]);
+		state->vertexbuffers[i] = NULL;
+	}
+	state->blobcount = 0;
+	state->texturecount = 0;
+	state->vertexbuffercount = 0;
+}
+
+/**
+  * Plays back one record of a capture.
+  * @param state
+  *  Objects of the capture
+  * @param type
+  *  Record type
+  * @param data
+  *  Data of the record
+  * @param size
+  *  Size of the data in bytes
+  */
+static void Replay_Record(ReplayState *state, DWORD type, const BYTE *data, DWORD size)
+{
+	glRenderer *renderer = state->ddraw->renderer;
+	QueueCmd cmd;
+	glTexture *texture;
+	const ReplayBlob *blob;
+	MSG Msg;
+	if (type == CAPTURE_BLOB)
+	{
+		if (!Replay_Reserve((void**)&state->blobs, &state->blobmax, state->blobcount, sizeof(ReplayBlob)))
+		{
+			state->quit = TRUE;
+			return;
+		}
+		state->blobs[state->blobcount].data = data;
+		state->blobs[state->blobcount++].size = size;
+		return;
+	}
+	if (!Replay_CheckSize(type, data, size)) return;
+	if (type == CAPTURE_MODE)
+	{
+		Replay_SetMode(state, (const CaptureMode*)data);
+		return;
+	}
+	if (!renderer) return;
+	if (size <= sizeof(cmd.args)) memcpy(&cmd.args, data, size);
+	switch (type)
+	{
+	case CAPTURE_TEXTURE:
+		{
+			const CaptureTexture *record = (const CaptureTexture*)data;
+			// IDs count up from 1, a larger jump comes from a corrupt capture
+			if (!record->texture || (record->texture > state->texturecount + 1)) break;
+			if (!Replay_Reserve((void**)&state->textures, &state->texturemax, record->texture, sizeof(glTexture*))) break;
+			if (state->textures[record->texture]) break;
+			if (record->texture > state->texturecount) state->texturecount = record->texture;
+			texture = (glTexture*)malloc(sizeof(glTexture));
+			if (!texture) break;
+			if (glTexture_Create(&record->ddsd, texture, renderer, FALSE, record->target) != DD_OK)
+			{
+				free(texture);
+				break;
+			}
+			texture->freeonrelease = TRUE;
+			state->textures[record->texture] = texture;
+		}
+		break;
+	case CAPTURE_UPLOAD:
+		Replay_Upload(state, (const CaptureUpload*)data);
+		break;
+	case CAPTURE_LINK:
+		{
+			const CaptureLink *record = (const CaptureLink*)data;
+			texture = Replay_Texture(state, record->texture);
+			if (!texture) break;
+			glTexture_SetPalette(texture, Replay_Texture(state, record->palette), FALSE);
+			glTexture_SetStencil(texture, Replay_Texture(state, record->stencil), FALSE);
+		}
+		break;
+	case CAPTURE_VERTEXBUFFER:
+		Replay_VertexBuffer(state, (const CaptureVertexBuffer*)data);
+		break;
+	case OP_BLT:
+		Replay_MapBlt(state, &cmd.args.blt);
+		if (cmd.args.blt.dest) glRenderer_Blt(renderer, &cmd.args.blt);
+		break;
+	case OP_DEPTHFILL:
+		{
+			CaptureDepthFill record = *(const CaptureDepthFill*)data;
+			Replay_MapBlt(state, &record.blt);
+			if (record.blt.dest) glRenderer_DepthFill(renderer, &record.blt,
+				Replay_Texture(state, record.parent), record.parentlevel);
+		}
+		break;
+	case OP_CLEAR:
+		{
+			ClearCommand clear = *(const ClearCommand*)data;
+			clear.target = Replay_Texture(state, (DWORD_PTR)clear.target);
+			clear.zbuffer = Replay_Texture(state, (DWORD_PTR)clear.zbuffer);
+			if (clear.dwCount)
+			{
+				blob = Replay_Blob(state, (DWORD_PTR)clear.lpRects);
+				if (!blob || (((unsigned __int64)clear.dwCount * sizeof(D3DRECT)) > blob->size)) break;
+				clear.lpRects = (LPD3DRECT)blob->data;
+			}
+			else clear.lpRects = NULL;
+			if (clear.target) glRenderer_Clear(renderer, &clear);
+		}
+		break;
+	case OP_DRAWPRIMITIVES:
+		Replay_DrawPrimitives(state, (const CaptureDraw*)data);
+		break;
+	case OP_DRAWSCREEN:
+		{
+			const CaptureDrawScreen *record = (const CaptureDrawScreen*)data;
+			texture = Replay_Texture(state, record->texture);
+			if (texture) glRenderer_DrawScreen(renderer, texture, Replay_Texture(state, record->paltex), record->vsync,
+				Replay_Texture(state, record->previous), record->settime);
+			state->frames++;
+			while (PeekMessage(&Msg, NULL, 0, 0, PM_REMOVE))
+			{
+				TranslateMessage(&Msg);
+				DispatchMessage(&Msg);
+			}
+			if (!IsWindow(state->hWnd)) state->quit = TRUE;
+		}
+		break;
+	case OP_INITD3D:
+		{
+			const CaptureInitD3D *record = (const CaptureInitD3D*)data;
+			glRenderer_InitD3D(renderer, record->zbuffer, record->x, record->y);
+		}
+		break;
+	case OP_MAKETEXTUREPRIMARY:
+		{
+			const CaptureTexturePrimary *record = (const CaptureTexturePrimary*)data;
+			texture = Replay_Texture(state, record->texture);
+			if (texture) glRenderer_MakeTexturePrimary(renderer, texture, Replay_Texture(state, record->parent),
+				record->primary);
+		}
+		break;
+	case OP_DOWNLOAD:
+		{
+			const CaptureLevel *record = (const CaptureLevel*)data;
+			texture = Replay_Texture(state, record->texture);
+			if (texture) glRenderer_DownloadTexture(renderer, texture, record->level);
+		}
+		break;
+	case OP_DELETETEX:
+		{
+			DWORD id = *(const DWORD*)data;
+			texture = Replay_Texture(state, id);
+			if (!texture) break;
+			state->textures[id] = NULL;
+			glTexture_Release(texture, FALSE);
+		}
+		break;
+	case OP_PRELOADTEXTURE:
+		texture = Replay_Texture(state, *(const DWORD*)data);
+		if (texture) glRenderer_PreloadTexture(renderer, texture);
+		break;
+	case OP_FLUSH:
+		glRenderer_Flush(renderer);
+		break;
+	case OP_SETGAMMARAMP:
+		glRenderer_SetGammaRamp(renderer, &cmd.args.gamma);
+		break;
+	case OP_SETRENDERSTATE:
+		glRenderer_SetRenderState(renderer, cmd.args.renderstate.type, cmd.args.renderstate.value);
+		break;
+	case OP_SETTEXTURE:
+		glRenderer_SetTexture(renderer, cmd.args.texture.stage, Replay_Texture(state, (DWORD_PTR)cmd.args.texture.texture));
+		break;
+	case OP_SETTEXTURESTAGESTATE:
+		glRenderer_SetTextureStageState(renderer, cmd.args.texturestagestate.stage,
+			cmd.args.texturestagestate.type, cmd.args.texturestagestate.value);
+		break;
+	case OP_SETTRANSFORM:
+		glRenderer_SetTransform(renderer, cmd.args.transform.type, &cmd.args.transform.matrix);
+		break;
+	case OP_SETMATERIAL:
+		glRenderer_SetMaterial(renderer, &cmd.args.material);
+		break;
+	case OP_SETLIGHT:
+		glRenderer_SetLight(renderer, cmd.args.light.index, &cmd.args.light.light);
+		break;
+	case OP_REMOVELIGHT:
+		glRenderer_RemoveLight(renderer, cmd.args.removelight);
+		break;
+	case OP_SETD3DVIEWPORT:
+		glRenderer_SetD3DViewport(renderer, &cmd.args.viewport);
+		break;
+	case OP_SETTEXTURECOLORKEY:
+		texture = Replay_Texture(state, (DWORD_PTR)cmd.args.colorkey.texture);
+		if (texture) glRenderer_SetTextureColorKey(renderer, texture, cmd.args.colorkey.flags,
+			cmd.args.colorkey.setkey ? &cmd.args.colorkey.key : NULL, cmd.args.colorkey.level);
+		break;
+	case OP_UPDATEPALETTE:
+		texture = Replay_Texture(state, (DWORD_PTR)cmd.args.palette.texture);
+		if (texture) glRenderer_UpdatePalette(renderer, texture, cmd.args.palette.start,
+			cmd.args.palette.count, cmd.args.palette.entries);
+		break;
+	case OP_APPLYSTATEDELTA:
+		// Deltas may be larger than the other command arguments
+		glRenderer_ApplyStateDelta(renderer, (StateDelta*)data);
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+  * Plays back a capture written with DebugCapture.
+  * @param filename
+  *  Path of the capture file
+  * @param loops
+  *  Number of times to play the capture, 0 is treated as 1
+  * @param frames
+  *  Receives the number of frames presented
+  * @param seconds
+  *  Receives the time the playback took
+  * @return
+  *  DD_OK if the capture was played back, DDERR_NOTFOUND if the file could
+  *  not be read, DDERR_UNSUPPORTED if it was written by a different build,
+  *  or an error from creating DirectDraw
+  */
+HRESULT Replay_Play(LPCSTR filename, DWORD loops, DWORD *frames, double *seconds)
+{
+	ReplayState state;
+	HANDLE file;
+	BYTE *data;
+	DWORD size, read, offset, loop;
+	const CaptureHeader *header;
+	const CaptureRecord *record;
+	WNDCLASSA wndclass;
+	LARGE_INTEGER frequency, start, end;
+	HRESULT error;
+	if (frames) *frames = 0;
+	if (seconds) *seconds = 0.0;
+	file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return DDERR_NOTFOUND;
+	size = GetFileSize(file, NULL);
+	if ((size == INVALID_FILE_SIZE) || (size < sizeof(CaptureHeader)))
+	{
+		CloseHandle(file);
+		return DDERR_NOTFOUND;
+	}
+	data = (BYTE*)malloc(size);
+	if (!data)
+	{
+		CloseHandle(file);
+		return DDERR_OUTOFMEMORY;
+	}
+	if (!ReadFile(file, data, size, &read, NULL) || (read != size))
+	{
+		CloseHandle(file);
+		free(data);
+		return DDERR_NOTFOUND;
+	}
+	CloseHandle(file);
+	header = (const CaptureHeader*)data;
+	if ((header->magic != CAPTURE_MAGIC) || (header->version != CAPTURE_VERSION) ||
+		(header->pointersize != sizeof(void*)))
+	{
+		free(data);
+		return DDERR_UNSUPPORTED;
+	}
+	ZeroMemory(&state, sizeof(ReplayState));
+	ZeroMemory(&wndclass, sizeof(WNDCLASSA));
+	wndclass.lpfnWndProc = Replay_WndProc;
+	wndclass.hInstance = GetModuleHandle(NULL);
+	wndclass.hCursor = LoadCursor(NULL, IDC_ARROW);
+	wndclass.lpszClassName = "DXGLReplay";
+	RegisterClassA(&wndclass);
+	state.hWnd = CreateWindowA("DXGLReplay", "DXGL Replay", WS_OVERLAPPEDWINDOW | WS_VISIBLE,
+		CW_USEDEFAULT, CW_USEDEFAULT, 640, 480, NULL, NULL, wndclass.hInstance, NULL);
+	error = DirectDrawCreateEx(NULL, (LPVOID*)&state.ddraw, IID_IDirectDraw7, NULL);
+	if (error != DD_OK)
+	{
+		DestroyWindow(state.hWnd);
+		free(data);
+		return error;
+	}
+	// The capture is played back, not recorded again
+	dxglcfg.DebugCapture = FALSE;
+	glDirectDraw7_SetCooperativeLevel(state.ddraw, state.hWnd, DDSCL_NORMAL);
+	if (!loops) loops = 1;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+	for (loop = 0; (loop < loops) && !state.quit; loop++)
+	{
+		offset = sizeof(CaptureHeader);
+		while ((offset + sizeof(CaptureRecord) <= size) && !state.quit)
+		{
+			record = (const CaptureRecord*)(data + offset);
+			offset += sizeof(CaptureRecord);
+			if (record->size > size - offset) break;
+			Replay_Record(&state, record->type, data + offset, record->size);
+			offset += record->size;
+		}
+		Replay_Release(&state);
+	}
+	if (state.ddraw->renderer) glRenderer_Sync(state.ddraw->renderer);
+	QueryPerformanceCounter(&end);
+	if (frames) *frames = state.frames;
+	if (seconds) *seconds = (double)(end.QuadPart - start.QuadPart) / (double)frequency.QuadPart;
+	glDirectDraw7_Release(state.ddraw);
+	if (IsWindow(state.hWnd)) DestroyWindow(state.hWnd);
+	free(state.blobs);
+	free(state.textures);
+	free(state.vertexbuffers);
+	free(data);
+	return DD_OK;
+}
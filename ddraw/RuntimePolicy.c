@@ -0,0 +1,50 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#include "common.h"
+#include <float.h>
+#include "RuntimePolicy.h"
+
+DXGLPOLICY dxglpolicy;
+
+/**
+  * Derives the runtime policy from a configuration.  Must be called again
+  * whenever the configuration is read.
+  * @param cfg
+  *  Pointer to the configuration to compile
+  * @param policy
+  *  Pointer to the DXGLPOLICY structure to fill in
+  */
+void RuntimePolicy_Compile(const DXGLCFG *cfg, DXGLPOLICY *policy)
+{
+	ZeroMemory(policy, sizeof(DXGLPOLICY));
+	if (_isnan(cfg->postsizex) || _isnan(cfg->postsizey) ||
+		(cfg->postsizex < 0.25f) || (cfg->postsizey < 0.25f))
+		policy->postsizeauto = TRUE;
+	if (!_isnan(cfg->postsizex) && !_isnan(cfg->postsizey) &&
+		(cfg->postsizex > 0.25f) && (cfg->postsizey > 0.25f) &&
+		(cfg->postsizex != 1.0f) && (cfg->postsizey != 1.0f) &&
+		((cfg->scaler == 0) || ((cfg->scaler >= 4) && (cfg->scaler <= 6))) &&
+		(!cfg->primaryscale))
+		policy->scalemodes = TRUE;
+	if ((cfg->WindowScaleX != 1.0f) || (cfg->WindowScaleY != 1.0f))
+		policy->windowscaled = TRUE;
+	policy->uploadonunlock = cfg->DebugUploadAfterUnlock;
+	policy->writewatch = cfg->HackWriteWatch;
+	policy->singlebuffer = cfg->SingleBufferDevice;
+	policy->autoexpand = cfg->HackAutoExpandViewport;
+}
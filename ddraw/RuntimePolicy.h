@@ -0,0 +1,48 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#pragma once
+#ifndef _RUNTIMEPOLICY_H
+#define _RUNTIMEPOLICY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Decisions derived from dxglcfg that are checked on every blt, draw or
+// present.  Compiled once each time the configuration is read so hot paths
+// test a flag instead of comparing floats.
+typedef struct DXGLPOLICY
+{
+	BOOL postsizeauto;  // postsizex/postsizey unset, resolutions up to 400x300 are doubled
+	BOOL scalemodes;  // Display modes are reported divided by postsizex/postsizey
+	BOOL windowscaled;  // WindowScaleX or WindowScaleY is not 1
+	BOOL uploadonunlock;  // Textures are uploaded on every Unlock, not only mapped ones
+	BOOL writewatch;  // Surface buffers are watched for writes made after Unlock
+	BOOL singlebuffer;  // Render to a single buffered window and flush instead of swapping
+	DWORD autoexpand;  // HackAutoExpandViewport mode, 0 if disabled
+} DXGLPOLICY;
+
+extern DXGLPOLICY dxglpolicy;
+
+void RuntimePolicy_Compile(const DXGLCFG *cfg, DXGLPOLICY *policy);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_RUNTIMEPOLICY_H
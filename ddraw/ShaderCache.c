@@ -0,0 +1,450 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#include "common.h"
+#include "ShaderCache.h"
+#include "../common/version.h"
+
+extern DXGLCFG dxglcfg;
+
+// Refuse implausibly large records so a corrupt file can't exhaust memory
+#define SHADERCACHE_MAXBINARY 16777216
+
+static const char signaturebase[] = "DXGL " DXGLVERSTRING " 2D" STR(SHADER2DVERSION) " 3D" STR(SHADER3DVERSION);
+static const __int64 zerotexids[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+
+static int ShaderCache_Hash(DWORD type, __int64 id, const __int64 *texids)
+{
+	int i;
+	unsigned __int64 hash = ((unsigned __int64)id + type) * 0x9E3779B97F4A7C15ULL;
+	for (i = 0; i < 8; i++)
+	{
+		hash ^= (unsigned __int64)texids[i] + 0x9E3779B97F4A7C15ULL + (hash << 6) + (hash >> 2);
+	}
+	hash *= 0xBF58476D1CE4E5B9ULL;
+	return (int)(hash >> 32);
+}
+
+static BOOL ShaderCache_Match(const SHADERCACHERECORD *record, DWORD type, __int64 id, const __int64 *texids)
+{
+	if ((record->type != type) || (record->id != id)) return FALSE;
+	return !memcmp(record->texids, texids, 8 * sizeof(__int64));
+}
+
+static int ShaderCache_FindSlot(ShaderCache *cache, DWORD type, __int64 id, const __int64 *texids)
+{
+	int slot = ShaderCache_Hash(type, id, texids) & cache->hashmask;
+	while (cache->hashtable[slot] != -1)
+	{
+		if (ShaderCache_Match(&cache->entries[cache->hashtable[slot]].record, type, id, texids)) break;
+		slot = (slot + 1) & cache->hashmask;
+	}
+	return slot;
+}
+
+/**
+  * Grows the entry array and hash table so at least one more entry fits.
+  * @param cache
+  *  Pointer to ShaderCache structure
+  * @return
+  *  TRUE if there is room for another entry, FALSE if out of memory.
+  */
+static BOOL ShaderCache_Grow(ShaderCache *cache)
+{
+	SHADERCACHEENTRY *entries;
+	int *hashtable;
+	int hashmask;
+	int i;
+	int slot;
+	if (cache->count < cache->maxcount) return TRUE;
+	// Nothing changes until both arrays are allocated
+	hashmask = (cache->maxcount * 4) - 1;
+	hashtable = (int*)malloc((hashmask + 1) * sizeof(int));
+	if (!hashtable) return FALSE;
+	entries = (SHADERCACHEENTRY*)realloc(cache->entries, cache->maxcount * 2 * sizeof(SHADERCACHEENTRY));
+	if (!entries)
+	{
+		free(hashtable);
+		return FALSE;
+	}
+	cache->entries = entries;
+	memset(hashtable, 0xff, (hashmask + 1) * sizeof(int));
+	for (i = 0; i < cache->count; i++)
+	{
+		slot = ShaderCache_Hash(cache->entries[i].record.type, cache->entries[i].record.id,
+			cache->entries[i].record.texids) & hashmask;
+		while (hashtable[slot] != -1) slot = (slot + 1) & hashmask;
+		hashtable[slot] = i;
+	}
+	free(cache->hashtable);
+	cache->hashtable = hashtable;
+	cache->hashmask = hashmask;
+	cache->maxcount *= 2;
+	return TRUE;
+}
+
+/**
+  * Adds a program binary to the in-memory cache, replacing any previous
+  * binary with the same key.  The cache takes ownership of the binary.
+  * @param cache
+  *  Pointer to ShaderCache structure
+  * @param record
+  *  Key and format of the program binary
+  * @param binary
+  *  Pointer to the program binary, allocated with malloc
+  * @return
+  *  1 if a previous binary was replaced, 0 if the binary was added, or -1 if
+  *  out of memory, in which case the binary is freed
+  */
+static int ShaderCache_Insert(ShaderCache *cache, const SHADERCACHERECORD *record, BYTE *binary)
+{
+	int slot;
+	if (!ShaderCache_Grow(cache))
+	{
+		free(binary);
+		return -1;
+	}
+	slot = ShaderCache_FindSlot(cache, record->type, record->id, record->texids);
+	if (cache->hashtable[slot] != -1)
+	{
+		free(cache->entries[cache->hashtable[slot]].binary);
+		cache->entries[cache->hashtable[slot]].record = *record;
+		cache->entries[cache->hashtable[slot]].binary = binary;
+		return 1;
+	}
+	cache->entries[cache->count].record = *record;
+	cache->entries[cache->count].binary = binary;
+	cache->hashtable[slot] = cache->count++;
+	return 0;
+}
+
+static void ShaderCache_WriteFile(ShaderCache *cache);
+
+/**
+  * Reads all program binaries from the cache file.  A file written by another
+  * DXGL build or GL driver is truncated, as is any partially written record
+  * at the end of the file.  A file holding superseded binaries is rewritten
+  * without them.
+  * @param cache
+  *  Pointer to ShaderCache structure
+  */
+static void ShaderCache_ReadFile(ShaderCache *cache)
+{
+	HANDLE file;
+	SHADERCACHEHEADER header;
+	SHADERCACHERECORD record;
+	DWORD bytesread;
+	DWORD valid;
+	BYTE *binary;
+	BOOL superseded = FALSE;
+	file = CreateFile(cache->filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return;
+	valid = 0;
+	if (ReadFile(file, &header, sizeof(SHADERCACHEHEADER), &bytesread, NULL)
+		&& (bytesread == sizeof(SHADERCACHEHEADER)) && (header.magic == SHADERCACHE_MAGIC)
+		&& (header.fileversion == SHADERCACHE_FILEVERSION) && !memcmp(header.signature, cache->signature, 32))
+	{
+		valid = sizeof(SHADERCACHEHEADER);
+		while (ReadFile(file, &record, sizeof(SHADERCACHERECORD), &bytesread, NULL)
+			&& (bytesread == sizeof(SHADERCACHERECORD)))
+		{
+			if (!record.length || (record.length > SHADERCACHE_MAXBINARY)) break;
+			binary = (BYTE*)malloc(record.length);
+			if (!binary) break;
+			if (!ReadFile(file, binary, record.length, &bytesread, NULL) || (bytesread != record.length))
+			{
+				free(binary);
+				break;
+			}
+			if (ShaderCache_Insert(cache, &record, binary) > 0) superseded = TRUE;
+			valid += sizeof(SHADERCACHERECORD) + record.length;
+		}
+	}
+	SetFilePointer(file, valid, NULL, FILE_BEGIN);
+	SetEndOfFile(file);
+	CloseHandle(file);
+	if (superseded) ShaderCache_WriteFile(cache);
+}
+
+static void ShaderCache_CreateDirectory(const TCHAR *filename)
+{
+	TCHAR path[MAX_PATH + 16];
+	size_t i;
+	_tcscpy(path, filename);
+	for (i = 1; path[i]; i++)
+	{
+		if (path[i] == 92)
+		{
+			path[i] = 0;
+			CreateDirectory(path, NULL);
+			path[i] = 92;
+		}
+	}
+}
+
+/**
+  * Opens the cache file for writing, creating its directory if it does not
+  * exist yet.
+  * @param cache
+  *  Pointer to ShaderCache structure
+  * @param disposition
+  *  OPEN_ALWAYS to keep the contents of the file, CREATE_ALWAYS to empty it
+  * @return
+  *  Handle of the file, or INVALID_HANDLE_VALUE on failure
+  */
+static HANDLE ShaderCache_OpenFile(ShaderCache *cache, DWORD disposition)
+{
+	HANDLE file;
+	file = CreateFile(cache->filename, GENERIC_WRITE, FILE_SHARE_READ, NULL,
+		disposition, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file != INVALID_HANDLE_VALUE) return file;
+	ShaderCache_CreateDirectory(cache->filename);
+	return CreateFile(cache->filename, GENERIC_WRITE, FILE_SHARE_READ, NULL,
+		disposition, FILE_ATTRIBUTE_NORMAL, NULL);
+}
+
+/**
+  * Writes the header of a new cache file.
+  * @param cache
+  *  Pointer to ShaderCache structure
+  * @param file
+  *  Handle of the empty cache file
+  */
+static void ShaderCache_WriteHeader(ShaderCache *cache, HANDLE file)
+{
+	SHADERCACHEHEADER header;
+	DWORD byteswritten;
+	header.magic = SHADERCACHE_MAGIC;
+	header.fileversion = SHADERCACHE_FILEVERSION;
+	memcpy(header.signature, cache->signature, 32);
+	WriteFile(file, &header, sizeof(SHADERCACHEHEADER), &byteswritten, NULL);
+}
+
+/**
+  * Rewrites the cache file with the binaries in the cache, dropping the
+  * binaries that were replaced since the file was written.
+  * @param cache
+  *  Pointer to ShaderCache structure
+  */
+static void ShaderCache_WriteFile(ShaderCache *cache)
+{
+	HANDLE file;
+	DWORD byteswritten;
+	int i;
+	file = ShaderCache_OpenFile(cache, CREATE_ALWAYS);
+	if (file == INVALID_HANDLE_VALUE) return;
+	ShaderCache_WriteHeader(cache, file);
+	for (i = 0; i < cache->count; i++)
+	{
+		WriteFile(file, &cache->entries[i].record, sizeof(SHADERCACHERECORD), &byteswritten, NULL);
+		WriteFile(file, cache->entries[i].binary, cache->entries[i].record.length, &byteswritten, NULL);
+	}
+	CloseHandle(file);
+}
+
+/**
+  * Appends a program binary to the cache file, creating the file and its
+  * directory if they do not exist yet.
+  * @param cache
+  *  Pointer to ShaderCache structure
+  * @param record
+  *  Key and format of the program binary
+  * @param binary
+  *  Pointer to the program binary
+  */
+static void ShaderCache_AppendFile(ShaderCache *cache, const SHADERCACHERECORD *record, const BYTE *binary)
+{
+	HANDLE file;
+	DWORD byteswritten;
+	file = ShaderCache_OpenFile(cache, OPEN_ALWAYS);
+	if (file == INVALID_HANDLE_VALUE) return;
+	if (!GetFileSize(file, NULL)) ShaderCache_WriteHeader(cache, file);
+	SetFilePointer(file, 0, NULL, FILE_END);
+	WriteFile(file, record, sizeof(SHADERCACHERECORD), &byteswritten, NULL);
+	WriteFile(file, binary, record->length, &byteswritten, NULL);
+	CloseHandle(file);
+}
+
+/**
+  * Initializes the program binary cache and preloads the cache file of the
+  * current profile.  The cache stays disabled if the ShaderCache option is
+  * off or the GL driver can't retrieve program binaries.
+  * @param cache
+  *  Pointer to ShaderCache structure to initialize
+  * @param ext
+  *  Pointer to glExtensions structure
+  */
+void ShaderCache_Init(ShaderCache *cache, glExtensions *ext)
+{
+	Sha256Context sha_context;
+	SHA256_HASH sha256;
+	const GLubyte *glstring;
+	GLint formats = 0;
+	GLenum names[3] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+	int i;
+	ZeroMemory(cache, sizeof(ShaderCache));
+	cache->ext = ext;
+	if (!dxglcfg.ShaderCache || !ext->GLEXT_ARB_get_program_binary || !dxglcfg.shadercachepath[0]) return;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	if (formats <= 0) return;
+	_tcscpy(cache->filename, dxglcfg.shadercachepath);
+	_tcscat(cache->filename, _T("\\shaders.bin"));
+	Sha256Initialise(&sha_context);
+	Sha256Update(&sha_context, signaturebase, (uint32_t)strlen(signaturebase));
+	for (i = 0; i < 3; i++)
+	{
+		glstring = glGetString(names[i]);
+		if (glstring) Sha256Update(&sha_context, glstring, (uint32_t)strlen((const char*)glstring));
+	}
+	// Shaders sampling bindless handles are not interchangeable with bound ones
+	if (ext->GLEXT_ARB_bindless_texture) Sha256Update(&sha_context, "bindless", 8);
+	Sha256Finalise(&sha_context, &sha256);
+	memcpy(cache->signature, sha256.bytes, 32);
+	cache->maxcount = 256;
+	cache->entries = (SHADERCACHEENTRY*)malloc(cache->maxcount * sizeof(SHADERCACHEENTRY));
+	cache->hashmask = (cache->maxcount * 2) - 1;
+	cache->hashtable = (int*)malloc((cache->hashmask + 1) * sizeof(int));
+	if (!cache->entries || !cache->hashtable)
+	{
+		ShaderCache_Delete(cache);
+		return;
+	}
+	memset(cache->hashtable, 0xff, (cache->hashmask + 1) * sizeof(int));
+	cache->enabled = TRUE;
+	ShaderCache_ReadFile(cache);
+}
+
+/**
+  * Frees all program binaries held by the cache.  Binaries are written to
+  * disk as they are stored so nothing needs to be flushed here.
+  * @param cache
+  *  Pointer to ShaderCache structure
+  */
+void ShaderCache_Delete(ShaderCache *cache)
+{
+	int i;
+	for (i = 0; i < cache->count; i++)
+		free(cache->entries[i].binary);
+	if (cache->entries) free(cache->entries);
+	if (cache->hashtable) free(cache->hashtable);
+	cache->entries = NULL;
+	cache->hashtable = NULL;
+	cache->count = cache->maxcount = 0;
+	cache->enabled = FALSE;
+}
+
+/**
+  * Creates a program object from a cached binary.
+  * @param cache
+  *  Pointer to ShaderCache structure
+  * @param type
+  *  SHADERCACHE_TYPE2D or SHADERCACHE_TYPE3D
+  * @param id
+  *  Shader ID of the program
+  * @param texids
+  *  Pointer to 8 texture stage IDs, or NULL for 2D shaders
+  * @return
+  *  Linked program object ready to use, or 0 if the program must be compiled
+  *  from source.
+  */
+GLuint ShaderCache_LoadProgram(ShaderCache *cache, DWORD type, __int64 id, const __int64 *texids)
+{
+	int slot;
+	GLuint prog;
+	GLint result = GL_FALSE;
+	SHADERCACHEENTRY *entry;
+	if (!cache->enabled) return 0;
+	if (!texids) texids = zerotexids;
+	slot = ShaderCache_FindSlot(cache, type, id, texids);
+	if (cache->hashtable[slot] == -1) return 0;
+	entry = &cache->entries[cache->hashtable[slot]];
+	prog = cache->ext->glCreateProgram();
+	cache->ext->glProgramBinary(prog, entry->record.format, entry->binary, entry->record.length);
+	cache->ext->glGetProgramiv(prog, GL_LINK_STATUS, &result);
+	if (result) return prog;
+	// A rejected binary gets replaced when the program is stored again
+	cache->ext->glDeleteProgram(prog);
+	return 0;
+}
+
+/**
+  * Marks a program object so its binary can be retrieved after linking.
+  * Must be called before glLinkProgram.
+  * @param cache
+  *  Pointer to ShaderCache structure
+  * @param prog
+  *  Program object about to be linked
+  */
+void ShaderCache_PrepareProgram(ShaderCache *cache, GLuint prog)
+{
+	if (!cache->enabled) return;
+	cache->ext->glProgramParameteri(prog, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+}
+
+/**
+  * Retrieves the binary of a freshly linked program and adds it to the cache
+  * and the cache file.  The file is rewritten if the binary replaces one
+  * already in it, so it doesn't grow with every driver rejected binary.
+  * @param cache
+  *  Pointer to ShaderCache structure
+  * @param type
+  *  SHADERCACHE_TYPE2D or SHADERCACHE_TYPE3D
+  * @param id
+  *  Shader ID of the program
+  * @param texids
+  *  Pointer to 8 texture stage IDs, or NULL for 2D shaders
+  * @param prog
+  *  Linked program object
+  */
+void ShaderCache_StoreProgram(ShaderCache *cache, DWORD type, __int64 id, const __int64 *texids, GLuint prog)
+{
+	GLint result = GL_FALSE;
+	GLint length = 0;
+	GLenum format = 0;
+	BYTE *binary;
+	SHADERCACHERECORD record;
+	if (!cache->enabled) return;
+	if (!texids) texids = zerotexids;
+	cache->ext->glGetProgramiv(prog, GL_LINK_STATUS, &result);
+	if (!result) return;
+	cache->ext->glGetProgramiv(prog, GL_PROGRAM_BINARY_LENGTH, &length);
+	if ((length <= 0) || (length > SHADERCACHE_MAXBINARY)) return;
+	binary = (BYTE*)malloc(length);
+	if (!binary) return;
+	cache->ext->glGetProgramBinary(prog, length, &length, &format, binary);
+	if (length <= 0)
+	{
+		free(binary);
+		return;
+	}
+	ZeroMemory(&record, sizeof(SHADERCACHERECORD));
+	record.type = type;
+	record.format = format;
+	record.length = length;
+	record.id = id;
+	memcpy(record.texids, texids, 8 * sizeof(__int64));
+	switch (ShaderCache_Insert(cache, &record, binary))
+	{
+	case 0:
+		ShaderCache_AppendFile(cache, &record, binary);
+		break;
+	case 1:
+		ShaderCache_WriteFile(cache);
+		break;
+	}
+}
@@ -0,0 +1,81 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#pragma once
+#ifndef _SHADERCACHE_H
+#define _SHADERCACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SHADERCACHE_TYPE2D 0
+#define SHADERCACHE_TYPE3D 1
+
+// Magic number at the start of the cache file, 'DXSC'
+#define SHADERCACHE_MAGIC 0x43535844
+// Increment when the layout of SHADERCACHEHEADER or SHADERCACHERECORD changes
+#define SHADERCACHE_FILEVERSION 1
+
+typedef struct SHADERCACHEHEADER
+{
+	DWORD magic;
+	DWORD fileversion;
+	BYTE signature[32];  // SHA-256 of the DXGL build, shader revisions and GL driver strings
+} SHADERCACHEHEADER;
+
+// Each record is followed by length bytes of program binary
+typedef struct SHADERCACHERECORD
+{
+	DWORD type;
+	GLenum format;
+	DWORD length;
+	DWORD reserved;
+	__int64 id;
+	__int64 texids[8];
+} SHADERCACHERECORD;
+
+typedef struct SHADERCACHEENTRY
+{
+	SHADERCACHERECORD record;
+	BYTE *binary;
+} SHADERCACHEENTRY;
+
+typedef struct ShaderCache
+{
+	glExtensions *ext;
+	BOOL enabled;
+	BYTE signature[32];
+	SHADERCACHEENTRY *entries;
+	int count;
+	int maxcount;
+	int *hashtable;
+	int hashmask;
+	TCHAR filename[MAX_PATH + 16];
+} ShaderCache;
+
+void ShaderCache_Init(ShaderCache *cache, glExtensions *ext);
+void ShaderCache_Delete(ShaderCache *cache);
+GLuint ShaderCache_LoadProgram(ShaderCache *cache, DWORD type, __int64 id, const __int64 *texids);
+void ShaderCache_PrepareProgram(ShaderCache *cache, GLuint prog);
+void ShaderCache_StoreProgram(ShaderCache *cache, DWORD type, __int64 id, const __int64 *texids, GLuint prog);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_SHADERCACHE_H
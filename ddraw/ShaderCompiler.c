@@ -0,0 +1,289 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#include "common.h"
+#include "util.h"
+#include "ShaderCompiler.h"
+
+static void ShaderCompiler_Compile(ShaderCompiler *compiler, ShaderCompileJob *job)
+{
+	GLint srclen;
+	job->vs = compiler->ext->glCreateShader(GL_VERTEX_SHADER);
+	srclen = (GLint)strlen(job->vsrc);
+	compiler->ext->glShaderSource(job->vs, 1, &job->vsrc, &srclen);
+	compiler->ext->glCompileShader(job->vs);
+	job->fs = compiler->ext->glCreateShader(GL_FRAGMENT_SHADER);
+	srclen = (GLint)strlen(job->fsrc);
+	compiler->ext->glShaderSource(job->fs, 1, &job->fsrc, &srclen);
+	compiler->ext->glCompileShader(job->fs);
+	job->prog = compiler->ext->glCreateProgram();
+	compiler->ext->glAttachShader(job->prog, job->vs);
+	compiler->ext->glAttachShader(job->prog, job->fs);
+	if (job->retrievable)
+		compiler->ext->glProgramParameteri(job->prog, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	compiler->ext->glLinkProgram(job->prog);
+}
+
+static DWORD WINAPI ShaderCompiler_ThreadProc(LPVOID param)
+{
+	ShaderCompiler *compiler = (ShaderCompiler*)param;
+	ShaderCompileJob *job;
+	wglMakeCurrent(compiler->hDC, compiler->hRC);
+	while (1)
+	{
+		WaitForSingleObject(compiler->wake, INFINITE);
+		while (1)
+		{
+			EnterCriticalSection(&compiler->cs);
+			job = compiler->head;
+			if (job)
+			{
+				compiler->head = job->next;
+				if (!compiler->head) compiler->tail = NULL;
+			}
+			compiler->current = job;
+			LeaveCriticalSection(&compiler->cs);
+			if (!job) break;
+			ShaderCompiler_Compile(compiler, job);
+			// The objects must be complete before the renderer context uses them
+			glFinish();
+			InterlockedExchange(&job->done, 1);
+		}
+		if (!compiler->running) break;
+	}
+	wglMakeCurrent(NULL, NULL);
+	return 0;
+}
+
+/**
+  * Sets up background compilation of generated shaders for the GL context
+  * current on the calling thread.  If the driver supports
+  * GL_KHR_parallel_shader_compile, compiles are issued on the renderer context
+  * and left to the driver.  Otherwise a worker thread with its own context
+  * sharing objects with the renderer context does the compiling.
+  * @param compiler
+  *  Pointer to ShaderCompiler structure to initialize
+  * @param ext
+  *  Pointer to glExtensions structure
+  * @return
+  *  TRUE if shaders can be compiled in the background.
+  */
+BOOL ShaderCompiler_Init(ShaderCompiler *compiler, glExtensions *ext)
+{
+	PIXELFORMATDESCRIPTOR pfd;
+	HDC hDC;
+	HGLRC hRC;
+	int pf;
+	PFNWGLCREATECONTEXTATTRIBSARBPROC wglCreateContextAttribsARB;
+	int attribs[7];
+	ZeroMemory(compiler, sizeof(ShaderCompiler));
+	compiler->ext = ext;
+	if (ext->GLEXT_KHR_parallel_shader_compile)
+	{
+		ext->glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+		compiler->parallel = TRUE;
+		return TRUE;
+	}
+	hDC = wglGetCurrentDC();
+	hRC = wglGetCurrentContext();
+	if (!hDC || !hRC) return FALSE;
+	pf = GetPixelFormat(hDC);
+	if (!pf || !DescribePixelFormat(hDC, pf, sizeof(PIXELFORMATDESCRIPTOR), &pfd)) return FALSE;
+	if (!wndclassdxgltempatom) RegisterDXGLTempWindowClass();
+	compiler->hWnd = CreateWindow(wndclassdxgltemp.lpszClassName, _T("DXGL Shader Compiler"), WS_POPUP,
+		0, 0, 1, 1, NULL, NULL, GetModuleHandle(NULL), NULL);
+	if (!compiler->hWnd) return FALSE;
+	compiler->hDC = GetDC(compiler->hWnd);
+	if (!compiler->hDC || !SetPixelFormat(compiler->hDC, pf, &pfd))
+	{
+		ShaderCompiler_Delete(compiler);
+		return FALSE;
+	}
+	wglCreateContextAttribsARB = (PFNWGLCREATECONTEXTATTRIBSARBPROC)wglGetProcAddress("wglCreateContextAttribsARB");
+	if (wglCreateContextAttribsARB)
+	{
+		attribs[0] = WGL_CONTEXT_MAJOR_VERSION_ARB;
+		attribs[1] = ext->glver_major;
+		attribs[2] = WGL_CONTEXT_MINOR_VERSION_ARB;
+		attribs[3] = ext->glver_minor;
+		attribs[4] = WGL_CONTEXT_PROFILE_MASK_ARB;
+		attribs[5] = WGL_CONTEXT_COMPATIBILITY_PROFILE_BIT_ARB;
+		attribs[6] = 0;
+		compiler->hRC = wglCreateContextAttribsARB(compiler->hDC, hRC, attribs);
+	}
+	if (!compiler->hRC)
+	{
+		compiler->hRC = wglCreateContext(compiler->hDC);
+		if (compiler->hRC && !wglShareLists(hRC, compiler->hRC))
+		{
+			wglDeleteContext(compiler->hRC);
+			compiler->hRC = NULL;
+		}
+	}
+	if (!compiler->hRC)
+	{
+		ShaderCompiler_Delete(compiler);
+		return FALSE;
+	}
+	InitializeCriticalSection(&compiler->cs);
+	compiler->wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+	compiler->running = TRUE;
+	compiler->thread = CreateThread(NULL, 0, ShaderCompiler_ThreadProc, compiler, 0, NULL);
+	if (!compiler->thread)
+	{
+		compiler->running = FALSE;
+		ShaderCompiler_Delete(compiler);
+		return FALSE;
+	}
+	SetThreadPriority(compiler->thread, THREAD_PRIORITY_BELOW_NORMAL);
+	return TRUE;
+}
+
+/**
+  * Stops the worker thread and destroys its context.  All jobs must have been
+  * released first.
+  * @param compiler
+  *  Pointer to ShaderCompiler structure
+  */
+void ShaderCompiler_Delete(ShaderCompiler *compiler)
+{
+	if (compiler->thread)
+	{
+		compiler->running = FALSE;
+		SetEvent(compiler->wake);
+		WaitForSingleObject(compiler->thread, INFINITE);
+		CloseHandle(compiler->thread);
+		compiler->thread = NULL;
+	}
+	if (compiler->wake)
+	{
+		CloseHandle(compiler->wake);
+		DeleteCriticalSection(&compiler->cs);
+		compiler->wake = NULL;
+	}
+	if (compiler->hRC) wglDeleteContext(compiler->hRC);
+	compiler->hRC = NULL;
+	if (compiler->hDC) ReleaseDC(compiler->hWnd, compiler->hDC);
+	compiler->hDC = NULL;
+	if (compiler->hWnd) DestroyWindow(compiler->hWnd);
+	compiler->hWnd = NULL;
+}
+
+/**
+  * Starts compiling and linking a shader program in the background.
+  * @param compiler
+  *  Pointer to ShaderCompiler structure
+  * @param vsrc
+  *  Vertex shader source, which must stay valid until the job is released
+  * @param fsrc
+  *  Fragment shader source, which must stay valid until the job is released
+  * @param retrievable
+  *  TRUE to allow retrieving the program binary once linked
+  * @return
+  *  Job to pass to ShaderCompiler_Poll, or NULL if out of memory.
+  */
+ShaderCompileJob *ShaderCompiler_Submit(ShaderCompiler *compiler, const char *vsrc, const char *fsrc, BOOL retrievable)
+{
+	ShaderCompileJob *job = (ShaderCompileJob*)malloc(sizeof(ShaderCompileJob));
+	if (!job) return NULL;
+	ZeroMemory(job, sizeof(ShaderCompileJob));
+	job->vsrc = vsrc;
+	job->fsrc = fsrc;
+	job->retrievable = retrievable;
+	if (compiler->parallel)
+	{
+		ShaderCompiler_Compile(compiler, job);
+		return job;
+	}
+	EnterCriticalSection(&compiler->cs);
+	if (compiler->tail) compiler->tail->next = job;
+	else compiler->head = job;
+	compiler->tail = job;
+	LeaveCriticalSection(&compiler->cs);
+	SetEvent(compiler->wake);
+	return job;
+}
+
+/**
+  * Checks whether a background compile has finished without blocking.
+  * @param compiler
+  *  Pointer to ShaderCompiler structure
+  * @param job
+  *  Job returned by ShaderCompiler_Submit
+  * @return
+  *  TRUE if the program in job->prog is linked and may be used.
+  */
+BOOL ShaderCompiler_Poll(ShaderCompiler *compiler, ShaderCompileJob *job)
+{
+	GLint status = GL_FALSE;
+	if (compiler->parallel)
+	{
+		if (job->done) return TRUE;
+		compiler->ext->glGetProgramiv(job->prog, GL_COMPLETION_STATUS_KHR, &status);
+		if (status) job->done = 1;
+		return status ? TRUE : FALSE;
+	}
+	return job->done ? TRUE : FALSE;
+}
+
+/**
+  * Stops a job so it can be released.  A job still waiting in the queue is
+  * dropped without creating any GL objects, one being compiled is waited for.
+  * @param compiler
+  *  Pointer to ShaderCompiler structure
+  * @param job
+  *  Job returned by ShaderCompiler_Submit
+  */
+void ShaderCompiler_Cancel(ShaderCompiler *compiler, ShaderCompileJob *job)
+{
+	ShaderCompileJob *prev;
+	ShaderCompileJob *item;
+	if (compiler->parallel)
+	{
+		job->done = 1;
+		return;
+	}
+	EnterCriticalSection(&compiler->cs);
+	prev = NULL;
+	for (item = compiler->head; item; item = item->next)
+	{
+		if (item == job)
+		{
+			if (prev) prev->next = job->next;
+			else compiler->head = job->next;
+			if (compiler->tail == job) compiler->tail = prev;
+			job->done = 1;
+			break;
+		}
+		prev = item;
+	}
+	LeaveCriticalSection(&compiler->cs);
+	while (!job->done) Sleep(0);
+}
+
+/**
+  * Frees a finished or cancelled job.  GL objects the job created are left to
+  * the caller.
+  * @param compiler
+  *  Pointer to ShaderCompiler structure
+  * @param job
+  *  Job returned by ShaderCompiler_Submit
+  */
+void ShaderCompiler_Release(ShaderCompiler *compiler, ShaderCompileJob *job)
+{
+	free(job);
+}
@@ -0,0 +1,65 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#pragma once
+#ifndef _SHADERCOMPILER_H
+#define _SHADERCOMPILER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ShaderCompileJob
+{
+	const char *vsrc;
+	const char *fsrc;
+	BOOL retrievable;  // Set GL_PROGRAM_BINARY_RETRIEVABLE_HINT before linking
+	GLuint vs;
+	GLuint fs;
+	GLuint prog;
+	volatile LONG done;
+	struct ShaderCompileJob *next;
+} ShaderCompileJob;
+
+typedef struct ShaderCompiler
+{
+	glExtensions *ext;
+	BOOL parallel;  // Driver compiles in the background via GL_KHR_parallel_shader_compile
+	HWND hWnd;
+	HDC hDC;
+	HGLRC hRC;
+	HANDLE thread;
+	HANDLE wake;
+	CRITICAL_SECTION cs;
+	ShaderCompileJob *head;
+	ShaderCompileJob *tail;
+	ShaderCompileJob *current;
+	volatile BOOL running;
+} ShaderCompiler;
+
+BOOL ShaderCompiler_Init(ShaderCompiler *compiler, glExtensions *ext);
+void ShaderCompiler_Delete(ShaderCompiler *compiler);
+ShaderCompileJob *ShaderCompiler_Submit(ShaderCompiler *compiler, const char *vsrc, const char *fsrc, BOOL retrievable);
+BOOL ShaderCompiler_Poll(ShaderCompiler *compiler, ShaderCompileJob *job);
+void ShaderCompiler_Cancel(ShaderCompiler *compiler, ShaderCompileJob *job);
+void ShaderCompiler_Release(ShaderCompiler *compiler, ShaderCompileJob *job);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_SHADERCOMPILER_H
@@ -26,6 +26,7 @@
 #include "string.h"
 #include "glExtensions.h"
 #include "ShaderGen2d.h"
+#include "ShaderCache.h"
 #include "../common/version.h"
 
 extern DXGLCFG dxglcfg;
@@ -67,6 +68,8 @@ Bit 31: (DXGL) Overlay display mode
 Bits 32-39: Texture type input
 Bits 40-47: Texture type output
 Bit 48: if 1, use screen scale for filtering when applicable
+Bit 49: (DXGL) Read destination with EXT_shader_framebuffer_fetch
+Bit 50: (DXGL) Integer ROP reading R8UI views of 8-bit palette surfaces
 AND the dwFlags by 0xF2FAADFF before packing ROP index bits
 
 Texture types:
@@ -108,6 +111,7 @@ static const char version_450[] = "#version 450 core\n";
 static const char version_460[] = "#version 460 core\n";
 static const char ext_shader4[] = "#extension GL_EXT_gpu_shader4 : require\n";
 static const char ext_texrect[] = "#extension GL_ARB_texture_rectangle : require\n";
+static const char ext_fbfetch[] = "#extension GL_EXT_shader_framebuffer_fetch : require\n";
 static const char vertexshader[] = "//2D Vertex Shader\n";
 static const char fragshader[] = "//2D Fragment Shader\n";
 static const char idheader[] = "//ID: 0x";
@@ -122,6 +126,7 @@ const vec3 yuv_offsets = vec3(-0.0625, -0.5, -0.5);\n";
 static const char const_bt601_coeff_inv[] =
 "const mat3 bt601_coeff_inv = mat3(0.2569,-0.1483,.4394,.5044,-.2911,-.3679,.0979,.4394,-.0715);\n\
 const vec3 yuv_offsets_inv = vec3(0.0625, 0.5, 0.5);\n";
+static const char const_colorsizedest8[] = "const ivec4 colorsizedest = ivec4(255);\n";
 
 // Attributes
 static const char attr_xy[] = "vec2 xy;\n";
@@ -138,6 +143,9 @@ static const char unif_srctexrect[] = "uniform sampler2DRect srctex;\n";
 static const char unif_desttex[] = "uniform sampler2D desttex;\n";
 static const char unif_desttexrect[] = "uniform sampler2DRect desttex;\n";
 static const char unif_patterntex[] = "uniform sampler2D patterntex;\n";
+static const char unif_srctexint[] = "uniform usampler2D srctex;\n";
+static const char unif_desttexint[] = "uniform usampler2D desttex;\n";
+static const char unif_patterntexint[] = "uniform usampler2D patterntex;\n";
 static const char unif_stenciltex[] = "uniform sampler2D stenciltex;\n";
 static const char unif_srcpal[] = "uniform sampler2D srcpal;\n";
 static const char unif_destpal[] = "uniform sampler2D destpal;\n";
@@ -166,6 +174,7 @@ static const char var_stencilcoord[] = "vec2 stencilcoord;\n";
 
 //Outputs
 static const char out_fragcolor[] = "out vec4 FragColor;\n";
+static const char inout_fragcolor[] = "inout vec4 FragColor;\n";
 
 // Operations
 // Non-integer color sampler
@@ -204,15 +213,23 @@ static const char op_pixelyuyv[] = "pixel = ivec4(readyuyv(srctex)*vec4(colorsiz
 static const char op_pixelyvyu[] = "pixel = ivec4(readyvyu(srctex)*vec4(colorsizedest)+.5);\n";
 static const char op_lumpixel[] = "pixel = ivec4(vec4(tex2d(srctex,texcoord.st).rrr,1.0)*vec4(colorsizedest)+.5);\n";
 static const char op_fillcolor[] = "pixel = fillcolor;\n";
+static const char op_pixelint[] = "pixel = ivec4(texture(srctex,texcoord.st));\n";
 
 // Destination sampler
 static const char op_dest[] = "dest = ivec4(tex2d(desttex,destcoord.st)*vec4(colorsizedest)+.5);\n";
+static const char op_destfetch[] = "dest = ivec4(FragColor*vec4(colorsizedest)+.5);\n";
+static const char op_destfetchgl2[] = "dest = ivec4(gl_LastFragData[0]*vec4(colorsizedest)+.5);\n";
+static const char op_destint[] = "dest = ivec4(texture(desttex,destcoord.st));\n";
 static const char op_pattern[] = "patternst = vec2(mod(gl_FragCoord.x,float(patternsize.x))/float(patternsize.x),\n\
 mod(gl_FragCoord.y, float(patternsize.y)) / float(patternsize.y));\n\
 pattern = ivec4(tex2d(patterntex,patternst)*vec4(colorsizedest)+.5);\n";
+static const char op_patternint[] = "patternst = vec2(mod(gl_FragCoord.x,float(patternsize.x))/float(patternsize.x),\n\
+mod(gl_FragCoord.y, float(patternsize.y)) / float(patternsize.y));\n\
+pattern = ivec4(texture(patterntex,patternst));\n";
 
 //Outputs
 static const char op_destoutdestblend[] = "FragColor = (vec4(pixel)/vec4(colorsizedest)) * tex2d(desttex,destcoord.st);\n";
+static const char op_destoutdestblendfetch[] = "FragColor = (vec4(pixel)/vec4(colorsizedest)) * (vec4(dest)/vec4(colorsizedest));\n";
 static const char op_destout[] = "FragColor = vec4(pixel)/vec4(colorsizedest);\n";
 static const char op_destoutcolor[] = "FragColor = color;\n";
 static const char op_destoutyuvrgb[] = "FragColor = yuvatorgba(vec4(pixel)/vec4(colorsizedest));\n";
@@ -874,10 +891,14 @@ void ShaderGen2D_Init(ShaderGen2D *gen, glExtensions *ext, ShaderManager *shader
 	gen->ext = ext;
 	gen->shaders = shaderman;
 	gen->shadercount = 0;
-	gen->genindex = 0;
-	gen->maxshaders = 256;
-	gen->genshaders2D = (GenShader2D *)malloc(256 * sizeof(GenShader2D));
-	ZeroMemory(gen->genshaders2D, 256 * sizeof(GenShader2D));
+	gen->maxshaders = GENSHADER2D_MAXSHADERS;
+	gen->compiles = 0;
+	gen->genshaders2D = (GenShader2D *)malloc(GENSHADER2D_MAXSHADERS * sizeof(GenShader2D));
+	ZeroMemory(gen->genshaders2D, GENSHADER2D_MAXSHADERS * sizeof(GenShader2D));
+	// Keep the table at most half full so probe sequences stay short
+	gen->hashmask = (GENSHADER2D_MAXSHADERS * 2) - 1;
+	gen->hashtable = (int *)malloc(GENSHADER2D_MAXSHADERS * 2 * sizeof(int));
+	memset(gen->hashtable, 0xff, GENSHADER2D_MAXSHADERS * 2 * sizeof(int));
 }
 
 void ShaderGen2D_Delete(ShaderGen2D *gen)
@@ -895,8 +916,109 @@ void ShaderGen2D_Delete(ShaderGen2D *gen)
 	}
 	if (gen->genshaders2D) free(gen->genshaders2D);
 	gen->genshaders2D = NULL;
+	if (gen->hashtable) free(gen->hashtable);
+	gen->hashtable = NULL;
 	gen->shadercount = 0;
-	gen->genindex = 0;
+}
+
+static int ShaderGen2D_Hash(__int64 id)
+{
+	unsigned __int64 hash = (unsigned __int64)id * 0x9E3779B97F4A7C15ULL;
+	return (int)(hash >> 32);
+}
+
+/**
+  * Removes a shader from the hash table, shifting later entries of the same
+  * probe sequence back so lookups never need tombstones.
+  * @param gen
+  *  Pointer to ShaderGen2D structure
+  * @param index
+  *  Index of the shader in the shader array
+  */
+static void ShaderGen2D_RemoveHash(ShaderGen2D *gen, int index)
+{
+	int slot = ShaderGen2D_Hash(gen->genshaders2D[index].id) & gen->hashmask;
+	int next, home;
+	while (gen->hashtable[slot] != index)
+	{
+		if (gen->hashtable[slot] == -1) return;
+		slot = (slot + 1) & gen->hashmask;
+	}
+	next = slot;
+	while (1)
+	{
+		next = (next + 1) & gen->hashmask;
+		if (gen->hashtable[next] == -1) break;
+		home = ShaderGen2D_Hash(gen->genshaders2D[gen->hashtable[next]].id) & gen->hashmask;
+		// Move the entry back if its home slot is not between the hole and its position
+		if (((next > slot) && ((home <= slot) || (home > next))) ||
+			((next < slot) && ((home <= slot) && (home > next))))
+		{
+			gen->hashtable[slot] = gen->hashtable[next];
+			slot = next;
+		}
+	}
+	gen->hashtable[slot] = -1;
+}
+
+/**
+  * Looks up a generated 2D shader, creating it if it does not exist.  When the
+  * cache is full the least recently used shader is deleted to make room.
+  * @param gen
+  *  Pointer to ShaderGen2D structure
+  * @param id
+  *  ID of the 2D shader
+  * @param frame
+  *  Current frame number, used to track the last use of each shader
+  * @return
+  *  Pointer to the shader, or NULL if it could not be added
+  */
+GenShader2D *ShaderGen2D_GetShader2D(ShaderGen2D *gen, __int64 id, DWORD frame)
+{
+	int slot;
+	int index;
+	int i;
+	DWORD oldest;
+	if (!gen->genshaders2D || !gen->hashtable) return NULL;
+	slot = ShaderGen2D_Hash(id) & gen->hashmask;
+	while (gen->hashtable[slot] != -1)
+	{
+		if (gen->genshaders2D[gen->hashtable[slot]].id == id)
+		{
+			gen->genshaders2D[gen->hashtable[slot]].lastused = frame;
+			return &gen->genshaders2D[gen->hashtable[slot]];
+		}
+		slot = (slot + 1) & gen->hashmask;
+	}
+	if (gen->shadercount < gen->maxshaders) index = gen->shadercount++;
+	else
+	{
+		index = 0;
+		oldest = frame - gen->genshaders2D[0].lastused;
+		for (i = 1; i < gen->shadercount; i++)
+		{
+			if ((frame - gen->genshaders2D[i].lastused) > oldest)
+			{
+				oldest = frame - gen->genshaders2D[i].lastused;
+				index = i;
+			}
+		}
+		ShaderGen2D_RemoveHash(gen, index);
+		gen->ext->glUseProgram(0);
+		if (gen->genshaders2D[index].shader.prog) gen->ext->glDeleteProgram(gen->genshaders2D[index].shader.prog);
+		if (gen->genshaders2D[index].shader.vs) gen->ext->glDeleteShader(gen->genshaders2D[index].shader.vs);
+		if (gen->genshaders2D[index].shader.fs) gen->ext->glDeleteShader(gen->genshaders2D[index].shader.fs);
+		String_Free(&gen->genshaders2D[index].shader.vsrc);
+		String_Free(&gen->genshaders2D[index].shader.fsrc);
+		ZeroMemory(&gen->genshaders2D[index], sizeof(GenShader2D));
+		// The removal may have shifted entries into the probe sequence
+		slot = ShaderGen2D_Hash(id) & gen->hashmask;
+		while (gen->hashtable[slot] != -1) slot = (slot + 1) & gen->hashmask;
+	}
+	ShaderGen2D_CreateShader2D(gen, index, id);
+	gen->genshaders2D[index].lastused = frame;
+	gen->hashtable[slot] = index;
+	return &gen->genshaders2D[index];
 }
 
 /**
@@ -946,31 +1068,31 @@ static void glslver(STRING* str, int major, int minor)
 		switch (minor)
 		{
 		case 0:
-			String_Append(str, version_110);
-			String_Append(str, ext_texrect);
+			String_AppendConst(str, version_110);
+			String_AppendConst(str, ext_texrect);
 			break;
 		case 1:
 		default:
-			String_Append(str, version_120);
-			String_Append(str, ext_texrect);
+			String_AppendConst(str, version_120);
+			String_AppendConst(str, ext_texrect);
 		}
 		break;
 	case 3:
 		switch (minor)
 		{
 		case 0:
-			String_Append(str, version_130);
-			String_Append(str, ext_texrect);
+			String_AppendConst(str, version_130);
+			String_AppendConst(str, ext_texrect);
 			break;
 		case 1:
-			String_Append(str, version_140);
+			String_AppendConst(str, version_140);
 			break;
 		case 2:
-			String_Append(str, version_150);
+			String_AppendConst(str, version_150);
 			break;
 		case 3:
 		default:
-			String_Append(str, version_330);
+			String_AppendConst(str, version_330);
 			break;
 		}
 		break;
@@ -978,42 +1100,78 @@ static void glslver(STRING* str, int major, int minor)
 		switch (minor)
 		{
 		case 0:
-			String_Append(str, version_400);
+			String_AppendConst(str, version_400);
 			break;
 		case 1:
-			String_Append(str, version_410);
+			String_AppendConst(str, version_410);
 			break;
 		case 2:
-			String_Append(str, version_420);
+			String_AppendConst(str, version_420);
 			break;
 		case 3:
-			String_Append(str, version_430);
+			String_AppendConst(str, version_430);
 			break;
 		case 4:
-			String_Append(str, version_440);
+			String_AppendConst(str, version_440);
 			break;
 		case 5:
-			String_Append(str, version_450);
+			String_AppendConst(str, version_450);
 			break;
 		case 6:
 		default:
-			String_Append(str, version_460);
+			String_AppendConst(str, version_460);
 			break;
 		}
 		break;
 	default:
-		if (major > 4) String_Append(str, version_460);
-		else String_Append(str, version_110);
+		if (major > 4) String_AppendConst(str, version_460);
+		else String_AppendConst(str, version_110);
 		break;
 	}
 }
 
+/**
+  * Looks up the attribute and uniform locations of a linked 2D shader.
+  * @param gen
+  *  Pointer to ShaderGen2D structure
+  * @param index
+  *  Index of the shader in the shader array
+  */
+static void ShaderGen2D_GetLocations(ShaderGen2D *gen, int index)
+{
+	gen->genshaders2D[index].shader.attribs[0] = gen->ext->glGetAttribLocation(gen->genshaders2D[index].shader.prog, "xy");
+	gen->genshaders2D[index].shader.attribs[1] = gen->ext->glGetAttribLocation(gen->genshaders2D[index].shader.prog, "rgb");
+	gen->genshaders2D[index].shader.attribs[2] = gen->ext->glGetAttribLocation(gen->genshaders2D[index].shader.prog, "rgba");
+	gen->genshaders2D[index].shader.attribs[3] = gen->ext->glGetAttribLocation(gen->genshaders2D[index].shader.prog, "srcst");
+	gen->genshaders2D[index].shader.attribs[4] = gen->ext->glGetAttribLocation(gen->genshaders2D[index].shader.prog, "destst");
+	gen->genshaders2D[index].shader.attribs[5] = gen->ext->glGetAttribLocation(gen->genshaders2D[index].shader.prog, "stencilst");
+	gen->genshaders2D[index].shader.uniforms[0] = gen->ext->glGetUniformLocation(gen->genshaders2D[index].shader.prog, "view");
+	gen->genshaders2D[index].shader.uniforms[1] = gen->ext->glGetUniformLocation(gen->genshaders2D[index].shader.prog, "srctex");
+	gen->genshaders2D[index].shader.uniforms[2] = gen->ext->glGetUniformLocation(gen->genshaders2D[index].shader.prog, "desttex");
+	gen->genshaders2D[index].shader.uniforms[3] = gen->ext->glGetUniformLocation(gen->genshaders2D[index].shader.prog, "patterntex");
+	gen->genshaders2D[index].shader.uniforms[4] = gen->ext->glGetUniformLocation(gen->genshaders2D[index].shader.prog, "stenciltex");
+	gen->genshaders2D[index].shader.uniforms[5] = gen->ext->glGetUniformLocation(gen->genshaders2D[index].shader.prog, "ckeysrc");
+	gen->genshaders2D[index].shader.uniforms[6] = gen->ext->glGetUniformLocation(gen->genshaders2D[index].shader.prog, "ckeydest");
+	gen->genshaders2D[index].shader.uniforms[7] = gen->ext->glGetUniformLocation(gen->genshaders2D[index].shader.prog, "ckeysrchigh");
+	gen->genshaders2D[index].shader.uniforms[8] = gen->ext->glGetUniformLocation(gen->genshaders2D[index].shader.prog, "ckeydesthigh");
+	gen->genshaders2D[index].shader.uniforms[9] = gen->ext->glGetUniformLocation(gen->genshaders2D[index].shader.prog, "patternsize");
+	gen->genshaders2D[index].shader.uniforms[10] = gen->ext->glGetUniformLocation(gen->genshaders2D[index].shader.prog, "colorsizesrc");
+	gen->genshaders2D[index].shader.uniforms[11] = gen->ext->glGetUniformLocation(gen->genshaders2D[index].shader.prog, "colorsizedest");
+	gen->genshaders2D[index].shader.uniforms[12] = gen->ext->glGetUniformLocation(gen->genshaders2D[index].shader.prog, "fillcolor");
+	gen->genshaders2D[index].shader.uniforms[13] = gen->ext->glGetUniformLocation(gen->genshaders2D[index].shader.prog, "srcpal");
+	gen->genshaders2D[index].shader.uniforms[14] = gen->ext->glGetUniformLocation(gen->genshaders2D[index].shader.prog, "destpal");
+	// Uniforms are zero after linking, which a zeroed shadow copy matches
+	ZeroMemory(gen->genshaders2D[index].shader.shadow, 16 * 4 * sizeof(GLfloat));
+}
+
 void ShaderGen2D_CreateShader2D(ShaderGen2D *gen, int index, __int64 id)
 {
 	STRING tmp;
 	DWORD rop;
 	BOOL intproc = FALSE;
 	BOOL usedest = FALSE;
+	BOOL fetchdest = (id >> 49) & 1;
+	BOOL introp = (id >> 50) & 1;
 	char idstring[30];
 	STRING *vsrc;
 	STRING *fsrc;
@@ -1033,10 +1191,20 @@ void ShaderGen2D_CreateShader2D(ShaderGen2D *gen, int index, __int64 id)
 	gen->genshaders2D[index].shader.fsrc.ptr = NULL;
 	_snprintf(idstring, 29, "%0.16I64X\n", id);
 	idstring[29] = 0;
+	// Skip generating and compiling the shader if a cached binary loads
+	gen->genshaders2D[index].shader.prog = ShaderCache_LoadProgram(gen->shaders->cache, SHADERCACHE_TYPE2D, id, NULL);
+	if (gen->genshaders2D[index].shader.prog)
+	{
+		gen->genshaders2D[index].shader.vs = gen->genshaders2D[index].shader.fs = 0;
+		ShaderGen2D_GetLocations(gen, index);
+		gen->genshaders2D[index].id = id;
+		return;
+	}
+	gen->compiles++;
 	// Create vertex shader
 	// Header
 	vsrc = &gen->genshaders2D[index].shader.vsrc;
-	String_Append(vsrc, revheader);
+	String_AppendConst(vsrc, revheader);
 	glslver(vsrc, gen->ext->glver_major, gen->ext->glver_minor);
 	if (id & DDBLT_ROP)
 	{
@@ -1051,11 +1219,11 @@ void ShaderGen2D_CreateShader2D(ShaderGen2D *gen, int index, __int64 id)
 		}
 		else if (gen->ext->GLEXT_EXT_gpu_shader4)
 		{
-			String_Append(vsrc, ext_shader4);
+			String_AppendConst(vsrc, ext_shader4);
 			intproc = TRUE;
 		}
 	}
-	String_Append(vsrc, idheader);
+	String_AppendConst(vsrc, idheader);
 	String_Append(vsrc, idstring);
 
 	// Attributes
@@ -1066,11 +1234,13 @@ void ShaderGen2D_CreateShader2D(ShaderGen2D *gen, int index, __int64 id)
 		if (rop_texture_usage[rop] & 2) usedest = TRUE;
 	}
 	if (id & DDBLT_KEYDEST) usedest = TRUE;
+	// Framebuffer fetch reads the destination without texture coordinates
+	if (fetchdest) usedest = FALSE;
 	if (usedest) append_attr(vsrc, attr_destst, gen->ext->glver_major);
 	if (id & 0x10000000) append_attr(vsrc, attr_stencilst, gen->ext->glver_major);
 
 	// Uniforms
-	String_Append(vsrc, unif_view);
+	String_AppendConst(vsrc, unif_view);
 
 	// Variables
 	if (!(id & DDBLT_COLORFILL)) append_varying(vsrc, var_texcoord, gen->ext->glver_major, FALSE, TRUE);
@@ -1078,12 +1248,12 @@ void ShaderGen2D_CreateShader2D(ShaderGen2D *gen, int index, __int64 id)
 	if (id & 0x10000000) append_varying(vsrc, var_stencilcoord, gen->ext->glver_major, FALSE, TRUE);
 
 	// Main
-	String_Append(vsrc, mainstart);
-	String_Append(vsrc, op_vertex);
-	if (!(id & DDBLT_COLORFILL)) String_Append(vsrc, op_texcoord0);
-	if(usedest) String_Append(vsrc, op_texcoord1);
-	if (id & 0x10000000) String_Append(vsrc, op_texcoord3);
-	String_Append(vsrc, mainend);
+	String_AppendConst(vsrc, mainstart);
+	String_AppendConst(vsrc, op_vertex);
+	if (!(id & DDBLT_COLORFILL)) String_AppendConst(vsrc, op_texcoord0);
+	if(usedest) String_AppendConst(vsrc, op_texcoord1);
+	if (id & 0x10000000) String_AppendConst(vsrc, op_texcoord3);
+	String_AppendConst(vsrc, mainend);
 #ifdef _DEBUG
 	OutputDebugStringA("2D blitter vertex shader:\n");
 	OutputDebugStringA(vsrc->ptr);
@@ -1093,7 +1263,7 @@ void ShaderGen2D_CreateShader2D(ShaderGen2D *gen, int index, __int64 id)
 	TRACE_STRING("\nCompiling 2D blitter vertex shader:\n");
 #endif
 	gen->genshaders2D[index].shader.vs = gen->ext->glCreateShader(GL_VERTEX_SHADER);
-	srclen = strlen(vsrc->ptr);
+	srclen = (GLint)vsrc->length;
 	gen->ext->glShaderSource(gen->genshaders2D[index].shader.vs, 1, &vsrc->ptr, &srclen);
 	gen->ext->glCompileShader(gen->genshaders2D[index].shader.vs);
 	infolog = NULL;
@@ -1114,7 +1284,7 @@ void ShaderGen2D_CreateShader2D(ShaderGen2D *gen, int index, __int64 id)
 	usedest = FALSE;
 	// Create fragment shader
 	fsrc = &gen->genshaders2D[index].shader.fsrc;
-	String_Append(fsrc, revheader);
+	String_AppendConst(fsrc, revheader);
 	glslver(fsrc, gen->ext->glver_major, gen->ext->glver_minor);
 	if (id & DDBLT_ROP)
 	{
@@ -1129,10 +1299,11 @@ void ShaderGen2D_CreateShader2D(ShaderGen2D *gen, int index, __int64 id)
 		}
 		else if (gen->ext->GLEXT_EXT_gpu_shader4)
 		{
-			String_Append(fsrc, ext_shader4);
+			String_AppendConst(fsrc, ext_shader4);
 			intproc = TRUE;
 		}
 	}
+	if (fetchdest) String_AppendConst(fsrc, ext_fbfetch);
 	switch (srctype)
 	{
 	default:
@@ -1142,10 +1313,10 @@ void ShaderGen2D_CreateShader2D(ShaderGen2D *gen, int index, __int64 id)
 	case 0x80:
 	case 0x81:
 	case 0x82:
-//		String_Append(fsrc, ext_texrect);
+//		String_AppendConst(fsrc, ext_texrect);
 		break;
 	}
-	String_Append(fsrc, idheader);
+	String_AppendConst(fsrc, idheader);
 	String_Append(fsrc, idstring);
 
 	// Constants
@@ -1159,7 +1330,7 @@ void ShaderGen2D_CreateShader2D(ShaderGen2D *gen, int index, __int64 id)
 	case 0x82:
 	case 0x83:
 		if ((desttype >= 0x80) && (desttype <= 0x83)) break;
-		String_Append(fsrc, const_bt601_coeff);
+		String_AppendConst(fsrc, const_bt601_coeff);
 		break;			
 	}
 
@@ -1173,12 +1344,13 @@ void ShaderGen2D_CreateShader2D(ShaderGen2D *gen, int index, __int64 id)
 	case 0x82:
 	case 0x83:
 		if ((srctype >= 0x80) && (srctype <= 0x83)) break;
-		String_Append(fsrc, const_bt601_coeff_inv);
+		String_AppendConst(fsrc, const_bt601_coeff_inv);
 		break;
 	}
 
 	// Uniforms
-	if (id & DDBLT_COLORFILL) String_Append(fsrc, unif_fillcolor);
+	if (id & DDBLT_COLORFILL) String_AppendConst(fsrc, unif_fillcolor);
+	else if (introp) String_AppendConst(fsrc, unif_srctexint);
 	else
 	{
 		switch (srctype)
@@ -1188,11 +1360,11 @@ void ShaderGen2D_CreateShader2D(ShaderGen2D *gen, int index, __int64 id)
 		case 0x80:
 		case 0x81:
 		case 0x82:
-			String_Append(fsrc, unif_srctexrect);
+			String_AppendConst(fsrc, unif_srctexrect);
 			break;
 		case 0x83:
 		default:
-			String_Append(fsrc, unif_srctex);
+			String_AppendConst(fsrc, unif_srctex);
 			break;
 		}
 	}
@@ -1202,23 +1374,27 @@ void ShaderGen2D_CreateShader2D(ShaderGen2D *gen, int index, __int64 id)
 		if (rop_texture_usage[rop] & 2) usedest = TRUE;
 		if (rop_texture_usage[rop] & 4)
 		{
-			String_Append(fsrc, unif_patterntex);
-			String_Append(fsrc, unif_patternsize);
+			if (introp) String_AppendConst(fsrc, unif_patterntexint);
+			else String_AppendConst(fsrc, unif_patterntex);
+			String_AppendConst(fsrc, unif_patternsize);
 		}
 	}
-	if (usedest) String_Append(fsrc, unif_desttex);
-	if (id & 0x10000000) String_Append(fsrc, unif_stenciltex);
+	if (usedest && introp) String_AppendConst(fsrc, unif_desttexint);
+	else if (usedest && !fetchdest) String_AppendConst(fsrc, unif_desttex);
+	if (id & 0x10000000) String_AppendConst(fsrc, unif_stenciltex);
 	if (id & DDBLT_KEYSRC)
 	{
-		String_Append(fsrc, unif_ckeysrc);
-		if (id & 0x20000000) String_Append(fsrc, unif_ckeysrchigh);
-		String_Append(fsrc, unif_colorsizesrc);
+		String_AppendConst(fsrc, unif_ckeysrc);
+		if (id & 0x20000000) String_AppendConst(fsrc, unif_ckeysrchigh);
+		String_AppendConst(fsrc, unif_colorsizesrc);
 	}
-	String_Append(fsrc, unif_colorsizedest);
+	// 8-bit palette indices need no per-surface color sizes
+	if (introp) String_AppendConst(fsrc, const_colorsizedest8);
+	else String_AppendConst(fsrc, unif_colorsizedest);
 	if (id & DDBLT_KEYDEST)
 	{
-		String_Append(fsrc, unif_ckeydest);
-		if (id & 0x40000000) String_Append(fsrc, unif_ckeydesthigh);
+		String_AppendConst(fsrc, unif_ckeydest);
+		if (id & 0x40000000) String_AppendConst(fsrc, unif_ckeydesthigh);
 	}
 	switch (srctype2)
 	{
@@ -1228,66 +1404,67 @@ void ShaderGen2D_CreateShader2D(ShaderGen2D *gen, int index, __int64 id)
 	case 0x11:
 	case 0x12:
 	case 0x13:
-		String_Append(fsrc, unif_srcpal);
+		String_AppendConst(fsrc, unif_srcpal);
 		break;
 	}
 
 	// Variables
-	if (id & 0x80000000) String_Append(fsrc, var_color);
-	else String_Append(fsrc, var_pixel);
-	if (id & DDBLT_KEYSRC) String_Append(fsrc, var_src);
+	if (id & 0x80000000) String_AppendConst(fsrc, var_color);
+	else String_AppendConst(fsrc, var_pixel);
+	if (id & DDBLT_KEYSRC) String_AppendConst(fsrc, var_src);
 	if (id & DDBLT_ROP)
 	{
 		if (rop_texture_usage[rop] & 4)
 		{
-			String_Append(fsrc, var_pattern);
-			String_Append(fsrc, var_patternst);
+			String_AppendConst(fsrc, var_pattern);
+			String_AppendConst(fsrc, var_patternst);
 		}
 	}
-	if (usedest) String_Append(fsrc, var_dest);
+	if (usedest) String_AppendConst(fsrc, var_dest);
 	if (!(id & DDBLT_COLORFILL)) append_varying(fsrc, var_texcoord, gen->ext->glver_major, TRUE, TRUE);
-	if (usedest) append_varying(fsrc, var_destcoord, gen->ext->glver_major, TRUE, TRUE);
+	if (usedest && !fetchdest) append_varying(fsrc, var_destcoord, gen->ext->glver_major, TRUE, TRUE);
 	if (id & 0x10000000) append_varying(fsrc, var_stencilcoord, gen->ext->glver_major, TRUE, TRUE);
-	if (gen->ext->glver_major >= 3) String_Append(fsrc, out_fragcolor);
-	else String_Append(fsrc, var_fragcolor);
+	if ((gen->ext->glver_major >= 3) && fetchdest) String_AppendConst(fsrc, inout_fragcolor);
+	else if (gen->ext->glver_major >= 3) String_AppendConst(fsrc, out_fragcolor);
+	else String_AppendConst(fsrc, var_fragcolor);
 
 	// Functions
 	if (gen->ext->glver_major >= 3)
 	{
-		String_Append(fsrc, func_tex2d_gl3);
-		String_Append(fsrc, func_tex2drect_gl3);
+		String_AppendConst(fsrc, func_tex2d_gl3);
+		String_AppendConst(fsrc, func_tex2drect_gl3);
 	}
 	else
 	{
-		String_Append(fsrc, func_tex2d_gl2);
-		String_Append(fsrc, func_tex2drect_gl2);
+		String_AppendConst(fsrc, func_tex2d_gl2);
+		String_AppendConst(fsrc, func_tex2drect_gl2);
 	}
 	switch (srctype)
 	{
 	case 0x20:
-		String_Append(fsrc, func_readrgbg_nearest);
+		String_AppendConst(fsrc, func_readrgbg_nearest);
 		break;
 	case 0x21:
-		String_Append(fsrc, func_readgrgb_nearest);
+		String_AppendConst(fsrc, func_readgrgb_nearest);
 		break;
 	case 0x80:
-		String_Append(fsrc, func_readuyvy_nearest);
+		String_AppendConst(fsrc, func_readuyvy_nearest);
 		if ((desttype >= 0x80) && (desttype <= 0x83)) break;
-		String_Append(fsrc, func_yuvatorgba);
+		String_AppendConst(fsrc, func_yuvatorgba);
 		break;
 	case 0x81:
-		String_Append(fsrc, func_readyuyv_nearest);
+		String_AppendConst(fsrc, func_readyuyv_nearest);
 		if ((desttype >= 0x80) && (desttype <= 0x83)) break;
-		String_Append(fsrc, func_yuvatorgba);
+		String_AppendConst(fsrc, func_yuvatorgba);
 		break;
 	case 0x82:
-		String_Append(fsrc, func_readyvyu_nearest);
+		String_AppendConst(fsrc, func_readyvyu_nearest);
 		if ((desttype >= 0x80) && (desttype <= 0x83)) break;
-		String_Append(fsrc, func_yuvatorgba);
+		String_AppendConst(fsrc, func_yuvatorgba);
 		break;
 	case 0x83:
 		if ((desttype >= 0x80) && (desttype <= 0x83)) break;
-		String_Append(fsrc, func_yuvatorgba);
+		String_AppendConst(fsrc, func_yuvatorgba);
 		break;
 	default:
 		break;
@@ -1307,16 +1484,17 @@ void ShaderGen2D_CreateShader2D(ShaderGen2D *gen, int index, __int64 id)
 		break;
 	case 0x83:
 		if ((srctype >= 0x80) && (srctype <= 0x83)) break;
-		String_Append(fsrc, func_rgbatoyuva);
+		String_AppendConst(fsrc, func_rgbatoyuva);
 		break;
 	default:
 		break;
 	}
 
 	// Main
-	String_Append(fsrc, mainstart);
-	if (id & 0x10000000) String_Append(fsrc, op_clip);
-	if (id & DDBLT_COLORFILL) String_Append(fsrc, op_fillcolor);
+	String_AppendConst(fsrc, mainstart);
+	if (id & 0x10000000) String_AppendConst(fsrc, op_clip);
+	if (id & DDBLT_COLORFILL) String_AppendConst(fsrc, op_fillcolor);
+	else if (introp) String_AppendConst(fsrc, op_pixelint);
 	else
 	{
 		switch (srctype)
@@ -1324,75 +1502,88 @@ void ShaderGen2D_CreateShader2D(ShaderGen2D *gen, int index, __int64 id)
 		case 0x00:  // Classic RGB
 		case 0x83:  // AYUV
 		default:
-			if (id & 0x80000000) String_Append(fsrc, op_color);
-			else String_Append(fsrc, op_pixel);
+			if (id & 0x80000000) String_AppendConst(fsrc, op_color);
+			else String_AppendConst(fsrc, op_pixel);
 			break;
 		case 0x01:
 		case 0x02:
-			if (id & 0x80000000) String_Append(fsrc, op_lumcolor);
-			else String_Append(fsrc, op_lumpixel);
+			if (id & 0x80000000) String_AppendConst(fsrc, op_lumcolor);
+			else String_AppendConst(fsrc, op_lumpixel);
 			break;
 		case 0x10:
 		case 0x11:
 		case 0x12:
 		case 0x13:
-			if (id & 0x80000000) String_Append(fsrc, op_palcolor);
+			if (id & 0x80000000) String_AppendConst(fsrc, op_palcolor);
 			else
 			{
-				if ((desttype >= 0x10) && (desttype <= 0x13)) String_Append(fsrc, op_pixel);
-				else String_Append(fsrc, op_palpixel);
+				if ((desttype >= 0x10) && (desttype <= 0x13)) String_AppendConst(fsrc, op_pixel);
+				else String_AppendConst(fsrc, op_palpixel);
 			}
 			break;
 		case 0x18:
 		case 0x19:
-			if (id & 0x80000000) String_Append(fsrc, op_colormul256);
-			else String_Append(fsrc, op_pixelmul256);
+			if (id & 0x80000000) String_AppendConst(fsrc, op_colormul256);
+			else String_AppendConst(fsrc, op_pixelmul256);
 			break;
 		case 0x20:
-			if (id & 0x80000000) String_Append(fsrc, op_colorrgbg);
-			else String_Append(fsrc, op_pixelrgbg);
+			if (id & 0x80000000) String_AppendConst(fsrc, op_colorrgbg);
+			else String_AppendConst(fsrc, op_pixelrgbg);
 			break;
 		case 0x21:
-			if (id & 0x80000000) String_Append(fsrc, op_colorgrgb);
-			else String_Append(fsrc, op_pixelgrgb);
+			if (id & 0x80000000) String_AppendConst(fsrc, op_colorgrgb);
+			else String_AppendConst(fsrc, op_pixelgrgb);
 			break;
 		case 0x80:
-			if (id & 0x80000000) String_Append(fsrc, op_coloruyvy);
-			else String_Append(fsrc, op_pixeluyvy);
+			if (id & 0x80000000) String_AppendConst(fsrc, op_coloruyvy);
+			else String_AppendConst(fsrc, op_pixeluyvy);
 			break;
 		case 0x81:
-			if (id & 0x80000000) String_Append(fsrc, op_coloryuyv);
-			else String_Append(fsrc, op_pixelyuyv);
+			if (id & 0x80000000) String_AppendConst(fsrc, op_coloryuyv);
+			else String_AppendConst(fsrc, op_pixelyuyv);
 			break;
 		case 0x82:
-			if (id & 0x80000000) String_Append(fsrc, op_coloryvyu);
-			else String_Append(fsrc, op_pixelyvyu);
+			if (id & 0x80000000) String_AppendConst(fsrc, op_coloryvyu);
+			else String_AppendConst(fsrc, op_pixelyvyu);
 			break;
 		}
 	}
-	if (id & DDBLT_KEYSRC) String_Append(fsrc, op_src);
-	if (usedest) String_Append(fsrc, op_dest);
+	if (id & DDBLT_KEYSRC) String_AppendConst(fsrc, op_src);
+	if (usedest)
+	{
+		if (introp) String_AppendConst(fsrc, op_destint);
+		else if (!fetchdest) String_AppendConst(fsrc, op_dest);
+		else if (gen->ext->glver_major >= 3) String_AppendConst(fsrc, op_destfetch);
+		else String_AppendConst(fsrc, op_destfetchgl2);
+	}
 	if (id & DDBLT_KEYSRC)
 	{
-		if (id & 0x20000000) String_Append(fsrc, op_ckeysrcrange);
-		else String_Append(fsrc, op_ckeysrc);
+		if (id & 0x20000000) String_AppendConst(fsrc, op_ckeysrcrange);
+		else String_AppendConst(fsrc, op_ckeysrc);
 	}
 	if (id & DDBLT_KEYDEST)
 	{
 		if (!dxglcfg.DebugBlendDestColorKey)
 		{
-			if (id & 0x40000000) String_Append(fsrc, op_ckeydestrange);
-			else String_Append(fsrc, op_ckeydest);
+			if (id & 0x40000000) String_AppendConst(fsrc, op_ckeydestrange);
+			else String_AppendConst(fsrc, op_ckeydest);
 		}
 	}
 	if (id & DDBLT_ROP)
 	{
-		if (rop_texture_usage[rop] & 4) String_Append(fsrc, op_pattern);
+		if (rop_texture_usage[rop] & 4)
+		{
+			if (introp) String_AppendConst(fsrc, op_patternint);
+			else String_AppendConst(fsrc, op_pattern);
+		}
 		if (intproc) String_Append(fsrc, op_ROP[rop]);
 		else String_Append(fsrc, op_ROP_float[rop]);
 	}
 	if (dxglcfg.DebugBlendDestColorKey && (id & DDBLT_KEYDEST))
-		String_Append(fsrc, op_destoutdestblend);
+	{
+		if (fetchdest) String_AppendConst(fsrc, op_destoutdestblendfetch);
+		else String_AppendConst(fsrc, op_destoutdestblend);
+	}
 	else
 	{
 		switch (srctype)
@@ -1406,58 +1597,58 @@ void ShaderGen2D_CreateShader2D(ShaderGen2D *gen, int index, __int64 id)
 			{
 			case 0:
 			default:
-				if (id & 0x80000000) String_Append(fsrc, op_destoutcolor);
-				else String_Append(fsrc, op_destout);
+				if (id & 0x80000000) String_AppendConst(fsrc, op_destoutcolor);
+				else String_AppendConst(fsrc, op_destout);
 				break;
 			case 0x83:
-				String_Append(fsrc, op_destoutrgbyuv);
+				String_AppendConst(fsrc, op_destoutrgbyuv);
 				break;
 			}
 			break;
 		case 0x80:
 			if ((desttype >= 0x80) && (desttype <= 0x83))
-				String_Append(fsrc, op_destout);
+				String_AppendConst(fsrc, op_destout);
 			else
 			{
-				if (id & 0x80000000) String_Append(fsrc, op_destoutyuvrgbcolor);
-				else String_Append(fsrc, op_destoutyuvrgb);
+				if (id & 0x80000000) String_AppendConst(fsrc, op_destoutyuvrgbcolor);
+				else String_AppendConst(fsrc, op_destoutyuvrgb);
 			}
 			break;
 		case 0x81:
 			if ((desttype >= 0x80) && (desttype <= 0x83))
-				String_Append(fsrc, op_destout);
+				String_AppendConst(fsrc, op_destout);
 			else
 			{
-				if (id & 0x80000000) String_Append(fsrc, op_destoutyuvrgbcolor);
-				else String_Append(fsrc, op_destoutyuvrgb);
+				if (id & 0x80000000) String_AppendConst(fsrc, op_destoutyuvrgbcolor);
+				else String_AppendConst(fsrc, op_destoutyuvrgb);
 			}
 			break;
 		case 0x82:
 			if ((desttype >= 0x80) && (desttype <= 0x83))
-				String_Append(fsrc, op_destout);
+				String_AppendConst(fsrc, op_destout);
 			else
 			{
-				if (id & 0x80000000) String_Append(fsrc, op_destoutyuvrgbcolor);
-				else String_Append(fsrc, op_destoutyuvrgb);
+				if (id & 0x80000000) String_AppendConst(fsrc, op_destoutyuvrgbcolor);
+				else String_AppendConst(fsrc, op_destoutyuvrgb);
 			}
 			break;
 		case 0x83:
 			if ((desttype >= 0x80) && (desttype <= 0x83))
-				String_Append(fsrc, op_destout);
+				String_AppendConst(fsrc, op_destout);
 			else
 			{
-				if (id & 0x80000000) String_Append(fsrc, op_destoutyuvrgbcolor);
-				else String_Append(fsrc, op_destoutyuvrgb);
+				if (id & 0x80000000) String_AppendConst(fsrc, op_destoutyuvrgbcolor);
+				else String_AppendConst(fsrc, op_destoutyuvrgb);
 			}
 			break;
 		default:
-			if (id & 0x80000000)String_Append(fsrc, op_destoutcolor);
-			else String_Append(fsrc, op_destout);
+			if (id & 0x80000000)String_AppendConst(fsrc, op_destoutcolor);
+			else String_AppendConst(fsrc, op_destout);
 			break;
 		}
 	}
-	if (gen->ext->glver_major < 3) String_Append(fsrc, op_destoutgl2);
-	String_Append(fsrc, mainend);
+	if (gen->ext->glver_major < 3) String_AppendConst(fsrc, op_destoutgl2);
+	String_AppendConst(fsrc, mainend);
 #ifdef _DEBUG
 	OutputDebugStringA("2D blitter fragment shader:\n");
 	OutputDebugStringA(fsrc->ptr);
@@ -1467,7 +1658,7 @@ void ShaderGen2D_CreateShader2D(ShaderGen2D *gen, int index, __int64 id)
 	TRACE_STRING("\nCompiling 2D blitter fragment shader:\n");
 #endif
 	gen->genshaders2D[index].shader.fs = gen->ext->glCreateShader(GL_FRAGMENT_SHADER);
-	srclen = strlen(fsrc->ptr);
+	srclen = (GLint)fsrc->length;
 	gen->ext->glShaderSource(gen->genshaders2D[index].shader.fs, 1, &fsrc->ptr, &srclen);
 	gen->ext->glCompileShader(gen->genshaders2D[index].shader.fs);
 	gen->ext->glGetShaderiv(gen->genshaders2D[index].shader.fs, GL_COMPILE_STATUS, &result);
@@ -1487,6 +1678,7 @@ void ShaderGen2D_CreateShader2D(ShaderGen2D *gen, int index, __int64 id)
 	gen->genshaders2D[index].shader.prog = gen->ext->glCreateProgram();
 	gen->ext->glAttachShader(gen->genshaders2D[index].shader.prog, gen->genshaders2D[index].shader.vs);
 	gen->ext->glAttachShader(gen->genshaders2D[index].shader.prog, gen->genshaders2D[index].shader.fs);
+	ShaderCache_PrepareProgram(gen->shaders->cache, gen->genshaders2D[index].shader.prog);
 	gen->ext->glLinkProgram(gen->genshaders2D[index].shader.prog);
 	gen->ext->glGetProgramiv(gen->genshaders2D[index].shader.prog, GL_LINK_STATUS, &result);
 #ifdef _DEBUG
@@ -1502,27 +1694,7 @@ void ShaderGen2D_CreateShader2D(ShaderGen2D *gen, int index, __int64 id)
 		free(infolog);
 	}
 #endif
-	gen->genshaders2D[index].shader.attribs[0] = gen->ext->glGetAttribLocation(gen->genshaders2D[index].shader.prog, "xy");
-	gen->genshaders2D[index].shader.attribs[1] = gen->ext->glGetAttribLocation(gen->genshaders2D[index].shader.prog, "rgb");
-	gen->genshaders2D[index].shader.attribs[2] = gen->ext->glGetAttribLocation(gen->genshaders2D[index].shader.prog, "rgba");
-	gen->genshaders2D[index].shader.attribs[3] = gen->ext->glGetAttribLocation(gen->genshaders2D[index].shader.prog, "srcst");
-	gen->genshaders2D[index].shader.attribs[4] = gen->ext->glGetAttribLocation(gen->genshaders2D[index].shader.prog, "destst");
-	gen->genshaders2D[index].shader.attribs[5] = gen->ext->glGetAttribLocation(gen->genshaders2D[index].shader.prog, "stencilst");
-	gen->genshaders2D[index].shader.uniforms[0] = gen->ext->glGetUniformLocation(gen->genshaders2D[index].shader.prog, "view");
-	gen->genshaders2D[index].shader.uniforms[1] = gen->ext->glGetUniformLocation(gen->genshaders2D[index].shader.prog, "srctex");
-	gen->genshaders2D[index].shader.uniforms[2] = gen->ext->glGetUniformLocation(gen->genshaders2D[index].shader.prog, "desttex");
-	gen->genshaders2D[index].shader.uniforms[3] = gen->ext->glGetUniformLocation(gen->genshaders2D[index].shader.prog, "patterntex");
-	gen->genshaders2D[index].shader.uniforms[4] = gen->ext->glGetUniformLocation(gen->genshaders2D[index].shader.prog, "stenciltex");
-	gen->genshaders2D[index].shader.uniforms[5] = gen->ext->glGetUniformLocation(gen->genshaders2D[index].shader.prog, "ckeysrc");
-	gen->genshaders2D[index].shader.uniforms[6] = gen->ext->glGetUniformLocation(gen->genshaders2D[index].shader.prog, "ckeydest");
-	gen->genshaders2D[index].shader.uniforms[7] = gen->ext->glGetUniformLocation(gen->genshaders2D[index].shader.prog, "ckeysrchigh");
-	gen->genshaders2D[index].shader.uniforms[8] = gen->ext->glGetUniformLocation(gen->genshaders2D[index].shader.prog, "ckeydesthigh");
-	gen->genshaders2D[index].shader.uniforms[9] = gen->ext->glGetUniformLocation(gen->genshaders2D[index].shader.prog, "patternsize");
-	gen->genshaders2D[index].shader.uniforms[10] = gen->ext->glGetUniformLocation(gen->genshaders2D[index].shader.prog, "colorsizesrc");
-	gen->genshaders2D[index].shader.uniforms[11] = gen->ext->glGetUniformLocation(gen->genshaders2D[index].shader.prog, "colorsizedest");
-	gen->genshaders2D[index].shader.uniforms[12] = gen->ext->glGetUniformLocation(gen->genshaders2D[index].shader.prog, "fillcolor");
-	gen->genshaders2D[index].shader.uniforms[13] = gen->ext->glGetUniformLocation(gen->genshaders2D[index].shader.prog, "srcpal");
-	gen->genshaders2D[index].shader.uniforms[14] = gen->ext->glGetUniformLocation(gen->genshaders2D[index].shader.prog, "destpal");
-
+	ShaderCache_StoreProgram(gen->shaders->cache, SHADERCACHE_TYPE2D, id, NULL, gen->genshaders2D[index].shader.prog);
+	ShaderGen2D_GetLocations(gen, index);
 	gen->genshaders2D[index].id = id;
 }
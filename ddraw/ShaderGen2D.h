@@ -34,22 +34,28 @@ typedef struct _GENSHADER2D
 	GLint prog;
 	GLint attribs[6];
 	GLint uniforms[16];
+	GLfloat shadow[16][4];  // Last values set for the uniforms
 } _GENSHADER2D;
 
 typedef struct GenShader2D
 {
 	_GENSHADER2D shader;
 	__int64 id;
+	DWORD lastused;
 } GenShader2D;
 
+#define GENSHADER2D_MAXSHADERS 1024
+
 typedef struct ShaderGen2D
 {
 	GenShader2D *genshaders2D;
+	int *hashtable;
+	int hashmask;
 	int shadercount;
 	int maxshaders;
-	int genindex;
 	glExtensions *ext;
 	ShaderManager *shaders;
+	DWORD compiles;  // Shaders generated because no cached binary loaded
 } ShaderGen2D;
 
 extern const DWORD valid_rop_codes[256];
@@ -62,6 +68,7 @@ __int64 PackROPBits(DWORD rop, __int64 flags);
 void ShaderGen2D_Init(ShaderGen2D *gen, glExtensions *ext, ShaderManager *shaderman);
 void ShaderGen2D_Delete(ShaderGen2D *gen);
 void ShaderGen2D_CreateShader2D(ShaderGen2D *gen, int index, __int64 id);
+GenShader2D *ShaderGen2D_GetShader2D(ShaderGen2D *gen, __int64 id, DWORD frame);
 
 #ifdef __cplusplus
 }
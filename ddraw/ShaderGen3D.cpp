@@ -25,6 +25,10 @@
 #include "ShaderGen3D.h"
 #include "ShaderGen2D.h"
 #include "ShaderManager.h"
+#include "ShaderCache.h"
+#include "ShaderCompiler.h"
+
+extern "C" DXGLCFG dxglcfg;
 #include "../common/version.h"
 #include "ddraw.h"
 
@@ -37,18 +41,26 @@ void ShaderGen3D_Init(glExtensions *glext, ShaderManager *shaderman, ShaderGen3D
 	gen->shaders = shaderman;
 	ZeroMemory(gen->current_texid,8*sizeof(__int64));
 	gen->shadercount = 0;
-	gen->genindex = 0;
-	gen->maxshaders = 256;
-	gen->genshaders = (GenShader*)malloc(256 * sizeof(GenShader));
-	ZeroMemory(gen->genshaders, 256 * sizeof(GenShader));
+	gen->maxshaders = GENSHADER_MAXSHADERS;
+	gen->genshaders = (GenShader*)malloc(GENSHADER_MAXSHADERS * sizeof(GenShader));
+	ZeroMemory(gen->genshaders, GENSHADER_MAXSHADERS * sizeof(GenShader));
+	gen->hashmask = (GENSHADER_MAXSHADERS * 2) - 1;
+	gen->hashtable = (int*)malloc(GENSHADER_MAXSHADERS * 2 * sizeof(int));
+	memset(gen->hashtable, 0xff, GENSHADER_MAXSHADERS * 2 * sizeof(int));
+	gen->frame = 0;
 	gen->current_shader = 0;
 	gen->current_shadertype = 0;
+	gen->switches = 0;
+	gen->compiles = 0;
+	ZeroMemory(&gen->ubershader, sizeof(GenShader));
+	if (dxglcfg.ShaderCompileMode == 3) ShaderGen3D_CreateUbershader(gen);
 }
 
 void ShaderGen3D_Delete(ShaderGen3D *This)
 {
 	ShaderGen3D_ClearShaders(This);
-	free(This->genshaders);
+	if(This->hashtable) free(This->hashtable);
+	This->hashtable = NULL;
 }
 /* Bits in Shader ID:
 Bits 0-1 - Shading mode:  00=flat 01=gouraud 11=phong 10=flat per-pixel GL/VS/FS
@@ -63,7 +75,8 @@ Bit 10 - Range based fog  VS/FS
 Bit 11 - Specular highlights  VS/FS
 Bit 12 - Stippled alpha  FS
 Bit 13 - Color key transparency  FS
-Bit 14-17 - Reserved
+Bit 14-16 - Reserved
+Bit 17 - Stage textures read per draw from the DrawTextures block  VS/FS
 Bits 18-20 - Number of lights  VS/FS
 Bit 21 - Camera relative specular highlights  VS/FS
 Bit 22 - Alpha blended color key  FS
@@ -85,6 +98,7 @@ Bit 59 - Enable lights  VS/FS
 Bit 60 - Use vertex colors  VS
 Bit 61 - Enable fog  VS/FS
 Bit 62 - Enable dithering  FS
+Bit 63 - Loop over the lights in the Lights uniform block, replaces bits 18-20, 38-45 and 51-58  VS/FS
 */
 
 /* Bits in Texture Stage ID:
@@ -115,6 +129,29 @@ Bit 60: Texture has color key
 */
 
 
+static void ShaderGen3D_GetLocations(ShaderGen3D *This, _GENSHADER *shader);
+static void ShaderGen3D_CreateUbershader(ShaderGen3D *This);
+static GenShader *ShaderGen3D_GetUbershader(ShaderGen3D *This);
+
+/**
+  * Stops waiting for a background compile of a shader, taking over any GL
+  * objects the compiler already created so they get deleted with the shader.
+  * @param This
+  *  Pointer to ShaderGen3D structure
+  * @param shader
+  *  Pointer to the shader being deleted
+  */
+static void ShaderGen3D_CancelCompile(ShaderGen3D *This, GenShader *shader)
+{
+	if (!shader->job) return;
+	ShaderCompiler_Cancel(This->shaders->compiler, shader->job);
+	shader->shader.vs = (GLint)shader->job->vs;
+	shader->shader.fs = (GLint)shader->job->fs;
+	shader->shader.prog = (GLint)shader->job->prog;
+	ShaderCompiler_Release(This->shaders->compiler, shader->job);
+	shader->job = NULL;
+}
+
 /**
   * Deletes all shader programs in the array.
   * @param This
@@ -125,6 +162,7 @@ void ShaderGen3D_ClearShaders(ShaderGen3D *This)
 	if(!This->genshaders) return;
 	for(int i = 0; i < This->shadercount; i++)
 	{
+		ShaderGen3D_CancelCompile(This, &This->genshaders[i]);
 		This->genshaders[i].id = 0;
 		ZeroMemory(This->genshaders[i].texids,8*sizeof(__int64));
 		if(This->genshaders[i].shader.prog) This->ext->glDeleteProgram(This->genshaders[i].shader.prog);
@@ -132,40 +170,310 @@ void ShaderGen3D_ClearShaders(ShaderGen3D *This)
 		if(This->genshaders[i].shader.vs) This->ext->glDeleteShader(This->genshaders[i].shader.vs);
 		if(This->genshaders[i].shader.fsrc.ptr) String_Free(&This->genshaders[i].shader.fsrc);
 		if(This->genshaders[i].shader.vsrc.ptr) String_Free(&This->genshaders[i].shader.vsrc);
+		if(This->genshaders[i].shader.shadow) free(This->genshaders[i].shader.shadow);
 	}
+	ShaderGen3D_CancelCompile(This, &This->ubershader);
+	if (This->ubershader.shader.prog) This->ext->glDeleteProgram(This->ubershader.shader.prog);
+	if (This->ubershader.shader.fs) This->ext->glDeleteShader(This->ubershader.shader.fs);
+	if (This->ubershader.shader.vs) This->ext->glDeleteShader(This->ubershader.shader.vs);
+	if (This->ubershader.shader.fsrc.ptr) String_Free(&This->ubershader.shader.fsrc);
+	if (This->ubershader.shader.vsrc.ptr) String_Free(&This->ubershader.shader.vsrc);
+	if (This->ubershader.shader.shadow) free(This->ubershader.shader.shadow);
+	ZeroMemory(&This->ubershader, sizeof(GenShader));
 	if(This->genshaders) free(This->genshaders);
 	This->genshaders = NULL;
 	This->current_genshader = NULL;
 	This->shadercount = 0;
-	This->genindex = 0;
+	if(This->hashtable) memset(This->hashtable, 0xff, (This->hashmask + 1) * sizeof(int));
+}
+
+static int ShaderGen3D_Hash(__int64 id, const __int64 *texids)
+{
+	unsigned __int64 hash = (unsigned __int64)id * 0x9E3779B97F4A7C15ULL;
+	for (int i = 0; i < 8; i++)
+	{
+		hash ^= (unsigned __int64)texids[i] + 0x9E3779B97F4A7C15ULL + (hash << 6) + (hash >> 2);
+	}
+	hash *= 0xBF58476D1CE4E5B9ULL;
+	return (int)(hash >> 32);
+}
+
+static BOOL ShaderGen3D_Match(const GenShader *shader, __int64 id, const __int64 *texids)
+{
+	if (shader->id != id) return FALSE;
+	return !memcmp(shader->texids, texids, 8 * sizeof(__int64));
+}
+
+/**
+  * Removes a shader from the hash table, shifting later entries of the same
+  * probe sequence back so lookups never need tombstones.
+  * @param This
+  *  Pointer to ShaderGen3D structure
+  * @param index
+  *  Index of the shader in the shader array
+  */
+static void ShaderGen3D_RemoveHash(ShaderGen3D *This, int index)
+{
+	int slot = ShaderGen3D_Hash(This->genshaders[index].id, This->genshaders[index].texids) & This->hashmask;
+	int next, home;
+	while (This->hashtable[slot] != index)
+	{
+		if (This->hashtable[slot] == -1) return;
+		slot = (slot + 1) & This->hashmask;
+	}
+	next = slot;
+	while (1)
+	{
+		next = (next + 1) & This->hashmask;
+		if (This->hashtable[next] == -1) break;
+		home = ShaderGen3D_Hash(This->genshaders[This->hashtable[next]].id,
+			This->genshaders[This->hashtable[next]].texids) & This->hashmask;
+		// Move the entry back if its home slot is not between the hole and its position
+		if (((next > slot) && ((home <= slot) || (home > next))) ||
+			((next < slot) && ((home <= slot) && (home > next))))
+		{
+			This->hashtable[slot] = This->hashtable[next];
+			slot = next;
+		}
+	}
+	This->hashtable[slot] = -1;
 }
 
 /**
-  * Sort 2D shaders callback, for qsort and bsearch functions
-  * @param elem1
-  *  First item to compare
-  * @param elem2
-  *  Second item to compare
+  * Looks up a generated 3D shader, creating it if it does not exist.  When the
+  * cache is full the least recently used shader is deleted to make room.
+  * @param This
+  *  Pointer to ShaderGen3D structure
+  * @param id
+  *  64-bit value containing current render states
+  * @param texstate
+  *  Pointer to the texture state ID.
   * @return
-  *  negative if elem1 is less than elem2, positive if greater, zero if same
+  *  Pointer to the shader, or NULL if it could not be added
   */
-int __cdecl compshader2D(const GenShader2D *elem1, const  GenShader2D *elem2)
+static GenShader *ShaderGen3D_GetShader(ShaderGen3D *This, __int64 id, __int64 *texstate)
 {
-	return memcmp(&elem1->id, &elem2->id, sizeof(__int64));
+	int slot;
+	int index;
+	DWORD oldest;
+	if (!This->genshaders || !This->hashtable) return NULL;
+	slot = ShaderGen3D_Hash(id, texstate) & This->hashmask;
+	while (This->hashtable[slot] != -1)
+	{
+		if (ShaderGen3D_Match(&This->genshaders[This->hashtable[slot]], id, texstate))
+		{
+			This->genshaders[This->hashtable[slot]].lastused = This->frame;
+			return &This->genshaders[This->hashtable[slot]];
+		}
+		slot = (slot + 1) & This->hashmask;
+	}
+	if (This->shadercount < This->maxshaders) index = This->shadercount++;
+	else
+	{
+		index = 0;
+		oldest = This->frame - This->genshaders[0].lastused;
+		for (int i = 1; i < This->shadercount; i++)
+		{
+			if ((This->frame - This->genshaders[i].lastused) > oldest)
+			{
+				oldest = This->frame - This->genshaders[i].lastused;
+				index = i;
+			}
+		}
+		ShaderGen3D_RemoveHash(This, index);
+		ShaderGen3D_CancelCompile(This, &This->genshaders[index]);
+		This->ext->glUseProgram(0);
+		if (This->genshaders[index].shader.prog) This->ext->glDeleteProgram(This->genshaders[index].shader.prog);
+		if (This->genshaders[index].shader.vs) This->ext->glDeleteShader(This->genshaders[index].shader.vs);
+		if (This->genshaders[index].shader.fs) This->ext->glDeleteShader(This->genshaders[index].shader.fs);
+		String_Free(&This->genshaders[index].shader.vsrc);
+		String_Free(&This->genshaders[index].shader.fsrc);
+		if (This->genshaders[index].shader.shadow) free(This->genshaders[index].shader.shadow);
+		ZeroMemory(&This->genshaders[index], sizeof(GenShader));
+		// The removal may have shifted entries into the probe sequence
+		slot = ShaderGen3D_Hash(id, texstate) & This->hashmask;
+		while (This->hashtable[slot] != -1) slot = (slot + 1) & This->hashmask;
+	}
+	ShaderGen3D_CreateShader(This, index, id, texstate);
+	This->genshaders[index].lastused = This->frame;
+	This->hashtable[slot] = index;
+	return &This->genshaders[index];
 }
 
 /**
-* Sort 2D shaders callback, for qsort and bsearch functions
-* @param elem1
-*  First item to compare
-* @param elem2
-*  Second item to compare
-* @return
-*  negative if elem1 is less than elem2, positive if greater, zero if same
-*/
-int __cdecl compshader3D(const GenShader *elem1, const  GenShader *elem2)
+  * Completes a shader compiled in the background once the compiler is done.
+  * @param This
+  *  Pointer to ShaderGen3D structure
+  * @param shader
+  *  Pointer to the shader to check
+  * @return
+  *  TRUE if the shader is ready to use.
+  */
+static BOOL ShaderGen3D_FinishShader(ShaderGen3D *This, GenShader *shader)
 {
-	return memcmp(&elem1->id, &elem2->id, 9 * sizeof(__int64));
+	if (!shader->job) return TRUE;
+	if (!ShaderCompiler_Poll(This->shaders->compiler, shader->job)) return FALSE;
+	shader->shader.vs = (GLint)shader->job->vs;
+	shader->shader.fs = (GLint)shader->job->fs;
+	shader->shader.prog = (GLint)shader->job->prog;
+	ShaderCompiler_Release(This->shaders->compiler, shader->job);
+	shader->job = NULL;
+	ShaderCache_StoreProgram(This->shaders->cache, SHADERCACHE_TYPE3D, shader->id, shader->texids,
+		shader->shader.prog);
+	ShaderGen3D_GetLocations(This, &shader->shader);
+	return TRUE;
+}
+
+static int ShaderGen3D_BitCount(unsigned __int64 bits)
+{
+	int count = 0;
+	while (bits)
+	{
+		bits &= bits - 1;
+		count++;
+	}
+	return count;
+}
+
+// Shader ID bits that select vertex attributes, which a substitute must match
+#define SHADERID_VERTEXINPUTMASK 0x5C03F80000000i64
+
+/**
+  * Finds the ready shader closest to a shader that is still compiling.
+  * @param This
+  *  Pointer to ShaderGen3D structure
+  * @param id
+  *  Shader ID of the shader being compiled
+  * @param texstate
+  *  Texture stage IDs of the shader being compiled
+  * @return
+  *  Pointer to the shader differing in the fewest state bits while taking the
+  *  same vertex inputs, or NULL if none is ready.
+  */
+static GenShader *ShaderGen3D_FindFallback(ShaderGen3D *This, __int64 id, __int64 *texstate)
+{
+	GenShader *best = NULL;
+	int bestscore = 0x7FFFFFFF;
+	int score;
+	int i, j;
+	for (i = 0; i < This->shadercount; i++)
+	{
+		if (This->genshaders[i].job || !This->genshaders[i].shader.prog) continue;
+		if ((This->genshaders[i].id & SHADERID_VERTEXINPUTMASK) != (id & SHADERID_VERTEXINPUTMASK)) continue;
+		score = ShaderGen3D_BitCount(This->genshaders[i].id ^ id);
+		for (j = 0; j < 8; j++)
+			score += ShaderGen3D_BitCount(This->genshaders[i].texids[j] ^ texstate[j]);
+		if (score < bestscore)
+		{
+			bestscore = score;
+			best = &This->genshaders[i];
+		}
+	}
+	return best;
+}
+
+/**
+  * Clears the state bits that do not change what a generated shader draws,
+  * so render states that only differ in them share one program.
+  * @param id
+  *  Pointer to the shader ID to normalize
+  * @param texstate
+  *  Pointer to the 8 texture stage IDs to normalize
+  */
+static void ShaderGen3D_Normalize(__int64 *id, __int64 *texstate)
+{
+	__int64 state = *id;
+	int numlights = 0;
+	int stages;
+	int i;
+	BOOL colorkey = FALSE;
+	BOOL alphadisabled = FALSE;
+	DWORD texcoords = 0;  // Texture coordinate sets read by enabled stages
+	DWORD attribs = 0;  // Texture coordinate attributes read by the vertex shader
+	// Phong shading, specular, stippling and the reserved bits are not generated
+	state &= ~(2i64 | (3i64 << 11) | (7i64 << 14) | (3i64 << 21));
+	// Alpha test
+	if (!((state >> 2) & 1) || (((state >> 3) & 7) == 7)) state &= ~(0xFi64 << 2);
+	// Fog
+	if (!((state >> 61) & 1) || !((state >> 6) & 15)) state &= ~((1i64 << 61) | (0x1Fi64 << 6));
+	else if ((state >> 6) & 3) state &= ~(7i64 << 8);  // Pixel fog replaces vertex fog
+	// Lights
+	if (((state >> 59) & 1) && !((state >> 50) & 1))
+	{
+		if ((state >> 63) & 1) numlights = LIGHTS_MAX;
+		else numlights = (state >> 18) & 7;
+	}
+	if (!numlights) state &= ~((3i64 << 59) | (7i64 << 18) | (0xFFi64 << 23) | (0xFFi64 << 38) | (0xFFi64 << 51)
+		| (1i64 << 63));
+	else
+	{
+		for (i = 0; i < 8; i++)
+		{
+			if (i >= numlights) state &= ~((1i64 << (38 + i)) | (1i64 << (51 + i)));
+			else if (!((state >> (38 + i)) & 1)) state &= ~(1i64 << (51 + i));
+		}
+		if (!((state >> 60) & 1)) state &= ~(0xFFi64 << 23);
+	}
+	// Texture stages
+	for (stages = 0; stages < 8; stages++)
+		if ((texstate[stages] & 31) == D3DTOP_DISABLE) break;
+	for (i = 0; i < 8; i++)
+	{
+		// Addressing, filtering and the coordinate flags are applied outside the shader
+		texstate[i] &= ((1i64 << 37) - 1) | (7i64 << 50) | (7i64 << 59);
+		if (i < stages)
+		{
+			texcoords |= 1 << ((texstate[i] >> 34) & 7);
+			if (!((state >> 13) & 1)) texstate[i] &= ~(3i64 << 60);
+			else if ((texstate[i] >> 60) & 1) colorkey = TRUE;
+			else texstate[i] &= ~(1i64 << 61);
+			if (alphadisabled) texstate[i] &= ~(0x1FFFFi64 << 17);
+			else if (((texstate[i] >> 17) & 31) == D3DTOP_DISABLE)
+			{
+				alphadisabled = TRUE;
+				texstate[i] &= ~(0xFFFi64 << 22);
+			}
+		}
+		// Only the color operation of the first disabled stage is read
+		else if (i == stages) texstate[i] &= 31 | (3i64 << 34) | (7i64 << 50);
+		else texstate[i] &= (3i64 << 34) | (7i64 << 50);
+	}
+	if (!colorkey) state &= ~(1i64 << 13);
+	for (i = 0; i < 8; i++)
+	{
+		// Coordinates no stage reads are written from the first set
+		if ((i >= stages) && !((texcoords >> i) & 1)) texstate[i] &= ~((3i64 << 34) | (1i64 << 50));
+		if (!((texstate[i] >> 50) & 1)) attribs |= 1 << ((texstate[i] >> 34) & 3);
+	}
+	// Attributes that are not read are declared with two components
+	for (i = 0; i < 8; i++)
+		if (!((attribs >> i) & 1)) texstate[i] = (texstate[i] & ~(3i64 << 51)) | (1i64 << 51);
+	*id = state;
+}
+
+/**
+  * Sets a 64-bit render state uniform of the ubershader, split into the two
+  * halves of an ivec2.  The program must be in use.
+  * @param This
+  *  Pointer to ShaderGen3D structure
+  * @param shader
+  *  Pointer to the ubershader
+  * @param index
+  *  Index of the uniform in the uniform location array
+  * @param value
+  *  Shader ID or texture stage ID to set
+  */
+static void ShaderGen3D_SetStateUniform(ShaderGen3D *This, _GENSHADER *shader, int index, __int64 value)
+{
+	GLint state[2] = { (GLint)(value & 0xFFFFFFFF), (GLint)(value >> 32) };
+	GLfloat *shadow = GENSHADER_SHADOW(shader, index);
+	if (shader->uniforms[index] == -1) return;
+	if (shadow)
+	{
+		if (!memcmp(shadow, state, sizeof(state))) return;
+		memcpy(shadow, state, sizeof(state));
+	}
+	This->ext->glUniform2i(shader->uniforms[index], state[0], state[1]);
 }
 
 /**
@@ -187,113 +495,111 @@ int __cdecl compshader3D(const GenShader *elem1, const  GenShader *elem2)
 void ShaderGen3D_SetShader(ShaderGen3D *This, __int64 id, __int64 *texstate, int type, ShaderGen2D *gen2d)
 {
 	//int shaderindex = -1;
+	SHADER *shader;
+	__int64 texids[8];
 	switch(type)
 	{
 	case 0:  // Static built-in shader
-		if((This->current_shadertype == 0) && (This->shaders->shaders[id].prog == This->current_shader)) return;
-		This->ext->glUseProgram(This->shaders->shaders[id].prog);
-		This->current_shader = This->shaders->shaders[id].prog;
+		shader = ShaderManager_GetBuiltin(This->shaders, (int)id);
+		if((This->current_shadertype == 0) && (shader->prog == This->current_shader)) return;
+		This->ext->glUseProgram(shader->prog);
+		This->switches++;
+		This->current_shader = shader->prog;
 		This->current_shadertype = 0;
 		This->current_genshader = NULL;
+		This->current_pending = FALSE;
 		break;
 	case 1:  // 2D generated shader
-		if ((This->current_shadertype == 1) && (id == This->current_shader)) return;
+		if ((This->current_shadertype == 1) && (id == This->current_shader))
+		{
+			if (This->current_genshader) ((GenShader2D*)This->current_genshader)->lastused = This->frame;
+			return;
+		}
 		This->current_shader = id;
 		This->current_shadertype = 1;
-		GenShader2D key2d;
+		This->current_pending = FALSE;
 		GenShader2D *shader2d;
-		key2d.id = id;
-		shader2d = (GenShader2D*)bsearch(&key2d, gen2d->genshaders2D, gen2d->genindex, sizeof(GenShader2D),
-			(int(__cdecl *) (const void *, const void *))compshader2D);
-		if (!shader2d)
-		{
-			gen2d->shadercount++;
-			if (gen2d->genshaders2D[gen2d->genindex].shader.prog)
-			{
-				This->ext->glUseProgram(0);
-				This->ext->glDeleteProgram(gen2d->genshaders2D[gen2d->genindex].shader.prog);
-				This->ext->glDeleteShader(gen2d->genshaders2D[gen2d->genindex].shader.vs);
-				This->ext->glDeleteShader(gen2d->genshaders2D[gen2d->genindex].shader.fs);
-				String_Free(&gen2d->genshaders2D[gen2d->genindex].shader.vsrc);
-				String_Free(&gen2d->genshaders2D[gen2d->genindex].shader.fsrc);
-				ZeroMemory(&gen2d->genshaders2D[gen2d->genindex], sizeof(GenShader2D));
-			}
-			ShaderGen2D_CreateShader2D(gen2d, gen2d->genindex, id);
-			gen2d->genindex++;
-			if (gen2d->genindex >= gen2d->maxshaders)
-			{
-				GenShader2D *tmp2dgen = (GenShader2D*)realloc(gen2d->genshaders2D,
-					gen2d->maxshaders * 2 * sizeof(GenShader2D));
-				if (!tmp2dgen) gen2d->genindex = 0;
-				else
-				{
-					ZeroMemory(&tmp2dgen[gen2d->maxshaders], gen2d->maxshaders * sizeof(GenShader2D));
-					gen2d->genshaders2D = tmp2dgen;
-					gen2d->maxshaders *= 2;
-				}
-			}
-			qsort(gen2d->genshaders2D, gen2d->genindex, sizeof(GenShader2D), 
-				(int(__cdecl *) (const void *, const void *))compshader2D);
-			shader2d = (GenShader2D*)bsearch(&key2d, gen2d->genshaders2D, gen2d->genindex, sizeof(GenShader2D),
-				(int(__cdecl *) (const void *, const void *))compshader2D);
-		}
+		shader2d = ShaderGen2D_GetShader2D(gen2d, id, This->frame);
 		if (!shader2d) return;  // Out of memory condition
 		This->ext->glUseProgram(shader2d->shader.prog);
+		This->switches++;
 		This->current_prog = shader2d->shader.prog;
 		This->current_genshader = (GenShader*)shader2d;
 		break;
 	case 2:  // 3D generated shader
-		if((This->current_shadertype == 2) && (id == This->current_shader))
+		memcpy(texids, texstate, 8 * sizeof(__int64));
+		ShaderGen3D_Normalize(&id, texids);
+		texstate = texids;
+		if((This->current_shadertype == 2) && (id == This->current_shader) && !This->current_pending)
 		{
-			if(!memcmp(This->current_texid,texstate,8*sizeof(__int64))) return;
+			if(!memcmp(This->current_texid,texstate,8*sizeof(__int64)))
+			{
+				if (This->current_genshader) This->current_genshader->lastused = This->frame;
+				return;
+			}
 		}
 		This->current_shader = id;
 		This->current_shadertype = 2;
-		GenShader key3d;
+		memcpy(This->current_texid, texstate, 8 * sizeof(__int64));
 		GenShader *shader3d;
-		key3d.id = id;
-		memcpy(&key3d.texids, texstate, 8 * sizeof(__int64));
-		shader3d = (GenShader*)bsearch(&key3d, This->genshaders, This->genindex, sizeof(GenShader),
-			(int(__cdecl *) (const void *, const void *))compshader3D);
-		if(!shader3d)
+		shader3d = ShaderGen3D_GetShader(This, id, texstate);
+		This->current_pending = FALSE;
+		if (shader3d && !ShaderGen3D_FinishShader(This, shader3d))
 		{
-			This->shadercount++;
-			if(This->genshaders[This->genindex].shader.prog)
-			{
-				This->ext->glUseProgram(0);
-				This->ext->glDeleteProgram(This->genshaders[This->genindex].shader.prog);
-				This->ext->glDeleteShader(This->genshaders[This->genindex].shader.vs);
-				This->ext->glDeleteShader(This->genshaders[This->genindex].shader.fs);
-				String_Free(&This->genshaders[This->genindex].shader.vsrc);
-				String_Free(&This->genshaders[This->genindex].shader.fsrc);
-				ZeroMemory(&This->genshaders[This->genindex],sizeof(GenShader));
-			}
-			ShaderGen3D_CreateShader(This, This->genindex,id,texstate);
-			This->genindex++;
-			if (This->genindex >= This->maxshaders)
+			// Still compiling, substitute the ubershader or a close match, or skip drawing
+			This->current_pending = TRUE;
+			switch (dxglcfg.ShaderCompileMode)
 			{
-				GenShader *tmp3dgen = (GenShader*)realloc(This->genshaders,
-					This->maxshaders * 2 * sizeof(GenShader));
-				if (!tmp3dgen) This->genindex = 0;
-				else
-				{
-					ZeroMemory(&tmp3dgen[This->maxshaders], This->maxshaders * sizeof(GenShader));
-					This->genshaders = tmp3dgen;
-					This->maxshaders *= 2;
-				}
+			case 1:
+				shader3d = ShaderGen3D_FindFallback(This, id, texstate);
+				break;
+			case 3:
+				shader3d = ShaderGen3D_GetUbershader(This);
+				if (!shader3d) shader3d = ShaderGen3D_FindFallback(This, id, texstate);
+				break;
+			default:
+				shader3d = NULL;
+				break;
 			}
-			qsort(This->genshaders, This->genindex, sizeof(GenShader),
-				(int(__cdecl *) (const void *, const void *))compshader3D);
-			shader3d = (GenShader*)bsearch(&key3d, This->genshaders, This->genindex, sizeof(GenShader),
-				(int(__cdecl *) (const void *, const void *))compshader3D);
+			if (shader3d) shader3d->lastused = This->frame;
+		}
+		if (!shader3d)
+		{
+			// Out of memory or no shader ready, callers skip the draw
+			This->current_genshader = NULL;
+			return;
 		}
-		if (!shader3d) return; // Out of memory condition
 		This->ext->glUseProgram(shader3d->shader.prog);
+		This->switches++;
 		This->current_prog = shader3d->shader.prog;
 		This->current_genshader = shader3d;
+		if (shader3d == &This->ubershader)
+		{
+			ShaderGen3D_SetStateUniform(This, &shader3d->shader, 170, id);
+			for (int i = 0; i < 8; i++)
+				ShaderGen3D_SetStateUniform(This, &shader3d->shader, 171 + i, texstate[i]);
+		}
 	}
 }
 
+/**
+  * Creates a shader ahead of its first use, so a program recorded in the
+  * shader cache does not stall the first draw that needs it.
+  * @param This
+  *  Pointer to ShaderGen3D structure
+  * @param id
+  *  64-bit value containing the render states of the shader
+  * @param texstate
+  *  Pointer to the texture stage state array, containing 8 64-bit state values
+  */
+void ShaderGen3D_Preload(ShaderGen3D *This, __int64 id, const __int64 *texstate)
+{
+	__int64 texids[8];
+	memcpy(texids, texstate, 8 * sizeof(__int64));
+	ShaderGen3D_Normalize(&id, texids);
+	ShaderGen3D_GetShader(This, id, texids);
+}
+
 /**
   * Retrieves the GLSL program currently in use
   * @param This
@@ -326,6 +632,9 @@ static const char version_450[] = "#version 450 core\n";
 static const char version_460[] = "#version 460 core\n";
 static const char vertexshader[] = "//Vertex Shader\n";
 static const char fragshader[] = "//Fragment Shader\n";
+static const char ext_bindless[] = "#extension GL_ARB_bindless_texture : require\n\
+layout(bindless_sampler) uniform;\n";
+static const char ext_drawparams[] = "#extension GL_ARB_shader_draw_parameters : require\n";
 static const char idheader[] = "//ID: 0x";
 static const char linefeed[] = "\n";
 static const char mainstart[] = "void main()\n{\n";
@@ -350,6 +659,7 @@ vec4 diffuse;\n\
 vec4 specular;\n\
 vec4 ambient;\n\
 vec3 position;\n\
+float type;\n\
 vec3 direction;\n\
 float range;\n\
 float falloff;\n\
@@ -362,6 +672,11 @@ float phi;\n\
 static const char unif_light[] = "uniform Light lightX;\n";
 static const char unif_ambient[] = "uniform vec4 ambientcolor;\n";
 static const char unif_tex[] = "uniform sampler2D texX;\n";
+static const char unif_drawtextures[] = "layout(std140) uniform DrawTextures\n\
+{\n\
+uvec4 drawtex[1024];\n\
+};\n";
+static const char def_drawtexture[] = "#define texX sampler2D(drawtex[drawid * 4 + Y].xy)\n";
 static const char unif_viewport[] = "uniform float width;\n\
 uniform float height;\n\
 uniform float xoffset;\n\
@@ -374,8 +689,8 @@ static const char unif_keybits[] = "uniform ivec4 keybitsX;\n";
 
 static const char unif_world[] = "uniform mat4 matWorld;\n";
 static const char unif_modelview[] = "uniform mat4 matModelView;\n";
-static const char unif_projection[] = "uniform mat4 matProjection;\n";
 static const char unif_normal[] = "uniform mat3 matNormal;\n";
+static const char unif_mvp[] = "uniform mat4 matMVP;\n";
 static const char unif_ditherbits[] = "uniform ivec4 ditherbits;\n";
 
 static const char unif_material[] = "uniform vec4 mtlambient;\n\
@@ -384,6 +699,29 @@ uniform vec4 mtlspecular;\n\
 uniform vec4 mtlemission;\n\
 uniform float mtlshininess;\n";
 
+// Uniform blocks, laid out like UBOTransforms, UBOMaterial and UBOLight
+static const char block_transforms[] = "layout(std140) uniform Transforms\n\
+{\n\
+mat4 matWorld;\n\
+mat4 matModelView;\n\
+mat4 matProjection;\n\
+mat3 matNormal;\n\
+mat4 matMVP;\n\
+};\n";
+static const char block_material[] = "layout(std140) uniform Material\n\
+{\n\
+vec4 mtlambient;\n\
+vec4 mtldiffuse;\n\
+vec4 mtlspecular;\n\
+vec4 mtlemission;\n\
+float mtlshininess;\n\
+};\n";
+static const char block_lights[] = "layout(std140) uniform Lights\n\
+{\n\
+int lightcount;\n\
+Light lights[" STR(LIGHTS_MAX) "];\n\
+};\n";
+
 static const char unif_fogcolor[] = "uniform vec4 fogcolor;\n";
 static const char unif_fogstart[] = "uniform float fogstart;\n";
 static const char unif_fogend[] = "uniform float fogend;\n";
@@ -405,6 +743,7 @@ static const char var_fogfragcoord[] = "float fogfragcoord;\n";
 static const char var_colors1[] = "vec4 vertcolor;\n";
 static const char var_colors2[] = "vec4 vertcolor2;\n";
 static const char var_texcoord[] = "vec4 texcoordX;\n";
+static const char var_drawid[] = "int drawid;\n";
 
 // Outputs
 static const char out_fragcolor[] = "out vec4 FragColor;\n";
@@ -419,10 +758,11 @@ static const char const_threshold[] = "mat4 threshold = mat4(\n\
 
 // Operations
 static const char op_transform[] = "xyzw = vec4(xyz,1.0);\n\
-vec4 pos = matProjection*matModelView*xyzw;\n\
+vec4 pos = matMVP*xyzw;\n\
 gl_Position = vec4(pos.x,-pos.y,pos.z,pos.w);\n";
 static const char op_normalize[] = "N = normalize(matNormal*nxyz);\n";
 static const char op_normalpassthru[] = "N = matNormal*nxyz;\n";
+static const char op_drawid[] = "drawid = gl_DrawIDARB;\n";
 static const char op_tlvertex[] = "gl_Position = vec4(((xyz.x-xoffset)/(width/2.0)-1.0)/rhw,\
 ((xyz.y-yoffset)/(height/2.0)-1.0)/rhw,xyz.z/rhw,1.0/rhw);\n";
 static const char op_resetcolor[] = "diffuse = specular = vec4(0.0);\n\
@@ -430,6 +770,7 @@ ambient = ambientcolor / 255.0;\n";
 static const char op_dirlight[] = "DirLight(lightX);\n";
 static const char op_pointlight[] = "PointLight(lightX);\n";
 static const char op_spotlight[] = "SpotLight(lightX);\n";
+static const char op_lightloop[] = "ApplyLights();\n";
 static const char op_colorout[] = "vertcolor = (mtldiffuse * diffuse) + (mtlambient * ambient)\n\
 + (mtlspecular * specular) + mtlemission;\n\
 vertcolor2 = (mtlspecular * specular);\n";
@@ -448,6 +789,7 @@ static const char op_dither[] = "color = dither(color);\n";
 static const char op_colorfragin[] = "color = vertcolor;\n";
 static const char op_colorkeyin[] = "keycomp = ivec4(texture2DProj(texX,texcoordY)*vec4(keybitsZ)+.5);\n";
 static const char op_colorkey[] = "if(keycomp.rgb == keyX) discard;\n";
+static const char op_colorkeyalpha[] = "if(texture2DProj(texX,texcoordY).a < .5) discard;\n";
 static const char op_texpassthru1[] = "texcoordX = ";
 static const char op_texpassthru2s[] = "vec4(sX,0,0,1);\n";
 static const char op_texpassthru2st[] = "vec4(stX,0,1);\n";
@@ -532,6 +874,15 @@ diffuse += light.diffuse*NdotV*attenuation;\n\
 ambient += light.ambient;\n\
 specular += light.specular*pf*attenuation;\n\
 }\n";
+static const char func_lightloop[] = "void ApplyLights()\n\
+{\n\
+for(int i = 0; i < lightcount; i++)\n\
+{\n\
+if(lights[i].type == 3.0) DirLight(lights[i]);\n\
+else if(lights[i].type == 2.0) SpotLight(lights[i]);\n\
+else PointLight(lights[i]);\n\
+}\n\
+}\n";
 static const char func_dither[] = "vec4 dither(vec4 color2)\n\
 {\n\
 	vec4 color = color2;\n\
@@ -556,6 +907,375 @@ static const char func_dither[] = "vec4 dither(vec4 color2)\n\
 	return color;\n\
 }\n";
 
+// Ubershader, reads the render states from the stateid and stageidX uniforms
+static const char uber_header[] = "//Ubershader\n";
+static const char uber_attr[] = "in vec3 xyz;\n\
+in float rhw;\n\
+in vec3 nxyz;\n\
+in vec4 rgba0;\n\
+in vec4 rgba1;\n\
+in vec4 strq0;\n\
+in vec4 strq1;\n\
+in vec4 strq2;\n\
+in vec4 strq3;\n\
+in vec4 strq4;\n\
+in vec4 strq5;\n\
+in vec4 strq6;\n\
+in vec4 strq7;\n";
+static const char unif_state[] = "uniform ivec2 stateid;\n\
+uniform ivec2 stageid0;\n\
+uniform ivec2 stageid1;\n\
+uniform ivec2 stageid2;\n\
+uniform ivec2 stageid3;\n\
+uniform ivec2 stageid4;\n\
+uniform ivec2 stageid5;\n\
+uniform ivec2 stageid6;\n\
+uniform ivec2 stageid7;\n";
+static const char uber_unif_lights[] = "uniform Light light0;\n\
+uniform Light light1;\n\
+uniform Light light2;\n\
+uniform Light light3;\n\
+uniform Light light4;\n\
+uniform Light light5;\n\
+uniform Light light6;\n\
+uniform Light light7;\n";
+static const char uber_var_vertex[] = "out float fogfragcoord;\n\
+out float fogfactor;\n\
+out vec4 vertcolor;\n\
+out vec4 vertcolor2;\n\
+out vec4 texcoord0;\n\
+out vec4 texcoord1;\n\
+out vec4 texcoord2;\n\
+out vec4 texcoord3;\n\
+out vec4 texcoord4;\n\
+out vec4 texcoord5;\n\
+out vec4 texcoord6;\n\
+out vec4 texcoord7;\n";
+static const char func_state[] = "bool StateBit(uvec2 state, int bit)\n\
+{\n\
+if(bit >= 32) return ((state.y >> uint(bit - 32)) & 1u) != 0u;\n\
+return ((state.x >> uint(bit)) & 1u) != 0u;\n\
+}\n\
+int StateBits(uvec2 state, int bit, uint mask)\n\
+{\n\
+if(bit >= 32) return int((state.y >> uint(bit - 32)) & mask);\n\
+if(bit == 0) return int(state.x & mask);\n\
+return int(((state.x >> uint(bit)) | (state.y << uint(32 - bit))) & mask);\n\
+}\n";
+static const char func_uberlight[] = "void ApplyLight(in Light light, int index)\n\
+{\n\
+if(StateBit(uvec2(stateid),38 + index))\n\
+{\n\
+if(StateBit(uvec2(stateid),51 + index)) SpotLight(light);\n\
+else PointLight(light);\n\
+}\n\
+else DirLight(light);\n\
+}\n\
+vec4 MaterialColor(int source, vec4 material)\n\
+{\n\
+if((source == 1) && StateBit(uvec2(stateid),35)) return rgba0.bgra;\n\
+if((source == 2) && StateBit(uvec2(stateid),36)) return rgba1.bgra;\n\
+return material;\n\
+}\n";
+static const char func_uberlights[] = "void ApplyLights()\n\
+{\n\
+int numlights = StateBits(uvec2(stateid),18,7u);\n\
+ApplyLight(light0,0);\n\
+if(numlights > 1) ApplyLight(light1,1);\n\
+if(numlights > 2) ApplyLight(light2,2);\n\
+if(numlights > 3) ApplyLight(light3,3);\n\
+if(numlights > 4) ApplyLight(light4,4);\n\
+if(numlights > 5) ApplyLight(light5,5);\n\
+if(numlights > 6) ApplyLight(light6,6);\n\
+}\n";
+static const char uber_main_vertex[] = "void main()\n\
+{\n\
+uvec2 id = uvec2(stateid);\n\
+xyzw = vec4(xyz,1.0);\n\
+if(StateBit(id,50)) gl_Position = vec4(((xyz.x-xoffset)/(width/2.0)-1.0)/rhw,\n\
+((xyz.y-yoffset)/(height/2.0)-1.0)/rhw,xyz.z/rhw,1.0/rhw);\n\
+else\n\
+{\n\
+vec4 pos = matMVP*xyzw;\n\
+gl_Position = vec4(pos.x,-pos.y,pos.z,pos.w);\n\
+}\n\
+N = vec3(0.0);\n\
+if(StateBit(id,37))\n\
+{\n\
+N = matNormal*nxyz;\n\
+if(StateBit(id,49)) N = normalize(N);\n\
+}\n\
+if(StateBit(id,59) && !StateBit(id,50) && (StateBit(id,63) || (StateBits(id,18,7u) > 0)))\n\
+{\n\
+diffuse = specular = vec4(0.0);\n\
+ambient = ambientcolor / 255.0;\n\
+ApplyLights();\n\
+vec4 matdiffuse = mtldiffuse;\n\
+vec4 matambient = mtlambient;\n\
+vec4 matspecular = mtlspecular;\n\
+vec4 matemission = mtlemission;\n\
+if(StateBit(id,60))\n\
+{\n\
+matdiffuse = MaterialColor(StateBits(id,23,3u),mtldiffuse);\n\
+matspecular = MaterialColor(StateBits(id,25,3u),mtlspecular);\n\
+matambient = MaterialColor(StateBits(id,27,3u),mtlambient);\n\
+matemission = MaterialColor(StateBits(id,29,3u),mtlemission);\n\
+}\n\
+vertcolor = (matdiffuse * diffuse) + (matambient * ambient)\n\
++ (matspecular * specular) + matemission;\n\
+vertcolor2 = (mtlspecular * specular);\n\
+}\n\
+else\n\
+{\n\
+if(StateBit(id,35)) vertcolor = rgba0.bgra;\n\
+else vertcolor = vec4(1.0);\n\
+if(StateBit(id,36)) vertcolor2 = rgba1.bgra;\n\
+else vertcolor2 = vec4(0.0);\n\
+}\n\
+vec4 coords[8] = vec4[8](strq0,strq1,strq2,strq3,strq4,strq5,strq6,strq7);\n\
+texcoord0 = coords[StateBits(uvec2(stageid0),34,3u)];\n\
+texcoord1 = coords[StateBits(uvec2(stageid1),34,3u)];\n\
+texcoord2 = coords[StateBits(uvec2(stageid2),34,3u)];\n\
+texcoord3 = coords[StateBits(uvec2(stageid3),34,3u)];\n\
+texcoord4 = coords[StateBits(uvec2(stageid4),34,3u)];\n\
+texcoord5 = coords[StateBits(uvec2(stageid5),34,3u)];\n\
+texcoord6 = coords[StateBits(uvec2(stageid6),34,3u)];\n\
+texcoord7 = coords[StateBits(uvec2(stageid7),34,3u)];\n\
+fogfragcoord = 0.0;\n\
+fogfactor = 1.0;\n\
+if(StateBit(id,61) && (StateBits(id,8,3u) != 0) && (StateBits(id,6,3u) == 0))\n\
+{\n\
+if(StateBit(id,10))\n\
+{\n\
+vec4 eyepos = matModelView*xyzw;\n\
+fogfragcoord = length(eyepos.xyz / eyepos.w);\n\
+}\n\
+else fogfragcoord = abs(matModelView*xyzw).z;\n\
+switch(StateBits(id,8,3u))\n\
+{\n\
+case 1:\n\
+fogfactor = 1.0 / exp(fogfragcoord * fogdensity);\n\
+break;\n\
+case 2:\n\
+fogfactor = 1.0 / exp(fogfragcoord * fogfragcoord * fogdensity * fogdensity);\n\
+break;\n\
+case 3:\n\
+fogfactor = (fogend - fogfragcoord) / (fogend - fogstart);\n\
+break;\n\
+}\n\
+fogfactor = clamp(fogfactor,0.0,1.0);\n\
+}\n\
+}\n";
+static const char uber_unif_frag[] = "uniform sampler2D tex0;\n\
+uniform sampler2D tex1;\n\
+uniform sampler2D tex2;\n\
+uniform sampler2D tex3;\n\
+uniform sampler2D tex4;\n\
+uniform sampler2D tex5;\n\
+uniform sampler2D tex6;\n\
+uniform sampler2D tex7;\n\
+uniform ivec3 key0;\n\
+uniform ivec3 key1;\n\
+uniform ivec3 key2;\n\
+uniform ivec3 key3;\n\
+uniform ivec3 key4;\n\
+uniform ivec3 key5;\n\
+uniform ivec3 key6;\n\
+uniform ivec3 key7;\n\
+uniform ivec4 keybits0;\n\
+uniform ivec4 keybits1;\n\
+uniform ivec4 keybits2;\n\
+uniform ivec4 keybits3;\n\
+uniform ivec4 keybits4;\n\
+uniform ivec4 keybits5;\n\
+uniform ivec4 keybits6;\n\
+uniform ivec4 keybits7;\n\
+uniform int alpharef;\n\
+uniform ivec4 ditherbits;\n";
+static const char uber_var_frag[] = "in float fogfragcoord;\n\
+in float fogfactor;\n\
+in vec4 vertcolor;\n\
+in vec4 vertcolor2;\n\
+in vec4 texcoord0;\n\
+in vec4 texcoord1;\n\
+in vec4 texcoord2;\n\
+in vec4 texcoord3;\n\
+in vec4 texcoord4;\n\
+in vec4 texcoord5;\n\
+in vec4 texcoord6;\n\
+in vec4 texcoord7;\n\
+vec4 texcoords[8];\n";
+static const char func_texstage[] = "vec4 TexArg(int arg, vec4 texel, bool bound, inout bool texfail)\n\
+{\n\
+vec4 value;\n\
+switch(arg & 7)\n\
+{\n\
+case 0:\n\
+value = vertcolor;\n\
+break;\n\
+case 2:\n\
+if(!bound) texfail = true;\n\
+value = texel;\n\
+break;\n\
+case 3:\n\
+value = vec4(1.0);\n\
+break;\n\
+case 4:\n\
+value = vertcolor2;\n\
+break;\n\
+default:\n\
+value = color;\n\
+break;\n\
+}\n\
+if((arg & 16) != 0) value = vec4(1.0) - value;\n\
+if((arg & 32) != 0) value = value.aaaa;\n\
+return value;\n\
+}\n\
+vec4 TexOp(int op, vec4 arg1, vec4 arg2, vec4 texel)\n\
+{\n\
+switch(op)\n\
+{\n\
+case 2:\n\
+return arg1;\n\
+case 3:\n\
+return arg2;\n\
+case 4:\n\
+return arg1 * arg2;\n\
+case 5:\n\
+return (arg1 * arg2) * 2.0;\n\
+case 6:\n\
+return (arg1 * arg2) * 4.0;\n\
+case 7:\n\
+return arg1 + arg2;\n\
+case 8:\n\
+return arg1 + arg2 - .5;\n\
+case 9:\n\
+return (arg1 + arg2 - .5) * 2.0;\n\
+case 10:\n\
+return arg1 - arg2;\n\
+case 11:\n\
+return arg1 + arg2 - arg1 * arg2;\n\
+case 12:\n\
+return arg1 * vertcolor.a + arg2 * (1.0-vertcolor.a);\n\
+case 13:\n\
+return arg1 * texel.a + arg2 * (1.0-texel.a);\n\
+case 14:\n\
+return arg1;\n\
+case 15:\n\
+return arg1 + arg2 * (1.0-texel.a);\n\
+case 16:\n\
+return arg1 * color.a + arg2 * (1.0-color.a);\n\
+default:\n\
+return color;\n\
+}\n\
+}\n\
+bool TexStage(ivec2 stageid, sampler2D tex, ivec3 key, ivec4 keybits, inout bool alphadisabled)\n\
+{\n\
+uvec2 state = uvec2(stageid);\n\
+int colorop = StateBits(state,0,31u);\n\
+if(colorop == 1) return false;\n\
+bool bound = StateBit(state,59);\n\
+bool texfail = false;\n\
+vec4 texel = textureProj(tex,texcoords[StateBits(state,34,7u)]);\n\
+if(StateBit(uvec2(stateid),13) && StateBit(state,60))\n\
+{\n\
+if(StateBit(state,61))\n\
+{\n\
+if(texel.a < .5) discard;\n\
+}\n\
+else\n\
+{\n\
+ivec4 keycomp = ivec4(texel*vec4(keybits)+.5);\n\
+if(keycomp.rgb == key) discard;\n\
+}\n\
+}\n\
+vec4 arg1 = TexArg(StateBits(state,5,63u),texel,bound,texfail);\n\
+vec4 arg2 = TexArg(StateBits(state,11,63u),texel,bound,texfail);\n\
+if(!texfail) color.rgb = TexOp(colorop,arg1,arg2,texel).rgb;\n\
+if(StateBits(state,17,31u) == 1) alphadisabled = true;\n\
+if(alphadisabled) return true;\n\
+texfail = false;\n\
+arg1 = TexArg(StateBits(state,22,63u),texel,bound,texfail);\n\
+arg2 = TexArg(StateBits(state,28,63u),texel,bound,texfail);\n\
+if(!texfail) color.a = TexOp(StateBits(state,17,31u),arg1,arg2,texel).a;\n\
+return true;\n\
+}\n";
+static const char uber_main_frag[] = "void main()\n\
+{\n\
+uvec2 id = uvec2(stateid);\n\
+texcoords[0] = texcoord0;\n\
+texcoords[1] = texcoord1;\n\
+texcoords[2] = texcoord2;\n\
+texcoords[3] = texcoord3;\n\
+texcoords[4] = texcoord4;\n\
+texcoords[5] = texcoord5;\n\
+texcoords[6] = texcoord6;\n\
+texcoords[7] = texcoord7;\n\
+color = vertcolor;\n\
+bool alphadisabled = false;\n\
+bool enabled = TexStage(stageid0,tex0,key0,keybits0,alphadisabled);\n\
+if(enabled) enabled = TexStage(stageid1,tex1,key1,keybits1,alphadisabled);\n\
+if(enabled) enabled = TexStage(stageid2,tex2,key2,keybits2,alphadisabled);\n\
+if(enabled) enabled = TexStage(stageid3,tex3,key3,keybits3,alphadisabled);\n\
+if(enabled) enabled = TexStage(stageid4,tex4,key4,keybits4,alphadisabled);\n\
+if(enabled) enabled = TexStage(stageid5,tex5,key5,keybits5,alphadisabled);\n\
+if(enabled) enabled = TexStage(stageid6,tex6,key6,keybits6,alphadisabled);\n\
+if(enabled) enabled = TexStage(stageid7,tex7,key7,keybits7,alphadisabled);\n\
+if(StateBit(id,2))\n\
+{\n\
+int alpha = int(color.a * 255.5);\n\
+switch(StateBits(id,3,7u))\n\
+{\n\
+case 0:\n\
+discard;\n\
+break;\n\
+case 1:\n\
+if(alpha >= alpharef) discard;\n\
+break;\n\
+case 2:\n\
+if(alpha != alpharef) discard;\n\
+break;\n\
+case 3:\n\
+if(alpha > alpharef) discard;\n\
+break;\n\
+case 4:\n\
+if(alpha <= alpharef) discard;\n\
+break;\n\
+case 5:\n\
+if(alpha == alpharef) discard;\n\
+break;\n\
+case 6:\n\
+if(alpha < alpharef) discard;\n\
+break;\n\
+}\n\
+}\n\
+if(StateBit(id,61))\n\
+{\n\
+int pixelfog = StateBits(id,6,3u);\n\
+if(pixelfog != 0)\n\
+{\n\
+float fogcoord = gl_FragCoord.z / gl_FragCoord.w;\n\
+float pixelfogfactor = 1.0;\n\
+switch(pixelfog)\n\
+{\n\
+case 1:\n\
+pixelfogfactor = 1.0 / exp(fogcoord * fogdensity);\n\
+break;\n\
+case 2:\n\
+pixelfogfactor = 1.0 / exp(fogcoord * fogcoord * fogdensity * fogdensity);\n\
+break;\n\
+case 3:\n\
+pixelfogfactor = (fogend - fogcoord) / (fogend - fogstart);\n\
+break;\n\
+}\n\
+color = mix(fogcolor,color,clamp(pixelfogfactor,0.0,1.0));\n\
+}\n\
+else if(StateBits(id,8,3u) != 0) color = mix(fogcolor,color,fogfactor);\n\
+}\n\
+if(StateBit(id,62)) color = dither(color);\n\
+FragColor = color;\n\
+}\n";
+
 /**
   * Adds an attribute to the shader.
   * @param str
@@ -612,28 +1332,28 @@ static void glslver(STRING* str, int major, int minor)
 		switch (minor)
 		{
 		case 0:
-			String_Append(str, version_110);
+			String_AppendConst(str, version_110);
 			break;
 		case 1:
 		default:
-			String_Append(str, version_120);
+			String_AppendConst(str, version_120);
 		}
 		break;
 	case 3:
 		switch (minor)
 		{
 		case 0:
-			String_Append(str, version_130);
+			String_AppendConst(str, version_130);
 			break;
 		case 1:
-			String_Append(str, version_140);
+			String_AppendConst(str, version_140);
 			break;
 		case 2:
-			String_Append(str, version_150);
+			String_AppendConst(str, version_150);
 			break;
 		case 3:
 		default:
-			String_Append(str, version_330);
+			String_AppendConst(str, version_330);
 			break;
 		}
 		break;
@@ -641,36 +1361,181 @@ static void glslver(STRING* str, int major, int minor)
 		switch (minor)
 		{
 		case 0:
-			String_Append(str, version_400);
+			String_AppendConst(str, version_400);
 			break;
 		case 1:
-			String_Append(str, version_410);
+			String_AppendConst(str, version_410);
 			break;
 		case 2:
-			String_Append(str, version_420);
+			String_AppendConst(str, version_420);
 			break;
 		case 3:
-			String_Append(str, version_430);
+			String_AppendConst(str, version_430);
 			break;
 		case 4:
-			String_Append(str, version_440);
+			String_AppendConst(str, version_440);
 			break;
 		case 5:
-			String_Append(str, version_450);
+			String_AppendConst(str, version_450);
 			break;
 		case 6:
 		default:
-			String_Append(str, version_460);
+			String_AppendConst(str, version_460);
 			break;
 		}
 		break;
 	default:
-		if (major > 4) String_Append(str, version_460);
-		else String_Append(str, version_110);
+		if (major > 4) String_AppendConst(str, version_460);
+		else String_AppendConst(str, version_110);
 		break;
 	}
 }
 
+/**
+  * Looks up the attribute and uniform locations of a linked generated shader.
+  * @param This
+  *  Pointer to ShaderGen3D structure
+  * @param shader
+  *  Pointer to the shader to look up
+  */
+static void ShaderGen3D_GetLocations(ShaderGen3D *This, _GENSHADER *shader)
+{
+	// Attributes
+	shader->attribs[0] = This->ext->glGetAttribLocation(shader->prog,"xyz");
+	shader->attribs[1] = This->ext->glGetAttribLocation(shader->prog,"rhw");
+	shader->attribs[2] = This->ext->glGetAttribLocation(shader->prog,"blend0");
+	shader->attribs[3] = This->ext->glGetAttribLocation(shader->prog,"blend1");
+	shader->attribs[4] = This->ext->glGetAttribLocation(shader->prog,"blend2");
+	shader->attribs[5] = This->ext->glGetAttribLocation(shader->prog,"blend3");
+	shader->attribs[6] = This->ext->glGetAttribLocation(shader->prog,"blend4");
+	shader->attribs[7] = This->ext->glGetAttribLocation(shader->prog,"nxyz");
+	shader->attribs[8] = This->ext->glGetAttribLocation(shader->prog,"rgba0");
+	shader->attribs[9] = This->ext->glGetAttribLocation(shader->prog,"rgba1");
+	char attrS[] = "sX";
+	for(int i = 0; i < 8; i++)
+	{
+		attrS[1] = i + '0';
+		shader->attribs[i + 10] = This->ext->glGetAttribLocation(shader->prog, attrS);
+	}
+	char attrST[] = "stX";
+	for(int i = 0; i < 8; i++)
+	{
+		attrST[2] = i + '0';
+		shader->attribs[i + 18] = This->ext->glGetAttribLocation(shader->prog, attrST);
+	}
+	char attrSTR[] = "strX";
+	for(int i = 0; i < 8; i++)
+	{
+		attrSTR[3] = i + '0';
+		shader->attribs[i + 26] = This->ext->glGetAttribLocation(shader->prog, attrSTR);
+	}
+	char attrSTRQ[] = "strqX";
+	for(int i = 0; i < 8; i++)
+	{
+		attrSTRQ[4] = i + '0';
+		shader->attribs[i + 34] = This->ext->glGetAttribLocation(shader->prog, attrSTRQ);
+	}
+	// Uniforms
+	shader->uniforms[0] = This->ext->glGetUniformLocation(shader->prog, "matWorld");
+	shader->uniforms[1] = This->ext->glGetUniformLocation(shader->prog, "matModelView");
+	shader->uniforms[2] = This->ext->glGetUniformLocation(shader->prog, "matProjection");
+	shader->uniforms[3] = This->ext->glGetUniformLocation(shader->prog, "matNormal");
+	shader->uniforms[4] = This->ext->glGetUniformLocation(shader->prog, "matMVP");
+	// TODO: 5-14 world1-3 and texture0-7
+	char uniflight[] = "lightX.            ";
+	for(int i = 0; i < 8; i++)
+	{
+		uniflight[5] = i + '0';
+		strcpy(uniflight+7,"diffuse");
+		shader->uniforms[20 + (i * 12)] = This->ext->glGetUniformLocation(shader->prog, uniflight);
+		strcpy(uniflight+7,"specular");
+		shader->uniforms[21 + (i * 12)] = This->ext->glGetUniformLocation(shader->prog, uniflight);
+		strcpy(uniflight+7,"ambient");
+		shader->uniforms[22 + (i * 12)] = This->ext->glGetUniformLocation(shader->prog, uniflight);
+		strcpy(uniflight+7,"position");
+		shader->uniforms[23 + (i * 12)] = This->ext->glGetUniformLocation(shader->prog, uniflight);
+		strcpy(uniflight+7,"direction");
+		shader->uniforms[24 + (i * 12)] = This->ext->glGetUniformLocation(shader->prog, uniflight);
+		strcpy(uniflight+7,"range");
+		shader->uniforms[25 + (i * 12)] = This->ext->glGetUniformLocation(shader->prog, uniflight);
+		strcpy(uniflight+7,"falloff");
+		shader->uniforms[26 + (i * 12)] = This->ext->glGetUniformLocation(shader->prog, uniflight);
+		strcpy(uniflight+7,"constant");
+		shader->uniforms[27 + (i * 12)] = This->ext->glGetUniformLocation(shader->prog, uniflight);
+		strcpy(uniflight+7,"linear");
+		shader->uniforms[28 + (i * 12)] = This->ext->glGetUniformLocation(shader->prog, uniflight);
+		strcpy(uniflight+7,"quad");
+		shader->uniforms[29 + (i * 12)] = This->ext->glGetUniformLocation(shader->prog, uniflight);
+		strcpy(uniflight+7,"theta");
+		shader->uniforms[30 + (i * 12)] = This->ext->glGetUniformLocation(shader->prog, uniflight);
+		strcpy(uniflight+7,"phi");
+		shader->uniforms[31 + (i * 12)] = This->ext->glGetUniformLocation(shader->prog, uniflight);
+	}
+	char uniftex[] = "texX";
+	for(int i = 0; i < 8; i++)
+	{
+		uniftex[3] = i + '0';
+		shader->uniforms[128 + i] = This->ext->glGetUniformLocation(shader->prog, uniftex);
+	}
+	shader->uniforms[136] = This->ext->glGetUniformLocation(shader->prog,"ambientcolor");
+	shader->uniforms[137] = This->ext->glGetUniformLocation(shader->prog,"width");
+	shader->uniforms[138] = This->ext->glGetUniformLocation(shader->prog,"height");
+	shader->uniforms[139] = This->ext->glGetUniformLocation(shader->prog,"xoffset");
+	shader->uniforms[140] = This->ext->glGetUniformLocation(shader->prog,"yoffset");
+	shader->uniforms[141] = This->ext->glGetUniformLocation(shader->prog,"alpharef");
+	char unifkey[] = "keyX";
+	for(int i = 0; i < 8; i++)
+	{
+		unifkey[3] = i + '0';
+		shader->uniforms[142 + i] = This->ext->glGetUniformLocation(shader->prog, unifkey);
+	}
+	shader->uniforms[150] = This->ext->glGetUniformLocation(shader->prog,"ditherbits");
+	shader->uniforms[151] = This->ext->glGetUniformLocation(shader->prog, "minz");
+	shader->uniforms[152] = This->ext->glGetUniformLocation(shader->prog, "maxz");
+	char unifkeybits[] = "keybitsX";
+	for (int i = 0; i < 8; i++)
+	{
+		unifkeybits[7] = i + '0';
+		shader->uniforms[153 + i] = This->ext->glGetUniformLocation(shader->prog, unifkeybits);
+	}
+	shader->uniforms[161] = This->ext->glGetUniformLocation(shader->prog, "mtlambient");
+	shader->uniforms[162] = This->ext->glGetUniformLocation(shader->prog, "mtldiffuse");
+	shader->uniforms[163] = This->ext->glGetUniformLocation(shader->prog, "mtlspecular");
+	shader->uniforms[164] = This->ext->glGetUniformLocation(shader->prog, "mtlemission");
+	shader->uniforms[165] = This->ext->glGetUniformLocation(shader->prog, "mtlshininess");
+
+	shader->uniforms[166] = This->ext->glGetUniformLocation(shader->prog, "fogcolor");
+	shader->uniforms[167] = This->ext->glGetUniformLocation(shader->prog, "fogstart");
+	shader->uniforms[168] = This->ext->glGetUniformLocation(shader->prog, "fogend");
+	shader->uniforms[169] = This->ext->glGetUniformLocation(shader->prog, "fogdensity");
+	// Render states read at run time by the ubershader
+	shader->uniforms[170] = This->ext->glGetUniformLocation(shader->prog, "stateid");
+	char unifstage[] = "stageidX";
+	for (int i = 0; i < 8; i++)
+	{
+		unifstage[7] = i + '0';
+		shader->uniforms[171 + i] = This->ext->glGetUniformLocation(shader->prog, unifstage);
+	}
+	shader->samplersset = FALSE;
+	// Uniforms are zero after linking, which a zeroed shadow copy matches
+	if (!shader->shadow)
+		shader->shadow = (GLfloat*)malloc(GENSHADER_SHADOWSIZE * sizeof(GLfloat));
+	if (shader->shadow)
+		ZeroMemory(shader->shadow, GENSHADER_SHADOWSIZE * sizeof(GLfloat));
+	if (This->ext->GLEXT_ARB_uniform_buffer_object)
+	{
+		static const char *blocks[] = { "Transforms", "Material", "Lights", "DrawTextures" };
+		static const GLuint bindings[] = { UBO_BINDING_TRANSFORMS, UBO_BINDING_MATERIAL, UBO_BINDING_LIGHTS,
+			UBO_BINDING_DRAWTEXTURES };
+		for (int i = 0; i < 4; i++)
+		{
+			GLuint block = This->ext->glGetUniformBlockIndex(shader->prog, blocks[i]);
+			if (block != GL_INVALID_INDEX)
+				This->ext->glUniformBlockBinding(shader->prog, block, bindings[i]);
+		}
+	}
+}
+
 /**
   * Creates an OpenGL shader program
   * @param This
@@ -696,6 +1561,7 @@ void ShaderGen3D_CreateShader(ShaderGen3D *This, int index, __int64 id, __int64
 	BOOL haskey = FALSE;
 	int count;
 	int numlights;
+	BOOL lightloop = FALSE;
 	int numtex;
 	int vertexfog,pixelfog;
 	vertexfog = pixelfog = 0;
@@ -711,13 +1577,28 @@ void ShaderGen3D_CreateShader(ShaderGen3D *This, int index, __int64 id, __int64
 	idstring[21] = 0;
 	This->genshaders[index].shader.vsrc.ptr = NULL;
 	This->genshaders[index].shader.fsrc.ptr = NULL;
+	// Skip generating and compiling the shader if a cached binary loads
+	This->genshaders[index].shader.prog =
+		ShaderCache_LoadProgram(This->shaders->cache, SHADERCACHE_TYPE3D, id, texstate);
+	if (This->genshaders[index].shader.prog)
+	{
+		glObjectLabel(GL_PROGRAM, This->genshaders[index].shader.prog, -1, idstring);
+		This->genshaders[index].shader.vs = This->genshaders[index].shader.fs = 0;
+		ShaderGen3D_GetLocations(This, &This->genshaders[index].shader);
+		This->genshaders[index].id = id;
+		memcpy(This->genshaders[index].texids, texstate, 8 * sizeof(__int64));
+		return;
+	}
 	// Create vertex shader
 	//Header
 	STRING *vsrc = &This->genshaders[index].shader.vsrc;
-	String_Append(vsrc, header);
+	// Room for a typical shader up front, so it isn't grown while it is built
+	String_Reserve(vsrc, 8192);
+	String_AppendConst(vsrc, header);
 	glslver(vsrc, This->ext->glver_major, This->ext->glver_minor);
-	String_Append(vsrc, vertexshader);
-	String_Append(vsrc, idheader);
+	if ((id >> 17) & 1) String_AppendConst(vsrc, ext_drawparams);
+	String_AppendConst(vsrc, vertexshader);
+	String_AppendConst(vsrc, idheader);
 	String_Append(vsrc, idstring);
 	// Attributes
 	append_attr(vsrc, attr_xyz, This->ext->glver_major);
@@ -734,7 +1615,7 @@ void ShaderGen3D_CreateShader(ShaderGen3D *This, int index, __int64 id, __int64
 		append_attr(vsrc, tmp.ptr, This->ext->glver_major);
 	}
 	if((id>>37)&1) append_attr(vsrc, attr_nxyz, This->ext->glver_major);
-	else String_Append(vsrc, const_nxyz);
+	else String_AppendConst(vsrc, const_nxyz);
 	count = (id>>46)&7;
 	if(count)
 	{
@@ -770,46 +1651,65 @@ void ShaderGen3D_CreateShader(ShaderGen3D *This, int index, __int64 id, __int64
 	}
 
 	// Uniforms
-	String_Append(vsrc, unif_ambient);
-	if((id>>50)&1) String_Append(vsrc, unif_viewport);
+	String_AppendConst(vsrc, unif_ambient);
+	if((id>>50)&1) String_AppendConst(vsrc, unif_viewport);
 	if((id>>59)&1) numlights = (id>>18)&7;
 	else numlights = 0;
 	if((id>>50)&1) numlights = 0;
-	if(numlights) // Lighting
+	// With uniform buffer objects the lights are read in a loop from the Lights block
+	if (This->ext->GLEXT_ARB_uniform_buffer_object && (((id >> 59) & 1) && !((id >> 50) & 1))
+		&& (numlights || ((id >> 63) & 1)))
+	{
+		lightloop = TRUE;
+		numlights = 0;
+	}
+	if (This->ext->GLEXT_ARB_uniform_buffer_object)
+	{
+		// The blocks are shared by every shader, so they are declared whole
+		if (lightloop || !((id >> 49) & 1) || !((id >> 50) & 1) || vertexfog)
+			String_AppendConst(vsrc, block_transforms);
+		if (lightloop)
+		{
+			String_AppendConst(vsrc, lightstruct);
+			String_AppendConst(vsrc, block_material);
+			String_AppendConst(vsrc, block_lights);
+		}
+	}
+	else if(numlights) // Lighting
 	{
-		String_Append(vsrc, lightstruct);
-		String_Append(vsrc, unif_world);
-		String_Append(vsrc, unif_normal);
-		String_Append(vsrc, unif_material);
+		String_AppendConst(vsrc, lightstruct);
+		String_AppendConst(vsrc, unif_world);
+		String_AppendConst(vsrc, unif_normal);
+		String_AppendConst(vsrc, unif_material);
 		String_Assign(&tmp, unif_light);
 		for(i = 0; i < numlights; i++)
 		{
 			tmp.ptr[19] = *(_itoa(i,idstring,10));
-			String_Append(vsrc, tmp.ptr);
+			String_AppendN(vsrc, tmp.ptr, tmp.length);
 		}
 	}
-	else if (!((id >> 49) & 1)) String_Append(vsrc, unif_normal);
-	if (numlights || !((id >> 50) & 1) || vertexfog)
+	else if (!((id >> 49) & 1)) String_AppendConst(vsrc, unif_normal);
+	if (!This->ext->GLEXT_ARB_uniform_buffer_object)
 	{
-		String_Append(vsrc, unif_modelview);
-		String_Append(vsrc, unif_projection);
+		if (numlights || vertexfog) String_AppendConst(vsrc, unif_modelview);
+		if (!((id >> 50) & 1)) String_AppendConst(vsrc, unif_mvp);
 	}
 	if (vertexfog || pixelfog)
 	{
-		String_Append(vsrc, unif_fogcolor);
-		String_Append(vsrc, unif_fogstart);
-		String_Append(vsrc, unif_fogend);
-		String_Append(vsrc, unif_fogdensity);
+		String_AppendConst(vsrc, unif_fogcolor);
+		String_AppendConst(vsrc, unif_fogstart);
+		String_AppendConst(vsrc, unif_fogend);
+		String_AppendConst(vsrc, unif_fogdensity);
 		append_varying(vsrc, var_fogfragcoord, This->ext->glver_major, FALSE, TRUE);
 	}
 	// Variables
-	String_Append(vsrc, var_common);
+	String_AppendConst(vsrc, var_common);
 	if (This->ext->glver_major >= 3)
 	{
 		append_varying(vsrc, var_colors1, This->ext->glver_major, FALSE, id & 1);
 		append_varying(vsrc, var_colors2, This->ext->glver_major, FALSE, id & 1);
 	}
-	String_Append(vsrc, var_xyzw);
+	String_AppendConst(vsrc, var_xyzw);
 	if(vertexfog && !pixelfog) append_varying(vsrc, var_fogfactorvertex, This->ext->glver_major, FALSE, TRUE);
 	for (i = 0; i < numtex; i++)
 	{
@@ -817,6 +1717,7 @@ void ShaderGen3D_CreateShader(ShaderGen3D *This, int index, __int64 id, __int64
 		tmp.ptr[13] = i + '0';
 		append_varying(vsrc, tmp.ptr, This->ext->glver_major, FALSE, TRUE);
 	}
+	if ((id >> 17) & 1) append_varying(vsrc, var_drawid, This->ext->glver_major, FALSE, FALSE);
 
 	// Functions
 	if(numlights)
@@ -832,20 +1733,24 @@ void ShaderGen3D_CreateShader(ShaderGen3D *This, int index, __int64 id, __int64
 		}
 	}
 	bool hasspecular = (id >> 11) & 1;
-	if(hasspot) String_Append(vsrc, func_spotlight);
-	if(haspoint) String_Append(vsrc, func_pointlight);
-	if(hasdir) String_Append(vsrc, func_dirlight);
+	if(lightloop) hasspot = haspoint = hasdir = true;
+	if(hasspot) String_AppendConst(vsrc, func_spotlight);
+	if(haspoint) String_AppendConst(vsrc, func_pointlight);
+	if(hasdir) String_AppendConst(vsrc, func_dirlight);
+	if(lightloop) String_AppendConst(vsrc, func_lightloop);
 	//Main
-	String_Append(vsrc, mainstart);
-	if((id>>50)&1) String_Append(vsrc, op_tlvertex);
-	else String_Append(vsrc, op_transform);
-	if((id>>49)&1) String_Append(vsrc, op_normalize);
-	else String_Append(vsrc, op_normalpassthru);
+	String_AppendConst(vsrc, mainstart);
+	if ((id >> 17) & 1) String_AppendConst(vsrc, op_drawid);
+	if((id>>50)&1) String_AppendConst(vsrc, op_tlvertex);
+	else String_AppendConst(vsrc, op_transform);
+	if((id>>49)&1) String_AppendConst(vsrc, op_normalize);
+	else String_AppendConst(vsrc, op_normalpassthru);
 	const char *colorargs[] = {"mtldiffuse","mtlambient","mtlspecular",
 		"mtlemission","rgba0.bgra","rgba1.bgra"};
-	if(numlights)
+	if(numlights || lightloop)
 	{
-		String_Append(vsrc, op_resetcolor);
+		String_AppendConst(vsrc, op_resetcolor);
+		if(lightloop) String_AppendConst(vsrc, op_lightloop);
 		for(i = 0; i < numlights; i++)
 		{
 			if(id>>(38+i)&1)
@@ -854,20 +1759,20 @@ void ShaderGen3D_CreateShader(ShaderGen3D *This, int index, __int64 id, __int64
 				{
 					String_Assign(&tmp, op_spotlight);
 					tmp.ptr[15] = *(_itoa(i,idstring,10));
-					String_Append(vsrc, tmp.ptr);
+					String_AppendN(vsrc, tmp.ptr, tmp.length);
 				}
 				else
 				{
 					String_Assign(&tmp, op_pointlight);
 					tmp.ptr[16] = *(_itoa(i,idstring,10));
-					String_Append(vsrc, tmp.ptr);
+					String_AppendN(vsrc, tmp.ptr, tmp.length);
 				}
 			}
 			else
 			{
 				String_Assign(&tmp, op_dirlight);
 				tmp.ptr[14] = *(_itoa(i,idstring,10));
-				String_Append(vsrc, tmp.ptr);
+				String_AppendN(vsrc, tmp.ptr, tmp.length);
 			}
 		}
 		if((id>>60)&1)
@@ -902,26 +1807,26 @@ void ShaderGen3D_CreateShader(ShaderGen3D *This, int index, __int64 id, __int64
 		}
 		else
 		{
-			if(This->ext->glver_major < 3) String_Append(vsrc, op_colorout_gl2);
-			else String_Append(vsrc, op_colorout);
+			if(This->ext->glver_major < 3) String_AppendConst(vsrc, op_colorout_gl2);
+			else String_AppendConst(vsrc, op_colorout);
 		}
 	}
 	else
 	{
 		if ((id >> 35) & 1)
 		{
-			if (This->ext->glver_major < 3) String_Append(vsrc, op_colorvert_gl2);
-			else String_Append(vsrc, op_colorvert);
+			if (This->ext->glver_major < 3) String_AppendConst(vsrc, op_colorvert_gl2);
+			else String_AppendConst(vsrc, op_colorvert);
 		}
 		else
 		{
-			if (This->ext->glver_major < 3) String_Append(vsrc, op_colorwhite_gl2);
-			else String_Append(vsrc, op_colorwhite);
+			if (This->ext->glver_major < 3) String_AppendConst(vsrc, op_colorwhite_gl2);
+			else String_AppendConst(vsrc, op_colorwhite);
 		}
 		if ((id >> 36) & 1)
 		{
-			if (This->ext->glver_major < 3) String_Append(vsrc, op_color2vert_gl2);
-			else String_Append(vsrc, op_color2vert);
+			if (This->ext->glver_major < 3) String_AppendConst(vsrc, op_color2vert_gl2);
+			else String_AppendConst(vsrc, op_color2vert);
 		}
 	}
 	int texindex;
@@ -935,129 +1840,121 @@ void ShaderGen3D_CreateShader(ShaderGen3D *This, int index, __int64 id, __int64
 		{
 			String_Assign(&tmp,op_texpassthru1);
 			tmp.ptr[8] = *(_itoa(i,idstring,10));
-			String_Append(vsrc, tmp.ptr);
+			String_AppendN(vsrc, tmp.ptr, tmp.length);
 			texindex = (texstate[i]>>34)&3;
 			switch ((texstate[texindex] >> 51) & 3)
 			{
 			case 0: // s
 				String_Assign(&tmp, op_texpassthru2s);
 				tmp.ptr[6] = *(_itoa(texindex, idstring, 10));
-				String_Append(vsrc, tmp.ptr);
+				String_AppendN(vsrc, tmp.ptr, tmp.length);
 				break;
 			case 1: // st
 				String_Assign(&tmp, op_texpassthru2st);
 				tmp.ptr[7] = *(_itoa(texindex,idstring,10));
-				String_Append(vsrc, tmp.ptr);
+				String_AppendN(vsrc, tmp.ptr, tmp.length);
 				break;
 			case 2: // str
 				String_Assign(&tmp, op_texpassthru2str);
 				tmp.ptr[8] = *(_itoa(texindex,idstring,10));
-				String_Append(vsrc, tmp.ptr);
+				String_AppendN(vsrc, tmp.ptr, tmp.length);
 				break;
 			case 3: // strq
 				String_Assign(&tmp, op_texpassthru2strq);
 				tmp.ptr[4] = *(_itoa(texindex,idstring,10));
-				String_Append(vsrc, tmp.ptr);
+				String_AppendN(vsrc, tmp.ptr, tmp.length);
 				break;
 			}
 		}
 	}
 	if(vertexfog && !pixelfog)
 	{
-		if((id>>10)&1) String_Append(vsrc, op_fogcoordrange);
-		else String_Append(vsrc, op_fogcoordstandard);
+		if((id>>10)&1) String_AppendConst(vsrc, op_fogcoordrange);
+		else String_AppendConst(vsrc, op_fogcoordstandard);
 		switch(vertexfog)
 		{
 		case D3DFOG_LINEAR:
-			String_Append(vsrc, op_foglinear);
+			String_AppendConst(vsrc, op_foglinear);
 			break;
 		case D3DFOG_EXP:
-			String_Append(vsrc, op_fogexp);
+			String_AppendConst(vsrc, op_fogexp);
 			break;
 		case D3DFOG_EXP2:
-			String_Append(vsrc, op_fogexp2);
+			String_AppendConst(vsrc, op_fogexp2);
 			break;
 		}
-		String_Append(vsrc, op_fogclamp);
+		String_AppendConst(vsrc, op_fogclamp);
 	}
-	String_Append(vsrc, mainend);
-#ifdef _DEBUG
-	OutputDebugStringA("Vertex shader:\n");
-	OutputDebugStringA(vsrc->ptr);
-	OutputDebugStringA("\nCompiling vertex shader:\n");
-	TRACE_STRING("Vertex shader:\n");
-	TRACE_STRING(vsrc->ptr);
-	TRACE_STRING("\nCompiling vertex shader:\n");
-#endif
-	This->genshaders[index].shader.vs = This->ext->glCreateShader(GL_VERTEX_SHADER);
-	const char *src = vsrc->ptr;
-	GLint srclen = strlen(src);
-	This->ext->glShaderSource(This->genshaders[index].shader.vs,1,&src,&srclen);
-	This->ext->glCompileShader(This->genshaders[index].shader.vs);
-	glObjectLabel(GL_SHADER, This->genshaders[index].shader.vs, -1, idstring);
-	GLint result;
-	char *infolog = NULL;
-	This->ext->glGetShaderiv(This->genshaders[index].shader.vs,GL_COMPILE_STATUS,&result);
-#ifdef _DEBUG
-	GLint loglen;
-	if(!result)
-	{
-		This->ext->glGetShaderiv(This->genshaders[index].shader.vs,GL_INFO_LOG_LENGTH,&loglen);
-		infolog = (char*)malloc(loglen);
-		This->ext->glGetShaderInfoLog(This->genshaders[index].shader.vs,loglen,&result,infolog);
-		OutputDebugStringA("Compilation failed. Error messages:\n");
-		OutputDebugStringA(infolog);
-		TRACE_STRING("Compilation failed. Error messages:\n");
-		TRACE_STRING(infolog);
-		free(infolog);
-	}
-#endif
+	String_AppendConst(vsrc, mainend);
 	// Create fragment shader
 	if ((id>>62)&1)	dither = true;
 	STRING *fsrc = &This->genshaders[index].shader.fsrc;
-	String_Append(fsrc, header);
+	String_Reserve(fsrc, 8192);
+	String_AppendConst(fsrc, header);
 	glslver(fsrc, This->ext->glver_major, This->ext->glver_minor);
-	String_Append(fsrc, fragshader);
+	if (This->ext->GLEXT_ARB_bindless_texture) String_AppendConst(fsrc, ext_bindless);
+	String_AppendConst(fsrc, fragshader);
 	_snprintf(idstring,21,"%0.16I64X\n",id);
 	idstring[21] = 0;
-	String_Append(fsrc, idheader);
+	String_AppendConst(fsrc, idheader);
 	String_Append(fsrc, idstring);
 	// Uniforms
+	if ((id >> 17) & 1)
+	{
+		// Two handles per uvec4, eight stages per draw
+		append_varying(fsrc, var_drawid, This->ext->glver_major, TRUE, FALSE);
+		String_AppendConst(fsrc, unif_drawtextures);
+	}
 	for(i = 0; i < 8; i++)
 	{
 		if((texstate[i] & 31) == D3DTOP_DISABLE)break;
-		String_Assign(&tmp, unif_tex);
-		tmp.ptr[21] = *(_itoa(i,idstring,10));
-		String_Append(fsrc, tmp.ptr);
+		if ((id >> 17) & 1)
+		{
+			String_Assign(&tmp, def_drawtexture);
+			tmp.ptr[11] = *(_itoa(i, idstring, 10));
+			tmp.ptr[44] = *(_itoa(i / 2, idstring, 10));
+			if (i & 1)
+			{
+				tmp.ptr[47] = 'z';
+				tmp.ptr[48] = 'w';
+			}
+		}
+		else
+		{
+			String_Assign(&tmp, unif_tex);
+			tmp.ptr[21] = *(_itoa(i, idstring, 10));
+		}
+		String_AppendN(fsrc, tmp.ptr, tmp.length);
 	}
 	if((id>>13)&1)
 	{
 		for(i = 0; i < 8; i++)
 		{
-			if((texstate[i]>>60)&1)
+			// Keys stored in the texture alpha need no uniforms
+			if(((texstate[i]>>60)&1) && !((texstate[i]>>61)&1))
 			{
 				String_Assign(&tmp, unif_key);
 				tmp.ptr[17] = *(_itoa(i,idstring,10));
-				String_Append(fsrc, tmp.ptr);
+				String_AppendN(fsrc, tmp.ptr, tmp.length);
 				String_Assign(&tmp, unif_keybits);
 				tmp.ptr[21] = *(_itoa(i, idstring, 10));
-				String_Append(fsrc, tmp.ptr);
+				String_AppendN(fsrc, tmp.ptr, tmp.length);
 				haskey = TRUE;
 			}
 		}
 	}
-	if((id>>2)&1) String_Append(fsrc, unif_alpharef);
-	if (dither) String_Append(fsrc, unif_ditherbits);
+	if((id>>2)&1) String_AppendConst(fsrc, unif_alpharef);
+	if (dither) String_AppendConst(fsrc, unif_ditherbits);
 	if (vertexfog || pixelfog)
 	{
-		String_Append(fsrc, unif_fogcolor);
-		String_Append(fsrc, unif_fogstart);
-		String_Append(fsrc, unif_fogend);
-		String_Append(fsrc, unif_fogdensity);
+		String_AppendConst(fsrc, unif_fogcolor);
+		String_AppendConst(fsrc, unif_fogstart);
+		String_AppendConst(fsrc, unif_fogend);
+		String_AppendConst(fsrc, unif_fogdensity);
 		append_varying(fsrc, var_fogfragcoord, This->ext->glver_major, TRUE, TRUE);
 	}
 	// Variables
-	String_Append(fsrc, var_color);
+	String_AppendConst(fsrc, var_color);
 	if (This->ext->glver_major >= 3)
 	{
 		append_varying(fsrc, var_colors1, This->ext->glver_major, TRUE, id & 1);
@@ -1065,13 +1962,13 @@ void ShaderGen3D_CreateShader(ShaderGen3D *This, int index, __int64 id, __int64
 	}
 	else
 	{
-		String_Append(fsrc, var_colors1);
-		String_Append(fsrc, var_colors2);
+		String_AppendConst(fsrc, var_colors1);
+		String_AppendConst(fsrc, var_colors2);
 	}
 	if(vertexfog && !pixelfog) append_varying(fsrc, var_fogfactorvertex, This->ext->glver_major, TRUE, TRUE);
-	if(pixelfog) String_Append(fsrc, var_fogfactorpixel);
-	if (dither) String_Append(fsrc, const_threshold);
-	if (haskey) String_Append(fsrc, var_keycomp);
+	if(pixelfog) String_AppendConst(fsrc, var_fogfactorpixel);
+	if (dither) String_AppendConst(fsrc, const_threshold);
+	if (haskey) String_AppendConst(fsrc, var_keycomp);
 	for (i = 0; i < numtex; i++)
 	{
 		String_Assign(&tmp, var_texcoord);
@@ -1079,13 +1976,13 @@ void ShaderGen3D_CreateShader(ShaderGen3D *This, int index, __int64 id, __int64
 		append_varying(fsrc, tmp.ptr, This->ext->glver_major, TRUE, TRUE);
 	}
 	// Outputs
-	if (This->ext->glver_major >= 3) String_Append(fsrc, out_fragcolor);
+	if (This->ext->glver_major >= 3) String_AppendConst(fsrc, out_fragcolor);
 	// Functions
-	if (dither) String_Append(fsrc, func_dither);
+	if (dither) String_AppendConst(fsrc, func_dither);
 	// Main
-	String_Append(fsrc, mainstart);
-	if (This->ext->glver_major < 3) String_Append(fsrc, op_colorsgl2);
-	String_Append(fsrc, op_colorfragin);
+	String_AppendConst(fsrc, mainstart);
+	if (This->ext->glver_major < 3) String_AppendConst(fsrc, op_colorsgl2);
+	String_AppendConst(fsrc, op_colorfragin);
 	STRING arg1,arg2;
 	STRING texarg;
 	ZeroMemory(&arg1, sizeof(STRING));
@@ -1108,16 +2005,23 @@ void ShaderGen3D_CreateShader(ShaderGen3D *This, int index, __int64 id, __int64
 		// Color key
 		if(usecolorkey)
 		{
-			if((texstate[i]>>60)&1)
+			if(((texstate[i]>>60)&1) && ((texstate[i]>>61)&1))
+			{
+				String_Assign(&arg1, op_colorkeyalpha);
+				arg1.ptr[20] = *(_itoa(i, idstring, 10));
+				arg1.ptr[30] = *(_itoa((texstate[i] >> 34) & 7, idstring, 10));
+				String_AppendN(fsrc, arg1.ptr, arg1.length);
+			}
+			else if((texstate[i]>>60)&1)
 			{
 				String_Assign(&arg1, op_colorkeyin);
 				arg1.ptr[33] = *(_itoa(i, idstring, 10));
 				arg1.ptr[43] = *(_itoa((texstate[i] >> 34) & 7, idstring, 10));
 				arg1.ptr[58] = *(_itoa(i, idstring, 10));
-				String_Append(fsrc, arg1.ptr);
+				String_AppendN(fsrc, arg1.ptr, arg1.length);
 				String_Assign(&arg1, op_colorkey);
 				arg1.ptr[21] = *(_itoa(i,idstring,10));
-				String_Append(fsrc, arg1.ptr);
+				String_AppendN(fsrc, arg1.ptr, arg1.length);
 			}
 		}
 		// Color stage
@@ -1152,7 +2056,7 @@ void ShaderGen3D_CreateShader(ShaderGen3D *This, int index, __int64 id, __int64
 		{
 			String_Assign(&tmp, arg1.ptr);
 			String_Append(&tmp, "(1.0 - ");
-			String_Append(&tmp, arg1.ptr);
+			String_AppendN(&tmp, arg1.ptr, arg1.length);
 			String_Append(&tmp, ")");
 			String_Assign(&arg1, tmp.ptr);
 		}
@@ -1188,7 +2092,7 @@ void ShaderGen3D_CreateShader(ShaderGen3D *This, int index, __int64 id, __int64
 		{
 			String_Assign(&tmp, arg2.ptr);
 			String_Append(&tmp, "(1.0 - ");
-			String_Append(&tmp, arg2.ptr);
+			String_AppendN(&tmp, arg2.ptr, arg2.length);
 			String_Append(&tmp, ")");
 			String_Assign(&arg2, tmp.ptr);
 		}
@@ -1201,79 +2105,79 @@ void ShaderGen3D_CreateShader(ShaderGen3D *This, int index, __int64 id, __int64
 			break;
 		case D3DTOP_SELECTARG1:
 			String_Append(fsrc, "color.rgb = ");
-				String_Append(fsrc, arg1.ptr);
+				String_AppendN(fsrc, arg1.ptr, arg1.length);
 				String_Append(fsrc, ";\n");
 			break;
 		case D3DTOP_SELECTARG2:
 			String_Append(fsrc, "color.rgb = ");
-			String_Append(fsrc, arg2.ptr);
+			String_AppendN(fsrc, arg2.ptr, arg2.length);
 			String_Append(fsrc, ";\n");
 			break;
 		case D3DTOP_MODULATE:
 			String_Append(fsrc, "color.rgb = ");
-			String_Append(fsrc, arg1.ptr);
+			String_AppendN(fsrc, arg1.ptr, arg1.length);
 			String_Append(fsrc, " * ");
-			String_Append(fsrc, arg2.ptr);
+			String_AppendN(fsrc, arg2.ptr, arg2.length);
 			String_Append(fsrc, ";\n");
 			break;
 		case D3DTOP_MODULATE2X:
 			String_Append(fsrc, "color.rgb = (");
-			String_Append(fsrc, arg1.ptr);
+			String_AppendN(fsrc, arg1.ptr, arg1.length);
 			String_Append(fsrc, " * ");
-			String_Append(fsrc, arg2.ptr);
+			String_AppendN(fsrc, arg2.ptr, arg2.length);
 			String_Append(fsrc, ") * 2.0;\n");
 			break;
 		case D3DTOP_MODULATE4X:
 			String_Append(fsrc, "color.rgb = (");
-			String_Append(fsrc, arg1.ptr);
+			String_AppendN(fsrc, arg1.ptr, arg1.length);
 			String_Append(fsrc, " * ");
-			String_Append(fsrc, arg2.ptr);
+			String_AppendN(fsrc, arg2.ptr, arg2.length);
 			String_Append(fsrc, ") * 4.0;\n");
 			break;
 		case D3DTOP_ADD:
 			String_Append(fsrc, "color.rgb = ");
-			String_Append(fsrc, arg1.ptr);
+			String_AppendN(fsrc, arg1.ptr, arg1.length);
 			String_Append(fsrc, " + ");
-			String_Append(fsrc, arg2.ptr);
+			String_AppendN(fsrc, arg2.ptr, arg2.length);
 			String_Append(fsrc, ";\n");
 			break;
 		case D3DTOP_ADDSIGNED:
 			String_Append(fsrc, "color.rgb = ");
-			String_Append(fsrc, arg1.ptr);
+			String_AppendN(fsrc, arg1.ptr, arg1.length);
 			String_Append(fsrc, " + ");
-			String_Append(fsrc, arg2.ptr);
+			String_AppendN(fsrc, arg2.ptr, arg2.length);
 			String_Append(fsrc, " - .5;\n");
 			break;
 		case D3DTOP_ADDSIGNED2X:
 			String_Append(fsrc, "color.rgb = (");
-			String_Append(fsrc, arg1.ptr);
+			String_AppendN(fsrc, arg1.ptr, arg1.length);
 			String_Append(fsrc, " + ");
-			String_Append(fsrc, arg2.ptr);
+			String_AppendN(fsrc, arg2.ptr, arg2.length);
 			String_Append(fsrc, " - .5) * 2.0;\n");
 			break;
 		case D3DTOP_SUBTRACT:
 			String_Append(fsrc, "color.rgb = ");
-			String_Append(fsrc, arg1.ptr);
+			String_AppendN(fsrc, arg1.ptr, arg1.length);
 			String_Append(fsrc, " - ");
-			String_Append(fsrc, arg2.ptr);
+			String_AppendN(fsrc, arg2.ptr, arg2.length);
 			String_Append(fsrc, ";\n");
 			break;
 		case D3DTOP_ADDSMOOTH:
 			String_Append(fsrc, "color.rgb = ");
-			String_Append(fsrc, arg1.ptr);
+			String_AppendN(fsrc, arg1.ptr, arg1.length);
 			String_Append(fsrc, " + ");
-			String_Append(fsrc, arg2.ptr);
+			String_AppendN(fsrc, arg2.ptr, arg2.length);
 			String_Append(fsrc, " - ");
-			String_Append(fsrc, arg1.ptr);
+			String_AppendN(fsrc, arg1.ptr, arg1.length);
 			String_Append(fsrc, " * ");
-			String_Append(fsrc, arg2.ptr);
+			String_AppendN(fsrc, arg2.ptr, arg2.length);
 			String_Append(fsrc, ";\n");
 			break;
 		case D3DTOP_BLENDDIFFUSEALPHA:
 			String_Append(fsrc, "color.rgb = ");
-			String_Append(fsrc, arg1.ptr);
+			String_AppendN(fsrc, arg1.ptr, arg1.length);
 			String_Append(fsrc, " * vertcolor.a + ");
-			String_Append(fsrc, arg2.ptr);
+			String_AppendN(fsrc, arg2.ptr, arg2.length);
 			String_Append(fsrc, " * (1.0-vertcolor.a);\n");
 			break;
 		case D3DTOP_BLENDTEXTUREALPHA:
@@ -1281,20 +2185,20 @@ void ShaderGen3D_CreateShader(ShaderGen3D *This, int index, __int64 id, __int64
 			texarg.ptr[17] = *(_itoa(i,idstring,10));
 			texarg.ptr[27] = *(_itoa((texstate[i]>>34)&7,idstring,10));
 			String_Append(fsrc, "color.rgb = ");
-			String_Append(fsrc, arg1.ptr);
+			String_AppendN(fsrc, arg1.ptr, arg1.length);
 			String_Append(fsrc, " * ");
-			String_Append(fsrc, texarg.ptr);
+			String_AppendN(fsrc, texarg.ptr, texarg.length);
 			String_Append(fsrc, ".a + ");
-			String_Append(fsrc, arg2.ptr);
+			String_AppendN(fsrc, arg2.ptr, arg2.length);
 			String_Append(fsrc, " * (1.0-");
-			String_Append(fsrc, texarg.ptr);
+			String_AppendN(fsrc, texarg.ptr, texarg.length);
 			String_Append(fsrc, ".a);\n");
 			break;
 		case D3DTOP_BLENDFACTORALPHA:
 			String_Append(fsrc, "color.rgb = ");
-			String_Append(fsrc, arg1.ptr);
+			String_AppendN(fsrc, arg1.ptr, arg1.length);
 			String_Append(fsrc, " * texfactor.a + ");
-			String_Append(fsrc, arg2.ptr);
+			String_AppendN(fsrc, arg2.ptr, arg2.length);
 			String_Append(fsrc, " * (1.0-texfactor.a);\n");
 			break;
 		case D3DTOP_BLENDTEXTUREALPHAPM:
@@ -1302,18 +2206,18 @@ void ShaderGen3D_CreateShader(ShaderGen3D *This, int index, __int64 id, __int64
 			texarg.ptr[17] = *(_itoa(i,idstring,10));
 			texarg.ptr[27] = *(_itoa((texstate[i]>>34)&7,idstring,10));
 			String_Append(fsrc, "color.rgb = ");
-			String_Append(fsrc, arg1.ptr);
+			String_AppendN(fsrc, arg1.ptr, arg1.length);
 			String_Append(fsrc, " + ");
-			String_Append(fsrc, arg2.ptr);
+			String_AppendN(fsrc, arg2.ptr, arg2.length);
 			String_Append(fsrc, " * (1.0-");
-			String_Append(fsrc, texarg.ptr);
+			String_AppendN(fsrc, texarg.ptr, texarg.length);
 			String_Append(fsrc, ".a);\n");
 			break;
 		case D3DTOP_BLENDCURRENTALPHA:
 			String_Append(fsrc, "color.rgb = ");
-			String_Append(fsrc, arg1.ptr);
+			String_AppendN(fsrc, arg1.ptr, arg1.length);
 			String_Append(fsrc, " * color.a + ");
-			String_Append(fsrc, arg2.ptr);
+			String_AppendN(fsrc, arg2.ptr, arg2.length);
 			String_Append(fsrc, " * (1.0-color.a);\n");
 			break;
 		}
@@ -1356,7 +2260,7 @@ void ShaderGen3D_CreateShader(ShaderGen3D *This, int index, __int64 id, __int64
 		{
 			String_Assign(&tmp, arg1.ptr);
 			String_Append(&tmp, "(1.0 - ");
-			String_Append(&tmp, arg1.ptr);
+			String_AppendN(&tmp, arg1.ptr, arg1.length);
 			String_Append(&tmp, ")");
 			String_Assign(&arg1, tmp.ptr);
 		}
@@ -1395,7 +2299,7 @@ void ShaderGen3D_CreateShader(ShaderGen3D *This, int index, __int64 id, __int64
 		{
 			String_Assign(&tmp, arg2.ptr);
 			String_Append(&tmp, "(1.0 - ");
-			String_Append(&tmp, arg2.ptr);
+			String_AppendN(&tmp, arg2.ptr, arg2.length);
 			String_Append(&tmp, ")");
 			String_Assign(&arg2, tmp.ptr);
 		}
@@ -1406,79 +2310,79 @@ void ShaderGen3D_CreateShader(ShaderGen3D *This, int index, __int64 id, __int64
 			break;
 		case D3DTOP_SELECTARG1:
 			String_Append(fsrc, "color.a = ");
-			String_Append(fsrc, arg1.ptr);
+			String_AppendN(fsrc, arg1.ptr, arg1.length);
 			String_Append(fsrc, ";\n");
 			break;
 		case D3DTOP_SELECTARG2:
 			String_Append(fsrc, "color.a = ");
-			String_Append(fsrc, arg2.ptr);
+			String_AppendN(fsrc, arg2.ptr, arg2.length);
 			String_Append(fsrc, ";\n");
 			break;
 		case D3DTOP_MODULATE:
 			String_Append(fsrc, "color.a = ");
-			String_Append(fsrc, arg1.ptr);
+			String_AppendN(fsrc, arg1.ptr, arg1.length);
 			String_Append(fsrc, " * ");
-			String_Append(fsrc, arg2.ptr);
+			String_AppendN(fsrc, arg2.ptr, arg2.length);
 			String_Append(fsrc, ";\n");
 			break;
 		case D3DTOP_MODULATE2X:
 			String_Append(fsrc, "color.a = (");
-			String_Append(fsrc, arg1.ptr);
+			String_AppendN(fsrc, arg1.ptr, arg1.length);
 			String_Append(fsrc, " * ");
-			String_Append(fsrc, arg2.ptr);
+			String_AppendN(fsrc, arg2.ptr, arg2.length);
 			String_Append(fsrc, ") * 2.0;\n");
 			break;
 		case D3DTOP_MODULATE4X:
 			String_Append(fsrc, "color.a = (");
-			String_Append(fsrc, arg1.ptr);
+			String_AppendN(fsrc, arg1.ptr, arg1.length);
 			String_Append(fsrc, " * ");
-			String_Append(fsrc, arg2.ptr);
+			String_AppendN(fsrc, arg2.ptr, arg2.length);
 			String_Append(fsrc, ") * 4.0;\n");
 			break;
 		case D3DTOP_ADD:
 			String_Append(fsrc, "color.a = ");
-			String_Append(fsrc, arg1.ptr);
+			String_AppendN(fsrc, arg1.ptr, arg1.length);
 			String_Append(fsrc, " + ");
-			String_Append(fsrc, arg2.ptr);
+			String_AppendN(fsrc, arg2.ptr, arg2.length);
 			String_Append(fsrc, ";\n");
 			break;
 		case D3DTOP_ADDSIGNED:
 			String_Append(fsrc, "color.a = ");
-			String_Append(fsrc, arg1.ptr);
+			String_AppendN(fsrc, arg1.ptr, arg1.length);
 			String_Append(fsrc, " + ");
-			String_Append(fsrc, arg2.ptr);
+			String_AppendN(fsrc, arg2.ptr, arg2.length);
 			String_Append(fsrc, " - .5;\n");
 			break;
 		case D3DTOP_ADDSIGNED2X:
 			String_Append(fsrc, "color.a = (");
-			String_Append(fsrc, arg1.ptr);
+			String_AppendN(fsrc, arg1.ptr, arg1.length);
 			String_Append(fsrc, " + ");
-			String_Append(fsrc, arg2.ptr);
+			String_AppendN(fsrc, arg2.ptr, arg2.length);
 			String_Append(fsrc, " - .5) * 2.0;\n");
 			break;
 		case D3DTOP_SUBTRACT:
 			String_Append(fsrc, "color.a = ");
-			String_Append(fsrc, arg1.ptr);
+			String_AppendN(fsrc, arg1.ptr, arg1.length);
 			String_Append(fsrc, " - ");
-			String_Append(fsrc, arg2.ptr);
+			String_AppendN(fsrc, arg2.ptr, arg2.length);
 			String_Append(fsrc, ";\n");
 			break;
 		case D3DTOP_ADDSMOOTH:
 			String_Append(fsrc, "color.a = ");
-			String_Append(fsrc, arg1.ptr);
+			String_AppendN(fsrc, arg1.ptr, arg1.length);
 			String_Append(fsrc, " + ");
-			String_Append(fsrc, arg2.ptr);
+			String_AppendN(fsrc, arg2.ptr, arg2.length);
 			String_Append(fsrc, " - ");
-			String_Append(fsrc, arg1.ptr);
+			String_AppendN(fsrc, arg1.ptr, arg1.length);
 			String_Append(fsrc, " * ");
-			String_Append(fsrc, arg2.ptr);
+			String_AppendN(fsrc, arg2.ptr, arg2.length);
 			String_Append(fsrc, ";\n");
 			break;
 		case D3DTOP_BLENDDIFFUSEALPHA:
 			String_Append(fsrc, "color.a = ");
-			String_Append(fsrc, arg1.ptr);
+			String_AppendN(fsrc, arg1.ptr, arg1.length);
 			String_Append(fsrc, " * vertcolor.a + ");
-			String_Append(fsrc, arg2.ptr);
+			String_AppendN(fsrc, arg2.ptr, arg2.length);
 			String_Append(fsrc, " * (1.0-vertcolor.a);\n");
 			break;
 		case D3DTOP_BLENDTEXTUREALPHA:
@@ -1486,20 +2390,20 @@ void ShaderGen3D_CreateShader(ShaderGen3D *This, int index, __int64 id, __int64
 			texarg.ptr[17] = *(_itoa(i,idstring,10));
 			texarg.ptr[27] = *(_itoa((texstate[i]>>34)&7,idstring,10));
 			String_Append(fsrc, "color.a = ");
-			String_Append(fsrc, arg1.ptr);
+			String_AppendN(fsrc, arg1.ptr, arg1.length);
 			String_Append(fsrc, " * ");
-			String_Append(fsrc, texarg.ptr);
+			String_AppendN(fsrc, texarg.ptr, texarg.length);
 			String_Append(fsrc, ".a + ");
-			String_Append(fsrc, arg2.ptr);
+			String_AppendN(fsrc, arg2.ptr, arg2.length);
 			String_Append(fsrc, " * (1.0-");
-			String_Append(fsrc, texarg.ptr);
+			String_AppendN(fsrc, texarg.ptr, texarg.length);
 			String_Append(fsrc, ".a);\n");
 			break;
 		case D3DTOP_BLENDFACTORALPHA:
 			String_Append(fsrc, "color.a = ");
-			String_Append(fsrc, arg1.ptr);
+			String_AppendN(fsrc, arg1.ptr, arg1.length);
 			String_Append(fsrc, " * texfactor.a + ");
-			String_Append(fsrc, arg2.ptr);
+			String_AppendN(fsrc, arg2.ptr, arg2.length);
 			String_Append(fsrc, " * (1.0-texfactor.a);\n");
 			break;
 		case D3DTOP_BLENDTEXTUREALPHAPM:
@@ -1507,18 +2411,18 @@ void ShaderGen3D_CreateShader(ShaderGen3D *This, int index, __int64 id, __int64
 			texarg.ptr[17] = *(_itoa(i,idstring,10));
 			texarg.ptr[27] = *(_itoa((texstate[i]>>34)&7,idstring,10));
 			String_Append(fsrc, "color.a = ");
-			String_Append(fsrc, arg1.ptr);
+			String_AppendN(fsrc, arg1.ptr, arg1.length);
 			String_Append(fsrc, " + ");
-			String_Append(fsrc, arg2.ptr);
+			String_AppendN(fsrc, arg2.ptr, arg2.length);
 			String_Append(fsrc, " * (1.0-");
-			String_Append(fsrc, texarg.ptr);
+			String_AppendN(fsrc, texarg.ptr, texarg.length);
 			String_Append(fsrc, ".a);\n");
 			break;
 		case D3DTOP_BLENDCURRENTALPHA:
 			String_Append(fsrc, "color.a = ");
-			String_Append(fsrc, arg1.ptr);
+			String_AppendN(fsrc, arg1.ptr, arg1.length);
 			String_Append(fsrc, " * color.a + ");
-			String_Append(fsrc, arg2.ptr);
+			String_AppendN(fsrc, arg2.ptr, arg2.length);
 			String_Append(fsrc, " * (1.0-color.a);\n");
 			break;
 		}
@@ -1553,34 +2457,78 @@ void ShaderGen3D_CreateShader(ShaderGen3D *This, int index, __int64 id, __int64
 			break;
 		}
 	}
-	if(vertexfog && !pixelfog) String_Append(fsrc, op_fogblend);
+	if(vertexfog && !pixelfog) String_AppendConst(fsrc, op_fogblend);
 	if(pixelfog)
 	{
-		String_Append(fsrc, op_fogcoordstandardpixel);
+		String_AppendConst(fsrc, op_fogcoordstandardpixel);
 		switch(pixelfog)
 		{
 		case D3DFOG_LINEAR:
-			String_Append(fsrc, op_foglinearpixel);
+			String_AppendConst(fsrc, op_foglinearpixel);
 			break;
 		case D3DFOG_EXP:
-			String_Append(fsrc, op_fogexppixel);
+			String_AppendConst(fsrc, op_fogexppixel);
 			break;
 		case D3DFOG_EXP2:
-			String_Append(fsrc, op_fogexp2pixel);
+			String_AppendConst(fsrc, op_fogexp2pixel);
 			break;
 		}
-		String_Append(fsrc, op_fogclamp);
-		String_Append(fsrc, op_fogblend);
+		String_AppendConst(fsrc, op_fogclamp);
+		String_AppendConst(fsrc, op_fogblend);
 	}
-	//if(((id>>61)&1) && !vertexfog && !pixelfog) String_Append(fsrc, op_fogassign);
-	if (dither) String_Append(fsrc,op_dither);
-	if (This->ext->glver_major >= 3) String_Append(fsrc, op_colorfragout_gl3);
-	else String_Append(fsrc, op_colorfragout);
-	String_Append(fsrc, mainend);
+	//if(((id>>61)&1) && !vertexfog && !pixelfog) String_AppendConst(fsrc, op_fogassign);
+	if (dither) String_AppendConst(fsrc, op_dither);
+	if (This->ext->glver_major >= 3) String_AppendConst(fsrc, op_colorfragout_gl3);
+	else String_AppendConst(fsrc, op_colorfragout);
+	String_AppendConst(fsrc, mainend);
 	String_Free(&tmp);
 	String_Free(&arg1);
 	String_Free(&arg2);
 	String_Free(&texarg);
+	This->compiles++;
+	// Let the background compiler finish the shader; it can't be used until then
+	if (This->shaders->compiler)
+	{
+		This->genshaders[index].job = ShaderCompiler_Submit(This->shaders->compiler, vsrc->ptr, fsrc->ptr,
+			This->shaders->cache->enabled);
+		if (This->genshaders[index].job)
+		{
+			This->genshaders[index].id = id;
+			memcpy(This->genshaders[index].texids, texstate, 8 * sizeof(__int64));
+			return;
+		}
+	}
+#ifdef _DEBUG
+	OutputDebugStringA("Vertex shader:\n");
+	OutputDebugStringA(vsrc->ptr);
+	OutputDebugStringA("\nCompiling vertex shader:\n");
+	TRACE_STRING("Vertex shader:\n");
+	TRACE_STRING(vsrc->ptr);
+	TRACE_STRING("\nCompiling vertex shader:\n");
+#endif
+	This->genshaders[index].shader.vs = This->ext->glCreateShader(GL_VERTEX_SHADER);
+	const char *src = vsrc->ptr;
+	GLint srclen = (GLint)vsrc->length;
+	This->ext->glShaderSource(This->genshaders[index].shader.vs,1,&src,&srclen);
+	This->ext->glCompileShader(This->genshaders[index].shader.vs);
+	glObjectLabel(GL_SHADER, This->genshaders[index].shader.vs, -1, idstring);
+	GLint result;
+	char *infolog = NULL;
+	This->ext->glGetShaderiv(This->genshaders[index].shader.vs,GL_COMPILE_STATUS,&result);
+#ifdef _DEBUG
+	GLint loglen;
+	if(!result)
+	{
+		This->ext->glGetShaderiv(This->genshaders[index].shader.vs,GL_INFO_LOG_LENGTH,&loglen);
+		infolog = (char*)malloc(loglen);
+		This->ext->glGetShaderInfoLog(This->genshaders[index].shader.vs,loglen,&result,infolog);
+		OutputDebugStringA("Compilation failed. Error messages:\n");
+		OutputDebugStringA(infolog);
+		TRACE_STRING("Compilation failed. Error messages:\n");
+		TRACE_STRING(infolog);
+		free(infolog);
+	}
+#endif
 #ifdef _DEBUG
 	OutputDebugStringA("Fragment shader:\n");
 	OutputDebugStringA(fsrc->ptr);
@@ -1591,7 +2539,7 @@ void ShaderGen3D_CreateShader(ShaderGen3D *This, int index, __int64 id, __int64
 #endif
 	This->genshaders[index].shader.fs = This->ext->glCreateShader(GL_FRAGMENT_SHADER);
 	src = fsrc->ptr;
-	srclen = strlen(src);
+	srclen = (GLint)fsrc->length;
 	This->ext->glShaderSource(This->genshaders[index].shader.fs,1,&src,&srclen);
 	This->ext->glCompileShader(This->genshaders[index].shader.fs);
 	glObjectLabel(GL_SHADER, This->genshaders[index].shader.fs, -1, idstring);
@@ -1614,6 +2562,7 @@ void ShaderGen3D_CreateShader(ShaderGen3D *This, int index, __int64 id, __int64
 	glObjectLabel(GL_PROGRAM, This->genshaders[index].shader.prog, -1, idstring);
 	This->ext->glAttachShader(This->genshaders[index].shader.prog,This->genshaders[index].shader.vs);
 	This->ext->glAttachShader(This->genshaders[index].shader.prog,This->genshaders[index].shader.fs);
+	ShaderCache_PrepareProgram(This->shaders->cache, This->genshaders[index].shader.prog);
 	This->ext->glLinkProgram(This->genshaders[index].shader.prog);
 	This->ext->glGetProgramiv(This->genshaders[index].shader.prog,GL_LINK_STATUS,&result);
 #ifdef _DEBUG
@@ -1629,117 +2578,129 @@ void ShaderGen3D_CreateShader(ShaderGen3D *This, int index, __int64 id, __int64
 		free(infolog);
 	}
 #endif
-	// Attributes
-	This->genshaders[index].shader.attribs[0] = This->ext->glGetAttribLocation(This->genshaders[index].shader.prog,"xyz");
-	This->genshaders[index].shader.attribs[1] = This->ext->glGetAttribLocation(This->genshaders[index].shader.prog,"rhw");
-	This->genshaders[index].shader.attribs[2] = This->ext->glGetAttribLocation(This->genshaders[index].shader.prog,"blend0");
-	This->genshaders[index].shader.attribs[3] = This->ext->glGetAttribLocation(This->genshaders[index].shader.prog,"blend1");
-	This->genshaders[index].shader.attribs[4] = This->ext->glGetAttribLocation(This->genshaders[index].shader.prog,"blend2");
-	This->genshaders[index].shader.attribs[5] = This->ext->glGetAttribLocation(This->genshaders[index].shader.prog,"blend3");
-	This->genshaders[index].shader.attribs[6] = This->ext->glGetAttribLocation(This->genshaders[index].shader.prog,"blend4");
-	This->genshaders[index].shader.attribs[7] = This->ext->glGetAttribLocation(This->genshaders[index].shader.prog,"nxyz");
-	This->genshaders[index].shader.attribs[8] = This->ext->glGetAttribLocation(This->genshaders[index].shader.prog,"rgba0");
-	This->genshaders[index].shader.attribs[9] = This->ext->glGetAttribLocation(This->genshaders[index].shader.prog,"rgba1");
-	char attrS[] = "sX";
-	for(int i = 0; i < 8; i++)
-	{
-		attrS[1] = i + '0';
-		This->genshaders[index].shader.attribs[i + 10] = This->ext->glGetAttribLocation(This->genshaders[index].shader.prog, attrS);
-	}
-	char attrST[] = "stX";
-	for(int i = 0; i < 8; i++)
-	{
-		attrST[2] = i + '0';
-		This->genshaders[index].shader.attribs[i + 18] = This->ext->glGetAttribLocation(This->genshaders[index].shader.prog, attrST);
-	}
-	char attrSTR[] = "strX";
-	for(int i = 0; i < 8; i++)
-	{
-		attrSTR[3] = i + '0';
-		This->genshaders[index].shader.attribs[i + 26] = This->ext->glGetAttribLocation(This->genshaders[index].shader.prog, attrSTR);
-	}
-	char attrSTRQ[] = "strqX";
-	for(int i = 0; i < 8; i++)
-	{
-		attrSTRQ[4] = i + '0';
-		This->genshaders[index].shader.attribs[i + 34] = This->ext->glGetAttribLocation(This->genshaders[index].shader.prog, attrSTRQ);
-	}
-	// Uniforms
-	This->genshaders[index].shader.uniforms[0] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog, "matWorld");
-	This->genshaders[index].shader.uniforms[1] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog, "matModelView");
-	This->genshaders[index].shader.uniforms[2] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog, "matProjection");
-	This->genshaders[index].shader.uniforms[3] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog, "matNormal");
-	// TODO: 4-14 world1-3 and texture0-7
-	char uniflight[] = "lightX.            ";
-	for(int i = 0; i < 8; i++)
-	{
-		uniflight[5] = i + '0';
-		strcpy(uniflight+7,"diffuse");
-		This->genshaders[index].shader.uniforms[20 + (i * 12)] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog, uniflight);
-		strcpy(uniflight+7,"specular");
-		This->genshaders[index].shader.uniforms[21 + (i * 12)] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog, uniflight);
-		strcpy(uniflight+7,"ambient");
-		This->genshaders[index].shader.uniforms[22 + (i * 12)] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog, uniflight);
-		strcpy(uniflight+7,"position");
-		This->genshaders[index].shader.uniforms[23 + (i * 12)] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog, uniflight);
-		strcpy(uniflight+7,"direction");
-		This->genshaders[index].shader.uniforms[24 + (i * 12)] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog, uniflight);
-		strcpy(uniflight+7,"range");
-		This->genshaders[index].shader.uniforms[25 + (i * 12)] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog, uniflight);
-		strcpy(uniflight+7,"falloff");
-		This->genshaders[index].shader.uniforms[26 + (i * 12)] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog, uniflight);
-		strcpy(uniflight+7,"constant");
-		This->genshaders[index].shader.uniforms[27 + (i * 12)] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog, uniflight);
-		strcpy(uniflight+7,"linear");
-		This->genshaders[index].shader.uniforms[28 + (i * 12)] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog, uniflight);
-		strcpy(uniflight+7,"quad");
-		This->genshaders[index].shader.uniforms[29 + (i * 12)] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog, uniflight);
-		strcpy(uniflight+7,"theta");
-		This->genshaders[index].shader.uniforms[30 + (i * 12)] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog, uniflight);
-		strcpy(uniflight+7,"phi");
-		This->genshaders[index].shader.uniforms[31 + (i * 12)] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog, uniflight);
-	}
-	char uniftex[] = "texX";
-	for(int i = 0; i < 8; i++)
+	ShaderCache_StoreProgram(This->shaders->cache, SHADERCACHE_TYPE3D, id, texstate, This->genshaders[index].shader.prog);
+	ShaderGen3D_GetLocations(This, &This->genshaders[index].shader);
+	This->genshaders[index].id = id;
+	for (int i = 0; i < 8; i++)
+		This->genshaders[index].texids[i] = texstate[i];
+}
+
+/**
+  * Starts compiling the ubershader in the background.  The ubershader takes
+  * every vertex attribute and reads the render states from uniforms, so one
+  * program can draw any state combination while its own shader compiles.
+  * @param This
+  *  Pointer to ShaderGen3D structure
+  */
+static void ShaderGen3D_CreateUbershader(ShaderGen3D *This)
+{
+	STRING *vsrc = &This->ubershader.shader.vsrc;
+	STRING *fsrc = &This->ubershader.shader.fsrc;
+	// Reading the state bits needs GLSL 1.30 integer operations
+	if (!This->shaders->compiler || (This->ext->glver_major < 3)) return;
+	// Vertex shader
+	String_AppendConst(vsrc, header);
+	glslver(vsrc, This->ext->glver_major, This->ext->glver_minor);
+	String_AppendConst(vsrc, vertexshader);
+	String_AppendConst(vsrc, uber_header);
+	String_AppendConst(vsrc, uber_attr);
+	String_AppendConst(vsrc, unif_state);
+	String_AppendConst(vsrc, lightstruct);
+	if (This->ext->GLEXT_ARB_uniform_buffer_object)
 	{
-		uniftex[3] = i + '0';
-		This->genshaders[index].shader.uniforms[128 + i] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog, uniftex);
+		String_AppendConst(vsrc, block_transforms);
+		String_AppendConst(vsrc, block_material);
+		String_AppendConst(vsrc, block_lights);
 	}
-	This->genshaders[index].shader.uniforms[136] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog,"ambientcolor");
-	This->genshaders[index].shader.uniforms[137] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog,"width");
-	This->genshaders[index].shader.uniforms[138] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog,"height");
-	This->genshaders[index].shader.uniforms[139] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog,"xoffset");
-	This->genshaders[index].shader.uniforms[140] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog,"yoffset");
-	This->genshaders[index].shader.uniforms[141] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog,"alpharef");
-	char unifkey[] = "keyX";
-	for(int i = 0; i < 8; i++)
+	else
 	{
-		unifkey[3] = i + '0';
-		This->genshaders[index].shader.uniforms[142 + i] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog, unifkey);
+		String_AppendConst(vsrc, unif_world);
+		String_AppendConst(vsrc, unif_modelview);
+		String_AppendConst(vsrc, unif_normal);
+		String_AppendConst(vsrc, unif_mvp);
+		String_AppendConst(vsrc, unif_material);
+		String_AppendConst(vsrc, uber_unif_lights);
 	}
-	This->genshaders[index].shader.uniforms[150] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog,"ditherbits");
-	This->genshaders[index].shader.uniforms[151] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog, "minz");
-	This->genshaders[index].shader.uniforms[152] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog, "maxz");
-	char unifkeybits[] = "keybitsX";
-	for (int i = 0; i < 8; i++)
+	String_AppendConst(vsrc, unif_ambient);
+	String_AppendConst(vsrc, unif_viewport);
+	String_AppendConst(vsrc, unif_fogcolor);
+	String_AppendConst(vsrc, unif_fogstart);
+	String_AppendConst(vsrc, unif_fogend);
+	String_AppendConst(vsrc, unif_fogdensity);
+	String_AppendConst(vsrc, uber_var_vertex);
+	String_AppendConst(vsrc, var_common);
+	String_AppendConst(vsrc, var_xyzw);
+	String_AppendConst(vsrc, func_state);
+	String_AppendConst(vsrc, func_spotlight);
+	String_AppendConst(vsrc, func_pointlight);
+	String_AppendConst(vsrc, func_dirlight);
+	String_AppendConst(vsrc, func_uberlight);
+	if (This->ext->GLEXT_ARB_uniform_buffer_object) String_AppendConst(vsrc, func_lightloop);
+	else String_AppendConst(vsrc, func_uberlights);
+	String_AppendConst(vsrc, uber_main_vertex);
+	// Fragment shader
+	String_AppendConst(fsrc, header);
+	glslver(fsrc, This->ext->glver_major, This->ext->glver_minor);
+	if (This->ext->GLEXT_ARB_bindless_texture) String_AppendConst(fsrc, ext_bindless);
+	String_AppendConst(fsrc, fragshader);
+	String_AppendConst(fsrc, uber_header);
+	String_AppendConst(fsrc, unif_state);
+	String_AppendConst(fsrc, uber_unif_frag);
+	String_AppendConst(fsrc, unif_fogcolor);
+	String_AppendConst(fsrc, unif_fogstart);
+	String_AppendConst(fsrc, unif_fogend);
+	String_AppendConst(fsrc, unif_fogdensity);
+	String_AppendConst(fsrc, uber_var_frag);
+	String_AppendConst(fsrc, out_fragcolor);
+	String_AppendConst(fsrc, var_color);
+	String_AppendConst(fsrc, const_threshold);
+	String_AppendConst(fsrc, func_dither);
+	String_AppendConst(fsrc, func_state);
+	String_AppendConst(fsrc, func_texstage);
+	String_AppendConst(fsrc, uber_main_frag);
+	This->ubershader.job = ShaderCompiler_Submit(This->shaders->compiler, vsrc->ptr, fsrc->ptr, FALSE);
+}
+
+/**
+  * Retrieves the ubershader, completing it if its background compile is done.
+  * @param This
+  *  Pointer to ShaderGen3D structure
+  * @return
+  *  Pointer to the ubershader, or NULL if it is not ready or failed to link.
+  */
+static GenShader *ShaderGen3D_GetUbershader(ShaderGen3D *This)
+{
+	GenShader *shader = &This->ubershader;
+	GLint result = GL_FALSE;
+	if (shader->job)
 	{
-		unifkeybits[7] = i + '0';
-		This->genshaders[index].shader.uniforms[153 + i] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog, unifkeybits);
+		if (!ShaderCompiler_Poll(This->shaders->compiler, shader->job)) return NULL;
+		shader->shader.vs = (GLint)shader->job->vs;
+		shader->shader.fs = (GLint)shader->job->fs;
+		shader->shader.prog = (GLint)shader->job->prog;
+		ShaderCompiler_Release(This->shaders->compiler, shader->job);
+		shader->job = NULL;
+		if (shader->shader.prog)
+			This->ext->glGetProgramiv(shader->shader.prog, GL_LINK_STATUS, &result);
+		if (!result)
+		{
+			// Keep substituting the closest compiled shader instead
+			if (shader->shader.prog) This->ext->glDeleteProgram(shader->shader.prog);
+			if (shader->shader.fs) This->ext->glDeleteShader(shader->shader.fs);
+			if (shader->shader.vs) This->ext->glDeleteShader(shader->shader.vs);
+			shader->shader.prog = shader->shader.fs = shader->shader.vs = 0;
+			return NULL;
+		}
+		glObjectLabel(GL_PROGRAM, shader->shader.prog, -1, "Ubershader");
+		ShaderGen3D_GetLocations(This, &shader->shader);
+		// Texture coordinates of any size feed the same vec4 attribute, which
+		// fills in the missing components the same way the generated shaders do
+		for (int i = 0; i < 8; i++)
+			shader->shader.attribs[10 + i] = shader->shader.attribs[18 + i] =
+				shader->shader.attribs[26 + i] = shader->shader.attribs[34 + i];
 	}
-	This->genshaders[index].shader.uniforms[161] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog, "mtlambient");
-	This->genshaders[index].shader.uniforms[162] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog, "mtldiffuse");
-	This->genshaders[index].shader.uniforms[163] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog, "mtlspecular");
-	This->genshaders[index].shader.uniforms[164] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog, "mtlemission");
-	This->genshaders[index].shader.uniforms[165] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog, "mtlshininess");
-
-	This->genshaders[index].shader.uniforms[166] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog, "fogcolor");
-	This->genshaders[index].shader.uniforms[167] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog, "fogstart");
-	This->genshaders[index].shader.uniforms[168] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog, "fogend");
-	This->genshaders[index].shader.uniforms[169] = This->ext->glGetUniformLocation(This->genshaders[index].shader.prog, "fogdensity");
-
-	This->genshaders[index].id = id;
-	for (int i = 0; i < 8; i++)
-		This->genshaders[index].texids[i] = texstate[i];
+	if (!shader->shader.prog) return NULL;
+	return shader;
 }
 
 }
\ No newline at end of file
@@ -31,39 +31,113 @@ typedef struct
 	GLint prog;
 	GLint attribs[42];
 	GLint uniforms[256];
+	BOOL samplersset;  // TRUE once the texture unit uniforms have been set
+	GLfloat *shadow;  // Last values set for the uniforms, allocated at link time
 } _GENSHADER;
 
+// Shadow copy layout: uniforms 0-4 are matrices, the rest have up to 4 components
+#define GENSHADER_SHADOWSIZE ((5 * 16) + (251 * 4))
+#define GENSHADER_SHADOW(shader, index) ((shader)->shadow ? ((index) < 5 ? \
+	(shader)->shadow + ((index) * 16) : (shader)->shadow + 80 + (((index) - 5) * 4)) : NULL)
+
+// Uniform buffer binding points of the blocks in generated shaders
+#define UBO_BINDING_TRANSFORMS 0
+#define UBO_BINDING_MATERIAL 1
+#define UBO_BINDING_LIGHTS 2
+#define UBO_BINDING_DRAWTEXTURES 3
+
+/** @brief std140 layout of the Transforms uniform block
+  * Matrices are column major, each column of matNormal is padded to a vec4.
+  */
+typedef struct UBOTransforms
+{
+	GLfloat world[16];
+	GLfloat modelview[16];
+	GLfloat projection[16];
+	GLfloat normal[12];
+	GLfloat mvp[16];
+} UBOTransforms;
+
+// std140 layout of the Material uniform block
+typedef struct UBOMaterial
+{
+	GLfloat ambient[4];
+	GLfloat diffuse[4];
+	GLfloat specular[4];
+	GLfloat emission[4];
+	GLfloat shininess;
+	GLfloat padding[3];
+} UBOMaterial;
+
+// std140 layout of one Light in the Lights uniform block
+typedef struct UBOLight
+{
+	GLfloat diffuse[4];
+	GLfloat specular[4];
+	GLfloat ambient[4];
+	GLfloat position[3];
+	GLfloat type;  // D3DLIGHTTYPE, read by the light loop
+	GLfloat direction[3];
+	GLfloat range;
+	GLfloat falloff;
+	GLfloat constant;
+	GLfloat linear;
+	GLfloat quad;
+	GLfloat theta;
+	GLfloat phi;
+	GLfloat padding1[2];
+} UBOLight;
+
+// std140 layout of the Lights uniform block
+typedef struct UBOLights
+{
+	GLint count;
+	GLint padding[3];
+	UBOLight lights[LIGHTS_MAX];
+} UBOLights;
+
 typedef struct
 {
 	_GENSHADER shader;
 	__int64 id;
 	__int64 texids[8];
+	DWORD lastused;
+	struct ShaderCompileJob *job;  // Non-NULL while compiling in the background
 } GenShader;
 
 #define D3DTOP_DXGL_DECALMASK 0x101;
 #define D3DTOP_DXGL_MODULATEMASK 0x102;
 
+#define GENSHADER_MAXSHADERS 1024
+
 struct ShaderGen2D;
 
 typedef struct ShaderGen3D
 {
 	GenShader *genshaders;
+	int *hashtable;
+	int hashmask;
+	DWORD frame;
 	GenShader *current_genshader;
 	__int64 current_shader;
 	__int64 current_texid[8];
 	int current_shadertype;
+	BOOL current_pending;
 	int shadercount;
 	int maxshaders;
-	int genindex;
 	GLuint current_prog;
 	glExtensions *ext;
 	ShaderManager *shaders;
+	DWORD switches;  // Programs made current, read by the performance counters
+	DWORD compiles;  // Shaders generated because no cached binary loaded
+	GenShader ubershader;  // Reads the render states from uniforms, drawn with while shaders compile
 } ShaderGen3D;
 
 void ShaderGen3D_Init(glExtensions *glext, ShaderManager *shaderman, ShaderGen3D *gen);
 void ShaderGen3D_Delete(ShaderGen3D *This);
 void ShaderGen3D_ClearShaders(ShaderGen3D *This);
 void ShaderGen3D_SetShader(ShaderGen3D *This, __int64 id, __int64 *texstate, int type, struct ShaderGen2D *gen2d);
+void ShaderGen3D_Preload(ShaderGen3D *This, __int64 id, const __int64 *texstate);
 GLuint ShaderGen3D_GetProgram(ShaderGen3D *This);
 void ShaderGen3D_ZeroShaderArray(ShaderGen3D *This);
 void ShaderGen3D_CreateShader(ShaderGen3D *This, int index, __int64 id, __int64 *texstate);
@@ -24,6 +24,10 @@
 #include "ShaderManager.h"
 #include "ShaderGen3D.h"
 #include "ShaderGen2D.h"
+#include "ShaderCache.h"
+#include "ShaderCompiler.h"
+
+extern DXGLCFG dxglcfg;
 
 static const char version_110[] = "#version 110\n";
 static const char version_120[] = "#version 120\n";
@@ -79,6 +83,61 @@ void main()\n\
 	FragColor = texel;\n\
 }";
 
+// tex1 is the 256x1 gamma ramp, looked up once per channel
+const char frag_TextureGamma[] = "\
+uniform sampler2D tex0;\n\
+uniform sampler2D tex1;\n\
+void main()\n\
+{\n\
+	vec4 color = texture2D(tex0, gl_TexCoord[0].st);\n\
+	vec3 index = (color.rgb*(255.0/256.0))+(0.5/256.0);\n\
+	gl_FragColor = vec4(texture2D(tex1, vec2(index.r,0.5)).r, texture2D(tex1, vec2(index.g,0.5)).g,\n\
+		texture2D(tex1, vec2(index.b,0.5)).b, color.a);\n\
+}";
+
+const char frag_TextureGamma_gl3[] = "\
+uniform sampler2D tex0;\n\
+uniform sampler2D tex1;\n\
+in vec4 TexCoord0;\n\
+out vec4 FragColor;\n\
+void main()\n\
+{\n\
+	vec4 color = texture(tex0, TexCoord0.st);\n\
+	vec3 index = (color.rgb*(255.0/256.0))+(0.5/256.0);\n\
+	FragColor = vec4(texture(tex1, vec2(index.r,0.5)).r, texture(tex1, vec2(index.g,0.5)).g,\n\
+		texture(tex1, vec2(index.b,0.5)).b, color.a);\n\
+}";
+
+const char frag_Pal256Gamma[] =  "\
+uniform sampler2D pal;\n\
+uniform sampler2D tex0;\n\
+uniform sampler2D tex1;\n\
+void main()\n\
+{\n\
+	vec4 myindex = texture2D(tex0, gl_TexCoord[0].xy);\n\
+	vec2 index = vec2(((myindex.x*(255.0/256.0))+(0.5/256.0)),0.5);\n\
+	vec4 texel = texture2D(pal, index);\n\
+	vec3 gamma = (texel.rgb*(255.0/256.0))+(0.5/256.0);\n\
+	gl_FragColor = vec4(texture2D(tex1, vec2(gamma.r,0.5)).r, texture2D(tex1, vec2(gamma.g,0.5)).g,\n\
+		texture2D(tex1, vec2(gamma.b,0.5)).b, texel.a);\n\
+}";
+
+const char frag_Pal256Gamma_gl3[] = "\
+uniform sampler2D pal;\n\
+uniform sampler2D tex0;\n\
+uniform sampler2D tex1;\n\
+in vec4 TexCoord0;\n\
+out vec4 FragColor;\n\
+void main()\n\
+{\n\
+	vec4 myindex = texture(tex0, TexCoord0.xy);\n\
+	vec2 index = vec2(((myindex.x*(255.0/256.0))+(0.5/256.0)),0.5);\n\
+	vec4 texel = texture(pal, index);\n\
+	vec3 gamma = (texel.rgb*(255.0/256.0))+(0.5/256.0);\n\
+	FragColor = vec4(texture(tex1, vec2(gamma.r,0.5)).r, texture(tex1, vec2(gamma.g,0.5)).g,\n\
+		texture(tex1, vec2(gamma.b,0.5)).b, texel.a);\n\
+}";
+
 const char frag_clipstencil[] = "\
 void main ()\n\
 {\n\
@@ -183,6 +242,148 @@ void main()\n\
 	TexCoord0 = vec4(st,0.0,1.0);\n\
 } ";
 
+// Format conversion shaders, drawn as a four vertex strip without attributes
+const char vert_convert_gl3[] = "\
+void main()\n\
+{\n\
+	gl_Position = vec4(float(gl_VertexID & 1) * 2.0 - 1.0,\n\
+ float(gl_VertexID >> 1) * 2.0 - 1.0, 0.0, 1.0);\n\
+}";
+
+// Expands packed 1, 2 or 4 bit indices (colorsize.x bits, MSB first)
+const char frag_unpackpal_gl3[] = "\
+uniform usampler2D tex0;\n\
+uniform ivec4 colorsize;\n\
+out vec4 FragColor;\n\
+void main()\n\
+{\n\
+	ivec2 pos = ivec2(gl_FragCoord.xy);\n\
+	int bit = pos.x * colorsize.x;\n\
+	int mask = (1 << colorsize.x) - 1;\n\
+	uint data = texelFetch(tex0, ivec2(bit >> 3, pos.y), 0).r;\n\
+	int index = int(data >> uint(8 - colorsize.x - (bit & 7))) & mask;\n\
+	FragColor = vec4(float(index) / float(mask));\n\
+}";
+
+const char frag_unpack8332_gl3[] = "\
+uniform usampler2D tex0;\n\
+out vec4 FragColor;\n\
+void main()\n\
+{\n\
+	uint pixel = texelFetch(tex0, ivec2(gl_FragCoord.xy), 0).r;\n\
+	FragColor = vec4(float((pixel >> 5u) & 7u) / 7.0, float((pixel >> 2u) & 7u) / 7.0,\n\
+ float(pixel & 3u) / 3.0, float(pixel >> 8u) / 255.0);\n\
+}";
+
+// Packs 8 / colorsize.x indices from mipmap level colorsize.y into each output byte
+const char frag_packpal_gl3[] = "\
+uniform sampler2D tex0;\n\
+uniform ivec4 colorsize;\n\
+out uvec4 FragColor;\n\
+void main()\n\
+{\n\
+	ivec2 pos = ivec2(gl_FragCoord.xy);\n\
+	int count = 8 / colorsize.x;\n\
+	int width = textureSize(tex0, colorsize.y).x;\n\
+	uint data = 0u;\n\
+	for (int i = 0; i < count; i++)\n\
+	{\n\
+		int x = pos.x * count + i;\n\
+		if (x >= width) break;\n\
+		uint index = uint(texelFetch(tex0, ivec2(x, pos.y), colorsize.y).r * 255.0 + 0.5);\n\
+		data |= (index >> uint(8 - colorsize.x)) << uint(8 - colorsize.x * (i + 1));\n\
+	}\n\
+	FragColor = uvec4(data);\n\
+}";
+
+const char frag_pack8332_gl3[] = "\
+uniform sampler2D tex0;\n\
+uniform ivec4 colorsize;\n\
+out uvec4 FragColor;\n\
+void main()\n\
+{\n\
+	uvec4 c = uvec4(texelFetch(tex0, ivec2(gl_FragCoord.xy), colorsize.y) * 255.0 + 0.5);\n\
+	FragColor = uvec4((c.a << 8u) | ((c.r >> 5u) << 5u) | ((c.g >> 5u) << 2u) | (c.b >> 6u));\n\
+}";
+
+// Converts planar YUV to RGB with BT.601 coefficients: tex0 is the Y plane,
+// tex1 the U plane and tex2 the V plane, or tex1 holds both if colorsize.z is 3 (NV12)
+const char frag_unpackyuv_gl3[] = "\
+uniform usampler2D tex0;\n\
+uniform usampler2D tex1;\n\
+uniform usampler2D tex2;\n\
+uniform ivec4 colorsize;\n\
+out vec4 FragColor;\n\
+void main()\n\
+{\n\
+	ivec2 pos = ivec2(gl_FragCoord.xy);\n\
+	vec3 yuv;\n\
+	uvec4 chroma = texelFetch(tex1, pos >> 1, 0);\n\
+	yuv.x = float(texelFetch(tex0, pos, 0).r);\n\
+	yuv.y = float(chroma.r);\n\
+	if (colorsize.z == 3) yuv.z = float(chroma.g);\n\
+	else yuv.z = float(texelFetch(tex2, pos >> 1, 0).r);\n\
+	yuv = (yuv / 255.0) + vec3(-0.0625, -0.5, -0.5);\n\
+	FragColor = vec4(clamp(mat3(1.164,1.164,1.164,0.0,-0.392,2.017,1.596,-0.813,0.0) * yuv, 0.0, 1.0), 1.0);\n\
+}";
+
+// Draws one rect per instance for multi-rect clears.  xy holds the rect as
+// x1,y1,x2,y2 in pixels, view the size of the target and the depth to write.
+const char vert_clearrects_gl3[] = "\
+uniform vec4 view;\n\
+in vec4 xy;\n\
+void main()\n\
+{\n\
+	vec2 corner = vec2(float(gl_VertexID & 1), float(gl_VertexID >> 1));\n\
+	vec2 pos = mix(xy.xy, xy.zw, corner);\n\
+	gl_Position = vec4(((pos / view.xy) * 2.0) - 1.0, (view.z * 2.0) - 1.0, 1.0);\n\
+}";
+
+const char frag_clearrects_gl3[] = "\
+uniform vec4 color;\n\
+out vec4 FragColor;\n\
+void main()\n\
+{\n\
+	FragColor = color;\n\
+}";
+
+// Debug view of a depth buffer in tex0.  The projection is not known, so the
+// distance is approximated as near / (1 - z) with a near plane of 0.01.
+const char frag_debugdepth_gl3[] = "\
+uniform sampler2D tex0;\n\
+in vec4 TexCoord0;\n\
+out vec4 FragColor;\n\
+void main()\n\
+{\n\
+	float z = 0.01 / max(1.0 - texture(tex0, TexCoord0.st).r, 1.0 / 65536.0);\n\
+	FragColor = vec4(vec3(clamp(z, 0.0, 1.0)), 1.0);\n\
+}";
+
+// Debug view of ambient occlusion, estimated by comparing the depth in tex0
+// against eight neighbors at two radii
+const char frag_debugssao_gl3[] = "\
+uniform sampler2D tex0;\n\
+in vec4 TexCoord0;\n\
+out vec4 FragColor;\n\
+float lineardepth(vec2 st)\n\
+{\n\
+	return 0.01 / max(1.0 - texture(tex0, st).r, 1.0 / 65536.0);\n\
+}\n\
+void main()\n\
+{\n\
+	vec2 texel = 1.0 / vec2(textureSize(tex0, 0));\n\
+	float center = lineardepth(TexCoord0.st);\n\
+	float occlusion = 0.0;\n\
+	for (int i = 0; i < 8; i++)\n\
+	{\n\
+		float angle = float(i) * 0.785398;\n\
+		vec2 offset = vec2(cos(angle), sin(angle)) * texel * ((i & 1) != 0 ? 8.0 : 4.0);\n\
+		float diff = center - lineardepth(TexCoord0.st + offset);\n\
+		occlusion += step(0.002, diff) * (1.0 - smoothstep(0.0, 0.1, diff));\n\
+	}\n\
+	FragColor = vec4(vec3(1.0 - (occlusion / 8.0)), 1.0);\n\
+}";
+
 
 // Use EXACTLY one line per entry.  Don't change layout of the list.
 const int SHADER_START = __LINE__;
@@ -192,7 +393,17 @@ const SHADER shader_template[] =
 	{0,0,	vert_ortho,			frag_Pal256,		0,-1,-1,-1,-1,-1,-1,-1,-1},
 	{0,0,	vert_ortho,			frag_clipstencil,	0,-1,-1,-1,-1,-1,-1,-1,-1},
 	{0,0,	vert_ortho,			frag_prepsrckey,	0,-1,-1,-1,-1,-1,-1,-1,-1},
-	{0,0,	vert_ortho,			frag_prepdestkey,	0,-1,-1,-1,-1,-1,-1,-1,-1}
+	{0,0,	vert_ortho,			frag_prepdestkey,	0,-1,-1,-1,-1,-1,-1,-1,-1},
+	{0,0,	NULL,				NULL,				0,-1,-1,-1,-1,-1,-1,-1,-1},
+	{0,0,	NULL,				NULL,				0,-1,-1,-1,-1,-1,-1,-1,-1},
+	{0,0,	NULL,				NULL,				0,-1,-1,-1,-1,-1,-1,-1,-1},
+	{0,0,	NULL,				NULL,				0,-1,-1,-1,-1,-1,-1,-1,-1},
+	{0,0,	NULL,				NULL,				0,-1,-1,-1,-1,-1,-1,-1,-1},
+	{0,0,	NULL,				NULL,				0,-1,-1,-1,-1,-1,-1,-1,-1},
+	{0,0,	NULL,				NULL,				0,-1,-1,-1,-1,-1,-1,-1,-1},
+	{0,0,	NULL,				NULL,				0,-1,-1,-1,-1,-1,-1,-1,-1},
+	{0,0,	vert_ortho,			frag_TextureGamma,	0,-1,-1,-1,-1,-1,-1,-1,-1},
+	{0,0,	vert_ortho,			frag_Pal256Gamma,	0,-1,-1,-1,-1,-1,-1,-1,-1}
 };
 const int SHADER_END = __LINE__ - 4;
 #define NumberOfShaders (SHADER_END - SHADER_START)
@@ -203,7 +414,17 @@ const SHADER shader_template_gl3[] =
 	{0,0,	vert_ortho_gl3,		frag_Pal256_gl3,	0,-1,-1,-1,-1,-1,-1,-1,-1},
 	{0,0,	vert_ortho_gl3,		frag_clipstencil_gl3,0,-1,-1,-1,-1,-1,-1,-1,-1},
 	{0,0,	vert_ortho_gl3,		frag_prepsrckey_gl3,0,-1,-1,-1,-1,-1,-1,-1,-1},
-	{0,0,	vert_ortho_gl3,		frag_prepdestkey_gl3,0,-1,-1,-1,-1,-1,-1,-1,-1}
+	{0,0,	vert_ortho_gl3,		frag_prepdestkey_gl3,0,-1,-1,-1,-1,-1,-1,-1,-1},
+	{0,0,	vert_convert_gl3,	frag_unpackpal_gl3,	0,-1,-1,-1,-1,-1,-1,-1,-1},
+	{0,0,	vert_convert_gl3,	frag_unpack8332_gl3,0,-1,-1,-1,-1,-1,-1,-1,-1},
+	{0,0,	vert_convert_gl3,	frag_packpal_gl3,	0,-1,-1,-1,-1,-1,-1,-1,-1},
+	{0,0,	vert_convert_gl3,	frag_pack8332_gl3,	0,-1,-1,-1,-1,-1,-1,-1,-1},
+	{0,0,	vert_convert_gl3,	frag_unpackyuv_gl3,	0,-1,-1,-1,-1,-1,-1,-1,-1},
+	{0,0,	vert_ortho_gl3,		frag_debugdepth_gl3,0,-1,-1,-1,-1,-1,-1,-1,-1},
+	{0,0,	vert_ortho_gl3,		frag_debugssao_gl3,	0,-1,-1,-1,-1,-1,-1,-1,-1},
+	{0,0,	vert_clearrects_gl3,frag_clearrects_gl3,0,-1,-1,-1,-1,-1,-1,-1,-1},
+	{0,0,	vert_ortho_gl3,		frag_TextureGamma_gl3,0,-1,-1,-1,-1,-1,-1,-1,-1},
+	{0,0,	vert_ortho_gl3,		frag_Pal256Gamma_gl3,0,-1,-1,-1,-1,-1,-1,-1,-1}
 };
 
 
@@ -274,56 +495,127 @@ static void glslver(STRING* str, int major, int minor)
 	}
 }
 
-void ShaderManager_Init(glExtensions *glext, ShaderManager *shaderman)
+/**
+  * Compiles and links a builtin shader program the first time it is used.
+  * @param This
+  *  Pointer to ShaderManager structure
+  * @param id
+  *  PROG_* index of the builtin program
+  * @return
+  *  Pointer to the program, its prog member is 0 if the program is disabled
+  */
+SHADER *ShaderManager_GetBuiltin(ShaderManager *This, int id)
 {
+	SHADER *shader = &This->shaders[id];
 	STRING src;
 	GLint srclen;
+	if (shader->prog) return shader;
+	// Debug view programs are only built if the view is enabled
+	if (((id == PROG_DEBUGDEPTH) || (id == PROG_DEBUGSSAO)) && !dxglcfg.DebugView) return shader;
+	ZeroMemory(&src, sizeof(STRING));
+	shader->prog = This->ext->glCreateProgram();
+	if(shader->vsrc)
+	{
+		shader->vs = This->ext->glCreateShader(GL_VERTEX_SHADER);
+		glslver(&src, This->ext->glver_major, This->ext->glver_minor);
+		String_Append(&src, shader->vsrc);
+		srclen = (GLint)src.length;
+		This->ext->glShaderSource(shader->vs, 1, &src.ptr, &srclen);
+		This->ext->glCompileShader(shader->vs);
+		This->ext->glAttachShader(shader->prog, shader->vs);
+	}
+	if(shader->fsrc)
+	{
+		shader->fs = This->ext->glCreateShader(GL_FRAGMENT_SHADER);
+		glslver(&src, This->ext->glver_major, This->ext->glver_minor);
+		String_Append(&src, shader->fsrc);
+		srclen = (GLint)src.length;
+		This->ext->glShaderSource(shader->fs, 1, &src.ptr, &srclen);
+		This->ext->glCompileShader(shader->fs);
+		This->ext->glAttachShader(shader->prog, shader->fs);
+	}
+	This->ext->glLinkProgram(shader->prog);
+	shader->pos = This->ext->glGetAttribLocation(shader->prog, "xy");
+	shader->texcoord = This->ext->glGetAttribLocation(shader->prog, "st");
+	shader->tex0 = This->ext->glGetUniformLocation(shader->prog, "tex0");
+	shader->tex1 = This->ext->glGetUniformLocation(shader->prog, "tex1");
+	shader->tex2 = This->ext->glGetUniformLocation(shader->prog, "tex2");
+	shader->ckey = This->ext->glGetUniformLocation(shader->prog, "ckey");
+	shader->colorsize = This->ext->glGetUniformLocation(shader->prog, "colorsize");
+	shader->pal = This->ext->glGetUniformLocation(shader->prog, "pal");
+	shader->view = This->ext->glGetUniformLocation(shader->prog, "view");
+	shader->color = This->ext->glGetUniformLocation(shader->prog, "color");
+	String_Free(&src);
+	return shader;
+}
+
+/**
+  * Creates the generated shaders recorded in the shader cache by earlier
+  * sessions, so the first blit or draw using each of them does not stall.
+  * The cache file is per profile, so it holds the shaders this application
+  * actually used.  Nothing more is preloaded once a generator is full, so the
+  * preloaded shaders do not evict each other.
+  * @param shaderman
+  *  Pointer to ShaderManager structure with the shader generators initialized
+  */
+static void ShaderManager__Preload(ShaderManager *shaderman)
+{
 	int i;
+	SHADERCACHERECORD *record;
+	if (!shaderman->cache->enabled) return;
+	for (i = 0; i < shaderman->cache->count; i++)
+	{
+		record = &shaderman->cache->entries[i].record;
+		if (record->type == SHADERCACHE_TYPE2D)
+		{
+			if (shaderman->gen2d->shadercount >= shaderman->gen2d->maxshaders) continue;
+			ShaderGen2D_GetShader2D(shaderman->gen2d, record->id, 0);
+		}
+		else if (record->type == SHADERCACHE_TYPE3D)
+		{
+			if (shaderman->gen3d->shadercount >= shaderman->gen3d->maxshaders) continue;
+			ShaderGen3D_Preload(shaderman->gen3d, record->id, record->texids);
+		}
+	}
+	shaderman->ext->glUseProgram(0);
+}
+
+/**
+  * Initializes the shader manager.  Builtin programs are compiled by
+  * ShaderManager_GetBuiltin when they are first used, so creating a renderer
+  * does not wait for the driver to compile shaders that may never be needed.
+  * @param glext
+  *  Pointer to the OpenGL extensions of the renderer
+  * @param shaderman
+  *  Pointer to ShaderManager structure to initialize
+  */
+void ShaderManager_Init(glExtensions *glext, ShaderManager *shaderman)
+{
 	shaderman->ext = glext;
 	shaderman->shaders = (SHADER*)malloc(sizeof(SHADER)*NumberOfShaders);
 	if (glext->glver_major >= 3)
 		memcpy(shaderman->shaders, shader_template_gl3, sizeof(SHADER) * NumberOfShaders);
 	else memcpy(shaderman->shaders, shader_template, sizeof(SHADER) * NumberOfShaders);
-	ZeroMemory(&src, sizeof(STRING));
-	for(i = 0; i < NumberOfShaders; i++)
+	shaderman->convvao = 0;
+	if (glext->GLEXT_ARB_vertex_array_object) glext->glGenVertexArrays(1, &shaderman->convvao);
+	shaderman->cache = (ShaderCache*)malloc(sizeof(ShaderCache));
+	ShaderCache_Init(shaderman->cache, shaderman->ext);
+	shaderman->compiler = NULL;
+	if (dxglcfg.ShaderCompileMode)
 	{
-		shaderman->shaders[i].prog = shaderman->ext->glCreateProgram();
-		if(shaderman->shaders[i].vsrc)
-		{
-			shaderman->shaders[i].vs = shaderman->ext->glCreateShader(GL_VERTEX_SHADER);
-			glslver(&src, glext->glver_major, glext->glver_minor);
-			String_Append(&src,shaderman->shaders[i].vsrc);
-			srclen = strlen(src.ptr);
-			shaderman->ext->glShaderSource(shaderman->shaders[i].vs,1,&src.ptr,&srclen);
-			shaderman->ext->glCompileShader(shaderman->shaders[i].vs);
-			shaderman->ext->glAttachShader(shaderman->shaders[i].prog,shaderman->shaders[i].vs);
-		}
-		if(shaderman->shaders[i].fsrc)
+		shaderman->compiler = (ShaderCompiler*)malloc(sizeof(ShaderCompiler));
+		if (shaderman->compiler && !ShaderCompiler_Init(shaderman->compiler, shaderman->ext))
 		{
-			shaderman->shaders[i].fs = shaderman->ext->glCreateShader(GL_FRAGMENT_SHADER);
-			glslver(&src, glext->glver_major, glext->glver_minor);
-			String_Append(&src, shaderman->shaders[i].fsrc);
-			srclen = strlen(src.ptr);
-			shaderman->ext->glShaderSource(shaderman->shaders[i].fs,1,&src.ptr,&srclen);
-			shaderman->ext->glCompileShader(shaderman->shaders[i].fs);
-			shaderman->ext->glAttachShader(shaderman->shaders[i].prog,shaderman->shaders[i].fs);
+			free(shaderman->compiler);
+			shaderman->compiler = NULL;
 		}
-		shaderman->ext->glLinkProgram(shaderman->shaders[i].prog);
-		shaderman->shaders[i].pos = shaderman->ext->glGetAttribLocation(shaderman->shaders[i].prog,"xy");
-		shaderman->shaders[i].texcoord = shaderman->ext->glGetAttribLocation(shaderman->shaders[i].prog,"st");
-		shaderman->shaders[i].tex0 = shaderman->ext->glGetUniformLocation(shaderman->shaders[i].prog,"tex0");
-		shaderman->shaders[i].tex1 = shaderman->ext->glGetUniformLocation(shaderman->shaders[i].prog,"tex1");
-		shaderman->shaders[i].ckey = shaderman->ext->glGetUniformLocation(shaderman->shaders[i].prog,"ckey");
-		shaderman->shaders[i].colorsize = shaderman->ext->glGetUniformLocation(shaderman->shaders[i].prog, "colorsize");
-		shaderman->shaders[i].pal = shaderman->ext->glGetUniformLocation(shaderman->shaders[i].prog,"pal");
-		shaderman->shaders[i].view = shaderman->ext->glGetUniformLocation(shaderman->shaders[i].prog,"view");
 	}
 	shaderman->gen3d = (ShaderGen3D*)malloc(sizeof(ShaderGen3D));
 	ShaderGen3D_Init(shaderman->ext, shaderman, shaderman->gen3d);
 	shaderman->gen2d = (ShaderGen2D*)malloc(sizeof(ShaderGen2D));
 	ZeroMemory(shaderman->gen2d, sizeof(ShaderGen2D));
 	ShaderGen2D_Init(shaderman->gen2d, shaderman->ext, shaderman);
-	String_Free(&src);
+	if (dxglcfg.ShaderPreload) ShaderManager__Preload(shaderman);
 }
 
 void ShaderManager_Delete(ShaderManager *This)
@@ -349,10 +641,18 @@ void ShaderManager_Delete(ShaderManager *This)
 		}
 	}
 	free(This->shaders);
+	if (This->convvao) This->ext->glDeleteVertexArrays(1, &This->convvao);
 	ShaderGen2D_Delete(This->gen2d);
 	free(This->gen2d);
 	ShaderGen3D_Delete(This->gen3d);
 	free(This->gen3d);
+	if (This->compiler)
+	{
+		ShaderCompiler_Delete(This->compiler);
+		free(This->compiler);
+	}
+	ShaderCache_Delete(This->cache);
+	free(This->cache);
 }
 
 void ShaderManager_SetShader(ShaderManager *This, __int64 id, __int64 *texstate, int type)
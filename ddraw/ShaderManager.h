@@ -28,12 +28,23 @@ extern const SHADER shader_template[];
 #define PROG_TEXTURE 0
 #define PROG_PAL256 1
 #define PROG_CLIPSTENCIL 2
+#define PROG_UNPACKPAL 5
+#define PROG_UNPACK8332 6
+#define PROG_PACKPAL 7
+#define PROG_PACK8332 8
+#define PROG_UNPACKYUV 9
+#define PROG_DEBUGDEPTH 10
+#define PROG_DEBUGSSAO 11
+#define PROG_CLEARRECTS 12
+#define PROG_TEXTUREGAMMA 13
+#define PROG_PAL256GAMMA 14
 
 struct TEXTURESTAGE;
 struct ShaderGen3D;
 
 void ShaderManager_Init(glExtensions *glext, ShaderManager *shaderman);
 void ShaderManager_Delete(ShaderManager *This);
+SHADER *ShaderManager_GetBuiltin(ShaderManager *This, int id);
 void ShaderManager_SetShader(ShaderManager *This, __int64 id, __int64 *texstate, int type);
 
 #ifdef __cplusplus
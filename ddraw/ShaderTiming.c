@@ -0,0 +1,282 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#include "common.h"
+#include "ShaderGen3D.h"
+#include "ShaderTiming.h"
+
+static const char *const shadertiming_opnames[SHADERTIMING_OPCOUNT] = { "Blt", "Draw", "Clear", "DrawScreen" };
+
+/**
+  * Initializes the GPU timing of shaders.
+  * @param timing
+  *  Pointer to ShaderTiming structure to initialize
+  * @param ext
+  *  OpenGL extensions of the context
+  * @return
+  *  TRUE if timer queries are available and memory was allocated
+  */
+BOOL ShaderTiming_Init(ShaderTiming *timing, glExtensions *ext)
+{
+	int i;
+	ZeroMemory(timing, sizeof(ShaderTiming));
+	if (!ext->GLEXT_ARB_timer_query) return FALSE;
+	timing->ext = ext;
+	timing->entries = (ShaderTimingEntry*)malloc(SHADERTIMING_ENTRIES * sizeof(ShaderTimingEntry));
+	if (!timing->entries) return FALSE;
+	ZeroMemory(timing->entries, SHADERTIMING_ENTRIES * sizeof(ShaderTimingEntry));
+	for (i = 0; i < SHADERTIMING_POOLS; i++)
+	{
+		timing->pools[i].samples = (ShaderTimingSample*)malloc(SHADERTIMING_SAMPLES * sizeof(ShaderTimingSample));
+		if (!timing->pools[i].samples)
+		{
+			while (--i >= 0) free(timing->pools[i].samples);
+			free(timing->entries);
+			return FALSE;
+		}
+		// Queries are generated the first time a sample is used
+		ZeroMemory(timing->pools[i].samples, SHADERTIMING_SAMPLES * sizeof(ShaderTimingSample));
+	}
+	return TRUE;
+}
+
+/**
+  * Adds the time of one operation to the totals of its key.
+  * @param timing
+  *  Pointer to ShaderTiming structure
+  * @param key
+  *  Operation and shader the time was spent on
+  * @param time
+  *  GPU time in nanoseconds
+  */
+static void ShaderTiming_Add(ShaderTiming *timing, const ShaderTimingKey *key, GLuint64 time)
+{
+	const BYTE *bytes = (const BYTE*)key;
+	DWORD hash = 2166136261U;
+	DWORD slot;
+	DWORD i;
+	ShaderTimingEntry *entry;
+	for (i = 0; i < sizeof(ShaderTimingKey); i++)
+		hash = (hash ^ bytes[i]) * 16777619U;
+	for (i = 0; i < SHADERTIMING_ENTRIES; i++)
+	{
+		slot = (hash + i) & (SHADERTIMING_ENTRIES - 1);
+		entry = &timing->entries[slot];
+		if (!entry->count)
+		{
+			// Keep a free slot so lookups of new keys always end
+			if (timing->entrycount >= SHADERTIMING_ENTRIES - 1) break;
+			memcpy(&entry->key, key, sizeof(ShaderTimingKey));
+			timing->entrycount++;
+		}
+		else if (memcmp(&entry->key, key, sizeof(ShaderTimingKey))) continue;
+		entry->count++;
+		entry->total += time;
+		if (time > entry->max) entry->max = time;
+		return;
+	}
+	timing->lost++;
+}
+
+/**
+  * Reads the results of a frame's queries and frees its pool for reuse.
+  * @param timing
+  *  Pointer to ShaderTiming structure
+  * @param pool
+  *  Pool to read the results of
+  * @param wait
+  *  TRUE to wait for the GPU to finish the queries
+  * @return
+  *  TRUE if the pool can be reused
+  */
+static BOOL ShaderTiming_Collect(ShaderTiming *timing, ShaderTimingPool *pool, BOOL wait)
+{
+	GLint available = 0;
+	GLuint64 begin, end;
+	DWORD i;
+	if (!pool->pending) return TRUE;
+	// Queries finish in the order they were issued, so the last one stands for all
+	if (!wait)
+	{
+		timing->ext->glGetQueryObjectiv(pool->lastquery, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available) return FALSE;
+	}
+	for (i = 0; i < pool->count; i++)
+	{
+		timing->ext->glGetQueryObjectui64v(pool->samples[i].query[0], GL_QUERY_RESULT, &begin);
+		timing->ext->glGetQueryObjectui64v(pool->samples[i].query[1], GL_QUERY_RESULT, &end);
+		ShaderTiming_Add(timing, &pool->samples[i].key, end - begin);
+	}
+	pool->count = 0;
+	pool->pending = FALSE;
+	return TRUE;
+}
+
+/**
+  * Starts timing an operation.  Must be paired with ShaderTiming_End in the
+  * same frame; operations may be nested.
+  * @param timing
+  *  Pointer to ShaderTiming structure
+  * @return
+  *  Index to pass to ShaderTiming_End, or -1 if the operation is not timed
+  */
+int ShaderTiming_Begin(ShaderTiming *timing)
+{
+	ShaderTimingPool *pool = &timing->pools[timing->current];
+	ShaderTimingSample *sample;
+	if (pool->pending || (pool->count >= SHADERTIMING_SAMPLES))
+	{
+		timing->dropped++;
+		return -1;
+	}
+	sample = &pool->samples[pool->count];
+	if (!sample->query[0]) timing->ext->glGenQueries(2, sample->query);
+	glQueryCounter(sample->query[0], GL_TIMESTAMP);
+	return pool->count++;
+}
+
+/**
+  * Ends timing an operation and records the program it was drawn with.
+  * @param timing
+  *  Pointer to ShaderTiming structure
+  * @param index
+  *  Value returned by ShaderTiming_Begin
+  * @param op
+  *  Operation that was timed, one of the SHADERTIMING_* operations
+  * @param gen3d
+  *  Shader generator holding the current program
+  */
+void ShaderTiming_End(ShaderTiming *timing, int index, DWORD op, struct ShaderGen3D *gen3d)
+{
+	ShaderTimingPool *pool = &timing->pools[timing->current];
+	ShaderTimingSample *sample;
+	if (index < 0) return;
+	sample = &pool->samples[index];
+	glQueryCounter(sample->query[1], GL_TIMESTAMP);
+	pool->lastquery = sample->query[1];
+	ZeroMemory(&sample->key, sizeof(ShaderTimingKey));
+	sample->key.op = op;
+	// Clears don't draw with a program
+	if (op == SHADERTIMING_CLEAR) sample->key.shadertype = -1;
+	else
+	{
+		sample->key.shadertype = gen3d->current_shadertype;
+		sample->key.id = gen3d->current_shader;
+		if (gen3d->current_shadertype == 2)
+			memcpy(sample->key.texid, gen3d->current_texid, 8 * sizeof(__int64));
+	}
+}
+
+/**
+  * Moves on to the next frame's pool and reads the results of earlier
+  * frames that the GPU has finished.  Must be called after all operations
+  * of the frame have ended.
+  * @param timing
+  *  Pointer to ShaderTiming structure
+  */
+void ShaderTiming_EndFrame(ShaderTiming *timing)
+{
+	DWORD i;
+	if (timing->pools[timing->current].count) timing->pools[timing->current].pending = TRUE;
+	timing->current = (timing->current + 1) % SHADERTIMING_POOLS;
+	for (i = 0; i < SHADERTIMING_POOLS; i++)
+		ShaderTiming_Collect(timing, &timing->pools[i], FALSE);
+}
+
+/**
+  * Orders entries by descending total time, with unused entries last.
+  */
+static int __cdecl ShaderTiming_Compare(const void *a, const void *b)
+{
+	const ShaderTimingEntry *entry1 = (const ShaderTimingEntry*)a;
+	const ShaderTimingEntry *entry2 = (const ShaderTimingEntry*)b;
+	if (entry1->total > entry2->total) return -1;
+	if (entry1->total < entry2->total) return 1;
+	if (entry1->count > entry2->count) return -1;
+	if (entry1->count < entry2->count) return 1;
+	return 0;
+}
+
+/**
+  * Writes the totals to dxgl-shadertiming.csv in the directory of the
+  * executable.
+  * @param timing
+  *  Pointer to ShaderTiming structure
+  */
+static void ShaderTiming_Write(ShaderTiming *timing)
+{
+	static const char header[] = "Operation,Shader type,Shader ID,Texture stage 0,Texture stage 1,Texture stage 2,"
+		"Texture stage 3,Texture stage 4,Texture stage 5,Texture stage 6,Texture stage 7,"
+		"Count,Total (us),Average (us),Max (us)\r\n";
+	TCHAR path[MAX_PATH + 1];
+	TCHAR *path_truncate;
+	HANDLE file;
+	DWORD written;
+	char line[512];
+	int length;
+	DWORD i;
+	ShaderTimingEntry *entry;
+	if (!timing->entrycount) return;
+	GetModuleFileName(NULL, path, MAX_PATH);
+	path[MAX_PATH] = 0;
+	path_truncate = _tcsrchr(path, _T('\\'));
+	if (path_truncate) *(path_truncate + 1) = 0;
+	_tcscat(path, _T("dxgl-shadertiming.csv"));
+	file = CreateFile(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return;
+	WriteFile(file, header, sizeof(header) - 1, &written, NULL);
+	qsort(timing->entries, SHADERTIMING_ENTRIES, sizeof(ShaderTimingEntry), ShaderTiming_Compare);
+	for (i = 0; i < timing->entrycount; i++)
+	{
+		entry = &timing->entries[i];
+		length = _snprintf(line, 511, "%s,%d,%016I64X,%016I64X,%016I64X,%016I64X,%016I64X,%016I64X,%016I64X,"
+			"%016I64X,%016I64X,%u,%.3f,%.3f,%.3f\r\n", shadertiming_opnames[entry->key.op], entry->key.shadertype,
+			entry->key.id, entry->key.texid[0], entry->key.texid[1], entry->key.texid[2], entry->key.texid[3],
+			entry->key.texid[4], entry->key.texid[5], entry->key.texid[6], entry->key.texid[7], entry->count,
+			(double)entry->total / 1000.0, (double)entry->total / 1000.0 / (double)entry->count,
+			(double)entry->max / 1000.0);
+		if (length > 0) WriteFile(file, line, length, &written, NULL);
+	}
+	CloseHandle(file);
+}
+
+/**
+  * Reads the outstanding results, writes the totals and frees the queries.
+  * Must be called from the thread that owns the OpenGL context.
+  * @param timing
+  *  Pointer to ShaderTiming structure
+  */
+void ShaderTiming_Delete(ShaderTiming *timing)
+{
+	char str[128];
+	DWORD i, j;
+	if (timing->pools[timing->current].count) timing->pools[timing->current].pending = TRUE;
+	for (i = 0; i < SHADERTIMING_POOLS; i++)
+	{
+		ShaderTiming_Collect(timing, &timing->pools[i], TRUE);
+		for (j = 0; j < SHADERTIMING_SAMPLES; j++)
+			if (timing->pools[i].samples[j].query[0]) timing->ext->glDeleteQueries(2, timing->pools[i].samples[j].query);
+		free(timing->pools[i].samples);
+		timing->pools[i].samples = NULL;
+	}
+	ShaderTiming_Write(timing);
+	sprintf(str, "Shader timing: %u combinations, %u operations not timed, %u not recorded\n",
+		timing->entrycount, timing->dropped, timing->lost);
+	TRACE_STRING(str);
+	free(timing->entries);
+	timing->entries = NULL;
+}
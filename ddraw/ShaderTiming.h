@@ -0,0 +1,113 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#pragma once
+#ifndef _SHADERTIMING_H
+#define _SHADERTIMING_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Operations timed on the GPU
+#define SHADERTIMING_BLT 0
+#define SHADERTIMING_DRAW 1
+#define SHADERTIMING_CLEAR 2
+#define SHADERTIMING_DRAWSCREEN 3
+#define SHADERTIMING_OPCOUNT 4
+
+// Frames of queries in flight; results are read back up to two frames later
+#define SHADERTIMING_POOLS 3
+// Operations timed per frame, later ones are not timed
+#define SHADERTIMING_SAMPLES 4096
+// Distinct operation and shader combinations kept
+#define SHADERTIMING_ENTRIES 4096
+
+struct ShaderGen3D;
+
+// Operation and the program current when it ended
+typedef struct ShaderTimingKey
+{
+	DWORD op;
+	int shadertype;  // As in ShaderGen3D, -1 if not drawn with a shader
+	__int64 id;  // Program name, ShaderGen2D ID or ShaderGen3D state ID
+	__int64 texid[8];  // Texture stage IDs of ShaderGen3D shaders, otherwise zero
+} ShaderTimingKey;
+
+typedef struct ShaderTimingSample
+{
+	GLuint query[2];  // GL_TIMESTAMP at the start and end of the operation
+	ShaderTimingKey key;
+} ShaderTimingSample;
+
+typedef struct ShaderTimingPool
+{
+	ShaderTimingSample *samples;
+	DWORD count;
+	GLuint lastquery;  // Query issued last, finishes after all others of the pool
+	BOOL pending;  // TRUE until the results of the samples have been read
+} ShaderTimingPool;
+
+typedef struct ShaderTimingEntry
+{
+	ShaderTimingKey key;
+	DWORD count;  // 0 if the entry is unused
+	GLuint64 total;  // Nanoseconds
+	GLuint64 max;
+} ShaderTimingEntry;
+
+/** @brief GPU time of blts, draws, clears and presents per shader
+  * Operations are bracketed with GL_TIMESTAMP queries and added up per
+  * operation and program.  The totals are written to dxgl-shadertiming.csv
+  * when the renderer is deleted.
+  */
+typedef struct ShaderTiming
+{
+	glExtensions *ext;
+	ShaderTimingPool pools[SHADERTIMING_POOLS];
+	DWORD current;  // Pool of the current frame
+	ShaderTimingEntry *entries;  // Hash table
+	DWORD entrycount;
+	DWORD dropped;  // Operations not timed because the pool was full or busy
+	DWORD lost;  // Timed operations not added because the table was full
+} ShaderTiming;
+
+BOOL ShaderTiming_Init(ShaderTiming *timing, glExtensions *ext);
+void ShaderTiming_Delete(ShaderTiming *timing);
+int ShaderTiming_Begin(ShaderTiming *timing);
+void ShaderTiming_End(ShaderTiming *timing, int index, DWORD op, struct ShaderGen3D *gen3d);
+void ShaderTiming_EndFrame(ShaderTiming *timing);
+
+#ifdef __cplusplus
+}
+
+// GPU time of an operation over a scope; a NULL timing, as passed when DebugShaderTiming is off, skips it
+struct ScopedShaderTiming
+{
+	ScopedShaderTiming(ShaderTiming *timing, DWORD op, struct ShaderGen3D *gen3d) : timing(timing), op(op), gen3d(gen3d)
+	{
+		if (timing) index = ShaderTiming_Begin(timing);
+	}
+	~ScopedShaderTiming() { if (timing) ShaderTiming_End(timing, index, op, gen3d); }
+	ShaderTiming *timing;
+	DWORD op;
+	struct ShaderGen3D *gen3d;
+	int index;
+};
+#endif
+
+#endif //_SHADERTIMING_H
@@ -0,0 +1,169 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#include "common.h"
+#include "SoftBlt.h"
+#include <emmintrin.h>
+
+static int sse2 = -1;
+
+static __inline DWORD SoftBlt__Read(const BYTE *p, DWORD bytes)
+{
+	switch (bytes)
+	{
+	case 1:
+		return *p;
+	case 2:
+		return *(const WORD*)p;
+	case 3:
+		return p[0] | (p[1] << 8) | (p[2] << 16);
+	default:
+		return *(const DWORD*)p;
+	}
+}
+
+static __inline void SoftBlt__Write(BYTE *p, DWORD bytes, DWORD pixel)
+{
+	switch (bytes)
+	{
+	case 1:
+		*p = (BYTE)pixel;
+		break;
+	case 2:
+		*(WORD*)p = (WORD)pixel;
+		break;
+	case 3:
+		p[0] = (BYTE)pixel;
+		p[1] = (BYTE)(pixel >> 8);
+		p[2] = (BYTE)(pixel >> 16);
+		break;
+	default:
+		*(DWORD*)p = pixel;
+		break;
+	}
+}
+
+// Copies the source pixels of a row that don't match the key, four at a time
+static void SoftBlt__KeyRow32_sse2(DWORD *dest, const DWORD *src, LONG width, DWORD key, DWORD keymask)
+{
+	__m128i k = _mm_set1_epi32(key);
+	__m128i m = _mm_set1_epi32(keymask);
+	__m128i s, d, match;
+	LONG x = 0;
+	for (; x + 4 <= width; x += 4)
+	{
+		s = _mm_loadu_si128((const __m128i*)(src + x));
+		d = _mm_loadu_si128((const __m128i*)(dest + x));
+		match = _mm_cmpeq_epi32(_mm_and_si128(s, m), k);
+		_mm_storeu_si128((__m128i*)(dest + x), _mm_or_si128(_mm_and_si128(match, d), _mm_andnot_si128(match, s)));
+	}
+	for (; x < width; x++)
+		if ((src[x] & keymask) != key) dest[x] = src[x];
+}
+
+// Copies the source pixels of a row that don't match the key, eight at a time
+static void SoftBlt__KeyRow16_sse2(WORD *dest, const WORD *src, LONG width, DWORD key, DWORD keymask)
+{
+	__m128i k = _mm_set1_epi16((short)key);
+	__m128i m = _mm_set1_epi16((short)keymask);
+	__m128i s, d, match;
+	LONG x = 0;
+	for (; x + 8 <= width; x += 8)
+	{
+		s = _mm_loadu_si128((const __m128i*)(src + x));
+		d = _mm_loadu_si128((const __m128i*)(dest + x));
+		match = _mm_cmpeq_epi16(_mm_and_si128(s, m), k);
+		_mm_storeu_si128((__m128i*)(dest + x), _mm_or_si128(_mm_and_si128(match, d), _mm_andnot_si128(match, s)));
+	}
+	for (; x < width; x++)
+		if ((src[x] & keymask) != key) dest[x] = src[x];
+}
+
+/**
+  * Copies a rectangle between two surfaces in system memory, with optional
+  * color keys and mirroring.  Stretched blts use nearest point sampling,
+  * like the blt shaders.  The rectangles must lie within their surfaces and
+  * must not overlap.
+  * @param dest
+  *  Destination surface, rectangle and key
+  * @param src
+  *  Source surface, rectangle and key
+  * @param bpp
+  *  Bits per pixel of both surfaces, 8, 16, 24 or 32
+  * @param keymask
+  *  Bits of a pixel that are compared with the color keys
+  * @param flags
+  *  Combination of SOFTBLT_* flags
+  */
+void SoftBlt_Blt(SOFTBLTSURFACE *dest, const SOFTBLTSURFACE *src, DWORD bpp, DWORD keymask, DWORD flags)
+{
+	DWORD bytes = bpp / 8;
+	LONG dw = dest->rect.right - dest->rect.left;
+	LONG dh = dest->rect.bottom - dest->rect.top;
+	LONG sw = src->rect.right - src->rect.left;
+	LONG sh = src->rect.bottom - src->rect.top;
+	DWORD srckey = src->key & keymask;
+	DWORD destkey = dest->key & keymask;
+	DWORD xstep, ystep, xpos, ypos;
+	DWORD pixel;
+	LONG x, y, sx, sy;
+	BYTE *drow;
+	const BYTE *srow;
+	if (sse2 == -1) sse2 = IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE) ? 1 : 0;
+	if ((dw == sw) && (dh == sh) && !(flags & (SOFTBLT_MIRRORX | SOFTBLT_KEYDEST)))
+	{
+		for (y = 0; y < dh; y++)
+		{
+			sy = (flags & SOFTBLT_MIRRORY) ? (sh - 1 - y) : y;
+			drow = dest->bits + ((dest->rect.top + y) * dest->pitch) + (dest->rect.left * bytes);
+			srow = src->bits + ((src->rect.top + sy) * src->pitch) + (src->rect.left * bytes);
+			if (!(flags & SOFTBLT_KEYSRC)) memcpy(drow, srow, dw * bytes);
+			else if (sse2 && (bytes == 4)) SoftBlt__KeyRow32_sse2((DWORD*)drow, (const DWORD*)srow, dw, srckey, keymask);
+			else if (sse2 && (bytes == 2)) SoftBlt__KeyRow16_sse2((WORD*)drow, (const WORD*)srow, dw, srckey, keymask);
+			else
+			{
+				for (x = 0; x < dw; x++)
+				{
+					pixel = SoftBlt__Read(srow + (x * bytes), bytes);
+					if ((pixel & keymask) != srckey) SoftBlt__Write(drow + (x * bytes), bytes, pixel);
+				}
+			}
+		}
+		return;
+	}
+	// 16.16 fixed point steps, sampling the source at the center of each destination pixel
+	xstep = ((DWORD)sw << 16) / dw;
+	ystep = ((DWORD)sh << 16) / dh;
+	ypos = ystep / 2;
+	for (y = 0; y < dh; y++, ypos += ystep)
+	{
+		sy = ypos >> 16;
+		if (flags & SOFTBLT_MIRRORY) sy = sh - 1 - sy;
+		drow = dest->bits + ((dest->rect.top + y) * dest->pitch) + (dest->rect.left * bytes);
+		srow = src->bits + ((src->rect.top + sy) * src->pitch) + (src->rect.left * bytes);
+		xpos = xstep / 2;
+		for (x = 0; x < dw; x++, xpos += xstep)
+		{
+			sx = xpos >> 16;
+			if (flags & SOFTBLT_MIRRORX) sx = sw - 1 - sx;
+			pixel = SoftBlt__Read(srow + (sx * bytes), bytes);
+			if ((flags & SOFTBLT_KEYSRC) && ((pixel & keymask) == srckey)) continue;
+			if ((flags & SOFTBLT_KEYDEST) && ((SoftBlt__Read(drow + (x * bytes), bytes) & keymask) != destkey)) continue;
+			SoftBlt__Write(drow + (x * bytes), bytes, pixel);
+		}
+	}
+}
@@ -0,0 +1,47 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#pragma once
+#ifndef _SOFTBLT_H
+#define _SOFTBLT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// SoftBlt_Blt flags
+#define SOFTBLT_KEYSRC		1  // Skip source pixels that match the source key
+#define SOFTBLT_KEYDEST		2  // Only write destination pixels that match the destination key
+#define SOFTBLT_MIRRORX		4  // Mirror the source left to right
+#define SOFTBLT_MIRRORY		8  // Mirror the source top to bottom
+
+// One side of a software blt
+typedef struct SOFTBLTSURFACE
+{
+	BYTE *bits;  // Top left pixel of the surface
+	LONG pitch;  // Bytes per row
+	RECT rect;  // Rectangle to copy from or to, within the surface
+	DWORD key;  // Color key, compared after masking with the keymask of the blt
+} SOFTBLTSURFACE;
+
+void SoftBlt_Blt(SOFTBLTSURFACE *dest, const SOFTBLTSURFACE *src, DWORD bpp, DWORD keymask, DWORD flags);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_SOFTBLT_H
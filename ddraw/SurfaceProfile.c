@@ -0,0 +1,225 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#include "common.h"
+#include "SurfaceProfile.h"
+
+static const char *const surfaceprofile_opnames[SURFACEPROFILE_OPCOUNT] =
+	{ "Download", "Upload", "Convert", "GetDC", "ReleaseDC", "FBO" };
+// Setting most likely to help a surface whose time goes mostly to each operation
+static const char *const surfaceprofile_hints[SURFACEPROFILE_OPCOUNT] =
+	{ "AsyncReadback", "TexUpload", "FormatConversion", "PersistentDC", "PersistentDC", "" };
+
+static CRITICAL_SECTION surfaceprofile_cs;
+static BOOL surfaceprofile_active = FALSE;
+static SurfaceProfileEntry *surfaceprofile_entries = NULL;  // Newest first
+static DWORD surfaceprofile_count = 0;
+static LONGLONG surfaceprofile_frequency = 1;
+
+/**
+  * Starts attributing costs to surfaces.  Called when the DLL is loaded if
+  * DebugSurfaceProfile is set.
+  */
+void SurfaceProfile_Init()
+{
+	LARGE_INTEGER frequency;
+	if (surfaceprofile_active) return;
+	InitializeCriticalSection(&surfaceprofile_cs);
+	QueryPerformanceFrequency(&frequency);
+	surfaceprofile_frequency = frequency.QuadPart;
+	surfaceprofile_active = TRUE;
+}
+
+/**
+  * Adds a surface to the profile.
+  * @param ddsd
+  *  Description the surface was created with
+  * @return
+  *  Entry to pass to SurfaceProfile_Begin and SurfaceProfile_End, or NULL if
+  *  profiling is off or out of memory
+  */
+SurfaceProfileEntry *SurfaceProfile_Add(const DDSURFACEDESC2 *ddsd)
+{
+	SurfaceProfileEntry *entry;
+	if (!surfaceprofile_active) return NULL;
+	entry = (SurfaceProfileEntry*)malloc(sizeof(SurfaceProfileEntry));
+	if (!entry) return NULL;
+	ZeroMemory(entry, sizeof(SurfaceProfileEntry));
+	entry->width = ddsd->dwWidth;
+	entry->height = ddsd->dwHeight;
+	entry->caps = ddsd->ddsCaps.dwCaps;
+	entry->caps2 = ddsd->ddsCaps.dwCaps2;
+	if (ddsd->ddpfPixelFormat.dwFlags & DDPF_FOURCC) entry->fourcc = ddsd->ddpfPixelFormat.dwFourCC;
+	else entry->bpp = ddsd->ddpfPixelFormat.dwRGBBitCount;
+	EnterCriticalSection(&surfaceprofile_cs);
+	entry->id = ++surfaceprofile_count;
+	entry->next = surfaceprofile_entries;
+	surfaceprofile_entries = entry;
+	LeaveCriticalSection(&surfaceprofile_cs);
+	return entry;
+}
+
+/**
+  * Gets the start time of an operation on a surface.
+  * @param entry
+  *  Profile entry of the surface, may be NULL
+  * @return
+  *  Time to pass to SurfaceProfile_End, 0 if entry is NULL
+  */
+LONGLONG SurfaceProfile_Begin(SurfaceProfileEntry *entry)
+{
+	LARGE_INTEGER counter;
+	if (!entry) return 0;
+	QueryPerformanceCounter(&counter);
+	return counter.QuadPart;
+}
+
+/**
+  * Adds the time since SurfaceProfile_Begin to an operation of a surface.
+  * Operations may end on any thread.
+  * @param entry
+  *  Profile entry of the surface, may be NULL
+  * @param op
+  *  SURFACEPROFILE_* operation
+  * @param start
+  *  Value returned by SurfaceProfile_Begin
+  * @param bytes
+  *  Bytes copied or converted by the operation
+  */
+void SurfaceProfile_End(SurfaceProfileEntry *entry, DWORD op, LONGLONG start, LONGLONG bytes)
+{
+	LARGE_INTEGER counter;
+	if (!entry) return;
+	QueryPerformanceCounter(&counter);
+	EnterCriticalSection(&surfaceprofile_cs);
+	entry->stats[op].count++;
+	entry->stats[op].bytes += bytes;
+	entry->stats[op].time += counter.QuadPart - start;
+	LeaveCriticalSection(&surfaceprofile_cs);
+}
+
+/**
+  * Orders entries by descending total time, then by creation.
+  */
+static int __cdecl SurfaceProfile_Compare(const void *a, const void *b)
+{
+	const SurfaceProfileEntry *entry1 = *(const SurfaceProfileEntry**)a;
+	const SurfaceProfileEntry *entry2 = *(const SurfaceProfileEntry**)b;
+	if (entry1->total > entry2->total) return -1;
+	if (entry1->total < entry2->total) return 1;
+	if (entry1->id < entry2->id) return -1;
+	if (entry1->id > entry2->id) return 1;
+	return 0;
+}
+
+/**
+  * Writes the surfaces that had any cost to dxgl-surfaceprofile.csv in the
+  * directory of the executable, most expensive first.
+  * @param sorted
+  *  Entries with any cost, sorted by SurfaceProfile_Compare
+  * @param count
+  *  Number of entries in sorted
+  */
+static void SurfaceProfile_Write(SurfaceProfileEntry **sorted, DWORD count)
+{
+	TCHAR path[MAX_PATH + 1];
+	TCHAR *path_truncate;
+	HANDLE file;
+	DWORD written;
+	char line[256];
+	int length;
+	DWORD i, op, worst;
+	SurfaceProfileEntry *entry;
+	GetModuleFileName(NULL, path, MAX_PATH);
+	path[MAX_PATH] = 0;
+	path_truncate = _tcsrchr(path, _T('\\'));
+	if (path_truncate) *(path_truncate + 1) = 0;
+	_tcscat(path, _T("dxgl-surfaceprofile.csv"));
+	file = CreateFile(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return;
+	length = _snprintf(line, 255, "Surface,Width,Height,Caps,Caps2,Bits,FourCC,Total (us)");
+	if (length > 0) WriteFile(file, line, length, &written, NULL);
+	for (op = 0; op < SURFACEPROFILE_OPCOUNT; op++)
+	{
+		length = _snprintf(line, 255, ",%s count,%s bytes,%s (us)", surfaceprofile_opnames[op],
+			surfaceprofile_opnames[op], surfaceprofile_opnames[op]);
+		if (length > 0) WriteFile(file, line, length, &written, NULL);
+	}
+	WriteFile(file, ",Setting to try\r\n", 17, &written, NULL);
+	for (i = 0; i < count; i++)
+	{
+		entry = sorted[i];
+		length = _snprintf(line, 255, "%u,%u,%u,%08X,%08X,%u,%.4s,%.3f", entry->id, entry->width, entry->height,
+			entry->caps, entry->caps2, entry->bpp, entry->fourcc ? (const char*)&entry->fourcc : "",
+			(double)entry->total * 1000000.0 / (double)surfaceprofile_frequency);
+		if (length > 0) WriteFile(file, line, length, &written, NULL);
+		worst = 0;
+		for (op = 0; op < SURFACEPROFILE_OPCOUNT; op++)
+		{
+			if (entry->stats[op].time > entry->stats[worst].time) worst = op;
+			length = _snprintf(line, 255, ",%u,%I64d,%.3f", entry->stats[op].count, entry->stats[op].bytes,
+				(double)entry->stats[op].time * 1000000.0 / (double)surfaceprofile_frequency);
+			if (length > 0) WriteFile(file, line, length, &written, NULL);
+		}
+		length = _snprintf(line, 255, ",%s\r\n", surfaceprofile_hints[worst]);
+		if (length > 0) WriteFile(file, line, length, &written, NULL);
+	}
+	CloseHandle(file);
+}
+
+/**
+  * Writes the report and frees the entries.  Called when the DLL is
+  * unloaded; textures still alive then are no longer profiled.
+  */
+void SurfaceProfile_Shutdown()
+{
+	SurfaceProfileEntry **sorted;
+	SurfaceProfileEntry *entry;
+	SurfaceProfileEntry *next;
+	DWORD count = 0;
+	DWORD op;
+	char str[128];
+	if (!surfaceprofile_active) return;
+	EnterCriticalSection(&surfaceprofile_cs);
+	surfaceprofile_active = FALSE;
+	sorted = (SurfaceProfileEntry**)malloc(surfaceprofile_count * sizeof(SurfaceProfileEntry*));
+	for (entry = surfaceprofile_entries; entry; entry = entry->next)
+	{
+		entry->total = 0;
+		for (op = 0; op < SURFACEPROFILE_OPCOUNT; op++)
+			entry->total += entry->stats[op].time;
+		if (sorted && entry->total) sorted[count++] = entry;
+	}
+	if (count)
+	{
+		qsort(sorted, count, sizeof(SurfaceProfileEntry*), SurfaceProfile_Compare);
+		SurfaceProfile_Write(sorted, count);
+	}
+	sprintf(str, "Surface profile: %u surfaces, %u with readbacks, uploads, conversions, DCs or FBO changes\n",
+		surfaceprofile_count, count);
+	TRACE_STRING(str);
+	free(sorted);
+	for (entry = surfaceprofile_entries; entry; entry = next)
+	{
+		next = entry->next;
+		free(entry);
+	}
+	surfaceprofile_entries = NULL;
+	surfaceprofile_count = 0;
+	LeaveCriticalSection(&surfaceprofile_cs);
+	DeleteCriticalSection(&surfaceprofile_cs);
+}
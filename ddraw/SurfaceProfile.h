@@ -0,0 +1,67 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#pragma once
+#ifndef _SURFACEPROFILE_H
+#define _SURFACEPROFILE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Operations whose cost is attributed to surfaces
+#define SURFACEPROFILE_DOWNLOAD 0  // Lock reading the surface back from the GPU
+#define SURFACEPROFILE_UPLOAD 1  // Upload of the surface buffer after Unlock
+#define SURFACEPROFILE_CONVERT 2  // CPU pixel format conversion of an upload or readback
+#define SURFACEPROFILE_GETDC 3
+#define SURFACEPROFILE_RELEASEDC 4
+#define SURFACEPROFILE_FBO 5  // Attaching the surface to a framebuffer
+#define SURFACEPROFILE_OPCOUNT 6
+
+typedef struct SurfaceProfileStat
+{
+	DWORD count;
+	LONGLONG bytes;
+	LONGLONG time;  // Performance counter ticks
+} SurfaceProfileStat;
+
+// Costs of one surface, kept until the process exits
+typedef struct SurfaceProfileEntry
+{
+	struct SurfaceProfileEntry *next;
+	DWORD id;  // Surfaces are numbered in the order they were created
+	DWORD width;
+	DWORD height;
+	DWORD caps;
+	DWORD caps2;
+	DWORD bpp;
+	DWORD fourcc;
+	LONGLONG total;  // Time of all operations, set when the report is written
+	SurfaceProfileStat stats[SURFACEPROFILE_OPCOUNT];
+} SurfaceProfileEntry;
+
+void SurfaceProfile_Init();
+void SurfaceProfile_Shutdown();
+SurfaceProfileEntry *SurfaceProfile_Add(const DDSURFACEDESC2 *ddsd);
+LONGLONG SurfaceProfile_Begin(SurfaceProfileEntry *entry);
+void SurfaceProfile_End(SurfaceProfileEntry *entry, DWORD op, LONGLONG start, LONGLONG bytes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_SURFACEPROFILE_H
@@ -0,0 +1,195 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#include "common.h"
+#include "glUtil.h"
+#include "TextureAtlas.h"
+
+/**
+  * Creates the texture of a new atlas page.
+  * @param atlas
+  *  Pointer to TextureAtlas structure
+  * @param page
+  *  Page with its format filled in
+  * @return
+  *  TRUE if the texture was created
+  */
+static BOOL TextureAtlas_CreatePage(TextureAtlas *atlas, TextureAtlasPage *page)
+{
+	while (glGetError() != GL_NO_ERROR);
+	glGenTextures(1, &page->id);
+	glUtil_SetActiveTexture(atlas->util, 0);
+	glBindTexture(GL_TEXTURE_2D, page->id);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+	if (atlas->ext->GLEXT_ARB_texture_storage)
+		atlas->ext->glTexStorage2D(GL_TEXTURE_2D, 1, page->internalformat, page->size, page->size);
+	else glTexImage2D(GL_TEXTURE_2D, 0, page->internalformat, page->size, page->size, 0,
+		page->format, page->type, NULL);
+	if (glGetError() != GL_NO_ERROR)
+	{
+		glDeleteTextures(1, &page->id);
+		page->id = 0;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+  * Tries to place a cell on the current shelf of a page, opening a new shelf
+  * below it if the current one is full.
+  * @param page
+  *  Page to place the cell in
+  * @param width,height
+  *  Size of the cell
+  * @param x,y
+  *  Receive the position of the cell
+  * @return
+  *  TRUE if the cell fits in the page
+  */
+static BOOL TextureAtlas_Place(TextureAtlasPage *page, GLsizei width, GLsizei height, GLint *x, GLint *y)
+{
+	if ((page->shelfx + width) > page->size)
+	{
+		page->shelfy += page->shelfheight;
+		page->shelfx = 0;
+		page->shelfheight = 0;
+	}
+	if ((page->shelfy + height) > page->size) return FALSE;
+	*x = page->shelfx;
+	*y = page->shelfy;
+	page->shelfx += width;
+	if (height > page->shelfheight) page->shelfheight = height;
+	page->cells++;
+	return TRUE;
+}
+
+/**
+  * Initializes an allocator of atlas textures for small surfaces.
+  * @param atlas
+  *  Pointer to TextureAtlas structure to initialize
+  * @param ext
+  *  Pointer to glExtensions structure of the context owning the textures
+  * @param util
+  *  Pointer to glUtil structure of the context owning the textures
+  * @param maxcell
+  *  Largest width or height of a surface placed in the atlas, 0 to disable it
+  */
+void TextureAtlas_Init(TextureAtlas *atlas, glExtensions *ext, glUtil *util, GLsizei maxcell)
+{
+	ZeroMemory(atlas, sizeof(TextureAtlas));
+	atlas->ext = ext;
+	atlas->util = util;
+	if (maxcell > TEXTUREATLAS_PAGESIZE / 4) maxcell = TEXTUREATLAS_PAGESIZE / 4;
+	atlas->maxcell = maxcell;
+}
+
+/**
+  * Deletes all atlas pages and logs the atlas statistics.
+  * @param atlas
+  *  Pointer to TextureAtlas structure
+  */
+void TextureAtlas_Delete(TextureAtlas *atlas)
+{
+	TextureAtlasPage *page;
+	char str[256];
+	while (atlas->pages)
+	{
+		page = atlas->pages;
+		atlas->pages = page->next;
+		glDeleteTextures(1, &page->id);
+		free(page);
+	}
+	sprintf(str, "Texture atlas: %u surfaces placed, %u released, %u pages\n",
+		atlas->placed, atlas->released, atlas->pagecount);
+	TRACE_STRING(str);
+}
+
+/**
+  * Finds room for a surface in an atlas page of matching format, creating a
+  * new page if none has room.
+  * @param atlas
+  *  Pointer to TextureAtlas structure
+  * @param internalformat
+  *  Internal format of the texture storage
+  * @param format,type
+  *  Pixel transfer format and type of the surface data
+  * @param blttype
+  *  Blt shader source type of the surface, so pages only mix surfaces that
+  *  are drawn with the same shader
+  * @param width,height
+  *  Size of the surface
+  * @param x,y
+  *  Receive the position of the surface in the page
+  * @return
+  *  Page holding the surface, or NULL if the surface can't be placed
+  */
+TextureAtlasPage *TextureAtlas_Alloc(TextureAtlas *atlas, GLint internalformat, GLenum format,
+	GLenum type, DWORD blttype, GLsizei width, GLsizei height, GLint *x, GLint *y)
+{
+	TextureAtlasPage *page;
+	if ((width > atlas->maxcell) || (height > atlas->maxcell)) return NULL;
+	for (page = atlas->pages; page; page = page->next)
+	{
+		if ((page->internalformat != internalformat) || (page->format != format) ||
+			(page->type != type) || (page->blttype != blttype)) continue;
+		if (TextureAtlas_Place(page, width, height, x, y))
+		{
+			atlas->placed++;
+			return page;
+		}
+	}
+	page = (TextureAtlasPage*)malloc(sizeof(TextureAtlasPage));
+	if (!page) return NULL;
+	ZeroMemory(page, sizeof(TextureAtlasPage));
+	page->internalformat = internalformat;
+	page->format = format;
+	page->type = type;
+	page->blttype = blttype;
+	page->size = TEXTUREATLAS_PAGESIZE;
+	if (!TextureAtlas_CreatePage(atlas, page))
+	{
+		free(page);
+		return NULL;
+	}
+	page->next = atlas->pages;
+	atlas->pages = page;
+	atlas->pagecount++;
+	TextureAtlas_Place(page, width, height, x, y);
+	atlas->placed++;
+	return page;
+}
+
+/**
+  * Releases the cell of a surface.  Cells are not reused individually; once
+  * the last surface in a page is released the whole page is packed again.
+  * @param atlas
+  *  Pointer to TextureAtlas structure
+  * @param page
+  *  Page holding the surface
+  */
+void TextureAtlas_Free(TextureAtlas *atlas, TextureAtlasPage *page)
+{
+	atlas->released++;
+	if (--page->cells) return;
+	page->shelfx = 0;
+	page->shelfy = 0;
+	page->shelfheight = 0;
+}
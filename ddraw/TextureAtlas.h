@@ -0,0 +1,67 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#pragma once
+#ifndef _TEXTUREATLAS_H
+#define _TEXTUREATLAS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TEXTUREATLAS_PAGESIZE 1024
+
+// Shared texture holding many small surfaces of one format
+typedef struct TextureAtlasPage
+{
+	GLint internalformat;
+	GLenum format;
+	GLenum type;
+	DWORD blttype;
+	GLuint id;
+	GLsizei size;
+	// Cells are packed left to right on shelves stacked top to bottom
+	GLint shelfx;
+	GLint shelfy;
+	GLint shelfheight;
+	DWORD cells;  // Surfaces currently placed in the page
+	struct TextureAtlasPage *next;
+} TextureAtlasPage;
+
+typedef struct TextureAtlas
+{
+	glExtensions *ext;
+	glUtil *util;
+	TextureAtlasPage *pages;
+	GLsizei maxcell;  // Largest width or height packed into a page, 0 if disabled
+	// Statistics, written to the trace log when the atlas is deleted
+	DWORD placed;
+	DWORD released;
+	DWORD pagecount;
+} TextureAtlas;
+
+void TextureAtlas_Init(TextureAtlas *atlas, glExtensions *ext, glUtil *util, GLsizei maxcell);
+void TextureAtlas_Delete(TextureAtlas *atlas);
+TextureAtlasPage *TextureAtlas_Alloc(TextureAtlas *atlas, GLint internalformat, GLenum format,
+	GLenum type, DWORD blttype, GLsizei width, GLsizei height, GLint *x, GLint *y);
+void TextureAtlas_Free(TextureAtlas *atlas, TextureAtlasPage *page);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_TEXTUREATLAS_H
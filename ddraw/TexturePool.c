@@ -0,0 +1,204 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#include "common.h"
+#include "TexturePool.h"
+
+static DWORD TexturePool_Hash(GLenum target, GLint internalformat, GLsizei width, GLsizei height, GLint miplevel)
+{
+	DWORD hash = target;
+	hash = (hash * 31) ^ internalformat;
+	hash = (hash * 31) ^ width;
+	hash = (hash * 31) ^ height;
+	hash = (hash * 31) ^ miplevel;
+	return hash % TEXTUREPOOL_BUCKETS;
+}
+
+static void TexturePool_FreeEntry(TexturePool *pool, TexturePoolEntry *entry)
+{
+	int i;
+	glDeleteTextures(1, &entry->id);
+	for (i = 0; i < 17; i++)
+		if (entry->fbo[i]) pool->ext->glDeleteFramebuffers(1, &entry->fbo[i]);
+	pool->size -= entry->size;
+	pool->count--;
+	free(entry);
+}
+
+/**
+  * Deletes the texture that has been in the pool the longest.
+  * @param pool
+  *  Pointer to TexturePool structure
+  */
+static void TexturePool_EvictOldest(TexturePool *pool)
+{
+	TexturePoolEntry **oldest = NULL;
+	TexturePoolEntry **link;
+	TexturePoolEntry *entry;
+	int i;
+	for (i = 0; i < TEXTUREPOOL_BUCKETS; i++)
+	{
+		for (link = &pool->buckets[i]; *link; link = &(*link)->next)
+		{
+			// Ages wrap around, compare them relative to the clock
+			if (!oldest || ((pool->clock - (*link)->age) > (pool->clock - (*oldest)->age)))
+				oldest = link;
+		}
+	}
+	if (!oldest) return;
+	entry = *oldest;
+	*oldest = entry->next;
+	TexturePool_FreeEntry(pool, entry);
+	pool->evictions++;
+}
+
+/**
+  * Initializes a pool of released textures.
+  * @param pool
+  *  Pointer to TexturePool structure to initialize
+  * @param ext
+  *  Pointer to glExtensions structure of the context owning the textures
+  * @param maxsize
+  *  Estimated texture memory in bytes the pool may hold, 0 to disable it
+  */
+void TexturePool_Init(TexturePool *pool, glExtensions *ext, GLsizeiptr maxsize)
+{
+	ZeroMemory(pool, sizeof(TexturePool));
+	pool->ext = ext;
+	pool->maxsize = maxsize;
+}
+
+/**
+  * Deletes all textures held by a pool and logs its statistics.
+  * @param pool
+  *  Pointer to TexturePool structure
+  */
+void TexturePool_Delete(TexturePool *pool)
+{
+	TexturePoolEntry *entry;
+	char str[256];
+	int i;
+	for (i = 0; i < TEXTUREPOOL_BUCKETS; i++)
+	{
+		while (pool->buckets[i])
+		{
+			entry = pool->buckets[i];
+			pool->buckets[i] = entry->next;
+			TexturePool_FreeEntry(pool, entry);
+		}
+	}
+	sprintf(str, "Texture pool: %u reused, %u created, %u recycled, %u evicted, peak %u KB\n",
+		pool->hits, pool->misses, pool->recycled, pool->evictions, (DWORD)(pool->peaksize / 1024));
+	TRACE_STRING(str);
+}
+
+/**
+  * Takes a texture with matching storage out of the pool.
+  * @param pool
+  *  Pointer to TexturePool structure
+  * @param target
+  *  Texture target
+  * @param internalformat
+  *  Internal format of the texture storage
+  * @param width,height
+  *  Dimensions of the top mipmap level
+  * @param miplevel
+  *  Number of mipmap levels
+  * @param fbo
+  *  Receives the framebuffer names of each level, 0 for levels without one.
+  *  Must have room for 17 entries.
+  * @return
+  *  Texture name, or 0 if the pool has no matching texture
+  */
+GLuint TexturePool_Get(TexturePool *pool, GLenum target, GLint internalformat,
+	GLsizei width, GLsizei height, GLint miplevel, GLuint *fbo)
+{
+	TexturePoolEntry **link;
+	TexturePoolEntry *entry;
+	GLuint id;
+	if (!pool->maxsize) return 0;
+	link = &pool->buckets[TexturePool_Hash(target, internalformat, width, height, miplevel)];
+	for (; *link; link = &(*link)->next)
+	{
+		entry = *link;
+		if ((entry->target == target) && (entry->internalformat == internalformat) &&
+			(entry->width == width) && (entry->height == height) && (entry->miplevel == miplevel))
+		{
+			*link = entry->next;
+			id = entry->id;
+			memcpy(fbo, entry->fbo, 17 * sizeof(GLuint));
+			pool->size -= entry->size;
+			pool->count--;
+			free(entry);
+			pool->hits++;
+			return id;
+		}
+	}
+	pool->misses++;
+	return 0;
+}
+
+/**
+  * Hands a released texture to the pool, evicting the oldest textures if the
+  * pool would grow past its limit.
+  * @param pool
+  *  Pointer to TexturePool structure
+  * @param target
+  *  Texture target
+  * @param internalformat
+  *  Internal format of the texture storage
+  * @param width,height
+  *  Dimensions of the top mipmap level
+  * @param miplevel
+  *  Number of mipmap levels
+  * @param id
+  *  Texture name
+  * @param fbo
+  *  Framebuffer names of each level, 0 for levels without one
+  * @param size
+  *  Estimated size of the texture storage in bytes
+  * @return
+  *  TRUE if the pool took ownership of the texture and framebuffers, FALSE if
+  *  the caller must delete them
+  */
+BOOL TexturePool_Put(TexturePool *pool, GLenum target, GLint internalformat, GLsizei width,
+	GLsizei height, GLint miplevel, GLuint id, const GLuint *fbo, GLsizeiptr size)
+{
+	TexturePoolEntry *entry;
+	DWORD hash;
+	if (size > pool->maxsize) return FALSE;
+	while (pool->count && ((pool->size + size) > pool->maxsize)) TexturePool_EvictOldest(pool);
+	entry = (TexturePoolEntry*)malloc(sizeof(TexturePoolEntry));
+	if (!entry) return FALSE;
+	entry->target = target;
+	entry->internalformat = internalformat;
+	entry->width = width;
+	entry->height = height;
+	entry->miplevel = miplevel;
+	entry->id = id;
+	memcpy(entry->fbo, fbo, 17 * sizeof(GLuint));
+	entry->size = size;
+	entry->age = pool->clock++;
+	hash = TexturePool_Hash(target, internalformat, width, height, miplevel);
+	entry->next = pool->buckets[hash];
+	pool->buckets[hash] = entry;
+	pool->size += size;
+	pool->count++;
+	pool->recycled++;
+	if (pool->size > pool->peaksize) pool->peaksize = pool->size;
+	return TRUE;
+}
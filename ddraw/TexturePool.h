@@ -0,0 +1,70 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#pragma once
+#ifndef _TEXTUREPOOL_H
+#define _TEXTUREPOOL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TEXTUREPOOL_BUCKETS 64
+
+// Released texture kept for reuse by a new surface of the same layout
+typedef struct TexturePoolEntry
+{
+	GLenum target;
+	GLint internalformat;
+	GLsizei width;
+	GLsizei height;
+	GLint miplevel;
+	GLuint id;
+	GLuint fbo[17];  // Level framebuffers still attached to the texture, or 0
+	GLsizeiptr size;
+	DWORD age;
+	struct TexturePoolEntry *next;
+} TexturePoolEntry;
+
+typedef struct TexturePool
+{
+	glExtensions *ext;
+	TexturePoolEntry *buckets[TEXTUREPOOL_BUCKETS];
+	GLsizeiptr size;  // Estimated bytes of texture storage held by the pool
+	GLsizeiptr maxsize;
+	DWORD clock;
+	DWORD count;
+	// Statistics, written to the trace log when the pool is deleted
+	DWORD hits;
+	DWORD misses;
+	DWORD recycled;
+	DWORD evictions;
+	GLsizeiptr peaksize;
+} TexturePool;
+
+void TexturePool_Init(TexturePool *pool, glExtensions *ext, GLsizeiptr maxsize);
+void TexturePool_Delete(TexturePool *pool);
+GLuint TexturePool_Get(TexturePool *pool, GLenum target, GLint internalformat,
+	GLsizei width, GLsizei height, GLint miplevel, GLuint *fbo);
+BOOL TexturePool_Put(TexturePool *pool, GLenum target, GLint internalformat, GLsizei width,
+	GLsizei height, GLint miplevel, GLuint id, const GLuint *fbo, GLsizeiptr size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_TEXTUREPOOL_H
@@ -0,0 +1,307 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#include "common.h"
+#include "glTexture.h"
+#include "TextureResidency.h"
+#include "BlockCompress.h"
+
+/**
+  * Reads the free video memory reported by the driver and records how much
+  * must be freed to keep the reserve.
+  * @param res
+  *  Pointer to TextureResidency structure
+  */
+static void TextureResidency_QueryMemory(TextureResidency *res)
+{
+	GLint available[4];
+	if (res->ext->GLEXT_NVX_gpu_memory_info)
+		glGetIntegerv(GL_GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX, available);
+	// The first value is the free memory of the texture pool
+	else if (res->ext->GLEXT_ATI_meminfo) glGetIntegerv(GL_TEXTURE_FREE_MEMORY_ATI, available);
+	else return;
+	if (available[0] < TEXTURERESIDENCY_RESERVE)
+		res->shortfall = (GLsizeiptr)(TEXTURERESIDENCY_RESERVE - available[0]) * 1024;
+	else res->shortfall = 0;
+}
+
+/**
+  * Picks the texture to evict next: the lowest priority, and of those the
+  * texture unused for longest.
+  * @param res
+  *  Pointer to TextureResidency structure
+  * @return
+  *  Texture to evict, or NULL if all resident textures were drawn recently
+  */
+static glTexture *TextureResidency_FindVictim(TextureResidency *res)
+{
+	glTexture *victim = NULL;
+	glTexture *texture;
+	for (texture = res->textures; texture; texture = texture->residentnext)
+	{
+		if (texture->evicted || !glTexture__CanEvict(texture)) continue;
+		// Frame numbers wrap around, compare them relative to the current frame
+		if ((res->frame - texture->lastused) < TEXTURERESIDENCY_MINAGE) continue;
+		if (!victim || (texture->priority < victim->priority) || ((texture->priority == victim->priority) &&
+			((res->frame - texture->lastused) > (res->frame - victim->lastused))))
+			victim = texture;
+	}
+	return victim;
+}
+
+/**
+  * Checks whether a texture can be replaced with a block compressed copy.
+  * Only textures kept whole in their surface buffers qualify, and color keyed
+  * textures are left alone since compression doesn't keep exact colors.
+  * @param res
+  *  Pointer to TextureResidency structure
+  * @param texture
+  *  Tracked texture
+  * @param age
+  *  TRUE to also require that the texture wasn't uploaded to recently
+  * @return
+  *  TRUE if the texture can be compressed
+  */
+static BOOL TextureResidency_CanCompress(TextureResidency *res, glTexture *texture, BOOL age)
+{
+	int i;
+	if (texture->evicted || !glTexture__CanEvict(texture)) return FALSE;
+	if (texture->keyalpha || texture->automipmap || (texture->levels[0].ddsd.dwFlags & DDSD_CKSRCBLT)) return FALSE;
+	if ((texture->levels[0].ddsd.dwWidth * texture->levels[0].ddsd.dwHeight) < BLOCKCOMPRESS_MINTEXELS) return FALSE;
+	if (!BlockCompress_CanEncode(&texture->levels[0].ddsd.ddpfPixelFormat)) return FALSE;
+	if (age && ((res->frame - texture->lastwritten) < TEXTURERESIDENCY_COMPRESSAGE)) return FALSE;
+	for (i = 0; i < texture->miplevel; i++)
+	{
+		// Levels drawn to or waiting for an upload are still changing
+		if (!texture->levels[i].buffer || (texture->levels[i].dirty & (1 | 2 | 32)) ||
+			texture->levels[i].fbo.fbo) return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+  * Swaps in the result of the finished compression job, if the texture
+  * wasn't written in the meantime, and starts compressing the next texture.
+  * One texture is compressed at a time.
+  * @param res
+  *  Pointer to TextureResidency structure
+  */
+static void TextureResidency_Compress(TextureResidency *res)
+{
+	BlockCompressJob *job = res->job;
+	glTexture *texture;
+	if (job)
+	{
+		if (!job->done) return;
+		res->job = NULL;
+		texture = job->texture;
+		if (texture && !job->failed && (texture->uploads == job->writes) &&
+			TextureResidency_CanCompress(res, texture, FALSE))
+		{
+			glTexture__Compress(texture, job);
+			res->size -= texture->residentsize;
+			res->size += texture->blocksize;
+			res->compressions++;
+		}
+		BlockCompress_Free(job);
+	}
+	for (texture = res->textures; texture; texture = texture->residentnext)
+	{
+		if (!TextureResidency_CanCompress(res, texture, TRUE)) continue;
+		res->job = BlockCompress_Start(texture, texture->uploads);
+		break;
+	}
+}
+
+/**
+  * Initializes a residency manager.
+  * @param res
+  *  Pointer to TextureResidency structure to initialize
+  * @param ext
+  *  Pointer to glExtensions structure of the context owning the textures
+  * @param budget
+  *  Estimated video memory in bytes tracked textures may use, 0 to only
+  *  evict when the driver reports low memory
+  * @param compress
+  *  TRUE to replace textures that are no longer written with block
+  *  compressed copies
+  */
+void TextureResidency_Init(TextureResidency *res, glExtensions *ext, GLsizeiptr budget, BOOL compress)
+{
+	ZeroMemory(res, sizeof(TextureResidency));
+	res->ext = ext;
+	res->budget = budget;
+	res->compress = compress && ext->GLEXT_EXT_texture_compression_s3tc;
+}
+
+/**
+  * Stops tracking all textures and logs the manager's statistics.  Evicted
+  * textures stay evicted and are restored if they are drawn with.
+  * @param res
+  *  Pointer to TextureResidency structure
+  */
+void TextureResidency_Delete(TextureResidency *res)
+{
+	glTexture *texture;
+	char str[256];
+	if (res->job)
+	{
+		BlockCompress_Wait(res->job);
+		BlockCompress_Free(res->job);
+		res->job = NULL;
+	}
+	while (res->textures)
+	{
+		texture = res->textures;
+		res->textures = texture->residentnext;
+		texture->residency = NULL;
+		texture->residentprev = texture->residentnext = NULL;
+	}
+	sprintf(str, "Texture residency: %u evicted, %u restored, %u compressed, %u decompressed, peak %u KB\n",
+		res->evictions, res->restores, res->compressions, res->decompressions, (DWORD)(res->peaksize / 1024));
+	TRACE_STRING(str);
+}
+
+/**
+  * Starts tracking a texture with its storage in video memory.
+  * @param res
+  *  Pointer to TextureResidency structure
+  * @param texture
+  *  Texture to track
+  */
+void TextureResidency_Add(TextureResidency *res, glTexture *texture)
+{
+	if (texture->residency) return;
+	texture->residency = res;
+	texture->residentsize = glTexture__StorageSize(texture);
+	texture->lastused = res->frame;
+	texture->residentprev = NULL;
+	texture->residentnext = res->textures;
+	if (res->textures) res->textures->residentprev = texture;
+	res->textures = texture;
+	res->size += texture->residentsize;
+	if (res->size > res->peaksize) res->peaksize = res->size;
+}
+
+/**
+  * Stops tracking a texture.  Called before the texture is destroyed.
+  * @param res
+  *  Pointer to TextureResidency structure
+  * @param texture
+  *  Tracked texture
+  */
+void TextureResidency_Remove(TextureResidency *res, glTexture *texture)
+{
+	if (texture->residency != res) return;
+	if (texture->residentprev) texture->residentprev->residentnext = texture->residentnext;
+	else res->textures = texture->residentnext;
+	if (texture->residentnext) texture->residentnext->residentprev = texture->residentprev;
+	if (!texture->evicted) res->size -= texture->residentsize;
+	else if (texture->blockid) res->size -= texture->blocksize;
+	if (res->job && (res->job->texture == texture)) res->job->texture = NULL;
+	texture->residency = NULL;
+	texture->residentprev = texture->residentnext = NULL;
+}
+
+/**
+  * Marks a tracked texture as used in the current frame, moving it back to
+  * video memory if it was evicted.  Block compressed textures are drawn with
+  * as they are.
+  * @param res
+  *  Pointer to TextureResidency structure
+  * @param texture
+  *  Tracked texture
+  */
+void TextureResidency_Use(TextureResidency *res, glTexture *texture)
+{
+	texture->lastused = res->frame;
+	if (!texture->evicted || texture->blockid) return;
+	TextureResidency_Restore(res, texture);
+}
+
+/**
+  * Moves a tracked texture back to video memory in its own format, for
+  * uploads, readbacks and drawing to it.
+  * @param res
+  *  Pointer to TextureResidency structure
+  * @param texture
+  *  Tracked texture
+  */
+void TextureResidency_Restore(TextureResidency *res, glTexture *texture)
+{
+	texture->lastused = res->frame;
+	if (!texture->evicted) return;
+	if (texture->blockid)
+	{
+		res->size -= texture->blocksize;
+		res->decompressions++;
+	}
+	else res->restores++;
+	glTexture__Restore(texture);
+	// Levels dropped by SetLOD are not allocated again
+	texture->residentsize = glTexture__StorageSize(texture);
+	res->size += texture->residentsize;
+	if (res->size > res->peaksize) res->peaksize = res->size;
+}
+
+/**
+  * Updates the size of a resident texture after its storage grew or shrank.
+  * @param res
+  *  Pointer to TextureResidency structure
+  * @param texture
+  *  Tracked texture
+  */
+void TextureResidency_Resize(TextureResidency *res, glTexture *texture)
+{
+	if ((texture->residency != res) || texture->evicted) return;
+	res->size -= texture->residentsize;
+	texture->residentsize = glTexture__StorageSize(texture);
+	res->size += texture->residentsize;
+	if (res->size > res->peaksize) res->peaksize = res->size;
+}
+
+/**
+  * Advances the frame counter and evicts textures until the tracked textures
+  * fit the budget and the driver's reserve.  Called after each present.
+  * @param res
+  *  Pointer to TextureResidency structure
+  */
+void TextureResidency_EndFrame(TextureResidency *res)
+{
+	GLsizeiptr limit;
+	glTexture *victim;
+	res->frame++;
+	if (res->compress) TextureResidency_Compress(res);
+	if (!(res->frame % TEXTURERESIDENCY_QUERYINTERVAL)) TextureResidency_QueryMemory(res);
+	if (!res->budget && !res->shortfall) return;
+	limit = res->budget ? res->budget : res->size;
+	if (res->shortfall)
+	{
+		if (res->shortfall >= res->size) limit = 0;
+		else if ((res->size - res->shortfall) < limit) limit = res->size - res->shortfall;
+		// Freed once per query, the next query shows whether it was enough
+		res->shortfall = 0;
+	}
+	while (res->size > limit)
+	{
+		victim = TextureResidency_FindVictim(res);
+		if (!victim) break;
+		glTexture__Evict(victim);
+		res->size -= victim->residentsize;
+		res->evictions++;
+	}
+}
@@ -0,0 +1,67 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#pragma once
+#ifndef _TEXTURERESIDENCY_H
+#define _TEXTURERESIDENCY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Textures drawn within this many frames are never evicted
+#define TEXTURERESIDENCY_MINAGE 2
+// Frames between queries of the free video memory reported by the driver
+#define TEXTURERESIDENCY_QUERYINTERVAL 32
+// Kilobytes of free video memory left to the driver when it reports its usage
+#define TEXTURERESIDENCY_RESERVE 32768
+// Textures not uploaded to for this many frames may be block compressed
+#define TEXTURERESIDENCY_COMPRESSAGE 120
+
+// Direct3D textures that can be moved out of video memory
+typedef struct TextureResidency
+{
+	glExtensions *ext;
+	struct glTexture *textures;  // Tracked textures, linked through residentnext
+	GLsizeiptr size;  // Estimated bytes of video memory used by resident tracked textures
+	GLsizeiptr budget;  // Bytes tracked textures may use, 0 for no fixed limit
+	GLsizeiptr shortfall;  // Bytes to free to leave the driver its reserve, from the last query
+	DWORD frame;
+	BOOL compress;  // Block compress textures that are no longer written
+	struct BlockCompressJob *job;  // Texture being compressed, NULL if none
+	// Statistics, written to the trace log when the manager is deleted
+	DWORD evictions;
+	DWORD restores;
+	DWORD compressions;
+	DWORD decompressions;
+	GLsizeiptr peaksize;
+} TextureResidency;
+
+void TextureResidency_Init(TextureResidency *res, glExtensions *ext, GLsizeiptr budget, BOOL compress);
+void TextureResidency_Delete(TextureResidency *res);
+void TextureResidency_Add(TextureResidency *res, struct glTexture *texture);
+void TextureResidency_Remove(TextureResidency *res, struct glTexture *texture);
+void TextureResidency_Use(TextureResidency *res, struct glTexture *texture);
+void TextureResidency_Restore(TextureResidency *res, struct glTexture *texture);
+void TextureResidency_Resize(TextureResidency *res, struct glTexture *texture);
+void TextureResidency_EndFrame(TextureResidency *res);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_TEXTURERESIDENCY_H
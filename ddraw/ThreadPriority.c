@@ -0,0 +1,98 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#include "common.h"
+#include "ThreadPriority.h"
+
+extern DXGLCFG dxglcfg;
+
+// avrt.h isn't in older SDKs, and avrt.dll isn't in Windows XP
+typedef HANDLE (WINAPI *AVSETMMTHREADCHARACTERISTICSW)(LPCWSTR TaskName, LPDWORD TaskIndex);
+typedef BOOL (WINAPI *AVSETMMTHREADPRIORITY)(HANDLE AvrtHandle, int Priority);
+typedef BOOL (WINAPI *AVREVERTMMTHREADCHARACTERISTICS)(HANDLE AvrtHandle);
+#define AVRT_PRIORITY_NORMAL 0
+#define AVRT_PRIORITY_HIGH 1
+#define AVRT_PRIORITY_CRITICAL 2
+
+static const LPCWSTR tasknames[] = { NULL, L"Games", L"Pro Audio" };
+static const int threadpriorities[] = { THREAD_PRIORITY_NORMAL, THREAD_PRIORITY_ABOVE_NORMAL, THREAD_PRIORITY_HIGHEST };
+static const int taskpriorities[] = { AVRT_PRIORITY_NORMAL, AVRT_PRIORITY_HIGH, AVRT_PRIORITY_CRITICAL };
+
+/**
+  * Applies the ThreadTask, ThreadPriority and RendererAffinity settings to
+  * the calling thread.  The thread is registered with the Multimedia Class
+  * Scheduler Service if possible, otherwise only its priority is raised.
+  * @param priority
+  *  Pointer to ThreadPriority structure to fill in, passed to
+  *  ThreadPriority_Leave before the thread exits
+  * @param renderer
+  *  TRUE if the thread is the renderer thread, which RendererAffinity applies to
+  */
+void ThreadPriority_Enter(ThreadPriority *priority, BOOL renderer)
+{
+	AVSETMMTHREADCHARACTERISTICSW pAvSetMmThreadCharacteristicsW;
+	AVSETMMTHREADPRIORITY pAvSetMmThreadPriority;
+	DWORD_PTR processmask, systemmask;
+	DWORD level = dxglcfg.ThreadPriority;
+	DWORD index = 0;
+	ZeroMemory(priority, sizeof(ThreadPriority));
+	if (level > 2) level = 2;
+	if (dxglcfg.ThreadTask && (dxglcfg.ThreadTask <= 2))
+	{
+		priority->avrt = LoadLibrary(_T("avrt.dll"));
+		if (priority->avrt)
+		{
+			pAvSetMmThreadCharacteristicsW = (AVSETMMTHREADCHARACTERISTICSW)GetProcAddress(priority->avrt,
+				"AvSetMmThreadCharacteristicsW");
+			pAvSetMmThreadPriority = (AVSETMMTHREADPRIORITY)GetProcAddress(priority->avrt, "AvSetMmThreadPriority");
+			if (pAvSetMmThreadCharacteristicsW)
+				priority->task = pAvSetMmThreadCharacteristicsW(tasknames[dxglcfg.ThreadTask], &index);
+			if (priority->task && pAvSetMmThreadPriority)
+				pAvSetMmThreadPriority(priority->task, taskpriorities[level]);
+			if (!priority->task)
+			{
+				FreeLibrary(priority->avrt);
+				priority->avrt = NULL;
+			}
+		}
+	}
+	// MMCSS sets the priority of threads in a task
+	if (!priority->task && level) SetThreadPriority(GetCurrentThread(), threadpriorities[level]);
+	if (renderer && dxglcfg.RendererAffinity &&
+		GetProcessAffinityMask(GetCurrentProcess(), &processmask, &systemmask) &&
+		(processmask & dxglcfg.RendererAffinity))
+		SetThreadAffinityMask(GetCurrentThread(), processmask & dxglcfg.RendererAffinity);
+}
+
+/**
+  * Removes the calling thread from its MMCSS task.  The thread priority and
+  * affinity are left alone since the thread is about to exit.
+  * @param priority
+  *  Pointer to ThreadPriority structure filled in by ThreadPriority_Enter
+  */
+void ThreadPriority_Leave(ThreadPriority *priority)
+{
+	AVREVERTMMTHREADCHARACTERISTICS pAvRevertMmThreadCharacteristics;
+	if (priority->task)
+	{
+		pAvRevertMmThreadCharacteristics = (AVREVERTMMTHREADCHARACTERISTICS)GetProcAddress(priority->avrt,
+			"AvRevertMmThreadCharacteristics");
+		if (pAvRevertMmThreadCharacteristics) pAvRevertMmThreadCharacteristics(priority->task);
+	}
+	if (priority->avrt) FreeLibrary(priority->avrt);
+	ZeroMemory(priority, sizeof(ThreadPriority));
+}
@@ -0,0 +1,40 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#pragma once
+#ifndef _THREADPRIORITY_H
+#define _THREADPRIORITY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Scheduling state of a thread set up with ThreadPriority_Enter
+typedef struct ThreadPriority
+{
+	HMODULE avrt;  // avrt.dll, NULL before Windows Vista or if ThreadTask is 0
+	HANDLE task;  // MMCSS task the thread is registered with, NULL if none
+} ThreadPriority;
+
+void ThreadPriority_Enter(ThreadPriority *priority, BOOL renderer);
+void ThreadPriority_Leave(ThreadPriority *priority);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_THREADPRIORITY_H
@@ -0,0 +1,290 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#include "common.h"
+#include "Timeline.h"
+
+/**
+  * Writes the formatted events to the file.  Must be called with the
+  * critical section held.
+  * @param timeline
+  *  Pointer to Timeline structure
+  */
+static void Timeline_Flush(Timeline *timeline)
+{
+	DWORD written;
+	if (!timeline->bufferused) return;
+	WriteFile(timeline->file, timeline->buffer, timeline->bufferused, &written, NULL);
+	timeline->bufferused = 0;
+}
+
+/**
+  * Adds a formatted event to the buffer, writing the buffer out if it is full.
+  * @param timeline
+  *  Pointer to Timeline structure
+  * @param event
+  *  JSON object of the event
+  * @param length
+  *  Length of the event in bytes
+  */
+static void Timeline_Write(Timeline *timeline, const char *event, int length)
+{
+	if (length <= 0) return;
+	EnterCriticalSection(&timeline->cs);
+	if (timeline->bufferused + length + 2 > TIMELINE_BUFFERSIZE) Timeline_Flush(timeline);
+	if (!timeline->empty)
+	{
+		timeline->buffer[timeline->bufferused++] = ',';
+		timeline->buffer[timeline->bufferused++] = '\n';
+	}
+	memcpy(timeline->buffer + timeline->bufferused, event, length);
+	timeline->bufferused += length;
+	timeline->empty = FALSE;
+	LeaveCriticalSection(&timeline->cs);
+}
+
+/**
+  * Converts a performance counter value to microseconds since the timeline
+  * was started.
+  * @param timeline
+  *  Pointer to Timeline structure
+  * @param counter
+  *  Performance counter value
+  */
+static double Timeline_Microseconds(Timeline *timeline, LONGLONG counter)
+{
+	return (double)(counter - timeline->start) * 1000000.0 / (double)timeline->frequency;
+}
+
+/**
+  * Opens dxgl-timeline.json in the directory of the executable and starts
+  * recording.  Must be called from the thread that owns the OpenGL context,
+  * which is named as the renderer thread.
+  * @param timeline
+  *  Pointer to Timeline structure to initialize
+  * @param ext
+  *  OpenGL extensions of the context, used to time GPU spans if
+  *  GL_ARB_timer_query is available
+  * @return
+  *  TRUE if the file was created
+  */
+BOOL Timeline_Init(Timeline *timeline, glExtensions *ext)
+{
+	TCHAR path[MAX_PATH + 1];
+	TCHAR *path_truncate;
+	LARGE_INTEGER counter;
+	char event[128];
+	int i;
+	ZeroMemory(timeline, sizeof(Timeline));
+	GetModuleFileName(NULL, path, MAX_PATH);
+	path[MAX_PATH] = 0;
+	path_truncate = _tcsrchr(path, _T('\\'));
+	if (path_truncate) *(path_truncate + 1) = 0;
+	_tcscat(path, _T("dxgl-timeline.json"));
+	timeline->file = CreateFile(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (timeline->file == INVALID_HANDLE_VALUE) return FALSE;
+	timeline->buffer = (char*)malloc(TIMELINE_BUFFERSIZE);
+	if (!timeline->buffer)
+	{
+		CloseHandle(timeline->file);
+		return FALSE;
+	}
+	InitializeCriticalSection(&timeline->cs);
+	timeline->empty = TRUE;
+	timeline->pid = GetCurrentProcessId();
+	QueryPerformanceFrequency(&counter);
+	timeline->frequency = counter.QuadPart;
+	if (ext->GLEXT_ARB_timer_query)
+	{
+		timeline->queries = (TimelineQuery*)malloc(TIMELINE_QUERIES * sizeof(TimelineQuery));
+		if (timeline->queries)
+		{
+			ZeroMemory(timeline->queries, TIMELINE_QUERIES * sizeof(TimelineQuery));
+			for (i = 0; i < TIMELINE_QUERIES; i++)
+				ext->glGenQueries(2, timeline->queries[i].query);
+			timeline->ext = ext;
+			glGetInteger64v(GL_TIMESTAMP, &timeline->gpustart);
+		}
+	}
+	QueryPerformanceCounter(&counter);
+	timeline->start = counter.QuadPart;
+	memcpy(timeline->buffer, "{\"traceEvents\":[\n", 17);
+	timeline->bufferused = 17;
+	Timeline_NameThread(timeline, "Renderer");
+	if (timeline->ext)
+	{
+		i = _snprintf(event, 127, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":\"GPU\"}}",
+			timeline->pid, TIMELINE_GPUTID);
+		Timeline_Write(timeline, event, i);
+	}
+	return TRUE;
+}
+
+/**
+  * Writes the outstanding GPU spans and closes the file.  Must be called from
+  * the thread that owns the OpenGL context, after all spans have ended.
+  * @param timeline
+  *  Pointer to Timeline structure
+  */
+void Timeline_Delete(Timeline *timeline)
+{
+	DWORD written;
+	char str[64];
+	int i;
+	Timeline_Poll(timeline, TRUE);
+	if (timeline->ext)
+	{
+		for (i = 0; i < TIMELINE_QUERIES; i++)
+			timeline->ext->glDeleteQueries(2, timeline->queries[i].query);
+	}
+	if (timeline->queries) free(timeline->queries);
+	timeline->queries = NULL;
+	timeline->ext = NULL;
+	EnterCriticalSection(&timeline->cs);
+	Timeline_Flush(timeline);
+	WriteFile(timeline->file, "\n]}\n", 4, &written, NULL);
+	CloseHandle(timeline->file);
+	timeline->file = INVALID_HANDLE_VALUE;
+	free(timeline->buffer);
+	timeline->buffer = NULL;
+	LeaveCriticalSection(&timeline->cs);
+	DeleteCriticalSection(&timeline->cs);
+	if (timeline->querydropped)
+	{
+		sprintf(str, "Timeline: %u GPU spans not timed\n", timeline->querydropped);
+		TRACE_STRING(str);
+	}
+}
+
+/**
+  * Names the calling thread in the trace.
+  * @param timeline
+  *  Pointer to Timeline structure
+  * @param name
+  *  Name of the thread
+  */
+void Timeline_NameThread(Timeline *timeline, const char *name)
+{
+	char event[192];
+	int length = _snprintf(event, 191, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+		timeline->pid, GetCurrentThreadId(), name);
+	Timeline_Write(timeline, event, length);
+}
+
+/**
+  * Records a span of the calling thread.  May be called from any thread.
+  * @param timeline
+  *  Pointer to Timeline structure
+  * @param name
+  *  Name of the span
+  * @param category
+  *  Category of the span, used to filter spans in the viewer
+  * @param start
+  *  Performance counter when the span started
+  * @param end
+  *  Performance counter when the span ended
+  */
+void Timeline_AddSpan(Timeline *timeline, const char *name, const char *category, LONGLONG start, LONGLONG end)
+{
+	char event[192];
+	int length = _snprintf(event, 191,
+		"{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+		name, category, timeline->pid, GetCurrentThreadId(), Timeline_Microseconds(timeline, start),
+		(double)(end - start) * 1000000.0 / (double)timeline->frequency);
+	Timeline_Write(timeline, event, length);
+}
+
+/**
+  * Starts timing a GPU span at the current point of the OpenGL command
+  * stream.  Must be called from the thread that owns the OpenGL context.
+  * @param timeline
+  *  Pointer to Timeline structure
+  * @param name
+  *  Name of the span, must stay valid until the timeline is deleted
+  * @return
+  *  Index to pass to Timeline_EndGPU, or -1 if the span is not timed
+  */
+int Timeline_BeginGPU(Timeline *timeline, const char *name)
+{
+	DWORD index;
+	if (!timeline->ext) return -1;
+	if (((timeline->querywrite + 1) % TIMELINE_QUERIES) == timeline->queryread)
+	{
+		Timeline_Poll(timeline, FALSE);
+		if (((timeline->querywrite + 1) % TIMELINE_QUERIES) == timeline->queryread)
+		{
+			timeline->querydropped++;
+			return -1;
+		}
+	}
+	index = timeline->querywrite;
+	glQueryCounter(timeline->queries[index].query[0], GL_TIMESTAMP);
+	timeline->queries[index].name = name;
+	timeline->queries[index].ended = FALSE;
+	timeline->querywrite = (index + 1) % TIMELINE_QUERIES;
+	return index;
+}
+
+/**
+  * Ends a GPU span at the current point of the OpenGL command stream.
+  * @param timeline
+  *  Pointer to Timeline structure
+  * @param index
+  *  Value returned by Timeline_BeginGPU
+  */
+void Timeline_EndGPU(Timeline *timeline, int index)
+{
+	if (index < 0) return;
+	glQueryCounter(timeline->queries[index].query[1], GL_TIMESTAMP);
+	timeline->queries[index].ended = TRUE;
+}
+
+/**
+  * Records the GPU spans that have finished, in the order they began.
+  * @param timeline
+  *  Pointer to Timeline structure
+  * @param wait
+  *  TRUE to wait for spans the GPU has not finished yet
+  */
+void Timeline_Poll(Timeline *timeline, BOOL wait)
+{
+	TimelineQuery *query;
+	GLint available;
+	GLuint64 begin, end;
+	char event[192];
+	int length;
+	if (!timeline->ext) return;
+	while (timeline->queryread != timeline->querywrite)
+	{
+		query = &timeline->queries[timeline->queryread];
+		// Spans end in reverse order of beginning, so an open span holds back the ones after it
+		if (!query->ended) break;
+		if (!wait)
+		{
+			timeline->ext->glGetQueryObjectiv(query->query[1], GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available) break;
+		}
+		timeline->ext->glGetQueryObjectui64v(query->query[0], GL_QUERY_RESULT, &begin);
+		timeline->ext->glGetQueryObjectui64v(query->query[1], GL_QUERY_RESULT, &end);
+		length = _snprintf(event, 191,
+			"{\"name\":\"%s\",\"cat\":\"gpu\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+			query->name, timeline->pid, TIMELINE_GPUTID, (double)((GLint64)begin - timeline->gpustart) / 1000.0,
+			(double)(end - begin) / 1000.0);
+		Timeline_Write(timeline, event, length);
+		timeline->queryread = (timeline->queryread + 1) % TIMELINE_QUERIES;
+	}
+}
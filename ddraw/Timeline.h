@@ -0,0 +1,100 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#pragma once
+#ifndef _TIMELINE_H
+#define _TIMELINE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Bytes of formatted events held before they are written to the file
+#define TIMELINE_BUFFERSIZE 65536
+// GPU spans whose timestamps may be outstanding at once
+#define TIMELINE_QUERIES 512
+// Thread ID of the GPU track in the trace
+#define TIMELINE_GPUTID 0
+
+// GPU span, timed by a pair of GL_TIMESTAMP queries
+typedef struct TimelineQuery
+{
+	GLuint query[2];
+	const char *name;
+	BOOL ended;  // TRUE once the second query has been issued
+} TimelineQuery;
+
+/** @brief Chrome trace event recorder
+  * Spans are written to dxgl-timeline.json in the Trace Event Format read by
+  * chrome://tracing and Perfetto.  CPU spans may be added from any thread,
+  * GPU spans only from the thread that owns the OpenGL context.
+  */
+typedef struct Timeline
+{
+	HANDLE file;
+	CRITICAL_SECTION cs;
+	char *buffer;
+	DWORD bufferused;
+	BOOL empty;  // TRUE until the first event is written
+	DWORD pid;
+	LONGLONG start;  // Performance counter all timestamps are relative to
+	LONGLONG frequency;
+	glExtensions *ext;  // NULL without timer queries
+	GLint64 gpustart;  // GL_TIMESTAMP when start was taken, in nanoseconds
+	TimelineQuery *queries;  // Ring of GPU spans in the order they began
+	DWORD queryread;
+	DWORD querywrite;
+	DWORD querydropped;  // GPU spans not timed because the ring was full
+} Timeline;
+
+BOOL Timeline_Init(Timeline *timeline, glExtensions *ext);
+void Timeline_Delete(Timeline *timeline);
+void Timeline_NameThread(Timeline *timeline, const char *name);
+void Timeline_AddSpan(Timeline *timeline, const char *name, const char *category, LONGLONG start, LONGLONG end);
+int Timeline_BeginGPU(Timeline *timeline, const char *name);
+void Timeline_EndGPU(Timeline *timeline, int index);
+void Timeline_Poll(Timeline *timeline, BOOL wait);
+
+#ifdef __cplusplus
+}
+
+// Timeline span around a scope; a NULL timeline, as passed when DebugTimeline is off, skips the span.
+// Names must stay valid until the timeline is deleted.
+struct ScopedTimelineSpan
+{
+	ScopedTimelineSpan(Timeline *timeline, const char *name) : timeline(timeline), name(name)
+	{
+		if (!timeline) return;
+		gpu = Timeline_BeginGPU(timeline, name);
+		QueryPerformanceCounter(&start);
+	}
+	~ScopedTimelineSpan()
+	{
+		LARGE_INTEGER end;
+		if (!timeline) return;
+		QueryPerformanceCounter(&end);
+		Timeline_EndGPU(timeline, gpu);
+		Timeline_AddSpan(timeline, name, "render", start.QuadPart, end.QuadPart);
+	}
+	Timeline *timeline;
+	const char *name;
+	LARGE_INTEGER start;
+	int gpu;
+};
+#endif
+
+#endif //_TIMELINE_H
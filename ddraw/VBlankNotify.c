@@ -0,0 +1,138 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+
+#include "common.h"
+#include "timer.h"
+#include "VBlankNotify.h"
+
+/**
+  * Entry point of the notification thread.  Waits for a vertical blank each
+  * time events are added and signals the events waiting at that time.
+  * @param param
+  *  Pointer to the VBlankNotify structure
+  */
+static DWORD WINAPI VBlankNotify__Thread(LPVOID param)
+{
+	VBlankNotify *notify = (VBlankNotify*)param;
+	HANDLE events[VBLANKNOTIFY_MAXEVENTS];
+	DWORD count, i;
+	while (1)
+	{
+		WaitForSingleObject(notify->wake, INFINITE);
+		EnterCriticalSection(&notify->cs);
+		if (notify->quit)
+		{
+			LeaveCriticalSection(&notify->cs);
+			break;
+		}
+		LeaveCriticalSection(&notify->cs);
+		DXGLTimer_WaitVBlank(notify->timer, FALSE, TRUE);
+		// Events added while waiting are signaled by this vertical blank too
+		EnterCriticalSection(&notify->cs);
+		count = notify->count;
+		memcpy(events, notify->events, count * sizeof(HANDLE));
+		notify->count = 0;
+		LeaveCriticalSection(&notify->cs);
+		for (i = 0; i < count; i++)
+		{
+			SetEvent(events[i]);
+			CloseHandle(events[i]);
+		}
+	}
+	return 0;
+}
+
+/**
+  * Starts the thread that signals vertical blank events.
+  * @param notify
+  *  Pointer to VBlankNotify structure to initialize
+  * @param timer
+  *  Timer of the renderer, used to wait for the vertical blank
+  * @return
+  *  TRUE if the thread was started
+  */
+BOOL VBlankNotify_Init(VBlankNotify *notify, DXGLTimer *timer)
+{
+	ZeroMemory(notify, sizeof(VBlankNotify));
+	notify->timer = timer;
+	notify->wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (!notify->wake) return FALSE;
+	InitializeCriticalSection(&notify->cs);
+	notify->thread = CreateThread(NULL, 0, VBlankNotify__Thread, notify, 0, NULL);
+	if (!notify->thread)
+	{
+		DeleteCriticalSection(&notify->cs);
+		CloseHandle(notify->wake);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+  * Stops the notification thread.  Events still waiting are signaled so
+  * their waiters don't hang.
+  * @param notify
+  *  Pointer to VBlankNotify structure to delete
+  */
+void VBlankNotify_Delete(VBlankNotify *notify)
+{
+	DWORD i;
+	EnterCriticalSection(&notify->cs);
+	notify->quit = TRUE;
+	LeaveCriticalSection(&notify->cs);
+	SetEvent(notify->wake);
+	WaitForSingleObject(notify->thread, INFINITE);
+	CloseHandle(notify->thread);
+	for (i = 0; i < notify->count; i++)
+	{
+		SetEvent(notify->events[i]);
+		CloseHandle(notify->events[i]);
+	}
+	DeleteCriticalSection(&notify->cs);
+	CloseHandle(notify->wake);
+	ZeroMemory(notify, sizeof(VBlankNotify));
+}
+
+/**
+  * Signals an event at the start of the next vertical blank.  The event is
+  * duplicated so the caller may close it before it is signaled.
+  * @param notify
+  *  Pointer to VBlankNotify structure
+  * @param event
+  *  Event to signal
+  * @return
+  *  DD_OK if the event will be signaled, DDERR_INVALIDPARAMS if it is not a
+  *  valid handle, or DDERR_OUTOFMEMORY if too many events are waiting
+  */
+HRESULT VBlankNotify_Add(VBlankNotify *notify, HANDLE event)
+{
+	HANDLE dup;
+	if (!DuplicateHandle(GetCurrentProcess(), event, GetCurrentProcess(), &dup, 0, FALSE, DUPLICATE_SAME_ACCESS))
+		return DDERR_INVALIDPARAMS;
+	EnterCriticalSection(&notify->cs);
+	if (notify->count >= VBLANKNOTIFY_MAXEVENTS)
+	{
+		LeaveCriticalSection(&notify->cs);
+		CloseHandle(dup);
+		return DDERR_OUTOFMEMORY;
+	}
+	notify->events[notify->count++] = dup;
+	LeaveCriticalSection(&notify->cs);
+	SetEvent(notify->wake);
+	return DD_OK;
+}
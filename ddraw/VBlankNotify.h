@@ -0,0 +1,55 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+
+#pragma once
+#ifndef _VBLANKNOTIFY_H
+#define _VBLANKNOTIFY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Events that can be waiting for the same vertical blank
+#define VBLANKNOTIFY_MAXEVENTS 16
+
+/** @brief Signals events at the start of the vertical blank
+  * Events passed to IDirectDraw::WaitForVerticalBlank with
+  * DDWAITVB_BLOCKBEGINEVENT are handed to a thread that waits for the next
+  * vertical blank from the display driver, or the one estimated with the
+  * timer, and then signals them.
+  */
+typedef struct VBlankNotify
+{
+	HANDLE thread;
+	HANDLE wake;  // Set when events are added or the thread should exit
+	CRITICAL_SECTION cs;  // Guards events, count and quit
+	HANDLE events[VBLANKNOTIFY_MAXEVENTS];  // Duplicates of the callers' events
+	DWORD count;
+	BOOL quit;
+	DXGLTimer *timer;
+} VBlankNotify;
+
+BOOL VBlankNotify_Init(VBlankNotify *notify, DXGLTimer *timer);
+void VBlankNotify_Delete(VBlankNotify *notify);
+HRESULT VBlankNotify_Add(VBlankNotify *notify, HANDLE event);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_VBLANKNOTIFY_H
@@ -42,6 +42,106 @@ COLORCONVPROC colorconvproc[] =
 	bpp32tobpp24,       // 18
 };
 
+typedef struct COLORCONVJOB
+{
+	COLORCONVPROC proc;
+	size_t width;
+	size_t rows;
+	BYTE *dest;
+	size_t destpitch;
+	BYTE *src;
+	size_t srcpitch;
+	volatile LONG *pending;
+	HANDLE done;
+} COLORCONVJOB;
+
+static DWORD cpucount = 0;
+
+static void ColorConv_ConvertBand(COLORCONVJOB *job)
+{
+	size_t i;
+	for (i = 0; i < job->rows; i++)
+		job->proc(job->width, job->dest + (i * job->destpitch), job->src + (i * job->srcpitch));
+}
+
+static DWORD WINAPI ColorConv_Worker(LPVOID param)
+{
+	COLORCONVJOB *job = (COLORCONVJOB*)param;
+	ColorConv_ConvertBand(job);
+	if (!InterlockedDecrement(job->pending)) SetEvent(job->done);
+	return 0;
+}
+
+/**
+  * Converts a block of rows with a color conversion function.  Surfaces of
+  * COLORCONV_THREADPIXELS or more are split into bands of rows across the
+  * system thread pool, with the calling thread taking the first band, and
+  * the call returns once every band is finished.
+  * @param proc
+  *  Color conversion function to use
+  * @param width
+  *  Number of pixels in each row
+  * @param rows
+  *  Number of rows to convert
+  * @param dest
+  *  Pointer to the first destination row
+  * @param destpitch
+  *  Distance in bytes between destination rows
+  * @param src
+  *  Pointer to the first source row
+  * @param srcpitch
+  *  Distance in bytes between source rows
+  */
+void ColorConv_ConvertRows(COLORCONVPROC proc, size_t width, size_t rows,
+	void *dest, size_t destpitch, void *src, size_t srcpitch)
+{
+	COLORCONVJOB jobs[COLORCONV_MAXTHREADS];
+	SYSTEM_INFO info;
+	volatile LONG pending;
+	size_t jobcount;
+	size_t band;
+	size_t i;
+	if (!cpucount)
+	{
+		GetSystemInfo(&info);
+		cpucount = info.dwNumberOfProcessors;
+		if (!cpucount) cpucount = 1;
+	}
+	if (width * rows < COLORCONV_THREADPIXELS) jobcount = 1;
+	else jobcount = rows / COLORCONV_MINBANDROWS;
+	if (jobcount > cpucount) jobcount = cpucount;
+	if (jobcount > COLORCONV_MAXTHREADS) jobcount = COLORCONV_MAXTHREADS;
+	jobs[0].proc = proc;
+	jobs[0].width = width;
+	jobs[0].rows = rows;
+	jobs[0].dest = (BYTE*)dest;
+	jobs[0].destpitch = destpitch;
+	jobs[0].src = (BYTE*)src;
+	jobs[0].srcpitch = srcpitch;
+	if (jobcount > 1) jobs[0].done = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if ((jobcount <= 1) || !jobs[0].done)
+	{
+		ColorConv_ConvertBand(&jobs[0]);
+		return;
+	}
+	band = rows / jobcount;
+	pending = (LONG)jobcount - 1;
+	for (i = 0; i < jobcount; i++)
+	{
+		jobs[i] = jobs[0];
+		jobs[i].dest = (BYTE*)dest + (i * band * destpitch);
+		jobs[i].src = (BYTE*)src + (i * band * srcpitch);
+		if (i == jobcount - 1) jobs[i].rows = rows - (i * band);
+		else jobs[i].rows = band;
+		jobs[i].pending = &pending;
+		if (i && !QueueUserWorkItem(ColorConv_Worker, &jobs[i], WT_EXECUTEDEFAULT))
+			ColorConv_Worker(&jobs[i]);
+	}
+	ColorConv_ConvertBand(&jobs[0]);
+	WaitForSingleObject(jobs[0].done, INFINITE);
+	CloseHandle(jobs[0].done);
+}
+
 __inline unsigned int _1to8(unsigned int input)
 {
 	return input * 255;
@@ -310,3 +410,390 @@ void bpp32tobpp24(size_t count, BYTE *dest, DWORD *src)
 		dest[(i * 3) + 2] = (in >> 16) & 0xFF;
 	}
 }
+
+/**
+  * Gets the size of a planar YUV surface buffer.
+  * @param pitch
+  *  Distance in bytes between rows of the Y plane
+  * @param height
+  *  Height of the surface in pixels
+  * @return
+  *  Size in bytes of the Y plane and both chroma planes
+  */
+size_t ColorConv_PlanarSize(size_t pitch, size_t height)
+{
+	return pitch * (height + ((height + 1) / 2));
+}
+
+/**
+  * Finds the chroma planes of a planar YUV surface buffer.
+  * @param layout
+  *  PLANAR_* layout of the buffer
+  * @param buffer
+  *  Pointer to the start of the buffer, which is the Y plane
+  * @param pitch
+  *  Distance in bytes between rows of the Y plane
+  * @param height
+  *  Height of the surface in pixels
+  * @param u
+  *  Receives a pointer to the U plane, or the interleaved UV plane for NV12
+  * @param v
+  *  Receives a pointer to the V plane, or the interleaved UV plane plus one
+  *  for NV12
+  */
+void ColorConv_GetPlanes(int layout, BYTE *buffer, size_t pitch, size_t height, BYTE **u, BYTE **v)
+{
+	BYTE *chroma = buffer + (pitch * height);
+	size_t planesize = (pitch / 2) * ((height + 1) / 2);
+	switch (layout)
+	{
+	case PLANAR_YV12:
+		*v = chroma;
+		*u = chroma + planesize;
+		break;
+	case PLANAR_I420:
+	default:
+		*u = chroma;
+		*v = chroma + planesize;
+		break;
+	case PLANAR_NV12:
+		*u = chroma;
+		*v = chroma + 1;
+		break;
+	}
+}
+
+__inline DWORD yuvtorgba(int y, int u, int v)
+{
+	int c = (y - 16) * 298;
+	int r = (c + (409 * (v - 128)) + 128) >> 8;
+	int g = (c - (100 * (u - 128)) - (208 * (v - 128)) + 128) >> 8;
+	int b = (c + (516 * (u - 128)) + 128) >> 8;
+	if (r < 0) r = 0;
+	else if (r > 255) r = 255;
+	if (g < 0) g = 0;
+	else if (g > 255) g = 255;
+	if (b < 0) b = 0;
+	else if (b > 255) b = 255;
+	return 0xFF000000 | (r << 16) | (g << 8) | b;
+}
+
+/**
+  * Converts a planar YUV surface to 32-bit BGRA with BT.601 coefficients.
+  * @param layout
+  *  PLANAR_* layout of the source
+  * @param width
+  *  Width of the surface in pixels
+  * @param height
+  *  Height of the surface in pixels
+  * @param dest
+  *  Pointer to the first destination row
+  * @param destpitch
+  *  Distance in bytes between destination rows
+  * @param src
+  *  Pointer to the planar YUV buffer
+  * @param srcpitch
+  *  Distance in bytes between rows of the Y plane
+  */
+void ColorConv_PlanarToRGBA(int layout, size_t width, size_t height, DWORD *dest, size_t destpitch,
+	BYTE *src, size_t srcpitch)
+{
+	BYTE *u, *v;
+	BYTE *yrow, *urow, *vrow;
+	DWORD *out;
+	size_t x, y;
+	size_t cpitch = (layout == PLANAR_NV12) ? srcpitch : (srcpitch / 2);
+	size_t cstep = (layout == PLANAR_NV12) ? 2 : 1;
+	ColorConv_GetPlanes(layout, src, srcpitch, height, &u, &v);
+	for (y = 0; y < height; y++)
+	{
+		yrow = src + (y * srcpitch);
+		urow = u + ((y / 2) * cpitch);
+		vrow = v + ((y / 2) * cpitch);
+		out = (DWORD*)((BYTE*)dest + (y * destpitch));
+		for (x = 0; x < width; x++)
+			out[x] = yuvtorgba(yrow[x], urow[(x / 2) * cstep], vrow[(x / 2) * cstep]);
+	}
+}
+
+/**
+  * Converts a 32-bit BGRA surface to planar YUV with BT.601 coefficients.
+  * Each chroma sample is the average of the 2x2 block of pixels it covers.
+  * @param layout
+  *  PLANAR_* layout of the destination
+  * @param width
+  *  Width of the surface in pixels
+  * @param height
+  *  Height of the surface in pixels
+  * @param dest
+  *  Pointer to the planar YUV buffer
+  * @param destpitch
+  *  Distance in bytes between rows of the Y plane
+  * @param src
+  *  Pointer to the first source row
+  * @param srcpitch
+  *  Distance in bytes between source rows
+  */
+void ColorConv_RGBAToPlanar(int layout, size_t width, size_t height, BYTE *dest, size_t destpitch,
+	DWORD *src, size_t srcpitch)
+{
+	BYTE *u, *v;
+	DWORD *row;
+	DWORD pixel;
+	size_t cpitch = (layout == PLANAR_NV12) ? destpitch : (destpitch / 2);
+	size_t cstep = (layout == PLANAR_NV12) ? 2 : 1;
+	size_t x, y, sx, sy;
+	int r, g, b;
+	int usum, vsum, count;
+	ColorConv_GetPlanes(layout, dest, destpitch, height, &u, &v);
+	for (y = 0; y < height; y++)
+	{
+		row = (DWORD*)((BYTE*)src + (y * srcpitch));
+		for (x = 0; x < width; x++)
+		{
+			pixel = row[x];
+			r = (pixel >> 16) & 0xFF;
+			g = (pixel >> 8) & 0xFF;
+			b = pixel & 0xFF;
+			dest[(y * destpitch) + x] = (BYTE)((((66 * r) + (129 * g) + (25 * b) + 128) >> 8) + 16);
+		}
+	}
+	for (y = 0; y < height; y += 2)
+	{
+		for (x = 0; x < width; x += 2)
+		{
+			usum = vsum = count = 0;
+			for (sy = y; (sy < y + 2) && (sy < height); sy++)
+			{
+				row = (DWORD*)((BYTE*)src + (sy * srcpitch));
+				for (sx = x; (sx < x + 2) && (sx < width); sx++)
+				{
+					pixel = row[sx];
+					r = (pixel >> 16) & 0xFF;
+					g = (pixel >> 8) & 0xFF;
+					b = pixel & 0xFF;
+					usum += (((-38 * r) - (74 * g) + (112 * b) + 128) >> 8) + 128;
+					vsum += (((112 * r) - (94 * g) - (18 * b) + 128) >> 8) + 128;
+					count++;
+				}
+			}
+			u[((y / 2) * cpitch) + ((x / 2) * cstep)] = (BYTE)(usum / count);
+			v[((y / 2) * cpitch) + ((x / 2) * cstep)] = (BYTE)(vsum / count);
+		}
+	}
+}
+
+/**
+  * Gets the distance between rows of blocks of an S3TC compressed surface.
+  * @param layout
+  *  COMPRESSED_* layout of the surface
+  * @param width
+  *  Width of the surface in pixels
+  * @return
+  *  Size in bytes of one row of 4x4 blocks
+  */
+size_t ColorConv_BlockPitch(int layout, size_t width)
+{
+	size_t blocks = (width + 3) / 4;
+	if (!blocks) blocks = 1;
+	return blocks * ((layout == COMPRESSED_DXT1) ? 8 : 16);
+}
+
+/**
+  * Gets the size of an S3TC compressed surface buffer.
+  * @param layout
+  *  COMPRESSED_* layout of the surface
+  * @param width
+  *  Width of the surface in pixels
+  * @param height
+  *  Height of the surface in pixels
+  * @return
+  *  Size in bytes of all blocks of the surface
+  */
+size_t ColorConv_BlockSize(int layout, size_t width, size_t height)
+{
+	size_t rows = (height + 3) / 4;
+	if (!rows) rows = 1;
+	return ColorConv_BlockPitch(layout, width) * rows;
+}
+
+__inline DWORD rgb565tobgra(WORD color)
+{
+	return 0xFF000000 | (_5to8((color >> 11) & 0x1F) << 16) | (_6to8((color >> 5) & 0x3F) << 8) |
+		_5to8(color & 0x1F);
+}
+
+__inline DWORD blendbgra(DWORD a, DWORD b, int wa, int wb, int div)
+{
+	DWORD out = 0xFF000000;
+	int shift;
+	for (shift = 0; shift < 24; shift += 8)
+		out |= ((((int)((a >> shift) & 0xFF) * wa) + ((int)((b >> shift) & 0xFF) * wb)) / div) << shift;
+	return out;
+}
+
+/**
+  * Decompresses an S3TC compressed surface to 32-bit BGRA.  Used when the
+  * OpenGL driver can't sample the blocks directly.  DXT2 and DXT4 surfaces
+  * are decoded like DXT3 and DXT5, their colors stay premultiplied.
+  * @param layout
+  *  COMPRESSED_* layout of the source
+  * @param width
+  *  Width of the surface in pixels
+  * @param height
+  *  Height of the surface in pixels
+  * @param dest
+  *  Pointer to the first destination row
+  * @param destpitch
+  *  Distance in bytes between destination rows
+  * @param src
+  *  Pointer to the first row of blocks
+  * @param srcpitch
+  *  Distance in bytes between rows of blocks
+  */
+void ColorConv_DXTToRGBA(int layout, size_t width, size_t height, DWORD *dest, size_t destpitch,
+	BYTE *src, size_t srcpitch)
+{
+	DWORD colors[4];
+	BYTE alphas[8];
+	BYTE *block;
+	BYTE *colorblock;
+	DWORD *out;
+	DWORD indices;
+	unsigned __int64 alphabits;
+	WORD c0, c1;
+	size_t bx, by, x, y;
+	int i, pixel, alpha;
+	int blocksize = (layout == COMPRESSED_DXT1) ? 8 : 16;
+	for (by = 0; by < height; by += 4)
+	{
+		block = src + ((by / 4) * srcpitch);
+		for (bx = 0; bx < width; bx += 4, block += blocksize)
+		{
+			colorblock = (layout == COMPRESSED_DXT1) ? block : (block + 8);
+			c0 = colorblock[0] | (colorblock[1] << 8);
+			c1 = colorblock[2] | (colorblock[3] << 8);
+			indices = colorblock[4] | (colorblock[5] << 8) | (colorblock[6] << 16) | ((DWORD)colorblock[7] << 24);
+			colors[0] = rgb565tobgra(c0);
+			colors[1] = rgb565tobgra(c1);
+			// Only DXT1 has the three color mode with transparent black
+			if ((layout != COMPRESSED_DXT1) || (c0 > c1))
+			{
+				colors[2] = blendbgra(colors[0], colors[1], 2, 1, 3);
+				colors[3] = blendbgra(colors[0], colors[1], 1, 2, 3);
+			}
+			else
+			{
+				colors[2] = blendbgra(colors[0], colors[1], 1, 1, 2);
+				colors[3] = 0;
+			}
+			alphabits = 0;
+			if (layout != COMPRESSED_DXT1)
+			{
+				for (i = 7; i >= 0; i--)
+					alphabits = (alphabits << 8) | block[i];
+			}
+			if (layout == COMPRESSED_DXT5)
+			{
+				alphas[0] = block[0];
+				alphas[1] = block[1];
+				if (alphas[0] > alphas[1])
+				{
+					for (i = 1; i < 7; i++)
+						alphas[i + 1] = (BYTE)((((7 - i) * alphas[0]) + (i * alphas[1])) / 7);
+				}
+				else
+				{
+					for (i = 1; i < 5; i++)
+						alphas[i + 1] = (BYTE)((((5 - i) * alphas[0]) + (i * alphas[1])) / 5);
+					alphas[6] = 0;
+					alphas[7] = 255;
+				}
+				alphabits >>= 16;
+			}
+			for (y = 0; (y < 4) && ((by + y) < height); y++)
+			{
+				out = (DWORD*)((BYTE*)dest + ((by + y) * destpitch)) + bx;
+				for (x = 0; x < 4; x++)
+				{
+					pixel = (int)((y * 4) + x);
+					if ((bx + x) >= width) continue;
+					out[x] = colors[(indices >> (pixel * 2)) & 3];
+					if (layout == COMPRESSED_DXT3)
+					{
+						alpha = (int)((alphabits >> (pixel * 4)) & 0xF);
+						out[x] = (out[x] & 0xFFFFFF) | (_4to8(alpha) << 24);
+					}
+					else if (layout == COMPRESSED_DXT5)
+						out[x] = (out[x] & 0xFFFFFF) | ((DWORD)alphas[(alphabits >> (pixel * 3)) & 7] << 24);
+				}
+			}
+		}
+	}
+}
+
+/**
+  * Stores a color key in the alpha channel of converted pixels.  Alpha is
+  * cleared where the source pixel matches the key and set elsewhere, the
+  * color bits of the destination are left alone.
+  * @param srcbits
+  *  Bits per source pixel, 16, 24 or 32
+  * @param destbits
+  *  Bits per destination pixel, 16 with alpha in the top bit or 32 with
+  *  alpha in the top byte
+  * @param width
+  *  Width of the surface in pixels
+  * @param height
+  *  Height of the surface in pixels
+  * @param dest
+  *  Pointer to the first destination row
+  * @param destpitch
+  *  Distance in bytes between destination rows
+  * @param src
+  *  Pointer to the first source row
+  * @param srcpitch
+  *  Distance in bytes between source rows
+  * @param key
+  *  Color key in the source format
+  * @param mask
+  *  Bits of the source pixel compared with the key
+  */
+void ColorConv_KeyToAlpha(int srcbits, int destbits, size_t width, size_t height, void *dest, size_t destpitch,
+	const void *src, size_t srcpitch, DWORD key, DWORD mask)
+{
+	size_t x, y;
+	const BYTE *in;
+	BYTE *out;
+	DWORD pixel;
+	key &= mask;
+	for (y = 0; y < height; y++)
+	{
+		in = (const BYTE*)src + (y * srcpitch);
+		out = (BYTE*)dest + (y * destpitch);
+		for (x = 0; x < width; x++)
+		{
+			switch (srcbits)
+			{
+			case 16:
+				pixel = ((const WORD*)in)[x];
+				break;
+			case 24:
+				pixel = in[x * 3] | (in[(x * 3) + 1] << 8) | (in[(x * 3) + 2] << 16);
+				break;
+			default:
+				pixel = ((const DWORD*)in)[x];
+				break;
+			}
+			if (destbits == 16)
+			{
+				if ((pixel & mask) == key) ((WORD*)out)[x] &= 0x7FFF;
+				else ((WORD*)out)[x] |= 0x8000;
+			}
+			else
+			{
+				if ((pixel & mask) == key) ((DWORD*)out)[x] &= 0xFFFFFF;
+				else ((DWORD*)out)[x] |= 0xFF000000;
+			}
+		}
+	}
+}
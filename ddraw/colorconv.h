@@ -26,6 +26,48 @@ extern "C" {
 typedef void(*COLORCONVPROC) (size_t count, void *dest, void *src);
 extern COLORCONVPROC colorconvproc[];
 
+// Surfaces with at least this many pixels are converted on multiple threads
+#define COLORCONV_THREADPIXELS (1024 * 1024)
+// Maximum number of threads a conversion is split across
+#define COLORCONV_MAXTHREADS 8
+// Minimum number of rows in each thread's band
+#define COLORCONV_MINBANDROWS 64
+
+void ColorConv_ConvertRows(COLORCONVPROC proc, size_t width, size_t rows,
+	void *dest, size_t destpitch, void *src, size_t srcpitch);
+
+// Smaller copies are left in the cache by ColorConv_StreamCopy
+#define COLORCONV_STREAMBYTES (256 * 1024)
+
+void ColorConv_StreamCopy(void *dest, const void *src, size_t size);
+void ColorConv_StreamCopyRows(void *dest, ptrdiff_t destpitch, const void *src, ptrdiff_t srcpitch,
+	size_t width, size_t rows);
+
+// Planar YUV layouts; chroma planes are subsampled 2x2 and follow the Y plane
+#define PLANAR_YV12 1  // Y, V, U planes, chroma pitch is half the Y pitch
+#define PLANAR_I420 2  // Y, U, V planes, chroma pitch is half the Y pitch
+#define PLANAR_NV12 3  // Y plane, then interleaved U and V at the Y pitch
+
+size_t ColorConv_PlanarSize(size_t pitch, size_t height);
+void ColorConv_GetPlanes(int layout, BYTE *buffer, size_t pitch, size_t height, BYTE **u, BYTE **v);
+void ColorConv_PlanarToRGBA(int layout, size_t width, size_t height, DWORD *dest, size_t destpitch,
+	BYTE *src, size_t srcpitch);
+void ColorConv_RGBAToPlanar(int layout, size_t width, size_t height, BYTE *dest, size_t destpitch,
+	DWORD *src, size_t srcpitch);
+
+// S3TC block compressed layouts; pixels are stored in 4x4 blocks
+#define COMPRESSED_DXT1 1  // 8-byte blocks with 1-bit alpha
+#define COMPRESSED_DXT3 2  // 16-byte blocks with explicit 4-bit alpha, also DXT2
+#define COMPRESSED_DXT5 3  // 16-byte blocks with interpolated alpha, also DXT4
+
+size_t ColorConv_BlockPitch(int layout, size_t width);
+size_t ColorConv_BlockSize(int layout, size_t width, size_t height);
+void ColorConv_DXTToRGBA(int layout, size_t width, size_t height, DWORD *dest, size_t destpitch,
+	BYTE *src, size_t srcpitch);
+
+void ColorConv_KeyToAlpha(int srcbits, int destbits, size_t width, size_t height, void *dest, size_t destpitch,
+	const void *src, size_t srcpitch, DWORD key, DWORD mask);
+
 void pal1topal8(size_t count, DWORD *dest, BYTE *src);
 void pal2topal8(size_t count, DWORD *dest, BYTE *src);
 void pal4topal8(size_t count, WORD *dest, BYTE *src);
@@ -45,6 +87,7 @@ void unpackrg88(size_t count, DWORD *dest, WORD *src);
 void packrg88(size_t count, WORD *dest, DWORD *src);
 void bpp24tobpp32(size_t count, DWORD *dest, BYTE *src);
 void bpp32tobpp24(size_t count, BYTE *dest, DWORD *src);
+void ColorConv_Init();
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,492 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#include "common.h"
+#include "colorconv.h"
+#include <intrin.h>
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#include <immintrin.h>
+
+// SIMD versions of the color conversion functions in colorconv.c.  These
+// produce the same output as the scalar versions, which are still used for
+// the remainder of each row and on CPUs without the required instructions.
+
+static __inline __m128i Expand5_SSE2(__m128i x)
+{
+	return _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(x, _mm_set1_epi16(527)), _mm_set1_epi16(23)), 6);
+}
+
+static __inline __m128i Expand6_SSE2(__m128i x)
+{
+	return _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(x, _mm_set1_epi16(259)), _mm_set1_epi16(33)), 6);
+}
+
+// Packs the low words of 32-bit lanes without signed saturation
+static __inline __m128i PackLow16_SSE2(__m128i a, __m128i b)
+{
+	return _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16),
+		_mm_srai_epi32(_mm_slli_epi32(b, 16), 16));
+}
+
+void rgb565torgba8888_sse2(size_t count, DWORD *dest, WORD *src)
+{
+	size_t i;
+	__m128i in, r, g, b, lo, hi;
+	const __m128i alpha = _mm_set1_epi16((short)0xFF00);
+	for (i = 0; i + 8 <= count; i += 8)
+	{
+		in = _mm_loadu_si128((const __m128i*)(src + i));
+		r = Expand5_SSE2(_mm_srli_epi16(in, 11));
+		g = Expand6_SSE2(_mm_and_si128(_mm_srli_epi16(in, 5), _mm_set1_epi16(0x3F)));
+		b = Expand5_SSE2(_mm_and_si128(in, _mm_set1_epi16(0x1F)));
+		lo = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+		hi = _mm_or_si128(r, alpha);
+		_mm_storeu_si128((__m128i*)(dest + i), _mm_unpacklo_epi16(lo, hi));
+		_mm_storeu_si128((__m128i*)(dest + i + 4), _mm_unpackhi_epi16(lo, hi));
+	}
+	if (i < count) rgb565torgba8888(count - i, dest + i, src + i);
+}
+
+void rgb565torgbx8888_sse2(size_t count, DWORD *dest, WORD *src)
+{
+	size_t i;
+	__m128i in, r, g, b, lo;
+	for (i = 0; i + 8 <= count; i += 8)
+	{
+		in = _mm_loadu_si128((const __m128i*)(src + i));
+		r = Expand5_SSE2(_mm_srli_epi16(in, 11));
+		g = Expand6_SSE2(_mm_and_si128(_mm_srli_epi16(in, 5), _mm_set1_epi16(0x3F)));
+		b = Expand5_SSE2(_mm_and_si128(in, _mm_set1_epi16(0x1F)));
+		lo = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+		_mm_storeu_si128((__m128i*)(dest + i), _mm_unpacklo_epi16(lo, r));
+		_mm_storeu_si128((__m128i*)(dest + i + 4), _mm_unpackhi_epi16(lo, r));
+	}
+	if (i < count) rgb565torgbx8888(count - i, dest + i, src + i);
+}
+
+void rgbx8888torgb565_sse2(size_t count, WORD *dest, DWORD *src)
+{
+	size_t i;
+	__m128i in[2];
+	int j;
+	for (i = 0; i + 8 <= count; i += 8)
+	{
+		for (j = 0; j < 2; j++)
+		{
+			in[j] = _mm_loadu_si128((const __m128i*)(src + i + (j * 4)));
+			in[j] = _mm_or_si128(_mm_or_si128(
+				_mm_srli_epi32(_mm_and_si128(in[j], _mm_set1_epi32(0xF80000)), 8),
+				_mm_srli_epi32(_mm_and_si128(in[j], _mm_set1_epi32(0xFC00)), 5)),
+				_mm_srli_epi32(_mm_and_si128(in[j], _mm_set1_epi32(0xF8)), 3));
+		}
+		_mm_storeu_si128((__m128i*)(dest + i), PackLow16_SSE2(in[0], in[1]));
+	}
+	if (i < count) rgbx8888torgb565(count - i, dest + i, src + i);
+}
+
+void rgba1555torgba8888_sse2(size_t count, DWORD *dest, WORD *src)
+{
+	size_t i;
+	__m128i in, a, r, g, b, lo, hi;
+	const __m128i mask = _mm_set1_epi16(0x1F);
+	for (i = 0; i + 8 <= count; i += 8)
+	{
+		in = _mm_loadu_si128((const __m128i*)(src + i));
+		a = _mm_mullo_epi16(_mm_srli_epi16(in, 15), _mm_set1_epi16(255));
+		r = Expand5_SSE2(_mm_and_si128(_mm_srli_epi16(in, 10), mask));
+		g = Expand5_SSE2(_mm_and_si128(_mm_srli_epi16(in, 5), mask));
+		b = Expand5_SSE2(_mm_and_si128(in, mask));
+		lo = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+		hi = _mm_or_si128(r, _mm_slli_epi16(a, 8));
+		_mm_storeu_si128((__m128i*)(dest + i), _mm_unpacklo_epi16(lo, hi));
+		_mm_storeu_si128((__m128i*)(dest + i + 4), _mm_unpackhi_epi16(lo, hi));
+	}
+	if (i < count) rgba1555torgba8888(count - i, dest + i, src + i);
+}
+
+void rgba8888torgba1555_sse2(size_t count, WORD *dest, DWORD *src)
+{
+	size_t i;
+	__m128i in[2];
+	int j;
+	for (i = 0; i + 8 <= count; i += 8)
+	{
+		for (j = 0; j < 2; j++)
+		{
+			in[j] = _mm_loadu_si128((const __m128i*)(src + i + (j * 4)));
+			in[j] = _mm_or_si128(_mm_or_si128(
+				_mm_srli_epi32(_mm_and_si128(in[j], _mm_set1_epi32(0x80000000)), 16),
+				_mm_srli_epi32(_mm_and_si128(in[j], _mm_set1_epi32(0xF80000)), 9)),
+				_mm_or_si128(_mm_srli_epi32(_mm_and_si128(in[j], _mm_set1_epi32(0xF800)), 6),
+				_mm_srli_epi32(_mm_and_si128(in[j], _mm_set1_epi32(0xF8)), 3)));
+		}
+		_mm_storeu_si128((__m128i*)(dest + i), PackLow16_SSE2(in[0], in[1]));
+	}
+	if (i < count) rgba8888torgba1555(count - i, dest + i, src + i);
+}
+
+void rgba4444torgba8888_sse2(size_t count, DWORD *dest, WORD *src)
+{
+	size_t i;
+	__m128i in, lo, hi;
+	const __m128i mask = _mm_set1_epi16(0x0F0F);
+	for (i = 0; i + 8 <= count; i += 8)
+	{
+		in = _mm_loadu_si128((const __m128i*)(src + i));
+		// x * 17 == (x << 4) | x for each nibble widened to a byte
+		lo = _mm_and_si128(in, mask);  // b, r
+		hi = _mm_and_si128(_mm_srli_epi16(in, 4), mask);  // g, a
+		lo = _mm_or_si128(lo, _mm_slli_epi16(lo, 4));
+		hi = _mm_or_si128(hi, _mm_slli_epi16(hi, 4));
+		in = _mm_unpacklo_epi8(lo, hi);  // b g r a of pixels 0-3
+		_mm_storeu_si128((__m128i*)(dest + i), in);
+		_mm_storeu_si128((__m128i*)(dest + i + 4), _mm_unpackhi_epi8(lo, hi));
+	}
+	if (i < count) rgba4444torgba8888(count - i, dest + i, src + i);
+}
+
+void rgba8888torgba4444_sse2(size_t count, WORD *dest, DWORD *src)
+{
+	size_t i;
+	__m128i in[2];
+	int j;
+	for (i = 0; i + 8 <= count; i += 8)
+	{
+		for (j = 0; j < 2; j++)
+		{
+			in[j] = _mm_loadu_si128((const __m128i*)(src + i + (j * 4)));
+			in[j] = _mm_or_si128(_mm_or_si128(
+				_mm_srli_epi32(_mm_and_si128(in[j], _mm_set1_epi32(0xF0000000)), 16),
+				_mm_srli_epi32(_mm_and_si128(in[j], _mm_set1_epi32(0xF00000)), 12)),
+				_mm_or_si128(_mm_srli_epi32(_mm_and_si128(in[j], _mm_set1_epi32(0xF000)), 8),
+				_mm_srli_epi32(_mm_and_si128(in[j], _mm_set1_epi32(0xF0)), 4)));
+		}
+		_mm_storeu_si128((__m128i*)(dest + i), PackLow16_SSE2(in[0], in[1]));
+	}
+	if (i < count) rgba8888torgba4444(count - i, dest + i, src + i);
+}
+
+void pal8topal4_sse2(size_t count, BYTE *dest, WORD *src)
+{
+	size_t i;
+	__m128i in[2];
+	int j;
+	// Each output byte packs two input pixels, so 32 pixels per iteration
+	for (i = 0; (i + 16) <= (count >> 1); i += 16)
+	{
+		for (j = 0; j < 2; j++)
+		{
+			in[j] = _mm_loadu_si128((const __m128i*)(src + i + (j * 8)));
+			in[j] = _mm_or_si128(_mm_and_si128(in[j], _mm_set1_epi16(0xF0)), _mm_srli_epi16(in[j], 12));
+		}
+		_mm_storeu_si128((__m128i*)(dest + i), _mm_packus_epi16(in[0], in[1]));
+	}
+	if (i < (count >> 1)) pal8topal4(count - (i << 1), dest + i, src + i);
+}
+
+void bpp24tobpp32_ssse3(size_t count, DWORD *dest, BYTE *src)
+{
+	size_t i;
+	const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	// Each load reads 16 bytes but consumes 12, leave enough input for the overread
+	for (i = 0; i + 6 <= count; i += 4)
+		_mm_storeu_si128((__m128i*)(dest + i),
+			_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + (i * 3))), shuffle));
+	if (i < count) bpp24tobpp32(count - i, dest + i, src + (i * 3));
+}
+
+void bpp32tobpp24_ssse3(size_t count, BYTE *dest, DWORD *src)
+{
+	size_t i;
+	const __m128i shuffle = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	// Each store writes 16 bytes but fills 12, the rest is overwritten by the next pixels
+	for (i = 0; i + 6 <= count; i += 4)
+		_mm_storeu_si128((__m128i*)(dest + (i * 3)),
+			_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + i)), shuffle));
+	if (i < count) bpp32tobpp24(count - i, dest + (i * 3), src + i);
+}
+
+static __inline __m256i Expand5_AVX2(__m256i x)
+{
+	return _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(x, _mm256_set1_epi16(527)), _mm256_set1_epi16(23)), 6);
+}
+
+static __inline __m256i Expand6_AVX2(__m256i x)
+{
+	return _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(x, _mm256_set1_epi16(259)), _mm256_set1_epi16(33)), 6);
+}
+
+// Interleaves 16-bit halves into 32-bit pixels in source order
+static __inline void StorePixels_AVX2(DWORD *dest, __m256i lo, __m256i hi)
+{
+	__m256i a = _mm256_unpacklo_epi16(lo, hi);
+	__m256i b = _mm256_unpackhi_epi16(lo, hi);
+	_mm256_storeu_si256((__m256i*)dest, _mm256_permute2x128_si256(a, b, 0x20));
+	_mm256_storeu_si256((__m256i*)(dest + 8), _mm256_permute2x128_si256(a, b, 0x31));
+}
+
+void rgb565torgba8888_avx2(size_t count, DWORD *dest, WORD *src)
+{
+	size_t i;
+	__m256i in, r, g, b;
+	const __m256i alpha = _mm256_set1_epi16((short)0xFF00);
+	for (i = 0; i + 16 <= count; i += 16)
+	{
+		in = _mm256_loadu_si256((const __m256i*)(src + i));
+		r = Expand5_AVX2(_mm256_srli_epi16(in, 11));
+		g = Expand6_AVX2(_mm256_and_si256(_mm256_srli_epi16(in, 5), _mm256_set1_epi16(0x3F)));
+		b = Expand5_AVX2(_mm256_and_si256(in, _mm256_set1_epi16(0x1F)));
+		StorePixels_AVX2(dest + i, _mm256_or_si256(b, _mm256_slli_epi16(g, 8)), _mm256_or_si256(r, alpha));
+	}
+	_mm256_zeroupper();
+	if (i < count) rgb565torgba8888_sse2(count - i, dest + i, src + i);
+}
+
+void rgba1555torgba8888_avx2(size_t count, DWORD *dest, WORD *src)
+{
+	size_t i;
+	__m256i in, a, r, g, b;
+	const __m256i mask = _mm256_set1_epi16(0x1F);
+	for (i = 0; i + 16 <= count; i += 16)
+	{
+		in = _mm256_loadu_si256((const __m256i*)(src + i));
+		a = _mm256_mullo_epi16(_mm256_srli_epi16(in, 15), _mm256_set1_epi16(255));
+		r = Expand5_AVX2(_mm256_and_si256(_mm256_srli_epi16(in, 10), mask));
+		g = Expand5_AVX2(_mm256_and_si256(_mm256_srli_epi16(in, 5), mask));
+		b = Expand5_AVX2(_mm256_and_si256(in, mask));
+		StorePixels_AVX2(dest + i, _mm256_or_si256(b, _mm256_slli_epi16(g, 8)),
+			_mm256_or_si256(r, _mm256_slli_epi16(a, 8)));
+	}
+	_mm256_zeroupper();
+	if (i < count) rgba1555torgba8888_sse2(count - i, dest + i, src + i);
+}
+
+void rgba4444torgba8888_avx2(size_t count, DWORD *dest, WORD *src)
+{
+	size_t i;
+	__m256i in, lo, hi;
+	const __m256i mask = _mm256_set1_epi16(0x0F0F);
+	for (i = 0; i + 16 <= count; i += 16)
+	{
+		in = _mm256_loadu_si256((const __m256i*)(src + i));
+		lo = _mm256_and_si256(in, mask);
+		hi = _mm256_and_si256(_mm256_srli_epi16(in, 4), mask);
+		lo = _mm256_or_si256(lo, _mm256_slli_epi16(lo, 4));
+		hi = _mm256_or_si256(hi, _mm256_slli_epi16(hi, 4));
+		in = _mm256_unpacklo_epi8(lo, hi);
+		hi = _mm256_unpackhi_epi8(lo, hi);
+		_mm256_storeu_si256((__m256i*)(dest + i), _mm256_permute2x128_si256(in, hi, 0x20));
+		_mm256_storeu_si256((__m256i*)(dest + i + 8), _mm256_permute2x128_si256(in, hi, 0x31));
+	}
+	_mm256_zeroupper();
+	if (i < count) rgba4444torgba8888_sse2(count - i, dest + i, src + i);
+}
+
+static BOOL streamcopy = FALSE;
+
+// Copies with streaming stores, the caller issues the fence
+static void StreamCopy_SSE2(BYTE *d, const BYTE *s, size_t size)
+{
+	size_t head;
+	__m128i a, b, c, e;
+	// Streaming stores need an aligned destination
+	head = (16 - ((size_t)d & 15)) & 15;
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	size -= head;
+	for (; size >= 64; size -= 64, d += 64, s += 64)
+	{
+		a = _mm_loadu_si128((const __m128i*)s);
+		b = _mm_loadu_si128((const __m128i*)(s + 16));
+		c = _mm_loadu_si128((const __m128i*)(s + 32));
+		e = _mm_loadu_si128((const __m128i*)(s + 48));
+		_mm_stream_si128((__m128i*)d, a);
+		_mm_stream_si128((__m128i*)(d + 16), b);
+		_mm_stream_si128((__m128i*)(d + 32), c);
+		_mm_stream_si128((__m128i*)(d + 48), e);
+	}
+	memcpy(d, s, size);
+}
+
+/**
+  * Copies a block of memory the CPU will not read again soon.  Large copies
+  * use streaming stores that bypass the cache, so copying a whole surface
+  * does not evict the application's own data.
+  * @param dest
+  *  Pointer to the destination
+  * @param src
+  *  Pointer to the source
+  * @param size
+  *  Number of bytes to copy
+  */
+void ColorConv_StreamCopy(void *dest, const void *src, size_t size)
+{
+	if (!streamcopy || (size < COLORCONV_STREAMBYTES))
+	{
+		memcpy(dest, src, size);
+		return;
+	}
+	StreamCopy_SSE2((BYTE*)dest, (const BYTE*)src, size);
+	// Make the streamed data visible before anything else reads it
+	_mm_sfence();
+}
+
+/**
+  * Copies rows of memory the CPU will not read again soon, with streaming
+  * stores if the rows add up to a large copy.
+  * @param dest
+  *  Pointer to the first destination row
+  * @param destpitch
+  *  Distance in bytes between destination rows
+  * @param src
+  *  Pointer to the first source row
+  * @param srcpitch
+  *  Distance in bytes between source rows, negative to copy bottom up
+  * @param width
+  *  Number of bytes to copy from each row
+  * @param rows
+  *  Number of rows
+  */
+void ColorConv_StreamCopyRows(void *dest, ptrdiff_t destpitch, const void *src, ptrdiff_t srcpitch,
+	size_t width, size_t rows)
+{
+	size_t i;
+	BOOL stream = streamcopy && ((width * rows) >= COLORCONV_STREAMBYTES);
+	for (i = 0; i < rows; i++)
+	{
+		if (stream) StreamCopy_SSE2((BYTE*)dest + ((ptrdiff_t)i * destpitch),
+			(const BYTE*)src + ((ptrdiff_t)i * srcpitch), width);
+		else memcpy((BYTE*)dest + ((ptrdiff_t)i * destpitch), (const BYTE*)src + ((ptrdiff_t)i * srcpitch), width);
+	}
+	if (stream) _mm_sfence();
+}
+
+#ifdef _DEBUG
+/**
+  * Checks a SIMD conversion function against its scalar version.
+  * @param simd
+  *  SIMD function to check
+  * @param scalar
+  *  Scalar function to compare against
+  * @param srcsize
+  *  Size in bytes of a source pixel
+  * @param destsize
+  *  Size in bytes of a destination pixel
+  * @return
+  *  TRUE if both functions produce the same output
+  */
+static BOOL ColorConv_Verify(COLORCONVPROC simd, COLORCONVPROC scalar, int srcsize, int destsize)
+{
+	// Covers every 16-bit input and row lengths not a multiple of the vector width
+	static const size_t counts[] = { 65536, 1, 7, 17, 33, 63 };
+	BYTE *src, *dest1, *dest2;
+	size_t i, j;
+	DWORD seed = 0x12345678;
+	BOOL ret = TRUE;
+	src = (BYTE*)malloc(65536 * srcsize + 16);
+	dest1 = (BYTE*)malloc(65536 * destsize + 16);
+	dest2 = (BYTE*)malloc(65536 * destsize + 16);
+	if (!src || !dest1 || !dest2) ret = FALSE;
+	else
+	{
+		if (srcsize == 2)
+			for (i = 0; i < 65536; i++) ((WORD*)src)[i] = (WORD)i;
+		else for (i = 0; i < 65536 * srcsize; i++)
+		{
+			seed = seed * 1103515245 + 12345;
+			src[i] = (BYTE)(seed >> 16);
+		}
+		for (j = 0; j < sizeof(counts) / sizeof(size_t); j++)
+		{
+			memset(dest1, 0xCD, 65536 * destsize + 16);
+			memset(dest2, 0xCD, 65536 * destsize + 16);
+			simd(counts[j], dest1, src);
+			scalar(counts[j], dest2, src);
+			if (memcmp(dest1, dest2, 65536 * destsize + 16)) ret = FALSE;
+		}
+	}
+	free(src);
+	free(dest1);
+	free(dest2);
+	return ret;
+}
+#endif
+
+/**
+  * Replaces entries in colorconvproc with the fastest versions the CPU
+  * supports.  Must be called before any surfaces are converted.
+  */
+void ColorConv_Init()
+{
+	int info[4];
+	int maxleaf;
+	BOOL sse2, ssse3, avx2 = FALSE;
+	COLORCONVPROC scalar[19];
+	int i;
+	memcpy(scalar, colorconvproc, sizeof(scalar));
+	__cpuid(info, 0);
+	maxleaf = info[0];
+	__cpuid(info, 1);
+	sse2 = (info[3] & (1 << 26)) ? TRUE : FALSE;
+	ssse3 = (info[2] & (1 << 9)) ? TRUE : FALSE;
+	// AVX2 also needs the OS to save YMM registers
+	if ((maxleaf >= 7) && (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && ((_xgetbv(0) & 6) == 6))
+	{
+		__cpuidex(info, 7, 0);
+		avx2 = (info[1] & (1 << 5)) ? TRUE : FALSE;
+	}
+	if (sse2)
+	{
+		colorconvproc[2] = (COLORCONVPROC)rgb565torgba8888_sse2;
+		colorconvproc[3] = (COLORCONVPROC)rgb565torgbx8888_sse2;
+		colorconvproc[4] = (COLORCONVPROC)rgbx8888torgb565_sse2;
+		colorconvproc[5] = (COLORCONVPROC)rgba1555torgba8888_sse2;
+		colorconvproc[6] = (COLORCONVPROC)rgba8888torgba1555_sse2;
+		colorconvproc[7] = (COLORCONVPROC)rgba4444torgba8888_sse2;
+		colorconvproc[8] = (COLORCONVPROC)rgba8888torgba4444_sse2;
+		colorconvproc[16] = (COLORCONVPROC)pal8topal4_sse2;
+		streamcopy = TRUE;
+	}
+	if (ssse3)
+	{
+		colorconvproc[17] = (COLORCONVPROC)bpp24tobpp32_ssse3;
+		colorconvproc[18] = (COLORCONVPROC)bpp32tobpp24_ssse3;
+	}
+	if (avx2)
+	{
+		colorconvproc[2] = (COLORCONVPROC)rgb565torgba8888_avx2;
+		colorconvproc[5] = (COLORCONVPROC)rgba1555torgba8888_avx2;
+		colorconvproc[7] = (COLORCONVPROC)rgba4444torgba8888_avx2;
+	}
+#ifdef _DEBUG
+	{
+		static const int srcsizes[19] = { 2, 4, 2, 2, 4, 2, 4, 2, 4, 2, 4, 1, 1, 1, 4, 4, 2, 3, 4 };
+		static const int destsizes[19] = { 4, 2, 4, 4, 2, 4, 2, 4, 2, 4, 2, 4, 4, 2, 1, 1, 1, 4, 3 };
+		for (i = 0; i < 19; i++)
+		{
+			if ((colorconvproc[i] != scalar[i]) &&
+				!ColorConv_Verify(colorconvproc[i], scalar[i], srcsizes[i], destsizes[i]))
+			{
+				FIXME("ColorConv_Init: SIMD color conversion does not match scalar version");
+				colorconvproc[i] = scalar[i];
+			}
+		}
+	}
+#endif
+}
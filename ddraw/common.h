@@ -37,6 +37,8 @@
 #include "struct.h"
 #include "const.h"
 #include "glExtensions.h"
+#include "PerfCounters.h"
+#include "Adapter.h"
 #ifdef __cplusplus
 #include "string.h"
 #include "ShaderGen2D.h"
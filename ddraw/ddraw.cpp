@@ -26,17 +26,30 @@
 #include "timer.h"
 #include "glRenderer.h"
 #include "hooks.h"
+#include "Replay.h"
+#include "RuntimePolicy.h"
 #include <intrin.h>
 
 extern "C" {DXGLCFG dxglcfg; }
 glDirectDraw7 *glDD7 = NULL;
-DWORD gllock = 0;
+DWORD gllock_tls = TLS_OUT_OF_INDEXES;
 HMODULE sysddraw = NULL;
 HRESULT (WINAPI *sysddrawcreate)(GUID FAR *lpGUID, LPDIRECTDRAW FAR *lplpDD, IUnknown FAR *pUnkOuter) = NULL;
 
 const GUID device_template = 
 { 0x9ff8900, 0x8c4a, 0x4ba4, { 0xbf, 0x29, 0x56, 0x50, 0x4a, 0xf, 0x3b, 0xb3 } };
 
+/**
+  * Marks the calling thread as creating an OpenGL context, so DirectDrawCreate
+  * calls made by the GL driver on that thread go to the system DirectDraw.
+  * Other threads, including other renderers, are not affected.
+  * @param lock
+  *  TRUE before creating or switching the context, FALSE after
+  */
+void SetGLLock(BOOL lock)
+{
+	if (gllock_tls != TLS_OUT_OF_INDEXES) TlsSetValue(gllock_tls, (LPVOID)(INT_PTR)lock);
+}
 
 void InitGL(int width, int height, int bpp, BOOL fullscreen, unsigned int frequency, HWND hWnd, glDirectDraw7 *glDD7, BOOL devwnd)
 {
@@ -131,7 +144,7 @@ HRESULT WINAPI DirectDrawCreate(GUID FAR *lpGUID, LPDIRECTDRAW FAR *lplpDD, IUnk
 	if(!dll_cs.LockCount && !dll_cs.OwningThread) InitializeCriticalSection(&dll_cs);
 	EnterCriticalSection(&dll_cs);
 	HRESULT ret;
-	if(gllock || IsCallerOpenGL((BYTE*)_ReturnAddress()))
+	if(((gllock_tls != TLS_OUT_OF_INDEXES) && TlsGetValue(gllock_tls)) || IsCallerOpenGL((BYTE*)_ReturnAddress()))
 	{
 		if(!sysddraw)
 		{
@@ -164,6 +177,7 @@ HRESULT WINAPI DirectDrawCreate(GUID FAR *lpGUID, LPDIRECTDRAW FAR *lplpDD, IUnk
 	}
 	InitHooks();
 	GetCurrentConfig(&dxglcfg, FALSE);
+	RuntimePolicy_Compile(&dxglcfg, &dxglpolicy);
 	glDirectDraw7 *myddraw7;
 	glDirectDraw1 *myddraw;
 	HRESULT error;
@@ -228,6 +242,7 @@ HRESULT WINAPI DirectDrawCreateEx(GUID FAR *lpGUID, LPVOID *lplpDD, REFIID iid,
 	if(!lplpDD) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
 	InitHooks();
 	GetCurrentConfig(&dxglcfg, FALSE);
+	RuntimePolicy_Compile(&dxglcfg, &dxglpolicy);
 	glDirectDraw7 *myddraw;
 	HRESULT error;
 	if(iid != IID_IDirectDraw7)
@@ -370,37 +385,6 @@ HRESULT WINAPI DirectDrawEnumerateExA(LPDDENUMCALLBACKEXA lpCallback, LPVOID lpC
 	return ret;
 }
 
-/**
-  * Callback for EnumDisplayMonitors.
-  * @param hMonitor
-  *  Handle to display device found by EnumDisplayMonitors.
-  * @param ptr
-  *  Pointer to list of display devices.  First value is the number of devices
-  *  found so far.  Subsequent values are stored display device handles.
-  */
-BOOL CALLBACK MonitorEnum(HMONITOR hMonitor, HDC unused, LPRECT unused2, LPARAM ptr)
-{
-	TRACE_ENTER(4,13,hMonitor,13,unused,26,unused2,13,ptr);
-	int * monitors = *(int**)ptr;
-	if(!monitors)
-	{
-		monitors = (int*)malloc(256*sizeof(int));
-		if(!monitors)
-		{
-			TRACE_EXIT(22,FALSE);
-			return FALSE;
-		}
-		monitors[0] = 1;
-	}
-	else monitors[0]++;
-	monitors[monitors[0]] = (int)hMonitor;
-	*(int**)ptr = monitors;
-	BOOL ret;
-	if(monitors[0] == 255) ret = FALSE;
-	else ret = TRUE;
-	TRACE_EXIT(22,ret);
-	return ret;
-}
 /**
   * Enumerates the available device GUIDs for DXGL, Unicode character format.
   * @param lpCallback
@@ -423,30 +407,27 @@ HRESULT WINAPI DirectDrawEnumerateExW(LPDDENUMCALLBACKEXW lpCallback, LPVOID lpC
 		TRACE_EXIT(23,DDERR_GENERIC);
 		return DDERR_INVALIDPARAMS;
 	}
-	int *monitors = NULL;
+	ADAPTER *adapters;
+	DWORD count;
 	GUID guid;
-	MONITORINFOEXW monitorinfo;
-	monitorinfo.cbSize = sizeof(MONITORINFOEXW);
-	DISPLAY_DEVICEW dev;
-	dev.cb = sizeof(DISPLAY_DEVICE);
 	if(!lpCallback(NULL,(wchar_t*)L"Primary Display Driver",(wchar_t*)L"display",lpContext,0)) return DD_OK;
 	if(dwFlags & DDENUM_ATTACHEDSECONDARYDEVICES)
 	{
-		EnumDisplayMonitors(NULL,NULL,MonitorEnum,(LPARAM)&monitors);
-		if(!monitors)
+		adapters = (ADAPTER*)malloc(ADAPTER_MAX * sizeof(ADAPTER));
+		if(!adapters)
 		{
 			TRACE_EXIT(23,DDERR_OUTOFMEMORY);
 			return DDERR_OUTOFMEMORY;
 		}
-		for(int i = 1; i < monitors[0]; i++)
+		count = Adapter_Enum(adapters, ADAPTER_MAX);
+		for(DWORD i = 0; i < count; i++)
 		{
+			// glDirectDraw7_Initialize maps the low byte back to the monitor
 			guid = device_template;
-			guid.Data1 |= i;
-			GetMonitorInfoW((HMONITOR)monitors[i],&monitorinfo);
-			EnumDisplayDevicesW(NULL,(monitorinfo.szDevice[_tcslen(monitorinfo.szDevice)-1])-49,&dev,0);
-			lpCallback(&guid,dev.DeviceString,monitorinfo.szDevice,lpContext,(HMONITOR)monitors[i]);
+			guid.Data1 |= i + 1;
+			if(!lpCallback(&guid,adapters[i].description,adapters[i].device,lpContext,adapters[i].monitor)) break;
 		}
-		free(monitors);
+		free(adapters);
 	}
 	TRACE_EXIT(23,DD_OK);
 	return DD_OK;
@@ -495,6 +476,7 @@ HRESULT WINAPI DllGetClassObject(REFCLSID rclsid, REFIID riid, LPVOID *ppv)
 		return CLASS_E_CLASSNOTAVAILABLE;
 	}
 	GetCurrentConfig(&dxglcfg, FALSE);
+	RuntimePolicy_Compile(&dxglcfg, &dxglpolicy);
 	glClassFactory_Create(&factory);
 	if(factory == NULL)
 	{
@@ -602,4 +584,26 @@ DDRAW_API void DXGLBreak()
 			glRenderer_DXGLBreak(glDD7->renderer);
 		}
 	}
+}
+
+/**
+  * Plays back a capture written with DebugCapture in a window of its own, to
+  * measure the renderer without the application.  The capture must have been
+  * written by the same build of DXGL.  Pressing Escape ends the playback.
+  * Do not link to this entry point.  Use LoadLibrary and GetProcAddress instead.
+  * @param filename
+  *  Path of the capture file
+  * @param loops
+  *  Number of times to play the capture
+  * @param frames
+  *  Receives the number of frames presented
+  * @param seconds
+  *  Receives the time the playback took
+  * @return
+  *  DD_OK if the capture was played back, or an error code otherwise.
+  */
+DDRAW_API HRESULT DXGLReplay(LPCSTR filename, DWORD loops, DWORD *frames, double *seconds)
+{
+	if (!filename) return DDERR_INVALIDPARAMS;
+	return Replay_Play(filename, loops, frames, seconds);
 }
\ No newline at end of file
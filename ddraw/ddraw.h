@@ -64,7 +64,8 @@ extern DXGLCFG dxglcfg;
 #ifdef __cplusplus
 }
 #endif
-extern DWORD gllock;
+extern DWORD gllock_tls;
+void SetGLLock(BOOL lock);
 extern const GUID device_template;
 struct glRenderer;
 struct glDirectDraw7;
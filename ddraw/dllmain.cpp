@@ -19,6 +19,9 @@
 #include "ddraw.h"
 #include "hooks.h"
 #include "util.h"
+#include "colorconv.h"
+#include "RuntimePolicy.h"
+#include "SurfaceProfile.h"
 
 
 MEMORYSTATUSEX memstatusex;
@@ -45,7 +48,10 @@ BOOL APIENTRY DllMain( HMODULE hModule,
 	case DLL_PROCESS_ATTACH:
 		if(!dll_cs.LockCount && !dll_cs.OwningThread) InitializeCriticalSection(&dll_cs);
 		if (!hook_cs.LockCount && !hook_cs.OwningThread) InitializeCriticalSection(&hook_cs);
+		gllock_tls = TlsAlloc();
 		GetCurrentConfig(&dxglcfg, TRUE);
+		RuntimePolicy_Compile(&dxglcfg, &dxglpolicy);
+		if (dxglcfg.DebugSurfaceProfile) SurfaceProfile_Init();
 		dxglcfg.SystemRAM = 0;
 		dxglcfg.VideoRAM = 0;
 		hKernel32 = GetModuleHandle(_T("kernel32.dll"));
@@ -66,6 +72,7 @@ BOOL APIENTRY DllMain( HMODULE hModule,
 			GlobalMemoryStatus(&memstatus);
 			dxglcfg.SystemRAM = memstatus.dwTotalPhys;
 		}
+		ColorConv_Init();
 		GetSystemDirectory(path, MAX_PATH);
 		_tcscat(path, _T("\\ddraw.dll"));
 		hSystemDDraw = LoadLibrary(path);
@@ -95,14 +102,20 @@ BOOL APIENTRY DllMain( HMODULE hModule,
 		FreeLibrary(hSystemDDraw);
 		break;
 	case DLL_THREAD_ATTACH:
+		break;
 	case DLL_THREAD_DETACH:
+		trace_thread_detach();
 		break;
 	case DLL_PROCESS_DETACH:
+		SurfaceProfile_Shutdown();
+		trace_shutdown();
 		ShutdownHooks();
 		DeleteCriticalSection(&hook_cs);
 		ZeroMemory(&hook_cs, sizeof(CRITICAL_SECTION));
 		DeleteCriticalSection(&dll_cs);
 		ZeroMemory(&dll_cs, sizeof(CRITICAL_SECTION));
+		if (gllock_tls != TLS_OUT_OF_INDEXES) TlsFree(gllock_tls);
+		gllock_tls = TLS_OUT_OF_INDEXES;
 		if (wndclassdxgltempatom) UnregisterDXGLTempWindowClass();
 		break;
 	}
@@ -19,6 +19,7 @@
 #include "scalers.h"
 #include "ddraw.h"
 #include "glTexture.h"
+#include "colorconv.h"
 #include "glUtil.h"
 #include "util.h"
 #include "timer.h"
@@ -35,6 +36,8 @@
 #include <string>
 using namespace std;
 #include "ShaderGen3D.h"
+#include "RuntimePolicy.h"
+#include "SurfaceProfile.h"
 #include <math.h>
 
 dxglDirectDrawSurface7Vtbl dxglDirectDrawSurface7_impl =
@@ -111,6 +114,7 @@ HRESULT dxglDirectDrawSurface7_Create(LPDIRECTDRAW7 lpDD7, LPDDSURFACEDESC2 lpDD
 	DWORD complexcount;
 	dxglDirectDrawSurface7 *surfaceptr;
 	glTexture *textureptr;
+	const DDSURFACEDESC2 **texddsd;
 	TRACE_ENTER(9,14,lpDD7,14,lpDDSurfaceDesc2,14,palettein,14,parenttex,11,version,14,glDDS7);
 	ZeroMemory(glDDS7, sizeof(dxglDirectDrawSurface7));
 	glDDS7->lpVtbl = &dxglDirectDrawSurface7_impl;
@@ -124,6 +128,7 @@ HRESULT dxglDirectDrawSurface7_Create(LPDIRECTDRAW7 lpDD7, LPDDSURFACEDESC2 lpDD
 	glDirectDrawGammaControl_Create(glDDS7, &glDDS7->gammacontrol);
 	glDDS7->ddInterface = (glDirectDraw7 *)lpDD7;
 	glDDS7->ddsd = *lpDDSurfaceDesc2;
+	glDDS7->sharecount = 1;
 	LONG sizes[6];
 	int i, x, y;
 	float xscale, yscale;
@@ -158,8 +163,7 @@ HRESULT dxglDirectDrawSurface7_Create(LPDIRECTDRAW7 lpDD7, LPDDSURFACEDESC2 lpDD
 			memcpy(&ddsdBigSurface, &glDDS7->ddsd, sizeof(DDSURFACEDESC2));
 			if (dxglcfg.primaryscale)
 			{
-				if (_isnan(dxglcfg.postsizex) || _isnan(dxglcfg.postsizey) ||
-					(dxglcfg.postsizex < 0.25f) || (dxglcfg.postsizey < 0.25f))
+				if (dxglpolicy.postsizeauto)
 				{
 					if (glDDS7->ddsd.dwWidth <= 400) xscale = 2.0f;
 					else xscale = 1.0f;
@@ -417,31 +421,43 @@ HRESULT dxglDirectDrawSurface7_Create(LPDIRECTDRAW7 lpDD7, LPDDSURFACEDESC2 lpDD
 	}
 	else
 	{*/
-		for (i = 0; i < buffercount; i++)
+		if (parenttex)
 		{
-			surfaceptr = &glDDS7[i * mipcount];
-			error = glTexture_Create(&surfaceptr->ddsd, surfaceptr->texture, surfaceptr->ddInterface->renderer, /*surfaceptr->hasstencil,*/ FALSE, 0);
-			if (error != DD_OK)
+			// Duplicate surface, shares the memory of the original
+			for (i = 0; i < buffercount; i++)
 			{
-				while (i > 0)
-				{
-					// Delete already created textures in case of failure
-					i--;
-					glRenderer_DeleteTexture(glDDS7->ddInterface->renderer,&textureptr[i]);
-				}
-				TRACE_EXIT(23, error);
-				return error;
+				glDDS7[i * mipcount].texture = parenttex;
+				glTexture_AddRef(parenttex);
+			}
+		}
+		else
+		{
+			// Every buffer of a flip chain is created with one wait for the renderer
+			texddsd = (const DDSURFACEDESC2**)malloc(buffercount * sizeof(DDSURFACEDESC2*));
+			if (!texddsd) TRACE_RET(HRESULT, 23, DDERR_OUTOFMEMORY);
+			for (i = 0; i < buffercount; i++)
+				texddsd[i] = &glDDS7[i * mipcount].ddsd;
+			error = glTexture_CreateBatch(texddsd, textureptr, buffercount, glDDS7->ddInterface->renderer);
+			free(texddsd);
+			if (error != DD_OK) TRACE_RET(HRESULT, 23, error);
+			for (i = 0; i < buffercount; i++)
+			{
+				// Set primary capability for DrawScreen
+				if (glDDS7->ddsd.ddsCaps.dwCaps & DDSCAPS_PRIMARYSURFACE)
+					textureptr[i].levels[0].ddsd.ddsCaps.dwCaps |= DDSCAPS_PRIMARYSURFACE;
+				textureptr[i].freeonrelease = FALSE;
 			}
-			// Set primary capability for DrawScreen
-			if (glDDS7->ddsd.ddsCaps.dwCaps & DDSCAPS_PRIMARYSURFACE)
-				surfaceptr->texture->levels[0].ddsd.ddsCaps.dwCaps |= DDSCAPS_PRIMARYSURFACE;
-			surfaceptr->texture->freeonrelease = FALSE;
 		}
 	//}
 	for (i = 0; i < complexcount; i++)
 	{
-		// Set pitch of surface
-		if (!(glDDS7[i].ddsd.dwFlags & DDSD_PITCH))
+		// Set pitch of surface, or the size of a compressed surface
+		if (glDDS7[i].texture->compressed)
+		{
+			glDDS7[i].ddsd.dwFlags = (glDDS7[i].ddsd.dwFlags & ~DDSD_PITCH) | DDSD_LINEARSIZE;
+			glDDS7[i].ddsd.dwLinearSize = glDDS7[i].texture->levels[glDDS7[i].miplevel].ddsd.dwLinearSize;
+		}
+		else if (!(glDDS7[i].ddsd.dwFlags & DDSD_PITCH))
 		{
 			glDDS7[i].ddsd.dwFlags |= DDSD_PITCH;
 			glDDS7[i].ddsd.lPitch = glDDS7[i].texture->levels[glDDS7[i].miplevel].ddsd.lPitch;
@@ -455,7 +471,8 @@ HRESULT dxglDirectDrawSurface7_Create(LPDIRECTDRAW7 lpDD7, LPDDSURFACEDESC2 lpDD
 		if (!glTexture_ValidatePixelFormat(&glDDS7[i].ddsd.ddpfPixelFormat))
 		{
 			// Clean up textures
-			for (i = 0; i < complexcount; i++)
+			if (parenttex) glTexture_Release(parenttex, FALSE);
+			else for (i = 0; i < complexcount; i++)
 				glRenderer_DeleteTexture(glDDS7->ddInterface->renderer, &textureptr[i]);
 			TRACE_EXIT(23, DDERR_INVALIDPIXELFORMAT);
 			return DDERR_INVALIDPIXELFORMAT;
@@ -564,10 +581,11 @@ void dxglDirectDrawSurface7_Delete(dxglDirectDrawSurface7 *This)
 	if (This->overlaydest) dxglDirectDrawSurface7_DeleteOverlay(This->overlaydest, This);
 	if (This->overlays)
 	{
+		glRenderer_RemoveOverlay(This->ddInterface->renderer, NULL);
 		for (i = 0; i < This->overlaycount; i++)
 			glTexture_Release(This->overlays[i].texture, FALSE);
 		free(This->overlays);
-		dxglDirectDrawSurface7_RenderScreen(This, This->texture, 0, NULL, FALSE, NULL, -1);
+		dxglDirectDrawSurface7_RenderScreen(This, This->texture, 0, NULL, FALSE);
 	}
 	if (This->ddsd.dwFlags & DDSD_BACKBUFFERCOUNT)
 	{
@@ -606,9 +624,24 @@ void dxglDirectDrawSurface7_Delete(dxglDirectDrawSurface7 *This)
 	if (This->device1) glDirect3DDevice7_Destroy(This->device1);
 	glDirectDraw7_DeleteSurface(This->ddInterface, This);
 	if (This->creator) This->creator->Release();
-	glRenderer_FreePointer(This->ddInterface->renderer, This);
+	if (This->shareowner) dxglDirectDrawSurface7_ReleaseShare(This->shareowner);
+	// Duplicates may still use the texture stored with this surface
+	dxglDirectDrawSurface7_ReleaseShare(This);
 	TRACE_EXIT(-1,0);
 }
+
+/**
+  * Drops a reference to the memory of a surface, which also holds its
+  * texture, and frees the memory after the surface and all duplicates
+  * sharing the texture are deleted.
+  * @param This
+  *  Surface that owns the memory
+  */
+void dxglDirectDrawSurface7_ReleaseShare(dxglDirectDrawSurface7 *This)
+{
+	if (!InterlockedDecrement(&This->sharecount))
+		glRenderer_FreePointer(This->ddInterface->renderer, This);
+}
 HRESULT WINAPI dxglDirectDrawSurface7_QueryInterface(dxglDirectDrawSurface7 *This, REFIID riid, void** ppvObj)
 {
 	HRESULT ret;
@@ -939,10 +972,70 @@ HRESULT WINAPI dxglDirectDrawSurface7_AddOverlayDirtyRect(dxglDirectDrawSurface7
 	TRACE_EXIT(23,DDERR_UNSUPPORTED);
 	return DDERR_UNSUPPORTED;
 }
+/**
+  * Copies blocks into a compressed surface.  Compressed surfaces can't be
+  * drawn to, so only unstretched copies from a surface of the same format
+  * with rectangles aligned to the 4x4 blocks are supported.
+  * @param This
+  *  Pointer to the compressed destination surface
+  * @param lpDestRect
+  *  Destination rectangle, or NULL for the whole surface
+  * @param src
+  *  Pointer to the source surface
+  * @param lpSrcRect
+  *  Source rectangle, or NULL for the whole surface
+  * @param dwFlags
+  *  DDBLT flags passed to Blt
+  * @return
+  *  DD_OK if the blocks were copied, otherwise an error code
+  */
+static HRESULT dxglDirectDrawSurface7_BltCompressed(dxglDirectDrawSurface7 *This, LPRECT lpDestRect,
+	dxglDirectDrawSurface7 *src, LPRECT lpSrcRect, DWORD dwFlags)
+{
+	RECT destrect, srcrect;
+	DDSURFACEDESC2 destddsd, srcddsd;
+	size_t destpitch, srcpitch, rowsize;
+	LONG y;
+	HRESULT error;
+	if (!src || (dwFlags & ~(DDBLT_WAIT | DDBLT_ASYNC | DDBLT_DONOTWAIT))) return DDERR_UNSUPPORTED;
+	if (src->texture->compressed != This->texture->compressed) return DDERR_UNSUPPORTED;
+	if (lpDestRect) destrect = *lpDestRect;
+	else SetRect(&destrect, 0, 0, This->ddsd.dwWidth, This->ddsd.dwHeight);
+	if (lpSrcRect) srcrect = *lpSrcRect;
+	else SetRect(&srcrect, 0, 0, src->ddsd.dwWidth, src->ddsd.dwHeight);
+	if (((destrect.right - destrect.left) != (srcrect.right - srcrect.left)) ||
+		((destrect.bottom - destrect.top) != (srcrect.bottom - srcrect.top))) return DDERR_UNSUPPORTED;
+	if ((destrect.left < 0) || (destrect.top < 0) || (destrect.right > (LONG)This->ddsd.dwWidth) ||
+		(destrect.bottom > (LONG)This->ddsd.dwHeight) || (destrect.left >= destrect.right) ||
+		(destrect.top >= destrect.bottom)) return DDERR_INVALIDRECT;
+	if ((srcrect.left < 0) || (srcrect.top < 0) || (srcrect.right > (LONG)src->ddsd.dwWidth) ||
+		(srcrect.bottom > (LONG)src->ddsd.dwHeight)) return DDERR_INVALIDRECT;
+	// Partial blocks are only allowed at the right and bottom edges of both surfaces
+	if ((destrect.left & 3) || (destrect.top & 3) || (srcrect.left & 3) || (srcrect.top & 3)) return DDERR_INVALIDRECT;
+	if (((destrect.right & 3) && (destrect.right != (LONG)This->ddsd.dwWidth)) ||
+		((destrect.bottom & 3) && (destrect.bottom != (LONG)This->ddsd.dwHeight)) ||
+		((srcrect.right & 3) && (srcrect.right != (LONG)src->ddsd.dwWidth)) ||
+		((srcrect.bottom & 3) && (srcrect.bottom != (LONG)src->ddsd.dwHeight))) return DDERR_INVALIDRECT;
+	destpitch = ColorConv_BlockPitch(This->texture->compressed, This->ddsd.dwWidth);
+	srcpitch = ColorConv_BlockPitch(src->texture->compressed, src->ddsd.dwWidth);
+	rowsize = ColorConv_BlockPitch(This->texture->compressed, destrect.right - destrect.left);
+	srcddsd.dwSize = destddsd.dwSize = sizeof(DDSURFACEDESC2);
+	error = glTexture_Lock(src->texture, src->miplevel, &srcrect, &srcddsd, DDLOCK_READONLY, FALSE);
+	if (FAILED(error)) return error;
+	error = glTexture_Lock(This->texture, This->miplevel, &destrect, &destddsd, DDLOCK_WRITEONLY, FALSE);
+	if (FAILED(error))
+	{
+		glTexture_Unlock(src->texture, src->miplevel, &srcrect, FALSE);
+		return error;
+	}
+	for (y = 0; y < destrect.bottom - destrect.top; y += 4)
+		memcpy((BYTE*)destddsd.lpSurface + ((y / 4) * destpitch), (BYTE*)srcddsd.lpSurface + ((y / 4) * srcpitch), rowsize);
+	glTexture_Unlock(This->texture, This->miplevel, &destrect, FALSE);
+	glTexture_Unlock(src->texture, src->miplevel, &srcrect, FALSE);
+	return DD_OK;
+}
 HRESULT WINAPI dxglDirectDrawSurface7_Blt(dxglDirectDrawSurface7 *This, LPRECT lpDestRect, LPDIRECTDRAWSURFACE7 lpDDSrcSurface, LPRECT lpSrcRect, DWORD dwFlags, LPDDBLTFX lpDDBltFx)
 {
-	HRESULT error;
-	RECT tmprect;
 	dxglDirectDrawSurface7* pattern;
 	BltCommand cmd;
 	TRACE_ENTER(6, 14, This, 26, lpDestRect, 14, lpDDSrcSurface, 26, lpSrcRect, 9, dwFlags, 14, lpDDBltFx);
@@ -950,6 +1043,9 @@ HRESULT WINAPI dxglDirectDrawSurface7_Blt(dxglDirectDrawSurface7 *This, LPRECT l
 	if ((dwFlags & DDBLT_DEPTHFILL) && !lpDDBltFx) TRACE_RET(HRESULT, 32, DDERR_INVALIDPARAMS);
 	if ((dwFlags & DDBLT_COLORFILL) && !lpDDBltFx) TRACE_RET(HRESULT, 23, DDERR_INVALIDPARAMS);
 	if ((dwFlags & DDBLT_DDFX) && !lpDDBltFx) TRACE_RET(HRESULT, 23, DDERR_INVALIDPARAMS);
+	if (This->texture->compressed)
+		TRACE_RET(HRESULT, 23, dxglDirectDrawSurface7_BltCompressed(This, lpDestRect,
+			(dxglDirectDrawSurface7*)lpDDSrcSurface, lpSrcRect, dwFlags));
 	ZeroMemory(&cmd, sizeof(BltCommand));
 	cmd.dest = This->texture;
 	cmd.destlevel = This->miplevel;
@@ -1019,21 +1115,36 @@ HRESULT WINAPI dxglDirectDrawSurface7_Blt(dxglDirectDrawSurface7 *This, LPRECT l
 		memcpy(&cmd.destkey, &lpDDBltFx->ddckDestColorkey, sizeof(DDCOLORKEY));
 	}
 	dxglDirectDrawSurface7 *src = (dxglDirectDrawSurface7 *)lpDDSrcSurface;
-	if (This->clipper)
+	if (This->clipper && !(This->clipper->hWnd))
 	{
-		if (!This->clipper->hWnd)
+		if (!This->clipper->clipsize) TRACE_RET(HRESULT, 23, DDERR_NOCLIPLIST);
+		if (glDirectDrawClipper_GetScissorRects(This->clipper, This->ddsd.dwWidth, This->ddsd.dwHeight,
+			cmd.cliprects, &cmd.clipcount))
 		{
-			if (!This->clipper->clipsize) TRACE_RET(HRESULT, 23, DDERR_NOCLIPLIST);
-			if (This->clipper->dirty)
+			// Few rectangles are applied with the scissor test instead of a stencil
+			if (!cmd.clipcount) TRACE_RET(HRESULT, 23, DD_OK);
+			if ((cmd.clipcount == 1) && !cmd.cliprects[0].left && !cmd.cliprects[0].top &&
+				(cmd.cliprects[0].right == (LONG)This->ddsd.dwWidth) &&
+				(cmd.cliprects[0].bottom == (LONG)This->ddsd.dwHeight))
 			{
-				glRenderer_UpdateClipper(This->ddInterface->renderer, &This->clipper->texture, This->clipper->indices,
-					This->clipper->vertices, This->clipper->clipsize, This->ddsd.dwWidth, This->ddsd.dwHeight);
-				This->clipper->dirty = false;
+				cmd.clipcount = 0;
+				ZeroMemory(cmd.cliprects, sizeof(RECT));
 			}
-			dwFlags |= 0x10000000;
+		}
+		else
+		{
+			glTexture *stencil = glDirectDrawClipper_GetStencil(This->clipper, This->ddsd.dwWidth,
+				This->ddsd.dwHeight, This->ddInterface->renderer);
+			if (!stencil) TRACE_RET(HRESULT, 23, DDERR_OUTOFMEMORY);
+			if (This->texture->stencil != stencil)
+			{
+				// Queued blts read the stencil of their destination when they are drawn
+				glRenderer_Sync(This->ddInterface->renderer);
+				glTexture_SetStencil(This->texture, stencil, FALSE);
+			}
+			cmd.flags |= 0x10000000;
 		}
 	}
-	if (This->clipper && !(This->clipper->hWnd)) cmd.flags |= 0x10000000;
 	if (lpDDBltFx) cmd.bltfx = *lpDDBltFx;
 	if (dwFlags & DDBLT_DEPTHFILL)
 	{
@@ -1047,44 +1158,63 @@ HRESULT WINAPI dxglDirectDrawSurface7_Blt(dxglDirectDrawSurface7 *This, LPRECT l
 			TRACE_RET(HRESULT, 23, glRenderer_DepthFill(This->ddInterface->renderer, &cmd, NULL, 0));
 		}
 	}
-	if (This == src)
-	{
-		tmprect.left = tmprect.top = 0;
-		if (lpSrcRect)
-		{
-			tmprect.right = lpSrcRect->right - lpSrcRect->left;
-			tmprect.bottom = lpSrcRect->bottom - lpSrcRect->top;
-		}
-		else
-		{
-			tmprect.right = src->ddsd.dwWidth;
-			tmprect.bottom = src->ddsd.dwHeight;
-		}
-		error = glDirectDraw7_SetupTempSurface(This->ddInterface, tmprect.right, tmprect.bottom);
-		if (FAILED(error)) TRACE_RET(HRESULT, 23, error);
-		error = dxglDirectDrawSurface7_Blt(This->ddInterface->tmpsurface, &tmprect, lpDDSrcSurface, lpSrcRect, 0, NULL);
-		if (FAILED(error)) TRACE_RET(HRESULT, 23, error);
-		if (dwFlags & DDBLT_KEYSRC)
-		{
-			if (This->ddInterface->tmpsurface->ddsd.ddckCKSrcBlt.dwColorSpaceHighValue !=
-				This->ddInterface->tmpsurface->ddsd.ddckCKSrcBlt.dwColorSpaceLowValue)
-				dxglDirectDrawSurface7_SetColorKey(This->ddInterface->tmpsurface, DDCKEY_SRCBLT | DDCKEY_COLORSPACE,
-					&((dxglDirectDrawSurface7*)lpDDSrcSurface)->ddsd.ddckCKSrcBlt);
-			else dxglDirectDrawSurface7_SetColorKey(This->ddInterface->tmpsurface, DDCKEY_SRCBLT,
-				&((dxglDirectDrawSurface7*)lpDDSrcSurface)->ddsd.ddckCKSrcBlt);
+	// Blts between surfaces only written by the CPU stay on the CPU
+	if (glTexture_SoftBlt(&cmd)) TRACE_RET(HRESULT, 23, DD_OK);
+	// Blts from a surface to itself are resolved by the renderer
+	TRACE_RET(HRESULT, 23, glRenderer_Blt(This->ddInterface->renderer, &cmd));
+}
+/**
+  * Performs the blts of a BltBatch call.  All blts but the last are queued
+  * without waiting, so the renderer can draw consecutive blts that share
+  * their source, flags and effects with one draw call.
+  * @param This
+  *  Pointer to the destination surface
+  * @param lpDDBltBatch
+  *  Array of blts to perform
+  * @param dwCount
+  *  Number of entries in lpDDBltBatch
+  * @param wrapped
+  *  TRUE if the source and pattern surfaces are IDirectDrawSurface to
+  *  IDirectDrawSurface4 interfaces that have to be unwrapped
+  * @return
+  *  DD_OK if all blts succeeded, otherwise the error of the first failed blt
+  */
+static HRESULT dxglDirectDrawSurface7_DoBltBatch(dxglDirectDrawSurface7 *This, LPDDBLTBATCH lpDDBltBatch, DWORD dwCount, BOOL wrapped)
+{
+	DWORD i;
+	DWORD flags;
+	HRESULT error;
+	LPDIRECTDRAWSURFACE7 src;
+	DDBLTFX bltfx;
+	LPDDBLTFX fx;
+	for (i = 0; i < dwCount; i++)
+	{
+		flags = lpDDBltBatch[i].dwFlags;
+		if (i < dwCount - 1) flags &= ~DDBLT_WAIT;
+		src = (LPDIRECTDRAWSURFACE7)lpDDBltBatch[i].lpDDSSrc;
+		fx = lpDDBltBatch[i].lpDDBltFx;
+		if (wrapped)
+		{
+			// All older surface interfaces keep the IDirectDrawSurface7 object in the same place
+			if (src) src = (LPDIRECTDRAWSURFACE7)((dxglDirectDrawSurface1*)src)->glDDS7;
+			if (fx && (flags & DDBLT_ROP) && fx->lpDDSPattern)
+			{
+				bltfx = *fx;
+				bltfx.lpDDSPattern = (LPDIRECTDRAWSURFACE)((dxglDirectDrawSurface1*)fx->lpDDSPattern)->glDDS7;
+				fx = &bltfx;
+			}
 		}
-		TRACE_RET(HRESULT, 23, dxglDirectDrawSurface7_Blt(This, lpDestRect, (LPDIRECTDRAWSURFACE7)This->ddInterface->tmpsurface,
-			&tmprect, dwFlags, lpDDBltFx));
+		error = dxglDirectDrawSurface7_Blt(This, lpDDBltBatch[i].lprDest, src, lpDDBltBatch[i].lprSrc, flags, fx);
+		if (FAILED(error)) return error;
 	}
-	else TRACE_RET(HRESULT, 23, glRenderer_Blt(This->ddInterface->renderer, &cmd));
+	return DD_OK;
 }
 HRESULT WINAPI dxglDirectDrawSurface7_BltBatch(dxglDirectDrawSurface7 *This, LPDDBLTBATCH lpDDBltBatch, DWORD dwCount, DWORD dwFlags)
 {
 	TRACE_ENTER(4,14,This,14,lpDDBltBatch,8,dwCount,9,dwFlags);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	FIXME("dxglDirectDrawSurface7_BltBatch: stub\n");
-	TRACE_EXIT(23,DDERR_GENERIC);
-	ERR(DDERR_GENERIC);
+	if (!lpDDBltBatch && dwCount) TRACE_RET(HRESULT, 23, DDERR_INVALIDPARAMS);
+	TRACE_RET(HRESULT, 23, dxglDirectDrawSurface7_DoBltBatch(This, lpDDBltBatch, dwCount, FALSE));
 }
 HRESULT WINAPI dxglDirectDrawSurface7_BltFast(dxglDirectDrawSurface7 *This, DWORD dwX, DWORD dwY, LPDIRECTDRAWSURFACE7 lpDDSrcSurface, LPRECT lpSrcRect, DWORD dwTrans)
 {
@@ -1213,7 +1343,7 @@ HRESULT WINAPI dxglDirectDrawSurface7_Flip(dxglDirectDrawSurface7 *This, LPDIREC
 			This->swapinterval++;
 			This->ddInterface->lastsync = false;
 		}
-		dxglDirectDrawSurface7_RenderScreen(This,This->texture,This->swapinterval,previous,TRUE,NULL,0);
+		dxglDirectDrawSurface7_RenderScreen(This,This->texture,This->swapinterval,previous,TRUE);
 	}
 	if (This->ddsd.ddsCaps.dwCaps & DDSCAPS_OVERLAY)
 	{
@@ -1403,8 +1533,20 @@ HRESULT WINAPI dxglDirectDrawSurface7_GetBltStatus(dxglDirectDrawSurface7 *This,
 	TRACE_ENTER(2,14,This,9,dwFlags);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
 	HRESULT islost = dxglDirectDrawSurface7_IsLost(This);
-	if (islost == DDERR_SURFACELOST) return DDERR_SURFACELOST;
-	// Async rendering not yet implemented
+	if (islost == DDERR_SURFACELOST) TRACE_RET(HRESULT,23,DDERR_SURFACELOST);
+	switch (dwFlags)
+	{
+	case DDGBS_CANBLT:
+		if (!glRenderer_CanQueueBlt(This->ddInterface->renderer)) TRACE_RET(HRESULT,23,DDERR_WASSTILLDRAWING);
+		break;
+	case DDGBS_ISBLTDONE:
+		if (glRenderer_IsTextureBusy(This->ddInterface->renderer, This->texture, This->miplevel))
+			TRACE_RET(HRESULT,23,DDERR_WASSTILLDRAWING);
+		break;
+	default:
+		TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	}
+	TRACE_EXIT(23,DD_OK);
 	return DD_OK;
 }
 HRESULT WINAPI dxglDirectDrawSurface7_GetCaps(dxglDirectDrawSurface7 *This, LPDDSCAPS2 lpDDSCaps)
@@ -1479,12 +1621,14 @@ HRESULT WINAPI dxglDirectDrawSurface7_GetDC(dxglDirectDrawSurface7 *This, HDC FA
 	if(!lphDC) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
 	glDirectDrawPalette *pal = NULL;
 	HRESULT error;
+	LONGLONG profilestart = SurfaceProfile_Begin(This->texture->profile);
 	if (This->ddsd.ddpfPixelFormat.dwRGBBitCount == 8)
 	{
 		if (This->palette) pal = This->palette;
 		else pal = This->ddInterface->primary->palette;
 	}
 	error = glTexture_GetDC(This->texture, This->miplevel, lphDC, pal);
+	SurfaceProfile_End(This->texture->profile, SURFACEPROFILE_GETDC, profilestart, 0);
 	if (SUCCEEDED(error)) { TRACE_VAR("*lphDC", 14, *lphDC); }
 	TRACE_EXIT(23,error);
 	return error;
@@ -1493,11 +1637,15 @@ HRESULT WINAPI dxglDirectDrawSurface7_GetFlipStatus(dxglDirectDrawSurface7 *This
 {
 	TRACE_ENTER(2,14,This,9,dwFlags);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
+	if ((dwFlags != DDGFS_CANFLIP) && (dwFlags != DDGFS_ISFLIPDONE)) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	if (!(This->ddsd.ddsCaps.dwCaps & DDSCAPS_FLIP)) TRACE_RET(HRESULT,23,DDERR_NOTFLIPPABLE);
+	if (dxglDirectDrawSurface7_IsLost(This) == DDERR_SURFACELOST) TRACE_RET(HRESULT,23,DDERR_SURFACELOST);
+	// Flips draw the screen before returning, only a scheduled redraw can be outstanding.
+	// Surfaces in the chain swap textures, so any pending draw counts as the flip.
+	if (glRenderer_IsDrawPending(This->ddInterface->renderer, NULL))
+		TRACE_RET(HRESULT,23,DDERR_WASSTILLDRAWING);
 	TRACE_EXIT(23,DD_OK);
 	return DD_OK;
-	FIXME("dxglDirectDrawSurface7_GetFlipStatus: stub\n");
-	TRACE_RET(HRESULT,23,DDERR_GENERIC);
-	ERR(DDERR_GENERIC);
 }
 HRESULT WINAPI dxglDirectDrawSurface7_GetOverlayPosition(dxglDirectDrawSurface7 *This, LPLONG lplX, LPLONG lplY)
 {
@@ -1562,8 +1710,10 @@ HRESULT WINAPI dxglDirectDrawSurface7_IsLost(dxglDirectDrawSurface7 *This)
 {
 	TRACE_ENTER(1,14,This);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	if(This->hRC == This->ddInterface->renderer->hRC) {TRACE_RET(HRESULT,23,DD_OK);}
-	else TRACE_RET(HRESULT,23,DDERR_SURFACELOST);
+	// The GL context survives mode changes and task switches, so a surface is only
+	// lost if its texture storage was replaced without its contents
+	if(This->texture && This->texture->contentlost) {TRACE_RET(HRESULT,23,DDERR_SURFACELOST);}
+	else TRACE_RET(HRESULT,23,DD_OK);
 }
 
 HRESULT WINAPI dxglDirectDrawSurface7_Lock(dxglDirectDrawSurface7 *This, LPRECT lpDestRect, LPDDSURFACEDESC2 lpDDSurfaceDesc, DWORD dwFlags, HANDLE hEvent)
@@ -1572,6 +1722,8 @@ HRESULT WINAPI dxglDirectDrawSurface7_Lock(dxglDirectDrawSurface7 *This, LPRECT
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
 	if(lpDDSurfaceDesc->dwSize != sizeof(DDSURFACEDESC2)) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
 	if(This->locked) TRACE_RET(HRESULT,23,DDERR_SURFACEBUSY);
+	if ((dwFlags & DDLOCK_DONOTWAIT) && glRenderer_IsTextureBusy(This->ddInterface->renderer, This->texture, This->miplevel))
+		TRACE_RET(HRESULT,23,DDERR_WASSTILLDRAWING);
 	HRESULT error = glTexture_Lock(This->texture, This->miplevel, lpDestRect, lpDDSurfaceDesc, dwFlags, FALSE);
 	if (SUCCEEDED(error))
 	{
@@ -1586,7 +1738,9 @@ HRESULT WINAPI dxglDirectDrawSurface7_ReleaseDC(dxglDirectDrawSurface7 *This, HD
 	TRACE_ENTER(2,14,This,14,hDC);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
 	if(!hDC) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	LONGLONG profilestart = SurfaceProfile_Begin(This->texture->profile);
 	HRESULT error = glTexture_ReleaseDC(This->texture, This->miplevel, hDC);
+	SurfaceProfile_End(This->texture->profile, SURFACEPROFILE_RELEASEDC, profilestart, 0);
 	if (((This->ddsd.ddsCaps.dwCaps & (DDSCAPS_FRONTBUFFER)) &&
 		(This->ddsd.ddsCaps.dwCaps & DDSCAPS_PRIMARYSURFACE)) ||
 		((This->ddsd.ddsCaps.dwCaps & DDSCAPS_PRIMARYSURFACE) &&
@@ -1594,10 +1748,10 @@ HRESULT WINAPI dxglDirectDrawSurface7_ReleaseDC(dxglDirectDrawSurface7 *This, HD
 	{
 		if (This->ddInterface->lastsync)
 		{
-			dxglDirectDrawSurface7_RenderScreen(This, This->texture, 1, NULL, TRUE, NULL, 0);
+			dxglDirectDrawSurface7_RenderScreen(This, This->texture, 1, NULL, TRUE);
 			This->ddInterface->lastsync = false;
 		}
-		else dxglDirectDrawSurface7_RenderScreen(This, This->texture, 0, NULL, TRUE, NULL, 0);
+		else dxglDirectDrawSurface7_RenderScreen(This, This->texture, 0, NULL, TRUE);
 	}
 	TRACE_EXIT(23,error);
 	return error;
@@ -1616,8 +1770,7 @@ void dxglDirectDrawSurface7_Restore2(dxglDirectDrawSurface7 *This)
 			This->ddsd.dwHeight = sizes[3];
 			if(dxglcfg.primaryscale)
 			{
-				if (_isnan(dxglcfg.postsizex) || _isnan(dxglcfg.postsizey) ||
-					(dxglcfg.postsizex < 0.25f) || (dxglcfg.postsizey < 0.25f))
+				if (dxglpolicy.postsizeauto)
 				{
 					if (This->ddsd.dwWidth <= 400) xscale = 2.0f;
 					else xscale = 1.0f;
@@ -1659,6 +1812,11 @@ HRESULT WINAPI dxglDirectDrawSurface7_Restore(dxglDirectDrawSurface7 *This)
 	//LONG sizes[6];
 	//float xscale, yscale;
 	if(!This->ddInterface->renderer) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
+	// Intact surfaces need nothing, lost ones already hold their buffers in the texture
+	// storage and evicted textures are re-uploaded when they are next used
+	if(This->texture) This->texture->contentlost = FALSE;
+	if(This->backbuffer) dxglDirectDrawSurface7_Restore(This->backbuffer);
+	if(This->zbuffer) dxglDirectDrawSurface7_Restore(This->zbuffer);
 /*	if(This->hRC != This->ddInterface->renderer->hRC)
 	{
 		if(This->ddsd.ddsCaps.dwCaps & DDSCAPS_PRIMARYSURFACE)
@@ -1670,8 +1828,7 @@ HRESULT WINAPI dxglDirectDrawSurface7_Restore(dxglDirectDrawSurface7 *This)
 				This->ddsd.dwHeight = sizes[3];
 				if(dxglcfg.primaryscale)
 				{
-					if (_isnan(dxglcfg.postsizex) || _isnan(dxglcfg.postsizey) ||
-						(dxglcfg.postsizex < 0.25f) || (dxglcfg.postsizey < 0.25f))
+					if (dxglpolicy.postsizeauto)
 					{
 						if (This->ddsd.dwWidth <= 400) xscale = 2.0f;
 						else xscale = 1.0f;
@@ -1718,21 +1875,13 @@ HRESULT WINAPI dxglDirectDrawSurface7_SetClipper(dxglDirectDrawSurface7 *This, L
 {
 	TRACE_ENTER(2,14,This,14,lpDDClipper);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	if (This->clipper)
-	{
-		This->clipper->dirty = true;
-		glDirectDrawClipper_Release(This->clipper);
-	}
+	if (This->clipper) glDirectDrawClipper_Release(This->clipper);
 	This->clipper = (glDirectDrawClipper *)lpDDClipper;
-	if (This->clipper)
-	{
-		glDirectDrawClipper_AddRef(This->clipper);
-		This->clipper->dirty = true;
-		if (!This->clipper->texture.initialized) glDirectDrawClipper_CreateTexture(This->clipper, This->texture, This->ddInterface->renderer);
-		glTexture_SetStencil(This->texture, &This->clipper->texture, FALSE);
-	}
-	else
+	if (This->clipper) glDirectDrawClipper_AddRef(This->clipper);
+	// The stencil of the new clipper is attached by the next clipped blt
+	if (This->texture->stencil)
 	{
+		glRenderer_Sync(This->ddInterface->renderer);
 		glTexture_SetStencil(This->texture, NULL, FALSE);
 	}
 	TRACE_EXIT(23,DD_OK);
@@ -1783,7 +1932,7 @@ HRESULT WINAPI dxglDirectDrawSurface7_SetColorKey(dxglDirectDrawSurface7 *This,
 		glRenderer_SetTextureColorKey(This->ddInterface->renderer, This->texture, dwFlags, lpDDColorKey, This->miplevel);
 		if (This->ddsd.ddsCaps.dwCaps & DDSCAPS_PRIMARYSURFACE)
 		{
-			dxglDirectDrawSurface7_RenderScreen(This, This->texture, 0, NULL, FALSE, 0, 0);
+			dxglDirectDrawSurface7_RenderScreen(This, This->texture, 0, NULL, FALSE);
 		}
 	}
 	TRACE_EXIT(23,DD_OK);
@@ -1799,6 +1948,7 @@ HRESULT WINAPI dxglDirectDrawSurface7_SetOverlayPosition(dxglDirectDrawSurface7
 	if (!This->overlayset) TRACE_RET(HRESULT, 23, DDERR_NOOVERLAYDEST);
 	This->overlaypos.x = lX;
 	This->overlaypos.y = lY;
+	if (This->overlaydest) dxglDirectDrawSurface7_MoveOverlay(This->overlaydest, This, lX, lY);
 	TRACE_EXIT(23, DD_OK);
 	return DD_OK;
 }
@@ -1849,7 +1999,7 @@ HRESULT WINAPI dxglDirectDrawSurface7_SetPalette(dxglDirectDrawSurface7 *This, L
 		if (!dxglcfg.DebugNoPaletteRedraw)
 		{
 			if(DXGLTimer_CheckLastDraw(&This->ddInterface->renderer->timer,dxglcfg.HackPaletteDelay))
-				dxglDirectDrawSurface7_RenderScreen(This, This->texture, dxglcfg.HackPaletteVsync, NULL, FALSE, NULL, 0);
+				glRenderer_ScheduleDrawScreen(This->ddInterface->renderer, This->texture, dxglcfg.HackPaletteVsync, FALSE);
 		}
 	}
 	TRACE_EXIT(23,DD_OK);
@@ -1907,7 +2057,9 @@ HRESULT WINAPI dxglDirectDrawSurface7_Unlock(dxglDirectDrawSurface7 *This, LPREC
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
 	if (!This->locked)
 	{
+		// No lock rectangle was recorded, so the whole level is uploaded
 		This->texture->levels[This->miplevel].dirty |= 1;
+		This->texture->levels[This->miplevel].dirtyrectcount = 0;
 		TRACE_RET(HRESULT, 23, DDERR_NOTLOCKED);
 	}
 	This->locked--;
@@ -1920,19 +2072,20 @@ HRESULT WINAPI dxglDirectDrawSurface7_Unlock(dxglDirectDrawSurface7 *This, LPREC
 		{
 			if(This->ddInterface->lastsync)
 			{
-				dxglDirectDrawSurface7_RenderScreen(This,This->texture,1,NULL,TRUE,NULL,0);
+				dxglDirectDrawSurface7_RenderScreen(This,This->texture,1,NULL,TRUE);
 				This->ddInterface->lastsync = false;
 			}
-			else dxglDirectDrawSurface7_RenderScreen(This,This->texture,0,NULL,TRUE,NULL,0);
+			// Unlocks within one refresh interval are shown with one frame
+			else glRenderer_ScheduleDrawScreen(This->ddInterface->renderer, This->texture, 0, TRUE);
 		}
 	if ((This->ddsd.ddsCaps.dwCaps & DDSCAPS_OVERLAY) && This->overlayenabled)
 	{
 		if (This->ddInterface->lastsync)
 		{
-			dxglDirectDrawSurface7_RenderScreen(This, This->ddInterface->primary->texture, 1, NULL, TRUE, NULL, 0);
+			dxglDirectDrawSurface7_RenderScreen(This, This->ddInterface->primary->texture, 1, NULL, TRUE);
 			This->ddInterface->lastsync = false;
 		}
-		else dxglDirectDrawSurface7_RenderScreen(This, This->ddInterface->primary->texture, 0, NULL, TRUE, NULL, 0);
+		else glRenderer_ScheduleDrawScreen(This->ddInterface->renderer, This->ddInterface->primary->texture, 0, TRUE);
 	}
 	TRACE_EXIT(23, DD_OK);
 	return DD_OK;
@@ -2011,15 +2164,16 @@ HRESULT WINAPI dxglDirectDrawSurface7_UpdateOverlayZOrder(dxglDirectDrawSurface7
 	ERR(DDERR_GENERIC);
 }
 
-extern "C" void glDirectDrawSurface7_RenderScreen2(LPDIRECTDRAWSURFACE7 surface, int vsync, BOOL settime, OVERLAY *overlays, int overlaycount)
+extern "C" void glDirectDrawSurface7_SchedulePalette(LPDIRECTDRAWSURFACE7 surface, int vsync)
 {
-	dxglDirectDrawSurface7_RenderScreen((dxglDirectDrawSurface7*)surface, ((dxglDirectDrawSurface7*)surface)->texture, vsync, NULL, settime, overlays, overlaycount);
+	dxglDirectDrawSurface7 *This = (dxglDirectDrawSurface7*)surface;
+	glRenderer_ScheduleDrawScreen(This->ddInterface->renderer, This->texture, vsync, FALSE);
 }
 
-void dxglDirectDrawSurface7_RenderScreen(dxglDirectDrawSurface7 *This, glTexture *texture, int vsync, glTexture *previous, BOOL settime, OVERLAY *overlays, int overlaycount)
+void dxglDirectDrawSurface7_RenderScreen(dxglDirectDrawSurface7 *This, glTexture *texture, int vsync, glTexture *previous, BOOL settime)
 {
 	TRACE_ENTER(3,14,This,14,texture,14,vsync);
-	glRenderer_DrawScreen(This->ddInterface->renderer,texture, texture->palette, vsync, previous, settime, overlays, overlaycount);
+	glRenderer_DrawScreen(This->ddInterface->renderer,texture, texture->palette, vsync, previous, settime);
 	TRACE_EXIT(0,0);
 }
 // ddraw 2+ api
@@ -2089,50 +2243,79 @@ HRESULT WINAPI dxglDirectDrawSurface7_GetUniquenessValue(dxglDirectDrawSurface7
 {
 	TRACE_ENTER(2,14,This,14,lpValue);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	FIXME("dxglDirectDrawSurface7_GetUniquenessValue: stub\n");
-	TRACE_EXIT(23,DDERR_GENERIC);
-	ERR(DDERR_GENERIC);
+	if(!lpValue) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	*lpValue = (DWORD)This->texture->levels[This->miplevel].version;
+	TRACE_VAR("*lpValue",8,*lpValue);
+	TRACE_EXIT(23,DD_OK);
+	return DD_OK;
 }
 HRESULT WINAPI dxglDirectDrawSurface7_ChangeUniquenessValue(dxglDirectDrawSurface7 *This)
 {
 	TRACE_ENTER(1,14,This);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	FIXME("dxglDirectDrawSurface7_ChangeUniquenessValue: stub\n");
-	TRACE_EXIT(23,DDERR_GENERIC);
-	ERR(DDERR_GENERIC);
+	glTexture_ChangeVersion(This->texture, This->miplevel);
+	TRACE_EXIT(23,DD_OK);
+	return DD_OK;
 }
 // ddraw 7 api
+// Priority and LOD are only kept for managed textures, and set on the top level
+static HRESULT dxglDirectDrawSurface7_CheckManaged(dxglDirectDrawSurface7 *This)
+{
+	if (!(This->ddsd.ddsCaps.dwCaps2 & (DDSCAPS2_TEXTUREMANAGE | DDSCAPS2_D3DTEXTUREMANAGE)))
+		return DDERR_INVALIDOBJECT;
+	if (This->miplevel) return DDERR_NOTONMIPMAPSUBLEVEL;
+	return DD_OK;
+}
 HRESULT WINAPI dxglDirectDrawSurface7_SetPriority(dxglDirectDrawSurface7 *This, DWORD dwPriority)
 {
+	HRESULT error;
 	TRACE_ENTER(2,14,This,8,dwPriority);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	FIXME("dxglDirectDrawSurface7_SetPriority: stub\n");
-	TRACE_EXIT(23,DDERR_GENERIC);
-	ERR(DDERR_GENERIC);
+	error = dxglDirectDrawSurface7_CheckManaged(This);
+	if (FAILED(error)) TRACE_RET(HRESULT, 23, error);
+	// Read by the texture residency manager when it picks textures to evict
+	This->texture->priority = dwPriority;
+	TRACE_EXIT(23,DD_OK);
+	return DD_OK;
 }
 HRESULT WINAPI dxglDirectDrawSurface7_GetPriority(dxglDirectDrawSurface7 *This, LPDWORD lpdwPriority)
 {
+	HRESULT error;
 	TRACE_ENTER(2,14,This,14,lpdwPriority);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	FIXME("dxglDirectDrawSurface7_GetPriority: stub\n");
-	TRACE_EXIT(23,DDERR_GENERIC);
-	ERR(DDERR_GENERIC);
+	if(!lpdwPriority) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	error = dxglDirectDrawSurface7_CheckManaged(This);
+	if (FAILED(error)) TRACE_RET(HRESULT, 23, error);
+	*lpdwPriority = This->texture->priority;
+	TRACE_VAR("*lpdwPriority",8,*lpdwPriority);
+	TRACE_EXIT(23,DD_OK);
+	return DD_OK;
 }
 HRESULT WINAPI dxglDirectDrawSurface7_SetLOD(dxglDirectDrawSurface7 *This, DWORD dwMaxLOD)
 {
+	HRESULT error;
 	TRACE_ENTER(2,14,This,8,dwMaxLOD);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	FIXME("dxglDirectDrawSurface7_SetLOD: stub\n");
-	TRACE_EXIT(23,DDERR_GENERIC);
-	ERR(DDERR_GENERIC);
+	error = dxglDirectDrawSurface7_CheckManaged(This);
+	if (FAILED(error)) TRACE_RET(HRESULT, 23, error);
+	if (dwMaxLOD >= (DWORD)This->texture->miplevel) TRACE_RET(HRESULT, 23, DDERR_INVALIDPARAMS);
+	// Applied by the renderer the next time the texture is drawn with
+	This->texture->lod = dwMaxLOD;
+	TRACE_EXIT(23,DD_OK);
+	return DD_OK;
 }
 HRESULT WINAPI dxglDirectDrawSurface7_GetLOD(dxglDirectDrawSurface7 *This, LPDWORD lpdwMaxLOD)
 {
+	HRESULT error;
 	TRACE_ENTER(2,14,This,14,lpdwMaxLOD);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	FIXME("dxglDirectDrawSurface7_GetLOD: stub\n");
-	TRACE_EXIT(23,DDERR_GENERIC);
-	ERR(DDERR_GENERIC);
+	if(!lpdwMaxLOD) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	error = dxglDirectDrawSurface7_CheckManaged(This);
+	if (FAILED(error)) TRACE_RET(HRESULT, 23, error);
+	*lpdwMaxLOD = This->texture->lod;
+	TRACE_VAR("*lpdwMaxLOD",8,*lpdwMaxLOD);
+	TRACE_EXIT(23,DD_OK);
+	return DD_OK;
 }
 HRESULT WINAPI dxglDirectDrawSurface7_Unlock2(dxglDirectDrawSurface7 *This, LPVOID lpSurfaceData)
 {
@@ -2182,18 +2365,40 @@ HRESULT dxglDirectDrawSurface7_GetGammaRamp(dxglDirectDrawSurface7 *This, DWORD
 {
 	TRACE_ENTER(3, 14, This, 9, dwFlags, 14, lpRampData);
 	if (!This) TRACE_RET(HRESULT, 23, DDERR_INVALIDOBJECT);
-	FIXME("dxglDirectDrawSurface7_GetGammaRamp: stub\n");
-	TRACE_EXIT(23, DDERR_GENERIC);
-	ERR(DDERR_GENERIC);
+	if (!lpRampData) TRACE_RET(HRESULT, 23, DDERR_INVALIDPARAMS);
+	if (!(This->ddsd.ddsCaps.dwCaps & DDSCAPS_PRIMARYSURFACE)) TRACE_RET(HRESULT, 23, DDERR_UNSUPPORTED);
+	memcpy(lpRampData, &This->ddInterface->gammaramp, sizeof(DDGAMMARAMP));
+	TRACE_EXIT(23, DD_OK);
+	return DD_OK;
 }
 
 HRESULT dxglDirectDrawSurface7_SetGammaRamp(dxglDirectDrawSurface7 *This, DWORD dwFlags, LPDDGAMMARAMP lpRampData)
 {
 	TRACE_ENTER(3, 14, This, 9, dwFlags, 14, lpRampData);
 	if (!This) TRACE_RET(HRESULT, 23, DDERR_INVALIDOBJECT);
-	FIXME("dxglDirectDrawSurface7_SetGammaRamp: stub\n");
-	TRACE_EXIT(23, DDERR_GENERIC);
-	ERR(DDERR_GENERIC);
+	if (!lpRampData) TRACE_RET(HRESULT, 23, DDERR_INVALIDPARAMS);
+	if (dwFlags & ~DDSGR_CALIBRATE) TRACE_RET(HRESULT, 23, DDERR_INVALIDPARAMS);
+	if (!(This->ddsd.ddsCaps.dwCaps & DDSCAPS_PRIMARYSURFACE)) TRACE_RET(HRESULT, 23, DDERR_UNSUPPORTED);
+	// There is no calibrator, DDSGR_CALIBRATE sets the ramp as given
+	memcpy(&This->ddInterface->gammaramp, lpRampData, sizeof(DDGAMMARAMP));
+	glRenderer_SetGammaRamp(This->ddInterface->renderer, lpRampData);
+	TRACE_EXIT(23, DD_OK);
+	return DD_OK;
+}
+
+/**
+  * Draws the primary surface again after its overlays were changed.
+  * @param This
+  *  Pointer to the surface the overlays are shown on
+  */
+static void dxglDirectDrawSurface7_RedrawOverlays(dxglDirectDrawSurface7 *This)
+{
+	if (This->ddInterface->lastsync)
+	{
+		dxglDirectDrawSurface7_RenderScreen(This, This->ddInterface->primary->texture, 1, NULL, TRUE);
+		This->ddInterface->lastsync = false;
+	}
+	else dxglDirectDrawSurface7_RenderScreen(This, This->ddInterface->primary->texture, 0, NULL, TRUE);
 }
 
 HRESULT dxglDirectDrawSurface7_AddOverlay(dxglDirectDrawSurface7 *This, OVERLAY *overlay)
@@ -2222,38 +2427,18 @@ HRESULT dxglDirectDrawSurface7_AddOverlay(dxglDirectDrawSurface7 *This, OVERLAY
 		if (This->overlays[i].surface == overlay->surface)
 		{
 			glTexture_Release(This->overlays[i].texture, FALSE);
-			This->overlays[i].destrect = overlay->destrect;
-			This->overlays[i].srcrect = overlay->srcrect;
-			This->overlays[i].flags = overlay->flags;
-			This->overlays[i].fx = overlay->fx;
-			This->overlays[i].surface = overlay->surface;
-			This->overlays[i].texture = overlay->texture;
-			if (overlay->flags & DDOVER_SHOW) This->overlays[i].enabled = TRUE;
-			if (overlay->flags & DDOVER_HIDE) This->overlays[i].enabled = FALSE;
 			memcpy(&This->overlays[i], overlay, sizeof(OVERLAY));
 			glTexture_AddRef(This->overlays[i].texture);
-			if (This->ddInterface->lastsync)
-			{
-				dxglDirectDrawSurface7_RenderScreen(This, This->ddInterface->primary->texture,
-					1, NULL, TRUE, This->overlays, This->overlaycount);
-				This->ddInterface->lastsync = false;
-			}
-			else dxglDirectDrawSurface7_RenderScreen(This, This->ddInterface->primary->texture,
-				0, NULL, TRUE, This->overlays, This->overlaycount);
+			glRenderer_SetOverlay(This->ddInterface->renderer, &This->overlays[i]);
+			dxglDirectDrawSurface7_RedrawOverlays(This);
 			return DD_OK;
 		}
 	}
 	This->overlays[This->overlaycount] = *overlay;
 	glTexture_AddRef(This->overlays[This->overlaycount].texture);
+	glRenderer_SetOverlay(This->ddInterface->renderer, &This->overlays[This->overlaycount]);
 	This->overlaycount++;
-	if (This->ddInterface->lastsync)
-	{
-		dxglDirectDrawSurface7_RenderScreen(This, This->ddInterface->primary->texture,
-			1, NULL, TRUE, This->overlays, This->overlaycount);
-		This->ddInterface->lastsync = false;
-	}
-	else dxglDirectDrawSurface7_RenderScreen(This, This->ddInterface->primary->texture,
-		0, NULL, TRUE, This->overlays, This->overlaycount);
+	dxglDirectDrawSurface7_RedrawOverlays(This);
 	return DD_OK;
 }
 
@@ -2264,20 +2449,11 @@ HRESULT dxglDirectDrawSurface7_DeleteOverlay(dxglDirectDrawSurface7 *This, dxglD
 	{
 		if (This->overlays[i].surface == surface)
 		{
+			glRenderer_RemoveOverlay(This->ddInterface->renderer, surface);
 			glTexture_Release(This->overlays[i].texture, FALSE);
 			This->overlaycount--;
 			memmove(&This->overlays[i], &This->overlays[i + 1], (This->overlaycount - i) * sizeof(OVERLAY));
-			if (surface->overlayenabled)
-			{
-				if (This->ddInterface->lastsync)
-				{
-					dxglDirectDrawSurface7_RenderScreen(This, This->ddInterface->primary->texture,
-						1, NULL, TRUE, This->overlays, This->overlaycount);
-					This->ddInterface->lastsync = false;
-				}
-				else dxglDirectDrawSurface7_RenderScreen(This, This->ddInterface->primary->texture,
-					0, NULL, TRUE, This->overlays, This->overlaycount);
-			}
+			if (surface->overlayenabled) dxglDirectDrawSurface7_RedrawOverlays(This);
 			return DD_OK;
 		}
 	}
@@ -2294,17 +2470,30 @@ HRESULT dxglDirectDrawSurface7_UpdateOverlayTexture(dxglDirectDrawSurface7 *This
 			glTexture_Release(This->overlays[i].texture, FALSE);
 			This->overlays[i].texture = texture;
 			glTexture_AddRef(This->overlays[i].texture);
-			if (surface->overlayenabled)
-			{
-				if (This->ddInterface->lastsync)
-				{
-					dxglDirectDrawSurface7_RenderScreen(This, This->ddInterface->primary->texture,
-						1, NULL, TRUE, This->overlays, This->overlaycount);
-					This->ddInterface->lastsync = false;
-				}
-				else dxglDirectDrawSurface7_RenderScreen(This, This->ddInterface->primary->texture,
-					0, NULL, TRUE, This->overlays, This->overlaycount);
-			}
+			glRenderer_SetOverlay(This->ddInterface->renderer, &This->overlays[i]);
+			if (surface->overlayenabled) dxglDirectDrawSurface7_RedrawOverlays(This);
+			return DD_OK;
+		}
+	}
+	return DDERR_NOTFOUND;
+}
+
+HRESULT dxglDirectDrawSurface7_MoveOverlay(dxglDirectDrawSurface7 *This, dxglDirectDrawSurface7 *surface, LONG x, LONG y)
+{
+	int i;
+	RECT *r;
+	for (i = 0; i < This->overlaycount; i++)
+	{
+		if (This->overlays[i].surface == surface)
+		{
+			r = &This->overlays[i].destrect;
+			if (!memcmp(r, &nullrect, sizeof(RECT))) return DD_OK;
+			r->right = x + (r->right - r->left);
+			r->bottom = y + (r->bottom - r->top);
+			r->left = x;
+			r->top = y;
+			glRenderer_SetOverlayPosition(This->ddInterface->renderer, surface, x, y);
+			if (surface->overlayenabled) dxglDirectDrawSurface7_RedrawOverlays(This);
 			return DD_OK;
 		}
 	}
@@ -2438,7 +2627,8 @@ HRESULT WINAPI dxglDirectDrawSurface1_BltBatch(dxglDirectDrawSurface1 *This, LPD
 {
 	TRACE_ENTER(4,14,This,14,lpDDBltBatch,8,dwCount,9,dwFlags);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	TRACE_RET(HRESULT,23, dxglDirectDrawSurface7_BltBatch(This->glDDS7,lpDDBltBatch,dwCount,dwFlags));
+	if (!lpDDBltBatch && dwCount) TRACE_RET(HRESULT, 23, DDERR_INVALIDPARAMS);
+	TRACE_RET(HRESULT,23, dxglDirectDrawSurface7_DoBltBatch(This->glDDS7,lpDDBltBatch,dwCount,TRUE));
 }
 HRESULT WINAPI dxglDirectDrawSurface1_BltFast(dxglDirectDrawSurface1 *This, DWORD dwX, DWORD dwY, LPDIRECTDRAWSURFACE lpDDSrcSurface, LPRECT lpSrcRect, DWORD dwTrans)
 {
@@ -2797,7 +2987,8 @@ HRESULT WINAPI dxglDirectDrawSurface2_BltBatch(dxglDirectDrawSurface2 *This, LPD
 {
 	TRACE_ENTER(4,14,This,14,lpDDBltBatch,8,dwCount,9,dwFlags);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	TRACE_RET(HRESULT,23, dxglDirectDrawSurface7_BltBatch(This->glDDS7,lpDDBltBatch,dwCount,dwFlags));
+	if (!lpDDBltBatch && dwCount) TRACE_RET(HRESULT, 23, DDERR_INVALIDPARAMS);
+	TRACE_RET(HRESULT,23, dxglDirectDrawSurface7_DoBltBatch(This->glDDS7,lpDDBltBatch,dwCount,TRUE));
 }
 HRESULT WINAPI dxglDirectDrawSurface2_BltFast(dxglDirectDrawSurface2 *This, DWORD dwX, DWORD dwY, LPDIRECTDRAWSURFACE2 lpDDSrcSurface, LPRECT lpSrcRect, DWORD dwTrans)
 {
@@ -3182,7 +3373,8 @@ HRESULT WINAPI dxglDirectDrawSurface3_BltBatch(dxglDirectDrawSurface3 *This, LPD
 {
 	TRACE_ENTER(4,14,This,14,lpDDBltBatch,8,dwCount,9,dwFlags);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	TRACE_RET(HRESULT,23, dxglDirectDrawSurface7_BltBatch(This->glDDS7,lpDDBltBatch,dwCount,dwFlags));
+	if (!lpDDBltBatch && dwCount) TRACE_RET(HRESULT, 23, DDERR_INVALIDPARAMS);
+	TRACE_RET(HRESULT,23, dxglDirectDrawSurface7_DoBltBatch(This->glDDS7,lpDDBltBatch,dwCount,TRUE));
 }
 HRESULT WINAPI dxglDirectDrawSurface3_BltFast(dxglDirectDrawSurface3 *This, DWORD dwX, DWORD dwY, LPDIRECTDRAWSURFACE3 lpDDSrcSurface, LPRECT lpSrcRect, DWORD dwTrans)
 {
@@ -3579,7 +3771,8 @@ HRESULT WINAPI dxglDirectDrawSurface4_BltBatch(dxglDirectDrawSurface4 *This, LPD
 {
 	TRACE_ENTER(4,14,This,14,lpDDBltBatch,8,dwCount,9,dwFlags);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	TRACE_RET(HRESULT,23, dxglDirectDrawSurface7_BltBatch(This->glDDS7,lpDDBltBatch,dwCount,dwFlags));
+	if (!lpDDBltBatch && dwCount) TRACE_RET(HRESULT, 23, DDERR_INVALIDPARAMS);
+	TRACE_RET(HRESULT,23, dxglDirectDrawSurface7_DoBltBatch(This->glDDS7,lpDDBltBatch,dwCount,TRUE));
 }
 HRESULT WINAPI dxglDirectDrawSurface4_BltFast(dxglDirectDrawSurface4 *This, DWORD dwX, DWORD dwY, LPDIRECTDRAWSURFACE4 lpDDSrcSurface, LPRECT lpSrcRect, DWORD dwTrans)
 {
@@ -124,6 +124,12 @@ typedef struct dxglDirectDrawSurface7
 	// The texture represented by the surface
 	glTexture *texture;
 
+	// Surface whose texture a duplicate made by DuplicateSurface shares, NULL otherwise
+	dxglDirectDrawSurface7 *shareowner;
+	// One for the surface plus one per duplicate sharing its texture, the
+	// memory holding the texture is freed when it reaches zero
+	LONG sharecount;
+
 	// The parent surface, null if it's the top of a complex structure 
 	dxglDirectDrawSurface7 *parent;
 
@@ -171,6 +177,9 @@ typedef struct dxglDirectDrawSurface7
 	// Tracks status of PageLock API.
 	int pagelocked;
 
+	// Index in the surface list of the DirectDraw object plus one, 0 if not listed
+	int surfaceslot;
+
 	// GL context that created the surface
 	HGLRC hRC;
 
@@ -260,6 +269,7 @@ typedef struct dxglDirectDrawSurface7Vtbl
 HRESULT dxglDirectDrawSurface7_Create(LPDIRECTDRAW7 lpDD7, LPDDSURFACEDESC2 lpDDSurfaceDesc2, glDirectDrawPalette *palettein,
 	glTexture *parenttex, int version, dxglDirectDrawSurface7 *glDDS7);
 void dxglDirectDrawSurface7_Delete(dxglDirectDrawSurface7 *This);
+void dxglDirectDrawSurface7_ReleaseShare(dxglDirectDrawSurface7 *This);
 // ddraw 1+ api
 HRESULT WINAPI dxglDirectDrawSurface7_QueryInterface(dxglDirectDrawSurface7 *This, REFIID riid, void** ppvObj);
 ULONG WINAPI dxglDirectDrawSurface7_AddRef(dxglDirectDrawSurface7 *This);
@@ -332,7 +342,7 @@ void dxglDirectDrawSurface7_Restore2(dxglDirectDrawSurface7 *This);
 HRESULT dxglDirectDrawSurface7_Flip2(dxglDirectDrawSurface7 *This, LPDIRECTDRAWSURFACE7 lpDDSurfaceTargetOverride, DWORD dwFlags, glTexture **previous);
 HRESULT dxglDirectDrawSurface7_AddAttachedSurface2(dxglDirectDrawSurface7 *This, LPDIRECTDRAWSURFACE7 lpDDSAttachedSurface, IUnknown *iface);
 void dxglDirectDrawSurface7_SetTexture(dxglDirectDrawSurface7 *This, glTexture *newtexture);
-void dxglDirectDrawSurface7_RenderScreen(dxglDirectDrawSurface7 *This, glTexture *texture, int vsync, glTexture *previous, BOOL settime, OVERLAY *overlays, int overlaycount);
+void dxglDirectDrawSurface7_RenderScreen(dxglDirectDrawSurface7 *This, glTexture *texture, int vsync, glTexture *previous, BOOL settime);
 // Special ddraw2->ddraw7 api
 HRESULT WINAPI dxglDirectDrawSurface7_Unlock2(dxglDirectDrawSurface7 *This, LPVOID lpSurfaceData);
 HRESULT dxglDirectDrawSurface7_GetHandle(dxglDirectDrawSurface7 *This, glDirect3DDevice7 *glD3DDev7, LPD3DTEXTUREHANDLE lpHandle);
@@ -342,6 +352,7 @@ HRESULT dxglDirectDrawSurface7_SetGammaRamp(dxglDirectDrawSurface7 *This, DWORD
 HRESULT dxglDirectDrawSurface7_AddOverlay(dxglDirectDrawSurface7 *This, OVERLAY *overlay);
 HRESULT dxglDirectDrawSurface7_DeleteOverlay(dxglDirectDrawSurface7 *This, dxglDirectDrawSurface7 *surface);
 HRESULT dxglDirectDrawSurface7_UpdateOverlayTexture(dxglDirectDrawSurface7 *This, dxglDirectDrawSurface7 *surface, glTexture *texture);
+HRESULT dxglDirectDrawSurface7_MoveOverlay(dxglDirectDrawSurface7 *This, dxglDirectDrawSurface7 *surface, LONG x, LONG y);
 
 // Legacy DDRAW Interfaces
 typedef struct dxglDirectDrawSurface1Vtbl
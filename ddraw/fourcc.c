@@ -35,7 +35,16 @@ const DWORD dxglfourcc[] =
 	MAKEFOURCC('G','R','E','Y'),
 	MAKEFOURCC('Y','1','6',' '),
 	MAKEFOURCC('R','G','B','G'),
-	MAKEFOURCC('G','R','G','B')
+	MAKEFOURCC('G','R','G','B'),
+	MAKEFOURCC('Y','V','1','2'),
+	MAKEFOURCC('I','4','2','0'),
+	MAKEFOURCC('I','Y','U','V'),
+	MAKEFOURCC('N','V','1','2'),
+	MAKEFOURCC('D','X','T','1'),
+	MAKEFOURCC('D','X','T','2'),
+	MAKEFOURCC('D','X','T','3'),
+	MAKEFOURCC('D','X','T','4'),
+	MAKEFOURCC('D','X','T','5')
 };
 static const int END_FOURCC = __LINE__ - 4;
 
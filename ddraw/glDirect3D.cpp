@@ -297,31 +297,71 @@ HRESULT WINAPI glDirect3D7_CreateViewport(glDirect3D7 *This, LPDIRECT3DVIEWPORT3
 
 void FixCapsTexture(D3DDEVICEDESC7 *d3ddesc, D3DDEVICEDESC *d3ddesc3, glRenderer *renderer)
 {
+	GLCAPS glcaps;
 	if (!d3ddesc->dwMaxTextureWidth)
 	{
-		if (!renderer)
-		{
-			HWND hGLWnd = CreateWindow(_T("Test"), NULL, WS_POPUP, 0, 0, 16, 16, NULL, NULL, NULL, NULL);
-			glRenderer *tmprenderer = (glRenderer*)malloc(sizeof(glRenderer));
-			DEVMODE mode;
-			mode.dmSize = sizeof(DEVMODE);
-			EnumDisplaySettings(NULL, ENUM_CURRENT_SETTINGS, &mode);
-			glRenderer_Init(tmprenderer, 16, 16, mode.dmBitsPerPel, false, mode.dmDisplayFrequency, hGLWnd, NULL, FALSE);
-			d3ddesc->dwMaxTextureWidth = d3ddesc->dwMaxTextureHeight =
-				d3ddesc->dwMaxTextureRepeat = d3ddesc->dwMaxTextureAspectRatio = tmprenderer->gl_caps.TextureMax;
-			d3ddesc3->dwMaxTextureWidth = d3ddesc3->dwMaxTextureHeight =
-				d3ddesc3->dwMaxTextureRepeat = d3ddesc3->dwMaxTextureAspectRatio = tmprenderer->gl_caps.TextureMax;
-			glRenderer_Delete(tmprenderer);
-			free(tmprenderer);
-		}
-		else
+		glRenderer_GetCaps(renderer, &glcaps);
+		d3ddesc->dwMaxTextureWidth = d3ddesc->dwMaxTextureHeight =
+			d3ddesc->dwMaxTextureRepeat = d3ddesc->dwMaxTextureAspectRatio = glcaps.TextureMax;
+		d3ddesc3->dwMaxTextureWidth = d3ddesc3->dwMaxTextureHeight =
+			d3ddesc3->dwMaxTextureRepeat = d3ddesc3->dwMaxTextureAspectRatio = glcaps.TextureMax;
+		d3ddesc->dwMaxActiveLights = d3ddesc3->dlcLightingCaps.dwNumLights = glcaps.MaxLights;
+	}
+}
+
+/**
+  * Builds the device descriptions and Z buffer formats reported by
+  * EnumDevices and EnumZBufferFormats.  The tables only depend on the
+  * renderer capabilities, so they are built once per renderer and the
+  * enumeration callbacks walk the prebuilt tables.
+  * @param glDD7
+  *  Pointer to the DirectDraw object to build the tables for
+  */
+static void glDirect3D7_BuildEnumTables(glDirectDraw7 *glDD7)
+{
+	GLCAPS glcaps;
+	DDPIXELFORMAT ddpf;
+	if (glDD7->enumbuilt && (glDD7->enumrenderer == glDD7->renderer)) return;
+	FixCapsTexture(&glDD7->d3ddesc, &glDD7->d3ddesc3, glDD7->renderer);
+	glDD7->enumdevices[0] = glDD7->d3ddesc;
+	glDD7->enumdevices[0].deviceGUID = IID_IDirect3DRGBDevice;
+	glDD7->enumdevices[1] = glDD7->enumdevices[0];
+	glDD7->enumdevices[1].deviceGUID = IID_IDirect3DHALDevice;
+	glDD7->enumdevices[1].dwDevCaps |= D3DDEVCAPS_HWRASTERIZATION;
+	glDD7->enumdevices[2] = glDD7->enumdevices[1];
+	glDD7->enumdevices[2].deviceGUID = IID_IDirect3DTnLHalDevice;
+	glDD7->enumdevices[2].dwDevCaps |= D3DDEVCAPS_HWTRANSFORMANDLIGHT;
+	glDD7->zbufferformatcount = 0;
+	ZeroMemory(&ddpf,sizeof(DDPIXELFORMAT));
+	ddpf.dwSize = sizeof(DDPIXELFORMAT);
+	ddpf.dwFlags = DDPF_ZBUFFER;
+	ddpf.dwZBufferBitDepth = 16;
+	ddpf.dwZBitMask = 0xffff;
+	glDD7->zbufferformats[glDD7->zbufferformatcount++] = ddpf;
+	ddpf.dwZBufferBitDepth = 24;
+	ddpf.dwZBitMask = 0xffffff00;
+	glDD7->zbufferformats[glDD7->zbufferformatcount++] = ddpf;
+	ddpf.dwZBufferBitDepth = 32;
+	glDD7->zbufferformats[glDD7->zbufferformatcount++] = ddpf;
+	ddpf.dwZBitMask = 0xffffffff;
+	glDD7->zbufferformats[glDD7->zbufferformatcount++] = ddpf;
+	if (glDD7->renderer)
+	{
+		glRenderer_GetCaps(glDD7->renderer, &glcaps);
+		if (glcaps.PackedDepthStencil)
 		{
-			d3ddesc->dwMaxTextureWidth = d3ddesc->dwMaxTextureHeight =
-				d3ddesc->dwMaxTextureRepeat = d3ddesc->dwMaxTextureAspectRatio = renderer->gl_caps.TextureMax;
-			d3ddesc3->dwMaxTextureWidth = d3ddesc3->dwMaxTextureHeight =
-				d3ddesc3->dwMaxTextureRepeat = d3ddesc3->dwMaxTextureAspectRatio = renderer->gl_caps.TextureMax;
+			ddpf.dwZBufferBitDepth = 32;
+			ddpf.dwStencilBitDepth = 8;
+			ddpf.dwZBitMask = 0xffffff00;
+			ddpf.dwStencilBitMask = 0xff;
+			glDD7->zbufferformats[glDD7->zbufferformatcount++] = ddpf;
+			ddpf.dwZBitMask = 0x00ffffff;
+			ddpf.dwStencilBitMask = 0xff000000;
+			glDD7->zbufferformats[glDD7->zbufferformatcount++] = ddpf;
 		}
 	}
+	glDD7->enumrenderer = glDD7->renderer;
+	glDD7->enumbuilt = true;
 }
 
 HRESULT WINAPI glDirect3D7_EnumDevices(glDirect3D7 *This, LPD3DENUMDEVICESCALLBACK7 lpEnumDevicesCallback, LPVOID lpUserArg)
@@ -330,24 +370,12 @@ HRESULT WINAPI glDirect3D7_EnumDevices(glDirect3D7 *This, LPD3DENUMDEVICESCALLBA
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
 	if(!lpEnumDevicesCallback) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
 	HRESULT result;
-	FixCapsTexture(&This->glDD7->d3ddesc, &This->glDD7->d3ddesc3, This->glDD7->renderer);
-	D3DDEVICEDESC7 desc = This->glDD7->d3ddesc;
+	D3DDEVICEDESC7 desc;
+	glDirect3D7_BuildEnumTables(This->glDD7);
 	for(int i = 0; i < 3; i++)
 	{
-		switch(i)
-		{
-		case 0:
-			desc.deviceGUID = IID_IDirect3DRGBDevice;
-			break;
-		case 1:
-			desc.deviceGUID = IID_IDirect3DHALDevice;
-			desc.dwDevCaps |= D3DDEVCAPS_HWRASTERIZATION;
-			break;
-		case 2:
-			desc.deviceGUID = IID_IDirect3DTnLHalDevice;
-			desc.dwDevCaps |= D3DDEVCAPS_HWRASTERIZATION | D3DDEVCAPS_HWTRANSFORMANDLIGHT;
-			break;
-		}
+		// Pass a copy so the callback can't modify the table
+		desc = This->glDD7->enumdevices[i];
 		result = lpEnumDevicesCallback(This->glDD7->stored_devices[i].name,This->glDD7->stored_devices[i].devname,&desc,lpUserArg);
 		if(result != D3DENUMRET_OK) break;
 	}
@@ -376,32 +404,11 @@ HRESULT WINAPI glDirect3D7_EnumZBufferFormats(glDirect3D7 *This, REFCLSID riidDe
 	TRACE_ENTER(4,14,This,24,&riidDevice,14,lpEnumCallback,14,lpContext);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
 	DDPIXELFORMAT ddpf;
-	ZeroMemory(&ddpf,sizeof(DDPIXELFORMAT));
-	ddpf.dwSize = sizeof(DDPIXELFORMAT);
-	ddpf.dwFlags = DDPF_ZBUFFER;
-	ddpf.dwZBufferBitDepth = 16;
-	ddpf.dwZBitMask = 0xffff;
-	if(lpEnumCallback(&ddpf,lpContext) == D3DENUMRET_CANCEL) TRACE_RET(HRESULT,23,D3D_OK);
-	ddpf.dwZBufferBitDepth = 24;
-	ddpf.dwZBitMask = 0xffffff00;
-	if(lpEnumCallback(&ddpf,lpContext) == D3DENUMRET_CANCEL) TRACE_RET(HRESULT,23,D3D_OK);
-	ddpf.dwZBufferBitDepth = 32;
-	if(lpEnumCallback(&ddpf,lpContext) == D3DENUMRET_CANCEL) TRACE_RET(HRESULT,23,D3D_OK);
-	ddpf.dwZBitMask = 0xffffffff;
-	if(lpEnumCallback(&ddpf,lpContext) == D3DENUMRET_CANCEL) TRACE_RET(HRESULT,23,D3D_OK);
-	if (This->glDD7->renderer)
+	glDirect3D7_BuildEnumTables(This->glDD7);
+	for(DWORD i = 0; i < This->glDD7->zbufferformatcount; i++)
 	{
-		if (This->glDD7->renderer->ext->GLEXT_EXT_packed_depth_stencil || This->glDD7->renderer->ext->GLEXT_NV_packed_depth_stencil)
-		{
-			ddpf.dwZBufferBitDepth = 32;
-			ddpf.dwStencilBitDepth = 8;
-			ddpf.dwZBitMask = 0xffffff00;
-			ddpf.dwStencilBitMask = 0xff;
-			if (lpEnumCallback(&ddpf, lpContext) == D3DENUMRET_CANCEL) TRACE_RET(HRESULT, 23, D3D_OK);
-			ddpf.dwZBitMask = 0x00ffffff;
-			ddpf.dwStencilBitMask = 0xff000000;
-			if (lpEnumCallback(&ddpf, lpContext) == D3DENUMRET_CANCEL) TRACE_RET(HRESULT, 23, D3D_OK);
-		}
+		ddpf = This->glDD7->zbufferformats[i];
+		if(lpEnumCallback(&ddpf,lpContext) == D3DENUMRET_CANCEL) TRACE_RET(HRESULT,23,D3D_OK);
 	}
 	TRACE_EXIT(23,D3D_OK);
 	return D3D_OK;
@@ -31,11 +31,13 @@
 #include "glDirect3DDevice.h"
 #include "glDirect3DLight.h"
 #include "glDirect3DExecuteBuffer.h"
+#include "glDirect3DStateBlock.h"
 #include <string>
 #include <cmath>
 using namespace std;
 #include "ShaderGen3D.h"
 #include "matrix.h"
+#include "vertexproc.h"
 
 typedef struct _D3DDeviceDesc1 {
         DWORD           dwSize;
@@ -377,18 +379,33 @@ HRESULT glDirect3DDevice7_Create(REFCLSID rclsid, glDirect3D7 *glD3D7, dxglDirec
 	This->outbuffersize = 0;
 	ZeroMemory(This->texcoords,8*sizeof(GLfloat*));
 	memcpy(This->renderstate,renderstate_default,RENDERSTATE_COUNT*sizeof(DWORD));
+	memcpy(This->glrenderstate,renderstate_default,RENDERSTATE_COUNT*sizeof(DWORD));
+	ZeroMemory(This->renderstatedirty,sizeof(This->renderstatedirty));
+	memset(This->gltexstagevalue,0xff,sizeof(This->gltexstagevalue));
+	ZeroMemory(This->texstagedirty,sizeof(This->texstagedirty));
+	This->transformdirty = 0;
 	__gluMakeIdentityf(This->matWorld);
 	__gluMakeIdentityf(This->matView);
 	__gluMakeIdentityf(This->matProjection);
 	This->transform_dirty = true;
+	This->frustum_dirty = true;
 	This->matrices = NULL;
 	This->matrixcount = 0;
+	This->matrixfree = 0;
+	This->stateblocks = NULL;
+	This->stateblockcount = 0;
+	This->maxstateblocks = 0;
+	This->recordingblock = NULL;
+	ZeroMemory(&This->immediate, sizeof(D3DIMMEDIATE));
+	ZeroMemory(&This->clipstatus, sizeof(D3DCLIPSTATUS));
+	This->clipstatusused = FALSE;
+	This->clipstatusreset = TRUE;
 	This->texstages[0] = texstagedefault0;
 	This->texstages[1] = This->texstages[2] = This->texstages[3] = This->texstages[4] =
 		This->texstages[5] = This->texstages[6] = This->texstages[7] = texstagedefault1;
 	This->refcount = 1;
 	This->inscene = false;
-	This->modelview_dirty = false;
+	This->modelview_dirty = true;
 	This->projection_dirty = false;
 	This->glD3D7 = glD3D7;
 	glDirect3D7_AddRef(glD3D7);
@@ -399,7 +416,7 @@ HRESULT glDirect3DDevice7_Create(REFCLSID rclsid, glDirect3D7 *glD3D7, dxglDirec
 	if(glDDS7->zbuffer) zbuffer = 1;
 	ZeroMemory(&This->material,sizeof(D3DMATERIAL7));
 	This->lightsmax = 16;
-	This->lights = (glDirect3DLight**) malloc(16*sizeof(glDirect3DLight*));
+	This->lights = (D3D7LIGHT*)malloc(16*sizeof(D3D7LIGHT));
 	if(!This->lights)
 	{
 		free(This->materials);
@@ -409,15 +426,18 @@ HRESULT glDirect3DDevice7_Create(REFCLSID rclsid, glDirect3D7 *glD3D7, dxglDirec
 		*newdev = NULL;
 		TRACE_RET(HRESULT, 23, DDERR_OUTOFMEMORY);
 	}
-	ZeroMemory(This->lights,16*sizeof(glDirect3DLight*));
-	memset(This->gllights,0xff,8*sizeof(int));
+	ZeroMemory(This->lights,16*sizeof(D3D7LIGHT));
+	memset(This->gllights,0xff,LIGHTS_MAX*sizeof(int));
 	memset(This->gltextures,0,8*sizeof(GLuint));
 	ZeroMemory(&This->stats,sizeof(D3DSTATS));
 	This->stats.dwSize = sizeof(D3DSTATS);
+	GLCAPS glcaps;
+	glRenderer_GetCaps(This->renderer, &glcaps);
 	This->d3ddesc.dwMaxTextureWidth = This->d3ddesc.dwMaxTextureHeight =
-		This->d3ddesc.dwMaxTextureRepeat = This->d3ddesc.dwMaxTextureAspectRatio = This->renderer->gl_caps.TextureMax;
+		This->d3ddesc.dwMaxTextureRepeat = This->d3ddesc.dwMaxTextureAspectRatio = glcaps.TextureMax;
 	This->d3ddesc3.dwMaxTextureWidth = This->d3ddesc3.dwMaxTextureHeight =
-		This->d3ddesc3.dwMaxTextureRepeat = This->d3ddesc3.dwMaxTextureAspectRatio = This->renderer->gl_caps.TextureMax;
+		This->d3ddesc3.dwMaxTextureRepeat = This->d3ddesc3.dwMaxTextureAspectRatio = glcaps.TextureMax;
+	This->d3ddesc.dwMaxActiveLights = This->d3ddesc3.dlcLightingCaps.dwNumLights = glcaps.MaxLights;
 	This->scalex = This->scaley = 0;
 	This->mhWorld = This->mhView = This->mhProjection = 0;
 	glRenderer_InitD3D(This->renderer,zbuffer,glDDS7->ddsd.dwWidth,glDDS7->ddsd.dwHeight);
@@ -434,8 +454,6 @@ void glDirect3DDevice7_Destroy(glDirect3DDevice7 *This)
 {
 	DWORD i;
 	TRACE_ENTER(1,14,This);
-	for(i = 0; i < This->lightsmax; i++)
-		if(This->lights[i]) delete This->lights[i];
 	free(This->lights);
 	for(i = 0; i < 8; i++)
 		if(This->texstages[i].surface) dxglDirectDrawSurface7_Release(This->texstages[i].surface);
@@ -467,6 +485,12 @@ void glDirect3DDevice7_Destroy(glDirect3DDevice7 *This)
 	free(This->materials);
 	free(This->textures);
 	if(This->matrices) free(This->matrices);
+	if(This->immediate.vertices) free(This->immediate.vertices);
+	if(This->immediate.indices) free(This->immediate.indices);
+	for(i = 0; i < This->stateblockcount; i++)
+		if(This->stateblocks[i]) glDirect3DStateBlock_Destroy(This->stateblocks[i]);
+	if(This->stateblocks) free(This->stateblocks);
+	if(This->recordingblock) glDirect3DStateBlock_Destroy(This->recordingblock);
 	if (This->glD3DDev3) free(This->glD3DDev3);
 	if (This->glD3DDev2) free(This->glD3DDev2);
 	if (This->glD3DDev1) free(This->glD3DDev1);
@@ -476,18 +500,46 @@ void glDirect3DDevice7_Destroy(glDirect3DDevice7 *This)
 	TRACE_EXIT(0,0);
 }
 
-int ExpandLightBuffer(glDirect3DLight ***lights, DWORD *maxlights, DWORD newmax)
+int ExpandLightBuffer(D3D7LIGHT **lights, DWORD *maxlights, DWORD newmax)
 {
-	if(newmax < *maxlights) return 1;
-	glDirect3DLight **tmp = (glDirect3DLight**)realloc(*lights,newmax*sizeof(glDirect3DLight*));
+	if(newmax <= *maxlights) return 1;
+	// Grow geometrically so lights set at rising indices don't reallocate every time
+	if(newmax < *maxlights * 2) newmax = *maxlights * 2;
+	D3D7LIGHT *tmp = (D3D7LIGHT*)realloc(*lights,newmax*sizeof(D3D7LIGHT));
 	if(!tmp) return 0;
 	*lights = tmp;
-	for(DWORD i = *maxlights; i < newmax; i++)
-		(*lights)[i] = NULL;
+	ZeroMemory(&tmp[*maxlights],(newmax - *maxlights)*sizeof(D3D7LIGHT));
 	*maxlights = newmax;
 	return 1;
 }
 
+/**
+  * Returns the slot of a light index, growing the light pool if needed.  A
+  * light enabled before it is set is a white directional light pointing
+  * along +Z, as in Direct3D.
+  * @param This
+  *  Pointer to glDirect3DDevice7 object
+  * @param index
+  *  Light index set by the application
+  * @return
+  *  Pointer to the light slot, or NULL if the pool could not be grown
+  */
+static D3D7LIGHT *glDirect3DDevice7__UseLight(glDirect3DDevice7 *This, DWORD index)
+{
+	D3D7LIGHT *slot;
+	if(!ExpandLightBuffer(&This->lights,&This->lightsmax,index+1)) return NULL;
+	slot = &This->lights[index];
+	if(!slot->active)
+	{
+		ZeroMemory(&slot->light,sizeof(D3DLIGHT7));
+		slot->light.dltType = D3DLIGHT_DIRECTIONAL;
+		slot->light.dcvDiffuse.r = slot->light.dcvDiffuse.g = slot->light.dcvDiffuse.b = 1.0f;
+		slot->light.dvDirection.z = 1.0f;
+		slot->active = TRUE;
+	}
+	return slot;
+}
+
 HRESULT WINAPI glDirect3DDevice7_QueryInterface(glDirect3DDevice7 *This, REFIID riid, void** ppvObj)
 {
 	TRACE_ENTER(3,14,This,24,&riid,14,ppvObj);
@@ -595,13 +647,45 @@ ULONG glDirect3DDevice7_ReleaseInternal(glDirect3DDevice7 *This)
 	return ret;
 }
 
+static HRESULT glDirect3DDevice7_AddStateBlock(glDirect3DDevice7 *This, glDirect3DStateBlock *block, LPDWORD lpdwBlockHandle)
+{
+	DWORD i;
+	for(i = 0; i < This->stateblockcount; i++)
+	{
+		if(!This->stateblocks[i])
+		{
+			This->stateblocks[i] = block;
+			*lpdwBlockHandle = i + 1;
+			return D3D_OK;
+		}
+	}
+	if(This->stateblockcount >= This->maxstateblocks)
+	{
+		glDirect3DStateBlock **tmp = (glDirect3DStateBlock**)realloc(This->stateblocks,
+			(This->maxstateblocks + 16) * sizeof(glDirect3DStateBlock*));
+		if(!tmp) return DDERR_OUTOFMEMORY;
+		This->stateblocks = tmp;
+		This->maxstateblocks += 16;
+	}
+	This->stateblocks[This->stateblockcount++] = block;
+	*lpdwBlockHandle = This->stateblockcount;
+	return D3D_OK;
+}
+static glDirect3DStateBlock *glDirect3DDevice7_GetStateBlock(glDirect3DDevice7 *This, DWORD dwBlockHandle)
+{
+	if(!dwBlockHandle || (dwBlockHandle > This->stateblockcount)) return NULL;
+	return This->stateblocks[dwBlockHandle - 1];
+}
 HRESULT WINAPI glDirect3DDevice7_ApplyStateBlock(glDirect3DDevice7 *This, DWORD dwBlockHandle)
 {
 	TRACE_ENTER(2,14,This,9,dwBlockHandle);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	FIXME("glDirect3DDevice7_ApplyStateBlock: stub");
-	TRACE_EXIT(23,DDERR_GENERIC);
-	ERR(DDERR_GENERIC);
+	if(This->recordingblock) TRACE_RET(HRESULT,23,D3DERR_INBEGINSTATEBLOCK);
+	glDirect3DStateBlock *block = glDirect3DDevice7_GetStateBlock(This,dwBlockHandle);
+	if(!block) TRACE_RET(HRESULT,23,D3DERR_INVALIDSTATEBLOCK);
+	glDirect3DStateBlock_Apply(block,This);
+	TRACE_EXIT(23,D3D_OK);
+	return D3D_OK;
 }
 HRESULT WINAPI glDirect3DDevice7_BeginScene(glDirect3DDevice7 *This)
 {
@@ -616,25 +700,36 @@ HRESULT WINAPI glDirect3DDevice7_BeginStateBlock(glDirect3DDevice7 *This)
 {
 	TRACE_ENTER(1,14,This);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	FIXME("glDirect3DDevice7_BeginStateBlock: stub");
-	TRACE_EXIT(23,D3D_OK);
-	ERR(DDERR_GENERIC);
+	if(This->recordingblock) TRACE_RET(HRESULT,23,D3DERR_INBEGINSTATEBLOCK);
+	HRESULT error = glDirect3DStateBlock_Create(&This->recordingblock);
+	TRACE_EXIT(23,error);
+	return error;
 }
 HRESULT WINAPI glDirect3DDevice7_CaptureStateBlock(glDirect3DDevice7 *This, DWORD dwBlockHandle)
 {
 	TRACE_ENTER(2,14,This,9,dwBlockHandle);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	FIXME("glDirect3DDevice7_CaptureStateBlock: stub");
+	if(This->recordingblock) TRACE_RET(HRESULT,23,D3DERR_INBEGINSTATEBLOCK);
+	glDirect3DStateBlock *block = glDirect3DDevice7_GetStateBlock(This,dwBlockHandle);
+	if(!block) TRACE_RET(HRESULT,23,D3DERR_INVALIDSTATEBLOCK);
+	glDirect3DStateBlock_Capture(block,This);
 	TRACE_EXIT(23,D3D_OK);
-	ERR(DDERR_GENERIC);
+	return D3D_OK;
 }
 HRESULT WINAPI glDirect3DDevice7_CreateStateBlock(glDirect3DDevice7 *This, D3DSTATEBLOCKTYPE d3dsbtype, LPDWORD lpdwBlockHandle)
 {
 	TRACE_ENTER(3,14,This,9,d3dsbtype,14,lpdwBlockHandle);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	FIXME("glDirect3DDevice7::CreateStateBlock: stub");
-	TRACE_EXIT(23,D3D_OK);
-	ERR(DDERR_GENERIC);
+	if(!lpdwBlockHandle) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	if(This->recordingblock) TRACE_RET(HRESULT,23,D3DERR_INBEGINSTATEBLOCK);
+	glDirect3DStateBlock *block;
+	HRESULT error = glDirect3DStateBlock_CreateType(This,d3dsbtype,&block);
+	if(FAILED(error)) TRACE_RET(HRESULT,23,error);
+	error = glDirect3DDevice7_AddStateBlock(This,block,lpdwBlockHandle);
+	if(FAILED(error)) glDirect3DStateBlock_Destroy(block);
+	else TRACE_VAR("*lpdwBlockHandle",9,*lpdwBlockHandle);
+	TRACE_EXIT(23,error);
+	return error;
 }
 HRESULT WINAPI glDirect3DDevice7_Clear(glDirect3DDevice7 *This, DWORD dwCount, LPD3DRECT lpRects, DWORD dwFlags, DWORD dwColor, D3DVALUE dvZ, DWORD dwStencil)
 {
@@ -648,6 +743,7 @@ HRESULT WINAPI glDirect3DDevice7_Clear(glDirect3DDevice7 *This, DWORD dwCount, L
 	cmd.dwColor = dwColor;
 	cmd.dvZ = dvZ;
 	cmd.dwStencil = dwStencil;
+	glDirect3DDevice7_FlushState(This);
 	cmd.target = This->glDDS7->texture;
 	cmd.targetlevel = This->glDDS7->miplevel;
 	if (This->glDDS7->zbuffer)
@@ -663,6 +759,172 @@ HRESULT WINAPI glDirect3DDevice7_Clear(glDirect3DDevice7 *This, DWORD dwCount, L
 	TRACE_RET(HRESULT,23,glRenderer_Clear(This->renderer,&cmd));
 }
 
+/**
+  * Extracts the frustum planes of the world, view and projection matrices if
+  * any of them changed since the planes were last extracted.
+  * @param This
+  *  Pointer to glDirect3DDevice7 object
+  */
+static void glDirect3DDevice7_UpdateFrustum(glDirect3DDevice7 *This)
+{
+	// The planes only change with the world, view or projection matrix
+	if(!This->frustum_dirty) return;
+	if(This->transform_dirty) glDirect3DDevice7_UpdateTransform(This);
+	Matrix_ExtractFrustum(This->matTransform,This->frustum);
+	This->frustum_dirty = false;
+}
+
+/**
+  * Checks if a box in model space lies entirely outside of the view frustum.
+  * @param This
+  *  Pointer to glDirect3DDevice7 object
+  * @param min
+  *  Lowest coordinates of the box
+  * @param max
+  *  Highest coordinates of the box
+  * @return
+  *  TRUE if nothing inside the box can be visible
+  */
+static BOOL glDirect3DDevice7_CullBounds(glDirect3DDevice7 *This, const float *min, const float *max)
+{
+	D3DVECTOR center;
+	D3DVALUE radius;
+	DWORD result;
+	center.x = (min[0] + max[0]) * 0.5f;
+	center.y = (min[1] + max[1]) * 0.5f;
+	center.z = (min[2] + max[2]) * 0.5f;
+	radius = 0.5f * (D3DVALUE)sqrt(((max[0] - min[0]) * (max[0] - min[0])) + ((max[1] - min[1]) * (max[1] - min[1])) +
+		((max[2] - min[2]) * (max[2] - min[2])));
+	glDirect3DDevice7_UpdateFrustum(This);
+	Matrix_SphereVisibility(This->frustum,&center,&radius,1,&result);
+	return (result & D3DSTATUS_CLIPINTERSECTIONALL) ? TRUE : FALSE;
+}
+
+/**
+  * Adds a draw to the clip status, as if the vertices inside a box in model
+  * space were transformed.  Only the corners of the box are projected, so the
+  * flags and extents are conservative instead of exact.
+  * @param This
+  *  Pointer to glDirect3DDevice7 object
+  * @param min
+  *  Lowest coordinates of the box
+  * @param max
+  *  Highest coordinates of the box
+  * @param extents
+  *  FALSE to leave the extents unchanged
+  */
+static void glDirect3DDevice7_AddClipStatus(glDirect3DDevice7 *This, const float *min, const float *max, BOOL extents)
+{
+	GLfloat corners[8][3];
+	GLfloat out[8][4];
+	GLfloat lo[3], hi[3];
+	MATRIXVIEWPORT vp;
+	DWORD clipunion, clipintersection, outside;
+	D3DRECT extent;
+	int i, j;
+	for(i = 0; i < 8; i++)
+	{
+		corners[i][0] = (i & 1) ? max[0] : min[0];
+		corners[i][1] = (i & 2) ? max[1] : min[1];
+		corners[i][2] = (i & 4) ? max[2] : min[2];
+	}
+	vp.minx = vp.miny = -1.0f;
+	vp.maxx = vp.maxy = 1.0f;
+	vp.scalex = (GLfloat)This->viewport.dwWidth / 2.0f;
+	vp.offsetx = (GLfloat)This->viewport.dwX + vp.scalex;
+	vp.scaley = -(GLfloat)This->viewport.dwHeight / 2.0f;
+	vp.offsety = (GLfloat)This->viewport.dwY - vp.scaley;
+	if(This->transform_dirty) glDirect3DDevice7_UpdateTransform(This);
+	Matrix_ProjectPoints(This->matTransform,&vp,&corners[0][0],3*sizeof(GLfloat),&out[0][0],4*sizeof(GLfloat),
+		NULL,8,TRUE,&clipunion,&clipintersection,&extent);
+	// The union flags are the clip flags, the intersection flags are shifted above them
+	This->clipstatus.dwStatus |= clipunion;
+	outside = clipintersection;
+	if(!This->clipstatusreset) clipintersection &= (This->clipstatus.dwStatus & D3DSTATUS_CLIPINTERSECTIONALL) >> 12;
+	This->clipstatus.dwStatus = (This->clipstatus.dwStatus & ~D3DSTATUS_CLIPINTERSECTIONALL) | (clipintersection << 12);
+	This->clipstatus.dwFlags |= D3DCLIPSTATUS_STATUS;
+	This->clipstatusreset = FALSE;
+	// Boxes outside of one edge add nothing, ones crossing an edge may cover the whole viewport
+	if(!extents || outside) return;
+	if(clipunion)
+	{
+		lo[0] = (GLfloat)This->viewport.dwX;
+		hi[0] = (GLfloat)(This->viewport.dwX + This->viewport.dwWidth);
+		lo[1] = (GLfloat)This->viewport.dwY;
+		hi[1] = (GLfloat)(This->viewport.dwY + This->viewport.dwHeight);
+		lo[2] = 0.0f;
+		hi[2] = 1.0f;
+	}
+	else
+	{
+		for(j = 0; j < 3; j++)
+			lo[j] = hi[j] = out[0][j];
+		for(i = 1; i < 8; i++)
+		{
+			for(j = 0; j < 3; j++)
+			{
+				if(out[i][j] < lo[j]) lo[j] = out[i][j];
+				if(out[i][j] > hi[j]) hi[j] = out[i][j];
+			}
+		}
+	}
+	if(!(This->clipstatus.dwFlags & D3DCLIPSTATUS_EXTENTS2))
+	{
+		This->clipstatus.minx = lo[0];
+		This->clipstatus.maxx = hi[0];
+		This->clipstatus.miny = lo[1];
+		This->clipstatus.maxy = hi[1];
+		This->clipstatus.minz = lo[2];
+		This->clipstatus.maxz = hi[2];
+		This->clipstatus.dwFlags |= D3DCLIPSTATUS_EXTENTS2;
+		return;
+	}
+	if(lo[0] < This->clipstatus.minx) This->clipstatus.minx = lo[0];
+	if(hi[0] > This->clipstatus.maxx) This->clipstatus.maxx = hi[0];
+	if(lo[1] < This->clipstatus.miny) This->clipstatus.miny = lo[1];
+	if(hi[1] > This->clipstatus.maxy) This->clipstatus.maxy = hi[1];
+	if(lo[2] < This->clipstatus.minz) This->clipstatus.minz = lo[2];
+	if(hi[2] > This->clipstatus.maxz) This->clipstatus.maxz = hi[2];
+}
+
+/**
+  * Updates the clip status with the bounds of the vertices of a draw.  Vertex
+  * buffers optimized in place supply their bounds, other draws find theirs
+  * from the untransformed positions.
+  * @param This
+  *  Pointer to glDirect3DDevice7 object
+  * @param dwVertexTypeDesc
+  *  Vertex format of the draw
+  * @param lpvVertices
+  *  Vertices of the draw, or a D3DDRAWPRIMITIVESTRIDEDDATA if strided is TRUE
+  * @param buffer
+  *  Vertex buffer the vertices are in, or NULL
+  * @param strided
+  *  TRUE if lpvVertices points to strided data
+  * @param dwVertexCount
+  *  Number of vertices
+  * @param dwFlags
+  *  Flags of the draw
+  */
+static void glDirect3DDevice7_UpdateClipStatus(glDirect3DDevice7 *This, DWORD dwVertexTypeDesc, LPVOID lpvVertices,
+	VertexBuffer *buffer, BOOL strided, DWORD dwVertexCount, DWORD dwFlags)
+{
+	VERTEXSTREAMS streams;
+	float min[3], max[3];
+	// Pre-transformed vertices skip clipping, so they never change the status
+	if((dwVertexTypeDesc & D3DFVF_POSITION_MASK) == D3DFVF_XYZRHW) return;
+	if(buffer && buffer->hasbounds)
+		glDirect3DDevice7_AddClipStatus(This,buffer->boundsmin,buffer->boundsmax,!(dwFlags & D3DDP_DONOTUPDATEEXTENTS));
+	else
+	{
+		if(strided) VertexProc_SetupStridedStreams(dwVertexTypeDesc,(D3DDRAWPRIMITIVESTRIDEDDATA*)lpvVertices,&streams);
+		else VertexProc_SetupStreams(dwVertexTypeDesc,(BYTE*)lpvVertices,
+			glDirect3DVertexBuffer7_GetVertexSize(dwVertexTypeDesc),&streams);
+		if(VertexProc_GetBounds(&streams,dwVertexCount,min,max))
+			glDirect3DDevice7_AddClipStatus(This,min,max,!(dwFlags & D3DDP_DONOTUPDATEEXTENTS));
+	}
+}
+
 // ComputeSphereVisibility based on modified code from the Wine project, subject
 // to the following license terms:
 /*
@@ -685,82 +947,15 @@ HRESULT WINAPI glDirect3DDevice7_Clear(glDirect3DDevice7 *This, DWORD dwCount, L
 * License along with this library; if not, write to the Free Software
 * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
 */
-static DWORD in_plane(UINT plane, D3DVECTOR normal, D3DVALUE origin_plane, D3DVECTOR center, D3DVALUE radius)
-{
-	float distance, norm;
-
-	norm = sqrtf(normal.x * normal.x + normal.y * normal.y + normal.z * normal.z);
-	distance = (origin_plane + normal.x * center.x + normal.y * center.y + normal.z * center.z) / norm;
-
-	if (fabs(distance) < radius) return D3DSTATUS_CLIPUNIONLEFT << plane;
-	if (distance < -radius) return (D3DSTATUS_CLIPUNIONLEFT | D3DSTATUS_CLIPINTERSECTIONLEFT) << plane;
-	return 0;
-}
-
-
 HRESULT WINAPI glDirect3DDevice7_ComputeSphereVisibility(glDirect3DDevice7 *This, LPD3DVECTOR lpCenters, LPD3DVALUE lpRadii, DWORD dwNumSpheres,
 	DWORD dwFlags, LPDWORD lpdwReturnValues)
 {
-	D3DMATRIX m, temp;
-	D3DVALUE origin_plane[6];
-	D3DVECTOR vec[6];
-	HRESULT hr;
-	UINT i, j;
-
 	TRACE_ENTER(6,14,This,14,lpCenters,14,lpRadii,8,dwNumSpheres,9,dwFlags,14,lpdwReturnValues);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	hr = glDirect3DDevice7_GetTransform(This, D3DTRANSFORMSTATE_WORLD, &m);
-	if (hr != DD_OK) return DDERR_INVALIDPARAMS;
-	hr = glDirect3DDevice7_GetTransform(This, D3DTRANSFORMSTATE_VIEW, &temp);
-	if (hr != DD_OK) return DDERR_INVALIDPARAMS;
-	multiply_matrix((wined3d_matrix*)&m, (wined3d_matrix*)&temp, (wined3d_matrix*)&m);
-
-	hr = glDirect3DDevice7_GetTransform(This, D3DTRANSFORMSTATE_PROJECTION, &temp);
-	if (hr != DD_OK) return DDERR_INVALIDPARAMS;
-	multiply_matrix((wined3d_matrix*)&m, (wined3d_matrix*)&temp, (wined3d_matrix*)&m);
-
-	/* Left plane */
-	vec[0].x = m._14 + m._11;
-	vec[0].y = m._24 + m._21;
-	vec[0].z = m._34 + m._31;
-	origin_plane[0] = m._44 + m._41;
-
-	/* Right plane */
-	vec[1].z = m._14 - m._11;
-	vec[1].y = m._24 - m._21;
-	vec[1].z = m._34 - m._31;
-	origin_plane[1] = m._44 - m._41;
-
-	/* Top plane */
-	vec[2].x = m._14 - m._12;
-	vec[2].y = m._24 - m._22;
-	vec[2].z = m._34 - m._32;
-	origin_plane[2] = m._44 - m._42;
-
-	/* Bottom plane */
-	vec[3].x = m._14 + m._12;
-	vec[3].y = m._24 + m._22;
-	vec[3].z = m._34 + m._32;
-	origin_plane[3] = m._44 + m._42;
-
-	/* Front plane */
-	vec[4].x = m._13;
-	vec[4].y = m._23;
-	vec[4].z = m._33;
-	origin_plane[4] = m._43;
-
-	/* Back plane*/
-	vec[5].x = m._14 - m._13;
-	vec[5].y = m._24 - m._23;
-	vec[5].z = m._34 - m._33;
-	origin_plane[5] = m._44 - m._43;
-
-	for (i = 0; i < dwNumSpheres; ++i)
-	{
-		lpdwReturnValues[i] = 0;
-		for (j = 0; j < 6; ++j)
-			lpdwReturnValues[i] |= in_plane(j, vec[j], origin_plane[j], lpCenters[i], lpRadii[i]);
-	}
+	if(!dwNumSpheres) TRACE_RET(HRESULT,23,D3D_OK);
+	if(!lpCenters || !lpRadii || !lpdwReturnValues) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	glDirect3DDevice7_UpdateFrustum(This);
+	Matrix_SphereVisibility(This->frustum,lpCenters,lpRadii,dwNumSpheres,lpdwReturnValues);
 	TRACE_EXIT(23, D3D_OK);
 	return D3D_OK;
 }
@@ -768,9 +963,13 @@ HRESULT WINAPI glDirect3DDevice7_DeleteStateBlock(glDirect3DDevice7 *This, DWORD
 {
 	TRACE_ENTER(2,14,This,9,dwBlockHandle);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	FIXME("glDirect3DDevice7_DeleteStateBlock: stub");
-	TRACE_EXIT(23,DDERR_GENERIC);
-	ERR(DDERR_GENERIC);
+	if(This->recordingblock) TRACE_RET(HRESULT,23,D3DERR_INBEGINSTATEBLOCK);
+	glDirect3DStateBlock *block = glDirect3DDevice7_GetStateBlock(This,dwBlockHandle);
+	if(!block) TRACE_RET(HRESULT,23,D3DERR_INVALIDSTATEBLOCK);
+	glDirect3DStateBlock_Destroy(block);
+	This->stateblocks[dwBlockHandle - 1] = NULL;
+	TRACE_EXIT(23,D3D_OK);
+	return D3D_OK;
 }
 
 void glDirect3DDevice7_SetArraySize(glDirect3DDevice7 *This, DWORD size, DWORD vertex, DWORD texcoord)
@@ -831,9 +1030,9 @@ void glDirect3DDevice7_SetArraySize(glDirect3DDevice7 *This, DWORD size, DWORD v
 	{
 		if(This->gllights[i] != -1)
 		{
-			if(This->lights[This->gllights[i]]->light.dltType != D3DLIGHT_DIRECTIONAL)
+			if(This->lights[This->gllights[i]].light.dltType != D3DLIGHT_DIRECTIONAL)
 				shader |= (1i64 << (38+lightindex));
-			if(This->lights[This->gllights[i]]->light.dltType == D3DLIGHT_SPOT)
+			if(This->lights[This->gllights[i]].light.dltType == D3DLIGHT_SPOT)
 				shader |= (1i64 << (51+lightindex));
 			lightindex++;
 		}
@@ -892,109 +1091,19 @@ void glDirect3DDevice7_SetArraySize(glDirect3DDevice7 *This, DWORD size, DWORD v
 	return shader;
 }*/
 
-HRESULT glDirect3DDevice7_fvftoglvertex(glDirect3DDevice7 *This, DWORD dwVertexTypeDesc,LPDWORD vertptr)
-{
-	TRACE_ENTER(3,14,This,9,dwVertexTypeDesc,14,vertptr);
-	int i;
-	int texformats1[8];
-	int ptr = 0;
-	if((dwVertexTypeDesc & D3DFVF_XYZ) && (dwVertexTypeDesc & D3DFVF_XYZRHW))
-		TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
-	if(dwVertexTypeDesc & D3DFVF_XYZ)
-	{
-		This->vertdata[0].data = vertptr;
-		This->vertdata[1].data = NULL;
-		ptr += 3;
-		if(dwVertexTypeDesc & D3DFVF_RESERVED1) ptr++;
-	}
-	else if(dwVertexTypeDesc & D3DFVF_XYZRHW)
-	{
-		This->vertdata[0].data = vertptr;
-		This->vertdata[1].data = &vertptr[3];
-		ptr += 4;
-	}
-	else TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
-	for(i = 0; i < 5; i++)
-		This->vertdata[i+2].data = NULL;
-	if(((dwVertexTypeDesc >> 1) & 7) >= 3)
-	{
-		for(i = 0; i < (signed)(((dwVertexTypeDesc >> 1) & 7) - 2); i++)
-		{
-			This->vertdata[((dwVertexTypeDesc >> 1) & 7)].data = &vertptr[ptr];
-			ptr++;
-		}
-	}
-	if(dwVertexTypeDesc & D3DFVF_NORMAL)
-	{
-		This->vertdata[7].data = &vertptr[ptr];
-		ptr += 3;
-	}
-	else This->vertdata[7].data = NULL;
-	if(dwVertexTypeDesc & D3DFVF_DIFFUSE)
-	{
-		This->vertdata[8].data = &vertptr[ptr];
-		ptr++;
-	}
-	else This->vertdata[8].data = NULL;
-	if(dwVertexTypeDesc & D3DFVF_SPECULAR)
-	{
-		This->vertdata[9].data = &vertptr[ptr];
-		ptr++;
-	}
-	else This->vertdata[9].data = NULL;
-	for(i = 0; i < 8; i++)
-		This->vertdata[i+10].data = NULL;
-	int numtex = (dwVertexTypeDesc&D3DFVF_TEXCOUNT_MASK)>>D3DFVF_TEXCOUNT_SHIFT;
-	for(i = 0; i < 8; i++)
-	{
-		This->vertdata[i+10].data = &vertptr[ptr];
-		if(i >= numtex) texformats1[i] = -1;
-		else texformats1[i] = (dwVertexTypeDesc>>(16+(2*i))&3);
-		switch(texformats1[i])
-		{
-		case 0: // st
-			ptr += 2;
-			This->texformats[i] = 2;
-			break;
-		case 1: // str
-			ptr += 3;
-			This->texformats[i] = 3;
-			break;
-		case 2: // strq
-			ptr += 4;
-			This->texformats[i] = 4;
-			break;
-		case 3: // s
-			ptr++;
-			This->texformats[i] = 1;
-			break;
-		default:
-			This->texformats[i] = 2;
-			break;
-		}
-	}
-	int stride = ptr*4;
-	for(i = 0; i < 17; i++)
-		This->vertdata[i].stride = stride;
-	TRACE_EXIT(23,D3D_OK);
-	return D3D_OK;
-}
-
-HRESULT WINAPI glDirect3DDevice7_DrawIndexedPrimitive(glDirect3DDevice7 *This, D3DPRIMITIVETYPE d3dptPrimitiveType, DWORD dwVertexTypeDesc,
-	LPVOID lpvVertices, DWORD dwVertexCount, LPWORD lpwIndices, DWORD dwIndexCount, DWORD dwFlags)
+static HRESULT glDirect3DDevice7_DrawBuffer(glDirect3DDevice7 *This, D3DPRIMITIVETYPE d3dptPrimitiveType, DWORD dwVertexTypeDesc,
+	LPVOID lpvVertices, VertexBuffer *buffer, BOOL strided, DWORD dwVertexCount, LPWORD lpwIndices, DWORD dwIndexCount, DWORD dwFlags)
 {
 	RenderTarget target;
-	TRACE_ENTER(8,9,d3dptPrimitiveType,9,dwVertexTypeDesc,14,lpvVertices,8,dwVertexCount,14,lpwIndices,8,dwIndexCount,9,dwFlags);
-	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	if(!This->inscene) TRACE_RET(HRESULT,23,D3DERR_SCENE_NOT_IN_SCENE);
-	HRESULT err = glDirect3DDevice7_fvftoglvertex(This,dwVertexTypeDesc,(LPDWORD)lpvVertices);
 	if(lpwIndices) AddStats(d3dptPrimitiveType,dwIndexCount,&This->stats);
 	else AddStats(d3dptPrimitiveType,dwVertexCount,&This->stats);
-	if(err != D3D_OK) TRACE_RET(HRESULT,23,err);
+	if(!lpvVertices || !(dwVertexTypeDesc & D3DFVF_POSITION_MASK)) return DDERR_INVALIDPARAMS;
+	if(This->clipstatusused) glDirect3DDevice7_UpdateClipStatus(This,dwVertexTypeDesc,lpvVertices,buffer,strided,
+		dwVertexCount,dwFlags);
 	target.target = This->glDDS7->texture;
 	target.level = This->glDDS7->miplevel;
-	//target.mulx = This->glDDS7->mulx;
-	//target.muly = This->glDDS7->muly;
+	// Set by the renderer to the scale of the framebuffer it draws to
+	target.mulx = target.muly = 1.0f;
 	if (This->glDDS7->zbuffer)
 	{
 		target.zbuffer = This->glDDS7->zbuffer->texture;
@@ -1005,26 +1114,48 @@ HRESULT WINAPI glDirect3DDevice7_DrawIndexedPrimitive(glDirect3DDevice7 *This, D
 		target.zbuffer = NULL;
 		target.zlevel = 0;
 	}
-	TRACE_RET(HRESULT,23,glRenderer_DrawPrimitives(This->renderer,&target,setdrawmode(d3dptPrimitiveType), This->vertdata, This->texformats,
-		dwVertexCount,lpwIndices,dwIndexCount,dwFlags));
+	glDirect3DDevice7_FlushState(This);
+	return glRenderer_DrawPrimitives(This->renderer,&target,setdrawmode(d3dptPrimitiveType),dwVertexTypeDesc,lpvVertices,
+		buffer,strided,dwVertexCount,lpwIndices,dwIndexCount,dwFlags);
+}
+HRESULT WINAPI glDirect3DDevice7_DrawIndexedPrimitive(glDirect3DDevice7 *This, D3DPRIMITIVETYPE d3dptPrimitiveType, DWORD dwVertexTypeDesc,
+	LPVOID lpvVertices, DWORD dwVertexCount, LPWORD lpwIndices, DWORD dwIndexCount, DWORD dwFlags)
+{
+	TRACE_ENTER(8,9,d3dptPrimitiveType,9,dwVertexTypeDesc,14,lpvVertices,8,dwVertexCount,14,lpwIndices,8,dwIndexCount,9,dwFlags);
+	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
+	if(!This->inscene) TRACE_RET(HRESULT,23,D3DERR_SCENE_NOT_IN_SCENE);
+	TRACE_RET(HRESULT,23,glDirect3DDevice7_DrawBuffer(This,d3dptPrimitiveType,dwVertexTypeDesc,lpvVertices,NULL,
+		FALSE,dwVertexCount,lpwIndices,dwIndexCount,dwFlags));
 }
 HRESULT WINAPI glDirect3DDevice7_DrawIndexedPrimitiveStrided(glDirect3DDevice7 *This, D3DPRIMITIVETYPE d3dptPrimitiveType, DWORD dwVertexTypeDesc,
 	LPD3DDRAWPRIMITIVESTRIDEDDATA lpvVertexArray, DWORD dwVertexCount, LPWORD lpwIndices, DWORD dwIndexCount, DWORD dwFlags)
 {
 	TRACE_ENTER(8,14,This,9,d3dptPrimitiveType,9,dwVertexTypeDesc,14,lpvVertexArray,8,dwVertexCount,14,lpwIndices,8,dwIndexCount,9,dwFlags);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	FIXME("glDirect3DDevice7_DrawIndexedPrimitiveStrided: stub");
-	TRACE_EXIT(23,DDERR_GENERIC);
-	ERR(DDERR_GENERIC);
+	if(!This->inscene) TRACE_RET(HRESULT,23,D3DERR_SCENE_NOT_IN_SCENE);
+	TRACE_RET(HRESULT,23,glDirect3DDevice7_DrawBuffer(This,d3dptPrimitiveType,dwVertexTypeDesc,lpvVertexArray,NULL,
+		TRUE,dwVertexCount,lpwIndices,dwIndexCount,dwFlags));
 }
 HRESULT WINAPI glDirect3DDevice7_DrawIndexedPrimitiveVB(glDirect3DDevice7 *This, D3DPRIMITIVETYPE d3dptPrimitiveType, LPDIRECT3DVERTEXBUFFER7 lpd3dVertexBuffer,
 	DWORD dwStartVertex, DWORD dwNumVertices, LPWORD lpwIndices, DWORD dwIndexCount, DWORD dwFlags)
 {
 	TRACE_ENTER(8,14,This,9,d3dptPrimitiveType,14,lpd3dVertexBuffer,8,dwStartVertex,8,dwNumVertices,9,lpwIndices,8,dwIndexCount,9,dwFlags);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	FIXME("glDirect3DDevice7_DrawIndexedPrimitiveVB: stub");
-	TRACE_EXIT(23,DDERR_GENERIC);
-	ERR(DDERR_GENERIC);
+	if(!lpd3dVertexBuffer) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	if(!This->inscene) TRACE_RET(HRESULT,23,D3DERR_SCENE_NOT_IN_SCENE);
+	glDirect3DVertexBuffer7 *vb = (glDirect3DVertexBuffer7*)lpd3dVertexBuffer;
+	if(vb->locked) TRACE_RET(HRESULT,23,D3DERR_VERTEXBUFFERLOCKED);
+	if(dwStartVertex >= vb->vbdesc.dwNumVertices) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	if((dwNumVertices == (DWORD)-1) || (dwNumVertices > vb->vbdesc.dwNumVertices - dwStartVertex))
+		dwNumVertices = vb->vbdesc.dwNumVertices - dwStartVertex;
+	// Any range of an optimized buffer lies within the bounds of the whole buffer
+	if(vb->buffer.hasbounds && glDirect3DDevice7_CullBounds(This,vb->buffer.boundsmin,vb->buffer.boundsmax))
+	{
+		TRACE_EXIT(23,D3D_OK);
+		return D3D_OK;
+	}
+	TRACE_RET(HRESULT,23,glDirect3DDevice7_DrawBuffer(This,d3dptPrimitiveType,vb->vbdesc.dwFVF,
+		vb->buffer.data+(dwStartVertex*vb->vertexsize),&vb->buffer,FALSE,dwNumVertices,lpwIndices,dwIndexCount,dwFlags));
 }
 HRESULT WINAPI glDirect3DDevice7_DrawPrimitive(glDirect3DDevice7 *This, D3DPRIMITIVETYPE dptPrimitiveType, DWORD dwVertexTypeDesc, LPVOID lpVertices,
 	DWORD dwVertexCount, DWORD dwFlags)
@@ -1039,18 +1170,16 @@ HRESULT WINAPI glDirect3DDevice7_DrawPrimitiveStrided(glDirect3DDevice7 *This, D
 {
 	TRACE_ENTER(6,14,This,9,dptPrimitiveType,9,dwVertexTypeDesc,14,lpVertexArray,8,dwVertexCount,9,dwFlags);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	FIXME("glDirect3DDevice7_DrawPrimitiveStrided: stub");
-	TRACE_EXIT(23,DDERR_GENERIC);
-	ERR(DDERR_GENERIC);
+	TRACE_RET(HRESULT,23,glDirect3DDevice7_DrawIndexedPrimitiveStrided(This,
+		dptPrimitiveType,dwVertexTypeDesc,lpVertexArray,dwVertexCount,NULL,0,dwFlags));
 }
 HRESULT WINAPI glDirect3DDevice7_DrawPrimitiveVB(glDirect3DDevice7 *This, D3DPRIMITIVETYPE d3dptPrimitiveType, LPDIRECT3DVERTEXBUFFER7 lpd3dVertexBuffer,
 	DWORD dwStartVertex, DWORD dwNumVertices, DWORD dwFlags)
 {
 	TRACE_ENTER(5,14,This,9,d3dptPrimitiveType,14,lpd3dVertexBuffer,8,dwStartVertex,8,dwNumVertices,9,dwFlags);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	FIXME("glDirect3DDevice7_DrawPrimitiveVB: stub");
-	TRACE_EXIT(23,DDERR_GENERIC);
-	ERR(DDERR_GENERIC);
+	TRACE_RET(HRESULT,23,glDirect3DDevice7_DrawIndexedPrimitiveVB(This,d3dptPrimitiveType,lpd3dVertexBuffer,
+		dwStartVertex,dwNumVertices,NULL,0,dwFlags));
 }
 HRESULT WINAPI glDirect3DDevice7_EndScene(glDirect3DDevice7 *This)
 {
@@ -1058,6 +1187,7 @@ HRESULT WINAPI glDirect3DDevice7_EndScene(glDirect3DDevice7 *This)
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
 	if(!This->inscene) TRACE_RET(HRESULT,23,D3DERR_SCENE_NOT_IN_SCENE);
 	This->inscene = false;
+	glDirect3DDevice7_FlushState(This);
 	glRenderer_Flush(This->renderer);
 	TRACE_EXIT(23,D3D_OK);
 	return D3D_OK;
@@ -1066,9 +1196,14 @@ HRESULT WINAPI glDirect3DDevice7_EndStateBlock(glDirect3DDevice7 *This, LPDWORD
 {
 	TRACE_ENTER(2,14,This,14,lpdwBlockHandle);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	FIXME("glDirect3DDevice7_EndStateBlock: stub");
-	TRACE_EXIT(23,DDERR_GENERIC);
-	ERR(DDERR_GENERIC);
+	if(!lpdwBlockHandle) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	if(!This->recordingblock) TRACE_RET(HRESULT,23,D3DERR_NOTINBEGINSTATEBLOCK);
+	HRESULT error = glDirect3DDevice7_AddStateBlock(This,This->recordingblock,lpdwBlockHandle);
+	if(FAILED(error)) glDirect3DStateBlock_Destroy(This->recordingblock);
+	else TRACE_VAR("*lpdwBlockHandle",9,*lpdwBlockHandle);
+	This->recordingblock = NULL;
+	TRACE_EXIT(23,error);
+	return error;
 }
 
 // Use EXACTLY one line per entry.  Don't change layout of the list.
@@ -1089,6 +1224,73 @@ const DDPIXELFORMAT limitedtexformats[] =
 static const int END_LIMITEDTEXFORMATS = __LINE__ - 4;
 int numlimitedtexformats;
 
+// Texture formats passed to an enumeration callback
+typedef struct TEXFORMATLIST
+{
+	int count;
+	DDPIXELFORMAT formats[1];
+} TEXFORMATLIST;
+
+// Lists for EnumTextureFormats and EnumTextureFormats2, built on first use
+static TEXFORMATLIST *volatile enumtexformats[2] = { NULL, NULL };
+
+/**
+  * Gets the texture formats reported by one of the texture enumeration
+  * methods.  The list only depends on the LimitTextureFormats setting so it
+  * is filtered once per process.
+  * @param fourcc
+  *  FALSE for the EnumTextureFormats list, TRUE for the EnumTextureFormats2
+  *  list which also excludes FOURCC formats
+  * @return
+  *  Pointer to the list, or NULL if it could not be allocated
+  */
+static const TEXFORMATLIST *GetEnumTexFormats(BOOL fourcc)
+{
+	TEXFORMATLIST *list = enumtexformats[fourcc];
+	const DDPIXELFORMAT *source;
+	int count;
+	BOOL limited;
+	if (list) return list;
+	if (fourcc) limited = (dxglcfg.LimitTextureFormats >= 1);
+	else limited = (dxglcfg.LimitTextureFormats >= 2);
+	if (limited)
+	{
+		numlimitedtexformats = END_LIMITEDTEXFORMATS - START_LIMITEDTEXFORMATS;
+		source = limitedtexformats;
+		count = numlimitedtexformats;
+	}
+	else
+	{
+		source = texformats;
+		count = numtexformats;
+	}
+	list = (TEXFORMATLIST*)malloc(sizeof(TEXFORMATLIST) + count * sizeof(DDPIXELFORMAT));
+	if (!list) return NULL;
+	list->count = 0;
+	for (int i = 0; i < count; i++)
+	{
+		//FIXME: Remove this line after implementing RGB3328 textures
+		if (!limited && (i == 11)) continue;
+		// Exclude Z buffer formats
+		if (source[i].dwFlags & DDPF_ZBUFFER) continue;
+		// Exclude FOURCC formats
+		if (fourcc && (source[i].dwFlags & DDPF_FOURCC)) continue;
+		//FIXME:  Remove these lines after implementing palette textures
+		if (source[i].dwFlags & DDPF_PALETTEINDEXED1) continue;
+		if (source[i].dwFlags & DDPF_PALETTEINDEXED2) continue;
+		if (source[i].dwFlags & DDPF_PALETTEINDEXED4) continue;
+		if (source[i].dwFlags & DDPF_PALETTEINDEXED8) continue;
+		list->formats[list->count++] = source[i];
+	}
+	// Another thread may have built the list at the same time
+	if (InterlockedCompareExchangePointer((PVOID volatile*)&enumtexformats[fourcc], list, NULL))
+	{
+		free(list);
+		list = enumtexformats[fourcc];
+	}
+	return list;
+}
+
 
 HRESULT WINAPI glDirect3DDevice7_EnumTextureFormats(glDirect3DDevice7 *This, LPD3DENUMPIXELFORMATSCALLBACK lpd3dEnumPixelProc, LPVOID lpArg)
 {
@@ -1096,36 +1298,13 @@ HRESULT WINAPI glDirect3DDevice7_EnumTextureFormats(glDirect3DDevice7 *This, LPD
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
 	HRESULT result;
 	DDPIXELFORMAT fmt;
-	if (dxglcfg.LimitTextureFormats >= 2)
-	{
-		numlimitedtexformats = END_LIMITEDTEXFORMATS - START_LIMITEDTEXFORMATS;
-		for (int i = 0; i < numlimitedtexformats; i++)
-		{
-			if (limitedtexformats[i].dwFlags & DDPF_ZBUFFER) continue;
-			//FIXME:  Remove this line after implementing palette textures
-			if (limitedtexformats[i].dwFlags & DDPF_PALETTEINDEXED8) continue;
-			memcpy(&fmt, &limitedtexformats[i], sizeof(DDPIXELFORMAT));
-			result = lpd3dEnumPixelProc(&fmt, lpArg);
-			if (result != D3DENUMRET_OK) TRACE_RET(HRESULT, 23, D3D_OK);
-		}
-	}
-	else
+	const TEXFORMATLIST *list = GetEnumTexFormats(FALSE);
+	if (!list) TRACE_RET(HRESULT, 23, DDERR_OUTOFMEMORY);
+	for (int i = 0; i < list->count; i++)
 	{
-		for (int i = 0; i < numtexformats; i++)
-		{
-			//FIXME: Remove this line after implementing RGB3328 textures
-			if (i == 11) continue;
-			// Exclude Z buffer formats
-			if (texformats[i].dwFlags & DDPF_ZBUFFER) continue;
-			//FIXME:  Remove these lines after implementing palette textures
-			if (texformats[i].dwFlags & DDPF_PALETTEINDEXED1) continue;
-			if (texformats[i].dwFlags & DDPF_PALETTEINDEXED2) continue;
-			if (texformats[i].dwFlags & DDPF_PALETTEINDEXED4) continue;
-			if (texformats[i].dwFlags & DDPF_PALETTEINDEXED8) continue;
-			memcpy(&fmt, &texformats[i], sizeof(DDPIXELFORMAT));
-			result = lpd3dEnumPixelProc(&fmt, lpArg);
-			if (result != D3DENUMRET_OK) TRACE_RET(HRESULT, 23, D3D_OK);
-		}
+		memcpy(&fmt, &list->formats[i], sizeof(DDPIXELFORMAT));
+		result = lpd3dEnumPixelProc(&fmt, lpArg);
+		if (result != D3DENUMRET_OK) TRACE_RET(HRESULT, 23, D3D_OK);
 	}
 	TRACE_EXIT(23,D3D_OK);
 	return D3D_OK;
@@ -1141,39 +1320,13 @@ HRESULT WINAPI glDirect3DDevice7_EnumTextureFormats2(glDirect3DDevice7 *This, LP
 	ddsd.dwSize = sizeof(DDSURFACEDESC);
 	ddsd.dwFlags = DDSD_CAPS | DDSD_PIXELFORMAT;
 	ddsd.ddsCaps.dwCaps = DDSCAPS_TEXTURE;
-	if (dxglcfg.LimitTextureFormats >= 1)
+	const TEXFORMATLIST *list = GetEnumTexFormats(TRUE);
+	if (!list) TRACE_RET(HRESULT, 23, DDERR_OUTOFMEMORY);
+	for (int i = 0; i < list->count; i++)
 	{
-		numlimitedtexformats = END_LIMITEDTEXFORMATS - START_LIMITEDTEXFORMATS;
-		for (int i = 0; i < numlimitedtexformats; i++)
-		{
-			// Exclude FOURCC formats
-			if (limitedtexformats[i].dwFlags & DDPF_FOURCC) continue;
-			//FIXME:  Remove this line after implementing palette textures
-			if (limitedtexformats[i].dwFlags & DDPF_PALETTEINDEXED8) continue;
-			memcpy(&ddsd.ddpfPixelFormat, &limitedtexformats[i], sizeof(DDPIXELFORMAT));
-			result = lpd3dEnumTextureProc(&ddsd, lpArg);
-			if (result != D3DENUMRET_OK) TRACE_RET(HRESULT, 23, D3D_OK);
-		}
-	}
-	else
-	{
-		for (int i = 0; i < numtexformats; i++)
-		{
-			//FIXME: Remove this line after implementing RGB3328 textures
-			if (i == 11) continue;
-			// Exclude Z buffer formats
-			if (texformats[i].dwFlags & DDPF_ZBUFFER) continue;
-			// Exclude FOURCC formats
-			if (texformats[i].dwFlags & DDPF_FOURCC) continue;
-			//FIXME:  Remove these lines after implementing palette textures
-			if (texformats[i].dwFlags & DDPF_PALETTEINDEXED1) continue;
-			if (texformats[i].dwFlags & DDPF_PALETTEINDEXED2) continue;
-			if (texformats[i].dwFlags & DDPF_PALETTEINDEXED4) continue;
-			if (texformats[i].dwFlags & DDPF_PALETTEINDEXED8) continue;
-			memcpy(&ddsd.ddpfPixelFormat, &::texformats[i], sizeof(DDPIXELFORMAT));
-			result = lpd3dEnumTextureProc(&ddsd, lpArg);
-			if (result != D3DENUMRET_OK) TRACE_RET(HRESULT, 23, D3D_OK);
-		}
+		memcpy(&ddsd.ddpfPixelFormat, &list->formats[i], sizeof(DDPIXELFORMAT));
+		result = lpd3dEnumTextureProc(&ddsd, lpArg);
+		if (result != D3DENUMRET_OK) TRACE_RET(HRESULT, 23, D3D_OK);
 	}
 	TRACE_EXIT(23, D3D_OK);
 	return D3D_OK;
@@ -1202,9 +1355,12 @@ HRESULT WINAPI glDirect3DDevice7_GetClipStatus(glDirect3DDevice7 *This, LPD3DCLI
 {
 	TRACE_ENTER(2,14,This,14,lpD3DClipStatus);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	FIXME("glDirect3DDevice7_GetClipStatus: stub");
-	TRACE_EXIT(23,DDERR_GENERIC);
-	ERR(DDERR_GENERIC);
+	if(!lpD3DClipStatus) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	// Draws only keep the status once it has been asked for
+	This->clipstatusused = TRUE;
+	memcpy(lpD3DClipStatus,&This->clipstatus,sizeof(D3DCLIPSTATUS));
+	TRACE_EXIT(23,D3D_OK);
+	return D3D_OK;
 }
 HRESULT WINAPI glDirect3DDevice7_GetDirect3D(glDirect3DDevice7 *This, LPDIRECT3D7 *lplpD3D)
 {
@@ -1219,11 +1375,49 @@ HRESULT WINAPI glDirect3DDevice7_GetDirect3D(glDirect3DDevice7 *This, LPDIRECT3D
 }
 HRESULT WINAPI glDirect3DDevice7_GetInfo(glDirect3DDevice7 *This, DWORD dwDevInfoID, LPVOID pDevInfoStruct, DWORD dwSize)
 {
+	DXGL_PERFCOUNTERS counters;
+	LPD3DDEVINFO_TEXTUREMANAGER texman;
+	LPD3DDEVINFO_TEXTURING texturing;
 	TRACE_ENTER(4,14,This,9,dwDevInfoID,14,pDevInfoStruct,8,dwSize);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	FIXME("glDirect3DDevice7_GetInfo: stub");
-	TRACE_EXIT(23,DDERR_GENERIC);
-	ERR(DDERR_GENERIC);
+	if(!pDevInfoStruct) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	// All IDs report the counters of the last presented frame
+	PerfCounters_Get(&This->renderer->perf, &counters);
+	switch(dwDevInfoID)
+	{
+	case D3DDEVINFOID_DXGLPERF:
+		if(dwSize != sizeof(DXGL_PERFCOUNTERS)) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+		memcpy(pDevInfoStruct, &counters, sizeof(DXGL_PERFCOUNTERS));
+		break;
+	case D3DDEVINFOID_TEXTUREMANAGER:
+	case D3DDEVINFOID_D3DTEXTUREMANAGER:
+		if(dwSize != sizeof(D3DDEVINFO_TEXTUREMANAGER)) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+		texman = (LPD3DDEVINFO_TEXTUREMANAGER)pDevInfoStruct;
+		ZeroMemory(texman, sizeof(D3DDEVINFO_TEXTUREMANAGER));
+		texman->bThrashing = (counters.dwEvictions && counters.dwRestores) ? TRUE : FALSE;
+		texman->dwApproxBytesDownloaded = counters.dwUploadBytes;
+		texman->dwNumEvicts = counters.dwEvictions;
+		texman->dwNumVidCreates = counters.dwTextureCreates + counters.dwRestores;
+		texman->dwNumTexturesUsed = counters.dwTexturesSet;
+		texman->dwWorkingSetBytes = counters.dwResidentBytes;
+		texman->dwTotalBytes = counters.dwResidentBytes;
+		break;
+	case D3DDEVINFOID_TEXTURING:
+		if(dwSize != sizeof(D3DDEVINFO_TEXTURING)) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+		texturing = (LPD3DDEVINFO_TEXTURING)pDevInfoStruct;
+		ZeroMemory(texturing, sizeof(D3DDEVINFO_TEXTURING));
+		texturing->dwNumLoads = counters.dwUploads;
+		texturing->dwApproxBytesLoaded = counters.dwUploadBytes;
+		texturing->dwNumPreLoads = counters.dwPreloads;
+		texturing->dwNumSet = counters.dwTexturesSet;
+		texturing->dwNumCreates = counters.dwTextureCreates;
+		texturing->dwNumDestroys = counters.dwTextureDeletes;
+		break;
+	default:
+		TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	}
+	TRACE_EXIT(23,D3D_OK);
+	return D3D_OK;
 }
 HRESULT WINAPI glDirect3DDevice7_GetLight(glDirect3DDevice7 *This, DWORD dwLightIndex, LPD3DLIGHT7 lpLight)
 {
@@ -1231,8 +1425,8 @@ HRESULT WINAPI glDirect3DDevice7_GetLight(glDirect3DDevice7 *This, DWORD dwLight
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
 	if(!lpLight) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
 	if(dwLightIndex >= This->lightsmax) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
-	if(!This->lights[dwLightIndex]) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
-	glDirect3DLight_GetLight7(This->lights[dwLightIndex], lpLight);
+	if(!This->lights[dwLightIndex].active) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	memcpy(lpLight,&This->lights[dwLightIndex].light,sizeof(D3DLIGHT7));
 	TRACE_EXIT(23,D3D_OK);
 	return D3D_OK;
 }
@@ -1241,10 +1435,10 @@ HRESULT WINAPI glDirect3DDevice7_GetLightEnable(glDirect3DDevice7 *This, DWORD d
 	TRACE_ENTER(3,14,This,8,dwLightIndex,14,pbEnable);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
 	if(dwLightIndex >= This->lightsmax) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
-	if(!This->lights[dwLightIndex]) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	if(!This->lights[dwLightIndex].active) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
 	if(!pbEnable) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
 	*pbEnable = FALSE;
-	for(int i = 0; i < 8; i++)
+	for(int i = 0; i < LIGHTS_MAX; i++)
 		if(This->gllights[i] == dwLightIndex) *pbEnable = TRUE;
 	TRACE_VAR("*pbEnable",22,*pbEnable);
 	TRACE_EXIT(23,D3D_OK);
@@ -1420,24 +1614,22 @@ HRESULT WINAPI glDirect3DDevice7_LightEnable(glDirect3DDevice7 *This, DWORD dwLi
 {
 	TRACE_ENTER(3,14,This,8,dwLightIndex,22,bEnable);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
+	if(This->recordingblock)
+		TRACE_RET(HRESULT,23,glDirect3DStateBlock_RecordLightEnable(This->recordingblock,dwLightIndex,bEnable));
 	int i;
 	BOOL foundlight = FALSE;
-	if(dwLightIndex >= This->lightsmax)
-	{
-		if(!ExpandLightBuffer(&This->lights,&This->lightsmax,dwLightIndex+1)) TRACE_RET(HRESULT,23,DDERR_OUTOFMEMORY);
-	}
-	if(!This->lights[dwLightIndex]) This->lights[dwLightIndex] = new glDirect3DLight;
+	if(!glDirect3DDevice7__UseLight(This,dwLightIndex)) TRACE_RET(HRESULT,23,DDERR_OUTOFMEMORY);
 	if(bEnable)
 	{
-		for(i = 0; i < 8; i++)
+		for(i = 0; i < LIGHTS_MAX; i++)
 			if(This->gllights[i] == dwLightIndex) TRACE_RET(HRESULT,23,D3D_OK);
-		for(i = 0; i < 8; i++)
+		for(i = 0; i < (int)This->d3ddesc.dwMaxActiveLights; i++)
 		{
 			if(This->gllights[i] == -1)
 			{
 				foundlight = TRUE;
 				This->gllights[i] = dwLightIndex;
-				glRenderer_SetLight(This->renderer, i, &This->lights[This->gllights[i]]->light);
+				glRenderer_SetLight(This->renderer, i, &This->lights[This->gllights[i]].light);
 				break;
 			}
 		}
@@ -1445,7 +1637,7 @@ HRESULT WINAPI glDirect3DDevice7_LightEnable(glDirect3DDevice7 *This, DWORD dwLi
 	}
 	else
 	{
-		for(i = 0; i < 8; i++)
+		for(i = 0; i < LIGHTS_MAX; i++)
 		{
 			if(This->gllights[i] == dwLightIndex)
 			{
@@ -1464,25 +1656,74 @@ HRESULT WINAPI glDirect3DDevice7_Load(glDirect3DDevice7 *This, LPDIRECTDRAWSURFA
 {
 	TRACE_ENTER(6,14,This,14,lpDestTex,25,lpDestPoint,14,lpSrcTex,26,lprcSrcRect,9,dwFlags);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	FIXME("glDirect3DDevice7_Load: stub");
-	TRACE_EXIT(23,DDERR_GENERIC);
-	ERR(DDERR_GENERIC);
+	dxglDirectDrawSurface7 *dest = (dxglDirectDrawSurface7*)lpDestTex;
+	dxglDirectDrawSurface7 *src = (dxglDirectDrawSurface7*)lpSrcTex;
+	if(!dest || !src) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	if((dest->ddsd.ddsCaps.dwCaps2 | src->ddsd.ddsCaps.dwCaps2) & DDSCAPS2_CUBEMAP)
+	{
+		FIXME("glDirect3DDevice7_Load: cube maps not supported");
+		TRACE_RET(HRESULT,23,DDERR_UNSUPPORTED);
+	}
+	RECT srcrect, destrect;
+	if(lprcSrcRect) srcrect = *lprcSrcRect;
+	else SetRect(&srcrect, 0, 0, src->ddsd.dwWidth, src->ddsd.dwHeight);
+	if((srcrect.left < 0) || (srcrect.top < 0) || (srcrect.right > (LONG)src->ddsd.dwWidth) ||
+		(srcrect.bottom > (LONG)src->ddsd.dwHeight) || (srcrect.left >= srcrect.right) || (srcrect.top >= srcrect.bottom))
+		TRACE_RET(HRESULT,23,DDERR_INVALIDRECT);
+	if(lpDestPoint) SetRect(&destrect, lpDestPoint->x, lpDestPoint->y, lpDestPoint->x + (srcrect.right - srcrect.left),
+		lpDestPoint->y + (srcrect.bottom - srcrect.top));
+	else SetRect(&destrect, srcrect.left, srcrect.top, srcrect.right, srcrect.bottom);
+	if((destrect.left < 0) || (destrect.top < 0) || (destrect.right > (LONG)dest->ddsd.dwWidth) ||
+		(destrect.bottom > (LONG)dest->ddsd.dwHeight))
+		TRACE_RET(HRESULT,23,DDERR_INVALIDRECT);
+	// Copy every level both textures have, the rectangles shrinking with the levels
+	DWORD srclevels = (src->ddsd.dwFlags & DDSD_MIPMAPCOUNT) ? src->ddsd.dwMipMapCount : 1;
+	DWORD destlevels = (dest->ddsd.dwFlags & DDSD_MIPMAPCOUNT) ? dest->ddsd.dwMipMapCount : 1;
+	HRESULT error;
+	for(DWORD i = 0; (i < srclevels) && (i < destlevels); i++)
+	{
+		if(i)
+		{
+			SetRect(&srcrect, srcrect.left >> 1, srcrect.top >> 1,
+				min((srcrect.right + 1) >> 1, (LONG)src[i].ddsd.dwWidth), min((srcrect.bottom + 1) >> 1, (LONG)src[i].ddsd.dwHeight));
+			destrect.left >>= 1;
+			destrect.top >>= 1;
+			destrect.right = min(destrect.left + (srcrect.right - srcrect.left), (LONG)dest[i].ddsd.dwWidth);
+			destrect.bottom = min(destrect.top + (srcrect.bottom - srcrect.top), (LONG)dest[i].ddsd.dwHeight);
+			if((destrect.left >= destrect.right) || (destrect.top >= destrect.bottom)) break;
+			srcrect.right = srcrect.left + (destrect.right - destrect.left);
+			srcrect.bottom = srcrect.top + (destrect.bottom - destrect.top);
+		}
+		error = dxglDirectDrawSurface7_Blt(&dest[i], &destrect, (LPDIRECTDRAWSURFACE7)&src[i], &srcrect, DDBLT_WAIT, NULL);
+		if(FAILED(error)) TRACE_RET(HRESULT,23,error);
+	}
+	dest->ddsd.ddsCaps.dwCaps &= ~DDSCAPS_ALLOCONLOAD;
+	TRACE_EXIT(23,D3D_OK);
+	return D3D_OK;
 }
 HRESULT WINAPI glDirect3DDevice7_MultiplyTransform(glDirect3DDevice7 *This, D3DTRANSFORMSTATETYPE dtstTransformStateType, LPD3DMATRIX lpD3DMatrix)
 {
 	TRACE_ENTER(3,14,This,29,dtstTransformStateType,14,lpD3DMatrix);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	FIXME("glDirect3DDevice7_MultiplyTransform: stub");
-	TRACE_EXIT(23,DDERR_GENERIC);
-	ERR(DDERR_GENERIC);
+	if(!lpD3DMatrix) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	D3DMATRIX mat;
+	HRESULT error = glDirect3DDevice7_GetTransform(This,dtstTransformStateType,&mat);
+	if(FAILED(error)) TRACE_RET(HRESULT,23,error);
+	// The new matrix is applied before the current one
+	__gluMultMatricesf((GLfloat*)lpD3DMatrix,(GLfloat*)&mat,(GLfloat*)&mat);
+	TRACE_RET(HRESULT,23,glDirect3DDevice7_SetTransform(This,dtstTransformStateType,&mat));
 }
 HRESULT WINAPI glDirect3DDevice7_PreLoad(glDirect3DDevice7 *This, LPDIRECTDRAWSURFACE7 lpddsTexture)
 {
 	TRACE_ENTER(2,14,This,14,lpddsTexture);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	FIXME("glDirect3DDevice7_PreLoad: stub");
-	TRACE_EXIT(23,DDERR_GENERIC);
-	ERR(DDERR_GENERIC);
+	dxglDirectDrawSurface7 *texture = (dxglDirectDrawSurface7*)lpddsTexture;
+	if(!texture) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	if(!(texture->ddsd.ddsCaps.dwCaps & DDSCAPS_TEXTURE)) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	// Queued behind earlier commands, the caller does not wait for the upload
+	glRenderer_PreloadTexture(This->renderer, texture->texture);
+	TRACE_EXIT(23,D3D_OK);
+	return D3D_OK;
 }
 HRESULT WINAPI glDirect3DDevice7_SetClipPlane(glDirect3DDevice7 *This, DWORD dwIndex, D3DVALUE* pPlaneEquation)
 {
@@ -1496,9 +1737,12 @@ HRESULT WINAPI glDirect3DDevice7_SetClipStatus(glDirect3DDevice7 *This, LPD3DCLI
 {
 	TRACE_ENTER(2,14,This,14,lpD3DClipStatus);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	FIXME("glDirect3DDevice7_SetClipStatus: stub");
-	TRACE_EXIT(23,DDERR_GENERIC);
-	ERR(DDERR_GENERIC);
+	if(!lpD3DClipStatus) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	This->clipstatusused = TRUE;
+	This->clipstatusreset = TRUE;
+	memcpy(&This->clipstatus,lpD3DClipStatus,sizeof(D3DCLIPSTATUS));
+	TRACE_EXIT(23,D3D_OK);
+	return D3D_OK;
 }
 HRESULT WINAPI glDirect3DDevice7_SetLight(glDirect3DDevice7 *This, DWORD dwLightIndex, LPD3DLIGHT7 lpLight)
 {
@@ -1507,17 +1751,16 @@ HRESULT WINAPI glDirect3DDevice7_SetLight(glDirect3DDevice7 *This, DWORD dwLight
 	if (!lpLight) TRACE_RET(HRESULT, 23, DDERR_INVALIDPARAMS);
 	if ((lpLight->dltType < D3DLIGHT_POINT) || (lpLight->dltType > D3DLIGHT_GLSPOT))
 		TRACE_RET(HRESULT, 23, DDERR_INVALIDPARAMS);
+	if(This->recordingblock)
+		TRACE_RET(HRESULT,23,glDirect3DStateBlock_RecordLight(This->recordingblock,dwLightIndex,lpLight));
 	bool foundlight = false;
-	if(dwLightIndex >= This->lightsmax)
-	{
-		if(!ExpandLightBuffer(&This->lights,&This->lightsmax,dwLightIndex+1)) TRACE_RET(HRESULT,23,DDERR_OUTOFMEMORY);
-	}
-	if(!This->lights[dwLightIndex]) This->lights[dwLightIndex] = new glDirect3DLight;
-	glDirect3DLight_SetLight7(This->lights[dwLightIndex], lpLight);
-	for (int i = 0; i < 8; i++)
+	D3D7LIGHT *slot = glDirect3DDevice7__UseLight(This,dwLightIndex);
+	if(!slot) TRACE_RET(HRESULT,23,DDERR_OUTOFMEMORY);
+	memcpy(&slot->light,lpLight,sizeof(D3DLIGHT7));
+	for (int i = 0; i < LIGHTS_MAX; i++)
 	{
 		if (This->gllights[i] == dwLightIndex)
-			glRenderer_SetLight(This->renderer, i, &This->lights[This->gllights[i]]->light);
+			glRenderer_SetLight(This->renderer, i, &This->lights[This->gllights[i]].light);
 	}
 	TRACE_EXIT(23,D3D_OK);
 	return D3D_OK;
@@ -1527,6 +1770,11 @@ HRESULT WINAPI glDirect3DDevice7_SetMaterial(glDirect3DDevice7 *This, LPD3DMATER
 	TRACE_ENTER(2,14,This,14,lpMaterial);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
 	if(!lpMaterial) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	if(This->recordingblock)
+	{
+		glDirect3DStateBlock_RecordMaterial(This->recordingblock,lpMaterial);
+		TRACE_RET(HRESULT,23,D3D_OK);
+	}
 	memcpy(&This->material,lpMaterial,sizeof(D3DMATERIAL7));
 	glRenderer_SetMaterial(This->renderer, lpMaterial);
 	TRACE_EXIT(23,D3D_OK);
@@ -1539,6 +1787,11 @@ HRESULT WINAPI glDirect3DDevice7_SetRenderState(glDirect3DDevice7 *This, D3DREND
 	BOOL noalpha = FALSE;
 	TRACE_ENTER(3, 14, This, 27, dwRendStateType, 9, dwRenderState);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
+	if(This->recordingblock)
+	{
+		if(dwRendStateType > 152) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+		TRACE_RET(HRESULT,23,glDirect3DStateBlock_RecordRenderState(This->recordingblock,dwRendStateType,dwRenderState));
+	}
 	switch(dwRendStateType)
 	{
 	case D3DRENDERSTATE_TEXTUREHANDLE:
@@ -1668,7 +1921,7 @@ HRESULT WINAPI glDirect3DDevice7_SetRenderState(glDirect3DDevice7 *This, D3DREND
 	if(dwRendStateType > 152) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
 	if(dwRendStateType < 0) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
 	This->renderstate[dwRendStateType] = dwRenderState;
-	if (devstate) glRenderer_SetRenderState(This->renderer, dwRendStateType, dwRenderState);
+	if (devstate) This->renderstatedirty[dwRendStateType >> 5] |= 1 << (dwRendStateType & 31);
 	TRACE_EXIT(23,D3D_OK);
 	return D3D_OK;
 }
@@ -1725,6 +1978,11 @@ HRESULT WINAPI glDirect3DDevice7_SetTextureStageState(glDirect3DDevice7 *This, D
 	TRACE_ENTER(4,14,This,8,dwStage,28,dwState,9,dwValue);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
 	if(dwStage > 7) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	if(This->recordingblock)
+	{
+		if(!dwState || (dwState > D3DTSS_TEXTURETRANSFORMFLAGS)) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+		TRACE_RET(HRESULT,23,glDirect3DStateBlock_RecordTextureStageState(This->recordingblock,dwStage,dwState,dwValue));
+	}
 	switch(dwState)
 	{
 	case D3DTSS_COLOROP:
@@ -1827,7 +2085,11 @@ HRESULT WINAPI glDirect3DDevice7_SetTextureStageState(glDirect3DDevice7 *This, D
 		TRACE_EXIT(23,DDERR_INVALIDPARAMS);
 		return DDERR_INVALIDPARAMS;
 	}
-	if (devstate) glRenderer_SetTextureStageState(This->renderer, dwStage, dwState, dwValue);
+	if (devstate)
+	{
+		This->texstagevalue[dwStage][dwState] = dwValue;
+		This->texstagedirty[dwStage] |= 1 << dwState;
+	}
 	TRACE_EXIT(23, D3D_OK);
 	return D3D_OK;
 }
@@ -1835,27 +2097,32 @@ HRESULT WINAPI glDirect3DDevice7_SetTransform(glDirect3DDevice7 *This, D3DTRANSF
 {
 	TRACE_ENTER(3,14,This,29,dtstTransformStateType,14,lpD3DMatrix);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
+	if(This->recordingblock)
+		TRACE_RET(HRESULT,23,glDirect3DStateBlock_RecordTransform(This->recordingblock,dtstTransformStateType,lpD3DMatrix));
 	switch(dtstTransformStateType)
 	{
 	case D3DTRANSFORMSTATE_WORLD:
 		memcpy(&This->matWorld,lpD3DMatrix,sizeof(D3DMATRIX));
+		This->frustum_dirty = true;
 		This->modelview_dirty = true;
 		This->transform_dirty = true;
 		break;
 	case D3DTRANSFORMSTATE_VIEW:
 		memcpy(&This->matView,lpD3DMatrix,sizeof(D3DMATRIX));
+		This->frustum_dirty = true;
 		This->modelview_dirty = true;
 		This->transform_dirty = true;
 		break;
 	case D3DTRANSFORMSTATE_PROJECTION:
 		memcpy(&This->matProjection,lpD3DMatrix,sizeof(D3DMATRIX));
+		This->frustum_dirty = true;
 		This->projection_dirty = true;
 		This->transform_dirty = true;
 		break;
 	default:
 		TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
 	}
-	glRenderer_SetTransform(This->renderer, dtstTransformStateType, lpD3DMatrix);
+	This->transformdirty |= 1 << dtstTransformStateType;
 	TRACE_EXIT(23, D3D_OK);
 	return D3D_OK;
 }
@@ -1863,6 +2130,11 @@ HRESULT WINAPI glDirect3DDevice7_SetViewport(glDirect3DDevice7 *This, LPD3DVIEWP
 {
 	TRACE_ENTER(2,14,This,14,lpViewport);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
+	if(This->recordingblock)
+	{
+		glDirect3DStateBlock_RecordViewport(This->recordingblock,lpViewport);
+		TRACE_RET(HRESULT,23,D3D_OK);
+	}
 	memcpy(&This->viewport,lpViewport,sizeof(D3DVIEWPORT7));
 	This->transform_dirty = true;
 	glRenderer_SetD3DViewport(This->renderer, lpViewport);
@@ -2077,47 +2349,116 @@ HRESULT glDirect3DDevice7_SetCurrentViewport(glDirect3DDevice7 *This, LPDIRECT3D
 	return DDERR_INVALIDPARAMS;
 }
 
+/**
+  * Makes room for one more entry in a Begin/End staging array, doubling it
+  * when it is full.
+  * @param buffer
+  *  Pointer to the staging array, may point to NULL
+  * @param max
+  *  Pointer to the number of entries the array holds
+  * @param count
+  *  Number of entries in use
+  * @param size
+  *  Size of an entry in bytes
+  * @return
+  *  FALSE if the array could not be grown
+  */
+static BOOL glDirect3DDevice7__GrowImmediate(void **buffer, DWORD *max, DWORD count, DWORD size)
+{
+	DWORD newmax;
+	void *newbuffer;
+	if (count < *max) return TRUE;
+	newmax = *max ? *max * 2 : 64;
+	newbuffer = realloc(*buffer, newmax * size);
+	if (!newbuffer) return FALSE;
+	*buffer = newbuffer;
+	*max = newmax;
+	return TRUE;
+}
+
 HRESULT glDirect3DDevice7_Begin(glDirect3DDevice7 *This, D3DPRIMITIVETYPE d3dpt, DWORD dwVertexTypeDesc, DWORD dwFlags)
 {
 	TRACE_ENTER(4,14,This,8,d3dpt,9,dwVertexTypeDesc,9,dwFlags);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	FIXME("glDirect3DDevice7_Begin: stub");
-	TRACE_EXIT(23,DDERR_GENERIC);
-	return DDERR_GENERIC;
+	if(This->immediate.active) TRACE_RET(HRESULT,23,D3DERR_INBEGIN);
+	if(!This->inscene) TRACE_RET(HRESULT,23,D3DERR_SCENE_NOT_IN_SCENE);
+	if(!(dwVertexTypeDesc & D3DFVF_POSITION_MASK)) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	This->immediate.active = TRUE;
+	This->immediate.indexed = FALSE;
+	This->immediate.primtype = d3dpt;
+	This->immediate.fvf = dwVertexTypeDesc;
+	This->immediate.flags = dwFlags;
+	This->immediate.vertexsize = glDirect3DVertexBuffer7_GetVertexSize(dwVertexTypeDesc);
+	This->immediate.vertexcount = 0;
+	This->immediate.indexcount = 0;
+	TRACE_EXIT(23,D3D_OK);
+	return D3D_OK;
 }
 HRESULT glDirect3DDevice7_BeginIndexed(glDirect3DDevice7 *This, D3DPRIMITIVETYPE dptPrimitiveType, DWORD dwVertexTypeDesc, LPVOID lpvVertices, DWORD dwNumVertices, DWORD dwFlags)
 {
 	TRACE_ENTER(6,14,This,8,dptPrimitiveType,9,dwVertexTypeDesc,14,lpvVertices,8,dwNumVertices,9,dwFlags);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
 	if(!lpvVertices) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
-	FIXME("glDirect3DDevice7_BeginIndexed: stub");
-	TRACE_EXIT(23,DDERR_GENERIC);
-	return DDERR_GENERIC;
+	if(This->immediate.active) TRACE_RET(HRESULT,23,D3DERR_INBEGIN);
+	if(!This->inscene) TRACE_RET(HRESULT,23,D3DERR_SCENE_NOT_IN_SCENE);
+	if(!(dwVertexTypeDesc & D3DFVF_POSITION_MASK)) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	This->immediate.active = TRUE;
+	This->immediate.indexed = TRUE;
+	This->immediate.primtype = dptPrimitiveType;
+	This->immediate.fvf = dwVertexTypeDesc;
+	This->immediate.flags = dwFlags;
+	This->immediate.vertexsize = glDirect3DVertexBuffer7_GetVertexSize(dwVertexTypeDesc);
+	This->immediate.vertexcount = 0;
+	This->immediate.indexcount = 0;
+	This->immediate.indexedvertices = lpvVertices;
+	This->immediate.indexedvertexcount = dwNumVertices;
+	TRACE_EXIT(23,D3D_OK);
+	return D3D_OK;
 }
 HRESULT glDirect3DDevice7_Index(glDirect3DDevice7 *This, WORD wVertexIndex)
 {
 	TRACE_ENTER(2,14,This,5,wVertexIndex);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	FIXME("glDirect3DDevice7_Index: stub");
-	TRACE_EXIT(23,DDERR_GENERIC);
-	return DDERR_GENERIC;
+	if(!This->immediate.active || !This->immediate.indexed) TRACE_RET(HRESULT,23,D3DERR_NOTINBEGIN);
+	if(wVertexIndex >= This->immediate.indexedvertexcount) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	if(!glDirect3DDevice7__GrowImmediate((void**)&This->immediate.indices, &This->immediate.indexmax,
+		This->immediate.indexcount, sizeof(WORD))) TRACE_RET(HRESULT,23,DDERR_OUTOFMEMORY);
+	This->immediate.indices[This->immediate.indexcount++] = wVertexIndex;
+	TRACE_EXIT(23,D3D_OK);
+	return D3D_OK;
 }
 HRESULT glDirect3DDevice7_Vertex(glDirect3DDevice7 *This, LPVOID lpVertex)
 {
 	TRACE_ENTER(2,14,This,14,lpVertex);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
 	if(!lpVertex) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
-	FIXME("glDirect3DDevice7_Vertex: stub");
-	TRACE_EXIT(23,DDERR_GENERIC);
-	return DDERR_GENERIC;
+	if(!This->immediate.active || This->immediate.indexed) TRACE_RET(HRESULT,23,D3DERR_NOTINBEGIN);
+	if(!glDirect3DDevice7__GrowImmediate((void**)&This->immediate.vertices, &This->immediate.vertexmax,
+		This->immediate.vertexcount, This->immediate.vertexsize)) TRACE_RET(HRESULT,23,DDERR_OUTOFMEMORY);
+	memcpy(This->immediate.vertices + (This->immediate.vertexcount * This->immediate.vertexsize),
+		lpVertex, This->immediate.vertexsize);
+	This->immediate.vertexcount++;
+	TRACE_EXIT(23,D3D_OK);
+	return D3D_OK;
 }
 HRESULT glDirect3DDevice7_End(glDirect3DDevice7 *This, DWORD dwFlags)
 {
 	TRACE_ENTER(2,14,This,9,dwFlags);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	FIXME("glDirect3DDevice7_End: stub");
-	TRACE_EXIT(23,DDERR_GENERIC);
-	return DDERR_GENERIC;
+	if(!This->immediate.active) TRACE_RET(HRESULT,23,D3DERR_NOTINBEGIN);
+	This->immediate.active = FALSE;
+	// The whole primitive is drawn at once, the renderer copies it and may
+	// merge it with the draws around it
+	if(This->immediate.indexed)
+	{
+		if(!This->immediate.indexcount) TRACE_RET(HRESULT,23,D3D_OK);
+		TRACE_RET(HRESULT,23,glDirect3DDevice7_DrawIndexedPrimitive(This,This->immediate.primtype,
+			This->immediate.fvf,This->immediate.indexedvertices,This->immediate.indexedvertexcount,
+			This->immediate.indices,This->immediate.indexcount,This->immediate.flags));
+	}
+	if(!This->immediate.vertexcount) TRACE_RET(HRESULT,23,D3D_OK);
+	TRACE_RET(HRESULT,23,glDirect3DDevice7_DrawIndexedPrimitive(This,This->immediate.primtype,
+		This->immediate.fvf,This->immediate.vertices,This->immediate.vertexcount,NULL,0,This->immediate.flags));
 }
 
 HRESULT glDirect3DDevice7_GetCaps3(glDirect3DDevice7 *This, LPD3DDEVICEDESC lpD3DHWDevDesc, LPD3DDEVICEDESC lpD3DHELDevDesc)
@@ -2274,43 +2615,70 @@ HRESULT glDirect3DDevice7_CreateMatrix(glDirect3DDevice7 *This, LPD3DMATRIXHANDL
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
 	if(!lpD3DMatHandle) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
 	D3DMATRIXHANDLE i;
-	int foundslot = 0;
-	if(!This->matrices)
+	D3DMATRIXHANDLE first;
+	D3DMATRIXHANDLE newcount;
+	D3DMATRIXHANDLE handle;
+	D3D1MATRIX *newmatrices;
+	if(!This->matrixfree)
 	{
-		This->matrices = (D3D1MATRIX*)malloc(16*sizeof(D3D1MATRIX));
-		if(!This->matrices) TRACE_RET(HRESULT,23,DDERR_OUTOFMEMORY);
-		ZeroMemory(This->matrices,16*sizeof(D3D1MATRIX));
-		This->matrixcount = 16;
-	}
-	for(i = 0; i < This->matrixcount; i++)
-	{
-		if(i == 0) continue;
-		if(!This->matrices[i].active)
-		{
-			foundslot = i;
-			break;
-		}
-	}
-	if(!foundslot)
-	{
-		int newcount;
-		D3D1MATRIX *newmatrices;
-		newcount = This->matrixcount + 16;
+		newcount = This->matrixcount ? This->matrixcount * 2 : 16;
 		newmatrices = (D3D1MATRIX*)realloc(This->matrices,newcount*sizeof(D3D1MATRIX));
 		if(!newmatrices) TRACE_RET(HRESULT,23,DDERR_OUTOFMEMORY);
-		ZeroMemory(&newmatrices[This->matrixcount],16*sizeof(D3D1MATRIX));
+		ZeroMemory(&newmatrices[This->matrixcount],(newcount - This->matrixcount)*sizeof(D3D1MATRIX));
+		// Handle 0 is never handed out, it stands for the identity matrix
+		first = This->matrixcount ? This->matrixcount : 1;
+		for(i = newcount; i > first; i--)
+		{
+			newmatrices[i - 1].nextfree = This->matrixfree;
+			This->matrixfree = i - 1;
+		}
 		This->matrices = newmatrices;
-		foundslot = This->matrixcount;
 		This->matrixcount = newcount;
 	}
-	*lpD3DMatHandle = foundslot;
-	__gluMakeIdentityf((GLfloat*)&This->matrices[foundslot].matrix);
-	This->matrices[foundslot].active = TRUE;
+	handle = This->matrixfree;
+	This->matrixfree = This->matrices[handle].nextfree;
+	*lpD3DMatHandle = handle;
+	__gluMakeIdentityf((GLfloat*)&This->matrices[handle].matrix);
+	This->matrices[handle].active = TRUE;
 	TRACE_VAR("*lpD3DMatHandle",9,*lpD3DMatHandle);
 	TRACE_EXIT(23,D3D_OK);
 	return D3D_OK;
 }
 
+/**
+  * Looks up the matrix of a D3D1-3 matrix handle without validating
+  * anything else, for execute buffer processing.
+  * @param This
+  *  Pointer to glDirect3DDevice7 object
+  * @param handle
+  *  Matrix handle, 0 for the identity matrix
+  * @return
+  *  Pointer to the matrix, or NULL if the handle is not in use
+  */
+static const D3DMATRIX *glDirect3DDevice7__Matrix(glDirect3DDevice7 *This, D3DMATRIXHANDLE handle)
+{
+	static const GLfloat identity[16] = { 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f,
+		0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f };
+	if(!handle) return (const D3DMATRIX*)identity;
+	if((handle >= This->matrixcount) || !This->matrices[handle].active) return NULL;
+	return &This->matrices[handle].matrix;
+}
+
+/**
+  * Reapplies a matrix that changed to the transforms it is bound to.
+  * @param This
+  *  Pointer to glDirect3DDevice7 object
+  * @param handle
+  *  Handle of the matrix that was written
+  */
+static void glDirect3DDevice7__MatrixChanged(glDirect3DDevice7 *This, D3DMATRIXHANDLE handle)
+{
+	LPD3DMATRIX matrix = &This->matrices[handle].matrix;
+	if(handle == This->mhWorld) glDirect3DDevice7_SetTransform(This,D3DTRANSFORMSTATE_WORLD,matrix);
+	if(handle == This->mhView) glDirect3DDevice7_SetTransform(This,D3DTRANSFORMSTATE_VIEW,matrix);
+	if(handle == This->mhProjection) glDirect3DDevice7_SetTransform(This,D3DTRANSFORMSTATE_PROJECTION,matrix);
+}
+
 HRESULT glDirect3DDevice7_DeleteMatrix(glDirect3DDevice7 *This, D3DMATRIXHANDLE d3dMatHandle)
 {
 	TRACE_ENTER(2,14,This,9,d3dMatHandle);
@@ -2319,6 +2687,8 @@ HRESULT glDirect3DDevice7_DeleteMatrix(glDirect3DDevice7 *This, D3DMATRIXHANDLE
 	if(d3dMatHandle >= This->matrixcount) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
 	if(!This->matrices[d3dMatHandle].active) TRACE_RET(HRESULT,23,D3DERR_MATRIX_DESTROY_FAILED);
 	This->matrices[d3dMatHandle].active = FALSE;
+	This->matrices[d3dMatHandle].nextfree = This->matrixfree;
+	This->matrixfree = d3dMatHandle;
 	TRACE_EXIT(23,D3D_OK);
 	return D3D_OK;
 }
@@ -2348,9 +2718,7 @@ HRESULT glDirect3DDevice7_SetMatrix(glDirect3DDevice7 *This, D3DMATRIXHANDLE d3d
 	if(d3dMatHandle >= This->matrixcount) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
 	if(!This->matrices[d3dMatHandle].active) TRACE_RET(HRESULT,23,D3DERR_MATRIX_SETDATA_FAILED);
 	memcpy(&This->matrices[d3dMatHandle].matrix,lpD3DMatrix,sizeof(D3DMATRIX));
-	if(d3dMatHandle == This->mhWorld) glDirect3DDevice7_SetTransform(This,D3DTRANSFORMSTATE_WORLD,lpD3DMatrix);
-	if(d3dMatHandle == This->mhView) glDirect3DDevice7_SetTransform(This,D3DTRANSFORMSTATE_VIEW,lpD3DMatrix);
-	if(d3dMatHandle == This->mhProjection) glDirect3DDevice7_SetTransform(This,D3DTRANSFORMSTATE_PROJECTION,lpD3DMatrix);
+	glDirect3DDevice7__MatrixChanged(This,d3dMatHandle);
 	TRACE_EXIT(23,D3D_OK);
 	return D3D_OK;
 }
@@ -2396,13 +2764,165 @@ INT AddTriangle(unsigned char **buffer, DWORD *buffersize, DWORD *offset, const
 void glDirect3DDevice7_UpdateTransform(glDirect3DDevice7 *This)
 {
 	TRACE_ENTER(1,14,This);
-	GLfloat mat1[16];
-	__gluMultMatricesf(This->matWorld,This->matView,mat1);
-	__gluMultMatricesf(mat1,This->matProjection,This->matTransform);
+	// A projection change reuses the world * view product
+	if(This->modelview_dirty)
+	{
+		__gluMultMatricesf(This->matWorld,This->matView,This->matModelView);
+		This->modelview_dirty = false;
+	}
+	__gluMultMatricesf(This->matModelView,This->matProjection,This->matTransform);
+	This->projection_dirty = false;
 	This->transform_dirty = false;
 	TRACE_EXIT(0,0);
 }
 
+static void glDirect3DDevice7_CopyColor(float *out, const D3DCOLORVALUE *color)
+{
+	out[0] = color->r;
+	out[1] = color->g;
+	out[2] = color->b;
+	out[3] = color->a;
+}
+
+/**
+  * Builds the CPU vertex pipeline state from the current device transforms,
+  * viewport, material, lights and render states.
+  * @param This
+  *  Pointer to glDirect3DDevice7 object
+  * @param state
+  *  Pointer to the structure to receive the state; lighting is left to the caller
+  */
+void glDirect3DDevice7_GetVertexProcState(glDirect3DDevice7 *This, VERTEXPROCSTATE *state)
+{
+	TRACE_ENTER(2,14,This,14,state);
+	GLfloat inverse[16];
+	DWORD ambient;
+	int i;
+	if(This->transform_dirty) glDirect3DDevice7_UpdateTransform(This);
+	memcpy(state->transform,This->matTransform,16*sizeof(GLfloat));
+	memcpy(state->world,This->matWorld,16*sizeof(GLfloat));
+	// Normals stay perpendicular to surfaces under non-uniform scale and shear
+	Matrix_InverseTranspose3x3(This->matWorld,state->normalmatrix);
+	if(!__gluInvertMatrixf(This->matView,inverse)) __gluMakeIdentityf(inverse);
+	state->eye[0] = inverse[12];
+	state->eye[1] = inverse[13];
+	state->eye[2] = inverse[14];
+	state->eye[3] = 0.0f;
+	state->eyedir[0] = -inverse[8];
+	state->eyedir[1] = -inverse[9];
+	state->eyedir[2] = -inverse[10];
+	state->eyedir[3] = 0.0f;
+	state->localviewer = This->renderstate[D3DRENDERSTATE_LOCALVIEWER];
+	state->viewscale[0] = (GLfloat)This->viewport.dwWidth * 0.5f;
+	state->viewscale[1] = -(GLfloat)This->viewport.dwHeight * 0.5f;
+	state->viewscale[2] = This->viewport.dvMaxZ - This->viewport.dvMinZ;
+	state->viewscale[3] = 0.0f;
+	state->viewoffset[0] = (GLfloat)This->viewport.dwX + state->viewscale[0];
+	state->viewoffset[1] = (GLfloat)This->viewport.dwY - state->viewscale[1];
+	state->viewoffset[2] = This->viewport.dvMinZ;
+	state->viewoffset[3] = 0.0f;
+	state->lighting = FALSE;
+	state->specular = This->renderstate[D3DRENDERSTATE_SPECULARENABLE];
+	if(This->renderstate[D3DRENDERSTATE_COLORVERTEX])
+	{
+		state->diffusesource = This->renderstate[D3DRENDERSTATE_DIFFUSEMATERIALSOURCE];
+		state->specularsource = This->renderstate[D3DRENDERSTATE_SPECULARMATERIALSOURCE];
+		state->ambientsource = This->renderstate[D3DRENDERSTATE_AMBIENTMATERIALSOURCE];
+		state->emissivesource = This->renderstate[D3DRENDERSTATE_EMISSIVEMATERIALSOURCE];
+	}
+	else state->diffusesource = state->specularsource = state->ambientsource = state->emissivesource = D3DMCS_MATERIAL;
+	glDirect3DDevice7_CopyColor(state->diffuse,&This->material.diffuse);
+	glDirect3DDevice7_CopyColor(state->ambient,&This->material.ambient);
+	glDirect3DDevice7_CopyColor(state->specularcolor,&This->material.specular);
+	glDirect3DDevice7_CopyColor(state->emissive,&This->material.emissive);
+	state->power = This->material.power;
+	ambient = This->renderstate[D3DRENDERSTATE_AMBIENT];
+	state->globalambient[0] = (GLfloat)RGBA_GETRED(ambient) / 255.0f;
+	state->globalambient[1] = (GLfloat)RGBA_GETGREEN(ambient) / 255.0f;
+	state->globalambient[2] = (GLfloat)RGBA_GETBLUE(ambient) / 255.0f;
+	state->globalambient[3] = 0.0f;
+	state->lightcount = 0;
+	for(i = 0; i < LIGHTS_MAX; i++)
+	{
+		if(This->gllights[i] != -1)
+			VertexProc_SetLight(&state->lights[state->lightcount++],&This->lights[This->gllights[i]].light);
+	}
+	TRACE_EXIT(0,0);
+}
+
+/**
+  * Sends all render states, texture stage states and transforms changed since
+  * the last flush to the renderer in a single packet.  Render states that were
+  * set back to the value the renderer already has are dropped.
+  * @param This
+  *  Pointer to glDirect3DDevice7 object
+  */
+void glDirect3DDevice7_FlushState(glDirect3DDevice7 *This)
+{
+	TRACE_ENTER(1,14,This);
+	StateDelta *delta = &This->statedelta;
+	DWORD *ptr = delta->data;
+	DWORD i, j, type;
+	GLfloat *matrix;
+	delta->renderstatecount = delta->texturestagecount = delta->transformcount = 0;
+	for (i = 0; i < (RENDERSTATE_COUNT + 31) / 32; i++)
+	{
+		if (!This->renderstatedirty[i]) continue;
+		for (j = 0; j < 32; j++)
+		{
+			if (!(This->renderstatedirty[i] & (1 << j))) continue;
+			type = (i << 5) + j;
+			if (This->renderstate[type] == This->glrenderstate[type]) continue;
+			This->glrenderstate[type] = This->renderstate[type];
+			ptr[0] = type;
+			ptr[1] = This->renderstate[type];
+			ptr += 2;
+			delta->renderstatecount++;
+		}
+		This->renderstatedirty[i] = 0;
+	}
+	for (i = 0; i < 8; i++)
+	{
+		if (!This->texstagedirty[i]) continue;
+		for (j = 0; j < 32; j++)
+		{
+			if (!(This->texstagedirty[i] & (1 << j))) continue;
+			if (This->texstagevalue[i][j] == This->gltexstagevalue[i][j]) continue;
+			This->gltexstagevalue[i][j] = This->texstagevalue[i][j];
+			ptr[0] = i;
+			ptr[1] = j;
+			ptr[2] = This->texstagevalue[i][j];
+			ptr += 3;
+			delta->texturestagecount++;
+		}
+		This->texstagedirty[i] = 0;
+	}
+	for (type = D3DTRANSFORMSTATE_WORLD; type <= D3DTRANSFORMSTATE_PROJECTION; type++)
+	{
+		if (!(This->transformdirty & (1 << type))) continue;
+		switch (type)
+		{
+		case D3DTRANSFORMSTATE_WORLD:
+			matrix = This->matWorld;
+			break;
+		case D3DTRANSFORMSTATE_VIEW:
+			matrix = This->matView;
+			break;
+		case D3DTRANSFORMSTATE_PROJECTION:
+		default:
+			matrix = This->matProjection;
+			break;
+		}
+		ptr[0] = type;
+		memcpy(&ptr[1], matrix, 16 * sizeof(GLfloat));
+		ptr += 17;
+		delta->transformcount++;
+	}
+	This->transformdirty = 0;
+	glRenderer_ApplyStateDelta(This->renderer, delta);
+	TRACE_EXIT(0,0);
+}
+
 void CalculateExtents(D3DRECT *extents, D3DTLVERTEX *vertices, DWORD count)
 {
 	if(!count) return;
@@ -2507,7 +3027,6 @@ INT glDirect3DDevice7_TransformAndLight(glDirect3DDevice7 *This, D3DTLVERTEX **o
 	D3DVALUE P[4];
 	D3DVALUE L[4];
 	D3DVALUE V[4];
-	D3DVALUE in[4];
 	D3DCOLORVALUE ambient;
 	D3DCOLORVALUE diffuse;
 	D3DCOLORVALUE specular;
@@ -2520,7 +3039,6 @@ INT glDirect3DDevice7_TransformAndLight(glDirect3DDevice7 *This, D3DTLVERTEX **o
 	D3DVALUE attenuation;
 	D3DVALUE pf;
 	DWORD i;
-	in[3] = 1.0f;
 	if(This->transform_dirty) glDirect3DDevice7_UpdateTransform(This);
 	if(*outsize < (dest+count)*sizeof(D3DTLVERTEX))
 	{
@@ -2529,12 +3047,9 @@ INT glDirect3DDevice7_TransformAndLight(glDirect3DDevice7 *This, D3DTLVERTEX **o
 		*output = tmpptr;
 		*outsize = (dest+count)*sizeof(D3DTLVERTEX);
 	}
+	Matrix_TransformPoints(This->matTransform,&input[start].dvX,sizeof(*input),&(*output)[dest].dvSX,sizeof(D3DTLVERTEX),count);
 	for(i = 0; i < count; i++)
 	{
-		in[0] = input[i+start].dvX;
-		in[1] = input[i+start].dvY;
-		in[2] = input[i+start].dvZ;
-		__gluMultMatrixVecf(This->matTransform,in,&(*output)[i+dest].dvSX);
 		glDirect3DDevice7_TransformViewport(This, &(*output)[i+dest]);
 		(*output)[i+dest].dvRHW = 1.0f/(*output)[i+dest].dvRHW;
 		(*output)[i+dest].dvTU = input[i+start].dvTU;
@@ -2545,25 +3060,25 @@ INT glDirect3DDevice7_TransformAndLight(glDirect3DDevice7 *This, D3DTLVERTEX **o
 		ambient.g = (D3DVALUE)RGBA_GETGREEN(This->renderstate[D3DRENDERSTATE_AMBIENT]) / 255.0f;
 		ambient.b = (D3DVALUE)RGBA_GETBLUE(This->renderstate[D3DRENDERSTATE_AMBIENT]) / 255.0f;
 		ambient.a = (D3DVALUE)RGBA_GETALPHA(This->renderstate[D3DRENDERSTATE_AMBIENT]) / 255.0f;
-		for(int l = 0; l < 8; l++)
+		for(int l = 0; l < LIGHTS_MAX; l++)
 		{
 			if(This->gllights[l] != -1)
 			{
-				AddD3DCV(&ambient,&This->lights[This->gllights[l]]->light.dcvAmbient);
-				switch(This->lights[This->gllights[l]]->light.dltType)
+				AddD3DCV(&ambient,&This->lights[This->gllights[l]].light.dcvAmbient);
+				switch(This->lights[This->gllights[l]].light.dltType)
 				{
 				case D3DLIGHT_DIRECTIONAL:
 					NdotHV = 0;
-					memcpy(dir,&This->lights[This->gllights[l]]->light.dvDirection,3*sizeof(D3DVALUE));
+					memcpy(dir,&This->lights[This->gllights[l]].light.dvDirection,3*sizeof(D3DVALUE));
 					normalize(dir);
 					NdotL = max(dot3((float*)&input[i+start].dvNX,(float*)&dir),0.0f);
-					color1 = This->lights[This->gllights[l]]->light.dcvDiffuse;
+					color1 = This->lights[This->gllights[l]].light.dcvDiffuse;
 					MulD3DCVFloat(&color1,NdotL);
 					AddD3DCV(&diffuse,&color1);
 					if((NdotL > 0.0) && (This->material.dvPower != 0.0))
 					{
-						__gluMultMatrixVecf(This->matWorld,&input[i+start].dvX,P);
-						memcpy(L,&This->lights[This->gllights[l]]->light.dvDirection,3*sizeof(D3DVALUE));
+						Matrix_TransformPoints(This->matWorld,&input[i+start].dvX,0,P,0,1);
+						memcpy(L,&This->lights[This->gllights[l]].light.dvDirection,3*sizeof(D3DVALUE));
 						NegativeVec3(L);
 						SubVec3(L,P);
 						normalize(L);
@@ -2572,20 +3087,20 @@ INT glDirect3DDevice7_TransformAndLight(glDirect3DDevice7 *This, D3DTLVERTEX **o
 						normalize(V);
 						AddVec3(L,V);
 						NdotHV = max(dot3((float*)&input[i+start].dvNX,L),0.0f);
-						color1 = This->lights[This->gllights[l]]->light.dcvSpecular;
+						color1 = This->lights[This->gllights[l]].light.dcvSpecular;
 						MulD3DCVFloat(&color1,pow(NdotHV,This->material.dvPower));
 						AddD3DCV(&specular,&color1);
 					}
 				break;
 				case D3DLIGHT_POINT:
-					__gluMultMatrixVecf(This->matWorld,&input[i+start].dvX,P);
-					memcpy(V,&This->lights[This->gllights[l]]->light.dvPosition,3*sizeof(D3DVALUE));
+					Matrix_TransformPoints(This->matWorld,&input[i+start].dvX,0,P,0,1);
+					memcpy(V,&This->lights[This->gllights[l]].light.dvPosition,3*sizeof(D3DVALUE));
 					SubVec3(V,P);
 					length = len3(V);
-					if((length > This->lights[This->gllights[l]]->light.dvRange) && (This->lights[This->gllights[l]]->light.dvRange != 0.0)) continue;
+					if((length > This->lights[This->gllights[l]].light.dvRange) && (This->lights[This->gllights[l]].light.dvRange != 0.0)) continue;
 					normalize(V);
-					attenuation = 1.0f/(This->lights[This->gllights[l]]->light.dvAttenuation0+(length*This->lights[This->gllights[l]]->light.dvAttenuation1)
-						+((length*length)*This->lights[This->gllights[l]]->light.dvAttenuation2));
+					attenuation = 1.0f/(This->lights[This->gllights[l]].light.dvAttenuation0+(length*This->lights[This->gllights[l]].light.dvAttenuation1)
+						+((length*length)*This->lights[This->gllights[l]].light.dvAttenuation2));
 					NdotV = max(0.0f,dot3((float*)&input[i+start].dvNX,V));
 					AddVec3(V,eye);
 					normalize(V);
@@ -2593,10 +3108,10 @@ INT glDirect3DDevice7_TransformAndLight(glDirect3DDevice7 *This, D3DTLVERTEX **o
 					if(NdotV == 0.0f) pf = 0.0f;
 					else if(This->material.dvPower != 0.0f) pf = pow(NdotHV, This->material.dvPower);
 					else pf = 0.0f;
-					color1 = This->lights[This->gllights[l]]->light.dcvDiffuse;
+					color1 = This->lights[This->gllights[l]].light.dcvDiffuse;
 					MulD3DCVFloat(&color1,NdotV*attenuation);
 					AddD3DCV(&diffuse,&color1);
-					color1 = This->lights[This->gllights[l]]->light.dcvSpecular;
+					color1 = This->lights[This->gllights[l]].light.dcvSpecular;
 					MulD3DCVFloat(&color1,pf*attenuation);
 					AddD3DCV(&specular,&color1);
 					break;
@@ -2630,9 +3145,7 @@ INT glDirect3DDevice7_TransformAndLight(glDirect3DDevice7 *This, D3DTLVERTEX **o
 INT glDirect3DDevice7_TransformOnly(glDirect3DDevice7 *This, D3DTLVERTEX **output, DWORD *outsize, D3DVERTEX *input, WORD start, WORD dest, DWORD count, D3DRECT *extents)
 {
 	TRACE_ENTER(8,14,This,14,output,14,outsize,14,input,5,start,5,dest,8,count,14,extents);
-	GLfloat in[4];
 	DWORD i;
-	in[3] = 1.0f;
 	if(This->transform_dirty) glDirect3DDevice7_UpdateTransform(This);
 	if(*outsize < (dest+count)*sizeof(D3DTLVERTEX))
 	{
@@ -2641,12 +3154,9 @@ INT glDirect3DDevice7_TransformOnly(glDirect3DDevice7 *This, D3DTLVERTEX **outpu
 		*output = tmpptr;
 		*outsize = (dest+count)*sizeof(D3DTLVERTEX);
 	}
+	Matrix_TransformPoints(This->matTransform,&input[start].dvX,sizeof(*input),&(*output)[dest].dvSX,sizeof(D3DTLVERTEX),count);
 	for(i = 0; i < count; i++)
 	{
-		in[0] = input[i+start].dvX;
-		in[1] = input[i+start].dvY;
-		in[2] = input[i+start].dvZ;
-		__gluMultMatrixVecf(This->matTransform,in,&(*output)[i+dest].dvSX);
 		glDirect3DDevice7_TransformViewport(This, &(*output)[i+dest]);
 		(*output)[i+dest].dvRHW = 1.0f/(*output)[i+dest].dvRHW;
 		(*output)[i+dest].dcColor = 0xFFFFFFFF;
@@ -2661,9 +3171,7 @@ INT glDirect3DDevice7_TransformOnly(glDirect3DDevice7 *This, D3DTLVERTEX **outpu
 INT glDirect3DDevice7_TransformOnlyLit(glDirect3DDevice7 *This, D3DTLVERTEX **output, DWORD *outsize, D3DLVERTEX *input, WORD start, WORD dest, DWORD count, D3DRECT *extents)
 {
 	TRACE_ENTER(8,14,This,14,output,14,outsize,14,input,5,start,5,dest,8,count,14,extents);
-	GLfloat in[4];
 	DWORD i;
-	in[3] = 1.0f;
 	if(This->transform_dirty) glDirect3DDevice7_UpdateTransform(This);
 	if(*outsize < (dest+count)*sizeof(D3DTLVERTEX))
 	{
@@ -2672,12 +3180,9 @@ INT glDirect3DDevice7_TransformOnlyLit(glDirect3DDevice7 *This, D3DTLVERTEX **ou
 		*output = tmpptr;
 		*outsize = (dest+count)*sizeof(D3DTLVERTEX);
 	}
+	Matrix_TransformPoints(This->matTransform,&input[start].dvX,sizeof(*input),&(*output)[dest].dvSX,sizeof(D3DTLVERTEX),count);
 	for(i = 0; i < count; i++)
 	{
-		in[0] = input[i+start].dvX;
-		in[1] = input[i+start].dvY;
-		in[2] = input[i+start].dvZ;
-		__gluMultMatrixVecf(This->matTransform,in,&(*output)[i+dest].dvSX);
 		glDirect3DDevice7_TransformViewport(This, &(*output)[i+dest]);
 		(*output)[i+dest].dvRHW = 1.0f/(*output)[i+dest].dvRHW;
 		(*output)[i+dest].dcColor = input[i+start].dcColor;
@@ -2723,127 +3228,99 @@ HRESULT glDirect3DDevice7_Execute(glDirect3DDevice7 *This, LPDIRECT3DEXECUTEBUFF
 	vp->Release();
 	D3DEXECUTEBUFFERDESC desc;
 	D3DEXECUTEDATA data;
-	HRESULT err = glDirect3DExecuteBuffer_ExecuteLock((glDirect3DExecuteBuffer*)lpDirect3DExecuteBuffer, &desc, &data);
+	glDirect3DExecuteBuffer *eb = (glDirect3DExecuteBuffer*)lpDirect3DExecuteBuffer;
+	HRESULT err = glDirect3DExecuteBuffer_ExecuteLock(eb, &desc, &data);
 	if(FAILED(err)) TRACE_RET(HRESULT,23,err);
-	unsigned char *opptr = (unsigned char *)desc.lpData + data.dwInstructionOffset;
+	if(!eb->compiled)
+	{
+		err = glDirect3DExecuteBuffer_Compile(eb);
+		if(FAILED(err))
+		{
+			glDirect3DExecuteBuffer_ExecuteUnlock(eb, &data);
+			TRACE_RET(HRESULT,23,err);
+		}
+	}
+	unsigned char *opptr;
 	unsigned char *in_vertptr = (unsigned char *)desc.lpData + data.dwVertexOffset;
-	DWORD offset;
-	INT result;
-	D3DMATRIX mat1,mat2,mat3;
-	bool ebExit = false;
+	D3DMATRIX mat3;
+	const D3DMATRIX *src1, *src2;
+	D3DMATRIXHANDLE dest;
+	DWORD vertexcount;
+	DWORD op;
 	int i;
 	if(This->outbuffersize < desc.dwBufferSize)
 	{
 		unsigned char *tmpbuffer = (unsigned char *)realloc(This->outbuffer,desc.dwBufferSize);
-		if(!tmpbuffer) TRACE_RET(HRESULT,23,DDERR_OUTOFMEMORY);
+		if(!tmpbuffer)
+		{
+			glDirect3DExecuteBuffer_ExecuteUnlock(eb, &data);
+			TRACE_RET(HRESULT,23,DDERR_OUTOFMEMORY);
+		}
 		This->outbuffer = tmpbuffer;
 		This->outbuffersize = desc.dwBufferSize;
-	}	
-	D3DVERTEX *vert_ptr = (D3DVERTEX*)This->outbuffer;
-	while(1)
+	}
+	// Replay the instructions translated when the buffer was last changed
+	for(op = 0; op < eb->opcount; op++)
 	{
-		D3DINSTRUCTION *instruction = (D3DINSTRUCTION*) opptr;
-		offset = 0;
-		switch(instruction->bOpcode)
+		ExecuteOp *instruction = &eb->ops[op];
+		opptr = (unsigned char *)desc.lpData + instruction->offset;
+		// Processed vertices may have been reallocated by an earlier instruction
+		vertexcount = instruction->vertexcount;
+		if(vertexcount > This->outbuffersize / sizeof(D3DTLVERTEX)) vertexcount = This->outbuffersize / sizeof(D3DTLVERTEX);
+		switch(instruction->opcode)
 		{
 		case D3DOP_POINT:
-			opptr += sizeof(D3DINSTRUCTION);
-			if(instruction->bSize < sizeof(D3DPOINT))
-			{
-				opptr += (instruction->bSize*instruction->wCount);
-				break;
-			}
-			for(i = 0; i < instruction->wCount; i++)
-			{
-				if(This->ebBufferSize < (offset + ((D3DPOINT*)opptr)->wCount*sizeof(D3DVERTEX)))
-				{
-					if(!ExpandBuffer((void**)&This->ebBuffer,&This->ebBufferSize,(((D3DPOINT*)opptr)->wCount*sizeof(D3DVERTEX) > 1024) ?
-						((D3DPOINT*)opptr)->wCount*sizeof(D3DVERTEX) : 1024))
-						TRACE_RET(HRESULT,23,DDERR_OUTOFMEMORY);
-				}
-				memcpy(&This->ebBuffer+offset,&vert_ptr[((D3DPOINT*)opptr)->wFirst],((D3DPOINT*)opptr)->wCount*sizeof(D3DVERTEX));
-				offset+=((D3DPOINT*)opptr)->wCount;
-				opptr += instruction->bSize;
-			}
-			glDirect3DDevice7_DrawPrimitive(This, D3DPT_POINTLIST,D3DFVF_TLVERTEX, This->ebBuffer,offset/sizeof(D3DVERTEX),0);
+			if(instruction->indexcount) glDirect3DDevice7_DrawIndexedPrimitive(This, D3DPT_POINTLIST,D3DFVF_TLVERTEX,
+				This->outbuffer,vertexcount,&eb->indices[instruction->offset],instruction->indexcount,0);
 			break;
 		case D3DOP_LINE:
-			opptr += sizeof(D3DINSTRUCTION);
-			if(instruction->bSize < sizeof(D3DLINE))
-			{
-				opptr += (instruction->bSize*instruction->wCount);
-				break;
-			}
-			for(i = 0; i < instruction->wCount; i++)
-			{
-				if(This->ebBufferSize < (offset + sizeof(D3DLINE)))
-				{
-					if(!ExpandBuffer((void**)&This->ebBuffer,&This->ebBufferSize,1024)) TRACE_RET(HRESULT,23,DDERR_OUTOFMEMORY);
-				}
-				memcpy(&This->ebBuffer+offset,opptr,sizeof(D3DLINE));
-				offset += sizeof(D3DLINE);
-				opptr += instruction->bSize;
-			}
-			glDirect3DDevice7_DrawIndexedPrimitive(This, D3DPT_LINELIST,D3DFVF_TLVERTEX,vert_ptr,(desc.dwBufferSize-data.dwVertexOffset)/sizeof(D3DVERTEX),
-				(WORD*)This->ebBuffer,instruction->wCount*2,0);
+			if(instruction->indexcount) glDirect3DDevice7_DrawIndexedPrimitive(This, D3DPT_LINELIST,D3DFVF_TLVERTEX,
+				This->outbuffer,vertexcount,&eb->indices[instruction->offset],instruction->indexcount,0);
 			break;
 		case D3DOP_TRIANGLE:
-			opptr += sizeof(D3DINSTRUCTION);
-			if(instruction->bSize < sizeof(D3DTRIANGLE))
-			{
-				opptr += (instruction->bSize*instruction->wCount);
-				break;
-			}
-			for(i = 0; i < instruction->wCount; i++)
-			{
-				result = AddTriangle(&This->ebBuffer,&This->ebBufferSize,&offset,(D3DTRIANGLE*)opptr);
-				if(result == -1) TRACE_RET(HRESULT,23,DDERR_OUTOFMEMORY);
-				opptr += instruction->bSize;
-			}
-			if(instruction->wCount) glDirect3DDevice7_DrawIndexedPrimitive(This, D3DPT_TRIANGLELIST,D3DFVF_TLVERTEX,vert_ptr,
-				(desc.dwBufferSize-data.dwVertexOffset)/sizeof(D3DVERTEX), (WORD*)This->ebBuffer,instruction->wCount*3,0);
+			if(instruction->indexcount) glDirect3DDevice7_DrawIndexedPrimitive(This, D3DPT_TRIANGLELIST,D3DFVF_TLVERTEX,
+				This->outbuffer,vertexcount,&eb->indices[instruction->offset],instruction->indexcount,0);
 			break;
 		case D3DOP_MATRIXLOAD:
-			opptr += sizeof(D3DINSTRUCTION);
-			if(instruction->bSize < sizeof(D3DMATRIXLOAD))
-			{
-				opptr += (instruction->bSize*instruction->wCount);
+			if(instruction->size < sizeof(D3DMATRIXLOAD))
 				break;
-			}
-			for(i = 0; i < instruction->wCount; i++)
+			for(i = 0; i < instruction->count; i++)
 			{
-				glDirect3DDevice7_GetMatrix(This, ((D3DMATRIXLOAD*)opptr)->hSrcMatrix,&mat1);
-				glDirect3DDevice7_SetMatrix(This, ((D3DMATRIXLOAD*)opptr)->hDestMatrix,&mat1);
-				opptr += instruction->bSize;
+				src1 = glDirect3DDevice7__Matrix(This, ((D3DMATRIXLOAD*)opptr)->hSrcMatrix);
+				dest = ((D3DMATRIXLOAD*)opptr)->hDestMatrix;
+				if(src1 && dest && glDirect3DDevice7__Matrix(This, dest))
+				{
+					memcpy(&This->matrices[dest].matrix,src1,sizeof(D3DMATRIX));
+					glDirect3DDevice7__MatrixChanged(This, dest);
+				}
+				opptr += instruction->size;
 			}
 			break;
 		case D3DOP_MATRIXMULTIPLY:
-			opptr += sizeof(D3DINSTRUCTION);
-			if(instruction->bSize < sizeof(D3DMATRIXMULTIPLY))
-			{
-				opptr += (instruction->bSize*instruction->wCount);
+			if(instruction->size < sizeof(D3DMATRIXMULTIPLY))
 				break;
-			}
-			for(i = 0; i < instruction->wCount; i++)
+			for(i = 0; i < instruction->count; i++)
 			{
-				glDirect3DDevice7_GetMatrix(This, ((D3DMATRIXMULTIPLY*)opptr)->hSrcMatrix1,&mat1);
-				glDirect3DDevice7_GetMatrix(This, ((D3DMATRIXMULTIPLY*)opptr)->hSrcMatrix2,&mat2);
-				__gluMultMatricesf((GLfloat*)&mat1,(GLfloat*)&mat2,(GLfloat*)&mat3);
-				glDirect3DDevice7_SetMatrix(This, ((D3DMATRIXMULTIPLY*)opptr)->hDestMatrix,&mat3);
-				opptr += instruction->bSize;
+				src1 = glDirect3DDevice7__Matrix(This, ((D3DMATRIXMULTIPLY*)opptr)->hSrcMatrix1);
+				src2 = glDirect3DDevice7__Matrix(This, ((D3DMATRIXMULTIPLY*)opptr)->hSrcMatrix2);
+				dest = ((D3DMATRIXMULTIPLY*)opptr)->hDestMatrix;
+				if(src1 && src2 && dest && glDirect3DDevice7__Matrix(This, dest))
+				{
+					// The destination may be one of the sources
+					__gluMultMatricesf((const GLfloat*)src1,(const GLfloat*)src2,(GLfloat*)&mat3);
+					memcpy(&This->matrices[dest].matrix,&mat3,sizeof(D3DMATRIX));
+					glDirect3DDevice7__MatrixChanged(This, dest);
+				}
+				opptr += instruction->size;
 			}
 			break;
 		case D3DOP_STATETRANSFORM:
-			opptr += sizeof(D3DINSTRUCTION);
-			if(instruction->bSize < sizeof(D3DSTATE))
-			{
-				opptr += (instruction->bSize*instruction->wCount);
+			if(instruction->size < sizeof(D3DSTATE))
 				break;
-			}
-			for(i = 0; i < instruction->wCount; i++)
+			for(i = 0; i < instruction->count; i++)
 			{
-				glDirect3DDevice7_GetMatrix(This, ((D3DSTATE*)opptr)->dwArg[0],&mat1);
-				glDirect3DDevice7_SetTransform(This, ((D3DSTATE*)opptr)->dtstTransformStateType,&mat1);
+				src1 = glDirect3DDevice7__Matrix(This, ((D3DSTATE*)opptr)->dwArg[0]);
+				if(src1) glDirect3DDevice7_SetTransform(This, ((D3DSTATE*)opptr)->dtstTransformStateType,(LPD3DMATRIX)src1);
 				switch(((D3DSTATE*)opptr)->dtstTransformStateType)
 				{
 				case D3DTRANSFORMSTATE_WORLD:
@@ -2858,43 +3335,31 @@ HRESULT glDirect3DDevice7_Execute(glDirect3DDevice7 *This, LPDIRECT3DEXECUTEBUFF
 				default:
 					break;
 				}
-				opptr += instruction->bSize;
+				opptr += instruction->size;
 			}
 			break;
 		case D3DOP_STATELIGHT:
-			opptr += sizeof(D3DINSTRUCTION);
-			if(instruction->bSize < sizeof(D3DSTATE))
-			{
-				opptr += (instruction->bSize*instruction->wCount);
+			if(instruction->size < sizeof(D3DSTATE))
 				break;
-			}
-			for(i = 0; i < instruction->wCount; i++)
+			for(i = 0; i < instruction->count; i++)
 			{
 				glDirect3DDevice7_SetLightState(This, ((D3DSTATE*)opptr)->dlstLightStateType,((D3DSTATE*)opptr)->dwArg[0]);
-				opptr += instruction->bSize;
+				opptr += instruction->size;
 			}
 			break;
 		case D3DOP_STATERENDER:
-			opptr += sizeof(D3DINSTRUCTION);
-			if(instruction->bSize < sizeof(D3DSTATE))
-			{
-				opptr += (instruction->bSize*instruction->wCount);
+			if(instruction->size < sizeof(D3DSTATE))
 				break;
-			}
-			for(i = 0; i < instruction->wCount; i++)
+			for(i = 0; i < instruction->count; i++)
 			{
 				glDirect3DDevice7_SetRenderState(This, ((D3DSTATE*)opptr)->drstRenderStateType,((D3DSTATE*)opptr)->dwArg[0]);
-				opptr += instruction->bSize;
+				opptr += instruction->size;
 			}
 			break;
 		case D3DOP_PROCESSVERTICES:
-			opptr += sizeof(D3DINSTRUCTION);
-			if(instruction->bSize < sizeof(D3DPROCESSVERTICES))
-			{
-				opptr += (instruction->bSize*instruction->wCount);
+			if(instruction->size < sizeof(D3DPROCESSVERTICES))
 				break;
-			}
-			for(i = 0; i < instruction->wCount; i++)
+			for(i = 0; i < instruction->count; i++)
 			{
 				switch(((D3DPROCESSVERTICES*)opptr)->dwFlags & D3DPROCESSVERTICES_OPMASK)
 				{
@@ -2934,47 +3399,35 @@ HRESULT glDirect3DDevice7_Execute(glDirect3DDevice7 *This, LPDIRECT3DEXECUTEBUFF
 					break;
 				}
 				This->stats.dwVerticesProcessed += ((D3DPROCESSVERTICES*)opptr)->dwCount;
-				opptr += instruction->bSize;
+				opptr += instruction->size;
 			}
 			break;
 		case D3DOP_TEXTURELOAD:
-			opptr += sizeof(D3DINSTRUCTION)+(instruction->bSize*instruction->wCount);
 			FIXME("D3DOP_TEXTURELOAD: stub");
 			break;
-		case D3DOP_EXIT:
-			ebExit = true;
-			break;
 		case D3DOP_BRANCHFORWARD:
-			opptr += sizeof(D3DINSTRUCTION)+(instruction->bSize*instruction->wCount);
 			FIXME("D3DOP_BRANCHFORWARD: stub");
 			break;
 		case D3DOP_SPAN:
-			opptr += sizeof(D3DINSTRUCTION)+(instruction->bSize*instruction->wCount);
 			FIXME("D3DOP_SPAN: stub");
 			break;
 		case D3DOP_SETSTATUS:
-			opptr += sizeof(D3DINSTRUCTION);
-			if(instruction->bSize < sizeof(D3DSTATUS))
-			{
-				opptr += (instruction->bSize*instruction->wCount);
+			if(instruction->size < sizeof(D3DSTATUS))
 				break;
-			}
-			for(i = 0; i < instruction->wCount; i++)
+			for(i = 0; i < instruction->count; i++)
 			{
 				if(((D3DSTATUS*)opptr)->dwFlags & D3DSETSTATUS_STATUS)
 					data.dsStatus.dwStatus = ((D3DSTATUS*)opptr)->dwStatus;
 				if(((D3DSTATUS*)opptr)->dwFlags & D3DSETSTATUS_EXTENTS)
 					data.dsStatus.drExtent = ((D3DSTATUS*)opptr)->drExtent;
-				opptr += instruction->bSize;
+				opptr += instruction->size;
 			}
 			break;
 		default:
-			opptr += sizeof(D3DINSTRUCTION)+(instruction->bSize*instruction->wCount);
 			break;
 		}
-		if(ebExit) break;
 	}
-	glDirect3DExecuteBuffer_ExecuteUnlock((glDirect3DExecuteBuffer*)lpDirect3DExecuteBuffer, &data);
+	glDirect3DExecuteBuffer_ExecuteUnlock(eb, &data);
 	TRACE_EXIT(23,D3D_OK);
 	return D3D_OK;
 }
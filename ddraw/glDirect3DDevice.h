@@ -25,9 +25,37 @@ struct D3D1MATRIX
 {
 	BOOL active;
 	D3DMATRIX matrix;
+	D3DMATRIXHANDLE nextfree;  // Next free handle while inactive, 0 ends the free list
+};
+
+// Light set with IDirect3DDevice7::SetLight, addressed by its light index
+struct D3D7LIGHT
+{
+	BOOL active;
+	D3DLIGHT7 light;
+};
+
+// Primitive built with Begin/Vertex/End or BeginIndexed/Index/End
+struct D3DIMMEDIATE
+{
+	BOOL active;
+	BOOL indexed;
+	D3DPRIMITIVETYPE primtype;
+	DWORD fvf;
+	DWORD flags;
+	DWORD vertexsize;
+	BYTE *vertices;  // Staging for Vertex, grows as needed and is kept between primitives
+	DWORD vertexcount;
+	DWORD vertexmax;
+	WORD *indices;  // Staging for Index
+	DWORD indexcount;
+	DWORD indexmax;
+	LPVOID indexedvertices;  // Vertices passed to BeginIndexed
+	DWORD indexedvertexcount;
 };
 
 struct glDirect3DLight;
+struct glDirect3DStateBlock;
 struct dxglDirectDrawSurface7;
 struct glDirect3DMaterial3;
 struct glDirect3DViewport3;
@@ -44,14 +72,18 @@ typedef struct glDirect3DDevice7
 	GLfloat matWorld[16];
 	GLfloat matView[16];
 	GLfloat matProjection[16];
+	GLfloat matModelView[16];  // World * view, rebuilt when modelview_dirty is set
 	GLfloat matTransform[16];
 	bool transform_dirty;
+	GLfloat frustum[24];  // Planes of matTransform for ComputeSphereVisibility
+	bool frustum_dirty;
 	D3D1MATRIX *matrices;
 	D3DMATRIXHANDLE matrixcount;
+	D3DMATRIXHANDLE matrixfree;  // First free matrix handle, 0 if all are in use
 	D3DMATERIAL7 material;
 	D3DVIEWPORT7 viewport;
-	glDirect3DLight **lights;
-	int gllights[8];
+	D3D7LIGHT *lights;
+	int gllights[LIGHTS_MAX];
 	dxglDirectDrawSurface7 *glDDS7;
 	DWORD renderstate[RENDERSTATE_COUNT];
 	TEXTURESTAGE texstages[8];
@@ -82,8 +114,6 @@ typedef struct glDirect3DDevice7
 	GLubyte *specular;
 	GLubyte *ambient;
 	GLfloat *texcoords[8];
-	GLVERTEX vertdata[18];
-	int texformats[8];
 	DWORD maxmaterials;
 	DWORD maxtextures;
 	glDirect3DViewport3 **viewports;
@@ -106,6 +136,24 @@ typedef struct glDirect3DDevice7
 	int version;
 	BOOL dx5init;
 	BOOL dx2init;
+	// Deferred state, sent to the renderer as one packet before each draw
+	DWORD glrenderstate[RENDERSTATE_COUNT];
+	DWORD renderstatedirty[(RENDERSTATE_COUNT + 31) / 32];
+	DWORD texstagevalue[8][32];
+	DWORD gltexstagevalue[8][32];
+	DWORD texstagedirty[8];
+	DWORD transformdirty;
+	StateDelta statedelta;
+	// State blocks, addressed by index + 1
+	glDirect3DStateBlock **stateblocks;
+	DWORD stateblockcount;
+	DWORD maxstateblocks;
+	glDirect3DStateBlock *recordingblock;
+	D3DIMMEDIATE immediate;
+	// Only kept up to date by draws once the application has used it
+	D3DCLIPSTATUS clipstatus;
+	BOOL clipstatusused;
+	BOOL clipstatusreset;  // Set until a draw replaces the intersection flags
 
 } glDirect3DDevice7;
 
@@ -269,13 +317,14 @@ INT glDirect3DDevice7_TransformOnly(glDirect3DDevice7 *This, D3DTLVERTEX **outpu
 INT glDirect3DDevice7_TransformOnlyLit(glDirect3DDevice7 *This, D3DTLVERTEX **output, DWORD *outsize, D3DLVERTEX *input, WORD start, WORD dest, DWORD count, D3DRECT *extents);
 INT glDirect3DDevice7_CopyVertices(glDirect3DDevice7 *This, D3DTLVERTEX **output, DWORD *outsize, D3DTLVERTEX *input, WORD start, WORD dest, DWORD count, D3DRECT *extents);
 void glDirect3DDevice7_UpdateTransform(glDirect3DDevice7 *This);
+void glDirect3DDevice7_FlushState(glDirect3DDevice7 *This);
+void glDirect3DDevice7_GetVertexProcState(glDirect3DDevice7 *This, struct VERTEXPROCSTATE *state);
 void glDirect3DDevice7_InitDX2(glDirect3DDevice7 *This);
 void glDirect3DDevice7_InitDX5(glDirect3DDevice7 *This);
 //__int64 glDirect3DDevice7_SelectShader(glDirect3DDevice7 *This, GLVERTEX *VertexType);
 void glDirect3DDevice7_SetScale(glDirect3DDevice7 *This, D3DVALUE x, D3DVALUE y);
 ULONG glDirect3DDevice7_AddRefInternal(glDirect3DDevice7 *This);
 ULONG glDirect3DDevice7_ReleaseInternal(glDirect3DDevice7 *This);
-HRESULT glDirect3DDevice7_fvftoglvertex(glDirect3DDevice7 *This, DWORD dwVertexTypeDesc,LPDWORD vertptr);
 
 
 struct glDirect3DDevice3Vtbl;
@@ -43,6 +43,11 @@ HRESULT glDirect3DExecuteBuffer_Create(LPD3DEXECUTEBUFFERDESC lpDesc, glDirect3D
 	This->locked = FALSE;
 	This->inuse = FALSE;
 	This->data = NULL;
+	This->compiled = FALSE;
+	This->ops = NULL;
+	This->opcount = This->maxops = 0;
+	This->indices = NULL;
+	This->indexcount = This->maxindices = 0;
 	This->desc = *lpDesc;
 	if(!(This->desc.dwFlags & D3DDEB_CAPS))
 	{
@@ -58,6 +63,8 @@ void glDirect3DExecuteBuffer_Destroy(glDirect3DExecuteBuffer *This)
 {
 	TRACE_ENTER(1,14,This);
 	if(This->data) free(This->data);
+	if(This->ops) free(This->ops);
+	if(This->indices) free(This->indices);
 	free(This);
 	TRACE_EXIT(0,0);
 }
@@ -137,6 +144,8 @@ HRESULT WINAPI glDirect3DExecuteBuffer_Lock(glDirect3DExecuteBuffer *This, LPD3D
 	This->desc.lpData = This->data;
 	memcpy(lpDesc,&This->desc,sizeof(D3DEXECUTEBUFFERDESC));
 	This->locked = TRUE;
+	// The application may rewrite the instructions
+	This->compiled = FALSE;
 	TRACE_EXIT(23,D3D_OK);
 	return D3D_OK;
 }
@@ -145,8 +154,9 @@ HRESULT WINAPI glDirect3DExecuteBuffer_Optimize(glDirect3DExecuteBuffer *This, D
 {
 	TRACE_ENTER(2,14,This,9,dwDummy);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	TRACE_EXIT(23,DDERR_UNSUPPORTED);
-	return DDERR_UNSUPPORTED;
+	if(This->locked) TRACE_RET(HRESULT,23,D3DERR_EXECUTE_LOCKED);
+	if(!This->data) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	TRACE_RET(HRESULT,23,glDirect3DExecuteBuffer_Compile(This));
 }
 
 HRESULT WINAPI glDirect3DExecuteBuffer_SetExecuteData(glDirect3DExecuteBuffer *This, LPD3DEXECUTEDATA lpData)
@@ -156,6 +166,7 @@ HRESULT WINAPI glDirect3DExecuteBuffer_SetExecuteData(glDirect3DExecuteBuffer *T
 	if(!lpData) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
 	if(lpData->dwSize != sizeof(D3DEXECUTEDATA)) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
 	memcpy(&This->datadesc,lpData,sizeof(D3DEXECUTEDATA));
+	This->compiled = FALSE;
 	TRACE_EXIT(23,D3D_OK);
 	return D3D_OK;
 }
@@ -213,4 +224,154 @@ HRESULT glDirect3DExecuteBuffer_ExecuteUnlock(glDirect3DExecuteBuffer *This, LPD
 	memcpy(&This->datadesc,lpData,sizeof(D3DEXECUTEDATA));
 	TRACE_RET(HRESULT,23,D3D_OK);
 	return D3D_OK;
-}
\ No newline at end of file
+}
+
+/**
+  * Adds an instruction to the translated instruction stream.
+  * @param This
+  *  Pointer to glDirect3DExecuteBuffer object
+  * @return
+  *  Pointer to the new instruction, or NULL if out of memory
+  */
+static ExecuteOp *glDirect3DExecuteBuffer_AddOp(glDirect3DExecuteBuffer *This)
+{
+	ExecuteOp *ptr;
+	if(This->opcount >= This->maxops)
+	{
+		ptr = (ExecuteOp*)realloc(This->ops, (This->maxops + 64) * sizeof(ExecuteOp));
+		if(!ptr) return NULL;
+		This->ops = ptr;
+		This->maxops += 64;
+	}
+	ZeroMemory(&This->ops[This->opcount], sizeof(ExecuteOp));
+	return &This->ops[This->opcount++];
+}
+
+/**
+  * Adds room for indices to the translated instruction stream.
+  * @param This
+  *  Pointer to glDirect3DExecuteBuffer object
+  * @param count
+  *  Number of indices to add
+  * @return
+  *  Pointer to the new indices, or NULL if out of memory
+  */
+static WORD *glDirect3DExecuteBuffer_AddIndices(glDirect3DExecuteBuffer *This, DWORD count)
+{
+	WORD *ptr;
+	DWORD newmax;
+	if(This->indexcount + count > This->maxindices)
+	{
+		newmax = This->maxindices ? This->maxindices : 1024;
+		while(newmax < This->indexcount + count) newmax *= 2;
+		ptr = (WORD*)realloc(This->indices, newmax * sizeof(WORD));
+		if(!ptr) return NULL;
+		This->indices = ptr;
+		This->maxindices = newmax;
+	}
+	ptr = &This->indices[This->indexcount];
+	This->indexcount += count;
+	return ptr;
+}
+
+/**
+  * Translates the instruction stream of an execute buffer into a list of
+  * instructions that glDirect3DDevice7_Execute replays.  Point, line and
+  * triangle instructions become ready-made index lists, so a buffer executed
+  * repeatedly without changes is only walked once.
+  * @param This
+  *  Pointer to glDirect3DExecuteBuffer object
+  * @return
+  *  D3D_OK if the call succeeds, or DDERR_OUTOFMEMORY if out of memory
+  */
+HRESULT glDirect3DExecuteBuffer_Compile(glDirect3DExecuteBuffer *This)
+{
+	TRACE_ENTER(1,14,This);
+	unsigned char *opptr = This->data + This->datadesc.dwInstructionOffset;
+	unsigned char *end = This->data + This->desc.dwBufferSize;
+	D3DINSTRUCTION *instruction;
+	ExecuteOp *op;
+	WORD *indices;
+	DWORD maxindex;
+	DWORD i, j;
+	This->compiled = FALSE;
+	This->opcount = 0;
+	This->indexcount = 0;
+	if(This->datadesc.dwInstructionLength &&
+		(This->datadesc.dwInstructionOffset + This->datadesc.dwInstructionLength < This->desc.dwBufferSize))
+		end = opptr + This->datadesc.dwInstructionLength;
+	while(opptr + sizeof(D3DINSTRUCTION) <= end)
+	{
+		instruction = (D3DINSTRUCTION*)opptr;
+		opptr += sizeof(D3DINSTRUCTION);
+		if(opptr + (instruction->bSize * instruction->wCount) > end) break;
+		op = glDirect3DExecuteBuffer_AddOp(This);
+		if(!op) TRACE_RET(HRESULT,23,DDERR_OUTOFMEMORY);
+		op->opcode = instruction->bOpcode;
+		op->size = instruction->bSize;
+		op->count = instruction->wCount;
+		op->offset = (DWORD)(opptr - This->data);
+		maxindex = 0;
+		switch(instruction->bOpcode)
+		{
+		case D3DOP_POINT:
+			if(instruction->bSize < sizeof(D3DPOINT)) break;
+			op->offset = This->indexcount;
+			for(i = 0; i < instruction->wCount; i++)
+			{
+				D3DPOINT *point = (D3DPOINT*)(opptr + (i * instruction->bSize));
+				indices = glDirect3DExecuteBuffer_AddIndices(This, point->wCount);
+				if(!indices) TRACE_RET(HRESULT,23,DDERR_OUTOFMEMORY);
+				for(j = 0; j < point->wCount; j++)
+					indices[j] = point->wFirst + (WORD)j;
+				if(point->wCount && ((DWORD)point->wFirst + point->wCount > maxindex))
+					maxindex = point->wFirst + point->wCount;
+			}
+			op->indexcount = This->indexcount - op->offset;
+			op->vertexcount = maxindex;
+			break;
+		case D3DOP_LINE:
+			if(instruction->bSize < sizeof(D3DLINE)) break;
+			op->offset = This->indexcount;
+			indices = glDirect3DExecuteBuffer_AddIndices(This, instruction->wCount * 2);
+			if(!indices) TRACE_RET(HRESULT,23,DDERR_OUTOFMEMORY);
+			for(i = 0; i < instruction->wCount; i++)
+			{
+				D3DLINE *line = (D3DLINE*)(opptr + (i * instruction->bSize));
+				indices[(i * 2) + 0] = line->v1;
+				indices[(i * 2) + 1] = line->v2;
+				if((DWORD)line->v1 + 1 > maxindex) maxindex = line->v1 + 1;
+				if((DWORD)line->v2 + 1 > maxindex) maxindex = line->v2 + 1;
+			}
+			op->indexcount = instruction->wCount * 2;
+			op->vertexcount = maxindex;
+			break;
+		case D3DOP_TRIANGLE:
+			if(instruction->bSize < sizeof(D3DTRIANGLE)) break;
+			op->offset = This->indexcount;
+			indices = glDirect3DExecuteBuffer_AddIndices(This, instruction->wCount * 3);
+			if(!indices) TRACE_RET(HRESULT,23,DDERR_OUTOFMEMORY);
+			// FIXME:  Process triangle strips and fans.
+			for(i = 0; i < instruction->wCount; i++)
+			{
+				D3DTRIANGLE *triangle = (D3DTRIANGLE*)(opptr + (i * instruction->bSize));
+				indices[(i * 3) + 0] = triangle->v1;
+				indices[(i * 3) + 1] = triangle->v2;
+				indices[(i * 3) + 2] = triangle->v3;
+				if((DWORD)triangle->v1 + 1 > maxindex) maxindex = triangle->v1 + 1;
+				if((DWORD)triangle->v2 + 1 > maxindex) maxindex = triangle->v2 + 1;
+				if((DWORD)triangle->v3 + 1 > maxindex) maxindex = triangle->v3 + 1;
+			}
+			op->indexcount = instruction->wCount * 3;
+			op->vertexcount = maxindex;
+			break;
+		default:
+			break;
+		}
+		if(instruction->bOpcode == D3DOP_EXIT) break;
+		opptr += instruction->bSize * instruction->wCount;
+	}
+	This->compiled = TRUE;
+	TRACE_EXIT(23,D3D_OK);
+	return D3D_OK;
+}
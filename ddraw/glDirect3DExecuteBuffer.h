@@ -21,6 +21,17 @@
 
 struct glDirect3DExecuteBufferVtbl;
 
+// Instruction of an execute buffer as translated by glDirect3DExecuteBuffer_Compile
+typedef struct ExecuteOp
+{
+	BYTE opcode;  // D3DOP_* code of the instruction
+	BYTE size;  // Size of each data element
+	WORD count;  // Number of data elements
+	DWORD offset;  // Offset of the data in the buffer, or of the first index for draws
+	DWORD indexcount;  // Number of indices of a draw
+	DWORD vertexcount;  // Number of processed vertices read by a draw
+} ExecuteOp;
+
 typedef struct glDirect3DExecuteBuffer
 {
 	glDirect3DExecuteBufferVtbl *lpVtbl;
@@ -30,6 +41,14 @@ typedef struct glDirect3DExecuteBuffer
 	unsigned char *data;
 	bool locked;
 	bool inuse;
+	// Translated instruction stream, replayed until the buffer is locked again
+	bool compiled;
+	ExecuteOp *ops;
+	DWORD opcount;
+	DWORD maxops;
+	WORD *indices;  // Point, line and triangle lists of all draws in ops
+	DWORD indexcount;
+	DWORD maxindices;
 } glDirect3DExecuteBuffer;
 
 typedef struct glDirect3DExecuteBufferVtbl
@@ -60,5 +79,6 @@ HRESULT WINAPI glDirect3DExecuteBuffer_Unlock(glDirect3DExecuteBuffer *This);
 HRESULT WINAPI glDirect3DExecuteBuffer_Validate(glDirect3DExecuteBuffer *This, LPDWORD lpdwOffset, LPD3DVALIDATECALLBACK lpFunc, LPVOID lpUserArg, DWORD dwReserved);
 HRESULT glDirect3DExecuteBuffer_ExecuteLock(glDirect3DExecuteBuffer *This, LPD3DEXECUTEBUFFERDESC lpDesc,LPD3DEXECUTEDATA lpData);
 HRESULT glDirect3DExecuteBuffer_ExecuteUnlock(glDirect3DExecuteBuffer *This, LPD3DEXECUTEDATA lpData);
+HRESULT glDirect3DExecuteBuffer_Compile(glDirect3DExecuteBuffer *This);
 
 #endif //__GLDIRECT3DEXECUTEBUFFER_H
@@ -0,0 +1,378 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#include "common.h"
+#include "glRenderer.h"
+#include "glDirect3DDevice.h"
+#include "glDirect3DLight.h"
+#include "glDirect3DStateBlock.h"
+
+// Render states saved by D3DSBT_PIXELSTATE
+static const DWORD pixelrenderstates[] =
+{
+	D3DRENDERSTATE_ZENABLE, D3DRENDERSTATE_FILLMODE, D3DRENDERSTATE_SHADEMODE, D3DRENDERSTATE_LINEPATTERN,
+	D3DRENDERSTATE_ZWRITEENABLE, D3DRENDERSTATE_ALPHATESTENABLE, D3DRENDERSTATE_LASTPIXEL, D3DRENDERSTATE_SRCBLEND,
+	D3DRENDERSTATE_DESTBLEND, D3DRENDERSTATE_ZFUNC, D3DRENDERSTATE_ALPHAREF, D3DRENDERSTATE_ALPHAFUNC,
+	D3DRENDERSTATE_DITHERENABLE, D3DRENDERSTATE_FOGSTART, D3DRENDERSTATE_FOGEND, D3DRENDERSTATE_FOGDENSITY,
+	D3DRENDERSTATE_ALPHABLENDENABLE, D3DRENDERSTATE_COLORKEYENABLE, D3DRENDERSTATE_ZBIAS, D3DRENDERSTATE_STENCILENABLE,
+	D3DRENDERSTATE_STENCILFAIL, D3DRENDERSTATE_STENCILZFAIL, D3DRENDERSTATE_STENCILPASS, D3DRENDERSTATE_STENCILFUNC,
+	D3DRENDERSTATE_STENCILREF, D3DRENDERSTATE_STENCILMASK, D3DRENDERSTATE_STENCILWRITEMASK, D3DRENDERSTATE_TEXTUREFACTOR,
+	D3DRENDERSTATE_WRAP0, D3DRENDERSTATE_WRAP1, D3DRENDERSTATE_WRAP2, D3DRENDERSTATE_WRAP3,
+	D3DRENDERSTATE_WRAP4, D3DRENDERSTATE_WRAP5, D3DRENDERSTATE_WRAP6, D3DRENDERSTATE_WRAP7
+};
+
+// Render states saved by D3DSBT_VERTEXSTATE
+static const DWORD vertexrenderstates[] =
+{
+	D3DRENDERSTATE_SHADEMODE, D3DRENDERSTATE_SPECULARENABLE, D3DRENDERSTATE_CULLMODE, D3DRENDERSTATE_FOGENABLE,
+	D3DRENDERSTATE_FOGCOLOR, D3DRENDERSTATE_FOGTABLEMODE, D3DRENDERSTATE_FOGSTART, D3DRENDERSTATE_FOGEND,
+	D3DRENDERSTATE_FOGDENSITY, D3DRENDERSTATE_RANGEFOGENABLE, D3DRENDERSTATE_AMBIENT, D3DRENDERSTATE_COLORVERTEX,
+	D3DRENDERSTATE_FOGVERTEXMODE, D3DRENDERSTATE_CLIPPING, D3DRENDERSTATE_LIGHTING, D3DRENDERSTATE_NORMALIZENORMALS,
+	D3DRENDERSTATE_LOCALVIEWER, D3DRENDERSTATE_EMISSIVEMATERIALSOURCE, D3DRENDERSTATE_AMBIENTMATERIALSOURCE,
+	D3DRENDERSTATE_DIFFUSEMATERIALSOURCE, D3DRENDERSTATE_SPECULARMATERIALSOURCE, D3DRENDERSTATE_VERTEXBLEND,
+	D3DRENDERSTATE_CLIPPLANEENABLE
+};
+
+HRESULT glDirect3DStateBlock_Create(glDirect3DStateBlock **block)
+{
+	TRACE_ENTER(1,14,block);
+	glDirect3DStateBlock *This = (glDirect3DStateBlock*)malloc(sizeof(glDirect3DStateBlock));
+	if(!This) TRACE_RET(HRESULT,23,DDERR_OUTOFMEMORY);
+	ZeroMemory(This,sizeof(glDirect3DStateBlock));
+	*block = This;
+	TRACE_EXIT(23,D3D_OK);
+	return D3D_OK;
+}
+
+/**
+  * Creates a state block containing the current values of a predefined set of
+  * device states.
+  * @param device
+  *  Pointer to glDirect3DDevice7 object to read the state from
+  * @param type
+  *  D3DSBT_ALL, D3DSBT_PIXELSTATE or D3DSBT_VERTEXSTATE
+  * @param block
+  *  Pointer to receive the new state block
+  * @return
+  *  D3D_OK on success, otherwise an error code
+  */
+HRESULT glDirect3DStateBlock_CreateType(glDirect3DDevice7 *device, D3DSTATEBLOCKTYPE type, glDirect3DStateBlock **block)
+{
+	TRACE_ENTER(3,14,device,9,type,14,block);
+	glDirect3DStateBlock *This;
+	HRESULT error;
+	DWORD i, j;
+	BOOL pixel = (type == D3DSBT_ALL) || (type == D3DSBT_PIXELSTATE);
+	BOOL vertex = (type == D3DSBT_ALL) || (type == D3DSBT_VERTEXSTATE);
+	if(!pixel && !vertex) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	error = glDirect3DStateBlock_Create(&This);
+	if(FAILED(error)) TRACE_RET(HRESULT,23,error);
+	if(type == D3DSBT_ALL)
+	{
+		for(i = D3DRENDERSTATE_ANTIALIAS; i <= D3DRENDERSTATE_CLIPPLANEENABLE; i++)
+		{
+			// Legacy states that map onto texture stage states are covered by those
+			switch(i)
+			{
+			case D3DRENDERSTATE_TEXTUREADDRESS:
+			case D3DRENDERSTATE_WRAPU:
+			case D3DRENDERSTATE_WRAPV:
+			case D3DRENDERSTATE_TEXTUREMAG:
+			case D3DRENDERSTATE_TEXTUREMIN:
+			case D3DRENDERSTATE_TEXTUREMAPBLEND:
+				continue;
+			}
+			error = glDirect3DStateBlock_RecordRenderState(This,i,0);
+			if(FAILED(error)) break;
+		}
+		for(i = 0; i < 8; i++)
+		{
+			for(j = D3DTSS_COLOROP; j <= D3DTSS_TEXTURETRANSFORMFLAGS; j++)
+			{
+				if(j == D3DTSS_ADDRESS) continue;
+				if(FAILED(error)) break;
+				error = glDirect3DStateBlock_RecordTextureStageState(This,i,j,0);
+			}
+		}
+		This->transformmask = (1 << D3DTRANSFORMSTATE_WORLD) | (1 << D3DTRANSFORMSTATE_VIEW)
+			| (1 << D3DTRANSFORMSTATE_PROJECTION);
+		This->hasviewport = TRUE;
+	}
+	else
+	{
+		if(pixel)
+		{
+			for(i = 0; i < sizeof(pixelrenderstates) / sizeof(DWORD); i++)
+			{
+				if(FAILED(error)) break;
+				error = glDirect3DStateBlock_RecordRenderState(This,pixelrenderstates[i],0);
+			}
+			for(i = 0; i < 8; i++)
+			{
+				for(j = D3DTSS_COLOROP; j <= D3DTSS_BUMPENVLOFFSET; j++)
+				{
+					if((j == D3DTSS_ADDRESS) || (j == D3DTSS_TEXCOORDINDEX)) continue;
+					if(FAILED(error)) break;
+					error = glDirect3DStateBlock_RecordTextureStageState(This,i,j,0);
+				}
+			}
+		}
+		else
+		{
+			for(i = 0; i < sizeof(vertexrenderstates) / sizeof(DWORD); i++)
+			{
+				if(FAILED(error)) break;
+				error = glDirect3DStateBlock_RecordRenderState(This,vertexrenderstates[i],0);
+			}
+			for(i = 0; i < 8; i++)
+			{
+				if(FAILED(error)) break;
+				error = glDirect3DStateBlock_RecordTextureStageState(This,i,D3DTSS_TEXCOORDINDEX,0);
+				if(FAILED(error)) break;
+				error = glDirect3DStateBlock_RecordTextureStageState(This,i,D3DTSS_TEXTURETRANSFORMFLAGS,0);
+			}
+		}
+	}
+	if(vertex)
+	{
+		This->hasmaterial = TRUE;
+		for(i = 0; i < device->lightsmax; i++)
+		{
+			if(!device->lights[i].active) continue;
+			if(FAILED(error)) break;
+			error = glDirect3DStateBlock_RecordLight(This,i,&device->lights[i].light);
+			if(FAILED(error)) break;
+			error = glDirect3DStateBlock_RecordLightEnable(This,i,FALSE);
+		}
+	}
+	if(FAILED(error))
+	{
+		glDirect3DStateBlock_Destroy(This);
+		TRACE_RET(HRESULT,23,error);
+	}
+	glDirect3DStateBlock_Capture(This,device);
+	*block = This;
+	TRACE_EXIT(23,D3D_OK);
+	return D3D_OK;
+}
+
+void glDirect3DStateBlock_Destroy(glDirect3DStateBlock *This)
+{
+	TRACE_ENTER(1,14,This);
+	if(This->renderstates) free(This->renderstates);
+	if(This->texstages) free(This->texstages);
+	if(This->lights) free(This->lights);
+	free(This);
+	TRACE_EXIT(0,0);
+}
+
+static BOOL glDirect3DStateBlock_Expand(void **array, DWORD *max, DWORD size)
+{
+	DWORD newmax = *max ? *max * 2 : 16;
+	void *ptr = realloc(*array, newmax * size);
+	if(!ptr) return FALSE;
+	*array = ptr;
+	*max = newmax;
+	return TRUE;
+}
+
+HRESULT glDirect3DStateBlock_RecordRenderState(glDirect3DStateBlock *This, DWORD state, DWORD value)
+{
+	TRACE_ENTER(3,14,This,27,state,9,value);
+	DWORD i;
+	for(i = 0; i < This->renderstatecount; i++)
+	{
+		if(This->renderstates[i].state == state)
+		{
+			This->renderstates[i].value = value;
+			TRACE_RET(HRESULT,23,D3D_OK);
+		}
+	}
+	if(This->renderstatecount >= This->renderstatemax)
+	{
+		if(!glDirect3DStateBlock_Expand((void**)&This->renderstates,&This->renderstatemax,sizeof(STATEBLOCKRENDERSTATE)))
+			TRACE_RET(HRESULT,23,DDERR_OUTOFMEMORY);
+	}
+	This->renderstates[This->renderstatecount].state = state;
+	This->renderstates[This->renderstatecount].value = value;
+	This->renderstatecount++;
+	TRACE_EXIT(23,D3D_OK);
+	return D3D_OK;
+}
+
+HRESULT glDirect3DStateBlock_RecordTextureStageState(glDirect3DStateBlock *This, DWORD stage, DWORD state, DWORD value)
+{
+	TRACE_ENTER(4,14,This,8,stage,28,state,9,value);
+	DWORD i;
+	for(i = 0; i < This->texstagecount; i++)
+	{
+		if((This->texstages[i].stage == stage) && (This->texstages[i].state == state))
+		{
+			This->texstages[i].value = value;
+			TRACE_RET(HRESULT,23,D3D_OK);
+		}
+	}
+	if(This->texstagecount >= This->texstagemax)
+	{
+		if(!glDirect3DStateBlock_Expand((void**)&This->texstages,&This->texstagemax,sizeof(STATEBLOCKTEXSTAGE)))
+			TRACE_RET(HRESULT,23,DDERR_OUTOFMEMORY);
+	}
+	This->texstages[This->texstagecount].stage = stage;
+	This->texstages[This->texstagecount].state = state;
+	This->texstages[This->texstagecount].value = value;
+	This->texstagecount++;
+	TRACE_EXIT(23,D3D_OK);
+	return D3D_OK;
+}
+
+HRESULT glDirect3DStateBlock_RecordTransform(glDirect3DStateBlock *This, D3DTRANSFORMSTATETYPE type, LPD3DMATRIX matrix)
+{
+	TRACE_ENTER(3,14,This,29,type,14,matrix);
+	if((type < D3DTRANSFORMSTATE_WORLD) || (type > D3DTRANSFORMSTATE_PROJECTION))
+		TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	memcpy(&This->transforms[type],matrix,sizeof(D3DMATRIX));
+	This->transformmask |= 1 << type;
+	TRACE_EXIT(23,D3D_OK);
+	return D3D_OK;
+}
+
+static STATEBLOCKLIGHT *glDirect3DStateBlock_FindLight(glDirect3DStateBlock *This, DWORD index)
+{
+	DWORD i;
+	for(i = 0; i < This->lightcount; i++)
+		if(This->lights[i].index == index) return &This->lights[i];
+	if(This->lightcount >= This->lightmax)
+	{
+		if(!glDirect3DStateBlock_Expand((void**)&This->lights,&This->lightmax,sizeof(STATEBLOCKLIGHT)))
+			return NULL;
+	}
+	ZeroMemory(&This->lights[This->lightcount],sizeof(STATEBLOCKLIGHT));
+	This->lights[This->lightcount].index = index;
+	return &This->lights[This->lightcount++];
+}
+
+HRESULT glDirect3DStateBlock_RecordLight(glDirect3DStateBlock *This, DWORD index, LPD3DLIGHT7 light)
+{
+	TRACE_ENTER(3,14,This,8,index,14,light);
+	STATEBLOCKLIGHT *entry = glDirect3DStateBlock_FindLight(This,index);
+	if(!entry) TRACE_RET(HRESULT,23,DDERR_OUTOFMEMORY);
+	memcpy(&entry->light,light,sizeof(D3DLIGHT7));
+	entry->flags |= STATEBLOCK_LIGHTSET;
+	TRACE_EXIT(23,D3D_OK);
+	return D3D_OK;
+}
+
+HRESULT glDirect3DStateBlock_RecordLightEnable(glDirect3DStateBlock *This, DWORD index, BOOL enable)
+{
+	TRACE_ENTER(3,14,This,8,index,22,enable);
+	STATEBLOCKLIGHT *entry = glDirect3DStateBlock_FindLight(This,index);
+	if(!entry) TRACE_RET(HRESULT,23,DDERR_OUTOFMEMORY);
+	entry->enable = enable;
+	entry->flags |= STATEBLOCK_LIGHTENABLE;
+	TRACE_EXIT(23,D3D_OK);
+	return D3D_OK;
+}
+
+void glDirect3DStateBlock_RecordMaterial(glDirect3DStateBlock *This, LPD3DMATERIAL7 material)
+{
+	TRACE_ENTER(2,14,This,14,material);
+	memcpy(&This->material,material,sizeof(D3DMATERIAL7));
+	This->hasmaterial = TRUE;
+	TRACE_EXIT(0,0);
+}
+
+void glDirect3DStateBlock_RecordViewport(glDirect3DStateBlock *This, LPD3DVIEWPORT7 viewport)
+{
+	TRACE_ENTER(2,14,This,14,viewport);
+	memcpy(&This->viewport,viewport,sizeof(D3DVIEWPORT7));
+	This->hasviewport = TRUE;
+	TRACE_EXIT(0,0);
+}
+
+/**
+  * Replaces the values stored in a state block with the current device values
+  * for the same set of states.
+  * @param This
+  *  Pointer to glDirect3DStateBlock object
+  * @param device
+  *  Pointer to glDirect3DDevice7 object to read the state from
+  */
+void glDirect3DStateBlock_Capture(glDirect3DStateBlock *This, glDirect3DDevice7 *device)
+{
+	TRACE_ENTER(2,14,This,14,device);
+	DWORD i;
+	for(i = 0; i < This->renderstatecount; i++)
+		glDirect3DDevice7_GetRenderState(device,(D3DRENDERSTATETYPE)This->renderstates[i].state,
+			&This->renderstates[i].value);
+	for(i = 0; i < This->texstagecount; i++)
+		glDirect3DDevice7_GetTextureStageState(device,This->texstages[i].stage,
+			(D3DTEXTURESTAGESTATETYPE)This->texstages[i].state,&This->texstages[i].value);
+	for(i = D3DTRANSFORMSTATE_WORLD; i <= D3DTRANSFORMSTATE_PROJECTION; i++)
+		if(This->transformmask & (1 << i))
+			glDirect3DDevice7_GetTransform(device,(D3DTRANSFORMSTATETYPE)i,&This->transforms[i]);
+	for(i = 0; i < This->lightcount; i++)
+	{
+		if(This->lights[i].flags & STATEBLOCK_LIGHTSET)
+		{
+			if(FAILED(glDirect3DDevice7_GetLight(device,This->lights[i].index,&This->lights[i].light)))
+				This->lights[i].flags &= ~STATEBLOCK_LIGHTSET;
+		}
+		if(This->lights[i].flags & STATEBLOCK_LIGHTENABLE)
+		{
+			if(FAILED(glDirect3DDevice7_GetLightEnable(device,This->lights[i].index,&This->lights[i].enable)))
+				This->lights[i].enable = FALSE;
+		}
+	}
+	if(This->hasmaterial) glDirect3DDevice7_GetMaterial(device,&This->material);
+	if(This->hasviewport) glDirect3DDevice7_GetViewport(device,&This->viewport);
+	TRACE_EXIT(0,0);
+}
+
+/**
+  * Applies a state block to a device.  Render states, texture stage states and
+  * transforms only update the device's deferred state, so they reach the
+  * renderer together in a single state delta.
+  * @param This
+  *  Pointer to glDirect3DStateBlock object
+  * @param device
+  *  Pointer to glDirect3DDevice7 object to apply the state to
+  */
+void glDirect3DStateBlock_Apply(glDirect3DStateBlock *This, glDirect3DDevice7 *device)
+{
+	TRACE_ENTER(2,14,This,14,device);
+	DWORD i;
+	for(i = 0; i < This->renderstatecount; i++)
+		glDirect3DDevice7_SetRenderState(device,(D3DRENDERSTATETYPE)This->renderstates[i].state,
+			This->renderstates[i].value);
+	for(i = 0; i < This->texstagecount; i++)
+		glDirect3DDevice7_SetTextureStageState(device,This->texstages[i].stage,
+			(D3DTEXTURESTAGESTATETYPE)This->texstages[i].state,This->texstages[i].value);
+	for(i = D3DTRANSFORMSTATE_WORLD; i <= D3DTRANSFORMSTATE_PROJECTION; i++)
+		if(This->transformmask & (1 << i))
+			glDirect3DDevice7_SetTransform(device,(D3DTRANSFORMSTATETYPE)i,&This->transforms[i]);
+	if(This->hasmaterial) glDirect3DDevice7_SetMaterial(device,&This->material);
+	if(This->hasviewport) glDirect3DDevice7_SetViewport(device,&This->viewport);
+	for(i = 0; i < This->lightcount; i++)
+	{
+		if(This->lights[i].flags & STATEBLOCK_LIGHTSET)
+			glDirect3DDevice7_SetLight(device,This->lights[i].index,&This->lights[i].light);
+		if(This->lights[i].flags & STATEBLOCK_LIGHTENABLE)
+			glDirect3DDevice7_LightEnable(device,This->lights[i].index,This->lights[i].enable);
+	}
+	glDirect3DDevice7_FlushState(device);
+	TRACE_EXIT(0,0);
+}
@@ -0,0 +1,79 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#pragma once
+#ifndef __GLDIRECT3DSTATEBLOCK_H
+#define __GLDIRECT3DSTATEBLOCK_H
+
+#define STATEBLOCK_LIGHTSET 1
+#define STATEBLOCK_LIGHTENABLE 2
+
+typedef struct STATEBLOCKRENDERSTATE
+{
+	DWORD state;
+	DWORD value;
+} STATEBLOCKRENDERSTATE;
+
+typedef struct STATEBLOCKTEXSTAGE
+{
+	DWORD stage;
+	DWORD state;
+	DWORD value;
+} STATEBLOCKTEXSTAGE;
+
+typedef struct STATEBLOCKLIGHT
+{
+	DWORD index;
+	DWORD flags;
+	D3DLIGHT7 light;
+	BOOL enable;
+} STATEBLOCKLIGHT;
+
+// Recorded device state, kept as compact arrays of the states that were set
+typedef struct glDirect3DStateBlock
+{
+	STATEBLOCKRENDERSTATE *renderstates;
+	DWORD renderstatecount;
+	DWORD renderstatemax;
+	STATEBLOCKTEXSTAGE *texstages;
+	DWORD texstagecount;
+	DWORD texstagemax;
+	STATEBLOCKLIGHT *lights;
+	DWORD lightcount;
+	DWORD lightmax;
+	DWORD transformmask;
+	D3DMATRIX transforms[4];
+	BOOL hasmaterial;
+	D3DMATERIAL7 material;
+	BOOL hasviewport;
+	D3DVIEWPORT7 viewport;
+} glDirect3DStateBlock;
+
+HRESULT glDirect3DStateBlock_Create(glDirect3DStateBlock **block);
+HRESULT glDirect3DStateBlock_CreateType(glDirect3DDevice7 *device, D3DSTATEBLOCKTYPE type, glDirect3DStateBlock **block);
+void glDirect3DStateBlock_Destroy(glDirect3DStateBlock *This);
+HRESULT glDirect3DStateBlock_RecordRenderState(glDirect3DStateBlock *This, DWORD state, DWORD value);
+HRESULT glDirect3DStateBlock_RecordTextureStageState(glDirect3DStateBlock *This, DWORD stage, DWORD state, DWORD value);
+HRESULT glDirect3DStateBlock_RecordTransform(glDirect3DStateBlock *This, D3DTRANSFORMSTATETYPE type, LPD3DMATRIX matrix);
+HRESULT glDirect3DStateBlock_RecordLight(glDirect3DStateBlock *This, DWORD index, LPD3DLIGHT7 light);
+HRESULT glDirect3DStateBlock_RecordLightEnable(glDirect3DStateBlock *This, DWORD index, BOOL enable);
+void glDirect3DStateBlock_RecordMaterial(glDirect3DStateBlock *This, LPD3DMATERIAL7 material);
+void glDirect3DStateBlock_RecordViewport(glDirect3DStateBlock *This, LPD3DVIEWPORT7 viewport);
+void glDirect3DStateBlock_Capture(glDirect3DStateBlock *This, glDirect3DDevice7 *device);
+void glDirect3DStateBlock_Apply(glDirect3DStateBlock *This, glDirect3DDevice7 *device);
+
+#endif //__GLDIRECT3DSTATEBLOCK_H
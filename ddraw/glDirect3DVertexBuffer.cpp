@@ -23,8 +23,10 @@
 #include "timer.h"
 #include "glRenderer.h"
 #include "glDirect3D.h"
+#include "glDirectDraw.h"
 #include "glDirect3DDevice.h"
 #include "glDirect3DVertexBuffer.h"
+#include "vertexproc.h"
 #include "ddraw.h"
 
 glDirect3DVertexBuffer7Vtbl glDirect3DVertexBuffer7_iface =
@@ -43,13 +45,30 @@ glDirect3DVertexBuffer7Vtbl glDirect3DVertexBuffer7_iface =
 HRESULT glDirect3DVertexBuffer7_Create(glDirect3D7 *glD3D7, D3DVERTEXBUFFERDESC desc, DWORD flags, glDirect3DVertexBuffer7 **buffer)
 {
 	TRACE_ENTER(4, 14, glD3D7, 14, &desc, 9, flags, 14, buffer);
+	if (!desc.dwNumVertices) TRACE_RET(HRESULT, 23, DDERR_INVALIDPARAMS);
+	DWORD vertexsize = glDirect3DVertexBuffer7_GetVertexSize(desc.dwFVF);
+	if (!vertexsize) TRACE_RET(HRESULT, 23, DDERR_INVALIDPARAMS);
 	glDirect3DVertexBuffer7 *This = (glDirect3DVertexBuffer7*)malloc(sizeof(glDirect3DVertexBuffer7));
 	if (!This) TRACE_RET(HRESULT, 23, DDERR_OUTOFMEMORY);
+	ZeroMemory(&This->buffer, sizeof(VertexBuffer));
+	This->vertexsize = vertexsize;
+	This->buffer.size = vertexsize * desc.dwNumVertices;
+	This->buffer.data = (unsigned char*)malloc(This->buffer.size);
+	if (!This->buffer.data)
+	{
+		free(This);
+		TRACE_RET(HRESULT, 23, DDERR_OUTOFMEMORY);
+	}
+	ZeroMemory(This->buffer.data, This->buffer.size);
+	This->buffer.dirty = TRUE;
+	This->locked = FALSE;
+	This->lockflags = 0;
 	This->lpVtbl = &glDirect3DVertexBuffer7_iface;
 	This->glD3D7 = glD3D7;
 	glDirect3D7_AddRef(This->glD3D7);
 	This->refcount = 1;
 	This->vbdesc = desc;
+	This->vbdesc.dwCaps &= ~D3DVBCAPS_OPTIMIZED;
 	This->flags = flags;
 	This->version = 7;
 	*buffer = This;
@@ -60,13 +79,30 @@ HRESULT glDirect3DVertexBuffer7_Create(glDirect3D7 *glD3D7, D3DVERTEXBUFFERDESC
 HRESULT glDirect3DVertexBuffer1_Create(glDirect3D3 *glD3D3, D3DVERTEXBUFFERDESC desc, DWORD flags, glDirect3DVertexBuffer7 **buffer)
 {
 	TRACE_ENTER(4, 14, glD3D3, 14, &desc, 9, flags, 14, buffer);
+	if (!desc.dwNumVertices) TRACE_RET(HRESULT, 23, DDERR_INVALIDPARAMS);
+	DWORD vertexsize = glDirect3DVertexBuffer7_GetVertexSize(desc.dwFVF);
+	if (!vertexsize) TRACE_RET(HRESULT, 23, DDERR_INVALIDPARAMS);
 	glDirect3DVertexBuffer7 *This = (glDirect3DVertexBuffer7*)malloc(sizeof(glDirect3DVertexBuffer7));
 	if (!This) TRACE_RET(HRESULT, 23, DDERR_OUTOFMEMORY);
+	ZeroMemory(&This->buffer, sizeof(VertexBuffer));
+	This->vertexsize = vertexsize;
+	This->buffer.size = vertexsize * desc.dwNumVertices;
+	This->buffer.data = (unsigned char*)malloc(This->buffer.size);
+	if (!This->buffer.data)
+	{
+		free(This);
+		TRACE_RET(HRESULT, 23, DDERR_OUTOFMEMORY);
+	}
+	ZeroMemory(This->buffer.data, This->buffer.size);
+	This->buffer.dirty = TRUE;
+	This->locked = FALSE;
+	This->lockflags = 0;
 	This->lpVtbl = &glDirect3DVertexBuffer7_iface;
 	This->glD3D7 = glD3D3->glD3D7;
 	glDirect3D7_AddRef(This->glD3D7);
 	This->refcount = 1;
 	This->vbdesc = desc;
+	This->vbdesc.dwCaps &= ~D3DVBCAPS_OPTIMIZED;
 	This->flags = flags;
 	This->version = 1;
 	*buffer = This;
@@ -77,11 +113,72 @@ HRESULT glDirect3DVertexBuffer1_Create(glDirect3D3 *glD3D3, D3DVERTEXBUFFERDESC
 void glDirect3DVertexBuffer7_Destroy(glDirect3DVertexBuffer7 *This)
 {
 	TRACE_ENTER(1,14,This);
+	if (This->buffer.vbo) glRenderer_ReleaseBuffer(This->glD3D7->glDD7->renderer, This->buffer.vbo);
+	if (This->buffer.ibo) glRenderer_ReleaseBuffer(This->glD3D7->glDD7->renderer, This->buffer.ibo);
+	// Freed in the backend so queued commands never see a dangling pointer
+	if (This->buffer.data) glRenderer_FreePointer(This->glD3D7->glDD7->renderer, This->buffer.data);
+	if (This->buffer.indexcache) glRenderer_FreePointer(This->glD3D7->glDD7->renderer, This->buffer.indexcache);
 	glDirect3D7_Release(This->glD3D7);
 	free(This);
 	TRACE_EXIT(0,0);
 }
 
+/**
+  * Calculates the size of one vertex of a flexible vertex format.
+  * @param fvf
+  *  Flexible vertex format flags
+  * @return
+  *  Size of one vertex in bytes, or 0 if the format has no position
+  */
+DWORD glDirect3DVertexBuffer7_GetVertexSize(DWORD fvf)
+{
+	DWORD size;
+	DWORD i;
+	DWORD numtex;
+	switch (fvf & D3DFVF_POSITION_MASK)
+	{
+	case D3DFVF_XYZ:
+		size = 3;
+		if (fvf & D3DFVF_RESERVED1) size++;
+		break;
+	case D3DFVF_XYZRHW:
+		size = 4;
+		break;
+	case D3DFVF_XYZB1:
+	case D3DFVF_XYZB2:
+	case D3DFVF_XYZB3:
+	case D3DFVF_XYZB4:
+	case D3DFVF_XYZB5:
+		size = 3 + ((fvf >> 1) & 7) - 2;
+		break;
+	default:
+		return 0;
+	}
+	if (fvf & D3DFVF_NORMAL) size += 3;
+	if (fvf & D3DFVF_DIFFUSE) size++;
+	if (fvf & D3DFVF_SPECULAR) size++;
+	numtex = (fvf & D3DFVF_TEXCOUNT_MASK) >> D3DFVF_TEXCOUNT_SHIFT;
+	for (i = 0; i < numtex; i++)
+	{
+		switch ((fvf >> (16 + (2 * i))) & 3)
+		{
+		case 0: // st
+			size += 2;
+			break;
+		case 1: // str
+			size += 3;
+			break;
+		case 2: // strq
+			size += 4;
+			break;
+		case 3: // s
+			size++;
+			break;
+		}
+	}
+	return size * sizeof(DWORD);
+}
+
 ULONG WINAPI glDirect3DVertexBuffer7_AddRef(glDirect3DVertexBuffer7 *This)
 {
 	TRACE_ENTER(1,14,This);
@@ -149,48 +246,131 @@ HRESULT WINAPI glDirect3DVertexBuffer7_Lock(glDirect3DVertexBuffer7 *This, DWORD
 {
 	TRACE_ENTER(4,14,This,9,dwFlags,14,lplpData,14,lpdwSize);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	FIXME("glDirect3DVertexBuffer7_Lock: stub");
-	TRACE_EXIT(23,DDERR_GENERIC);
-	return DDERR_GENERIC;
+	if(!lplpData) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	if(This->vbdesc.dwCaps & D3DVBCAPS_OPTIMIZED) TRACE_RET(HRESULT,23,D3DERR_VERTEXBUFFEROPTIMIZED);
+	if(This->locked) TRACE_RET(HRESULT,23,D3DERR_VERTEXBUFFERLOCKED);
+	// Draws are synchronous, so the system memory copy is never in use here;
+	// DISCARDCONTENTS and NOOVERWRITE only decide how the next upload is done.
+	This->locked = TRUE;
+	This->lockflags = dwFlags;
+	*lplpData = This->buffer.data;
+	if(lpdwSize) *lpdwSize = This->buffer.size;
+	TRACE_VAR("*lplpData",14,*lplpData);
+	TRACE_EXIT(23,D3D_OK);
+	return D3D_OK;
 }
 
 HRESULT WINAPI glDirect3DVertexBuffer7_Optimize(glDirect3DVertexBuffer7 *This, LPDIRECT3DDEVICE7 lpD3DDevice, DWORD dwFlags)
 {
 	glDirect3DDevice7 *dev7;
+	VERTEXSTREAMS streams;
 	TRACE_ENTER(3,14,This,14,lpD3DDevice,9,dwFlags);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
+	if(!lpD3DDevice) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
 	if (This->version == 7) dev7 = (glDirect3DDevice7*)lpD3DDevice;
 	else dev7 = ((glDirect3DDevice3*)lpD3DDevice)->glD3DDev7;
-	FIXME("glDirect3DVertexBuffer7_Optimize: stub");
-	TRACE_EXIT(23,DDERR_GENERIC);
-	return DDERR_GENERIC;
+	if(This->vbdesc.dwCaps & D3DVBCAPS_OPTIMIZED) TRACE_RET(HRESULT,23,D3DERR_VERTEXBUFFEROPTIMIZED);
+	if(This->locked) TRACE_RET(HRESULT,23,D3DERR_VERTEXBUFFERLOCKED);
+	// The contents can no longer change, so upload them once as static data
+	This->vbdesc.dwCaps |= D3DVBCAPS_OPTIMIZED;
+	This->buffer.isstatic = TRUE;
+	This->buffer.dirty = TRUE;
+	This->buffer.nooverwrite = FALSE;
+	// Lets whole draws from the buffer be tested against the view before they are queued
+	VertexProc_SetupStreams(This->vbdesc.dwFVF, This->buffer.data, This->vertexsize, &streams);
+	This->buffer.hasbounds = VertexProc_GetBounds(&streams, This->vbdesc.dwNumVertices,
+		This->buffer.boundsmin, This->buffer.boundsmax);
+	TRACE_EXIT(23,D3D_OK);
+	return D3D_OK;
+}
+/**
+  * Transforms, and if requested lights, vertices from a set of source streams
+  * into this buffer using the CPU vertex pipeline.
+  * @param This
+  *  Pointer to glDirect3DVertexBuffer7 object to receive the vertices
+  * @param dwVertexOp
+  *  D3DVOP flags for the operations to perform
+  * @param dwDestIndex
+  *  Index of the first vertex to write
+  * @param dwCount
+  *  Number of vertices to process
+  * @param fvf
+  *  Flexible vertex format of the source vertices
+  * @param src
+  *  Source streams, starting at the first vertex to read
+  * @param dev7
+  *  Device to take the transforms, viewport, material and lights from
+  * @param dwFlags
+  *  D3DPV flags
+  * @return
+  *  D3D_OK on success, otherwise an error code
+  */
+static HRESULT glDirect3DVertexBuffer7_ProcessStreams(glDirect3DVertexBuffer7 *This, DWORD dwVertexOp, DWORD dwDestIndex,
+	DWORD dwCount, DWORD fvf, VERTEXSTREAMS *src, glDirect3DDevice7 *dev7, DWORD dwFlags)
+{
+	VERTEXPROCSTATE state;
+	VERTEXSTREAMS dest;
+	if(!(dwVertexOp & D3DVOP_TRANSFORM)) return DDERR_INVALIDPARAMS;
+	if((This->vbdesc.dwFVF & D3DFVF_POSITION_MASK) != D3DFVF_XYZRHW) return DDERR_INVALIDPARAMS;
+	if((fvf & D3DFVF_POSITION_MASK) == D3DFVF_XYZRHW) return DDERR_INVALIDPARAMS;
+	if(This->locked) return D3DERR_VERTEXBUFFERLOCKED;
+	if(This->vbdesc.dwCaps & D3DVBCAPS_OPTIMIZED) return D3DERR_VERTEXBUFFEROPTIMIZED;
+	if((dwDestIndex + dwCount) > This->vbdesc.dwNumVertices) return DDERR_INVALIDPARAMS;
+	if(!dwCount) return D3D_OK;
+	glDirect3DDevice7_GetVertexProcState(dev7,&state);
+	state.lighting = (dwVertexOp & D3DVOP_LIGHT) && dev7->renderstate[D3DRENDERSTATE_LIGHTING] && (fvf & D3DFVF_NORMAL);
+	VertexProc_SetupStreams(This->vbdesc.dwFVF,This->buffer.data,This->vertexsize,&dest);
+	VertexProc_OffsetStreams(&dest,dwDestIndex);
+	VertexProc_Process(&state,src,&dest,dwCount,!(dwFlags & D3DPV_DONOTCOPYDATA));
+	This->buffer.dirty = TRUE;
+	This->buffer.nooverwrite = FALSE;
+	return D3D_OK;
 }
+
 HRESULT WINAPI glDirect3DVertexBuffer7_ProcessVertices(glDirect3DVertexBuffer7 *This, DWORD dwVertexOp, DWORD dwDestIndex, DWORD dwCount, 
 	LPDIRECT3DVERTEXBUFFER7 lpSrcBuffer, DWORD dwSrcIndex, LPDIRECT3DDEVICE7 lpD3DDevice, DWORD dwFlags)
 {
 	glDirect3DDevice7 *dev7;
+	glDirect3DVertexBuffer7 *src = (glDirect3DVertexBuffer7*)lpSrcBuffer;
+	VERTEXSTREAMS srcstreams;
 	TRACE_ENTER(8,14,This,9,dwVertexOp,8,dwDestIndex,8,dwCount,14,lpSrcBuffer,8,dwSrcIndex,14,lpD3DDevice,9,dwFlags);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
+	if(!src || !lpD3DDevice) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
 	if (This->version == 7) dev7 = (glDirect3DDevice7*)lpD3DDevice;
 	else dev7 = ((glDirect3DDevice3*)lpD3DDevice)->glD3DDev7;
-	FIXME("glDirect3DVertexBuffer7_ProcessVertices: stub");
-	TRACE_EXIT(23,DDERR_GENERIC);
-	return DDERR_GENERIC;
+	if(src->locked) TRACE_RET(HRESULT,23,D3DERR_VERTEXBUFFERLOCKED);
+	if((dwSrcIndex + dwCount) > src->vbdesc.dwNumVertices) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	VertexProc_SetupStreams(src->vbdesc.dwFVF,src->buffer.data,src->vertexsize,&srcstreams);
+	VertexProc_OffsetStreams(&srcstreams,dwSrcIndex);
+	HRESULT error = glDirect3DVertexBuffer7_ProcessStreams(This,dwVertexOp,dwDestIndex,dwCount,
+		src->vbdesc.dwFVF,&srcstreams,dev7,dwFlags);
+	TRACE_EXIT(23,error);
+	return error;
 }
 HRESULT WINAPI glDirect3DVertexBuffer7_ProcessVerticesStrided(glDirect3DVertexBuffer7 *This, DWORD dwVertexOp, DWORD dwDestIndex, DWORD dwCount,
-	LPD3DDRAWPRIMITIVESTRIDEDDATA lpVertexArray, DWORD dwSrcIndex, LPDIRECT3DDEVICE7 lpD3DDevice, DWORD dwFlags)
+	LPD3DDRAWPRIMITIVESTRIDEDDATA lpVertexArray, DWORD dwVertexTypeDesc, LPDIRECT3DDEVICE7 lpD3DDevice, DWORD dwFlags)
 {
-	TRACE_ENTER(8,14,This,9,dwVertexOp,8,dwDestIndex,8,dwCount,14,lpVertexArray,8,dwSrcIndex,14,lpD3DDevice,9,dwFlags);
+	VERTEXSTREAMS srcstreams;
+	TRACE_ENTER(8,14,This,9,dwVertexOp,8,dwDestIndex,8,dwCount,14,lpVertexArray,9,dwVertexTypeDesc,14,lpD3DDevice,9,dwFlags);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	FIXME("glDirect3DVertexBuffer7_ProcessVerticesStrided: stub");
-	TRACE_EXIT(23,DDERR_GENERIC);
-	return DDERR_GENERIC;
+	if(!lpVertexArray || !lpD3DDevice) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	VertexProc_SetupStridedStreams(dwVertexTypeDesc,lpVertexArray,&srcstreams);
+	HRESULT error = glDirect3DVertexBuffer7_ProcessStreams(This,dwVertexOp,dwDestIndex,dwCount,
+		dwVertexTypeDesc,&srcstreams,(glDirect3DDevice7*)lpD3DDevice,dwFlags);
+	TRACE_EXIT(23,error);
+	return error;
 }
 HRESULT WINAPI glDirect3DVertexBuffer7_Unlock(glDirect3DVertexBuffer7 *This)
 {
 	TRACE_ENTER(1,14,This);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	FIXME("glDirect3DVertexBuffer7_Unlock: stub");
-	TRACE_EXIT(23,DDERR_GENERIC);
-	return DDERR_GENERIC;
+	if(!This->locked) TRACE_RET(HRESULT,23,D3DERR_VERTEXBUFFERUNLOCKFAILED);
+	This->locked = FALSE;
+	if(!(This->lockflags & DDLOCK_READONLY))
+	{
+		if(!(This->lockflags & DDLOCK_NOOVERWRITE)) This->buffer.nooverwrite = FALSE;
+		This->buffer.dirty = TRUE;
+	}
+	TRACE_EXIT(23,D3D_OK);
+	return D3D_OK;
 }
\ No newline at end of file
@@ -29,6 +29,10 @@ typedef struct glDirect3DVertexBuffer7
 	ULONG refcount;
 	D3DVERTEXBUFFERDESC vbdesc;
 	DWORD flags;
+	DWORD vertexsize;
+	VertexBuffer buffer;
+	BOOL locked;
+	DWORD lockflags;
 } glDirect3DVertexBuffer7;
 
 typedef struct glDirect3DVertexBuffer7Vtbl
@@ -43,12 +47,13 @@ typedef struct glDirect3DVertexBuffer7Vtbl
 	HRESULT(WINAPI *GetVertexBufferDesc)(glDirect3DVertexBuffer7 *This, LPD3DVERTEXBUFFERDESC lpVBDesc);
 	HRESULT(WINAPI *Optimize)(glDirect3DVertexBuffer7 *This, LPDIRECT3DDEVICE7 lpD3DDevice, DWORD dwFlags);
 	HRESULT(WINAPI *ProcessVerticesStrided)(glDirect3DVertexBuffer7 *This, DWORD dwVertexOp, DWORD dwDestIndex, DWORD dwCount,
-		LPD3DDRAWPRIMITIVESTRIDEDDATA lpVertexArray, DWORD dwSrcIndex, LPDIRECT3DDEVICE7 lpD3DDevice, DWORD dwFlags);
+		LPD3DDRAWPRIMITIVESTRIDEDDATA lpVertexArray, DWORD dwVertexTypeDesc, LPDIRECT3DDEVICE7 lpD3DDevice, DWORD dwFlags);
 } glDirect3DVertexBuffer7Vtbl;
 
 HRESULT glDirect3DVertexBuffer7_Create(glDirect3D7 *glD3D7, D3DVERTEXBUFFERDESC desc, DWORD flags, glDirect3DVertexBuffer7 **buffer);
 HRESULT glDirect3DVertexBuffer1_Create(glDirect3D3 *glD3D3, D3DVERTEXBUFFERDESC desc, DWORD flags, glDirect3DVertexBuffer7 **buffer);
 void glDirect3DVertexBuffer7_Destroy(glDirect3DVertexBuffer7 *This);
+DWORD glDirect3DVertexBuffer7_GetVertexSize(DWORD fvf);
 HRESULT WINAPI glDirect3DVertexBuffer7_QueryInterface(glDirect3DVertexBuffer7 *This, REFIID riid, void** ppvObj);
 ULONG WINAPI glDirect3DVertexBuffer7_AddRef(glDirect3DVertexBuffer7 *This);
 ULONG WINAPI glDirect3DVertexBuffer7_Release(glDirect3DVertexBuffer7 *This);
@@ -58,7 +63,7 @@ HRESULT WINAPI glDirect3DVertexBuffer7_Optimize(glDirect3DVertexBuffer7 *This, L
 HRESULT WINAPI glDirect3DVertexBuffer7_ProcessVertices(glDirect3DVertexBuffer7 *This, DWORD dwVertexOp, DWORD dwDestIndex, DWORD dwCount,
 		LPDIRECT3DVERTEXBUFFER7 lpSrcBuffer, DWORD dwSrcIndex, LPDIRECT3DDEVICE7 lpD3DDevice, DWORD dwFlags);
 HRESULT WINAPI glDirect3DVertexBuffer7_ProcessVerticesStrided(glDirect3DVertexBuffer7 *This, DWORD dwVertexOp, DWORD dwDestIndex, DWORD dwCount,
-		LPD3DDRAWPRIMITIVESTRIDEDDATA lpVertexArray, DWORD dwSrcIndex, LPDIRECT3DDEVICE7 lpD3DDevice, DWORD dwFlags);
+		LPD3DDRAWPRIMITIVESTRIDEDDATA lpVertexArray, DWORD dwVertexTypeDesc, LPDIRECT3DDEVICE7 lpD3DDevice, DWORD dwFlags);
 HRESULT WINAPI glDirect3DVertexBuffer7_Unlock(glDirect3DVertexBuffer7 *This);
 
 #endif //__GLDIRECT3DVERTEXBUFFER_H
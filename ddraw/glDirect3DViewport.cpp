@@ -26,6 +26,7 @@
 #include "glDirect3DDevice.h"
 #include "glDirect3DMaterial.h"
 #include "glDirect3DViewport.h"
+#include "matrix.h"
 #include "ddraw.h"
 
 extern "C" {
@@ -373,9 +374,48 @@ HRESULT WINAPI glDirect3DViewport3_TransformVertices(glDirect3DViewport3 *This,
 {
 	TRACE_ENTER(5,14,This,8,dwVertexCount,14,lpData,9,dwFlags,14,lpOffscreen);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	FIXME("glDirect3DViewport3::TransformVertices: stub");
-	TRACE_EXIT(23,DDERR_GENERIC);
-	return DDERR_GENERIC;
+	if(!This->device) TRACE_RET(HRESULT,23,D3DERR_VIEWPORTHASNODEVICE);
+	if(!lpData || !lpOffscreen) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	if(lpData->dwSize != sizeof(D3DTRANSFORMDATA)) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	if((dwFlags != D3DTRANSFORM_CLIPPED) && (dwFlags != D3DTRANSFORM_UNCLIPPED)) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	if(!dwVertexCount) TRACE_RET(HRESULT,23,D3D_OK);
+	if(!lpData->lpIn || !lpData->lpOut) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	MATRIXVIEWPORT vp;
+	if(This->viewportver == 1)
+	{
+		// Clip volume is -dvMaxX to dvMaxX, scaled about the center of the viewport
+		vp.minx = -This->viewport1.dvMaxX;
+		vp.maxx = This->viewport1.dvMaxX;
+		vp.miny = -This->viewport1.dvMaxY;
+		vp.maxy = This->viewport1.dvMaxY;
+		vp.scalex = This->viewport1.dvScaleX;
+		vp.offsetx = (GLfloat)This->viewport1.dwX + ((GLfloat)This->viewport1.dwWidth / 2.0f);
+		vp.scaley = -This->viewport1.dvScaleY;
+		vp.offsety = (GLfloat)This->viewport1.dwY + ((GLfloat)This->viewport1.dwHeight / 2.0f);
+	}
+	else
+	{
+		// Clip volume is given by its top left corner and size
+		if((This->viewport.dvClipWidth == 0) || (This->viewport.dvClipHeight == 0))
+			TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+		vp.minx = This->viewport.dvClipX;
+		vp.maxx = This->viewport.dvClipX + This->viewport.dvClipWidth;
+		vp.miny = This->viewport.dvClipY - This->viewport.dvClipHeight;
+		vp.maxy = This->viewport.dvClipY;
+		vp.scalex = (GLfloat)This->viewport.dwWidth / This->viewport.dvClipWidth;
+		vp.offsetx = (GLfloat)This->viewport.dwX - (This->viewport.dvClipX * vp.scalex);
+		vp.scaley = -(GLfloat)This->viewport.dwHeight / This->viewport.dvClipHeight;
+		vp.offsety = (GLfloat)This->viewport.dwY - (This->viewport.dvClipY * vp.scaley);
+	}
+	if(This->device->transform_dirty) glDirect3DDevice7_UpdateTransform(This->device);
+	Matrix_ProjectPoints(This->device->matTransform, &vp, (const GLfloat*)lpData->lpIn, lpData->dwInSize,
+		(GLfloat*)lpData->lpOut, lpData->dwOutSize, (dwFlags == D3DTRANSFORM_CLIPPED) ? lpData->lpHOut : NULL,
+		dwVertexCount, dwFlags == D3DTRANSFORM_CLIPPED, &lpData->dwClipUnion, &lpData->dwClipIntersection,
+		&lpData->drExtent);
+	// Set if every vertex is outside the same edge of the clip volume
+	*lpOffscreen = lpData->dwClipIntersection;
+	TRACE_EXIT(23,D3D_OK);
+	return D3D_OK;
 }
 
 void glDirect3DViewport3_SetCurrent(glDirect3DViewport3 *This, bool current)
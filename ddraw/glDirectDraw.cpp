@@ -30,6 +30,9 @@ using namespace std;
 #include "dxglDirectDrawSurface.h"
 #include "glDirectDrawPalette.h"
 #include "glRenderer.h"
+#include "CapsCache.h"
+#include "ModeIndex.h"
+#include "RuntimePolicy.h"
 #include "../common/version.h"
 #include "hooks.h"
 #include "fourcc.h"
@@ -52,7 +55,7 @@ LONG (WINAPI *_QueryDisplayConfig)(UINT32 flags, UINT32 *numPathArrayElements,
 LONG (WINAPI *_SetDisplayConfig)(UINT32 numPathArrayElements, DISPLAYCONFIG_PATH_INFO *pathArray,
 	UINT32 numModeInfoArrayElements, DISPLAYCONFIG_MODE_INFO *modeInfoArray, UINT32 flags) = NULL;
 
-LONG SetVidMode(LPCTSTR devname, DEVMODE *mode, DWORD flags)
+static LONG ApplyVidMode(LPCTSTR devname, DEVMODE *mode, DWORD flags)
 {
 	DEVMODE currmode;
 	HMODULE hUser32;
@@ -62,6 +65,15 @@ LONG SetVidMode(LPCTSTR devname, DEVMODE *mode, DWORD flags)
 	DISPLAYCONFIG_MODE_INFO *modeInfoArray;
 	LONG error;
 	int i;
+	// Setting the mode the display is already in would only blank the screen
+	currmode.dmSize = sizeof(DEVMODE);
+	if (EnumDisplaySettings(devname, ENUM_CURRENT_SETTINGS, &currmode)
+		&& (mode->dmPelsWidth == currmode.dmPelsWidth) && (mode->dmPelsHeight == currmode.dmPelsHeight)
+		&& (!(mode->dmFields & DM_BITSPERPEL) || (mode->dmBitsPerPel == currmode.dmBitsPerPel)
+			|| ((mode->dmBitsPerPel == 15) && (currmode.dmBitsPerPel == 16)))
+		&& (!(mode->dmFields & DM_DISPLAYFREQUENCY) || !mode->dmDisplayFrequency
+			|| (mode->dmDisplayFrequency == currmode.dmDisplayFrequency)))
+		return DISP_CHANGE_SUCCESSFUL;
 	if (dxglcfg.UseSetDisplayConfig)
 	{
 		currmode.dmSize = sizeof(DEVMODE);
@@ -152,6 +164,25 @@ LONG SetVidMode(LPCTSTR devname, DEVMODE *mode, DWORD flags)
 	else return ChangeDisplaySettingsEx(devname, mode, NULL, flags, NULL);
 }
 
+/**
+  * Changes the display mode, unless the display is already in it.
+  * @param devname
+  *  Name of the display device, NULL for the primary display
+  * @param mode
+  *  Display mode to set
+  * @param flags
+  *  Flags for ChangeDisplaySettingsEx
+  * @return
+  *  DISP_CHANGE_SUCCESSFUL or an error from ChangeDisplaySettingsEx
+  */
+LONG SetVidMode(LPCTSTR devname, DEVMODE *mode, DWORD flags)
+{
+	LONG error = ApplyVidMode(devname, mode, flags);
+	// The hooks cache the display metrics of the mode being left
+	InvalidateDisplayCache();
+	return error;
+}
+
 const DDDEVICEIDENTIFIER2 devid_default = {
 	"ddraw.dll",
 	"DXGL DDraw Wrapper",
@@ -175,45 +206,34 @@ const D3DDevice d3ddevices[3] =
 	}
 };
 
-void DiscardDuplicateModes(DEVMODE **array, DWORD *count)
-{
-	DEVMODE *newarray = (DEVMODE *)malloc(sizeof(DEVMODE)*(*count));
-	if(!newarray) return;
+/**
+  * Removes modes with the same size, bpp and refresh rate from a mode list
+  * and rebuilds its index.
+  * @param array
+  *  Pointer to the mode list
+  * @param count
+  *  Pointer to the number of modes in the list
+  * @param index
+  *  Pointer to the index of the mode list, rebuilt from the remaining modes
+  */
+void DiscardDuplicateModes(DEVMODE **array, DWORD *count, MODEINDEX *index)
+{
+	MODEINDEX newindex;
 	DWORD newcount = 0;
-	bool match;
-	for(DWORD x = 0; x < (*count); x++)
+	if (!ModeIndex_Init(&newindex, *count)) return;
+	for (DWORD x = 0; x < (*count); x++)
 	{
-		match = false;
-		memcpy(&newarray[newcount],&(*array)[x],sizeof(DEVMODE));
-		for(int y = newcount; y > 0; y--)
+		if (ModeIndex_Insert(&newindex, &(*array)[x]))
 		{
-			if((*array)[x].dmBitsPerPel == newarray[y-1].dmBitsPerPel &&
-				(*array)[x].dmDisplayFrequency == newarray[y-1].dmDisplayFrequency &&
-				(*array)[x].dmPelsWidth == newarray[y-1].dmPelsWidth &&
-				(*array)[x].dmPelsHeight == newarray[y-1].dmPelsHeight)
-			{
-				match = true;
-				break;
-			}
+			if (x != newcount) (*array)[newcount] = (*array)[x];
+			newcount++;
 		}
-		if(!match) newcount++;
 	}
-	DEVMODE *newarray2 = (DEVMODE*)realloc(newarray,sizeof(DEVMODE)*newcount);
-	if(newarray2) newarray = newarray2;
-	free(*array);
-	*array = newarray;
+	ModeIndex_Delete(index);
+	*index = newindex;
 	*count = newcount;
 }
 
-bool ScanModeList(DEVMODE *array, DEVMODE comp, DWORD count)
-{
-	for(DWORD i = 0; i < count; i++)
-	{
-		if(!memcmp(&array[i],&comp,sizeof(DEVMODE))) return true;
-	}
-	return false;
-}
-
 const int START_LOWRESMODES = __LINE__;
 const int LowResModes[][3] =
 {
@@ -369,33 +389,14 @@ const int DoubledModes[] [5] =
 const int END_DOUBLEDMODESCOUNT = __LINE__ - 4;
 const int numdoubledmodes = END_DOUBLEDMODESCOUNT - START_DOUBLEDMODESCOUNT;
 
-bool ScanColorMode(DEVMODE *array, DWORD count, int bpp)
-{
-	for(DWORD i = 0; i < count; i++)
-	{
-		if(array[i].dmBitsPerPel == bpp) return true;
-	}
-	return false;
-}
-
-bool ScanModeListNoRefresh(DEVMODE *array, DEVMODE comp, DWORD count)
-{
-	for(DWORD i = 0; i < count; i++)
-	{
-		if((array[i].dmBitsPerPel == comp.dmBitsPerPel) &&
-			(array[i].dmPelsWidth == comp.dmPelsWidth) &&
-			(array[i].dmPelsHeight == comp.dmPelsHeight)) return true;
-	}
-	return false;
-} 
-
-void AddExtraResolutions(DEVMODE **array, DWORD *count, const int (*modelist)[3], const int nummodes)
+void AddExtraResolutions(DEVMODE **array, DWORD *count, MODEINDEX *index, const int (*modelist)[3], const int nummodes)
 {
 	DEVMODE *array2 = (DEVMODE *)malloc(sizeof(DEVMODE) * 5 * nummodes);
+	if (!array2) return;
 	DEVMODE compmode = *array[0];
 	DWORD newcount = 0;
 	int i;
-	if (ScanColorMode(*array, *count, 8))
+	if (ModeIndex_HasBPP(index, 8))
 	{
 		compmode.dmBitsPerPel = 8;
 		for (i = 0; i < nummodes; i++)
@@ -403,14 +404,14 @@ void AddExtraResolutions(DEVMODE **array, DWORD *count, const int (*modelist)[3]
 			compmode.dmPelsWidth = modelist[i][0];
 			compmode.dmPelsHeight = modelist[i][1];
 			compmode.dmDisplayFrequency = modelist[i][2];
-			if (!ScanModeListNoRefresh(*array, compmode, *count))
+			if (!ModeIndex_FindNoRefresh(index, &compmode))
 			{
 				array2[newcount] = compmode;
 				newcount++;
 			}
 		}
 	}
-	if (ScanColorMode(*array, *count, 15))
+	if (ModeIndex_HasBPP(index, 15))
 	{
 		compmode.dmBitsPerPel = 15;
 		for (i = 0; i < nummodes; i++)
@@ -418,14 +419,14 @@ void AddExtraResolutions(DEVMODE **array, DWORD *count, const int (*modelist)[3]
 			compmode.dmPelsWidth = modelist[i][0];
 			compmode.dmPelsHeight = modelist[i][1];
 			compmode.dmDisplayFrequency = modelist[i][2];
-			if (!ScanModeListNoRefresh(*array, compmode, *count))
+			if (!ModeIndex_FindNoRefresh(index, &compmode))
 			{
 				array2[newcount] = compmode;
 				newcount++;
 			}
 		}
 	}
-	if (ScanColorMode(*array, *count, 16))
+	if (ModeIndex_HasBPP(index, 16))
 	{
 		compmode.dmBitsPerPel = 16;
 		for (i = 0; i < nummodes; i++)
@@ -433,14 +434,14 @@ void AddExtraResolutions(DEVMODE **array, DWORD *count, const int (*modelist)[3]
 			compmode.dmPelsWidth = modelist[i][0];
 			compmode.dmPelsHeight = modelist[i][1];
 			compmode.dmDisplayFrequency = modelist[i][2];
-			if (!ScanModeListNoRefresh(*array, compmode, *count))
+			if (!ModeIndex_FindNoRefresh(index, &compmode))
 			{
 				array2[newcount] = compmode;
 				newcount++;
 			}
 		}
 	}
-	if (ScanColorMode(*array, *count, 24))
+	if (ModeIndex_HasBPP(index, 24))
 	{
 		compmode.dmBitsPerPel = 24;
 		for (i = 0; i < nummodes; i++)
@@ -448,14 +449,14 @@ void AddExtraResolutions(DEVMODE **array, DWORD *count, const int (*modelist)[3]
 			compmode.dmPelsWidth = modelist[i][0];
 			compmode.dmPelsHeight = modelist[i][1];
 			compmode.dmDisplayFrequency = modelist[i][2];
-			if (!ScanModeListNoRefresh(*array, compmode, *count))
+			if (!ModeIndex_FindNoRefresh(index, &compmode))
 			{
 				array2[newcount] = compmode;
 				newcount++;
 			}
 		}
 	}
-	if (ScanColorMode(*array, *count, 32))
+	if (ModeIndex_HasBPP(index, 32))
 	{
 		compmode.dmBitsPerPel = 32;
 		for (i = 0; i < nummodes; i++)
@@ -463,26 +464,33 @@ void AddExtraResolutions(DEVMODE **array, DWORD *count, const int (*modelist)[3]
 			compmode.dmPelsWidth = modelist[i][0];
 			compmode.dmPelsHeight = modelist[i][1];
 			compmode.dmDisplayFrequency = modelist[i][2];
-			if (!ScanModeListNoRefresh(*array, compmode, *count))
+			if (!ModeIndex_FindNoRefresh(index, &compmode))
 			{
 				array2[newcount] = compmode;
 				newcount++;
 			}
 		}
 	}
-	*array = (DEVMODE *)realloc(*array, (*count + newcount) * sizeof(DEVMODE));
-	memcpy(&(*array)[*count - 1], array2, newcount * sizeof(DEVMODE));
+	DEVMODE *tmp = (DEVMODE *)realloc(*array, (*count + newcount) * sizeof(DEVMODE));
+	if (tmp)
+	{
+		*array = tmp;
+		for (DWORD x = 0; x < newcount; x++)
+		{
+			if (ModeIndex_Insert(index, &array2[x])) (*array)[(*count)++] = array2[x];
+		}
+	}
 	free(array2);
-	*count += newcount;
 }
 
-void AddDoubledResolutions(DEVMODE **array, DWORD *count)
+void AddDoubledResolutions(DEVMODE **array, DWORD *count, MODEINDEX *index)
 {
 	DEVMODE *array2 = (DEVMODE *)malloc(sizeof(DEVMODE) * 5 * numdoubledmodes);
+	if (!array2) return;
 	DEVMODE compmode = *array[0];
 	DWORD newcount = 0;
 	int i;
-	if (ScanColorMode(*array, *count, 8))
+	if (ModeIndex_HasBPP(index, 8))
 	{
 		compmode.dmBitsPerPel = 8;
 		for (i = 0; i < numdoubledmodes; i++)
@@ -490,7 +498,7 @@ void AddDoubledResolutions(DEVMODE **array, DWORD *count)
 			compmode.dmPelsWidth = DoubledModes[i][3];
 			compmode.dmPelsHeight = DoubledModes[i][4];
 			compmode.dmDisplayFrequency = DoubledModes[i][2];
-			if (ScanModeListNoRefresh(*array, compmode, *count))
+			if (ModeIndex_FindNoRefresh(index, &compmode))
 			{
 				compmode.dmPelsWidth = DoubledModes[i][0];
 				compmode.dmPelsHeight = DoubledModes[i][1];
@@ -499,7 +507,7 @@ void AddDoubledResolutions(DEVMODE **array, DWORD *count)
 			}
 		}
 	}
-	if (ScanColorMode(*array, *count, 15))
+	if (ModeIndex_HasBPP(index, 15))
 	{
 		compmode.dmBitsPerPel = 15;
 		for (i = 0; i < numdoubledmodes; i++)
@@ -507,7 +515,7 @@ void AddDoubledResolutions(DEVMODE **array, DWORD *count)
 			compmode.dmPelsWidth = DoubledModes[i][3];
 			compmode.dmPelsHeight = DoubledModes[i][4];
 			compmode.dmDisplayFrequency = DoubledModes[i][2];
-			if (ScanModeListNoRefresh(*array, compmode, *count))
+			if (ModeIndex_FindNoRefresh(index, &compmode))
 			{
 				compmode.dmPelsWidth = DoubledModes[i][0];
 				compmode.dmPelsHeight = DoubledModes[i][1];
@@ -516,7 +524,7 @@ void AddDoubledResolutions(DEVMODE **array, DWORD *count)
 			}
 		}
 	}
-	if (ScanColorMode(*array, *count, 16))
+	if (ModeIndex_HasBPP(index, 16))
 	{
 		compmode.dmBitsPerPel = 16;
 		for (i = 0; i < numdoubledmodes; i++)
@@ -524,7 +532,7 @@ void AddDoubledResolutions(DEVMODE **array, DWORD *count)
 			compmode.dmPelsWidth = DoubledModes[i][3];
 			compmode.dmPelsHeight = DoubledModes[i][4];
 			compmode.dmDisplayFrequency = DoubledModes[i][2];
-			if (ScanModeListNoRefresh(*array, compmode, *count))
+			if (ModeIndex_FindNoRefresh(index, &compmode))
 			{
 				compmode.dmPelsWidth = DoubledModes[i][0];
 				compmode.dmPelsHeight = DoubledModes[i][1];
@@ -533,7 +541,7 @@ void AddDoubledResolutions(DEVMODE **array, DWORD *count)
 			}
 		}
 	}
-	if (ScanColorMode(*array, *count, 24))
+	if (ModeIndex_HasBPP(index, 24))
 	{
 		compmode.dmBitsPerPel = 24;
 		for (i = 0; i < numdoubledmodes; i++)
@@ -541,7 +549,7 @@ void AddDoubledResolutions(DEVMODE **array, DWORD *count)
 			compmode.dmPelsWidth = DoubledModes[i][3];
 			compmode.dmPelsHeight = DoubledModes[i][4];
 			compmode.dmDisplayFrequency = DoubledModes[i][2];
-			if (ScanModeListNoRefresh(*array, compmode, *count))
+			if (ModeIndex_FindNoRefresh(index, &compmode))
 			{
 				compmode.dmPelsWidth = DoubledModes[i][0];
 				compmode.dmPelsHeight = DoubledModes[i][1];
@@ -550,7 +558,7 @@ void AddDoubledResolutions(DEVMODE **array, DWORD *count)
 			}
 		}
 	}
-	if (ScanColorMode(*array, *count, 32))
+	if (ModeIndex_HasBPP(index, 32))
 	{
 		compmode.dmBitsPerPel = 32;
 		for (i = 0; i < numdoubledmodes; i++)
@@ -558,7 +566,7 @@ void AddDoubledResolutions(DEVMODE **array, DWORD *count)
 			compmode.dmPelsWidth = DoubledModes[i][3];
 			compmode.dmPelsHeight = DoubledModes[i][4];
 			compmode.dmDisplayFrequency = DoubledModes[i][2];
-			if (ScanModeListNoRefresh(*array, compmode, *count))
+			if (ModeIndex_FindNoRefresh(index, &compmode))
 			{
 				compmode.dmPelsWidth = DoubledModes[i][0];
 				compmode.dmPelsHeight = DoubledModes[i][1];
@@ -567,10 +575,16 @@ void AddDoubledResolutions(DEVMODE **array, DWORD *count)
 			}
 		}
 	}
-	*array = (DEVMODE *)realloc(*array, (*count + newcount) * sizeof(DEVMODE));
-	memcpy(&(*array)[*count - 1], array2, newcount * sizeof(DEVMODE));
+	DEVMODE *tmp = (DEVMODE *)realloc(*array, (*count + newcount) * sizeof(DEVMODE));
+	if (tmp)
+	{
+		*array = tmp;
+		for (DWORD x = 0; x < newcount; x++)
+		{
+			if (ModeIndex_Insert(index, &array2[x])) (*array)[(*count)++] = array2[x];
+		}
+	}
 	free(array2);
-	*count += newcount;
 }
 
 void RemoveTVAspectModes(DEVMODE **array, DWORD count)
@@ -593,9 +607,10 @@ void RemoveTVAspectModes(DEVMODE **array, DWORD count)
 }
 
 
-void AddExtraColorModes(DEVMODE **array, DWORD *count)
+void AddExtraColorModes(DEVMODE **array, DWORD *count, MODEINDEX *index)
 {
 	DEVMODE *array2 = (DEVMODE *)malloc(sizeof(DEVMODE)*(7*(*count)));
+	if (!array2) return;
 	DEVMODE compmode;
 	DWORD count2 = 0;
 	for(DWORD i = 0; i < *count; i++)
@@ -605,7 +620,7 @@ void AddExtraColorModes(DEVMODE **array, DWORD *count)
 		case 15:
 			compmode = (*array)[i];
 			compmode.dmBitsPerPel = 16;
-			if(!ScanModeList(*array,compmode,*count) && (dxglcfg.AddColorDepths & 4))
+			if(!ModeIndex_Find(index,&compmode) && (dxglcfg.AddColorDepths & 4))
 			{
 				array2[count2] = compmode;
 				count2++;
@@ -614,7 +629,7 @@ void AddExtraColorModes(DEVMODE **array, DWORD *count)
 		case 16:
 			compmode = (*array)[i];
 			compmode.dmBitsPerPel = 15;
-			if(!ScanModeList(*array,compmode,*count) && (dxglcfg.AddColorDepths & 2))
+			if(!ModeIndex_Find(index,&compmode) && (dxglcfg.AddColorDepths & 2))
 			{
 				array2[count2] = compmode;
 				count2++;
@@ -623,7 +638,7 @@ void AddExtraColorModes(DEVMODE **array, DWORD *count)
 		case 24:
 			compmode = (*array)[i];
 			compmode.dmBitsPerPel = 32;
-			if(!ScanModeList(*array,compmode,*count) && (dxglcfg.AddColorDepths & 16))
+			if(!ModeIndex_Find(index,&compmode) && (dxglcfg.AddColorDepths & 16))
 			{
 				array2[count2] = compmode;
 				count2++;
@@ -632,28 +647,28 @@ void AddExtraColorModes(DEVMODE **array, DWORD *count)
 		case 32:
 			compmode = (*array)[i];
 			compmode.dmBitsPerPel = 24;
-			if(!ScanModeList(*array,compmode,*count) && (dxglcfg.AddColorDepths & 8))
+			if(!ModeIndex_Find(index,&compmode) && (dxglcfg.AddColorDepths & 8))
 			{
 				array2[count2] = compmode;
 				count2++;
 			}
 			compmode = (*array)[i];
 			compmode.dmBitsPerPel = 16;
-			if(!ScanModeList(*array,compmode,*count) && (dxglcfg.AddColorDepths & 4))
+			if(!ModeIndex_Find(index,&compmode) && (dxglcfg.AddColorDepths & 4))
 			{
 				array2[count2] = compmode;
 				count2++;
 			}
 			compmode = (*array)[i];
 			compmode.dmBitsPerPel = 15;
-			if(!ScanModeList(*array,compmode,*count) && (dxglcfg.AddColorDepths & 2))
+			if(!ModeIndex_Find(index,&compmode) && (dxglcfg.AddColorDepths & 2))
 			{
 				array2[count2] = compmode;
 				count2++;
 			}
 			compmode = (*array)[i];
 			compmode.dmBitsPerPel = 8;
-			if(!ScanModeList(*array,compmode,*count) && (dxglcfg.AddColorDepths & 1))
+			if(!ModeIndex_Find(index,&compmode) && (dxglcfg.AddColorDepths & 1))
 			{
 				array2[count2] = compmode;
 				count2++;
@@ -663,16 +678,23 @@ void AddExtraColorModes(DEVMODE **array, DWORD *count)
 			break;
 		}
 	}
-	*array = (DEVMODE *)realloc(*array,(*count+count2)*sizeof(DEVMODE));
-	memcpy(&(*array)[*count-1],array2,count2*sizeof(DEVMODE));
+	DEVMODE *tmp = (DEVMODE *)realloc(*array,(*count+count2)*sizeof(DEVMODE));
+	if (tmp)
+	{
+		*array = tmp;
+		for (DWORD x = 0; x < count2; x++)
+		{
+			if (ModeIndex_Insert(index, &array2[x])) (*array)[(*count)++] = array2[x];
+		}
+	}
 	free(array2);
-	*count += count2;
 	if ((dxglcfg.AddColorDepths & 2) && !(dxglcfg.AddColorDepths & 4))
 	{
 		for (DWORD x = 0; x < (*count); x++)
 		{
 			if ((*array)[x].dmBitsPerPel == 15) (*array)[x].dmBitsPerPel = 16;
 		}
+		DiscardDuplicateModes(array, count, index);
 	}
 }
 
@@ -709,81 +731,85 @@ int SortRes(const DEVMODE *mode1, const DEVMODE *mode2)
 	else return 0;
 }
 
-HRESULT EnumDisplayModes1(DWORD dwFlags, LPDDSURFACEDESC lpDDSurfaceDesc, LPVOID lpContext, LPDDENUMMODESCALLBACK lpEnumModesCallback)
-{
-	if(!lpEnumModesCallback) return DDERR_INVALIDPARAMS;
-	if (dwFlags & 0xFFFFFFFC) return DDERR_INVALIDPARAMS;
-	BOOL match;
-	BOOL scalemodes;
-	DWORD modenum = 0;
-	DWORD modemax = 128;
-	DEVMODE mode;
-	ZeroMemory(&mode,sizeof(DEVMODE));
-	mode.dmSize = sizeof(DEVMODE);
-	DEVMODE *modes = (DEVMODE*)malloc(128*sizeof(DEVMODE));
-	DEVMODE *tmp;
-	if(!modes) ERR(DDERR_OUTOFMEMORY);
-	DDSURFACEDESC ddmode;
-	ZeroMemory(&ddmode,sizeof(DDSURFACEDESC));
-	ddmode.dwSize = sizeof(DDSURFACEDESC);
-	ddmode.dwFlags = DDSD_HEIGHT | DDSD_WIDTH | DDSD_PITCH | DDSD_PIXELFORMAT | DDSD_REFRESHRATE;
-	ddmode.ddpfPixelFormat.dwSize = sizeof(DDPIXELFORMAT);
-	if (!_isnan(dxglcfg.postsizex) && !_isnan(dxglcfg.postsizey) &&
-		(dxglcfg.postsizex > 0.25f) && (dxglcfg.postsizey > 0.25f) &&
-		(dxglcfg.postsizex != 1.0f) && (dxglcfg.postsizey != 1.0f) &&
-		((dxglcfg.scaler == 0) || ((dxglcfg.scaler >= 4) && (dxglcfg.scaler <= 6))) &&
-		(!dxglcfg.primaryscale))
-		scalemodes = TRUE;
-	else scalemodes = FALSE;
-	while(EnumDisplaySettings(NULL,modenum++,&mode))
-	{
-		if (scalemodes)
+/**
+  * Gets the list of display modes to enumerate, built from the modes of the
+  * display driver and the modes added by DXGL.  The list is cached in memory
+  * and on disk so it is only built again when the settings or display change.
+  * @param type
+  *  CAPSCACHE_MODES1 for IDirectDraw through IDirectDraw4, CAPSCACHE_MODES2
+  *  for IDirectDraw7
+  * @param list
+  *  Pointer to receive the mode list, allocated with malloc
+  * @param count
+  *  Pointer to receive the number of modes in the list
+  * @return
+  *  DD_OK if the list was retrieved, DDERR_OUTOFMEMORY otherwise.
+  */
+static HRESULT GetDisplayModeList(DWORD type, DEVMODE **list, DWORD *count)
+{
+	if (CapsCache_GetModes(type, list, count)) return DD_OK;
+	DWORD modenum;
+	MODEINDEX index;
+	const DRIVERMODES *drivermodes = ModeIndex_GetDriverModes();
+	if (!drivermodes)
+	{
+		ModeIndex_ReleaseDriverModes();
+		return DDERR_OUTOFMEMORY;
+	}
+	modenum = drivermodes->count;
+	DEVMODE *modes = (DEVMODE*)malloc((modenum ? modenum : 1)*sizeof(DEVMODE));
+	if(!modes)
+	{
+		ModeIndex_ReleaseDriverModes();
+		return DDERR_OUTOFMEMORY;
+	}
+	memcpy(modes, drivermodes->modes, modenum*sizeof(DEVMODE));
+	ModeIndex_ReleaseDriverModes();
+	ZeroMemory(&index, sizeof(MODEINDEX));
+	if (dxglpolicy.scalemodes)
+	{
+		for (DWORD i = 0; i < modenum; i++)
 		{
-			mode.dmPelsWidth = (DWORD)((float)mode.dmPelsWidth / dxglcfg.postsizex);
-			mode.dmPelsHeight = (DWORD)((float)mode.dmPelsHeight / dxglcfg.postsizey);
-		}
-		modes[modenum-1] = mode;
-		if(modenum >= modemax)
-		{
-			modemax += 128;
-			tmp = (DEVMODE*)realloc(modes,modemax*sizeof(DEVMODE));
-			if(tmp == NULL)
-			{
-				free(modes);
-				ERR(DDERR_OUTOFMEMORY);
-			}
-			modes = tmp;
+			modes[i].dmPelsWidth = (DWORD)((float)modes[i].dmPelsWidth / dxglcfg.postsizex);
+			modes[i].dmPelsHeight = (DWORD)((float)modes[i].dmPelsHeight / dxglcfg.postsizey);
 		}
 	}
-	DiscardDuplicateModes(&modes,&modenum);
-	if(dxglcfg.AddColorDepths) AddExtraColorModes(&modes,&modenum);
-	if (dxglcfg.scaler != 0)
+	DiscardDuplicateModes(&modes,&modenum,&index);
+	if (!index.exact)
+	{
+		free(modes);
+		return DDERR_OUTOFMEMORY;
+	}
+	if(dxglcfg.AddColorDepths) AddExtraColorModes(&modes,&modenum,&index);
+	if (modenum && (dxglcfg.scaler != 0))
 	{
 		if (dxglcfg.AddModes & 1) //Common low resolutions and doubled modes
-			AddExtraResolutions(&modes, &modenum, LowResModes, NumLowResModes);
+			AddExtraResolutions(&modes, &modenum, &index, LowResModes, NumLowResModes);
 		if (dxglcfg.AddModes & 2) //Uncommon low resolutions
-			AddExtraResolutions(&modes, &modenum, UncommonLowResModes, NumUncommonLowResModes);
+			AddExtraResolutions(&modes, &modenum, &index, UncommonLowResModes, NumUncommonLowResModes);
 		if (dxglcfg.AddModes & 4) //Uncommon SD reosolutions
-			AddExtraResolutions(&modes, &modenum, UncommonSDModes, NumUncommonSDModes);
+			AddExtraResolutions(&modes, &modenum, &index, UncommonSDModes, NumUncommonSDModes);
 		if (dxglcfg.AddModes & 8) //High definition resolutions
-			AddExtraResolutions(&modes, &modenum, HDModes, NumHDModes);
+			AddExtraResolutions(&modes, &modenum, &index, HDModes, NumHDModes);
 		if (dxglcfg.AddModes & 16) //Ultra-HD resolutions
-			AddExtraResolutions(&modes, &modenum, UHDModes, NumUHDModes);
+			AddExtraResolutions(&modes, &modenum, &index, UHDModes, NumUHDModes);
 		if (dxglcfg.AddModes & 32) //Ultra-HD resolutions above 4k
-			AddExtraResolutions(&modes, &modenum, UHD2Modes, NumUHD2Modes);
+			AddExtraResolutions(&modes, &modenum, &index, UHD2Modes, NumUHD2Modes);
 		if (dxglcfg.AddModes & 64) //Very uncommon resolutions
-			AddExtraResolutions(&modes, &modenum, UncommonModes, NumUncommonModes);
-		if (dxglcfg.AddModes & 128) //Common SVGA modes
-			AddExtraResolutions(&modes, &modenum, CommonSVGAModes, NumCommonSVGAModes);
+			AddExtraResolutions(&modes, &modenum, &index, UncommonModes, NumUncommonModes);
+		if ((dxglcfg.AddModes & 128) && (type == CAPSCACHE_MODES1)) //Common SVGA modes
+			AddExtraResolutions(&modes, &modenum, &index, CommonSVGAModes, NumCommonSVGAModes);
 	}
-	if (dxglcfg.AddModes && (_isnan(dxglcfg.postsizex) || _isnan(dxglcfg.postsizey) ||
-		(dxglcfg.postsizex < 0.25f) || (dxglcfg.postsizey < 0.25f)))
+	if (modenum && dxglcfg.AddModes && dxglpolicy.postsizeauto)
 	{
-		if (dxglcfg.AddModes & 1) AddDoubledResolutions(&modes, &modenum);
+		if (dxglcfg.AddModes & 1) AddDoubledResolutions(&modes, &modenum, &index);
 	}
-	if (dxglcfg.HackNoTVRefresh) RemoveTVAspectModes(&modes, modenum);
-	DiscardDuplicateModes(&modes, &modenum);
-	modenum--;
+	if (dxglcfg.HackNoTVRefresh)
+	{
+		RemoveTVAspectModes(&modes, modenum);
+		DiscardDuplicateModes(&modes, &modenum, &index);
+	}
+	ModeIndex_Delete(&index);
 	switch(dxglcfg.SortModes)
 	{
 	case 0:
@@ -796,6 +822,26 @@ HRESULT EnumDisplayModes1(DWORD dwFlags, LPDDSURFACEDESC lpDDSurfaceDesc, LPVOID
 		qsort(modes,modenum,sizeof(DEVMODE),(int(*)(const void*, const void*))SortRes);
 		break;
 	}
+	CapsCache_StoreModes(type, modes, modenum);
+	*list = modes;
+	*count = modenum;
+	return DD_OK;
+}
+
+HRESULT EnumDisplayModes1(DWORD dwFlags, LPDDSURFACEDESC lpDDSurfaceDesc, LPVOID lpContext, LPDDENUMMODESCALLBACK lpEnumModesCallback)
+{
+	if(!lpEnumModesCallback) return DDERR_INVALIDPARAMS;
+	if (dwFlags & 0xFFFFFFFC) return DDERR_INVALIDPARAMS;
+	BOOL match;
+	DWORD modenum;
+	DEVMODE *modes;
+	HRESULT error = GetDisplayModeList(CAPSCACHE_MODES1, &modes, &modenum);
+	if (error != DD_OK) ERR(error);
+	DDSURFACEDESC ddmode;
+	ZeroMemory(&ddmode,sizeof(DDSURFACEDESC));
+	ddmode.dwSize = sizeof(DDSURFACEDESC);
+	ddmode.dwFlags = DDSD_HEIGHT | DDSD_WIDTH | DDSD_PITCH | DDSD_PIXELFORMAT | DDSD_REFRESHRATE;
+	ddmode.ddpfPixelFormat.dwSize = sizeof(DDPIXELFORMAT);
 	for(DWORD i = 0; i < modenum; i++)
 	{
 		match = TRUE;
@@ -854,7 +900,11 @@ HRESULT EnumDisplayModes1(DWORD dwFlags, LPDDSURFACEDESC lpDDSurfaceDesc, LPVOID
 			if(modes[i].dmBitsPerPel == 15) ddmode.lPitch = modes[i].dmPelsWidth * 2;
 			else if(modes[i].dmBitsPerPel == 4) ddmode.lPitch = modes[i].dmPelsWidth / 2;
 			else ddmode.lPitch = modes[i].dmPelsWidth * (modes[i].dmBitsPerPel / 8);
-			if(lpEnumModesCallback(&ddmode,lpContext) == DDENUMRET_CANCEL) return DD_OK;
+			if(lpEnumModesCallback(&ddmode,lpContext) == DDENUMRET_CANCEL)
+			{
+				free(modes);
+				return DD_OK;
+			}
 		}
 	}
 	free(modes);
@@ -863,86 +913,15 @@ HRESULT EnumDisplayModes1(DWORD dwFlags, LPDDSURFACEDESC lpDDSurfaceDesc, LPVOID
 HRESULT EnumDisplayModes2(DWORD dwFlags, LPDDSURFACEDESC2 lpDDSurfaceDesc, LPVOID lpContext, LPDDENUMMODESCALLBACK2 lpEnumModesCallback)
 {
 	BOOL match;
-	BOOL scalemodes;
-	DWORD modenum = 0;
-	DWORD modemax = 128;
-	DEVMODE mode;
-	ZeroMemory(&mode,sizeof(DEVMODE));
-	mode.dmSize = sizeof(DEVMODE);
-	DEVMODE *modes = (DEVMODE*)malloc(128*sizeof(DEVMODE));
-	DEVMODE *tmp;
-	if(!modes) ERR(DDERR_OUTOFMEMORY);
+	DWORD modenum;
+	DEVMODE *modes;
+	HRESULT error = GetDisplayModeList(CAPSCACHE_MODES2, &modes, &modenum);
+	if (error != DD_OK) ERR(error);
 	DDSURFACEDESC2 ddmode;
 	ZeroMemory(&ddmode,sizeof(DDSURFACEDESC2));
 	ddmode.dwSize = sizeof(DDSURFACEDESC2);
 	ddmode.dwFlags = DDSD_HEIGHT | DDSD_WIDTH | DDSD_PITCH | DDSD_PIXELFORMAT | DDSD_REFRESHRATE;
 	ddmode.ddpfPixelFormat.dwSize = sizeof(DDPIXELFORMAT);
-	if (!_isnan(dxglcfg.postsizex) && !_isnan(dxglcfg.postsizey) &&
-		(dxglcfg.postsizex > 0.25f) && (dxglcfg.postsizey > 0.25f) &&
-		(dxglcfg.postsizex != 1.0f) && (dxglcfg.postsizey != 1.0f) &&
-		((dxglcfg.scaler == 0) || ((dxglcfg.scaler >= 4) && (dxglcfg.scaler <= 6))) &&
-		(!dxglcfg.primaryscale))
-		scalemodes = TRUE;
-	else scalemodes = FALSE;
-	while(EnumDisplaySettings(NULL,modenum++,&mode))
-	{
-		if (scalemodes)
-		{
-			mode.dmPelsWidth = (DWORD)((float)mode.dmPelsWidth / dxglcfg.postsizex);
-			mode.dmPelsHeight = (DWORD)((float)mode.dmPelsHeight / dxglcfg.postsizey);
-		}
-		modes[modenum-1] = mode;
-		if(modenum >= modemax)
-		{
-			modemax += 128;
-			tmp = (DEVMODE*)realloc(modes,modemax*sizeof(DEVMODE));
-			if(tmp == NULL)
-			{
-				free(modes);
-				ERR(DDERR_OUTOFMEMORY);
-			}
-			modes = tmp;
-		}
-	}
-	DiscardDuplicateModes(&modes,&modenum);
-	if(dxglcfg.AddColorDepths) AddExtraColorModes(&modes,&modenum);
-	if (dxglcfg.scaler != 0)
-	{
-		if (dxglcfg.AddModes & 1) //Common low resolutions and doubled modes
-			AddExtraResolutions(&modes, &modenum, LowResModes, NumLowResModes);
-		if (dxglcfg.AddModes & 2) //Uncommon low resolutions
-			AddExtraResolutions(&modes, &modenum, UncommonLowResModes, NumUncommonLowResModes);
-		if (dxglcfg.AddModes & 4) //Uncommon SD reosolutions
-			AddExtraResolutions(&modes, &modenum, UncommonSDModes, NumUncommonSDModes);
-		if (dxglcfg.AddModes & 8) //High definition resolutions
-			AddExtraResolutions(&modes, &modenum, HDModes, NumHDModes);
-		if (dxglcfg.AddModes & 16) //Ultra-HD resolutions
-			AddExtraResolutions(&modes, &modenum, UHDModes, NumUHDModes);
-		if (dxglcfg.AddModes & 32) //Ultra-HD resolutions above 4k
-			AddExtraResolutions(&modes, &modenum, UHD2Modes, NumUHD2Modes);
-		if (dxglcfg.AddModes & 64) //Very uncommon resolutions
-			AddExtraResolutions(&modes, &modenum, UncommonModes, NumUncommonModes);
-	}
-	if (dxglcfg.AddModes && (_isnan(dxglcfg.postsizex) || _isnan(dxglcfg.postsizey) ||
-		(dxglcfg.postsizex < 0.25f) || (dxglcfg.postsizey < 0.25f)))
-	{
-		if (dxglcfg.AddModes & 1) AddDoubledResolutions(&modes, &modenum);
-	}
-	if (dxglcfg.HackNoTVRefresh) RemoveTVAspectModes(&modes, modenum);
-	DiscardDuplicateModes(&modes, &modenum);
-	modenum--;
-	switch(dxglcfg.SortModes)
-	{
-	case 0:
-	default:
-		break;
-	case 1:
-		qsort(modes,modenum,sizeof(DEVMODE),(int(*)(const void*, const void*))SortDepth);
-		break;
-	case 2:
-		qsort(modes,modenum,sizeof(DEVMODE),(int(*)(const void*, const void*))SortRes);
-		break;
-	}
 	for(DWORD i = 0; i < modenum; i++)
 	{
 		match = true;
@@ -1001,7 +980,11 @@ HRESULT EnumDisplayModes2(DWORD dwFlags, LPDDSURFACEDESC2 lpDDSurfaceDesc, LPVOI
 			if(modes[i].dmBitsPerPel == 15) ddmode.lPitch = modes[i].dmPelsWidth * 2;
 			else if(modes[i].dmBitsPerPel == 4) ddmode.lPitch = modes[i].dmPelsWidth / 2;
 			else ddmode.lPitch = modes[i].dmPelsWidth * (modes[i].dmBitsPerPel / 8);
-			if(lpEnumModesCallback(&ddmode,lpContext) == DDENUMRET_CANCEL) return DD_OK;
+			if(lpEnumModesCallback(&ddmode,lpContext) == DDENUMRET_CANCEL)
+			{
+				free(modes);
+				return DD_OK;
+			}
 		}
 	}
 	free(modes);
@@ -1067,6 +1050,8 @@ HRESULT glDirectDraw7_Create(glDirectDraw7 **glDD7)
 	This->refcount2 = 0;
 	This->refcount1 = 0;
 	This->renderer = NULL;
+	for (int i = 0; i < 256; i++)
+		This->gammaramp.red[i] = This->gammaramp.green[i] = This->gammaramp.blue[i] = (WORD)(i * 257);
 	*glDD7 = This;
 	TRACE_EXIT(23, DD_OK);
 	return DD_OK;
@@ -1150,11 +1135,9 @@ void glDirectDraw7_Delete(glDirectDraw7 *This)
 		}
 		if(This->surfaces)
 		{
-			for(int i = 0; i < This->surfacecount; i++)
-			{
-				if(This->surfaces[i]) dxglDirectDrawSurface7_Delete(This->surfaces[i]);
-				This->surfaces[i] = NULL;
-			}
+			// Each surface removes itself from the list, along with any it deletes
+			while (This->surfacecount)
+				dxglDirectDrawSurface7_Delete(This->surfaces[This->surfacecount - 1]);
 			free(This->surfaces);
 		}
 		if(This->renderer)
@@ -1419,7 +1402,7 @@ HRESULT WINAPI glDirectDraw7_CreateSurface(glDirectDraw7 *This, LPDDSURFACEDESC2
 	if(!lpDDSurfaceDesc2) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
 	if(pUnkOuter) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
 	if(lpDDSurfaceDesc2->dwSize < sizeof(DDSURFACEDESC2)) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
-	HRESULT ret = glDirectDraw7_CreateSurface2(This,lpDDSurfaceDesc2,lplpDDSurface,pUnkOuter,TRUE,7);
+	HRESULT ret = glDirectDraw7_CreateSurface2(This,lpDDSurfaceDesc2,lplpDDSurface,pUnkOuter,TRUE,7,NULL);
 	if (ret == DD_OK)
 	{
 		glDirectDraw7_AddRef(This);
@@ -1430,12 +1413,14 @@ HRESULT WINAPI glDirectDraw7_CreateSurface(glDirectDraw7 *This, LPDDSURFACEDESC2
 }
 
 
-HRESULT glDirectDraw7_CreateSurface2(glDirectDraw7 *This, LPDDSURFACEDESC2 lpDDSurfaceDesc2, LPDIRECTDRAWSURFACE7 FAR *lplpDDSurface, IUnknown FAR *pUnkOuter, BOOL RecordSurface, int version)
+HRESULT glDirectDraw7_CreateSurface2(glDirectDraw7 *This, LPDDSURFACEDESC2 lpDDSurfaceDesc2, LPDIRECTDRAWSURFACE7 FAR *lplpDDSurface, IUnknown FAR *pUnkOuter, BOOL RecordSurface, int version,
+	dxglDirectDrawSurface7 *shareowner)
 {
 	HRESULT error;
 	DWORD mipcount;
 	DWORD complexcount = 1;
 	size_t surfacesize;
+	dxglDirectDrawSurface7 *newsurface;
 	TRACE_ENTER(5, 14, This, 14, lpDDSurfaceDesc2, 14, lplpDDSurface, 14, pUnkOuter, 22, RecordSurface);
 	// Validate interface pointer pointer
 	if (!This) TRACE_RET(HRESULT, 23, DDERR_INVALIDOBJECT);
@@ -1483,43 +1468,44 @@ HRESULT glDirectDraw7_CreateSurface2(glDirectDraw7 *This, LPDDSURFACEDESC2 lpDDS
 		complexcount * lpDDSurfaceDesc2->dwMipMapCount;
 	// Calculate surface size
 	surfacesize = sizeof(dxglDirectDrawSurface7) * complexcount;
-	if (lpDDSurfaceDesc2->dwFlags & DDSD_BACKBUFFERCOUNT)
+	// Duplicates use the texture stored with the original surface
+	if (shareowner);
+	else if (lpDDSurfaceDesc2->dwFlags & DDSD_BACKBUFFERCOUNT)
 		surfacesize += sizeof(glTexture) * (lpDDSurfaceDesc2->dwBackBufferCount + 1);
 	else surfacesize += sizeof(glTexture);
 
 	// Create recorded surface
 	if (RecordSurface)
 	{
-		This->surfacecount++;
-		if (This->surfacecount > This->surfacecountmax)
+		if (This->surfacecount >= This->surfacecountmax)
 		{
 			dxglDirectDrawSurface7 **surfaces2;
-			surfaces2 = (dxglDirectDrawSurface7 **)realloc(This->surfaces, (This->surfacecountmax + 1024)*sizeof(dxglDirectDrawSurface7 *));
+			surfaces2 = (dxglDirectDrawSurface7 **)realloc(This->surfaces, This->surfacecountmax * 2 * sizeof(dxglDirectDrawSurface7 *));
 			if (!surfaces2) TRACE_RET(HRESULT, 23, DDERR_OUTOFMEMORY);
 			This->surfaces = surfaces2;
-			ZeroMemory(&This->surfaces[This->surfacecountmax], 1024 * sizeof(dxglDirectDrawSurface7 *));
-			This->surfacecountmax += 1024;
+			This->surfacecountmax *= 2;
 		}
-		This->surfaces[This->surfacecount - 1] = (dxglDirectDrawSurface7*)malloc(surfacesize);
-		if (!This->surfaces[This->surfacecount - 1])
-		{
-			This->surfacecount--;
-			TRACE_RET(HRESULT, 23, DDERR_OUTOFMEMORY);
-		}
-		error = dxglDirectDrawSurface7_Create((LPDIRECTDRAW7)This, lpDDSurfaceDesc2, NULL, NULL, version, This->surfaces[This->surfacecount - 1]);
+		newsurface = (dxglDirectDrawSurface7*)malloc(surfacesize);
+		if (!newsurface) TRACE_RET(HRESULT, 23, DDERR_OUTOFMEMORY);
+		error = dxglDirectDrawSurface7_Create((LPDIRECTDRAW7)This, lpDDSurfaceDesc2, NULL,
+			shareowner ? shareowner->texture : NULL, version, newsurface);
+		// Listed even if creation failed, deleting it below removes it again
+		This->surfaces[This->surfacecount] = newsurface;
+		newsurface->surfaceslot = ++This->surfacecount;
 		if (lpDDSurfaceDesc2->ddsCaps.dwCaps & DDSCAPS_PRIMARYSURFACE)
 		{
-			This->primary = This->surfaces[This->surfacecount - 1];
+			This->primary = newsurface;
 			This->primarylost = false;
 		}
-		*lplpDDSurface = (LPDIRECTDRAWSURFACE7)This->surfaces[This->surfacecount - 1];
+		*lplpDDSurface = (LPDIRECTDRAWSURFACE7)newsurface;
 	}
 	else
 	{
 		if (lpDDSurfaceDesc2->ddsCaps.dwCaps & DDSCAPS_PRIMARYSURFACE) TRACE_RET(HRESULT, 23, DDERR_INVALIDPARAMS);
 		*lplpDDSurface = (LPDIRECTDRAWSURFACE7)malloc(surfacesize);
 		if (!*lplpDDSurface) TRACE_RET(HRESULT, 23, DDERR_OUTOFMEMORY);
-		error = dxglDirectDrawSurface7_Create((LPDIRECTDRAW7)This, lpDDSurfaceDesc2, NULL, NULL, version, (dxglDirectDrawSurface7 *)lplpDDSurface);
+		error = dxglDirectDrawSurface7_Create((LPDIRECTDRAW7)This, lpDDSurfaceDesc2, NULL,
+			shareowner ? shareowner->texture : NULL, version, (dxglDirectDrawSurface7 *)lplpDDSurface);
 	}
 	// Delete surface if creation failed
 	if (error != DD_OK)
@@ -1527,24 +1513,56 @@ HRESULT glDirectDraw7_CreateSurface2(glDirectDraw7 *This, LPDDSURFACEDESC2 lpDDS
 		dxglDirectDrawSurface7_Delete((dxglDirectDrawSurface7*)*lplpDDSurface);
 		*lplpDDSurface = NULL;
 	}
+	else if (shareowner)
+	{
+		// Keep the memory holding the shared texture until the duplicate is gone
+		InterlockedIncrement(&shareowner->sharecount);
+		((dxglDirectDrawSurface7*)*lplpDDSurface)->shareowner = shareowner;
+	}
 	TRACE_VAR("*lplpDDSurface",14,*lplpDDSurface);
 	TRACE_EXIT(23,error);
 	return error;
 }
+/**
+  * Creates a surface that shares the texture and memory of another surface,
+  * so writes to either one show up in both.  Nothing is copied.
+  * @param This
+  *  Pointer to glDirectDraw7 interface
+  * @param src
+  *  Surface to duplicate
+  * @param lplpDupDDSurface
+  *  Receives the new surface
+  * @param version
+  *  DirectDraw interface version the duplicate is created for
+  * @return
+  *  DD_OK if the call succeeds, or DDERR_CANTDUPLICATE if src is a primary,
+  *  flipping, mipmap or z-buffer surface
+  */
+HRESULT glDirectDraw7_DuplicateSurface2(glDirectDraw7 *This, dxglDirectDrawSurface7 *src,
+	LPDIRECTDRAWSURFACE7 FAR *lplpDupDDSurface, int version)
+{
+	DDSURFACEDESC2 ddsd;
+	TRACE_ENTER(4, 14, This, 14, src, 14, lplpDupDDSurface, 11, version);
+	if ((src->ddsd.ddsCaps.dwCaps & (DDSCAPS_PRIMARYSURFACE | DDSCAPS_COMPLEX | DDSCAPS_FLIP |
+		DDSCAPS_MIPMAP | DDSCAPS_ZBUFFER)) || src->miplevel)
+		TRACE_RET(HRESULT, 23, DDERR_CANTDUPLICATE);
+	// Duplicates of a duplicate share the memory of the original
+	if (src->shareowner) src = src->shareowner;
+	ddsd = src->ddsd;
+	TRACE_RET(HRESULT, 23, glDirectDraw7_CreateSurface2(This, &ddsd, lplpDupDDSurface, NULL, TRUE, version, src));
+}
 HRESULT WINAPI glDirectDraw7_DuplicateSurface(glDirectDraw7 *This, LPDIRECTDRAWSURFACE7 lpDDSurface, LPDIRECTDRAWSURFACE7 FAR *lplpDupDDSurface)
 {
 	TRACE_ENTER(3,14,This,14,lpDDSurface,14,lplpDupDDSurface);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
 	if(!lpDDSurface) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
 	if(!lplpDupDDSurface) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
-	DDSURFACEDESC2 ddsd;
-	HRESULT ret;
-	ZeroMemory(&ddsd, sizeof(DDSURFACEDESC2));
-	ddsd.dwSize = sizeof(DDSURFACEDESC2);
-	lpDDSurface->GetSurfaceDesc(&ddsd);
-	ret = glDirectDraw7_CreateSurface(This, &ddsd, lplpDupDDSurface, NULL);
-	if (ret != DD_OK) TRACE_RET(HRESULT, 23, ret);
-	ret = (*lplpDupDDSurface)->Blt(NULL, lpDDSurface, NULL, 0, NULL);
+	HRESULT ret = glDirectDraw7_DuplicateSurface2(This, (dxglDirectDrawSurface7*)lpDDSurface, lplpDupDDSurface, 7);
+	if (ret == DD_OK)
+	{
+		glDirectDraw7_AddRef(This);
+		((dxglDirectDrawSurface7*)*lplpDupDDSurface)->creator = (IUnknown*)This;
+	}
 	TRACE_EXIT(23, ret);
 	return ret;
 }
@@ -1593,6 +1611,8 @@ HRESULT WINAPI glDirectDraw7_EnumSurfaces(glDirectDraw7 *This, DWORD dwFlags, LP
 	BOOL match;
 	HRESULT ret;
 	LPDIRECTDRAWSURFACE7 surface;
+	dxglDirectDrawSurface7 **matches;
+	int matchcount = 0;
 	DDSURFACEDESC2 ddsd;
 	ZeroMemory(&ddsd, sizeof(DDSURFACEDESC2));
 	ddsd.dwSize = sizeof(DDSURFACEDESC2);
@@ -1619,30 +1639,44 @@ HRESULT WINAPI glDirectDraw7_EnumSurfaces(glDirectDraw7 *This, DWORD dwFlags, LP
 	}
 	else
 	{
+		// The callback may release surfaces, which reorders the list, so the
+		// matches are collected and referenced before the first call
+		if (!This->surfacecount)
+		{
+			TRACE_EXIT(23, DD_OK);
+			return DD_OK;
+		}
+		matches = (dxglDirectDrawSurface7**)malloc(This->surfacecount * sizeof(dxglDirectDrawSurface7*));
+		if (!matches) TRACE_RET(HRESULT, 23, DDERR_OUTOFMEMORY);
 		for (i = 0; i < This->surfacecount; i++)
 		{
-			if (This->surfaces[i])
+			if (dwFlags & DDENUMSURFACES_ALL) match = TRUE;
+			if (dwFlags & DDENUMSURFACES_MATCH)
 			{
-				if (dwFlags & DDENUMSURFACES_ALL) match = TRUE;
-				if (dwFlags & DDENUMSURFACES_MATCH)
-				{
-					if (!memcmp(&This->surfaces[i]->ddsd, lpDDSD2, sizeof(DDSURFACEDESC2))) match = TRUE;
-					else match = FALSE;
-				}
-				if (dwFlags & DDENUMSURFACES_NOMATCH)
-				{
-					if (memcmp(&This->surfaces[i]->ddsd, lpDDSD2, sizeof(DDSURFACEDESC2))) match = TRUE;
-					else match = FALSE;
-				}
-				if (match)
-				{
-					dxglDirectDrawSurface7_AddRef(This->surfaces[i]);
-					dxglDirectDrawSurface7_GetSurfaceDesc(This->surfaces[i], &ddsd);
-					ret = lpEnumSurfacesCallback((LPDIRECTDRAWSURFACE7)This->surfaces[i], &ddsd, lpContext);
-					if (ret == DDENUMRET_CANCEL) break;
-				}
+				if (!memcmp(&This->surfaces[i]->ddsd, lpDDSD2, sizeof(DDSURFACEDESC2))) match = TRUE;
+				else match = FALSE;
+			}
+			if (dwFlags & DDENUMSURFACES_NOMATCH)
+			{
+				if (memcmp(&This->surfaces[i]->ddsd, lpDDSD2, sizeof(DDSURFACEDESC2))) match = TRUE;
+				else match = FALSE;
+			}
+			if (match)
+			{
+				matches[matchcount++] = This->surfaces[i];
+				dxglDirectDrawSurface7_AddRef(This->surfaces[i]);
 			}
 		}
+		for (i = 0; i < matchcount; i++)
+		{
+			dxglDirectDrawSurface7_GetSurfaceDesc(matches[i], &ddsd);
+			ret = lpEnumSurfacesCallback((LPDIRECTDRAWSURFACE7)matches[i], &ddsd, lpContext);
+			if (ret == DDENUMRET_CANCEL) break;
+		}
+		// Surfaces not passed to the callback keep no reference
+		for (i++; i < matchcount; i++)
+			dxglDirectDrawSurface7_Release(matches[i]);
+		free(matches);
 	}
 	TRACE_EXIT(23,DD_OK);
 	return DD_OK;
@@ -1685,7 +1719,7 @@ HRESULT WINAPI glDirectDraw7_GetCaps(glDirectDraw7 *This, LPDDCAPS lpDDDriverCap
 		DDCAPS_3D | DDCAPS_CANCLIP | DDCAPS_CANCLIPSTRETCHED | DDCAPS_READSCANLINE |
 		DDCAPS_OVERLAY | DDCAPS_OVERLAYSTRETCH;
 	ddCaps.dwCaps2 = DDCAPS2_CANRENDERWINDOWED | DDCAPS2_WIDESURFACES | DDCAPS2_NOPAGELOCKREQUIRED |
-		DDCAPS2_FLIPINTERVAL | DDCAPS2_FLIPNOVSYNC | DDCAPS2_NONLOCALVIDMEM;
+		DDCAPS2_FLIPINTERVAL | DDCAPS2_FLIPNOVSYNC | DDCAPS2_NONLOCALVIDMEM | DDCAPS2_PRIMARYGAMMA;
 	ddCaps.dwFXCaps = DDFXCAPS_BLTSHRINKX | DDFXCAPS_BLTSHRINKY |
 		DDFXCAPS_BLTSTRETCHX | DDFXCAPS_BLTSTRETCHY | DDFXCAPS_BLTMIRRORLEFTRIGHT |
 		DDFXCAPS_BLTMIRRORUPDOWN | DDFXCAPS_BLTROTATION90;
@@ -1705,24 +1739,10 @@ HRESULT WINAPI glDirectDraw7_GetCaps(glDirectDraw7 *This, LPDDCAPS lpDDDriverCap
 	ddCaps.dwZBufferBitDepths = DDBD_16 | DDBD_24 | DDBD_32;
 	ddCaps.dwNumFourCCCodes = GetNumFOURCC();
 	BOOL fullrop = FALSE;
-	if (!This->renderer)
-	{
-		HWND hGLWnd = CreateWindow(_T("Test"), NULL, WS_POPUP, 0, 0, 16, 16, NULL, NULL, NULL, NULL);
-		glRenderer *tmprenderer = (glRenderer*)malloc(sizeof(glRenderer));
-		DEVMODE mode;
-		mode.dmSize = sizeof(DEVMODE);
-		EnumDisplaySettings(NULL, ENUM_CURRENT_SETTINGS, &mode);
-		glRenderer_Init(tmprenderer, 16, 16, mode.dmBitsPerPel, false, mode.dmDisplayFrequency, hGLWnd, NULL, FALSE);
-		if ((tmprenderer->ext->glver_major >= 3) && !dxglcfg.DebugNoGLSL130) fullrop = TRUE;
-		if (tmprenderer->ext->GLEXT_EXT_gpu_shader4) fullrop = TRUE;
-		glRenderer_Delete(tmprenderer);
-		free(tmprenderer);
-	}
-	else
-	{
-		if ((This->renderer->ext->glver_major >= 3) && !dxglcfg.DebugNoGLSL130) fullrop = TRUE;
-		if (This->renderer->ext->GLEXT_EXT_gpu_shader4) fullrop = TRUE;
-	}
+	GLCAPS glcaps;
+	glRenderer_GetCaps(This->renderer, &glcaps);
+	if ((glcaps.VersionMajor >= 3) && !dxglcfg.DebugNoGLSL130) fullrop = TRUE;
+	if (glcaps.GpuShader4) fullrop = TRUE;
 	if (fullrop)
 	{
 		memcpy(ddCaps.dwRops, supported_rops, 8 * sizeof(DWORD));
@@ -1944,7 +1964,7 @@ HRESULT WINAPI glDirectDraw7_Initialize(glDirectDraw7 *This, GUID FAR *lpGUID)
 	ZeroMemory(This->clippers, 1024 * sizeof(glDirectDrawClipper *));
 	This->clippercount = 0;
 	This->clippercountmax = 1024;
-	bool useguid = false;
+	DWORD adapterindex = 0;
 	switch((INT_PTR)lpGUID)
 	{
 	case NULL:
@@ -1956,12 +1976,13 @@ HRESULT WINAPI glDirectDraw7_Initialize(glDirectDraw7 *This, GUID FAR *lpGUID)
 		DEBUG("DDCREATE_HARDWAREONLY unnecessarily called.\n");
 		break;
 	default:
-		useguid = true;
-		DEBUG("Display GUIDs not yet supported, using primary.\n");
+		adapterindex = lpGUID->Data1 & 0xFF;
 	}
+	Adapter_Get(adapterindex, &This->adapter);
 	This->d3ddesc = d3ddesc_default;
 	This->d3ddesc3 = d3ddesc3_default;
 	memcpy(This->stored_devices, d3ddevices, 3 * sizeof(D3DDevice));
+	This->enumbuilt = false;
 	This->initialized = true;
 	TRACE_EXIT(23,DD_OK);
 	return DD_OK;
@@ -1996,7 +2017,7 @@ void glDirectDraw7_SetWindowSize(glDirectDraw7 *glDD7, DWORD dwWidth, DWORD dwHe
 	if ((glDD7->primaryx == 640) && (glDD7->primaryy == 480) && dxglcfg.HackCrop640480to640400)
 		glDD7->internaly = (DWORD)((float)glDD7->internaly * 1.2f);
 	if (glDD7->renderer && glDD7->primary) glRenderer_DrawScreen(glDD7->renderer, glDD7->primary->texture,
-		glDD7->primary->texture->palette, 0, NULL, FALSE, NULL, 0);
+		glDD7->primary->texture->palette, 0, NULL, FALSE);
 }
 BOOL glDirectDraw7_GetFullscreen(glDirectDraw7 *glDD7)
 {
@@ -2004,6 +2025,10 @@ BOOL glDirectDraw7_GetFullscreen(glDirectDraw7 *glDD7)
 	if (glDD7->fullscreen) return TRUE;
 	else return FALSE;
 }
+void glDirectDraw7_WindowChanged(glDirectDraw7 *glDD7)
+{
+	if (glDD7->renderer) glRenderer_WindowChanged(glDD7->renderer);
+}
 
 HRESULT WINAPI glDirectDraw7_SetCooperativeLevel(glDirectDraw7 *This, HWND hWnd, DWORD dwFlags)
 {
@@ -2109,7 +2134,7 @@ HRESULT WINAPI glDirectDraw7_SetCooperativeLevel(glDirectDraw7 *This, HWND hWnd,
 		}
 		This->internalx = This->primaryx = (DWORD)((float)This->screenx / dxglcfg.WindowScaleX);
 		This->internaly = This->primaryy = (DWORD)((float)This->screeny / dxglcfg.WindowScaleY);
-		if ((dxglcfg.WindowScaleX != 1.0f) || (dxglcfg.WindowScaleY != 1.0f))
+		if (dxglpolicy.windowscaled)
 		{
 			GetWindowRect(hWnd, &rect);
 			EnableWindowScaleHook(TRUE);
@@ -2126,69 +2151,46 @@ HRESULT WINAPI glDirectDraw7_SetCooperativeLevel(glDirectDraw7 *This, HWND hWnd,
 	return DD_OK;
 }
 
-void DiscardUndersizedModes(DEVMODE **array, DWORD *count, DEVMODE comp)
-{
-	DEVMODE *newarray = (DEVMODE *)malloc(sizeof(DEVMODE)*(*count));
-	if(!newarray) return;
-	DWORD newcount = 0;
-	bool match;
-	for(DWORD x = 0; x < (*count); x++)
-	{
-		match = false;
-		memcpy(&newarray[newcount],&(*array)[x],sizeof(DEVMODE));
-		for(int y = newcount; y > 0; y--)
-		{
-			if((*array)[x].dmBitsPerPel != comp.dmBitsPerPel ||
-				(*array)[x].dmPelsWidth < comp.dmPelsWidth ||
-				(*array)[x].dmPelsHeight < comp.dmPelsHeight)
-			{
-				match = true;
-				break;
-			}
-		}
-		if(!match) newcount++;
-	}
-	newarray = (DEVMODE*)realloc(newarray,sizeof(DEVMODE)*newcount);
-	free(*array);
-	*array = newarray;
-	*count = newcount;
-}
-
-
+/**
+  * Finds the smallest display mode with the same bits per pixel that is at
+  * least as large as the requested mode.
+  * @param in
+  *  Requested mode
+  * @return
+  *  The closest mode, or the requested mode if no mode is large enough.
+  */
 DEVMODE FindClosestMode(const DEVMODE in)
 {
 	DEVMODE newmode;
-	DEVMODE *candidates = (DEVMODE *)malloc(128*sizeof(DEVMODE));
-	DEVMODE mode;
-	ZeroMemory(&mode,sizeof(DEVMODE));
-	mode.dmSize = sizeof(DEVMODE);
-	DEVMODE *tmp = NULL;
-	DWORD modenum = 0;
-	DWORD modemax = 128;
-	while(EnumDisplaySettings(NULL,modenum++,&mode))
-	{
-		candidates[modenum-1] = mode;
-		if(modenum >= modemax)
-		{
-			modemax += 128;
-			tmp = (DEVMODE*)realloc(candidates,modemax*sizeof(DEVMODE));
-			if(tmp == NULL)
-			{
-				free(candidates);
-				return in;
-			}
-			candidates = tmp;
-		}
+	const DRIVERMODES *drivermodes = ModeIndex_GetDriverModes();
+	if (!drivermodes || !ModeIndex_FindClosest(drivermodes, &in, &newmode))
+	{
+		ModeIndex_ReleaseDriverModes();
+		return in;
 	}
-	DiscardDuplicateModes(&candidates,&modenum);
-	DiscardUndersizedModes(&candidates,&modenum,in);
-	qsort(candidates,modenum,sizeof(DEVMODE),(int(*)(const void*, const void*))SortRes);
-	newmode = candidates[0];
+	ModeIndex_ReleaseDriverModes();
 	newmode.dmFields = DM_BITSPERPEL| DM_PELSWIDTH | DM_PELSHEIGHT;
-	free(candidates);
 	return newmode;
 }
 
+/**
+  * Checks if the display driver reports a mode.
+  * @param mode
+  *  Mode to look up, the refresh rate is ignored if it is 0
+  * @return
+  *  TRUE if the driver has the mode, or if the mode list is unavailable.
+  */
+static BOOL IsDriverMode(const DEVMODE *mode)
+{
+	BOOL found;
+	const DRIVERMODES *drivermodes = ModeIndex_GetDriverModes();
+	if (!drivermodes) found = TRUE;
+	else if (mode->dmDisplayFrequency) found = ModeIndex_Find(&drivermodes->index, mode);
+	else found = ModeIndex_FindNoRefresh(&drivermodes->index, mode);
+	ModeIndex_ReleaseDriverModes();
+	return found;
+}
+
 int IsStretchedMode(DWORD width, DWORD height)
 {
 	if ((width == 320) || (width == 360))
@@ -2253,8 +2255,7 @@ HRESULT WINAPI glDirectDraw7_SetDisplayMode(glDirectDraw7 *This, DWORD dwWidth,
 	currmode.dmSize = sizeof(DEVMODE);
 	EnumDisplaySettings(NULL,ENUM_CURRENT_SETTINGS,&currmode);
 	This->currmode.dmSize = 0;
-	if (_isnan(dxglcfg.postsizex) || _isnan(dxglcfg.postsizey) ||
-		(dxglcfg.postsizex < 0.25f) || (dxglcfg.postsizey < 0.25f))
+	if (dxglpolicy.postsizeauto)
 	{
 		if (dwWidth <= 400) xscale = 2.0f;
 		else xscale = 1.0f;
@@ -2278,8 +2279,7 @@ HRESULT WINAPI glDirectDraw7_SetDisplayMode(glDirectDraw7 *This, DWORD dwWidth,
 		default:
 			newmode.dmSize = sizeof(DEVMODE);
 			newmode.dmDriverExtra = 0;
-			if (!dxglcfg.primaryscale || (_isnan(dxglcfg.postsizex) || _isnan(dxglcfg.postsizey) ||
-				(dxglcfg.postsizex < 0.25f) || (dxglcfg.postsizey < 0.25f)))
+			if (!dxglcfg.primaryscale || dxglpolicy.postsizeauto)
 			{
 				newmode.dmPelsWidth = (DWORD)(dwWidth * xscale);
 				newmode.dmPelsHeight = (DWORD)(dwHeight * yscale);
@@ -2476,7 +2476,8 @@ HRESULT WINAPI glDirectDraw7_SetDisplayMode(glDirectDraw7 *This, DWORD dwWidth,
 			flags = 0;
 			if (This->fullscreen) flags |= CDS_FULLSCREEN;
 			if (crop400) error = Try640400Mode(NULL, &newmode, flags, &crop400);
-			else error = SetVidMode(NULL, &newmode, flags);
+			else if (IsDriverMode(&newmode)) error = SetVidMode(NULL, &newmode, flags);
+			else error = DISP_CHANGE_BADMODE;
 			if (error != DISP_CHANGE_SUCCESSFUL)
 			{
 				newmode2 = FindClosestMode(newmode);
@@ -2782,12 +2783,30 @@ HRESULT WINAPI glDirectDraw7_WaitForVerticalBlank(glDirectDraw7 *This, DWORD dwF
 {
 	TRACE_ENTER(3,14,This,9,dwFlags,14,hEvent);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
-	if(dwFlags & DDWAITVB_BLOCKBEGINEVENT)
-		TRACE_RET(HRESULT,23,DDERR_UNSUPPORTED);
+	if(dwFlags == DDWAITVB_BLOCKBEGINEVENT)
+	{
+		if(!hEvent) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+		// Without a renderer the blocking waits return at once too
+		if(!This->renderer)
+		{
+			SetEvent(hEvent);
+			TRACE_EXIT(23,DD_OK);
+			return DD_OK;
+		}
+		HRESULT error = glRenderer_SignalVerticalBlank(This->renderer, hEvent);
+		TRACE_EXIT(23,error);
+		return error;
+	}
 	if(dwFlags & 0xFFFFFFFA) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
 	if(dwFlags == 5) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
+	if(This->renderer && glRenderer_WaitForVerticalBlank(This->renderer, (dwFlags & DDWAITVB_BLOCKEND) ? TRUE : FALSE, FALSE))
+	{
+		TRACE_EXIT(23,DD_OK);
+		return DD_OK;
+	}
+	// The first wait is folded into the swap interval of the next flip
 	if(!This->lastsync) This->lastsync = true;
-	else if(This->primary) dxglDirectDrawSurface7_RenderScreen(This->primary,This->primary->texture,1,NULL,TRUE,NULL,0);
+	else if(This->renderer) glRenderer_WaitForVerticalBlank(This->renderer, (dwFlags & DDWAITVB_BLOCKEND) ? TRUE : FALSE, TRUE);
 	TRACE_EXIT(23,DD_OK);
 	return DD_OK;
 }
@@ -2829,9 +2848,7 @@ HRESULT WINAPI glDirectDraw7_RestoreAllSurfaces(glDirectDraw7 *This)
 	TRACE_ENTER(1,14,This);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
 	for (int i = 0; i < This->surfacecount; i++)
-	{
-		if (This->surfaces[i]) dxglDirectDrawSurface7_Restore(This->surfaces[i]);
-	}
+		dxglDirectDrawSurface7_Restore(This->surfaces[i]);
 	return DD_OK;
 }
 HRESULT WINAPI glDirectDraw7_TestCooperativeLevel(glDirectDraw7 *This)
@@ -2886,9 +2903,17 @@ DWORD glDirectDraw7_GetBPPMultipleOf8(glDirectDraw7 *This)
 
 void glDirectDraw7_DeleteSurface(glDirectDraw7 *This, dxglDirectDrawSurface7 *surface)
 {
+	int slot = surface->surfaceslot;
 	TRACE_ENTER(2,14,This,14,surface);
-	for(int i = 0; i < This->surfacecount; i++)
-		if(This->surfaces[i] == surface) This->surfaces[i] = NULL;
+	// The last surface takes the place of the removed one
+	if (slot && (slot <= This->surfacecount) && (This->surfaces[slot - 1] == surface))
+	{
+		This->surfacecount--;
+		This->surfaces[slot - 1] = This->surfaces[This->surfacecount];
+		This->surfaces[slot - 1]->surfaceslot = slot;
+		This->surfaces[This->surfacecount] = NULL;
+	}
+	surface->surfaceslot = 0;
 	if (surface == This->primary)
 	{
 		This->primary = NULL;
@@ -2919,12 +2944,12 @@ HRESULT glDirectDraw7_SetupTempSurface(glDirectDraw7 *This, DWORD width, DWORD h
 		ddsd.dwWidth = width;
 		ddsd.dwHeight = height;
 		error = glDirectDraw7_CreateSurface2(This, &ddsd,
-			(LPDIRECTDRAWSURFACE7*)&This->tmpsurface, NULL, FALSE, 7);
+			(LPDIRECTDRAWSURFACE7*)&This->tmpsurface, NULL, FALSE, 7, NULL);
 		if (error == DDERR_OUTOFVIDEOMEMORY)
 		{
 			ddsd.ddsCaps.dwCaps = DDSCAPS_OFFSCREENPLAIN | DDSCAPS_SYSTEMMEMORY;
 			error = glDirectDraw7_CreateSurface2(This, &ddsd,
-				(LPDIRECTDRAWSURFACE7*)&This->tmpsurface, NULL, FALSE, 7);
+				(LPDIRECTDRAWSURFACE7*)&This->tmpsurface, NULL, FALSE, 7, NULL);
 		}
 		if (error != DD_OK) return error;
 	}
@@ -3069,7 +3094,7 @@ HRESULT WINAPI glDirectDraw1_CreateSurface(glDirectDraw1 *This, LPDDSURFACEDESC
 	ZeroMemory(&ddsd2, sizeof(DDSURFACEDESC2));
 	memcpy(&ddsd2, lpDDSurfaceDesc, sizeof(DDSURFACEDESC));
 	ddsd2.dwSize = sizeof(DDSURFACEDESC2);
-	HRESULT err = glDirectDraw7_CreateSurface2(This->glDD7,&ddsd2,&lpDDS7,pUnkOuter,TRUE,1);
+	HRESULT err = glDirectDraw7_CreateSurface2(This->glDD7,&ddsd2,&lpDDS7,pUnkOuter,TRUE,1,NULL);
 	if(err == DD_OK)
 	{
 		lpDDS7->QueryInterface(IID_IDirectDrawSurface,(LPVOID*) lplpDDSurface);
@@ -3088,14 +3113,14 @@ HRESULT WINAPI glDirectDraw1_DuplicateSurface(glDirectDraw1 *This, LPDIRECTDRAWS
 	if (!This) TRACE_RET(HRESULT, 23, DDERR_INVALIDOBJECT);
 	if (!lpDDSurface) TRACE_RET(HRESULT, 23, DDERR_INVALIDPARAMS);
 	if (!lplpDupDDSurface) TRACE_RET(HRESULT, 23, DDERR_INVALIDPARAMS);
-	DDSURFACEDESC ddsd;
-	HRESULT ret;
-	ZeroMemory(&ddsd, sizeof(DDSURFACEDESC));
-	ddsd.dwSize = sizeof(DDSURFACEDESC);
-	lpDDSurface->GetSurfaceDesc(&ddsd);
-	ret = glDirectDraw1_CreateSurface(This, &ddsd, lplpDupDDSurface, NULL);
-	if (ret != DD_OK) TRACE_RET(HRESULT, 23, ret);
-	ret = (*lplpDupDDSurface)->Blt(NULL, lpDDSurface, NULL, 0, NULL);
+	LPDIRECTDRAWSURFACE7 lpDDS7;
+	HRESULT ret = glDirectDraw7_DuplicateSurface2(This->glDD7, ((dxglDirectDrawSurface1*)lpDDSurface)->glDDS7, &lpDDS7, 1);
+	if (ret == DD_OK)
+	{
+		lpDDS7->QueryInterface(IID_IDirectDrawSurface, (LPVOID*)lplpDupDDSurface);
+		lpDDS7->Release();
+	}
+	else *lplpDupDDSurface = NULL;
 	TRACE_EXIT(23, ret);
 	return ret;
 }
@@ -3309,7 +3334,7 @@ HRESULT WINAPI glDirectDraw2_CreateSurface(glDirectDraw2 *This, LPDDSURFACEDESC
 	ZeroMemory(&ddsd2, sizeof(DDSURFACEDESC2));
 	memcpy(&ddsd2, lpDDSurfaceDesc, sizeof(DDSURFACEDESC));
 	ddsd2.dwSize = sizeof(DDSURFACEDESC2);
-	HRESULT err = glDirectDraw7_CreateSurface2(This->glDD7, &ddsd2, &lpDDS7, pUnkOuter, TRUE, 2);
+	HRESULT err = glDirectDraw7_CreateSurface2(This->glDD7, &ddsd2, &lpDDS7, pUnkOuter, TRUE, 2, NULL);
 	if(err == DD_OK)
 	{
 		lpDDS7->QueryInterface(IID_IDirectDrawSurface,(LPVOID*) lplpDDSurface);
@@ -3327,14 +3352,14 @@ HRESULT WINAPI glDirectDraw2_DuplicateSurface(glDirectDraw2 *This, LPDIRECTDRAWS
 	if (!This) TRACE_RET(HRESULT, 23, DDERR_INVALIDOBJECT);
 	if (!lpDDSurface) TRACE_RET(HRESULT, 23, DDERR_INVALIDPARAMS);
 	if (!lplpDupDDSurface) TRACE_RET(HRESULT, 23, DDERR_INVALIDPARAMS);
-	DDSURFACEDESC ddsd;
-	HRESULT ret;
-	ZeroMemory(&ddsd, sizeof(DDSURFACEDESC));
-	ddsd.dwSize = sizeof(DDSURFACEDESC);
-	lpDDSurface->GetSurfaceDesc(&ddsd);
-	ret = glDirectDraw2_CreateSurface(This, &ddsd, lplpDupDDSurface, NULL);
-	if (ret != DD_OK) TRACE_RET(HRESULT, 23, ret);
-	ret = (*lplpDupDDSurface)->Blt(NULL, lpDDSurface, NULL, 0, NULL);
+	LPDIRECTDRAWSURFACE7 lpDDS7;
+	HRESULT ret = glDirectDraw7_DuplicateSurface2(This->glDD7, ((dxglDirectDrawSurface1*)lpDDSurface)->glDDS7, &lpDDS7, 2);
+	if (ret == DD_OK)
+	{
+		lpDDS7->QueryInterface(IID_IDirectDrawSurface, (LPVOID*)lplpDupDDSurface);
+		lpDDS7->Release();
+	}
+	else *lplpDupDDSurface = NULL;
 	TRACE_EXIT(23, ret);
 	return ret;
 }
@@ -3577,7 +3602,7 @@ HRESULT WINAPI glDirectDraw4_CreateSurface(glDirectDraw4 *This, LPDDSURFACEDESC2
 	if(!lpDDSurfaceDesc) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
 	if(lpDDSurfaceDesc->dwSize < sizeof(DDSURFACEDESC2)) TRACE_RET(HRESULT,23,DDERR_INVALIDPARAMS);
 	LPDIRECTDRAWSURFACE7 lpDDS7;
-	HRESULT err = glDirectDraw7_CreateSurface2(This->glDD7,(LPDDSURFACEDESC2)lpDDSurfaceDesc,&lpDDS7,pUnkOuter,TRUE,4);
+	HRESULT err = glDirectDraw7_CreateSurface2(This->glDD7,(LPDDSURFACEDESC2)lpDDSurfaceDesc,&lpDDS7,pUnkOuter,TRUE,4,NULL);
 	if(err == DD_OK)
 	{
 		lpDDS7->QueryInterface(IID_IDirectDrawSurface4,(LPVOID*) lplpDDSurface);
@@ -3597,14 +3622,16 @@ HRESULT WINAPI glDirectDraw4_DuplicateSurface(glDirectDraw4 *This, LPDIRECTDRAWS
 	if (!This) TRACE_RET(HRESULT, 23, DDERR_INVALIDOBJECT);
 	if (!lpDDSurface) TRACE_RET(HRESULT, 23, DDERR_INVALIDPARAMS);
 	if (!lplpDupDDSurface) TRACE_RET(HRESULT, 23, DDERR_INVALIDPARAMS);
-	DDSURFACEDESC2 ddsd;
-	HRESULT ret;
-	ZeroMemory(&ddsd, sizeof(DDSURFACEDESC2));
-	ddsd.dwSize = sizeof(DDSURFACEDESC2);
-	lpDDSurface->GetSurfaceDesc(&ddsd);
-	ret = glDirectDraw4_CreateSurface(This, &ddsd, lplpDupDDSurface, NULL);
-	if (ret != DD_OK) TRACE_RET(HRESULT, 23, ret);
-	ret = (*lplpDupDDSurface)->Blt(NULL, lpDDSurface, NULL, 0, NULL);
+	LPDIRECTDRAWSURFACE7 lpDDS7;
+	HRESULT ret = glDirectDraw7_DuplicateSurface2(This->glDD7, ((dxglDirectDrawSurface4*)lpDDSurface)->glDDS7, &lpDDS7, 4);
+	if (ret == DD_OK)
+	{
+		lpDDS7->QueryInterface(IID_IDirectDrawSurface4, (LPVOID*)lplpDupDDSurface);
+		lpDDS7->Release();
+		glDirectDraw4_AddRef(This);
+		((dxglDirectDrawSurface7*)lpDDS7)->creator = (IUnknown*)This;
+	}
+	else *lplpDupDDSurface = NULL;
 	TRACE_EXIT(23, ret);
 	return ret;
 }
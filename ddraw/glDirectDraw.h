@@ -51,6 +51,7 @@ typedef struct glDirectDraw7
 	DWORD screenx, screeny, screenrefresh, screenbpp;
 	DWORD internalx, internaly, internalrefresh, internalbpp;
 	DWORD primaryx, primaryy, primaryrefresh, primarybpp;
+	DDGAMMARAMP gammaramp;  // Gamma ramp of the primary surface
 	dxglDirectDrawSurface7 *primary;
 	bool primarylost;
 	bool lastsync;
@@ -63,6 +64,11 @@ typedef struct glDirectDraw7
 	D3DDevice stored_devices[3];
 	D3DDEVICEDESC7 d3ddesc;
 	D3DDEVICEDESC d3ddesc3;
+	D3DDEVICEDESC7 enumdevices[3];  // Descriptions passed to the EnumDevices callback
+	DDPIXELFORMAT zbufferformats[6];  // Formats passed to the EnumZBufferFormats callback
+	DWORD zbufferformatcount;
+	glRenderer *enumrenderer;  // Renderer the enumeration tables were built with
+	bool enumbuilt;
 	DEVMODE currmode;
 	HRESULT error;
 	ULONG refcount7, refcount4, refcount2, refcount1;
@@ -73,7 +79,7 @@ typedef struct glDirectDraw7
 	bool threadsafe;
 	bool nowindowchanges;
 	LONG_PTR winstyle, winstyleex;
-	dxglDirectDrawSurface7 **surfaces;
+	dxglDirectDrawSurface7 **surfaces;  // Surfaces created by CreateSurface, without gaps in any order
 	int surfacecount, surfacecountmax;
 	glDirectDrawClipper **clippers;
 	int clippercount, clippercountmax;
@@ -86,6 +92,7 @@ typedef struct glDirectDraw7
 	DWORD timer;
 	bool devwnd;
 	DWORD cooplevel;
+	ADAPTER adapter;  // Monitor selected by the GUID the object was created with
 } glDirectDraw7;
 
 typedef struct glDirectDraw7Vtbl
@@ -169,7 +176,10 @@ ULONG WINAPI glDirectDraw7_AddRef2(glDirectDraw7 *This);
 ULONG WINAPI glDirectDraw7_Release2(glDirectDraw7 *This);
 ULONG WINAPI glDirectDraw7_AddRef1(glDirectDraw7 *This);
 ULONG WINAPI glDirectDraw7_Release1(glDirectDraw7 *This);
-HRESULT glDirectDraw7_CreateSurface2(glDirectDraw7 *This, LPDDSURFACEDESC2 lpDDSurfaceDesc2, LPDIRECTDRAWSURFACE7 FAR *lplpDDSurface, IUnknown FAR *pUnkOuter, BOOL RecordSurface, int version);
+HRESULT glDirectDraw7_CreateSurface2(glDirectDraw7 *This, LPDDSURFACEDESC2 lpDDSurfaceDesc2, LPDIRECTDRAWSURFACE7 FAR *lplpDDSurface, IUnknown FAR *pUnkOuter, BOOL RecordSurface, int version,
+	dxglDirectDrawSurface7 *shareowner);
+HRESULT glDirectDraw7_DuplicateSurface2(glDirectDraw7 *This, dxglDirectDrawSurface7 *src,
+	LPDIRECTDRAWSURFACE7 FAR *lplpDupDDSurface, int version);
 HRESULT glDirectDraw7_CreateClipper2(glDirectDraw7 *This, DWORD dwFlags, LPDIRECTDRAWCLIPPER FAR *lplpDDClipper, IUnknown FAR *pUnkOuter);
 HRESULT glDirectDraw7_CreatePalette2(glDirectDraw7 *This, DWORD dwFlags, LPPALETTEENTRY lpDDColorArray, LPDIRECTDRAWPALETTE FAR *lplpDDPalette, IUnknown FAR *pUnkOuter);
 void glDirectDraw7_RemoveSurface(glDirectDraw7 *This, dxglDirectDrawSurface7 *surface);
@@ -183,6 +193,7 @@ void glDirectDraw7_DeleteTempSurface(glDirectDraw7 *This);
 void glDirectDraw7_UnrestoreDisplayMode(glDirectDraw7 *This);
 void glDirectDraw7_SetWindowSize(glDirectDraw7 *glDD7, DWORD dwWidth, DWORD dwHeight);
 BOOL glDirectDraw7_GetFullscreen(glDirectDraw7 *glDD7);
+void glDirectDraw7_WindowChanged(glDirectDraw7 *glDD7);
 LONG Try640400Mode(LPCTSTR devname, DEVMODE *mode, DWORD flags, BOOL *crop400);
 
 struct glDirectDraw1Vtbl;
@@ -21,6 +21,7 @@
 #include "glDirectDraw.h"
 #include "glDirectDrawClipper.h"
 #include "glRenderer.h"
+#include "hooks.h"
 #pragma warning(disable: 4996)
 #include "ddraw.h"
 
@@ -58,6 +59,25 @@ static const DDSURFACEDESC2 ddsdclipper =
 	},
 	0,
 };
+/**
+  * Computes an FNV-1a hash of the current clip list.
+  * @param This
+  *  Pointer to glDirectDrawClipper object
+  * @return
+  *  Hash of the clip list rectangles
+  */
+static DWORD glDirectDrawClipper_HashClipList(glDirectDrawClipper *This)
+{
+	const BYTE *ptr;
+	size_t i;
+	DWORD hash = 2166136261U;
+	if (!This->clipsize) return hash;
+	ptr = (const BYTE*)This->cliplist->Buffer;
+	for (i = 0; i < This->clipsize * sizeof(RECT); i++)
+		hash = (hash ^ ptr[i]) * 16777619U;
+	return hash;
+}
+
 glDirectDrawClipperVtbl glDirectDrawClipper_iface =
 {
 	glDirectDrawClipper_QueryInterface,
@@ -149,22 +169,91 @@ ULONG WINAPI glDirectDrawClipper_Release(glDirectDrawClipper *This)
 	if (This->refcount == 0)
 	{
 		if (This->cliplist) free(This->cliplist);
+		if (This->wndclip) free(This->wndclip);
 		if (This->vertices) free(This->vertices);
 		if (This->indices) free(This->indices);
 		if (This->glDD7) glDirectDraw7_DeleteClipper(This->glDD7, This);
 		if (This->creator) This->creator->Release();
-		if (This->texture.initialized) glTexture_Release(&This->texture, FALSE);
+		for (int i = 0; i < CLIPPER_STENCILCACHE; i++)
+		{
+			if (This->stencils[i].texture) glTexture_Release(This->stencils[i].texture, FALSE);
+			if (This->stencils[i].rects) free(This->stencils[i].rects);
+		}
 		if (This->glDD7) glRenderer_FreePointer(This->glDD7->renderer, This);
 	};
 	TRACE_EXIT(8,ret);
 	return ret;
 }
 
-HRESULT WINAPI glDirectDrawClipper_GetClipList(glDirectDrawClipper *This, LPRECT lpRect, LPRGNDATA lpClipList, LPDWORD lpdwSize)
+/**
+  * Reads the visible region of the clipper's window from the system, unless
+  * the copy read last time is still current.  The copy is kept until a
+  * hooked window moves, changes size or Z order, the application is
+  * activated or deactivated, the foreground window changes or the window
+  * rectangle changes.  Sets cliplistchanged if the region is different.
+  * @param This
+  *  Pointer to glDirectDrawClipper object with a window
+  * @return
+  *  DD_OK if This->wndclip holds the clip list of the window
+  */
+static HRESULT glDirectDrawClipper_UpdateWindowClip(glDirectDrawClipper *This)
 {
 	int error;
 	POINT origin;
 	HDC hdc;
+	HRGN rgncliplist;
+	RGNDATA *rgn;
+	DWORD rgnsize;
+	LONG serial = GetWindowClipSerial();
+	HWND foreground = GetForegroundWindow();
+	RECT wndrect;
+	GetWindowRect(This->hWnd, &wndrect);
+	if (This->wndclip && (serial == This->wndclipserial) && (foreground == This->wndclipforeground) &&
+		EqualRect(&wndrect, &This->wndcliprect)) return DD_OK;
+	hdc = GetDC(This->hWnd);
+	if (!hdc) return DDERR_GENERIC;
+	rgncliplist = CreateRectRgn(0, 0, 0, 0);
+	if (!rgncliplist)
+	{
+		ReleaseDC(This->hWnd, hdc);
+		return DDERR_GENERIC;
+	}
+	error = GetRandomRgn(hdc, rgncliplist, SYSRGN);
+	if (error == -1)
+	{
+		DeleteObject(rgncliplist);
+		ReleaseDC(This->hWnd, hdc);
+		return DDERR_GENERIC;
+	}
+	if (GetVersion() & 0x80000000)
+	{
+		GetDCOrgEx(hdc, &origin);
+		OffsetRgn(rgncliplist, origin.x, origin.y);
+	}
+	ReleaseDC(This->hWnd, hdc);
+	rgnsize = GetRegionData(rgncliplist, 0, NULL);
+	rgn = (RGNDATA*)malloc(rgnsize);
+	if (!rgn)
+	{
+		DeleteObject(rgncliplist);
+		return DDERR_OUTOFMEMORY;
+	}
+	GetRegionData(rgncliplist, rgnsize, rgn);
+	DeleteObject(rgncliplist);
+	if (!This->wndclip || (This->wndclip->rdh.nCount != rgn->rdh.nCount) ||
+		memcmp(This->wndclip->Buffer, rgn->Buffer, rgn->rdh.nCount * sizeof(RECT)))
+		This->cliplistchanged = TRUE;
+	if (This->wndclip) free(This->wndclip);
+	This->wndclip = rgn;
+	This->wndclipserial = serial;
+	This->wndclipforeground = foreground;
+	This->wndcliprect = wndrect;
+	return DD_OK;
+}
+
+HRESULT WINAPI glDirectDrawClipper_GetClipList(glDirectDrawClipper *This, LPRECT lpRect, LPRGNDATA lpClipList, LPDWORD lpdwSize)
+{
+	HRESULT error;
 	HRGN rgnrect;
 	HRGN rgncliplist;
 	RGNDATA *rgn;
@@ -175,30 +264,14 @@ HRESULT WINAPI glDirectDrawClipper_GetClipList(glDirectDrawClipper *This, LPRECT
 	if (!This->clipsize || This->hWnd)
 	{
 		if (!This->hWnd) TRACE_RET(HRESULT, 23, DDERR_NOCLIPLIST);
-		hdc = GetDC(This->hWnd);
-		if (!hdc) TRACE_RET(HRESULT, 23, DDERR_GENERIC);
-		rgncliplist = CreateRectRgn(0, 0, 0, 0);
-		if (!rgncliplist)
-		{
-			ReleaseDC(This->hWnd, hdc);
-			TRACE_RET(HRESULT, 23, DDERR_GENERIC);
-		}
-		error = GetRandomRgn(hdc, rgncliplist, SYSRGN);
-		if (error == -1)
-		{
-			DeleteObject(rgncliplist);
-			ReleaseDC(This->hWnd, hdc);
-			TRACE_RET(HRESULT, 23, DDERR_GENERIC);
-		}
-		if (GetVersion() & 0x80000000)
-		{
-			GetDCOrgEx(hdc, &origin);
-			OffsetRgn(rgncliplist, origin.x, origin.y);
-		}
-		ReleaseDC(This->hWnd, hdc);
+		error = glDirectDrawClipper_UpdateWindowClip(This);
+		if (FAILED(error)) TRACE_RET(HRESULT, 23, error);
+		rgn = This->wndclip;
 		if (lpRect)
 		{
 			rgnrect = CreateRectRgnIndirect(lpRect);
+			rgncliplist = ExtCreateRegion(NULL, sizeof(RGNDATAHEADER) + (This->wndclip->rdh.nCount*sizeof(RECT)),
+				This->wndclip);
 			if (CombineRgn(rgncliplist, rgnrect, rgncliplist, RGN_AND) == ERROR)
 			{
 				DeleteObject(rgnrect);
@@ -206,20 +279,20 @@ HRESULT WINAPI glDirectDrawClipper_GetClipList(glDirectDrawClipper *This, LPRECT
 				TRACE_RET(HRESULT, 23, DDERR_GENERIC);
 			}
 			DeleteObject(rgnrect);
-		}
-		rgnsize = GetRegionData(rgncliplist, 0, NULL);
-		rgn = (RGNDATA*)malloc(rgnsize);
-		if (!rgn)
-		{
+			rgnsize = GetRegionData(rgncliplist, 0, NULL);
+			rgn = (RGNDATA*)malloc(rgnsize);
+			if (!rgn)
+			{
+				DeleteObject(rgncliplist);
+				TRACE_RET(HRESULT, 23, DDERR_OUTOFMEMORY);
+			}
+			GetRegionData(rgncliplist, rgnsize, rgn);
 			DeleteObject(rgncliplist);
-			TRACE_RET(HRESULT, 23, DDERR_OUTOFMEMORY);
 		}
-		GetRegionData(rgncliplist, rgnsize, rgn);
 		if (!lpClipList)
 		{
 			*lpdwSize = sizeof(RGNDATAHEADER) + (rgn->rdh.nCount*sizeof(RECT));
-			free(rgn);
-			DeleteObject(rgncliplist);
+			if (rgn != This->wndclip) free(rgn);
 			TRACE_EXIT(23, DD_OK);
 			return DD_OK;
 		}
@@ -227,8 +300,7 @@ HRESULT WINAPI glDirectDrawClipper_GetClipList(glDirectDrawClipper *This, LPRECT
 		{
 			if (*lpdwSize < (sizeof(RGNDATAHEADER) + (rgn->rdh.nCount*sizeof(RECT))))
 			{
-				free(rgn);
-				DeleteObject(rgncliplist);
+				if (rgn != This->wndclip) free(rgn);
 				TRACE_RET(HRESULT, 23, DDERR_REGIONTOOSMALL);
 			}
 			*lpdwSize = sizeof(RGNDATAHEADER) + (rgn->rdh.nCount*sizeof(RECT));
@@ -241,13 +313,11 @@ HRESULT WINAPI glDirectDrawClipper_GetClipList(glDirectDrawClipper *This, LPRECT
 			}
 			__except (GetExceptionCode() == STATUS_ACCESS_VIOLATION)
 			{
-				free(rgn);
-				DeleteObject(rgncliplist);
+				if (rgn != This->wndclip) free(rgn);
 				TRACE_RET(HRESULT, 23, DDERR_INVALIDCLIPLIST);
 			}
 #endif
-			free(rgn);
-			DeleteObject(rgncliplist);
+			if (rgn != This->wndclip) free(rgn);
 			TRACE_EXIT(23, DD_OK);
 			return DD_OK;
 		}
@@ -392,24 +462,18 @@ HRESULT WINAPI glDirectDrawClipper_Initialize(glDirectDrawClipper *This, LPDIREC
 	This->maxsize = This->clipsize = 0;
 	This->refcount = 1;
 	This->initialized = true;
-	This->dirty = true;
+	This->cliphash = 0;
 	This->cliplistchanged = TRUE;
 	TRACE_EXIT(23,DD_OK);
 	return DD_OK;
 }
 HRESULT WINAPI glDirectDrawClipper_IsClipListChanged(glDirectDrawClipper *This, BOOL FAR *lpbChanged)
 {
-	WINDOWPLACEMENT newpos;
 	TRACE_ENTER(2,14,This,14,lpbChanged);
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
 	if (!lpbChanged) TRACE_RET(HRESULT, 23, DDERR_INVALIDPARAMS);
-	newpos.length = sizeof(WINDOWPLACEMENT);
-	if (This->hWnd) GetWindowPlacement(This->hWnd, &newpos);
-	if (memcmp(&This->lastpos, &newpos, sizeof(WINDOWPLACEMENT)))
-	{
-		This->cliplistchanged = TRUE;
-		memcpy(&This->lastpos, &newpos, sizeof(WINDOWPLACEMENT));
-	}
+	// Only reports a change if the visible region of the window is different
+	if (This->hWnd) glDirectDrawClipper_UpdateWindowClip(This);
 	*lpbChanged = This->cliplistchanged;
 	This->cliplistchanged = FALSE;
 	TRACE_EXIT(23, DD_OK);
@@ -494,7 +558,7 @@ HRESULT WINAPI glDirectDrawClipper_SetClipList(glDirectDrawClipper *This, LPRGND
 		}
 	}
 	else This->clipsize = 0;
-	This->dirty = true;
+	This->cliphash = glDirectDrawClipper_HashClipList(This);
 	This->cliplistchanged = TRUE;
 	TRACE_EXIT(23,DD_OK);
 	return DD_OK;
@@ -505,21 +569,125 @@ HRESULT WINAPI glDirectDrawClipper_SetHWnd(glDirectDrawClipper *This, DWORD dwFl
 	if(!This) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
 	if (dwFlags) TRACE_RET(HRESULT, 23, DDERR_INVALIDPARAMS);
 	This->hWnd = hWnd;
-	This->lastpos.length = sizeof(WINDOWPLACEMENT);
-	GetWindowPlacement(hWnd, &This->lastpos);
+	if (This->wndclip) free(This->wndclip);
+	This->wndclip = NULL;
 	This->cliplistchanged = TRUE;
 	TRACE_EXIT(23,DD_OK);
 	return DD_OK;
 }
 
-void glDirectDrawClipper_CreateTexture(glDirectDrawClipper *This, glTexture *texture, glRenderer *renderer)
+/**
+  * Gets the clip list as scissor rectangles clamped to a surface, if it has
+  * few enough rectangles that drawing once per rectangle is cheaper than
+  * sampling a stencil.
+  * @param This
+  *  Pointer to glDirectDrawClipper object
+  * @param width
+  *  Width of the surface to clip
+  * @param height
+  *  Height of the surface to clip
+  * @param rects
+  *  Array of BLTCLIP_MAXRECTS rectangles to receive the scissor rectangles
+  * @param count
+  *  Receives the number of rectangles that are not empty on the surface
+  * @return
+  *  FALSE if the clip list has to be applied with a stencil
+  */
+BOOL glDirectDrawClipper_GetScissorRects(glDirectDrawClipper *This, DWORD width, DWORD height, RECT *rects, DWORD *count)
+{
+	RECT *buffer = (RECT*)This->cliplist->Buffer;
+	RECT surface = { 0, 0, (LONG)width, (LONG)height };
+	RECT overlap;
+	DWORD i, j;
+	if (This->clipsize > BLTCLIP_MAXRECTS) return FALSE;
+	// Overlapping rectangles would draw some pixels twice
+	for (i = 0; i < This->clipsize; i++)
+	{
+		for (j = i + 1; j < This->clipsize; j++)
+			if (IntersectRect(&overlap, &buffer[i], &buffer[j])) return FALSE;
+	}
+	*count = 0;
+	for (i = 0; i < This->clipsize; i++)
+	{
+		if (IntersectRect(&rects[*count], &buffer[i], &surface)) (*count)++;
+	}
+	return TRUE;
+}
+
+/**
+  * Gets a stencil texture containing the current clip list for a surface.
+  * The clipper keeps the last CLIPPER_STENCILCACHE stencils it has drawn,
+  * so switching between clip lists or surface sizes only draws a stencil
+  * the first time a combination is used.
+  * @param This
+  *  Pointer to glDirectDrawClipper object
+  * @param width
+  *  Width of the surface to clip
+  * @param height
+  *  Height of the surface to clip
+  * @param renderer
+  *  Renderer to draw the stencil with
+  * @return
+  *  Stencil texture for the surface, or NULL if out of memory
+  */
+glTexture *glDirectDrawClipper_GetStencil(glDirectDrawClipper *This, DWORD width, DWORD height, glRenderer *renderer)
 {
 	DDSURFACEDESC2 ddsd;
-	ZeroMemory(&ddsd, sizeof(DDSURFACEDESC2));
-	memcpy(&ddsd, &ddsdclipper, sizeof(DDSURFACEDESC2));
-	ddsd.dwWidth = texture->levels[0].ddsd.dwWidth;
-	ddsd.lPitch = NextMultipleOf4(ddsd.dwWidth * 2);
-	ddsd.dwHeight = texture->levels[0].ddsd.dwHeight;
-	glTexture_Create(&ddsd, &This->texture, renderer, FALSE, 0);
-	This->texture.freeonrelease = FALSE;
-}
\ No newline at end of file
+	ClipStencil *entry = NULL;
+	RECT *rects;
+	int i;
+	This->usecount++;
+	for (i = 0; i < CLIPPER_STENCILCACHE; i++)
+	{
+		if (!This->stencils[i].texture) continue;
+		if ((This->stencils[i].hash == This->cliphash) && (This->stencils[i].count == This->clipsize) &&
+			(This->stencils[i].width == width) && (This->stencils[i].height == height) &&
+			!memcmp(This->stencils[i].rects, This->cliplist->Buffer, This->clipsize * sizeof(RECT)))
+		{
+			This->stencils[i].lastused = This->usecount;
+			return This->stencils[i].texture;
+		}
+	}
+	// Use an empty slot, or replace the least recently used stencil
+	for (i = 0; i < CLIPPER_STENCILCACHE; i++)
+	{
+		if (!This->stencils[i].texture)
+		{
+			entry = &This->stencils[i];
+			break;
+		}
+		if (!entry || (This->stencils[i].lastused < entry->lastused)) entry = &This->stencils[i];
+	}
+	if (entry->count != This->clipsize)
+	{
+		rects = (RECT*)realloc(entry->rects, This->clipsize * sizeof(RECT));
+		if (!rects) return NULL;
+		entry->rects = rects;
+	}
+	if (!entry->texture)
+	{
+		entry->texture = (glTexture*)malloc(sizeof(glTexture));
+		if (!entry->texture) return NULL;
+		ZeroMemory(&ddsd, sizeof(DDSURFACEDESC2));
+		memcpy(&ddsd, &ddsdclipper, sizeof(DDSURFACEDESC2));
+		ddsd.dwWidth = width;
+		ddsd.lPitch = NextMultipleOf4(ddsd.dwWidth * 2);
+		ddsd.dwHeight = height;
+		if (FAILED(glTexture_Create(&ddsd, entry->texture, renderer, FALSE, 0)))
+		{
+			free(entry->texture);
+			entry->texture = NULL;
+			return NULL;
+		}
+		entry->texture->freeonrelease = TRUE;
+	}
+	memcpy(entry->rects, This->cliplist->Buffer, This->clipsize * sizeof(RECT));
+	entry->count = This->clipsize;
+	entry->hash = This->cliphash;
+	entry->width = width;
+	entry->height = height;
+	entry->lastused = This->usecount;
+	glRenderer_UpdateClipper(renderer, entry->texture, This->indices, This->vertices,
+		This->clipsize, width, height);
+	return entry->texture;
+}
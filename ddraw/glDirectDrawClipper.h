@@ -23,6 +23,19 @@ struct glDirectDraw7;
 
 struct glDirectDrawClipperVtbl;
 
+#define CLIPPER_STENCILCACHE 4
+
+typedef struct ClipStencil
+{
+	glTexture *texture;  // Stencil texture, NULL if the slot is unused
+	RECT *rects;  // Clip list drawn into the texture
+	DWORD count;  // Number of rectangles in rects
+	DWORD hash;  // Hash of rects
+	DWORD width;
+	DWORD height;
+	DWORD lastused;  // Value of usecount when the stencil was last used
+} ClipStencil;
+
 typedef struct glDirectDrawClipper
 {
 	struct glDirectDrawClipperVtbl *lpVtbl;
@@ -37,11 +50,15 @@ typedef struct glDirectDrawClipper
 	size_t clipsize;
 	size_t maxsize;
 	bool hascliplist;
-	bool dirty;
 	IUnknown *creator;
-	glTexture texture;
 	BOOL cliplistchanged;
-	WINDOWPLACEMENT lastpos;
+	RGNDATA *wndclip;  // Visible region of hWnd read from the system, NULL if not read yet
+	LONG wndclipserial;  // GetWindowClipSerial when wndclip was read
+	HWND wndclipforeground;  // Foreground window when wndclip was read
+	RECT wndcliprect;  // Rectangle of hWnd when wndclip was read
+	DWORD cliphash;  // Hash of the current clip list
+	ClipStencil stencils[CLIPPER_STENCILCACHE];  // Recently drawn stencils of this clipper
+	DWORD usecount;
 } glDirectDrawClipper;
 
 typedef struct glDirectDrawClipperVtbl
@@ -70,5 +87,6 @@ HRESULT WINAPI glDirectDrawClipper_Initialize(glDirectDrawClipper *This, LPDIREC
 HRESULT WINAPI glDirectDrawClipper_IsClipListChanged(glDirectDrawClipper *This, BOOL FAR *lpbChanged);
 HRESULT WINAPI glDirectDrawClipper_SetClipList(glDirectDrawClipper *This, LPRGNDATA lpClipList, DWORD dwFlags);
 HRESULT WINAPI glDirectDrawClipper_SetHWnd(glDirectDrawClipper *This, DWORD dwFlags, HWND hWnd);
-void glDirectDrawClipper_CreateTexture(glDirectDrawClipper *This, glTexture *texture, glRenderer *renderer);
+BOOL glDirectDrawClipper_GetScissorRects(glDirectDrawClipper *This, DWORD width, DWORD height, RECT *rects, DWORD *count);
+glTexture *glDirectDrawClipper_GetStencil(glDirectDrawClipper *This, DWORD width, DWORD height, glRenderer *renderer);
 #endif //_GLDIRECTDRAWCLIPPER_H
@@ -24,7 +24,7 @@
 #include "timer.h"
 
 extern DXGLCFG dxglcfg;
-void glDirectDrawSurface7_RenderScreen2(LPDIRECTDRAWSURFACE7 surface, int vsync, BOOL settime, OVERLAY *overlays, int overlaycount);
+void glDirectDrawSurface7_SchedulePalette(LPDIRECTDRAWSURFACE7 surface, int vsync);
 
 static const DDSURFACEDESC2 ddsd256pal =
 {
@@ -226,7 +226,7 @@ HRESULT WINAPI glDirectDrawPalette_SetEntries(glDirectDrawPalette *This, DWORD d
 {
 	DWORD allentries = 256;
 	DWORD entrysize;
-	DDSURFACEDESC2 ddsd;
+	DWORD first, last;
 	TRACE_ENTER(5, 14, This, 9, dwFlags, 8, dwStartingEntry, 8, dwCount, 14, lpEntries);
 	if (dwFlags) TRACE_RET(HRESULT, 23, DDERR_INVALIDPARAMS);
 	if (!IsReadablePointer(This, sizeof(glDirectDrawPalette))) TRACE_RET(HRESULT,23,DDERR_INVALIDOBJECT);
@@ -249,9 +249,20 @@ HRESULT WINAPI glDirectDrawPalette_SetEntries(glDirectDrawPalette *This, DWORD d
 	}
 	if (This->texture.initialized)
 	{
-		glTexture_Lock(&This->texture, 0, NULL, &ddsd, 0, FALSE);
-		memcpy(ddsd.lpSurface, This->palette, 4 * This->palsize);
-		glTexture_Unlock(&This->texture, 0, NULL, FALSE);
+		if (entrysize == 1)
+		{
+			// Update the whole texture entries holding the changed bytes
+			first = dwStartingEntry / 4;
+			last = (dwStartingEntry + dwCount + 3) / 4;
+		}
+		else
+		{
+			first = dwStartingEntry;
+			last = dwStartingEntry + dwCount;
+		}
+		if (last > This->palsize) last = This->palsize;
+		if (last > first) glRenderer_UpdatePalette(This->texture.renderer, &This->texture,
+			first, last - first, (const DWORD*)&This->palette[first]);
 	}
 	if ((This->flags & DDPCAPS_PRIMARYSURFACE) && (This->surface))
 	{
@@ -260,7 +271,7 @@ HRESULT WINAPI glDirectDrawPalette_SetEntries(glDirectDrawPalette *This, DWORD d
 			if (This->timer)
 			{
 				if (DXGLTimer_CheckLastDraw(This->timer, dxglcfg.HackPaletteDelay))
-					glDirectDrawSurface7_RenderScreen2(This->surface, dxglcfg.HackPaletteVsync, FALSE, NULL, 0);
+					glDirectDrawSurface7_SchedulePalette(This->surface, dxglcfg.HackPaletteVsync);
 			}
 		}
 	}
@@ -34,6 +34,8 @@ void glExtensions_Init(glExtensions *ext)
 {
 	const GLubyte *glversion;
 	const GLubyte *glextensions;
+	const char *wglextensions = NULL;
+	const char *extstr;
 	BOOL broken_fbo;
 	BOOL broken_texrect;
 	ZeroMemory(ext, sizeof(glExtensions));
@@ -159,9 +161,90 @@ Please contact your graphics card manufacturer for an updated driver.\r\n\r\nThi
 		|| ((ext->glver_major >= 3) && (ext->glver_minor >= 3))) && !dxglcfg.DebugNoSamplerObjects)
 		ext->GLEXT_ARB_sampler_objects = 1;
 	else ext->GLEXT_ARB_sampler_objects = 0;
+	if (strstr((char*)glextensions, "GL_EXT_texture_filter_anisotropic")
+		|| strstr((char*)glextensions, "GL_ARB_texture_filter_anisotropic"))
+		ext->GLEXT_EXT_texture_filter_anisotropic = 1;
+	else ext->GLEXT_EXT_texture_filter_anisotropic = 0;
 	if(strstr((char*)glextensions,"GL_EXT_gpu_shader4") && !dxglcfg.DebugNoGpuShader4)
 		ext->GLEXT_EXT_gpu_shader4 = 1;
 	else ext->GLEXT_EXT_gpu_shader4 = 0;
+	// Don't mistake GL_EXT_shader_framebuffer_fetch_non_coherent for the coherent extension
+	extstr = strstr((char*)glextensions, "GL_EXT_shader_framebuffer_fetch");
+	if (extstr && ((extstr[31] == ' ') || !extstr[31]))
+		ext->GLEXT_EXT_shader_framebuffer_fetch = 1;
+	else ext->GLEXT_EXT_shader_framebuffer_fetch = 0;
+	if (strstr((char*)glextensions, "GL_ARB_map_buffer_range") || (ext->glver_major >= 3))
+		ext->GLEXT_ARB_map_buffer_range = 1;
+	else ext->GLEXT_ARB_map_buffer_range = 0;
+	if (strstr((char*)glextensions, "GL_ARB_buffer_storage") || (ext->glver_major >= 5)
+		|| ((ext->glver_major >= 4) && (ext->glver_minor >= 4)))
+		ext->GLEXT_ARB_buffer_storage = 1;
+	else ext->GLEXT_ARB_buffer_storage = 0;
+	if (strstr((char*)glextensions, "GL_ARB_sync") || (ext->glver_major >= 4)
+		|| ((ext->glver_major >= 3) && (ext->glver_minor >= 2)))
+		ext->GLEXT_ARB_sync = 1;
+	else ext->GLEXT_ARB_sync = 0;
+	if (strstr((char*)glextensions, "GL_ARB_get_program_binary") || (ext->glver_major >= 5)
+		|| ((ext->glver_major >= 4) && (ext->glver_minor >= 1)))
+		ext->GLEXT_ARB_get_program_binary = 1;
+	else ext->GLEXT_ARB_get_program_binary = 0;
+	if (strstr((char*)glextensions, "GL_ARB_vertex_array_object") || (ext->glver_major >= 3))
+		ext->GLEXT_ARB_vertex_array_object = 1;
+	else ext->GLEXT_ARB_vertex_array_object = 0;
+	if (strstr((char*)glextensions, "GL_ARB_texture_storage") || (ext->glver_major >= 5)
+		|| ((ext->glver_major >= 4) && (ext->glver_minor >= 2)))
+		ext->GLEXT_ARB_texture_storage = 1;
+	else ext->GLEXT_ARB_texture_storage = 0;
+	if (strstr((char*)glextensions, "GL_ARB_texture_view") || (ext->glver_major >= 5)
+		|| ((ext->glver_major >= 4) && (ext->glver_minor >= 3)))
+		ext->GLEXT_ARB_texture_view = 1;
+	else ext->GLEXT_ARB_texture_view = 0;
+	if (strstr((char*)glextensions, "GL_ARB_copy_image") || (ext->glver_major >= 5)
+		|| ((ext->glver_major >= 4) && (ext->glver_minor >= 3)))
+		ext->GLEXT_ARB_copy_image = 1;
+	else ext->GLEXT_ARB_copy_image = 0;
+	if (strstr((char*)glextensions, "GL_ARB_invalidate_subdata") || (ext->glver_major >= 5)
+		|| ((ext->glver_major >= 4) && (ext->glver_minor >= 3)))
+		ext->GLEXT_ARB_invalidate_subdata = 1;
+	else ext->GLEXT_ARB_invalidate_subdata = 0;
+	if (strstr((char*)glextensions, "GL_ARB_timer_query") || (ext->glver_major >= 4)
+		|| ((ext->glver_major >= 3) && (ext->glver_minor >= 3)))
+		ext->GLEXT_ARB_timer_query = 1;
+	else ext->GLEXT_ARB_timer_query = 0;
+	if ((ext->glver_major >= 4) || ((ext->glver_major >= 3) && (ext->glver_minor >= 1)))
+		ext->GLEXT_ARB_uniform_buffer_object = 1;
+	else ext->GLEXT_ARB_uniform_buffer_object = 0;
+	if (strstr((char*)glextensions, "GL_ARB_draw_elements_base_vertex") || (ext->glver_major >= 4)
+		|| ((ext->glver_major >= 3) && (ext->glver_minor >= 2)))
+		ext->GLEXT_ARB_draw_elements_base_vertex = 1;
+	else ext->GLEXT_ARB_draw_elements_base_vertex = 0;
+	if (strstr((char*)glextensions, "GL_ARB_instanced_arrays") || (ext->glver_major >= 4)
+		|| ((ext->glver_major >= 3) && (ext->glver_minor >= 3)))
+		ext->GLEXT_ARB_instanced_arrays = 1;
+	else ext->GLEXT_ARB_instanced_arrays = 0;
+	if (strstr((char*)glextensions, "GL_ARB_ES3_compatibility") || (ext->glver_major >= 5)
+		|| ((ext->glver_major >= 4) && (ext->glver_minor >= 3)))
+		ext->GLEXT_ARB_ES3_compatibility = 1;
+	else ext->GLEXT_ARB_ES3_compatibility = 0;
+	if (strstr((char*)glextensions, "GL_EXT_texture_compression_s3tc"))
+		ext->GLEXT_EXT_texture_compression_s3tc = 1;
+	else ext->GLEXT_EXT_texture_compression_s3tc = 0;
+	if (strstr((char*)glextensions, "GL_KHR_parallel_shader_compile"))
+		ext->GLEXT_KHR_parallel_shader_compile = 1;
+	else ext->GLEXT_KHR_parallel_shader_compile = 0;
+	if (strstr((char*)glextensions, "GL_ARB_multi_draw_indirect") || (ext->glver_major >= 5)
+		|| ((ext->glver_major >= 4) && (ext->glver_minor >= 3)))
+		ext->GLEXT_ARB_multi_draw_indirect = 1;
+	else ext->GLEXT_ARB_multi_draw_indirect = 0;
+	if (strstr((char*)glextensions, "GL_ARB_shader_draw_parameters") || (ext->glver_major >= 5)
+		|| ((ext->glver_major >= 4) && (ext->glver_minor >= 6)))
+		ext->GLEXT_ARB_shader_draw_parameters = 1;
+	else ext->GLEXT_ARB_shader_draw_parameters = 0;
+	// Handles are made from sampler objects and the extension needs GLSL 4.00
+	if (strstr((char*)glextensions, "GL_ARB_bindless_texture") && ext->GLEXT_ARB_sampler_objects
+		&& (ext->glver_major >= 4) && dxglcfg.BindlessTextures)
+		ext->GLEXT_ARB_bindless_texture = 1;
+	else ext->GLEXT_ARB_bindless_texture = 0;
 	broken_fbo = TRUE;
 	if(ext->GLEXT_ARB_framebuffer_object)
 	{
@@ -170,9 +253,15 @@ Please contact your graphics card manufacturer for an updated driver.\r\n\r\nThi
 		ext->glBindFramebuffer = (PFNGLBINDFRAMEBUFFERPROC)wglGetProcAddress("glBindFramebuffer");
 		ext->glGenRenderbuffers = (PFNGLGENRENDERBUFFERSPROC)wglGetProcAddress("glGenRenderbuffers");
 		ext->glBindRenderbuffer = (PFNGLBINDRENDERBUFFERPROC)wglGetProcAddress("glBindRenderbuffer");
+		ext->glDeleteRenderbuffers = (PFNGLDELETERENDERBUFFERSPROC)wglGetProcAddress("glDeleteRenderbuffers");
+		ext->glRenderbufferStorageMultisample =
+			(PFNGLRENDERBUFFERSTORAGEMULTISAMPLEPROC)wglGetProcAddress("glRenderbufferStorageMultisample");
+		ext->glFramebufferRenderbuffer = (PFNGLFRAMEBUFFERRENDERBUFFERPROC)wglGetProcAddress("glFramebufferRenderbuffer");
 		ext->glFramebufferTexture2D = (PFNGLFRAMEBUFFERTEXTURE2DPROC)wglGetProcAddress("glFramebufferTexture2D");
 		ext->glCheckFramebufferStatus = (PFNGLCHECKFRAMEBUFFERSTATUSPROC)wglGetProcAddress("glCheckFramebufferStatus");
 		ext->glDeleteFramebuffers = (PFNGLDELETEFRAMEBUFFERSPROC)wglGetProcAddress("glDeleteFramebuffers");
+		ext->glGenerateMipmap = (PFNGLGENERATEMIPMAPPROC)wglGetProcAddress("glGenerateMipmap");
+		ext->glBlitFramebuffer = (PFNGLBLITFRAMEBUFFERPROC)wglGetProcAddress("glBlitFramebuffer");
 		broken_fbo = FALSE;
 	}
 	broken_texrect = TRUE;
@@ -201,6 +290,15 @@ Please contact your graphics card manufacturer for an updated driver.\r\n\r\nThi
 		ext->glNamedBufferData = (PFNGLNAMEDBUFFERDATAPROC)wglGetProcAddress("glNamedBufferData");
 		ext->glMapNamedBuffer = (PFNGLMAPNAMEDBUFFERPROC)wglGetProcAddress("glMapNamedBuffer");
 		ext->glUnmapNamedBuffer = (PFNGLUNMAPNAMEDBUFFERPROC)wglGetProcAddress("glUnmapNamedBuffer");
+		ext->glCreateBuffers = (PFNGLCREATEBUFFERSPROC)wglGetProcAddress("glCreateBuffers");
+		ext->glNamedBufferStorage = (PFNGLNAMEDBUFFERSTORAGEPROC)wglGetProcAddress("glNamedBufferStorage");
+		ext->glMapNamedBufferRange = (PFNGLMAPNAMEDBUFFERRANGEPROC)wglGetProcAddress("glMapNamedBufferRange");
+		ext->glCreateVertexArrays = (PFNGLCREATEVERTEXARRAYSPROC)wglGetProcAddress("glCreateVertexArrays");
+		ext->glEnableVertexArrayAttrib = (PFNGLENABLEVERTEXARRAYATTRIBPROC)wglGetProcAddress("glEnableVertexArrayAttrib");
+		ext->glVertexArrayAttribFormat = (PFNGLVERTEXARRAYATTRIBFORMATPROC)wglGetProcAddress("glVertexArrayAttribFormat");
+		ext->glVertexArrayAttribBinding = (PFNGLVERTEXARRAYATTRIBBINDINGPROC)wglGetProcAddress("glVertexArrayAttribBinding");
+		ext->glVertexArrayVertexBuffer = (PFNGLVERTEXARRAYVERTEXBUFFERPROC)wglGetProcAddress("glVertexArrayVertexBuffer");
+		ext->glVertexArrayElementBuffer = (PFNGLVERTEXARRAYELEMENTBUFFERPROC)wglGetProcAddress("glVertexArrayElementBuffer");
 	}
 	if (ext->GLEXT_ARB_sampler_objects)
 	{
@@ -212,6 +310,124 @@ Please contact your graphics card manufacturer for an updated driver.\r\n\r\nThi
 		ext->glSamplerParameterfv = (PFNGLSAMPLERPARAMETERFVPROC)wglGetProcAddress("glSamplerParameterfv");
 		ext->glSamplerParameteriv = (PFNGLSAMPLERPARAMETERIVPROC)wglGetProcAddress("glSamplerParameteriv");
 	}
+	if (ext->GLEXT_ARB_map_buffer_range)
+	{
+		ext->glMapBufferRange = (PFNGLMAPBUFFERRANGEPROC)wglGetProcAddress("glMapBufferRange");
+		if (!ext->glMapBufferRange) ext->GLEXT_ARB_map_buffer_range = 0;
+	}
+	if (ext->GLEXT_ARB_sync)
+	{
+		ext->glFenceSync = (PFNGLFENCESYNCPROC)wglGetProcAddress("glFenceSync");
+		ext->glClientWaitSync = (PFNGLCLIENTWAITSYNCPROC)wglGetProcAddress("glClientWaitSync");
+		ext->glWaitSync = (PFNGLWAITSYNCPROC)wglGetProcAddress("glWaitSync");
+		ext->glDeleteSync = (PFNGLDELETESYNCPROC)wglGetProcAddress("glDeleteSync");
+		if (!ext->glFenceSync || !ext->glClientWaitSync || !ext->glWaitSync || !ext->glDeleteSync) ext->GLEXT_ARB_sync = 0;
+	}
+	if (ext->GLEXT_ARB_get_program_binary)
+	{
+		ext->glGetProgramBinary = (PFNGLGETPROGRAMBINARYPROC)wglGetProcAddress("glGetProgramBinary");
+		ext->glProgramBinary = (PFNGLPROGRAMBINARYPROC)wglGetProcAddress("glProgramBinary");
+		ext->glProgramParameteri = (PFNGLPROGRAMPARAMETERIPROC)wglGetProcAddress("glProgramParameteri");
+		if (!ext->glGetProgramBinary || !ext->glProgramBinary || !ext->glProgramParameteri)
+			ext->GLEXT_ARB_get_program_binary = 0;
+	}
+	if (ext->GLEXT_KHR_parallel_shader_compile)
+	{
+		ext->glMaxShaderCompilerThreadsKHR =
+			(PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)wglGetProcAddress("glMaxShaderCompilerThreadsKHR");
+		if (!ext->glMaxShaderCompilerThreadsKHR) ext->GLEXT_KHR_parallel_shader_compile = 0;
+	}
+	if (ext->GLEXT_ARB_texture_storage)
+	{
+		ext->glTexStorage2D = (PFNGLTEXSTORAGE2DPROC)wglGetProcAddress("glTexStorage2D");
+		if (!ext->glTexStorage2D) ext->GLEXT_ARB_texture_storage = 0;
+	}
+	if (ext->GLEXT_ARB_texture_view)
+	{
+		ext->glTextureView = (PFNGLTEXTUREVIEWPROC)wglGetProcAddress("glTextureView");
+		if (!ext->glTextureView) ext->GLEXT_ARB_texture_view = 0;
+	}
+	if (ext->GLEXT_ARB_copy_image)
+	{
+		ext->glCopyImageSubData = (PFNGLCOPYIMAGESUBDATAPROC)wglGetProcAddress("glCopyImageSubData");
+		if (!ext->glCopyImageSubData) ext->GLEXT_ARB_copy_image = 0;
+	}
+	if (ext->GLEXT_ARB_invalidate_subdata)
+	{
+		ext->glInvalidateTexImage = (PFNGLINVALIDATETEXIMAGEPROC)wglGetProcAddress("glInvalidateTexImage");
+		ext->glInvalidateFramebuffer = (PFNGLINVALIDATEFRAMEBUFFERPROC)wglGetProcAddress("glInvalidateFramebuffer");
+		if (!ext->glInvalidateTexImage || !ext->glInvalidateFramebuffer) ext->GLEXT_ARB_invalidate_subdata = 0;
+	}
+	if (ext->GLEXT_ARB_timer_query)
+	{
+		ext->glGenQueries = (PFNGLGENQUERIESPROC)wglGetProcAddress("glGenQueries");
+		ext->glDeleteQueries = (PFNGLDELETEQUERIESPROC)wglGetProcAddress("glDeleteQueries");
+		ext->glBeginQuery = (PFNGLBEGINQUERYPROC)wglGetProcAddress("glBeginQuery");
+		ext->glEndQuery = (PFNGLENDQUERYPROC)wglGetProcAddress("glEndQuery");
+		ext->glGetQueryObjectiv = (PFNGLGETQUERYOBJECTIVPROC)wglGetProcAddress("glGetQueryObjectiv");
+		ext->glGetQueryObjectui64v = (PFNGLGETQUERYOBJECTUI64VPROC)wglGetProcAddress("glGetQueryObjectui64v");
+		if (!ext->glGenQueries || !ext->glDeleteQueries || !ext->glBeginQuery || !ext->glEndQuery
+			|| !ext->glGetQueryObjectiv || !ext->glGetQueryObjectui64v) ext->GLEXT_ARB_timer_query = 0;
+	}
+	if (ext->GLEXT_ARB_multi_draw_indirect)
+	{
+		ext->glMultiDrawElementsIndirect = (PFNGLMULTIDRAWELEMENTSINDIRECTPROC)wglGetProcAddress("glMultiDrawElementsIndirect");
+		if (!ext->glMultiDrawElementsIndirect) ext->GLEXT_ARB_multi_draw_indirect = 0;
+	}
+	if (ext->GLEXT_ARB_bindless_texture)
+	{
+		ext->glGetTextureSamplerHandleARB = (PFNGLGETTEXTURESAMPLERHANDLEARBPROC)wglGetProcAddress("glGetTextureSamplerHandleARB");
+		ext->glMakeTextureHandleResidentARB = (PFNGLMAKETEXTUREHANDLERESIDENTARBPROC)wglGetProcAddress("glMakeTextureHandleResidentARB");
+		ext->glMakeTextureHandleNonResidentARB = (PFNGLMAKETEXTUREHANDLENONRESIDENTARBPROC)wglGetProcAddress("glMakeTextureHandleNonResidentARB");
+		ext->glUniformHandleui64ARB = (PFNGLUNIFORMHANDLEUI64ARBPROC)wglGetProcAddress("glUniformHandleui64ARB");
+		if (!ext->glGetTextureSamplerHandleARB || !ext->glMakeTextureHandleResidentARB
+			|| !ext->glMakeTextureHandleNonResidentARB || !ext->glUniformHandleui64ARB)
+			ext->GLEXT_ARB_bindless_texture = 0;
+	}
+	if (ext->GLEXT_ARB_uniform_buffer_object)
+	{
+		ext->glGetUniformBlockIndex = (PFNGLGETUNIFORMBLOCKINDEXPROC)wglGetProcAddress("glGetUniformBlockIndex");
+		ext->glUniformBlockBinding = (PFNGLUNIFORMBLOCKBINDINGPROC)wglGetProcAddress("glUniformBlockBinding");
+		ext->glBindBufferBase = (PFNGLBINDBUFFERBASEPROC)wglGetProcAddress("glBindBufferBase");
+		if (!ext->glGetUniformBlockIndex || !ext->glUniformBlockBinding || !ext->glBindBufferBase)
+			ext->GLEXT_ARB_uniform_buffer_object = 0;
+	}
+	if (ext->GLEXT_ARB_draw_elements_base_vertex)
+	{
+		ext->glDrawElementsBaseVertex = (PFNGLDRAWELEMENTSBASEVERTEXPROC)wglGetProcAddress("glDrawElementsBaseVertex");
+		if (!ext->glDrawElementsBaseVertex) ext->GLEXT_ARB_draw_elements_base_vertex = 0;
+	}
+	if (ext->GLEXT_ARB_instanced_arrays)
+	{
+		ext->glDrawArraysInstanced = (PFNGLDRAWARRAYSINSTANCEDPROC)wglGetProcAddress("glDrawArraysInstanced");
+		if (!ext->glDrawArraysInstanced)
+			ext->glDrawArraysInstanced = (PFNGLDRAWARRAYSINSTANCEDPROC)wglGetProcAddress("glDrawArraysInstancedARB");
+		ext->glVertexAttribDivisor = (PFNGLVERTEXATTRIBDIVISORPROC)wglGetProcAddress("glVertexAttribDivisor");
+		if (!ext->glVertexAttribDivisor)
+			ext->glVertexAttribDivisor = (PFNGLVERTEXATTRIBDIVISORPROC)wglGetProcAddress("glVertexAttribDivisorARB");
+		if (!ext->glDrawArraysInstanced || !ext->glVertexAttribDivisor) ext->GLEXT_ARB_instanced_arrays = 0;
+	}
+	ext->glTextureBarrier = NULL;
+	if (strstr((char*)glextensions, "GL_ARB_texture_barrier") || (ext->glver_major >= 5)
+		|| ((ext->glver_major >= 4) && (ext->glver_minor >= 5)))
+		ext->glTextureBarrier = (PFNGLTEXTUREBARRIERPROC)wglGetProcAddress("glTextureBarrier");
+	if (!ext->glTextureBarrier && strstr((char*)glextensions, "GL_NV_texture_barrier"))
+		ext->glTextureBarrier = (PFNGLTEXTUREBARRIERNVPROC)wglGetProcAddress("glTextureBarrierNV");
+	if (ext->GLEXT_ARB_vertex_array_object)
+	{
+		ext->glGenVertexArrays = (PFNGLGENVERTEXARRAYSPROC)wglGetProcAddress("glGenVertexArrays");
+		ext->glBindVertexArray = (PFNGLBINDVERTEXARRAYPROC)wglGetProcAddress("glBindVertexArray");
+		ext->glDeleteVertexArrays = (PFNGLDELETEVERTEXARRAYSPROC)wglGetProcAddress("glDeleteVertexArrays");
+		if (!ext->glGenVertexArrays || !ext->glBindVertexArray || !ext->glDeleteVertexArrays)
+			ext->GLEXT_ARB_vertex_array_object = 0;
+	}
+	if (ext->GLEXT_ARB_buffer_storage)
+	{
+		ext->glBufferStorage = (PFNGLBUFFERSTORAGEPROC)wglGetProcAddress("glBufferStorage");
+		// Persistent mapping needs both fences and ranged maps
+		if (!ext->glBufferStorage || !ext->GLEXT_ARB_sync || !ext->GLEXT_ARB_map_buffer_range)
+			ext->GLEXT_ARB_buffer_storage = 0;
+	}
 	if(broken_fbo)
 	{
 		if(dxglcfg.DebugNoArbFramebuffer || dxglcfg.DebugNoExtFramebuffer)
@@ -237,4 +453,13 @@ MB_OK | MB_ICONERROR);
 		ext->wglSwapIntervalEXT = wglSwapIntervalEXTStub;
 		ext->wglGetSwapIntervalEXT = wglGetSwapIntervalEXTStub;
 	}
+	else
+	{
+		// Negative swap intervals enable adaptive vsync
+		ext->wglGetExtensionsStringARB = (const char *(APIENTRY *)(HDC))wglGetProcAddress("wglGetExtensionsStringARB");
+		if (ext->wglGetExtensionsStringARB)
+			wglextensions = ext->wglGetExtensionsStringARB(wglGetCurrentDC());
+		if ((wglextensions && strstr(wglextensions, "WGL_EXT_swap_control_tear")) ||
+			strstr((char*)glextensions, "WGL_EXT_swap_control_tear")) ext->WGLEXT_EXT_swap_control_tear = 1;
+	}
 }
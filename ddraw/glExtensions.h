@@ -26,10 +26,21 @@
 #define GL_STENCIL_BUFFER 0x8224
 #endif
 
+#ifndef GL_KHR_parallel_shader_compile
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+typedef void (APIENTRY *PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)(GLuint count);
+#endif
+
 #define GL_GPU_MEMORY_INFO_DEDICATED_VIDMEM_NVX 0x9047
 #define GL_GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX 0x9049
 #define GL_RGB565 0x8D62
 
+#ifndef GL_EXT_texture_compression_s3tc
+#define GL_COMPRESSED_RGBA_S3TC_DXT1_EXT 0x83F1
+#define GL_COMPRESSED_RGBA_S3TC_DXT3_EXT 0x83F2
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -18,6 +18,7 @@
 #include "common.h"
 #include "glDirectDraw.h"
 #include "glRenderWindow.h"
+#include "ThreadPriority.h"
 #include "ddraw.h"
 #include "hooks.h"
 
@@ -84,6 +85,9 @@ DWORD glRenderWindow__Entry(glRenderWindow *This)
 	if (This->device) windowname = "DirectDrawDeviceWnd";
 	else windowname = "Renderer";
 	MSG Msg;
+	ThreadPriority priority;
+	// Input and window messages are handled without waiting behind background work
+	ThreadPriority_Enter(&priority, FALSE);
 	if (!wndclasscreated)
 	{
 		wndclass.cbSize = sizeof(WNDCLASSEXA);
@@ -112,11 +116,16 @@ DWORD glRenderWindow__Entry(glRenderWindow *This)
 	}
 	else
 	{
-		This->width = GetSystemMetrics(SM_CXSCREEN);
-		This->height = GetSystemMetrics(SM_CYSCREEN);
+		// Cover the monitor selected by the DirectDraw GUID so its GPU presents
+		if (This->ddInterface) rectRender = This->ddInterface->adapter.rect;
+		else SetRect(&rectRender, 0, 0, GetSystemMetrics(SM_CXSCREEN), GetSystemMetrics(SM_CYSCREEN));
+		This->width = rectRender.right - rectRender.left;
+		This->height = rectRender.bottom - rectRender.top;
 		This->hWnd = CreateWindowExA(WS_EX_TOOLWINDOW | WS_EX_LAYERED | WS_EX_TRANSPARENT | WS_EX_TOPMOST,
-			"DirectDrawDeviceWnd", windowname, WS_POPUP, 0, 0, This->width, This->height, 0, 0, NULL, This);
-		SetWindowPos(This->hWnd, HWND_TOP, 0, 0, This->width, This->height, SWP_SHOWWINDOW | SWP_NOACTIVATE);
+			"DirectDrawDeviceWnd", windowname, WS_POPUP, rectRender.left, rectRender.top, This->width, This->height,
+			0, 0, NULL, This);
+		SetWindowPos(This->hWnd, HWND_TOP, rectRender.left, rectRender.top, This->width, This->height,
+			SWP_SHOWWINDOW | SWP_NOACTIVATE);
 	}
 #if 1 //def _DEBUG
 	if (RegisterHotKey(This->hWnd, 1, 0, VK_F11)) hotkeyregistered = true;
@@ -142,6 +151,7 @@ DWORD glRenderWindow__Entry(glRenderWindow *This)
 		TranslateMessage(&Msg);
 		DispatchMessage(&Msg);
 	}
+	ThreadPriority_Leave(&priority);
 	return 0;
 }
 
@@ -159,7 +169,6 @@ DWORD WINAPI BeepThread(void *unused)
 	Beep(3600,150);
 	return 0;
 }
-extern "C" extern bool debugRenderingEnabled;
 LRESULT glRenderWindow_WndProc(glRenderWindow *This, HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
 {
 	HWND hParent;
@@ -200,8 +209,6 @@ LRESULT glRenderWindow_WndProc(glRenderWindow *This, HWND hwnd, UINT msg, WPARAM
 		This->dead = TRUE;
 		return 0;
 	case WM_HOTKEY:
-		debugRenderingEnabled = !debugRenderingEnabled;
-		break;
 		if (dxglcfg.DebugTraceLevel)
 		{
 			trace_end = TRUE;
@@ -218,16 +225,6 @@ LRESULT glRenderWindow_WndProc(glRenderWindow *This, HWND hwnd, UINT msg, WPARAM
 			#endif
 		}
 		break;
-	case WM_KEYUP:
-		switch (wParam)
-		{
-		case VK_F11:
-			debugRenderingEnabled = !debugRenderingEnabled;
-			break;
-		default:
-			break;
-		}
-		break;
 	default:
 		return DefWindowProc(hwnd,msg,wParam,lParam);
 	}
@@ -25,8 +25,27 @@
 #include "glRenderer.h"
 #include "ddraw.h"
 #include "ShaderGen3D.h"
+#include "TexturePool.h"
+#include "FrameArena.h"
+#include "TextureAtlas.h"
+#include "TextureResidency.h"
+#include "PostProcess.h"
+#include "Timeline.h"
+#include "ShaderTiming.h"
+#include "FrameCapture.h"
+#include "LatencyMeter.h"
+#include "Capture.h"
+#include "Presenter.h"
+#include "DXGIOutput.h"
+#include "DwmSync.h"
+#include "VBlankNotify.h"
+#include "ThreadPriority.h"
+#include "CapsCache.h"
+#include "RenderBackend.h"
+#include "RuntimePolicy.h"
 #include "matrix.h"
 #include "util.h"
+#include "colorconv.h"
 #include <stdarg.h>
 #include "hooks.h"
 #include "glutils.h"
@@ -34,6 +53,12 @@
 
 extern "C" {
 
+static PFNWGLCREATECONTEXTATTRIBSARBPROC wglCreateContextAttribsARB_cached = NULL;
+static GLCAPS glcaps_cached;
+static BOOL glcaps_valid = FALSE;
+static DWORD gladlock = 0;  // glad keeps its extension list in globals while loading
+static PFNWGLDELETEDCNVPROC wglDeleteDCNV_cached = NULL;
+
 static const DDSURFACEDESC2 ddsdbackbuffer =
 {
 	sizeof(DDSURFACEDESC2),
@@ -71,6 +96,35 @@ static const DDSURFACEDESC2 ddsdbackbuffer =
 
 const GLushort bltindices[4] = {0,1,2,3};
 
+// Names of the renderer opcodes, as shown in the timeline
+static const char *const opcodenames[] = {
+	"OP_NULL", "OP_SETWND", "OP_DELETE", "OP_CREATE", "OP_UPLOAD", "OP_DOWNLOAD", "OP_DELETETEX",
+	"OP_BLT", "OP_DRAWSCREEN", "OP_INITD3D", "OP_CLEAR", "OP_FLUSH", "OP_DRAWPRIMITIVES",
+	"OP_UPDATECLIPPER", "OP_DEPTHFILL", "OP_SETRENDERSTATE", "OP_SETTEXTURE", "OP_SETTEXTURESTAGESTATE",
+	"OP_SETTRANSFORM", "OP_SETMATERIAL", "OP_SETLIGHT", "OP_REMOVELIGHT", "OP_SETD3DVIEWPORT",
+	"OP_DXGLBREAK", "OP_SETTEXTURECOLORKEY", "OP_MAKETEXTUREPRIMARY", "OP_ENDCOMMAND",
+	"OP_INITTEXTURESTAGE", "OP_SETTEXTURESURFACEDESC", "OP_SETSHADER2D", "OP_SETSHADER",
+	"OP_SETRENDERTARGET", "OP_SETVIEWPORT", "OP_VERTEX2D", "OP_SETD3DDEPTHMODE", "OP_BLENDENABLE",
+	"OP_SETDEPTHTEST", "OP_SETFRONTBUFFERBITS", "OP_SETSWAP", "OP_SWAPBUFFERS", "OP_SETUNIFORM",
+	"OP_SETATTRIB", "OP_SETMODE3D", "OP_FREEPOINTER", "OP_SYNC", "OP_APPLYSTATEDELTA",
+	"OP_RELEASEBUFFER", "OP_MAPTEXTURELOCK", "OP_UPDATEPALETTE", "OP_SETOVERLAY",
+	"OP_SETOVERLAYPOSITION", "OP_REMOVEOVERLAY", "OP_DRAWBATCH", "OP_QUEUEUPLOAD", "OP_PRELOADTEXTURE",
+	"OP_SETGAMMARAMP"
+};
+
+/**
+  * Gets the name of a renderer opcode.
+  * @param opcode
+  *  Opcode to name
+  * @return
+  *  Name of the opcode, "OP_UNKNOWN" if it has none
+  */
+static const char *glRenderer__OpcodeName(int opcode)
+{
+	if ((opcode < 0) || (opcode >= (int)(sizeof(opcodenames) / sizeof(opcodenames[0])))) return "OP_UNKNOWN";
+	return opcodenames[opcode];
+}
+
 /**
   * Expands a 5-bit value to 8 bits.
   * @param number
@@ -96,16 +150,32 @@ inline int _6to8bit(int number)
 }
 
 /**
-  * Sets the Windows OpenGL swap interval
+  * Applies the vsync options to a swap interval requested by the application.
   * @param This
   *  Pointer to glRenderer object
   * @param swap
   *  Number of vertical retraces to wait per frame, 0 disable vsync
+  * @return
+  *  Interval to pass to wglSwapIntervalEXT
   */
-void glRenderer__SetSwap(glRenderer *This, int swap)
+static int glRenderer__SwapInterval(glRenderer *This, int swap)
 {
 	if (dxglcfg.vsync == 1) swap = 0;
 	else if (dxglcfg.vsync == 2) swap = 1;
+	// A negative interval lets late frames tear instead of waiting a whole refresh
+	if (swap && dxglcfg.AdaptiveVsync && This->ext->WGLEXT_EXT_swap_control_tear) return -swap;
+	return swap;
+}
+
+/**
+  * Sets the Windows OpenGL swap interval without applying the vsync settings
+  * @param This
+  *  Pointer to glRenderer object
+  * @param swap
+  *  Swap interval to set
+  */
+static void glRenderer__SetSwapInterval(glRenderer *This, int swap)
+{
 	if(swap != This->oldswap)
 	{
 		This->ext->wglSwapIntervalEXT(swap);
@@ -114,6 +184,115 @@ void glRenderer__SetSwap(glRenderer *This, int swap)
 	}
 }
 
+/**
+  * Sets the Windows OpenGL swap interval
+  * @param This
+  *  Pointer to glRenderer object
+  * @param swap
+  *  Number of vertical retraces to wait per frame, 0 disable vsync
+  */
+void glRenderer__SetSwap(glRenderer *This, int swap)
+{
+	glRenderer__SetSwapInterval(This, glRenderer__SwapInterval(This, swap));
+}
+
+/**
+  * Binds the framebuffer that stands in for the window.  While the presenter
+  * thread shows the frames, that is the frame being composed for it.
+  * @param This
+  *  Pointer to glRenderer object
+  * @return
+  *  Framebuffer that was bound, NULL for the window itself
+  */
+static FBO *glRenderer__SetScreenFBO(glRenderer *This)
+{
+	FBO *fbo;
+	if (This->dxgidrawing)
+	{
+		glUtil_SetFBOSurface(This->util, &This->dxgiframe, NULL, 0, 0, TRUE);
+		return &This->dxgiframe.levels[0].fbo;
+	}
+	fbo = This->presenter ? Presenter_GetFBO(This->presenter) : NULL;
+	glUtil_SetFBO(This->util, fbo);
+	return fbo;
+}
+
+/**
+  * Starts composing a frame for the DXGI swap chain.  The frame is drawn
+  * into a texture of its own and copied to the swap chain when it is done.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param width,height
+  *  Size of the frame
+  * @return
+  *  TRUE if the frame is drawn for the swap chain
+  */
+static BOOL glRenderer__BeginDXGIFrame(glRenderer *This, DWORD width, DWORD height)
+{
+	DDSURFACEDESC2 ddsd;
+	if (!width || !height) return FALSE;
+	if (!This->dxgiframe.initialized)
+	{
+		memcpy(&ddsd, &ddsdbackbuffer, sizeof(DDSURFACEDESC2));
+		ddsd.dwWidth = width;
+		ddsd.lPitch = width * 4;
+		ddsd.dwHeight = height;
+		if (FAILED(glTexture_Create(&ddsd, &This->dxgiframe, This, TRUE, 0)))
+		{
+			ZeroMemory(&This->dxgiframe, sizeof(glTexture));
+			return FALSE;
+		}
+		This->dxgiframe.freeonrelease = FALSE;
+		glUtil_InitFBO(This->util, &This->dxgiframe.levels[0].fbo);
+	}
+	else if ((This->dxgiframe.levels[0].ddsd.dwWidth != width) || (This->dxgiframe.levels[0].ddsd.dwHeight != height))
+	{
+		ZeroMemory(&ddsd, sizeof(DDSURFACEDESC2));
+		ddsd.dwSize = sizeof(DDSURFACEDESC2);
+		ddsd.dwWidth = width;
+		ddsd.dwHeight = height;
+		ddsd.dwFlags = DDSD_WIDTH | DDSD_HEIGHT;
+		glTexture__SetSurfaceDesc(&This->dxgiframe, &ddsd);
+	}
+	if (glUtil_SetFBOSurface(This->util, &This->dxgiframe, NULL, 0, 0, TRUE) != GL_FRAMEBUFFER_COMPLETE)
+	{
+		glUtil_SetFBO(This->util, NULL);
+		return FALSE;
+	}
+	This->dxgidrawing = TRUE;
+	return TRUE;
+}
+
+/**
+  * Copies the frame composed since glRenderer__BeginDXGIFrame to the DXGI
+  * swap chain and presents it.  Direct3D stores the top row first, so the
+  * frame is flipped on the way.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param swap
+  *  Swap interval to present with
+  */
+static void glRenderer__EndDXGIFrame(glRenderer *This, int swap)
+{
+	GLuint target;
+	GLsizei width = This->dxgiframe.levels[0].ddsd.dwWidth;
+	GLsizei height = This->dxgiframe.levels[0].ddsd.dwHeight;
+	This->dxgidrawing = FALSE;
+	glUtil_SetFBO(This->util, NULL);
+	target = DXGIOutput_BeginFrame(This->dxgioutput, width, height);
+	if (!target) return;
+	if (!This->dxgifbo.fbo) glUtil_InitFBO(This->util, &This->dxgifbo);
+	glUtil_SetScissor(This->util, FALSE, 0, 0, 0, 0);
+	This->ext->glBindFramebuffer(GL_DRAW_FRAMEBUFFER, This->dxgifbo.fbo);
+	This->ext->glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, target, 0);
+	This->ext->glBindFramebuffer(GL_READ_FRAMEBUFFER, This->dxgiframe.levels[0].fbo.fbo);
+	This->ext->glBlitFramebuffer(0, 0, width, height, 0, height, width, 0, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	// The shared texture must not stay attached while Direct3D owns it
+	This->ext->glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, 0, 0);
+	This->ext->glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	DXGIOutput_EndFrame(This->dxgioutput, swap);
+}
+
 /**
   * glRenderer wrapper for glTexture__Upload
   * @param This
@@ -151,613 +330,936 @@ void glRenderer__DownloadTexture(glRenderer *This, glTexture *texture, GLint lev
   */
 void glRenderer_InitCmdBuffer(glRenderer *This, CmdBuffer *buffer)
 {
+	GLsizeiptr vertexsize, indexsize, unpacksize;
 	ZeroMemory(buffer, sizeof(CmdBuffer));
 	BufferObject_Create(&buffer->vertices, This->ext, This->util);
 	BufferObject_Create(&buffer->indices, This->ext, This->util);
 	BufferObject_Create(&buffer->pixelunpack, This->ext, This->util);
-	BufferObject_SetData(buffer->vertices, GL_ARRAY_BUFFER, dxglcfg.VertexBufferSize * 1024, NULL, GL_STREAM_DRAW);
-	BufferObject_SetData(buffer->indices, GL_ARRAY_BUFFER, dxglcfg.IndexBufferSize * 1024, NULL, GL_STREAM_DRAW);
-	BufferObject_SetData(buffer->pixelunpack, GL_ARRAY_BUFFER, dxglcfg.UnpackBufferSize * 1024, NULL, GL_STREAM_DRAW);
-	buffer->cmdsize = dxglcfg.CmdBufferSize * 1024;
-	buffer->cmdbuffer = (DWORD*)malloc(dxglcfg.CmdBufferSize);
+	if (dxglcfg.VertexBufferSize) vertexsize = dxglcfg.VertexBufferSize * 1024;
+	else vertexsize = 4096 * 1024;
+	if (dxglcfg.IndexBufferSize) indexsize = dxglcfg.IndexBufferSize * 1024;
+	else indexsize = 1024 * 1024;
+	if (dxglcfg.UnpackBufferSize) unpacksize = dxglcfg.UnpackBufferSize * 1024;
+	else unpacksize = 16384 * 1024;
+	buffer->vertices->pointer = This->backend->InitStreamBuffer(This->ext, buffer->vertices, GL_ARRAY_BUFFER, vertexsize);
+	buffer->indices->pointer = This->backend->InitStreamBuffer(This->ext, buffer->indices, GL_ARRAY_BUFFER, indexsize);
+	// Shared staging area for texture uploads
+	buffer->pixelunpack->pointer = This->backend->InitStreamBuffer(This->ext, buffer->pixelunpack,
+		GL_PIXEL_UNPACK_BUFFER, unpacksize);
+	if (buffer->pixelunpack->pointer) buffer->pixelunpack->mapped = TRUE;
+	if (This->ext->GLEXT_ARB_buffer_storage)
+	{
+		// Persistent, coherent mapping; regions are recycled behind fences
+		if (buffer->vertices->pointer && buffer->indices->pointer)
+		{
+			buffer->vertices->mapped = buffer->indices->mapped = TRUE;
+			buffer->streaming = TRUE;
+		}
+	}
+	// Orphan the whole buffer on wrap-around instead of fencing it
+	else if (This->ext->GLEXT_ARB_map_buffer_range) buffer->streaming = TRUE;
+	if (dxglcfg.CmdBufferSize) buffer->cmdsize = dxglcfg.CmdBufferSize * 1024;
+	else buffer->cmdsize = 256 * 1024;
+	if (buffer->cmdsize < 64 * 1024) buffer->cmdsize = 64 * 1024;  // Must fit the largest command
+	buffer->cmdbuffer = (DWORD*)malloc(buffer->cmdsize);
+	if (!buffer->cmdbuffer) buffer->cmdsize = 0;
 }
 
 /**
-  * Initializes a glRenderer object
+  * Frees the resources used by a command buffer.
   * @param This
-  *  Pointer to glRenderer object to initialize
-  * @param width,height,bpp
-  *  Width, height, and BPP of the rendering window
-  * @param fullscreen
-  *  True if fullscreen mode is required, false for windowed
-  * @param hwnd
-  *  Handle of the window to render into.  If this value is NULL, then a transparent
-  *  layered window will be created for the renderer.
-  * @param glDD7
-  *  Pointer to the glDirectDraw7 object that is managing the glRenderer object
-  * @param devwnd
-  *  True if creating window with name "DirectDrawDeviceWnd"
+  *  Pointer to glRenderer object
+  * @param buffer
+  *  Pointer to command buffer structure
   */
-void glRenderer_Init(glRenderer *This, int width, int height, int bpp, BOOL fullscreen, unsigned int frequency, HWND hwnd, glDirectDraw7 *glDD7, BOOL devwnd)
+void glRenderer_DeleteCmdBuffer(glRenderer *This, CmdBuffer *buffer)
 {
-	RECT wndrect;
-	WINDOWPLACEMENT wndplace;
-	int screenx, screeny;
-	LONG_PTR winstyle, winstyleex;
-	This->oldswap = 0;
-	This->fogcolor = 0;
-	This->fogstart = 0.0f;
-	This->fogend = 1.0f;
-	This->fogdensity = 1.0f;
-	ZeroMemory(&This->backbuffers, 16 * sizeof(glTexture));
-	This->hDC = NULL;
-	This->hRC = NULL;
-	This->pbo = NULL;
-	This->overlays = NULL;
-	This->overlaycount = 0;
-	This->last_fvf = 0xFFFFFFFF; // Bogus value to force initial FVF change
-	This->mode_3d = FALSE;
-	ZeroMemory(&This->dib, sizeof(DIB));
-	This->hWnd = hwnd;
-	InitializeCriticalSection(&This->cs);
-	This->busy = CreateEvent(NULL,FALSE,FALSE,NULL);
-	This->start = CreateEvent(NULL,FALSE,FALSE,NULL);
-	HWND hTempWnd;
-	DWORD threadid;
-	if(fullscreen)
+	int i;
+	for (i = 0; i < STREAMBUFFER_SEGMENTS; i++)
 	{
-		switch (dxglcfg.fullmode)
+		if (buffer->vertexfences[i]) This->ext->glDeleteSync(buffer->vertexfences[i]);
+		if (buffer->indexfences[i]) This->ext->glDeleteSync(buffer->indexfences[i]);
+		if (buffer->unpackfences[i]) This->ext->glDeleteSync(buffer->unpackfences[i]);
+	}
+	if (buffer->vertices) BufferObject_Release(buffer->vertices);
+	if (buffer->indices) BufferObject_Release(buffer->indices);
+	if (buffer->pixelunpack) BufferObject_Release(buffer->pixelunpack);
+	if (buffer->cmdbuffer) free(buffer->cmdbuffer);
+	ZeroMemory(buffer, sizeof(CmdBuffer));
+}
+
+/**
+  * Adds a command to the renderer command ring and returns without waiting
+  * for the renderer thread to execute it.  If the ring is full, waits until
+  * the renderer thread has drained it.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param opcode
+  *  Command to add to the ring
+  * @param args
+  *  Pointer to the arguments of the command, may be NULL if argsize is 0
+  * @param argsize
+  *  Size in bytes of the arguments
+  */
+static void glRenderer_Wake(glRenderer *This);
+static void glRenderer_WaitForThread(glRenderer *This, int opcode);
+static void glRenderer_FlushDraws(glRenderer *This);
+static void glRenderer__DrawBatch(glRenderer *This);
+static BOOL glRenderer__CanBatchBlt(const BltCommand *cmd);
+static BOOL glRenderer__BltMatches(const BltCommand *first, const BltCommand *cmd);
+static BOOL glRenderer__CanClearFill(const BltCommand *cmd);
+static void glRenderer__ClearFill(glRenderer *This, BltCommand *cmd, DWORD count);
+static BOOL glRenderer__CanCopyBlt(glRenderer *This, const BltCommand *cmd);
+static BOOL glRenderer__CopyBlt(glRenderer *This, BltCommand *cmd, DWORD count);
+static BOOL glRenderer__SelfBlt(glRenderer *This, BltCommand *cmd, BOOL backend);
+static BOOL glRenderer__CanIntegerROP(glRenderer *This, const BltCommand *cmd, DWORD count, BOOL usedest, BOOL usepattern);
+static void glRenderer__SetIntegerView(glRenderer *This, unsigned int unit, glTexture *texture);
+static void glRenderer__FinishBlt(glRenderer *This, BltCommand *cmd, BOOL backend);
+static void glRenderer__ShowLayeredFrame(glRenderer *This);
+static void glRenderer__CaptureFrame(glRenderer *This, glTexture *primary, GLint width, GLint height);
+static void glRenderer__ChooseUnpack(glRenderer *This, CmdBuffer *buffer);
+static void glRenderer__SetTransformBlock(glRenderer *This);
+static void glRenderer__UpdateTransforms(glRenderer *This, BOOL modelview);
+static void glRenderer__SetMaterialBlock(glRenderer *This);
+static void glRenderer__SetLightBlock(glRenderer *This);
+static __int64 glRenderer__LightStateBits(glRenderer *This, const D3DLIGHT7 *lights);
+static void glRenderer__UpdateLights(glRenderer *This);
+static void glRenderer__DeleteVertexArrays(glRenderer *This);
+static GLintptr glRenderer__StreamData(glRenderer *This, BufferObject *buffer, GLenum target, size_t *ptr,
+	int *segment, GLsync *fences, const void *data, GLsizeiptr size, GLsizeiptr align);
+static void glRenderer_AddCommandEx(glRenderer *This, DWORD opcode, const void *args, size_t argsize, BOOL hold);
+static void glRenderer_AddCommand(glRenderer *This, DWORD opcode, const void *args, size_t argsize)
+{
+	glRenderer_AddCommandEx(This, opcode, args, argsize, FALSE);
+}
+
+/**
+  * Finds room for a command in the renderer command ring without waiting.
+  * Must be called with the renderer lock held.
+  * @param ring
+  *  Pointer to the command ring
+  * @param size
+  *  Size in bytes of the command including its header
+  * @param write
+  *  Receives the offset to write the command at.  If this differs from
+  *  ring->writeptr the command does not fit at the end and the caller must
+  *  mark the wrap at ring->writeptr.
+  * @param next
+  *  Receives the write offset following the command
+  * @return
+  *  TRUE if the command fits, FALSE if the renderer thread has to execute
+  *  commands first
+  */
+static BOOL glRenderer__FindRoom(CmdBuffer *ring, size_t size, size_t *write, size_t *next)
+{
+	size_t read = ring->readptr;
+	*write = ring->writeptr;
+	if (*write >= read)
+	{
+		if (((*write + size) < ring->cmdsize) || (((*write + size) == ring->cmdsize) && read))
 		{
-		case 0:    // Fullscreen
-			winstyle = GetWindowLongPtrA(This->hWnd, GWL_STYLE);
-			winstyleex = GetWindowLongPtrA(This->hWnd, GWL_EXSTYLE);
-			SetWindowLongPtrA(This->hWnd, GWL_EXSTYLE, winstyleex & ~(WS_EX_WINDOWEDGE | WS_EX_CLIENTEDGE));
-			SetWindowLongPtrA(This->hWnd, GWL_STYLE, (winstyle | WS_POPUP) & ~(WS_CAPTION | WS_THICKFRAME | WS_BORDER));
-			ShowWindow(This->hWnd, SW_MAXIMIZE);
-			break;
-		case 1:    // Non-exclusive Fullscreen
-		case 5:    // Windowed borderless scaled
-			winstyle = GetWindowLongPtrA(This->hWnd, GWL_STYLE);
-			winstyleex = GetWindowLongPtrA(This->hWnd, GWL_EXSTYLE);
-			SetWindowLongPtrA(This->hWnd, GWL_EXSTYLE, winstyleex & ~(WS_EX_WINDOWEDGE | WS_EX_CLIENTEDGE));
-			SetWindowLongPtrA(This->hWnd, GWL_STYLE, winstyle & ~(WS_CAPTION | WS_THICKFRAME | WS_BORDER | WS_POPUP));
-			ShowWindow(This->hWnd, SW_MAXIMIZE);
-			break;
-		case 2:     // Windowed non-resizable
-			winstyle = GetWindowLongPtrA(This->hWnd, GWL_STYLE);
-			winstyleex = GetWindowLongPtrA(This->hWnd, GWL_EXSTYLE);
-			SetWindowLongPtrA(This->hWnd, GWL_EXSTYLE, winstyleex | WS_EX_APPWINDOW);
-			SetWindowLongPtrA(This->hWnd, GWL_STYLE, (winstyle | WS_OVERLAPPEDWINDOW) & ~(WS_THICKFRAME | WS_MAXIMIZEBOX | WS_POPUP));
-			ShowWindow(This->hWnd, SW_NORMAL);
-			if (dxglcfg.WindowPosition == 1)
-			{
-				wndrect.left = dxglcfg.WindowX;
-				wndrect.top = dxglcfg.WindowY;
-				wndrect.right = dxglcfg.WindowX + dxglcfg.WindowWidth;
-				wndrect.bottom = dxglcfg.WindowY + dxglcfg.WindowHeight;
-				AdjustWindowRectEx(&wndrect, (winstyle | WS_OVERLAPPEDWINDOW) & ~(WS_THICKFRAME | WS_MAXIMIZEBOX), FALSE,
-					(winstyleex | WS_EX_APPWINDOW));
-			}
-			else if (dxglcfg.WindowPosition == 2)
-			{
-				wndrect.left = wndrect.top = 0;
-				wndrect.right = dxglcfg.WindowWidth;
-				wndrect.bottom = dxglcfg.WindowHeight;
-				AdjustWindowRectEx(&wndrect, (winstyle | WS_OVERLAPPEDWINDOW) & ~(WS_THICKFRAME | WS_MAXIMIZEBOX), FALSE,
-					(winstyleex | WS_EX_APPWINDOW));
-				wndrect.right -= wndrect.left;
-				wndrect.left = 0;
-				wndrect.bottom -= wndrect.top;
-				wndrect.top = 0;
-			}
-			else if (dxglcfg.WindowPosition == 3)
-			{
-				if (!wndclassdxgltempatom) RegisterDXGLTempWindowClass();
-				wndrect.left = wndrect.top = 0;
-				wndrect.right = dxglcfg.WindowWidth;
-				wndrect.bottom = dxglcfg.WindowHeight;
-				AdjustWindowRectEx(&wndrect, (winstyle | WS_OVERLAPPEDWINDOW) & ~(WS_THICKFRAME | WS_MAXIMIZEBOX), FALSE,
-					(winstyleex | WS_EX_APPWINDOW));
-				hTempWnd = CreateWindow(wndclassdxgltemp.lpszClassName, _T("DXGL Sizing Window"),
-					(winstyle | WS_OVERLAPPEDWINDOW) & ~(WS_THICKFRAME | WS_MAXIMIZEBOX | WS_POPUP | WS_VISIBLE),
-					CW_USEDEFAULT, CW_USEDEFAULT, wndrect.right - wndrect.left, wndrect.bottom - wndrect.top, NULL, NULL,
-					GetModuleHandle(NULL), NULL);
-				GetWindowRect(hTempWnd, &wndrect);
-				DestroyWindow(hTempWnd);
-			}
-			else
-			{
-				screenx = GetSystemMetrics(SM_CXSCREEN);
-				screeny = GetSystemMetrics(SM_CYSCREEN);
-				wndrect.right = dxglcfg.WindowWidth + (screenx / 2) - (dxglcfg.WindowWidth / 2);
-				wndrect.bottom = dxglcfg.WindowHeight + (screeny / 2) - (dxglcfg.WindowHeight / 2);
-				wndrect.left = (screenx / 2) - (dxglcfg.WindowWidth / 2);
-				wndrect.top = (screeny / 2) - (dxglcfg.WindowHeight / 2);
-				AdjustWindowRectEx(&wndrect, (winstyle | WS_OVERLAPPEDWINDOW) & ~(WS_THICKFRAME | WS_MAXIMIZEBOX), FALSE,
-					(winstyleex | WS_EX_APPWINDOW));
-			}
-			SetWindowPos(This->hWnd, 0, wndrect.left, wndrect.top, wndrect.right - wndrect.left,
-				wndrect.bottom - wndrect.top, SWP_ASYNCWINDOWPOS | SWP_NOACTIVATE | SWP_NOOWNERZORDER);
-			break;
-		case 3:     // Windowed resizable
-			winstyle = GetWindowLongPtrA(This->hWnd, GWL_STYLE);
-			winstyleex = GetWindowLongPtrA(This->hWnd, GWL_EXSTYLE);
-			SetWindowLongPtrA(This->hWnd, GWL_EXSTYLE, winstyleex | WS_EX_APPWINDOW);
-			SetWindowLongPtrA(This->hWnd, GWL_STYLE, (winstyle | WS_OVERLAPPEDWINDOW) & ~WS_POPUP);
-			ShowWindow(This->hWnd, SW_NORMAL);
-			if (dxglcfg.WindowPosition == 1)
-			{
-				wndrect.left = dxglcfg.WindowX;
-				wndrect.top = dxglcfg.WindowY;
-				wndrect.right = dxglcfg.WindowX + dxglcfg.WindowWidth;
-				wndrect.bottom = dxglcfg.WindowY + dxglcfg.WindowHeight;
-				AdjustWindowRectEx(&wndrect, winstyle | WS_OVERLAPPEDWINDOW, FALSE, (winstyleex | WS_EX_APPWINDOW));
-			}
-			else if (dxglcfg.WindowPosition == 2)
-			{
-				wndrect.left = wndrect.top = 0;
-				wndrect.right = dxglcfg.WindowWidth;
-				wndrect.bottom = dxglcfg.WindowHeight;
-				AdjustWindowRectEx(&wndrect, winstyle | WS_OVERLAPPEDWINDOW, FALSE, (winstyleex | WS_EX_APPWINDOW));
-				wndrect.right -= wndrect.left;
-				wndrect.left = 0;
-				wndrect.bottom -= wndrect.top;
-				wndrect.top = 0;
-			}
-			else if (dxglcfg.WindowPosition == 3)
-			{
-				if (!wndclassdxgltempatom) RegisterDXGLTempWindowClass();
-				wndrect.left = wndrect.top = 0;
-				wndrect.right = dxglcfg.WindowWidth;
-				wndrect.bottom = dxglcfg.WindowHeight;
-				AdjustWindowRectEx(&wndrect, (winstyle | WS_OVERLAPPEDWINDOW), FALSE, (winstyleex | WS_EX_APPWINDOW));
-				hTempWnd = CreateWindow(wndclassdxgltemp.lpszClassName, _T("DXGL Sizing Window"),
-					((winstyle | WS_OVERLAPPEDWINDOW) & ~(WS_POPUP | WS_VISIBLE)), CW_USEDEFAULT, CW_USEDEFAULT,
-					wndrect.right - wndrect.left, wndrect.bottom - wndrect.top, NULL, NULL, GetModuleHandle(NULL), NULL);
-				GetWindowRect(hTempWnd, &wndrect);
-				DestroyWindow(hTempWnd);
-			}
-			else
-			{
-				screenx = GetSystemMetrics(SM_CXSCREEN);
-				screeny = GetSystemMetrics(SM_CYSCREEN);
-				wndrect.right = dxglcfg.WindowWidth + (screenx / 2) - (dxglcfg.WindowWidth / 2);
-				wndrect.bottom = dxglcfg.WindowHeight + (screeny / 2) - (dxglcfg.WindowHeight / 2);
-				wndrect.left = (screenx / 2) - (dxglcfg.WindowWidth / 2);
-				wndrect.top = (screeny / 2) - (dxglcfg.WindowHeight / 2);
-				AdjustWindowRectEx(&wndrect, winstyle | WS_OVERLAPPEDWINDOW, FALSE, (winstyleex | WS_EX_APPWINDOW));
-			}
-			wndplace.length = sizeof(WINDOWPLACEMENT);
-			GetWindowPlacement(This->hWnd, &wndplace);
-			wndplace.flags = WPF_ASYNCWINDOWPLACEMENT;
-			if (dxglcfg.WindowMaximized == 1) wndplace.showCmd = SW_SHOWMAXIMIZED;
-			else wndplace.showCmd = SW_SHOWNORMAL;
-			wndplace.rcNormalPosition = wndrect;
-			SetWindowPlacement(This->hWnd, &wndplace);
-			break;
-		case 4:     // Windowed borderless
-			winstyle = GetWindowLongPtrA(This->hWnd, GWL_STYLE);
-			winstyleex = GetWindowLongPtrA(This->hWnd, GWL_EXSTYLE);
-			SetWindowLongPtrA(This->hWnd, GWL_EXSTYLE, winstyleex & ~(WS_EX_WINDOWEDGE | WS_EX_CLIENTEDGE));
-			SetWindowLongPtrA(This->hWnd, GWL_STYLE, winstyle & ~(WS_CAPTION | WS_THICKFRAME | WS_BORDER | WS_POPUP));
-			ShowWindow(This->hWnd, SW_NORMAL);
-			if (dxglcfg.WindowPosition == 1)
-			{
-				wndrect.left = dxglcfg.WindowX;
-				wndrect.top = dxglcfg.WindowY;
-				wndrect.right = dxglcfg.WindowX + dxglcfg.WindowWidth;
-				wndrect.bottom = dxglcfg.WindowY + dxglcfg.WindowHeight;
-			}
-			else if (dxglcfg.WindowPosition == 2)
-			{
-				wndrect.left = wndrect.top = 0;
-				wndrect.right = dxglcfg.WindowWidth;
-				wndrect.bottom = dxglcfg.WindowHeight;
-			}
-			else if (dxglcfg.WindowPosition == 3)
-			{
-				if (!wndclassdxgltempatom) RegisterDXGLTempWindowClass();
-				wndrect.left = wndrect.top = 0;
-				wndrect.right = dxglcfg.WindowWidth;
-				wndrect.bottom = dxglcfg.WindowHeight;
-				hTempWnd = CreateWindow(wndclassdxgltemp.lpszClassName, _T("DXGL Sizing Window"),
-					winstyle & ~(WS_CAPTION | WS_THICKFRAME | WS_BORDER | WS_POPUP | WS_VISIBLE), CW_USEDEFAULT, CW_USEDEFAULT,
-					wndrect.right - wndrect.left, wndrect.bottom - wndrect.top, NULL, NULL, GetModuleHandle(NULL), NULL);
-				GetWindowRect(hTempWnd, &wndrect);
-				DestroyWindow(hTempWnd);
-			}
-			else
-			{
-				screenx = GetSystemMetrics(SM_CXSCREEN);
-				screeny = GetSystemMetrics(SM_CYSCREEN);
-				wndrect.right = dxglcfg.WindowWidth + (screenx / 2) - (dxglcfg.WindowWidth / 2);
-				wndrect.bottom = dxglcfg.WindowHeight + (screeny / 2) - (dxglcfg.WindowHeight / 2);
-				wndrect.left = (screenx / 2) - (dxglcfg.WindowWidth / 2);
-				wndrect.top = (screeny / 2) - (dxglcfg.WindowHeight / 2);
-			}
-			SetWindowPos(This->hWnd, 0, wndrect.left, wndrect.top, wndrect.right - wndrect.left,
-				wndrect.bottom - wndrect.top, SWP_ASYNCWINDOWPOS | SWP_NOACTIVATE | SWP_NOOWNERZORDER);
-			break;
+			*next = *write + size;
+			if (*next == ring->cmdsize) *next = 0;
+			return TRUE;
+		}
+		if (size < read)
+		{
+			*write = 0;
+			*next = size;
+			return TRUE;
 		}
 	}
-	if(width)
+	else if ((*write + size) < read)
 	{
-		// TODO:  Adjust window rect
+		*next = *write + size;
+		return TRUE;
 	}
-	
-	SetWindowPos(This->hWnd,HWND_TOP,0,0,0,0,SWP_NOMOVE | SWP_NOSIZE | SWP_FRAMECHANGED);
-	glRenderWindow_Create(width, height, fullscreen, This->hWnd, glDD7, devwnd, &This->RenderWnd);
-	This->inputs[0] = (void*)width;
-	This->inputs[1] = (void*)height;
-	This->inputs[2] = (void*)bpp;
-	This->inputs[3] = (void*)fullscreen;
-	This->inputs[4] = (void*)frequency;
-	This->inputs[5] = (void*)This->hWnd;
-	This->inputs[6] = glDD7;
-	This->inputs[7] = This;
-	This->inputs[8] = (void*)devwnd;
-	This->hThread = CreateThread(NULL, 0, glRenderer_ThreadEntry, This->inputs, 0, &threadid);
-	WaitForSingleObject(This->busy,INFINITE);
+	return FALSE;
 }
 
-__inline BOOL UnadjustWindowRectEx(LPRECT lpRect, DWORD dwStyle, BOOL bMenu, DWORD dwExStyle)
+/**
+  * Records that the command last added to the ring reads or writes a
+  * texture level.  Must be called with the renderer lock held.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param texture
+  *  Texture used by the command, may be NULL
+  * @param level
+  *  Mipmap level used by the command
+  * @param write
+  *  TRUE if the command writes the level, FALSE if it only reads it
+  */
+static void glRenderer__MarkLevel(glRenderer *This, glTexture *texture, GLint level, BOOL write)
 {
-	RECT r;
-	ZeroMemory(&r, sizeof(RECT));
-	BOOL ret = AdjustWindowRectEx(&r, dwStyle, bMenu, dwExStyle);
-	if (!ret) return ret;
-	else
+	if (!texture) return;
+	if (write)
 	{
-		lpRect->left -= r.left;
-		lpRect->top -= r.top;
-		lpRect->right -= r.right;
-		lpRect->bottom -= r.bottom;
-		return ret;
+		texture->levels[level].writeseq = This->cmdbuffer[0].cmdseq;
+		glTexture_ChangeVersion(texture, level);
 	}
+	else texture->levels[level].readseq = This->cmdbuffer[0].cmdseq;
 }
 
 /**
-  * Deletes a glRenderer object
-  * @param This
-  *  Pointer to glRenderer object
+  * Moves a command ring sequence number forward to the last queued command
+  * that must run before a texture level is accessed.
+  * @param texture
+  *  Texture to access, may be NULL
+  * @param level
+  *  Mipmap level to access
+  * @param write
+  *  TRUE if the level is written, so queued commands reading it must also
+  *  run first
+  * @param bound
+  *  Sequence number to move forward
   */
-void glRenderer_Delete(glRenderer *This)
+static void glRenderer__LevelBound(const glTexture *texture, GLint level, BOOL write, DWORD *bound)
 {
-	BOOL hasmenu;
-	RECT wndrect;
-	LONG_PTR winstyle, winstyleex;
-	WINDOWPLACEMENT wndplace;
-	switch (dxglcfg.fullmode)
-	{
-	case 2:
-	case 3:
-	case 4:
-		wndplace.length = sizeof(WINDOWPLACEMENT);
-		GetWindowPlacement(This->hWnd, &wndplace);
-		wndrect = wndplace.rcNormalPosition;
-		if (dxglcfg.fullmode != 4)
-		{
-			winstyle = GetWindowLongPtrA(This->hWnd, GWL_STYLE);
-			winstyleex = GetWindowLongPtrA(This->hWnd, GWL_EXSTYLE);
-			if (GetMenu(This->hWnd)) hasmenu = TRUE;
-			else hasmenu = FALSE;
-			UnadjustWindowRectEx(&wndrect, winstyle, hasmenu, winstyleex);
-		}
-		dxglcfg.WindowX = wndrect.left;
-		dxglcfg.WindowY = wndrect.top;
-		dxglcfg.WindowWidth = wndrect.right - wndrect.left;
-		dxglcfg.WindowHeight = wndrect.bottom - wndrect.top;
-		if (dxglcfg.fullmode == 3)
-		{
-			if (wndplace.showCmd == SW_MAXIMIZE) dxglcfg.WindowMaximized = TRUE;
-			else dxglcfg.WindowMaximized = FALSE;
-		}
-		SaveWindowSettings(&dxglcfg);
-		break;
-	default:
-		break;
-	}
-	EnterCriticalSection(&This->cs);
-	This->opcode = OP_DELETE;
-	SetEvent(This->start);
-	WaitForObjectAndMessages(This->busy);
-	CloseHandle(This->start);
-	CloseHandle(This->busy);
-	LeaveCriticalSection(&This->cs);
-	DeleteCriticalSection(&This->cs);
-	CloseHandle(This->hThread);
+	DWORD seq;
+	if (!texture) return;
+	seq = texture->levels[level].writeseq;
+	if ((LONG)(seq - *bound) > 0) *bound = seq;
+	if (!write) return;
+	seq = texture->levels[level].readseq;
+	if ((LONG)(seq - *bound) > 0) *bound = seq;
 }
 
 /**
-  * Gets the BPP of the DirectDraw object that owns the renderer
+  * Lets the next opcode run once the command ring is executed up to a
+  * sequence number instead of after the whole ring.  Must be called with the
+  * renderer lock held, right before setting the opcode.
   * @param This
   *  Pointer to glRenderer object
+  * @param bound
+  *  Sequence number of the last command the opcode depends on
   */
-DWORD glRenderer_GetBPP(glRenderer *This)
+static void glRenderer__BoundQueue(glRenderer *This, DWORD bound)
 {
-	return This->ddInterface->primarybpp;
+	This->queueseq = bound;
+	InterlockedExchange(&This->queuebounded, TRUE);
 }
 
 /**
-  * Entry point for the renderer thread
-  * @param entry
-  *  Pointer to the inputs passed by the CreateThread function
+  * Records the textures read and written by the blt last added to the ring.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param cmd
+  *  Blt that was added
   */
-DWORD WINAPI glRenderer_ThreadEntry(void *entry)
+static void glRenderer__MarkBlt(glRenderer *This, const BltCommand *cmd)
 {
-	void **inputsin = (void**)entry;
-	glRenderer *This = (glRenderer*)inputsin[7];
-	return glRenderer__Entry(This);
+	glRenderer__MarkLevel(This, cmd->dest, cmd->destlevel, TRUE);
+	glRenderer__MarkLevel(This, cmd->src, cmd->srclevel, FALSE);
+	glRenderer__MarkLevel(This, cmd->zdest, cmd->zdestlevel, TRUE);
+	glRenderer__MarkLevel(This, cmd->zsrc, cmd->zsrclevel, FALSE);
+	glRenderer__MarkLevel(This, cmd->alphadest, cmd->alphadestlevel, TRUE);
+	glRenderer__MarkLevel(This, cmd->alphasrc, cmd->alphasrclevel, FALSE);
+	glRenderer__MarkLevel(This, cmd->pattern, cmd->patternlevel, FALSE);
 }
 
 /**
-  * Finishes creating an OpenGL texture.  
+  * Gets the last queued command a blt depends on, including the palettes and
+  * color keys of its surfaces.
   * @param This
   *  Pointer to glRenderer object
-  * @param texture
-  *  Texture object to finish creating
-  * @param wraps,wrapt
-  *  OpenGL texture wrap parameters
+  * @param cmd
+  *  Blt to run
+  * @return
+  *  Sequence number of the last command that must run before the blt
   */
-void glRenderer_MakeTexture(glRenderer *This, glTexture *texture)
+static DWORD glRenderer__BltBound(glRenderer *This, const BltCommand *cmd)
 {
-	EnterCriticalSection(&This->cs);
-	This->inputs[0] = texture;
-	This->opcode = OP_CREATE;
-	SetEvent(This->start);
-	WaitForSingleObject(This->busy,INFINITE);
-	LeaveCriticalSection(&This->cs);
+	DWORD bound = This->cmdbuffer[0].doneseq;
+	glRenderer__LevelBound(cmd->dest, cmd->destlevel, TRUE, &bound);
+	glRenderer__LevelBound(cmd->src, cmd->srclevel, FALSE, &bound);
+	glRenderer__LevelBound(cmd->zdest, cmd->zdestlevel, TRUE, &bound);
+	glRenderer__LevelBound(cmd->zsrc, cmd->zsrclevel, FALSE, &bound);
+	glRenderer__LevelBound(cmd->alphadest, cmd->alphadestlevel, TRUE, &bound);
+	glRenderer__LevelBound(cmd->alphasrc, cmd->alphasrclevel, FALSE, &bound);
+	glRenderer__LevelBound(cmd->pattern, cmd->patternlevel, FALSE, &bound);
+	if (cmd->dest) glRenderer__LevelBound(cmd->dest->palette, 0, FALSE, &bound);
+	if (cmd->src) glRenderer__LevelBound(cmd->src->palette, 0, FALSE, &bound);
+	return bound;
 }
 
 /**
-  * Uploads the content of a surface to an OpenGL texture.
+  * Checks if a command can be queued ahead of the pending draw batch.
+  * Pre-transformed draws without fog do not read the transforms, material or
+  * lights, so HUD and menu draws stay merged across updates of those.
+  * Texture changes are checked by glRenderer_SetTexture.
   * @param This
   *  Pointer to glRenderer object
-  * @param texture
-  *  Texture object to upload to
-  * @param level
-  *  Mipmap level of texture to write
+  * @param opcode
+  *  Command to be queued
+  * @return
+  *  TRUE if the pending draw batch does not depend on the command
   */
-void glRenderer_UploadTexture(glRenderer *This, glTexture *texture, GLint level) 
+static BOOL glRenderer_BatchIgnoresCommand(glRenderer *This, DWORD opcode)
 {
-	EnterCriticalSection(&This->cs);
-	This->inputs[0] = texture;
-	This->inputs[1] = (void*)level;
-	This->opcode = OP_UPLOAD;
-	SetEvent(This->start);
-	WaitForSingleObject(This->busy,INFINITE);
-	LeaveCriticalSection(&This->cs);
+	const DrawBatch *batch = &This->drawbatch;
+	if (!batch->draws) return FALSE;
+	// glRenderer_SetTexture draws the batch itself if it can't switch the texture per draw
+	if (opcode == OP_SETTEXTURE) return TRUE;
+	if (batch->fogenable) return FALSE;
+	if ((batch->fvf & D3DFVF_POSITION_MASK) != D3DFVF_XYZRHW) return FALSE;
+	switch (opcode)
+	{
+	case OP_SETTRANSFORM:
+	case OP_SETMATERIAL:
+	case OP_SETLIGHT:
+	case OP_REMOVELIGHT:
+		return TRUE;
+	default:
+		return FALSE;
+	}
 }
 
 /**
-  * Downloads the contents of an OpenGL texture to a the texture object's buffer.
+  * Adds a command to the renderer command ring, optionally without handing
+  * it to the renderer thread yet.
   * @param This
   *  Pointer to glRenderer object
-  * @param texture
-  *  Texture object to download from
-  * @param level
-  *  Mipmap level of texture to read
+  * @param opcode
+  *  Command to add to the ring
+  * @param args
+  *  Pointer to the arguments of the command, may be NULL if argsize is 0
+  * @param argsize
+  *  Size in bytes of the arguments
+  * @param hold
+  *  TRUE to hold an OP_BLT back so following matching blts can be drawn
+  *  with it.  Held commands are handed over by glRenderer_FlushBlts, by the
+  *  next command that is not held, or by a blt that does not match them.
   */
-void glRenderer_DownloadTexture(glRenderer *This, glTexture *texture, GLint level)
+static void glRenderer_AddCommandEx(glRenderer *This, DWORD opcode, const void *args, size_t argsize, BOOL hold)
 {
+	CmdBuffer *ring = &This->cmdbuffer[0];
+	size_t size = (FIELD_OFFSET(QueueCmd, args) + argsize + 7) & ~7;
+	size_t write, next;
+	QueueCmd *wrap;
+	QueueCmd *cmd;
 	EnterCriticalSection(&This->cs);
-	This->inputs[0] = texture;
-	This->inputs[1] = (void*)level;
-	This->opcode = OP_DOWNLOAD;
-	SetEvent(This->start);
-	WaitForSingleObject(This->busy,INFINITE);
+	InterlockedIncrement(&This->perf.commands);
+	// Merged draws must run before any state change or blt queued after them
+	if (!glRenderer_BatchIgnoresCommand(This, opcode)) glRenderer_FlushDraws(This);
+	if (!ring->cmdbuffer)
+	{
+		// Renderer failed to initialize, nothing to execute the command
+		LeaveCriticalSection(&This->cs);
+		return;
+	}
+	while (!glRenderer__FindRoom(ring, size, &write, &next))
+		glRenderer_Sync(This);
+	if (write != ring->writeptr)
+	{
+		// Not enough room at the end, mark the wrap and start over
+		wrap = (QueueCmd*)((BYTE*)ring->cmdbuffer + ring->writeptr);
+		wrap->opcode = OP_NULL;
+		wrap->size = 0;
+	}
+	cmd = (QueueCmd*)((BYTE*)ring->cmdbuffer + write);
+	cmd->opcode = opcode;
+	cmd->size = (DWORD)size;
+	if (argsize) memcpy(&cmd->args, args, argsize);
+	ring->writeptr = next;
+	ring->cmdseq++;
+	if (hold)
+	{
+		// A different blt ends the run; hand over the held blts before it
+		if (ring->heldblt && !glRenderer__BltMatches(ring->heldblt, &cmd->args.blt))
+		{
+			ring->cmdptr = write;
+			glRenderer_Wake(This);
+		}
+		ring->heldblt = &cmd->args.blt;
+		LeaveCriticalSection(&This->cs);
+		return;
+	}
+	// cmdptr is volatile so the store is not reordered before the copy
+	ring->cmdptr = next;
+	ring->heldblt = NULL;
+	glRenderer_Wake(This);
 	LeaveCriticalSection(&This->cs);
 }
 
 /**
-  * Deletes an OpenGL texture.
+  * Hands blts held back for coalescing over to the renderer thread.
+  * Must be called before anything that depends on the result of a blt,
+  * and before setting an opcode so the held blts run before it.
   * @param This
   *  Pointer to glRenderer object
-  * @param texture
-  *  OpenGL texture to be deleted
   */
-void glRenderer_DeleteTexture(glRenderer *This, glTexture * texture)
+static void glRenderer_FlushBlts(glRenderer *This)
 {
+	CmdBuffer *ring = &This->cmdbuffer[0];
 	EnterCriticalSection(&This->cs);
-	This->inputs[0] = texture;
-	This->opcode = OP_DELETETEX;
-	SetEvent(This->start);
-	WaitForSingleObject(This->busy,INFINITE);
+	if (ring->heldblt)
+	{
+		ring->cmdptr = ring->writeptr;
+		ring->heldblt = NULL;
+		glRenderer_Wake(This);
+	}
+	glRenderer_FlushDraws(This);
 	LeaveCriticalSection(&This->cs);
 }
 
 /**
-  * Copies part or all of the contents of one texture to another.
+  * Draws the 3D draws held back for merging.  Called by glRenderer_FlushBlts
+  * and before queueing a command, so every call that may change state or read
+  * the render target draws them first.  Does not touch the inputs, so it
+  * may be called after a caller has set them up.
   * @param This
   *  Pointer to glRenderer object
-  * @param cmd
-  *  Pointer to structure contaning all paramaters for a Blt operation.
-  * @return
-  *  DD_OK if the call succeeds, or DDERR_WASSTILLDRAWING if queue is full and not waiting.
   */
-HRESULT glRenderer_Blt(glRenderer *This, BltCommand *cmd)
+static void glRenderer_FlushDraws(glRenderer *This)
 {
-	/*BltCmd bltcmd;
-	bltcmd.opcode = OP_DELETE;
-	bltcmd.zise = sizeof(BltCmd) - 8;
-	bltcmd.cmd = *cmd;
-	glRenderer_AddCommand(This, (BYTE*)&bltcmd);*/
 	EnterCriticalSection(&This->cs);
-	RECT r,r2;
-	if(((cmd->dest->levels[0].ddsd.ddsCaps.dwCaps & (DDSCAPS_FRONTBUFFER)) &&
-		(cmd->dest->levels[0].ddsd.ddsCaps.dwCaps & DDSCAPS_PRIMARYSURFACE)) ||
-		((cmd->dest->levels[0].ddsd.ddsCaps.dwCaps & DDSCAPS_PRIMARYSURFACE) &&
-		!(cmd->dest->levels[0].ddsd.ddsCaps.dwCaps & DDSCAPS_FLIP)))
+	if (This->drawbatch.draws)
 	{
-		_GetClientRect(This->hWnd,&r);
-		GetClientRect(This->RenderWnd->hWnd,&r2);
-		if(memcmp(&r2,&r,sizeof(RECT)) != 0)
-			SetWindowPos(This->RenderWnd->hWnd,NULL,0,0,r.right,r.bottom,SWP_SHOWWINDOW);
+		This->opcode = OP_DRAWBATCH;
+		glRenderer_Wake(This);
+		glRenderer_WaitForThread(This, OP_DRAWBATCH);
+		This->drawbatch.vertexcount = 0;
+		This->drawbatch.indexcount = 0;
+		This->drawbatch.draws = 0;
 	}
-	This->inputs[0] = cmd;
-	This->opcode = OP_BLT;
-	SetEvent(This->start);
-	WaitForSingleObject(This->busy,INFINITE);
 	LeaveCriticalSection(&This->cs);
-	return (HRESULT)This->outputs[0];
 }
 
 /**
-  * Updates the display with the current primary texture.
+  * Checks if the pending draw batch can go on with a different texture in a
+  * stage, drawing the following draws with it while the earlier draws keep
+  * their own.  The generated shader must stay the same, so the stage must
+  * keep having a texture, and textures with a color key need their key in
+  * the uniforms of the shader.
   * @param This
   *  Pointer to glRenderer object
+  * @param stage
+  *  Texture stage being set
   * @param texture
-  *  Texture to use as the primary
-  * @param paltex
-  *  Texture that contains the color palette for 8-bit modes
-  * @param vsync
-  *  Vertical sync count
-  * @param previous
-  *  Texture previously used as primary before a flip
+  *  Texture to set to the stage, NULL to unbind
+  * @return
+  *  TRUE if the batch can stay pending
   */
-void glRenderer_DrawScreen(glRenderer *This, glTexture *texture, glTexture *paltex, GLint vsync, glTexture *previous, BOOL settime, OVERLAY *overlays, int overlaycount)
+static BOOL glRenderer_BatchSwitchesTexture(glRenderer *This, DWORD stage, glTexture *texture)
 {
-	EnterCriticalSection(&This->cs);
-	This->inputs[0] = texture;
-	This->inputs[1] = paltex;
-	This->inputs[2] = (void*)vsync;
-	This->inputs[3] = previous;
-	This->inputs[4] = (void*)settime;
-	This->inputs[5] = overlays;
-	This->inputs[6] = (void*)overlaycount;
-	This->opcode = OP_DRAWSCREEN;
-	SetEvent(This->start);
-	WaitForSingleObject(This->busy,INFINITE);
-	LeaveCriticalSection(&This->cs);
+	const DrawBatch *batch = &This->drawbatch;
+	glTexture *current;
+	if (!batch->draws || !batch->commands || (stage >= 8)) return FALSE;
+	current = batch->textures[stage];
+	if (current == texture) return TRUE;
+	if (!current || !texture) return FALSE;
+	if ((current->levels[0].ddsd.dwFlags | texture->levels[0].ddsd.dwFlags) & DDSD_CKSRCBLT) return FALSE;
+	return TRUE;
 }
 
 /**
-  * Ensures the renderer is set up for handling Direct3D commands.
-  * @param This
-  *  Pointer to glRenderer object
-  * @param zbuffer
-  *  Nonzero if a Z buffer is present.
-  * @param x
-  *  Width of the initial viewport
-  * @param y
-  *  Height of the initial viewport
+  * Gets the size of a vertex in a flexible vertex format.
+  * @param fvf
+  *  Flexible vertex format
+  * @return
+  *  Size of a vertex in bytes, or 0 if the format has no position
   */
-void glRenderer_InitD3D(glRenderer *This, int zbuffer, int x, int y)
+static GLsizei glRenderer_GetFVFStride(DWORD fvf)
 {
-	EnterCriticalSection(&This->cs);
-	This->inputs[0] = (void*)zbuffer;
-	This->inputs[1] = (void*)x;
-	This->inputs[2] = (void*)y;
-	This->opcode = OP_INITD3D;
-	SetEvent(This->start);
-	WaitForSingleObject(This->busy,INFINITE);
-	LeaveCriticalSection(&This->cs);
+	static const int texsizes[4] = { 2, 3, 4, 1 };
+	GLsizei stride;
+	int numtex;
+	int i;
+	switch (fvf & D3DFVF_POSITION_MASK)
+	{
+	case 0:
+		return 0;
+	case D3DFVF_XYZ:
+		stride = 3 * sizeof(GLfloat);
+		if (fvf & D3DFVF_RESERVED1) stride += sizeof(DWORD);
+		break;
+	default: // Reciprocal W or blend weights
+		stride = (((fvf & D3DFVF_POSITION_MASK) >> 1) + 1) * sizeof(GLfloat);
+		break;
+	}
+	if (fvf & D3DFVF_NORMAL) stride += 3 * sizeof(GLfloat);
+	if (fvf & D3DFVF_DIFFUSE) stride += sizeof(DWORD);
+	if (fvf & D3DFVF_SPECULAR) stride += sizeof(DWORD);
+	numtex = (fvf & D3DFVF_TEXCOUNT_MASK) >> D3DFVF_TEXCOUNT_SHIFT;
+	if (numtex > 8) numtex = 8;
+	for (i = 0; i < numtex; i++)
+		stride += texsizes[(fvf >> (16 + (2 * i))) & 3] * sizeof(GLfloat);
+	return stride;
 }
 
 /**
-  * Clears the viewport.
+  * Makes room for more vertices and indices in the pending draw batch,
+  * widening its indices to 32 bits if the vertices no longer fit 16-bit ones.
+  * @param batch
+  *  Pointer to the draw batch
+  * @param vertexbytes
+  *  Size in bytes of the vertices to add
+  * @param indexcount
+  *  Number of indices to add
+  * @param lastvertex
+  *  Highest vertex index the batch will use
+  * @param restart
+  *  TRUE if the batch uses the primitive restart index, which 16-bit
+  *  indices cannot also use as a vertex index
+  * @return
+  *  TRUE if the batch has room, FALSE if out of memory
+  */
+static BOOL glRenderer_GrowBatch(DrawBatch *batch, DWORD vertexbytes, DWORD indexcount, DWORD lastvertex, BOOL restart)
+{
+	DWORD newmax;
+	DWORD indexsize;
+	DWORD i;
+	void *ptr;
+	if ((batch->vertexcount * batch->stride) + vertexbytes > batch->vertexmax)
+	{
+		newmax = batch->vertexmax ? batch->vertexmax : (DRAWBATCH_MAXVERTICES * 64);
+		while (newmax < (batch->vertexcount * batch->stride) + vertexbytes) newmax *= 2;
+		ptr = realloc(batch->vertices, newmax);
+		if (!ptr) return FALSE;
+		batch->vertices = (BYTE*)ptr;
+		batch->vertexmax = newmax;
+	}
+	if ((batch->indextype == GL_UNSIGNED_SHORT) && (lastvertex >= (restart ? 0xFFFFu : 0x10000u)))
+	{
+		// Widen in place from the end so no index is overwritten before it is read
+		if (batch->indexcount * sizeof(GLuint) > batch->indexmax)
+		{
+			ptr = realloc(batch->indices, batch->indexcount * sizeof(GLuint));
+			if (!ptr) return FALSE;
+			batch->indices = ptr;
+			batch->indexmax = batch->indexcount * sizeof(GLuint);
+		}
+		for (i = batch->indexcount; i > 0; i--)
+		{
+			if (((GLushort*)batch->indices)[i - 1] == 0xFFFF) ((GLuint*)batch->indices)[i - 1] = 0xFFFFFFFF;
+			else ((GLuint*)batch->indices)[i - 1] = ((GLushort*)batch->indices)[i - 1];
+		}
+		batch->indextype = GL_UNSIGNED_INT;
+	}
+	indexsize = (batch->indextype == GL_UNSIGNED_INT) ? sizeof(GLuint) : sizeof(GLushort);
+	if ((batch->indexcount + indexcount) * indexsize > batch->indexmax)
+	{
+		newmax = batch->indexmax ? batch->indexmax : (DRAWBATCH_MAXVERTICES * 3 * sizeof(GLushort));
+		while (newmax < (batch->indexcount + indexcount) * indexsize) newmax *= 2;
+		ptr = realloc(batch->indices, newmax);
+		if (!ptr) return FALSE;
+		batch->indices = ptr;
+		batch->indexmax = newmax;
+	}
+	return TRUE;
+}
+
+/**
+  * Stores an index in the pending draw batch.
+  * @param batch
+  *  Pointer to the draw batch
+  * @param pos
+  *  Pointer to the position to store the index at, incremented afterwards
+  * @param index
+  *  Vertex index to store, 0xFFFFFFFF for the primitive restart index
+  */
+static void glRenderer_PutBatchIndex(DrawBatch *batch, DWORD *pos, DWORD index)
+{
+	if (batch->indextype == GL_UNSIGNED_INT) ((GLuint*)batch->indices)[(*pos)++] = index;
+	else ((GLushort*)batch->indices)[(*pos)++] = (GLushort)index;
+}
+
+/**
+  * Adds a draw to the pending draw batch, drawing the batch first if the draw
+  * cannot be merged with it.
   * @param This
   *  Pointer to glRenderer object
-  * @param cmd
-  *  Pointer to structure contaning all paramaters for a Clear operation.
+  * @param target
+  *  Textures and mip levels of the render target
+  * @param mode
+  *  OpenGL primitive drawing mode of the draw
+  * @param fvf
+  *  Flexible vertex format of the vertex data
+  * @param vertices
+  *  Interleaved vertex data in application memory
+  * @param count
+  *  Number of vertices
+  * @param indices
+  *  Vertex indices, or NULL for non-indexed mode
+  * @param indexcount
+  *  Number of vertex indices
   * @return
-  *  Returns D3D_OK
+  *  TRUE if the draw was added, FALSE if it must be drawn on its own
   */
-HRESULT glRenderer_Clear(glRenderer *This, ClearCommand *cmd)
+static BOOL glRenderer_BatchDraw(glRenderer *This, RenderTarget *target, GLenum mode, DWORD fvf,
+	BYTE *vertices, DWORD count, LPWORD indices, DWORD indexcount)
 {
-	EnterCriticalSection(&This->cs);
-	This->inputs[0] = cmd;
-	This->opcode = OP_CLEAR;
-	SetEvent(This->start);
-	WaitForSingleObject(This->busy,INFINITE);
-	LeaveCriticalSection(&This->cs);
-	return (HRESULT)This->outputs[0];
+	DrawBatch *batch = &This->drawbatch;
+	GLenum listmode;
+	GLenum batchmode;
+	GLsizei stride;
+	DWORD n = indices ? indexcount : count;
+	DWORD listindices;
+	DWORD newindices;
+	DWORD maxbytes;
+	DWORD base;
+	DWORD pos;
+	DWORD first;
+	DWORD i;
+	BOOL restart = FALSE;
+	if ((count > DRAWBATCH_MAXVERTICES) || !count) return FALSE;
+	switch (mode)
+	{
+	case GL_POINTS:
+		listmode = GL_POINTS;
+		listindices = n;
+		break;
+	case GL_LINES:
+		listmode = GL_LINES;
+		listindices = n & ~1;
+		break;
+	case GL_LINE_STRIP:
+		listmode = GL_LINES;
+		listindices = (n > 1) ? 2 * (n - 1) : 0;
+		restart = TRUE;
+		break;
+	case GL_TRIANGLES:
+		listmode = GL_TRIANGLES;
+		listindices = n - (n % 3);
+		break;
+	case GL_TRIANGLE_STRIP:
+	case GL_TRIANGLE_FAN:
+		listmode = GL_TRIANGLES;
+		listindices = (n > 2) ? 3 * (n - 2) : 0;
+		restart = TRUE;
+		break;
+	default:
+		return FALSE;
+	}
+	if (!listindices) return FALSE;
+	// Strips and fans stay as they are when they can be separated by restart indices
+	if (!This->ext || !This->ext->GLEXT_ARB_ES3_compatibility) restart = FALSE;
+	stride = glRenderer_GetFVFStride(fvf);
+	if (!stride) return FALSE;
+	// Keep the batch small enough to be streamed in one region of the vertex buffer
+	if (dxglcfg.VertexBufferSize) maxbytes = (dxglcfg.VertexBufferSize * 1024) / (STREAMBUFFER_SEGMENTS * 2);
+	else maxbytes = (4096 * 1024) / (STREAMBUFFER_SEGMENTS * 2);
+	if (batch->draws && ((batch->fvf != fvf) ||
+		(batch->target.target != target->target) || (batch->target.level != target->level) ||
+		(batch->target.zbuffer != target->zbuffer) || (batch->target.zlevel != target->zlevel) ||
+		((batch->vertexcount + count) * stride > maxbytes) ||
+		(batch->commands && (batch->draws >= DRAWBATCH_MAXDRAWS))))
+		glRenderer_FlushDraws(This);
+	if (This->batchtextures && !batch->commands && !batch->draws)
+	{
+		batch->commands = (DrawBatchCommand*)malloc(DRAWBATCH_MAXDRAWS * sizeof(DrawBatchCommand));
+		batch->drawtextures = (glTexture**)malloc(DRAWBATCH_MAXDRAWS * 8 * sizeof(glTexture*));
+		if (!batch->commands || !batch->drawtextures)
+		{
+			if (batch->commands) free(batch->commands);
+			if (batch->drawtextures) free(batch->drawtextures);
+			batch->commands = NULL;
+			batch->drawtextures = NULL;
+			This->batchtextures = FALSE;
+		}
+	}
+	if (batch->draws && restart && (batch->mode == mode))
+	{
+		batchmode = mode;
+		newindices = n + 1;
+	}
+	else if (batch->draws && (batch->mode == listmode))
+	{
+		batchmode = listmode;
+		newindices = listindices;
+		restart = FALSE;
+	}
+	else
+	{
+		glRenderer_FlushDraws(This);
+		glRenderer_FlushBlts(This);
+		batchmode = restart ? mode : listmode;
+		newindices = restart ? n : listindices;
+		batch->target = *target;
+		batch->mode = batchmode;
+		batch->fvf = fvf;
+		batch->stride = stride;
+		batch->indextype = GL_UNSIGNED_SHORT;
+		batch->texchanged = FALSE;
+	}
+	if (!glRenderer_GrowBatch(batch, count * stride, newindices, batch->vertexcount + count - 1,
+		(batchmode != listmode)))
+		return FALSE;
+	base = batch->vertexcount;
+	memcpy(batch->vertices + (base * stride), vertices, count * stride);
+	pos = batch->indexcount;
+	first = pos;
+	// Rebase the indices to the batch, reading the draw's own indices if it has any
+	#define BATCHINDEX(x) (base + (indices ? indices[x] : (x)))
+	if (batchmode != listmode)
+	{
+		if (batch->draws) glRenderer_PutBatchIndex(batch, &pos, 0xFFFFFFFF);
+		first = pos;
+		for (i = 0; i < n; i++)
+			glRenderer_PutBatchIndex(batch, &pos, BATCHINDEX(i));
+	}
+	else switch (mode)
+	{
+	case GL_POINTS:
+	case GL_LINES:
+	case GL_TRIANGLES:
+		for (i = 0; i < listindices; i++)
+			glRenderer_PutBatchIndex(batch, &pos, BATCHINDEX(i));
+		break;
+	case GL_LINE_STRIP:
+		for (i = 0; i < n - 1; i++)
+		{
+			glRenderer_PutBatchIndex(batch, &pos, BATCHINDEX(i));
+			glRenderer_PutBatchIndex(batch, &pos, BATCHINDEX(i + 1));
+		}
+		break;
+	case GL_TRIANGLE_STRIP:
+		for (i = 0; i < n - 2; i++)
+		{
+			// Every other triangle of a strip is wound the other way
+			glRenderer_PutBatchIndex(batch, &pos, BATCHINDEX((i & 1) ? i + 1 : i));
+			glRenderer_PutBatchIndex(batch, &pos, BATCHINDEX((i & 1) ? i : i + 1));
+			glRenderer_PutBatchIndex(batch, &pos, BATCHINDEX(i + 2));
+		}
+		break;
+	case GL_TRIANGLE_FAN:
+		for (i = 0; i < n - 2; i++)
+		{
+			glRenderer_PutBatchIndex(batch, &pos, BATCHINDEX(0));
+			glRenderer_PutBatchIndex(batch, &pos, BATCHINDEX(i + 1));
+			glRenderer_PutBatchIndex(batch, &pos, BATCHINDEX(i + 2));
+		}
+		break;
+	}
+	#undef BATCHINDEX
+	if (batch->commands)
+	{
+		// Each draw keeps its indices and textures for drawing with switched textures
+		batch->commands[batch->draws].count = pos - first;
+		batch->commands[batch->draws].instancecount = 1;
+		batch->commands[batch->draws].firstindex = first;
+		batch->commands[batch->draws].basevertex = 0;
+		batch->commands[batch->draws].baseinstance = 0;
+		memcpy(&batch->drawtextures[batch->draws * 8], batch->textures, 8 * sizeof(glTexture*));
+		if (batch->draws && memcmp(batch->drawtextures, batch->textures, 8 * sizeof(glTexture*)))
+			batch->texchanged = TRUE;
+	}
+	batch->vertexcount += count;
+	batch->indexcount = pos;
+	batch->draws++;
+	return TRUE;
 }
 
 /**
-  * Instructs the OpenGL driver to send all queued commands to the GPU.
+  * Signals the renderer thread that there is work to do.  The start event is
+  * only set if the renderer thread has stopped spinning and parked on it, so
+  * a busy renderer thread picks up new commands without a kernel transition.
   * @param This
   *  Pointer to glRenderer object
   */
-void glRenderer_Flush(glRenderer *This)
+static void glRenderer_Wake(glRenderer *This)
 {
-	EnterCriticalSection(&This->cs);
-	This->opcode = OP_FLUSH;
-	SetEvent(This->start);
-	WaitForSingleObject(This->busy,INFINITE);
-	LeaveCriticalSection(&This->cs);
+	if (InterlockedCompareExchange(&This->parked, FALSE, TRUE)) SetEvent(This->start);
 }
 
 /**
-  * Changes the window used for rendering.
+  * Waits for the renderer thread to finish the current command, counting the
+  * time the calling thread was held up.
   * @param This
   *  Pointer to glRenderer object
-  * @param width,height
-  *  Width and height of the new window.
+  * @param opcode
+  *  Command being waited for, names the wait in the timeline
+  */
+static void glRenderer_WaitForThread(glRenderer *This, int opcode)
+{
+	LARGE_INTEGER start, end;
+	QueryPerformanceCounter(&start);
+	WaitForSingleObject(This->busy, INFINITE);
+	QueryPerformanceCounter(&end);
+	PerfCounters_AddWait(&This->perf, end.QuadPart - start.QuadPart);
+	if (This->timeline)
+		Timeline_AddSpan(This->timeline, glRenderer__OpcodeName(opcode), "wait", start.QuadPart, end.QuadPart);
+}
+
+/**
+  * Waits for the renderer thread to run the command ring up to a sequence
+  * number.  Called without the renderer lock, so other threads can keep
+  * queueing commands and the renderer thread keeps running while waiting.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param bound
+  *  Sequence number of the last command to wait for
+  * @param opcode
+  *  Command the wait is for, names the wait in the timeline
+  */
+static void glRenderer_WaitForSequence(glRenderer *This, DWORD bound, int opcode)
+{
+	CmdBuffer *ring = &This->cmdbuffer[0];
+	LARGE_INTEGER start, end;
+	QueryPerformanceCounter(&start);
+	InterlockedIncrement(&This->seqwaiters);
+	// An empty ring has run everything handed to it, including commands from before a reset
+	while (((LONG)(bound - ring->doneseq) > 0) && (ring->readptr != ring->cmdptr))
+		WaitForSingleObject(This->progress, INFINITE);
+	// Each finished command wakes one waiter, which passes it on to the others
+	if (InterlockedDecrement(&This->seqwaiters)) SetEvent(This->progress);
+	QueryPerformanceCounter(&end);
+	PerfCounters_AddWait(&This->perf, end.QuadPart - start.QuadPart);
+	if (This->timeline)
+		Timeline_AddSpan(This->timeline, glRenderer__OpcodeName(opcode), "wait", start.QuadPart, end.QuadPart);
+}
+
+/**
+  * Initializes a glRenderer object
+  * @param This
+  *  Pointer to glRenderer object to initialize
+  * @param width,height,bpp
+  *  Width, height, and BPP of the rendering window
   * @param fullscreen
-  *  True if fullscreen
-  * @param newwnd
-  *  HWND of the new window
+  *  True if fullscreen mode is required, false for windowed
+  * @param hwnd
+  *  Handle of the window to render into.  If this value is NULL, then a transparent
+  *  layered window will be created for the renderer.
+  * @param glDD7
+  *  Pointer to the glDirectDraw7 object that is managing the glRenderer object
   * @param devwnd
   *  True if creating window with name "DirectDrawDeviceWnd"
   */
-void glRenderer_SetWnd(glRenderer *This, int width, int height, int bpp, int fullscreen, unsigned int frequency, HWND newwnd, BOOL devwnd)
+void glRenderer_Init(glRenderer *This, int width, int height, int bpp, BOOL fullscreen, unsigned int frequency, HWND hwnd, glDirectDraw7 *glDD7, BOOL devwnd)
 {
-	RECT wndrect, wndrect2;
+	RECT wndrect;
 	WINDOWPLACEMENT wndplace;
-	BOOL hasmenu;
 	int screenx, screeny;
 	LONG_PTR winstyle, winstyleex;
-	EnterCriticalSection(&This->cs);
-	if(fullscreen && newwnd)
+	This->oldswap = 0;
+	This->fogcolor = 0;
+	This->fogstart = 0.0f;
+	This->fogend = 1.0f;
+	This->fogdensity = 1.0f;
+	ZeroMemory(&This->backbuffers, 16 * sizeof(glTexture));
+	This->hDC = NULL;
+	This->hRC = NULL;
+	This->affinitydc = NULL;
+	ZeroMemory(This->pbo, DIB_READBACK_BUFFERS * sizeof(BufferObject*));
+	ZeroMemory(This->pbofences, DIB_READBACK_BUFFERS * sizeof(GLsync));
+	This->pboframe = 0;
+	This->pbopending = -1;
+	ZeroMemory(&This->dibflip, sizeof(glTexture));
+	ZeroMemory(&This->gammatexture, sizeof(glTexture));
+	This->gammaenabled = FALSE;
+	This->overlays = NULL;
+	This->overlaycount = 0;
+	This->maxoverlays = 0;
+	This->uploads = NULL;
+	This->uploadcount = This->maxuploads = 0;
+	This->uploadbytes = This->uploadpeak = 0;
+	This->uploadframes = 0;
+	This->readbacktexture = NULL;
+	This->readbacklevel = 0;
+	This->scenetexture = NULL;
+	This->scenelevel = 0;
+	This->texpool = NULL;
+	This->arena = NULL;
+	This->residency = NULL;
+	This->atlas = NULL;
+	This->postprocess = NULL;
+	This->timeline = NULL;
+	This->shadertiming = NULL;
+	This->framecapture = NULL;
+	This->latency = NULL;
+	This->dwmsync = NULL;
+	This->vblanknotify = NULL;
+	This->capture = NULL;
+	This->presenter = NULL;
+	This->dxgioutput = NULL;
+	ZeroMemory(&This->dxgiframe, sizeof(glTexture));
+	ZeroMemory(&This->dxgifbo, sizeof(FBO));
+	This->dxgidrawing = FALSE;
+	This->debugdepth = NULL;
+	This->cliprebuilds = 0;
+	ZeroMemory(This->framefences, FRAMEPACING_MAXFRAMES * sizeof(GLsync));
+	This->framefence = 0;
+	This->scrolltexture = NULL;
+	This->borderpbo = NULL;
+	This->borderfence = NULL;
+	This->bordertexture = NULL;
+	This->borderpixel = 0;
+	This->bordervalid = FALSE;
+	This->palettetexture = NULL;
+	This->palettestart = 0;
+	This->paletteend = 0;
+	This->recomposite = NULL;
+	This->recompositevsync = 0;
+	This->recompositetime = FALSE;
+	This->bltbatch = NULL;
+	This->bltbatchvertices = NULL;
+	This->bltbatchindices = NULL;
+	ZeroMemory(&This->drawbatch, sizeof(DrawBatch));
+	This->batchtextures = FALSE;
+	This->indirectbatch = NULL;
+	This->batchhandles = FALSE;
+	This->drawhandles = NULL;
+	This->indirect = NULL;
+	PerfCounters_Init(&This->perf);
+	This->last_fvf = 0xFFFFFFFF; // Bogus value to force initial FVF change
+	This->shaderkeydirty = TRUE;
+	This->mode_3d = FALSE;
+	ZeroMemory(&This->dib, sizeof(DIB));
+	This->hWnd = hwnd;
+	This->wndchanged = TRUE;
+	ZeroMemory(&This->wndrect, sizeof(RECT));
+	InitializeCriticalSectionAndSpinCount(&This->cs, dxglcfg.MaxSpinCount);
+	This->parked = FALSE;
+	This->busy = CreateEvent(NULL,FALSE,FALSE,NULL);
+	This->start = CreateEvent(NULL,FALSE,FALSE,NULL);
+	This->progress = CreateEvent(NULL,FALSE,FALSE,NULL);
+	This->seqwaiters = 0;
+	This->ready = CreateEvent(NULL,TRUE,FALSE,NULL);
+	This->timer.lastdrawmeasured = FALSE;
+	HWND hTempWnd;
+	DWORD threadid;
+	if(fullscreen)
 	{
 		switch (dxglcfg.fullmode)
 		{
 		case 0:    // Fullscreen
-			/*winstyle = GetWindowLongPtrA(newwnd, GWL_STYLE);
-			winstyleex = GetWindowLongPtrA(newwnd, GWL_EXSTYLE);
-			SetWindowLongPtrA(newwnd, GWL_EXSTYLE, winstyleex & ~(WS_EX_WINDOWEDGE | WS_EX_CLIENTEDGE));
-			SetWindowLongPtrA(newwnd, GWL_STYLE, (winstyle | WS_POPUP) & ~(WS_CAPTION | WS_THICKFRAME | WS_BORDER));
-			ShowWindow(newwnd, SW_MAXIMIZE);*/  //This seems to cause a black screen in some cases
-			SetWindowLongPtrA(newwnd, GWL_EXSTYLE, WS_EX_APPWINDOW);
-			SetWindowLongPtrA(newwnd, GWL_STYLE, WS_OVERLAPPED|WS_POPUP);
-			ShowWindow(newwnd, SW_MAXIMIZE);
+			winstyle = GetWindowLongPtrA(This->hWnd, GWL_STYLE);
+			winstyleex = GetWindowLongPtrA(This->hWnd, GWL_EXSTYLE);
+			SetWindowLongPtrA(This->hWnd, GWL_EXSTYLE, winstyleex & ~(WS_EX_WINDOWEDGE | WS_EX_CLIENTEDGE));
+			SetWindowLongPtrA(This->hWnd, GWL_STYLE, (winstyle | WS_POPUP) & ~(WS_CAPTION | WS_THICKFRAME | WS_BORDER));
+			// Maximizing fills the monitor the window is on, so move it to the selected one first
+			Adapter_MoveWindow(This->hWnd, &glDD7->adapter);
+			ShowWindow(This->hWnd, SW_MAXIMIZE);
 			break;
 		case 1:    // Non-exclusive Fullscreen
 		case 5:    // Windowed borderless scaled
-			/*winstyle = GetWindowLongPtrA(newwnd, GWL_STYLE);
-			winstyleex = GetWindowLongPtrA(newwnd, GWL_EXSTYLE);
-			SetWindowLongPtrA(newwnd, GWL_EXSTYLE, winstyleex & ~(WS_EX_WINDOWEDGE | WS_EX_CLIENTEDGE));
-			SetWindowLongPtrA(newwnd, GWL_STYLE, winstyle & ~(WS_CAPTION | WS_THICKFRAME | WS_BORDER | WS_POPUP));
-			ShowWindow(newwnd, SW_MAXIMIZE);*/  //This seems to cause a black screen in some cases
-			SetWindowLongPtrA(newwnd, GWL_EXSTYLE, WS_EX_APPWINDOW);
-			SetWindowLongPtrA(newwnd, GWL_STYLE, WS_OVERLAPPED);
-			ShowWindow(newwnd, SW_MAXIMIZE);
+			winstyle = GetWindowLongPtrA(This->hWnd, GWL_STYLE);
+			winstyleex = GetWindowLongPtrA(This->hWnd, GWL_EXSTYLE);
+			SetWindowLongPtrA(This->hWnd, GWL_EXSTYLE, winstyleex & ~(WS_EX_WINDOWEDGE | WS_EX_CLIENTEDGE));
+			SetWindowLongPtrA(This->hWnd, GWL_STYLE, winstyle & ~(WS_CAPTION | WS_THICKFRAME | WS_BORDER | WS_POPUP));
+			Adapter_MoveWindow(This->hWnd, &glDD7->adapter);
+			ShowWindow(This->hWnd, SW_MAXIMIZE);
 			break;
-		case 2:     // Windowed
-			winstyle = GetWindowLongPtrA(newwnd, GWL_STYLE);
-			winstyleex = GetWindowLongPtrA(newwnd, GWL_EXSTYLE);
-			SetWindowLongPtrA(newwnd, GWL_EXSTYLE, winstyleex | WS_EX_APPWINDOW);
-			SetWindowLongPtrA(newwnd, GWL_STYLE, (winstyle | WS_OVERLAPPEDWINDOW) & ~(WS_THICKFRAME | WS_MAXIMIZEBOX | WS_POPUP));
-			ShowWindow(newwnd, SW_NORMAL);
-			if ((dxglcfg.WindowPosition == 1) || (dxglcfg.WindowPosition == 3))
+		case 2:     // Windowed non-resizable
+			winstyle = GetWindowLongPtrA(This->hWnd, GWL_STYLE);
+			winstyleex = GetWindowLongPtrA(This->hWnd, GWL_EXSTYLE);
+			SetWindowLongPtrA(This->hWnd, GWL_EXSTYLE, winstyleex | WS_EX_APPWINDOW);
+			SetWindowLongPtrA(This->hWnd, GWL_STYLE, (winstyle | WS_OVERLAPPEDWINDOW) & ~(WS_THICKFRAME | WS_MAXIMIZEBOX | WS_POPUP));
+			ShowWindow(This->hWnd, SW_NORMAL);
+			if (dxglcfg.WindowPosition == 1)
 			{
-				GetWindowRect(newwnd, &wndrect);
-				if (GetMenu(newwnd)) hasmenu = TRUE;
-				else hasmenu = FALSE;
-				UnadjustWindowRectEx(&wndrect, (winstyle | WS_OVERLAPPEDWINDOW) & ~(WS_THICKFRAME | WS_MAXIMIZEBOX | WS_POPUP),
-					hasmenu, winstyleex | WS_EX_APPWINDOW);
-				wndrect.right = wndrect.left + width;
-				wndrect.bottom = wndrect.top + height;
+				wndrect.left = dxglcfg.WindowX;
+				wndrect.top = dxglcfg.WindowY;
+				wndrect.right = dxglcfg.WindowX + dxglcfg.WindowWidth;
+				wndrect.bottom = dxglcfg.WindowY + dxglcfg.WindowHeight;
 				AdjustWindowRectEx(&wndrect, (winstyle | WS_OVERLAPPEDWINDOW) & ~(WS_THICKFRAME | WS_MAXIMIZEBOX), FALSE,
 					(winstyleex | WS_EX_APPWINDOW));
 			}
 			else if (dxglcfg.WindowPosition == 2)
 			{
-				wndrect.left = 0;
-				wndrect.top = 0;
-				wndrect.right = width;
-				wndrect.bottom = height;
+				wndrect.left = wndrect.top = 0;
+				wndrect.right = dxglcfg.WindowWidth;
+				wndrect.bottom = dxglcfg.WindowHeight;
 				AdjustWindowRectEx(&wndrect, (winstyle | WS_OVERLAPPEDWINDOW) & ~(WS_THICKFRAME | WS_MAXIMIZEBOX), FALSE,
 					(winstyleex | WS_EX_APPWINDOW));
 				wndrect.right -= wndrect.left;
@@ -765,2528 +1267,6880 @@ void glRenderer_SetWnd(glRenderer *This, int width, int height, int bpp, int ful
 				wndrect.bottom -= wndrect.top;
 				wndrect.top = 0;
 			}
+			else if (dxglcfg.WindowPosition == 3)
+			{
+				if (!wndclassdxgltempatom) RegisterDXGLTempWindowClass();
+				wndrect.left = wndrect.top = 0;
+				wndrect.right = dxglcfg.WindowWidth;
+				wndrect.bottom = dxglcfg.WindowHeight;
+				AdjustWindowRectEx(&wndrect, (winstyle | WS_OVERLAPPEDWINDOW) & ~(WS_THICKFRAME | WS_MAXIMIZEBOX), FALSE,
+					(winstyleex | WS_EX_APPWINDOW));
+				hTempWnd = CreateWindow(wndclassdxgltemp.lpszClassName, _T("DXGL Sizing Window"),
+					(winstyle | WS_OVERLAPPEDWINDOW) & ~(WS_THICKFRAME | WS_MAXIMIZEBOX | WS_POPUP | WS_VISIBLE),
+					CW_USEDEFAULT, CW_USEDEFAULT, wndrect.right - wndrect.left, wndrect.bottom - wndrect.top, NULL, NULL,
+					GetModuleHandle(NULL), NULL);
+				GetWindowRect(hTempWnd, &wndrect);
+				DestroyWindow(hTempWnd);
+			}
 			else
 			{
 				screenx = GetSystemMetrics(SM_CXSCREEN);
 				screeny = GetSystemMetrics(SM_CYSCREEN);
-				wndrect.left = (screenx / 2) - (width / 2);
-				wndrect.top = (screeny / 2) - (height / 2);
-				wndrect.right = wndrect.left + width;
-				wndrect.bottom = wndrect.top + height;
+				wndrect.right = dxglcfg.WindowWidth + (screenx / 2) - (dxglcfg.WindowWidth / 2);
+				wndrect.bottom = dxglcfg.WindowHeight + (screeny / 2) - (dxglcfg.WindowHeight / 2);
+				wndrect.left = (screenx / 2) - (dxglcfg.WindowWidth / 2);
+				wndrect.top = (screeny / 2) - (dxglcfg.WindowHeight / 2);
 				AdjustWindowRectEx(&wndrect, (winstyle | WS_OVERLAPPEDWINDOW) & ~(WS_THICKFRAME | WS_MAXIMIZEBOX), FALSE,
 					(winstyleex | WS_EX_APPWINDOW));
 			}
-			dxglcfg.WindowX = wndrect.left;
-			dxglcfg.WindowY = wndrect.top;
-			dxglcfg.WindowWidth = wndrect.right - wndrect.left;
-			dxglcfg.WindowHeight = wndrect.bottom - wndrect.top;
-			SetWindowPos(newwnd, 0, wndrect.left, wndrect.top, wndrect.right - wndrect.left,
+			SetWindowPos(This->hWnd, 0, wndrect.left, wndrect.top, wndrect.right - wndrect.left,
 				wndrect.bottom - wndrect.top, SWP_ASYNCWINDOWPOS | SWP_NOACTIVATE | SWP_NOOWNERZORDER);
-			SaveWindowSettings(&dxglcfg);
 			break;
 		case 3:     // Windowed resizable
-			winstyle = GetWindowLongPtrA(newwnd, GWL_STYLE);
-			winstyleex = GetWindowLongPtrA(newwnd, GWL_EXSTYLE);
-			SetWindowLongPtrA(newwnd, GWL_EXSTYLE, winstyleex | WS_EX_APPWINDOW);
-			SetWindowLongPtrA(newwnd, GWL_STYLE, (winstyle | WS_OVERLAPPEDWINDOW) & ~WS_POPUP);
-			wndplace.length = sizeof(WINDOWPLACEMENT);
-			GetWindowPlacement(newwnd, &wndplace);
-			if(wndplace.showCmd == SW_SHOWMAXIMIZED) ShowWindow(newwnd, SW_SHOWMAXIMIZED);
-			else ShowWindow(newwnd, SW_NORMAL);
-			if ((dxglcfg.WindowPosition == 1) || (dxglcfg.WindowPosition == 3))
-			{
-				wndrect = wndplace.rcNormalPosition;
-				GetWindowRect(newwnd, &wndrect2);
-				if (GetMenu(newwnd)) hasmenu = TRUE;
-				else hasmenu = FALSE;
-				UnadjustWindowRectEx(&wndrect, (winstyle | WS_OVERLAPPEDWINDOW) & ~WS_POPUP,
-					hasmenu, (winstyleex | WS_EX_APPWINDOW));
-				UnadjustWindowRectEx(&wndrect2, (winstyle | WS_OVERLAPPEDWINDOW) & ~WS_POPUP,
-					hasmenu, (winstyleex | WS_EX_APPWINDOW));
-				if (!dxglcfg.NoResizeWindow)
-				{
-					wndrect.right = wndrect.left + width;
-					wndrect.bottom = wndrect.top + height;
-				}
+			winstyle = GetWindowLongPtrA(This->hWnd, GWL_STYLE);
+			winstyleex = GetWindowLongPtrA(This->hWnd, GWL_EXSTYLE);
+			SetWindowLongPtrA(This->hWnd, GWL_EXSTYLE, winstyleex | WS_EX_APPWINDOW);
+			SetWindowLongPtrA(This->hWnd, GWL_STYLE, (winstyle | WS_OVERLAPPEDWINDOW) & ~WS_POPUP);
+			ShowWindow(This->hWnd, SW_NORMAL);
+			if (dxglcfg.WindowPosition == 1)
+			{
+				wndrect.left = dxglcfg.WindowX;
+				wndrect.top = dxglcfg.WindowY;
+				wndrect.right = dxglcfg.WindowX + dxglcfg.WindowWidth;
+				wndrect.bottom = dxglcfg.WindowY + dxglcfg.WindowHeight;
+				AdjustWindowRectEx(&wndrect, winstyle | WS_OVERLAPPEDWINDOW, FALSE, (winstyleex | WS_EX_APPWINDOW));
 			}
 			else if (dxglcfg.WindowPosition == 2)
 			{
-				if (dxglcfg.NoResizeWindow)
-				{
-					GetWindowRect(newwnd, &wndrect2);
-					if (GetMenu(newwnd)) hasmenu = TRUE;
-					else hasmenu = FALSE;
-					UnadjustWindowRectEx(&wndrect2, (winstyle | WS_OVERLAPPEDWINDOW) & ~WS_POPUP,
-						hasmenu, (winstyleex | WS_EX_APPWINDOW));
-					glDirectDraw7_SetWindowSize(This->ddInterface,
-						wndrect2.right - wndrect2.left, wndrect2.bottom - wndrect2.top);
-					break;
-				}
-				wndrect.left = 0;
-				wndrect.top = 0;
-				wndrect.right = width;
-				wndrect.bottom = height;
+				wndrect.left = wndrect.top = 0;
+				wndrect.right = dxglcfg.WindowWidth;
+				wndrect.bottom = dxglcfg.WindowHeight;
 				AdjustWindowRectEx(&wndrect, winstyle | WS_OVERLAPPEDWINDOW, FALSE, (winstyleex | WS_EX_APPWINDOW));
 				wndrect.right -= wndrect.left;
 				wndrect.left = 0;
 				wndrect.bottom -= wndrect.top;
 				wndrect.top = 0;
 			}
+			else if (dxglcfg.WindowPosition == 3)
+			{
+				if (!wndclassdxgltempatom) RegisterDXGLTempWindowClass();
+				wndrect.left = wndrect.top = 0;
+				wndrect.right = dxglcfg.WindowWidth;
+				wndrect.bottom = dxglcfg.WindowHeight;
+				AdjustWindowRectEx(&wndrect, (winstyle | WS_OVERLAPPEDWINDOW), FALSE, (winstyleex | WS_EX_APPWINDOW));
+				hTempWnd = CreateWindow(wndclassdxgltemp.lpszClassName, _T("DXGL Sizing Window"),
+					((winstyle | WS_OVERLAPPEDWINDOW) & ~(WS_POPUP | WS_VISIBLE)), CW_USEDEFAULT, CW_USEDEFAULT,
+					wndrect.right - wndrect.left, wndrect.bottom - wndrect.top, NULL, NULL, GetModuleHandle(NULL), NULL);
+				GetWindowRect(hTempWnd, &wndrect);
+				DestroyWindow(hTempWnd);
+			}
 			else
 			{
-				if (dxglcfg.NoResizeWindow)
-				{
-					GetWindowRect(newwnd, &wndrect2);
-					if (GetMenu(newwnd)) hasmenu = TRUE;
-					else hasmenu = FALSE;
-					UnadjustWindowRectEx(&wndrect2, (winstyle | WS_OVERLAPPEDWINDOW) & ~WS_POPUP,
-						hasmenu, (winstyleex | WS_EX_APPWINDOW));
-					glDirectDraw7_SetWindowSize(This->ddInterface,
-						wndrect2.right - wndrect2.left, wndrect2.bottom - wndrect2.top);
-					break;
-				}
 				screenx = GetSystemMetrics(SM_CXSCREEN);
 				screeny = GetSystemMetrics(SM_CYSCREEN);
-				wndrect.left = (screenx / 2) - (width / 2);
-				wndrect.top = (screeny / 2) - (height / 2);
-				if (!dxglcfg.NoResizeWindow)
-				{
-					wndrect.right = wndrect.left + width;
-					wndrect.bottom = wndrect.top + height;
-				}
-			}
-			dxglcfg.WindowX = wndrect.left;
-			dxglcfg.WindowY = wndrect.top;
-			dxglcfg.WindowWidth = wndrect.right - wndrect.left;
-			dxglcfg.WindowHeight = wndrect.bottom - wndrect.top;
-			if(dxglcfg.WindowPosition != 2)
+				wndrect.right = dxglcfg.WindowWidth + (screenx / 2) - (dxglcfg.WindowWidth / 2);
+				wndrect.bottom = dxglcfg.WindowHeight + (screeny / 2) - (dxglcfg.WindowHeight / 2);
+				wndrect.left = (screenx / 2) - (dxglcfg.WindowWidth / 2);
+				wndrect.top = (screeny / 2) - (dxglcfg.WindowHeight / 2);
 				AdjustWindowRectEx(&wndrect, winstyle | WS_OVERLAPPEDWINDOW, FALSE, (winstyleex | WS_EX_APPWINDOW));
+			}
+			wndplace.length = sizeof(WINDOWPLACEMENT);
+			GetWindowPlacement(This->hWnd, &wndplace);
 			wndplace.flags = WPF_ASYNCWINDOWPLACEMENT;
-			if (!dxglcfg.NoResizeWindow) wndplace.showCmd = SW_SHOWNORMAL;
+			if (dxglcfg.WindowMaximized == 1) wndplace.showCmd = SW_SHOWMAXIMIZED;
+			else wndplace.showCmd = SW_SHOWNORMAL;
 			wndplace.rcNormalPosition = wndrect;
-			SetWindowPlacement(newwnd, &wndplace);
-			if(dxglcfg.NoResizeWindow) glDirectDraw7_SetWindowSize(This->ddInterface,
-				wndrect2.right - wndrect2.left, wndrect2.bottom - wndrect2.top);
-			SaveWindowSettings(&dxglcfg);
+			SetWindowPlacement(This->hWnd, &wndplace);
 			break;
 		case 4:     // Windowed borderless
-			winstyle = GetWindowLongPtrA(newwnd, GWL_STYLE);
-			winstyleex = GetWindowLongPtrA(newwnd, GWL_EXSTYLE);
-			SetWindowLongPtrA(newwnd, GWL_EXSTYLE, winstyleex & ~(WS_EX_WINDOWEDGE | WS_EX_CLIENTEDGE));
-			SetWindowLongPtrA(newwnd, GWL_STYLE, winstyle & ~(WS_CAPTION | WS_THICKFRAME | WS_BORDER | WS_POPUP));
-			ShowWindow(newwnd, SW_NORMAL);
-			screenx = GetSystemMetrics(SM_CXSCREEN);
-			screeny = GetSystemMetrics(SM_CYSCREEN);
-			if ((dxglcfg.WindowPosition == 1) || (dxglcfg.WindowPosition == 3))
-				GetWindowRect(newwnd, &wndrect);
+			winstyle = GetWindowLongPtrA(This->hWnd, GWL_STYLE);
+			winstyleex = GetWindowLongPtrA(This->hWnd, GWL_EXSTYLE);
+			SetWindowLongPtrA(This->hWnd, GWL_EXSTYLE, winstyleex & ~(WS_EX_WINDOWEDGE | WS_EX_CLIENTEDGE));
+			SetWindowLongPtrA(This->hWnd, GWL_STYLE, winstyle & ~(WS_CAPTION | WS_THICKFRAME | WS_BORDER | WS_POPUP));
+			ShowWindow(This->hWnd, SW_NORMAL);
+			if (dxglcfg.WindowPosition == 1)
+			{
+				wndrect.left = dxglcfg.WindowX;
+				wndrect.top = dxglcfg.WindowY;
+				wndrect.right = dxglcfg.WindowX + dxglcfg.WindowWidth;
+				wndrect.bottom = dxglcfg.WindowY + dxglcfg.WindowHeight;
+			}
 			else if (dxglcfg.WindowPosition == 2)
 			{
-				wndrect.left = 0;
-				wndrect.top = 0;
+				wndrect.left = wndrect.top = 0;
+				wndrect.right = dxglcfg.WindowWidth;
+				wndrect.bottom = dxglcfg.WindowHeight;
+			}
+			else if (dxglcfg.WindowPosition == 3)
+			{
+				if (!wndclassdxgltempatom) RegisterDXGLTempWindowClass();
+				wndrect.left = wndrect.top = 0;
+				wndrect.right = dxglcfg.WindowWidth;
+				wndrect.bottom = dxglcfg.WindowHeight;
+				hTempWnd = CreateWindow(wndclassdxgltemp.lpszClassName, _T("DXGL Sizing Window"),
+					winstyle & ~(WS_CAPTION | WS_THICKFRAME | WS_BORDER | WS_POPUP | WS_VISIBLE), CW_USEDEFAULT, CW_USEDEFAULT,
+					wndrect.right - wndrect.left, wndrect.bottom - wndrect.top, NULL, NULL, GetModuleHandle(NULL), NULL);
+				GetWindowRect(hTempWnd, &wndrect);
+				DestroyWindow(hTempWnd);
 			}
 			else
 			{
 				screenx = GetSystemMetrics(SM_CXSCREEN);
 				screeny = GetSystemMetrics(SM_CYSCREEN);
-				wndrect.left = (screenx / 2) - (width / 2);
-				wndrect.top = (screeny / 2) - (height / 2);
+				wndrect.right = dxglcfg.WindowWidth + (screenx / 2) - (dxglcfg.WindowWidth / 2);
+				wndrect.bottom = dxglcfg.WindowHeight + (screeny / 2) - (dxglcfg.WindowHeight / 2);
+				wndrect.left = (screenx / 2) - (dxglcfg.WindowWidth / 2);
+				wndrect.top = (screeny / 2) - (dxglcfg.WindowHeight / 2);
 			}
-			wndrect.right = wndrect.left + width;
-			wndrect.bottom = wndrect.top + height;
-			dxglcfg.WindowX = wndrect.left;
-			dxglcfg.WindowY = wndrect.top;
-			dxglcfg.WindowWidth = wndrect.right - wndrect.left;
-			dxglcfg.WindowHeight = wndrect.bottom - wndrect.top;
-			SetWindowPos(newwnd, 0, wndrect.left, wndrect.top, wndrect.right - wndrect.left,
+			SetWindowPos(This->hWnd, 0, wndrect.left, wndrect.top, wndrect.right - wndrect.left,
 				wndrect.bottom - wndrect.top, SWP_ASYNCWINDOWPOS | SWP_NOACTIVATE | SWP_NOOWNERZORDER);
-			SaveWindowSettings(&dxglcfg);
 			break;
 		}
 	}
+	if(width)
+	{
+		// TODO:  Adjust window rect
+	}
+	
+	SetWindowPos(This->hWnd,HWND_TOP,0,0,0,0,SWP_NOMOVE | SWP_NOSIZE | SWP_FRAMECHANGED);
+	glRenderWindow_Create(width, height, fullscreen, This->hWnd, glDD7, devwnd, &This->RenderWnd);
 	This->inputs[0] = (void*)width;
 	This->inputs[1] = (void*)height;
 	This->inputs[2] = (void*)bpp;
 	This->inputs[3] = (void*)fullscreen;
 	This->inputs[4] = (void*)frequency;
-	This->inputs[5] = (void*)newwnd;
-	This->inputs[6] = (void*)devwnd;
-	This->opcode = OP_SETWND;
-	SetEvent(This->start);
-	WaitForObjectAndMessages(This->busy);
-	LeaveCriticalSection(&This->cs);
+	This->inputs[5] = (void*)This->hWnd;
+	This->inputs[6] = glDD7;
+	This->inputs[7] = This;
+	This->inputs[8] = (void*)devwnd;
+	// The thread signals busy once it owns the renderer lock, and creates
+	// the GL context while DirectDraw setup continues on this thread.
+	This->hThread = CreateThread(NULL, 0, glRenderer_ThreadEntry, This->inputs, 0, &threadid);
+	WaitForSingleObject(This->busy,INFINITE);
+}
+
+__inline BOOL UnadjustWindowRectEx(LPRECT lpRect, DWORD dwStyle, BOOL bMenu, DWORD dwExStyle)
+{
+	RECT r;
+	ZeroMemory(&r, sizeof(RECT));
+	BOOL ret = AdjustWindowRectEx(&r, dwStyle, bMenu, dwExStyle);
+	if (!ret) return ret;
+	else
+	{
+		lpRect->left -= r.left;
+		lpRect->top -= r.top;
+		lpRect->right -= r.right;
+		lpRect->bottom -= r.bottom;
+		return ret;
+	}
 }
+
 /**
-  * Draws one or more primitives to the currently selected render target.
+  * Deletes a glRenderer object
   * @param This
   *  Pointer to glRenderer object
-  * @param target
-  *  Textures and mip levels of the current render target
-  * @param mode
-  *  OpenGL primitive drawing mode to use
-  * @param vertices
-  *  Pointer to vertex data
-  * @param packed
-  *  True if vertex data is packed (e.g. xyz,normal,texcoord,xyz,normal,etc.)
-  * @param texformats
-  *  Pointer to texture coordinate formats used in the call
-  * @param count
-  *  Number of vertices to copy to the draw command
-  * @param indices
-  *  List of vertex indices to use in the drawing command, may be NULL for
-  *  non-indexed mode.
-  * @param indexcount
-  *  Number of vertex indices.  May be 0 for non-indexed mode.
-  * @param flags
-  *  Set to D3DDP_WAIT to wait until the queue has processed the call. (not yet
-  *  implemented)
-  * @return
-  *  D3D_OK if the call succeeds, or D3DERR_INVALIDVERTEXTYPE if the vertex format
-  *  has no position coordinates.
   */
-HRESULT glRenderer_DrawPrimitives(glRenderer *This, RenderTarget *target, GLenum mode, GLVERTEX *vertices, int *texformats, DWORD count, LPWORD indices,
-	DWORD indexcount, DWORD flags)
+void glRenderer_Delete(glRenderer *This)
 {
+	BOOL hasmenu;
+	RECT wndrect;
+	LONG_PTR winstyle, winstyleex;
+	WINDOWPLACEMENT wndplace;
+	switch (dxglcfg.fullmode)
+	{
+	case 2:
+	case 3:
+	case 4:
+		wndplace.length = sizeof(WINDOWPLACEMENT);
+		GetWindowPlacement(This->hWnd, &wndplace);
+		wndrect = wndplace.rcNormalPosition;
+		if (dxglcfg.fullmode != 4)
+		{
+			winstyle = GetWindowLongPtrA(This->hWnd, GWL_STYLE);
+			winstyleex = GetWindowLongPtrA(This->hWnd, GWL_EXSTYLE);
+			if (GetMenu(This->hWnd)) hasmenu = TRUE;
+			else hasmenu = FALSE;
+			UnadjustWindowRectEx(&wndrect, winstyle, hasmenu, winstyleex);
+		}
+		dxglcfg.WindowX = wndrect.left;
+		dxglcfg.WindowY = wndrect.top;
+		dxglcfg.WindowWidth = wndrect.right - wndrect.left;
+		dxglcfg.WindowHeight = wndrect.bottom - wndrect.top;
+		if (dxglcfg.fullmode == 3)
+		{
+			if (wndplace.showCmd == SW_MAXIMIZE) dxglcfg.WindowMaximized = TRUE;
+			else dxglcfg.WindowMaximized = FALSE;
+		}
+		SaveWindowSettings(&dxglcfg);
+		break;
+	default:
+		break;
+	}
 	EnterCriticalSection(&This->cs);
-	This->inputs[1] = (void*)mode;
-	This->inputs[2] = vertices;
-	This->inputs[3] = texformats;
-	This->inputs[4] = (void*)count;
-	This->inputs[5] = indices;
-	This->inputs[6] = (void*)indexcount;
-	This->inputs[7] = (void*)flags;
-	memcpy(&This->inputs[8], target, sizeof(RenderTarget));
-	This->opcode = OP_DRAWPRIMITIVES;
-	SetEvent(This->start);
-	WaitForSingleObject(This->busy,INFINITE);
+	// Uses the timer, which is deleted by the renderer thread
+	if (This->vblanknotify)
+	{
+		VBlankNotify_Delete(This->vblanknotify);
+		free(This->vblanknotify);
+		This->vblanknotify = NULL;
+	}
+	glRenderer_FlushBlts(This);
+	This->opcode = OP_DELETE;
+	glRenderer_Wake(This);
+	WaitForObjectAndMessages(This->busy);
+	CloseHandle(This->start);
+	CloseHandle(This->busy);
+	CloseHandle(This->progress);
+	CloseHandle(This->ready);
+	if (This->drawbatch.vertices) free(This->drawbatch.vertices);
+	if (This->drawbatch.indices) free(This->drawbatch.indices);
+	if (This->drawbatch.commands) free(This->drawbatch.commands);
+	if (This->drawbatch.drawtextures) free(This->drawbatch.drawtextures);
+	ZeroMemory(&This->drawbatch, sizeof(DrawBatch));
 	LeaveCriticalSection(&This->cs);
-	return (HRESULT)This->outputs[0];
+	DeleteCriticalSection(&This->cs);
+	CloseHandle(This->hThread);
+	PerfCounters_Delete(&This->perf);
 }
 
 /**
-  * Updates a clipping stencil.
+  * Gets the BPP of the DirectDraw object that owns the renderer
   * @param This
   *  Pointer to glRenderer object
-  * @param stencil
-  *  Stencil texture to update
-  * @param indices
-  *  Pointer to array of indices representing the clip list
-  * @param vertices
-  *  Pointer to array of vertices representing the clip list
-  * @param count
-  *  Number of entries in the clip list
-  * @param width
-  *  Width of surface the stencil is attached to
-  * @param height
-  *  Height of surface the stencil is attached to
   */
-void glRenderer_UpdateClipper(glRenderer *This, glTexture *stencil, GLushort *indices, BltVertex *vertices,
-	GLsizei count, GLsizei width, GLsizei height)
+DWORD glRenderer_GetBPP(glRenderer *This)
 {
-	EnterCriticalSection(&This->cs);
-	This->inputs[0] = stencil;
-	This->inputs[1] = indices;
-	This->inputs[2] = vertices;
-	This->inputs[3] = (void*)count;
-	This->inputs[4] = (void*)width;
-	This->inputs[5] = (void*)height;
-	This->opcode = OP_UPDATECLIPPER;
-	SetEvent(This->start);
-	WaitForSingleObject(This->busy,INFINITE);
-	LeaveCriticalSection(&This->cs);
+	return This->ddInterface->primarybpp;
 }
 
+/**
+  * Entry point for the renderer thread
+  * @param entry
+  *  Pointer to the inputs passed by the CreateThread function
+  */
+DWORD WINAPI glRenderer_ThreadEntry(void *entry)
+{
+	void **inputsin = (void**)entry;
+	glRenderer *This = (glRenderer*)inputsin[7];
+	return glRenderer__Entry(This);
+}
 
 /**
-  * Gets an estimate of the scanline currently being drawn.
+  * Finishes creating an OpenGL texture.  
   * @param This
   *  Pointer to glRenderer object
+  * @param texture
+  *  Texture object to finish creating
+  * @param wraps,wrapt
+  *  OpenGL texture wrap parameters
   */
-unsigned int glRenderer_GetScanLine(glRenderer *This)
+void glRenderer_MakeTexture(glRenderer *This, glTexture *texture)
 {
-	return DXGLTimer_GetScanLine(&This->timer);
+	glRenderer_MakeTextures(This, texture, 1);
 }
 
 /**
-* Fills a depth surface with a specified value.
-* @param This
-*  Pointer to glRenderer object
-* @param cmd
-*  Pointer to structure contaning all paramaters for a Blt operation, with
-*  appropriate depth fill parameters filled in.
-* @param parent
-*  Texture representing parent surface
-* @param parentlevel
-*  Mipmap level of parent surface
-* @return
-*  DD_OK if the depth fill succeeded.
-*/
-HRESULT glRenderer_DepthFill(glRenderer *This, BltCommand *cmd, glTexture *parent, GLint parentlevel)
+  * Finishes creating an array of OpenGL textures, waiting for the renderer
+  * thread once for all of them.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param textures
+  *  Array of texture objects to finish creating
+  * @param count
+  *  Number of textures in the array
+  */
+void glRenderer_MakeTextures(glRenderer *This, glTexture *textures, DWORD count)
 {
 	EnterCriticalSection(&This->cs);
-	This->inputs[0] = cmd;
-	This->inputs[1] = parent;
-	This->inputs[2] = (void*)parentlevel;
-	This->opcode = OP_DEPTHFILL;
-	SetEvent(This->start);
-	WaitForSingleObject(This->busy, INFINITE);
+	This->inputs[0] = textures;
+	This->inputs[1] = (void*)count;
+	glRenderer_FlushBlts(This);
+	This->opcode = OP_CREATE;
+	glRenderer_Wake(This);
+	glRenderer_WaitForThread(This, OP_CREATE);
 	LeaveCriticalSection(&This->cs);
-	return (HRESULT)This->outputs[0];
 }
 
 /**
-  * Sets a render state within the renderer.
+  * Uploads the content of a surface to an OpenGL texture.
   * @param This
   *  Pointer to glRenderer object
-  * @param dwRendStateType
-  *  Render state to change
-  * @param dwRenderState
-  *  New render state value
+  * @param texture
+  *  Texture object to upload to
+  * @param level
+  *  Mipmap level of texture to write
   */
-void glRenderer_SetRenderState(glRenderer *This, D3DRENDERSTATETYPE dwRendStateType, DWORD dwRenderState)
+void glRenderer_UploadTexture(glRenderer *This, glTexture *texture, GLint level) 
 {
 	EnterCriticalSection(&This->cs);
-	This->inputs[0] = (void*)dwRendStateType;
-	This->inputs[1] = (void*)dwRenderState;
-	This->opcode = OP_SETRENDERSTATE;
-	SetEvent(This->start);
-	WaitForSingleObject(This->busy, INFINITE);
+	This->inputs[0] = texture;
+	This->inputs[1] = (void*)level;
+	glRenderer_FlushBlts(This);
+	This->opcode = OP_UPLOAD;
+	glRenderer_Wake(This);
+	glRenderer_WaitForThread(This, OP_UPLOAD);
 	LeaveCriticalSection(&This->cs);
 }
 
 /**
-  * Binds a surface to a texture stage in the renderer.
+  * Downloads the contents of an OpenGL texture to a the texture object's buffer.
   * @param This
   *  Pointer to glRenderer object
-  * @param dwStage
-  *  Texture stage to bind (8 through 11 are reserved for 2D drawing)
-  * @param Texture
-  *  Texture to bind to the stage; NULL to unbind
+  * @param texture
+  *  Texture object to download from
+  * @param level
+  *  Mipmap level of texture to read
   */
-void glRenderer_SetTexture(glRenderer *This, DWORD dwStage, glTexture *Texture)
+void glRenderer_DownloadTexture(glRenderer *This, glTexture *texture, GLint level)
 {
-	EnterCriticalSection(&This->cs);
-	This->inputs[0] = (void*)dwStage;
-	This->inputs[1] = Texture;
-	This->opcode = OP_SETTEXTURE;
-	SetEvent(This->start);
-	WaitForSingleObject(This->busy, INFINITE);
-	LeaveCriticalSection(&This->cs);
+	glRenderer_DownloadTextureRect(This, texture, level, NULL);
 }
 
 /**
-  * Sets a texture stage state within the renderer.
+  * Downloads a rectangle of an OpenGL texture to the texture object's buffer.
+  * Falls back to downloading the whole level if the rectangle can't be read
+  * on its own.
   * @param This
   *  Pointer to glRenderer object
-  * @param dwStage
-  *  Texture stage to modify
-  * @param dwState
-  *  Texture stage state to modify
-  * @param dwValue
-  *  New value for texture stage state.
+  * @param texture
+  *  Texture object to download from
+  * @param level
+  *  Mipmap level of texture to read
+  * @param r
+  *  Rectangle to read, or NULL to read the whole level
   */
-void glRenderer_SetTextureStageState(glRenderer *This, DWORD dwStage, D3DTEXTURESTAGESTATETYPE dwState, DWORD dwValue)
+void glRenderer_DownloadTextureRect(glRenderer *This, glTexture *texture, GLint level, LPRECT r)
 {
 	EnterCriticalSection(&This->cs);
-	This->inputs[0] = (void*)dwStage;
-	This->inputs[1] = (void*)dwState;
-	This->inputs[2] = (void*)dwValue;
-	This->opcode = OP_SETTEXTURESTAGESTATE;
-	SetEvent(This->start);
-	WaitForSingleObject(This->busy, INFINITE);
+	This->inputs[0] = texture;
+	This->inputs[1] = (void*)level;
+	This->inputs[2] = r;
+	glRenderer_FlushBlts(This);
+	DWORD bound = This->cmdbuffer[0].doneseq;
+	glRenderer__LevelBound(texture, level, TRUE, &bound);
+	glRenderer__BoundQueue(This, bound);
+	This->opcode = OP_DOWNLOAD;
+	glRenderer_Wake(This);
+	glRenderer_WaitForThread(This, OP_DOWNLOAD);
 	LeaveCriticalSection(&This->cs);
 }
 
 /**
-  * Sets a transform matrix in the renderer.
+  * Gets a pointer into the persistently mapped pixel buffer of a texture
+  * level for a write-only lock.
   * @param This
   *  Pointer to glRenderer object
-  * @param dtstTransformStateType
-  *  Transform matrix to replace
-  * @param lpD3DMatrix
-  *  New transform matrix
+  * @param texture
+  *  Texture object to lock
+  * @param level
+  *  Mipmap level of texture to lock
+  * @return
+  *  Pointer to write the level's data to, or NULL if the surface buffer
+  *  should be locked instead
   */
-void glRenderer_SetTransform(glRenderer *This, D3DTRANSFORMSTATETYPE dtstTransformStateType, LPD3DMATRIX lpD3DMatrix)
+char *glRenderer_MapTextureLock(glRenderer *This, glTexture *texture, GLint level)
 {
+	char *ret;
+	// Captures record uploads from the surface buffer
+	if (This->capture) return NULL;
 	EnterCriticalSection(&This->cs);
-	This->inputs[0] = (void*)dtstTransformStateType;
-	This->inputs[1] = lpD3DMatrix;
-	This->opcode = OP_SETTRANSFORM;
-	SetEvent(This->start);
-	WaitForSingleObject(This->busy, INFINITE);
+	This->inputs[0] = texture;
+	This->inputs[1] = (void*)level;
+	glRenderer_FlushBlts(This);
+	DWORD bound = This->cmdbuffer[0].doneseq;
+	glRenderer__LevelBound(texture, level, TRUE, &bound);
+	glRenderer__BoundQueue(This, bound);
+	This->opcode = OP_MAPTEXTURELOCK;
+	glRenderer_Wake(This);
+	glRenderer_WaitForThread(This, OP_MAPTEXTURELOCK);
+	ret = (char*)This->outputs[0];
 	LeaveCriticalSection(&This->cs);
+	return ret;
 }
 
 /**
-  * Sets the material in the renderer.
+  * Deletes an OpenGL texture.
   * @param This
   *  Pointer to glRenderer object
-  * @param lpMaterial
-  *  New material parameters
+  * @param texture
+  *  OpenGL texture to be deleted
   */
-void glRenderer_SetMaterial(glRenderer *This, LPD3DMATERIAL7 lpMaterial)
+void glRenderer_DeleteTexture(glRenderer *This, glTexture * texture)
 {
 	EnterCriticalSection(&This->cs);
-	This->inputs[0] = lpMaterial;
-	This->opcode = OP_SETMATERIAL;
-	SetEvent(This->start);
-	WaitForSingleObject(This->busy, INFINITE);
+	This->inputs[0] = texture;
+	glRenderer_FlushBlts(This);
+	This->opcode = OP_DELETETEX;
+	glRenderer_Wake(This);
+	glRenderer_WaitForThread(This, OP_DELETETEX);
 	LeaveCriticalSection(&This->cs);
 }
 
 /**
-  * Sets a light in the renderer.
+  * Copies part or all of the contents of one texture to another.
   * @param This
   *  Pointer to glRenderer object
-  * @param index
-  *  Index of light to set
-  * @param light
-  *  Pointer to light to change, ignored if remove is TRUE
+  * @param cmd
+  *  Pointer to structure contaning all paramaters for a Blt operation.
+  * @return
+  *  DD_OK if the call succeeds, or DDERR_WASSTILLDRAWING if queue is full and not waiting.
+  * @remark
+  *  Blts without the DDBLT_WAIT flag are added to the command ring and return
+  *  immediately.  The textures remember the blt so glRenderer_IsTextureBusy
+  *  can tell when it has run.  Blts that wait only wait for the queued
+  *  commands using their textures.
   */
-
-void glRenderer_SetLight(glRenderer *This, DWORD index, LPD3DLIGHT7 light)
+HRESULT glRenderer_Blt(glRenderer *This, BltCommand *cmd)
 {
 	EnterCriticalSection(&This->cs);
-	This->inputs[0] = (void*)index;
-	This->inputs[1] = light;
-	This->opcode = OP_SETLIGHT;
-	SetEvent(This->start);
-	WaitForSingleObject(This->busy, INFINITE);
+	BOOL hold = FALSE;
+	BOOL visible = ((cmd->dest->levels[0].ddsd.ddsCaps.dwCaps & (DDSCAPS_FRONTBUFFER)) &&
+		(cmd->dest->levels[0].ddsd.ddsCaps.dwCaps & DDSCAPS_PRIMARYSURFACE)) ||
+		((cmd->dest->levels[0].ddsd.ddsCaps.dwCaps & DDSCAPS_PRIMARYSURFACE) &&
+		!(cmd->dest->levels[0].ddsd.ddsCaps.dwCaps & DDSCAPS_FLIP));
+	// Blts to a visible surface are never held so they reach the screen.
+	// The window is sized for them by glRenderer__DrawScreen.
+	if (!visible && dxglcfg.BltCoalescing) hold = glRenderer__CanBatchBlt(cmd);
+	if (!(cmd->flags & DDBLT_WAIT) || hold)
+	{
+		if ((cmd->flags & DDBLT_DONOTWAIT) && !glRenderer_CanQueueBlt(This))
+		{
+			LeaveCriticalSection(&This->cs);
+			return DDERR_WASSTILLDRAWING;
+		}
+		glRenderer_AddCommandEx(This, OP_BLT, cmd, sizeof(BltCommand), hold);
+		glRenderer__MarkBlt(This, cmd);
+		LeaveCriticalSection(&This->cs);
+		return DD_OK;
+	}
+	This->inputs[0] = cmd;
+	glRenderer_FlushBlts(This);
+	glRenderer__BoundQueue(This, glRenderer__BltBound(This, cmd));
+	This->opcode = OP_BLT;
+	glRenderer_Wake(This);
+	glRenderer_WaitForThread(This, OP_BLT);
 	LeaveCriticalSection(&This->cs);
+	return (HRESULT)This->outputs[0];
 }
 
 /**
-  * Removes a light from the renderer.
+  * Updates the display with the current primary texture.
   * @param This
   *  Pointer to glRenderer object
-  * @param index
-  *  Index of light to remove
+  * @param texture
+  *  Texture to use as the primary
+  * @param paltex
+  *  Texture that contains the color palette for 8-bit modes
+  * @param vsync
+  *  Vertical sync count
+  * @param previous
+  *  Texture previously used as primary before a flip
   */
-void glRenderer_RemoveLight(glRenderer *This, DWORD index)
+void glRenderer_DrawScreen(glRenderer *This, glTexture *texture, glTexture *paltex, GLint vsync, glTexture *previous, BOOL settime)
 {
 	EnterCriticalSection(&This->cs);
-	This->inputs[0] = (void*)index;
-	This->opcode = OP_REMOVELIGHT;
-	SetEvent(This->start);
-	WaitForSingleObject(This->busy, INFINITE);
+	This->inputs[0] = texture;
+	This->inputs[1] = paltex;
+	This->inputs[2] = (void*)vsync;
+	This->inputs[3] = previous;
+	This->inputs[4] = (void*)settime;
+	if (This->latency) LatencyMeter_Present(This->latency);
+	glRenderer_FlushBlts(This);
+	This->opcode = OP_DRAWSCREEN;
+	glRenderer_Wake(This);
+	glRenderer_WaitForThread(This, OP_DRAWSCREEN);
 	LeaveCriticalSection(&This->cs);
 }
 
 /**
-  * Sets the Direct3D viewport for the renderer.
+  * Marks a primary surface as needing to be drawn to the screen again,
+  * without waiting for it.  The renderer draws it once the refresh interval
+  * of the last frame has ended, so palette changes and unlocks made within
+  * one refresh interval are shown with a single frame.
   * @param This
   *  Pointer to glRenderer object
-  * @param lpViewport
-  *  New viewport parameters for renderer.
+  * @param texture
+  *  Primary surface texture to draw
+  * @param vsync
+  *  Vertical sync count
+  * @param settime
+  *  Set this to TRUE to set the last draw time for palette redraw delays
   */
-void glRenderer_SetD3DViewport(glRenderer *This, LPD3DVIEWPORT7 lpViewport)
+void glRenderer_ScheduleDrawScreen(glRenderer *This, glTexture *texture, GLint vsync, BOOL settime)
 {
-	EnterCriticalSection(&This->cs);
-	This->inputs[0] = lpViewport;
-	This->opcode = OP_SETD3DVIEWPORT;
-	SetEvent(This->start);
-	WaitForSingleObject(This->busy, INFINITE);
-	LeaveCriticalSection(&This->cs);
+	InterlockedExchange(&This->recompositevsync, vsync);
+	InterlockedExchange(&This->recompositetime, settime);
+	InterlockedExchangePointer((PVOID volatile*)&This->recomposite, texture);
+	glRenderer_FlushBlts(This);
+	glRenderer_Wake(This);
 }
 
 /**
-* Sets a color key for a texture object.
-* @param This
-*  Pointer to glRenderer object
-* @param texture
-*  Texture to set color key on
-* @param dwFlags
-*  DDraw color key flags to select color key to add or update
-* @param lpDDColorKey
-*  Pointer to a DDraw color key structure to set in the texture
-* @param level
-*  Mip level of color key to set for DirectDraw; Direct3D colorkey operations use level 0
-*/
-void glRenderer_SetTextureColorKey(glRenderer *This, glTexture *texture, DWORD dwFlags, LPDDCOLORKEY lpDDColorKey, GLint level)
+  * Ensures the renderer is set up for handling Direct3D commands.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param zbuffer
+  *  Nonzero if a Z buffer is present.
+  * @param x
+  *  Width of the initial viewport
+  * @param y
+  *  Height of the initial viewport
+  */
+void glRenderer_InitD3D(glRenderer *This, int zbuffer, int x, int y)
 {
 	EnterCriticalSection(&This->cs);
-	This->inputs[0] = texture;
-	This->inputs[1] = (void*)dwFlags;
-	This->inputs[2] = lpDDColorKey;
-	This->inputs[3] = (void*)level;
-	This->opcode = OP_SETTEXTURECOLORKEY;
-	SetEvent(This->start);
-	WaitForSingleObject(This->busy, INFINITE);
+	This->inputs[0] = (void*)zbuffer;
+	This->inputs[1] = (void*)x;
+	This->inputs[2] = (void*)y;
+	glRenderer_FlushBlts(This);
+	This->opcode = OP_INITD3D;
+	glRenderer_Wake(This);
+	glRenderer_WaitForThread(This, OP_INITD3D);
+	This->drawbatch.fogenable = This->renderstate[D3DRENDERSTATE_FOGENABLE] ? TRUE : FALSE;
+	ZeroMemory(This->drawbatch.textures, 8 * sizeof(glTexture*));
 	LeaveCriticalSection(&This->cs);
 }
 
 /**
-* Sets whether a texure has primary scaling
-* @param This
-*  Pointer to glRenderer object
-* @param texture
-*  Texture to set primary scaling
-* @param parent
-*  Parent texture this one is attached to, needed only if primary is TRUE
-* @param primary
-*  TRUE if texture should have primary scaling, FALSE to remove scaling
-*/
-void glRenderer_MakeTexturePrimary(glRenderer *This, glTexture *texture, glTexture *parent, BOOL primary)
+  * Clears the viewport.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param cmd
+  *  Pointer to structure contaning all paramaters for a Clear operation.
+  * @return
+  *  Returns D3D_OK
+  */
+HRESULT glRenderer_Clear(glRenderer *This, ClearCommand *cmd)
 {
 	EnterCriticalSection(&This->cs);
-	This->inputs[0] = texture;
-	This->inputs[1] = parent;
-	This->inputs[2] = (void*)primary;
-	This->opcode = OP_MAKETEXTUREPRIMARY;
-	SetEvent(This->start);
-	WaitForSingleObject(This->busy, INFINITE);
+	This->inputs[0] = cmd;
+	glRenderer_FlushBlts(This);
+	This->opcode = OP_CLEAR;
+	glRenderer_Wake(This);
+	glRenderer_WaitForThread(This, OP_CLEAR);
 	LeaveCriticalSection(&This->cs);
+	return (HRESULT)This->outputs[0];
 }
 
 /**
-  * Generates a glFrameTerminatorGREMEDY command in OpenGL if the 
-  * glFrameTerminatorGREMEDY command is available
-  * (i.e. running under gDebugger or CodeXL).
+  * Instructs the OpenGL driver to send all queued commands to the GPU.
   * @param This
   *  Pointer to glRenderer object
   */
-void glRenderer_DXGLBreak(glRenderer *This)
+void glRenderer_Flush(glRenderer *This)
 {
 	EnterCriticalSection(&This->cs);
-	This->opcode = OP_DXGLBREAK;
-	SetEvent(This->start);
-	WaitForSingleObject(This->busy, INFINITE);
-	LeaveCriticalSection(&This->cs);
-}
-
-/**
-  * Frees a pointer via the backend to ensure textures are not freed early.
-  * @param This
-  *  Pointer to glRenderer object
-  * @param ptr
-  *  Pointer to free in backend thread
-  */
-void glRenderer_FreePointer(glRenderer *This, void *ptr)
-{
-	EnterCriticalSection(&This->cs);
-	This->inputs[0] = ptr;
-	This->opcode = OP_FREEPOINTER;
-	SetEvent(This->start);
-	WaitForSingleObject(This->busy, INFINITE);
+	glRenderer_FlushBlts(This);
+	This->opcode = OP_FLUSH;
+	glRenderer_Wake(This);
+	glRenderer_WaitForThread(This, OP_FLUSH);
 	LeaveCriticalSection(&This->cs);
 }
 
 /**
-  * Main loop for glRenderer class
+  * Changes the window used for rendering.
   * @param This
   *  Pointer to glRenderer object
-  * @return
-  *  Returns 0 to signal successful thread termination
+  * @param width,height
+  *  Width and height of the new window.
+  * @param fullscreen
+  *  True if fullscreen
+  * @param newwnd
+  *  HWND of the new window
+  * @param devwnd
+  *  True if creating window with name "DirectDrawDeviceWnd"
   */
-DWORD glRenderer__Entry(glRenderer *This)
+void glRenderer_SetWnd(glRenderer *This, int width, int height, int bpp, int fullscreen, unsigned int frequency, HWND newwnd, BOOL devwnd)
 {
-	int i;
+	RECT wndrect, wndrect2;
+	WINDOWPLACEMENT wndplace;
+	BOOL hasmenu;
+	int screenx, screeny;
+	LONG_PTR winstyle, winstyleex;
 	EnterCriticalSection(&This->cs);
-	glRenderer__InitGL(This,(int)This->inputs[0],(int)This->inputs[1],(int)This->inputs[2],
-		(int)This->inputs[3],(unsigned int)This->inputs[4],(HWND)This->inputs[5],
-		(glDirectDraw7*)This->inputs[6]);
-	LeaveCriticalSection(&This->cs);
-	SetEvent(This->busy);
-	while(1)
+	if(fullscreen && newwnd)
 	{
-		WaitForSingleObject(This->start,INFINITE);
-		switch(This->opcode)
+		switch (dxglcfg.fullmode)
 		{
-		case OP_DELETE:
-			if(This->hRC)
+		case 0:    // Fullscreen
+			/*winstyle = GetWindowLongPtrA(newwnd, GWL_STYLE);
+			winstyleex = GetWindowLongPtrA(newwnd, GWL_EXSTYLE);
+			SetWindowLongPtrA(newwnd, GWL_EXSTYLE, winstyleex & ~(WS_EX_WINDOWEDGE | WS_EX_CLIENTEDGE));
+			SetWindowLongPtrA(newwnd, GWL_STYLE, (winstyle | WS_POPUP) & ~(WS_CAPTION | WS_THICKFRAME | WS_BORDER));
+			ShowWindow(newwnd, SW_MAXIMIZE);*/  //This seems to cause a black screen in some cases
+			SetWindowLongPtrA(newwnd, GWL_EXSTYLE, WS_EX_APPWINDOW);
+			SetWindowLongPtrA(newwnd, GWL_STYLE, WS_OVERLAPPED|WS_POPUP);
+			Adapter_MoveWindow(newwnd, &This->ddInterface->adapter);
+			ShowWindow(newwnd, SW_MAXIMIZE);
+			break;
+		case 1:    // Non-exclusive Fullscreen
+		case 5:    // Windowed borderless scaled
+			/*winstyle = GetWindowLongPtrA(newwnd, GWL_STYLE);
+			winstyleex = GetWindowLongPtrA(newwnd, GWL_EXSTYLE);
+			SetWindowLongPtrA(newwnd, GWL_EXSTYLE, winstyleex & ~(WS_EX_WINDOWEDGE | WS_EX_CLIENTEDGE));
+			SetWindowLongPtrA(newwnd, GWL_STYLE, winstyle & ~(WS_CAPTION | WS_THICKFRAME | WS_BORDER | WS_POPUP));
+			ShowWindow(newwnd, SW_MAXIMIZE);*/  //This seems to cause a black screen in some cases
+			SetWindowLongPtrA(newwnd, GWL_EXSTYLE, WS_EX_APPWINDOW);
+			SetWindowLongPtrA(newwnd, GWL_STYLE, WS_OVERLAPPED);
+			Adapter_MoveWindow(newwnd, &This->ddInterface->adapter);
+			ShowWindow(newwnd, SW_MAXIMIZE);
+			break;
+		case 2:     // Windowed
+			winstyle = GetWindowLongPtrA(newwnd, GWL_STYLE);
+			winstyleex = GetWindowLongPtrA(newwnd, GWL_EXSTYLE);
+			SetWindowLongPtrA(newwnd, GWL_EXSTYLE, winstyleex | WS_EX_APPWINDOW);
+			SetWindowLongPtrA(newwnd, GWL_STYLE, (winstyle | WS_OVERLAPPEDWINDOW) & ~(WS_THICKFRAME | WS_MAXIMIZEBOX | WS_POPUP));
+			ShowWindow(newwnd, SW_NORMAL);
+			if ((dxglcfg.WindowPosition == 1) || (dxglcfg.WindowPosition == 3))
 			{
-				if(This->dib.enabled)
+				GetWindowRect(newwnd, &wndrect);
+				if (GetMenu(newwnd)) hasmenu = TRUE;
+				else hasmenu = FALSE;
+				UnadjustWindowRectEx(&wndrect, (winstyle | WS_OVERLAPPEDWINDOW) & ~(WS_THICKFRAME | WS_MAXIMIZEBOX | WS_POPUP),
+					hasmenu, winstyleex | WS_EX_APPWINDOW);
+				wndrect.right = wndrect.left + width;
+				wndrect.bottom = wndrect.top + height;
+				AdjustWindowRectEx(&wndrect, (winstyle | WS_OVERLAPPEDWINDOW) & ~(WS_THICKFRAME | WS_MAXIMIZEBOX), FALSE,
+					(winstyleex | WS_EX_APPWINDOW));
+			}
+			else if (dxglcfg.WindowPosition == 2)
+			{
+				wndrect.left = 0;
+				wndrect.top = 0;
+				wndrect.right = width;
+				wndrect.bottom = height;
+				AdjustWindowRectEx(&wndrect, (winstyle | WS_OVERLAPPEDWINDOW) & ~(WS_THICKFRAME | WS_MAXIMIZEBOX), FALSE,
+					(winstyleex | WS_EX_APPWINDOW));
+				wndrect.right -= wndrect.left;
+				wndrect.left = 0;
+				wndrect.bottom -= wndrect.top;
+				wndrect.top = 0;
+			}
+			else
+			{
+				screenx = GetSystemMetrics(SM_CXSCREEN);
+				screeny = GetSystemMetrics(SM_CYSCREEN);
+				wndrect.left = (screenx / 2) - (width / 2);
+				wndrect.top = (screeny / 2) - (height / 2);
+				wndrect.right = wndrect.left + width;
+				wndrect.bottom = wndrect.top + height;
+				AdjustWindowRectEx(&wndrect, (winstyle | WS_OVERLAPPEDWINDOW) & ~(WS_THICKFRAME | WS_MAXIMIZEBOX), FALSE,
+					(winstyleex | WS_EX_APPWINDOW));
+			}
+			dxglcfg.WindowX = wndrect.left;
+			dxglcfg.WindowY = wndrect.top;
+			dxglcfg.WindowWidth = wndrect.right - wndrect.left;
+			dxglcfg.WindowHeight = wndrect.bottom - wndrect.top;
+			SetWindowPos(newwnd, 0, wndrect.left, wndrect.top, wndrect.right - wndrect.left,
+				wndrect.bottom - wndrect.top, SWP_ASYNCWINDOWPOS | SWP_NOACTIVATE | SWP_NOOWNERZORDER);
+			SaveWindowSettings(&dxglcfg);
+			break;
+		case 3:     // Windowed resizable
+			winstyle = GetWindowLongPtrA(newwnd, GWL_STYLE);
+			winstyleex = GetWindowLongPtrA(newwnd, GWL_EXSTYLE);
+			SetWindowLongPtrA(newwnd, GWL_EXSTYLE, winstyleex | WS_EX_APPWINDOW);
+			SetWindowLongPtrA(newwnd, GWL_STYLE, (winstyle | WS_OVERLAPPEDWINDOW) & ~WS_POPUP);
+			wndplace.length = sizeof(WINDOWPLACEMENT);
+			GetWindowPlacement(newwnd, &wndplace);
+			if(wndplace.showCmd == SW_SHOWMAXIMIZED) ShowWindow(newwnd, SW_SHOWMAXIMIZED);
+			else ShowWindow(newwnd, SW_NORMAL);
+			if ((dxglcfg.WindowPosition == 1) || (dxglcfg.WindowPosition == 3))
+			{
+				wndrect = wndplace.rcNormalPosition;
+				GetWindowRect(newwnd, &wndrect2);
+				if (GetMenu(newwnd)) hasmenu = TRUE;
+				else hasmenu = FALSE;
+				UnadjustWindowRectEx(&wndrect, (winstyle | WS_OVERLAPPEDWINDOW) & ~WS_POPUP,
+					hasmenu, (winstyleex | WS_EX_APPWINDOW));
+				UnadjustWindowRectEx(&wndrect2, (winstyle | WS_OVERLAPPEDWINDOW) & ~WS_POPUP,
+					hasmenu, (winstyleex | WS_EX_APPWINDOW));
+				if (!dxglcfg.NoResizeWindow)
 				{
-					if(This->dib.hbitmap) DeleteObject(This->dib.hbitmap);
-					if(This->dib.hdc) DeleteDC(This->dib.hdc);
-					if (This->dib.info) free(This->dib.info);
-					ZeroMemory(&This->dib,sizeof(DIB));
+					wndrect.right = wndrect.left + width;
+					wndrect.bottom = wndrect.top + height;
 				}
-				glUtil_DeleteFBO(This->util, &This->fbo);
-				if(This->pbo)
+			}
+			else if (dxglcfg.WindowPosition == 2)
+			{
+				if (dxglcfg.NoResizeWindow)
 				{
-					BufferObject_Release(This->pbo);
-					This->pbo = NULL;
+					GetWindowRect(newwnd, &wndrect2);
+					if (GetMenu(newwnd)) hasmenu = TRUE;
+					else hasmenu = FALSE;
+					UnadjustWindowRectEx(&wndrect2, (winstyle | WS_OVERLAPPEDWINDOW) & ~WS_POPUP,
+						hasmenu, (winstyleex | WS_EX_APPWINDOW));
+					glDirectDraw7_SetWindowSize(This->ddInterface,
+						wndrect2.right - wndrect2.left, wndrect2.bottom - wndrect2.top);
+					break;
 				}
-				for (i = 0; i < 16; i++)
+				wndrect.left = 0;
+				wndrect.top = 0;
+				wndrect.right = width;
+				wndrect.bottom = height;
+				AdjustWindowRectEx(&wndrect, winstyle | WS_OVERLAPPEDWINDOW, FALSE, (winstyleex | WS_EX_APPWINDOW));
+				wndrect.right -= wndrect.left;
+				wndrect.left = 0;
+				wndrect.bottom -= wndrect.top;
+				wndrect.top = 0;
+			}
+			else
+			{
+				if (dxglcfg.NoResizeWindow)
 				{
-					if (This->backbuffers[i].initialized)
-					{
-						glTexture_Release(&This->backbuffers[i], TRUE);
-					}
+					GetWindowRect(newwnd, &wndrect2);
+					if (GetMenu(newwnd)) hasmenu = TRUE;
+					else hasmenu = FALSE;
+					UnadjustWindowRectEx(&wndrect2, (winstyle | WS_OVERLAPPEDWINDOW) & ~WS_POPUP,
+						hasmenu, (winstyleex | WS_EX_APPWINDOW));
+					glDirectDraw7_SetWindowSize(This->ddInterface,
+						wndrect2.right - wndrect2.left, wndrect2.bottom - wndrect2.top);
+					break;
 				}
-				ZeroMemory(&This->backbuffers, 16 * sizeof(glTexture));
-				//glRenderer__DeleteCommandBuffer(&This->cmd1);
-				//glRenderer__DeleteCommandBuffer(&This->cmd2);
-				ShaderManager_Delete(This->shaders);
-				glUtil_Release(This->util);
-				free(This->shaders);
-				free(This->ext);
-				if (This->overlays) free(This->overlays);
-				This->ext = NULL;
-				wglMakeCurrent(NULL,NULL);
-				wglDeleteContext(This->hRC);
-				This->hRC = NULL;
-			};
-			if(This->hDC) ReleaseDC(This->RenderWnd->hWnd,This->hDC);
-			This->hDC = NULL;
-			if (This->dib.info) free(This->dib.info);
-			This->dib.info = NULL;
-			glRenderWindow_Delete(This->RenderWnd);
-			This->RenderWnd = NULL;
-			SetEvent(This->busy);
-			return 0;
+				screenx = GetSystemMetrics(SM_CXSCREEN);
+				screeny = GetSystemMetrics(SM_CYSCREEN);
+				wndrect.left = (screenx / 2) - (width / 2);
+				wndrect.top = (screeny / 2) - (height / 2);
+				if (!dxglcfg.NoResizeWindow)
+				{
+					wndrect.right = wndrect.left + width;
+					wndrect.bottom = wndrect.top + height;
+				}
+			}
+			dxglcfg.WindowX = wndrect.left;
+			dxglcfg.WindowY = wndrect.top;
+			dxglcfg.WindowWidth = wndrect.right - wndrect.left;
+			dxglcfg.WindowHeight = wndrect.bottom - wndrect.top;
+			if(dxglcfg.WindowPosition != 2)
+				AdjustWindowRectEx(&wndrect, winstyle | WS_OVERLAPPEDWINDOW, FALSE, (winstyleex | WS_EX_APPWINDOW));
+			wndplace.flags = WPF_ASYNCWINDOWPLACEMENT;
+			if (!dxglcfg.NoResizeWindow) wndplace.showCmd = SW_SHOWNORMAL;
+			wndplace.rcNormalPosition = wndrect;
+			SetWindowPlacement(newwnd, &wndplace);
+			if(dxglcfg.NoResizeWindow) glDirectDraw7_SetWindowSize(This->ddInterface,
+				wndrect2.right - wndrect2.left, wndrect2.bottom - wndrect2.top);
+			SaveWindowSettings(&dxglcfg);
 			break;
-		case OP_SETWND:
-			glRenderer__SetWnd(This,(int)This->inputs[0],(int)This->inputs[1],(int)This->inputs[2],
-				(int)This->inputs[3],(unsigned int)This->inputs[4],(HWND)This->inputs[5],(BOOL)This->inputs[6]);
+		case 4:     // Windowed borderless
+			winstyle = GetWindowLongPtrA(newwnd, GWL_STYLE);
+			winstyleex = GetWindowLongPtrA(newwnd, GWL_EXSTYLE);
+			SetWindowLongPtrA(newwnd, GWL_EXSTYLE, winstyleex & ~(WS_EX_WINDOWEDGE | WS_EX_CLIENTEDGE));
+			SetWindowLongPtrA(newwnd, GWL_STYLE, winstyle & ~(WS_CAPTION | WS_THICKFRAME | WS_BORDER | WS_POPUP));
+			ShowWindow(newwnd, SW_NORMAL);
+			screenx = GetSystemMetrics(SM_CXSCREEN);
+			screeny = GetSystemMetrics(SM_CYSCREEN);
+			if ((dxglcfg.WindowPosition == 1) || (dxglcfg.WindowPosition == 3))
+				GetWindowRect(newwnd, &wndrect);
+			else if (dxglcfg.WindowPosition == 2)
+			{
+				wndrect.left = 0;
+				wndrect.top = 0;
+			}
+			else
+			{
+				screenx = GetSystemMetrics(SM_CXSCREEN);
+				screeny = GetSystemMetrics(SM_CYSCREEN);
+				wndrect.left = (screenx / 2) - (width / 2);
+				wndrect.top = (screeny / 2) - (height / 2);
+			}
+			wndrect.right = wndrect.left + width;
+			wndrect.bottom = wndrect.top + height;
+			dxglcfg.WindowX = wndrect.left;
+			dxglcfg.WindowY = wndrect.top;
+			dxglcfg.WindowWidth = wndrect.right - wndrect.left;
+			dxglcfg.WindowHeight = wndrect.bottom - wndrect.top;
+			SetWindowPos(newwnd, 0, wndrect.left, wndrect.top, wndrect.right - wndrect.left,
+				wndrect.bottom - wndrect.top, SWP_ASYNCWINDOWPOS | SWP_NOACTIVATE | SWP_NOOWNERZORDER);
+			SaveWindowSettings(&dxglcfg);
 			break;
-		case OP_CREATE:
-			glRenderer__MakeTexture(This,(glTexture*)This->inputs[0]);
-			SetEvent(This->busy);
-			break;
-		case OP_UPLOAD:
-			glRenderer__UploadTexture(This,(glTexture*)This->inputs[0],(GLint)This->inputs[1]);
-			SetEvent(This->busy);
-			break;
-		case OP_DOWNLOAD:
-			glRenderer__DownloadTexture(This,(glTexture*)This->inputs[0],(GLint)This->inputs[1]);
-			SetEvent(This->busy);
-			break;
-		case OP_DELETETEX:
-			glRenderer__DeleteTexture(This,(glTexture*)This->inputs[0]);
-			break;
-		case OP_BLT:
-			glRenderer__Blt(This, (BltCommand*)This->inputs[0], FALSE);
-			break;
-		case OP_DRAWSCREEN:
-			glRenderer__DrawScreen(This,(glTexture*)This->inputs[0],(glTexture*)This->inputs[1],
-				(GLint)This->inputs[2],(glTexture*)This->inputs[3],TRUE,(BOOL)This->inputs[4],
-				(OVERLAY*)This->inputs[5],(int)This->inputs[6]);
-			break;
-		case OP_INITD3D:
-			glRenderer__InitD3D(This,(int)This->inputs[0],(int)This->inputs[1],(int)This->inputs[2]);
-			break;
-		case OP_CLEAR:
-			glRenderer__Clear(This,(ClearCommand*)This->inputs[0]);
-			break;
-		case OP_FLUSH:
-			glRenderer__Flush(This);
-			break;
-		case OP_DRAWPRIMITIVES:
-			glRenderer__DrawPrimitivesOld(This,(RenderTarget*)&This->inputs[8],(GLenum)This->inputs[1],
-				(GLVERTEX*)This->inputs[2],(int*)This->inputs[3],(DWORD)This->inputs[4],(LPWORD)This->inputs[5],
-				(DWORD)This->inputs[6],(DWORD)This->inputs[7]);
-			break;
-		case OP_UPDATECLIPPER:
-			glRenderer__UpdateClipper(This,(glTexture*)This->inputs[0], (GLushort*)This->inputs[1],
-				(BltVertex*)This->inputs[2], (GLsizei)This->inputs[3], (GLsizei)This->inputs[4], (GLsizei)This->inputs[5]);
-			break;
-		case OP_DEPTHFILL:
-			glRenderer__DepthFill(This, (BltCommand*)This->inputs[0], (glTexture*)This->inputs[1], (GLint)This->inputs[2]);
-			break;
-		case OP_SETRENDERSTATE:
-			glRenderer__SetRenderState(This, (D3DRENDERSTATETYPE)(DWORD)This->inputs[0], (DWORD)This->inputs[1]);
-			break;
-		case OP_SETTEXTURE:
-			glRenderer__SetTexture(This, (DWORD)This->inputs[0], (glTexture*)This->inputs[1]);
-			break;
-		case OP_SETTEXTURESTAGESTATE:
-			glRenderer__SetTextureStageState(This, (DWORD)This->inputs[0], (D3DTEXTURESTAGESTATETYPE)(DWORD)This->inputs[1],
-				(DWORD)This->inputs[2]);
-			break;
-		case OP_SETTRANSFORM:
-			glRenderer__SetTransform(This, (D3DTRANSFORMSTATETYPE)(DWORD)This->inputs[0], (LPD3DMATRIX)This->inputs[1]);
-			break;
-		case OP_SETMATERIAL:
-			glRenderer__SetMaterial(This, (LPD3DMATERIAL7)This->inputs[0]);
-			break;
-		case OP_SETLIGHT:
-			glRenderer__SetLight(This, (DWORD)This->inputs[0], (LPD3DLIGHT7)This->inputs[1]);
-			break;
-		case OP_REMOVELIGHT:
-			glRenderer__RemoveLight(This, (DWORD)This->inputs[0]);
-			break;
-		case OP_SETD3DVIEWPORT:
-			glRenderer__SetD3DViewport(This, (LPD3DVIEWPORT7)This->inputs[0]);
-			break;
-		case OP_SETTEXTURECOLORKEY:
-			glRenderer__SetTextureColorKey(This, (glTexture*)This->inputs[0], (DWORD)This->inputs[1],
-				(LPDDCOLORKEY)This->inputs[2], (GLint)This->inputs[3]);
-			break;
-		case OP_MAKETEXTUREPRIMARY:
-			glRenderer__MakeTexturePrimary(This, (glTexture*)This->inputs[0], (glTexture*)This->inputs[1], (DWORD)This->inputs[2]);
-			break;
-		case OP_DXGLBREAK:
-			glRenderer__DXGLBreak(This, TRUE);
-			break;
-		case OP_ENDCOMMAND:
-			glRenderer__EndCommand(This, (BOOL)This->inputs[0]);
-			break;
-		case OP_FREEPOINTER:
-			glRenderer__FreePointer(This, (void*)This->inputs[0]);
 		}
 	}
-	return 0;
+	This->inputs[0] = (void*)width;
+	This->inputs[1] = (void*)height;
+	This->inputs[2] = (void*)bpp;
+	This->inputs[3] = (void*)fullscreen;
+	This->inputs[4] = (void*)frequency;
+	This->inputs[5] = (void*)newwnd;
+	This->inputs[6] = (void*)devwnd;
+	glRenderer_FlushBlts(This);
+	This->opcode = OP_SETWND;
+	glRenderer_Wake(This);
+	WaitForObjectAndMessages(This->busy);
+	LeaveCriticalSection(&This->cs);
+}
+/**
+  * Draws one or more primitives to the currently selected render target.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param target
+  *  Textures and mip levels of the current render target
+  * @param mode
+  *  OpenGL primitive drawing mode to use
+  * @param fvf
+  *  Flexible vertex format of the vertex data
+  * @param vertices
+  *  Pointer to vertex data, or to a D3DDRAWPRIMITIVESTRIDEDDATA structure if
+  *  strided is TRUE
+  * @param buffer
+  *  Vertex buffer the vertex data points into, or NULL to draw from
+  *  application memory
+  * @param strided
+  *  TRUE if each vertex component has its own pointer and stride
+  * @param count
+  *  Number of vertices to copy to the draw command
+  * @param indices
+  *  List of vertex indices to use in the drawing command, may be NULL for
+  *  non-indexed mode.
+  * @param indexcount
+  *  Number of vertex indices.  May be 0 for non-indexed mode.
+  * @param flags
+  *  Set to D3DDP_WAIT to wait until the queue has processed the call. (not yet
+  *  implemented)
+  * @return
+  *  D3D_OK if the call succeeds, or D3DERR_INVALIDVERTEXTYPE if the vertex format
+  *  has no position coordinates.
+  * @remark
+  *  Small draws from application memory are held back and merged with the
+  *  following draws until a state change or any other renderer call.
+  */
+HRESULT glRenderer_DrawPrimitives(glRenderer *This, RenderTarget *target, GLenum mode, DWORD fvf, void *vertices,
+	VertexBuffer *buffer, BOOL strided, DWORD count, LPWORD indices, DWORD indexcount, DWORD flags)
+{
+	EnterCriticalSection(&This->cs);
+	// Captures record each draw, replay batches them again
+	if (!buffer && !strided && vertices && !(flags & D3DDP_WAIT) && !This->capture &&
+		glRenderer_BatchDraw(This, target, mode, fvf, (BYTE*)vertices, count, indices, indexcount))
+	{
+		LeaveCriticalSection(&This->cs);
+		return D3D_OK;
+	}
+	This->inputs[0] = buffer;
+	This->inputs[1] = (void*)mode;
+	This->inputs[2] = vertices;
+	This->inputs[3] = (void*)fvf;
+	This->inputs[4] = (void*)count;
+	This->inputs[5] = indices;
+	This->inputs[6] = (void*)indexcount;
+	This->inputs[7] = (void*)flags;
+	memcpy(&This->inputs[8], target, sizeof(RenderTarget));
+	This->inputs[16] = (void*)strided;
+	glRenderer_FlushBlts(This);
+	This->opcode = OP_DRAWPRIMITIVES;
+	glRenderer_Wake(This);
+	glRenderer_WaitForThread(This, OP_DRAWPRIMITIVES);
+	LeaveCriticalSection(&This->cs);
+	return (HRESULT)This->outputs[0];
 }
 
-static void setupDebugOutputCallback()
+/**
+  * Updates a clipping stencil.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param stencil
+  *  Stencil texture to update
+  * @param indices
+  *  Pointer to array of indices representing the clip list
+  * @param vertices
+  *  Pointer to array of vertices representing the clip list
+  * @param count
+  *  Number of entries in the clip list
+  * @param width
+  *  Width of surface the stencil is attached to
+  * @param height
+  *  Height of surface the stencil is attached to
+  */
+void glRenderer_UpdateClipper(glRenderer *This, glTexture *stencil, GLushort *indices, BltVertex *vertices,
+	GLsizei count, GLsizei width, GLsizei height)
 {
-	auto callback = [](GLenum source,
-		                GLenum type,
-		                GLuint /*id*/,
-		                GLenum severity,
-		                GLsizei length,
-		                const GLchar* message,
-		                const void*) {
-		char buf[256];
-		snprintf(buf, sizeof(buf), "[%s] %s (%s): %.*s\n",
-			debugSourceString(source),
-			debugTypeString(type), // could be GL_DEBUG_TYPE_PUSH_GROUP
-			debugSeverityString(severity),
-			length, message);
-		OutputDebugStringA(buf);
-		if (type == GL_DEBUG_TYPE_ERROR || severity == GL_DEBUG_SEVERITY_HIGH)
-			__debugbreak();
-			//exit(1);
-	};
-	glEnable(GL_DEBUG_OUTPUT);
-	glDebugMessageCallback(callback, nullptr);
+	EnterCriticalSection(&This->cs);
+	This->inputs[0] = stencil;
+	This->inputs[1] = indices;
+	This->inputs[2] = vertices;
+	This->inputs[3] = (void*)count;
+	This->inputs[4] = (void*)width;
+	This->inputs[5] = (void*)height;
+	glRenderer_FlushBlts(This);
+	This->opcode = OP_UPDATECLIPPER;
+	glRenderer_Wake(This);
+	glRenderer_WaitForThread(This, OP_UPDATECLIPPER);
+	LeaveCriticalSection(&This->cs);
 }
 
+
 /**
-  * Creates a render window and initializes OpenGL.
+  * Gets an estimate of the scanline currently being drawn.
   * @param This
   *  Pointer to glRenderer object
-  * @param width,height
-  *  Width and height of the render window.
-  * @param bpp
-  *  Color depth of the screen.
-  * @param fullscreen
-  *  True if full screen mode is requested.
-  * @param hWnd
-  *  Handle to the window to use as the renderer.  If NULL, then creates a
-  *  transparent overlay window.
-  * @param glDD7
-  *  Pointer to the glDirectDraw7 interface that creates the renderer.
-  * @return
-  *  TRUE if OpenGL has been initialized, FALSE otherwise.
   */
-BOOL glRenderer__InitGL(glRenderer *This, int width, int height, int bpp, int fullscreen, unsigned int frequency, HWND hWnd, glDirectDraw7 *glDD7)
+unsigned int glRenderer_GetScanLine(glRenderer *This)
 {
-	EnterCriticalSection(&dll_cs);
-	This->ddInterface = glDD7;
-	if(This->hRC)
-	{
-		wglMakeCurrent(NULL,NULL);
-		wglDeleteContext(This->hRC);
-	};
-	PIXELFORMATDESCRIPTOR pfd;
-	GLuint pf;
-	ZeroMemory(&pfd,sizeof(PIXELFORMATDESCRIPTOR));
-	pfd.nSize = sizeof(PIXELFORMATDESCRIPTOR);
-	pfd.nVersion = 1;
-	if (dxglcfg.SingleBufferDevice) pfd.dwFlags = PFD_DRAW_TO_WINDOW | PFD_SUPPORT_OPENGL;
-	else pfd.dwFlags = PFD_DRAW_TO_WINDOW | PFD_SUPPORT_OPENGL | PFD_DOUBLEBUFFER;
-	pfd.iPixelType = PFD_TYPE_RGBA;
-	pfd.cColorBits = bpp;
-	pfd.iLayerType = PFD_MAIN_PLANE;
-	InterlockedIncrement((LONG*)&gllock);
-	This->hDC = GetDC(This->RenderWnd->hWnd);
-	if(!This->hDC)
+	WaitForSingleObject(This->ready, INFINITE);
+	return DXGLTimer_GetScanLine(&This->timer);
+}
+
+/**
+  * Marks the cached window geometry as stale.  Called from the DXGL window
+  * hook when the application window is moved or resized.
+  * @param This
+  *  Pointer to glRenderer object
+  */
+void glRenderer_WindowChanged(glRenderer *This)
+{
+	InterlockedExchange(&This->wndchanged, TRUE);
+}
+
+/**
+  * Resizes the render window to the client area of the application window
+  * if it was moved or resized since the last call.  Windows without a DXGL
+  * hook can't report changes, so they are checked on every call.
+  * @param This
+  *  Pointer to glRenderer object
+  */
+static void glRenderer__SyncWindow(glRenderer *This)
+{
+	RECT r;
+	if (!InterlockedExchange(&This->wndchanged, FALSE)) return;
+	_GetClientRect(This->hWnd, &r);
+	if (memcmp(&This->wndrect, &r, sizeof(RECT)))
 	{
-		DEBUG("glRenderer::InitGL: Can not create hDC\n");
-		InterlockedDecrement((LONG*)&gllock);
-		LeaveCriticalSection(&dll_cs);
-		return FALSE;
+		SetWindowPos(This->RenderWnd->hWnd, NULL, 0, 0, r.right, r.bottom, SWP_SHOWWINDOW);
+		This->wndrect = r;
 	}
-	pf = ChoosePixelFormat(This->hDC,&pfd);
-	if(!pf)
+	This->wndorigin.x = This->wndorigin.y = 0;
+	ClientToScreen(This->RenderWnd->hWnd, &This->wndorigin);
+	if (!GetWndHook(This->hWnd)) This->wndchanged = TRUE;
+}
+
+/**
+  * Gets the OpenGL capabilities used to fill in DirectDraw and Direct3D caps.
+  * If no renderer is given, the capabilities found by the first renderer in
+  * the process or the capability cache are used, and a temporary renderer is
+  * only created if neither has them.
+  * @param This
+  *  Pointer to glRenderer object, or NULL to use the cached capabilities
+  * @param caps
+  *  Pointer to a GLCAPS structure to receive the capabilities
+  */
+void glRenderer_GetCaps(glRenderer *This, GLCAPS *caps)
+{
+	if (This)
 	{
-		DEBUG("glRenderer::InitGL: Can not get pixelformat\n");
-		InterlockedDecrement((LONG*)&gllock);
-		LeaveCriticalSection(&dll_cs);
-		return FALSE;
+		WaitForSingleObject(This->ready, INFINITE);
+		memcpy(caps, &This->gl_caps, sizeof(GLCAPS));
+		return;
 	}
-	if(!SetPixelFormat(This->hDC,pf,&pfd))
-		DEBUG("glRenderer::InitGL: Can not set pixelformat\n");
-	This->hRC = wglCreateContext(This->hDC);
-	if(!This->hRC)
+	if (!glcaps_valid && CapsCache_GetGLCaps(caps)) return;
+	if (!glcaps_valid)
 	{
-		DEBUG("glRenderer::InitGL: Can not create GL context\n");
-		InterlockedDecrement((LONG*)&gllock);
-		LeaveCriticalSection(&dll_cs);
-		return FALSE;
+		HWND hGLWnd = CreateWindow(_T("Test"), NULL, WS_POPUP, 0, 0, 16, 16, NULL, NULL, NULL, NULL);
+		glRenderer *tmprenderer = (glRenderer*)malloc(sizeof(glRenderer));
+		DEVMODE mode;
+		mode.dmSize = sizeof(DEVMODE);
+		EnumDisplaySettings(NULL, ENUM_CURRENT_SETTINGS, &mode);
+		glRenderer_Init(tmprenderer, 16, 16, mode.dmBitsPerPel, false, mode.dmDisplayFrequency, hGLWnd, NULL, FALSE);
+		WaitForSingleObject(tmprenderer->ready, INFINITE);
+		if (!glcaps_valid) memcpy(&glcaps_cached, &tmprenderer->gl_caps, sizeof(GLCAPS));
+		glRenderer_Delete(tmprenderer);
+		free(tmprenderer);
 	}
-	if(!wglMakeCurrent(This->hDC,This->hRC))
+	memcpy(caps, &glcaps_cached, sizeof(GLCAPS));
+}
+
+/**
+  * Waits for a vertical blank reported by the display driver.  This is done
+  * on the calling thread and does not go through the command queue.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param end
+  *  TRUE to return at the end of the vertical blank instead of the start
+  * @param emulate
+  *  TRUE to wait for the vertical blank estimated with the timer if the
+  *  display driver does not report them
+  * @return
+  *  TRUE if a vertical blank was waited for, FALSE if emulate is FALSE and
+  *  the display driver does not report them
+  */
+BOOL glRenderer_WaitForVerticalBlank(glRenderer *This, BOOL end, BOOL emulate)
+{
+	WaitForSingleObject(This->ready, INFINITE);
+	return DXGLTimer_WaitVBlank(&This->timer, end, emulate);
+}
+
+/**
+  * Signals an event at the start of the next vertical blank, without
+  * blocking the calling thread.  The notification thread is started the
+  * first time this is called.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param event
+  *  Event to signal
+  * @return
+  *  DD_OK if the event will be signaled, or an error from VBlankNotify_Add
+  */
+HRESULT glRenderer_SignalVerticalBlank(glRenderer *This, HANDLE event)
+{
+	HRESULT error;
+	WaitForSingleObject(This->ready, INFINITE);
+	EnterCriticalSection(&This->cs);
+	if (!This->vblanknotify)
 	{
-		DEBUG("glRenderer::InitGL: Can not activate GL context\n");
-		wglDeleteContext(This->hRC);
-		This->hRC = NULL;
-		ReleaseDC(This->RenderWnd->hWnd,This->hDC);
-		This->hDC = NULL;
-		InterlockedDecrement((LONG*)&gllock);
-		LeaveCriticalSection(&dll_cs);
-		return FALSE;
+		This->vblanknotify = (VBlankNotify*)malloc(sizeof(VBlankNotify));
+		if (This->vblanknotify && !VBlankNotify_Init(This->vblanknotify, &This->timer))
+		{
+			free(This->vblanknotify);
+			This->vblanknotify = NULL;
+		}
+		if (!This->vblanknotify)
+		{
+			LeaveCriticalSection(&This->cs);
+			return DDERR_OUTOFMEMORY;
+		}
 	}
-	static const int contextAttribs[] = {
+	error = VBlankNotify_Add(This->vblanknotify, event);
+	LeaveCriticalSection(&This->cs);
+	return error;
+}
+
+/**
+* Fills a depth surface with a specified value.
+* @param This
+*  Pointer to glRenderer object
+* @param cmd
+*  Pointer to structure contaning all paramaters for a Blt operation, with
+*  appropriate depth fill parameters filled in.
+* @param parent
+*  Texture representing parent surface
+* @param parentlevel
+*  Mipmap level of parent surface
+* @return
+*  DD_OK if the depth fill succeeded.
+*/
+HRESULT glRenderer_DepthFill(glRenderer *This, BltCommand *cmd, glTexture *parent, GLint parentlevel)
+{
+	EnterCriticalSection(&This->cs);
+	This->inputs[0] = cmd;
+	This->inputs[1] = parent;
+	This->inputs[2] = (void*)parentlevel;
+	glRenderer_FlushBlts(This);
+	This->opcode = OP_DEPTHFILL;
+	glRenderer_Wake(This);
+	glRenderer_WaitForThread(This, OP_DEPTHFILL);
+	LeaveCriticalSection(&This->cs);
+	return (HRESULT)This->outputs[0];
+}
+
+/**
+  * Sets a render state within the renderer.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param dwRendStateType
+  *  Render state to change
+  * @param dwRenderState
+  *  New render state value
+  */
+void glRenderer_SetRenderState(glRenderer *This, D3DRENDERSTATETYPE dwRendStateType, DWORD dwRenderState)
+{
+	QueueCmd cmd;
+	cmd.args.renderstate.type = dwRendStateType;
+	cmd.args.renderstate.value = dwRenderState;
+	EnterCriticalSection(&This->cs);
+	if (dwRendStateType == D3DRENDERSTATE_FOGENABLE) This->drawbatch.fogenable = dwRenderState ? TRUE : FALSE;
+	LeaveCriticalSection(&This->cs);
+	glRenderer_AddCommand(This, OP_SETRENDERSTATE, &cmd.args, sizeof(cmd.args.renderstate));
+}
+
+/**
+  * Binds a surface to a texture stage in the renderer.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param dwStage
+  *  Texture stage to bind (8 through 11 are reserved for 2D drawing)
+  * @param Texture
+  *  Texture to bind to the stage; NULL to unbind
+  */
+void glRenderer_SetTexture(glRenderer *This, DWORD dwStage, glTexture *Texture)
+{
+	QueueCmd cmd;
+	cmd.args.texture.stage = dwStage;
+	cmd.args.texture.texture = Texture;
+	EnterCriticalSection(&This->cs);
+	if (!glRenderer_BatchSwitchesTexture(This, dwStage, Texture)) glRenderer_FlushDraws(This);
+	if (dwStage < 8) This->drawbatch.textures[dwStage] = Texture;
+	glRenderer_AddCommand(This, OP_SETTEXTURE, &cmd.args, sizeof(cmd.args.texture));
+	LeaveCriticalSection(&This->cs);
+}
+
+/**
+  * Sets a texture stage state within the renderer.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param dwStage
+  *  Texture stage to modify
+  * @param dwState
+  *  Texture stage state to modify
+  * @param dwValue
+  *  New value for texture stage state.
+  */
+void glRenderer_SetTextureStageState(glRenderer *This, DWORD dwStage, D3DTEXTURESTAGESTATETYPE dwState, DWORD dwValue)
+{
+	QueueCmd cmd;
+	cmd.args.texturestagestate.stage = dwStage;
+	cmd.args.texturestagestate.type = dwState;
+	cmd.args.texturestagestate.value = dwValue;
+	glRenderer_AddCommand(This, OP_SETTEXTURESTAGESTATE, &cmd.args, sizeof(cmd.args.texturestagestate));
+}
+
+/**
+  * Sets a transform matrix in the renderer.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param dtstTransformStateType
+  *  Transform matrix to replace
+  * @param lpD3DMatrix
+  *  New transform matrix
+  */
+void glRenderer_SetTransform(glRenderer *This, D3DTRANSFORMSTATETYPE dtstTransformStateType, LPD3DMATRIX lpD3DMatrix)
+{
+	QueueCmd cmd;
+	cmd.args.transform.type = dtstTransformStateType;
+	memcpy(&cmd.args.transform.matrix, lpD3DMatrix, sizeof(D3DMATRIX));
+	glRenderer_AddCommand(This, OP_SETTRANSFORM, &cmd.args, sizeof(cmd.args.transform));
+}
+
+/**
+  * Sets the material in the renderer.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param lpMaterial
+  *  New material parameters
+  */
+void glRenderer_SetMaterial(glRenderer *This, LPD3DMATERIAL7 lpMaterial)
+{
+	QueueCmd cmd;
+	memcpy(&cmd.args.material, lpMaterial, sizeof(D3DMATERIAL7));
+	glRenderer_AddCommand(This, OP_SETMATERIAL, &cmd.args, sizeof(D3DMATERIAL7));
+}
+
+/**
+  * Sets a light in the renderer.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param index
+  *  Index of light to set
+  * @param light
+  *  Pointer to light to change, ignored if remove is TRUE
+  */
+
+void glRenderer_SetLight(glRenderer *This, DWORD index, LPD3DLIGHT7 light)
+{
+	QueueCmd cmd;
+	cmd.args.light.index = index;
+	memcpy(&cmd.args.light.light, light, sizeof(D3DLIGHT7));
+	glRenderer_AddCommand(This, OP_SETLIGHT, &cmd.args, sizeof(cmd.args.light));
+}
+
+/**
+  * Removes a light from the renderer.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param index
+  *  Index of light to remove
+  */
+void glRenderer_RemoveLight(glRenderer *This, DWORD index)
+{
+	QueueCmd cmd;
+	cmd.args.removelight = index;
+	glRenderer_AddCommand(This, OP_REMOVELIGHT, &cmd.args, sizeof(DWORD));
+}
+
+/**
+  * Sets the Direct3D viewport for the renderer.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param lpViewport
+  *  New viewport parameters for renderer.
+  */
+void glRenderer_SetD3DViewport(glRenderer *This, LPD3DVIEWPORT7 lpViewport)
+{
+	QueueCmd cmd;
+	memcpy(&cmd.args.viewport, lpViewport, sizeof(D3DVIEWPORT7));
+	glRenderer_AddCommand(This, OP_SETD3DVIEWPORT, &cmd.args, sizeof(D3DVIEWPORT7));
+}
+
+/**
+* Sets a color key for a texture object.
+* @param This
+*  Pointer to glRenderer object
+* @param texture
+*  Texture to set color key on
+* @param dwFlags
+*  DDraw color key flags to select color key to add or update
+* @param lpDDColorKey
+*  Pointer to a DDraw color key structure to set in the texture
+* @param level
+*  Mip level of color key to set for DirectDraw; Direct3D colorkey operations use level 0
+*/
+void glRenderer_SetTextureColorKey(glRenderer *This, glTexture *texture, DWORD dwFlags, LPDDCOLORKEY lpDDColorKey, GLint level)
+{
+	QueueCmd cmd;
+	cmd.args.colorkey.texture = texture;
+	cmd.args.colorkey.flags = dwFlags;
+	if (lpDDColorKey)
+	{
+		cmd.args.colorkey.setkey = TRUE;
+		cmd.args.colorkey.key = *lpDDColorKey;
+	}
+	else
+	{
+		cmd.args.colorkey.setkey = FALSE;
+		ZeroMemory(&cmd.args.colorkey.key, sizeof(DDCOLORKEY));
+	}
+	cmd.args.colorkey.level = level;
+	EnterCriticalSection(&This->cs);
+	glRenderer_AddCommand(This, OP_SETTEXTURECOLORKEY, &cmd.args, sizeof(cmd.args.colorkey));
+	glRenderer__MarkLevel(This, texture, level, TRUE);
+	LeaveCriticalSection(&This->cs);
+}
+
+/**
+  * Updates a range of entries in a palette texture.  Only the changed
+  * entries are copied into the command ring, and consecutive updates of the
+  * same palette are uploaded together.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param texture
+  *  Palette texture to update
+  * @param start
+  *  First palette entry to update
+  * @param count
+  *  Number of palette entries to update
+  * @param entries
+  *  Pointer to the new palette entries
+  */
+void glRenderer_UpdatePalette(glRenderer *This, glTexture *texture, DWORD start, DWORD count, const DWORD *entries)
+{
+	QueueCmd cmd;
+	if (!count) return;
+	if (start + count > 256) count = 256 - start;
+	cmd.args.palette.texture = texture;
+	cmd.args.palette.start = start;
+	cmd.args.palette.count = count;
+	memcpy(cmd.args.palette.entries, entries, count * sizeof(DWORD));
+	EnterCriticalSection(&This->cs);
+	glRenderer_AddCommand(This, OP_UPDATEPALETTE, &cmd.args,
+		FIELD_OFFSET(QueueCmd, args.palette.entries) - FIELD_OFFSET(QueueCmd, args) + (count * sizeof(DWORD)));
+	glRenderer__MarkLevel(This, texture, 0, TRUE);
+	LeaveCriticalSection(&This->cs);
+}
+
+/**
+  * Adds an overlay to be drawn over the primary surface, or updates an
+  * overlay added before.  The renderer keeps the overlay until it is
+  * removed, so it does not need to be passed when drawing the screen.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param overlay
+  *  Overlay to add or update, copied into the command ring
+  */
+void glRenderer_SetOverlay(glRenderer *This, const OVERLAY *overlay)
+{
+	glRenderer_AddCommand(This, OP_SETOVERLAY, overlay, sizeof(OVERLAY));
+}
+
+/**
+  * Moves an overlay added with glRenderer_SetOverlay.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param surface
+  *  Overlay surface to move
+  * @param x
+  *  New left edge of the overlay on the primary
+  * @param y
+  *  New top edge of the overlay on the primary
+  */
+void glRenderer_SetOverlayPosition(glRenderer *This, void *surface, LONG x, LONG y)
+{
+	QueueCmd cmd;
+	cmd.args.overlaypos.surface = surface;
+	cmd.args.overlaypos.x = x;
+	cmd.args.overlaypos.y = y;
+	glRenderer_AddCommand(This, OP_SETOVERLAYPOSITION, &cmd.args, sizeof(cmd.args.overlaypos));
+}
+
+/**
+  * Removes an overlay added with glRenderer_SetOverlay.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param surface
+  *  Overlay surface to remove, or NULL to remove all overlays
+  */
+void glRenderer_RemoveOverlay(glRenderer *This, void *surface)
+{
+	glRenderer_AddCommand(This, OP_REMOVEOVERLAY, &surface, sizeof(void*));
+}
+
+/**
+  * Queues an unlocked texture level to be uploaded ahead of the draws that
+  * use it, without waiting for the renderer thread.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param texture
+  *  Texture written by the CPU
+  * @param level
+  *  Mipmap level that was unlocked
+  */
+void glRenderer_QueueUpload(glRenderer *This, glTexture *texture, GLint level)
+{
+	QueueCmd cmd;
+	cmd.args.upload.texture = texture;
+	cmd.args.upload.level = level;
+	EnterCriticalSection(&This->cs);
+	glRenderer_AddCommand(This, OP_QUEUEUPLOAD, &cmd.args, sizeof(cmd.args.upload));
+	// Reads the surface buffer and writes the GL texture
+	glRenderer__MarkLevel(This, texture, level, FALSE);
+	glRenderer__MarkLevel(This, texture, level, TRUE);
+	LeaveCriticalSection(&This->cs);
+}
+
+/**
+  * Makes a texture ready to draw with ahead of its first draw, without
+  * waiting for the renderer thread.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param texture
+  *  Texture to move to video memory and upload
+  */
+void glRenderer_PreloadTexture(glRenderer *This, glTexture *texture)
+{
+	DWORD i;
+	EnterCriticalSection(&This->cs);
+	glRenderer_AddCommand(This, OP_PRELOADTEXTURE, &texture, sizeof(glTexture*));
+	for (i = 0; i < texture->levels[0].ddsd.dwMipMapCount; i++)
+	{
+		glRenderer__MarkLevel(This, texture, i, FALSE);
+		glRenderer__MarkLevel(This, texture, i, TRUE);
+	}
+	LeaveCriticalSection(&This->cs);
+}
+
+/**
+  * Sets the gamma ramp applied by the final draw to the window.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param ramp
+  *  Red, green and blue ramps with 256 16-bit entries each
+  */
+void glRenderer_SetGammaRamp(glRenderer *This, const DDGAMMARAMP *ramp)
+{
+	EnterCriticalSection(&This->cs);
+	glRenderer_AddCommand(This, OP_SETGAMMARAMP, ramp, sizeof(DDGAMMARAMP));
+	LeaveCriticalSection(&This->cs);
+}
+
+/**
+* Sets whether a texure has primary scaling
+* @param This
+*  Pointer to glRenderer object
+* @param texture
+*  Texture to set primary scaling
+* @param parent
+*  Parent texture this one is attached to, needed only if primary is TRUE
+* @param primary
+*  TRUE if texture should have primary scaling, FALSE to remove scaling
+*/
+void glRenderer_MakeTexturePrimary(glRenderer *This, glTexture *texture, glTexture *parent, BOOL primary)
+{
+	EnterCriticalSection(&This->cs);
+	This->inputs[0] = texture;
+	This->inputs[1] = parent;
+	This->inputs[2] = (void*)primary;
+	glRenderer_FlushBlts(This);
+	This->opcode = OP_MAKETEXTUREPRIMARY;
+	glRenderer_Wake(This);
+	glRenderer_WaitForThread(This, OP_MAKETEXTUREPRIMARY);
+	LeaveCriticalSection(&This->cs);
+}
+
+/**
+  * Generates a glFrameTerminatorGREMEDY command in OpenGL if the 
+  * glFrameTerminatorGREMEDY command is available
+  * (i.e. running under gDebugger or CodeXL).
+  * @param This
+  *  Pointer to glRenderer object
+  */
+void glRenderer_DXGLBreak(glRenderer *This)
+{
+	glRenderer_AddCommand(This, OP_DXGLBREAK, NULL, 0);
+}
+
+/**
+  * Frees a pointer via the backend to ensure textures are not freed early.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param ptr
+  *  Pointer to free in backend thread
+  */
+void glRenderer_FreePointer(glRenderer *This, void *ptr)
+{
+	QueueCmd cmd;
+	cmd.args.ptr = ptr;
+	glRenderer_AddCommand(This, OP_FREEPOINTER, &cmd.args, sizeof(void*));
+}
+
+/**
+  * Releases a buffer object in the backend thread, after any queued commands
+  * that may still use it.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param buffer
+  *  Buffer object to release
+  */
+void glRenderer_ReleaseBuffer(glRenderer *This, BufferObject *buffer)
+{
+	QueueCmd cmd;
+	cmd.args.ptr = buffer;
+	glRenderer_AddCommand(This, OP_RELEASEBUFFER, &cmd.args, sizeof(void*));
+}
+
+/**
+  * Sends a packet of coalesced state changes to the renderer.  The packet is
+  * copied into the command ring, so it may be reused as soon as this returns.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param delta
+  *  Pointer to the state changes to apply
+  */
+void glRenderer_ApplyStateDelta(glRenderer *This, StateDelta *delta)
+{
+	size_t size = (2 * delta->renderstatecount) + (3 * delta->texturestagecount) + (17 * delta->transformcount);
+	if (!size) return;
+	glRenderer_AddCommand(This, OP_APPLYSTATEDELTA, delta, FIELD_OFFSET(StateDelta, data) + (size * sizeof(DWORD)));
+}
+
+/**
+  * Waits for the renderer thread to execute all commands in the command ring.
+  * Must be called before reading any state written by queued commands.
+  * @param This
+  *  Pointer to glRenderer object
+  */
+void glRenderer_Sync(glRenderer *This)
+{
+	EnterCriticalSection(&This->cs);
+	glRenderer_FlushBlts(This);
+	if (This->cmdbuffer[0].readptr == This->cmdbuffer[0].cmdptr)
+	{
+		LeaveCriticalSection(&This->cs);
+		return;
+	}
+	This->opcode = OP_SYNC;
+	glRenderer_Wake(This);
+	glRenderer_WaitForThread(This, OP_SYNC);
+	LeaveCriticalSection(&This->cs);
+}
+
+/**
+  * Checks without waiting whether queued commands reading or writing a
+  * texture level are still to be executed.  Held blts are handed to the
+  * renderer thread so that polling eventually reports them done.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param texture
+  *  Texture to check
+  * @param level
+  *  Mipmap level to check
+  * @return
+  *  TRUE if a command using the level is still in the command ring
+  */
+BOOL glRenderer_IsTextureBusy(glRenderer *This, glTexture *texture, GLint level)
+{
+	CmdBuffer *ring = &This->cmdbuffer[0];
+	DWORD bound;
+	BOOL busy;
+	EnterCriticalSection(&This->cs);
+	if (ring->heldblt)
+	{
+		ring->cmdptr = ring->writeptr;
+		ring->heldblt = NULL;
+		glRenderer_Wake(This);
+	}
+	// An empty ring also covers sequence numbers from before the ring was reset
+	if (ring->readptr == ring->writeptr) busy = FALSE;
+	else
+	{
+		bound = ring->doneseq;
+		glRenderer__LevelBound(texture, level, TRUE, &bound);
+		busy = (LONG)(bound - ring->doneseq) > 0;
+	}
+	LeaveCriticalSection(&This->cs);
+	return busy;
+}
+
+/**
+  * Waits for the queued commands that use a texture level, leaving the
+  * commands that do not use it to the renderer thread.  The renderer lock
+  * is not held while waiting, so other threads are not held up by the wait.
+  * Must be called before the CPU accesses the level.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param texture
+  *  Texture to be accessed
+  * @param level
+  *  Mipmap level to be accessed
+  * @param write
+  *  TRUE if the level will be written, so queued commands reading it are
+  *  also waited for
+  */
+void glRenderer_WaitForTexture(glRenderer *This, glTexture *texture, GLint level, BOOL write)
+{
+	CmdBuffer *ring = &This->cmdbuffer[0];
+	DWORD bound;
+	EnterCriticalSection(&This->cs);
+	glRenderer_FlushBlts(This);
+	bound = ring->doneseq;
+	glRenderer__LevelBound(texture, level, write, &bound);
+	LeaveCriticalSection(&This->cs);
+	if ((ring->readptr == ring->cmdptr) || ((LONG)(bound - ring->doneseq) <= 0)) return;
+	// The commands up to the bound were handed to the renderer thread, which runs them without an opcode
+	glRenderer_WaitForSequence(This, bound, OP_SYNC);
+}
+
+/**
+  * Checks whether a blt can be added to the command ring without waiting
+  * for the renderer thread.
+  * @param This
+  *  Pointer to glRenderer object
+  * @return
+  *  TRUE if the command ring has room for a blt
+  */
+BOOL glRenderer_CanQueueBlt(glRenderer *This)
+{
+	CmdBuffer *ring = &This->cmdbuffer[0];
+	size_t write, next;
+	BOOL room;
+	EnterCriticalSection(&This->cs);
+	if (!ring->cmdbuffer) room = TRUE;
+	else room = glRenderer__FindRoom(ring, (FIELD_OFFSET(QueueCmd, args) + sizeof(BltCommand) + 7) & ~7,
+		&write, &next);
+	LeaveCriticalSection(&This->cs);
+	return room;
+}
+
+/**
+  * Checks whether a primary surface draw scheduled with
+  * glRenderer_ScheduleDrawScreen has not reached the screen yet.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param texture
+  *  Texture to check for, or NULL to check for any scheduled draw
+  * @return
+  *  TRUE if the draw is still pending
+  */
+BOOL glRenderer_IsDrawPending(glRenderer *This, glTexture *texture)
+{
+	glTexture *pending = This->recomposite;
+	if (!pending) return FALSE;
+	return !texture || (pending == texture);
+}
+
+/**
+  * Records the creation of a texture, preceded by the display mode if it is
+  * a primary surface.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param texture
+  *  Texture being created
+  */
+static void glRenderer__CaptureTexture(glRenderer *This, glTexture *texture)
+{
+	if ((texture->levels[0].ddsd.ddsCaps.dwCaps & DDSCAPS_PRIMARYSURFACE) && This->ddInterface)
+		Capture_SetMode(This->capture, This->ddInterface->primaryx, This->ddInterface->primaryy,
+			This->ddInterface->primarybpp, This->ddInterface->primaryrefresh,
+			glDirectDraw7_GetFullscreen(This->ddInterface));
+	Capture_MakeTexture(This->capture, texture);
+}
+
+/**
+  * Main loop for glRenderer class
+  * @param This
+  *  Pointer to glRenderer object
+  * @return
+  *  Returns 0 to signal successful thread termination
+  */
+DWORD glRenderer__Entry(glRenderer *This)
+{
+	int i;
+	int opcode;
+	char str[256];
+	ThreadPriority priority;
+	ThreadPriority_Enter(&priority, TRUE);
+	EnterCriticalSection(&This->cs);
+	// Commands wait on the renderer lock until initialization is done
+	SetEvent(This->busy);
+	if(glRenderer__InitGL(This,(int)This->inputs[0],(int)This->inputs[1],(int)This->inputs[2],
+		(int)This->inputs[3],(unsigned int)This->inputs[4],(HWND)This->inputs[5],
+		(glDirectDraw7*)This->inputs[6]))
+	{
+		glRenderer_InitCmdBuffer(This, &This->cmdbuffer[0]);
+		glRenderer__ChooseUnpack(This, &This->cmdbuffer[0]);
+	}
+	LeaveCriticalSection(&This->cs);
+	SetEvent(This->ready);
+	while(1)
+	{
+		glRenderer__WaitForCommands(This);
+		// Commands in the ring were queued before the opcode was set, so
+		// drain the ring after fetching the opcode to keep them in order.
+		opcode = InterlockedExchange((volatile LONG*)&This->opcode, OP_NULL);
+		// Opcodes that only depend on some of the commands run right after them
+		if ((opcode != OP_NULL) && InterlockedExchange(&This->queuebounded, FALSE))
+			glRenderer__ExecuteQueue(This, TRUE, This->queueseq);
+		else glRenderer__ExecuteQueue(This, FALSE, 0);
+		// OP_DELETE deletes the timeline before the span would end
+		ScopedTimelineSpan span(((opcode != OP_NULL) && (opcode != OP_DELETE)) ? This->timeline : NULL,
+			glRenderer__OpcodeName(opcode));
+		switch(opcode)
+		{
+		case OP_NULL:
+			break;
+		case OP_SYNC:
+			SetEvent(This->busy);
+			break;
+		case OP_DELETE:
+			if(This->hRC)
+			{
+				// Shows the frames still queued before the window goes away
+				if (This->presenter)
+				{
+					Presenter_Delete(This->presenter);
+					free(This->presenter);
+					This->presenter = NULL;
+				}
+				if (This->dxgioutput) DXGIOutput_Delete(This->dxgioutput);
+				This->dxgioutput = NULL;
+				if (This->dxgiframe.initialized) glTexture_Release(&This->dxgiframe, TRUE);
+				ZeroMemory(&This->dxgiframe, sizeof(glTexture));
+				glUtil_DeleteFBO(This->util, &This->dxgifbo);
+				if(This->dib.enabled)
+				{
+					if(This->dib.hbitmap) DeleteObject(This->dib.hbitmap);
+					if(This->dib.hdc) DeleteDC(This->dib.hdc);
+					if (This->dib.info) free(This->dib.info);
+					ZeroMemory(&This->dib,sizeof(DIB));
+				}
+				glUtil_DeleteFBO(This->util, &This->fbo);
+				for (i = 0; i < DIB_READBACK_BUFFERS; i++)
+				{
+					if (This->pbofences[i]) This->ext->glDeleteSync(This->pbofences[i]);
+					This->pbofences[i] = NULL;
+					if (This->pbo[i]) BufferObject_Release(This->pbo[i]);
+					This->pbo[i] = NULL;
+				}
+				This->pbopending = -1;
+				if (This->dibflip.initialized) glTexture_Release(&This->dibflip, TRUE);
+				ZeroMemory(&This->dibflip, sizeof(glTexture));
+				if (This->gammatexture.initialized) glTexture_Release(&This->gammatexture, TRUE);
+				ZeroMemory(&This->gammatexture, sizeof(glTexture));
+				for (i = 0; i < 16; i++)
+				{
+					if (This->backbuffers[i].initialized)
+					{
+						glTexture_Release(&This->backbuffers[i], TRUE);
+					}
+				}
+				ZeroMemory(&This->backbuffers, 16 * sizeof(glTexture));
+				if (This->scrolltexture)
+				{
+					glTexture_Release(This->scrolltexture, TRUE);
+					This->scrolltexture = NULL;
+				}
+				if (This->borderfence) This->ext->glDeleteSync(This->borderfence);
+				This->borderfence = NULL;
+				if (This->borderpbo) BufferObject_Release(This->borderpbo);
+				This->borderpbo = NULL;
+				This->bordertexture = NULL;
+				for (i = 0; i < FRAMEPACING_MAXFRAMES; i++)
+				{
+					if (This->framefences[i]) This->ext->glDeleteSync(This->framefences[i]);
+					This->framefences[i] = NULL;
+				}
+				DXGLTimer_Delete(&This->timer);
+				glRenderer__DeleteVertexArrays(This);
+				glRenderer_DeleteCmdBuffer(This, &This->cmdbuffer[0]);
+				for (i = 0; i < 4; i++)
+				{
+					if (This->ubo[i]) BufferObject_Release(This->ubo[i]);
+					This->ubo[i] = NULL;
+				}
+				if (This->indirect) BufferObject_Release(This->indirect);
+				This->indirect = NULL;
+				if (This->drawhandles) free(This->drawhandles);
+				This->drawhandles = NULL;
+				This->batchtextures = FALSE;
+				if (This->residency)
+				{
+					TextureResidency_Delete(This->residency);
+					free(This->residency);
+					This->residency = NULL;
+				}
+				if (This->texpool)
+				{
+					TexturePool_Delete(This->texpool);
+					free(This->texpool);
+					This->texpool = NULL;
+				}
+				if (This->arena)
+				{
+					FrameArena_Delete(This->arena);
+					free(This->arena);
+					This->arena = NULL;
+				}
+				if (This->atlas)
+				{
+					TextureAtlas_Delete(This->atlas);
+					free(This->atlas);
+					This->atlas = NULL;
+				}
+				if (This->postprocess)
+				{
+					PostProcess_Delete(This->postprocess);
+					free(This->postprocess);
+					This->postprocess = NULL;
+				}
+				if (This->timeline)
+				{
+					Timeline_Delete(This->timeline);
+					free(This->timeline);
+					This->timeline = NULL;
+				}
+				if (This->shadertiming)
+				{
+					ShaderTiming_Delete(This->shadertiming);
+					free(This->shadertiming);
+					This->shadertiming = NULL;
+				}
+				if (This->framecapture)
+				{
+					FrameCapture_Delete(This->framecapture);
+					free(This->framecapture);
+					This->framecapture = NULL;
+				}
+				if (This->latency)
+				{
+					LatencyMeter_Delete(This->latency);
+					free(This->latency);
+					This->latency = NULL;
+				}
+				if (This->dwmsync)
+				{
+					DwmSync_Delete(This->dwmsync);
+					free(This->dwmsync);
+					This->dwmsync = NULL;
+				}
+				if (This->capture)
+				{
+					Capture_Delete(This->capture);
+					free(This->capture);
+					This->capture = NULL;
+				}
+				free(This->bltbatch);
+				free(This->bltbatchvertices);
+				free(This->bltbatchindices);
+				This->bltbatch = NULL;
+				This->bltbatchvertices = NULL;
+				This->bltbatchindices = NULL;
+				ShaderManager_Delete(This->shaders);
+				glUtil_Release(This->util);
+				free(This->shaders);
+				free(This->ext);
+				if (This->overlays) free(This->overlays);
+				This->overlays = NULL;
+				This->overlaycount = This->maxoverlays = 0;
+				sprintf(str, "Texture uploads: peak %u KB per frame, %u frames over budget\n",
+					(DWORD)(This->uploadpeak / 1024), This->uploadframes);
+				TRACE_STRING(str);
+				if (This->uploads) free(This->uploads);
+				This->uploads = NULL;
+				This->uploadcount = This->maxuploads = 0;
+				This->ext = NULL;
+				wglMakeCurrent(NULL,NULL);
+				wglDeleteContext(This->hRC);
+				This->hRC = NULL;
+				glRenderer__DeleteAffinityDC(This);
+			};
+			if(This->hDC) ReleaseDC(This->RenderWnd->hWnd,This->hDC);
+			This->hDC = NULL;
+			if (This->dib.info) free(This->dib.info);
+			This->dib.info = NULL;
+			glRenderWindow_Delete(This->RenderWnd);
+			This->RenderWnd = NULL;
+			ThreadPriority_Leave(&priority);
+			SetEvent(This->busy);
+			return 0;
+			break;
+		case OP_SETWND:
+			glRenderer__SetWnd(This,(int)This->inputs[0],(int)This->inputs[1],(int)This->inputs[2],
+				(int)This->inputs[3],(unsigned int)This->inputs[4],(HWND)This->inputs[5],(BOOL)This->inputs[6]);
+			break;
+		case OP_CREATE:
+			for (i = 0; i < (int)This->inputs[1]; i++)
+			{
+				if (This->capture) glRenderer__CaptureTexture(This, &((glTexture*)This->inputs[0])[i]);
+				glRenderer__MakeTexture(This, &((glTexture*)This->inputs[0])[i]);
+			}
+			SetEvent(This->busy);
+			break;
+		case OP_UPLOAD:
+			glRenderer__UploadTexture(This,(glTexture*)This->inputs[0],(GLint)This->inputs[1]);
+			SetEvent(This->busy);
+			break;
+		case OP_DOWNLOAD:
+			if (This->capture) Capture_Download(This->capture, (glTexture*)This->inputs[0], (GLint)This->inputs[1]);
+			if (!This->inputs[2] || !glTexture__DownloadRect((glTexture*)This->inputs[0],
+				(GLint)This->inputs[1], (LPRECT)This->inputs[2]))
+				glRenderer__DownloadTexture(This,(glTexture*)This->inputs[0],(GLint)This->inputs[1]);
+			SetEvent(This->busy);
+			break;
+		case OP_MAPTEXTURELOCK:
+			This->outputs[0] = glTexture__MapLock((glTexture*)This->inputs[0],(GLint)This->inputs[1]);
+			SetEvent(This->busy);
+			break;
+		case OP_DELETETEX:
+			if (This->capture) Capture_DeleteTexture(This->capture, (glTexture*)This->inputs[0]);
+			glRenderer__DeleteTexture(This,(glTexture*)This->inputs[0]);
+			break;
+		case OP_BLT:
+			if (This->capture) Capture_Blt(This->capture, (BltCommand*)This->inputs[0]);
+			glRenderer__Blt(This, (BltCommand*)This->inputs[0], FALSE);
+			break;
+		case OP_DRAWSCREEN:
+			// A full present replaces the scheduled one
+			InterlockedCompareExchangePointer((PVOID volatile*)&This->recomposite, NULL, This->inputs[0]);
+			if (This->capture) Capture_DrawScreen(This->capture, (glTexture*)This->inputs[0], (glTexture*)This->inputs[1],
+				(GLint)This->inputs[2], (glTexture*)This->inputs[3], (BOOL)This->inputs[4]);
+			glRenderer__DrawScreen(This,(glTexture*)This->inputs[0],(glTexture*)This->inputs[1],
+				(GLint)This->inputs[2],(glTexture*)This->inputs[3],TRUE,(BOOL)This->inputs[4]);
+			break;
+		case OP_INITD3D:
+			if (This->capture) Capture_InitD3D(This->capture, (int)This->inputs[0], (int)This->inputs[1], (int)This->inputs[2]);
+			glRenderer__InitD3D(This,(int)This->inputs[0],(int)This->inputs[1],(int)This->inputs[2]);
+			break;
+		case OP_CLEAR:
+			if (This->capture) Capture_Clear(This->capture, (ClearCommand*)This->inputs[0]);
+			glRenderer__Clear(This,(ClearCommand*)This->inputs[0]);
+			break;
+		case OP_FLUSH:
+			if (This->capture) Capture_Flush(This->capture);
+			glRenderer__Flush(This);
+			break;
+		case OP_DRAWBATCH:
+			glRenderer__DrawBatch(This);
+			break;
+		case OP_DRAWPRIMITIVES:
+			glRenderer__DrawPrimitives(This,(RenderTarget*)&This->inputs[8],(GLenum)This->inputs[1],
+				(DWORD)This->inputs[3],(BYTE*)This->inputs[2],(VertexBuffer*)This->inputs[0],(BOOL)This->inputs[16],
+				(DWORD)This->inputs[4],(LPWORD)This->inputs[5],GL_UNSIGNED_SHORT,(DWORD)This->inputs[6],(DWORD)This->inputs[7]);
+			break;
+		case OP_UPDATECLIPPER:
+			glRenderer__UpdateClipper(This,(glTexture*)This->inputs[0], (GLushort*)This->inputs[1],
+				(BltVertex*)This->inputs[2], (GLsizei)This->inputs[3], (GLsizei)This->inputs[4], (GLsizei)This->inputs[5]);
+			break;
+		case OP_DEPTHFILL:
+			if (This->capture) Capture_DepthFill(This->capture, (BltCommand*)This->inputs[0], (glTexture*)This->inputs[1],
+				(GLint)This->inputs[2]);
+			glRenderer__DepthFill(This, (BltCommand*)This->inputs[0], (glTexture*)This->inputs[1], (GLint)This->inputs[2]);
+			break;
+		case OP_MAKETEXTUREPRIMARY:
+			if (This->capture) Capture_MakeTexturePrimary(This->capture, (glTexture*)This->inputs[0], (glTexture*)This->inputs[1],
+				(DWORD)This->inputs[2]);
+			glRenderer__MakeTexturePrimary(This, (glTexture*)This->inputs[0], (glTexture*)This->inputs[1], (DWORD)This->inputs[2]);
+			break;
+		case OP_ENDCOMMAND:
+			glRenderer__EndCommand(This, (BOOL)This->inputs[0]);
+			break;
+		}
+		if (This->capture) Capture_EndCommand(This->capture);
+	}
+	return 0;
+}
+
+/**
+  * Uploads the palette entries changed since the last upload.
+  * @param This
+  *  Pointer to glRenderer object
+  */
+static void glRenderer__FlushPalette(glRenderer *This)
+{
+	glTexture *texture = This->palettetexture;
+	MIPLEVEL *mip;
+	GLint x, y;
+	if (!texture) return;
+	This->palettetexture = NULL;
+	mip = &texture->levels[0];
+	if (!mip->buffer) return;
+	x = This->palettestart;
+	y = 0;
+	if (texture->atlas)
+	{
+		x += texture->atlasx;
+		y = texture->atlasy;
+	}
+	if (This->ext->GLEXT_EXT_direct_state_access)
+		This->ext->glTextureSubImage2DEXT(texture->id, texture->target, 0, x, y,
+			This->paletteend - This->palettestart, 1, texture->format, texture->type,
+			mip->buffer + (This->palettestart * 4));
+	else
+	{
+		glUtil_SetActiveTexture(This->util, 0);
+		glUtil_SetTexture(This->util, 0, texture);
+		glTexSubImage2D(texture->target, 0, x, y, This->paletteend - This->palettestart, 1,
+			texture->format, texture->type, mip->buffer + (This->palettestart * 4));
+	}
+}
+
+/**
+  * Converts a gamma ramp to the lookup table used by the final draw and
+  * uploads it if it changed.  An identity ramp disables the lookup.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param ramp
+  *  Red, green and blue ramps with 256 16-bit entries each
+  */
+static void glRenderer__SetGammaRamp(glRenderer *This, const DDGAMMARAMP *ramp)
+{
+	DDSURFACEDESC2 ddsd;
+	DWORD lut[256];
+	BOOL identity = TRUE;
+	int i;
+	for (i = 0; i < 256; i++)
+	{
+		// Only the top 8 bits of each entry are kept, stored as R8G8B8 in memory order
+		lut[i] = (ramp->red[i] >> 8) | (ramp->green[i] & 0xFF00) | ((ramp->blue[i] & 0xFF00) << 8);
+		if (lut[i] != (DWORD)(i | (i << 8) | (i << 16))) identity = FALSE;
+	}
+	This->gammaenabled = !identity;
+	if (identity) return;
+	if (!This->gammatexture.initialized)
+	{
+		memcpy(&ddsd, &ddsdbackbuffer, sizeof(DDSURFACEDESC2));
+		ddsd.dwWidth = 256;
+		ddsd.lPitch = 256 * 4;
+		ddsd.dwHeight = 1;
+		if (FAILED(glTexture_Create(&ddsd, &This->gammatexture, This, TRUE, 0)))
+		{
+			ZeroMemory(&This->gammatexture, sizeof(glTexture));
+			This->gammaenabled = FALSE;
+			return;
+		}
+		This->gammatexture.freeonrelease = FALSE;
+	}
+	else if (!memcmp(This->gammalut, lut, sizeof(lut))) return;
+	memcpy(This->gammalut, lut, sizeof(lut));
+	if (This->ext->GLEXT_EXT_direct_state_access)
+		This->ext->glTextureSubImage2DEXT(This->gammatexture.id, This->gammatexture.target, 0, 0, 0,
+			256, 1, This->gammatexture.format, This->gammatexture.type, lut);
+	else
+	{
+		glUtil_SetActiveTexture(This->util, 0);
+		glUtil_SetTexture(This->util, 0, &This->gammatexture);
+		glTexSubImage2D(This->gammatexture.target, 0, 0, 0, 256, 1,
+			This->gammatexture.format, This->gammatexture.type, lut);
+	}
+}
+
+/**
+  * Copies new palette entries into a palette texture's buffer and adds them
+  * to the range uploaded by glRenderer__FlushPalette.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param texture
+  *  Palette texture to update
+  * @param start
+  *  First palette entry to update
+  * @param count
+  *  Number of palette entries to update
+  * @param entries
+  *  Pointer to the new palette entries
+  */
+static void glRenderer__UpdatePalette(glRenderer *This, glTexture *texture, DWORD start, DWORD count, const DWORD *entries)
+{
+	MIPLEVEL *mip = &texture->levels[0];
+	if (This->palettetexture && (This->palettetexture != texture)) glRenderer__FlushPalette(This);
+	// The buffer is allocated when the palette texture is created
+	if (!mip->buffer) return;
+	memcpy(mip->buffer + (start * 4), entries, count * sizeof(DWORD));
+	if (!This->palettetexture)
+	{
+		This->palettetexture = texture;
+		This->palettestart = start;
+		This->paletteend = start + count;
+	}
+	else
+	{
+		if (start < This->palettestart) This->palettestart = start;
+		if (start + count > This->paletteend) This->paletteend = start + count;
+	}
+}
+
+/**
+  * Finds an overlay in the overlay registry of the renderer.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param surface
+  *  Overlay surface to find
+  * @return
+  *  Pointer to the overlay, or NULL if it was not added
+  */
+static RendererOverlay *glRenderer__FindOverlay(glRenderer *This, void *surface)
+{
+	DWORD i;
+	for (i = 0; i < This->overlaycount; i++)
+		if (This->overlays[i].surface == surface) return &This->overlays[i];
+	return NULL;
+}
+
+/**
+  * Adds an overlay to the overlay registry or updates it, and builds the
+  * blt that draws it to the screen.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param overlay
+  *  Overlay to add or update
+  */
+static void glRenderer__SetOverlay(glRenderer *This, const OVERLAY *overlay)
+{
+	RendererOverlay *entry = glRenderer__FindOverlay(This, overlay->surface);
+	RendererOverlay *tmpptr;
+	if (!entry)
+	{
+		if (This->overlaycount >= This->maxoverlays)
+		{
+			tmpptr = (RendererOverlay*)realloc(This->overlays, (This->maxoverlays + 16) * sizeof(RendererOverlay));
+			if (!tmpptr) return;
+			This->overlays = tmpptr;
+			This->maxoverlays += 16;
+		}
+		entry = &This->overlays[This->overlaycount++];
+	}
+	ZeroMemory(entry, sizeof(RendererOverlay));
+	entry->surface = overlay->surface;
+	entry->enabled = overlay->enabled;
+	entry->keyflags = 0x80000000;
+	entry->blt.bltfx.dwSize = sizeof(DDBLTFX);
+	if (overlay->flags & DDOVER_DDFX)
+	{
+		if (overlay->flags & DDOVER_KEYDEST) entry->keyflags |= DDBLT_KEYDEST;
+		if (overlay->flags & DDOVER_KEYDESTOVERRIDE)
+		{
+			entry->keyflags |= DDBLT_KEYDESTOVERRIDE;
+			entry->blt.bltfx.ddckDestColorkey = entry->blt.destkey = overlay->fx.dckDestColorkey;
+		}
+		if (overlay->flags & DDOVER_KEYSRC) entry->keyflags |= DDBLT_KEYSRC;
+		if (overlay->flags & DDOVER_KEYSRCOVERRIDE)
+		{
+			entry->keyflags |= DDBLT_KEYSRCOVERRIDE;
+			entry->blt.bltfx.ddckSrcColorkey = entry->blt.srckey = overlay->fx.dckSrcColorkey;
+		}
+	}
+	entry->blt.flags = entry->keyflags;
+	entry->blt.src = overlay->texture;
+	entry->blt.srcrect = overlay->srcrect;
+	entry->blt.destrect = overlay->destrect;
+}
+
+/**
+  * Moves an overlay in the overlay registry, keeping its size.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param surface
+  *  Overlay surface to move
+  * @param x
+  *  New left edge of the overlay on the primary
+  * @param y
+  *  New top edge of the overlay on the primary
+  */
+static void glRenderer__SetOverlayPosition(glRenderer *This, void *surface, LONG x, LONG y)
+{
+	RendererOverlay *entry = glRenderer__FindOverlay(This, surface);
+	RECT *r;
+	if (!entry) return;
+	r = &entry->blt.destrect;
+	// Overlays covering the whole primary have no position
+	if (!memcmp(r, &nullrect, sizeof(RECT))) return;
+	r->right = x + (r->right - r->left);
+	r->bottom = y + (r->bottom - r->top);
+	r->left = x;
+	r->top = y;
+}
+
+/**
+  * Removes an overlay from the overlay registry.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param surface
+  *  Overlay surface to remove, or NULL to remove all overlays
+  */
+static void glRenderer__RemoveOverlay(glRenderer *This, void *surface)
+{
+	RendererOverlay *entry;
+	if (!surface)
+	{
+		This->overlaycount = 0;
+		return;
+	}
+	entry = glRenderer__FindOverlay(This, surface);
+	if (!entry) return;
+	This->overlaycount--;
+	memmove(entry, entry + 1, (This->overlaycount - (entry - This->overlays)) * sizeof(RendererOverlay));
+}
+
+/**
+  * Adds a texture level to the pending uploads unless it is already queued.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param texture
+  *  Texture written by the CPU
+  * @param level
+  *  Mipmap level that was unlocked
+  */
+static void glRenderer__QueueUpload(glRenderer *This, glTexture *texture, GLint level)
+{
+	PendingUpload *tmpptr;
+	if (texture->levels[level].dirty & 32) return;
+	if (This->uploadcount >= This->maxuploads)
+	{
+		tmpptr = (PendingUpload*)realloc(This->uploads, (This->maxuploads + 64) * sizeof(PendingUpload));
+		if (!tmpptr)
+		{
+			// Uploaded when it is drawn with instead
+			return;
+		}
+		This->uploads = tmpptr;
+		This->maxuploads += 64;
+	}
+	This->uploads[This->uploadcount].texture = texture;
+	This->uploads[This->uploadcount].level = level;
+	This->uploadcount++;
+	texture->levels[level].dirty |= 32;
+}
+
+/**
+  * Uploads pending texture levels in the order they were unlocked until the
+  * bytes uploaded this frame reach TextureUploadBudget.  Called at the start
+  * of a frame, while the GPU draws the frame just presented.
+  * @param This
+  *  Pointer to glRenderer object
+  */
+static void glRenderer__ProcessUploads(glRenderer *This)
+{
+	GLsizeiptr budget = (GLsizeiptr)dxglcfg.TextureUploadBudget * 1024;
+	PendingUpload *upload;
+	DWORD i;
+	for (i = 0; i < This->uploadcount; i++)
+	{
+		if (budget && (This->uploadbytes >= budget)) break;
+		upload = &This->uploads[i];
+		upload->texture->levels[upload->level].dirty &= ~32;
+		// Levels drawn with were uploaded already, evicted textures upload all levels when restored
+		if (!(upload->texture->levels[upload->level].dirty & 1) || upload->texture->evicted) continue;
+		glTexture__Upload(upload->texture, upload->level);
+	}
+	if (!i) return;
+	This->uploadcount -= i;
+	memmove(This->uploads, This->uploads + i, This->uploadcount * sizeof(PendingUpload));
+}
+
+/**
+  * Removes the pending uploads of a texture that is being destroyed.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param texture
+  *  Texture to remove
+  */
+static void glRenderer__RemoveUploads(glRenderer *This, glTexture *texture)
+{
+	DWORD i, count = 0;
+	for (i = 0; i < This->uploadcount; i++)
+		if (This->uploads[i].texture != texture) This->uploads[count++] = This->uploads[i];
+	This->uploadcount = count;
+}
+
+/**
+  * Restores a texture if it was evicted and uploads all of its levels
+  * written by the CPU, regardless of the frame's upload budget.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param texture
+  *  Texture to preload
+  */
+static void glRenderer__PreloadTexture(glRenderer *This, glTexture *texture)
+{
+	This->perf.frame.dwPreloads++;
+	if (!texture->id && !texture->evicted) return;
+	if (texture->residency) TextureResidency_Use(texture->residency, texture);
+	else if (texture->evicted) glTexture__MakeResident(texture);
+	glTexture__ApplyLOD(texture);
+}
+
+/**
+  * Executes the commands handed to the renderer thread.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param bounded
+  *  TRUE to stop once the command with the sequence number until has run
+  * @param until
+  *  Sequence number of the last command to execute if bounded is TRUE
+  */
+void glRenderer__ExecuteQueue(glRenderer *This, BOOL bounded, DWORD until)
+{
+	CmdBuffer *ring = &This->cmdbuffer[0];
+	QueueCmd *cmd;
+	QueueCmd *nextcmd;
+	size_t read, next;
+	DWORD count;
+	DWORD executed;
+	if (!ring->cmdbuffer) return;
+	read = ring->readptr;
+	ScopedTimelineSpan span((read != ring->cmdptr) ? This->timeline : NULL, "ExecuteQueue");
+	while (read != ring->cmdptr)
+	{
+		if (bounded && ((LONG)(until - ring->doneseq) <= 0)) break;
+		cmd = (QueueCmd*)((BYTE*)ring->cmdbuffer + read);
+		executed = 1;
+		// Other commands may use the palette, so upload the gathered entries first
+		if (This->palettetexture && (cmd->opcode != OP_UPDATEPALETTE) && (cmd->opcode != OP_NULL))
+			glRenderer__FlushPalette(This);
+		if (This->capture) Capture_Command(This->capture, cmd);
+		switch (cmd->opcode)
+		{
+		case OP_NULL:  // End of ring, continue at the start
+			read = 0;
+			ring->readptr = 0;
+			continue;
+		case OP_BLT:
+			if (!This->bltbatch || !This->bltbatchvertices || !This->bltbatchindices ||
+				!glRenderer__CanBatchBlt(&cmd->args.blt))
+			{
+				glRenderer__Blt(This, &cmd->args.blt, TRUE);
+				break;
+			}
+			// Draw following blts that only differ in their rectangles together
+			count = 0;
+			This->bltbatch[count++] = cmd->args.blt;
+			next = read + cmd->size;
+			if (next >= ring->cmdsize) next = 0;
+			while ((count < BLTBATCH_MAX) && (next != ring->cmdptr))
+			{
+				nextcmd = (QueueCmd*)((BYTE*)ring->cmdbuffer + next);
+				if (nextcmd->opcode != OP_BLT) break;
+				if (!glRenderer__BltMatches(&This->bltbatch[0], &nextcmd->args.blt)) break;
+				This->bltbatch[count++] = nextcmd->args.blt;
+				if (This->capture) Capture_Blt(This->capture, &nextcmd->args.blt);
+				read = next;
+				cmd = nextcmd;
+				next = read + cmd->size;
+				if (next >= ring->cmdsize) next = 0;
+			}
+			glRenderer__BltBatch(This, This->bltbatch, count, TRUE);
+			executed = count;
+			break;
+		case OP_SETRENDERSTATE:
+			glRenderer__SetRenderState(This, cmd->args.renderstate.type, cmd->args.renderstate.value);
+			break;
+		case OP_SETTEXTURE:
+			glRenderer__SetTexture(This, cmd->args.texture.stage, cmd->args.texture.texture);
+			break;
+		case OP_SETTEXTURESTAGESTATE:
+			glRenderer__SetTextureStageState(This, cmd->args.texturestagestate.stage,
+				cmd->args.texturestagestate.type, cmd->args.texturestagestate.value);
+			break;
+		case OP_SETTRANSFORM:
+			glRenderer__SetTransform(This, cmd->args.transform.type, &cmd->args.transform.matrix);
+			break;
+		case OP_SETMATERIAL:
+			glRenderer__SetMaterial(This, &cmd->args.material);
+			break;
+		case OP_SETLIGHT:
+			glRenderer__SetLight(This, cmd->args.light.index, &cmd->args.light.light);
+			break;
+		case OP_REMOVELIGHT:
+			glRenderer__RemoveLight(This, cmd->args.removelight);
+			break;
+		case OP_SETD3DVIEWPORT:
+			glRenderer__SetD3DViewport(This, &cmd->args.viewport);
+			break;
+		case OP_SETTEXTURECOLORKEY:
+			glRenderer__SetTextureColorKey(This, cmd->args.colorkey.texture, cmd->args.colorkey.flags,
+				cmd->args.colorkey.setkey ? &cmd->args.colorkey.key : NULL, cmd->args.colorkey.level);
+			break;
+		case OP_DXGLBREAK:
+			glRenderer__DXGLBreak(This, FALSE);
+			break;
+		case OP_FREEPOINTER:
+			glRenderer__FreePointer(This, cmd->args.ptr);
+			break;
+		case OP_RELEASEBUFFER:
+			BufferObject_Release((BufferObject*)cmd->args.ptr);
+			break;
+		case OP_APPLYSTATEDELTA:
+			glRenderer__ApplyStateDelta(This, (StateDelta*)&cmd->args);
+			break;
+		case OP_UPDATEPALETTE:
+			glRenderer__UpdatePalette(This, cmd->args.palette.texture, cmd->args.palette.start,
+				cmd->args.palette.count, cmd->args.palette.entries);
+			break;
+		case OP_SETOVERLAY:
+			glRenderer__SetOverlay(This, &cmd->args.overlay);
+			break;
+		case OP_SETOVERLAYPOSITION:
+			glRenderer__SetOverlayPosition(This, cmd->args.overlaypos.surface,
+				cmd->args.overlaypos.x, cmd->args.overlaypos.y);
+			break;
+		case OP_REMOVEOVERLAY:
+			glRenderer__RemoveOverlay(This, cmd->args.ptr);
+			break;
+		case OP_QUEUEUPLOAD:
+			glRenderer__QueueUpload(This, cmd->args.upload.texture, cmd->args.upload.level);
+			break;
+		case OP_PRELOADTEXTURE:
+			glRenderer__PreloadTexture(This, (glTexture*)cmd->args.ptr);
+			break;
+		case OP_SETGAMMARAMP:
+			glRenderer__SetGammaRamp(This, &cmd->args.gamma);
+			break;
+		default:
+			FIXME("glRenderer__ExecuteQueue: Unknown opcode in command ring\n");
+			break;
+		}
+		read += cmd->size;
+		if (read >= ring->cmdsize) read = 0;
+		ring->readptr = read;
+		// Interlocked so the waiter count is read after the sequence number is stored
+		InterlockedExchangeAdd((volatile LONG*)&ring->doneseq, executed);
+		if (This->seqwaiters) SetEvent(This->progress);
+		if (This->capture) Capture_EndCommand(This->capture);
+	}
+	glRenderer__FlushPalette(This);
+}
+
+/**
+  * Draws the primary surface scheduled with glRenderer_ScheduleDrawScreen if
+  * the refresh interval of the last frame has ended.
+  * @param This
+  *  Pointer to glRenderer object
+  * @return
+  *  Milliseconds until the scheduled frame is due, or INFINITE if no frame
+  *  is scheduled anymore
+  */
+static DWORD glRenderer__DrawScheduledScreen(glRenderer *This)
+{
+	glTexture *texture;
+	DWORD wait;
+	if (!This->recomposite) return INFINITE;
+	wait = DXGLTimer_GetPresentWait(&This->timer, This->frequency);
+	if (wait) return wait;
+	texture = (glTexture*)InterlockedExchangePointer((PVOID volatile*)&This->recomposite, NULL);
+	if (!texture) return INFINITE;
+	if (This->capture) Capture_DrawScreen(This->capture, texture, texture->palette, This->recompositevsync,
+		NULL, This->recompositetime);
+	glRenderer__DrawScreen(This, texture, texture->palette, This->recompositevsync,
+		NULL, FALSE, This->recompositetime);
+	if (This->capture) Capture_EndCommand(This->capture);
+	return INFINITE;
+}
+
+/**
+  * Waits for a command to be sent to the renderer thread.  Spins for up to
+  * MaxSpinCount iterations checking the command ring and opcode before
+  * parking on the start event.
+  * @param This
+  *  Pointer to glRenderer object
+  */
+void glRenderer__WaitForCommands(glRenderer *This)
+{
+	CmdBuffer *ring = &This->cmdbuffer[0];
+	DWORD spincount = dxglcfg.MaxSpinCount;
+	DWORD wait;
+	LONGLONG idlestart;
+	// The ring is idle, so the last blt destination is finished for now
+	glRenderer__StartReadback(This);
+	glRenderer__ShowLayeredFrame(This);
+	wait = glRenderer__DrawScheduledScreen(This);
+	idlestart = DXGLTimer_GetTime(&This->timer);
+	while (spincount--)
+	{
+		if ((This->opcode != OP_NULL) || (ring->readptr != ring->cmdptr))
+		{
+			DXGLTimer_AddFrameTime(&This->timer, DXGLTIMER_IDLE, idlestart);
+			return;
+		}
+		YieldProcessor();
+	}
+	InterlockedExchange(&This->parked, TRUE);
+	// Check again after parking in case a command arrived while spinning
+	if ((This->opcode == OP_NULL) && (ring->readptr == ring->cmdptr))
+		WaitForSingleObject(This->start, wait);
+	InterlockedExchange(&This->parked, FALSE);
+	DXGLTimer_AddFrameTime(&This->timer, DXGLTIMER_IDLE, idlestart);
+}
+
+/**
+  * Starts an asynchronous readback of the surface recorded by the last
+  * glRenderer__Blt into a surface that the application locks after drawing,
+  * so that the next lock only has to map the pack buffer.
+  * @param This
+  *  Pointer to glRenderer object
+  */
+void glRenderer__StartReadback(glRenderer *This)
+{
+	glTexture *texture = This->readbacktexture;
+	MIPLEVEL *mip;
+	DWORD frame = This->perf.frame.dwFrame + 1;
+	if (!texture) return;
+	This->readbacktexture = NULL;
+	mip = &texture->levels[This->readbacklevel];
+	if (mip->readbackframe && (mip->readbackframe != frame))
+	{
+		// A whole frame went by without locking the last readback, stop predicting
+		mip->dirty &= ~8;
+		mip->lockstreak = 0;
+		mip->readbackframe = 0;
+		return;
+	}
+	// Only read back if the GPU copy is newer than both the buffer and any pending readback
+	if ((mip->dirty & 6) == 2)
+	{
+		glTexture__BeginDownload(texture, This->readbacklevel);
+		mip->readbackframe = frame;
+	}
+}
+
+/**
+  * Records a level that was just drawn to for glRenderer__StartReadback if
+  * the application has been locking it after every frame.  A different
+  * level starts the readback of the previous one.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param texture
+  *  Texture that was drawn to
+  * @param level
+  *  Mipmap level that was drawn to
+  */
+static void glRenderer__PredictReadback(glRenderer *This, glTexture *texture, GLint level)
+{
+	if (!dxglcfg.AsyncReadback || !(texture->levels[level].dirty & 8)) return;
+	// Batch consecutive draws into the same surface into one readback
+	if ((This->readbacktexture != texture) || (This->readbacklevel != level))
+		glRenderer__StartReadback(This);
+	This->readbacktexture = texture;
+	This->readbacklevel = level;
+}
+
+static void setupDebugOutputCallback()
+{
+	auto callback = [](GLenum source,
+		                GLenum type,
+		                GLuint /*id*/,
+		                GLenum severity,
+		                GLsizei length,
+		                const GLchar* message,
+		                const void*) {
+		char buf[256];
+		snprintf(buf, sizeof(buf), "[%s] %s (%s): %.*s\n",
+			debugSourceString(source),
+			debugTypeString(type), // could be GL_DEBUG_TYPE_PUSH_GROUP
+			debugSeverityString(severity),
+			length, message);
+		OutputDebugStringA(buf);
+		if (type == GL_DEBUG_TYPE_ERROR || severity == GL_DEBUG_SEVERITY_HIGH)
+			__debugbreak();
+			//exit(1);
+	};
+	glEnable(GL_DEBUG_OUTPUT);
+	glDebugMessageCallback(callback, nullptr);
+}
+
+// Debug group text for GLScopedDebugMarker, or NULL without formatting it if markers are disabled
+#define DEBUGMARKER(text) (This->debugmarkers ? (text) : NULL)
+
+/**
+  * Decides whether GL work is labeled with debug groups.  Markers are only
+  * worth their cost when something consumes them, so they are enabled by the
+  * DebugMarkers setting or when a graphics debugger has been injected.
+  * @param This
+  *  Pointer to glRenderer object
+  */
+static void glRenderer__InitDebugMarkers(glRenderer *This)
+{
+	ZeroMemory(This->markers, DEBUGMARKER_COUNT * sizeof(DebugMarker));
+	This->debugmarkers = FALSE;
+	if (!glPushDebugGroup || !glPopDebugGroup) return;
+	if (dxglcfg.DebugMarkers) This->debugmarkers = TRUE;
+	else if (GetModuleHandleA("renderdoc.dll")) This->debugmarkers = TRUE;
+	else if (GetModuleHandleA("Nvda.Graphics.Interception.dll")) This->debugmarkers = TRUE;
+}
+
+/**
+  * Returns the text of a debug marker, formatting it only if the format or
+  * arguments changed since the marker was last used.
+  * @param marker
+  *  Pointer to the marker to fill
+  * @param format
+  *  printf style format taking up to 8 int arguments; compared by address
+  * @param args
+  *  Arguments for the format
+  * @param count
+  *  Number of arguments, up to 8
+  * @return
+  *  Text of the marker
+  */
+static const char *glRenderer__DebugMarker(DebugMarker *marker, const char *format, const int *args, int count)
+{
+	int values[8];
+	ZeroMemory(values, 8 * sizeof(int));
+	memcpy(values, args, count * sizeof(int));
+	if ((marker->format == format) && !memcmp(marker->args, values, 8 * sizeof(int))) return marker->text;
+	marker->format = format;
+	memcpy(marker->args, values, 8 * sizeof(int));
+	// Unused arguments are ignored by the format
+	_snprintf(marker->text, 63, format, values[0], values[1], values[2], values[3],
+		values[4], values[5], values[6], values[7]);
+	marker->text[63] = 0;
+	return marker->text;
+}
+
+/**
+  * Selects the number of samples and the scale 3D rendering uses from the
+  * Antialiasing and RenderScale settings.  Modes that only apply when the
+  * application requests antialiasing leave it disabled.
+  * @param This
+  *  Pointer to glRenderer object
+  */
+static void glRenderer__InitMultisample(glRenderer *This)
+{
+	GLint maxsamples = 0;
+	GLsizei samples;
+	This->msaasamples = 0;
+	This->renderscale = 1;
+	This->mulx = This->muly = 1.0f;
+	if (!This->ext->GLEXT_ARB_framebuffer_object || !This->ext->glRenderbufferStorageMultisample) return;
+	// Multisampled renderbuffers can't be resolved to another size, and scaling already supersamples
+	if (dxglcfg.RenderScale > 1)
+	{
+		This->renderscale = dxglcfg.RenderScale > 4 ? 4 : dxglcfg.RenderScale;
+		return;
+	}
+	if (dxglcfg.msaa & 0x10000) return;
+	// Coverage modes are stored as coverage samples + 4096 * color samples
+	if ((dxglcfg.msaa & 0xFFFF) > 0xFF) samples = (dxglcfg.msaa >> 12) & 0xF;
+	else samples = dxglcfg.msaa & 0xFF;
+	if (samples < 2) return;
+	glGetIntegerv(GL_MAX_SAMPLES, &maxsamples);
+	if (samples > maxsamples) samples = maxsamples;
+	if (samples >= 2) This->msaasamples = samples;
+}
+
+/**
+  * Recreates the current context on the GPU driving the monitor selected by
+  * the DirectDraw GUID, so frames are not copied between GPUs to reach it.
+  * Uses WGL_NV_gpu_affinity, and keeps the current context if the extension is
+  * missing, the monitor's GPU is not found or the pinned context can't draw
+  * to the window.
+  * @param This
+  *  Pointer to glRenderer object with a current context
+  * @param pfd
+  *  Pixel format requested for the window
+  * @param attribs
+  *  Attributes the current context was created with
+  */
+static void glRenderer__PinContext(glRenderer *This, const PIXELFORMATDESCRIPTOR *pfd, const int *attribs)
+{
+	PFNWGLENUMGPUSNVPROC wglEnumGpusNV = (PFNWGLENUMGPUSNVPROC)wglGetProcAddress("wglEnumGpusNV");
+	PFNWGLENUMGPUDEVICESNVPROC wglEnumGpuDevicesNV = (PFNWGLENUMGPUDEVICESNVPROC)wglGetProcAddress("wglEnumGpuDevicesNV");
+	PFNWGLCREATEAFFINITYDCNVPROC wglCreateAffinityDCNV = (PFNWGLCREATEAFFINITYDCNVPROC)wglGetProcAddress("wglCreateAffinityDCNV");
+	PFNWGLDELETEDCNVPROC wglDeleteDCNV = (PFNWGLDELETEDCNVPROC)wglGetProcAddress("wglDeleteDCNV");
+	HGPUNV gpu;
+	HGPUNV gpus[2] = { NULL, NULL };
+	GPU_DEVICE device;
+	CHAR devname[32];
+	HDC affinitydc;
+	HGLRC affinityrc;
+	GLuint pf;
+	UINT i, j;
+	if (!This->ddInterface) return;
+	if (!wglEnumGpusNV || !wglEnumGpuDevicesNV || !wglCreateAffinityDCNV || !wglDeleteDCNV) return;
+	// With a single GPU every context already runs on the monitor's GPU
+	if (!wglEnumGpusNV(1, &gpu)) return;
+	WideCharToMultiByte(CP_ACP, 0, This->ddInterface->adapter.device, -1, devname, 32, NULL, NULL);
+	for (i = 0; !gpus[0] && wglEnumGpusNV(i, &gpu); i++)
+	{
+		device.cb = sizeof(GPU_DEVICE);
+		for (j = 0; wglEnumGpuDevicesNV(gpu, j, &device); j++)
+		{
+			if (strcmp(device.DeviceName, devname)) continue;
+			gpus[0] = gpu;
+			break;
+		}
+	}
+	if (!gpus[0]) return;
+	affinitydc = wglCreateAffinityDCNV(gpus);
+	if (!affinitydc) return;
+	pf = ChoosePixelFormat(affinitydc, pfd);
+	if (!pf || !SetPixelFormat(affinitydc, pf, pfd))
+	{
+		wglDeleteDCNV(affinitydc);
+		return;
+	}
+	if (wglCreateContextAttribsARB_cached) affinityrc = wglCreateContextAttribsARB_cached(affinitydc, nullptr, attribs);
+	else affinityrc = wglCreateContext(affinitydc);
+	if (!affinityrc)
+	{
+		wglDeleteDCNV(affinitydc);
+		return;
+	}
+	if (!wglMakeCurrent(This->hDC, affinityrc))
+	{
+		DEBUG("glRenderer::InitGL: GPU affinity context can't draw to the window\n");
+		wglMakeCurrent(This->hDC, This->hRC);
+		wglDeleteContext(affinityrc);
+		wglDeleteDCNV(affinitydc);
+		return;
+	}
+	wglDeleteContext(This->hRC);
+	This->hRC = affinityrc;
+	This->affinitydc = affinitydc;
+	wglDeleteDCNV_cached = wglDeleteDCNV;
+	TRACE_STRING("Context pinned to the GPU driving the display\n");
+}
+
+/**
+  * Deletes the GPU affinity DC the context was created from, after the
+  * context was deleted.
+  * @param This
+  *  Pointer to glRenderer object
+  */
+static void glRenderer__DeleteAffinityDC(glRenderer *This)
+{
+	if (!This->affinitydc) return;
+	if (wglDeleteDCNV_cached) wglDeleteDCNV_cached(This->affinitydc);
+	This->affinitydc = NULL;
+}
+
+/**
+  * Creates a render window and initializes OpenGL.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param width,height
+  *  Width and height of the render window.
+  * @param bpp
+  *  Color depth of the screen.
+  * @param fullscreen
+  *  True if full screen mode is requested.
+  * @param hWnd
+  *  Handle to the window to use as the renderer.  If NULL, then creates a
+  *  transparent overlay window.
+  * @param glDD7
+  *  Pointer to the glDirectDraw7 interface that creates the renderer.
+  * @return
+  *  TRUE if OpenGL has been initialized, FALSE otherwise.
+  */
+BOOL glRenderer__InitGL(glRenderer *This, int width, int height, int bpp, int fullscreen, unsigned int frequency, HWND hWnd, glDirectDraw7 *glDD7)
+{
+	This->ddInterface = glDD7;
+	if(This->hRC)
+	{
+		wglMakeCurrent(NULL,NULL);
+		wglDeleteContext(This->hRC);
+		glRenderer__DeleteAffinityDC(This);
+	};
+	PIXELFORMATDESCRIPTOR pfd;
+	GLuint pf;
+	int i;
+	char str[64];
+	ZeroMemory(&pfd,sizeof(PIXELFORMATDESCRIPTOR));
+	pfd.nSize = sizeof(PIXELFORMATDESCRIPTOR);
+	pfd.nVersion = 1;
+	if (dxglcfg.SingleBufferDevice) pfd.dwFlags = PFD_DRAW_TO_WINDOW | PFD_SUPPORT_OPENGL;
+	else pfd.dwFlags = PFD_DRAW_TO_WINDOW | PFD_SUPPORT_OPENGL | PFD_DOUBLEBUFFER;
+	pfd.iPixelType = PFD_TYPE_RGBA;
+	pfd.cColorBits = bpp;
+	pfd.iLayerType = PFD_MAIN_PLANE;
+	SetGLLock(TRUE);
+	This->hDC = GetDC(This->RenderWnd->hWnd);
+	if(!This->hDC)
+	{
+		DEBUG("glRenderer::InitGL: Can not create hDC\n");
+		SetGLLock(FALSE);
+		return FALSE;
+	}
+	pf = ChoosePixelFormat(This->hDC,&pfd);
+	if(!pf)
+	{
+		DEBUG("glRenderer::InitGL: Can not get pixelformat\n");
+		SetGLLock(FALSE);
+		return FALSE;
+	}
+	if(!SetPixelFormat(This->hDC,pf,&pfd))
+		DEBUG("glRenderer::InitGL: Can not set pixelformat\n");
+	static const int contextAttribs[] = {
 		WGL_CONTEXT_MAJOR_VERSION_ARB, 4,
 		WGL_CONTEXT_MINOR_VERSION_ARB, 6,
 		WGL_CONTEXT_FLAGS_ARB, WGL_CONTEXT_DEBUG_BIT_ARB,
 		WGL_CONTEXT_PROFILE_MASK_ARB, WGL_CONTEXT_COMPATIBILITY_PROFILE_BIT_ARB,
 		0};
-	auto wglCreateContextAttribsARB = (PFNWGLCREATECONTEXTATTRIBSARBPROC)wglGetProcAddress("wglCreateContextAttribsARB");
-	auto newRC = wglCreateContextAttribsARB(This->hDC, nullptr, contextAttribs);
-	if (!newRC)
+	This->hRC = NULL;
+	// Once a previous renderer has found wglCreateContextAttribsARB the
+	// dummy legacy context is not needed to create the real one.
+	if (wglCreateContextAttribsARB_cached)
+	{
+		This->hRC = wglCreateContextAttribsARB_cached(This->hDC, nullptr, contextAttribs);
+		if (This->hRC && !wglMakeCurrent(This->hDC, This->hRC))
+		{
+			wglDeleteContext(This->hRC);
+			This->hRC = NULL;
+		}
+	}
+	if (!This->hRC)
+	{
+		This->hRC = wglCreateContext(This->hDC);
+		if(!This->hRC)
+		{
+			DEBUG("glRenderer::InitGL: Can not create GL context\n");
+			SetGLLock(FALSE);
+			return FALSE;
+		}
+		if(!wglMakeCurrent(This->hDC,This->hRC))
+		{
+			DEBUG("glRenderer::InitGL: Can not activate GL context\n");
+			wglDeleteContext(This->hRC);
+			This->hRC = NULL;
+			ReleaseDC(This->RenderWnd->hWnd,This->hDC);
+			This->hDC = NULL;
+			SetGLLock(FALSE);
+			return FALSE;
+		}
+		auto wglCreateContextAttribsARB = (PFNWGLCREATECONTEXTATTRIBSARBPROC)wglGetProcAddress("wglCreateContextAttribsARB");
+		auto newRC = wglCreateContextAttribsARB ? wglCreateContextAttribsARB(This->hDC, nullptr, contextAttribs) : NULL;
+		if (!newRC)
+		{
+			DWORD err = (uint16_t)GetLastError();
+			if (err == ERROR_INVALID_VERSION_ARB)
+			{
+			}
+			else if (err == ERROR_INVALID_PROFILE_ARB)
+			{
+			}
+		}
+		else
+		{
+			wglMakeCurrent(nullptr, nullptr);
+			wglDeleteContext(This->hRC);
+			This->hRC = newRC;
+			wglMakeCurrent(This->hDC, This->hRC);
+			wglCreateContextAttribsARB_cached = wglCreateContextAttribsARB;
+		}
+	}
+	glRenderer__PinContext(This, &pfd, contextAttribs);
+
+	SetGLLock(FALSE);
+
+	EnterSpinlock(&gladlock);
+	if (!gladLoadGL())
+	{
+		ExitSpinlock(&gladlock);
+		return FALSE;
+	}
+	ExitSpinlock(&gladlock);
+
+	setupDebugOutputCallback();
+
+	This->ext = (glExtensions *)malloc(sizeof(glExtensions));
+	glExtensions_Init(This->ext);
+	glRenderer__InitDebugMarkers(This);
+	glUtil_Create(This->ext, &This->util);
+	glRenderer__InitMultisample(This);
+	glRenderer__SetSwap(This,1);
+	glFinish();
+	DXGLTimer_Init(&This->timer);
+	DXGLTimer_Calibrate(&This->timer, height, frequency);
+	// Renderers created only to probe capabilities never present
+	if (glDD7 && DXGLTimer_OpenVBlank(&This->timer, hWnd)) DXGLTimer_CalibrateVBlank(&This->timer);
+	if (dxglcfg.vsync == 1) This->oldswap = 1;
+	glRenderer__SetSwap(This,0);
+	glUtil_SetViewport(This->util,0,0,width,height);
+	glViewport(0,0,width,height);
+	glUtil_SetDepthRange(This->util,0.0,1.0);
+	glUtil_DepthWrite(This->util,TRUE);
+	glUtil_DepthTest(This->util,FALSE);
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_DITHER);
+	glUtil_SetDepthComp(This->util,GL_LESS);
+	const GLubyte *glver = glGetString(GL_VERSION);
+	This->gl_caps.Version = (GLfloat)atof((char*)glver);
+	if(This->gl_caps.Version >= 2)
+	{
+		glver = glGetString(GL_SHADING_LANGUAGE_VERSION);
+		This->gl_caps.ShaderVer = (GLfloat)atof((char*)glver);
+	}
+	else This->gl_caps.ShaderVer = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE,&This->gl_caps.TextureMax);
+	This->gl_caps.VersionMajor = This->ext->glver_major;
+	This->gl_caps.GpuShader4 = This->ext->GLEXT_EXT_gpu_shader4;
+	This->gl_caps.PackedDepthStencil = This->ext->GLEXT_EXT_packed_depth_stencil || This->ext->GLEXT_NV_packed_depth_stencil;
+	This->gl_caps.MaxLights = This->ext->GLEXT_ARB_uniform_buffer_object ? LIGHTS_MAX : 8;
+	if (!glcaps_valid)
+	{
+		memcpy(&glcaps_cached, &This->gl_caps, sizeof(GLCAPS));
+		InterlockedExchange((LONG*)&glcaps_valid, TRUE);
+	}
+	CapsCache_StoreGLCaps(&This->gl_caps);
+	This->shaders = (ShaderManager*)malloc(sizeof(ShaderManager));
+	ShaderManager_Init(This->ext, This->shaders);
+	This->texpool = (TexturePool*)malloc(sizeof(TexturePool));
+	if (This->texpool) TexturePool_Init(This->texpool, This->ext, (GLsizeiptr)dxglcfg.TexturePoolSize * 1024);
+	This->arena = (FrameArena*)malloc(sizeof(FrameArena));
+	if (This->arena) FrameArena_Init(This->arena, 256 * 1024);
+	This->residency = (TextureResidency*)malloc(sizeof(TextureResidency));
+	if (This->residency) TextureResidency_Init(This->residency, This->ext, (GLsizeiptr)dxglcfg.TextureMemoryBudget * 1024,
+		dxglcfg.CompressTextures);
+	if (dxglcfg.TextureAtlasSize)
+	{
+		This->atlas = (TextureAtlas*)malloc(sizeof(TextureAtlas));
+		if (This->atlas) TextureAtlas_Init(This->atlas, This->ext, This->util, dxglcfg.TextureAtlasSize);
+	}
+	This->postprocess = (PostProcess*)malloc(sizeof(PostProcess));
+	if (This->postprocess) PostProcess_Init(This->postprocess, This);
+	if (dxglcfg.DebugTimeline)
+	{
+		This->timeline = (Timeline*)malloc(sizeof(Timeline));
+		if (This->timeline && !Timeline_Init(This->timeline, This->ext))
+		{
+			free(This->timeline);
+			This->timeline = NULL;
+		}
+	}
+	if (dxglcfg.DebugShaderTiming)
+	{
+		This->shadertiming = (ShaderTiming*)malloc(sizeof(ShaderTiming));
+		if (This->shadertiming && !ShaderTiming_Init(This->shadertiming, This->ext))
+		{
+			free(This->shadertiming);
+			This->shadertiming = NULL;
+		}
+	}
+	if (dxglcfg.ScreenshotKey || dxglcfg.RecordKey)
+	{
+		This->framecapture = (FrameCapture*)malloc(sizeof(FrameCapture));
+		if (This->framecapture && !FrameCapture_Init(This->framecapture, This->ext, This->util))
+		{
+			free(This->framecapture);
+			This->framecapture = NULL;
+		}
+	}
+	if (dxglcfg.DebugLatency)
+	{
+		This->latency = (LatencyMeter*)malloc(sizeof(LatencyMeter));
+		if (This->latency && !LatencyMeter_Init(This->latency, This->ext))
+		{
+			free(This->latency);
+			This->latency = NULL;
+		}
+	}
+	if (dxglcfg.DwmVsync)
+	{
+		This->dwmsync = (DwmSync*)malloc(sizeof(DwmSync));
+		if (This->dwmsync && !DwmSync_Init(This->dwmsync))
+		{
+			free(This->dwmsync);
+			This->dwmsync = NULL;
+		}
+	}
+	if (dxglcfg.DebugCapture)
+	{
+		This->capture = (Capture*)malloc(sizeof(Capture));
+		if (This->capture && !Capture_Init(This->capture))
+		{
+			free(This->capture);
+			This->capture = NULL;
+		}
+	}
+	ZeroMemory(This->ubo, 4 * sizeof(BufferObject*));
+	This->indirect = NULL;
+	This->drawhandles = NULL;
+	This->backend = RenderBackend_Select(This->ext, dxglcfg.RenderBackend);
+	sprintf(str, "Renderer backend: %s\n", This->backend->name);
+	TRACE_STRING(str);
+	ZeroMemory(This->vertexarrays, VERTEXARRAY_CACHESIZE * sizeof(VertexArrayEntry));
+	This->vertexarrayclock = 0;
+	if (This->ext->GLEXT_ARB_uniform_buffer_object)
+	{
+		for (i = 0; i < 3; i++)
+		{
+			BufferObject_Create(&This->ubo[i], This->ext, This->util);
+			This->ext->glBindBufferBase(GL_UNIFORM_BUFFER, i, This->ubo[i]->buffer);
+		}
+	}
+	// Batches switch textures per draw by reading bindless handles by draw index,
+	// captures record the stage textures of each draw call so they don't
+	This->batchtextures = This->ext->GLEXT_ARB_bindless_texture && This->ext->GLEXT_ARB_multi_draw_indirect
+		&& This->ext->GLEXT_ARB_shader_draw_parameters && This->ext->GLEXT_ARB_uniform_buffer_object
+		&& !This->capture;
+	if (This->batchtextures)
+	{
+		This->drawhandles = (GLuint64*)calloc(DRAWBATCH_MAXDRAWS * 8, sizeof(GLuint64));
+		if (This->drawhandles)
+		{
+			BufferObject_Create(&This->ubo[UBO_BINDING_DRAWTEXTURES], This->ext, This->util);
+			BufferObject_Create(&This->indirect, This->ext, This->util);
+			This->ext->glBindBufferBase(GL_UNIFORM_BUFFER, UBO_BINDING_DRAWTEXTURES,
+				This->ubo[UBO_BINDING_DRAWTEXTURES]->buffer);
+		}
+		else This->batchtextures = FALSE;
+	}
+	This->indirectbatch = NULL;
+	This->batchhandles = FALSE;
+	This->ubodirty = UBODIRTY_TRANSFORMS | UBODIRTY_MATERIAL | UBODIRTY_LIGHTS;
+	This->bltbatch = (BltCommand*)malloc(BLTBATCH_MAX * sizeof(BltCommand));
+	This->bltbatchvertices = (BltVertex*)malloc(BLTBATCH_MAX * 4 * sizeof(BltVertex));
+	This->bltbatchindices = (GLushort*)malloc(BLTBATCH_MAX * 6 * sizeof(GLushort));
+	if (This->bltbatchindices)
+	{
+		for (i = 0; i < BLTBATCH_MAX; i++)
+		{
+			This->bltbatchindices[(i * 6) + 0] = (GLushort)(i * 4) + 0;
+			This->bltbatchindices[(i * 6) + 1] = (GLushort)(i * 4) + 1;
+			This->bltbatchindices[(i * 6) + 2] = (GLushort)(i * 4) + 2;
+			This->bltbatchindices[(i * 6) + 3] = (GLushort)(i * 4) + 2;
+			This->bltbatchindices[(i * 6) + 4] = (GLushort)(i * 4) + 1;
+			This->bltbatchindices[(i * 6) + 5] = (GLushort)(i * 4) + 3;
+		}
+	}
+	This->fbo.fbo = 0;
+	glUtil_InitFBO(This->util,&This->fbo);
+	glUtil_ClearColor(This->util, 0.0f, 0.0f, 0.0f, 0.0f);
+	glUtil_ClearDepth(This->util, 1.0);
+	glUtil_ClearStencil(This->util, 0);
+	glUtil_EnableArray(This->util,-1,FALSE);
+	glUtil_BlendFunc(This->util,GL_ONE,GL_ZERO);
+	glUtil_BlendEnable(This->util,FALSE);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glFlush();
+	glUtil_SetScissor(This->util,FALSE,0,0,0,0);
+	glDisable(GL_SCISSOR_TEST);
+	glUtil_SetCull(This->util,D3DCULL_CCW);
+	glEnable(GL_CULL_FACE);
+	if (glDD7) SwapBuffers(This->hDC);
+	glUtil_SetActiveTexture(This->util,0);
+	glRenderer__SetFogColor(This,0);
+	glRenderer__SetFogStart(This,0);
+	glRenderer__SetFogEnd(This,1);
+	glRenderer__SetFogDensity(This,1);
+	glUtil_SetPolyMode(This->util, D3DFILL_SOLID);
+	glUtil_SetShadeMode(This->util, D3DSHADE_GOURAUD);
+	if(hWnd)
+	{
+		This->dib.enabled = TRUE;
+		This->dib.width = width;
+		This->dib.height = height;
+		This->dib.pitch = (((width<<5)+31)&~31) >>3;
+		This->dib.pixels = NULL;
+		This->dib.hdc = CreateCompatibleDC(NULL);
+		if(!This->dib.info)
+			This->dib.info = (BITMAPINFO*)malloc(sizeof(BITMAPINFO));
+		ZeroMemory(This->dib.info,sizeof(BITMAPINFO));
+		This->dib.info->bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+		This->dib.info->bmiHeader.biBitCount = 32;
+		This->dib.info->bmiHeader.biWidth = width;
+		This->dib.info->bmiHeader.biHeight = height;
+		This->dib.info->bmiHeader.biCompression = BI_RGB;
+		This->dib.info->bmiHeader.biPlanes = 1;
+		This->dib.hbitmap = CreateDIBSection(This->dib.hdc,This->dib.info,
+			DIB_RGB_COLORS,(void**)&This->dib.pixels,NULL,0);
+	}
+	if (dxglpolicy.postsizeauto)
+	{
+		This->postsizex = 1.0f;
+		This->postsizey = 1.0f;
+	}
+	else
+	{
+		This->postsizex = dxglcfg.postsizex;
+		This->postsizey = dxglcfg.postsizey;
+	}
+	if (dxglcfg.FlipModelPresent && This->hWnd && This->ext->GLEXT_ARB_framebuffer_object)
+		This->dxgioutput = DXGIOutput_Create(This->RenderWnd->hWnd);
+	if (dxglcfg.PresentQueueDepth && This->hWnd && !This->dxgioutput)
+	{
+		This->presenter = (Presenter*)malloc(sizeof(Presenter));
+		if (This->presenter && !Presenter_Init(This->presenter, This, dxglcfg.PresentQueueDepth))
+		{
+			free(This->presenter);
+			This->presenter = NULL;
+		}
+	}
+	TRACE_SYSINFO();
+	return TRUE;
+}
+
+/**
+  * Splits a DirectDraw fill color into its components.
+  * @param color
+  *  Fill color in the surface's pixel format
+  * @param colorsizes
+  *  Maximum value of each component of the surface's format
+  * @param colororder
+  *  Component order of the surface's format
+  * @param colorbits
+  *  Number of bits of each component of the surface's format
+  * @param rgba
+  *  Receives the red, green, blue and alpha values
+  */
+static void UnpackFillColor(DWORD color, DWORD *colorsizes, int colororder, DWORD *colorbits, DWORD *rgba)
+{
+	DWORD r, g, b, a;
+	switch (colororder)
+	{
+	case 0:
+		r = color & colorsizes[0];
+		color >>= colorbits[0];
+		g = color & colorsizes[1];
+		color >>= colorbits[1];
+		b = color & colorsizes[2];
+		color >>= colorbits[2];
+		a = color & colorsizes[3];
+		rgba[0] = r;
+		rgba[1] = g;
+		rgba[2] = b;
+		rgba[3] = a;
+		break;
+	case 1:
+		b = color & colorsizes[2];
+		color >>= colorbits[2];
+		g = color & colorsizes[1];
+		color >>= colorbits[1];
+		r = color & colorsizes[0];
+		color >>= colorbits[0];
+		a = color & colorsizes[3];
+		rgba[0] = r;
+		rgba[1] = g;
+		rgba[2] = b;
+		rgba[3] = a;
+		break;
+	case 2:
+		a = color & colorsizes[3];
+		color >>= colorbits[3];
+		r = color & colorsizes[0];
+		color >>= colorbits[0];
+		g = color & colorsizes[1];
+		color >>= colorbits[1];
+		b = color & colorsizes[2];
+		rgba[0] = r;
+		rgba[1] = g;
+		rgba[2] = b;
+		rgba[3] = a;
+		break;
+	case 3:
+		a = color & colorsizes[3];
+		color >>= colorbits[3];
+		b = color & colorsizes[2];
+		color >>= colorbits[2];
+		g = color & colorsizes[1];
+		color >>= colorbits[1];
+		r = color & colorsizes[0];
+		rgba[0] = r;
+		rgba[1] = g;
+		rgba[2] = b;
+		rgba[3] = a;
+		break;
+	case 4:
+		r = color & colorsizes[0];
+		rgba[0] = r;
+		rgba[1] = r;
+		rgba[2] = r;
+		rgba[3] = r;
+		break;
+	case 5:
+		r = color & colorsizes[0];
+		rgba[0] = r;
+		rgba[1] = r;
+		rgba[2] = r;
+		rgba[3] = r;
+		break;
+	case 6:
+		a = color & colorsizes[3];
+		rgba[0] = a;
+		rgba[1] = a;
+		rgba[2] = a;
+		rgba[3] = a;
+		break;
+	case 7:
+		r = color & colorsizes[0];
+		color >>= colorbits[0];
+		a = color & colorsizes[3];
+		rgba[0] = r;
+		rgba[1] = r;
+		rgba[2] = r;
+		rgba[3] = a;
+		break;
+	}
+}
+
+/**
+  * Compares a uniform value with the last value set on the program, and
+  * updates the shadow copy if it changed.
+  * @param uniform
+  *  Location of the uniform, or -1 if the program does not use it
+  * @param shadow
+  *  Pointer to the shadow copy of the uniform, or NULL if it is not available
+  * @param value
+  *  Pointer to the new value
+  * @param size
+  *  Size of the value in bytes
+  * @return
+  *  TRUE if the uniform needs to be set, FALSE if it is unused or unchanged
+  */
+static BOOL glRenderer__ShadowUniform(GLint uniform, GLfloat *shadow, const void *value, size_t size)
+{
+	if (uniform == -1) return FALSE;
+	if (!shadow) return TRUE;
+	if (!memcmp(shadow, value, size)) return FALSE;
+	memcpy(shadow, value, size);
+	return TRUE;
+}
+
+void SetColorFillUniform(DWORD color, DWORD *colorsizes, int colororder, DWORD *colorbits, GLint uniform, glExtensions *ext)
+{
+	DWORD rgba[4];
+	UnpackFillColor(color, colorsizes, colororder, colorbits, rgba);
+	ext->glUniform4i(uniform, rgba[0], rgba[1], rgba[2], rgba[3]);
+}
+
+void SetColorKeyUniform(DWORD key, DWORD *colorsizes, int colororder, GLint uniform, DWORD *colorbits, glExtensions *ext)
+{
+	DWORD r, g, b, a;
+	switch (colororder)
+	{
+	case 0:
+		r = key & colorsizes[0];
+		key >>= colorbits[0];
+		g = key & colorsizes[1];
+		key >>= colorbits[1];
+		b = key & colorsizes[2];
+		ext->glUniform3i(uniform, r, g, b);
+		break;
+	case 1:
+		b = key & colorsizes[2];
+		key >>= colorbits[2];
+		g = key & colorsizes[1];
+		key >>= colorbits[1];
+		r = key & colorsizes[0];
+		ext->glUniform3i(uniform, r, g, b);
+		break;
+	case 2:
+		a = key & colorsizes[3];
+		key >>= colorbits[3];
+		r = key & colorsizes[0];
+		key >>= colorbits[0];
+		g = key & colorsizes[1];
+		key >>= colorbits[1];
+		b = key & colorsizes[2];
+		ext->glUniform3i(uniform, r, g, b);
+		break;
+	case 3:
+		a = key & colorsizes[3];
+		key >>= colorbits[3];
+		b = key & colorsizes[2];
+		key >>= colorbits[2];
+		g = key & colorsizes[1];
+		key >>= colorbits[1];
+		r = key & colorsizes[0];
+		ext->glUniform3i(uniform, r, g, b);
+		break;
+	case 4:
+		r = key & colorsizes[0];
+		if (ext->glver_major >= 3) ext->glUniform3i(uniform, r, 0, 0);
+		else ext->glUniform3i(uniform, r, r, r);
+		break;
+	case 5:
+		r = key & colorsizes[0];
+		ext->glUniform3i(uniform, r, r, r);
+		break;
+	case 6:
+		a = key & colorsizes[3];
+		ext->glUniform4i(uniform, 0, 0, 0, a);
+		break;
+	case 7:
+		r = key & colorsizes[0];
+		key >>= colorbits[0];
+		a = key & colorsizes[3];
+		ext->glUniform4i(uniform, r, r, r, a);
+		break;
+	}
+}
+
+void BltFlipLR(BltVertex *vertices)
+{
+	GLfloat s1, s2;
+	s1 = vertices[0].s;
+	s2 = vertices[2].s;
+	vertices[0].s = vertices[1].s;
+	vertices[2].s = vertices[3].s;
+	vertices[1].s = s1;
+	vertices[3].s = s2;
+}
+
+void BltFlipUD(BltVertex *vertices)
+{
+	GLfloat t1, t2;
+	t1 = vertices[0].t;
+	t2 = vertices[1].t;
+	vertices[0].t = vertices[2].t;
+	vertices[1].t = vertices[3].t;
+	vertices[2].t = t1;
+	vertices[3].t = t2;
+}
+
+void RotateBlt90(BltVertex *vertices, int times)
+{
+	GLfloat s0, s1, s2, s3;
+	GLfloat t0, t1, t2, t3;
+	switch (times)
+	{
+	case 0:
+	default:
+		return;
+	case 1:
+		s0 = vertices[0].s; t0 = vertices[0].t;
+		s1 = vertices[1].s; t1 = vertices[1].t;
+		s2 = vertices[2].s; t2 = vertices[2].t;
+		s3 = vertices[3].s; t3 = vertices[3].t;
+		vertices[0].s = s1; vertices[0].t = t1;
+		vertices[1].s = s3; vertices[1].t = t3;
+		vertices[2].s = s0; vertices[2].t = t0;
+		vertices[3].s = s2; vertices[3].t = t2;
+		break;
+	case 2:
+		s0 = vertices[0].s; t0 = vertices[0].t;
+		s1 = vertices[1].s; t1 = vertices[1].t;
+		s2 = vertices[2].s; t2 = vertices[2].t;
+		s3 = vertices[3].s; t3 = vertices[3].t;
+		vertices[0].s = s3; vertices[0].t = t3;
+		vertices[1].s = s2; vertices[1].t = t2;
+		vertices[2].s = s1; vertices[2].t = t1;
+		vertices[3].s = s0; vertices[3].t = t0;
+		break;
+	case 3:
+		s0 = vertices[0].s; t0 = vertices[0].t;
+		s1 = vertices[1].s; t1 = vertices[1].t;
+		s2 = vertices[2].s; t2 = vertices[2].t;
+		s3 = vertices[3].s; t3 = vertices[3].t;
+		vertices[0].s = s2; vertices[0].t = t2;
+		vertices[1].s = s0; vertices[1].t = t0;
+		vertices[2].s = s3; vertices[2].t = t3;
+		vertices[3].s = s1; vertices[3].t = t1;
+		break;
+	}
+}
+
+/**
+  * Fills in the vertices of one blt quad.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param cmd
+  *  Blt command to get the rectangles and effects from
+  * @param vertices
+  *  Pointer to the 4 vertices to write
+  * @param ddsd
+  *  Surface description of the destination level
+  * @param ddsdSrc
+  *  Surface description of the source level
+  * @param sizes
+  *  Display sizes from glDirectDraw7_GetSizes
+  */
+static void glRenderer__SetBltVertices(glRenderer *This, const BltCommand *cmd, BltVertex *vertices,
+	const DDSURFACEDESC2 *ddsd, const DDSURFACEDESC2 *ddsdSrc, const LONG *sizes)
+{
+	int rotates = 0;
+	GLfloat xoffset, yoffset, xmul, ymul;
+	RECT srcrect;
+	RECT destrect;
+	RECT wndrect;
+	if (!memcmp(&cmd->destrect, &nullrect, sizeof(RECT)))
+	{
+		destrect.left = 0;
+		destrect.top = 0;
+		destrect.right = ddsd->dwWidth;
+		destrect.bottom = ddsd->dwHeight;
+	}
+	else destrect = cmd->destrect;
+	if (!memcmp(&cmd->srcrect, &nullrect, sizeof(RECT)))
+	{
+		srcrect.left = 0;
+		srcrect.top = 0;
+		srcrect.right = ddsdSrc->dwWidth;
+		srcrect.bottom = ddsdSrc->dwHeight;
+	}
+	else srcrect = cmd->srcrect;
+	if (cmd->flags & 0x80000000)
+	{
+		if (glDirectDraw7_GetFullscreen(This->ddInterface))
+		{
+			xmul = (GLfloat)sizes[0] / (GLfloat)sizes[2];
+			ymul = (GLfloat)sizes[1] / (GLfloat)sizes[3];
+			xoffset = ((GLfloat)sizes[4] - (GLfloat)sizes[0]) / 2.0f;
+			yoffset = ((GLfloat)sizes[5] - (GLfloat)sizes[1]) / 2.0f;
+			vertices[1].x = vertices[3].x = ((GLfloat)destrect.left * xmul) + xoffset;
+			vertices[0].x = vertices[2].x = ((GLfloat)destrect.right * xmul) + xoffset;
+			vertices[0].y = vertices[1].y = ((GLfloat)destrect.top * ymul) + yoffset;
+			vertices[2].y = vertices[3].y = ((GLfloat)destrect.bottom * ymul) + yoffset;
+		}
+		else
+		{
+			xmul = ((GLfloat)sizes[0] / (GLfloat)sizes[2]) * dxglcfg.WindowScaleX;
+			ymul = (GLfloat)sizes[1] / (GLfloat)sizes[3] * dxglcfg.WindowScaleY;
+			_GetClientRect(This->hWnd, &wndrect);
+			ClientToScreen(This->hWnd, (LPPOINT)&wndrect.left);
+			ClientToScreen(This->hWnd, (LPPOINT)&wndrect.right);
+			xoffset = (GLfloat)wndrect.left * dxglcfg.WindowScaleX;
+			yoffset = ((GLfloat)sizes[1] - wndrect.bottom) * dxglcfg.WindowScaleY;
+			vertices[1].x = vertices[3].x = ((GLfloat)destrect.left * xmul) - xoffset;
+			vertices[0].x = vertices[2].x = ((GLfloat)destrect.right * xmul) - xoffset;
+			vertices[0].y = vertices[1].y = ((GLfloat)destrect.top * ymul) + yoffset;
+			vertices[2].y = vertices[3].y = ((GLfloat)destrect.bottom * ymul) + yoffset;
+		}
+	}
+	else
+	{
+		vertices[1].x = vertices[3].x = (GLfloat)destrect.left;
+		vertices[0].x = vertices[2].x = (GLfloat)destrect.right;
+		vertices[0].y = vertices[1].y = (GLfloat)ddsd->dwHeight - (GLfloat)destrect.top;
+		vertices[2].y = vertices[3].y = (GLfloat)ddsd->dwHeight - (GLfloat)destrect.bottom;
+	}
+	if (cmd->src && cmd->src->atlas)
+	{
+		// Source is a cell of a shared atlas page
+		vertices[1].s = vertices[3].s = (GLfloat)(cmd->src->atlasx + srcrect.left) / (GLfloat)cmd->src->atlas->size;
+		vertices[0].s = vertices[2].s = (GLfloat)(cmd->src->atlasx + srcrect.right) / (GLfloat)cmd->src->atlas->size;
+		vertices[0].t = vertices[1].t = (GLfloat)(cmd->src->atlasy + srcrect.top) / (GLfloat)cmd->src->atlas->size;
+		vertices[2].t = vertices[3].t = (GLfloat)(cmd->src->atlasy + srcrect.bottom) / (GLfloat)cmd->src->atlas->size;
+	}
+	else if (cmd->src && (cmd->src->target == GL_TEXTURE_RECTANGLE))
+	{
+		vertices[1].s = vertices[3].s = (GLfloat)srcrect.left;
+		vertices[0].s = vertices[2].s = (GLfloat)srcrect.right;
+		vertices[0].t = vertices[1].t = (GLfloat)srcrect.top;
+		vertices[2].t = vertices[3].t = (GLfloat)srcrect.bottom;
+	}
+	else
+	{
+		vertices[1].s = vertices[3].s = (GLfloat)srcrect.left / (GLfloat)ddsdSrc->dwWidth;
+		vertices[0].s = vertices[2].s = (GLfloat)srcrect.right / (GLfloat)ddsdSrc->dwWidth;
+		vertices[0].t = vertices[1].t = (GLfloat)srcrect.top / (GLfloat)ddsdSrc->dwHeight;
+		vertices[2].t = vertices[3].t = (GLfloat)srcrect.bottom / (GLfloat)ddsdSrc->dwHeight;
+	}
+	if ((cmd->bltfx.dwSize == sizeof(DDBLTFX)) && (cmd->flags & DDBLT_DDFX))
+	{
+		if (cmd->bltfx.dwDDFX & DDBLTFX_MIRRORLEFTRIGHT)
+			BltFlipLR(vertices);
+		if (cmd->bltfx.dwDDFX & DDBLTFX_MIRRORUPDOWN)
+			BltFlipUD(vertices);
+		if (cmd->bltfx.dwDDFX & DDBLTFX_ROTATE90) rotates++;
+		if (cmd->bltfx.dwDDFX & DDBLTFX_ROTATE180) rotates += 2;
+		if (cmd->bltfx.dwDDFX & DDBLTFX_ROTATE270) rotates += 3;
+		rotates &= 3;
+		if (rotates)
+		{
+			RotateBlt90(vertices, rotates);
+		}
+	}
+	if (cmd->flags & 0x10000000)
+	{
+		vertices[1].stencils = vertices[3].stencils = vertices[1].x / (GLfloat)cmd->dest->levels[cmd->destlevel].ddsd.dwWidth;
+		vertices[0].stencils = vertices[2].stencils = vertices[0].x / (GLfloat)cmd->dest->levels[cmd->destlevel].ddsd.dwWidth;
+		vertices[0].stencilt = vertices[1].stencilt = vertices[0].y / (GLfloat)cmd->dest->levels[cmd->destlevel].ddsd.dwHeight;
+		vertices[2].stencilt = vertices[3].stencilt = vertices[2].y / (GLfloat)cmd->dest->levels[cmd->destlevel].ddsd.dwHeight;
+	}
+}
+
+/**
+  * Checks if a blt can be drawn together with other blts.  Blts that read the
+  * destination or draw to the screen need one draw each.
+  * @param cmd
+  *  Blt command to check
+  * @return
+  *  TRUE if the blt can be part of a batch
+  */
+static BOOL glRenderer__CanBatchBlt(const BltCommand *cmd)
+{
+	if (cmd->src && (cmd->src == cmd->dest)) return FALSE;
+	if (cmd->flags & (0x80000000 | DDBLT_KEYDEST | DDBLT_DEPTHFILL)) return FALSE;
+	if ((cmd->bltfx.dwSize == sizeof(DDBLTFX)) && (cmd->flags & DDBLT_ROP) &&
+		(rop_texture_usage[(cmd->bltfx.dwROP >> 16) & 0xFF] & 2)) return FALSE;
+	return TRUE;
+}
+
+/**
+  * Compares the state of two blts that is not their rectangles.  Only the
+  * DDBLTFX members selected by the blt flags are compared, the others and
+  * the padding of the commands may hold anything.
+  * @param first
+  *  First blt of the batch
+  * @param cmd
+  *  Blt to compare against the batch
+  * @param src
+  *  Source to compare the source of first with, in place of the source of cmd
+  * @return
+  *  TRUE if the blts draw with the same state
+  */
+static BOOL glRenderer__BltStateMatches(const BltCommand *first, const BltCommand *cmd, const glTexture *src)
+{
+	DWORD flags = first->flags;
+	if ((first->dest != cmd->dest) || (first->src != src) || (first->destlevel != cmd->destlevel) ||
+		(first->srclevel != cmd->srclevel) || (flags != cmd->flags)) return FALSE;
+	if (first->bltfx.dwSize != cmd->bltfx.dwSize) return FALSE;
+	if ((flags & DDBLT_ROP) && (first->bltfx.dwROP != cmd->bltfx.dwROP)) return FALSE;
+	if ((flags & DDBLT_DDFX) && (first->bltfx.dwDDFX != cmd->bltfx.dwDDFX)) return FALSE;
+	if ((flags & DDBLT_COLORFILL) && (first->bltfx.dwFillColor != cmd->bltfx.dwFillColor)) return FALSE;
+	if ((flags & DDBLT_DEPTHFILL) && (first->bltfx.dwFillDepth != cmd->bltfx.dwFillDepth)) return FALSE;
+	if ((flags & DDBLT_KEYSRCOVERRIDE) &&
+		(memcmp(&first->bltfx.ddckSrcColorkey, &cmd->bltfx.ddckSrcColorkey, sizeof(DDCOLORKEY)) ||
+		memcmp(&first->srckey, &cmd->srckey, sizeof(DDCOLORKEY)))) return FALSE;
+	if ((flags & DDBLT_KEYDESTOVERRIDE) &&
+		(memcmp(&first->bltfx.ddckDestColorkey, &cmd->bltfx.ddckDestColorkey, sizeof(DDCOLORKEY)) ||
+		memcmp(&first->destkey, &cmd->destkey, sizeof(DDCOLORKEY)))) return FALSE;
+	if ((first->zdest != cmd->zdest) || (first->zsrc != cmd->zsrc) || (first->alphadest != cmd->alphadest) ||
+		(first->alphasrc != cmd->alphasrc) || (first->pattern != cmd->pattern)) return FALSE;
+	if ((first->zdestlevel != cmd->zdestlevel) || (first->zsrclevel != cmd->zsrclevel) ||
+		(first->alphadestlevel != cmd->alphadestlevel) || (first->alphasrclevel != cmd->alphasrclevel) ||
+		(first->patternlevel != cmd->patternlevel)) return FALSE;
+	if (first->clipcount != cmd->clipcount) return FALSE;
+	return !memcmp(first->cliprects, cmd->cliprects, first->clipcount * sizeof(RECT));
+}
+
+/**
+  * Checks if two blts only differ in their rectangles, or in their sources
+  * when both are cells of one atlas page, so they can share a shader,
+  * textures and uniforms.
+  * @param first
+  *  First blt of the batch
+  * @param cmd
+  *  Blt to compare against the batch
+  * @return
+  *  TRUE if cmd can be added to the batch
+  */
+static BOOL glRenderer__BltMatches(const BltCommand *first, const BltCommand *cmd)
+{
+	if ((first->src == cmd->src) || !first->src || !cmd->src)
+		return glRenderer__BltStateMatches(first, cmd, cmd->src);
+	// Different sources in one atlas page only differ in their texture coordinates
+	if (!first->src->atlas || (first->src->atlas != cmd->src->atlas)) return FALSE;
+	if ((cmd->src == first->dest) || (first->src == cmd->dest)) return FALSE;
+	if ((cmd->flags & DDBLT_KEYSRC) && !(cmd->flags & DDBLT_KEYSRCOVERRIDE) &&
+		memcmp(&first->src->levels[0].ddsd.ddckCKSrcBlt, &cmd->src->levels[0].ddsd.ddckCKSrcBlt, sizeof(DDCOLORKEY)))
+		return FALSE;
+	return glRenderer__BltStateMatches(first, cmd, first->src);
+}
+
+/**
+  * Checks if a blt replaces every pixel of its destination level without
+  * reading it, so the old contents of the level can be discarded.
+  * @param cmd
+  *  Blt to check
+  * @return
+  *  TRUE if the blt overwrites the whole destination level
+  */
+static BOOL glRenderer__BltCoversDest(const BltCommand *cmd)
+{
+	const MIPLEVEL *mip = &cmd->dest->levels[cmd->destlevel];
+	if (cmd->clipcount || (cmd->src && (cmd->src == cmd->dest))) return FALSE;
+	// Color keys leave pixels alone, the screen and depth fills go elsewhere
+	if (cmd->flags & ~(DDBLT_COLORFILL | DDBLT_ROP | DDBLT_DDFX | DDBLT_WAIT | DDBLT_ASYNC | DDBLT_DONOTWAIT)) return FALSE;
+	if ((cmd->flags & DDBLT_ROP) && ((cmd->bltfx.dwSize != sizeof(DDBLTFX)) ||
+		(rop_texture_usage[(cmd->bltfx.dwROP >> 16) & 0xFF] & 2))) return FALSE;
+	if ((cmd->flags & DDBLT_DDFX) && (cmd->bltfx.dwDDFX & ~(DDBLTFX_MIRRORLEFTRIGHT | DDBLTFX_MIRRORUPDOWN |
+		DDBLTFX_NOTEARING))) return FALSE;
+	if (!memcmp(&cmd->destrect, &nullrect, sizeof(RECT))) return TRUE;
+	return (cmd->destrect.left <= 0) && (cmd->destrect.top <= 0) &&
+		((DWORD)cmd->destrect.right >= mip->ddsd.dwWidth) && ((DWORD)cmd->destrect.bottom >= mip->ddsd.dwHeight);
+}
+
+/**
+  * Checks if a blt is a plain color fill that can be done by clearing the
+  * destination framebuffer, without a shader.
+  * @param cmd
+  *  Blt to check
+  * @return
+  *  TRUE if glRenderer__ClearFill can execute the blt
+  */
+static BOOL glRenderer__CanClearFill(const BltCommand *cmd)
+{
+	const DDPIXELFORMAT *format;
+	if (!(cmd->flags & DDBLT_COLORFILL)) return FALSE;
+	// ROPs, effects, color keys and the clipper stencil need the shader
+	if (cmd->flags & ~(DDBLT_COLORFILL | DDBLT_WAIT | DDBLT_ASYNC | DDBLT_DONOTWAIT)) return FALSE;
+	// The shader converts fills of palettized, YUV and converted formats
+	if (cmd->dest->useconv || cmd->dest->blttype) return FALSE;
+	format = &cmd->dest->levels[cmd->destlevel].ddsd.ddpfPixelFormat;
+	if (format->dwFlags & (DDPF_FOURCC | DDPF_PALETTEINDEXED1 | DDPF_PALETTEINDEXED2 |
+		DDPF_PALETTEINDEXED4 | DDPF_PALETTEINDEXED8)) return FALSE;
+	if (format->dwRGBBitCount <= 8) return FALSE;
+	return TRUE;
+}
+
+/**
+  * Executes color fills with one scissored glClear per rectangle.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param cmd
+  *  Array of matching color fill blts
+  * @param count
+  *  Number of blts in the array
+  */
+static void glRenderer__ClearFill(glRenderer *This, BltCommand *cmd, DWORD count)
+{
+	MIPLEVEL *mip = &cmd->dest->levels[cmd->destlevel];
+	DWORD rgba[4];
+	GLfloat color[4];
+	RECT r, clip;
+	DWORD i, j;
+	do
+	{
+		if (glUtil_SetFBOSurface(This->util, cmd->dest, NULL, cmd->destlevel, 0, TRUE) == GL_FRAMEBUFFER_COMPLETE) break;
+		if (!cmd->dest->internalformats[1]) break;
+		glTexture__Repair(cmd->dest, TRUE);
+		glUtil_SetFBO(This->util, NULL);
+		mip->fbo.fbcolor = NULL;
+		mip->fbo.fbz = NULL;
+	} while (1);
+	if (glTexture__CPUDirty(cmd->dest, cmd->destlevel)) glTexture__Upload(cmd->dest, cmd->destlevel);
+	glUtil_SetScissor(This->util, FALSE, 0, 0, 0, 0);
+	if (mip->fbz) glClear(GL_DEPTH_BUFFER_BIT);
+	UnpackFillColor(cmd->bltfx.dwFillColor, cmd->dest->colorsizes, cmd->dest->colororder, cmd->dest->colorbits, rgba);
+	for (i = 0; i < 4; i++)
+		color[i] = cmd->dest->colorsizes[i] ? (GLfloat)rgba[i] / (GLfloat)cmd->dest->colorsizes[i] : 0.0f;
+	glUtil_ClearColor(This->util, color[0], color[1], color[2], color[3]);
+	for (i = 0; i < count; i++)
+	{
+		if (!memcmp(&cmd[i].destrect, &nullrect, sizeof(RECT)))
+		{
+			r.left = 0;
+			r.top = 0;
+			r.right = mip->ddsd.dwWidth;
+			r.bottom = mip->ddsd.dwHeight;
+		}
+		else r = cmd[i].destrect;
+		// Surface rows map to framebuffer rows without flipping
+		if (!cmd[i].clipcount)
+		{
+			glUtil_SetScissor(This->util, TRUE, r.left, r.top, r.right - r.left, r.bottom - r.top);
+			glClear(GL_COLOR_BUFFER_BIT);
+		}
+		else for (j = 0; j < cmd[i].clipcount; j++)
+		{
+			if (!IntersectRect(&clip, &r, &cmd[i].cliprects[j])) continue;
+			glUtil_SetScissor(This->util, TRUE, clip.left, clip.top, clip.right - clip.left, clip.bottom - clip.top);
+			glClear(GL_COLOR_BUFFER_BIT);
+		}
+	}
+	glUtil_SetScissor(This->util, FALSE, 0, 0, 0, 0);
+	mip->dirty = (mip->dirty | 2) & ~84;
+	if (cmd->destlevel) cmd->dest->automipmap = FALSE;
+}
+
+/**
+  * Gets the source and destination rectangles of a blt, replacing empty
+  * rectangles with the whole surface.
+  * @param cmd
+  *  Blt to get the rectangles of
+  * @param src
+  *  Receives the source rectangle
+  * @param dest
+  *  Receives the destination rectangle
+  */
+static void glRenderer__GetBltRects(const BltCommand *cmd, RECT *src, RECT *dest)
+{
+	if (!memcmp(&cmd->srcrect, &nullrect, sizeof(RECT)))
+	{
+		src->left = 0;
+		src->top = 0;
+		src->right = cmd->src->levels[cmd->srclevel].ddsd.dwWidth;
+		src->bottom = cmd->src->levels[cmd->srclevel].ddsd.dwHeight;
+	}
+	else *src = cmd->srcrect;
+	if (!memcmp(&cmd->destrect, &nullrect, sizeof(RECT)))
+	{
+		dest->left = 0;
+		dest->top = 0;
+		dest->right = cmd->dest->levels[cmd->destlevel].ddsd.dwWidth;
+		dest->bottom = cmd->dest->levels[cmd->destlevel].ddsd.dwHeight;
+	}
+	else *dest = cmd->destrect;
+}
+
+/**
+  * Checks if a blt is a plain copy between surfaces of the same format that
+  * can be done without a shader.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param cmd
+  *  Blt to check
+  * @return
+  *  TRUE if glRenderer__CopyBlt can execute the blt
+  */
+static BOOL glRenderer__CanCopyBlt(glRenderer *This, const BltCommand *cmd)
+{
+	if (!cmd->src || (cmd->src == cmd->dest)) return FALSE;
+	if (!This->ext->GLEXT_ARB_framebuffer_object || !This->ext->glBlitFramebuffer) return FALSE;
+	// Keys, effects, the clipper stencil and raster operations other than a copy need the shader
+	if (cmd->flags & ~(DDBLT_WAIT | DDBLT_ASYNC | DDBLT_DONOTWAIT | DDBLT_ROP)) return FALSE;
+	if (cmd->clipcount) return FALSE;
+	if ((cmd->flags & DDBLT_ROP) && ((cmd->bltfx.dwSize != sizeof(DDBLTFX)) ||
+		(cmd->bltfx.dwROP != SRCCOPY))) return FALSE;
+	if (cmd->src->useconv || cmd->dest->useconv) return FALSE;
+	if ((cmd->src->internalformats[0] != cmd->dest->internalformats[0]) ||
+		(cmd->src->format != cmd->dest->format) || (cmd->src->type != cmd->dest->type) ||
+		(cmd->src->blttype != cmd->dest->blttype) || (cmd->src->colororder != cmd->dest->colororder) ||
+		(cmd->src->target != cmd->dest->target)) return FALSE;
+	// The shader path also clears an attached depth buffer
+	if (cmd->dest->levels[cmd->destlevel].fbz) return FALSE;
+	return TRUE;
+}
+
+/**
+  * Executes plain copies with glCopyImageSubData, or with glBlitFramebuffer
+  * if the blts are stretched or ARB_copy_image is not available.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param cmd
+  *  Array of matching copy blts
+  * @param count
+  *  Number of blts in the array
+  * @return
+  *  FALSE if the blts must be drawn with the shader instead
+  */
+static BOOL glRenderer__CopyBlt(glRenderer *This, BltCommand *cmd, DWORD count)
+{
+	MIPLEVEL *mip = &cmd->dest->levels[cmd->destlevel];
+	BOOL copy = This->ext->GLEXT_ARB_copy_image;
+	GLenum filter;
+	RECT src, dest;
+	DWORD i;
+	for (i = 0; i < count; i++)
+	{
+		glRenderer__GetBltRects(&cmd[i], &src, &dest);
+		if (((src.right - src.left) != (dest.right - dest.left)) ||
+			((src.bottom - src.top) != (dest.bottom - dest.top))) copy = FALSE;
+	}
+	// Reading an atlas page through a framebuffer would move the source out of it
+	if (!copy)
+		for (i = 0; i < count; i++)
+			if (cmd[i].src->atlas) return FALSE;
+	if (cmd->dest->atlas) glTexture__LeaveAtlas(cmd->dest);
+	for (i = 0; i < count; i++)
+	{
+		// Copies need the storage in the surface's own format
+		if (cmd[i].src->evicted) glTexture__MakeResident(cmd[i].src);
+		if (glTexture__CPUDirty(cmd[i].src, cmd[i].srclevel)) glTexture__Upload(cmd[i].src, cmd[i].srclevel);
+	}
+	if (glTexture__CPUDirty(cmd->dest, cmd->destlevel)) glTexture__Upload(cmd->dest, cmd->destlevel);
+	if (copy)
+	{
+		for (i = 0; i < count; i++)
+		{
+			glRenderer__GetBltRects(&cmd[i], &src, &dest);
+			This->ext->glCopyImageSubData(cmd[i].src->id, cmd[i].src->target, cmd[i].srclevel,
+				cmd[i].src->atlasx + src.left, cmd[i].src->atlasy + src.top, 0,
+				cmd->dest->id, cmd->dest->target, cmd->destlevel, dest.left, dest.top, 0,
+				src.right - src.left, src.bottom - src.top, 1);
+		}
+	}
+	else if (cmd->dest->levels[0].ddsd.ddsCaps.dwCaps & DDSCAPS_ZBUFFER)
+	{
+		// Depth buffers are blitted through framebuffers without a color buffer
+		BOOL depthwrite = This->util->depthwrite;
+		GLbitfield mask = cmd->dest->zhasstencil ? (GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT) : GL_DEPTH_BUFFER_BIT;
+		if (glUtil_SetFBODepth(This->util, 1, GL_DRAW_FRAMEBUFFER, cmd->dest, cmd->destlevel) != GL_FRAMEBUFFER_COMPLETE)
+		{
+			glUtil_EndFBODepth(This->util, 1, GL_DRAW_FRAMEBUFFER);
+			return FALSE;
+		}
+		glUtil_SetScissor(This->util, FALSE, 0, 0, 0, 0);
+		glUtil_DepthWrite(This->util, TRUE);
+		for (i = 0; i < count; i++)
+		{
+			if (glUtil_SetFBODepth(This->util, 0, GL_READ_FRAMEBUFFER, cmd[i].src, cmd[i].srclevel)
+				== GL_FRAMEBUFFER_COMPLETE)
+			{
+				glRenderer__GetBltRects(&cmd[i], &src, &dest);
+				This->ext->glBlitFramebuffer(src.left, src.top, src.right, src.bottom,
+					dest.left, dest.top, dest.right, dest.bottom, mask, GL_NEAREST);
+			}
+			glUtil_EndFBODepth(This->util, 0, GL_READ_FRAMEBUFFER);
+		}
+		glUtil_EndFBODepth(This->util, 1, GL_DRAW_FRAMEBUFFER);
+		glUtil_DepthWrite(This->util, depthwrite);
+		if (!cmd->destlevel) glTexture__InvalidateMSAA(cmd->dest);
+	}
+	else
+	{
+		if (glUtil_SetFBOSurface(This->util, cmd->src, NULL, cmd->srclevel, 0, TRUE) != GL_FRAMEBUFFER_COMPLETE)
+			return FALSE;
+		if (glUtil_SetFBOSurface(This->util, cmd->dest, NULL, cmd->destlevel, 0, TRUE) != GL_FRAMEBUFFER_COMPLETE)
+			return FALSE;
+		if ((dxglcfg.BltScale == 0) || (This->ddInterface->primarybpp == 8)) filter = GL_NEAREST;
+		else filter = GL_LINEAR;
+		glUtil_SetScissor(This->util, FALSE, 0, 0, 0, 0);
+		This->ext->glBindFramebuffer(GL_READ_FRAMEBUFFER, cmd->src->levels[cmd->srclevel].fbo.fbo);
+		for (i = 0; i < count; i++)
+		{
+			glRenderer__GetBltRects(&cmd[i], &src, &dest);
+			This->ext->glBlitFramebuffer(src.left, src.top, src.right, src.bottom,
+				dest.left, dest.top, dest.right, dest.bottom, GL_COLOR_BUFFER_BIT, filter);
+		}
+		This->ext->glBindFramebuffer(GL_READ_FRAMEBUFFER, mip->fbo.fbo);
+	}
+	mip->dirty = (mip->dirty | 2) & ~84;
+	if (cmd->destlevel) cmd->dest->automipmap = FALSE;
+	return TRUE;
+}
+
+/**
+  * Gets the scratch texture for the source of an overlapping self-blt,
+  * creating or enlarging it when the surface format or size requires it.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param surface
+  *  Texture being blitted to itself
+  * @param level
+  *  Mipmap level of the texture
+  * @param width,height
+  *  Size of the region to copy
+  * @return
+  *  Pointer to the scratch texture, or NULL if it could not be created
+  */
+static glTexture *glRenderer__GetScrollTexture(glRenderer *This, glTexture *surface, GLint level, DWORD width, DWORD height)
+{
+	glTexture *scroll = This->scrolltexture;
+	DDSURFACEDESC2 ddsd;
+	if (scroll)
+	{
+		if ((scroll->internalformats[0] == surface->internalformats[0]) && (scroll->format == surface->format) &&
+			(scroll->type == surface->type) && (scroll->target == surface->target) &&
+			(scroll->levels[0].ddsd.dwWidth >= width) && (scroll->levels[0].ddsd.dwHeight >= height))
+			return scroll;
+		width = max(width, scroll->levels[0].ddsd.dwWidth);
+		height = max(height, scroll->levels[0].ddsd.dwHeight);
+		glTexture_Release(scroll, TRUE);
+		This->scrolltexture = NULL;
+	}
+	scroll = (glTexture*)malloc(sizeof(glTexture));
+	if (!scroll) return NULL;
+	ddsd = surface->levels[level].ddsd;
+	ddsd.dwFlags = DDSD_CAPS | DDSD_WIDTH | DDSD_HEIGHT | DDSD_PIXELFORMAT;
+	ddsd.dwWidth = width;
+	ddsd.dwHeight = height;
+	ddsd.ddsCaps.dwCaps = DDSCAPS_VIDEOMEMORY;
+	ddsd.ddsCaps.dwCaps2 = 0;
+	if (FAILED(glTexture_Create(&ddsd, scroll, This, TRUE, surface->target)))
+	{
+		free(scroll);
+		return NULL;
+	}
+	scroll->freeonrelease = TRUE;
+	This->scrolltexture = scroll;
+	return scroll;
+}
+
+/**
+  * Checks if a ROP blt only involves 8-bit palette surfaces that can be read
+  * through integer views, so the ROP works on the raw palette indices.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param cmd
+  *  First blt of the batch
+  * @param count
+  *  Number of blts in the batch
+  * @param usedest
+  *  TRUE if the ROP reads the destination
+  * @param usepattern
+  *  TRUE if the ROP reads the pattern
+  * @return
+  *  TRUE if the blt can use integer views of all its surfaces
+  */
+static BOOL glRenderer__CanIntegerROP(glRenderer *This, const BltCommand *cmd, DWORD count, BOOL usedest, BOOL usepattern)
+{
+	if ((This->ext->glver_major < 3) || dxglcfg.DebugNoGLSL130) return FALSE;
+	if (cmd->flags & (0x80000000 | DDBLT_KEYSRC | DDBLT_KEYDEST | DDBLT_COLORFILL)) return FALSE;
+	if ((cmd->dest->blttype != 0x10) || (cmd->dest->internalformats[0] != GL_R8)) return FALSE;
+	// The destination is read in place, which needs a texture barrier
+	if (usedest && (!This->ext->glTextureBarrier || cmd->destlevel || (count > 1)
+		|| !glTexture__GetIntegerView(cmd->dest))) return FALSE;
+	if (cmd->src && !glTexture__GetIntegerView(cmd->src)) return FALSE;
+	if (usepattern && !glTexture__GetIntegerView(cmd->pattern)) return FALSE;
+	return TRUE;
+}
+
+/**
+  * Binds the integer view of a texture to a texture unit, with a sampler
+  * that does not filter.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param unit
+  *  Texture unit to bind the view to
+  * @param texture
+  *  Texture with an integer view created by glTexture__GetIntegerView
+  */
+static void glRenderer__SetIntegerView(glRenderer *This, unsigned int unit, glTexture *texture)
+{
+	// Lets the texture resolve pending rendering before it is read
+	glUtil_SetTexture(This->util, unit, texture);
+	glUtil_SetActiveTexture(This->util, unit);
+	glBindTexture(GL_TEXTURE_2D, texture->intview);
+	if (This->ext->GLEXT_ARB_sampler_objects)
+		glUtil_SetSampler(This->util, unit, This->util->samplers[unit].wraps,
+			This->util->samplers[unit].wrapt, GL_NEAREST, GL_NEAREST);
+}
+
+/**
+  * Executes a blt from a surface to the same mipmap level of itself.
+  * Regions that don't overlap are drawn directly after a texture barrier.
+  * Otherwise only the source rectangle is copied to a scratch texture
+  * without a shader, and the blt is drawn from there.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param cmd
+  *  Blt to execute
+  * @param backend
+  *  TRUE if called from the renderer thread without a waiting caller
+  * @return
+  *  FALSE if the blt should be drawn directly by the caller
+  */
+static BOOL glRenderer__SelfBlt(glRenderer *This, BltCommand *cmd, BOOL backend)
+{
+	glTexture *scroll;
+	BltCommand scrollcmd;
+	RECT src, dest;
+	GLsizei width, height;
+	glRenderer__GetBltRects(cmd, &src, &dest);
+	if (cmd->dest->atlas) glTexture__LeaveAtlas(cmd->dest);
+	if (This->ext->glTextureBarrier && ((src.left >= dest.right) || (dest.left >= src.right) ||
+		(src.top >= dest.bottom) || (dest.top >= src.bottom)))
+	{
+		// Texels written by the draw are never read by it
+		This->ext->glTextureBarrier();
+		return FALSE;
+	}
+	width = src.right - src.left;
+	height = src.bottom - src.top;
+	if (glTexture__CPUDirty(cmd->src, cmd->srclevel)) glTexture__Upload(cmd->src, cmd->srclevel);
+	scroll = glRenderer__GetScrollTexture(This, cmd->src, cmd->srclevel, width, height);
+	if (!scroll) return FALSE;
+	if (This->ext->GLEXT_ARB_copy_image)
+		This->ext->glCopyImageSubData(cmd->src->id, cmd->src->target, cmd->srclevel, src.left, src.top, 0,
+			scroll->id, scroll->target, 0, 0, 0, 0, width, height, 1);
+	else
+	{
+		if (glUtil_SetFBOSurface(This->util, cmd->src, NULL, cmd->srclevel, 0, TRUE) != GL_FRAMEBUFFER_COMPLETE)
+			return FALSE;
+		if (glUtil_SetFBOSurface(This->util, scroll, NULL, 0, 0, TRUE) != GL_FRAMEBUFFER_COMPLETE)
+			return FALSE;
+		glUtil_SetScissor(This->util, FALSE, 0, 0, 0, 0);
+		This->ext->glBindFramebuffer(GL_READ_FRAMEBUFFER, cmd->src->levels[cmd->srclevel].fbo.fbo);
+		This->ext->glBlitFramebuffer(src.left, src.top, src.right, src.bottom, 0, 0, width, height,
+			GL_COLOR_BUFFER_BIT, GL_NEAREST);
+		This->ext->glBindFramebuffer(GL_READ_FRAMEBUFFER, scroll->levels[0].fbo.fbo);
+	}
+	scroll->levels[0].dirty = (scroll->levels[0].dirty | 2) & ~84;
+	// Source color keys are read from the source surface
+	scroll->levels[0].ddsd.dwFlags &= ~DDSD_CKSRCBLT;
+	scroll->levels[0].ddsd.dwFlags |= cmd->src->levels[cmd->srclevel].ddsd.dwFlags & DDSD_CKSRCBLT;
+	scroll->levels[0].ddsd.ddckCKSrcBlt = cmd->src->levels[cmd->srclevel].ddsd.ddckCKSrcBlt;
+	scrollcmd = *cmd;
+	scrollcmd.src = scroll;
+	scrollcmd.srclevel = 0;
+	scrollcmd.srcrect.left = 0;
+	scrollcmd.srcrect.top = 0;
+	scrollcmd.srcrect.right = width;
+	scrollcmd.srcrect.bottom = height;
+	// Borrow the palette without taking a reference
+	scroll->palette = cmd->src->palette;
+	glRenderer__BltBatch(This, &scrollcmd, 1, backend);
+	scroll->palette = NULL;
+	return TRUE;
+}
+
+void glRenderer__Blt(glRenderer *This, BltCommand *cmd, BOOL backend)
+{
+	glRenderer__BltBatch(This, cmd, 1, backend);
+}
+
+/**
+  * Returns the debug marker text of a blt.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param cmd
+  *  Blt command to describe
+  * @return
+  *  Text of the marker
+  */
+static const char *glRenderer__BltMarker(glRenderer *This, const BltCommand *cmd)
+{
+	static const char format[] = "Blt [%d %d %dx%d] <- [%d %d %dx%d]";
+	int args[8] = { cmd->destrect.left, cmd->destrect.top, cmd->destrect.right - cmd->destrect.left,
+		cmd->destrect.bottom - cmd->destrect.top, cmd->srcrect.left, cmd->srcrect.top,
+		cmd->srcrect.right - cmd->srcrect.left, cmd->srcrect.bottom - cmd->srcrect.top };
+	return glRenderer__DebugMarker(&This->markers[DEBUGMARKER_BLT], format, args, 8);
+}
+
+/**
+  * Draws one or more blts that share everything but their rectangles with one
+  * draw call.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param cmd
+  *  Array of blt commands; all but the first are only used for their rectangles
+  * @param count
+  *  Number of blt commands, up to BLTBATCH_MAX.  Commands after the first
+  *  must pass glRenderer__CanBatchBlt and glRenderer__BltMatches.
+  * @param backend
+  *  TRUE if called from the command queue, FALSE to signal the busy event
+  */
+void glRenderer__BltBatch(glRenderer *This, BltCommand *cmd, DWORD count, BOOL backend)
+{
+	GLScopedDebugMarker scope(DEBUGMARKER(glRenderer__BltMarker(This, cmd)));
+	ScopedShaderTiming timing(This->shadertiming, SHADERTIMING_BLT, This->shaders->gen3d);
+
+	This->perf.frame.dwBlts += count;
+	// Batched blts don't read the destination, so any of them replacing it whole makes the old contents dead
+	for (DWORD j = 0; j < count; j++)
+	{
+		if (glRenderer__BltCoversDest(&cmd[j]))
+		{
+			glTexture__Discard(cmd->dest, cmd->destlevel);
+			break;
+		}
+	}
+	if (glRenderer__CanClearFill(cmd))
+	{
+		glRenderer__ClearFill(This, cmd, count);
+		glRenderer__FinishBlt(This, cmd, backend);
+		return;
+	}
+	if (cmd->src && (cmd->src == cmd->dest) && (cmd->srclevel == cmd->destlevel) &&
+		!(cmd->flags & 0x80000000) && glRenderer__SelfBlt(This, cmd, backend)) return;
+	if (glRenderer__CanCopyBlt(This, cmd) && glRenderer__CopyBlt(This, cmd, count))
+	{
+		glRenderer__FinishBlt(This, cmd, backend);
+		return;
+	}
+	BOOL usedest = FALSE;
+	BOOL fetchdest = FALSE;
+	BOOL directdest = FALSE;
+	BOOL introp = FALSE;
+	BOOL usepattern = FALSE;
+	LONG sizes[6];
+	RECT destrect, destrect2;
+	BltVertex *vertices = (count > 1) ? This->bltbatchvertices : This->bltvertices;
+	DWORD i;
+	glDirectDraw7_GetSizes(This->ddInterface, sizes);
+	unsigned __int64 shaderid;
+	DDSURFACEDESC2 ddsd;
+	ddsd = cmd->dest->levels[cmd->destlevel].ddsd;
+	if (!memcmp(&cmd->destrect, &nullrect, sizeof(RECT)))
+	{
+		destrect.left = 0;
+		destrect.top = 0;
+		destrect.right = ddsd.dwWidth;
+		destrect.bottom = ddsd.dwHeight;
+		destrect2 = destrect;
+	}
+	else
+	{
+		destrect = cmd->destrect;
+		destrect2.left = 0;
+		destrect2.top = 0;
+		destrect2.right = destrect.right - destrect.left;
+		destrect2.bottom = destrect.bottom - destrect.top;
+	}
+	if ((cmd->bltfx.dwSize == sizeof(DDBLTFX)) && (cmd->flags & DDBLT_ROP))
+	{
+		shaderid = PackROPBits(cmd->bltfx.dwROP, cmd->flags);
+		if (rop_texture_usage[(cmd->bltfx.dwROP >> 16) & 0xFF] & 2) usedest = TRUE;
+		if (rop_texture_usage[(cmd->bltfx.dwROP >> 16) & 0xFF] & 4) usepattern = TRUE;
+	}
+	else shaderid = cmd->flags & 0xF2FAADFF;
+	if (cmd->src) shaderid |= ((long long)cmd->src->blttype << 32);
+	if (!(cmd->flags & 0x80000000) && cmd->dest)
+		shaderid |= ((long long)cmd->dest->blttype << 40);
+	if (cmd->flags & DDBLT_KEYDEST) usedest = TRUE;
+	if ((cmd->bltfx.dwSize == sizeof(DDBLTFX)) && (cmd->flags & DDBLT_ROP) &&
+		glRenderer__CanIntegerROP(This, cmd, count, usedest, usepattern))
+	{
+		shaderid |= (1i64 << 50);
+		introp = TRUE;
+	}
+	if (IsAlphaCKey())
+	{
+
+	}
+	else if (usedest && !introp && !(cmd->flags & 0x80000000) && This->ext->GLEXT_EXT_shader_framebuffer_fetch)
+	{
+		// The shader reads the destination from the framebuffer
+		shaderid |= (1i64 << 49);
+		fetchdest = TRUE;
+	}
+	else if (usedest)
+	{
+		// With a texture barrier each fragment can read the destination texel it
+		// replaces straight from the surface, so no copy of the destination is needed
+		if (!(cmd->flags & 0x80000000) && This->ext->glTextureBarrier && !cmd->destlevel && (count == 1))
+		{
+			if (cmd->dest->atlas) glTexture__LeaveAtlas(cmd->dest);
+			directdest = TRUE;
+		}
+		if ((cmd->flags & 0x80000000) || directdest)
+		{
+			This->bltvertices[1].dests = This->bltvertices[3].dests = (GLfloat)(destrect.left) / (GLfloat)cmd->dest->levels[0].ddsd.dwWidth;
+			This->bltvertices[0].dests = This->bltvertices[2].dests = (GLfloat)(destrect.right) / (GLfloat)cmd->dest->levels[0].ddsd.dwWidth;
+			This->bltvertices[0].destt = This->bltvertices[1].destt = (GLfloat)(destrect.top) / (GLfloat)cmd->dest->levels[0].ddsd.dwHeight;
+			This->bltvertices[2].destt = This->bltvertices[3].destt = (GLfloat)(destrect.bottom) / (GLfloat)cmd->dest->levels[0].ddsd.dwHeight;
+		}
+		else
+		{
+			ShaderManager_SetShader(This->shaders, PROG_TEXTURE, NULL, 0);
+			glRenderer__DrawBackbufferRect(This, cmd->dest, destrect, destrect2, PROG_TEXTURE, 0);
+			This->bltvertices[1].dests = This->bltvertices[3].dests = 0.0f;
+			This->bltvertices[0].dests = This->bltvertices[2].dests = (GLfloat)(destrect.right - destrect.left) / (GLfloat)This->backbuffers[0].levels[0].ddsd.dwWidth;
+			This->bltvertices[0].destt = This->bltvertices[1].destt = 1.0f;
+			This->bltvertices[2].destt = This->bltvertices[3].destt = 1.0f - ((GLfloat)(destrect.bottom - destrect.top) / (GLfloat)This->backbuffers[0].levels[0].ddsd.dwHeight);
+		}
+	}
+	ShaderManager_SetShader(This->shaders, shaderid, NULL, 1);
+	GenShader2D *shader = (GenShader2D*)This->shaders->gen3d->current_genshader;
+	glUtil_BlendEnable(This->util, FALSE);
+	if (cmd->flags & 0x80000000)
+	{
+		glRenderer__SetScreenFBO(This);
+		glUtil_SetViewport(This->util, 0, 0, sizes[4], sizes[5]);
+	}
+	else
+	{
+		do
+		{
+			if (glUtil_SetFBOSurface(This->util, cmd->dest, NULL, cmd->destlevel, 0, TRUE) == GL_FRAMEBUFFER_COMPLETE) break;
+			if (!cmd->dest->internalformats[1]) break;
+			glTexture__Repair(cmd->dest, TRUE);
+			glUtil_SetFBO(This->util, NULL);
+			cmd->dest->levels[cmd->destlevel].fbo.fbcolor = NULL;
+			cmd->dest->levels[cmd->destlevel].fbo.fbz = NULL;
+		} while (1);
+		glUtil_SetViewport(This->util, 0, 0, cmd->dest->levels[cmd->destlevel].ddsd.dwWidth,
+			cmd->dest->levels[cmd->destlevel].ddsd.dwHeight);
+	}
+	glUtil_DepthTest(This->util, FALSE);
+	DDSURFACEDESC2 ddsdSrc;
+	ZeroMemory(&ddsdSrc, sizeof(DDSURFACEDESC2));
+	ddsdSrc.dwSize = sizeof(DDSURFACEDESC2);
+	if (cmd->src)
+	{
+		ddsdSrc = cmd->src->levels[cmd->srclevel].ddsd;
+		if (glTexture__CPUDirty(cmd->src, cmd->srclevel)) glTexture__Upload(cmd->src, cmd->srclevel);
+	}
+	if (glTexture__CPUDirty(cmd->dest, cmd->destlevel))
+		glTexture__Upload(cmd->dest, cmd->destlevel);
+	for (i = 0; i < count; i++)
+	{
+		if (cmd[i].src && (cmd[i].src != cmd->src))
+		{
+			// Batched sources other than the first share its atlas page
+			if (glTexture__CPUDirty(cmd[i].src, cmd[i].srclevel)) glTexture__Upload(cmd[i].src, cmd[i].srclevel);
+			glRenderer__SetBltVertices(This, &cmd[i], &vertices[i * 4], &ddsd,
+				&cmd[i].src->levels[cmd[i].srclevel].ddsd, sizes);
+		}
+		else glRenderer__SetBltVertices(This, &cmd[i], &vertices[i * 4], &ddsd, &ddsdSrc, sizes);
+	}
+	if (cmd->dest->levels[cmd->destlevel].fbz) glClear(GL_DEPTH_BUFFER_BIT);
+	if (cmd->flags & DDBLT_COLORFILL) SetColorFillUniform(cmd->bltfx.dwFillColor, cmd->dest->colorsizes,
+		cmd->dest->colororder, cmd->dest->colorbits, shader->shader.uniforms[12], This->ext);
+	if ((cmd->flags & DDBLT_KEYSRC) && (cmd->src && ((cmd->src->levels[cmd->srclevel].ddsd.dwFlags & DDSD_CKSRCBLT))
+		|| (cmd->flags & DDBLT_KEYSRCOVERRIDE)) && !(cmd->flags & DDBLT_COLORFILL))
+	{
+		if (cmd->src->blockid) glTexture__MakeResident(cmd->src);
+		if (cmd->flags & DDBLT_KEYSRCOVERRIDE)
+		{
+			SetColorKeyUniform(cmd->bltfx.ddckSrcColorkey.dwColorSpaceLowValue, cmd->src->colorsizes,
+				cmd->src->colororder, shader->shader.uniforms[5], cmd->src->colorbits, This->ext);
+			if (cmd->flags & 0x20000000) SetColorKeyUniform(cmd->bltfx.ddckSrcColorkey.dwColorSpaceHighValue, cmd->src->colorsizes,
+				cmd->src->colororder, shader->shader.uniforms[7], cmd->src->colorbits, This->ext);
+		}
+		else
+		{
+			SetColorKeyUniform(cmd->src->levels[cmd->srclevel].ddsd.ddckCKSrcBlt.dwColorSpaceLowValue, cmd->src->colorsizes,
+				cmd->src->colororder, shader->shader.uniforms[5], cmd->src->colorbits, This->ext);
+			if (cmd->flags & 0x20000000) SetColorKeyUniform(cmd->src->levels[cmd->srclevel].ddsd.ddckCKSrcBlt.dwColorSpaceHighValue, cmd->src->colorsizes,
+				cmd->src->colororder, shader->shader.uniforms[7], cmd->src->colorbits, This->ext);
+		}
+	}
+	GLint unit;
+	if (!(cmd->flags & DDBLT_COLORFILL))
+	{
+		unit = 8;
+		if (glRenderer__ShadowUniform(shader->shader.uniforms[1], shader->shader.shadow[1], &unit, sizeof(GLint)))
+			This->ext->glUniform1i(shader->shader.uniforms[1], unit);
+	}
+	if (cmd->flags & 0x80000000)
+	{
+		if ((cmd->flags & DDBLT_KEYDEST) && (This && ((cmd->dest->levels[cmd->destlevel].ddsd.dwFlags & DDSD_CKDESTOVERLAY)
+			|| (cmd->flags & DDBLT_KEYDESTOVERRIDE))))
+		{
+			if (cmd->flags & DDBLT_KEYDESTOVERRIDE)
+			{
+				SetColorKeyUniform(cmd->bltfx.ddckDestColorkey.dwColorSpaceLowValue, cmd->dest->colorsizes,
+					cmd->dest->colororder, shader->shader.uniforms[6], cmd->dest->colorbits, This->ext);
+				if (cmd->flags & 0x40000000) SetColorKeyUniform(cmd->bltfx.ddckDestColorkey.dwColorSpaceHighValue, cmd->dest->colorsizes,
+					cmd->dest->colororder, shader->shader.uniforms[8], cmd->dest->colorbits, This->ext);
+			}
+			else
+			{
+				SetColorKeyUniform(cmd->dest->levels[cmd->destlevel].ddsd.ddckCKDestOverlay.dwColorSpaceLowValue, cmd->dest->colorsizes,
+					cmd->dest->colororder, shader->shader.uniforms[6], cmd->dest->colorbits, This->ext);
+				if (cmd->flags & 0x40000000) SetColorKeyUniform(cmd->dest->levels[cmd->destlevel].ddsd.ddckCKDestOverlay.dwColorSpaceHighValue, cmd->dest->colorsizes,
+					cmd->dest->colororder, shader->shader.uniforms[8], cmd->dest->colorbits, This->ext);
+			}
+		}
+	}
+	else if ((cmd->flags & DDBLT_KEYDEST) && (This && ((cmd->dest->levels[cmd->destlevel].ddsd.dwFlags & DDSD_CKDESTBLT)
+		|| (cmd->flags & DDBLT_KEYDESTOVERRIDE))))
 	{
-		DWORD err = (uint16_t)GetLastError();
-		if (err == ERROR_INVALID_VERSION_ARB)
+		if (cmd->flags & DDBLT_KEYDESTOVERRIDE)
 		{
+			SetColorKeyUniform(cmd->bltfx.ddckDestColorkey.dwColorSpaceLowValue, cmd->dest->colorsizes,
+				cmd->dest->colororder, shader->shader.uniforms[6], cmd->dest->colorbits, This->ext);
+			if (cmd->flags & 0x40000000) SetColorKeyUniform(cmd->bltfx.ddckDestColorkey.dwColorSpaceHighValue, cmd->dest->colorsizes,
+				cmd->dest->colororder, shader->shader.uniforms[8], cmd->dest->colorbits, This->ext);
 		}
-		else if (err == ERROR_INVALID_PROFILE_ARB)
+		else
 		{
+			SetColorKeyUniform(cmd->dest->levels[cmd->destlevel].ddsd.ddckCKDestBlt.dwColorSpaceLowValue, cmd->dest->colorsizes,
+				cmd->dest->colororder, shader->shader.uniforms[6], cmd->dest->colorbits, This->ext);
+			if (cmd->flags & 0x40000000) SetColorKeyUniform(cmd->dest->levels[cmd->destlevel].ddsd.ddckCKDestBlt.dwColorSpaceHighValue, cmd->dest->colorsizes,
+				cmd->dest->colororder, shader->shader.uniforms[8], cmd->dest->colorbits, This->ext);
 		}
 	}
-	else
+	if (usedest && !fetchdest && (shader->shader.uniforms[2] != -1))
 	{
-		wglMakeCurrent(nullptr, nullptr);
-		wglDeleteContext(This->hRC);
-		This->hRC = newRC;
-		wglMakeCurrent(This->hDC, This->hRC);
+		if (introp) glRenderer__SetIntegerView(This, 9, cmd->dest);
+		else if ((cmd->flags & 0x80000000) || directdest) glUtil_SetTexture(This->util, 9, cmd->dest);
+		else glUtil_SetTexture(This->util, 9, &This->backbuffers[0]);
+		unit = 9;
+		if (glRenderer__ShadowUniform(shader->shader.uniforms[2], shader->shader.shadow[2], &unit, sizeof(GLint)))
+			This->ext->glUniform1i(shader->shader.uniforms[2], unit);
 	}
-
-	InterlockedDecrement((LONG*)&gllock);
-	LeaveCriticalSection(&dll_cs);
-
-	if (!gladLoadGL())
-		return FALSE;
-
-	setupDebugOutputCallback();
-
-	This->ext = (glExtensions *)malloc(sizeof(glExtensions));
-	glExtensions_Init(This->ext);
-	glUtil_Create(This->ext, &This->util);
-	glRenderer__SetSwap(This,1);
-	glFinish();
-	DXGLTimer_Init(&This->timer);
-	DXGLTimer_Calibrate(&This->timer, height, frequency);
-	if (dxglcfg.vsync == 1) This->oldswap = 1;
-	glRenderer__SetSwap(This,0);
-	glUtil_SetViewport(This->util,0,0,width,height);
-	glViewport(0,0,width,height);
-	glUtil_SetDepthRange(This->util,0.0,1.0);
-	glUtil_DepthWrite(This->util,TRUE);
-	glUtil_DepthTest(This->util,FALSE);
-	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_DITHER);
-	glUtil_SetDepthComp(This->util,GL_LESS);
-	const GLubyte *glver = glGetString(GL_VERSION);
-	This->gl_caps.Version = (GLfloat)atof((char*)glver);
-	if(This->gl_caps.Version >= 2)
+	if (usepattern && (shader->shader.uniforms[3] != -1))
 	{
-		glver = glGetString(GL_SHADING_LANGUAGE_VERSION);
-		This->gl_caps.ShaderVer = (GLfloat)atof((char*)glver);
+		// Patterns are tiled from the origin of their texture
+		if (cmd->pattern->atlas) glTexture__LeaveAtlas(cmd->pattern);
+		if (glTexture__CPUDirty(cmd->pattern, cmd->patternlevel)) glTexture__Upload(cmd->pattern, cmd->patternlevel);
+		if (introp) glRenderer__SetIntegerView(This, 10, cmd->pattern);
+		else glUtil_SetTexture(This->util, 10, cmd->pattern);
+		unit = 10;
+		if (glRenderer__ShadowUniform(shader->shader.uniforms[3], shader->shader.shadow[3], &unit, sizeof(GLint)))
+			This->ext->glUniform1i(shader->shader.uniforms[3], unit);
+		GLint patternsize[2] = { (GLint)cmd->pattern->levels[cmd->patternlevel].ddsd.dwWidth,
+			(GLint)cmd->pattern->levels[cmd->patternlevel].ddsd.dwHeight };
+		if (glRenderer__ShadowUniform(shader->shader.uniforms[9], shader->shader.shadow[9], patternsize, 2 * sizeof(GLint)))
+			This->ext->glUniform2i(shader->shader.uniforms[9], patternsize[0], patternsize[1]);
 	}
-	else This->gl_caps.ShaderVer = 0;
-	glGetIntegerv(GL_MAX_TEXTURE_SIZE,&This->gl_caps.TextureMax);
-	This->shaders = (ShaderManager*)malloc(sizeof(ShaderManager));
-	ShaderManager_Init(This->ext, This->shaders);
-	This->fbo.fbo = 0;
-	glUtil_InitFBO(This->util,&This->fbo);
-	glUtil_ClearColor(This->util, 0.0f, 0.0f, 0.0f, 0.0f);
-	glUtil_ClearDepth(This->util, 1.0);
-	glUtil_ClearStencil(This->util, 0);
-	glUtil_EnableArray(This->util,-1,FALSE);
-	glUtil_BlendFunc(This->util,GL_ONE,GL_ZERO);
-	glUtil_BlendEnable(This->util,FALSE);
-	glClear(GL_COLOR_BUFFER_BIT);
-	glFlush();
-	glUtil_SetScissor(This->util,FALSE,0,0,0,0);
-	glDisable(GL_SCISSOR_TEST);
-	glUtil_SetCull(This->util,D3DCULL_CCW);
-	glEnable(GL_CULL_FACE);
-	SwapBuffers(This->hDC);
-	glUtil_SetActiveTexture(This->util,0);
-	glRenderer__SetFogColor(This,0);
-	glRenderer__SetFogStart(This,0);
-	glRenderer__SetFogEnd(This,1);
-	glRenderer__SetFogDensity(This,1);
-	glUtil_SetPolyMode(This->util, D3DFILL_SOLID);
-	glUtil_SetShadeMode(This->util, D3DSHADE_GOURAUD);
-	if(hWnd)
+	if (cmd->flags & 0x10000000)  // Use clipper
 	{
-		This->dib.enabled = TRUE;
-		This->dib.width = width;
-		This->dib.height = height;
-		This->dib.pitch = (((width<<3)+31)&~31) >>3;
-		This->dib.pixels = NULL;
-		This->dib.hdc = CreateCompatibleDC(NULL);
-		if(!This->dib.info)
-			This->dib.info = (BITMAPINFO*)malloc(sizeof(BITMAPINFO));
-		ZeroMemory(This->dib.info,sizeof(BITMAPINFO));
-		This->dib.info->bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
-		This->dib.info->bmiHeader.biBitCount = 32;
-		This->dib.info->bmiHeader.biWidth = width;
-		This->dib.info->bmiHeader.biHeight = height;
-		This->dib.info->bmiHeader.biCompression = BI_RGB;
-		This->dib.info->bmiHeader.biPlanes = 1;
-		This->dib.hbitmap = CreateDIBSection(This->dib.hdc,This->dib.info,
-			DIB_RGB_COLORS,(void**)&This->dib.pixels,NULL,0);
+		glUtil_SetTexture(This->util, 11, cmd->dest->stencil);
+		unit = 11;
+		if (glRenderer__ShadowUniform(shader->shader.uniforms[4], shader->shader.shadow[4], &unit, sizeof(GLint)))
+			This->ext->glUniform1i(shader->shader.uniforms[4], unit);
+		glUtil_EnableArray(This->util, shader->shader.attribs[5], TRUE);
+		This->ext->glVertexAttribPointer(shader->shader.attribs[5], 2, GL_FLOAT, GL_FALSE, sizeof(BltVertex), &vertices[0].stencils);
 	}
-	BufferObject_Create(&This->pbo, This->ext, This->util);
-	BufferObject_SetData(This->pbo, GL_PIXEL_PACK_BUFFER, width*height * 4, NULL, GL_STREAM_READ);
-	if (_isnan(dxglcfg.postsizex) || _isnan(dxglcfg.postsizey) ||
-		(dxglcfg.postsizex < 0.25f) || (dxglcfg.postsizey < 0.25f))
+	switch ((shaderid >> 32) & 0xFF)
 	{
-		This->postsizex = 1.0f;
-		This->postsizey = 1.0f;
+	case 0x10:
+	case 0x11:
+	case 0x12:
+	case 0x13: // Use palette
+		if (cmd->src->palette)
+		{
+			if (cmd->src->palette->levels[0].dirty & 1) glTexture__Upload(cmd->src->palette, 0);
+			glUtil_SetTexture(This->util, 12, cmd->src->palette);
+			unit = 12;
+			if (glRenderer__ShadowUniform(shader->shader.uniforms[13], shader->shader.shadow[13], &unit, sizeof(GLint)))
+				This->ext->glUniform1i(shader->shader.uniforms[13], unit);
+		}
+		break;
+	default:
+		break;
+	}
+	if (cmd->src && introp) glRenderer__SetIntegerView(This, 8, cmd->src);
+	else if (cmd->src)
+	{
+		glUtil_SetTexture(This->util, 8, cmd->src);
+		if(This->ext->GLEXT_ARB_sampler_objects)
+		{
+			if((dxglcfg.BltScale == 0) || (This->ddInterface->primarybpp == 8))
+				glTexture__SetFilter(cmd->src, 8, GL_NEAREST, GL_NEAREST, This);
+			else glTexture__SetFilter(cmd->src, 8, GL_LINEAR, GL_LINEAR, This);
+		}
+	}
+	else glUtil_SetTexture(This->util,8,NULL);
+	GLfloat view[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+	if (cmd->flags & 0x80000000)
+	{
+		view[1] = (GLfloat)sizes[4];
+		view[3] = (GLfloat)sizes[5];
 	}
 	else
 	{
-		This->postsizex = dxglcfg.postsizex;
-		This->postsizey = dxglcfg.postsizey;
+		view[1] = (GLfloat)cmd->dest->levels[cmd->destlevel].ddsd.dwWidth;
+		view[3] = (GLfloat)cmd->dest->levels[cmd->destlevel].ddsd.dwHeight;
 	}
-	TRACE_SYSINFO();
-	return TRUE;
+	if (glRenderer__ShadowUniform(shader->shader.uniforms[0], shader->shader.shadow[0], view, 4 * sizeof(GLfloat)))
+		This->ext->glUniform4fv(shader->shader.uniforms[0], 1, view);
+	// colorsizes are DWORDs, which glUniform4iv reads the same as GLints
+	if (cmd->src && glRenderer__ShadowUniform(shader->shader.uniforms[10], shader->shader.shadow[10],
+		cmd->src->colorsizes, 4 * sizeof(GLint)))
+		This->ext->glUniform4iv(shader->shader.uniforms[10], 1, (GLint*)cmd->src->colorsizes);
+	if (cmd->dest && glRenderer__ShadowUniform(shader->shader.uniforms[11], shader->shader.shadow[11],
+		cmd->dest->colorsizes, 4 * sizeof(GLint)))
+		This->ext->glUniform4iv(shader->shader.uniforms[11], 1, (GLint*)cmd->dest->colorsizes);
+	cmd->dest->levels[cmd->destlevel].dirty = (cmd->dest->levels[cmd->destlevel].dirty | 2) & ~84;
+	if (cmd->destlevel) cmd->dest->automipmap = FALSE;
+	glUtil_EnableArray(This->util, shader->shader.attribs[0], TRUE);
+	This->ext->glVertexAttribPointer(shader->shader.attribs[0],2,GL_FLOAT,GL_FALSE,sizeof(BltVertex),&vertices[0].x);
+	if((!(cmd->flags & DDBLT_COLORFILL)) && (shader->shader.attribs[3] != -1))
+	{
+		glUtil_EnableArray(This->util, shader->shader.attribs[3], TRUE);
+		This->ext->glVertexAttribPointer(shader->shader.attribs[3],2,GL_FLOAT,GL_FALSE,sizeof(BltVertex),&vertices[0].s);
+	}
+	if (usedest && !fetchdest)
+	{
+		glUtil_EnableArray(This->util, shader->shader.attribs[4], TRUE);
+		This->ext->glVertexAttribPointer(shader->shader.attribs[4],2,GL_FLOAT,GL_FALSE,sizeof(BltVertex),&vertices[0].dests);
+	}
+	glUtil_SetCull(This->util, D3DCULL_NONE);
+	glUtil_SetPolyMode(This->util, D3DFILL_SOLID);
+	// Make earlier drawing to the destination visible to its texture fetches
+	if (directdest) This->ext->glTextureBarrier();
+	// Draw once per scissor rectangle if the clip list has few rectangles
+	i = 0;
+	do
+	{
+		if (cmd->clipcount && !(cmd->flags & 0x80000000))
+			glUtil_SetScissor(This->util, TRUE, cmd->cliprects[i].left, cmd->cliprects[i].top,
+				cmd->cliprects[i].right - cmd->cliprects[i].left, cmd->cliprects[i].bottom - cmd->cliprects[i].top);
+		if (count > 1) This->ext->glDrawRangeElements(GL_TRIANGLES, 0, (count * 4) - 1, count * 6,
+			GL_UNSIGNED_SHORT, This->bltbatchindices);
+		else This->ext->glDrawRangeElements(GL_TRIANGLE_STRIP,0,3,4,GL_UNSIGNED_SHORT,bltindices);
+	} while (++i < cmd->clipcount);
+	if (cmd->clipcount) glUtil_SetScissor(This->util, FALSE, 0, 0, 0, 0);
+	glRenderer__FinishBlt(This, cmd, backend);
 }
 
-void SetColorFillUniform(DWORD color, DWORD *colorsizes, int colororder, DWORD *colorbits, GLint uniform, glExtensions *ext)
+/**
+  * Completes a blt after its draw calls: schedules readback of the
+  * destination, updates the screen after drawing to the front buffer and
+  * signals the calling thread.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param cmd
+  *  First blt of the batch that was drawn
+  * @param backend
+  *  TRUE if called from the renderer thread without a waiting caller
+  */
+static void glRenderer__FinishBlt(glRenderer *This, BltCommand *cmd, BOOL backend)
 {
-	DWORD r, g, b, a;
-	switch (colororder)
+	DDSURFACEDESC2 ddsd = cmd->dest->levels[cmd->destlevel].ddsd;
+	glUtil_SetFBO(This->util, NULL);
+	if (!(cmd->flags & 0x80000000)) glRenderer__PredictReadback(This, cmd->dest, cmd->destlevel);
+	if(((ddsd.ddsCaps.dwCaps & (DDSCAPS_FRONTBUFFER)) &&
+		(ddsd.ddsCaps.dwCaps & DDSCAPS_PRIMARYSURFACE)) ||
+		((ddsd.ddsCaps.dwCaps & DDSCAPS_PRIMARYSURFACE) &&
+		!(ddsd.ddsCaps.dwCaps & DDSCAPS_FLIP)))
+		if(!(cmd->flags & 0x80000000)) glRenderer__DrawScreen(This,cmd->dest,cmd->dest->palette,0,NULL,FALSE,TRUE);
+	This->outputs[0] = (void*)DD_OK;
+	if(!backend) SetEvent(This->busy);
+}
+
+void glRenderer__MakeTexture(glRenderer *This, glTexture *texture)
+{
+	This->perf.frame.dwTextureCreates++;
+	glTexture__FinishCreate(texture);
+}
+
+void glRenderer__DrawBackbufferRect(glRenderer *This, glTexture *texture, RECT srcrect, RECT destrect, int progtype, int index)
+{
+	GLfloat view[4];
+	DDSURFACEDESC2 ddsd;
+	int x1 = destrect.left;
+	int x2 = destrect.right;
+	int y1 = destrect.top;
+	int y2 = destrect.bottom;
+	if (index > 15) return;
+	glUtil_SetActiveTexture(This->util, 0);
+	if (!This->backbuffers[index].initialized)
 	{
-	case 0:
-		r = color & colorsizes[0];
-		color >>= colorbits[0];
-		g = color & colorsizes[1];
-		color >>= colorbits[1];
-		b = color & colorsizes[2];
-		color >>= colorbits[2];
-		a = color & colorsizes[3];
-		ext->glUniform4i(uniform, r, g, b, a);
-		break;
-	case 1:
-		b = color & colorsizes[2];
-		color >>= colorbits[2];
-		g = color & colorsizes[1];
-		color >>= colorbits[1];
-		r = color & colorsizes[0];
-		color >>= colorbits[0];
-		a = color & colorsizes[3];
-		ext->glUniform4i(uniform, r, g, b, a);
-		break;
-	case 2:
-		a = color & colorsizes[3];
-		color >>= colorbits[3];
-		r = color & colorsizes[0];
-		color >>= colorbits[0];
-		g = color & colorsizes[1];
-		color >>= colorbits[1];
-		b = color & colorsizes[2];
-		ext->glUniform4i(uniform, r, g, b, a);
-		break;
-	case 3:
-		a = color & colorsizes[3];
-		color >>= colorbits[3];
-		b = color & colorsizes[2];
-		color >>= colorbits[2];
-		g = color & colorsizes[1];
-		color >>= colorbits[1];
-		r = color & colorsizes[0];
-		ext->glUniform4i(uniform, r, g, b, a);
-		break;
-	case 4:
-		r = color & colorsizes[0];
-		ext->glUniform4i(uniform, r, r, r, r);
-		break;
-	case 5:
-		r = color & colorsizes[0];
-		ext->glUniform4i(uniform, r, r, r, r);
-		break;
-	case 6:
-		a = color & colorsizes[3];
-		ext->glUniform4i(uniform, a, a, a, a);
-		break;
-	case 7:
-		r = color & colorsizes[0];
-		color >>= colorbits[0];
-		a = color & colorsizes[3];
-		ext->glUniform4i(uniform, r, r, r, a);
-		break;
+		ZeroMemory(&ddsd, sizeof(DDSURFACEDESC2));
+		memcpy(&ddsd, &ddsdbackbuffer, sizeof(DDSURFACEDESC2));
+		ddsd.dwWidth = x2;
+		ddsd.lPitch = x2 * 4;
+		ddsd.dwHeight = y2;
+		glTexture_Create(&ddsd, &This->backbuffers[index], This, TRUE, 0);
+	}
+	if ((This->backbuffers[index].levels[0].ddsd.dwWidth < x2) || (This->backbuffers[index].levels[0].ddsd.dwHeight < y2))
+	{
+		if (This->backbuffers[index].levels[0].ddsd.dwWidth > x2) x2 = This->backbuffers[index].levels[0].ddsd.dwWidth;
+		if (This->backbuffers[index].levels[0].ddsd.dwHeight > y2) y2 = This->backbuffers[index].levels[0].ddsd.dwHeight;
+		ZeroMemory(&ddsd, sizeof(DDSURFACEDESC2));
+		ddsd.dwSize = sizeof(DDSURFACEDESC2);
+		ddsd.dwWidth = x2;
+		ddsd.dwHeight = y2;
+		ddsd.dwFlags = DDSD_WIDTH | DDSD_HEIGHT;
+		glTexture__SetSurfaceDesc(&This->backbuffers[index], &ddsd);
+		x2 = destrect.right;
+		y2 = destrect.bottom;
+	}
+	glUtil_SetFBOTextures(This->util, &This->fbo, &This->backbuffers[index], NULL, 0, 0, FALSE);
+	view[0] = view[2] = 0;
+	view[1] = (GLfloat)This->backbuffers[index].levels[0].ddsd.dwWidth;
+	view[3] = (GLfloat)This->backbuffers[index].levels[0].ddsd.dwHeight;
+	glUtil_SetViewport(This->util, 0, 0, This->backbuffers[index].levels[0].ddsd.dwWidth, This->backbuffers[index].levels[0].ddsd.dwHeight);
+	glUtil_SetScissor(This->util, TRUE, 0, 0, This->backbuffers[index].levels[0].ddsd.dwWidth, This->backbuffers[index].levels[0].ddsd.dwHeight);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	glUtil_SetScissor(This->util, FALSE, 0, 0, 0, 0);
+	glUtil_SetTexture(This->util, 8, texture);
+	This->ext->glUniform1i(This->shaders->shaders[progtype].tex0, 8);
+	This->ext->glUniform4f(This->shaders->shaders[progtype].view, view[0], view[1], view[2], view[3]);
+	if (texture->target == GL_TEXTURE_RECTANGLE)
+	{
+		This->bltvertices[1].s = This->bltvertices[3].s = (GLfloat)srcrect.left;
+		This->bltvertices[0].s = This->bltvertices[2].s = (GLfloat)srcrect.right;
+		This->bltvertices[0].t = This->bltvertices[1].t = (GLfloat)srcrect.top;
+		This->bltvertices[2].t = This->bltvertices[3].t = (GLfloat)srcrect.bottom;
 	}
+	else
+	{
+		This->bltvertices[1].s = This->bltvertices[3].s = (GLfloat)srcrect.left / (GLfloat)texture->levels[0].ddsd.dwWidth;
+		This->bltvertices[0].s = This->bltvertices[2].s = (GLfloat)srcrect.right / (GLfloat)texture->levels[0].ddsd.dwWidth;
+		This->bltvertices[0].t = This->bltvertices[1].t = (GLfloat)srcrect.top / (GLfloat)texture->levels[0].ddsd.dwHeight;
+		This->bltvertices[2].t = This->bltvertices[3].t = (GLfloat)srcrect.bottom / (GLfloat)texture->levels[0].ddsd.dwHeight;
+	}
+	This->bltvertices[1].x = This->bltvertices[3].x = (float)x1;
+	This->bltvertices[0].x = This->bltvertices[2].x = (float)x2;
+	This->bltvertices[0].y = This->bltvertices[1].y = (float)y1;
+	This->bltvertices[2].y = This->bltvertices[3].y = (float)y2;
+	glUtil_EnableArray(This->util, This->shaders->shaders[progtype].pos, TRUE);
+	This->ext->glVertexAttribPointer(This->shaders->shaders[progtype].pos, 2, GL_FLOAT, GL_FALSE, sizeof(BltVertex), &This->bltvertices[0].x);
+	glUtil_EnableArray(This->util, This->shaders->shaders[progtype].texcoord, TRUE);
+	This->ext->glVertexAttribPointer(This->shaders->shaders[progtype].texcoord, 2, GL_FLOAT, GL_FALSE, sizeof(BltVertex), &This->bltvertices[0].s);
+	glUtil_SetCull(This->util, D3DCULL_NONE);
+	glUtil_SetPolyMode(This->util, D3DFILL_SOLID);
+	This->ext->glDrawRangeElements(GL_TRIANGLE_STRIP, 0, 3, 4, GL_UNSIGNED_SHORT, bltindices);
+	glUtil_SetFBO(This->util, NULL);
 }
 
-void SetColorKeyUniform(DWORD key, DWORD *colorsizes, int colororder, GLint uniform, DWORD *colorbits, glExtensions *ext)
+static DWORD dummypalette[256];
+
+BOOL CompareRGB(DWORD rgb, BOOL greater)
 {
-	DWORD r, g, b, a;
-	switch (colororder)
+	RGBQUAD *pixel = (RGBQUAD*)&rgb;
+	RGBQUAD *comp = (RGBQUAD*)&dxglcfg.HackAutoExpandViewportValue;
+	if (greater)
 	{
-	case 0:
-		r = key & colorsizes[0];
-		key >>= colorbits[0];
-		g = key & colorsizes[1];
-		key >>= colorbits[1];
-		b = key & colorsizes[2];
-		ext->glUniform3i(uniform, r, g, b);
-		break;
-	case 1:
-		b = key & colorsizes[2];
-		key >>= colorbits[2];
-		g = key & colorsizes[1];
-		key >>= colorbits[1];
-		r = key & colorsizes[0];
-		ext->glUniform3i(uniform, r, g, b);
-		break;
-	case 2:
-		a = key & colorsizes[3];
-		key >>= colorbits[3];
-		r = key & colorsizes[0];
-		key >>= colorbits[0];
-		g = key & colorsizes[1];
-		key >>= colorbits[1];
-		b = key & colorsizes[2];
-		ext->glUniform3i(uniform, r, g, b);
-		break;
-	case 3:
-		a = key & colorsizes[3];
-		key >>= colorbits[3];
-		b = key & colorsizes[2];
-		key >>= colorbits[2];
-		g = key & colorsizes[1];
-		key >>= colorbits[1];
-		r = key & colorsizes[0];
-		ext->glUniform3i(uniform, r, g, b);
-		break;
-	case 4:
-		r = key & colorsizes[0];
-		if (ext->glver_major >= 3) ext->glUniform3i(uniform, r, 0, 0);
-		else ext->glUniform3i(uniform, r, r, r);
-		break;
-	case 5:
-		r = key & colorsizes[0];
-		ext->glUniform3i(uniform, r, r, r);
-		break;
-	case 6:
-		a = key & colorsizes[3];
-		ext->glUniform4i(uniform, 0, 0, 0, a);
-		break;
-	case 7:
-		r = key & colorsizes[0];
-		key >>= colorbits[0];
-		a = key & colorsizes[3];
-		ext->glUniform4i(uniform, r, r, r, a);
-		break;
+		if ((pixel->rgbBlue >= comp->rgbBlue) && (pixel->rgbGreen >= comp->rgbGreen)
+			&& (pixel->rgbRed >= comp->rgbRed)) return TRUE;
+		else return FALSE;
+	}
+	else
+	{
+		if ((pixel->rgbBlue <= comp->rgbBlue) && (pixel->rgbGreen <= comp->rgbGreen)
+			&& (pixel->rgbRed <= comp->rgbRed)) return TRUE;
+		else return FALSE;
 	}
 }
 
-void BltFlipLR(BltVertex *vertices)
+DWORD RGB555toRGB888(WORD pixel)
 {
-	GLfloat s1, s2;
-	s1 = vertices[0].s;
-	s2 = vertices[2].s;
-	vertices[0].s = vertices[1].s;
-	vertices[2].s = vertices[3].s;
-	vertices[1].s = s1;
-	vertices[3].s = s2;
+	DWORD red, green, blue;
+	red = _5to8bit((pixel & 0x7C00) >> 10) << 16;
+	green = _5to8bit((pixel & 0x3E0) >> 5) << 8;
+	blue = _5to8bit(pixel & 0x1F);
+	return red | green | blue;
 }
 
-void BltFlipUD(BltVertex *vertices)
+DWORD RGB565toRGB888(WORD pixel)
 {
-	GLfloat t1, t2;
-	t1 = vertices[0].t;
-	t2 = vertices[1].t;
-	vertices[0].t = vertices[2].t;
-	vertices[1].t = vertices[3].t;
-	vertices[2].t = t1;
-	vertices[3].t = t2;
+	DWORD red, green, blue;
+	red = _5to8bit((pixel & 0xF800) >> 11) << 16;
+	green = _6to8bit((pixel & 0x7E0) >> 5) << 8;
+	blue = _5to8bit(pixel & 0x1F);
+	return red | green | blue;
 }
 
-void RotateBlt90(BltVertex *vertices, int times)
+BOOL BorderColorCompare(glRenderer *This, DWORD pixel, DWORD *palette, DWORD bpp)
 {
-	GLfloat s0, s1, s2, s3;
-	GLfloat t0, t1, t2, t3;
-	switch (times)
+	if (!palette) palette = dummypalette;
+	switch (bpp)
 	{
-	case 0:
-	default:
-		return;
-	case 1:
-		s0 = vertices[0].s; t0 = vertices[0].t;
-		s1 = vertices[1].s; t1 = vertices[1].t;
-		s2 = vertices[2].s; t2 = vertices[2].t;
-		s3 = vertices[3].s; t3 = vertices[3].t;
-		vertices[0].s = s1; vertices[0].t = t1;
-		vertices[1].s = s3; vertices[1].t = t3;
-		vertices[2].s = s0; vertices[2].t = t0;
-		vertices[3].s = s2; vertices[3].t = t2;
+	case 8:
+		switch (dxglcfg.HackAutoExpandViewportCompare)
+		{
+		case 0: // Match color
+			if ((palette[pixel & 0xFF] & 0xFFFFFF) == dxglcfg.HackAutoExpandViewportValue & 0xFFFFFF) return TRUE;
+			else return FALSE;
+			break;
+		case 1: // Color less than or equal
+			return CompareRGB(palette[pixel & 0xFF], FALSE);
+			break;
+		case 2: // Color greater than or equal
+			return CompareRGB(palette[pixel & 0xFF], TRUE);
+			break;
+		case 3: // Palette/value equal
+			if ((pixel & 0xFF) == (dxglcfg.HackAutoExpandViewportValue & 0xFF)) return TRUE;
+			else return FALSE;
+			break;
+		case 4: // Palette/value less than or equal
+			if ((pixel & 0xFF) <= (dxglcfg.HackAutoExpandViewportValue & 0xFF)) return TRUE;
+			else return FALSE;
+			break;
+		case 5: // Palette/value greater than or equal
+			if ((pixel & 0xFF) >= (dxglcfg.HackAutoExpandViewportValue & 0xFF)) return TRUE;
+			else return FALSE;
+			break;
+		case 6: // Match 3 palette entries
+			if (((pixel & 0xFF) == (dxglcfg.HackAutoExpandViewportValue & 0xFF)) ||
+				((pixel & 0xFF) == ((dxglcfg.HackAutoExpandViewportValue & 0xFF00) >> 8)) ||
+				((pixel & 0xFF) == ((dxglcfg.HackAutoExpandViewportValue & 0xFF0000) >> 16))) return TRUE;
+			else return FALSE;
+			break;
+		default:
+			return FALSE;
+		}
 		break;
-	case 2:
-		s0 = vertices[0].s; t0 = vertices[0].t;
-		s1 = vertices[1].s; t1 = vertices[1].t;
-		s2 = vertices[2].s; t2 = vertices[2].t;
-		s3 = vertices[3].s; t3 = vertices[3].t;
-		vertices[0].s = s3; vertices[0].t = t3;
-		vertices[1].s = s2; vertices[1].t = t2;
-		vertices[2].s = s1; vertices[2].t = t1;
-		vertices[3].s = s0; vertices[3].t = t0;
+	case 15:
+		switch (dxglcfg.HackAutoExpandViewportCompare)
+		{
+		case 0: // Match color
+			if (RGB555toRGB888(pixel) == dxglcfg.HackAutoExpandViewportValue & 0xFFFFFF) return TRUE;
+			else return FALSE;
+			break;
+		case 1: // Color less than or equal
+			return CompareRGB(RGB555toRGB888(pixel), FALSE);
+			break;
+		case 2: // Color greater than or equal
+			return CompareRGB(RGB555toRGB888(pixel), TRUE);
+			break;
+		case 3: // Palette/value equal
+		case 6: // Match 3 palette entries
+			if ((pixel & 0x7FFF) == (dxglcfg.HackAutoExpandViewportValue & 0x7FFF)) return TRUE;
+			else return FALSE;
+			break;
+		case 4: // Palette/value less than or equal
+			if ((pixel & 0x7FFF) <= (dxglcfg.HackAutoExpandViewportValue & 0x7FFF)) return TRUE;
+			else return FALSE;
+			break;
+		case 5: // Palette/value greater than or equal
+			if ((pixel & 0x7FFF) >= (dxglcfg.HackAutoExpandViewportValue & 0x7FFF)) return TRUE;
+			else return FALSE;
+			break;
+		default:
+			return FALSE;
+		}
+		break;
+	case 16:
+		switch (dxglcfg.HackAutoExpandViewportCompare)
+		{
+		case 0: // Match color
+			if (RGB565toRGB888(pixel) == dxglcfg.HackAutoExpandViewportValue & 0xFFFFFF) return TRUE;
+			else return FALSE;
+			break;
+		case 1: // Color less than or equal
+			return CompareRGB(RGB565toRGB888(pixel), FALSE);
+			break;
+		case 2: // Color greater than or equal
+			return CompareRGB(RGB565toRGB888(pixel), TRUE);
+			break;
+		case 3: // Palette/value equal
+		case 6: // Match 3 palette entries
+			if ((pixel & 0xFFFF) == (dxglcfg.HackAutoExpandViewportValue & 0xFFFF)) return TRUE;
+			else return FALSE;
+			break;
+		case 4: // Palette/value less than or equal
+			if ((pixel & 0xFFFF) <= (dxglcfg.HackAutoExpandViewportValue & 0xFFFF)) return TRUE;
+			else return FALSE;
+			break;
+		case 5: // Palette/value greater than or equal
+			if ((pixel & 0xFFFF) >= (dxglcfg.HackAutoExpandViewportValue & 0xFFFF)) return TRUE;
+			else return FALSE;
+			break;
+		default:
+			return FALSE;
+		}
 		break;
-	case 3:
-		s0 = vertices[0].s; t0 = vertices[0].t;
-		s1 = vertices[1].s; t1 = vertices[1].t;
-		s2 = vertices[2].s; t2 = vertices[2].t;
-		s3 = vertices[3].s; t3 = vertices[3].t;
-		vertices[0].s = s2; vertices[0].t = t2;
-		vertices[1].s = s0; vertices[1].t = t0;
-		vertices[2].s = s3; vertices[2].t = t3;
-		vertices[3].s = s1; vertices[3].t = t1;
+	case 24:
+	case 32:
+		switch (dxglcfg.HackAutoExpandViewportCompare)
+		{
+		case 0: // Match color
+			if (pixel == dxglcfg.HackAutoExpandViewportValue & 0xFFFFFF) return TRUE;
+			else return FALSE;
+			break;
+		case 1: // Color less than or equal
+			return CompareRGB(pixel, FALSE);
+			break;
+		case 2: // Color greater than or equal
+			return CompareRGB(pixel, TRUE);
+			break;
+		case 3: // Palette/value equal
+		case 6: // Match 3 palette entries
+			if ((pixel & 0xFFFFFF) == (dxglcfg.HackAutoExpandViewportValue & 0xFFFFFF)) return TRUE;
+			else return FALSE;
+			break;
+		case 4: // Palette/value less than or equal
+			if ((pixel & 0xFFFFFF) <= (dxglcfg.HackAutoExpandViewportValue & 0xFFFFFF)) return TRUE;
+			else return FALSE;
+			break;
+		case 5: // Palette/value greater than or equal
+			if ((pixel & 0xFFFFFF) >= (dxglcfg.HackAutoExpandViewportValue & 0xFFFFFF)) return TRUE;
+			else return FALSE;
+			break;
+		default:
+			return FALSE;
+		}
 		break;
+	default:
+		return FALSE;
 	}
 }
 
-void glRenderer__Blt(glRenderer *This, BltCommand *cmd, BOOL backend)
+/**
+  * Copies the finished border pixel readback into the renderer's cache.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param timeout
+  *  Time in nanoseconds to wait for the readback, 0 to only poll it
+  */
+static void glRenderer__CollectBorderPixel(glRenderer *This, GLuint64 timeout)
 {
-	static char buf[256];
-	snprintf(buf, sizeof(buf), "Blt [%d %d %dx%d] <- [%d %d %dx%d]", cmd->destrect.left, cmd->destrect.top, cmd->destrect.right - cmd->destrect.left, cmd->destrect.bottom - cmd->destrect.top,
-		cmd->srcrect.left, cmd->srcrect.top, cmd->srcrect.right - cmd->srcrect.left, cmd->srcrect.bottom - cmd->srcrect.top);
-	GLScopedDebugMarker scope(buf);
-
-	int rotates = 0;
-	BOOL usedest = FALSE;
-	BOOL usepattern = FALSE;
-	LONG sizes[6];
-	GLfloat xoffset, yoffset, xmul, ymul;
-	RECT srcrect;
-	RECT destrect, destrect2;
-	RECT wndrect;
-	glDirectDraw7_GetSizes(This->ddInterface, sizes);
-	unsigned __int64 shaderid;
-	DDSURFACEDESC2 ddsd;
-	ddsd = cmd->dest->levels[cmd->destlevel].ddsd;
-	if (!memcmp(&cmd->destrect, &nullrect, sizeof(RECT)))
+	GLenum status;
+	DWORD *pixel;
+	if (!This->borderfence) return;
+	do
 	{
-		destrect.left = 0;
-		destrect.top = 0;
-		destrect.right = ddsd.dwWidth;
-		destrect.bottom = ddsd.dwHeight;
-		destrect2 = destrect;
-	}
-	else
+		status = This->ext->glClientWaitSync(This->borderfence, GL_SYNC_FLUSH_COMMANDS_BIT, timeout);
+	} while (timeout && (status == GL_TIMEOUT_EXPIRED));
+	if ((status != GL_ALREADY_SIGNALED) && (status != GL_CONDITION_SATISFIED)) return;
+	This->ext->glDeleteSync(This->borderfence);
+	This->borderfence = NULL;
+	BufferObject_Bind(This->borderpbo, GL_PIXEL_PACK_BUFFER);
+	pixel = (DWORD*)BufferObject_Map(This->borderpbo, GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+	if (pixel)
 	{
-		destrect = cmd->destrect;
-		destrect2.left = 0;
-		destrect2.top = 0;
-		destrect2.right = destrect.right - destrect.left;
-		destrect2.bottom = destrect.bottom - destrect.top;
+		This->borderpixel = *pixel;
+		This->bordervalid = TRUE;
 	}
-	//MIPLEVEL& src = cmd->src->levels[cmd->srclevel];
-	// 	if (src.ddsd.ddsCaps.dwCaps & DDSCAPS_BACKBUFFER)
-	if (false)//This->util->currentfbo) // && This->util->currentfbo->fbz)
-	{
-		GLScopedDebugMarker scope("SSAO");
-		const auto vscode = R"(#version 460
-layout(location = 0) out vec2 texCoord;
-void main()
-{
-    vec2 position = vec2(gl_VertexID % 2, gl_VertexID / 2) * 4.0 - 1;
-    texCoord = (position + 1) * 0.5;
-	// flip horizontally
-	//texCoord = vec2(texCoord.x, 1 - texCoord.y);
-    gl_Position = vec4(position, 0, 1);
-}
-)";
-		const auto fscode = R"(#version 460
-layout(location = 0) in vec2 texCoord;
-layout(location = 0) uniform sampler2D depthTex;
-layout(location = 0) out vec4 outColor;
-void main()
-{
-	const float near = 0.1;
-	const float far = 100;
-	// z' = (Q*z - Q*near) / z
-	// z' = Q - Q*near / z
-	// z' = Q (1 - near / z)
-	// z	= Q*near / (Q - z')
-	// z	= near / (1 - z' / Q)
-	const float Q = far / (far - near);
-	float z_b = texture(depthTex, texCoord).x;
-    //outColor = vec4(vec3(z_b), 1); return;
-
-	//float z_n = 2.0 * z_b - 1.0;
-	//float z_e = 2.0 * zNear * zFar / (zFar + zNear - z_n * (zFar - zNear));
-	float z	= Q * near / (Q - z_b);
-	z = 1/(1-z_b)/100; // should be equal to next, but isn't
-	//z = 1 / (1 - z_b / Q);
-	outColor = vec4(z,z,z,1); return;
-	//z = z_b;
-}
-)";
-		GLSLShader vs(GL_VERTEX_SHADER, "ssao vs", vscode);
-		GLSLShader fs(GL_FRAGMENT_SHADER, "ssao fs", fscode);
-		GLSLProgram prog("ssao", {&vs, &fs});
-		//glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, This->util->currentfbo->fbz->id);
-		//glUniform1i(0, 0); // texture unit
-		//glDepthMask(GL_FALSE);
-		glDisable(GL_DEPTH_TEST);
-		glDrawArrays(GL_TRIANGLES, 0, 3);
-		glUseProgram(This->shaders->gen3d->current_prog);
+	BufferObject_Unmap(This->borderpbo, GL_PIXEL_PACK_BUFFER);
+	BufferObject_Unbind(This->borderpbo, GL_PIXEL_PACK_BUFFER);
+}
+
+/**
+  * Gets the first four bytes of the primary surface for the viewport
+  * expansion hack.  If the GPU holds newer contents than the surface buffer,
+  * only those bytes are read back, and the result is used one frame later
+  * instead of downloading and waiting for the whole surface.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param primary
+  *  Primary surface texture
+  * @return
+  *  First four bytes of the primary surface
+  */
+static DWORD glRenderer__GetBorderPixel(glRenderer *This, glTexture *primary)
+{
+	MIPLEVEL *mip = &primary->levels[0];
+	GLint packalign;
+	GLsizei count;
+	if (!(mip->dirty & 2) && mip->buffer)
+	{
+		This->bordertexture = primary;
+		This->borderpixel = *(DWORD*)mip->buffer;
+		This->bordervalid = TRUE;
+		return This->borderpixel;
 	}
-	if ((cmd->bltfx.dwSize == sizeof(DDBLTFX)) && (cmd->flags & DDBLT_ROP))
+	if (primary->useconv || !This->ext->GLEXT_ARB_framebuffer_object || !This->ext->GLEXT_ARB_sync)
 	{
-		shaderid = PackROPBits(cmd->bltfx.dwROP, cmd->flags);
-		if (rop_texture_usage[(cmd->bltfx.dwROP >> 16) & 0xFF] & 2) usedest = TRUE;
-		if (rop_texture_usage[(cmd->bltfx.dwROP >> 16) & 0xFF] & 4) usepattern = TRUE;
+		glTexture__Download(primary, 0);
+		return *(DWORD*)mip->buffer;
 	}
-	else shaderid = cmd->flags & 0xF2FAADFF;
-	if (cmd->src) shaderid |= ((long long)cmd->src->blttype << 32);
-	if (!(cmd->flags & 0x80000000) && cmd->dest)
-		shaderid |= ((long long)cmd->dest->blttype << 40);
-	if (cmd->flags & DDBLT_KEYDEST) usedest = TRUE;
-	if (IsAlphaCKey())
+	if (This->bordertexture != primary)
 	{
-
+		if (This->borderfence) This->ext->glDeleteSync(This->borderfence);
+		This->borderfence = NULL;
+		This->bordertexture = primary;
+		This->bordervalid = FALSE;
 	}
-	else if (usedest)
+	glRenderer__CollectBorderPixel(This, 0);
+	if (!This->borderfence)
 	{
-		if (cmd->flags & 0x80000000)
+		if (!This->borderpbo)
 		{
-			This->bltvertices[1].dests = This->bltvertices[3].dests = (GLfloat)(destrect.left) / (GLfloat)cmd->dest->levels[0].ddsd.dwWidth;
-			This->bltvertices[0].dests = This->bltvertices[2].dests = (GLfloat)(destrect.right) / (GLfloat)cmd->dest->levels[0].ddsd.dwWidth;
-			This->bltvertices[0].destt = This->bltvertices[1].destt = (GLfloat)(destrect.top) / (GLfloat)cmd->dest->levels[0].ddsd.dwHeight;
-			This->bltvertices[2].destt = This->bltvertices[3].destt = (GLfloat)(destrect.bottom) / (GLfloat)cmd->dest->levels[0].ddsd.dwHeight;
+			BufferObject_Create(&This->borderpbo, This->ext, This->util);
+			BufferObject_SetData(This->borderpbo, GL_PIXEL_PACK_BUFFER, 8, NULL, GL_STREAM_READ);
 		}
-		else
+		if (glUtil_SetFBOSurface(This->util, primary, NULL, 0, 0, TRUE) == GL_FRAMEBUFFER_COMPLETE)
 		{
-			ShaderManager_SetShader(This->shaders, PROG_TEXTURE, NULL, 0);
-			glRenderer__DrawBackbufferRect(This, cmd->dest, destrect, destrect2, PROG_TEXTURE, 0);
-			This->bltvertices[1].dests = This->bltvertices[3].dests = 0.0f;
-			This->bltvertices[0].dests = This->bltvertices[2].dests = (GLfloat)(destrect.right - destrect.left) / (GLfloat)This->backbuffers[0].levels[0].ddsd.dwWidth;
-			This->bltvertices[0].destt = This->bltvertices[1].destt = 1.0f;
-			This->bltvertices[2].destt = This->bltvertices[3].destt = 1.0f - ((GLfloat)(destrect.bottom - destrect.top) / (GLfloat)This->backbuffers[0].levels[0].ddsd.dwHeight);
+			// Enough pixels to cover four bytes
+			count = (mip->ddsd.ddpfPixelFormat.dwRGBBitCount + 31) / mip->ddsd.ddpfPixelFormat.dwRGBBitCount;
+			if (count > 4) count = 4;
+			BufferObject_Bind(This->borderpbo, GL_PIXEL_PACK_BUFFER);
+			glGetIntegerv(GL_PACK_ALIGNMENT, &packalign);
+			glPixelStorei(GL_PACK_ALIGNMENT, 1);
+			glReadPixels(0, 0, count, 1, primary->format, primary->type, 0);
+			glPixelStorei(GL_PACK_ALIGNMENT, packalign);
+			BufferObject_Unbind(This->borderpbo, GL_PIXEL_PACK_BUFFER);
+			This->borderfence = This->ext->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
 		}
-	}
-	ShaderManager_SetShader(This->shaders, shaderid, NULL, 1);
-	GenShader2D *shader = (GenShader2D*)This->shaders->gen3d->current_genshader;
-	glUtil_BlendEnable(This->util, FALSE);
-	if (cmd->flags & 0x80000000)
-	{
 		glUtil_SetFBO(This->util, NULL);
-		glUtil_SetViewport(This->util, 0, 0, sizes[4], sizes[5]);
-	}
-	else
-	{
-		do
-		{
-			if (glUtil_SetFBOSurface(This->util, cmd->dest, NULL, cmd->destlevel, 0, TRUE) == GL_FRAMEBUFFER_COMPLETE) break;
-			if (!cmd->dest->internalformats[1]) break;
-			glTexture__Repair(cmd->dest, TRUE);
-			glUtil_SetFBO(This->util, NULL);
-			cmd->dest->levels[cmd->destlevel].fbo.fbcolor = NULL;
-			cmd->dest->levels[cmd->destlevel].fbo.fbz = NULL;
-		} while (1);
-		glUtil_SetViewport(This->util, 0, 0, cmd->dest->levels[cmd->destlevel].ddsd.dwWidth,
-			cmd->dest->levels[cmd->destlevel].ddsd.dwHeight);
 	}
-	glUtil_DepthTest(This->util, FALSE);
-	DDSURFACEDESC2 ddsdSrc;
-	ZeroMemory(&ddsdSrc, sizeof(DDSURFACEDESC2));
-	ddsdSrc.dwSize = sizeof(DDSURFACEDESC2);
-	if (cmd->src)
+	// Nothing cached for this primary yet
+	if (!This->bordervalid) glRenderer__CollectBorderPixel(This, 1000000);
+	if (!This->bordervalid)
 	{
-		ddsdSrc = cmd->src->levels[cmd->srclevel].ddsd;
-		if (cmd->src->levels[cmd->srclevel].dirty & 1) glTexture__Upload(cmd->src, cmd->srclevel);
+		glTexture__Download(primary, 0);
+		return *(DWORD*)mip->buffer;
 	}
-	if (cmd->dest->levels[cmd->destlevel].dirty & 1)
-		glTexture__Upload(cmd->dest, cmd->destlevel);
-	if (!memcmp(&cmd->srcrect, &nullrect, sizeof(RECT)))
+	return This->borderpixel;
+}
+
+BOOL Is512448Scale(glRenderer *This, glTexture *primary, glTexture *palette)
+{
+	DWORD pixel;
+	if (!dxglpolicy.autoexpand) return FALSE;
+	if (!(((primary->levels[0].ddsd.dwWidth == 640) && (primary->levels[0].ddsd.dwHeight == 480)) ||
+		((primary->levels[0].ddsd.dwWidth == 320) && (primary->levels[0].ddsd.dwHeight == 240))))
+		return FALSE;
+	pixel = glRenderer__GetBorderPixel(This, primary);
+	if (primary->levels[0].ddsd.ddpfPixelFormat.dwRGBBitCount == 8)
+		return BorderColorCompare(This, pixel, (DWORD*)palette->levels[0].buffer, 8);
+	else if (primary->levels[0].ddsd.ddpfPixelFormat.dwRGBBitCount == 16)
 	{
-		srcrect.left = 0;
-		srcrect.top = 0;
-		srcrect.right = ddsdSrc.dwWidth;
-		srcrect.bottom = ddsdSrc.dwHeight;
+		if (primary->levels[0].ddsd.ddpfPixelFormat.dwRBitMask == 0x7FFF)
+			return BorderColorCompare(This, pixel, NULL, 15);
+		else return BorderColorCompare(This, pixel, NULL, 16);
 	}
-	else srcrect = cmd->srcrect;
-	if (cmd->flags & 0x80000000)
+	else return BorderColorCompare(This, pixel, NULL, 24);
+}
+
+static BOOL(WINAPI *__UpdateLayeredWindow)(HWND hWnd, HDC hdcDst, POINT *pptDst, SIZE *psize,
+	HDC hdcSrc, POINT *pptSrc, COLORREF crKey, BLENDFUNCTION *pblend, DWORD dwFlags) = NULL;
+static BOOL UpdateLayeredWindowFail = FALSE;
+static BOOL WINAPI _UpdateLayeredWindow(HWND hWnd, HDC hdcDst, POINT *pptDst, SIZE *psize,
+	HDC hdcSrc, POINT *pptSrc, COLORREF crKey, BLENDFUNCTION *pblend, DWORD dwFlags)
+{
+	HANDLE hUser32;
+	if (!__UpdateLayeredWindow)
 	{
-		if (glDirectDraw7_GetFullscreen(This->ddInterface))
+		if (UpdateLayeredWindowFail) return FALSE;
+		hUser32 = GetModuleHandle(_T("user32.dll"));
+		if (!hUser32)
 		{
-			xmul = (GLfloat)sizes[0] / (GLfloat)sizes[2];
-			ymul = (GLfloat)sizes[1] / (GLfloat)sizes[3];
-			xoffset = ((GLfloat)sizes[4] - (GLfloat)sizes[0]) / 2.0f;
-			yoffset = ((GLfloat)sizes[5] - (GLfloat)sizes[1]) / 2.0f;
-			This->bltvertices[1].x = This->bltvertices[3].x = ((GLfloat)destrect.left * xmul) + xoffset;
-			This->bltvertices[0].x = This->bltvertices[2].x = ((GLfloat)destrect.right * xmul) + xoffset;
-			This->bltvertices[0].y = This->bltvertices[1].y = ((GLfloat)destrect.top * ymul) + yoffset;
-			This->bltvertices[2].y = This->bltvertices[3].y = ((GLfloat)destrect.bottom * ymul) + yoffset;
+			UpdateLayeredWindowFail = TRUE;
+			return FALSE;
 		}
-		else
+		__UpdateLayeredWindow = (BOOL(WINAPI*)(HWND,HDC,POINT*,SIZE*,HDC,POINT*,COLORREF,BLENDFUNCTION*,DWORD))
+			GetProcAddress((HMODULE)hUser32, "UpdateLayeredWindow");
+		if (!__UpdateLayeredWindow)
 		{
-			xmul = ((GLfloat)sizes[0] / (GLfloat)sizes[2]) * dxglcfg.WindowScaleX;
-			ymul = (GLfloat)sizes[1] / (GLfloat)sizes[3] * dxglcfg.WindowScaleY;
-			_GetClientRect(This->hWnd, &wndrect);
-			ClientToScreen(This->hWnd, (LPPOINT)&wndrect.left);
-			ClientToScreen(This->hWnd, (LPPOINT)&wndrect.right);
-			xoffset = (GLfloat)wndrect.left * dxglcfg.WindowScaleX;
-			yoffset = ((GLfloat)sizes[1] - wndrect.bottom) * dxglcfg.WindowScaleY;
-			This->bltvertices[1].x = This->bltvertices[3].x = ((GLfloat)destrect.left * xmul) - xoffset;
-			This->bltvertices[0].x = This->bltvertices[2].x = ((GLfloat)destrect.right * xmul) - xoffset;
-			This->bltvertices[0].y = This->bltvertices[1].y = ((GLfloat)destrect.top * ymul) + yoffset;
-			This->bltvertices[2].y = This->bltvertices[3].y = ((GLfloat)destrect.bottom * ymul) + yoffset;
+			UpdateLayeredWindowFail = TRUE;
+			return NULL;
 		}
 	}
-	else
-	{
-		This->bltvertices[1].x = This->bltvertices[3].x = (GLfloat)destrect.left;
-		This->bltvertices[0].x = This->bltvertices[2].x = (GLfloat)destrect.right;
-		This->bltvertices[0].y = This->bltvertices[1].y = (GLfloat)ddsd.dwHeight - (GLfloat)destrect.top;
-		This->bltvertices[2].y = This->bltvertices[3].y = (GLfloat)ddsd.dwHeight - (GLfloat)destrect.bottom;
-	}
-	if (cmd->src && (cmd->src->target == GL_TEXTURE_RECTANGLE))
+	return __UpdateLayeredWindow(hWnd, hdcDst, pptDst, psize, hdcSrc, pptSrc, crKey, pblend, dwFlags);
+}
+
+/**
+  * Copies the primary surface to the window back buffer with one
+  * framebuffer blit, if no palette, gamma, format conversion or post
+  * process shader is needed to show it.  Fullscreen, the surface is
+  * stretched to the display area and the borders around it are cleared;
+  * windowed, the part of the surface under the window is copied.  The
+  * scaling filter is applied by the blit.  The blit replaces the shader
+  * setup and full screen draw of glRenderer__DrawScreen.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param texture
+  *  Primary surface texture to display
+  * @param sizes
+  *  Display sizes from glDirectDraw7_GetSizes, used if fullscreen
+  * @param viewport
+  *  Size of the window back buffer in elements 2 and 3
+  * @param viewrect
+  *  Part of the surface shown in the window, used if windowed
+  * @param scale512448
+  *  TRUE if the 512x448 viewport expansion hack is active
+  * @return
+  *  FALSE if the surface has to be drawn with a shader
+  */
+static BOOL glRenderer__PresentDirect(glRenderer *This, glTexture *texture, const LONG *sizes,
+	const GLint *viewport, const RECT *viewrect, BOOL scale512448)
+{
+	GLint width = texture->levels[0].ddsd.dwWidth;
+	GLint height = texture->levels[0].ddsd.dwHeight;
+	RECT src, dest;
+	FBO *screen;
+	if (!(texture->levels[0].ddsd.ddsCaps.dwCaps & DDSCAPS_PRIMARYSURFACE)) return FALSE;
+	if (!This->ext->GLEXT_ARB_framebuffer_object || !This->ext->glBlitFramebuffer) return FALSE;
+	if ((This->ddInterface->primarybpp == 8) || scale512448) return FALSE;
+	if (This->gammaenabled || dxglcfg.DebugView) return FALSE;
+	if (texture->useconv || texture->blttype) return FALSE;
+	if ((This->postsizex != 1.0f) || (This->postsizey != 1.0f)) return FALSE;
+	if (glDirectDraw7_GetFullscreen(This->ddInterface))
 	{
-		This->bltvertices[1].s = This->bltvertices[3].s = (GLfloat)srcrect.left;
-		This->bltvertices[0].s = This->bltvertices[2].s = (GLfloat)srcrect.right;
-		This->bltvertices[0].t = This->bltvertices[1].t = (GLfloat)srcrect.top;
-		This->bltvertices[2].t = This->bltvertices[3].t = (GLfloat)srcrect.bottom;
+		SetRect(&src, 0, 0, width, height);
+		dest.left = (sizes[4] - sizes[0]) / 2;
+		dest.top = (sizes[5] - sizes[1]) / 2;
+		dest.right = dest.left + sizes[0];
+		dest.bottom = dest.top + sizes[1];
 	}
 	else
 	{
-		This->bltvertices[1].s = This->bltvertices[3].s = (GLfloat)srcrect.left / (GLfloat)ddsdSrc.dwWidth;
-		This->bltvertices[0].s = This->bltvertices[2].s = (GLfloat)srcrect.right / (GLfloat)ddsdSrc.dwWidth;
-		This->bltvertices[0].t = This->bltvertices[1].t = (GLfloat)srcrect.top / (GLfloat)ddsdSrc.dwHeight;
-		This->bltvertices[2].t = This->bltvertices[3].t = (GLfloat)srcrect.bottom / (GLfloat)ddsdSrc.dwHeight;
-	}
-	if ((cmd->bltfx.dwSize == sizeof(DDBLTFX)) && (cmd->flags & DDBLT_DDFX))
-	{
-		if (cmd->bltfx.dwDDFX & DDBLTFX_MIRRORLEFTRIGHT)
-			BltFlipLR(This->bltvertices);
-		if (cmd->bltfx.dwDDFX & DDBLTFX_MIRRORUPDOWN)
-			BltFlipUD(This->bltvertices);
-		if (cmd->bltfx.dwDDFX & DDBLTFX_ROTATE90) rotates++;
-		if (cmd->bltfx.dwDDFX & DDBLTFX_ROTATE180) rotates += 2;
-		if (cmd->bltfx.dwDDFX & DDBLTFX_ROTATE270) rotates += 3;
-		rotates &= 3;
-		if (rotates)
-		{
-			RotateBlt90(This->bltvertices, rotates);
-		}
-	}
-	if (cmd->flags & 0x10000000)
-	{
-		This->bltvertices[1].stencils = This->bltvertices[3].stencils = This->bltvertices[1].x / (GLfloat)cmd->dest->levels[cmd->destlevel].ddsd.dwWidth;
-		This->bltvertices[0].stencils = This->bltvertices[2].stencils = This->bltvertices[0].x / (GLfloat)cmd->dest->levels[cmd->destlevel].ddsd.dwWidth;
-		This->bltvertices[0].stencilt = This->bltvertices[1].stencilt = This->bltvertices[0].y / (GLfloat)cmd->dest->levels[cmd->destlevel].ddsd.dwHeight;
-		This->bltvertices[2].stencilt = This->bltvertices[3].stencilt = This->bltvertices[2].y / (GLfloat)cmd->dest->levels[cmd->destlevel].ddsd.dwHeight;
-	}
-	if (cmd->dest->levels[cmd->destlevel].fbo.fbz) glClear(GL_DEPTH_BUFFER_BIT);
-	if (cmd->flags & DDBLT_COLORFILL) SetColorFillUniform(cmd->bltfx.dwFillColor, cmd->dest->colorsizes,
-		cmd->dest->colororder, cmd->dest->colorbits, shader->shader.uniforms[12], This->ext);
-	if ((cmd->flags & DDBLT_KEYSRC) && (cmd->src && ((cmd->src->levels[cmd->srclevel].ddsd.dwFlags & DDSD_CKSRCBLT))
-		|| (cmd->flags & DDBLT_KEYSRCOVERRIDE)) && !(cmd->flags & DDBLT_COLORFILL))
-	{
-		if (cmd->flags & DDBLT_KEYSRCOVERRIDE)
-		{
-			SetColorKeyUniform(cmd->bltfx.ddckSrcColorkey.dwColorSpaceLowValue, cmd->src->colorsizes,
-				cmd->src->colororder, shader->shader.uniforms[5], cmd->src->colorbits, This->ext);
-			if (cmd->flags & 0x20000000) SetColorKeyUniform(cmd->bltfx.ddckSrcColorkey.dwColorSpaceHighValue, cmd->src->colorsizes,
-				cmd->src->colororder, shader->shader.uniforms[7], cmd->src->colorbits, This->ext);
-		}
-		else
-		{
-			SetColorKeyUniform(cmd->src->levels[cmd->srclevel].ddsd.ddckCKSrcBlt.dwColorSpaceLowValue, cmd->src->colorsizes,
-				cmd->src->colororder, shader->shader.uniforms[5], cmd->src->colorbits, This->ext);
-			if (cmd->flags & 0x20000000) SetColorKeyUniform(cmd->src->levels[cmd->srclevel].ddsd.ddckCKSrcBlt.dwColorSpaceHighValue, cmd->src->colorsizes,
-				cmd->src->colororder, shader->shader.uniforms[7], cmd->src->colorbits, This->ext);
-		}
-	}
-	if (!(cmd->flags & DDBLT_COLORFILL)) This->ext->glUniform1i(shader->shader.uniforms[1], 8);
-	if (cmd->flags & 0x80000000)
-	{
-		if ((cmd->flags & DDBLT_KEYDEST) && (This && ((cmd->dest->levels[cmd->destlevel].ddsd.dwFlags & DDSD_CKDESTOVERLAY)
-			|| (cmd->flags & DDBLT_KEYDESTOVERRIDE))))
-		{
-			if (cmd->flags & DDBLT_KEYDESTOVERRIDE)
-			{
-				SetColorKeyUniform(cmd->bltfx.ddckDestColorkey.dwColorSpaceLowValue, cmd->dest->colorsizes,
-					cmd->dest->colororder, shader->shader.uniforms[6], cmd->dest->colorbits, This->ext);
-				if (cmd->flags & 0x40000000) SetColorKeyUniform(cmd->bltfx.ddckDestColorkey.dwColorSpaceHighValue, cmd->dest->colorsizes,
-					cmd->dest->colororder, shader->shader.uniforms[8], cmd->dest->colorbits, This->ext);
-			}
-			else
-			{
-				SetColorKeyUniform(cmd->dest->levels[cmd->destlevel].ddsd.ddckCKDestOverlay.dwColorSpaceLowValue, cmd->dest->colorsizes,
-					cmd->dest->colororder, shader->shader.uniforms[6], cmd->dest->colorbits, This->ext);
-				if (cmd->flags & 0x40000000) SetColorKeyUniform(cmd->dest->levels[cmd->destlevel].ddsd.ddckCKDestOverlay.dwColorSpaceHighValue, cmd->dest->colorsizes,
-					cmd->dest->colororder, shader->shader.uniforms[8], cmd->dest->colorbits, This->ext);
-			}
-		}
+		// Parts of the window beyond the surface are drawn with its edge texels
+		if ((viewrect->left < 0) || (viewrect->top < 0) || (viewrect->right > width) || (viewrect->bottom > height))
+			return FALSE;
+		src = *viewrect;
+		SetRect(&dest, 0, 0, viewport[2], viewport[3]);
 	}
-	else if ((cmd->flags & DDBLT_KEYDEST) && (This && ((cmd->dest->levels[cmd->destlevel].ddsd.dwFlags & DDSD_CKDESTBLT)
-		|| (cmd->flags & DDBLT_KEYDESTOVERRIDE))))
+	if ((src.right <= src.left) || (src.bottom <= src.top)) return FALSE;
+	if (glUtil_SetFBOSurface(This->util, texture, NULL, 0, 0, TRUE) != GL_FRAMEBUFFER_COMPLETE) return FALSE;
+	screen = glRenderer__SetScreenFBO(This);
+	glUtil_SetScissor(This->util, FALSE, 0, 0, 0, 0);
+	if ((dest.left > 0) || (dest.top > 0)) glClear(GL_COLOR_BUFFER_BIT);
+	This->ext->glBindFramebuffer(GL_READ_FRAMEBUFFER, texture->levels[0].fbo.fbo);
+	// The first surface row is shown at the top of the window
+	This->ext->glBlitFramebuffer(src.left, src.top, src.right, src.bottom, dest.left, dest.bottom, dest.right, dest.top,
+		GL_COLOR_BUFFER_BIT, (dxglcfg.scalingfilter && (((src.right - src.left) != (dest.right - dest.left)) ||
+		((src.bottom - src.top) != (dest.bottom - dest.top)))) ? GL_LINEAR : GL_NEAREST);
+	This->ext->glBindFramebuffer(GL_READ_FRAMEBUFFER, screen ? screen->fbo : 0);
+	return TRUE;
+}
+
+/**
+  * Fences the frame that was just swapped and waits until the GPU has
+  * finished the frame MaxFramesInFlight frames before it, so the driver
+  * cannot queue more frames than configured.
+  * @param This
+  *  Pointer to glRenderer object
+  */
+static void glRenderer__LimitFramesInFlight(glRenderer *This)
+{
+	DWORD frames = min(dxglcfg.MaxFramesInFlight, FRAMEPACING_MAXFRAMES);
+	GLsync *fence;
+	if (!frames || !This->ext->GLEXT_ARB_sync) return;
+	if (This->framefence >= frames) This->framefence = 0;
+	fence = &This->framefences[This->framefence];
+	if (*fence)
 	{
-		if (cmd->flags & DDBLT_KEYDESTOVERRIDE)
-		{
-			SetColorKeyUniform(cmd->bltfx.ddckDestColorkey.dwColorSpaceLowValue, cmd->dest->colorsizes,
-				cmd->dest->colororder, shader->shader.uniforms[6], cmd->dest->colorbits, This->ext);
-			if (cmd->flags & 0x40000000) SetColorKeyUniform(cmd->bltfx.ddckDestColorkey.dwColorSpaceHighValue, cmd->dest->colorsizes,
-				cmd->dest->colororder, shader->shader.uniforms[8], cmd->dest->colorbits, This->ext);
-		}
-		else
-		{
-			SetColorKeyUniform(cmd->dest->levels[cmd->destlevel].ddsd.ddckCKDestBlt.dwColorSpaceLowValue, cmd->dest->colorsizes,
-				cmd->dest->colororder, shader->shader.uniforms[6], cmd->dest->colorbits, This->ext);
-			if (cmd->flags & 0x40000000) SetColorKeyUniform(cmd->dest->levels[cmd->destlevel].ddsd.ddckCKDestBlt.dwColorSpaceHighValue, cmd->dest->colorsizes,
-				cmd->dest->colororder, shader->shader.uniforms[8], cmd->dest->colorbits, This->ext);
-		}
+		while (This->ext->glClientWaitSync(*fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED);
+		This->ext->glDeleteSync(*fence);
 	}
-	if (usedest && (shader->shader.uniforms[2] != -1))
+	*fence = This->ext->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	This->framefence++;
+}
+
+/**
+  * Copies the oldest frame read back for a layered window into the DIB
+  * section and updates the window with it.
+  * @param This
+  *  Pointer to glRenderer object
+  */
+static void glRenderer__ShowLayeredFrame(glRenderer *This)
+{
+	int index = This->pbopending;
+	GLubyte *pixels;
+	GLint width, height;
+	if (index < 0) return;
+	This->pbopending = -1;
+	if (This->pbofences[index])
 	{
-		if(cmd->flags & 0x80000000)	glUtil_SetTexture(This->util, 9, cmd->dest);
-		else glUtil_SetTexture(This->util, 9, &This->backbuffers[0]);
-		This->ext->glUniform1i(shader->shader.uniforms[2], 9);
+		while (This->ext->glClientWaitSync(This->pbofences[index], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000)
+			== GL_TIMEOUT_EXPIRED);
+		This->ext->glDeleteSync(This->pbofences[index]);
+		This->pbofences[index] = NULL;
 	}
-	if (usepattern && (shader->shader.uniforms[3] != -1))
+	width = min(This->pbowidth[index], This->dib.width);
+	height = min(This->pboheight[index], This->dib.height);
+	BufferObject_Bind(This->pbo[index], GL_PIXEL_PACK_BUFFER);
+	pixels = (GLubyte*)BufferObject_Map(This->pbo[index], GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+	if (pixels)
 	{
-		if (cmd->pattern->levels[cmd->patternlevel].dirty & 1) glTexture__Upload(cmd->pattern, cmd->patternlevel);
-		glUtil_SetTexture(This->util, 10, cmd->pattern);
-		This->ext->glUniform1i(shader->shader.uniforms[3], 10);
-		This->ext->glUniform2i(shader->shader.uniforms[9],
-			cmd->pattern->levels[cmd->patternlevel].ddsd.dwWidth, cmd->pattern->levels[cmd->patternlevel].ddsd.dwHeight);
+		// The frame goes straight to the window, so it should not take up the cache
+		if (This->pboflipped[index] && (This->pbowidth[index] * 4 == This->dib.pitch))
+			ColorConv_StreamCopy(This->dib.pixels, pixels, This->dib.pitch * height);
+		else if (This->pboflipped[index]) ColorConv_StreamCopyRows(This->dib.pixels, This->dib.pitch,
+			pixels, This->pbowidth[index] * 4, width * 4, height);
+		else ColorConv_StreamCopyRows(This->dib.pixels, This->dib.pitch,
+			&pixels[(This->pboheight[index] - 1) * This->pbowidth[index] * 4],
+			-(ptrdiff_t)(This->pbowidth[index] * 4), width * 4, height);
 	}
-	if (cmd->flags & 0x10000000)  // Use clipper
+	BufferObject_Unmap(This->pbo[index], GL_PIXEL_PACK_BUFFER);
+	BufferObject_Unbind(This->pbo[index], GL_PIXEL_PACK_BUFFER);
+	HDC hRenderDC = (HDC)::GetDC(This->RenderWnd->hWnd);
+	HGDIOBJ hPrevObj = 0;
+	POINT dest = {0,0};
+	POINT srcpoint = {0,0};
+	SIZE wnd = {This->dib.width,This->dib.height};
+	BLENDFUNCTION func = {AC_SRC_OVER,0,255,AC_SRC_ALPHA};
+	hPrevObj = SelectObject(This->dib.hdc,This->dib.hbitmap);
+	ClientToScreen(This->RenderWnd->hWnd,&dest);
+	_UpdateLayeredWindow(This->RenderWnd->hWnd,hRenderDC,&dest,&wnd,
+		This->dib.hdc,&srcpoint,0,&func,ULW_ALPHA);
+	SelectObject(This->dib.hdc,hPrevObj);
+	ReleaseDC(This->RenderWnd->hWnd,hRenderDC);
+}
+
+/**
+  * Starts reading back the frame drawn for a layered window without
+  * waiting for it.  The rows are flipped top down on the GPU so the
+  * DIB section can be filled with one copy.  The previous frame is shown
+  * once this readback is queued, so reading one frame overlaps drawing
+  * the next; an idle renderer shows the last frame without waiting for
+  * another one.
+  * @param This
+  *  Pointer to glRenderer object
+  */
+static void glRenderer__ReadLayeredFrame(glRenderer *This)
+{
+	LONG sizes[6];
+	DDSURFACEDESC2 ddsd;
+	GLint packalign;
+	int index = This->pboframe;
+	glDirectDraw7_GetSizes(This->ddInterface, sizes);
+	This->pboframe = (index + 1) % DIB_READBACK_BUFFERS;
+	if (!This->pbo[index]) BufferObject_Create(&This->pbo[index], This->ext, This->util);
+	if (!This->pbo[index]) return;
+	if ((This->pbowidth[index] != sizes[4]) || (This->pboheight[index] != sizes[5]))
 	{
-		glUtil_SetTexture(This->util, 11, cmd->dest->stencil);
-		This->ext->glUniform1i(shader->shader.uniforms[4],11);
-		glUtil_EnableArray(This->util, shader->shader.attribs[5], TRUE);
-		This->ext->glVertexAttribPointer(shader->shader.attribs[5], 2, GL_FLOAT, GL_FALSE, sizeof(BltVertex), &This->bltvertices[0].stencils);
+		BufferObject_SetData(This->pbo[index], GL_PIXEL_PACK_BUFFER, sizes[4] * sizes[5] * 4, NULL, GL_STREAM_READ);
+		This->pbowidth[index] = sizes[4];
+		This->pboheight[index] = sizes[5];
 	}
-	switch ((shaderid >> 32) & 0xFF)
+	This->pboflipped[index] = FALSE;
+	glReadBuffer(GL_FRONT);
+	if (This->ext->GLEXT_ARB_framebuffer_object && This->ext->glBlitFramebuffer)
 	{
-	case 0x10:
-	case 0x11:
-	case 0x12:
-	case 0x13: // Use palette
-		if (cmd->src->palette)
+		if (!This->dibflip.initialized)
 		{
-			if (cmd->src->palette->levels[0].dirty & 1) glTexture__Upload(cmd->src->palette, 0);
-			glUtil_SetTexture(This->util, 12, cmd->src->palette);
-			This->ext->glUniform1i(shader->shader.uniforms[13], 12);
+			ZeroMemory(&ddsd, sizeof(DDSURFACEDESC2));
+			memcpy(&ddsd, &ddsdbackbuffer, sizeof(DDSURFACEDESC2));
+			ddsd.dwWidth = sizes[4];
+			ddsd.lPitch = sizes[4] * 4;
+			ddsd.dwHeight = sizes[5];
+			glTexture_Create(&ddsd, &This->dibflip, This, TRUE, 0);
+			This->dibflip.freeonrelease = FALSE;
+			glUtil_InitFBO(This->util, &This->dibflip.levels[0].fbo);
 		}
-		break;
-	default:
-		break;
-	}
-	if (cmd->src)
-	{
-		glUtil_SetTexture(This->util, 8, cmd->src);
-		if(This->ext->GLEXT_ARB_sampler_objects)
+		else if ((This->dibflip.levels[0].ddsd.dwWidth != sizes[4]) || (This->dibflip.levels[0].ddsd.dwHeight != sizes[5]))
 		{
-			if((dxglcfg.BltScale == 0) || (This->ddInterface->primarybpp == 8))
-				glTexture__SetFilter(cmd->src, 8, GL_NEAREST, GL_NEAREST, This);
-			else glTexture__SetFilter(cmd->src, 8, GL_LINEAR, GL_LINEAR, This);
+			ZeroMemory(&ddsd, sizeof(DDSURFACEDESC2));
+			ddsd.dwSize = sizeof(DDSURFACEDESC2);
+			ddsd.dwWidth = sizes[4];
+			ddsd.dwHeight = sizes[5];
+			ddsd.dwFlags = DDSD_WIDTH | DDSD_HEIGHT;
+			glTexture__SetSurfaceDesc(&This->dibflip, &ddsd);
 		}
+		if (glUtil_SetFBOSurface(This->util, &This->dibflip, NULL, 0, 0, TRUE) == GL_FRAMEBUFFER_COMPLETE)
+		{
+			glUtil_SetScissor(This->util, FALSE, 0, 0, 0, 0);
+			This->ext->glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+			This->ext->glBlitFramebuffer(0, 0, sizes[4], sizes[5], 0, sizes[5], sizes[4], 0,
+				GL_COLOR_BUFFER_BIT, GL_NEAREST);
+			This->ext->glBindFramebuffer(GL_READ_FRAMEBUFFER, This->dibflip.levels[0].fbo.fbo);
+			This->pboflipped[index] = TRUE;
+		}
+		else glUtil_SetFBO(This->util, NULL);
 	}
-	else glUtil_SetTexture(This->util,8,NULL);
-	if (cmd->flags & 0x80000000) This->ext->glUniform4f(shader->shader.uniforms[0], 0,
-		(GLfloat)sizes[4], 0, (GLfloat)sizes[5]);
-	else This->ext->glUniform4f(shader->shader.uniforms[0], 0,
-		(GLfloat)cmd->dest->levels[cmd->destlevel].ddsd.dwWidth, 0, (GLfloat)cmd->dest->levels[cmd->destlevel].ddsd.dwHeight);
-	if (cmd->src) This->ext->glUniform4i(shader->shader.uniforms[10], cmd->src->colorsizes[0], cmd->src->colorsizes[1],
-		cmd->src->colorsizes[2], cmd->src->colorsizes[3]);
-	if (cmd->dest) This->ext->glUniform4i(shader->shader.uniforms[11], cmd->dest->colorsizes[0], cmd->dest->colorsizes[1],
-		cmd->dest->colorsizes[2], cmd->dest->colorsizes[3]);
-	cmd->dest->levels[cmd->destlevel].dirty |= 2;
-	glUtil_EnableArray(This->util, shader->shader.attribs[0], TRUE);
-	This->ext->glVertexAttribPointer(shader->shader.attribs[0],2,GL_FLOAT,GL_FALSE,sizeof(BltVertex),&This->bltvertices[0].x);
-	if((!(cmd->flags & DDBLT_COLORFILL)) && (shader->shader.attribs[3] != -1))
-	{
-		glUtil_EnableArray(This->util, shader->shader.attribs[3], TRUE);
-		This->ext->glVertexAttribPointer(shader->shader.attribs[3],2,GL_FLOAT,GL_FALSE,sizeof(BltVertex),&This->bltvertices[0].s);
-	}
-	if (usedest)
+	BufferObject_Bind(This->pbo[index], GL_PIXEL_PACK_BUFFER);
+	glGetIntegerv(GL_PACK_ALIGNMENT, &packalign);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, sizes[4], sizes[5], GL_BGRA, GL_UNSIGNED_BYTE, 0);
+	glPixelStorei(GL_PACK_ALIGNMENT, packalign);
+	BufferObject_Unbind(This->pbo[index], GL_PIXEL_PACK_BUFFER);
+	if (This->pboflipped[index]) glUtil_SetFBO(This->util, NULL);
+	if (This->ext->GLEXT_ARB_sync)
+		This->pbofences[index] = This->ext->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	glFlush();
+	glRenderer__ShowLayeredFrame(This);
+	This->pbopending = index;
+}
+
+/**
+  * Adds the counters kept by the shader generators, glUtil and the texture
+  * residency manager to the frame that was just presented and publishes it.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param presentstart
+  *  Performance counter when drawing of the primary started
+  */
+static void glRenderer__EndPerfFrame(glRenderer *This, LONGLONG presentstart)
+{
+	PerfCounters *perf = &This->perf;
+	DWORD compiles = This->shaders->gen3d->compiles + This->shaders->gen2d->compiles;
+	perf->frame.dwShaderSwitches = This->shaders->gen3d->switches - perf->lastswitches;
+	perf->frame.dwShaderCompiles = compiles - perf->lastcompiles;
+	perf->frame.dwFBOSwitches = This->util->fboswitches - perf->lastfboswitches;
+	perf->lastswitches = This->shaders->gen3d->switches;
+	perf->lastcompiles = compiles;
+	perf->lastfboswitches = This->util->fboswitches;
+	if (This->residency)
 	{
-		glUtil_EnableArray(This->util, shader->shader.attribs[4], TRUE);
-		This->ext->glVertexAttribPointer(shader->shader.attribs[4],2,GL_FLOAT,GL_FALSE,sizeof(BltVertex),&This->bltvertices[0].dests);
+		perf->frame.dwEvictions = This->residency->evictions - perf->lastevictions;
+		perf->frame.dwRestores = This->residency->restores - perf->lastrestores;
+		perf->frame.dwResidentBytes = (DWORD)This->residency->size;
+		perf->lastevictions = This->residency->evictions;
+		perf->lastrestores = This->residency->restores;
 	}
-	glUtil_SetCull(This->util, D3DCULL_NONE);
-	glUtil_SetPolyMode(This->util, D3DFILL_SOLID);
-	This->ext->glDrawRangeElements(GL_TRIANGLE_STRIP,0,3,4,GL_UNSIGNED_SHORT,bltindices);
-	glUtil_SetFBO(This->util, NULL);
-	if(((ddsd.ddsCaps.dwCaps & (DDSCAPS_FRONTBUFFER)) &&
-		(ddsd.ddsCaps.dwCaps & DDSCAPS_PRIMARYSURFACE)) ||
-		((ddsd.ddsCaps.dwCaps & DDSCAPS_PRIMARYSURFACE) &&
-		!(ddsd.ddsCaps.dwCaps & DDSCAPS_FLIP)))
-		if(!(cmd->flags & 0x80000000)) glRenderer__DrawScreen(This,cmd->dest,cmd->dest->palette,0,NULL,FALSE,TRUE,NULL,0);
-	This->outputs[0] = (void*)DD_OK;
-	if(!backend) SetEvent(This->busy);
+	if (This->latency) perf->frame.dwInputLatency = This->latency->last;
+	PerfCounters_EndFrame(perf, presentstart);
 }
 
-void glRenderer__MakeTexture(glRenderer *This, glTexture *texture)
+/**
+  * Measures the frame that was just presented, and logs it with its
+  * performance counters if it took much longer than most frames.
+  * @param This
+  *  Pointer to glRenderer object
+  */
+static void glRenderer__CheckStutter(glRenderer *This)
 {
-	glTexture__FinishCreate(texture);
+	DXGLFRAMETIMES times;
+	DXGL_PERFCOUNTERS counters;
+	char str[512];
+	if (!DXGLTimer_EndFrame(&This->timer, &times)) return;
+	if (!dxglcfg.DebugTraceLevel) return;
+	PerfCounters_Get(&This->perf, &counters);
+	sprintf(str, "Stutter in frame %u: %.1f ms, median %.1f ms (idle %.1f ms, execute %.1f ms, present %.1f ms, "
+		"queue wait %.1f ms in %u handoffs)\n", counters.dwFrame, times.frame, times.median, times.idle,
+		times.execute, times.present, (double)counters.dwHandoffWait / 1000.0, counters.dwHandoffs);
+	TRACE_STRING(str);
+	sprintf(str, "  %u commands, %u draws, %u blts, %u shader compiles, %u shader switches, %u FBO switches, "
+		"%u readback stalls, %u uploads (%u KB), %u KB downloaded, %u textures created, %u deleted, "
+		"%u evicted, %u restored\n", counters.dwCommands, counters.dwDraws, counters.dwBlts,
+		counters.dwShaderCompiles, counters.dwShaderSwitches, counters.dwFBOSwitches, counters.dwReadbackStalls,
+		counters.dwUploads, counters.dwUploadBytes / 1024, counters.dwDownloadBytes / 1024,
+		counters.dwTextureCreates, counters.dwTextureDeletes, counters.dwEvictions, counters.dwRestores);
+	TRACE_STRING(str);
 }
 
-void glRenderer__DrawBackbuffer(glRenderer *This, glTexture **texture, int x, int y, int progtype, BOOL paletted, BOOL firstpass, int index)
+/**
+  * Reads back the frame being presented for a screenshot or recording.  The
+  * frame is read as shown in the window, or as the application drew it if
+  * CaptureSource is set and the primary isn't palettized.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param primary
+  *  Primary surface being presented
+  * @param width,height
+  *  Size of the frame in the window
+  */
+static void glRenderer__CaptureFrame(glRenderer *This, glTexture *primary, GLint width, GLint height)
 {
-	GLfloat view[4];
-	DDSURFACEDESC2 ddsd;
-	DWORD x2, y2;
-	x2 = (DWORD)((float)x * This->postsizex);
-	y2 = (DWORD)((float)y * This->postsizey);
-	glUtil_SetActiveTexture(This->util,8);
-	if(!This->backbuffers[index].initialized)
+	FBO *fbo;
+	if ((dxglcfg.CaptureSource == 1) && (This->ddInterface->primarybpp != 8) &&
+		(glUtil_SetFBOSurface(This->util, primary, NULL, 0, 0, TRUE) == GL_FRAMEBUFFER_COMPLETE))
 	{
-		ZeroMemory(&ddsd, sizeof(DDSURFACEDESC2));
-		memcpy(&ddsd, &ddsdbackbuffer, sizeof(DDSURFACEDESC2));
-		ddsd.dwWidth = x2;
-		ddsd.lPitch = x2 * 4;
-		ddsd.dwHeight = y2;
-		glTexture_Create(&ddsd, &This->backbuffers[index], This, TRUE, 0);
-		This->backbuffers[index].freeonrelease = FALSE;
-		glUtil_InitFBO(This->util, &This->backbuffers[index].levels[0].fbo);
+		// Surfaces are stored top row first
+		FrameCapture_Read(This->framecapture, primary->levels[0].ddsd.dwWidth,
+			primary->levels[0].ddsd.dwHeight, FALSE);
 	}
-	if((This->backbuffers[index].levels[0].ddsd.dwWidth != x2) || (This->backbuffers[index].levels[0].ddsd.dwHeight != y2))
+	else
 	{
-		ZeroMemory(&ddsd, sizeof(DDSURFACEDESC2));
-		ddsd.dwSize = sizeof(DDSURFACEDESC2);
-		ddsd.dwWidth = x2;
-		ddsd.dwHeight = y2;
-		ddsd.dwFlags = DDSD_WIDTH | DDSD_HEIGHT;
-		glTexture__SetSurfaceDesc(&This->backbuffers[index], &ddsd);
-	}
-	if (texture)
-	{
-		glUtil_SetFBOTextures(This->util, &This->fbo, &This->backbuffers[index], NULL, 0, 0, FALSE);
-		view[0] = view[2] = 0;
-		view[1] = (GLfloat)x2;
-		view[3] = (GLfloat)y2;
-		glUtil_SetViewport(This->util, 0, 0, x2, y2);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-		glUtil_SetTexture(This->util, 8, *texture);
-		*texture = &This->backbuffers[index];
-		if (!paletted && firstpass && (dxglcfg.postfilter == 1))
-			glTexture__SetFilter(*texture, 8, GL_LINEAR, GL_LINEAR, This);
-		else glTexture__SetFilter(*texture, 8, GL_NEAREST, GL_NEAREST, This);
-		This->ext->glUniform1i(This->shaders->shaders[progtype].tex0, 8);
-		This->ext->glUniform4f(This->shaders->shaders[progtype].view, view[0], view[1], view[2], view[3]);
-		This->bltvertices[0].s = This->bltvertices[0].t = This->bltvertices[1].t = This->bltvertices[2].s = 1.;
-		This->bltvertices[1].s = This->bltvertices[2].t = This->bltvertices[3].s = This->bltvertices[3].t = 0.;
-		This->bltvertices[0].y = This->bltvertices[1].y = This->bltvertices[1].x = This->bltvertices[3].x = 0.;
-		This->bltvertices[0].x = This->bltvertices[2].x = (float)x2;
-		This->bltvertices[2].y = This->bltvertices[3].y = (float)y2;
-		glUtil_EnableArray(This->util, This->shaders->shaders[progtype].pos, TRUE);
-		This->ext->glVertexAttribPointer(This->shaders->shaders[progtype].pos, 2, GL_FLOAT, GL_FALSE, sizeof(BltVertex), &This->bltvertices[0].x);
-		glUtil_EnableArray(This->util, This->shaders->shaders[progtype].texcoord, TRUE);
-		This->ext->glVertexAttribPointer(This->shaders->shaders[progtype].texcoord, 2, GL_FLOAT, GL_FALSE, sizeof(BltVertex), &This->bltvertices[0].s);
-		glUtil_SetCull(This->util, D3DCULL_NONE);
-		glUtil_SetPolyMode(This->util, D3DFILL_SOLID);
-		This->ext->glDrawRangeElements(GL_TRIANGLE_STRIP, 0, 3, 4, GL_UNSIGNED_SHORT, bltindices);
-		glUtil_SetFBO(This->util, NULL);
+		fbo = glRenderer__SetScreenFBO(This);
+		if (!fbo) glReadBuffer(dxglpolicy.singlebuffer ? GL_FRONT : GL_BACK);
+		FrameCapture_Read(This->framecapture, width, height, TRUE);
 	}
+	// The frame is shown from the screen framebuffer
+	glRenderer__SetScreenFBO(This);
 }
 
-void glRenderer__DrawBackbufferRect(glRenderer *This, glTexture *texture, RECT srcrect, RECT destrect, int progtype, int index)
+void glRenderer__DrawScreen(glRenderer *This, glTexture *texture, glTexture *paltex, GLint vsync, glTexture *previous, BOOL setsync, BOOL settime)
 {
+	GLScopedDebugMarker scope(DEBUGMARKER("DrawScreen"));
+	int progtype;
+	RECT r, r2;
+	DWORD i;
+	RendererOverlay *overlay;
+	glTexture *primary = texture;
+	BOOL scale512448 = Is512448Scale(This, texture, paltex);
+	LARGE_INTEGER presentstart;
+	LONGLONG swapstart;
+	int timingindex = -1;
+	int dwminterval = 0;
+	BOOL presenting = FALSE;
+	QueryPerformanceCounter(&presentstart);
+	if (This->latency) LatencyMeter_Poll(This->latency, FALSE);
+	if (This->shadertiming) timingindex = ShaderTiming_Begin(This->shadertiming);
+	glUtil_BlendEnable(This->util, FALSE);
+	if (previous) previous->levels[0].ddsd.ddsCaps.dwCaps &= ~DDSCAPS_FRONTBUFFER;
+	texture->levels[0].ddsd.ddsCaps.dwCaps |= DDSCAPS_FRONTBUFFER;
+	if((texture->levels[0].ddsd.ddsCaps.dwCaps & DDSCAPS_PRIMARYSURFACE))
+	{
+		glRenderer__SyncWindow(This);
+		r2 = This->wndrect;
+	}
+	glUtil_DepthTest(This->util, FALSE);
+	RECT *viewrect = &r2;
+	// The presenter thread and the swap chain set the swap interval of the frames they show
+	if (!This->presenter && !This->dxgioutput)
+	{
+		// The compositor shows a window once per refresh, so wait for it instead of the vertical blank
+		if (This->dwmsync && This->hWnd && !glDirectDraw7_GetFullscreen(This->ddInterface) &&
+			DwmSync_Composited(This->dwmsync))
+			dwminterval = abs(glRenderer__SwapInterval(This, vsync));
+		if (dwminterval) glRenderer__SetSwapInterval(This, 0);
+		else glRenderer__SetSwap(This, vsync);
+	}
+	LONG sizes[6];
 	GLfloat view[4];
-	DDSURFACEDESC2 ddsd;
-	int x1 = destrect.left;
-	int x2 = destrect.right;
-	int y1 = destrect.top;
-	int y2 = destrect.bottom;
-	if (index > 15) return;
-	glUtil_SetActiveTexture(This->util, 0);
-	if (!This->backbuffers[index].initialized)
+	GLint viewport[4];
+	// 3D rendering since the last present is resolved once for the whole frame
+	glTexture__ResolveMSAA(texture);
+	if(glTexture__CPUDirty(texture, 0)) glTexture__Upload(texture, 0);
+	if(texture->levels[0].ddsd.ddsCaps.dwCaps & DDSCAPS_PRIMARYSURFACE)
 	{
-		ZeroMemory(&ddsd, sizeof(DDSURFACEDESC2));
-		memcpy(&ddsd, &ddsdbackbuffer, sizeof(DDSURFACEDESC2));
-		ddsd.dwWidth = x2;
-		ddsd.lPitch = x2 * 4;
-		ddsd.dwHeight = y2;
-		glTexture_Create(&ddsd, &This->backbuffers[index], This, TRUE, 0);
+		if(glDirectDraw7_GetFullscreen(This->ddInterface))
+		{
+			glDirectDraw7_GetSizes(This->ddInterface, sizes);
+			if (dxglpolicy.postsizeauto)
+			{
+				if (sizes[2] <= 400) This->postsizex = 2.0f;
+				else This->postsizex = 1.0f;
+				if (sizes[3] <= 300) This->postsizey = 2.0f;
+				else This->postsizey = 1.0f;
+			}
+			else
+			{
+				This->postsizex = dxglcfg.postsizex;
+				This->postsizey = dxglcfg.postsizey;
+			}
+			viewport[0] = viewport[1] = 0;
+			viewport[2] = sizes[4];
+			viewport[3] = sizes[5];
+			view[0] = (GLfloat)-(sizes[4]-sizes[0])/2;
+			view[1] = (GLfloat)(sizes[4]-sizes[0])/2+sizes[0];
+			view[2] = (GLfloat)(sizes[5]-sizes[1])/2+sizes[1];
+			view[3] = (GLfloat)-(sizes[5]-sizes[1])/2;
+		}
+		else
+		{
+			This->postsizex = 1.0f;
+			This->postsizey = 1.0f;
+			viewport[0] = viewport[1] = 0;
+			viewport[2] = viewrect->right;
+			viewport[3] = viewrect->bottom;
+			OffsetRect(viewrect, This->wndorigin.x - This->xoffset, This->wndorigin.y - This->yoffset);
+			if (dxglpolicy.windowscaled)
+			{
+				viewrect->left = (LONG)((float)viewrect->left / dxglcfg.WindowScaleX);
+				viewrect->top = (LONG)((float)viewrect->top / dxglcfg.WindowScaleY);
+				viewrect->right = (LONG)((float)viewrect->right / dxglcfg.WindowScaleX);
+				viewrect->bottom = (LONG)((float)viewrect->bottom / dxglcfg.WindowScaleY);
+			}
+			view[0] = (GLfloat)viewrect->left;
+			view[1] = (GLfloat)viewrect->right;
+			view[2] = (GLfloat)texture->levels[0].ddsd.dwHeight-(GLfloat)viewrect->top;
+			view[3] = (GLfloat)texture->levels[0].ddsd.dwHeight-(GLfloat)viewrect->bottom;
+		}
 	}
-	if ((This->backbuffers[index].levels[0].ddsd.dwWidth < x2) || (This->backbuffers[index].levels[0].ddsd.dwHeight < y2))
+	else
 	{
-		if (This->backbuffers[index].levels[0].ddsd.dwWidth > x2) x2 = This->backbuffers[index].levels[0].ddsd.dwWidth;
-		if (This->backbuffers[index].levels[0].ddsd.dwHeight > y2) y2 = This->backbuffers[index].levels[0].ddsd.dwHeight;
-		ZeroMemory(&ddsd, sizeof(DDSURFACEDESC2));
-		ddsd.dwSize = sizeof(DDSURFACEDESC2);
-		ddsd.dwWidth = x2;
-		ddsd.dwHeight = y2;
-		ddsd.dwFlags = DDSD_WIDTH | DDSD_HEIGHT;
-		glTexture__SetSurfaceDesc(&This->backbuffers[index], &ddsd);
-		x2 = destrect.right;
-		y2 = destrect.bottom;
+		view[0] = 0;
+		view[1] = (GLfloat)texture->levels[0].ddsd.dwWidth;
+		view[2] = 0;
+		view[3] = (GLfloat)texture->levels[0].ddsd.dwHeight;
 	}
-	glUtil_SetFBOTextures(This->util, &This->fbo, &This->backbuffers[index], NULL, 0, 0, FALSE);
-	view[0] = view[2] = 0;
-	view[1] = (GLfloat)This->backbuffers[index].levels[0].ddsd.dwWidth;
-	view[3] = (GLfloat)This->backbuffers[index].levels[0].ddsd.dwHeight;
-	glUtil_SetViewport(This->util, 0, 0, This->backbuffers[index].levels[0].ddsd.dwWidth, This->backbuffers[index].levels[0].ddsd.dwHeight);
-	glUtil_SetScissor(This->util, TRUE, 0, 0, This->backbuffers[index].levels[0].ddsd.dwWidth, This->backbuffers[index].levels[0].ddsd.dwHeight);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	glUtil_SetScissor(This->util, FALSE, 0, 0, 0, 0);
-	glUtil_SetTexture(This->util, 8, texture);
-	This->ext->glUniform1i(This->shaders->shaders[progtype].tex0, 8);
-	This->ext->glUniform4f(This->shaders->shaders[progtype].view, view[0], view[1], view[2], view[3]);
-	if (texture->target == GL_TEXTURE_RECTANGLE)
+	if (This->dxgioutput && (texture->levels[0].ddsd.ddsCaps.dwCaps & DDSCAPS_PRIMARYSURFACE))
+		glRenderer__BeginDXGIFrame(This, viewport[2], viewport[3]);
+	if (This->presenter)
 	{
-		This->bltvertices[1].s = This->bltvertices[3].s = (GLfloat)srcrect.left;
-		This->bltvertices[0].s = This->bltvertices[2].s = (GLfloat)srcrect.right;
-		This->bltvertices[0].t = This->bltvertices[1].t = (GLfloat)srcrect.top;
-		This->bltvertices[2].t = This->bltvertices[3].t = (GLfloat)srcrect.bottom;
+		if (texture->levels[0].ddsd.ddsCaps.dwCaps & DDSCAPS_PRIMARYSURFACE)
+			presenting = Presenter_BeginFrame(This->presenter, viewport[2], viewport[3]);
+		// Frames not handed to the presenter are swapped here once it is idle
+		if (!presenting) Presenter_Wait(This->presenter);
+	}
+	if (!glRenderer__PresentDirect(This, texture, sizes, viewport, viewrect, scale512448))
+	{
+		if (This->ddInterface->primarybpp == 8) glTexture__Upload(paltex, 0);
+		if (This->postprocess)
+		{
+			PostProcess_Build(This->postprocess, texture->levels[0].ddsd.dwWidth, texture->levels[0].ddsd.dwHeight,
+				(This->ddInterface->primarybpp == 8), This->postsizex, This->postsizey);
+			texture = PostProcess_Run(This->postprocess, texture, paltex);
+			if (dxglcfg.DebugView)
+			{
+				glTexture *debugview = PostProcess_RunDebug(This->postprocess, This->debugdepth);
+				if (debugview) texture = debugview;
+			}
+		}
+		glRenderer__SetScreenFBO(This);
+		glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
+		if((This->ddInterface->primarybpp == 8) && (texture == primary))
+		{
+			// No pass converted the palette, so the final draw does
+			progtype = This->gammaenabled ? PROG_PAL256GAMMA : PROG_PAL256;
+			ShaderManager_SetShader(This->shaders,progtype,NULL,0);
+			This->ext->glUniform1i(This->shaders->shaders[progtype].tex0,8);
+			This->ext->glUniform1i(This->shaders->shaders[progtype].pal,9);
+			glUtil_SetTexture(This->util,8,texture);
+			glUtil_SetTexture(This->util,9,paltex);
+		}
+		else
+		{
+			progtype = This->gammaenabled ? PROG_TEXTUREGAMMA : PROG_TEXTURE;
+			ShaderManager_SetShader(This->shaders,progtype,NULL,0);
+			glUtil_SetTexture(This->util,8,texture);
+			This->ext->glUniform1i(This->shaders->shaders[progtype].tex0,8);
+		}
+		if (This->gammaenabled)
+		{
+			glUtil_SetTexture(This->util,10,&This->gammatexture);
+			glTexture__SetFilter(&This->gammatexture, 10, GL_NEAREST, GL_NEAREST, This);
+			This->ext->glUniform1i(This->shaders->shaders[progtype].tex1,10);
+		}
+		if (dxglcfg.scalingfilter) glTexture__SetFilter(texture, 8, GL_LINEAR, GL_LINEAR, This);
+		else glTexture__SetFilter(texture, 8, GL_NEAREST, GL_NEAREST, This);
+		glUtil_SetViewport(This->util,viewport[0],viewport[1],viewport[2],viewport[3]);
+		This->ext->glUniform4f(This->shaders->shaders[progtype].view,view[0],view[1],view[2],view[3]);
+		if(glDirectDraw7_GetFullscreen(This->ddInterface))
+		{
+			This->bltvertices[0].x = This->bltvertices[2].x = (float)sizes[0];
+			This->bltvertices[0].y = This->bltvertices[1].y = This->bltvertices[1].x = This->bltvertices[3].x = 0.;
+			This->bltvertices[2].y = This->bltvertices[3].y = (float)sizes[1];
+		}
+		else
+		{
+			This->bltvertices[0].x = This->bltvertices[2].x = (float)texture->levels[0].ddsd.dwWidth;
+			This->bltvertices[0].y = This->bltvertices[1].y = This->bltvertices[1].x = This->bltvertices[3].x = 0.;
+			This->bltvertices[2].y = This->bltvertices[3].y = (float)texture->levels[0].ddsd.dwHeight;
+		}
+		if (scale512448)
+		{
+			if (dxglpolicy.autoexpand == 1)
+			{
+				This->bltvertices[0].s = This->bltvertices[2].s = 0.9f;
+				This->bltvertices[0].t = This->bltvertices[1].t = 0.966666667f;
+				This->bltvertices[1].s = This->bltvertices[3].s = 0.1f;
+				This->bltvertices[2].t = This->bltvertices[3].t = 0.0333333333f;
+			}
+			else if (dxglpolicy.autoexpand == 2)
+			{
+				This->bltvertices[0].s = This->bltvertices[2].s = 0.9f;
+				This->bltvertices[1].s = This->bltvertices[3].s = 0.1f;
+			}
+		}
+		else
+		{
+			This->bltvertices[0].s = This->bltvertices[0].t = This->bltvertices[1].t = This->bltvertices[2].s = 1.;
+			This->bltvertices[1].s = This->bltvertices[2].t = This->bltvertices[3].s = This->bltvertices[3].t = 0.;
+		}
+		glUtil_EnableArray(This->util, This->shaders->shaders[progtype].pos, TRUE);
+		This->ext->glVertexAttribPointer(This->shaders->shaders[progtype].pos,2,GL_FLOAT,GL_FALSE,sizeof(BltVertex),&This->bltvertices[0].x);
+		glUtil_EnableArray(This->util, This->shaders->shaders[progtype].texcoord, TRUE);
+		This->ext->glVertexAttribPointer(This->shaders->shaders[progtype].texcoord,2,GL_FLOAT,GL_FALSE,sizeof(BltVertex),&This->bltvertices[0].s);
+		glUtil_SetCull(This->util, D3DCULL_NONE);
+		glUtil_SetPolyMode(This->util, D3DFILL_SOLID);
+		This->ext->glDrawRangeElements(GL_TRIANGLE_STRIP,0,3,4,GL_UNSIGNED_SHORT,bltindices);
 	}
-	else
+	for (i = 0; i < This->overlaycount; i++)
 	{
-		This->bltvertices[1].s = This->bltvertices[3].s = (GLfloat)srcrect.left / (GLfloat)texture->levels[0].ddsd.dwWidth;
-		This->bltvertices[0].s = This->bltvertices[2].s = (GLfloat)srcrect.right / (GLfloat)texture->levels[0].ddsd.dwWidth;
-		This->bltvertices[0].t = This->bltvertices[1].t = (GLfloat)srcrect.top / (GLfloat)texture->levels[0].ddsd.dwHeight;
-		This->bltvertices[2].t = This->bltvertices[3].t = (GLfloat)srcrect.bottom / (GLfloat)texture->levels[0].ddsd.dwHeight;
+		overlay = &This->overlays[i];
+		if (!overlay->enabled || !overlay->blt.src) continue;
+		// Only the destination key of the primary can change between frames
+		overlay->blt.flags = overlay->keyflags;
+		if (primary->levels[0].ddsd.dwFlags & DDSD_CKDESTOVERLAY) overlay->blt.flags |= DDBLT_KEYDEST;
+		overlay->blt.dest = primary;
+		glRenderer__Blt(This, &overlay->blt, TRUE);
 	}
-	This->bltvertices[1].x = This->bltvertices[3].x = (float)x1;
-	This->bltvertices[0].x = This->bltvertices[2].x = (float)x2;
-	This->bltvertices[0].y = This->bltvertices[1].y = (float)y1;
-	This->bltvertices[2].y = This->bltvertices[3].y = (float)y2;
-	glUtil_EnableArray(This->util, This->shaders->shaders[progtype].pos, TRUE);
-	This->ext->glVertexAttribPointer(This->shaders->shaders[progtype].pos, 2, GL_FLOAT, GL_FALSE, sizeof(BltVertex), &This->bltvertices[0].x);
-	glUtil_EnableArray(This->util, This->shaders->shaders[progtype].texcoord, TRUE);
-	This->ext->glVertexAttribPointer(This->shaders->shaders[progtype].texcoord, 2, GL_FLOAT, GL_FALSE, sizeof(BltVertex), &This->bltvertices[0].s);
-	glUtil_SetCull(This->util, D3DCULL_NONE);
-	glUtil_SetPolyMode(This->util, D3DFILL_SOLID);
-	This->ext->glDrawRangeElements(GL_TRIANGLE_STRIP, 0, 3, 4, GL_UNSIGNED_SHORT, bltindices);
-	glUtil_SetFBO(This->util, NULL);
-}
-
-static DWORD dummypalette[256];
-
-BOOL CompareRGB(DWORD rgb, BOOL greater)
-{
-	RGBQUAD *pixel = (RGBQUAD*)&rgb;
-	RGBQUAD *comp = (RGBQUAD*)&dxglcfg.HackAutoExpandViewportValue;
-	if (greater)
+	if (This->framecapture && (primary->levels[0].ddsd.ddsCaps.dwCaps & DDSCAPS_PRIMARYSURFACE))
 	{
-		if ((pixel->rgbBlue >= comp->rgbBlue) && (pixel->rgbGreen >= comp->rgbGreen)
-			&& (pixel->rgbRed >= comp->rgbRed)) return TRUE;
-		else return FALSE;
+		FrameCapture_Poll(This->framecapture, FALSE);
+		if (FrameCapture_Begin(This->framecapture)) glRenderer__CaptureFrame(This, primary, viewport[2], viewport[3]);
 	}
-	else
+	This->shaders->gen3d->frame++;
+	if (This->shadertiming)
+		ShaderTiming_End(This->shadertiming, timingindex, SHADERTIMING_DRAWSCREEN, This->shaders->gen3d);
+	if(dxglpolicy.singlebuffer) glFlush();
+	swapstart = DXGLTimer_GetTime(&This->timer);
+	DXGLTimer_WaitFrame(&This->timer, dxglcfg.FrameLimit);
+	if (This->dxgidrawing) glRenderer__EndDXGIFrame(This, glRenderer__SwapInterval(This, vsync));
+	else if (presenting) Presenter_EndFrame(This->presenter, glRenderer__SwapInterval(This, vsync));
+	else if(This->hWnd)
 	{
-		if ((pixel->rgbBlue <= comp->rgbBlue) && (pixel->rgbGreen <= comp->rgbGreen)
-			&& (pixel->rgbRed <= comp->rgbRed)) return TRUE;
-		else return FALSE;
+		SwapBuffers(This->hDC);
+		if (dwminterval) DwmSync_Wait(This->dwmsync, dwminterval);
+		glRenderer__LimitFramesInFlight(This);
 	}
+	else glRenderer__ReadLayeredFrame(This);
+	DXGLTimer_AddFrameTime(&This->timer, DXGLTIMER_PRESENT, swapstart);
+	if (This->latency && (primary->levels[0].ddsd.ddsCaps.dwCaps & DDSCAPS_PRIMARYSURFACE))
+		LatencyMeter_EndFrame(This->latency, This->perf.frame.dwFrame + 1);
+	if(setsync) SetEvent(This->busy);
+	if(settime) DXGLTimer_SetLastDraw(&This->timer);
+	DXGLTimer_SetLastPresent(&This->timer);
+	if (This->residency) TextureResidency_EndFrame(This->residency);
+	if (This->arena) FrameArena_Reset(This->arena);
+	if (This->uploadbytes > This->uploadpeak) This->uploadpeak = This->uploadbytes;
+	if (dxglcfg.TextureUploadBudget && (This->uploadbytes > (GLsizeiptr)dxglcfg.TextureUploadBudget * 1024))
+		This->uploadframes++;
+	This->uploadbytes = 0;
+	glRenderer__ProcessUploads(This);
+	glRenderer__EndPerfFrame(This, presentstart.QuadPart);
+	glRenderer__CheckStutter(This);
+	if (This->timeline) Timeline_Poll(This->timeline, FALSE);
+	if (This->shadertiming) ShaderTiming_EndFrame(This->shadertiming);
 }
 
-DWORD RGB555toRGB888(WORD pixel)
-{
-	DWORD red, green, blue;
-	red = _5to8bit((pixel & 0x7C00) >> 10) << 16;
-	green = _5to8bit((pixel & 0x3E0) >> 5) << 8;
-	blue = _5to8bit(pixel & 0x1F);
-	return red | green | blue;
-}
-
-DWORD RGB565toRGB888(WORD pixel)
+void glRenderer__DeleteTexture(glRenderer *This, glTexture *texture)
 {
-	DWORD red, green, blue;
-	red = _5to8bit((pixel & 0xF800) >> 11) << 16;
-	green = _6to8bit((pixel & 0x7E0) >> 5) << 8;
-	blue = _5to8bit(pixel & 0x1F);
-	return red | green | blue;
+	DWORD i;
+	InterlockedCompareExchangePointer((PVOID volatile*)&This->recomposite, NULL, texture);
+	This->perf.frame.dwTextureDeletes++;
+	if (This->debugdepth == texture) This->debugdepth = NULL;
+	glRenderer__RemoveUploads(This, texture);
+	for (i = 0; i < This->overlaycount; i++)
+		if (This->overlays[i].blt.src == texture) This->overlays[i].blt.src = NULL;
+	glTexture__Destroy(texture);
+	SetEvent(This->busy);
 }
 
-BOOL BorderColorCompare(glRenderer *This, DWORD pixel, DWORD *palette, DWORD bpp)
+__int64 InitShaderState(glRenderer *renderer, DWORD *renderstate, TEXTURESTAGE *texstages, D3DLIGHT7 *lights)
 {
-	if (!palette) palette = dummypalette;
-	switch (bpp)
+	int i;
+	__int64 shader = 0;
+	switch (renderstate[D3DRENDERSTATE_SHADEMODE])
 	{
-	case 8:
-		switch (dxglcfg.HackAutoExpandViewportCompare)
-		{
-		case 0: // Match color
-			if ((palette[pixel & 0xFF] & 0xFFFFFF) == dxglcfg.HackAutoExpandViewportValue & 0xFFFFFF) return TRUE;
-			else return FALSE;
-			break;
-		case 1: // Color less than or equal
-			return CompareRGB(palette[pixel & 0xFF], FALSE);
-			break;
-		case 2: // Color greater than or equal
-			return CompareRGB(palette[pixel & 0xFF], TRUE);
-			break;
-		case 3: // Palette/value equal
-			if ((pixel & 0xFF) == (dxglcfg.HackAutoExpandViewportValue & 0xFF)) return TRUE;
-			else return FALSE;
-			break;
-		case 4: // Palette/value less than or equal
-			if ((pixel & 0xFF) <= (dxglcfg.HackAutoExpandViewportValue & 0xFF)) return TRUE;
-			else return FALSE;
-			break;
-		case 5: // Palette/value greater than or equal
-			if ((pixel & 0xFF) >= (dxglcfg.HackAutoExpandViewportValue & 0xFF)) return TRUE;
-			else return FALSE;
-			break;
-		case 6: // Match 3 palette entries
-			if (((pixel & 0xFF) == (dxglcfg.HackAutoExpandViewportValue & 0xFF)) ||
-				((pixel & 0xFF) == ((dxglcfg.HackAutoExpandViewportValue & 0xFF00) >> 8)) ||
-				((pixel & 0xFF) == ((dxglcfg.HackAutoExpandViewportValue & 0xFF0000) >> 16))) return TRUE;
-			else return FALSE;
-			break;
-		default:
-			return FALSE;
-		}
+	case D3DSHADE_FLAT:
+	default:
 		break;
-	case 15:
-		switch (dxglcfg.HackAutoExpandViewportCompare)
+	case D3DSHADE_GOURAUD:
+		shader |= 1;
+		break;
+	case D3DSHADE_PHONG:
+		shader |= 3;
+		break;
+	}
+	if (renderstate[D3DRENDERSTATE_ALPHATESTENABLE]) shader |= 4;
+	shader |= ((((__int64)renderstate[D3DRENDERSTATE_ALPHAFUNC] - 1) & 7) << 3);
+	shader |= (((__int64)renderstate[D3DRENDERSTATE_FOGTABLEMODE] & 3) << 6);
+	shader |= (((__int64)renderstate[D3DRENDERSTATE_FOGVERTEXMODE] & 3) << 8);
+	if (renderstate[D3DRENDERSTATE_RANGEFOGENABLE]) shader |= (1i64 << 10);
+	if (renderstate[D3DRENDERSTATE_SPECULARENABLE]) shader |= (1i64 << 11);
+	if (renderstate[D3DRENDERSTATE_STIPPLEDALPHA]) shader |= (1i64 << 12);
+	if (renderstate[D3DRENDERSTATE_COLORKEYENABLE]) shader |= (1i64 << 13);
+	shader |= (((__int64)renderstate[D3DRENDERSTATE_ZBIAS] & 7) << 14);
+	shader |= glRenderer__LightStateBits(renderer, lights);
+	if (renderstate[D3DRENDERSTATE_LOCALVIEWER]) shader |= (1i64 << 21);
+	if (renderstate[D3DRENDERSTATE_COLORKEYBLENDENABLE]) shader |= (1i64 << 22);
+	shader |= (((__int64)renderstate[D3DRENDERSTATE_DIFFUSEMATERIALSOURCE] & 3) << 23);
+	shader |= (((__int64)renderstate[D3DRENDERSTATE_SPECULARMATERIALSOURCE] & 3) << 25);
+	shader |= (((__int64)renderstate[D3DRENDERSTATE_AMBIENTMATERIALSOURCE] & 3) << 27);
+	shader |= (((__int64)renderstate[D3DRENDERSTATE_EMISSIVEMATERIALSOURCE] & 3) << 29);
+	if (renderstate[D3DRENDERSTATE_NORMALIZENORMALS]) shader |= (1i64 << 49);
+	if (renderstate[D3DRENDERSTATE_TEXTUREMAPBLEND] == D3DTBLEND_MODULATE)
+	{
+		bool noalpha = false;;
+		if (!texstages[0].texture) noalpha = true;
+		if (texstages[0].texture)
+			if (!(texstages[0].texture->levels[0].ddsd.ddpfPixelFormat.dwFlags & DDPF_ALPHAPIXELS))
+				noalpha = true;
+		if (noalpha) texstages[0].alphaop = D3DTOP_SELECTARG2;
+		else texstages[0].alphaop = D3DTOP_MODULATE;
+	}
+	if (renderstate[D3DRENDERSTATE_LIGHTING]) shader |= (1i64 << 59);
+	if (renderstate[D3DRENDERSTATE_COLORVERTEX]) shader |= (1i64 << 60);
+	if (renderstate[D3DRENDERSTATE_FOGENABLE]) shader |= (1i64 << 61);
+	if (renderstate[D3DRENDERSTATE_DITHERENABLE]) shader |= (1i64 << 62);
+	for (i = 0; i < 8; i++)
+	{
+		renderer->shaderstate3d.texstageid[i] = texstages[i].colorop & 31;
+		renderer->shaderstate3d.texstageid[i] |= (__int64)(texstages[i].colorarg1 & 63) << 5;
+		renderer->shaderstate3d.texstageid[i] |= (__int64)(texstages[i].colorarg2 & 63) << 11;
+		renderer->shaderstate3d.texstageid[i] |= (__int64)(texstages[i].alphaop & 31) << 17;
+		renderer->shaderstate3d.texstageid[i] |= (__int64)(texstages[i].alphaarg1 & 63) << 22;
+		renderer->shaderstate3d.texstageid[i] |= (__int64)(texstages[i].alphaarg2 & 63) << 28;
+		renderer->shaderstate3d.texstageid[i] |= (__int64)(texstages[i].texcoordindex & 7) << 34;
+		renderer->shaderstate3d.texstageid[i] |= (__int64)((texstages[i].texcoordindex >> 16) & 3) << 37;
+		renderer->shaderstate3d.texstageid[i] |= (__int64)((texstages[i].addressu - 1) & 3) << 39;
+		renderer->shaderstate3d.texstageid[i] |= (__int64)((texstages[i].addressv - 1) & 3) << 41;
+		//renderer->shaderstate3d.texstageid[i] |= (__int64)(texstages[i].magfilter & 7) << 43;
+		//renderer->shaderstate3d.texstageid[i] |= (__int64)(texstages[i].minfilter & 3) << 46;
+		//renderer->shaderstate3d.texstageid[i] |= (__int64)(texstages[i].mipfilter & 3) << 48;
+		if (texstages[i].textransform & 7)
 		{
-		case 0: // Match color
-			if (RGB555toRGB888(pixel) == dxglcfg.HackAutoExpandViewportValue & 0xFFFFFF) return TRUE;
-			else return FALSE;
-			break;
-		case 1: // Color less than or equal
-			return CompareRGB(RGB555toRGB888(pixel), FALSE);
-			break;
-		case 2: // Color greater than or equal
-			return CompareRGB(RGB555toRGB888(pixel), TRUE);
-			break;
-		case 3: // Palette/value equal
-		case 6: // Match 3 palette entries
-			if ((pixel & 0x7FFF) == (dxglcfg.HackAutoExpandViewportValue & 0x7FFF)) return TRUE;
-			else return FALSE;
-			break;
-		case 4: // Palette/value less than or equal
-			if ((pixel & 0x7FFF) <= (dxglcfg.HackAutoExpandViewportValue & 0x7FFF)) return TRUE;
-			else return FALSE;
-			break;
-		case 5: // Palette/value greater than or equal
-			if ((pixel & 0x7FFF) >= (dxglcfg.HackAutoExpandViewportValue & 0x7FFF)) return TRUE;
-			else return FALSE;
-			break;
-		default:
-			return FALSE;
+			renderer->shaderstate3d.texstageid[i] |= 1i64 << 50;
+			renderer->shaderstate3d.texstageid[i] |= (__int64)(((texstages[i].textransform & 7) - 1) & 3) << 51;
 		}
-		break;
-	case 16:
-		switch (dxglcfg.HackAutoExpandViewportCompare)
+		if (texstages[i].textransform & D3DTTFF_PROJECTED) renderer->shaderstate3d.texstageid[i] |= 1i64 << 53;
+		renderer->shaderstate3d.texstageid[i] |= (__int64)(texstages[i].texcoordindex & 7) << 54;
+		renderer->shaderstate3d.texstageid[i] |= (__int64)((texstages[i].texcoordindex >> 16) & 3) << 57;
+		if (texstages[i].texture)
 		{
-		case 0: // Match color
-			if (RGB565toRGB888(pixel) == dxglcfg.HackAutoExpandViewportValue & 0xFFFFFF) return TRUE;
-			else return FALSE;
-			break;
-		case 1: // Color less than or equal
-			return CompareRGB(RGB565toRGB888(pixel), FALSE);
-			break;
-		case 2: // Color greater than or equal
-			return CompareRGB(RGB565toRGB888(pixel), TRUE);
-			break;
-		case 3: // Palette/value equal
-		case 6: // Match 3 palette entries
-			if ((pixel & 0xFFFF) == (dxglcfg.HackAutoExpandViewportValue & 0xFFFF)) return TRUE;
-			else return FALSE;
-			break;
-		case 4: // Palette/value less than or equal
-			if ((pixel & 0xFFFF) <= (dxglcfg.HackAutoExpandViewportValue & 0xFFFF)) return TRUE;
-			else return FALSE;
-			break;
-		case 5: // Palette/value greater than or equal
-			if ((pixel & 0xFFFF) >= (dxglcfg.HackAutoExpandViewportValue & 0xFFFF)) return TRUE;
-			else return FALSE;
-			break;
-		default:
-			return FALSE;
+			renderer->shaderstate3d.texstageid[i] |= 1i64 << 59;
+			if (texstages[i].texture->levels[0].ddsd.dwFlags & DDSD_CKSRCBLT) renderer->shaderstate3d.texstageid[i] |= 1i64 << 60;
+		}
+	}
+	return shader;
+}
+
+void glRenderer__InitD3D(glRenderer *This, int zbuffer, int x, int y)
+{
+	SetEvent(This->busy);
+	glHint(GL_PERSPECTIVE_CORRECTION_HINT,GL_NICEST);
+	GLfloat ambient[] = {0.0,0.0,0.0,0.0};
+	if (zbuffer) glUtil_DepthTest(This->util, TRUE);
+	glUtil_SetDepthComp(This->util, GL_LEQUAL);
+	GLfloat identity[16];
+	__gluMakeIdentityf(identity);
+	for (int i = 0; i < 24; i++)
+		memcpy(&This->transform[i], identity, sizeof(D3DMATRIX));
+	GLfloat one[4] = {1,1,1,1};
+	GLfloat zero[4] = {0,0,0,1};
+	glUtil_SetMaterial(This->util, one, one, zero, zero, 0);
+	ZeroMemory(&This->material, sizeof(D3DMATERIAL7));
+	ZeroMemory(&This->lights, LIGHTS_MAX * sizeof(D3DLIGHT7));
+	glRenderer__UpdateTransforms(This, TRUE);
+	glRenderer__SetMaterialBlock(This);
+	glRenderer__UpdateLights(This);
+	memcpy(&This->renderstate, &renderstate_default, RENDERSTATE_COUNT * sizeof(DWORD));
+	This->texstages[0] = texstagedefault0;
+	This->texstages[1] = This->texstages[2] = This->texstages[3] = This->texstages[4] =
+		This->texstages[5] = This->texstages[6] = This->texstages[7] = This->texstages[8] =
+		This->texstages[9] = This->texstages[10] = This->texstages[11] = texstagedefault1;
+	for (int i = 0; i < 8; i++)
+		glRenderer__UpdateStageSampler(This, i);
+	This->viewport.dwX = 0;
+	This->viewport.dwY = 0;
+	This->viewport.dwWidth = x;
+	This->viewport.dwHeight = y;
+	This->viewport.dvMinZ = 0.0f;
+	This->viewport.dvMaxZ = 1.0f;
+	This->shaderstate3d.stateid = InitShaderState(This, This->renderstate, This->texstages, This->lights);
+	This->shaderkeydirty = TRUE;
+}
+
+/**
+  * Binds the framebuffer 3D rendering draws into.  If antialiasing or render
+  * scaling is enabled, draws to the top level of a render target with a depth
+  * buffer go to multisampled or scaled renderbuffers that are resolved when
+  * the surface is read.  Sets mulx and muly to the scale of the framebuffer.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param target
+  *  Render target texture
+  * @param zbuffer
+  *  Depth buffer texture, or NULL if none
+  * @param level
+  *  Mipmap level of the render target
+  * @param zlevel
+  *  Mipmap level of the depth buffer
+  * @return
+  *  Completeness status of the framebuffer
+  */
+static GLenum glRenderer__SetRenderTarget(glRenderer *This, glTexture *target, glTexture *zbuffer,
+	GLint level, GLint zlevel)
+{
+	This->mulx = This->muly = 1.0f;
+	if ((This->msaasamples || (This->renderscale > 1)) && zbuffer && !level && !zlevel &&
+		glTexture__InitMSAA(target, This->msaasamples, This->renderscale) &&
+		glTexture__InitMSAA(zbuffer, This->msaasamples, This->renderscale))
+	{
+		if (glUtil_SetFBOMultisample(This->util, target, zbuffer) == GL_FRAMEBUFFER_COMPLETE)
+		{
+			This->mulx = This->muly = (GLfloat)This->renderscale;
+			return GL_FRAMEBUFFER_COMPLETE;
 		}
-		break;
-	case 24:
-	case 32:
-		switch (dxglcfg.HackAutoExpandViewportCompare)
+		// The formats can't be combined, so this pair draws to the textures
+		glTexture__DeleteMSAA(target);
+		glTexture__DeleteMSAA(zbuffer);
+		target->msaastate = zbuffer->msaastate = MSAA_FAILED;
+	}
+	return glUtil_SetFBOSurface(This->util, target, zbuffer, level, zlevel, FALSE);
+}
+
+/**
+  * Clears all rects of a clear command with one instanced draw of a quad per
+  * rect, instead of a scissor change and glClear for each rect.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param cmd
+  *  Clear command with the FBO of its target already bound
+  * @param color
+  *  Clear color as floats
+  * @return
+  *  TRUE if the rects were drawn, FALSE if they should be cleared one by one
+  */
+static BOOL glRenderer__ClearInstanced(glRenderer *This, ClearCommand *cmd, const GLfloat *color)
+{
+	CmdBuffer *buffer = &This->cmdbuffer[0];
+	SHADER *shader = ShaderManager_GetBuiltin(This->shaders, PROG_CLEARRECTS);
+	glUtil *util = This->util;
+	GLint viewport[4] = { util->viewportx, util->viewporty, util->viewportwidth, util->viewportheight };
+	GLclampd depthrange[2] = { util->depthnear, util->depthfar };
+	BOOL blendenabled = util->blendenabled;
+	BOOL depthtest = util->depthtest;
+	GLenum depthcomp = util->depthcomp;
+	D3DCULL cullmode = util->cullmode;
+	D3DFILLMODE polymode = util->polymode;
+	BOOL stenciltest = util->stenciltest;
+	GLenum stencilop[3] = { util->stencilfail, util->stencilzfail, util->stencilpass };
+	GLenum stencilfunc = util->stencilfunc;
+	GLint stencilref = util->stencilref;
+	GLuint stencilmask = util->stencilmask;
+	GLfloat polyoffset[2] = { util->polyoffsetfactor, util->polyoffsetunits };
+	GLintptr offset;
+	if ((cmd->dwCount < CLEARRECTS_INSTANCED) || (This->ext->glver_major < 3)) return FALSE;
+	if (!This->ext->GLEXT_ARB_instanced_arrays || !This->shaders->convvao || !buffer->streaming) return FALSE;
+	if (shader->pos == -1) return FALSE;
+	// D3DRECT is four LONGs, read as x1,y1,x2,y2 by the shader
+	offset = glRenderer__StreamData(This, buffer->vertices, GL_ARRAY_BUFFER, &buffer->vertexptr,
+		&buffer->vertexsegment, buffer->vertexfences, cmd->lpRects, cmd->dwCount * sizeof(D3DRECT), sizeof(D3DRECT));
+	if (offset == -1) return FALSE;
+	ShaderManager_SetShader(This->shaders, PROG_CLEARRECTS, NULL, 0);
+	This->ext->glUniform4f(shader->view, (GLfloat)cmd->target->levels[cmd->targetlevel].ddsd.dwWidth,
+		(GLfloat)cmd->target->levels[cmd->targetlevel].ddsd.dwHeight, cmd->dvZ, 0.0f);
+	This->ext->glUniform4fv(shader->color, 1, color);
+	glUtil_SetScissor(util, FALSE, 0, 0, 0, 0);
+	glUtil_SetViewport(util, 0, 0, (GLsizei)((GLfloat)cmd->target->levels[cmd->targetlevel].ddsd.dwWidth * This->mulx),
+		(GLsizei)((GLfloat)cmd->target->levels[cmd->targetlevel].ddsd.dwHeight * This->muly));
+	glUtil_SetDepthRange(util, 0.0, 1.0);
+	glUtil_BlendEnable(util, FALSE);
+	glUtil_SetCull(util, D3DCULL_NONE);
+	glUtil_SetPolyMode(util, D3DFILL_SOLID);
+	glUtil_PolygonOffset(util, 0.0f, 0.0f);
+	if (!(cmd->dwFlags & D3DCLEAR_TARGET)) glUtil_ColorMask(util, GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	if (cmd->dwFlags & D3DCLEAR_ZBUFFER)
+	{
+		// Depth is only written with the depth test enabled
+		glUtil_DepthTest(util, TRUE);
+		glUtil_SetDepthComp(util, GL_ALWAYS);
+	}
+	else glUtil_DepthTest(util, FALSE);
+	if (cmd->dwFlags & D3DCLEAR_STENCIL)
+	{
+		glUtil_StencilTest(util, TRUE);
+		glUtil_StencilFunc(util, GL_ALWAYS, cmd->dwStencil, 0xFF);
+		glUtil_StencilOp(util, GL_REPLACE, GL_REPLACE, GL_REPLACE);
+		glUtil_StencilMask(util, 0xFFFFFFFF);
+	}
+	else glUtil_StencilTest(util, FALSE);
+	This->ext->glBindVertexArray(This->shaders->convvao);
+	BufferObject_Bind(buffer->vertices, GL_ARRAY_BUFFER);
+	This->ext->glEnableVertexAttribArray(shader->pos);
+	This->ext->glVertexAttribPointer(shader->pos, 4, GL_INT, GL_FALSE, sizeof(D3DRECT), (const GLvoid*)offset);
+	This->ext->glVertexAttribDivisor(shader->pos, 1);
+	This->ext->glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, cmd->dwCount);
+	// The conversion shaders share the vertex array and read no attributes
+	This->ext->glVertexAttribDivisor(shader->pos, 0);
+	This->ext->glDisableVertexAttribArray(shader->pos);
+	This->ext->glBindVertexArray(0);
+	BufferObject_Unbind(buffer->vertices, GL_ARRAY_BUFFER);
+	glUtil_StencilOp(util, stencilop[0], stencilop[1], stencilop[2]);
+	glUtil_StencilFunc(util, stencilfunc, stencilref, stencilmask);
+	glUtil_StencilTest(util, stenciltest);
+	glUtil_PolygonOffset(util, polyoffset[0], polyoffset[1]);
+	glUtil_ColorMask(util, GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	glUtil_DepthTest(util, depthtest);
+	glUtil_SetDepthComp(util, depthcomp);
+	glUtil_SetViewport(util, viewport[0], viewport[1], viewport[2], viewport[3]);
+	glUtil_SetDepthRange(util, depthrange[0], depthrange[1]);
+	glUtil_BlendEnable(util, blendenabled);
+	glUtil_SetCull(util, cullmode);
+	glUtil_SetPolyMode(util, polymode);
+	return TRUE;
+}
+
+/**
+  * Discards the attachments of the bound render target that a clear replaces
+  * whole, so tiled and integrated GPUs don't load their old contents.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param cmd
+  *  Clear about to be executed
+  */
+static void glRenderer__DiscardCleared(glRenderer *This, ClearCommand *cmd)
+{
+	const MIPLEVEL *mip = &cmd->target->levels[cmd->targetlevel];
+	GLenum attachments[3];
+	GLsizei count = 0;
+	DWORD i;
+	if (cmd->dwCount)
+	{
+		for (i = 0; i < cmd->dwCount; i++)
 		{
-		case 0: // Match color
-			if (pixel == dxglcfg.HackAutoExpandViewportValue & 0xFFFFFF) return TRUE;
-			else return FALSE;
-			break;
-		case 1: // Color less than or equal
-			return CompareRGB(pixel, FALSE);
-			break;
-		case 2: // Color greater than or equal
-			return CompareRGB(pixel, TRUE);
-			break;
-		case 3: // Palette/value equal
-		case 6: // Match 3 palette entries
-			if ((pixel & 0xFFFFFF) == (dxglcfg.HackAutoExpandViewportValue & 0xFFFFFF)) return TRUE;
-			else return FALSE;
-			break;
-		case 4: // Palette/value less than or equal
-			if ((pixel & 0xFFFFFF) <= (dxglcfg.HackAutoExpandViewportValue & 0xFFFFFF)) return TRUE;
-			else return FALSE;
-			break;
-		case 5: // Palette/value greater than or equal
-			if ((pixel & 0xFFFFFF) >= (dxglcfg.HackAutoExpandViewportValue & 0xFFFFFF)) return TRUE;
-			else return FALSE;
-			break;
-		default:
-			return FALSE;
+			if ((cmd->lpRects[i].x1 <= 0) && (cmd->lpRects[i].y1 <= 0) &&
+				((DWORD)cmd->lpRects[i].x2 >= mip->ddsd.dwWidth) && ((DWORD)cmd->lpRects[i].y2 >= mip->ddsd.dwHeight)) break;
 		}
-		break;
-	default:
-		return FALSE;
+		if (i == cmd->dwCount) return;
+	}
+	if (cmd->dwFlags & D3DCLEAR_TARGET)
+	{
+		glTexture__Discard(cmd->target, cmd->targetlevel);
+		attachments[count++] = GL_COLOR_ATTACHMENT0;
+	}
+	// A larger depth buffer keeps its contents outside of the render target
+	if (cmd->zbuffer && (cmd->zbuffer->levels[cmd->zlevel].ddsd.dwWidth == mip->ddsd.dwWidth) &&
+		(cmd->zbuffer->levels[cmd->zlevel].ddsd.dwHeight == mip->ddsd.dwHeight))
+	{
+		if (cmd->dwFlags & D3DCLEAR_ZBUFFER) attachments[count++] = GL_DEPTH_ATTACHMENT;
+		if ((cmd->dwFlags & D3DCLEAR_STENCIL) && cmd->zbuffer->zhasstencil) attachments[count++] = GL_STENCIL_ATTACHMENT;
+		if ((cmd->dwFlags & D3DCLEAR_ZBUFFER) && (!cmd->zbuffer->zhasstencil || (cmd->dwFlags & D3DCLEAR_STENCIL)))
+			glTexture__Discard(cmd->zbuffer, cmd->zlevel);
 	}
+	if (count && This->ext->GLEXT_ARB_invalidate_subdata)
+		This->ext->glInvalidateFramebuffer(GL_FRAMEBUFFER, count, attachments);
 }
 
-BOOL Is512448Scale(glRenderer *This, glTexture *primary, glTexture *palette)
+void glRenderer__Clear(glRenderer *This, ClearCommand *cmd)
 {
-	if (dxglcfg.HackAutoExpandViewport)
+	ScopedShaderTiming timing(This->shadertiming, SHADERTIMING_CLEAR, This->shaders->gen3d);
+	This->outputs[0] = (void*)D3D_OK;
+	GLfloat color[4];
+	glTexture *ztexture = NULL;
+	GLint zlevel = 0;
+	GLfloat mulx, muly;
+	GLsizei x1, y1, x2, y2;
+	if (cmd->zbuffer)
+	{
+		ztexture = cmd->zbuffer;
+		zlevel = cmd->zlevel;
+	}
+	dwordto4float(cmd->dwColor,color);
+	do
+	{
+		if (glRenderer__SetRenderTarget(This, cmd->target, ztexture,
+			cmd->targetlevel, zlevel) == GL_FRAMEBUFFER_COMPLETE) break;
+		if (!cmd->target->internalformats[1]) break;
+		glTexture__Repair(cmd->target, TRUE);
+		glUtil_SetFBO(This->util, NULL);
+		cmd->target->levels[cmd->targetlevel].fbo.fbcolor = NULL;
+		cmd->target->levels[cmd->targetlevel].fbo.fbz = NULL;
+	} while (1);
+	glRenderer__DiscardCleared(This, cmd);
+	int clearbits = 0;
+	if(cmd->dwFlags & D3DCLEAR_TARGET)
+	{
+		clearbits |= GL_COLOR_BUFFER_BIT;
+		glUtil_ClearColor(This->util, color[0], color[1], color[2], color[3]);
+	}
+	if(cmd->dwFlags & D3DCLEAR_ZBUFFER)
+	{
+		clearbits |= GL_DEPTH_BUFFER_BIT;
+		glUtil_ClearDepth(This->util, cmd->dvZ);
+		glUtil_DepthWrite(This->util, TRUE);
+	}
+	if(cmd->dwFlags & D3DCLEAR_STENCIL)
+	{
+		clearbits |= GL_STENCIL_BUFFER_BIT;
+		glUtil_ClearStencil(This->util, cmd->dwStencil);
+		glUtil_StencilMask(This->util, 0xFFFFFFFF);
+	}
+	if(cmd->dwCount)
 	{
-		if ((primary->levels[0].ddsd.dwWidth == 640) && (primary->levels[0].ddsd.dwHeight == 480))
+		if (!glRenderer__ClearInstanced(This, cmd, color))
 		{
-			if (primary->levels[0].dirty & 2) glTexture__Download(primary, 0);
-			if (primary->levels[0].ddsd.ddpfPixelFormat.dwRGBBitCount == 8)
+			if ((This->mulx != 1.0f) || (This->muly != 1.0f))
 			{
-				return BorderColorCompare(This, *(DWORD*)primary->levels[0].buffer, (DWORD*)palette->levels[0].buffer, 8);
+				mulx = This->mulx;
+				muly = This->muly;
+				for (DWORD i = 0; i < cmd->dwCount; i++)
+				{
+					x1 = (GLsizei)(((GLfloat)cmd->lpRects[i].x1) * mulx);
+					x2 = ((GLsizei)(((GLfloat)cmd->lpRects[i].x2) * mulx)) - x1;
+					y1 = (GLsizei)(((GLfloat)cmd->lpRects[i].y1) * muly);
+					y2 = ((GLsizei)(((GLfloat)cmd->lpRects[i].y2) * muly)) - y1;
+					glUtil_SetScissor(This->util, TRUE, x1, y1, x2, y2);
+					glClear(clearbits);
+				}
 			}
-			else if (primary->levels[0].ddsd.ddpfPixelFormat.dwRGBBitCount == 16)
+			else
 			{
-				if (primary->levels[0].ddsd.ddpfPixelFormat.dwRBitMask == 0x7FFF)
-					return BorderColorCompare(This, *(DWORD*)primary->levels[0].buffer, NULL, 15);
-				else return BorderColorCompare(This, *(DWORD*)primary->levels[0].buffer, NULL, 16);
+				for (DWORD i = 0; i < cmd->dwCount; i++)
+				{
+					glUtil_SetScissor(This->util, TRUE, cmd->lpRects[i].x1, cmd->lpRects[i].y1,
+						(cmd->lpRects[i].x2 - cmd->lpRects[i].x1), cmd->lpRects[i].y2 - cmd->lpRects[i].y1);
+					glClear(clearbits);
+				}
 			}
-			else return BorderColorCompare(This, *(DWORD*)primary->levels[0].buffer, NULL, 24);
 		}
-		else if ((primary->levels[0].ddsd.dwWidth == 320) && (primary->levels[0].ddsd.dwHeight == 240))
+		glUtil_SetScissor(This->util, false, 0, 0, 0, 0);
+	}
+	else glClear(clearbits);
+	if(cmd->zbuffer) cmd->zbuffer->levels[zlevel].dirty = (cmd->zbuffer->levels[zlevel].dirty | 2) & ~84;
+	cmd->target->levels[cmd->targetlevel].dirty = (cmd->target->levels[cmd->targetlevel].dirty | 2) & ~84;
+	if (cmd->targetlevel) cmd->target->automipmap = FALSE;
+	This->scenetexture = cmd->target;
+	This->scenelevel = cmd->targetlevel;
+	SetEvent(This->busy);
+}
+
+void glRenderer__Flush(glRenderer *This)
+{
+	// The scene is finished, read its render target back only now rather than after every draw
+	if (This->scenetexture) glRenderer__PredictReadback(This, This->scenetexture, This->scenelevel);
+	This->scenetexture = NULL;
+	glFlush();
+	SetEvent(This->busy);
+}
+
+void glRenderer__SetWnd(glRenderer *This, int width, int height, int bpp, int fullscreen, unsigned int frequency, HWND newwnd, BOOL devwnd)
+{
+	if(newwnd != This->hWnd)
+	{
+		// The presenter context is made current on the old window
+		if (This->presenter) Presenter_Delete(This->presenter);
+		// The swap chain belongs to the old window
+		if (This->dxgioutput) DXGIOutput_Delete(This->dxgioutput);
+		This->dxgioutput = NULL;
+		wglMakeCurrent(NULL, NULL);
+		ReleaseDC(This->hWnd,This->hDC);
+		glRenderWindow_Delete(This->RenderWnd);
+		glRenderWindow_Create(width, height, fullscreen, newwnd, This->ddInterface, devwnd, &This->RenderWnd);
+		ZeroMemory(&This->wndrect, sizeof(RECT));
+		PIXELFORMATDESCRIPTOR pfd;
+		GLuint pf;
+		SetGLLock(TRUE);
+		ZeroMemory(&pfd,sizeof(PIXELFORMATDESCRIPTOR));
+		pfd.nSize = sizeof(PIXELFORMATDESCRIPTOR);
+		pfd.nVersion = 1;
+		if (dxglcfg.SingleBufferDevice) pfd.dwFlags = PFD_DRAW_TO_WINDOW | PFD_SUPPORT_OPENGL;
+		else pfd.dwFlags = PFD_DRAW_TO_WINDOW | PFD_SUPPORT_OPENGL | PFD_DOUBLEBUFFER;
+		pfd.iPixelType = PFD_TYPE_RGBA;
+		pfd.cColorBits = bpp;
+		pfd.iLayerType = PFD_MAIN_PLANE;
+		This->hDC = GetDC(This->RenderWnd->hWnd);
+		if(!This->hDC)
+			DEBUG("glRenderer::SetWnd: Can not create hDC\n");
+		pf = ChoosePixelFormat(This->hDC,&pfd);
+		if(!pf)
+			DEBUG("glRenderer::SetWnd: Can not get pixelformat\n");
+		if(!SetPixelFormat(This->hDC,pf,&pfd))
+			DEBUG("glRenderer::SetWnd: Can not set pixelformat\n");
+		if(!wglMakeCurrent(This->hDC,This->hRC))
+			DEBUG("glRenderer::SetWnd: Can not activate GL context\n");
+		SetGLLock(FALSE);
+		glRenderer__SetSwap(This,1);
+		SwapBuffers(This->hDC);
+		DXGLTimer_Delete(&This->timer);
+		DXGLTimer_Init(&This->timer);
+		DXGLTimer_Calibrate(&This->timer, height, frequency);
+		if (DXGLTimer_OpenVBlank(&This->timer, newwnd)) DXGLTimer_CalibrateVBlank(&This->timer);
+		glRenderer__SetSwap(This,0);
+		glUtil_SetViewport(This->util, 0, 0, width, height);
+		if (dxglcfg.FlipModelPresent && newwnd && This->ext->GLEXT_ARB_framebuffer_object)
+			This->dxgioutput = DXGIOutput_Create(This->RenderWnd->hWnd);
+		if (This->presenter && (This->dxgioutput || !Presenter_Init(This->presenter, This, dxglcfg.PresentQueueDepth)))
 		{
-			if (primary->levels[0].dirty & 2) glTexture__Download(primary, 0);
-			if (primary->levels[0].ddsd.ddpfPixelFormat.dwRGBBitCount == 8)
-			{
-				return BorderColorCompare(This, *(DWORD*)primary->levels[0].buffer, (DWORD*)palette->levels[0].buffer, 8);
-			}
-			else if (primary->levels[0].ddsd.ddpfPixelFormat.dwRGBBitCount == 16)
-			{
-				if (primary->levels[0].ddsd.ddpfPixelFormat.dwRBitMask == 0x7FFF)
-					return BorderColorCompare(This, *(DWORD*)primary->levels[0].buffer, NULL, 15);
-				else return BorderColorCompare(This, *(DWORD*)primary->levels[0].buffer, NULL, 16);
-			}
-			else return BorderColorCompare(This, *(DWORD*)primary->levels[0].buffer, NULL, 24);
+			free(This->presenter);
+			This->presenter = NULL;
 		}
-		else return FALSE;
 	}
-	else return FALSE;
+	This->wndchanged = TRUE;
+	if (dxglpolicy.postsizeauto)
+	{
+		if (width <= 400) This->postsizex = 2.0f;
+		else This->postsizex = 1.0f;
+		if (height <= 300) This->postsizey = 2.0f;
+		else This->postsizey = 1.0f;
+	}
+	else
+	{
+		This->postsizex = dxglcfg.postsizex;
+		This->postsizey = dxglcfg.postsizey;
+	}
+	SetEvent(This->busy);
+}
+
+void glRenderer__SetBlend(glRenderer *This, DWORD src, DWORD dest)
+{
+	GLenum glsrc, gldest;
+	bool bothalpha = false;
+	switch(src)
+	{
+	case D3DBLEND_ZERO:
+		glsrc = GL_ZERO;
+		break;
+	case D3DBLEND_ONE:
+	default:
+		glsrc = GL_ONE;
+		break;
+	case D3DBLEND_SRCCOLOR:
+		glsrc = GL_SRC_COLOR;
+		break;
+	case D3DBLEND_INVSRCCOLOR:
+		glsrc = GL_ONE_MINUS_SRC_COLOR;
+		break;
+	case D3DBLEND_SRCALPHA:
+		glsrc = GL_SRC_ALPHA;
+		break;
+	case D3DBLEND_INVSRCALPHA:
+		glsrc = GL_ONE_MINUS_SRC_ALPHA;
+		break;
+	case D3DBLEND_DESTALPHA:
+		glsrc = GL_DST_ALPHA;
+		break;
+	case D3DBLEND_INVDESTALPHA:
+		glsrc = GL_ONE_MINUS_DST_ALPHA;
+		break;
+	case D3DBLEND_DESTCOLOR:
+		glsrc = GL_DST_COLOR;
+		break;
+	case D3DBLEND_INVDESTCOLOR:
+		glsrc = GL_ONE_MINUS_DST_COLOR;
+		break;
+	case D3DBLEND_SRCALPHASAT:
+		glsrc = GL_SRC_ALPHA_SATURATE;
+		break;
+	case D3DBLEND_BOTHSRCALPHA:
+		bothalpha = true;
+		glsrc = GL_SRC_ALPHA;
+		gldest = GL_ONE_MINUS_SRC_ALPHA;
+		break;
+	case D3DBLEND_BOTHINVSRCALPHA:
+		bothalpha = true;
+		glsrc = GL_ONE_MINUS_SRC_ALPHA;
+		gldest = GL_SRC_ALPHA;
+		break;
+	}
+
+	if(!bothalpha) switch(dest)
+	{
+	case D3DBLEND_ZERO:
+	default:
+		gldest = GL_ZERO;
+		break;
+	case D3DBLEND_ONE:
+		gldest = GL_ONE;
+		break;
+	case D3DBLEND_SRCCOLOR:
+		gldest = GL_SRC_COLOR;
+		break;
+	case D3DBLEND_INVSRCCOLOR:
+		gldest = GL_ONE_MINUS_SRC_COLOR;
+		break;
+	case D3DBLEND_SRCALPHA:
+		gldest = GL_SRC_ALPHA;
+		break;
+	case D3DBLEND_INVSRCALPHA:
+		gldest = GL_ONE_MINUS_SRC_ALPHA;
+		break;
+	case D3DBLEND_DESTALPHA:
+		gldest = GL_DST_ALPHA;
+		break;
+	case D3DBLEND_INVDESTALPHA:
+		gldest = GL_ONE_MINUS_DST_ALPHA;
+		break;
+	case D3DBLEND_DESTCOLOR:
+		gldest = GL_DST_COLOR;
+		break;
+	case D3DBLEND_INVDESTCOLOR:
+		gldest = GL_ONE_MINUS_DST_COLOR;
+		break;
+	case D3DBLEND_SRCALPHASAT:
+		gldest = GL_SRC_ALPHA_SATURATE;
+		break;
+	case D3DBLEND_BOTHSRCALPHA:
+		bothalpha = true;
+		glsrc = GL_SRC_ALPHA;
+		gldest = GL_ONE_MINUS_SRC_ALPHA;
+		break;
+	case D3DBLEND_BOTHINVSRCALPHA:
+		bothalpha = true;
+		glsrc = GL_ONE_MINUS_SRC_ALPHA;
+		gldest = GL_SRC_ALPHA;
+		break;
+	}
+	glUtil_BlendFunc(This->util, glsrc, gldest);
 }
 
-static BOOL(WINAPI *__UpdateLayeredWindow)(HWND hWnd, HDC hdcDst, POINT *pptDst, SIZE *psize,
-	HDC hdcSrc, POINT *pptSrc, COLORREF crKey, BLENDFUNCTION *pblend, DWORD dwFlags) = NULL;
-static BOOL UpdateLayeredWindowFail = FALSE;
-static BOOL WINAPI _UpdateLayeredWindow(HWND hWnd, HDC hdcDst, POINT *pptDst, SIZE *psize,
-	HDC hdcSrc, POINT *pptSrc, COLORREF crKey, BLENDFUNCTION *pblend, DWORD dwFlags)
+/**
+  * Decodes a flexible vertex format into the offsets of its vertex components
+  * and the shader state bits it selects, so draws in the same format as the
+  * last one do not have to decode it again.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param fvf
+  *  Flexible vertex format to decode
+  */
+void glRenderer__UpdateFVF(glRenderer *This, DWORD fvf)
 {
-	HANDLE hUser32;
-	if (!__UpdateLayeredWindow)
+	static const int texsizes[4] = { 2, 3, 4, 1 };
+	GLsizei offset = 0;
+	int blendweights = 0;
+	int numtex;
+	int i;
+	This->last_fvf = fvf;
+	This->shaderkeydirty = TRUE;
+	This->fvf_stateid = 0;
+	for (i = 0; i < 18; i++)
+		This->fvf_offsets[i] = -1;
+	switch (fvf & D3DFVF_POSITION_MASK)
 	{
-		if (UpdateLayeredWindowFail) return FALSE;
-		hUser32 = GetModuleHandle(_T("user32.dll"));
-		if (!hUser32)
-		{
-			UpdateLayeredWindowFail = TRUE;
-			return FALSE;
-		}
-		__UpdateLayeredWindow = (BOOL(WINAPI*)(HWND,HDC,POINT*,SIZE*,HDC,POINT*,COLORREF,BLENDFUNCTION*,DWORD))
-			GetProcAddress((HMODULE)hUser32, "UpdateLayeredWindow");
-		if (!__UpdateLayeredWindow)
+	case 0: // Missing vertex position
+		This->fvf_stride = 0;
+		return;
+	case D3DFVF_XYZ:
+		This->fvf_offsets[0] = 0;
+		offset = 3 * sizeof(GLfloat);
+		if (fvf & D3DFVF_RESERVED1) offset += sizeof(DWORD);
+		break;
+	case D3DFVF_XYZRHW:
+		This->fvf_offsets[0] = 0;
+		This->fvf_offsets[1] = 3 * sizeof(GLfloat);
+		offset = 4 * sizeof(GLfloat);
+		This->fvf_stateid |= (1i64 << 50);
+		break;
+	default: // Blend weights follow the position
+		This->fvf_offsets[0] = 0;
+		offset = 3 * sizeof(GLfloat);
+		blendweights = ((fvf & D3DFVF_POSITION_MASK) >> 1) - 2;
+		for (i = 0; i < blendweights; i++)
 		{
-			UpdateLayeredWindowFail = TRUE;
-			return NULL;
+			This->fvf_offsets[i + 2] = offset;
+			offset += sizeof(GLfloat);
 		}
+		This->fvf_stateid |= (__int64)blendweights << 46;
+		break;
 	}
-	return __UpdateLayeredWindow(hWnd, hdcDst, pptDst, psize, hdcSrc, pptSrc, crKey, pblend, dwFlags);
-}
-
-void glRenderer__DrawScreen(glRenderer *This, glTexture *texture, glTexture *paltex, GLint vsync, glTexture *previous, BOOL setsync, BOOL settime, OVERLAY *overlays, int overlaycount)
-{
-	GLScopedDebugMarker scope("DrawScreen");
-	int progtype;
-	RECT r, r2;
-	int i;
-	unsigned __int64 shaderid;
-	BltCommand bltcmd;
-	glTexture *primary = texture;
-	BOOL scale512448 = Is512448Scale(This, texture, paltex);
-	if (overlays && overlaycount)
+	if (fvf & D3DFVF_NORMAL)
 	{
-		if (!This->overlays)
-		{
-			This->overlays = (OVERLAY *)malloc(overlaycount * sizeof(OVERLAY));
-			This->overlaycount = overlaycount;
-		}
-		else
-		{
-			if (overlaycount != This->overlaycount)
-			{
-				This->overlays = (OVERLAY*)realloc(This->overlays, overlaycount * sizeof(OVERLAY));
-				This->overlaycount = overlaycount;
-			}
-		}
-		memcpy(This->overlays, overlays, overlaycount * sizeof(OVERLAY));
+		This->fvf_offsets[7] = offset;
+		offset += 3 * sizeof(GLfloat);
+		This->fvf_stateid |= (1i64 << 37);
 	}
-	if (overlaycount == -1)
+	if (fvf & D3DFVF_DIFFUSE)
 	{
-		ZeroMemory(This->overlays, This->overlaycount * sizeof(OVERLAY));
-		This->overlaycount = 0;
+		This->fvf_offsets[8] = offset;
+		offset += sizeof(DWORD);
+		This->fvf_stateid |= (1i64 << 35);
 	}
-	glUtil_BlendEnable(This->util, FALSE);
-	if (previous) previous->levels[0].ddsd.ddsCaps.dwCaps &= ~DDSCAPS_FRONTBUFFER;
-	texture->levels[0].ddsd.ddsCaps.dwCaps |= DDSCAPS_FRONTBUFFER;
-	if((texture->levels[0].ddsd.ddsCaps.dwCaps & DDSCAPS_PRIMARYSURFACE))
+	if (fvf & D3DFVF_SPECULAR)
 	{
-		_GetClientRect(This->hWnd,&r);
-		GetClientRect(This->RenderWnd->hWnd,&r2);
-		if(memcmp(&r2,&r,sizeof(RECT)))
-		SetWindowPos(This->RenderWnd->hWnd,NULL,0,0,r.right,r.bottom,SWP_SHOWWINDOW);
+		This->fvf_offsets[9] = offset;
+		offset += sizeof(DWORD);
+		This->fvf_stateid |= (1i64 << 36);
 	}
-	glUtil_DepthTest(This->util, FALSE);
-	RECT *viewrect = &r2;
-	glRenderer__SetSwap(This,vsync);
-	LONG sizes[6];
-	GLfloat view[4];
-	GLint viewport[4];
-	if(texture->levels[0].dirty & 1) glTexture__Upload(texture, 0);
-	if(texture->levels[0].ddsd.ddsCaps.dwCaps & DDSCAPS_PRIMARYSURFACE)
+	numtex = (fvf & D3DFVF_TEXCOUNT_MASK) >> D3DFVF_TEXCOUNT_SHIFT;
+	if (numtex > 8) numtex = 8;
+	for (i = 0; i < 8; i++)
 	{
-		if(glDirectDraw7_GetFullscreen(This->ddInterface))
-		{
-			glDirectDraw7_GetSizes(This->ddInterface, sizes);
-			if (_isnan(dxglcfg.postsizex) || _isnan(dxglcfg.postsizey) ||
-				(dxglcfg.postsizex < 0.25f) || (dxglcfg.postsizey < 0.25f))
-			{
-				if (sizes[2] <= 400) This->postsizex = 2.0f;
-				else This->postsizex = 1.0f;
-				if (sizes[3] <= 300) This->postsizey = 2.0f;
-				else This->postsizey = 1.0f;
-			}
-			else
-			{
-				This->postsizex = dxglcfg.postsizex;
-				This->postsizey = dxglcfg.postsizey;
-			}
-			viewport[0] = viewport[1] = 0;
-			viewport[2] = sizes[4];
-			viewport[3] = sizes[5];
-			view[0] = (GLfloat)-(sizes[4]-sizes[0])/2;
-			view[1] = (GLfloat)(sizes[4]-sizes[0])/2+sizes[0];
-			view[2] = (GLfloat)(sizes[5]-sizes[1])/2+sizes[1];
-			view[3] = (GLfloat)-(sizes[5]-sizes[1])/2;
-		}
-		else
+		if (i < numtex)
 		{
-			This->postsizex = 1.0f;
-			This->postsizey = 1.0f;
-			viewport[0] = viewport[1] = 0;
-			viewport[2] = viewrect->right;
-			viewport[3] = viewrect->bottom;
-			ClientToScreen(This->RenderWnd->hWnd,(LPPOINT)&viewrect->left);
-			ClientToScreen(This->RenderWnd->hWnd,(LPPOINT)&viewrect->right);
-			OffsetRect(viewrect, 0 - This->xoffset, 0 -	This->yoffset);
-			if ((dxglcfg.WindowScaleX != 1.0f) || (dxglcfg.WindowScaleY != 1.0f))
-			{
-				viewrect->left = (LONG)((float)viewrect->left / dxglcfg.WindowScaleX);
-				viewrect->top = (LONG)((float)viewrect->top / dxglcfg.WindowScaleY);
-				viewrect->right = (LONG)((float)viewrect->right / dxglcfg.WindowScaleX);
-				viewrect->bottom = (LONG)((float)viewrect->bottom / dxglcfg.WindowScaleY);
-			}
-			view[0] = (GLfloat)viewrect->left;
-			view[1] = (GLfloat)viewrect->right;
-			view[2] = (GLfloat)texture->levels[0].ddsd.dwHeight-(GLfloat)viewrect->top;
-			view[3] = (GLfloat)texture->levels[0].ddsd.dwHeight-(GLfloat)viewrect->bottom;
+			This->fvf_texformats[i] = texsizes[(fvf >> (16 + (2 * i))) & 3];
+			This->fvf_offsets[i + 10] = offset;
+			offset += This->fvf_texformats[i] * sizeof(GLfloat);
 		}
+		else This->fvf_texformats[i] = 2;
+		This->fvf_texstageid[i] = (__int64)(This->fvf_texformats[i] - 1) << 51;
 	}
-	else
+	// Shaders declare all eight sets, the ones the format lacks are left unbound
+	This->fvf_stateid |= (7i64 << 31) | (1i64 << 34);
+	This->fvf_stride = offset;
+}
+
+/**
+  * Lists the streams of strided vertex data that the current vertex format
+  * reads, with where each goes in an interleaved vertex.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param strided
+  *  Vertex component pointers and strides of the draw
+  * @param components
+  *  Receives up to 12 streams
+  * @param offsets
+  *  Receives the offset of each stream in an interleaved vertex
+  * @param sizes
+  *  Receives the size in bytes of each stream's data in one vertex
+  * @return
+  *  Number of streams
+  */
+static int glRenderer__GetStridedComponents(glRenderer *This, LPD3DDRAWPRIMITIVESTRIDEDDATA strided,
+	D3DDP_PTRSTRIDE **components, GLintptr *offsets, GLsizei *sizes)
+{
+	int numcomponents = 0;
+	int j;
+	// The position carries the reciprocal W or blend weights that follow it
+	components[numcomponents] = &strided->position;
+	offsets[numcomponents] = 0;
+	if (This->fvf_offsets[7] != -1) sizes[numcomponents++] = (GLsizei)This->fvf_offsets[7];
+	else if (This->fvf_offsets[8] != -1) sizes[numcomponents++] = (GLsizei)This->fvf_offsets[8];
+	else if (This->fvf_offsets[9] != -1) sizes[numcomponents++] = (GLsizei)This->fvf_offsets[9];
+	else if (This->fvf_offsets[10] != -1) sizes[numcomponents++] = (GLsizei)This->fvf_offsets[10];
+	else sizes[numcomponents++] = This->fvf_stride;
+	if (This->fvf_offsets[7] != -1)
 	{
-		view[0] = 0;
-		view[1] = (GLfloat)texture->levels[0].ddsd.dwWidth;
-		view[2] = 0;
-		view[3] = (GLfloat)texture->levels[0].ddsd.dwHeight;
-	}
-	glUtil_SetFBO(This->util, NULL);
-	glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
-	if(This->ddInterface->primarybpp == 8)
-	{
-		ShaderManager_SetShader(This->shaders,PROG_PAL256,NULL,0);
-		progtype = PROG_PAL256;
-		glTexture__Upload(paltex, 0);
-		This->ext->glUniform1i(This->shaders->shaders[progtype].tex0,8);
-		This->ext->glUniform1i(This->shaders->shaders[progtype].pal,9);
-		glUtil_SetTexture(This->util,8,texture);
-		glUtil_SetTexture(This->util,9,paltex);
-		if(dxglcfg.scalingfilter || (This->postsizex != 1.0f) || (This->postsizey != 1.0f))
-		{
-			glRenderer__DrawBackbuffer(This,&texture,texture->levels[0].ddsd.dwWidth,texture->levels[0].ddsd.dwHeight,progtype,TRUE,TRUE,0);
-			ShaderManager_SetShader(This->shaders,PROG_TEXTURE,NULL,0);
-			progtype = PROG_TEXTURE;
-			glUtil_SetTexture(This->util,8,texture);
-			This->ext->glUniform1i(This->shaders->shaders[progtype].tex0,8);
-		}
+		components[numcomponents] = &strided->normal;
+		offsets[numcomponents] = This->fvf_offsets[7];
+		sizes[numcomponents++] = 3 * sizeof(GLfloat);
 	}
-	else
+	if (This->fvf_offsets[8] != -1)
 	{
-		if ((This->postsizex != 1.0f) || (This->postsizey != 1.0f))
-		{
-			progtype = PROG_TEXTURE;
-			ShaderManager_SetShader(This->shaders, PROG_TEXTURE, NULL, 0);
-			glRenderer__DrawBackbuffer(This, &texture, texture->levels[0].ddsd.dwWidth, texture->levels[0].ddsd.dwHeight, progtype, FALSE, TRUE, 0);
-			glUtil_SetTexture(This->util, 8, texture);
-			This->ext->glUniform1i(This->shaders->shaders[progtype].tex0, 0);
-		}
-		ShaderManager_SetShader(This->shaders,PROG_TEXTURE,NULL,0);
-		progtype = PROG_TEXTURE;
-		glUtil_SetTexture(This->util,8,texture);
-		This->ext->glUniform1i(This->shaders->shaders[progtype].tex0,8);
+		components[numcomponents] = &strided->diffuse;
+		offsets[numcomponents] = This->fvf_offsets[8];
+		sizes[numcomponents++] = sizeof(DWORD);
 	}
-	if (dxglcfg.scalingfilter) glTexture__SetFilter(texture, 8, GL_LINEAR, GL_LINEAR, This);
-	else glTexture__SetFilter(texture, 8, GL_NEAREST, GL_NEAREST, This);
-	glUtil_SetViewport(This->util,viewport[0],viewport[1],viewport[2],viewport[3]);
-	This->ext->glUniform4f(This->shaders->shaders[progtype].view,view[0],view[1],view[2],view[3]);
-	if(glDirectDraw7_GetFullscreen(This->ddInterface))
+	if (This->fvf_offsets[9] != -1)
 	{
-		This->bltvertices[0].x = This->bltvertices[2].x = (float)sizes[0];
-		This->bltvertices[0].y = This->bltvertices[1].y = This->bltvertices[1].x = This->bltvertices[3].x = 0.;
-		This->bltvertices[2].y = This->bltvertices[3].y = (float)sizes[1];
+		components[numcomponents] = &strided->specular;
+		offsets[numcomponents] = This->fvf_offsets[9];
+		sizes[numcomponents++] = sizeof(DWORD);
 	}
-	else
+	for (j = 0; j < 8; j++)
 	{
-		This->bltvertices[0].x = This->bltvertices[2].x = (float)texture->levels[0].ddsd.dwWidth;
-		This->bltvertices[0].y = This->bltvertices[1].y = This->bltvertices[1].x = This->bltvertices[3].x = 0.;
-		This->bltvertices[2].y = This->bltvertices[3].y = (float)texture->levels[0].ddsd.dwHeight;
+		if (This->fvf_offsets[j + 10] == -1) continue;
+		components[numcomponents] = &strided->textureCoords[j];
+		offsets[numcomponents] = This->fvf_offsets[j + 10];
+		sizes[numcomponents++] = This->fvf_texformats[j] * sizeof(GLfloat);
 	}
-	if (scale512448)
+	return numcomponents;
+}
+
+/**
+  * Copies strided vertex data into interleaved vertices in the layout of the
+  * current vertex format.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param strided
+  *  Vertex component pointers and strides of the draw
+  * @param count
+  *  Number of vertices
+  * @param dest
+  *  Buffer for the interleaved vertices, fvf_stride * count bytes
+  */
+static void glRenderer__GatherStrided(glRenderer *This, LPD3DDRAWPRIMITIVESTRIDEDDATA strided, DWORD count, BYTE *dest)
+{
+	D3DDP_PTRSTRIDE *components[12];
+	GLintptr offsets[12];
+	GLsizei sizes[12];
+	int numcomponents = glRenderer__GetStridedComponents(This, strided, components, offsets, sizes);
+	DWORD i;
+	int j;
+	for (j = 0; j < numcomponents; j++)
 	{
-		if (dxglcfg.HackAutoExpandViewport == 1)
-		{
-			This->bltvertices[0].s = This->bltvertices[2].s = 0.9f;
-			This->bltvertices[0].t = This->bltvertices[1].t = 0.966666667f;
-			This->bltvertices[1].s = This->bltvertices[3].s = 0.1f;
-			This->bltvertices[2].t = This->bltvertices[3].t = 0.0333333333f;
-		}
-		else if (dxglcfg.HackAutoExpandViewport == 2)
+		if (!components[j]->lpvData)
 		{
-			This->bltvertices[0].s = This->bltvertices[2].s = 0.9f;
-			This->bltvertices[1].s = This->bltvertices[3].s = 0.1f;
+			for (i = 0; i < count; i++)
+				ZeroMemory(dest + (i * This->fvf_stride) + offsets[j], sizes[j]);
 		}
+		else for (i = 0; i < count; i++)
+			memcpy(dest + (i * This->fvf_stride) + offsets[j],
+				(BYTE*)components[j]->lpvData + (i * components[j]->dwStride), sizes[j]);
 	}
-	else
-	{
-		This->bltvertices[0].s = This->bltvertices[0].t = This->bltvertices[1].t = This->bltvertices[2].s = 1.;
-		This->bltvertices[1].s = This->bltvertices[2].t = This->bltvertices[3].s = This->bltvertices[3].t = 0.;
-	}
-	glUtil_EnableArray(This->util, This->shaders->shaders[progtype].pos, TRUE);
-	This->ext->glVertexAttribPointer(This->shaders->shaders[progtype].pos,2,GL_FLOAT,GL_FALSE,sizeof(BltVertex),&This->bltvertices[0].x);
-	glUtil_EnableArray(This->util, This->shaders->shaders[progtype].texcoord, TRUE);
-	This->ext->glVertexAttribPointer(This->shaders->shaders[progtype].texcoord,2,GL_FLOAT,GL_FALSE,sizeof(BltVertex),&This->bltvertices[0].s);
-	glUtil_SetCull(This->util, D3DCULL_NONE);
-	glUtil_SetPolyMode(This->util, D3DFILL_SOLID);
-	This->ext->glDrawRangeElements(GL_TRIANGLE_STRIP,0,3,4,GL_UNSIGNED_SHORT,bltindices);
-	if (This->overlays)
+}
+
+/**
+  * Reserves space in one of the streaming buffers of the command buffer,
+  * moving on to the next region and waiting for it if the current one is full.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param buffer
+  *  Streaming buffer to write to
+  * @param target
+  *  Binding point to use when orphaning the buffer
+  * @param ptr
+  *  Pointer to the write offset of the buffer
+  * @param segment
+  *  Pointer to the index of the region currently being written
+  * @param fences
+  *  Fences guarding each region of the buffer
+  * @param size
+  *  Size of the space to reserve in bytes
+  * @param align
+  *  Alignment of the space in bytes, need not be a power of two
+  * @return
+  *  Offset of the space in the buffer, or -1 if it does not fit in a region
+  */
+static GLintptr glRenderer__StreamReserve(glRenderer *This, BufferObject *buffer, GLenum target, size_t *ptr,
+	int *segment, GLsync *fences, GLsizeiptr size, GLsizeiptr align)
+{
+	GLsizeiptr segsize = buffer->size / STREAMBUFFER_SEGMENTS;
+	GLintptr offset = ((*ptr + align - 1) / align) * align;
+	if (size + align > segsize) return -1;
+	if (offset + size > (*segment + 1) * segsize)
 	{
-		ZeroMemory(&bltcmd, sizeof(BltCommand));
-		for (i = 0; i < This->overlaycount; i++)
+		*segment = (*segment + 1) % STREAMBUFFER_SEGMENTS;
+		if (buffer->mapped)
 		{
-			if (This->overlays[i].enabled)
+			// Fence the region just filled and wait until the GPU is done with the next one
+			fences[(*segment + STREAMBUFFER_SEGMENTS - 1) % STREAMBUFFER_SEGMENTS] =
+				This->ext->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			if (fences[*segment])
 			{
-				bltcmd.flags = 0x80000000;
-				if (This->overlays[i].flags & DDOVER_DDFX)
-				{
-					if (This->overlays[i].flags & DDOVER_KEYDEST) bltcmd.flags |= DDBLT_KEYDEST;
-					if (This->overlays[i].flags & DDOVER_KEYDESTOVERRIDE)
-					{
-						bltcmd.flags |= DDBLT_KEYDESTOVERRIDE;
-						bltcmd.destkey = This->overlays[i].fx.dckDestColorkey;
-					}
-					if (This->overlays[i].flags & DDOVER_KEYSRC) bltcmd.flags |= DDBLT_KEYSRC;
-					if (This->overlays[i].flags & DDOVER_KEYSRCOVERRIDE)
-					{
-						bltcmd.flags |= DDBLT_KEYSRCOVERRIDE;
-						bltcmd.srckey = This->overlays[i].fx.dckSrcColorkey;
-					}
-				}
-				if (primary->levels[0].ddsd.dwFlags & DDSD_CKDESTOVERLAY)
-				{
-					bltcmd.flags |= DDBLT_KEYDEST;
-				}
-				shaderid = bltcmd.flags;
-				shaderid |= ((long long)This->overlays[i].texture->blttype << 32);
-				shaderid |= ((long long)texture->blttype << 40);
-				bltcmd.src = This->overlays[i].texture;
-				bltcmd.srclevel = 0;
-				bltcmd.srcrect = This->overlays[i].srcrect;
-				bltcmd.dest = primary;
-				bltcmd.destlevel = 0;
-				bltcmd.destrect = This->overlays[i].destrect;
-				glRenderer__Blt(This, &bltcmd, TRUE);
+				while (This->ext->glClientWaitSync(fences[*segment], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000)
+					== GL_TIMEOUT_EXPIRED);
+				This->ext->glDeleteSync(fences[*segment]);
+				fences[*segment] = NULL;
 			}
 		}
+		else if (!*segment) BufferObject_SetData(buffer, target, buffer->size, NULL, GL_STREAM_DRAW);
+		offset = (((*segment * segsize) + align - 1) / align) * align;
 	}
-	if(dxglcfg.SingleBufferDevice) glFlush();
-	if(This->hWnd) SwapBuffers(This->hDC);
+	*ptr = offset + size;
+	return offset;
+}
+
+/**
+  * Copies data into one of the streaming buffers of the command buffer.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param buffer
+  *  Streaming buffer to write to
+  * @param target
+  *  Binding point to use when mapping the buffer
+  * @param ptr
+  *  Pointer to the write offset of the buffer
+  * @param segment
+  *  Pointer to the index of the region currently being written
+  * @param fences
+  *  Fences guarding each region of the buffer
+  * @param data
+  *  Data to copy into the buffer
+  * @param size
+  *  Size of the data in bytes
+  * @param align
+  *  Alignment of the data in the buffer in bytes
+  * @return
+  *  Offset of the data in the buffer, or -1 if it could not be written
+  */
+static GLintptr glRenderer__StreamData(glRenderer *This, BufferObject *buffer, GLenum target, size_t *ptr,
+	int *segment, GLsync *fences, const void *data, GLsizeiptr size, GLsizeiptr align)
+{
+	GLintptr offset = glRenderer__StreamReserve(This, buffer, target, ptr, segment, fences, size, align);
+	void *dest;
+	if (offset == -1) return -1;
+	if (buffer->mapped) memcpy(buffer->pointer + offset, data, size);
 	else
 	{
-		glReadBuffer(GL_FRONT);
-		BufferObject_Bind(This->pbo, GL_PIXEL_PACK_BUFFER);
-		GLint packalign;
-		glGetIntegerv(GL_PACK_ALIGNMENT,&packalign);
-		glPixelStorei(GL_PACK_ALIGNMENT,1);
-		glDirectDraw7_GetSizes(This->ddInterface, sizes);
-		glReadPixels(0,0,sizes[4],sizes[5],GL_BGRA,GL_UNSIGNED_BYTE,0);
-		BufferObject_Map(This->pbo, GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
-		GLubyte *pixels = (GLubyte*)This->pbo->pointer;
-		for(int i = 0; i < sizes[5];i++)
-		{
-			memcpy(&This->dib.pixels[This->dib.pitch*i],
-				&pixels[((sizes[5]-1)-i)*(sizes[4]*4)],sizes[4]*4);
-		}
-		BufferObject_Unmap(This->pbo, GL_PIXEL_PACK_BUFFER);
-		BufferObject_Unbind(This->pbo, GL_PIXEL_PACK_BUFFER);
-		glPixelStorei(GL_PACK_ALIGNMENT,packalign);
-		HDC hRenderDC = (HDC)::GetDC(This->RenderWnd->hWnd);
-		HGDIOBJ hPrevObj = 0;
-		POINT dest = {0,0};
-		POINT srcpoint = {0,0};
-		SIZE wnd = {This->dib.width,This->dib.height};
-		BLENDFUNCTION func = {AC_SRC_OVER,0,255,AC_SRC_ALPHA};
-		hPrevObj = SelectObject(This->dib.hdc,This->dib.hbitmap);
-		ClientToScreen(This->RenderWnd->hWnd,&dest);
-		_UpdateLayeredWindow(This->RenderWnd->hWnd,hRenderDC,&dest,&wnd,
-			This->dib.hdc,&srcpoint,0,&func,ULW_ALPHA);
-		SelectObject(This->dib.hdc,hPrevObj);
-		ReleaseDC(This->RenderWnd->hWnd,hRenderDC);
+		dest = BufferObject_MapRange(buffer, target, offset, size,
+			GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+		if (!dest) return -1;
+		memcpy(dest, data, size);
+		BufferObject_Unmap(buffer, target);
 	}
-	if(setsync) SetEvent(This->busy);
-	if(settime) DXGLTimer_SetLastDraw(&This->timer);
+	return offset;
 }
 
-void glRenderer__DeleteTexture(glRenderer *This, glTexture *texture)
+/**
+  * Reserves space in the persistently mapped unpack buffer for texture data.
+  * The space may be written until the next call, then it is owned by the GPU
+  * until the fence of its region signals.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param size
+  *  Size of the texture data in bytes
+  * @param offset
+  *  Receives the offset to pass to glTexSubImage2D with the unpack buffer bound
+  * @return
+  *  Pointer to write the texture data to, or NULL if the texture should use its
+  *  own pixel buffer
+  */
+GLbyte *glRenderer__StreamUnpack(glRenderer *This, GLsizeiptr size, GLintptr *offset)
 {
-	glTexture__Destroy(texture);
-	SetEvent(This->busy);
+	CmdBuffer *buffer = &This->cmdbuffer[0];
+	if (!buffer->unpackstreaming) return NULL;
+	*offset = glRenderer__StreamReserve(This, buffer->pixelunpack, GL_PIXEL_UNPACK_BUFFER, &buffer->unpackptr,
+		&buffer->unpacksegment, buffer->unpackfences, size, 16);
+	if (*offset == -1) return NULL;
+	return buffer->pixelunpack->pointer + *offset;
 }
 
-__int64 InitShaderState(glRenderer *renderer, DWORD *renderstate, TEXTURESTAGE *texstages, D3DLIGHT7 *lights)
-{
-	int i;
-	__int64 shader = 0;
-	switch (renderstate[D3DRENDERSTATE_SHADEMODE])
-	{
-	case D3DSHADE_FLAT:
-	default:
-		break;
-	case D3DSHADE_GOURAUD:
-		shader |= 1;
-		break;
-	case D3DSHADE_PHONG:
-		shader |= 3;
-		break;
-	}
-	if (renderstate[D3DRENDERSTATE_ALPHATESTENABLE]) shader |= 4;
-	shader |= ((((__int64)renderstate[D3DRENDERSTATE_ALPHAFUNC] - 1) & 7) << 3);
-	shader |= (((__int64)renderstate[D3DRENDERSTATE_FOGTABLEMODE] & 3) << 6);
-	shader |= (((__int64)renderstate[D3DRENDERSTATE_FOGVERTEXMODE] & 3) << 8);
-	if (renderstate[D3DRENDERSTATE_RANGEFOGENABLE]) shader |= (1i64 << 10);
-	if (renderstate[D3DRENDERSTATE_SPECULARENABLE]) shader |= (1i64 << 11);
-	if (renderstate[D3DRENDERSTATE_STIPPLEDALPHA]) shader |= (1i64 << 12);
-	if (renderstate[D3DRENDERSTATE_COLORKEYENABLE]) shader |= (1i64 << 13);
-	shader |= (((__int64)renderstate[D3DRENDERSTATE_ZBIAS] & 15) << 14);
-	int numlights = 0;
-	for (i = 0; i < 8; i++)
-		if (lights[i].dltType) numlights++;
-	shader |= (__int64)numlights << 18;
-	if (renderstate[D3DRENDERSTATE_LOCALVIEWER]) shader |= (1i64 << 21);
-	if (renderstate[D3DRENDERSTATE_COLORKEYBLENDENABLE]) shader |= (1i64 << 22);
-	shader |= (((__int64)renderstate[D3DRENDERSTATE_DIFFUSEMATERIALSOURCE] & 3) << 23);
-	shader |= (((__int64)renderstate[D3DRENDERSTATE_SPECULARMATERIALSOURCE] & 3) << 25);
-	shader |= (((__int64)renderstate[D3DRENDERSTATE_AMBIENTMATERIALSOURCE] & 3) << 27);
-	shader |= (((__int64)renderstate[D3DRENDERSTATE_EMISSIVEMATERIALSOURCE] & 3) << 29);
-	int lightindex = 0;
-	for (i = 0; i < 8; i++)
-	{
-		if (lights[i].dltType)
-		{
-			if (lights[i].dltType != D3DLIGHT_DIRECTIONAL)
-				shader |= (1i64 << (38 + lightindex));
-			if (lights[i].dltType == D3DLIGHT_SPOT)
-				shader |= (1i64 << (51 + lightindex));
-			lightindex++;
-		}
-	}
-	if (renderstate[D3DRENDERSTATE_NORMALIZENORMALS]) shader |= (1i64 << 49);
-	if (renderstate[D3DRENDERSTATE_TEXTUREMAPBLEND] == D3DTBLEND_MODULATE)
-	{
-		bool noalpha = false;;
-		if (!texstages[0].texture) noalpha = true;
-		if (texstages[0].texture)
-			if (!(texstages[0].texture->levels[0].ddsd.ddpfPixelFormat.dwFlags & DDPF_ALPHAPIXELS))
-				noalpha = true;
-		if (noalpha) texstages[0].alphaop = D3DTOP_SELECTARG2;
-		else texstages[0].alphaop = D3DTOP_MODULATE;
-	}
-	if (renderstate[D3DRENDERSTATE_LIGHTING]) shader |= (1i64 << 59);
-	if (renderstate[D3DRENDERSTATE_COLORVERTEX]) shader |= (1i64 << 60);
-	if (renderstate[D3DRENDERSTATE_FOGENABLE]) shader |= (1i64 << 61);
-	if (renderstate[D3DRENDERSTATE_DITHERENABLE]) shader |= (1i64 << 62);
+/**
+  * Times uploads of a test texture through the shared unpack buffer against
+  * uploads straight from system memory.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param buffer
+  *  Command buffer with a persistently mapped unpack buffer
+  * @return
+  *  2 if uploading from system memory was faster, otherwise 1
+  */
+static DWORD glRenderer__BenchmarkUnpack(glRenderer *This, CmdBuffer *buffer)
+{
+	const GLsizei size = 512;
+	const GLsizeiptr bytes = size * size * 4;
+	LARGE_INTEGER start, end;
+	LONGLONG direct, streamed = 0;
+	GLintptr offset = 0;
+	GLuint texture;
+	BYTE *data;
+	int i;
+	data = (BYTE*)malloc(bytes);
+	if (!data) return 1;
+	for (i = 0; i < bytes; i++) data[i] = (BYTE)(i * 7);
+	glUtil_SetActiveTexture(This->util, 0);
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, size, size, 0, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, NULL);
+	// The first upload of each kind warms up the driver and is not timed
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, size, size, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, data);
+	glFinish();
+	QueryPerformanceCounter(&start);
 	for (i = 0; i < 8; i++)
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, size, size, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, data);
+	glFinish();
+	QueryPerformanceCounter(&end);
+	direct = end.QuadPart - start.QuadPart;
+	BufferObject_Bind(buffer->pixelunpack, GL_PIXEL_UNPACK_BUFFER);
+	for (i = -1; i < 8; i++)
 	{
-		renderer->shaderstate3d.texstageid[i] = texstages[i].colorop & 31;
-		renderer->shaderstate3d.texstageid[i] |= (__int64)(texstages[i].colorarg1 & 63) << 5;
-		renderer->shaderstate3d.texstageid[i] |= (__int64)(texstages[i].colorarg2 & 63) << 11;
-		renderer->shaderstate3d.texstageid[i] |= (__int64)(texstages[i].alphaop & 31) << 17;
-		renderer->shaderstate3d.texstageid[i] |= (__int64)(texstages[i].alphaarg1 & 63) << 22;
-		renderer->shaderstate3d.texstageid[i] |= (__int64)(texstages[i].alphaarg2 & 63) << 28;
-		renderer->shaderstate3d.texstageid[i] |= (__int64)(texstages[i].texcoordindex & 7) << 34;
-		renderer->shaderstate3d.texstageid[i] |= (__int64)((texstages[i].texcoordindex >> 16) & 3) << 37;
-		renderer->shaderstate3d.texstageid[i] |= (__int64)((texstages[i].addressu - 1) & 3) << 39;
-		renderer->shaderstate3d.texstageid[i] |= (__int64)((texstages[i].addressv - 1) & 3) << 41;
-		//renderer->shaderstate3d.texstageid[i] |= (__int64)(texstages[i].magfilter & 7) << 43;
-		//renderer->shaderstate3d.texstageid[i] |= (__int64)(texstages[i].minfilter & 3) << 46;
-		//renderer->shaderstate3d.texstageid[i] |= (__int64)(texstages[i].mipfilter & 3) << 48;
-		if (texstages[i].textransform & 7)
+		if (!i)
 		{
-			renderer->shaderstate3d.texstageid[i] |= 1i64 << 50;
-			renderer->shaderstate3d.texstageid[i] |= (__int64)(((texstages[i].textransform & 7) - 1) & 3) << 51;
+			glFinish();
+			QueryPerformanceCounter(&start);
 		}
-		if (texstages[i].textransform & D3DTTFF_PROJECTED) renderer->shaderstate3d.texstageid[i] |= 1i64 << 53;
-		renderer->shaderstate3d.texstageid[i] |= (__int64)(texstages[i].texcoordindex & 7) << 54;
-		renderer->shaderstate3d.texstageid[i] |= (__int64)((texstages[i].texcoordindex >> 16) & 3) << 57;
-		if (texstages[i].texture)
+		offset = glRenderer__StreamReserve(This, buffer->pixelunpack, GL_PIXEL_UNPACK_BUFFER, &buffer->unpackptr,
+			&buffer->unpacksegment, buffer->unpackfences, bytes, 16);
+		if (offset == -1) break;
+		ColorConv_StreamCopy(buffer->pixelunpack->pointer + offset, data, bytes);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, size, size, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, (GLvoid*)offset);
+	}
+	glFinish();
+	QueryPerformanceCounter(&end);
+	if (offset != -1) streamed = end.QuadPart - start.QuadPart;
+	BufferObject_Unbind(buffer->pixelunpack, GL_PIXEL_UNPACK_BUFFER);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glDeleteTextures(1, &texture);
+	free(data);
+	// Buffers too small for the test texture can't stage most uploads either
+	if (offset == -1) return 2;
+	return (streamed <= direct) ? 1 : 2;
+}
+
+/**
+  * Chooses whether texture uploads are staged in the shared unpack buffer,
+  * measuring both methods the first time if TexUpload is automatic.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param buffer
+  *  Command buffer created by glRenderer_InitCmdBuffer
+  */
+static void glRenderer__ChooseUnpack(glRenderer *This, CmdBuffer *buffer)
+{
+	static DWORD measured = 0;
+	CAPSCACHETUNING tuning;
+	DWORD method = dxglcfg.TexUpload;
+	buffer->unpackstreaming = FALSE;
+	if (!buffer->pixelunpack || !buffer->pixelunpack->mapped) return;
+	if (!method) method = measured;
+	if (!method)
+	{
+		if (CapsCache_GetTuning(&tuning) && (tuning.texupload >= 1) && (tuning.texupload <= 2))
+			method = tuning.texupload;
+		else
 		{
-			renderer->shaderstate3d.texstageid[i] |= 1i64 << 59;
-			if (texstages[i].texture->levels[0].ddsd.dwFlags & DDSD_CKSRCBLT) renderer->shaderstate3d.texstageid[i] |= 1i64 << 60;
+			method = tuning.texupload = glRenderer__BenchmarkUnpack(This, buffer);
+			CapsCache_StoreTuning(&tuning);
 		}
+		InterlockedExchange((LONG*)&measured, method);
 	}
-	return shader;
+	buffer->unpackstreaming = (method == 1);
 }
 
-void glRenderer__InitD3D(glRenderer *This, int zbuffer, int x, int y)
+/**
+  * Copies the vertex data of a draw into the streaming vertex buffer and binds
+  * it to GL_ARRAY_BUFFER.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param vertices
+  *  Interleaved vertices in the current vertex format
+  * @param count
+  *  Number of vertices
+  * @param base
+  *  Receives the offset of the first vertex in the vertex buffer
+  * @return
+  *  TRUE if the vertices were streamed, FALSE to draw from client memory
+  */
+static BOOL glRenderer__StreamVertices(glRenderer *This, BYTE *vertices, DWORD count, GLintptr *base)
 {
-	SetEvent(This->busy);
-	glHint(GL_PERSPECTIVE_CORRECTION_HINT,GL_NICEST);
-	GLfloat ambient[] = {0.0,0.0,0.0,0.0};
-	if (zbuffer) glUtil_DepthTest(This->util, TRUE);
-	glUtil_SetDepthComp(This->util, GL_LEQUAL);
-	GLfloat identity[16];
-	__gluMakeIdentityf(identity);
-	for (int i = 0; i < 24; i++)
-		memcpy(&This->transform[i], identity, sizeof(D3DMATRIX));
-	GLfloat one[4] = {1,1,1,1};
-	GLfloat zero[4] = {0,0,0,1};
-	glUtil_SetMaterial(This->util, one, one, zero, zero, 0);
-	ZeroMemory(&This->material, sizeof(D3DMATERIAL7));
-	ZeroMemory(&This->lights, 8 * sizeof(D3DLIGHT7));
-	memcpy(&This->renderstate, &renderstate_default, RENDERSTATE_COUNT * sizeof(DWORD));
-	This->texstages[0] = texstagedefault0;
-	This->texstages[1] = This->texstages[2] = This->texstages[3] = This->texstages[4] =
-		This->texstages[5] = This->texstages[6] = This->texstages[7] = This->texstages[8] =
-		This->texstages[9] = This->texstages[10] = This->texstages[11] = texstagedefault1;
-	This->viewport.dwX = 0;
-	This->viewport.dwY = 0;
-	This->viewport.dwWidth = x;
-	This->viewport.dwHeight = y;
-	This->viewport.dvMinZ = 0.0f;
-	This->viewport.dvMaxZ = 1.0f;
-	This->shaderstate3d.stateid = InitShaderState(This, This->renderstate, This->texstages, This->lights);
+	CmdBuffer *buffer = &This->cmdbuffer[0];
+	GLintptr offset;
+	if (!buffer->streaming || !count) return FALSE;
+	// Whole vertices from the start of the buffer keep the layout the same between draws
+	offset = glRenderer__StreamData(This, buffer->vertices, GL_ARRAY_BUFFER, &buffer->vertexptr,
+		&buffer->vertexsegment, buffer->vertexfences, vertices, This->fvf_stride * count, This->fvf_stride);
+	if (offset == -1) return FALSE;
+	*base = offset;
+	BufferObject_Bind(buffer->vertices, GL_ARRAY_BUFFER);
+	return TRUE;
 }
 
-void glRenderer__Clear(glRenderer *This, ClearCommand *cmd)
+/**
+  * Interleaves strided vertex data straight into the streaming vertex buffer
+  * and binds it to GL_ARRAY_BUFFER.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param strided
+  *  Vertex component pointers and strides of the draw
+  * @param count
+  *  Number of vertices
+  * @param base
+  *  Receives the offset of the first vertex in the vertex buffer
+  * @return
+  *  TRUE if the vertices were streamed, FALSE if they must be gathered into
+  *  client memory instead
+  */
+static BOOL glRenderer__StreamStrided(glRenderer *This, LPD3DDRAWPRIMITIVESTRIDEDDATA strided, DWORD count, GLintptr *base)
 {
-	This->outputs[0] = (void*)D3D_OK;
-	GLfloat color[4];
-	glTexture *ztexture = NULL;
-	GLint zlevel = 0;
-	GLfloat mulx, muly;
-	GLsizei x1, y1, x2, y2;
-	if (cmd->zbuffer)
+	CmdBuffer *buffer = &This->cmdbuffer[0];
+	GLsizeiptr size = This->fvf_stride * count;
+	GLintptr offset;
+	BYTE *dest;
+	if (!buffer->streaming || !count) return FALSE;
+	offset = glRenderer__StreamReserve(This, buffer->vertices, GL_ARRAY_BUFFER, &buffer->vertexptr,
+		&buffer->vertexsegment, buffer->vertexfences, size, This->fvf_stride);
+	if (offset == -1) return FALSE;
+	if (buffer->vertices->mapped)
+		glRenderer__GatherStrided(This, strided, count, (BYTE*)buffer->vertices->pointer + offset);
+	else
 	{
-		ztexture = cmd->zbuffer;
-		zlevel = cmd->zlevel;
+		dest = (BYTE*)BufferObject_MapRange(buffer->vertices, GL_ARRAY_BUFFER, offset, size,
+			GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+		if (!dest) return FALSE;
+		glRenderer__GatherStrided(This, strided, count, dest);
+		BufferObject_Unmap(buffer->vertices, GL_ARRAY_BUFFER);
 	}
-	dwordto4float(cmd->dwColor,color);
-	do
+	*base = offset;
+	BufferObject_Bind(buffer->vertices, GL_ARRAY_BUFFER);
+	return TRUE;
+}
+
+/**
+  * Copies each stream of strided vertex data into the streaming vertex buffer
+  * as one block and binds it to GL_ARRAY_BUFFER, so the streams can be read as
+  * separate attribute arrays without interleaving the vertices.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param strided
+  *  Vertex component pointers and strides of the draw
+  * @param count
+  *  Number of vertices
+  * @param offsets
+  *  Receives the buffer offset of each vertex component of the current format
+  * @param strides
+  *  Receives the stride of each vertex component of the current format
+  * @return
+  *  TRUE if the streams were copied, FALSE if the vertices must be interleaved
+  */
+static BOOL glRenderer__StreamSeparate(glRenderer *This, LPD3DDRAWPRIMITIVESTRIDEDDATA strided, DWORD count,
+	GLintptr *offsets, GLsizei *strides)
+{
+	CmdBuffer *buffer = &This->cmdbuffer[0];
+	D3DDP_PTRSTRIDE *components[12];
+	GLintptr componentoffsets[12];
+	GLsizei sizes[12];
+	GLintptr blocks[12];
+	GLsizeiptr size = 0;
+	GLintptr offset;
+	BYTE *dest;
+	int numcomponents;
+	int i, j;
+	if (!buffer->streaming || !count) return FALSE;
+	numcomponents = glRenderer__GetStridedComponents(This, strided, components, componentoffsets, sizes);
+	for (j = 0; j < numcomponents; j++)
 	{
-		if (glUtil_SetFBOSurface(This->util, cmd->target, ztexture,
-			cmd->targetlevel, zlevel, FALSE) == GL_FRAMEBUFFER_COMPLETE) break;
-		if (!cmd->target->internalformats[1]) break;
-		glTexture__Repair(cmd->target, TRUE);
-		glUtil_SetFBO(This->util, NULL);
-		cmd->target->levels[cmd->targetlevel].fbo.fbcolor = NULL;
-		cmd->target->levels[cmd->targetlevel].fbo.fbz = NULL;
-	} while (1);
-	int clearbits = 0;
-	if(cmd->dwFlags & D3DCLEAR_TARGET)
+		// Streams interleaved with other data would copy more than they use
+		if (!components[j]->lpvData || (components[j]->dwStride != (DWORD)sizes[j])) return FALSE;
+		blocks[j] = size;
+		size += ((sizes[j] * count) + 15) & ~15;
+	}
+	// A single reservation keeps all of the blocks in the same region
+	offset = glRenderer__StreamReserve(This, buffer->vertices, GL_ARRAY_BUFFER, &buffer->vertexptr,
+		&buffer->vertexsegment, buffer->vertexfences, size, 16);
+	if (offset == -1) return FALSE;
+	if (buffer->vertices->mapped) dest = (BYTE*)buffer->vertices->pointer + offset;
+	else
 	{
-		clearbits |= GL_COLOR_BUFFER_BIT;
-		glUtil_ClearColor(This->util, color[0], color[1], color[2], color[3]);
+		dest = (BYTE*)BufferObject_MapRange(buffer->vertices, GL_ARRAY_BUFFER, offset, size,
+			GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+		if (!dest) return FALSE;
 	}
-	if(cmd->dwFlags & D3DCLEAR_ZBUFFER)
+	for (j = 0; j < numcomponents; j++)
+		memcpy(dest + blocks[j], components[j]->lpvData, sizes[j] * count);
+	if (!buffer->vertices->mapped) BufferObject_Unmap(buffer->vertices, GL_ARRAY_BUFFER);
+	for (i = 0; i < 18; i++)
 	{
-		clearbits |= GL_DEPTH_BUFFER_BIT;
-		glUtil_ClearDepth(This->util, cmd->dvZ);
-		glUtil_DepthWrite(This->util, TRUE);
+		if (This->fvf_offsets[i] == -1) continue;
+		// The position stream also carries the reciprocal W and blend weights
+		for (j = 0; j < numcomponents; j++)
+		{
+			if ((This->fvf_offsets[i] >= componentoffsets[j])
+				&& (This->fvf_offsets[i] < componentoffsets[j] + sizes[j])) break;
+		}
+		if (j == numcomponents) return FALSE;
+		offsets[i] = offset + blocks[j] + This->fvf_offsets[i] - componentoffsets[j];
+		strides[i] = sizes[j];
 	}
-	if(cmd->dwFlags & D3DCLEAR_STENCIL)
+	BufferObject_Bind(buffer->vertices, GL_ARRAY_BUFFER);
+	return TRUE;
+}
+
+/**
+  * Copies the index data of a draw into the streaming index buffer and binds
+  * it to GL_ELEMENT_ARRAY_BUFFER.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param indices
+  *  Index data of the draw
+  * @param indextype
+  *  GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+  * @param count
+  *  Number of indices
+  * @param out
+  *  Receives the index pointer to pass to glDrawElements
+  * @return
+  *  TRUE if the indices were streamed, FALSE to draw from client memory
+  */
+static BOOL glRenderer__StreamIndices(glRenderer *This, const void *indices, GLenum indextype, DWORD count,
+	const GLvoid **out)
+{
+	CmdBuffer *buffer = &This->cmdbuffer[0];
+	GLsizeiptr size = count * ((indextype == GL_UNSIGNED_INT) ? sizeof(GLuint) : sizeof(GLushort));
+	GLintptr offset;
+	if (!buffer->streaming || !count) return FALSE;
+	offset = glRenderer__StreamData(This, buffer->indices, GL_ELEMENT_ARRAY_BUFFER, &buffer->indexptr,
+		&buffer->indexsegment, buffer->indexfences, indices, size, 16);
+	if (offset == -1) return FALSE;
+	*out = (const GLvoid*)offset;
+	BufferObject_Bind(buffer->indices, GL_ELEMENT_ARRAY_BUFFER);
+	return TRUE;
+}
+
+/**
+  * Binds the index buffer of an optimized vertex buffer if a draw uses the same
+  * indices as the previous draw from the buffer.  Indices drawn twice in a row
+  * are uploaded once as static data, so static geometry drawn every frame does
+  * not stream its indices again.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param buffer
+  *  Optimized vertex buffer the draw reads from
+  * @param indices
+  *  Indices of the draw
+  * @param count
+  *  Number of indices
+  * @return
+  *  TRUE if the index buffer was bound, FALSE to stream the indices
+  */
+static BOOL glRenderer__BindCachedIndices(glRenderer *This, VertexBuffer *buffer, const WORD *indices, DWORD count)
+{
+	WORD *cache;
+	if ((buffer->indexcount != count) || memcmp(buffer->indexcache, indices, count * sizeof(WORD)))
 	{
-		clearbits |= GL_STENCIL_BUFFER_BIT;
-		glUtil_ClearStencil(This->util, cmd->dwStencil);
+		// Only remember the list, buffers drawn in parts with varying lists keep streaming
+		if (count > buffer->indexmax)
+		{
+			cache = (WORD*)realloc(buffer->indexcache, count * sizeof(WORD));
+			if (!cache) return FALSE;
+			buffer->indexcache = cache;
+			buffer->indexmax = count;
+		}
+		memcpy(buffer->indexcache, indices, count * sizeof(WORD));
+		buffer->indexcount = count;
+		buffer->indexuploaded = FALSE;
+		return FALSE;
 	}
-	if(cmd->dwCount)
+	if (!buffer->indexuploaded)
+	{
+		if (!buffer->ibo)
+		{
+			BufferObject_Create(&buffer->ibo, This->ext, This->util);
+			if (!buffer->ibo) return FALSE;
+		}
+		BufferObject_SetData(buffer->ibo, GL_ELEMENT_ARRAY_BUFFER, count * sizeof(WORD),
+			buffer->indexcache, GL_STATIC_DRAW);
+		buffer->indexuploaded = TRUE;
+	}
+	BufferObject_Bind(buffer->ibo, GL_ELEMENT_ARRAY_BUFFER);
+	return TRUE;
+}
+
+/**
+  * Uploads the contents of a vertex buffer if they changed since the last draw
+  * and binds it to GL_ARRAY_BUFFER.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param buffer
+  *  Vertex buffer to bind
+  * @return
+  *  TRUE if the buffer object was bound, FALSE to draw from buffer->data
+  */
+static BOOL glRenderer__BindVertexBuffer(glRenderer *This, VertexBuffer *buffer)
+{
+	void *dest;
+	if (!buffer->vbo)
 	{
-		if (cmd->targetlevel == 0 && (cmd->target->levels[0].ddsd.dwWidth != cmd->target->levels[0].ddsd.dwWidth) ||
-			(cmd->target->levels[0].ddsd.dwHeight != cmd->target->levels[0].ddsd.dwHeight))
+		BufferObject_Create(&buffer->vbo, This->ext, This->util);
+		if (!buffer->vbo) return FALSE;
+		buffer->dirty = TRUE;
+		buffer->nooverwrite = FALSE;
+	}
+	if (buffer->dirty)
+	{
+		if (buffer->nooverwrite && This->ext->GLEXT_ARB_map_buffer_range && (buffer->vbo->size == buffer->size))
 		{
-			mulx = (GLfloat)cmd->target->levels[0].ddsd.dwWidth / (GLfloat)cmd->target->levels[0].ddsd.dwWidth;
-			muly = (GLfloat)cmd->target->levels[0].ddsd.dwHeight / (GLfloat)cmd->target->levels[0].ddsd.dwHeight;
-			for (DWORD i = 0; i < cmd->dwCount; i++)
+			// The application promised not to touch data in use by the GPU
+			dest = BufferObject_MapRange(buffer->vbo, GL_ARRAY_BUFFER, 0, buffer->size,
+				GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+			if (dest)
 			{
-				x1 = (GLsizei)(((GLfloat)cmd->lpRects[i].x1) * mulx);
-				x2 = ((GLsizei)(((GLfloat)cmd->lpRects[i].x2) * mulx)) - x1;
-				y1 = (GLsizei)(((GLfloat)cmd->lpRects[i].y1) * muly);
-				y2 = ((GLsizei)(((GLfloat)cmd->lpRects[i].y2) * muly)) - y1;
-				glUtil_SetScissor(This->util, TRUE, x1, y1, x2, y2);
-				glClear(clearbits);
+				memcpy(dest, buffer->data, buffer->size);
+				BufferObject_Unmap(buffer->vbo, GL_ARRAY_BUFFER);
 			}
 		}
+		// Respecifying the whole store orphans the copy still in use by the GPU
+		else BufferObject_SetData(buffer->vbo, GL_ARRAY_BUFFER, buffer->size, buffer->data,
+			buffer->isstatic ? GL_STATIC_DRAW : GL_DYNAMIC_DRAW);
+		buffer->dirty = FALSE;
+		buffer->nooverwrite = TRUE;
+	}
+	BufferObject_Bind(buffer->vbo, GL_ARRAY_BUFFER);
+	return TRUE;
+}
+
+/**
+  * Gets the vertex attribute layout of a draw in the current vertex format from
+  * the attribute locations of its program.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param prog
+  *  Program used for the draw
+  * @param base
+  *  Offset of the first vertex in buffer, or its address in client memory
+  * @param buffer
+  *  Buffer object the vertices are in, NULL for client memory
+  * @param key
+  *  Receives the vertex layout
+  */
+static void glRenderer__GetVertexLayout(glRenderer *This, _GENSHADER *prog, GLintptr base,
+	BufferObject *buffer, VertexArrayKey *key)
+{
+	static const GLint attribsizes[10] = { 3, 1, 1, 1, 1, 1, 1, 3, 4, 4 };
+	int i;
+	// Zero the padding too, keys are compared with memcmp
+	ZeroMemory(key, sizeof(VertexArrayKey));
+	key->buffer = buffer;
+	for (i = 0; i < 18; i++)
+	{
+		key->location[i] = -1;
+		if (This->fvf_offsets[i] == -1) continue;
+		if (i < 10)
+		{
+			key->location[i] = prog->attribs[i];
+			key->size[i] = attribsizes[i];
+		}
 		else
 		{
-			for (DWORD i = 0; i < cmd->dwCount; i++)
-			{
-				glUtil_SetScissor(This->util, TRUE, cmd->lpRects[i].x1, cmd->lpRects[i].y1,
-					(cmd->lpRects[i].x2 - cmd->lpRects[i].x1), cmd->lpRects[i].y2 - cmd->lpRects[i].y1);
-				glClear(clearbits);
-			}
+			// Each texture coordinate size has its own set of attributes
+			key->location[i] = prog->attribs[i + ((This->fvf_texformats[i - 10] - 1) * 8)];
+			key->size[i] = This->fvf_texformats[i - 10];
 		}
-		glUtil_SetScissor(This->util, false, 0, 0, 0, 0);
+		if (key->location[i] == -1)
+		{
+			key->size[i] = 0;
+			continue;
+		}
+		key->stride[i] = This->fvf_stride;
+		key->offset[i] = base + This->fvf_offsets[i];
 	}
-	else glClear(clearbits);
-	if(cmd->zbuffer) cmd->zbuffer->levels[zlevel].dirty |= 2;
-	cmd->target->levels[cmd->targetlevel].dirty |= 2;
-	SetEvent(This->busy);
 }
 
-void glRenderer__Flush(glRenderer *This)
+/**
+  * Enables the vertex attributes of a layout and points them at its offsets.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param key
+  *  Vertex layout to set
+  */
+static void glRenderer__SetVertexAttribs(glRenderer *This, const VertexArrayKey *key)
 {
-	glFlush();
-	SetEvent(This->busy);
+	BOOL used[42];
+	int i;
+	// Components missing from this format must not read stale pointers
+	ZeroMemory(used, 42 * sizeof(BOOL));
+	for (i = 0; i < 18; i++)
+		if ((key->location[i] >= 0) && (key->location[i] < 42)) used[key->location[i]] = TRUE;
+	for (i = 0; i < 42; i++)
+		if (!used[i] && This->util->arrays[i]) glUtil_EnableArray(This->util, i, FALSE);
+	for (i = 0; i < 18; i++)
+	{
+		if (key->location[i] == -1) continue;
+		glUtil_EnableArray(This->util, key->location[i], TRUE);
+		if ((i == 8) || (i == 9)) // Diffuse and specular colors
+			This->ext->glVertexAttribPointer(key->location[i], 4, GL_UNSIGNED_BYTE, GL_TRUE,
+				key->stride[i], (const GLvoid*)key->offset[i]);
+		else This->ext->glVertexAttribPointer(key->location[i], key->size[i], GL_FLOAT, GL_FALSE,
+			key->stride[i], (const GLvoid*)key->offset[i]);
+	}
 }
 
-void glRenderer__SetWnd(glRenderer *This, int width, int height, int bpp, int fullscreen, unsigned int frequency, HWND newwnd, BOOL devwnd)
+/**
+  * Moves the offsets of a vertex layout to be relative to its first whole
+  * vertex, so draws that start at different vertices share the layout.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param key
+  *  Vertex layout to rebase
+  * @param indexed
+  *  TRUE if the draw uses indices
+  * @param basevertex
+  *  Receives the vertex to start drawing at
+  * @return
+  *  TRUE if the layout can be drawn with a vertex array object
+  */
+static BOOL glRenderer__RebaseVertexLayout(glRenderer *This, VertexArrayKey *key, BOOL indexed, GLint *basevertex)
 {
-	if(newwnd != This->hWnd)
+	GLsizei stride = key->stride[0];
+	GLint base;
+	int i;
+	if (!key->buffer || (key->location[0] == -1) || !stride) return FALSE;
+	base = (GLint)(key->offset[0] / stride);
+	if (base && indexed && !This->ext->GLEXT_ARB_draw_elements_base_vertex) return FALSE;
+	for (i = 0; i < 18; i++)
 	{
-		EnterCriticalSection(&dll_cs);
-		wglMakeCurrent(NULL, NULL);
-		ReleaseDC(This->hWnd,This->hDC);
-		glRenderWindow_Delete(This->RenderWnd);
-		glRenderWindow_Create(width, height, fullscreen, newwnd, This->ddInterface, devwnd, &This->RenderWnd);
-		PIXELFORMATDESCRIPTOR pfd;
-		GLuint pf;
-		InterlockedIncrement((LONG*)&gllock);
-		ZeroMemory(&pfd,sizeof(PIXELFORMATDESCRIPTOR));
-		pfd.nSize = sizeof(PIXELFORMATDESCRIPTOR);
-		pfd.nVersion = 1;
-		if (dxglcfg.SingleBufferDevice) pfd.dwFlags = PFD_DRAW_TO_WINDOW | PFD_SUPPORT_OPENGL;
-		else pfd.dwFlags = PFD_DRAW_TO_WINDOW | PFD_SUPPORT_OPENGL | PFD_DOUBLEBUFFER;
-		pfd.iPixelType = PFD_TYPE_RGBA;
-		pfd.cColorBits = bpp;
-		pfd.iLayerType = PFD_MAIN_PLANE;
-		This->hDC = GetDC(This->RenderWnd->hWnd);
-		if(!This->hDC)
-			DEBUG("glRenderer::SetWnd: Can not create hDC\n");
-		pf = ChoosePixelFormat(This->hDC,&pfd);
-		if(!pf)
-			DEBUG("glRenderer::SetWnd: Can not get pixelformat\n");
-		if(!SetPixelFormat(This->hDC,pf,&pfd))
-			DEBUG("glRenderer::SetWnd: Can not set pixelformat\n");
-		if(!wglMakeCurrent(This->hDC,This->hRC))
-			DEBUG("glRenderer::SetWnd: Can not activate GL context\n");
-		InterlockedDecrement((LONG*)&gllock);
-		LeaveCriticalSection(&dll_cs);
-		glRenderer__SetSwap(This,1);
-		SwapBuffers(This->hDC);
-		DXGLTimer_Init(&This->timer);
-		DXGLTimer_Calibrate(&This->timer, height, frequency);
-		glRenderer__SetSwap(This,0);
-		glUtil_SetViewport(This->util, 0, 0, width, height);
+		if (key->location[i] == -1) continue;
+		if (key->offset[i] < (GLintptr)base * stride) return FALSE;
 	}
-	if (_isnan(dxglcfg.postsizex) || _isnan(dxglcfg.postsizey) ||
-		(dxglcfg.postsizex < 0.25f) || (dxglcfg.postsizey < 0.25f))
+	for (i = 0; i < 18; i++)
 	{
-		if (width <= 400) This->postsizex = 2.0f;
-		else This->postsizex = 1.0f;
-		if (height <= 300) This->postsizey = 2.0f;
-		else This->postsizey = 1.0f;
+		if (key->location[i] == -1) continue;
+		key->offset[i] -= (GLintptr)base * stride;
+	}
+	*basevertex = base;
+	return TRUE;
+}
+
+/**
+  * Binds the cached vertex array object for a vertex layout, creating it if
+  * the layout was not used recently.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param key
+  *  Vertex layout of the draw, rebased with glRenderer__RebaseVertexLayout
+  */
+static void glRenderer__BindVertexArray(glRenderer *This, const VertexArrayKey *key)
+{
+	VertexArrayEntry *entry = NULL;
+	int i;
+	This->vertexarrayclock++;
+	for (i = 0; i < VERTEXARRAY_CACHESIZE; i++)
+	{
+		if (This->vertexarrays[i].vao && !memcmp(&This->vertexarrays[i].key, key, sizeof(VertexArrayKey)))
+		{
+			entry = &This->vertexarrays[i];
+			break;
+		}
 	}
+	if (entry) This->ext->glBindVertexArray(entry->vao);
 	else
 	{
-		This->postsizex = dxglcfg.postsizex;
-		This->postsizey = dxglcfg.postsizey;
+		// Take a free entry, or replace the least recently used one
+		entry = &This->vertexarrays[0];
+		for (i = 0; i < VERTEXARRAY_CACHESIZE; i++)
+		{
+			if (!This->vertexarrays[i].vao)
+			{
+				entry = &This->vertexarrays[i];
+				break;
+			}
+			if ((This->vertexarrayclock - This->vertexarrays[i].lastused) > (This->vertexarrayclock - entry->lastused))
+				entry = &This->vertexarrays[i];
+		}
+		if (entry->vao)
+		{
+			This->ext->glDeleteVertexArrays(1, &entry->vao);
+			BufferObject_Release(entry->key.buffer);
+		}
+		memcpy(&entry->key, key, sizeof(VertexArrayKey));
+		BufferObject_AddRef(entry->key.buffer);
+		// Indexed draws always stream their indices into the same buffer
+		entry->vao = This->backend->CreateVertexArray(This->ext, &entry->key, This->cmdbuffer[0].indices);
 	}
-	SetEvent(This->busy);
+	entry->lastused = This->vertexarrayclock;
 }
 
-void glRenderer__SetBlend(glRenderer *This, DWORD src, DWORD dest)
+/**
+  * Deletes the cached vertex array objects and releases their buffers.
+  * @param This
+  *  Pointer to glRenderer object
+  */
+static void glRenderer__DeleteVertexArrays(glRenderer *This)
 {
-	GLenum glsrc, gldest;
-	bool bothalpha = false;
-	switch(src)
+	int i;
+	for (i = 0; i < VERTEXARRAY_CACHESIZE; i++)
 	{
-	case D3DBLEND_ZERO:
-		glsrc = GL_ZERO;
-		break;
-	case D3DBLEND_ONE:
-	default:
-		glsrc = GL_ONE;
-		break;
-	case D3DBLEND_SRCCOLOR:
-		glsrc = GL_SRC_COLOR;
-		break;
-	case D3DBLEND_INVSRCCOLOR:
-		glsrc = GL_ONE_MINUS_SRC_COLOR;
-		break;
-	case D3DBLEND_SRCALPHA:
-		glsrc = GL_SRC_ALPHA;
-		break;
-	case D3DBLEND_INVSRCALPHA:
-		glsrc = GL_ONE_MINUS_SRC_ALPHA;
-		break;
-	case D3DBLEND_DESTALPHA:
-		glsrc = GL_DST_ALPHA;
-		break;
-	case D3DBLEND_INVDESTALPHA:
-		glsrc = GL_ONE_MINUS_DST_ALPHA;
-		break;
-	case D3DBLEND_DESTCOLOR:
-		glsrc = GL_DST_COLOR;
-		break;
-	case D3DBLEND_INVDESTCOLOR:
-		glsrc = GL_ONE_MINUS_DST_COLOR;
-		break;
-	case D3DBLEND_SRCALPHASAT:
-		glsrc = GL_SRC_ALPHA_SATURATE;
-		break;
-	case D3DBLEND_BOTHSRCALPHA:
-		bothalpha = true;
-		glsrc = GL_SRC_ALPHA;
-		gldest = GL_ONE_MINUS_SRC_ALPHA;
-		break;
-	case D3DBLEND_BOTHINVSRCALPHA:
-		bothalpha = true;
-		glsrc = GL_ONE_MINUS_SRC_ALPHA;
-		gldest = GL_SRC_ALPHA;
-		break;
+		if (!This->vertexarrays[i].vao) continue;
+		This->ext->glDeleteVertexArrays(1, &This->vertexarrays[i].vao);
+		BufferObject_Release(This->vertexarrays[i].key.buffer);
 	}
+	ZeroMemory(This->vertexarrays, VERTEXARRAY_CACHESIZE * sizeof(VertexArrayEntry));
+}
 
-	if(!bothalpha) switch(dest)
+/**
+  * Records a draw, gathering strided vertices into interleaved ones first.
+  * Must be called after the vertex format of the draw has been set up and
+  * before its vertex buffer is uploaded.  The parameters are those of
+  * glRenderer__DrawPrimitives.
+  */
+static void glRenderer__CaptureDraw(glRenderer *This, RenderTarget *target, GLenum mode, DWORD fvf, BYTE *vertices,
+	VertexBuffer *buffer, BOOL strided, DWORD count, const void *indices, GLenum indextype, DWORD indexcount, DWORD flags)
+{
+	BYTE *gathered;
+	// Only batched draws use 32-bit indices, and batching is off while capturing
+	if (indices && (indextype != GL_UNSIGNED_SHORT)) return;
+	if (!strided)
 	{
-	case D3DBLEND_ZERO:
-	default:
-		gldest = GL_ZERO;
-		break;
-	case D3DBLEND_ONE:
-		gldest = GL_ONE;
-		break;
-	case D3DBLEND_SRCCOLOR:
-		gldest = GL_SRC_COLOR;
-		break;
-	case D3DBLEND_INVSRCCOLOR:
-		gldest = GL_ONE_MINUS_SRC_COLOR;
-		break;
-	case D3DBLEND_SRCALPHA:
-		gldest = GL_SRC_ALPHA;
-		break;
-	case D3DBLEND_INVSRCALPHA:
-		gldest = GL_ONE_MINUS_SRC_ALPHA;
-		break;
-	case D3DBLEND_DESTALPHA:
-		gldest = GL_DST_ALPHA;
-		break;
-	case D3DBLEND_INVDESTALPHA:
-		gldest = GL_ONE_MINUS_DST_ALPHA;
-		break;
-	case D3DBLEND_DESTCOLOR:
-		gldest = GL_DST_COLOR;
-		break;
-	case D3DBLEND_INVDESTCOLOR:
-		gldest = GL_ONE_MINUS_DST_COLOR;
-		break;
-	case D3DBLEND_SRCALPHASAT:
-		gldest = GL_SRC_ALPHA_SATURATE;
-		break;
-	case D3DBLEND_BOTHSRCALPHA:
-		bothalpha = true;
-		glsrc = GL_SRC_ALPHA;
-		gldest = GL_ONE_MINUS_SRC_ALPHA;
-		break;
-	case D3DBLEND_BOTHINVSRCALPHA:
-		bothalpha = true;
-		glsrc = GL_ONE_MINUS_SRC_ALPHA;
-		gldest = GL_SRC_ALPHA;
-		break;
+		Capture_DrawPrimitives(This->capture, target, mode, fvf, vertices, This->fvf_stride, buffer, count,
+			(const WORD*)indices, indexcount, flags);
+		return;
 	}
-	glUtil_BlendFunc(This->util, glsrc, gldest);
+	if (!This->arena) return;
+	gathered = (BYTE*)FrameArena_Alloc(This->arena, This->fvf_stride * count);
+	if (!gathered) return;
+	glRenderer__GatherStrided(This, (LPD3DDRAWPRIMITIVESTRIDEDDATA)vertices, count, gathered);
+	Capture_DrawPrimitives(This->capture, target, mode, fvf, gathered, This->fvf_stride, NULL, count,
+		(const WORD*)indices, indexcount, flags);
+	FrameArena_Rewind(This->arena, gathered);
 }
 
-void glRenderer__UpdateFVF(glRenderer *This, DWORD fvf)
+/**
+  * Checks if the alpha channel of a texture holds its source color key by the
+  * time it is drawn with, so the shader can test alpha instead of the key.
+  * @param texture
+  *  Texture bound to a stage with color keying
+  * @return
+  *  TRUE if every level was or will be uploaded with the key in alpha
+  */
+static BOOL glRenderer__KeyInAlpha(glTexture *texture)
 {
+	GLint i;
+	if (!texture->keyalpha || !texture->alphakeyset) return FALSE;
+	// Levels written by the CPU are uploaded with the key before the draw samples them
+	for (i = 0; i < texture->levelcount; i++)
+		if (!(texture->levels[i].dirty & 65)) return FALSE;
+	return TRUE;
 }
 
-void glRenderer__DrawPrimitives(glRenderer *This, RenderTarget *target, GLenum mode, DWORD fvf,
-	BYTE *vertices, BOOL strided, DWORD count, LPWORD indices, DWORD indexcount, DWORD flags)
+/**
+  * Sets the sampler uniform of a texture stage in a generated shader that
+  * uses bindless textures, skipping the call if it holds the value already.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param prog
+  *  Generated shader being drawn with
+  * @param stage
+  *  Texture stage of the sampler
+  * @param handle
+  *  Resident texture handle, or 0 to sample the texture bound to the unit
+  *  of the stage
+  */
+static void glRenderer__SetSamplerHandle(glRenderer *This, _GENSHADER *prog, int stage, GLuint64 handle)
 {
-	//BOOL transformed;
-	//int i;
-	glTexture *ztexture = NULL;
-	GLint zlevel = 0;
-	if (!vertices)
+	// Units are shadowed separately, since a handle can have any value
+	GLuint64 value[2] = { handle, handle ? 0 : (GLuint64)stage + 1 };
+	if (!glRenderer__ShadowUniform(prog->uniforms[128 + stage], GENSHADER_SHADOW(prog, 128 + stage),
+		value, sizeof(value))) return;
+	if (handle) This->ext->glUniformHandleui64ARB(prog->uniforms[128 + stage], handle);
+	else This->ext->glUniform1i(prog->uniforms[128 + stage], stage);
+}
+
+/**
+  * Binds the textures of the enabled Direct3D texture stages for a 3D draw,
+  * or sets their bindless handles, after uploading the levels they read.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param prog
+  *  Generated shader being drawn with
+  */
+static void glRenderer__SetTextureStages(glRenderer *This, _GENSHADER *prog)
+{
+	GLuint64 handle;
+	int i;
+	// Restoring and uploading textures binds them to unit 0, so finish before binding the stages
+	for (i = 0; i < 8; i++)
 	{
-		This->outputs[0] = (void*)DDERR_INVALIDPARAMS;
-		SetEvent(This->busy);
-		return;
+		if (This->texstages[i].colorop == D3DTOP_DISABLE) break;
+		if (!This->texstages[i].texture) continue;
+		if (This->texstages[i].texture->residency)
+			TextureResidency_Use(This->texstages[i].texture->residency, This->texstages[i].texture);
+		glTexture__ApplyLOD(This->texstages[i].texture);
 	}
-	if (fvf != This->last_fvf) glRenderer__UpdateFVF(This, fvf);
-	glRenderer__SetDepthComp(This);
-	glUtil_DepthTest(This->util, This->renderstate[D3DRENDERSTATE_ZENABLE]);
-	glUtil_DepthWrite(This->util, This->renderstate[D3DRENDERSTATE_ZWRITEENABLE]);
-	_GENSHADER *prog = &This->shaders->gen3d->current_genshader->shader;
-	switch (fvf & D3DFVF_POSITION_MASK)
+	for(i = 0; i < 8; i++)
 	{
-	case 0: // Missing vertex position
-		This->outputs[0] = (void*)DDERR_INVALIDPARAMS;
-		SetEvent(This->busy);
-		return;
-	case D3DFVF_XYZ:
-		glUtil_EnableArray(This->util, prog->attribs[0], TRUE);
-		This->ext->glVertexAttribPointer(prog->attribs[0], 3, GL_FLOAT, GL_FALSE, This->fvf_stride, vertices);
-		break;
-	case D3DFVF_XYZRHW:
-		glUtil_EnableArray(This->util, prog->attribs[0], TRUE);
-		This->ext->glVertexAttribPointer(prog->attribs[0], 3, GL_FLOAT, GL_FALSE, This->fvf_stride, vertices);
-		if (prog->attribs[1] != -1)
+		if(This->texstages[i].colorop == D3DTOP_DISABLE) break;
+		if(This->texstages[i].texture)
+		{
+			handle = 0;
+			if (This->ext->GLEXT_ARB_bindless_texture)
+			{
+				handle = glTexture__GetHandle(This->texstages[i].texture,
+					glUtil_GetSampler(This->util, &This->texstages[i].sampler));
+				glRenderer__SetSamplerHandle(This, prog, i, handle);
+			}
+			// Textures sampled through a handle aren't bound
+			if (!handle && This->ext->GLEXT_ARB_sampler_objects)
+			{
+				// One cached sampler per stage state, the texture's own parameters are left alone
+				glUtil_BindSampler(This->util, i, &This->texstages[i].sampler);
+				glUtil_SetTexture(This->util, i, This->texstages[i].texture);
+			}
+			else if (!handle)
+			{
+				glTexture__SetFilter(This->texstages[i].texture, i, This->texstages[i].glmagfilter, This->texstages[i].glminfilter, This);
+				glUtil_SetTexture(This->util, i, This->texstages[i].texture);
+				glUtil_SetWrap(This->util, i, 0, This->texstages[i].addressu);
+				glUtil_SetWrap(This->util, i, 1, This->texstages[i].addressv);
+			}
+		}
+		else
 		{
-			glUtil_EnableArray(This->util, prog->attribs[1], TRUE);
-			This->ext->glVertexAttribPointer(prog->attribs[1], 1, GL_FLOAT, GL_FALSE, This->fvf_stride, vertices+(3*sizeof(float)));
+			if (This->ext->GLEXT_ARB_bindless_texture) glRenderer__SetSamplerHandle(This, prog, i, 0);
+			glUtil_SetTexture(This->util,i,0);
+		}
+		if(This->renderstate[D3DRENDERSTATE_COLORKEYENABLE] && This->texstages[i].texture && (prog->uniforms[142+i] != -1))
+		{
+			if(This->texstages[i].texture->levels[0].ddsd.dwFlags & DDSD_CKSRCBLT)
+			{
+				SetColorKeyUniform(This->texstages[i].texture->levels[0].ddsd.ddckCKSrcBlt.dwColorSpaceLowValue,
+					This->texstages[i].texture->colorsizes, This->texstages[i].texture->colororder,
+					prog->uniforms[142 + i], This->texstages[i].texture->colorbits, This->ext);
+				if (glRenderer__ShadowUniform(prog->uniforms[153 + i], GENSHADER_SHADOW(prog, 153 + i),
+					This->texstages[i].texture->colorsizes, 4 * sizeof(GLint)))
+					This->ext->glUniform4iv(prog->uniforms[153 + i], 1, (GLint*)This->texstages[i].texture->colorsizes);
+			}
 		}
-		break;
-	case D3DFVF_XYZB1:
-	case D3DFVF_XYZB2:
-	case D3DFVF_XYZB3:
-	case D3DFVF_XYZB4:
-	case D3DFVF_XYZB5:
-		FIXME("glRenderer__DrawPrimitives: Blend weights not yet supported");
-		This->outputs[0] = (void*)DDERR_INVALIDPARAMS;
-		SetEvent(This->busy);
-		return;
-		break;
 	}
 }
 
-bool debugRenderingEnabled = false;
+/**
+  * Draws a batch whose draws switch textures.  If the handles of all the
+  * textures were gathered and the shader that reads them by draw index is
+  * ready, the batch is drawn with one indirect draw call, otherwise the runs
+  * of draws with the same textures are drawn one after another.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param prog
+  *  Generated shader being drawn with
+  * @param mode
+  *  OpenGL primitive drawing mode
+  * @param indextype
+  *  GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+  * @param indexptr
+  *  Offset of the batch indices in the bound index buffer, or pointer to them
+  * @param basevertex
+  *  Index of the first batch vertex in the bound vertex arrays
+  * @param inbuffer
+  *  TRUE if the indices are in the bound index buffer
+  */
+static void glRenderer__DrawBatchRanges(glRenderer *This, _GENSHADER *prog, GLenum mode, GLenum indextype,
+	const GLvoid *indexptr, GLint basevertex, BOOL inbuffer)
+{
+	const DrawBatch *batch = This->indirectbatch;
+	GLsizeiptr indexsize = (indextype == GL_UNSIGNED_INT) ? sizeof(GLuint) : sizeof(GLushort);
+	DrawBatchCommand commands[DRAWBATCH_MAXDRAWS];
+	const BYTE *ptr;
+	GLsizei count;
+	DWORD first, last;
+	int i;
+	// A shader substituted while the real one compiles samples the stage uniforms
+	BOOL perdraw = This->batchhandles && !This->shaders->gen3d->current_pending;
+	if (perdraw && inbuffer)
+	{
+		for (first = 0; first < batch->draws; first++)
+		{
+			commands[first] = batch->commands[first];
+			commands[first].firstindex += (GLuint)((GLintptr)indexptr / indexsize);
+			commands[first].basevertex += basevertex;
+		}
+		BufferObject_SetData(This->ubo[UBO_BINDING_DRAWTEXTURES], GL_UNIFORM_BUFFER,
+			DRAWBATCH_MAXDRAWS * 8 * sizeof(GLuint64), This->drawhandles, GL_STREAM_DRAW);
+		BufferObject_SetData(This->indirect, GL_DRAW_INDIRECT_BUFFER, batch->draws * sizeof(DrawBatchCommand),
+			commands, GL_STREAM_DRAW);
+		BufferObject_Bind(This->indirect, GL_DRAW_INDIRECT_BUFFER);
+		This->ext->glMultiDrawElementsIndirect(mode, indextype, NULL, batch->draws, 0);
+		BufferObject_Unbind(This->indirect, GL_DRAW_INDIRECT_BUFFER);
+		return;
+	}
+	for (first = 0; first < batch->draws; first = last)
+	{
+		for (last = first + 1; last < batch->draws; last++)
+			if (memcmp(&batch->drawtextures[first * 8], &batch->drawtextures[last * 8], 8 * sizeof(glTexture*)))
+				break;
+		if (perdraw)
+		{
+			// Without the draw index every draw reads the handles of the first draw
+			if (first) memcpy(This->drawhandles, &This->drawhandles[first * 8], 8 * sizeof(GLuint64));
+			BufferObject_SetData(This->ubo[UBO_BINDING_DRAWTEXTURES], GL_UNIFORM_BUFFER,
+				DRAWBATCH_MAXDRAWS * 8 * sizeof(GLuint64), This->drawhandles, GL_STREAM_DRAW);
+		}
+		else
+		{
+			for (i = 0; i < 8; i++)
+				This->texstages[i].texture = batch->drawtextures[(first * 8) + i];
+			glRenderer__SetTextureStages(This, prog);
+		}
+		// Runs include the restart indices between their draws
+		count = batch->commands[last - 1].firstindex + batch->commands[last - 1].count
+			- batch->commands[first].firstindex;
+		ptr = (const BYTE*)indexptr + (batch->commands[first].firstindex * indexsize);
+		if (basevertex) This->ext->glDrawElementsBaseVertex(mode, count, indextype, ptr, basevertex);
+		else glDrawElements(mode, count, indextype, ptr);
+	}
+}
 
-void glRenderer__DrawPrimitivesOld(glRenderer *This, RenderTarget *target, GLenum mode, GLVERTEX *vertices, int *texformats, DWORD count, LPWORD indices,
-	DWORD indexcount, DWORD flags)
+/**
+  * Draws primitives in a flexible vertex format with the current Direct3D state.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param target
+  *  Textures and mip levels of the current render target
+  * @param mode
+  *  OpenGL primitive drawing mode to use
+  * @param fvf
+  *  Flexible vertex format of the vertex data
+  * @param vertices
+  *  Interleaved vertex data, or a D3DDRAWPRIMITIVESTRIDEDDATA structure if
+  *  strided is TRUE
+  * @param buffer
+  *  Vertex buffer the vertex data points into, or NULL for application memory
+  * @param strided
+  *  TRUE if each vertex component has its own pointer and stride
+  * @param count
+  *  Number of vertices
+  * @param indices
+  *  Vertex indices, or NULL for non-indexed mode
+  * @param indextype
+  *  GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+  * @param indexcount
+  *  Number of vertex indices
+  * @param flags
+  *  D3DDP_WAIT to flush the GL command queue after drawing
+  */
+void glRenderer__DrawPrimitives(glRenderer *This, RenderTarget *target, GLenum mode, DWORD fvf, BYTE *vertices,
+	VertexBuffer *buffer, BOOL strided, DWORD count, const void *indices, GLenum indextype, DWORD indexcount, DWORD flags)
 {
-	static char buf[256];
-	snprintf(buf, sizeof(buf), "%s %d", indices ? "DrawIndexedPrimitive" : "DrawPrimitive", indices ? indexcount : count);
-	GLScopedDebugMarker scope(buf);
+	static const char indexedformat[] = "DrawIndexedPrimitive %d";
+	static const char format[] = "DrawPrimitive %d";
+	int markercount = indices ? indexcount : count;
+	GLScopedDebugMarker scope(DEBUGMARKER(glRenderer__DebugMarker(&This->markers[DEBUGMARKER_DRAW],
+		indices ? indexedformat : format, &markercount, 1)));
+	ScopedShaderTiming timing(This->shadertiming, SHADERTIMING_DRAW, This->shaders->gen3d);
 	BOOL haslights = FALSE;
-	bool transformed;
+	BOOL streamindices = FALSE;
+	BOOL cachedindices = FALSE;
+	BOOL separate = FALSE;
+	GLintptr separateoffsets[18];
+	GLsizei separatestrides[18];
 	int i;
 	glTexture *ztexture = NULL;
 	GLint zlevel = 0;
@@ -3295,228 +8149,282 @@ void glRenderer__DrawPrimitivesOld(glRenderer *This, RenderTarget *target, GLenu
 		ztexture = target->zbuffer;
 		zlevel = target->zlevel;
 	}
-	if(vertices[1].data) transformed = true;
-	else transformed = false;
-	if(!vertices[0].data)
+	if (!vertices)
 	{
 		This->outputs[0] = (void*)DDERR_INVALIDPARAMS;
 		SetEvent(This->busy);
 		return;
 	}
-	This->shaderstate3d.stateid &= 0xFFFA3FF87FFFFFFFi64;
-	int numtextures = 0;
-	for (i = 0; i < 8; i++)
+	if (fvf != This->last_fvf) glRenderer__UpdateFVF(This, fvf);
+	if (!This->fvf_stride)
 	{
-		This->shaderstate3d.texstageid[i] &= 0xFFE7FFFFFFFFFFFFi64;
-		This->shaderstate3d.texstageid[i] |= (__int64)(texformats[i] - 1) << 51;
-		if (vertices[i + 10].data) numtextures++;
+		This->outputs[0] = (void*)D3DERR_INVALIDVERTEXTYPE;
+		SetEvent(This->busy);
+		return;
 	}
-	This->shaderstate3d.stateid |= (__int64)((numtextures-1)&7) << 31;
-	if (numtextures) This->shaderstate3d.stateid |= (1i64 << 34);
-	int blendweights = 0;
-	for (i = 0; i < 5; i++)
-		if (vertices[i + 2].data) blendweights++;
-	This->shaderstate3d.stateid |= (__int64)blendweights << 46;
-	if (vertices[1].data) This->shaderstate3d.stateid |= (1i64 << 50);
-	if (vertices[8].data) This->shaderstate3d.stateid |= (1i64 << 35);
-	if (vertices[9].data) This->shaderstate3d.stateid |= (1i64 << 36);
-	if (vertices[7].data) This->shaderstate3d.stateid |= (1i64 << 37);
-	ShaderManager_SetShader(This->shaders,This->shaderstate3d.stateid,This->shaderstate3d.texstageid,2);
-	glRenderer__SetDepthComp(This);
-	glUtil_DepthTest(This->util, This->renderstate[D3DRENDERSTATE_ZENABLE]);
-	glUtil_DepthWrite(This->util, This->renderstate[D3DRENDERSTATE_ZWRITEENABLE]);
-	_GENSHADER *prog = &This->shaders->gen3d->current_genshader->shader;
-	glUtil_EnableArray(This->util, prog->attribs[0], TRUE);
-	This->ext->glVertexAttribPointer(prog->attribs[0],3,GL_FLOAT,GL_FALSE,vertices[0].stride,vertices[0].data);
-	if(transformed)
+	if (This->capture) glRenderer__CaptureDraw(This, target, mode, fvf, vertices, buffer, strided, count,
+		indices, indextype, indexcount, flags);
+	if (This->shaderkeydirty)
 	{
-		if(prog->attribs[1] != -1)
+		This->shaderstate3d.stateid &= ~((0x7Fi64 << 31) | (7i64 << 46) | (1i64 << 50));
+		This->shaderstate3d.stateid |= This->fvf_stateid;
+		for (i = 0; i < 8; i++)
 		{
-			glUtil_EnableArray(This->util, prog->attribs[1], TRUE);
-			This->ext->glVertexAttribPointer(prog->attribs[1],1,GL_FLOAT,GL_FALSE,vertices[1].stride,vertices[1].data);
+			This->shaderstate3d.texstageid[i] &= 0xFFE7FFFFFFFFFFFFi64;
+			This->shaderstate3d.texstageid[i] |= This->fvf_texstageid[i];
 		}
 	}
-	for(i = 0; i < 5; i++)
+	// Whether the key is in alpha depends on uploads, not on the state
+	for (i = 0; i < 8; i++)
 	{
-		if(vertices[i+2].data)
+		if (((This->shaderstate3d.texstageid[i] >> 60) & 1) && glRenderer__KeyInAlpha(This->texstages[i].texture))
 		{
-			if(prog->attribs[i+2] != -1)
-			{
-				glUtil_EnableArray(This->util, prog->attribs[i + 2], TRUE);
-				This->ext->glVertexAttribPointer(prog->attribs[i+2],1,GL_FLOAT,GL_FALSE,vertices[i+2].stride,vertices[i+2].data);
-			}
+			if (!((This->shaderstate3d.texstageid[i] >> 61) & 1)) This->shaderkeydirty = TRUE;
+			This->shaderstate3d.texstageid[i] |= 1i64 << 61;
 		}
-	}
-	if(vertices[7].data)
-	{
-		if(prog->attribs[7] != -1)
+		else if ((This->shaderstate3d.texstageid[i] >> 61) & 1)
 		{
-			glUtil_EnableArray(This->util, prog->attribs[7], TRUE);
-			This->ext->glVertexAttribPointer(prog->attribs[7],3,GL_FLOAT,GL_FALSE,vertices[7].stride,vertices[7].data);
+			This->shaderkeydirty = TRUE;
+			This->shaderstate3d.texstageid[i] &= ~(1i64 << 61);
 		}
 	}
-	for(i = 0; i < 2; i++)
+	// Draws with the same state as the last one skip normalizing the key and the shader lookup,
+	// unless a 2D or built-in shader was used in between or the shader was still compiling
+	if (This->shaderkeydirty || (This->shaders->gen3d->current_shadertype != 2) ||
+		This->shaders->gen3d->current_pending || !This->shaders->gen3d->current_genshader)
+		ShaderManager_SetShader(This->shaders,This->shaderstate3d.stateid | (This->batchhandles ? 1i64 << 17 : 0),
+			This->shaderstate3d.texstageid,2);
+	else This->shaders->gen3d->current_genshader->lastused = This->shaders->gen3d->frame;
+	This->shaderkeydirty = FALSE;
+	if (!This->shaders->gen3d->current_genshader)
 	{
-		if(vertices[i+8].data)
-		{
-			if(prog->attribs[8+i] != -1)
-			{
-				glUtil_EnableArray(This->util, prog->attribs[8 + i], TRUE);
-				This->ext->glVertexAttribPointer(prog->attribs[8+i],4,GL_UNSIGNED_BYTE,GL_TRUE,vertices[i+8].stride,vertices[i+8].data);
-			}
-		}
+		// Shader is still compiling in the background
+		This->outputs[0] = (void*)D3D_OK;
+		SetEvent(This->busy);
+		return;
 	}
-	for(i = 0; i < 8; i++)
+	glRenderer__SetDepthComp(This);
+	glUtil_DepthTest(This->util, This->renderstate[D3DRENDERSTATE_ZENABLE]);
+	glUtil_DepthWrite(This->util, This->renderstate[D3DRENDERSTATE_ZWRITEENABLE]);
+	glRenderer__SetStencil(This);
+	// Higher ZBIAS values pull the primitive towards the viewer
+	glUtil_PolygonOffset(This->util, 0.0f, -(GLfloat)This->renderstate[D3DRENDERSTATE_ZBIAS]);
+	_GENSHADER *prog = &This->shaders->gen3d->current_genshader->shader;
+	const GLvoid *indexptr = indices;
+	BufferObject *vbo = NULL;
+	BYTE *gathered = NULL;
+	GLintptr base = (GLintptr)vertices;
+	if (strided)
 	{
+		if (glRenderer__StreamSeparate(This, (LPD3DDRAWPRIMITIVESTRIDEDDATA)vertices, count,
+			separateoffsets, separatestrides))
 		{
-			switch(texformats[i])
-			{
-			case -1: // Null
-				break;
-			case 1: // s
-				if (prog->attribs[i + 10] != -1)
-				{
-					glUtil_EnableArray(This->util, prog->attribs[i + 10], TRUE);
-					This->ext->glVertexAttribPointer(prog->attribs[i + 10], 1, GL_FLOAT, GL_FALSE, vertices[i + 10].stride, vertices[i + 10].data);
-				}
-				break;
-			case 2: // st
-				if(prog->attribs[i+18] != -1)
-				{
-					glUtil_EnableArray(This->util, prog->attribs[i + 18], TRUE);
-					This->ext->glVertexAttribPointer(prog->attribs[i+18],2,GL_FLOAT,GL_FALSE,vertices[i+10].stride,vertices[i+10].data);
-				}
-				break;
-			case 3: // str
-				if(prog->attribs[i+26] != -1)
-				{
-					glUtil_EnableArray(This->util, prog->attribs[i + 26], TRUE);
-					This->ext->glVertexAttribPointer(prog->attribs[i+26],3,GL_FLOAT,GL_FALSE,vertices[i+10].stride,vertices[i+10].data);
-				}
-				break;
-			case 4: // strq
-				if(prog->attribs[i+34] != -1)
-				{
-					glUtil_EnableArray(This->util, prog->attribs[i + 34], TRUE);
-					This->ext->glVertexAttribPointer(prog->attribs[i+34],4,GL_FLOAT,false,vertices[i+10].stride,vertices[i+10].data);
-				}
-				break;
+			vbo = This->cmdbuffer[0].vertices;
+			separate = TRUE;
+		}
+		else if (glRenderer__StreamStrided(This, (LPD3DDRAWPRIMITIVESTRIDEDDATA)vertices, count, &base))
+			vbo = This->cmdbuffer[0].vertices;
+		else
+		{
+			if (This->arena) gathered = (BYTE*)FrameArena_Alloc(This->arena, This->fvf_stride * count);
+			if (!gathered)
+			{
+				This->outputs[0] = (void*)DDERR_OUTOFMEMORY;
+				SetEvent(This->busy);
+				return;
 			}
-
+			glRenderer__GatherStrided(This, (LPD3DDRAWPRIMITIVESTRIDEDDATA)vertices, count, gathered);
+			base = (GLintptr)gathered;
 		}
 	}
-	glUtil_SetMaterial(This->util, (GLfloat*)&This->material.ambient, (GLfloat*)&This->material.diffuse, (GLfloat*)&This->material.specular,
-		(GLfloat*)&This->material.emissive, This->material.power);
-
-	int lightindex = 0;
-	char lightname[] = "lightX.xxxxxxxxxxxxxxxx";
-	for(i = 0; i < 8; i++)
+	else if (buffer)
 	{
-		if(This->lights[i].dltType)
-		{
-			haslights = TRUE;
-			if(prog->uniforms[20+(i*12)] != -1)
-				This->ext->glUniform4fv(prog->uniforms[20+(i*12)],1,(GLfloat*)&This->lights[i].dcvDiffuse);
-			if(prog->uniforms[21+(i*12)] != -1)
-				This->ext->glUniform4fv(prog->uniforms[21+(i*12)],1,(GLfloat*)&This->lights[i].dcvSpecular);
-			if(prog->uniforms[22+(i*12)] != -1)
-				This->ext->glUniform4fv(prog->uniforms[22+(i*12)],1,(GLfloat*)&This->lights[i].dcvAmbient);
-			if(prog->uniforms[24+(i*12)] != -1)
-				This->ext->glUniform3fv(prog->uniforms[24+(i*12)],1,(GLfloat*)&This->lights[i].dvDirection);
-			if(This->lights[i].dltType != D3DLIGHT_DIRECTIONAL)
-			{
-				if(prog->uniforms[23+(i*12)] != -1)
-					This->ext->glUniform3fv(prog->uniforms[23+(i*12)],1,(GLfloat*)&This->lights[i].dvPosition);
-				if(prog->uniforms[25+(i*12)] != -1)
-					This->ext->glUniform1f(prog->uniforms[25+(i*12)],This->lights[i].dvRange);
-				if(prog->uniforms[26+(i*12)] != -1)
-					This->ext->glUniform1f(prog->uniforms[26+(i*12)],This->lights[i].dvFalloff);
-				if(prog->uniforms[27+(i*12)] != -1)
-					This->ext->glUniform1f(prog->uniforms[27+(i*12)],This->lights[i].dvAttenuation0);
-				if(prog->uniforms[28+(i*12)] != -1)
-					This->ext->glUniform1f(prog->uniforms[28+(i*12)],This->lights[i].dvAttenuation1);
-				if(prog->uniforms[29+(i*12)] != -1)
-					This->ext->glUniform1f(prog->uniforms[29+(i*12)],This->lights[i].dvAttenuation2);
-				if(prog->uniforms[30+(i*12)] != -1)
-					This->ext->glUniform1f(prog->uniforms[30+(i*12)],This->lights[i].dvTheta);
-				if(prog->uniforms[31+(i*12)] != -1)
-					This->ext->glUniform1f(prog->uniforms[31+(i*12)],This->lights[i].dvPhi);
-			}
+		if (glRenderer__BindVertexBuffer(This, buffer))
+		{
+			vbo = buffer->vbo;
+			base = vertices - buffer->data;
 		}
-		lightindex++;
 	}
-	if (haslights)
+	else if (glRenderer__StreamVertices(This, vertices, count, &base)) vbo = This->cmdbuffer[0].vertices;
+	if (indices && buffer && buffer->isstatic && (indextype == GL_UNSIGNED_SHORT) && This->cmdbuffer[0].streaming)
 	{
-		if (prog->uniforms[0] != -1) This->ext->glUniformMatrix4fv(prog->uniforms[0], 1, false,
-			(GLfloat*)&This->transform[D3DTRANSFORMSTATE_WORLD]);
-		This->ext->glUniform4fv(prog->uniforms[161], 1, This->util->materialambient);
-		This->ext->glUniform4fv(prog->uniforms[162], 1, This->util->materialdiffuse);
-		This->ext->glUniform4fv(prog->uniforms[163], 1, This->util->materialspecular);
-		This->ext->glUniform4fv(prog->uniforms[164], 1, This->util->materialemission);
-		This->ext->glUniform1f(prog->uniforms[165], This->util->materialshininess);
+		cachedindices = glRenderer__BindCachedIndices(This, buffer, (const WORD*)indices, indexcount);
+		if (cachedindices) indexptr = NULL;
 	}
-	if(prog->uniforms[1] != -1) This->ext->glUniformMatrix4fv(prog->uniforms[1], 1, false,
-		(GLfloat*)&This->transform[4]);
-	if (prog->uniforms[2] != -1) This->ext->glUniformMatrix4fv(prog->uniforms[2], 1, false,
-		(GLfloat*)&This->transform[D3DTRANSFORMSTATE_PROJECTION]);
-	if (prog->uniforms[3] != -1) This->ext->glUniformMatrix3fv(prog->uniforms[3], 1, true,
-		(GLfloat*)&This->transform[5]);
-	DWORD ambient = This->renderstate[D3DRENDERSTATE_AMBIENT];
-	if (prog->uniforms[136] != -1)
-		This->ext->glUniform4f(prog->uniforms[136], (GLfloat)RGBA_GETRED(ambient),
-			(GLfloat)RGBA_GETGREEN(ambient), (GLfloat)RGBA_GETBLUE(ambient),
-			(GLfloat)RGBA_GETALPHA(ambient));
-	for(i = 0; i < 8; i++)
+	if (indices && !cachedindices)
+		streamindices = glRenderer__StreamIndices(This, indices, indextype, indexcount, &indexptr);
+	VertexArrayKey layout;
+	GLint basevertex = 0;
+	BOOL usevao;
+	glRenderer__GetVertexLayout(This, prog, base, vbo, &layout);
+	if (separate)
 	{
-		if(This->texstages[i].colorop == D3DTOP_DISABLE) break;
-		if(This->texstages[i].texture)
+		for (i = 0; i < 18; i++)
 		{
-			if(This->texstages[i].texture->levels[0].dirty & 1)
-			{
-				glTexture__Upload(This->texstages[i].texture, 0);
-			}
-			if (This->texstages[i].texture)
-				glTexture__SetFilter(This->texstages[i].texture, i, This->texstages[i].glmagfilter, This->texstages[i].glminfilter, This);
-			glUtil_SetTexture(This->util,i,This->texstages[i].texture);
-			glUtil_SetWrap(This->util, i, 0, This->texstages[i].addressu);
-			glUtil_SetWrap(This->util, i, 1, This->texstages[i].addressv);
+			if (layout.location[i] == -1) continue;
+			layout.offset[i] = separateoffsets[i];
+			layout.stride[i] = separatestrides[i];
 		}
-		else glUtil_SetTexture(This->util,i,0);
-		This->ext->glUniform1i(prog->uniforms[128+i],i);
-		if(This->renderstate[D3DRENDERSTATE_COLORKEYENABLE] && This->texstages[i].texture && (prog->uniforms[142+i] != -1))
+	}
+	// A cached vertex array object is bound just before drawing instead, separate
+	// streams land at different distances apart every draw so they never share one
+	usevao = This->ext->GLEXT_ARB_vertex_array_object && vbo && !separate
+		&& (!indices || streamindices || cachedindices)
+		&& glRenderer__RebaseVertexLayout(This, &layout, indices != NULL, &basevertex);
+	if (!usevao) glRenderer__SetVertexAttribs(This, &layout);
+	if (vbo) BufferObject_Unbind(vbo, GL_ARRAY_BUFFER);
+	if (This->ubo[0])
+	{
+		// The light loop only applies the lights that reach this draw
+		if (((This->shaderstate3d.stateid >> 63) & 1) && ((This->shaderstate3d.stateid >> 59) & 1)
+			&& !((This->shaderstate3d.stateid >> 50) & 1))
 		{
-			if(This->texstages[i].texture->levels[0].ddsd.dwFlags & DDSD_CKSRCBLT)
+			if (strided) glRenderer__CullLights(This,
+				(const BYTE*)((LPD3DDRAWPRIMITIVESTRIDEDDATA)vertices)->position.lpvData,
+				((LPD3DDRAWPRIMITIVESTRIDEDDATA)vertices)->position.dwStride, count);
+			else glRenderer__CullLights(This, vertices, This->fvf_stride, count);
+		}
+		glRenderer__UpdateUniformBlocks(This);
+	}
+	else
+	{
+		// Pre-transformed vertices are never lit, their shaders have no light or material uniforms
+		BOOL pretransformed = (This->shaderstate3d.stateid >> 50) & 1;
+		if (!pretransformed)
+			glUtil_SetMaterial(This->util, (GLfloat*)&This->material.ambient, (GLfloat*)&This->material.diffuse,
+				(GLfloat*)&This->material.specular, (GLfloat*)&This->material.emissive, This->material.power);
+
+		int lightindex = 0;
+		for(i = 0; (i < 8) && !pretransformed; i++)
+		{
+			if(This->lights[i].dltType)
 			{
-				SetColorKeyUniform(This->texstages[i].texture->levels[0].ddsd.ddckCKSrcBlt.dwColorSpaceLowValue,
-					This->texstages[i].texture->colorsizes, This->texstages[i].texture->colororder,
-					prog->uniforms[142 + i], This->texstages[i].texture->colorbits, This->ext);
-				This->ext->glUniform4i(prog->uniforms[153+i], This->texstages[i].texture->colorsizes[0], 
-					This->texstages[i].texture->colorsizes[1],
-					This->texstages[i].texture->colorsizes[2],
-					This->texstages[i].texture->colorsizes[3]);
+				haslights = TRUE;
+				if (glRenderer__ShadowUniform(prog->uniforms[20 + (lightindex * 12)], GENSHADER_SHADOW(prog, 20 + (lightindex * 12)),
+					(GLfloat*)&This->lights[i].dcvDiffuse, 4 * sizeof(GLfloat)))
+					This->ext->glUniform4fv(prog->uniforms[20 + (lightindex * 12)], 1, (GLfloat*)&This->lights[i].dcvDiffuse);
+				if (glRenderer__ShadowUniform(prog->uniforms[21 + (lightindex * 12)], GENSHADER_SHADOW(prog, 21 + (lightindex * 12)),
+					(GLfloat*)&This->lights[i].dcvSpecular, 4 * sizeof(GLfloat)))
+					This->ext->glUniform4fv(prog->uniforms[21 + (lightindex * 12)], 1, (GLfloat*)&This->lights[i].dcvSpecular);
+				if (glRenderer__ShadowUniform(prog->uniforms[22 + (lightindex * 12)], GENSHADER_SHADOW(prog, 22 + (lightindex * 12)),
+					(GLfloat*)&This->lights[i].dcvAmbient, 4 * sizeof(GLfloat)))
+					This->ext->glUniform4fv(prog->uniforms[22 + (lightindex * 12)], 1, (GLfloat*)&This->lights[i].dcvAmbient);
+				if (glRenderer__ShadowUniform(prog->uniforms[24 + (lightindex * 12)], GENSHADER_SHADOW(prog, 24 + (lightindex * 12)),
+					(GLfloat*)&This->lights[i].dvDirection, 3 * sizeof(GLfloat)))
+					This->ext->glUniform3fv(prog->uniforms[24 + (lightindex * 12)], 1, (GLfloat*)&This->lights[i].dvDirection);
+				if(This->lights[i].dltType != D3DLIGHT_DIRECTIONAL)
+				{
+					if (glRenderer__ShadowUniform(prog->uniforms[23 + (lightindex * 12)], GENSHADER_SHADOW(prog, 23 + (lightindex * 12)),
+						(GLfloat*)&This->lights[i].dvPosition, 3 * sizeof(GLfloat)))
+						This->ext->glUniform3fv(prog->uniforms[23 + (lightindex * 12)], 1, (GLfloat*)&This->lights[i].dvPosition);
+					if (glRenderer__ShadowUniform(prog->uniforms[25 + (lightindex * 12)], GENSHADER_SHADOW(prog, 25 + (lightindex * 12)),
+						&This->lights[i].dvRange, sizeof(GLfloat)))
+						This->ext->glUniform1f(prog->uniforms[25 + (lightindex * 12)], This->lights[i].dvRange);
+					if (glRenderer__ShadowUniform(prog->uniforms[26 + (lightindex * 12)], GENSHADER_SHADOW(prog, 26 + (lightindex * 12)),
+						&This->lights[i].dvFalloff, sizeof(GLfloat)))
+						This->ext->glUniform1f(prog->uniforms[26 + (lightindex * 12)], This->lights[i].dvFalloff);
+					if (glRenderer__ShadowUniform(prog->uniforms[27 + (lightindex * 12)], GENSHADER_SHADOW(prog, 27 + (lightindex * 12)),
+						&This->lights[i].dvAttenuation0, sizeof(GLfloat)))
+						This->ext->glUniform1f(prog->uniforms[27 + (lightindex * 12)], This->lights[i].dvAttenuation0);
+					if (glRenderer__ShadowUniform(prog->uniforms[28 + (lightindex * 12)], GENSHADER_SHADOW(prog, 28 + (lightindex * 12)),
+						&This->lights[i].dvAttenuation1, sizeof(GLfloat)))
+						This->ext->glUniform1f(prog->uniforms[28 + (lightindex * 12)], This->lights[i].dvAttenuation1);
+					if (glRenderer__ShadowUniform(prog->uniforms[29 + (lightindex * 12)], GENSHADER_SHADOW(prog, 29 + (lightindex * 12)),
+						&This->lights[i].dvAttenuation2, sizeof(GLfloat)))
+						This->ext->glUniform1f(prog->uniforms[29 + (lightindex * 12)], This->lights[i].dvAttenuation2);
+					if (glRenderer__ShadowUniform(prog->uniforms[30 + (lightindex * 12)], GENSHADER_SHADOW(prog, 30 + (lightindex * 12)),
+						&This->lights[i].dvTheta, sizeof(GLfloat)))
+						This->ext->glUniform1f(prog->uniforms[30 + (lightindex * 12)], This->lights[i].dvTheta);
+					if (glRenderer__ShadowUniform(prog->uniforms[31 + (lightindex * 12)], GENSHADER_SHADOW(prog, 31 + (lightindex * 12)),
+						&This->lights[i].dvPhi, sizeof(GLfloat)))
+						This->ext->glUniform1f(prog->uniforms[31 + (lightindex * 12)], This->lights[i].dvPhi);
+				}
+				lightindex++;
 			}
 		}
+		if (haslights)
+		{
+			if (glRenderer__ShadowUniform(prog->uniforms[0], GENSHADER_SHADOW(prog, 0),
+				&This->transform[D3DTRANSFORMSTATE_WORLD], 16 * sizeof(GLfloat)))
+				This->ext->glUniformMatrix4fv(prog->uniforms[0], 1, false,
+					(GLfloat*)&This->transform[D3DTRANSFORMSTATE_WORLD]);
+			if (glRenderer__ShadowUniform(prog->uniforms[161], GENSHADER_SHADOW(prog, 161),
+				This->util->materialambient, 4 * sizeof(GLfloat)))
+				This->ext->glUniform4fv(prog->uniforms[161], 1, This->util->materialambient);
+			if (glRenderer__ShadowUniform(prog->uniforms[162], GENSHADER_SHADOW(prog, 162),
+				This->util->materialdiffuse, 4 * sizeof(GLfloat)))
+				This->ext->glUniform4fv(prog->uniforms[162], 1, This->util->materialdiffuse);
+			if (glRenderer__ShadowUniform(prog->uniforms[163], GENSHADER_SHADOW(prog, 163),
+				This->util->materialspecular, 4 * sizeof(GLfloat)))
+				This->ext->glUniform4fv(prog->uniforms[163], 1, This->util->materialspecular);
+			if (glRenderer__ShadowUniform(prog->uniforms[164], GENSHADER_SHADOW(prog, 164),
+				This->util->materialemission, 4 * sizeof(GLfloat)))
+				This->ext->glUniform4fv(prog->uniforms[164], 1, This->util->materialemission);
+			if (glRenderer__ShadowUniform(prog->uniforms[165], GENSHADER_SHADOW(prog, 165),
+				&This->util->materialshininess, sizeof(GLfloat)))
+				This->ext->glUniform1f(prog->uniforms[165], This->util->materialshininess);
+		}
+		if (glRenderer__ShadowUniform(prog->uniforms[1], GENSHADER_SHADOW(prog, 1),
+			&This->transform[4], 16 * sizeof(GLfloat)))
+			This->ext->glUniformMatrix4fv(prog->uniforms[1], 1, false, (GLfloat*)&This->transform[4]);
+		if (glRenderer__ShadowUniform(prog->uniforms[2], GENSHADER_SHADOW(prog, 2),
+			&This->transform[D3DTRANSFORMSTATE_PROJECTION], 16 * sizeof(GLfloat)))
+			This->ext->glUniformMatrix4fv(prog->uniforms[2], 1, false,
+				(GLfloat*)&This->transform[D3DTRANSFORMSTATE_PROJECTION]);
+		if (glRenderer__ShadowUniform(prog->uniforms[3], GENSHADER_SHADOW(prog, 3),
+			&This->transform[5], 9 * sizeof(GLfloat)))
+			This->ext->glUniformMatrix3fv(prog->uniforms[3], 1, true, (GLfloat*)&This->transform[5]);
+		if (glRenderer__ShadowUniform(prog->uniforms[4], GENSHADER_SHADOW(prog, 4),
+			&This->transformmvp, 16 * sizeof(GLfloat)))
+			This->ext->glUniformMatrix4fv(prog->uniforms[4], 1, false, (GLfloat*)&This->transformmvp);
+	}
+	// Bindless samplers are set per draw, either to a handle or to their texture unit
+	if (!prog->samplersset && !This->ext->GLEXT_ARB_bindless_texture)
+	{
+		for (i = 0; i < 8; i++)
+			if (prog->uniforms[128 + i] != -1) This->ext->glUniform1i(prog->uniforms[128 + i], i);
+		prog->samplersset = TRUE;
 	}
-	if(prog->uniforms[137]!= -1) This->ext->glUniform1f(prog->uniforms[137],(GLfloat)This->viewport.dwWidth);
-	if(prog->uniforms[138]!= -1) This->ext->glUniform1f(prog->uniforms[138],(GLfloat)This->viewport.dwHeight);
-	if(prog->uniforms[139]!= -1) This->ext->glUniform1f(prog->uniforms[139],(GLfloat)This->viewport.dwX);
-	if(prog->uniforms[140]!= -1) This->ext->glUniform1f(prog->uniforms[140],(GLfloat)This->viewport.dwY);
-	if(prog->uniforms[141]!= -1) This->ext->glUniform1i(prog->uniforms[141],This->renderstate[D3DRENDERSTATE_ALPHAREF]);
-	if(prog->uniforms[150]!= -1) This->ext->glUniform4iv(prog->uniforms[150],1,(GLint*)target->target->colorbits);
-	if (prog->uniforms[166] != -1) This->ext->glUniform4fv(prog->uniforms[166], 1, This->fogcolorfloat);
-	if (prog->uniforms[167] != -1) This->ext->glUniform1f(prog->uniforms[167], This->fogstart);
-	if (prog->uniforms[168] != -1) This->ext->glUniform1f(prog->uniforms[168], This->fogend);
-	if (prog->uniforms[169] != -1) This->ext->glUniform1f(prog->uniforms[169], This->fogdensity);
+	DWORD ambient = This->renderstate[D3DRENDERSTATE_AMBIENT];
+	GLfloat ambientcolor[4] = { (GLfloat)RGBA_GETRED(ambient), (GLfloat)RGBA_GETGREEN(ambient),
+		(GLfloat)RGBA_GETBLUE(ambient), (GLfloat)RGBA_GETALPHA(ambient) };
+	if (glRenderer__ShadowUniform(prog->uniforms[136], GENSHADER_SHADOW(prog, 136), ambientcolor, 4 * sizeof(GLfloat)))
+		This->ext->glUniform4fv(prog->uniforms[136], 1, ambientcolor);
+	glRenderer__SetTextureStages(This, prog);
+	GLfloat viewsize[4] = { (GLfloat)This->viewport.dwWidth, (GLfloat)This->viewport.dwHeight,
+		(GLfloat)This->viewport.dwX, (GLfloat)This->viewport.dwY };
+	for (i = 0; i < 4; i++)
+	{
+		if (glRenderer__ShadowUniform(prog->uniforms[137 + i], GENSHADER_SHADOW(prog, 137 + i), &viewsize[i], sizeof(GLfloat)))
+			This->ext->glUniform1f(prog->uniforms[137 + i], viewsize[i]);
+	}
+	if (glRenderer__ShadowUniform(prog->uniforms[141], GENSHADER_SHADOW(prog, 141),
+		&This->renderstate[D3DRENDERSTATE_ALPHAREF], sizeof(GLint)))
+		This->ext->glUniform1i(prog->uniforms[141], This->renderstate[D3DRENDERSTATE_ALPHAREF]);
+	if (glRenderer__ShadowUniform(prog->uniforms[150], GENSHADER_SHADOW(prog, 150),
+		target->target->colorbits, 4 * sizeof(GLint)))
+		This->ext->glUniform4iv(prog->uniforms[150], 1, (GLint*)target->target->colorbits);
+	if (glRenderer__ShadowUniform(prog->uniforms[166], GENSHADER_SHADOW(prog, 166), This->fogcolorfloat, 4 * sizeof(GLfloat)))
+		This->ext->glUniform4fv(prog->uniforms[166], 1, This->fogcolorfloat);
+	if (glRenderer__ShadowUniform(prog->uniforms[167], GENSHADER_SHADOW(prog, 167), &This->fogstart, sizeof(GLfloat)))
+		This->ext->glUniform1f(prog->uniforms[167], This->fogstart);
+	if (glRenderer__ShadowUniform(prog->uniforms[168], GENSHADER_SHADOW(prog, 168), &This->fogend, sizeof(GLfloat)))
+		This->ext->glUniform1f(prog->uniforms[168], This->fogend);
+	if (glRenderer__ShadowUniform(prog->uniforms[169], GENSHADER_SHADOW(prog, 169), &This->fogdensity, sizeof(GLfloat)))
+		This->ext->glUniform1f(prog->uniforms[169], This->fogdensity);
 	do
 	{
-		if (glUtil_SetFBOSurface(This->util, target->target, ztexture,
-			target->level, zlevel, FALSE) == GL_FRAMEBUFFER_COMPLETE) break;
+		if (glRenderer__SetRenderTarget(This, target->target, ztexture,
+			target->level, zlevel) == GL_FRAMEBUFFER_COMPLETE) break;
 		if (!target->target->internalformats[1]) break;
 		glTexture__Repair(target->target, TRUE);
 		glUtil_SetFBO(This->util, NULL);
 		target->target->levels[target->level].fbo.fbcolor = NULL;
 		target->target->levels[target->level].fbo.fbz = NULL;
 	} while (1);
+	// The scale is known once the target is bound
+	target->mulx = This->mulx;
+	target->muly = This->muly;
 	glUtil_SetViewport(This->util, (int)((float)This->viewport.dwX*target->mulx),
 		(int)((float)This->viewport.dwY*target->muly),
 		(int)((float)This->viewport.dwWidth*target->mulx),
@@ -3532,110 +8440,130 @@ void glRenderer__DrawPrimitivesOld(glRenderer *This, RenderTarget *target, GLenu
 	glRenderer__SetFogDensity(This,*(GLfloat*)(&This->renderstate[D3DRENDERSTATE_FOGDENSITY]));
 	glUtil_SetPolyMode(This->util, (D3DFILLMODE)This->renderstate[D3DRENDERSTATE_FILLMODE]);
 	glUtil_SetShadeMode(This->util, (D3DSHADEMODE)This->renderstate[D3DRENDERSTATE_SHADEMODE]);
-	if (indices)
-	{
-		#if 1
-		static GLuint oneColorProg = [=]() {
-			//This->ext->glClipControl(GL_UPPER_LEFT, GL_NEGATIVE_ONE_TO_ONE);
-			auto vsShaderSrc = R"(#version 460
-in vec3 xyz;
-in float rhw;
-in vec4 rgba0;
-in vec2 st0;
-in vec2 st1;
-in vec2 st2;
-in vec2 st3;
-in vec2 st4;
-in vec2 st5;
-in vec2 st6;
-in vec2 st7;
-
-layout(location = 0) uniform float width;
-layout(location = 1) uniform float height;
-layout(location = 2) uniform float xoffset;
-layout(location = 3) uniform float yoffset;
-void main()
-{
-	gl_Position = vec4(((xyz.x-xoffset)/(width/2.0)-1.0)/rhw, -((xyz.y-yoffset)/(height/2.0)-1.0)/rhw, xyz.z/rhw, 1.0/rhw);
-}
-)";
-
-			auto oneColorSrc = R"(#version 460
-layout(location = 99)
-uniform vec4 onecolor;
-void main()
-{
-	gl_FragColor = onecolor;
-}
-)";
-			GLuint vsShader = glCreateShader(GL_VERTEX_SHADER);
-			glShaderSource(vsShader, 1, &vsShaderSrc, nullptr);
-			glCompileShader(vsShader);
-			GLuint oneColorShader = glCreateShader(GL_FRAGMENT_SHADER);
-			glShaderSource(oneColorShader, 1, &oneColorSrc, nullptr);
-			glCompileShader(oneColorShader);
-			GLuint oneColorProg = glCreateProgram();
-			glObjectLabel(GL_SHADER, oneColorShader, sizeof("onecolor"), "onecolor");
-			glAttachShader(oneColorProg, vsShader);
-			glAttachShader(oneColorProg, oneColorShader);
-			glLinkProgram(oneColorProg);
-			// have to check status as glLinkProgram always returns "no error"
-			GLint status;
-			glGetProgramiv(oneColorProg, GL_LINK_STATUS, &status);
-			char logbuf[256];
-			glGetProgramInfoLog(oneColorProg, sizeof(logbuf), nullptr, logbuf);
-			glUseProgram(oneColorProg);
-			glUniform1f(0, (GLfloat)This->viewport.dwWidth);
-			glUniform1f(1, (GLfloat)This->viewport.dwHeight);
-			glUniform1f(2, (GLfloat)This->viewport.dwX);
-			glUniform1f(3, (GLfloat)This->viewport.dwY);
-			//glUniform1i(prog->uniforms[141], This->renderstate[D3DRENDERSTATE_ALPHAREF]);
-			return oneColorProg;
-		}();
-		if (debugRenderingEnabled)
-		{
-			GLScopedDebugMarker ovscope("Depth Overlay");
-			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
-			// copy current partial frame
-			const int screenxres = 1920;
-			const int gamexres = 1600;
-			const int x = (screenxres - gamexres) / 2;
-			// copy and flip
-			glBlitFramebuffer(0, This->viewport.dwHeight, This->viewport.dwWidth, 0, x, 0, gamexres + x, 1080, GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT, GL_NEAREST);
-			SwapBuffers(This->hDC);
-			//glFinish();
-			Sleep(indexcount);
-			glViewport(x, 0, gamexres, 1080);
-			glDepthMask(GL_FALSE);
-			glDisable(GL_DEPTH_TEST);
-			glUseProgram(oneColorProg);
-			glUniform4f(99, 1, 0, 0, 1);
-			glDrawElements(mode, indexcount, GL_UNSIGNED_SHORT, indices);
-			glEnable(GL_DEPTH_TEST);
-			glUniform4f(99, 0, 1, 0, 1);
-			glDrawElements(mode, indexcount, GL_UNSIGNED_SHORT, indices);
-			//glFlush();
-			SwapBuffers(This->hDC);
-			//glFinish();
-			Sleep(indexcount);
-			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, This->util->currentfbo->fbo);
-			glViewport(This->viewport.dwX, This->viewport.dwY, This->viewport.dwWidth, This->viewport.dwHeight);
-			glDepthMask(This->util->depthwrite);
-			glUseProgram(prog->prog);
-		}
-#endif
-		glDrawElements(mode, indexcount, GL_UNSIGNED_SHORT, indices);
+	if (usevao) glRenderer__BindVertexArray(This, &layout);
+	// Cached vertex arrays keep the stream buffer bound, so the index buffer is swapped in for the draw
+	if (usevao && cachedindices) BufferObject_Bind(buffer->ibo, GL_ELEMENT_ARRAY_BUFFER);
+	This->perf.frame.dwDraws++;
+	if (This->indirectbatch)
+	{
+		glRenderer__DrawBatchRanges(This, prog, mode, indextype, indexptr, basevertex, streamindices);
+		if (usevao) This->ext->glBindVertexArray(0);
+		if (streamindices) BufferObject_Unbind(This->cmdbuffer[0].indices, GL_ELEMENT_ARRAY_BUFFER);
+	}
+	else if (indices)
+	{
+		if (usevao && basevertex)
+			This->ext->glDrawElementsBaseVertex(mode, indexcount, indextype, indexptr, basevertex);
+		else glDrawElements(mode, indexcount, indextype, indexptr);
+		if (usevao && cachedindices) BufferObject_Bind(This->cmdbuffer[0].indices, GL_ELEMENT_ARRAY_BUFFER);
+		if (usevao) This->ext->glBindVertexArray(0);
+		if (streamindices) BufferObject_Unbind(This->cmdbuffer[0].indices, GL_ELEMENT_ARRAY_BUFFER);
+		else if (cachedindices) BufferObject_Unbind(buffer->ibo, GL_ELEMENT_ARRAY_BUFFER);
 	}
 	else
-		glDrawArrays(mode, 0, count);
-	if(target->zbuffer) target->zbuffer->levels[target->zlevel].dirty |= 2;
-	target->target->levels[target->level].dirty |= 2;
+	{
+		glDrawArrays(mode, basevertex, count);
+		if (usevao) This->ext->glBindVertexArray(0);
+	}
+	if (gathered) FrameArena_Rewind(This->arena, gathered);
+	if(target->zbuffer) target->zbuffer->levels[target->zlevel].dirty = (target->zbuffer->levels[target->zlevel].dirty | 2) & ~84;
+	if (dxglcfg.DebugView && target->zbuffer && !target->zlevel) This->debugdepth = target->zbuffer;
+	target->target->levels[target->level].dirty = (target->target->levels[target->level].dirty | 2) & ~84;
+	if (target->level) target->target->automipmap = FALSE;
+	This->scenetexture = target->target;
+	This->scenelevel = target->level;
 	if(flags & D3DDP_WAIT) glFlush();
 	This->outputs[0] = (void*)D3D_OK;
 	SetEvent(This->busy);
 	return;
 }
 
+/**
+  * Uploads the textures of every draw of a batch that switches textures and
+  * gathers their bindless handles into drawhandles.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param batch
+  *  Batch to be drawn
+  * @return
+  *  TRUE if every texture has a handle, FALSE if the draws have to bind
+  *  their textures
+  */
+static BOOL glRenderer__GetBatchHandles(glRenderer *This, const DrawBatch *batch)
+{
+	glTexture *texture;
+	GLuint sampler;
+	BOOL complete = TRUE;
+	DWORD draw;
+	int i;
+	ZeroMemory(This->drawhandles, DRAWBATCH_MAXDRAWS * 8 * sizeof(GLuint64));
+	for (i = 0; i < 8; i++)
+	{
+		if (This->texstages[i].colorop == D3DTOP_DISABLE) break;
+		sampler = glUtil_GetSampler(This->util, &This->texstages[i].sampler);
+		for (draw = 0; draw < batch->draws; draw++)
+		{
+			texture = batch->drawtextures[(draw * 8) + i];
+			if (!texture) continue;
+			// Finish uploads and resolves now, they would disturb the bindings while drawing
+			if (texture->residency) TextureResidency_Use(texture->residency, texture);
+			glTexture__ApplyLOD(texture);
+			This->drawhandles[(draw * 8) + i] = glTexture__GetHandle(texture, sampler);
+			if (!This->drawhandles[(draw * 8) + i]) complete = FALSE;
+		}
+	}
+	return complete;
+}
+
+/**
+  * Draws the draws merged by glRenderer_BatchDraw as one indexed list, or
+  * with one indirect draw call if the draws switch textures.
+  * @param This
+  *  Pointer to glRenderer object
+  */
+static void glRenderer__DrawBatch(glRenderer *This)
+{
+	DrawBatch *batch = &This->drawbatch;
+	static const char format[] = "DrawBatch %d draws";
+	int draws = batch->draws;
+	BOOL restart = (batch->mode == GL_TRIANGLE_STRIP) || (batch->mode == GL_TRIANGLE_FAN) ||
+		(batch->mode == GL_LINE_STRIP);
+	BOOL switching = batch->commands != NULL;
+	glTexture *textures[8];
+	int i;
+	GLScopedDebugMarker scope(DEBUGMARKER(glRenderer__DebugMarker(&This->markers[DEBUGMARKER_DRAWBATCH], format, &draws, 1)));
+	if (switching)
+	{
+		// Textures set after the first draw were applied ahead of the batch
+		for (i = 0; i < 8; i++)
+		{
+			textures[i] = This->texstages[i].texture;
+			This->texstages[i].texture = batch->drawtextures[i];
+		}
+		if (batch->texchanged)
+		{
+			This->indirectbatch = batch;
+			This->batchhandles = glRenderer__GetBatchHandles(This, batch);
+			This->shaderkeydirty = TRUE;
+		}
+	}
+	if (restart) glEnable(GL_PRIMITIVE_RESTART_FIXED_INDEX);
+	glRenderer__DrawPrimitives(This, &batch->target, batch->mode, batch->fvf, batch->vertices, NULL, FALSE,
+		batch->vertexcount, batch->indices, batch->indextype, batch->indexcount, 0);
+	if (restart) glDisable(GL_PRIMITIVE_RESTART_FIXED_INDEX);
+	if (switching)
+	{
+		for (i = 0; i < 8; i++)
+			This->texstages[i].texture = textures[i];
+		if (This->indirectbatch)
+		{
+			This->indirectbatch = NULL;
+			This->batchhandles = FALSE;
+			This->shaderkeydirty = TRUE;
+		}
+	}
+}
+
 void glRenderer__DeleteFBO(glRenderer *This, FBO *fbo)
 {
 	glUtil_DeleteFBO(This->util, fbo);
@@ -3656,6 +8584,7 @@ void glRenderer__UpdateClipper(glRenderer *This, glTexture *stencil, GLushort *i
 		ddsd.dwFlags = DDSD_WIDTH | DDSD_HEIGHT;
 		glTexture__SetSurfaceDesc(stencil, &ddsd);
 	}
+	This->cliprebuilds++;
 	glUtil_SetFBOTextures(This->util, &stencil->levels[0].fbo, stencil, NULL, 0, 0, FALSE);
 	view[0] = view[2] = 0;
 	view[1] = (GLfloat)width;
@@ -3681,6 +8610,7 @@ void glRenderer__DepthFill(glRenderer *This, BltCommand *cmd, glTexture *parent,
 	DDSURFACEDESC2 ddsd;
 	DDSURFACEDESC2 tmpddsd;
 	BOOL usedestrect = FALSE;
+	BOOL depthonly = FALSE;
 	ddsd = cmd->dest->levels[cmd->destlevel].ddsd;
 	if (!memcmp(&cmd->destrect, &nullrect, sizeof(RECT)))
 	{
@@ -3707,6 +8637,17 @@ void glRenderer__DepthFill(glRenderer *This, BltCommand *cmd, glTexture *parent,
 		} while (1);
 	}
 	else
+	{
+		if (!cmd->destlevel) glTexture__InvalidateMSAA(cmd->dest);
+		// The depth buffer is cleared alone, the dummy color buffer is only needed if that is unsupported
+		if (This->ext->GLEXT_ARB_framebuffer_object)
+		{
+			if (glUtil_SetFBODepth(This->util, 0, GL_FRAMEBUFFER, cmd->dest, cmd->destlevel) == GL_FRAMEBUFFER_COMPLETE)
+				depthonly = TRUE;
+			else glUtil_EndFBODepth(This->util, 0, GL_FRAMEBUFFER);
+		}
+	}
+	if (!parent && !depthonly)
 	{
 		if (!cmd->dest->dummycolor)
 		{
@@ -3721,27 +8662,28 @@ void glRenderer__DepthFill(glRenderer *This, BltCommand *cmd, glTexture *parent,
 			tmpddsd.dwHeight = cmd->dest->levels[cmd->destlevel].ddsd.dwHeight;
 			tmpddsd.dwFlags = DDSD_WIDTH | DDSD_HEIGHT;
 			glTexture__SetSurfaceDesc(cmd->dest->dummycolor, &tmpddsd);
-		}			
+		}
 		glUtil_SetFBOTextures(This->util, &cmd->dest->dummycolor->levels[0].fbo, cmd->dest->dummycolor,
 			cmd->dest, cmd->destlevel, 0, FALSE);
 	}
 	glUtil_SetViewport(This->util, 0, 0, cmd->dest->levels[cmd->destlevel].ddsd.dwWidth,
 		cmd->dest->levels[cmd->destlevel].ddsd.dwHeight);
 	if (usedestrect) glUtil_SetScissor(This->util, TRUE, cmd->destrect.left, cmd->destrect.top,
-		cmd->destrect.right, cmd->destrect.bottom);
+		cmd->destrect.right - cmd->destrect.left, cmd->destrect.bottom - cmd->destrect.top);
 	glUtil_DepthWrite(This->util, TRUE);
 	glUtil_ClearDepth(This->util, cmd->bltfx.dwFillDepth / (double)0xFFFF); // FIXME:  SOTE depth workaround
 	glClear(GL_DEPTH_BUFFER_BIT);
 	if (usedestrect)glUtil_SetScissor(This->util, false, 0, 0, 0, 0);
+	if (depthonly) glUtil_EndFBODepth(This->util, 0, GL_FRAMEBUFFER);
 	This->outputs[0] = (void*)DD_OK;
 	SetEvent(This->busy);
 }
 
 void glRenderer__SetRenderState(glRenderer *This, D3DRENDERSTATETYPE dwRendStateType, DWORD dwRenderState)
 {
-	SetEvent(This->busy);
 	if (This->renderstate[dwRendStateType] == dwRenderState) return;
 	This->renderstate[dwRendStateType] = dwRenderState;
+	This->shaderkeydirty = TRUE;
 	switch (dwRendStateType)
 	{
 	case D3DRENDERSTATE_SHADEMODE:
@@ -3848,32 +8790,63 @@ void glRenderer__RemoveTextureFromD3D(glRenderer *This, glTexture *texture)
 		if (This->texstages[i].texture == texture)
 		{
 			This->texstages[i].texture = NULL;
-			This->shaderstate3d.texstageid[i] &= 0xE7FFFFFFFFFFFFFFi64;
+			This->shaderstate3d.texstageid[i] &= 0xC7FFFFFFFFFFFFFFi64;
+			This->shaderkeydirty = TRUE;
 		}
 	}
 }
 
 void glRenderer__SetTexture(glRenderer *This, DWORD dwStage, glTexture *Texture)
 {
-	if (This->texstages[dwStage].texture == Texture)
-	{
-		SetEvent(This->busy);
-		return;
-	}
+	This->perf.frame.dwTexturesSet++;
+	if (This->texstages[dwStage].texture == Texture) return;
 	This->texstages[dwStage].texture = Texture;
+	This->shaderkeydirty = TRUE;
 	if (Texture)
 	{
 		This->shaderstate3d.texstageid[dwStage] |= 1i64 << 59;
 		if (Texture->levels[0].ddsd.dwFlags & DDSD_CKSRCBLT) This->shaderstate3d.texstageid[dwStage] |= 1i64 << 60;
-		else This->shaderstate3d.texstageid[dwStage] &= 0xEFFFFFFFFFFFFFFFi64;
+		else This->shaderstate3d.texstageid[dwStage] &= 0xCFFFFFFFFFFFFFFFi64;
+	}
+	else This->shaderstate3d.texstageid[dwStage] &= 0xC7FFFFFFFFFFFFFFi64;
+}
+
+/**
+  * Rebuilds the sampler object state of a texture stage from its address,
+  * filter, border color, LOD bias and anisotropy states.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param dwStage
+  *  Texture stage to update
+  */
+void glRenderer__UpdateStageSampler(glRenderer *This, DWORD dwStage)
+{
+	TEXTURESTAGE *stage = &This->texstages[dwStage];
+	SAMPLER *sampler = &stage->sampler;
+	sampler->id = 0;
+	sampler->wraps = glUtil_GetWrapMode(stage->addressu);
+	if (!sampler->wraps) sampler->wraps = GL_REPEAT;
+	sampler->wrapt = glUtil_GetWrapMode(stage->addressv);
+	if (!sampler->wrapt) sampler->wrapt = GL_REPEAT;
+	sampler->magfilter = stage->glmagfilter;
+	sampler->minfilter = stage->glminfilter;
+	glTexture__ConfigFilter(&sampler->magfilter, &sampler->minfilter);
+	sampler->bordercolor = (sampler->wraps == GL_CLAMP_TO_BORDER) || (sampler->wrapt == GL_CLAMP_TO_BORDER)
+		? stage->bordercolor : 0;
+	sampler->lodbias = stage->lodbias;
+	sampler->anisotropy = 1;
+	if (This->ext->GLEXT_EXT_texture_filter_anisotropic)
+	{
+		if (dxglcfg.anisotropic) sampler->anisotropy = dxglcfg.anisotropic;
+		else if ((stage->minfilter == D3DTFN_ANISOTROPIC) || (stage->magfilter == D3DTFG_ANISOTROPIC))
+			sampler->anisotropy = stage->anisotropy;
+		if (!sampler->anisotropy) sampler->anisotropy = 1;
 	}
-	else This->shaderstate3d.texstageid[dwStage] &= 0xE7FFFFFFFFFFFFFFi64;
-	SetEvent(This->busy);
 }
 
 void glRenderer__SetTextureStageState(glRenderer *This, DWORD dwStage, D3DTEXTURESTAGESTATETYPE dwState, DWORD dwValue)
 {
-	SetEvent(This->busy);
+	This->shaderkeydirty = TRUE;
 	switch (dwState)
 	{
 	case D3DTSS_COLOROP:
@@ -4065,89 +9038,299 @@ void glRenderer__SetTextureStageState(glRenderer *This, DWORD dwStage, D3DTEXTUR
 	default:
 		break;
 	}
+	switch (dwState)
+	{
+	case D3DTSS_ADDRESSU:
+	case D3DTSS_ADDRESSV:
+	case D3DTSS_BORDERCOLOR:
+	case D3DTSS_MAGFILTER:
+	case D3DTSS_MINFILTER:
+	case D3DTSS_MIPFILTER:
+	case D3DTSS_MIPMAPLODBIAS:
+	case D3DTSS_MAXANISOTROPY:
+		glRenderer__UpdateStageSampler(This, dwStage);
+		break;
+	default:
+		break;
+	}
 }
 
-void glRenderer__SetTransform(glRenderer *This, D3DTRANSFORMSTATETYPE dtstTransformStateType, LPD3DMATRIX lpD3DMatrix)
+/**
+  * Fills the Transforms uniform block from the world and projection matrices
+  * and the matrices derived from them, and marks it for upload.
+  * @param This
+  *  Pointer to glRenderer object
+  */
+static void glRenderer__SetTransformBlock(glRenderer *This)
 {
+	UBOTransforms *block = &This->ubotransforms;
+	const GLfloat *normal = (const GLfloat *)&This->transform[5];
 	int x, y;
-	GLfloat temp[16];
-	GLfloat* out;
-	if (dtstTransformStateType > 23)
+	memcpy(block->world, &This->transform[D3DTRANSFORMSTATE_WORLD], 16 * sizeof(GLfloat));
+	memcpy(block->modelview, &This->transform[4], 16 * sizeof(GLfloat));
+	memcpy(block->projection, &This->transform[D3DTRANSFORMSTATE_PROJECTION], 16 * sizeof(GLfloat));
+	// Each column of the normal matrix is padded to a vec4
+	for (y = 0; y < 3; y++)
 	{
-		SetEvent(This->busy);
-		return;
+		for (x = 0; x < 3; x++)
+			block->normal[x + (y * 4)] = normal[y + (x * 3)];
+		block->normal[3 + (y * 4)] = 0.0f;
 	}
-	memcpy(&This->transform[dtstTransformStateType], lpD3DMatrix, sizeof(D3DMATRIX));
-	if ((dtstTransformStateType == D3DTRANSFORMSTATE_WORLD) || (dtstTransformStateType == D3DTRANSFORMSTATE_VIEW))
+	memcpy(block->mvp, &This->transformmvp, 16 * sizeof(GLfloat));
+	This->ubodirty |= UBODIRTY_TRANSFORMS;
+}
+
+/**
+  * Recomputes the matrices derived from the world, view and projection
+  * transforms.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param modelview
+  *  TRUE if the world or view matrix changed, FALSE if only the projection
+  *  matrix changed and the modelview and normal matrices are still valid
+  */
+static void glRenderer__UpdateTransforms(glRenderer *This, BOOL modelview)
+{
+	GLfloat normal[12];
+	GLfloat *out;
+	int x, y;
+	if (modelview)
 	{
 		__gluMultMatricesf((const GLfloat *)&This->transform[D3DTRANSFORMSTATE_WORLD],
 			(const GLfloat *)&This->transform[D3DTRANSFORMSTATE_VIEW], (GLfloat *)&This->transform[4]);
-		__gluInvertMatrixf((const GLfloat *)&This->transform[4], (GLfloat*)&temp);
+		Matrix_InverseTranspose3x3((const GLfloat *)&This->transform[4], normal);
 		out = (GLfloat *)&This->transform[5];
 		for (y = 0; y < 3; y++)
 			for (x = 0; x < 3; x++)
-				out[x + (y * 3)] = temp[x + (y * 4)];
+				out[x + (y * 3)] = normal[y + (x * 4)];
 	}
-	SetEvent(This->busy);
+	__gluMultMatricesf((const GLfloat *)&This->transform[4],
+		(const GLfloat *)&This->transform[D3DTRANSFORMSTATE_PROJECTION], (GLfloat *)&This->transformmvp);
+	glRenderer__SetTransformBlock(This);
 }
 
-void glRenderer__SetMaterial(glRenderer *This, LPD3DMATERIAL7 lpMaterial)
+/**
+  * Fills the Material uniform block from the current material, and marks it
+  * for upload.
+  * @param This
+  *  Pointer to glRenderer object
+  */
+static void glRenderer__SetMaterialBlock(glRenderer *This)
 {
-	memcpy(&This->material, lpMaterial, sizeof(D3DMATERIAL7));
-	SetEvent(This->busy);
+	UBOMaterial *block = &This->ubomaterial;
+	memcpy(block->ambient, &This->material.ambient, 4 * sizeof(GLfloat));
+	memcpy(block->diffuse, &This->material.diffuse, 4 * sizeof(GLfloat));
+	memcpy(block->specular, &This->material.specular, 4 * sizeof(GLfloat));
+	memcpy(block->emission, &This->material.emissive, 4 * sizeof(GLfloat));
+	block->shininess = This->material.power;
+	This->ubodirty |= UBODIRTY_MATERIAL;
 }
 
-void glRenderer__SetLight(glRenderer *This, DWORD index, LPD3DLIGHT7 light)
+/**
+  * Fills the Lights uniform block with the lights in lightsvisible in index
+  * order, and marks it for upload.
+  * @param This
+  *  Pointer to glRenderer object
+  */
+static void glRenderer__SetLightBlock(glRenderer *This)
 {
-	int numlights = 0;
+	UBOLight *block;
+	int i;
 	int lightindex = 0;
-	memcpy(&This->lights[index], light, sizeof(D3DLIGHT7));
-	SetEvent(This->busy);
-	for (int i = 0; i < 8; i++)
-		if (This->lights[i].dltType) numlights++;
-	This->shaderstate3d.stateid &= 0xF807C03FFFE3FFFFi64;
-	This->shaderstate3d.stateid |= ((__int64)numlights << 18);
-	for (int i = 0; i < 8; i++)
+	ZeroMemory(&This->ubolights, sizeof(UBOLights));
+	for (i = 0; i < LIGHTS_MAX; i++)
 	{
-		if (This->lights[i].dltType != 1)
-		{
-			if (This->lights[i].dltType != D3DLIGHT_DIRECTIONAL)
-				This->shaderstate3d.stateid |= (1i64 << (38 + lightindex));
-			if (This->lights[i].dltType == D3DLIGHT_SPOT)
-				This->shaderstate3d.stateid |= (1i64 << (51 + lightindex));
-			lightindex++;
-		}
+		if (!((This->lightsvisible >> i) & 1)) continue;
+		block = &This->ubolights.lights[lightindex++];
+		block->type = (GLfloat)This->lights[i].dltType;
+		memcpy(block->diffuse, &This->lights[i].dcvDiffuse, 4 * sizeof(GLfloat));
+		memcpy(block->specular, &This->lights[i].dcvSpecular, 4 * sizeof(GLfloat));
+		memcpy(block->ambient, &This->lights[i].dcvAmbient, 4 * sizeof(GLfloat));
+		memcpy(block->position, &This->lights[i].dvPosition, 3 * sizeof(GLfloat));
+		memcpy(block->direction, &This->lights[i].dvDirection, 3 * sizeof(GLfloat));
+		block->range = This->lights[i].dvRange;
+		block->falloff = This->lights[i].dvFalloff;
+		block->constant = This->lights[i].dvAttenuation0;
+		block->linear = This->lights[i].dvAttenuation1;
+		block->quad = This->lights[i].dvAttenuation2;
+		block->theta = This->lights[i].dvTheta;
+		block->phi = This->lights[i].dvPhi;
 	}
-
+	This->ubolights.count = lightindex;
+	This->ubodirty |= UBODIRTY_LIGHTS;
 }
 
-void glRenderer__RemoveLight(glRenderer *This, DWORD index)
+/**
+  * Computes the light bits of the shader ID.  With uniform buffer objects
+  * only bit 63 is set, and one shader loops over the lights in the Lights
+  * block, otherwise the lights are numbered in the ID.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param lights
+  *  Pointer to the LIGHTS_MAX light slots, with dltType 0 if disabled
+  * @return
+  *  Bits 18-20, 38-45, 51-58 and 63 of the shader ID
+  */
+static __int64 glRenderer__LightStateBits(glRenderer *This, const D3DLIGHT7 *lights)
 {
+	__int64 bits = 0;
 	int numlights = 0;
-	int lightindex = 0;
-	ZeroMemory(&This->lights[index], sizeof(D3DLIGHT7));
-	SetEvent(This->busy);
-	for (int i = 0; i < 8; i++)
-		if (This->lights[i].dltType) numlights++;
-	This->shaderstate3d.stateid &= 0xF807C03FFFE3FFFFi64;
-	This->shaderstate3d.stateid |= ((__int64)numlights << 18);
-	for (int i = 0; i < 8; i++)
+	int i;
+	if (This->ubo[0])
+	{
+		for (i = 0; i < LIGHTS_MAX; i++)
+			if (lights[i].dltType) return 1i64 << 63;
+		return 0;
+	}
+	for (i = 0; i < 8; i++)
+	{
+		if (!lights[i].dltType) continue;
+		if (lights[i].dltType != D3DLIGHT_DIRECTIONAL)
+			bits |= (1i64 << (38 + numlights));
+		if (lights[i].dltType == D3DLIGHT_SPOT)
+			bits |= (1i64 << (51 + numlights));
+		numlights++;
+	}
+	return bits | ((__int64)numlights << 18);
+}
+
+/**
+  * Updates the light masks, the Lights uniform block and the light bits of
+  * the shader ID after a light is set or removed.
+  * @param This
+  *  Pointer to glRenderer object
+  */
+static void glRenderer__UpdateLights(glRenderer *This)
+{
+	int i;
+	This->shaderkeydirty = TRUE;
+	This->lightsenabled = This->lightspositional = 0;
+	for (i = 0; i < LIGHTS_MAX; i++)
+	{
+		if (!This->lights[i].dltType) continue;
+		This->lightsenabled |= 1 << i;
+		if (This->lights[i].dltType != D3DLIGHT_DIRECTIONAL)
+			This->lightspositional |= 1 << i;
+	}
+	This->lightsvisible = This->lightsenabled;
+	glRenderer__SetLightBlock(This);
+	This->shaderstate3d.stateid &= 0x7807C03FFFE3FFFFi64;
+	This->shaderstate3d.stateid |= glRenderer__LightStateBits(This, This->lights);
+}
+
+/**
+  * Drops the point and spot lights whose range does not reach a draw from
+  * the Lights uniform block, so the light loop skips them.
+  * @param This
+  *  Pointer to glRenderer object
+  * @param positions
+  *  Pointer to the position of the first vertex
+  * @param stride
+  *  Distance in bytes between vertex positions
+  * @param count
+  *  Number of vertices in the draw
+  */
+static void glRenderer__CullLights(glRenderer *This, const BYTE *positions, DWORD stride, DWORD count)
+{
+	DWORD visible = This->lightsenabled & ~This->lightspositional;
+	D3DVECTOR center;
+	D3DVALUE radius;
+	GLfloat dx, dy, dz, reach;
+	int i;
+	if (!This->lightspositional) return;
+	if (!positions || !count) visible = This->lightsenabled;
+	else
 	{
-		if (This->lights[i].dltType != 1)
+		Matrix_BoundingSphere((GLfloat*)&This->transform[D3DTRANSFORMSTATE_WORLD], (const GLfloat*)positions,
+			stride, count, &center, &radius);
+		for (i = 0; i < LIGHTS_MAX; i++)
 		{
-			if (This->lights[i].dltType != D3DLIGHT_DIRECTIONAL)
-				This->shaderstate3d.stateid |= (1i64 << (38 + lightindex));
-			if (This->lights[i].dltType == D3DLIGHT_SPOT)
-				This->shaderstate3d.stateid |= (1i64 << (51 + lightindex));
-			lightindex++;
+			if (!((This->lightspositional >> i) & 1)) continue;
+			// Zero range is treated as unlimited, as in software lighting
+			if (This->lights[i].dvRange <= 0.0f)
+			{
+				visible |= 1 << i;
+				continue;
+			}
+			dx = This->lights[i].dvPosition.x - center.x;
+			dy = This->lights[i].dvPosition.y - center.y;
+			dz = This->lights[i].dvPosition.z - center.z;
+			reach = This->lights[i].dvRange + radius;
+			if (((dx * dx) + (dy * dy) + (dz * dz)) <= (reach * reach)) visible |= 1 << i;
 		}
 	}
+	if (visible == This->lightsvisible) return;
+	This->lightsvisible = visible;
+	glRenderer__SetLightBlock(This);
+}
+
+/**
+  * Uploads the uniform blocks changed since the last draw.
+  * @param This
+  *  Pointer to glRenderer object
+  */
+static void glRenderer__UpdateUniformBlocks(glRenderer *This)
+{
+	if (!This->ubo[0]) return;
+	if (This->ubodirty & UBODIRTY_TRANSFORMS)
+		BufferObject_SetData(This->ubo[UBO_BINDING_TRANSFORMS], GL_UNIFORM_BUFFER, sizeof(UBOTransforms),
+			&This->ubotransforms, GL_DYNAMIC_DRAW);
+	if (This->ubodirty & UBODIRTY_MATERIAL)
+		BufferObject_SetData(This->ubo[UBO_BINDING_MATERIAL], GL_UNIFORM_BUFFER, sizeof(UBOMaterial),
+			&This->ubomaterial, GL_DYNAMIC_DRAW);
+	if (This->ubodirty & UBODIRTY_LIGHTS)
+		BufferObject_SetData(This->ubo[UBO_BINDING_LIGHTS], GL_UNIFORM_BUFFER, sizeof(UBOLights),
+			&This->ubolights, GL_DYNAMIC_DRAW);
+	This->ubodirty = 0;
+}
+
+void glRenderer__SetTransform(glRenderer *This, D3DTRANSFORMSTATETYPE dtstTransformStateType, LPD3DMATRIX lpD3DMatrix)
+{
+	if (dtstTransformStateType > 23) return;
+	// Vertex blending is not supported, and slots 4 and 5 hold derived matrices
+	if ((dtstTransformStateType == D3DTRANSFORMSTATE_WORLD1) || (dtstTransformStateType == D3DTRANSFORMSTATE_WORLD2)) return;
+	if (!memcmp(&This->transform[dtstTransformStateType], lpD3DMatrix, sizeof(D3DMATRIX))) return;
+	memcpy(&This->transform[dtstTransformStateType], lpD3DMatrix, sizeof(D3DMATRIX));
+	switch (dtstTransformStateType)
+	{
+	case D3DTRANSFORMSTATE_WORLD:
+	case D3DTRANSFORMSTATE_VIEW:
+		glRenderer__UpdateTransforms(This, TRUE);
+		break;
+	case D3DTRANSFORMSTATE_PROJECTION:
+		glRenderer__UpdateTransforms(This, FALSE);
+		break;
+	default:
+		break;
+	}
+}
+
+void glRenderer__SetMaterial(glRenderer *This, LPD3DMATERIAL7 lpMaterial)
+{
+	if (!memcmp(&This->material, lpMaterial, sizeof(D3DMATERIAL7))) return;
+	memcpy(&This->material, lpMaterial, sizeof(D3DMATERIAL7));
+	glRenderer__SetMaterialBlock(This);
+}
+
+void glRenderer__SetLight(glRenderer *This, DWORD index, LPD3DLIGHT7 light)
+{
+	if (index >= LIGHTS_MAX) return;
+	if (!memcmp(&This->lights[index], light, sizeof(D3DLIGHT7))) return;
+	memcpy(&This->lights[index], light, sizeof(D3DLIGHT7));
+	glRenderer__UpdateLights(This);
+}
+
+void glRenderer__RemoveLight(glRenderer *This, DWORD index)
+{
+	if (index >= LIGHTS_MAX) return;
+	if (!This->lights[index].dltType) return;
+	ZeroMemory(&This->lights[index], sizeof(D3DLIGHT7));
+	glRenderer__UpdateLights(This);
 }
 
 void glRenderer__SetD3DViewport(glRenderer *This, LPD3DVIEWPORT7 lpViewport)
 {
 	memcpy(&This->viewport, lpViewport, sizeof(D3DVIEWPORT7));
-	SetEvent(This->busy);
 }
 
 void glRenderer__SetFogColor(glRenderer *This, DWORD color)
@@ -4178,38 +9361,71 @@ void glRenderer__SetFogDensity(glRenderer *This, GLfloat density)
 	This->fogdensity = density;
 }
 
-void glRenderer__SetDepthComp(glRenderer *This)
+static GLenum glRenderer__CompFunc(DWORD func)
 {
-	switch (This->renderstate[D3DRENDERSTATE_ZFUNC])
+	switch (func)
 	{
 	case D3DCMP_NEVER:
-		glUtil_SetDepthComp(This->util, GL_NEVER);
-		break;
+		return GL_NEVER;
 	case D3DCMP_LESS:
-		glUtil_SetDepthComp(This->util, GL_LESS);
-		break;
+		return GL_LESS;
 	case D3DCMP_EQUAL:
-		glUtil_SetDepthComp(This->util, GL_EQUAL);
-		break;
+		return GL_EQUAL;
 	case D3DCMP_LESSEQUAL:
-		glUtil_SetDepthComp(This->util, GL_LEQUAL);
-		break;
+		return GL_LEQUAL;
 	case D3DCMP_GREATER:
-		glUtil_SetDepthComp(This->util, GL_GREATER);
-		break;
+		return GL_GREATER;
 	case D3DCMP_NOTEQUAL:
-		glUtil_SetDepthComp(This->util, GL_NOTEQUAL);
-		break;
+		return GL_NOTEQUAL;
 	case D3DCMP_GREATEREQUAL:
-		glUtil_SetDepthComp(This->util, GL_GEQUAL);
-		break;
+		return GL_GEQUAL;
 	case D3DCMP_ALWAYS:
 	default:
-		glUtil_SetDepthComp(This->util, GL_ALWAYS);
-		break;
+		return GL_ALWAYS;
 	}
 }
 
+static GLenum glRenderer__StencilOp(DWORD op)
+{
+	switch (op)
+	{
+	case D3DSTENCILOP_KEEP:
+	default:
+		return GL_KEEP;
+	case D3DSTENCILOP_ZERO:
+		return GL_ZERO;
+	case D3DSTENCILOP_REPLACE:
+		return GL_REPLACE;
+	case D3DSTENCILOP_INCRSAT:
+		return GL_INCR;
+	case D3DSTENCILOP_DECRSAT:
+		return GL_DECR;
+	case D3DSTENCILOP_INVERT:
+		return GL_INVERT;
+	case D3DSTENCILOP_INCR:
+		return GL_INCR_WRAP;
+	case D3DSTENCILOP_DECR:
+		return GL_DECR_WRAP;
+	}
+}
+
+void glRenderer__SetDepthComp(glRenderer *This)
+{
+	glUtil_SetDepthComp(This->util, glRenderer__CompFunc(This->renderstate[D3DRENDERSTATE_ZFUNC]));
+}
+
+void glRenderer__SetStencil(glRenderer *This)
+{
+	glUtil_StencilTest(This->util, This->renderstate[D3DRENDERSTATE_STENCILENABLE] ? TRUE : FALSE);
+	if (!This->renderstate[D3DRENDERSTATE_STENCILENABLE]) return;
+	glUtil_StencilFunc(This->util, glRenderer__CompFunc(This->renderstate[D3DRENDERSTATE_STENCILFUNC]),
+		This->renderstate[D3DRENDERSTATE_STENCILREF], This->renderstate[D3DRENDERSTATE_STENCILMASK]);
+	glUtil_StencilOp(This->util, glRenderer__StencilOp(This->renderstate[D3DRENDERSTATE_STENCILFAIL]),
+		glRenderer__StencilOp(This->renderstate[D3DRENDERSTATE_STENCILZFAIL]),
+		glRenderer__StencilOp(This->renderstate[D3DRENDERSTATE_STENCILPASS]));
+	glUtil_StencilMask(This->util, This->renderstate[D3DRENDERSTATE_STENCILWRITEMASK]);
+}
+
 void glRenderer__SetTextureColorKey(glRenderer *This, glTexture *texture, DWORD dwFlags, LPDDCOLORKEY lpDDColorKey, GLint level)
 {
 	if (dwFlags & DDCKEY_SRCBLT)
@@ -4222,6 +9438,10 @@ void glRenderer__SetTextureColorKey(glRenderer *This, glTexture *texture, DWORD
 			else texture->levels[level].ddsd.ddckCKSrcBlt.dwColorSpaceHighValue = lpDDColorKey->dwColorSpaceLowValue;
 		}
 		else texture->levels[level].ddsd.dwFlags &= ~DDSD_CKSRCBLT;
+		// Keys are compared with exact texels, which block compression doesn't keep
+		if (lpDDColorKey && texture->blockid) glTexture__MakeResident(texture);
+		// Textures that keep the key in alpha are uploaded again with the new key
+		if (!level) glTexture__SetAlphaKey(texture);
 	}
 	if (dwFlags & DDCKEY_DESTBLT)
 	{
@@ -4256,7 +9476,6 @@ void glRenderer__SetTextureColorKey(glRenderer *This, glTexture *texture, DWORD
 		}
 		else texture->levels[level].ddsd.dwFlags &= ~DDSD_CKDESTOVERLAY;
 	}
-	SetEvent(This->busy);
 }
 
 void glRenderer__MakeTexturePrimary(glRenderer *This, glTexture *texture, glTexture *parent, BOOL primary)
@@ -4290,8 +9509,28 @@ void glRenderer__SetMode3D(glRenderer *This, BOOL enabled)
 
 void glRenderer__FreePointer(glRenderer *This, void *ptr)
 {
-	SetEvent(This->busy);
 	free(ptr);
 }
 
+void glRenderer__ApplyStateDelta(glRenderer *This, StateDelta *delta)
+{
+	DWORD i;
+	DWORD *ptr = delta->data;
+	for (i = 0; i < delta->renderstatecount; i++)
+	{
+		glRenderer__SetRenderState(This, (D3DRENDERSTATETYPE)ptr[0], ptr[1]);
+		ptr += 2;
+	}
+	for (i = 0; i < delta->texturestagecount; i++)
+	{
+		glRenderer__SetTextureStageState(This, ptr[0], (D3DTEXTURESTAGESTATETYPE)ptr[1], ptr[2]);
+		ptr += 3;
+	}
+	for (i = 0; i < delta->transformcount; i++)
+	{
+		glRenderer__SetTransform(This, (D3DTRANSFORMSTATETYPE)ptr[0], (LPD3DMATRIX)&ptr[1]);
+		ptr += 17;
+	}
+}
+
 }
\ No newline at end of file
@@ -62,8 +62,14 @@ typedef struct TEXTURESTAGE
 	} DUMMYUNIONNAME1;
 	GLint glmagfilter;
 	GLint glminfilter;
+	SAMPLER sampler;  // Sampler object state of the stage, rebuilt when the stage state changes
 } TEXTURESTAGE;
 
+// Maximum frames the MaxFramesInFlight option can keep queued
+#define FRAMEPACING_MAXFRAMES		8
+// Pixel pack buffers used to read back frames for layered windows
+#define DIB_READBACK_BUFFERS		3
+
 #define OP_NULL						0
 #define OP_SETWND					1
 #define OP_DELETE					2
@@ -108,6 +114,235 @@ typedef struct TEXTURESTAGE
 #define OP_SETATTRIB				41
 #define OP_SETMODE3D				42
 #define OP_FREEPOINTER				43
+#define OP_SYNC						44
+#define OP_APPLYSTATEDELTA			45
+#define OP_RELEASEBUFFER			46
+#define OP_MAPTEXTURELOCK			47
+#define OP_UPDATEPALETTE			48
+#define OP_SETOVERLAY				49
+#define OP_SETOVERLAYPOSITION		50
+#define OP_REMOVEOVERLAY			51
+#define OP_DRAWBATCH				52
+#define OP_QUEUEUPLOAD				53
+#define OP_PRELOADTEXTURE			54
+#define OP_SETGAMMARAMP				55
+
+// Maximum number of queued blts drawn with one draw call
+#define BLTBATCH_MAX 256
+
+// Minimum number of rects for a clear to be drawn with one instanced draw
+#define CLEARRECTS_INSTANCED 16
+
+// Uniform blocks changed since they were last uploaded, in glRenderer.ubodirty
+#define UBODIRTY_TRANSFORMS 1
+#define UBODIRTY_MATERIAL 2
+#define UBODIRTY_LIGHTS 4
+
+// Number of vertex array objects kept for the vertex layouts of 3D draws
+#define VERTEXARRAY_CACHESIZE 32
+
+// Largest 3D draw in vertices that is held back to be merged with the next one
+#define DRAWBATCH_MAXVERTICES 1024
+
+// Most draws in a batch that switches textures per draw, the texture handles
+// of all of them fill the 16 KB DrawTextures uniform block
+#define DRAWBATCH_MAXDRAWS 256
+
+/** @brief Range of a batch drawn by one draw of an indirect draw call
+  * Laid out as the GL DrawElementsIndirectCommand structure.
+  */
+typedef struct DrawBatchCommand
+{
+	GLuint count;
+	GLuint instancecount;
+	GLuint firstindex;
+	GLint basevertex;
+	GLuint baseinstance;
+} DrawBatchCommand;
+
+// Maximum number of DWORDs in a StateDelta packet
+#define STATEDELTA_MAXSIZE (3 + (RENDERSTATE_COUNT * 2) + (8 * 32 * 3) + (3 * 17))
+
+/** @brief Merged Direct3D draws
+  * Small draws with the same vertex format and render target and no state
+  * change in between are gathered into one indexed draw.  Strips and fans are
+  * separated by the primitive restart index where supported, otherwise they
+  * are converted to lists so draws of all primitive types of a class can merge.
+  * Indices start out 16-bit and are widened once the batch outgrows them.
+  * With bindless textures and multi-draw indirect, draws may also switch
+  * the textures of their stages; each draw then keeps its index range and
+  * textures, and the batch is drawn with one indirect draw call.
+  */
+typedef struct DrawBatch
+{
+	RenderTarget target;
+	GLenum mode;  // A list mode, or a strip or fan mode with primitive restart
+	DWORD fvf;
+	GLsizei stride;
+	BYTE *vertices;
+	DWORD vertexcount;
+	DWORD vertexmax;  // In bytes
+	void *indices;  // GLushort or GLuint, as given by indextype
+	GLenum indextype;
+	DWORD indexcount;
+	DWORD indexmax;  // In bytes
+	DWORD draws;  // Number of draws gathered, 0 if none is pending
+	BOOL fogenable;  // D3DRENDERSTATE_FOGENABLE as last queued by the calling thread
+	glTexture *textures[8];  // Stage textures as last queued by the calling thread
+	DrawBatchCommand *commands;  // DRAWBATCH_MAXDRAWS entries, NULL if textures can't switch per draw
+	glTexture **drawtextures;  // Stage textures of each draw, 8 per draw
+	BOOL texchanged;  // Some draws have different stage textures than the first
+} DrawBatch;
+
+// Debug markers kept formatted by the renderer
+#define DEBUGMARKER_BLT 0
+#define DEBUGMARKER_DRAW 1
+#define DEBUGMARKER_DRAWBATCH 2
+#define DEBUGMARKER_COUNT 3
+
+/** @brief Text of a debug marker
+  * The text is only formatted again when the format or its arguments differ
+  * from the previous use of the marker.
+  */
+typedef struct DebugMarker
+{
+	const char *format;
+	int args[8];
+	char text[64];
+} DebugMarker;
+
+/** @brief Coalesced Direct3D state changes
+  * Contains all render state, texture stage state, and transform changes
+  * made by a device between two draws.  The data array contains
+  * renderstatecount pairs of (state, value), then texturestagecount triples
+  * of (stage, state, value), then transformcount entries of (transform type,
+  * 16 matrix values).  Only the used part of the packet is copied into the
+  * command ring, directly after the QueueCmd header.
+  */
+typedef struct StateDelta
+{
+	DWORD renderstatecount;
+	DWORD texturestagecount;
+	DWORD transformcount;
+	DWORD data[STATEDELTA_MAXSIZE - 3];
+} StateDelta;
+
+/** @brief Vertex attribute layout of a 3D draw
+  * Offsets are relative to the base vertex of the draw, so draws that only
+  * differ in where their vertices start in the buffer share a layout.  The
+  * attribute locations come from the program, so programs with the same
+  * attribute layout also share it.
+  */
+typedef struct VertexArrayKey
+{
+	BufferObject *buffer;  // Buffer the attributes are read from
+	GLint location[18];  // Attribute location of each vertex component, -1 if unused
+	GLint size[18];  // Number of components of each vertex component
+	GLsizei stride[18];
+	GLintptr offset[18];
+} VertexArrayKey;
+
+/** @brief Cached vertex array object
+  * Holds a reference to the buffer in its key, so the buffer name cannot be
+  * reused while the vertex array object still points to it.
+  */
+typedef struct VertexArrayEntry
+{
+	VertexArrayKey key;
+	GLuint vao;  // 0 if the entry is unused
+	DWORD lastused;
+} VertexArrayEntry;
+
+/** @brief Overlay drawn over the primary surface
+  * Kept by the renderer between frames and changed only when the overlay is
+  * updated, moved or removed, so drawing the screen only has to draw it.
+  */
+typedef struct RendererOverlay
+{
+	void *surface;  // Overlay surface, identifies the overlay
+	BOOL enabled;
+	DWORD keyflags;  // Color key blt flags set by the overlay itself
+	BltCommand blt;  // Draw of the overlay to the screen, dest is set when drawn
+} RendererOverlay;
+
+/** @brief Texture level waiting to be uploaded
+  * Queued when a texture level is unlocked and uploaded at the start of a
+  * later frame, or earlier if a draw needs it first.
+  */
+typedef struct PendingUpload
+{
+	glTexture *texture;
+	GLint level;
+} PendingUpload;
+
+/** @brief Queued renderer command
+  * Header and arguments of a command stored in the renderer command ring.
+  * Arguments are copied by value so the caller does not have to wait for
+  * the renderer thread to consume them.
+  */
+typedef struct QueueCmd
+{
+	DWORD opcode;
+	DWORD size;
+	union
+	{
+		struct
+		{
+			D3DRENDERSTATETYPE type;
+			DWORD value;
+		} renderstate;
+		struct
+		{
+			DWORD stage;
+			glTexture *texture;
+		} texture;
+		struct
+		{
+			DWORD stage;
+			D3DTEXTURESTAGESTATETYPE type;
+			DWORD value;
+		} texturestagestate;
+		struct
+		{
+			D3DTRANSFORMSTATETYPE type;
+			D3DMATRIX matrix;
+		} transform;
+		D3DMATERIAL7 material;
+		struct
+		{
+			DWORD index;
+			D3DLIGHT7 light;
+		} light;
+		DWORD removelight;
+		D3DVIEWPORT7 viewport;
+		struct
+		{
+			glTexture *texture;
+			DWORD flags;
+			BOOL setkey;
+			DDCOLORKEY key;
+			GLint level;
+		} colorkey;
+		BltCommand blt;
+		struct
+		{
+			glTexture *texture;
+			DWORD start;
+			DWORD count;
+			DWORD entries[256];
+		} palette;
+		OVERLAY overlay;
+		struct
+		{
+			void *surface;
+			LONG x;
+			LONG y;
+		} overlaypos;
+		PendingUpload upload;
+		DDGAMMARAMP gamma;
+		void *ptr;
+	} args;
+} QueueCmd;
 
 extern const DWORD renderstate_default[RENDERSTATE_COUNT];
 extern const TEXTURESTAGE texstagedefault0;
@@ -122,21 +357,47 @@ typedef struct glRenderer
 	GLCAPS gl_caps;
 	glExtensions *ext;
 	glDirectDraw7 *ddInterface;
-	int opcode;
+	volatile int opcode;
 	void* inputs[32];
 	void* outputs[32];
 	HANDLE hThread;
 	HDC hDC;
+	HDC affinitydc;  // WGL_NV_gpu_affinity DC hRC was created from, NULL if the context is not pinned to a GPU
 	HWND hWnd;
 	glRenderWindow *RenderWnd;
+	volatile LONG wndchanged;  // Set when hWnd was moved or resized since wndrect was read
+	RECT wndrect;  // Client rect of hWnd, RenderWnd is kept at this size
+	POINT wndorigin;  // Screen position of the client area of RenderWnd
 	DIB dib;
 	FBO fbo;
-	BufferObject *pbo;
+	BufferObject *pbo[DIB_READBACK_BUFFERS];  // Layered window readback buffers, used in turn
+	GLsync pbofences[DIB_READBACK_BUFFERS];  // Fences after the readback into each buffer
+	GLint pbowidth[DIB_READBACK_BUFFERS];
+	GLint pboheight[DIB_READBACK_BUFFERS];
+	BOOL pboflipped[DIB_READBACK_BUFFERS];  // TRUE if the rows in the buffer are already top down
+	int pboframe;  // Buffer for the next readback
+	int pbopending;  // Buffer read back but not shown yet, -1 if none
+	glTexture dibflip;  // Upside down copy of the window for readback
+	glTexture gammatexture;  // 256x1 lookup table of the gamma ramp for the final draw
+	BOOL gammaenabled;  // FALSE while the gamma ramp is the identity
+	DWORD gammalut[256];  // Contents of gammatexture
 	CRITICAL_SECTION cs;
 	HANDLE busy;
 	HANDLE start;
+	HANDLE ready;  // Set once the GL context and renderer state are initialized
+	volatile LONG parked;
+	// Set along with an opcode that only depends on the ring commands up to
+	// queueseq, so the commands after them are executed after the opcode
+	volatile LONG queuebounded;
+	DWORD queueseq;
+	// Threads waiting without the renderer lock for the ring to run up to a
+	// sequence number; progress is set as commands finish while there are any
+	HANDLE progress;
+	volatile LONG seqwaiters;
 	unsigned int frequency;
 	DXGLTimer timer;
+	GLsync framefences[FRAMEPACING_MAXFRAMES];  // Fences after the last presented frames
+	DWORD framefence;  // Next entry of framefences to wait on and replace
 	glTexture backbuffers[16];
 	DWORD fogcolor;
 	GLfloat fogcolorfloat[4];
@@ -149,22 +410,95 @@ typedef struct glRenderer
 	ShaderManager *shaders;
 	DWORD renderstate[RENDERSTATE_COUNT];
 	SHADERSTATE shaderstate3d;
+	BOOL shaderkeydirty;  // shaderstate3d or the vertex format changed since the last 3D shader was set
 	TEXTURESTAGE texstages[12];
 	D3DMATERIAL7 material;
-	D3DLIGHT7 lights[8];
-	D3DMATRIX transform[24];
+	D3DLIGHT7 lights[LIGHTS_MAX];
+	DWORD lightsenabled;  // Bit n is set if lights[n] is enabled
+	DWORD lightspositional;  // Bit n is set if lights[n] is a point or spot light
+	DWORD lightsvisible;  // Enabled lights in ubolights, without those culled for the last draw
+	D3DMATRIX transform[24];  // Slots 4 and 5 hold the modelview and normal matrices
+	D3DMATRIX transformmvp;  // World * view * projection
+	BufferObject *ubo[4];  // Transforms, Material, Lights and DrawTextures uniform buffers, NULL if not used
+	UBOTransforms ubotransforms;
+	UBOMaterial ubomaterial;
+	UBOLights ubolights;  // Visible lights in index order
+	DWORD ubodirty;
+	const struct RenderBackend *backend;  // Creates stream buffers and vertex array objects for the context
+	VertexArrayEntry vertexarrays[VERTEXARRAY_CACHESIZE];
+	DWORD vertexarrayclock;  // Incremented on every vertex array cache lookup
 	D3DVIEWPORT7 viewport;
 	float mulx, muly;
 	size_t scenesize, scenesizevertex, scenesizeindex;
 	DWORD last_fvf;
-	GLsizei fvf_stride;
+	GLsizei fvf_stride;  // Zero if the last vertex format has no position
+	GLintptr fvf_offsets[18];  // Offsets of the vertex components, -1 if absent
+	int fvf_texformats[8];
+	__int64 fvf_stateid;
+	__int64 fvf_texstageid[8];
 	BOOL mode_3d;
 	float postsizex, postsizey;
 	int xoffset, yoffset;
-	OVERLAY *overlays;
-	int overlaycount;
+	RendererOverlay *overlays;  // Overlays drawn over the primary, in the order they were added
+	DWORD overlaycount;
+	DWORD maxoverlays;
+	PendingUpload *uploads;  // Unlocked texture levels to upload, in the order they were unlocked
+	DWORD uploadcount;
+	DWORD maxuploads;
+	GLsizeiptr uploadbytes;  // Bytes of texture data uploaded in the current frame
+	GLsizeiptr uploadpeak;  // Most bytes uploaded in one frame
+	DWORD uploadframes;  // Frames that uploaded more than TextureUploadBudget
 	CmdBuffer cmdbuffer[3];
 	int current_cmdbuffer;
+	glTexture *readbacktexture;  // Blt destination to read back once the ring drains
+	GLint readbacklevel;
+	glTexture *scenetexture;  // Render target of the 3D draws since the last flush
+	GLint scenelevel;
+	struct TexturePool *texpool;  // Released textures kept for reuse, NULL without a context
+	struct FrameArena *arena;  // Scratch memory for the renderer thread, reset after each frame
+	struct TextureResidency *residency;  // Textures that can leave video memory, NULL without a context
+	struct TextureAtlas *atlas;  // Shared textures for small surfaces, NULL if disabled
+	struct PostProcess *postprocess;  // Passes drawn before the final draw of the primary, NULL without a context
+	struct Timeline *timeline;  // Records renderer activity if DebugTimeline is set, NULL otherwise
+	struct ShaderTiming *shadertiming;  // GPU time per shader if DebugShaderTiming is set, NULL otherwise
+	struct Capture *capture;  // Records the command stream if DebugCapture is set, NULL otherwise
+	struct FrameCapture *framecapture;  // Screenshots and recordings if a capture key is set, NULL otherwise
+	struct LatencyMeter *latency;  // Input to screen latency if DebugLatency is set, NULL otherwise
+	struct Presenter *presenter;  // Shows frames from a thread of its own if PresentQueueDepth is set, NULL otherwise
+	struct DXGIOutput *dxgioutput;  // Flip model swap chain of the window if FlipModelPresent is set, NULL otherwise
+	struct DwmSync *dwmsync;  // Paces composited windowed frames if DwmVsync is set, NULL otherwise
+	struct VBlankNotify *vblanknotify;  // Signals vertical blank events, NULL until the first one is requested
+	glTexture dxgiframe;  // Frame composed for dxgioutput
+	FBO dxgifbo;  // Draws into the texture shared with dxgioutput
+	BOOL dxgidrawing;  // dxgiframe stands in for the window
+	glTexture *debugdepth;  // Depth buffer of the last 3D draw if DebugView is set, NULL if none
+	GLsizei msaasamples;  // Samples of the renderbuffers 3D rendering draws into, 0 if antialiasing is off
+	GLsizei renderscale;  // Size of the renderbuffers 3D rendering draws into as a multiple of the surface
+	DWORD cliprebuilds;  // Number of clip stencils drawn
+	glTexture *scrolltexture;  // Copy of the source of overlapping self-blts, NULL until needed
+	BufferObject *borderpbo;  // Readback of the first primary pixels for HackAutoExpandViewport
+	GLsync borderfence;  // Fence after the pending border readback, NULL if none
+	glTexture *bordertexture;  // Primary the border pixel is read from
+	DWORD borderpixel;  // First four bytes of bordertexture, last read back
+	BOOL bordervalid;  // TRUE once borderpixel holds a value for bordertexture
+	glTexture *palettetexture;  // Palette with entries not uploaded yet, NULL if none
+	DWORD palettestart;  // First entry not uploaded yet
+	DWORD paletteend;  // Entry after the last one not uploaded yet
+	glTexture * volatile recomposite;  // Primary to draw at the end of the refresh interval, NULL if none
+	volatile LONG recompositevsync;
+	volatile LONG recompositetime;
+	BltCommand *bltbatch;  // Queued blts gathered for one draw, BLTBATCH_MAX entries
+	BltVertex *bltbatchvertices;
+	GLushort *bltbatchindices;
+	DrawBatch drawbatch;  // Written by the calling thread, drawn by OP_DRAWBATCH
+	BOOL batchtextures;  // Draw batches can switch textures per draw
+	const DrawBatch *indirectbatch;  // Batch with texture switches being drawn, NULL for other draws
+	BOOL batchhandles;  // drawhandles holds the textures of every draw of indirectbatch
+	GLuint64 *drawhandles;  // DRAWBATCH_MAXDRAWS sets of 8 stage texture handles, NULL if not used
+	BufferObject *indirect;  // Draw commands of indirect draws, NULL if not used
+	BOOL debugmarkers;  // TRUE to label GL work with debug groups
+	DebugMarker markers[DEBUGMARKER_COUNT];
+	PerfCounters perf;  // Counters of the current and last presented frames
 } glRenderer;
 
 void glRenderer_Init(glRenderer *This, int width, int height, int bpp, BOOL fullscreen, unsigned int frequency, HWND hwnd, glDirectDraw7 *glDD7, BOOL devwnd);
@@ -173,19 +507,27 @@ DWORD glRenderer_GetBPP(glRenderer *This);
 static DWORD WINAPI glRenderer_ThreadEntry(void *entry);
 void glRenderer_UploadTexture(glRenderer *This, glTexture *texture, GLint level);
 void glRenderer_DownloadTexture(glRenderer *This, glTexture *texture, GLint level);
+void glRenderer_DownloadTextureRect(glRenderer *This, glTexture *texture, GLint level, LPRECT r);
+char *glRenderer_MapTextureLock(glRenderer *This, glTexture *texture, GLint level);
 HRESULT glRenderer_Blt(glRenderer *This, BltCommand *cmd);
 void glRenderer_MakeTexture(glRenderer *This, glTexture *texture);
-void glRenderer_DrawScreen(glRenderer *This, glTexture *texture, glTexture *paltex, GLint vsync, glTexture *previous, BOOL settime, OVERLAY *overlays, int overlaycount);
+void glRenderer_MakeTextures(glRenderer *This, glTexture *textures, DWORD count);
+void glRenderer_DrawScreen(glRenderer *This, glTexture *texture, glTexture *paltex, GLint vsync, glTexture *previous, BOOL settime);
+void glRenderer_ScheduleDrawScreen(glRenderer *This, glTexture *texture, GLint vsync, BOOL settime);
 void glRenderer_DeleteTexture(glRenderer *This, glTexture *texture);
 void glRenderer_InitD3D(glRenderer *This, int zbuffer, int x, int y);
 void glRenderer_Flush(glRenderer *This);
 void glRenderer_SetWnd(glRenderer *This, int width, int height, int bpp, int fullscreen, unsigned int frequency, HWND newwnd, BOOL devwnd);
 HRESULT glRenderer_Clear(glRenderer *This, ClearCommand *cmd);
-HRESULT glRenderer_DrawPrimitives(glRenderer *This, RenderTarget *target, GLenum mode, GLVERTEX *vertices, int *texformats, DWORD count, LPWORD indices,
-	DWORD indexcount, DWORD flags);
+HRESULT glRenderer_DrawPrimitives(glRenderer *This, RenderTarget *target, GLenum mode, DWORD fvf, void *vertices,
+	VertexBuffer *buffer, BOOL strided, DWORD count, LPWORD indices, DWORD indexcount, DWORD flags);
 void glRenderer_UpdateClipper(glRenderer *This, glTexture *stencil, GLushort *indices, BltVertex *vertices,
 	GLsizei count, GLsizei width, GLsizei height);
 unsigned int glRenderer_GetScanLine(glRenderer *This);
+void glRenderer_GetCaps(glRenderer *This, GLCAPS *caps);
+void glRenderer_WindowChanged(glRenderer *This);
+BOOL glRenderer_WaitForVerticalBlank(glRenderer *This, BOOL end, BOOL emulate);
+HRESULT glRenderer_SignalVerticalBlank(glRenderer *This, HANDLE event);
 HRESULT glRenderer_DepthFill(glRenderer *This, BltCommand *cmd, glTexture *parent, GLint parentlevel);
 void glRenderer_SetRenderState(glRenderer *This, D3DRENDERSTATETYPE dwRendStateType, DWORD dwRenderState);
 void glRenderer_SetTexture(glRenderer *This, DWORD dwStage, glTexture *Texture);
@@ -196,27 +538,45 @@ void glRenderer_SetLight(glRenderer *This, DWORD index, LPD3DLIGHT7 light);
 void glRenderer_RemoveLight(glRenderer *This, DWORD index);
 void glRenderer_SetD3DViewport(glRenderer *This, LPD3DVIEWPORT7 lpViewport);
 void glRenderer_SetTextureColorKey(glRenderer *This, glTexture *texture, DWORD dwFlags, LPDDCOLORKEY lpDDColorKey, GLint level);
+void glRenderer_UpdatePalette(glRenderer *This, glTexture *texture, DWORD start, DWORD count, const DWORD *entries);
+void glRenderer_SetOverlay(glRenderer *This, const OVERLAY *overlay);
+void glRenderer_SetOverlayPosition(glRenderer *This, void *surface, LONG x, LONG y);
+void glRenderer_RemoveOverlay(glRenderer *This, void *surface);
+void glRenderer_QueueUpload(glRenderer *This, glTexture *texture, GLint level);
+void glRenderer_PreloadTexture(glRenderer *This, glTexture *texture);
+void glRenderer_SetGammaRamp(glRenderer *This, const DDGAMMARAMP *ramp);
 void glRenderer_MakeTexturePrimary(glRenderer *This, glTexture *texture, glTexture *parent, BOOL primary);
 void glRenderer_DXGLBreak(glRenderer *This);
 void glRenderer_FreePointer(glRenderer *This, void *ptr);
+void glRenderer_ReleaseBuffer(glRenderer *This, BufferObject *buffer);
+void glRenderer_Sync(glRenderer *This);
+BOOL glRenderer_IsTextureBusy(glRenderer *This, glTexture *texture, GLint level);
+void glRenderer_WaitForTexture(glRenderer *This, glTexture *texture, GLint level, BOOL write);
+BOOL glRenderer_CanQueueBlt(glRenderer *This);
+BOOL glRenderer_IsDrawPending(glRenderer *This, glTexture *texture);
+void glRenderer_ApplyStateDelta(glRenderer *This, StateDelta *delta);
+void glRenderer_InitCmdBuffer(glRenderer *This, CmdBuffer *buffer);
+void glRenderer_DeleteCmdBuffer(glRenderer *This, CmdBuffer *buffer);
 // In-thread APIs
 DWORD glRenderer__Entry(glRenderer *This);
+void glRenderer__ExecuteQueue(glRenderer *This, BOOL bounded, DWORD until);
+void glRenderer__WaitForCommands(glRenderer *This);
+void glRenderer__StartReadback(glRenderer *This);
+GLbyte *glRenderer__StreamUnpack(glRenderer *This, GLsizeiptr size, GLintptr *offset);
 BOOL glRenderer__InitGL(glRenderer *This, int width, int height, int bpp, int fullscreen, unsigned int frequency, HWND hWnd, glDirectDraw7 *glDD7);
 void glRenderer__UploadTexture(glRenderer *This, glTexture *texture, GLint level);
 void glRenderer__DownloadTexture(glRenderer *This, glTexture *texture, GLint level);
 void glRenderer__Blt(glRenderer *This, BltCommand *cmd, BOOL backend);
+void glRenderer__BltBatch(glRenderer *This, BltCommand *cmd, DWORD count, BOOL backend);
 void glRenderer__MakeTexture(glRenderer *This, glTexture *texture);
-void glRenderer__DrawScreen(glRenderer *This, glTexture *texture, glTexture *paltex, GLint vsync, glTexture *previous, BOOL setsync, BOOL settime, OVERLAY *overlays, int overlaycount);
+void glRenderer__DrawScreen(glRenderer *This, glTexture *texture, glTexture *paltex, GLint vsync, glTexture *previous, BOOL setsync, BOOL settime);
 void glRenderer__DeleteTexture(glRenderer *This, glTexture *texture);
-void glRenderer__DrawBackbuffer(glRenderer *This, glTexture **texture, int x, int y, int progtype, BOOL paletted, BOOL firstpass, int index);
 void glRenderer__DrawBackbufferRect(glRenderer *This, glTexture *texture, RECT srcrect, RECT destrect, int progtype, int index);
 void glRenderer__InitD3D(glRenderer *This, int zbuffer, int x, int y);
 void glRenderer__Clear(glRenderer *This, ClearCommand *cmd);
 void glRenderer__UpdateFVF(glRenderer *This, DWORD fvf);
-void glRenderer__DrawPrimitives(glRenderer *This, RenderTarget *target, GLenum mode, DWORD fvf,
-	BYTE *vertices, BOOL strided, DWORD count, LPWORD indices, DWORD indexcount, DWORD flags);
-void glRenderer__DrawPrimitivesOld(glRenderer *This, RenderTarget *target, GLenum mode, GLVERTEX *vertices, int *texcormats, DWORD count, LPWORD indices,
-	DWORD indexcount, DWORD flags);
+void glRenderer__DrawPrimitives(glRenderer *This, RenderTarget *target, GLenum mode, DWORD fvf, BYTE *vertices,
+	VertexBuffer *buffer, BOOL strided, DWORD count, const void *indices, GLenum indextype, DWORD indexcount, DWORD flags);
 void glRenderer__Flush(glRenderer *This);
 void glRenderer__SetWnd(glRenderer *This, int width, int height, int fullscreen, int bpp, unsigned int frequency, HWND newwnd, BOOL devwnd);
 void glRenderer__DeleteFBO(glRenderer *This, FBO *fbo);
@@ -232,6 +592,7 @@ void glRenderer__SetBlend(glRenderer *This, DWORD src, DWORD dest);
 void glRenderer__SetRenderState(glRenderer *This, D3DRENDERSTATETYPE dwRendStateType, DWORD dwRenderState);
 void glRenderer__RemoveTextureFromD3D(glRenderer *This, glTexture *texture);
 void glRenderer__SetTexture(glRenderer *This, DWORD dwStage, glTexture *Texture);
+void glRenderer__UpdateStageSampler(glRenderer *This, DWORD dwStage);
 void glRenderer__SetTextureStageState(glRenderer *This, DWORD dwStage, D3DTEXTURESTAGESTATETYPE dwState, DWORD dwValue);
 void glRenderer__SetTransform(glRenderer *This, D3DTRANSFORMSTATETYPE dtstTransformStateType, LPD3DMATRIX lpD3DMatrix);
 void glRenderer__SetMaterial(glRenderer *This, LPD3DMATERIAL7 lpMaterial);
@@ -241,10 +602,12 @@ void glRenderer__SetD3DViewport(glRenderer *This, LPD3DVIEWPORT7 lpViewport);
 void glRenderer__SetTextureColorKey(glRenderer *This, glTexture *texture, DWORD dwFlags, LPDDCOLORKEY lpDDColorKey, GLint level);
 void glRenderer__MakeTexturePrimary(glRenderer *This, glTexture *texture, glTexture *parent, BOOL primary);
 void glRenderer__SetDepthComp(glRenderer *This);
+void glRenderer__SetStencil(glRenderer *This);
 void glRenderer__DXGLBreak(glRenderer *This, BOOL setbusy);
 void glRenderer__EndCommand(glRenderer *This, BOOL wait);
 void glRenderer__SetMode3D(glRenderer *This, BOOL enabled);
 void glRenderer__FreePointer(glRenderer *This, void *ptr);
+void glRenderer__ApplyStateDelta(glRenderer *This, StateDelta *delta);
 
 void BltFlipLR(BltVertex *vertices);
 void BltFlipUD(BltVertex *vertices);
@@ -25,7 +25,19 @@
 #include "util.h"
 #include <math.h>
 #include "scalers.h"
+#include "SoftBlt.h"
 #include "colorconv.h"
+#include "ShaderManager.h"
+#include "TexturePool.h"
+#include "TextureAtlas.h"
+#include "TextureResidency.h"
+#include "BlockCompress.h"
+#include "Capture.h"
+#include "RuntimePolicy.h"
+#include "SurfaceProfile.h"
+
+// Smallest mipmap level converted with shaders when FormatConversion is automatic
+#define GPUCONV_MINPIXELS 65536
 
 static const DDSURFACEDESC2 ddsddummycolor =
 {
@@ -106,6 +118,15 @@ const DDPIXELFORMAT texformats[] =
 	{sizeof(DDPIXELFORMAT), DDPF_FOURCC, MAKEFOURCC('R','G','B','G'), 0,	0,			0,			0,			0},  // RGBG packed 16-bit pixelformat
 	{sizeof(DDPIXELFORMAT), DDPF_FOURCC, MAKEFOURCC('G','R','G','B'), 0,	0,			0,			0,			0},  // GRGB packed 16-bit pixelformat
 	{sizeof(DDPIXELFORMAT), DDPF_FOURCC, MAKEFOURCC('A','Y','U','V'), 0,	0,			0,			0,			0},  // AYUV packed YUV surface
+	{sizeof(DDPIXELFORMAT), DDPF_FOURCC, MAKEFOURCC('Y','V','1','2'), 0,	0,			0,			0,			0},  // YV12 planar YUV surface
+	{sizeof(DDPIXELFORMAT), DDPF_FOURCC, MAKEFOURCC('I','4','2','0'), 0,	0,			0,			0,			0},  // I420 planar YUV surface
+	{sizeof(DDPIXELFORMAT), DDPF_FOURCC, MAKEFOURCC('I','Y','U','V'), 0,	0,			0,			0,			0},  // I420 planar YUV surface (dup. of I420)
+	{sizeof(DDPIXELFORMAT), DDPF_FOURCC, MAKEFOURCC('N','V','1','2'), 0,	0,			0,			0,			0},  // NV12 planar YUV surface
+	{sizeof(DDPIXELFORMAT), DDPF_FOURCC, MAKEFOURCC('D','X','T','1'), 0,	0,			0,			0,			0},  // DXT1 compressed texture
+	{sizeof(DDPIXELFORMAT), DDPF_FOURCC, MAKEFOURCC('D','X','T','2'), 0,	0,			0,			0,			0},  // DXT2 compressed texture, premultiplied alpha
+	{sizeof(DDPIXELFORMAT), DDPF_FOURCC, MAKEFOURCC('D','X','T','3'), 0,	0,			0,			0,			0},  // DXT3 compressed texture
+	{sizeof(DDPIXELFORMAT), DDPF_FOURCC, MAKEFOURCC('D','X','T','4'), 0,	0,			0,			0,			0},  // DXT4 compressed texture, premultiplied alpha
+	{sizeof(DDPIXELFORMAT), DDPF_FOURCC, MAKEFOURCC('D','X','T','5'), 0,	0,			0,			0,			0},  // DXT5 compressed texture
 };
 static const int END_TEXFORMATS = __LINE__ - 4;
 int numtexformats;
@@ -151,6 +172,15 @@ int numtexformats;
 #define DXGLPIXELFORMAT_FOURCC_RGBG		36
 #define DXGLPIXELFORMAT_FOURCC_GRGB		37
 #define DXGLPIXELFORMAT_FOURCC_AYUV		38
+#define DXGLPIXELFORMAT_FOURCC_YV12		39
+#define DXGLPIXELFORMAT_FOURCC_I420		40
+#define DXGLPIXELFORMAT_FOURCC_IYUV		41
+#define DXGLPIXELFORMAT_FOURCC_NV12		42
+#define DXGLPIXELFORMAT_FOURCC_DXT1		43
+#define DXGLPIXELFORMAT_FOURCC_DXT2		44
+#define DXGLPIXELFORMAT_FOURCC_DXT3		45
+#define DXGLPIXELFORMAT_FOURCC_DXT4		46
+#define DXGLPIXELFORMAT_FOURCC_DXT5		47
 
 void ClearError()
 {
@@ -182,7 +212,21 @@ void ShrinkMip(DWORD *x, DWORD *y)
 	*y = max(1, (DWORD)floorf((float)*y / 2.0f));
 }
 
-HRESULT glTexture_Create(const DDSURFACEDESC2 *ddsd, glTexture *texture, struct glRenderer *renderer, BOOL backend, GLenum targetoverride)
+/**
+  * Fills in a texture object and its mipmap levels from a surface
+  * description, without creating the OpenGL texture.
+  * @param ddsd
+  *  Description of the surface
+  * @param texture
+  *  Texture object to fill in
+  * @param renderer
+  *  Renderer the texture will be created on
+  * @param targetoverride
+  *  OpenGL texture target, or 0 to choose one from the surface format
+  * @return
+  *  DD_OK if the texture can be created
+  */
+static HRESULT glTexture__Init(const DDSURFACEDESC2 *ddsd, glTexture *texture, struct glRenderer *renderer, GLenum targetoverride)
 {
 	int i;
 	if (!texture) return DDERR_INVALIDPARAMS;
@@ -192,6 +236,16 @@ HRESULT glTexture_Create(const DDSURFACEDESC2 *ddsd, glTexture *texture, struct
 	if ((ddsd->dwFlags & DDSD_PIXELFORMAT) && (ddsd->ddpfPixelFormat.dwSize != sizeof(DDPIXELFORMAT)))
 		return DDERR_INVALIDPARAMS;
 	ZeroMemory(texture, sizeof(glTexture));
+	texture->profile = SurfaceProfile_Add(ddsd);
+	// Levels past the first are only needed by mipmap chains
+	if ((ddsd->dwFlags & DDSD_MIPMAPCOUNT) && ddsd->dwMipMapCount)
+		texture->levelcount = min(ddsd->dwMipMapCount, 17);
+	else texture->levelcount = 1;
+	texture->levels = (MIPLEVEL*)malloc(texture->levelcount * sizeof(MIPLEVEL));
+	if (!texture->levels) return DDERR_OUTOFMEMORY;
+	ZeroMemory(texture->levels, texture->levelcount * sizeof(MIPLEVEL));
+	for (i = 0; i < texture->levelcount; i++)
+		texture->levels[i].version = 1;
 	memcpy(&texture->levels[0].ddsd, ddsd, sizeof(DDSURFACEDESC2));
 	texture->useconv = FALSE;
 	texture->pboPack = NULL;
@@ -278,6 +332,10 @@ HRESULT glTexture_Create(const DDSURFACEDESC2 *ddsd, glTexture *texture, struct
 			case MAKEFOURCC('Y', '8', ' ', ' '):
 			case MAKEFOURCC('Y', '8', '0', '0'):
 			case MAKEFOURCC('G', 'R', 'E', 'Y'):
+			case MAKEFOURCC('Y', 'V', '1', '2'):  // Pitch of the Y plane
+			case MAKEFOURCC('I', '4', '2', '0'):
+			case MAKEFOURCC('I', 'Y', 'U', 'V'):
+			case MAKEFOURCC('N', 'V', '1', '2'):
 				texture->levels[0].ddsd.lPitch = NextMultipleOf4(texture->levels[0].ddsd.dwWidth);
 				break;
 			case MAKEFOURCC('Y', '1', '6', ' '):
@@ -292,11 +350,29 @@ HRESULT glTexture_Create(const DDSURFACEDESC2 *ddsd, glTexture *texture, struct
 			case MAKEFOURCC('G', 'R', 'G', 'B'):
 				texture->levels[0].ddsd.lPitch = NextMultipleOf4(texture->levels[0].ddsd.dwWidth * 2);
 				break;
+			case MAKEFOURCC('D', 'X', 'T', '1'):
+				texture->compressed = COMPRESSED_DXT1;
+				break;
+			case MAKEFOURCC('D', 'X', 'T', '2'):
+			case MAKEFOURCC('D', 'X', 'T', '3'):
+				texture->compressed = COMPRESSED_DXT3;
+				break;
+			case MAKEFOURCC('D', 'X', 'T', '4'):
+			case MAKEFOURCC('D', 'X', 'T', '5'):
+				texture->compressed = COMPRESSED_DXT5;
+				break;
 			case MAKEFOURCC('A', 'Y', 'U', 'V'):
 			default:
 				texture->levels[0].ddsd.lPitch = NextMultipleOf4(texture->levels[0].ddsd.dwWidth * 4);
 				break;
 			}
+			if (texture->compressed)
+			{
+				// Compressed surfaces report the size of the level instead of a pitch
+				texture->levels[0].ddsd.dwFlags = (texture->levels[0].ddsd.dwFlags & ~DDSD_PITCH) | DDSD_LINEARSIZE;
+				texture->levels[0].ddsd.dwLinearSize = (DWORD)ColorConv_BlockSize(texture->compressed,
+					texture->levels[0].ddsd.dwWidth, texture->levels[0].ddsd.dwHeight);
+			}
 		}
 		else
 		{
@@ -332,18 +408,201 @@ HRESULT glTexture_Create(const DDSURFACEDESC2 *ddsd, glTexture *texture, struct
 			texture->levels[i].ddsd.dwWidth = max(1, (DWORD)floorf((float)texture->levels[i - 1].ddsd.dwWidth / 2.0f));
 			texture->levels[i].ddsd.dwHeight = max(1, (DWORD)floorf((float)texture->levels[i - 1].ddsd.dwHeight / 2.0f));
 			texture->levels[i].ddsd.ddsCaps.dwCaps2 |= DDSCAPS2_MIPMAPSUBLEVEL;
+			if (texture->compressed) texture->levels[i].ddsd.dwLinearSize = (DWORD)ColorConv_BlockSize(
+				texture->compressed, texture->levels[i].ddsd.dwWidth, texture->levels[i].ddsd.dwHeight);
 		}
 	}
+	return DD_OK;
+}
+
+HRESULT glTexture_Create(const DDSURFACEDESC2 *ddsd, glTexture *texture, struct glRenderer *renderer, BOOL backend, GLenum targetoverride)
+{
+	HRESULT error = glTexture__Init(ddsd, texture, renderer, targetoverride);
+	if (error != DD_OK) return error;
 	if (backend) glTexture__FinishCreate(texture);
 	else glRenderer_MakeTexture(renderer, texture);
 	texture->initialized = TRUE;
 	return DD_OK;
 }
+
+/**
+  * Creates the textures of the buffers of a complex surface, such as the
+  * buffers of a flip chain or the faces of a cube map, with a single call
+  * to the renderer thread.
+  * @param ddsd
+  *  Array of count pointers to the description of each texture
+  * @param textures
+  *  Array of count texture objects to create
+  * @param count
+  *  Number of textures to create
+  * @param renderer
+  *  Renderer to create the textures on
+  * @return
+  *  DD_OK if all textures were created, otherwise none of them were
+  */
+HRESULT glTexture_CreateBatch(const DDSURFACEDESC2 **ddsd, glTexture *textures, DWORD count, struct glRenderer *renderer)
+{
+	HRESULT error;
+	DWORD i;
+	for (i = 0; i < count; i++)
+	{
+		error = glTexture__Init(ddsd[i], &textures[i], renderer, 0);
+		if (error != DD_OK)
+		{
+			// Nothing was created in OpenGL yet, only the levels were allocated
+			while (i > 0)
+			{
+				i--;
+				free(textures[i].levels);
+				textures[i].levels = NULL;
+			}
+			return error;
+		}
+	}
+	glRenderer_MakeTextures(renderer, textures, count);
+	for (i = 0; i < count; i++)
+		textures[i].initialized = TRUE;
+	return DD_OK;
+}
 ULONG glTexture_AddRef(glTexture *This)
 {
 	InterlockedIncrement((LONG*)&This->refcount);
 	return This->refcount;
 }
+/**
+  * Deletes the DIB section holding the buffer of a mipmap level, and the DC
+  * it is selected into.  The level is left without a buffer.
+  * @param This
+  *  Pointer to texture object
+  * @param level
+  *  Mipmap level with a buffer created by glTexture__CreateDIB
+  */
+static void glTexture__DeleteDIB(glTexture *This, GLint level)
+{
+	DeleteDC(This->levels[level].gdi->hdc);
+	This->levels[level].gdi->hdc = NULL;
+	DeleteObject(This->levels[level].gdi->hbitmap);
+	This->levels[level].gdi->hbitmap = NULL;
+	This->levels[level].buffer = NULL;
+	This->levels[level].gdi->dibbuffer = FALSE;
+}
+/**
+  * Gets the size of a large page if the LargePages option is set and the
+  * process may lock memory, enabling the privilege the first time.
+  * @return
+  *  Size of a large page in bytes, or 0 if buffers can't use large pages
+  */
+static SIZE_T glTexture__LargePageSize()
+{
+	static SIZE_T pagesize = (SIZE_T)-1;
+	SIZE_T(WINAPI *_GetLargePageMinimum)();
+	HANDLE token;
+	TOKEN_PRIVILEGES privileges;
+	if (pagesize != (SIZE_T)-1) return pagesize;
+	pagesize = 0;
+	if (!dxglcfg.LargePages) return 0;
+	// Not available before Windows Server 2003
+	_GetLargePageMinimum = (SIZE_T(WINAPI*)())GetProcAddress(GetModuleHandle(_T("kernel32.dll")),
+		"GetLargePageMinimum");
+	if (!_GetLargePageMinimum) return 0;
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)) return 0;
+	privileges.PrivilegeCount = 1;
+	privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+	// Succeeds without enabling anything if the user was not granted the privilege
+	if (LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid) &&
+		AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL) &&
+		(GetLastError() == ERROR_SUCCESS))
+		pagesize = _GetLargePageMinimum();
+	CloseHandle(token);
+	return pagesize;
+}
+
+/**
+  * Allocates the system memory buffer of a mipmap level.  Buffers start on a
+  * cache line so row copies and conversions of the common widths whose pitch
+  * is a multiple of 64 bytes work on whole lines.  With the
+  * HackWriteWatch option the buffer is watched by the system so writes made
+  * through a pointer kept after Unlock can be found and uploaded.  With the
+  * LargePages option, buffers of at least one large page use large pages
+  * when rounding up wastes little, so walking the rows of a full screen
+  * surface takes fewer TLB misses.
+  * @param This
+  *  Pointer to texture object
+  * @param level
+  *  Mipmap level to allocate the buffer of
+  * @param size
+  *  Size of the buffer in bytes
+  * @return
+  *  Pointer to the level's buffer, or NULL if it could not be allocated
+  */
+static char *glTexture__AllocBuffer(glTexture *This, int level, DWORD size)
+{
+	SIZE_T pagesize;
+	SIZE_T rounded;
+	This->levels[level].writewatch = FALSE;
+	This->levels[level].largepage = FALSE;
+	// Compressed and planar levels can't be uploaded by rows
+	if (dxglpolicy.writewatch && !This->compressed && !This->planar)
+	{
+		This->levels[level].buffer = (char*)VirtualAlloc(NULL, size,
+			MEM_RESERVE | MEM_COMMIT | MEM_WRITE_WATCH, PAGE_READWRITE);
+		if (This->levels[level].buffer)
+		{
+			This->levels[level].writewatch = TRUE;
+			return This->levels[level].buffer;
+		}
+	}
+	pagesize = glTexture__LargePageSize();
+	if (pagesize && (size >= pagesize))
+	{
+		rounded = ((size + pagesize - 1) / pagesize) * pagesize;
+		// Large pages are locked in memory, don't lock much more than the buffer needs
+		if ((rounded - size) <= (size / 4))
+		{
+			This->levels[level].buffer = (char*)VirtualAlloc(NULL, rounded,
+				MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+			if (This->levels[level].buffer)
+			{
+				This->levels[level].largepage = TRUE;
+				return This->levels[level].buffer;
+			}
+		}
+	}
+	This->levels[level].buffer = (char*)_aligned_malloc(size, BUFFER_ALIGNMENT);
+	return This->levels[level].buffer;
+}
+
+/**
+  * Frees a buffer allocated by glTexture__AllocBuffer.
+  * @param This
+  *  Pointer to texture object
+  * @param level
+  *  Mipmap level to free the buffer of
+  */
+static void glTexture__FreeBuffer(glTexture *This, int level)
+{
+	if (This->levels[level].writewatch || This->levels[level].largepage)
+		VirtualFree(This->levels[level].buffer, 0, MEM_RELEASE);
+	else _aligned_free(This->levels[level].buffer);
+	This->levels[level].buffer = NULL;
+	This->levels[level].writewatch = FALSE;
+	This->levels[level].largepage = FALSE;
+}
+
+/**
+  * Forgets the writes recorded in a watched buffer, after DXGL itself wrote
+  * the current GPU contents to it.
+  * @param This
+  *  Pointer to texture object
+  * @param level
+  *  Mipmap level that was read back
+  */
+static void glTexture__ResetWriteWatch(glTexture *This, int level)
+{
+	if (This->levels[level].writewatch)
+		ResetWriteWatch(This->levels[level].buffer, glTexture__LevelSize(This, level));
+}
+
 ULONG glTexture_Release(glTexture *This, BOOL backend)
 {
 	int i;
@@ -351,34 +610,428 @@ ULONG glTexture_Release(glTexture *This, BOOL backend)
 	ret = InterlockedDecrement((LONG*)&This->refcount);
 	if (This->refcount == 0)
 	{
+		// Queued blts may still upload from the buffers freed below
+		if (!backend)
+			for (i = 0; i < This->levelcount; i++) glRenderer_WaitForTexture(This->renderer, This, i, TRUE);
 		if (This->palette) glTexture_Release(This->palette, backend);
 		if (This->stencil) glTexture_Release(This->stencil, backend);
 		if (This->dummycolor) glTexture_Release(This->dummycolor, backend);
-		for (i = 0; i < This->miplevel; i++)
+		for (i = 0; i < This->levelcount; i++)
 		{
-			if (This->levels[i].buffer) free(This->levels[i].buffer);
-			if (This->levels[i].bitmapinfo) free(This->levels[i].bitmapinfo);
+			if (This->levels[i].gdi)
+			{
+				if (This->levels[i].gdi->dibbuffer) glTexture__DeleteDIB(This, i);
+				if (This->levels[i].gdi->bitmapinfo) free(This->levels[i].gdi->bitmapinfo);
+				free(This->levels[i].gdi);
+				This->levels[i].gdi = NULL;
+			}
+			if (This->levels[i].buffer) glTexture__FreeBuffer(This, i);
 		}
 		if (backend) glTexture__Destroy(This);
 		else glRenderer_DeleteTexture(This->renderer, This);
 	}
 	return ret;
 }
+/**
+  * Allocates the system memory buffer of a mipmap level if it doesn't have
+  * one yet.  Sub-levels are only given a buffer once they are locked or read
+  * back, so untouched levels of large mipmapped textures cost no memory.
+  * @param This
+  *  Pointer to texture object
+  * @param level
+  *  Mipmap level to allocate
+  * @return
+  *  Pointer to the level's buffer, or NULL if it could not be allocated
+  */
+static char *glTexture__AllocLevel(glTexture *This, int level)
+{
+	if (This->levels[level].buffer) return This->levels[level].buffer;
+	return glTexture__AllocBuffer(This, level, glTexture__LevelSize(This, level));
+}
+
+/**
+  * Gets the size of the CPU buffer of a mipmap level.
+  * @param This
+  *  Pointer to texture object
+  * @param level
+  *  Mipmap level to get the size of
+  * @return
+  *  Size of the level's buffer in bytes
+  */
+DWORD glTexture__LevelSize(glTexture *This, int level)
+{
+	int bytes;
+	if (This->planar)
+		return (DWORD)ColorConv_PlanarSize(This->levels[level].ddsd.lPitch, This->levels[level].ddsd.dwHeight);
+	if (This->compressed)
+		return (DWORD)ColorConv_BlockSize(This->compressed, This->levels[level].ddsd.dwWidth, This->levels[level].ddsd.dwHeight);
+	if (This->levels[level].ddsd.ddpfPixelFormat.dwFlags & DDPF_FOURCC)
+	{
+		switch (This->levels[level].ddsd.ddpfPixelFormat.dwFourCC)
+		{
+		case MAKEFOURCC('Y', '8', ' ', ' '):
+		case MAKEFOURCC('Y', '8', '0', '0'):
+		case MAKEFOURCC('G', 'R', 'E', 'Y'):
+			bytes = NextMultipleOf4(This->levels[level].ddsd.dwWidth);
+		case MAKEFOURCC('Y', '1', '6', ' '):
+		case MAKEFOURCC('U', 'Y', 'V', 'Y'):
+		case MAKEFOURCC('U', 'Y', 'N', 'V'):
+		case MAKEFOURCC('Y', '4', '2', '2'):
+		case MAKEFOURCC('Y', 'U', 'Y', '2'):
+		case MAKEFOURCC('Y', 'U', 'Y', 'V'):
+		case MAKEFOURCC('Y', 'U', 'N', 'V'):
+		case MAKEFOURCC('Y', 'V', 'Y', 'U'):
+		case MAKEFOURCC('R', 'G', 'B', 'G'):
+		case MAKEFOURCC('G', 'R', 'G', 'B'):
+			bytes = NextMultipleOf4(2 * This->levels[level].ddsd.dwWidth);
+			break;
+		case MAKEFOURCC('A', 'Y', 'U', 'V'):
+		default:
+			bytes = 4 * This->levels[level].ddsd.dwWidth;
+			break;
+		}
+	}
+	else bytes = NextMultipleOf4((This->levels[level].ddsd.ddpfPixelFormat.dwRGBBitCount *
+		This->levels[level].ddsd.dwWidth) / 8);
+	return bytes * This->levels[level].ddsd.dwHeight;
+}
+
+/**
+  * Fills the sub-levels of a mipmapped texture from level 0 on the GPU.
+  * Used while the application has not written to any sub-level itself.
+  * @param This
+  *  Pointer to texture object
+  * @param util
+  *  Pointer to the glUtil object to bind the texture with
+  */
+static void glTexture__GenerateMipmap(glTexture *This, glUtil *util)
+{
+	int i;
+	glUtil_SetActiveTexture(util, 0);
+	glUtil_SetTexture(util, 0, This);
+	// Levels are generated from the base level, which SetLOD may have raised
+	if (This->appliedlod) glTexParameteri(This->target, GL_TEXTURE_BASE_LEVEL, 0);
+	This->renderer->ext->glGenerateMipmap(This->target);
+	if (This->appliedlod) glTexParameteri(This->target, GL_TEXTURE_BASE_LEVEL, This->appliedlod);
+	for (i = 1; i < This->miplevel; i++)
+		This->levels[i].dirty = (This->levels[i].dirty | 2) & ~84;
+}
+
+/**
+  * Adds a rectangle to the CPU-dirty region of a mipmap level, merging it
+  * into the existing rectangles once DIRTYRECT_MAX are in use.
+  * @param level
+  *  Pointer to mipmap level
+  * @param r
+  *  Rectangle written to, or NULL if the whole level may have been written to
+  */
+static void glTexture__AddDirtyRect(MIPLEVEL *level, const RECT *r)
+{
+	RECT rect;
+	DWORD i;
+	DWORD best = 0;
+	__int64 growth, bestgrowth = -1;
+	if (!(level->dirty & 1)) level->dirtyrectcount = 0;
+	// Already uploading the whole level
+	else if (!level->dirtyrectcount) return;
+	if (!r)
+	{
+		level->dirtyrectcount = 0;
+		return;
+	}
+	rect.left = max(r->left, 0);
+	rect.top = max(r->top, 0);
+	rect.right = min(r->right, (LONG)level->ddsd.dwWidth);
+	rect.bottom = min(r->bottom, (LONG)level->ddsd.dwHeight);
+	if ((rect.left >= rect.right) || (rect.top >= rect.bottom)) return;
+	for (i = 0; i < level->dirtyrectcount; i++)
+	{
+		// Fold into a rectangle it touches
+		if ((rect.left <= level->dirtyrects[i].right) && (rect.right >= level->dirtyrects[i].left) &&
+			(rect.top <= level->dirtyrects[i].bottom) && (rect.bottom >= level->dirtyrects[i].top))
+		{
+			UnionRect(&level->dirtyrects[i], &level->dirtyrects[i], &rect);
+			return;
+		}
+	}
+	if (level->dirtyrectcount < DIRTYRECT_MAX)
+	{
+		level->dirtyrects[level->dirtyrectcount++] = rect;
+		return;
+	}
+	// List is full, merge into the rectangle that grows the least
+	for (i = 0; i < DIRTYRECT_MAX; i++)
+	{
+		growth = (__int64)(max(rect.right, level->dirtyrects[i].right) - min(rect.left, level->dirtyrects[i].left)) *
+			(max(rect.bottom, level->dirtyrects[i].bottom) - min(rect.top, level->dirtyrects[i].top)) -
+			(__int64)(level->dirtyrects[i].right - level->dirtyrects[i].left) *
+			(level->dirtyrects[i].bottom - level->dirtyrects[i].top);
+		if ((bestgrowth < 0) || (growth < bestgrowth))
+		{
+			best = i;
+			bestgrowth = growth;
+		}
+	}
+	UnionRect(&level->dirtyrects[best], &level->dirtyrects[best], &rect);
+}
+
+/**
+  * Adds the rows of the pages written to since the last check to the
+  * CPU-dirty region of a watched mipmap level.  The level isn't skipped while
+  * locked, since some games never unlock the primary.
+  * @param This
+  *  Pointer to texture object
+  * @param level
+  *  Mipmap level with a buffer allocated with MEM_WRITE_WATCH
+  */
+static void glTexture__ReadWriteWatch(glTexture *This, GLint level)
+{
+	MIPLEVEL *mip = &This->levels[level];
+	PVOID pages[256];
+	ULONG_PTR count;
+	ULONG granularity;
+	DWORD size = glTexture__LevelSize(This, level);
+	DWORD offset = 0;
+	DWORD chunk;
+	DWORD start, end;
+	ULONG_PTR i;
+	RECT r;
+	while (offset < size)
+	{
+		chunk = min(size - offset, 256 * 4096);
+		count = 256;
+		if (GetWriteWatch(WRITE_WATCH_FLAG_RESET, mip->buffer + offset, chunk,
+			pages, &count, &granularity)) return;
+		for (i = 0; i < count; i++)
+		{
+			// Merge consecutive pages into one band of rows
+			start = (DWORD)((char*)pages[i] - mip->buffer);
+			end = start + granularity;
+			while ((i + 1 < count) && ((char*)pages[i + 1] - mip->buffer == (ptrdiff_t)end))
+			{
+				end += granularity;
+				i++;
+			}
+			r.left = 0;
+			r.right = mip->ddsd.dwWidth;
+			r.top = start / mip->ddsd.lPitch;
+			r.bottom = (min(end, size) + mip->ddsd.lPitch - 1) / mip->ddsd.lPitch;
+			glTexture__AddDirtyRect(mip, &r);
+			mip->dirty = (mip->dirty | 1) & ~16;
+		}
+		offset += chunk;
+	}
+}
+
+/**
+  * Checks if a mipmap level was written by the CPU since its last upload.
+  * Watched levels first pick up writes made through a pointer kept after
+  * Unlock.
+  * @param This
+  *  Pointer to texture object
+  * @param level
+  *  Mipmap level to check
+  * @return
+  *  TRUE if the level needs to be uploaded
+  */
+BOOL glTexture__CPUDirty(glTexture *This, GLint level)
+{
+	if (This->levels[level].writewatch) glTexture__ReadWriteWatch(This, level);
+	return This->levels[level].dirty & 1;
+}
+
+/**
+  * Checks if a lock can hand out a pointer into the level's persistently
+  * mapped pixel buffer instead of the surface buffer.
+  * The lock must cover the whole level, must not read the surface, and the
+  * data must not need conversion.  A write-only lock that keeps the contents
+  * also needs the pixel buffer to still hold the current level.
+  * @param This
+  *  Pointer to texture object
+  * @param level
+  *  Mipmap level to lock
+  * @param r
+  *  Rectangle to lock, or NULL for the whole level
+  * @param flags
+  *  DDLOCK flags passed to the lock
+  * @return
+  *  TRUE if the lock can write directly into the pixel buffer
+  */
+static BOOL glTexture__CanLockDirect(glTexture *This, GLint level, LPRECT r, DWORD flags)
+{
+	if (!(flags & DDLOCK_DISCARDCONTENTS))
+	{
+		if (!(flags & DDLOCK_WRITEONLY)) return FALSE;
+		if (!(This->levels[level].dirty & 16)) return FALSE;
+	}
+	if (flags & DDLOCK_READONLY) return FALSE;
+	if (!This->renderer->ext->GLEXT_ARB_buffer_storage || !This->renderer->ext->GLEXT_ARB_sync) return FALSE;
+	if (This->useconv || This->compressed || (This->target != GL_TEXTURE_2D) || This->atlas) return FALSE;
+	// Evicted textures keep their contents in the surface buffers
+	if (This->evicted) return FALSE;
+	// The color key is added to the data on upload
+	if (This->keyalpha) return FALSE;
+	// Writes through a kept pointer must land in the watched buffer
+	if (This->levels[level].writewatch) return FALSE;
+	if (This->levels[level].locked || (This->levels[level].gdi && This->levels[level].gdi->dcout)) return FALSE;
+	if (r && ((r->left > 0) || (r->top > 0) || ((DWORD)r->right < This->levels[level].ddsd.dwWidth) ||
+		((DWORD)r->bottom < This->levels[level].ddsd.dwHeight))) return FALSE;
+	return TRUE;
+}
+
+/**
+  * Checks if a lock can read back only its rectangle of a level written by
+  * the GPU instead of the whole level.
+  * @param This
+  *  Pointer to texture object
+  * @param level
+  *  Mipmap level to lock
+  * @param r
+  *  Rectangle to lock, or NULL for the whole level
+  * @param flags
+  *  DDLOCK flags of the lock
+  * @return
+  *  TRUE if glTexture__DownloadRect may be used for the lock
+  */
+static BOOL glTexture__CanDownloadRect(glTexture *This, GLint level, LPRECT r, DWORD flags)
+{
+	MIPLEVEL *mip = &This->levels[level];
+	DWORD bpp = mip->ddsd.ddpfPixelFormat.dwRGBBitCount;
+	// The rest of the buffer stays stale, so writes would upload it over the GPU contents
+	if (!r || !(flags & DDLOCK_READONLY)) return FALSE;
+	if (This->compressed || This->planar || This->atlas || (This->target != GL_TEXTURE_2D)) return FALSE;
+	if ((bpp < 8) || (bpp & 7)) return FALSE;
+	if (mip->ddsd.ddpfPixelFormat.dwFlags & DDPF_ZBUFFER)
+	{
+		// Depth and stencil can only be read together if both are attached
+		if ((This->format != GL_DEPTH_COMPONENT) && !This->zhasstencil) return FALSE;
+	}
+	// Other converted formats are read back by glTexture__Download only
+	else if (This->useconv) return FALSE;
+	if (mip->ddsd.lPitch != NextMultipleOf4(mip->ddsd.dwWidth * (bpp / 8))) return FALSE;
+	if (!This->renderer->ext->GLEXT_ARB_framebuffer_object) return FALSE;
+	// A started asynchronous readback already has the whole level
+	if (mip->dirty & 4) return FALSE;
+	if ((r->left <= 0) && (r->top <= 0) && ((DWORD)r->right >= mip->ddsd.dwWidth) &&
+		((DWORD)r->bottom >= mip->ddsd.dwHeight)) return FALSE;
+	return TRUE;
+}
+
+/**
+  * Learns how often a level is locked after the GPU draws to it.  Once it
+  * has been locked in READBACK_LOCKFRAMES consecutive frames, dirty bit 8
+  * has the renderer read it back as soon as it is drawn.  The renderer
+  * clears the bit again if a readback goes unused for a frame.
+  * @param This
+  *  Pointer to texture object
+  * @param level
+  *  Mipmap level being locked in full
+  */
+static void glTexture__LearnLock(glTexture *This, GLint level)
+{
+	MIPLEVEL *mip = &This->levels[level];
+	DWORD frame = This->renderer->perf.frame.dwFrame;
+	// Any readback started for this lock has been used
+	mip->readbackframe = 0;
+	if (!(mip->dirty & 2)) return;
+	if (mip->lockstreak && (frame == mip->lockframe)) return;
+	if (mip->lockstreak && (frame == mip->lockframe + 1)) mip->lockstreak++;
+	else mip->lockstreak = 1;
+	mip->lockframe = frame;
+	if (mip->lockstreak >= READBACK_LOCKFRAMES) mip->dirty |= 8;
+}
+
+/**
+  * Adds a readback for a lock to the profile of the surface.
+  * @param This
+  *  Pointer to texture object
+  * @param level
+  *  Mipmap level that was read back
+  * @param r
+  *  Rectangle that was locked
+  * @param partial
+  *  TRUE if only r was read back
+  * @param start
+  *  Value returned by SurfaceProfile_Begin before the readback
+  */
+static void glTexture__ProfileDownload(glTexture *This, GLint level, LPRECT r, BOOL partial, LONGLONG start)
+{
+	LONGLONG bytes;
+	if (!This->profile) return;
+	if (partial) bytes = (LONGLONG)(r->right - r->left) * (r->bottom - r->top) *
+		(This->levels[level].ddsd.ddpfPixelFormat.dwRGBBitCount / 8);
+	else bytes = glTexture__LevelSize(This, level);
+	SurfaceProfile_End(This->profile, SURFACEPROFILE_DOWNLOAD, start, bytes);
+}
+
 HRESULT glTexture_Lock(glTexture *This, GLint level, LPRECT r, LPDDSURFACEDESC2 ddsd, DWORD flags, BOOL backend)
 {
+	char *direct = NULL;
+	BOOL partial;
+	LONGLONG profilestart;
 	if (level > (This->levels[0].ddsd.dwMipMapCount - 1)) return DDERR_INVALIDPARAMS;
 	if (!ddsd) return DDERR_INVALIDPARAMS;
+	if (glTexture__CanLockDirect(This, level, r, flags))
+	{
+		if (backend) direct = glTexture__MapLock(This, level);
+		else
+		{
+			// Queued blts may still use this level
+			glRenderer_WaitForTexture(This->renderer, This, level, TRUE);
+			direct = glRenderer_MapTextureLock(This->renderer, This, level);
+		}
+	}
+	if (direct)
+	{
+		// Unlock uploads straight from the pixel buffer; the surface buffer goes stale
+		InterlockedIncrement((LONG*)&This->levels[level].locked);
+		This->levels[level].lockmapped = TRUE;
+		This->levels[level].ddsd.lpSurface = direct;
+		memcpy(ddsd, &This->levels[level].ddsd, sizeof(DDSURFACEDESC2));
+		return DD_OK;
+	}
+	if (!glTexture__AllocLevel(This, level)) return DDERR_OUTOFMEMORY;
 	InterlockedIncrement((LONG*)&This->levels[level].locked);
+	partial = glTexture__CanDownloadRect(This, level, r, flags);
+	// Small probes don't teach the readback prediction
+	if (!partial) glTexture__LearnLock(This, level);
 	if (backend)
 	{
-		if (This->levels[level].dirty & 2) glTexture__Download(This, level);
+		if (This->levels[level].dirty & 2)
+		{
+			profilestart = SurfaceProfile_Begin(This->profile);
+			if (!partial || !glTexture__DownloadRect(This, level, r)) glTexture__Download(This, level);
+			glTexture__ProfileDownload(This, level, r, partial, profilestart);
+		}
 	}
 	else
 	{
-		if (This->levels[level].dirty & 2) glRenderer_DownloadTexture(This->renderer, This, level);
+		// Queued blts may still use this level, unrelated commands keep running
+		glRenderer_WaitForTexture(This->renderer, This, level, !(flags & DDLOCK_READONLY));
+		if (This->levels[level].dirty & 2)
+		{
+			profilestart = SurfaceProfile_Begin(This->profile);
+			if (partial) glRenderer_DownloadTextureRect(This->renderer, This, level, r);
+			else glRenderer_DownloadTexture(This->renderer, This, level);
+			glTexture__ProfileDownload(This, level, r, partial, profilestart);
+		}
 	}
-	This->levels[level].dirty |= 1;
-	if (r)
+	if (!(flags & DDLOCK_READONLY))
+	{
+		glTexture__AddDirtyRect(&This->levels[level], r);
+		This->levels[level].dirty = (This->levels[level].dirty | 1) & ~16;
+		// The application supplies its own sub-levels from now on
+		if (level) This->automipmap = FALSE;
+	}
+	if (r && This->compressed)
+	{
+		// Points to the block holding the top left corner of the rectangle
+		ULONG_PTR ptr = (ULONG_PTR)This->levels[level].buffer;
+		ptr += (r->left / 4) * ColorConv_BlockPitch(This->compressed, 4);
+		ptr += (r->top / 4) * ColorConv_BlockPitch(This->compressed, This->levels[level].ddsd.dwWidth);
+		This->levels[level].ddsd.lpSurface = (LPVOID)ptr;
+	}
+	else if (r)
 	{
 		ULONG_PTR ptr = (ULONG_PTR)This->levels[level].buffer;
 		ptr += (r->left * (This->levels[level].ddsd.ddpfPixelFormat.dwRGBBitCount / 8));
@@ -393,13 +1046,222 @@ HRESULT glTexture_Unlock(glTexture *This, GLint level, LPRECT r, BOOL backend)
 {
 	if (level > (This->levels[0].ddsd.dwMipMapCount - 1)) return DDERR_INVALIDPARAMS;
 	InterlockedDecrement((LONG*)&This->levels[level].locked);
-	if ((This->miplevel > 1) || dxglcfg.DebugUploadAfterUnlock)
+	glTexture_ChangeVersion(This, level);
+	if (This->levels[level].lockmapped || dxglpolicy.uploadonunlock)
 	{
 		if (backend) glTexture__Upload(This, level);
 		else glRenderer_UploadTexture(This->renderer, This, level);
 	}
+	else if ((This->miplevel > 1) || (This->levels[0].ddsd.ddsCaps.dwCaps & DDSCAPS_TEXTURE))
+	{
+		// Uploaded at the start of a later frame, or by the first draw that needs it
+		if (backend) glTexture__Upload(This, level);
+		else glRenderer_QueueUpload(This->renderer, This, level);
+	}
 	return DD_OK;
 }
+
+/**
+  * Marks a mipmap level as written, so caches built from its contents can
+  * tell they are stale by comparing the version they were built from.
+  * Called for unlocks, released DCs, software blts and every queued command
+  * that writes the level.
+  * @param This
+  *  Pointer to texture object
+  * @param level
+  *  Mipmap level that was written
+  */
+void glTexture_ChangeVersion(glTexture *This, GLint level)
+{
+	// 0 is skipped so it can be used for "not built yet"
+	if (!InterlockedIncrement(&This->levels[level].version))
+		InterlockedIncrement(&This->levels[level].version);
+}
+
+/**
+  * Checks if the CPU has the current contents of a mipmap level for a
+  * software blt.
+  * @param This
+  *  Pointer to texture object
+  * @param level
+  *  Mipmap level to check
+  * @param written
+  *  TRUE if the level must also have been written by the CPU since its last
+  *  upload, so the blt doesn't add an upload of a level the GPU has
+  * @return
+  *  TRUE if the level's surface buffer holds its current contents
+  */
+static BOOL glTexture__IsCPUCurrent(glTexture *This, GLint level, BOOL written)
+{
+	MIPLEVEL *mip = &This->levels[level];
+	if (!mip->buffer || mip->locked || mip->lockmapped || (mip->gdi && mip->gdi->dcout)) return FALSE;
+	if (mip->dirty & (2 | 4 | 16)) return FALSE;
+	if (written && !(mip->dirty & 1)) return FALSE;
+	// The renderbuffer may hold newer contents than the texture
+	if (This->msaarb) return FALSE;
+	return TRUE;
+}
+
+/**
+  * Performs a blt on the CPU if both surfaces were last written by the CPU
+  * and the blt only copies, stretches, mirrors or uses single color keys.
+  * Software rendered games that compose their frames in system memory then
+  * don't make the renderer draw and read back each blt.
+  * @param cmd
+  *  Blt to perform
+  * @return
+  *  TRUE if the blt was performed, FALSE if the renderer has to perform it
+  */
+BOOL glTexture_SoftBlt(BltCommand *cmd)
+{
+	glTexture *src = cmd->src;
+	glTexture *dest = cmd->dest;
+	DDPIXELFORMAT *format;
+	SOFTBLTSURFACE srcsurface, destsurface;
+	DWORD keymask;
+	DWORD flags = 0;
+	if (!src || !dest || ((src == dest) && (cmd->srclevel == cmd->destlevel))) return FALSE;
+	if (cmd->flags & ~(DDBLT_WAIT | DDBLT_ASYNC | DDBLT_DONOTWAIT | DDBLT_KEYSRC | DDBLT_KEYDEST |
+		DDBLT_KEYSRCOVERRIDE | DDBLT_KEYDESTOVERRIDE | DDBLT_DDFX | DDBLT_ROP)) return FALSE;
+	if ((cmd->flags & DDBLT_ROP) && (cmd->bltfx.dwROP != SRCCOPY)) return FALSE;
+	if ((cmd->flags & DDBLT_DDFX) && (cmd->bltfx.dwDDFX & ~(DDBLTFX_MIRRORLEFTRIGHT | DDBLTFX_MIRRORUPDOWN |
+		DDBLTFX_NOTEARING))) return FALSE;
+	if (cmd->clipcount) return FALSE;
+	// The primary is shown by the renderer
+	if (dest->levels[0].ddsd.ddsCaps.dwCaps & DDSCAPS_PRIMARYSURFACE) return FALSE;
+	if (src->compressed || dest->compressed || src->planar || dest->planar) return FALSE;
+	format = &dest->levels[0].ddsd.ddpfPixelFormat;
+	if (memcmp(&src->levels[0].ddsd.ddpfPixelFormat, format, sizeof(DDPIXELFORMAT))) return FALSE;
+	if ((format->dwRGBBitCount != 8) && (format->dwRGBBitCount != 16) &&
+		(format->dwRGBBitCount != 24) && (format->dwRGBBitCount != 32)) return FALSE;
+	if (format->dwFlags & (DDPF_FOURCC | DDPF_ZBUFFER)) return FALSE;
+	srcsurface.rect = cmd->srcrect;
+	if (!memcmp(&srcsurface.rect, &nullrect, sizeof(RECT)))
+		SetRect(&srcsurface.rect, 0, 0, src->levels[cmd->srclevel].ddsd.dwWidth, src->levels[cmd->srclevel].ddsd.dwHeight);
+	destsurface.rect = cmd->destrect;
+	if (!memcmp(&destsurface.rect, &nullrect, sizeof(RECT)))
+		SetRect(&destsurface.rect, 0, 0, dest->levels[cmd->destlevel].ddsd.dwWidth, dest->levels[cmd->destlevel].ddsd.dwHeight);
+	// Invalid rectangles are left to the renderer
+	if ((srcsurface.rect.left < 0) || (srcsurface.rect.top < 0) || (srcsurface.rect.left >= srcsurface.rect.right) ||
+		(srcsurface.rect.top >= srcsurface.rect.bottom) ||
+		(srcsurface.rect.right > (LONG)src->levels[cmd->srclevel].ddsd.dwWidth) ||
+		(srcsurface.rect.bottom > (LONG)src->levels[cmd->srclevel].ddsd.dwHeight)) return FALSE;
+	if ((destsurface.rect.left < 0) || (destsurface.rect.top < 0) || (destsurface.rect.left >= destsurface.rect.right) ||
+		(destsurface.rect.top >= destsurface.rect.bottom) ||
+		(destsurface.rect.right > (LONG)dest->levels[cmd->destlevel].ddsd.dwWidth) ||
+		(destsurface.rect.bottom > (LONG)dest->levels[cmd->destlevel].ddsd.dwHeight)) return FALSE;
+	if (cmd->flags & DDBLT_KEYSRC)
+	{
+		// Color key ranges are left to the shader
+		if (cmd->flags & 0x20000000) return FALSE;
+		if (cmd->flags & DDBLT_KEYSRCOVERRIDE) srcsurface.key = cmd->srckey.dwColorSpaceLowValue;
+		else srcsurface.key = src->levels[cmd->srclevel].ddsd.ddckCKSrcBlt.dwColorSpaceLowValue;
+		flags |= SOFTBLT_KEYSRC;
+	}
+	else srcsurface.key = 0;
+	if (cmd->flags & DDBLT_KEYDEST)
+	{
+		if (cmd->flags & 0x40000000) return FALSE;
+		if (cmd->flags & DDBLT_KEYDESTOVERRIDE) destsurface.key = cmd->destkey.dwColorSpaceLowValue;
+		else destsurface.key = dest->levels[cmd->destlevel].ddsd.ddckCKDestBlt.dwColorSpaceLowValue;
+		flags |= SOFTBLT_KEYDEST;
+	}
+	else destsurface.key = 0;
+	if (cmd->flags & DDBLT_DDFX)
+	{
+		if (cmd->bltfx.dwDDFX & DDBLTFX_MIRRORLEFTRIGHT) flags |= SOFTBLT_MIRRORX;
+		if (cmd->bltfx.dwDDFX & DDBLTFX_MIRRORUPDOWN) flags |= SOFTBLT_MIRRORY;
+	}
+	// Keys are compared on the color channels, like the blt shader does
+	if (format->dwFlags & DDPF_RGB) keymask = format->dwRBitMask | format->dwGBitMask | format->dwBBitMask;
+	else if (format->dwRGBBitCount == 32) keymask = 0xFFFFFFFF;
+	else keymask = (1 << format->dwRGBBitCount) - 1;
+	// Cheap check first, queued blts may still change the flags
+	if (!glTexture__IsCPUCurrent(src, cmd->srclevel, FALSE) || !glTexture__IsCPUCurrent(dest, cmd->destlevel, TRUE))
+		return FALSE;
+	glRenderer_WaitForTexture(dest->renderer, src, cmd->srclevel, FALSE);
+	glRenderer_WaitForTexture(dest->renderer, dest, cmd->destlevel, TRUE);
+	if (!glTexture__IsCPUCurrent(src, cmd->srclevel, FALSE) || !glTexture__IsCPUCurrent(dest, cmd->destlevel, TRUE))
+		return FALSE;
+	srcsurface.bits = (BYTE*)src->levels[cmd->srclevel].buffer;
+	srcsurface.pitch = src->levels[cmd->srclevel].ddsd.lPitch;
+	destsurface.bits = (BYTE*)dest->levels[cmd->destlevel].buffer;
+	destsurface.pitch = dest->levels[cmd->destlevel].ddsd.lPitch;
+	SoftBlt_Blt(&destsurface, &srcsurface, format->dwRGBBitCount, keymask, flags);
+	glTexture__AddDirtyRect(&dest->levels[cmd->destlevel], &destsurface.rect);
+	glTexture_ChangeVersion(dest, cmd->destlevel);
+	if (cmd->destlevel) dest->automipmap = FALSE;
+	// Uploaded the same way as after an unlock
+	if (dxglpolicy.uploadonunlock) glRenderer_UploadTexture(dest->renderer, dest, cmd->destlevel);
+	else if ((dest->miplevel > 1) || (dest->levels[0].ddsd.ddsCaps.dwCaps & DDSCAPS_TEXTURE))
+		glRenderer_QueueUpload(dest->renderer, dest, cmd->destlevel);
+	return TRUE;
+}
+/**
+  * Checks if a mipmap level can keep its buffer in a DIB section.  GDI pads
+  * the rows of a DIB to 4 bytes, so this works for RGB and palette formats
+  * whose surface pitch is padded the same way.
+  * @param This
+  *  Pointer to texture object
+  * @param level
+  *  Mipmap level to check
+  * @return
+  *  TRUE if the buffer can be a DIB section
+  */
+static BOOL glTexture__CanUseDIB(glTexture *This, GLint level)
+{
+	MIPLEVEL *mip = &This->levels[level];
+	DWORD bpp = mip->ddsd.ddpfPixelFormat.dwRGBBitCount;
+	if (!dxglcfg.PersistentDC) return FALSE;
+	if (This->planar || (mip->ddsd.ddpfPixelFormat.dwFlags & DDPF_FOURCC)) return FALSE;
+	if ((bpp != 8) && (bpp != 16) && (bpp != 24) && (bpp != 32)) return FALSE;
+	// An outstanding lock still points into the buffer being replaced
+	if (mip->locked) return FALSE;
+	if (mip->ddsd.lPitch != NextMultipleOf4((int)(mip->ddsd.dwWidth * (bpp / 8)))) return FALSE;
+	return glTexture__LevelSize(This, level) == (DWORD)mip->ddsd.lPitch * mip->ddsd.dwHeight;
+}
+
+/**
+  * Moves the buffer of a mipmap level into a DIB section that stays
+  * selected into a DC, so GetDC can hand out the DC without copying the
+  * surface.  The contents of the old buffer are kept.
+  * @param This
+  *  Pointer to texture object
+  * @param level
+  *  Mipmap level to move, its bitmapinfo must be filled in
+  * @return
+  *  TRUE if the DIB section was created
+  */
+static BOOL glTexture__CreateDIB(glTexture *This, GLint level)
+{
+	MIPLEVEL *mip = &This->levels[level];
+	LPVOID bits;
+	HDC hdc;
+	HBITMAP hbitmap;
+	hdc = CreateCompatibleDC(NULL);
+	if (!hdc) return FALSE;
+	mip->gdi->bitmapinfo->bmiHeader.biWidth = mip->ddsd.dwWidth;
+	hbitmap = CreateDIBSection(hdc, mip->gdi->bitmapinfo, DIB_RGB_COLORS, &bits, NULL, 0);
+	if (!hbitmap)
+	{
+		DeleteDC(hdc);
+		return FALSE;
+	}
+	// Pending uploads may still read the old buffer
+	glRenderer_WaitForTexture(This->renderer, This, level, TRUE);
+	if (mip->buffer)
+	{
+		ColorConv_StreamCopy(bits, mip->buffer, mip->ddsd.lPitch * mip->ddsd.dwHeight);
+		glTexture__FreeBuffer(This, level);
+	}
+	SelectObject(hdc, hbitmap);
+	mip->buffer = (char*)bits;
+	mip->gdi->hdc = hdc;
+	mip->gdi->hbitmap = hbitmap;
+	mip->gdi->dibbuffer = TRUE;
+	return TRUE;
+}
+
 HRESULT glTexture_GetDC(glTexture *This, GLint level, HDC *hdc, glDirectDrawPalette *palette)
 {
 	int i;
@@ -408,60 +1270,163 @@ HRESULT glTexture_GetDC(glTexture *This, GLint level, HDC *hdc, glDirectDrawPale
 	DWORD colormasks[3];
 	LPVOID surface;
 	HGDIOBJ temp;
-	if (This->levels[level].hdc) return DDERR_DCALREADYCREATED;
-	if (!This->levels[level].bitmapinfo)
-	{
-		This->levels[level].bitmapinfo = (BITMAPINFO *)malloc(sizeof(BITMAPINFO) + (255 * sizeof(RGBQUAD)));
-		ZeroMemory(This->levels[level].bitmapinfo, sizeof(BITMAPINFO) + (255 * sizeof(RGBQUAD)));
-		This->levels[level].bitmapinfo->bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
-		This->levels[level].bitmapinfo->bmiHeader.biWidth = This->levels[level].ddsd.dwWidth;
-		This->levels[level].bitmapinfo->bmiHeader.biHeight = -(signed)This->levels[level].ddsd.dwHeight;
-		This->levels[level].bitmapinfo->bmiHeader.biPlanes = 1;
-		This->levels[level].bitmapinfo->bmiHeader.biCompression = BI_RGB;
-		This->levels[level].bitmapinfo->bmiHeader.biBitCount = (WORD)This->levels[level].ddsd.ddpfPixelFormat.dwRGBBitCount;
+	if (This->compressed) return DDERR_CANTCREATEDC;
+	if (!This->levels[level].gdi)
+	{
+		This->levels[level].gdi = (MIPLEVELGDI*)malloc(sizeof(MIPLEVELGDI));
+		if (!This->levels[level].gdi) return DDERR_OUTOFMEMORY;
+		ZeroMemory(This->levels[level].gdi, sizeof(MIPLEVELGDI));
+	}
+	if (This->levels[level].gdi->dcout) return DDERR_DCALREADYCREATED;
+	if (!This->levels[level].gdi->bitmapinfo)
+	{
+		This->levels[level].gdi->bitmapinfo = (BITMAPINFO *)malloc(sizeof(BITMAPINFO) + (255 * sizeof(RGBQUAD)));
+		ZeroMemory(This->levels[level].gdi->bitmapinfo, sizeof(BITMAPINFO) + (255 * sizeof(RGBQUAD)));
+		This->levels[level].gdi->bitmapinfo->bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+		This->levels[level].gdi->bitmapinfo->bmiHeader.biWidth = This->levels[level].ddsd.dwWidth;
+		This->levels[level].gdi->bitmapinfo->bmiHeader.biHeight = -(signed)This->levels[level].ddsd.dwHeight;
+		This->levels[level].gdi->bitmapinfo->bmiHeader.biPlanes = 1;
+		This->levels[level].gdi->bitmapinfo->bmiHeader.biCompression = BI_RGB;
+		This->levels[level].gdi->bitmapinfo->bmiHeader.biBitCount = (WORD)This->levels[level].ddsd.ddpfPixelFormat.dwRGBBitCount;
 		if (This->levels[level].ddsd.ddpfPixelFormat.dwRGBBitCount > 8)
 		{
 			colormasks[0] = This->levels[level].ddsd.ddpfPixelFormat.dwRBitMask;
 			colormasks[1] = This->levels[level].ddsd.ddpfPixelFormat.dwGBitMask;
 			colormasks[2] = This->levels[level].ddsd.ddpfPixelFormat.dwBBitMask;
-			memcpy(This->levels[level].bitmapinfo->bmiColors, colormasks, 3 * sizeof(DWORD));
+			memcpy(This->levels[level].gdi->bitmapinfo->bmiColors, colormasks, 3 * sizeof(DWORD));
 		}
 	}
-	error = glTexture_Lock(This, level, NULL, &This->levels[level].ddsd, 0, FALSE);
-	if (error != DD_OK) return error;
-	This->levels[level].hdc = CreateCompatibleDC(NULL);
-	This->levels[level].bitmapinfo->bmiHeader.biWidth = This->levels[level].ddsd.lPitch /
-		(This->levels[level].bitmapinfo->bmiHeader.biBitCount / 8);
 	if ((This->levels[level].ddsd.ddpfPixelFormat.dwRGBBitCount == 8) && palette)
 	{
 		memcpy(colors, palette->palette, 1024);
 		for (i = 0; i < 256; i++)
 			colors[i] = ((colors[i] & 0x0000FF) << 16) | (colors[i] & 0x00FF00) | ((colors[i] & 0xFF0000) >> 16);
-		memcpy(This->levels[level].bitmapinfo->bmiColors, colors, 1024);
+		memcpy(This->levels[level].gdi->bitmapinfo->bmiColors, colors, 1024);
 	}
 	if (This->levels[level].ddsd.ddpfPixelFormat.dwRGBBitCount == 16)
-		This->levels[level].bitmapinfo->bmiHeader.biCompression = BI_BITFIELDS;
-	else This->levels[level].bitmapinfo->bmiHeader.biCompression = BI_RGB;
-	This->levels[level].hbitmap = CreateDIBSection(This->levels[level].hdc,
-		This->levels[level].bitmapinfo, DIB_RGB_COLORS, &surface, NULL, 0);
-	memcpy(surface, This->levels[level].ddsd.lpSurface,
+		This->levels[level].gdi->bitmapinfo->bmiHeader.biCompression = BI_BITFIELDS;
+	else This->levels[level].gdi->bitmapinfo->bmiHeader.biCompression = BI_RGB;
+	if (!This->levels[level].gdi->dibbuffer && glTexture__CanUseDIB(This, level))
+		glTexture__CreateDIB(This, level);
+	if (This->levels[level].gdi->dibbuffer)
+	{
+		// GDI draws straight into the surface buffer
+		error = glTexture_Lock(This, level, NULL, &This->levels[level].ddsd, DDLOCK_READONLY, FALSE);
+		if (error != DD_OK) return error;
+		if ((This->levels[level].ddsd.ddpfPixelFormat.dwRGBBitCount == 8) && palette)
+			SetDIBColorTable(This->levels[level].gdi->hdc, 0, 256, This->levels[level].gdi->bitmapinfo->bmiColors);
+		// The game gets a DC in its default state each time, like a new one
+		SaveDC(This->levels[level].gdi->hdc);
+		SetBoundsRect(This->levels[level].gdi->hdc, NULL, DCB_ENABLE | DCB_RESET);
+		This->levels[level].gdi->dcout = TRUE;
+		*hdc = This->levels[level].gdi->hdc;
+		return DD_OK;
+	}
+	// ReleaseDC marks only the area GDI drew to
+	error = glTexture_Lock(This, level, NULL, &This->levels[level].ddsd, DDLOCK_READONLY, FALSE);
+	if (error != DD_OK) return error;
+	This->levels[level].gdi->hdc = CreateCompatibleDC(NULL);
+	This->levels[level].gdi->bitmapinfo->bmiHeader.biWidth = This->levels[level].ddsd.lPitch /
+		(This->levels[level].gdi->bitmapinfo->bmiHeader.biBitCount / 8);
+	This->levels[level].gdi->hbitmap = CreateDIBSection(This->levels[level].gdi->hdc,
+		This->levels[level].gdi->bitmapinfo, DIB_RGB_COLORS, &surface, NULL, 0);
+	ColorConv_StreamCopy(surface, This->levels[level].ddsd.lpSurface,
 		This->levels[level].ddsd.lPitch*This->levels[level].ddsd.dwHeight);
-	temp = SelectObject(This->levels[level].hdc, This->levels[level].hbitmap);
+	temp = SelectObject(This->levels[level].gdi->hdc, This->levels[level].gdi->hbitmap);
 	DeleteObject(temp);
-	*hdc = This->levels[level].hdc;
+	SetBoundsRect(This->levels[level].gdi->hdc, NULL, DCB_ENABLE | DCB_RESET);
+	This->levels[level].gdi->dcout = TRUE;
+	*hdc = This->levels[level].gdi->hdc;
 	return DD_OK;
 }
+/**
+  * Gets the area GDI drew to on the DC of a mipmap level since glTexture_GetDC
+  * enabled bounds accumulation, and resets the bounds.
+  * @param This
+  *  Pointer to texture object
+  * @param level
+  *  Mipmap level with an outstanding DC
+  * @param r
+  *  Receives the area drawn to, in pixels of the level
+  * @return
+  *  DCB_SET if r was filled in, DCB_RESET if nothing was drawn, or 0 if
+  *  the area is not known
+  */
+static UINT glTexture__GetDCBounds(glTexture *This, GLint level, RECT *r)
+{
+	RECT full;
+	UINT bounds = GetBoundsRect(This->levels[level].gdi->hdc, r, DCB_RESET);
+	if ((bounds & DCB_SET) != DCB_SET) return bounds ? DCB_RESET : 0;
+	// The bounds are in logical units of the mapping mode the game set
+	if (!LPtoDP(This->levels[level].gdi->hdc, (LPPOINT)r, 2)) return 0;
+	SetRect(&full, 0, 0, This->levels[level].ddsd.dwWidth, This->levels[level].ddsd.dwHeight);
+	if (!IntersectRect(r, r, &full)) return DCB_RESET;
+	return DCB_SET;
+}
+
 HRESULT glTexture_ReleaseDC(glTexture *This, GLint level, HDC hdc)
 {
-	if (This->levels[level].hdc != hdc) return DDERR_INVALIDPARAMS;
-	GetDIBits(This->levels[level].hdc, This->levels[level].hbitmap, 0,
+	DIBSECTION dib;
+	RECT r;
+	DWORD i;
+	UINT bounds;
+	if (!This->levels[level].gdi || !This->levels[level].gdi->dcout ||
+		(This->levels[level].gdi->hdc != hdc)) return DDERR_INVALIDPARAMS;
+	GdiFlush();
+	This->levels[level].gdi->dcout = FALSE;
+	bounds = glTexture__GetDCBounds(This, level, &r);
+	if (This->levels[level].gdi->dibbuffer)
+	{
+		RestoreDC(This->levels[level].gdi->hdc, -1);
+		if (bounds != DCB_RESET)
+		{
+			glTexture__AddDirtyRect(&This->levels[level], (bounds == DCB_SET) ? &r : NULL);
+			This->levels[level].dirty = (This->levels[level].dirty | 1) & ~16;
+		}
+		glTexture_Unlock(This, level, NULL, FALSE);
+		return DD_OK;
+	}
+	if (bounds == DCB_SET)
+	{
+		glTexture__AddDirtyRect(&This->levels[level], &r);
+		This->levels[level].dirty |= 1;
+	}
+	else if (!bounds && GetObject(This->levels[level].gdi->hbitmap, sizeof(DIBSECTION), &dib))
+	{
+		// Find the band of rows GDI wrote to
+		r.left = 0;
+		r.right = This->levels[level].ddsd.dwWidth;
+		r.top = -1;
+		r.bottom = 0;
+		for (i = 0; i < This->levels[level].ddsd.dwHeight; i++)
+		{
+			if (memcmp((BYTE*)dib.dsBm.bmBits + (i * This->levels[level].ddsd.lPitch),
+				(BYTE*)This->levels[level].ddsd.lpSurface + (i * This->levels[level].ddsd.lPitch),
+				This->levels[level].ddsd.lPitch))
+			{
+				if (r.top < 0) r.top = i;
+				r.bottom = i + 1;
+			}
+		}
+		if (r.top >= 0)
+		{
+			glTexture__AddDirtyRect(&This->levels[level], &r);
+			This->levels[level].dirty |= 1;
+		}
+	}
+	else if (!bounds)
+	{
+		glTexture__AddDirtyRect(&This->levels[level], NULL);
+		This->levels[level].dirty |= 1;
+	}
+	GetDIBits(This->levels[level].gdi->hdc, This->levels[level].gdi->hbitmap, 0,
 		This->levels[level].ddsd.dwHeight, This->levels[level].ddsd.lpSurface,
-		This->levels[level].bitmapinfo, DIB_RGB_COLORS);
+		This->levels[level].gdi->bitmapinfo, DIB_RGB_COLORS);
 	glTexture_Unlock(This, level, NULL, FALSE);
-	DeleteDC(This->levels[level].hdc);
-	This->levels[level].hdc = NULL;
-	DeleteObject(This->levels[level].hbitmap);
-	This->levels[level].hbitmap = NULL;
+	DeleteDC(This->levels[level].gdi->hdc);
+	This->levels[level].gdi->hdc = NULL;
+	DeleteObject(This->levels[level].gdi->hbitmap);
+	This->levels[level].gdi->hbitmap = NULL;
 	return DD_OK;
 }
 void glTexture_SetPalette(glTexture *This, glTexture *palette, BOOL backend)
@@ -524,6 +1489,8 @@ HRESULT glTexture__SetSurfaceDesc(glTexture *This, LPDDSURFACEDESC2 ddsd)
 	// FIXME:  Implement SetSurfaceDesc fully
 	BOOL sizechanged = FALSE;
 	if (This->miplevel > 1) return DDERR_UNSUPPORTED; // Not supported by DDraw
+	// Compressed storage is sized in blocks and can't be respecified from a pitch
+	if (This->compressed) return DDERR_INVALIDSURFACETYPE;
 	if (ddsd->dwFlags & DDSD_PIXELFORMAT) return DDERR_UNSUPPORTED; //FIXME
 	if (ddsd->dwFlags & DDSD_LPSURFACE) return DDERR_UNSUPPORTED; //FIXME
 	if (ddsd->dwFlags & DDSD_WIDTH)
@@ -542,6 +1509,385 @@ HRESULT glTexture__SetSurfaceDesc(glTexture *This, LPDDSURFACEDESC2 ddsd)
 		This->levels[0].ddsd.dwWidth, This->levels[0].ddsd.dwHeight, FALSE, TRUE, This->renderer->util);
 	return DD_OK;
 }
+/**
+  * Checks if a mipmap level is converted to and from its surface format with
+  * shaders instead of colorconvproc.
+  * @param This
+  *  Pointer to texture object
+  * @param level
+  *  Mipmap level to check
+  * @return
+  *  TRUE if the level should be converted on the GPU
+  */
+static BOOL glTexture__UseGPUConversion(glTexture *This, GLint level)
+{
+	glExtensions *ext = This->renderer->ext;
+	if (!This->useconv || This->compressed || (dxglcfg.FormatConversion == 1)) return FALSE;
+	if ((ext->glver_major < 3) || !ext->GLEXT_ARB_framebuffer_object ||
+		!ext->GLEXT_ARB_vertex_array_object) return FALSE;
+	if (!This->renderer->shaders || !This->renderer->shaders->convvao) return FALSE;
+	if (This->target != GL_TEXTURE_2D) return FALSE;
+	if (!This->planar) switch (This->convfunctionupload)
+	{
+	case 0:  // RGBA8332
+	case 11:  // 1-bit palette
+	case 12:  // 2-bit palette
+	case 13:  // 4-bit palette
+		break;
+	default:
+		return FALSE;
+	}
+	if (dxglcfg.FormatConversion == 2) return TRUE;
+	return ((__int64)This->levels[level].ddsd.dwWidth * This->levels[level].ddsd.dwHeight) >= GPUCONV_MINPIXELS;
+}
+
+/**
+  * Sizes the integer texture that holds the raw surface data of a mipmap
+  * level for GPU conversion, and leaves it bound to texture unit 15.
+  * @param This
+  *  Pointer to texture object
+  * @param level
+  *  Mipmap level to size the raw texture for
+  * @param util
+  *  Pointer to glUtil object to bind the texture with
+  * @return
+  *  TRUE if the raw texture and its framebuffer are usable
+  */
+static BOOL glTexture__PrepareRaw(glTexture *This, GLint level, glUtil *util)
+{
+	glExtensions *ext = This->renderer->ext;
+	int bpp = This->levels[level].ddsd.ddpfPixelFormat.dwRGBBitCount;
+	GLsizei width, height;
+	GLenum status;
+	if (bpp < 8) width = (This->levels[level].ddsd.dwWidth * bpp + 7) / 8;
+	else width = This->levels[level].ddsd.dwWidth;
+	height = This->levels[level].ddsd.dwHeight;
+	if (!This->rawid) glGenTextures(1, &This->rawid);
+	glUtil_SetActiveTexture(util, 15);
+	glBindTexture(GL_TEXTURE_2D, This->rawid);
+	if ((width == This->rawwidth) && (height == This->rawheight)) return TRUE;
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+	if (bpp < 8) glTexImage2D(GL_TEXTURE_2D, 0, GL_R8UI, width, height, 0, GL_RED_INTEGER, GL_UNSIGNED_BYTE, NULL);
+	else glTexImage2D(GL_TEXTURE_2D, 0, GL_R16UI, width, height, 0, GL_RED_INTEGER, GL_UNSIGNED_SHORT, NULL);
+	if (!This->rawfbo) ext->glGenFramebuffers(1, &This->rawfbo);
+	ext->glBindFramebuffer(GL_FRAMEBUFFER, This->rawfbo);
+	ext->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, This->rawid, 0);
+	status = ext->glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	ext->glBindFramebuffer(GL_FRAMEBUFFER, util->currentfbo ? util->currentfbo->fbo : 0);
+	if (status != GL_FRAMEBUFFER_COMPLETE) return FALSE;
+	This->rawwidth = width;
+	This->rawheight = height;
+	return TRUE;
+}
+
+/**
+  * Draws a format conversion shader over the bound framebuffer, reading
+  * from texture unit 15.  Render state changed here is put back afterwards.
+  * @param This
+  *  Pointer to texture object
+  * @param prog
+  *  PROG_UNPACK* or PROG_PACK* shader to draw with
+  * @param level
+  *  Mipmap level being converted
+  * @param width
+  *  Width of the framebuffer to draw to
+  * @param height
+  *  Height of the framebuffer to draw to
+  * @param rects
+  *  Regions to convert, or NULL to convert everything
+  * @param rectcount
+  *  Number of rectangles in rects
+  */
+static void glTexture__DrawConversion(glTexture *This, int prog, GLint level,
+	GLsizei width, GLsizei height, const RECT *rects, DWORD rectcount)
+{
+	glUtil *util = This->renderer->util;
+	glExtensions *ext = This->renderer->ext;
+	SHADER *shader = &This->renderer->shaders->shaders[prog];
+	GLint viewport[4] = { util->viewportx, util->viewporty, util->viewportwidth, util->viewportheight };
+	GLint scissor[4] = { util->scissorx, util->scissory, util->scissorwidth, util->scissorheight };
+	BOOL scissorenabled = util->scissorenabled;
+	BOOL blendenabled = util->blendenabled;
+	BOOL depthtest = util->depthtest;
+	D3DCULL cullmode = util->cullmode;
+	D3DFILLMODE polymode = util->polymode;
+	DWORD i;
+	ShaderManager_SetShader(This->renderer->shaders, prog, NULL, 0);
+	ext->glUniform1i(shader->tex0, 15);
+	if (shader->tex1 != -1) ext->glUniform1i(shader->tex1, 14);
+	if (shader->tex2 != -1) ext->glUniform1i(shader->tex2, 13);
+	ext->glUniform4i(shader->colorsize, This->levels[level].ddsd.ddpfPixelFormat.dwRGBBitCount, level, This->planar, 0);
+	glUtil_SetViewport(util, 0, 0, width, height);
+	glUtil_BlendEnable(util, FALSE);
+	glUtil_DepthTest(util, FALSE);
+	glUtil_SetCull(util, D3DCULL_NONE);
+	glUtil_SetPolyMode(util, D3DFILL_SOLID);
+	ext->glBindVertexArray(This->renderer->shaders->convvao);
+	if (!rectcount)
+	{
+		glUtil_SetScissor(util, FALSE, 0, 0, 0, 0);
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	}
+	for (i = 0; i < rectcount; i++)
+	{
+		glUtil_SetScissor(util, TRUE, rects[i].left, rects[i].top,
+			rects[i].right - rects[i].left, rects[i].bottom - rects[i].top);
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	}
+	ext->glBindVertexArray(0);
+	glUtil_SetScissor(util, scissorenabled, scissor[0], scissor[1], scissor[2], scissor[3]);
+	glUtil_SetViewport(util, viewport[0], viewport[1], viewport[2], viewport[3]);
+	glUtil_BlendEnable(util, blendenabled);
+	glUtil_DepthTest(util, depthtest);
+	glUtil_SetCull(util, cullmode);
+	glUtil_SetPolyMode(util, polymode);
+}
+
+/**
+  * Uploads a mipmap level in its surface format and converts it to the
+  * texture format with a shader.
+  * @param This
+  *  Pointer to texture object
+  * @param level
+  *  Mipmap level to upload
+  * @param util
+  *  Pointer to glUtil object to bind the texture with
+  * @return
+  *  TRUE if the level was uploaded, FALSE if it should be converted on the CPU
+  */
+static BOOL glTexture__UploadGPU(glTexture *This, int level, glUtil *util)
+{
+	MIPLEVEL *mip = &This->levels[level];
+	int bpp = mip->ddsd.ddpfPixelFormat.dwRGBBitCount;
+	FBO *oldfbo = util->currentfbo;
+	DWORD rectcount = 0;
+	DWORD i;
+	if (!glTexture__PrepareRaw(This, level, util)) return FALSE;
+	if (glUtil_SetFBOSurface(util, This, NULL, level, 0, TRUE) != GL_FRAMEBUFFER_COMPLETE)
+	{
+		glUtil_SetFBO(util, oldfbo);
+		return FALSE;
+	}
+	// Palette rectangles don't start on whole bytes, those levels are sent whole
+	if ((bpp == 16) && (mip->dirty & 1)) rectcount = mip->dirtyrectcount;
+	glUtil_SetActiveTexture(util, 15);
+	if (bpp < 8) glPixelStorei(GL_UNPACK_ROW_LENGTH, mip->ddsd.lPitch);
+	else glPixelStorei(GL_UNPACK_ROW_LENGTH, mip->ddsd.lPitch / 2);
+	if (bpp < 8) glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, This->rawwidth, This->rawheight,
+		GL_RED_INTEGER, GL_UNSIGNED_BYTE, mip->buffer);
+	else if (!rectcount) glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, This->rawwidth, This->rawheight,
+		GL_RED_INTEGER, GL_UNSIGNED_SHORT, mip->buffer);
+	for (i = 0; i < rectcount; i++)
+		glTexSubImage2D(GL_TEXTURE_2D, 0, mip->dirtyrects[i].left, mip->dirtyrects[i].top,
+			mip->dirtyrects[i].right - mip->dirtyrects[i].left, mip->dirtyrects[i].bottom - mip->dirtyrects[i].top,
+			GL_RED_INTEGER, GL_UNSIGNED_SHORT, mip->buffer + (mip->dirtyrects[i].top * mip->ddsd.lPitch) +
+			(mip->dirtyrects[i].left * 2));
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glTexture__DrawConversion(This, (bpp < 8) ? PROG_UNPACKPAL : PROG_UNPACK8332, level,
+		mip->ddsd.dwWidth, mip->ddsd.dwHeight, mip->dirtyrects, rectcount);
+	glUtil_SetFBO(util, oldfbo);
+	return TRUE;
+}
+
+/**
+  * Converts a mipmap level to its surface format with a shader and reads
+  * it back into the surface buffer.
+  * @param This
+  *  Pointer to texture object
+  * @param level
+  *  Mipmap level to read back
+  * @return
+  *  TRUE if the level was read back, FALSE if it should be converted on the CPU
+  */
+static BOOL glTexture__DownloadGPU(glTexture *This, GLint level)
+{
+	glUtil *util = This->renderer->util;
+	glExtensions *ext = This->renderer->ext;
+	MIPLEVEL *mip = &This->levels[level];
+	int bpp = mip->ddsd.ddpfPixelFormat.dwRGBBitCount;
+	if (This->planar) return FALSE;
+	if (!glTexture__PrepareRaw(This, level, util)) return FALSE;
+	glBindTexture(GL_TEXTURE_2D, This->id);
+	ext->glBindFramebuffer(GL_FRAMEBUFFER, This->rawfbo);
+	glTexture__DrawConversion(This, (bpp < 8) ? PROG_PACKPAL : PROG_PACK8332, level,
+		This->rawwidth, This->rawheight, NULL, 0);
+	if (bpp < 8) glPixelStorei(GL_PACK_ROW_LENGTH, mip->ddsd.lPitch);
+	else glPixelStorei(GL_PACK_ROW_LENGTH, mip->ddsd.lPitch / 2);
+	glReadPixels(0, 0, This->rawwidth, This->rawheight, GL_RED_INTEGER,
+		(bpp < 8) ? GL_UNSIGNED_BYTE : GL_UNSIGNED_SHORT, mip->buffer);
+	glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+	ext->glBindFramebuffer(GL_FRAMEBUFFER, util->currentfbo ? util->currentfbo->fbo : 0);
+	return TRUE;
+}
+
+/**
+  * Copies a mipmap level into the level's pack buffer without waiting for
+  * the copy to finish.  A following glTexture__Download of the same level
+  * maps the buffer instead of stalling on a new readback.
+  * Requires ARB_sync; does nothing if it is unavailable.
+  * @param This
+  *  Pointer to texture object
+  * @param level
+  *  Mipmap level to read back
+  */
+void glTexture__BeginDownload(glTexture *This, GLint level)
+{
+	glExtensions *ext = This->renderer->ext;
+	int pitch;
+	if (!ext->GLEXT_ARB_sync) return;
+	// Shader conversion reads back synchronously
+	if (glTexture__UseGPUConversion(This, level)) return;
+	if (!level) glTexture__ResolveMSAA(This);
+	if (This->useconv) pitch = NextMultipleOf4(This->levels[level].ddsd.dwWidth * This->internalsize);
+	else pitch = This->levels[level].ddsd.lPitch;
+	if (!This->levels[level].pboPack)
+		BufferObject_Create(&This->levels[level].pboPack, ext, This->renderer->util);
+	if (This->levels[level].pboPack->size < pitch * This->levels[level].ddsd.dwHeight)
+		BufferObject_SetData(This->levels[level].pboPack, GL_PIXEL_PACK_BUFFER,
+			pitch * This->levels[level].ddsd.dwHeight, NULL, GL_STREAM_READ);
+	BufferObject_Bind(This->levels[level].pboPack, GL_PIXEL_PACK_BUFFER);
+	if (ext->GLEXT_EXT_direct_state_access)
+		ext->glGetTextureImageEXT(This->id, This->target, level, This->format, This->type, 0);
+	else
+	{
+		glUtil_SetActiveTexture(This->renderer->util, 0);
+		glUtil_SetTexture(This->renderer->util, 0, This);
+		glGetTexImage(This->target, level, This->format, This->type, 0);
+	}
+	BufferObject_Unbind(This->levels[level].pboPack, GL_PIXEL_PACK_BUFFER);
+	if (This->levels[level].packfence) ext->glDeleteSync(This->levels[level].packfence);
+	This->levels[level].packfence = ext->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	This->levels[level].dirty |= 4;
+}
+
+/**
+  * Waits for a readback started by glTexture__BeginDownload and copies it
+  * into the surface buffer.
+  * @param This
+  *  Pointer to texture object
+  * @param level
+  *  Mipmap level to finish reading back
+  */
+static void glTexture__FinishDownload(glTexture *This, GLint level)
+{
+	glExtensions *ext = This->renderer->ext;
+	int pitch = This->levels[level].ddsd.lPitch;
+	int inpitch;
+	char *readbuffer;
+	LONGLONG profilestart;
+	if (ext->glClientWaitSync(This->levels[level].packfence, GL_SYNC_FLUSH_COMMANDS_BIT, 0) == GL_TIMEOUT_EXPIRED)
+	{
+		This->renderer->perf.frame.dwReadbackStalls++;
+		while (ext->glClientWaitSync(This->levels[level].packfence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000)
+			== GL_TIMEOUT_EXPIRED);
+	}
+	This->renderer->perf.frame.dwDownloadBytes += pitch * This->levels[level].ddsd.dwHeight;
+	ext->glDeleteSync(This->levels[level].packfence);
+	This->levels[level].packfence = NULL;
+	readbuffer = (char*)BufferObject_Map(This->levels[level].pboPack, GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+	if (readbuffer)
+	{
+		if (This->useconv)
+		{
+			inpitch = NextMultipleOf4(This->levels[level].ddsd.dwWidth * This->internalsize);
+			profilestart = SurfaceProfile_Begin(This->profile);
+			if (This->planar) ColorConv_RGBAToPlanar(This->planar, This->levels[level].ddsd.dwWidth,
+				This->levels[level].ddsd.dwHeight, (BYTE*)This->levels[level].buffer, pitch, (DWORD*)readbuffer, inpitch);
+			else ColorConv_ConvertRows(colorconvproc[This->convfunctiondownload], This->levels[level].ddsd.dwWidth,
+				This->levels[level].ddsd.dwHeight, This->levels[level].buffer, pitch, readbuffer, inpitch);
+			SurfaceProfile_End(This->profile, SURFACEPROFILE_CONVERT, profilestart,
+				glTexture__LevelSize(This, level));
+		}
+		else memcpy(This->levels[level].buffer, readbuffer, pitch * This->levels[level].ddsd.dwHeight);
+		BufferObject_Unmap(This->levels[level].pboPack, GL_PIXEL_PACK_BUFFER);
+	}
+	This->levels[level].dirty &= ~6;
+}
+
+/**
+  * Reads back a rectangle of a mipmap level into the surface buffer.  The
+  * level stays marked as written by the GPU, so the rest of the buffer is
+  * read back by the next lock or blt that needs it.
+  * @param This
+  *  Pointer to texture object
+  * @param level
+  *  Mipmap level to read back
+  * @param r
+  *  Rectangle to read back
+  * @return
+  *  TRUE if the rectangle was read back, FALSE if the whole level has to be
+  */
+BOOL glTexture__DownloadRect(glTexture *This, GLint level, LPRECT r)
+{
+	glUtil *util = This->renderer->util;
+	MIPLEVEL *mip = &This->levels[level];
+	int bytes = mip->ddsd.ddpfPixelFormat.dwRGBBitCount / 8;
+	BOOL depth = (mip->ddsd.ddpfPixelFormat.dwFlags & DDPF_ZBUFFER) ? TRUE : FALSE;
+	GLint packalign;
+	GLenum status;
+	RECT rect;
+	GLsizei width, height;
+	int inpitch;
+	char *dest;
+	char *readbuffer = NULL;
+	LONGLONG profilestart;
+	if ((mip->dirty & 4) && mip->packfence) return FALSE;
+	if (!glTexture__AllocLevel(This, level)) return FALSE;
+	rect.left = max(r->left, 0);
+	rect.top = max(r->top, 0);
+	rect.right = min(r->right, (LONG)mip->ddsd.dwWidth);
+	rect.bottom = min(r->bottom, (LONG)mip->ddsd.dwHeight);
+	if ((rect.right <= rect.left) || (rect.bottom <= rect.top)) return FALSE;
+	width = rect.right - rect.left;
+	height = rect.bottom - rect.top;
+	dest = mip->buffer + (rect.top * mip->ddsd.lPitch) + (rect.left * bytes);
+	if (This->useconv)
+	{
+		// Read at the GL size, then packed into the surface buffer
+		inpitch = NextMultipleOf4(width * This->internalsize);
+		readbuffer = (char*)malloc(inpitch * height);
+		if (!readbuffer) return FALSE;
+	}
+	if (This->evicted) glTexture__MakeResident(This);
+	if (!level) glTexture__ResolveMSAA(This);
+	// Depth buffers are read from a framebuffer without a color buffer
+	if (depth) status = glUtil_SetFBODepth(util, 1, GL_READ_FRAMEBUFFER, This, level);
+	else status = glUtil_SetFBOSurface(util, This, NULL, level, 0, TRUE);
+	if (status != GL_FRAMEBUFFER_COMPLETE)
+	{
+		if (depth) glUtil_EndFBODepth(util, 1, GL_READ_FRAMEBUFFER);
+		else glUtil_SetFBO(util, NULL);
+		free(readbuffer);
+		return FALSE;
+	}
+	This->renderer->perf.frame.dwReadbackStalls++;
+	This->renderer->perf.frame.dwDownloadBytes += width * bytes * height;
+	// Rows of the surface buffer are padded to four bytes like OpenGL's default packing
+	glGetIntegerv(GL_PACK_ALIGNMENT, &packalign);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	if (readbuffer)
+	{
+		glReadPixels(rect.left, rect.top, width, height, This->format, This->type, readbuffer);
+		profilestart = SurfaceProfile_Begin(This->profile);
+		ColorConv_ConvertRows(colorconvproc[This->convfunctiondownload], width, height,
+			dest, mip->ddsd.lPitch, readbuffer, inpitch);
+		SurfaceProfile_End(This->profile, SURFACEPROFILE_CONVERT, profilestart, width * bytes * height);
+		free(readbuffer);
+	}
+	else
+	{
+		glPixelStorei(GL_PACK_ROW_LENGTH, mip->ddsd.dwWidth);
+		glReadPixels(rect.left, rect.top, width, height, This->format, This->type, dest);
+		glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+	}
+	glPixelStorei(GL_PACK_ALIGNMENT, packalign);
+	if (depth) glUtil_EndFBODepth(util, 1, GL_READ_FRAMEBUFFER);
+	else glUtil_SetFBO(util, NULL);
+	return TRUE;
+}
+
 void glTexture__Download(glTexture *This, GLint level)
 {
 	int bpp = This->levels[level].ddsd.ddpfPixelFormat.dwRGBBitCount;
@@ -554,6 +1900,7 @@ void glTexture__Download(glTexture *This, GLint level)
 	int inpitch, outpitch;
 	GLenum error;
 	char *readbuffer;
+	LONGLONG profilestart;
 	/*if (level)
 	{
 		bigx = This->levels[level].ddsd.dwWidth;
@@ -564,6 +1911,39 @@ void glTexture__Download(glTexture *This, GLint level)
 		bigx = This->bigwidth;
 		bigy = This->bigheight;
 	}*/
+	if (!glTexture__AllocLevel(This, level)) return;
+	if ((This->levels[level].dirty & 4) && This->levels[level].packfence)
+	{
+		glTexture__FinishDownload(This, level);
+		glTexture__ResetWriteWatch(This, level);
+		return;
+	}
+	if (This->evicted) glTexture__MakeResident(This);
+	// A level dropped by SetLOD was never written on the GPU, its buffer is current
+	if ((DWORD)level < This->droppedlevels) return;
+	if (!level) glTexture__ResolveMSAA(This);
+	// Reading back without a finished asynchronous readback waits for the GPU
+	This->renderer->perf.frame.dwReadbackStalls++;
+	if (This->compressed) This->renderer->perf.frame.dwDownloadBytes += This->levels[level].ddsd.dwLinearSize;
+	else This->renderer->perf.frame.dwDownloadBytes += pitch * y;
+	if (This->compressed)
+	{
+		// Blocks can't be rebuilt from the decompressed fallback texture, its buffer stays current
+		if (!This->useconv)
+		{
+			glUtil_SetActiveTexture(This->renderer->util, 0);
+			glUtil_SetTexture(This->renderer->util, 0, This);
+			glGetCompressedTexImage(This->target, level, This->levels[level].buffer);
+		}
+		This->levels[level].dirty &= ~2;
+		return;
+	}
+	if (glTexture__UseGPUConversion(This, level) && glTexture__DownloadGPU(This, level))
+	{
+		This->levels[level].dirty &= ~2;
+		glTexture__ResetWriteWatch(This, level);
+		return;
+	}
 	if (This->useconv)
 	{
 		/*if ((bigx == x && bigy == y) || !This->levels[level].bigbuffer)
@@ -589,12 +1969,15 @@ void glTexture__Download(glTexture *This, GLint level)
 		BufferObject_Unbind(This->pboPack, GL_PIXEL_PACK_BUFFER);
 		readbuffer = (char*)BufferObject_Map(This->pboPack, GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
 		error = glGetError();
+		profilestart = SurfaceProfile_Begin(This->profile);
+		if ((error == GL_NO_ERROR) && This->planar)
+			ColorConv_RGBAToPlanar(This->planar, This->levels[level].ddsd.dwWidth, This->levels[level].ddsd.dwHeight,
+				(BYTE*)This->levels[level].buffer, outpitch, (DWORD*)readbuffer, inpitch);
+		else if (error == GL_NO_ERROR)
+			ColorConv_ConvertRows(colorconvproc[This->convfunctiondownload], This->levels[level].ddsd.dwWidth,
+				This->levels[level].ddsd.dwHeight, This->levels[level].buffer, outpitch, readbuffer, inpitch);
 		if (error == GL_NO_ERROR)
-		{
-			for (i = 0; i < This->levels[level].ddsd.dwHeight; i++)
-				colorconvproc[This->convfunctiondownload](This->levels[level].ddsd.dwWidth,
-					This->levels[level].buffer + (i*outpitch), readbuffer + (i * inpitch));
-		}
+			SurfaceProfile_End(This->profile, SURFACEPROFILE_CONVERT, profilestart, glTexture__LevelSize(This, level));
 		BufferObject_Unmap(This->pboPack, GL_PIXEL_PACK_BUFFER);
 	}
 	else
@@ -643,6 +2026,584 @@ void glTexture__Download(glTexture *This, GLint level)
 		}*/
 	}
 	This->levels[level].dirty &= ~2;
+	glTexture__ResetWriteWatch(This, level);
+}
+
+/**
+  * Gets space to write converted texture data to before uploading it from a
+  * pixel buffer.  Uses the renderer's shared staging buffer if uploads are
+  * staged there, otherwise maps the texture's own pixel buffer.
+  * @param This
+  *  Pointer to texture object
+  * @param size
+  *  Size of the data in bytes
+  * @param buffer
+  *  Receives the buffer object to bind to GL_PIXEL_UNPACK_BUFFER for the upload
+  * @param offset
+  *  Receives the offset of the data in the buffer object
+  * @return
+  *  Pointer to write the data to, or NULL on failure
+  */
+static char *glTexture__MapUnpack(glTexture *This, GLsizeiptr size, BufferObject **buffer, GLintptr *offset)
+{
+	char *ptr = (char*)glRenderer__StreamUnpack(This->renderer, size, offset);
+	if (ptr)
+	{
+		*buffer = This->renderer->cmdbuffer[0].pixelunpack;
+		return ptr;
+	}
+	if (!This->pboUnpack)
+		BufferObject_Create(&This->pboUnpack, This->renderer->ext, This->renderer->util);
+	if (This->pboUnpack->size < size)
+		BufferObject_SetData(This->pboUnpack, GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+	*buffer = This->pboUnpack;
+	*offset = 0;
+	return (char*)BufferObject_Map(This->pboUnpack, GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+}
+
+/**
+  * Finishes writing data obtained with glTexture__MapUnpack and binds its
+  * buffer to GL_PIXEL_UNPACK_BUFFER.
+  * @param This
+  *  Pointer to texture object
+  * @param buffer
+  *  Buffer object returned by glTexture__MapUnpack
+  */
+static void glTexture__UnmapUnpack(glTexture *This, BufferObject *buffer)
+{
+	if (!buffer->mapped) BufferObject_Unmap(buffer, GL_PIXEL_UNPACK_BUFFER);
+	BufferObject_Bind(buffer, GL_PIXEL_UNPACK_BUFFER);
+}
+
+/**
+  * Sizes the integer textures that hold the planes of a planar YUV surface,
+  * and leaves them bound to texture units 15 (Y), 14 (U or UV) and 13 (V).
+  * @param This
+  *  Pointer to texture object
+  * @param util
+  *  Pointer to glUtil object to bind the textures with
+  */
+static void glTexture__PreparePlanes(glTexture *This, glUtil *util)
+{
+	GLsizei width = This->levels[0].ddsd.dwWidth;
+	GLsizei height = This->levels[0].ddsd.dwHeight;
+	GLsizei cwidth = (width + 1) / 2;
+	GLsizei cheight = (height + 1) / 2;
+	BOOL resize = (width != This->rawwidth) || (height != This->rawheight);
+	int i;
+	if (!This->rawid) glGenTextures(1, &This->rawid);
+	if (!This->rawplanes[0]) glGenTextures(2, This->rawplanes);
+	for (i = 0; i < 3; i++)
+	{
+		glUtil_SetActiveTexture(util, 15 - i);
+		glBindTexture(GL_TEXTURE_2D, i ? This->rawplanes[i - 1] : This->rawid);
+		if (!resize) continue;
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+		if (!i) glTexImage2D(GL_TEXTURE_2D, 0, GL_R8UI, width, height, 0, GL_RED_INTEGER, GL_UNSIGNED_BYTE, NULL);
+		else if ((i == 1) && (This->planar == PLANAR_NV12))
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RG8UI, cwidth, cheight, 0, GL_RG_INTEGER, GL_UNSIGNED_BYTE, NULL);
+		else glTexImage2D(GL_TEXTURE_2D, 0, GL_R8UI, cwidth, cheight, 0, GL_RED_INTEGER, GL_UNSIGNED_BYTE, NULL);
+	}
+	This->rawwidth = width;
+	This->rawheight = height;
+	This->rawplanewidth = cwidth;
+	This->rawplaneheight = cheight;
+}
+
+/**
+  * Uploads the dirty part of one plane of a planar YUV surface from the
+  * unpack buffer.  The plane texture must be bound to the active texture unit.
+  * @param format
+  *  GL_RED_INTEGER for single planes, GL_RG_INTEGER for interleaved chroma
+  * @param r
+  *  Region of the plane to upload, in texels of the plane
+  * @param rowlength
+  *  Distance in texels between rows of the plane
+  * @param base
+  *  Offset of the first row of the plane in the unpack buffer
+  * @param pitch
+  *  Distance in bytes between rows of the plane
+  * @param bytes
+  *  Size of one texel of the plane in bytes
+  */
+static void glTexture__UploadPlane(GLenum format, const RECT *r, GLint rowlength,
+	GLintptr base, GLsizei pitch, int bytes)
+{
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, rowlength);
+	// Half-width chroma rows need not be a multiple of four bytes apart
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, r->left, r->top, r->right - r->left, r->bottom - r->top,
+		format, GL_UNSIGNED_BYTE, (const GLvoid*)(base + (r->top * pitch) + (r->left * bytes)));
+}
+
+/**
+  * Uploads the planes of a planar YUV surface and converts them to the RGB
+  * texture with one shader pass.  Only the rows covered by the CPU-dirty
+  * rectangles are copied into the unpack buffer and uploaded, with the
+  * matching half-size rows of the chroma planes.
+  * @param This
+  *  Pointer to texture object
+  * @param util
+  *  Pointer to glUtil object to bind the textures with
+  * @return
+  *  TRUE if the surface was uploaded, FALSE if it should be converted on the CPU
+  */
+static BOOL glTexture__UploadPlanes(glTexture *This, glUtil *util)
+{
+	MIPLEVEL *mip = &This->levels[0];
+	FBO *oldfbo = util->currentfbo;
+	size_t pitch = mip->ddsd.lPitch;
+	size_t cpitch = (This->planar == PLANAR_NV12) ? pitch : (pitch / 2);
+	size_t size = ColorConv_PlanarSize(pitch, mip->ddsd.dwHeight);
+	BYTE *u, *v;
+	GLintptr uoffset, voffset;
+	RECT rects[DIRTYRECT_MAX];
+	RECT full, chroma;
+	DWORD rectcount = 0;
+	BufferObject *unpack;
+	GLintptr base;
+	char *writebuffer;
+	LONG y;
+	DWORD i;
+	if (glUtil_SetFBOSurface(util, This, NULL, 0, 0, TRUE) != GL_FRAMEBUFFER_COMPLETE)
+	{
+		glUtil_SetFBO(util, oldfbo);
+		return FALSE;
+	}
+	if (mip->dirty & 1) rectcount = mip->dirtyrectcount;
+	// Chroma samples cover 2x2 pixels, so convert whole sample blocks
+	for (i = 0; i < rectcount; i++)
+	{
+		rects[i].left = mip->dirtyrects[i].left & ~1;
+		rects[i].top = mip->dirtyrects[i].top & ~1;
+		rects[i].right = min((mip->dirtyrects[i].right + 1) & ~1, (LONG)mip->ddsd.dwWidth);
+		rects[i].bottom = min((mip->dirtyrects[i].bottom + 1) & ~1, (LONG)mip->ddsd.dwHeight);
+	}
+	full.left = full.top = 0;
+	full.right = mip->ddsd.dwWidth;
+	full.bottom = mip->ddsd.dwHeight;
+	ColorConv_GetPlanes(This->planar, (BYTE*)mip->buffer, pitch, mip->ddsd.dwHeight, &u, &v);
+	uoffset = (GLintptr)(u - (BYTE*)mip->buffer);
+	voffset = (GLintptr)(v - (BYTE*)mip->buffer);
+	writebuffer = glTexture__MapUnpack(This, size, &unpack, &base);
+	if (!writebuffer)
+	{
+		glUtil_SetFBO(util, oldfbo);
+		return FALSE;
+	}
+	// The unpack buffer is laid out like the surface buffer, only dirty rows are copied
+	if (!rectcount) ColorConv_StreamCopy(writebuffer, mip->buffer, size);
+	for (i = 0; i < rectcount; i++)
+	{
+		for (y = rects[i].top; y < rects[i].bottom; y++)
+			memcpy(writebuffer + (y * pitch) + rects[i].left, mip->buffer + (y * pitch) + rects[i].left,
+				rects[i].right - rects[i].left);
+		for (y = rects[i].top / 2; y < (rects[i].bottom + 1) / 2; y++)
+		{
+			if (This->planar == PLANAR_NV12)
+				memcpy(writebuffer + uoffset + (y * cpitch) + rects[i].left,
+					mip->buffer + uoffset + (y * cpitch) + rects[i].left, rects[i].right - rects[i].left);
+			else
+			{
+				memcpy(writebuffer + uoffset + (y * cpitch) + (rects[i].left / 2),
+					mip->buffer + uoffset + (y * cpitch) + (rects[i].left / 2), (rects[i].right - rects[i].left + 1) / 2);
+				memcpy(writebuffer + voffset + (y * cpitch) + (rects[i].left / 2),
+					mip->buffer + voffset + (y * cpitch) + (rects[i].left / 2), (rects[i].right - rects[i].left + 1) / 2);
+			}
+		}
+	}
+	glTexture__UnmapUnpack(This, unpack);
+	glTexture__PreparePlanes(This, util);
+	for (i = 0; i < (rectcount ? rectcount : 1); i++)
+	{
+		const RECT *r = rectcount ? &rects[i] : &full;
+		chroma.left = r->left / 2;
+		chroma.top = r->top / 2;
+		chroma.right = (r->right + 1) / 2;
+		chroma.bottom = (r->bottom + 1) / 2;
+		glUtil_SetActiveTexture(util, 15);
+		glTexture__UploadPlane(GL_RED_INTEGER, r, (GLint)pitch, base, (GLsizei)pitch, 1);
+		glUtil_SetActiveTexture(util, 14);
+		if (This->planar == PLANAR_NV12)
+			glTexture__UploadPlane(GL_RG_INTEGER, &chroma, (GLint)(cpitch / 2), base + uoffset, (GLsizei)cpitch, 2);
+		else
+		{
+			glTexture__UploadPlane(GL_RED_INTEGER, &chroma, (GLint)cpitch, base + uoffset, (GLsizei)cpitch, 1);
+			glUtil_SetActiveTexture(util, 13);
+			glTexture__UploadPlane(GL_RED_INTEGER, &chroma, (GLint)cpitch, base + voffset, (GLsizei)cpitch, 1);
+		}
+	}
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	BufferObject_Unbind(unpack, GL_PIXEL_UNPACK_BUFFER);
+	glTexture__DrawConversion(This, PROG_UNPACKYUV, 0, mip->ddsd.dwWidth, mip->ddsd.dwHeight, rects, rectcount);
+	glUtil_SetFBO(util, oldfbo);
+	return TRUE;
+}
+
+/**
+  * Uploads only the CPU-dirty rectangles of a mipmap level.
+  * @param This
+  *  Pointer to texture object
+  * @param level
+  *  Mipmap level to upload
+  * @param util
+  *  Pointer to glUtil object to bind the texture with
+  * @return
+  *  TRUE if the dirty rectangles were uploaded, FALSE if the whole level
+  *  should be uploaded instead
+  */
+static BOOL glTexture__UploadRects(glTexture *This, int level, glUtil *util)
+{
+	MIPLEVEL *mip = &This->levels[level];
+	glExtensions *ext = This->renderer->ext;
+	int bytes = mip->ddsd.ddpfPixelFormat.dwRGBBitCount / 8;
+	__int64 area = 0;
+	GLsizeiptr size = 0;
+	GLsizeiptr offsets[DIRTYRECT_MAX];
+	BufferObject *unpack = NULL;
+	GLintptr base = 0;
+	int outpitch;
+	int width, height;
+	char *writebuffer;
+	DWORD i;
+	int y;
+	LONGLONG profilestart;
+	if ((This->packsize != 1) || (mip->ddsd.ddpfPixelFormat.dwRGBBitCount < 8) || This->planar) return FALSE;
+	for (i = 0; i < mip->dirtyrectcount; i++)
+	{
+		width = mip->dirtyrects[i].right - mip->dirtyrects[i].left;
+		height = mip->dirtyrects[i].bottom - mip->dirtyrects[i].top;
+		area += (__int64)width * height;
+		offsets[i] = size;
+		size += NextMultipleOf4(width * This->internalsize) * height;
+	}
+	// Not worth splitting up once most of the level is dirty
+	if (area * 2 > (__int64)mip->ddsd.dwWidth * mip->ddsd.dwHeight) return FALSE;
+	if (This->useconv)
+	{
+		writebuffer = glTexture__MapUnpack(This, size, &unpack, &base);
+		if (!writebuffer) return FALSE;
+		// Pack each rectangle tightly into the unpack buffer
+		profilestart = SurfaceProfile_Begin(This->profile);
+		for (i = 0; i < mip->dirtyrectcount; i++)
+		{
+			width = mip->dirtyrects[i].right - mip->dirtyrects[i].left;
+			outpitch = NextMultipleOf4(width * This->internalsize);
+			for (y = mip->dirtyrects[i].top; y < mip->dirtyrects[i].bottom; y++)
+				colorconvproc[This->convfunctionupload](width,
+					writebuffer + offsets[i] + ((y - mip->dirtyrects[i].top) * outpitch),
+					mip->buffer + (y * mip->ddsd.lPitch) + (mip->dirtyrects[i].left * bytes));
+		}
+		SurfaceProfile_End(This->profile, SURFACEPROFILE_CONVERT, profilestart, size);
+		glTexture__UnmapUnpack(This, unpack);
+	}
+	else
+	{
+		// Rows of the surface buffer are not a whole number of pixels apart
+		if (mip->ddsd.lPitch % bytes) return FALSE;
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, mip->ddsd.lPitch / bytes);
+	}
+	if (!ext->GLEXT_EXT_direct_state_access)
+	{
+		glUtil_SetActiveTexture(util, 0);
+		glUtil_SetTexture(util, 0, This);
+	}
+	for (i = 0; i < mip->dirtyrectcount; i++)
+	{
+		const void *data;
+		if (This->useconv) data = (const void*)(base + offsets[i]);
+		else data = mip->buffer + (mip->dirtyrects[i].top * mip->ddsd.lPitch) + (mip->dirtyrects[i].left * bytes);
+		width = mip->dirtyrects[i].right - mip->dirtyrects[i].left;
+		height = mip->dirtyrects[i].bottom - mip->dirtyrects[i].top;
+		if (ext->GLEXT_EXT_direct_state_access)
+			ext->glTextureSubImage2DEXT(This->id, This->target, level, mip->dirtyrects[i].left,
+				mip->dirtyrects[i].top, width, height, This->format, This->type, data);
+		else glTexSubImage2D(This->target, level, mip->dirtyrects[i].left,
+			mip->dirtyrects[i].top, width, height, This->format, This->type, data);
+	}
+	if (This->useconv) BufferObject_Unbind(unpack, GL_PIXEL_UNPACK_BUFFER);
+	else glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	return TRUE;
+}
+
+/**
+  * Uploads the blocks of a compressed mipmap level without decompressing
+  * them.  Only the rows of blocks covered by the dirty rectangles are sent.
+  * @param This
+  *  Pointer to texture object
+  * @param level
+  *  Mipmap level to upload
+  * @param util
+  *  Pointer to glUtil object to bind the texture with
+  */
+static void glTexture__UploadCompressed(glTexture *This, int level, glUtil *util)
+{
+	MIPLEVEL *mip = &This->levels[level];
+	size_t pitch = ColorConv_BlockPitch(This->compressed, mip->ddsd.dwWidth);
+	LONG top = 0;
+	LONG bottom = mip->ddsd.dwHeight;
+	GLsizei size;
+	BufferObject *unpack = NULL;
+	GLintptr offset;
+	char *writebuffer;
+	const GLvoid *data;
+	DWORD i;
+	if ((mip->dirty & 1) && mip->dirtyrectcount)
+	{
+		top = bottom;
+		bottom = 0;
+		for (i = 0; i < mip->dirtyrectcount; i++)
+		{
+			if (mip->dirtyrects[i].top < top) top = mip->dirtyrects[i].top;
+			if (mip->dirtyrects[i].bottom > bottom) bottom = mip->dirtyrects[i].bottom;
+		}
+		// Compressed updates must start on a block and end on a block or the edge
+		top &= ~3;
+		bottom = min((LONG)mip->ddsd.dwHeight, NextMultipleOf4(bottom));
+		if (top >= bottom) return;
+	}
+	size = (GLsizei)(pitch * ((bottom - top + 3) / 4));
+	data = mip->buffer + ((top / 4) * pitch);
+	writebuffer = (char*)glRenderer__StreamUnpack(This->renderer, size, &offset);
+	if (writebuffer)
+	{
+		ColorConv_StreamCopy(writebuffer, data, size);
+		unpack = This->renderer->cmdbuffer[0].pixelunpack;
+		BufferObject_Bind(unpack, GL_PIXEL_UNPACK_BUFFER);
+		data = (const GLvoid*)offset;
+	}
+	glUtil_SetActiveTexture(util, 0);
+	glUtil_SetTexture(util, 0, This);
+	glCompressedTexSubImage2D(This->target, level, 0, top, mip->ddsd.dwWidth, bottom - top,
+		This->internalformats[0], size, data);
+	if (unpack) BufferObject_Unbind(unpack, GL_PIXEL_UNPACK_BUFFER);
+}
+
+/**
+  * Replaces immutable texture storage with a new texture whose levels can be
+  * reallocated with glTexImage2D.  Each level gets uninitialized storage of
+  * its current size; the previous contents are lost.
+  * @param This
+  *  Pointer to texture object
+  */
+static void glTexture__MakeMutable(glTexture *This)
+{
+	int i;
+	for (i = 0; i < This->levelcount; i++)
+	{
+		// Attach the new texture name the next time a level is drawn to
+		if (This->levels[i].fbo.fbcolor == This) This->levels[i].fbo.fbcolor = NULL;
+	}
+	glUtil_InvalidateFBOs(This->renderer->util, This);
+	glTexture__DeleteIntegerView(This);
+	glTexture__ReleaseHandles(This);
+	glDeleteTextures(1, &This->id);
+	glGenTextures(1, &This->id);
+	glUtil_SetActiveTexture(This->renderer->util, 0);
+	glUtil_SetTexture(This->renderer->util, 0, This);
+	glTexParameteri(This->target, GL_TEXTURE_MIN_FILTER, This->minfilter);
+	glTexParameteri(This->target, GL_TEXTURE_MAG_FILTER, This->magfilter);
+	glTexParameteri(This->target, GL_TEXTURE_WRAP_S, This->wraps);
+	glTexParameteri(This->target, GL_TEXTURE_WRAP_T, This->wrapt);
+	glTexParameteri(This->target, GL_TEXTURE_MAX_LEVEL, This->miplevel - 1);
+	for (i = 0; i < This->miplevel; i++)
+		glTexImage2D(This->target, i, This->internalformats[0], DivCeiling(This->levels[i].ddsd.dwWidth, This->packsize),
+			This->levels[i].ddsd.dwHeight, 0, This->format, This->type, NULL);
+	This->immutable = FALSE;
+}
+
+/**
+  * Gets the persistently mapped pixel buffer of a mipmap level for a
+  * write-only lock, creating it on first use.  Waits until the GPU has
+  * finished reading the previous contents of the buffer.
+  * Must be called from the renderer thread.
+  * @param This
+  *  Pointer to texture object
+  * @param level
+  *  Mipmap level to lock
+  * @return
+  *  Pointer to write the level's data to, or NULL if the buffer could not be
+  *  mapped and the surface buffer should be used instead
+  */
+char *glTexture__MapLock(glTexture *This, GLint level)
+{
+	glExtensions *ext = This->renderer->ext;
+	MIPLEVEL *mip = &This->levels[level];
+	GLsizeiptr size = mip->ddsd.lPitch * mip->ddsd.dwHeight;
+	if (mip->pboLock && (mip->pboLock->size < size))
+	{
+		// Buffer storage can't be resized
+		if (mip->lockfence) ext->glDeleteSync(mip->lockfence);
+		mip->lockfence = NULL;
+		BufferObject_Release(mip->pboLock);
+		mip->pboLock = NULL;
+		mip->dirty &= ~16;
+	}
+	if (!mip->pboLock)
+	{
+		BufferObject_Create(&mip->pboLock, ext, This->renderer->util);
+		BufferObject_SetStorage(mip->pboLock, GL_PIXEL_UNPACK_BUFFER, size, NULL,
+			GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+		mip->pboLock->pointer = (GLbyte*)BufferObject_MapRange(mip->pboLock, GL_PIXEL_UNPACK_BUFFER, 0, size,
+			GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+		if (mip->pboLock->pointer) mip->pboLock->mapped = TRUE;
+	}
+	if (!mip->pboLock->mapped) return NULL;
+	if (mip->lockfence)
+	{
+		while (ext->glClientWaitSync(mip->lockfence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED);
+		ext->glDeleteSync(mip->lockfence);
+		mip->lockfence = NULL;
+	}
+	return (char*)mip->pboLock->pointer;
+}
+
+/**
+  * Uploads a mipmap level from the pixel buffer filled by a direct lock.
+  * @param This
+  *  Pointer to texture object
+  * @param level
+  *  Mipmap level to upload
+  * @param width
+  *  Width of the level in texels
+  * @param height
+  *  Height of the level in texels
+  * @param util
+  *  Pointer to the glUtil object to bind the buffer and texture with
+  */
+static void glTexture__UploadLock(glTexture *This, int level, int width, int height, glUtil *util)
+{
+	MIPLEVEL *mip = &This->levels[level];
+	BufferObject_Bind(mip->pboLock, GL_PIXEL_UNPACK_BUFFER);
+	if (This->renderer->ext->GLEXT_EXT_direct_state_access)
+		This->renderer->ext->glTextureSubImage2DEXT(This->id, This->target, level,
+			0, 0, width, height, This->format, This->type, 0);
+	else
+	{
+		glUtil_SetActiveTexture(util, 0);
+		glUtil_SetTexture(util, 0, This);
+		glTexSubImage2D(This->target, level, 0, 0, width, height, This->format, This->type, 0);
+	}
+	BufferObject_Unbind(mip->pboLock, GL_PIXEL_UNPACK_BUFFER);
+	mip->lockfence = This->renderer->ext->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	mip->lockmapped = FALSE;
+	// Only the pixel buffer and the texture hold the new contents
+	mip->dirty = (mip->dirty | 2 | 16) & ~69;
+	mip->dirtyrectcount = 0;
+}
+
+/**
+  * Uploads the surface buffer of a texture placed in an atlas page to its
+  * cell in the page.
+  * @param This
+  *  Pointer to texture object
+  * @param util
+  *  Pointer to the glUtil object to bind the texture with
+  */
+static void glTexture__UploadAtlas(glTexture *This, glUtil *util)
+{
+	MIPLEVEL *mip = &This->levels[0];
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, mip->ddsd.lPitch / (mip->ddsd.ddpfPixelFormat.dwRGBBitCount / 8));
+	if (This->renderer->ext->GLEXT_EXT_direct_state_access)
+		This->renderer->ext->glTextureSubImage2DEXT(This->id, This->target, 0, This->atlasx, This->atlasy,
+			mip->ddsd.dwWidth, mip->ddsd.dwHeight, This->format, This->type, mip->buffer);
+	else
+	{
+		glUtil_SetActiveTexture(util, 0);
+		glUtil_SetTexture(util, 0, This);
+		glTexSubImage2D(This->target, 0, This->atlasx, This->atlasy, mip->ddsd.dwWidth,
+			mip->ddsd.dwHeight, This->format, This->type, mip->buffer);
+	}
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	mip->dirty &= ~69;
+	mip->dirtyrectcount = 0;
+}
+
+/**
+  * Uploads a mipmap level of a texture set up by ColorKeyAlpha, with the
+  * source color key stored in the alpha channel.
+  * @param This
+  *  Pointer to texture object
+  * @param level
+  *  Mipmap level to upload
+  * @param width
+  *  Width of the level in texels
+  * @param height
+  *  Height of the level in texels
+  * @param util
+  *  Pointer to the glUtil object to bind the texture with
+  * @return
+  *  TRUE if the level was uploaded
+  */
+static BOOL glTexture__UploadKeyed(glTexture *This, int level, int width, int height, glUtil *util)
+{
+	MIPLEVEL *mip = &This->levels[level];
+	DDPIXELFORMAT *format = &This->levels[0].ddsd.ddpfPixelFormat;
+	int bits = format->dwRGBBitCount;
+	int inpitch = mip->ddsd.lPitch;
+	int outpitch;
+	char *writebuffer;
+	BufferObject *unpack;
+	GLintptr offset;
+	LONGLONG profilestart;
+	if (This->useconv) outpitch = NextMultipleOf4(mip->ddsd.dwWidth * This->internalsize);
+	else outpitch = inpitch;
+	writebuffer = glTexture__MapUnpack(This, outpitch * mip->ddsd.dwHeight, &unpack, &offset);
+	if (!writebuffer) return FALSE;
+	if (This->useconv)
+	{
+		profilestart = SurfaceProfile_Begin(This->profile);
+		ColorConv_ConvertRows(colorconvproc[This->convfunctionupload], mip->ddsd.dwWidth,
+			mip->ddsd.dwHeight, writebuffer, outpitch, mip->buffer, inpitch);
+		SurfaceProfile_End(This->profile, SURFACEPROFILE_CONVERT, profilestart, outpitch * mip->ddsd.dwHeight);
+	}
+	else memcpy(writebuffer, mip->buffer, outpitch * mip->ddsd.dwHeight);
+	ColorConv_KeyToAlpha(bits, This->useconv ? 32 : bits, mip->ddsd.dwWidth, mip->ddsd.dwHeight, writebuffer,
+		outpitch, mip->buffer, inpitch, This->alphakey, format->dwRBitMask | format->dwGBitMask | format->dwBBitMask);
+	glTexture__UnmapUnpack(This, unpack);
+	if (This->renderer->ext->GLEXT_EXT_direct_state_access)
+		This->renderer->ext->glTextureSubImage2DEXT(This->id, This->target, level,
+			0, 0, width, height, This->format, This->type, (const GLvoid*)offset);
+	else
+	{
+		glUtil_SetActiveTexture(util, 0);
+		glUtil_SetTexture(util, 0, This);
+		glTexSubImage2D(This->target, level, 0, 0, width, height, This->format, This->type, (const GLvoid*)offset);
+	}
+	BufferObject_Unbind(unpack, GL_PIXEL_UNPACK_BUFFER);
+	mip->dirty = (mip->dirty & ~5) | 64;
+	mip->dirtyrectcount = 0;
+	return TRUE;
+}
+
+/**
+  * Changes the source color key that uploads of a texture set up by
+  * ColorKeyAlpha store in the alpha channel.  Levels are uploaded again
+  * before they are next drawn with, levels last written by the GPU are read
+  * back first.
+  * @param This
+  *  Pointer to texture object
+  */
+void glTexture__SetAlphaKey(glTexture *This)
+{
+	BOOL keyset = (This->levels[0].ddsd.dwFlags & DDSD_CKSRCBLT) ? TRUE : FALSE;
+	DWORD key = This->levels[0].ddsd.ddckCKSrcBlt.dwColorSpaceLowValue;
+	GLint i;
+	if (!This->keyalpha) return;
+	if ((keyset == This->alphakeyset) && (!keyset || (key == This->alphakey))) return;
+	This->alphakeyset = keyset;
+	This->alphakey = key;
+	for (i = 0; i < This->levelcount; i++)
+	{
+		if (This->levels[i].dirty & 2) glTexture__Download(This, i);
+		This->levels[i].dirty &= ~64;
+		if (!This->levels[i].buffer) continue;
+		This->levels[i].dirty |= 1;
+		This->levels[i].dirtyrectcount = 0;
+	}
 }
 
 void glTexture__Upload2(glTexture *This, int level, int width, int height, BOOL checkerror, BOOL dorealloc, glUtil *util)
@@ -652,56 +2613,113 @@ void glTexture__Upload2(glTexture *This, int level, int width, int height, BOOL
 	int inpitch, outpitch;
 	int i;
 	char *writebuffer;
+	BufferObject *unpack;
+	GLintptr offset;
+	LONGLONG profilestart;
+	// A resized surface no longer fits its atlas cell
+	if (dorealloc && This->atlas) glTexture__LeaveAtlas(This);
+	if (!level) glTexture__InvalidateMSAA(This);
 	width = DivCeiling(width, This->packsize);
 	if (dorealloc)
 	{
 		This->levels[level].ddsd.dwWidth = width;
 		This->levels[level].ddsd.dwHeight = height;
+		This->levels[level].dirty &= ~16;
 		//This->bigwidth = width;
 		//This->bigheight = height;
-		This->levels[level].buffer = (char*)realloc(This->levels[level].buffer,
+		// The DIB section has the old size, GetDC makes a new one
+		if (This->levels[level].gdi && This->levels[level].gdi->dibbuffer) glTexture__DeleteDIB(This, level);
+		// Watched and large page buffers can't be resized in place, the contents change meaning anyway
+		if (This->levels[level].writewatch || This->levels[level].largepage)
+		{
+			glTexture__FreeBuffer(This, level);
+			glTexture__AllocBuffer(This, level, NextMultipleOf4((This->levels[level].ddsd.ddpfPixelFormat.dwRGBBitCount *
+				This->levels[level].ddsd.dwWidth) / 8) * This->levels[level].ddsd.dwHeight);
+		}
+		else This->levels[level].buffer = (char*)_aligned_realloc(This->levels[level].buffer,
 			NextMultipleOf4((This->levels[level].ddsd.ddpfPixelFormat.dwRGBBitCount *
-			This->levels[level].ddsd.dwWidth) / 8) * This->levels[level].ddsd.dwHeight);
+			This->levels[level].ddsd.dwWidth) / 8) * This->levels[level].ddsd.dwHeight, BUFFER_ALIGNMENT);
 		/*if ((level == 0) && ((This->levels[level].ddsd.dwWidth != This->bigwidth) ||
 			(This->levels[level].ddsd.dwHeight != This->bigheight)))
 			This->levels[level].bigbuffer = (char *)realloc(This->levels[level].bigbuffer,
 				NextMultipleOf4((This->levels[level].ddsd.ddpfPixelFormat.dwRGBBitCount *
 				This->bigwidth) / 8) * This->bigheight);*/
 	}
+	if (This->levels[level].lockmapped)
+	{
+		glTexture__UploadLock(This, level, width, height, util);
+		return;
+	}
+	// Levels that were never locked have nothing to upload
+	if (!This->levels[level].buffer) return;
+	if (This->atlas)
+	{
+		glTexture__UploadAtlas(This, util);
+		return;
+	}
+	// Immutable storage can't change size
+	if (dorealloc && This->immutable) glTexture__MakeMutable(This);
 	/*if ((level == 0) && ((This->levels[level].ddsd.dwWidth != This->bigwidth) ||
 		(This->levels[level].ddsd.dwHeight != This->bigheight)))
 		data = This->levels[level].bigbuffer;
 	else */data = This->levels[level].buffer;
+	if (This->compressed && !This->useconv)
+	{
+		glTexture__UploadCompressed(This, level, util);
+		This->levels[level].dirty &= ~69;
+		This->levels[level].dirtyrectcount = 0;
+		return;
+	}
+	if (This->keyalpha && This->alphakeyset && !checkerror && !dorealloc &&
+		glTexture__UploadKeyed(This, level, width, height, util)) return;
+	if (!checkerror && glTexture__UseGPUConversion(This, level) &&
+		(width == This->levels[level].ddsd.dwWidth) && (height == This->levels[level].ddsd.dwHeight) &&
+		(This->planar ? glTexture__UploadPlanes(This, util) : glTexture__UploadGPU(This, level, util)))
+	{
+		This->levels[level].dirty &= ~69;
+		This->levels[level].dirtyrectcount = 0;
+		return;
+	}
+	if (!dorealloc && !checkerror && (This->levels[level].dirty & 1) && This->levels[level].dirtyrectcount &&
+		(width == This->levels[level].ddsd.dwWidth) && (height == This->levels[level].ddsd.dwHeight) &&
+		glTexture__UploadRects(This, level, util))
+	{
+		This->levels[level].dirty &= ~69;
+		This->levels[level].dirtyrectcount = 0;
+		return;
+	}
 	if (This->useconv)
 	{
-		if (!This->pboUnpack)
-			BufferObject_Create(&This->pboUnpack, This->renderer->ext, This->renderer->util);
 		outpitch = NextMultipleOf4(This->levels[level].ddsd.dwWidth * This->internalsize);
 		inpitch = This->levels[level].ddsd.lPitch;
-		if (This->pboUnpack->size < outpitch * This->levels[level].ddsd.dwHeight)
-			BufferObject_SetData(This->pboUnpack, GL_PIXEL_UNPACK_BUFFER,
-				outpitch * This->levels[level].ddsd.dwHeight, NULL, GL_DYNAMIC_DRAW);
-		writebuffer = (char*)BufferObject_Map(This->pboUnpack, GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
-		for (i = 0; i < This->levels[level].ddsd.dwHeight; i++)
-			colorconvproc[This->convfunctionupload](This->levels[level].ddsd.dwWidth,
-				writebuffer + (i*outpitch), This->levels[level].buffer + (i * inpitch));
-		BufferObject_Unmap(This->pboUnpack, GL_PIXEL_UNPACK_BUFFER);
-		BufferObject_Bind(This->pboUnpack, GL_PIXEL_UNPACK_BUFFER);
+		writebuffer = glTexture__MapUnpack(This, outpitch * This->levels[level].ddsd.dwHeight, &unpack, &offset);
+		if (!writebuffer) return;
+		profilestart = SurfaceProfile_Begin(This->profile);
+		if (This->planar) ColorConv_PlanarToRGBA(This->planar, This->levels[level].ddsd.dwWidth,
+			This->levels[level].ddsd.dwHeight, (DWORD*)writebuffer, outpitch, (BYTE*)This->levels[level].buffer, inpitch);
+		else if (This->compressed) ColorConv_DXTToRGBA(This->compressed, This->levels[level].ddsd.dwWidth,
+			This->levels[level].ddsd.dwHeight, (DWORD*)writebuffer, outpitch, (BYTE*)This->levels[level].buffer,
+			ColorConv_BlockPitch(This->compressed, This->levels[level].ddsd.dwWidth));
+		else ColorConv_ConvertRows(colorconvproc[This->convfunctionupload], This->levels[level].ddsd.dwWidth,
+			This->levels[level].ddsd.dwHeight, writebuffer, outpitch, This->levels[level].buffer, inpitch);
+		SurfaceProfile_End(This->profile, SURFACEPROFILE_CONVERT, profilestart,
+			outpitch * This->levels[level].ddsd.dwHeight);
+		glTexture__UnmapUnpack(This, unpack);
 		if (This->renderer->ext->GLEXT_EXT_direct_state_access)
 		{
 			/*if (dorealloc)This->renderer->ext->glTextureImage2DEXT(This->id, This->target, level, This->internalformats[0],
 				width, height, 0, This->format, This->type, data);
 			else */This->renderer->ext->glTextureSubImage2DEXT(This->id, This->target, level,
-				0, 0, width, height, This->format, This->type, 0);
+				0, 0, width, height, This->format, This->type, (const GLvoid*)offset);
 		}
 		else
 		{
 			glUtil_SetActiveTexture(util, 0);
 			glUtil_SetTexture(util, 0, This);
 			/*if (dorealloc)glTexImage2D(This->target, level, This->internalformats[0], width, height, 0, This->format, This->type, data);
-			else */glTexSubImage2D(This->target, level, 0, 0, width, height, This->format, This->type, 0);
+			else */glTexSubImage2D(This->target, level, 0, 0, width, height, This->format, This->type, (const GLvoid*)offset);
 		}
-		BufferObject_Unbind(This->pboUnpack, GL_PIXEL_UNPACK_BUFFER);
+		BufferObject_Unbind(unpack, GL_PIXEL_UNPACK_BUFFER);
 	}
 	else
 	{
@@ -740,6 +2758,21 @@ void glTexture__Upload2(glTexture *This, int level, int width, int height, BOOL
 		}
 		else
 		{
+			// Stage the data in the shared unpack buffer so the driver can copy it later
+			unpack = NULL;
+			if (!dorealloc)
+			{
+				writebuffer = (char*)glRenderer__StreamUnpack(This->renderer,
+					This->levels[level].ddsd.lPitch * This->levels[level].ddsd.dwHeight, &offset);
+				if (writebuffer)
+				{
+					ColorConv_StreamCopy(writebuffer, data,
+						This->levels[level].ddsd.lPitch * This->levels[level].ddsd.dwHeight);
+					unpack = This->renderer->cmdbuffer[0].pixelunpack;
+					BufferObject_Bind(unpack, GL_PIXEL_UNPACK_BUFFER);
+					data = (void*)offset;
+				}
+			}
 			if (This->renderer->ext->GLEXT_EXT_direct_state_access)
 			{
 				if (dorealloc)This->renderer->ext->glTextureImage2DEXT(This->id, This->target, level, This->internalformats[0],
@@ -754,9 +2787,11 @@ void glTexture__Upload2(glTexture *This, int level, int width, int height, BOOL
 				if (dorealloc)glTexImage2D(This->target, level, This->internalformats[0], width, height, 0, This->format, This->type, data);
 				else glTexSubImage2D(This->target, level, 0, 0, width, height, This->format, This->type, data);
 			}
+			if (unpack) BufferObject_Unbind(unpack, GL_PIXEL_UNPACK_BUFFER);
 		}
 	}
-	This->levels[level].dirty &= ~1;
+	This->levels[level].dirty &= ~69;
+	This->levels[level].dirtyrectcount = 0;
 }
 
 void glTexture__Upload(glTexture *This, GLint level)
@@ -767,6 +2802,17 @@ void glTexture__Upload(glTexture *This, GLint level)
 	//int bigpitch = NextMultipleOf4((bpp / 8)*This->bigwidth);
 	int pitch = This->levels[level].ddsd.lPitch;
 	int bigx, bigy;
+	LONGLONG profilestart;
+	if (This->evicted) glTexture__MakeResident(This);
+	if ((DWORD)level < This->droppedlevels)
+	{
+		// Uploads every dropped level from its buffer, this one included
+		glTexture__AllocateDropped(This);
+		return;
+	}
+	profilestart = SurfaceProfile_Begin(This->profile);
+	This->uploads++;
+	if (This->residency) This->lastwritten = This->residency->frame;
 	/*if (level)
 	{*/
 		bigx = This->levels[level].ddsd.dwWidth;
@@ -778,10 +2824,19 @@ void glTexture__Upload(glTexture *This, GLint level)
 		bigy = This->bigheight;
 	}*/
 	if (bpp == 15) bpp = 16;
+	// The linear size of compressed levels is in place of the pitch
+	if (This->compressed) This->renderer->uploadbytes += This->levels[level].ddsd.dwLinearSize;
+	else This->renderer->uploadbytes += (GLsizeiptr)pitch * y;
+	This->renderer->perf.frame.dwUploads++;
+	if (This->compressed) This->renderer->perf.frame.dwUploadBytes += This->levels[level].ddsd.dwLinearSize;
+	else This->renderer->perf.frame.dwUploadBytes += pitch * y;
+	if (This->renderer->capture) Capture_Upload(This->renderer->capture, This, level);
 	/*if ((x == bigx && y == bigy) || !This->levels[level].bigbuffer)
 	{*/
 		glTexture__Upload2(This,level,
 			This->levels[level].ddsd.dwWidth, This->levels[level].ddsd.dwHeight, FALSE, FALSE, This->renderer->util);
+		if (!level && This->automipmap) glTexture__GenerateMipmap(This, This->renderer->util);
+		SurfaceProfile_End(This->profile, SURFACEPROFILE_UPLOAD, profilestart, glTexture__LevelSize(This, level));
 	/*}
 	else
 	{
@@ -808,6 +2863,42 @@ void glTexture__Upload(glTexture *This, GLint level)
 			bigx, bigy, FALSE, FALSE, This->renderer->util);
 	}*/
 }
+/**
+  * Moves a texture out of its atlas page into a texture of its own.  Called
+  * before the surface is drawn to, since rendering to the page would need
+  * the surface's own framebuffer.  The surface buffer always holds the
+  * contents of atlas textures, so it is uploaded to the new texture.
+  * @param This
+  *  Pointer to texture object
+  */
+void glTexture__LeaveAtlas(glTexture *This)
+{
+	MIPLEVEL *mip = &This->levels[0];
+	if (!This->atlas) return;
+	TextureAtlas_Free(This->renderer->atlas, This->atlas);
+	This->atlas = NULL;
+	glGenTextures(1, &This->id);
+	glUtil_SetTexture(This->renderer->util, 0, This);
+	glTexParameteri(This->target, GL_TEXTURE_MIN_FILTER, This->minfilter);
+	glTexParameteri(This->target, GL_TEXTURE_MAG_FILTER, This->magfilter);
+	glTexParameteri(This->target, GL_TEXTURE_WRAP_S, This->wraps);
+	glTexParameteri(This->target, GL_TEXTURE_WRAP_T, This->wrapt);
+	glTexParameteri(This->target, GL_TEXTURE_MAX_LEVEL, 0);
+	This->immutable = FALSE;
+	if (This->renderer->ext->GLEXT_ARB_texture_storage)
+	{
+		ClearError();
+		This->renderer->ext->glTexStorage2D(This->target, 1, This->internalformats[0],
+			mip->ddsd.dwWidth, mip->ddsd.dwHeight);
+		if (glGetError() == GL_NO_ERROR) This->immutable = TRUE;
+	}
+	if (!This->immutable) glTexImage2D(This->target, 0, This->internalformats[0], mip->ddsd.dwWidth,
+		mip->ddsd.dwHeight, 0, This->format, This->type, NULL);
+	mip->dirty |= 1;
+	mip->dirtyrectcount = 0;
+	glTexture__Upload2(This, 0, mip->ddsd.dwWidth, mip->ddsd.dwHeight, FALSE, FALSE, This->renderer->util);
+}
+
 BOOL glTexture__Repair(glTexture *This, BOOL preserve)
 {
 	// data should be null to create uninitialized texture or be pointer to top-level
@@ -817,12 +2908,29 @@ BOOL glTexture__Repair(glTexture *This, BOOL preserve)
 	BOOL repairfail = FALSE;
 	int i;
 	if (This->internalformats[1] == 0) return FALSE;
+	// The renderbuffer uses the format being replaced
+	glTexture__ResolveMSAA(This);
+	glTexture__DeleteMSAA(This);
+	This->msaastate = MSAA_SYNCED;
+	// Completeness of the cached framebuffers changes with the format
+	glUtil_InvalidateFBOs(This->renderer->util, This);
 	glUtil_SetActiveTexture(This->renderer->util, 0);
-	if (preserve)
+	for (i = 0; i < This->miplevel; i++)
 	{
-		for (i = 0; i < This->miplevel; i++)
-			glTexture__Download(This, i);
+		// Only levels the GPU wrote last need reading back, the buffers of the others are current
+		if (!(This->levels[i].dirty & 6)) continue;
+		if (preserve)
+		{
+			if (!i || This->levels[i].buffer) glTexture__Download(This, i);
+		}
+		else
+		{
+			This->levels[i].dirty &= ~6;
+			This->contentlost = TRUE;
+		}
 	}
+	// The storage is replaced with the next internal format, which immutable textures can't do
+	if (This->immutable) glTexture__MakeMutable(This);
 	//if (preserve) data = This->levels[0].bigbuffer ? This->levels[0].bigbuffer : This->levels[0].buffer;
 	if (preserve) data = This->levels[0].buffer;
 	glUtil_SetTexture(This->renderer->util, 0, This);
@@ -853,6 +2961,7 @@ BOOL glTexture__Repair(glTexture *This, BOOL preserve)
 		if (repairfail) break;
 	}
 	if (repairfail) return FALSE;
+	if (preserve && This->automipmap) glTexture__GenerateMipmap(This, This->renderer->util);
 	return TRUE;
 }
 
@@ -881,17 +2990,156 @@ BOOL glTexture__Repair(glTexture *This, BOOL preserve)
 		glTexture__Upload2(This, 0, This->levels[0].ddsd.dwWidth, This->levels[0].ddsd.dwHeight,
 			FALSE, TRUE, This->renderer->util);
 	}
-}*/
+}*/
+
+/**
+  * Places a small offscreen surface in a shared atlas page instead of giving
+  * it a texture of its own, so blts from many such surfaces can be drawn
+  * with one texture bound.  Surfaces leave the atlas when they are drawn to.
+  * @param This
+  *  Pointer to texture object with its format set up
+  * @return
+  *  TRUE if the texture was placed in an atlas page
+  */
+static BOOL glTexture__PlaceInAtlas(glTexture *This)
+{
+	MIPLEVEL *mip = &This->levels[0];
+	int bytes = mip->ddsd.ddpfPixelFormat.dwRGBBitCount / 8;
+	if (!This->renderer->atlas) return FALSE;
+	if (!(mip->ddsd.ddsCaps.dwCaps & DDSCAPS_OFFSCREENPLAIN)) return FALSE;
+	if (mip->ddsd.ddsCaps.dwCaps & (DDSCAPS_TEXTURE | DDSCAPS_3DDEVICE | DDSCAPS_PRIMARYSURFACE |
+		DDSCAPS_FRONTBUFFER | DDSCAPS_BACKBUFFER | DDSCAPS_FLIP | DDSCAPS_OVERLAY | DDSCAPS_ZBUFFER)) return FALSE;
+	if (mip->ddsd.ddpfPixelFormat.dwFlags & (DDPF_FOURCC | DDPF_PALETTEINDEXED1 | DDPF_PALETTEINDEXED2 |
+		DDPF_PALETTEINDEXED4 | DDPF_PALETTEINDEXED8 | DDPF_ZBUFFER | DDPF_STENCILBUFFER)) return FALSE;
+	if ((This->miplevel > 1) || This->useconv || (This->target != GL_TEXTURE_2D) || (This->packsize != 1))
+		return FALSE;
+	// Uploads give the rows of the surface buffer as a length in pixels
+	if (!bytes || (mip->ddsd.lPitch % bytes)) return FALSE;
+	// Linear filtering of scaled blts would blend in neighbouring cells
+	if (dxglcfg.BltScale) return FALSE;
+	This->atlas = TextureAtlas_Alloc(This->renderer->atlas, This->internalformats[0], This->format,
+		This->type, This->blttype, mip->ddsd.dwWidth, mip->ddsd.dwHeight, &This->atlasx, &This->atlasy);
+	if (!This->atlas) return FALSE;
+	This->id = This->atlas->id;
+	This->minfilter = This->magfilter = GL_NEAREST;
+	This->wraps = This->wrapt = GL_CLAMP_TO_EDGE;
+	// The cell may still hold a released surface, so start out cleared
+	if (glTexture__AllocLevel(This, 0)) ZeroMemory(mip->buffer, mip->ddsd.lPitch * mip->ddsd.dwHeight);
+	mip->dirty = 1;
+	mip->dirtyrectcount = 0;
+	return TRUE;
+}
+
+/**
+  * Sets up a Direct3D texture without an alpha channel to store its source
+  * color key in the alpha channel when it is uploaded, if ColorKeyAlpha is
+  * enabled.  Formats with no spare bits in their GL storage are stored with
+  * 32 bits per pixel instead.
+  * @param This
+  *  Pointer to texture object with its format set up
+  * @param texformat
+  *  DXGLPIXELFORMAT_* index of the surface format
+  */
+static void glTexture__SetKeyAlpha(glTexture *This, int texformat)
+{
+	DWORD caps = This->levels[0].ddsd.ddsCaps.dwCaps;
+	This->keyalpha = FALSE;
+	This->alphakeyset = (This->levels[0].ddsd.dwFlags & DDSD_CKSRCBLT) ? TRUE : FALSE;
+	This->alphakey = This->levels[0].ddsd.ddckCKSrcBlt.dwColorSpaceLowValue;
+	if (!dxglcfg.ColorKeyAlpha || (This->target != GL_TEXTURE_2D)) return;
+	if (!(caps & DDSCAPS_TEXTURE) || (caps & (DDSCAPS_3DDEVICE | DDSCAPS_PRIMARYSURFACE | DDSCAPS_ZBUFFER))) return;
+	switch (texformat)
+	{
+	case DXGLPIXELFORMAT_RGB555:
+	case DXGLPIXELFORMAT_RGBX8888:
+	case DXGLPIXELFORMAT_RGBX8888_REV:
+		// The unused bits are already stored as alpha
+		break;
+	case DXGLPIXELFORMAT_RGB565:
+		This->useconv = TRUE;
+		This->convfunctionupload = 3;
+		This->convfunctiondownload = 4;
+		This->internalsize = 4;  // Store in 8888 texture
+		ZeroMemory(This->internalformats, 8 * sizeof(GLint));
+		This->internalformats[0] = GL_RGBA8;
+		This->format = GL_BGRA;
+		This->type = GL_UNSIGNED_BYTE;
+		break;
+	case DXGLPIXELFORMAT_RGB888:
+	case DXGLPIXELFORMAT_RGB888_REV:
+		This->useconv = TRUE;
+		This->convfunctionupload = 17;
+		This->convfunctiondownload = 18;
+		This->internalsize = 4;  // Store in 8888 texture
+		ZeroMemory(This->internalformats, 8 * sizeof(GLint));
+		This->internalformats[0] = GL_RGBA8;
+		if (texformat == DXGLPIXELFORMAT_RGB888) This->format = GL_BGRA;
+		else This->format = GL_RGBA;
+		This->type = GL_UNSIGNED_BYTE;
+		break;
+	default:
+		return;
+	}
+	This->keyalpha = TRUE;
+}
+
+/**
+  * Checks if a surface should get its GL texture only when the GPU first
+  * uses it.  Surfaces the application put in system memory are often only
+  * locked or blitted on the CPU, so until then they only need their buffers.
+  * @param This
+  *  Pointer to texture object with its format set up
+  * @return
+  *  TRUE if the texture should start out evicted
+  */
+static BOOL glTexture__DeferAllocation(glTexture *This)
+{
+	DWORD caps = This->levels[0].ddsd.ddsCaps.dwCaps;
+	if (!(caps & DDSCAPS_SYSTEMMEMORY)) return FALSE;
+	// Textures are tracked by the residency manager, which expects them resident when added
+	if (caps & (DDSCAPS_TEXTURE | DDSCAPS_3DDEVICE | DDSCAPS_PRIMARYSURFACE | DDSCAPS_FRONTBUFFER |
+		DDSCAPS_BACKBUFFER | DDSCAPS_FLIP | DDSCAPS_OVERLAY | DDSCAPS_ZBUFFER)) return FALSE;
+	if (This->useconv || This->compressed || This->planar || (This->target != GL_TEXTURE_2D)) return FALSE;
+	return TRUE;
+}
+
+/**
+  * Sets the filters and wrap modes a new texture is created with.
+  * @param This
+  *  Pointer to texture object
+  */
+static void glTexture__SetDefaultFilter(glTexture *This)
+{
+	if ((This->levels[0].ddsd.dwFlags & DDSD_CAPS) && (This->levels[0].ddsd.ddsCaps.dwCaps & DDSCAPS_TEXTURE))
+		This->minfilter = This->magfilter = GL_NEAREST;
+	else
+	{
+		if (This->levels[0].ddsd.ddsCaps.dwCaps & DDSCAPS_PRIMARYSURFACE)
+		{
+			if (dxglcfg.scalingfilter && (glRenderer_GetBPP(This->renderer) > 8))
+				This->minfilter = This->magfilter = GL_LINEAR;
+			else This->minfilter = This->magfilter = GL_NEAREST;
+		}
+		else
+		{
+			if (dxglcfg.BltScale && (glRenderer_GetBPP(This->renderer) > 8))
+				This->minfilter = This->magfilter = GL_LINEAR;
+			else This->minfilter = This->magfilter = GL_NEAREST;
+		}
+	}
+	This->wraps = This->wrapt = GL_CLAMP_TO_EDGE;
+}
 
 void glTexture__FinishCreate(glTexture *This)
 {
 	int texformat = -1;
 	int i;
-	int bytes;
-	//int bytes2;
 	DWORD x, y;
 	GLenum error;
 	DDPIXELFORMAT compformat;
+	GLuint pooledfbo[17];
+	BOOL pooled = FALSE;
+	GLint immutable;
 	numtexformats = END_TEXFORMATS - START_TEXFORMATS;
 	if (This->levels[0].ddsd.ddpfPixelFormat.dwFlags & DDPF_FOURCC)
 	{
@@ -1620,32 +3868,100 @@ void glTexture__FinishCreate(glTexture *This)
 		This->colorbits[3] = 8;
 		This->packsize = 1;
 		break;
-	}
-	glGenTextures(1, &This->id);
-	glUtil_SetTexture(This->renderer->util, 0, This);
-	if ((This->levels[0].ddsd.dwFlags & DDSD_CAPS) && (This->levels[0].ddsd.ddsCaps.dwCaps & DDSCAPS_TEXTURE))
-		This->minfilter = This->magfilter = GL_NEAREST;
-	else
-	{
-		if (This->levels[0].ddsd.ddsCaps.dwCaps & DDSCAPS_PRIMARYSURFACE)
+	case DXGLPIXELFORMAT_FOURCC_YV12:  // Planar 4:2:0 YUV, stored as RGB
+	case DXGLPIXELFORMAT_FOURCC_I420:
+	case DXGLPIXELFORMAT_FOURCC_IYUV:
+	case DXGLPIXELFORMAT_FOURCC_NV12:
+		if (texformat == DXGLPIXELFORMAT_FOURCC_YV12) This->planar = PLANAR_YV12;
+		else if (texformat == DXGLPIXELFORMAT_FOURCC_NV12) This->planar = PLANAR_NV12;
+		else This->planar = PLANAR_I420;
+		This->useconv = TRUE;
+		This->internalsize = 4;
+		This->internalformats[0] = GL_RGBA8;
+		This->format = GL_BGRA;
+		This->type = GL_UNSIGNED_BYTE;
+		if (!This->target) This->target = GL_TEXTURE_2D;
+		This->colororder = 1;
+		This->colorsizes[0] = 255;
+		This->colorsizes[1] = 255;
+		This->colorsizes[2] = 255;
+		This->colorsizes[3] = 255;
+		This->colorbits[0] = 8;
+		This->colorbits[1] = 8;
+		This->colorbits[2] = 8;
+		This->colorbits[3] = 8;
+		This->packsize = 1;
+		break;
+	case DXGLPIXELFORMAT_FOURCC_DXT1:  // S3TC compressed, sampled as blocks when supported
+	case DXGLPIXELFORMAT_FOURCC_DXT2:
+	case DXGLPIXELFORMAT_FOURCC_DXT3:
+	case DXGLPIXELFORMAT_FOURCC_DXT4:
+	case DXGLPIXELFORMAT_FOURCC_DXT5:
+		if (This->renderer->ext->GLEXT_EXT_texture_compression_s3tc)
 		{
-			if (dxglcfg.scalingfilter && (glRenderer_GetBPP(This->renderer) > 8))
-				This->minfilter = This->magfilter = GL_LINEAR;
-			else This->minfilter = This->magfilter = GL_NEAREST;
+			if (This->compressed == COMPRESSED_DXT1) This->internalformats[0] = GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+			else if (This->compressed == COMPRESSED_DXT3) This->internalformats[0] = GL_COMPRESSED_RGBA_S3TC_DXT3_EXT;
+			else This->internalformats[0] = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
 		}
 		else
 		{
-			if (dxglcfg.BltScale && (glRenderer_GetBPP(This->renderer) > 8))
-				This->minfilter = This->magfilter = GL_LINEAR;
-			else This->minfilter = This->magfilter = GL_NEAREST;
+			// Decompressed on upload
+			This->useconv = TRUE;
+			This->internalsize = 4;
+			This->internalformats[0] = GL_RGBA8;
+		}
+		This->format = GL_BGRA;
+		This->type = GL_UNSIGNED_BYTE;
+		if (!This->target) This->target = GL_TEXTURE_2D;
+		This->colororder = 1;
+		This->colorsizes[0] = 255;
+		This->colorsizes[1] = 255;
+		This->colorsizes[2] = 255;
+		This->colorsizes[3] = 255;
+		This->colorbits[0] = 8;
+		This->colorbits[1] = 8;
+		This->colorbits[2] = 8;
+		This->colorbits[3] = 8;
+		This->packsize = 1;
+		break;
+	}
+	glTexture__SetKeyAlpha(This, texformat);
+	if (glTexture__DeferAllocation(This))
+	{
+		// Created by glTexture__Restore the first time the GPU uses it
+		glTexture__SetDefaultFilter(This);
+		glTexture__AllocLevel(This, 0);
+		This->evicted = TRUE;
+		return;
+	}
+	if (glTexture__PlaceInAtlas(This)) return;
+	if (This->renderer->texpool)
+	{
+		This->id = TexturePool_Get(This->renderer->texpool, This->target, This->internalformats[0],
+			DivCeiling(This->levels[0].ddsd.dwWidth, This->packsize), This->levels[0].ddsd.dwHeight,
+			This->miplevel, pooledfbo);
+		if (This->id)
+		{
+			pooled = TRUE;
+			for (i = 0; i < This->miplevel; i++)
+				This->levels[i].fbo.fbo = pooledfbo[i];
 		}
 	}
-	This->wraps = This->wrapt = GL_CLAMP_TO_EDGE;
+	if (!pooled) glGenTextures(1, &This->id);
+	glUtil_SetTexture(This->renderer->util, 0, This);
+	This->immutable = FALSE;
+	if (pooled && This->renderer->ext->GLEXT_ARB_texture_storage)
+	{
+		glGetTexParameteriv(This->target, GL_TEXTURE_IMMUTABLE_FORMAT, &immutable);
+		if (immutable) This->immutable = TRUE;
+	}
+	glTexture__SetDefaultFilter(This);
 	glTexParameteri(This->target, GL_TEXTURE_MIN_FILTER, This->minfilter);
 	glTexParameteri(This->target, GL_TEXTURE_MAG_FILTER, This->magfilter);
 	glTexParameteri(This->target, GL_TEXTURE_WRAP_S, This->wraps);
 	glTexParameteri(This->target, GL_TEXTURE_WRAP_T, This->wrapt);
 	glTexParameteri(This->target, GL_TEXTURE_MAX_LEVEL, This->miplevel - 1);
+	if (pooled) glTexParameteri(This->target, GL_TEXTURE_BASE_LEVEL, 0);
 	/*if ((This->levels[0].ddsd.dwWidth != This->bigwidth) || (This->levels[0].ddsd.dwHeight != This->bigheight))
 	{
 		x = This->bigwidth;
@@ -1656,13 +3972,23 @@ void glTexture__FinishCreate(glTexture *This)
 		x = This->levels[0].ddsd.dwWidth;
 		y = This->levels[0].ddsd.dwHeight;
 	//}
+	if (!pooled && This->renderer->ext->GLEXT_ARB_texture_storage && (This->target == GL_TEXTURE_2D))
+	{
+		// Immutable storage; formats it rejects fall back to glTexImage2D below
+		ClearError();
+		This->renderer->ext->glTexStorage2D(This->target, This->miplevel, This->internalformats[0],
+			DivCeiling(x, This->packsize), y);
+		if (glGetError() == GL_NO_ERROR) This->immutable = TRUE;
+	}
 	for (i = 0; i < This->miplevel; i++)
 	{
-		do
+		// Pooled and immutable textures already have storage of this size and format
+		if (pooled || This->immutable) This->levels[i].dirty = (This->levels[i].dirty | 2) & ~84;
+		else do
 		{
 			ClearError();
 			glTexImage2D(This->target, i, This->internalformats[0], DivCeiling(x, This->packsize), y, 0, This->format, This->type, NULL);
-			This->levels[i].dirty |= 2;
+			This->levels[i].dirty = (This->levels[i].dirty | 2) & ~84;
 			ShrinkMip(&x, &y);
 			error = glGetError();
 			if (error != GL_NO_ERROR)
@@ -1677,92 +4003,721 @@ void glTexture__FinishCreate(glTexture *This)
 			}
 			else break;
 		} while (1);
-		if (This->levels[i].ddsd.ddpfPixelFormat.dwFlags & DDPF_FOURCC)
+	}
+	if (pooled)
+	{
+		// The storage still holds the pixels of the surface it was pooled from
+		for (i = 0; i < This->miplevel; i++)
 		{
-			switch (This->levels[i].ddsd.ddpfPixelFormat.dwFourCC)
-			{
-			case MAKEFOURCC('Y', '8', ' ', ' '):
-			case MAKEFOURCC('Y', '8', '0', '0'):
-			case MAKEFOURCC('G', 'R', 'E', 'Y'):
-				bytes = NextMultipleOf4(This->levels[i].ddsd.dwWidth);
-				//bytes2 = NextMultipleOf4(This->bigwidth);
-			case MAKEFOURCC('Y', '1', '6', ' '):
-			case MAKEFOURCC('U', 'Y', 'V', 'Y'):
-			case MAKEFOURCC('U', 'Y', 'N', 'V'):
-			case MAKEFOURCC('Y', '4', '2', '2'):
-			case MAKEFOURCC('Y', 'U', 'Y', '2'):
-			case MAKEFOURCC('Y', 'U', 'Y', 'V'):
-			case MAKEFOURCC('Y', 'U', 'N', 'V'):
-			case MAKEFOURCC('Y', 'V', 'Y', 'U'):
-			case MAKEFOURCC('R', 'G', 'B', 'G'):
-			case MAKEFOURCC('G', 'R', 'G', 'B'):
-				bytes = NextMultipleOf4(2 * This->levels[i].ddsd.dwWidth);
-				//bytes2 = NextMultipleOf4(2 * This->bigwidth);
-				break;
-			case MAKEFOURCC('A', 'Y', 'U', 'V'):
-			default:
-				bytes = 4 * This->levels[i].ddsd.dwWidth;
-				//bytes2 = 4 * This->bigwidth;
-				break;
-			}
+			if (!glTexture__AllocLevel(This, i)) continue;
+			ZeroMemory(This->levels[i].buffer, glTexture__LevelSize(This, i));
+			This->levels[i].dirty = (This->levels[i].dirty | 1) & ~2;
+			This->levels[i].dirtyrectcount = 0;
 		}
-		else
+	}
+	// The surface buffers of compressed textures always hold their contents
+	if (This->compressed)
+	{
+		for (i = 0; i < This->miplevel; i++)
+			This->levels[i].dirty &= ~2;
+	}
+	// Sub-level buffers are allocated when they are first locked, and so is the
+	// top level of z-buffers, which are rarely locked and start out on the GPU
+	if (!(This->levels[0].ddsd.ddsCaps.dwCaps & DDSCAPS_ZBUFFER)) glTexture__AllocLevel(This, 0);
+	This->automipmap = (This->miplevel > 1) && (This->target == GL_TEXTURE_2D) && !This->compressed &&
+		This->renderer->ext->glGenerateMipmap && !(This->levels[0].ddsd.ddpfPixelFormat.dwFlags &
+		(DDPF_PALETTEINDEXED1 | DDPF_PALETTEINDEXED2 | DDPF_PALETTEINDEXED4 | DDPF_PALETTEINDEXED8 |
+		DDPF_ZBUFFER | DDPF_STENCILBUFFER));
+	if (This->renderer->residency && (This->levels[0].ddsd.ddsCaps.dwCaps & DDSCAPS_TEXTURE) &&
+		!(This->levels[0].ddsd.ddsCaps.dwCaps & DDSCAPS_3DDEVICE) && (This->target == GL_TEXTURE_2D) &&
+		!This->useconv)
+		TextureResidency_Add(This->renderer->residency, This);
+}
+/**
+  * Estimates the video memory used by a texture's storage.
+  * @param This
+  *  Pointer to texture object
+  * @return
+  *  Size of the allocated mipmap levels in bytes
+  */
+GLsizeiptr glTexture__StorageSize(glTexture *This)
+{
+	GLsizeiptr size = 0;
+	DWORD x = This->levels[0].ddsd.dwWidth;
+	DWORD y = This->levels[0].ddsd.dwHeight;
+	int bytes;
+	int i;
+	if (This->compressed && !This->useconv)
+	{
+		for (i = 0; i < This->miplevel; i++)
 		{
-			bytes = NextMultipleOf4((This->levels[i].ddsd.ddpfPixelFormat.dwRGBBitCount *
-				This->levels[i].ddsd.dwWidth) / 8);
-			/*bytes2 = NextMultipleOf4((This->levels[i].ddsd.ddpfPixelFormat.dwRGBBitCount *
-				This->bigwidth) / 8);*/
+			if ((DWORD)i >= This->droppedlevels) size += (GLsizeiptr)ColorConv_BlockSize(This->compressed, x, y);
+			ShrinkMip(&x, &y);
 		}
-		This->levels[i].buffer = (char*)malloc(bytes * This->levels[i].ddsd.dwHeight);
-		/*if ((i == 0) && ((This->levels[i].ddsd.dwWidth != This->bigwidth) || (This->levels[i].ddsd.dwHeight != This->bigheight)))
-			This->levels[i].bigbuffer = (char *)malloc(bytes2 * This->bigheight);*/
+		return size;
+	}
+	if (This->useconv) bytes = This->internalsize;
+	else if (This->levels[0].ddsd.ddpfPixelFormat.dwFlags & DDPF_FOURCC) bytes = 4;
+	else bytes = (This->levels[0].ddsd.ddpfPixelFormat.dwRGBBitCount + 7) / 8;
+	if (!bytes) bytes = 4;
+	for (i = 0; i < This->miplevel; i++)
+	{
+		if ((DWORD)i >= This->droppedlevels) size += (GLsizeiptr)x * y * bytes;
+		ShrinkMip(&x, &y);
+	}
+	return size;
+}
+
+/**
+  * Copies between the multisampled or scaled renderbuffer of a texture and
+  * the texture's top level through the scratch framebuffers of glUtil.
+  * Scaled color images are filtered, depth can only be copied per sample.
+  * @param This
+  *  Pointer to texture object with a multisampled or scaled renderbuffer
+  * @param resolve
+  *  TRUE to resolve the renderbuffer into the texture, FALSE to copy the
+  *  texture into the renderbuffer
+  */
+static void glTexture__BlitMSAA(glTexture *This, BOOL resolve)
+{
+	glUtil *util = This->renderer->util;
+	glExtensions *ext = This->renderer->ext;
+	BOOL depthwrite = util->depthwrite;
+	GLsizei width = This->msaawidth / This->msaascale;
+	GLsizei height = This->msaaheight / This->msaascale;
+	GLenum attachment;
+	GLbitfield mask;
+	GLenum filter = GL_NEAREST;
+	if (This->levels[0].ddsd.ddsCaps.dwCaps & DDSCAPS_ZBUFFER)
+	{
+		attachment = This->zhasstencil ? GL_DEPTH_STENCIL_ATTACHMENT : GL_DEPTH_ATTACHMENT;
+		mask = This->zhasstencil ? (GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT) : GL_DEPTH_BUFFER_BIT;
+	}
+	else
+	{
+		attachment = GL_COLOR_ATTACHMENT0;
+		mask = GL_COLOR_BUFFER_BIT;
+		if (This->msaascale > 1) filter = GL_LINEAR;
+	}
+	if (!util->resolvefbo[0]) ext->glGenFramebuffers(2, util->resolvefbo);
+	ext->glBindFramebuffer(GL_FRAMEBUFFER, util->resolvefbo[0]);
+	ext->glFramebufferRenderbuffer(GL_FRAMEBUFFER, attachment, GL_RENDERBUFFER, This->msaarb);
+	ext->glBindFramebuffer(GL_FRAMEBUFFER, util->resolvefbo[1]);
+	ext->glFramebufferTexture2D(GL_FRAMEBUFFER, attachment, This->target, This->id, 0);
+	ext->glBindFramebuffer(GL_READ_FRAMEBUFFER, util->resolvefbo[resolve ? 0 : 1]);
+	ext->glBindFramebuffer(GL_DRAW_FRAMEBUFFER, util->resolvefbo[resolve ? 1 : 0]);
+	// Blits are clipped by the scissor and depth writes are masked
+	if (util->scissorenabled) glDisable(GL_SCISSOR_TEST);
+	glUtil_DepthWrite(util, TRUE);
+	if (resolve) ext->glBlitFramebuffer(0, 0, This->msaawidth, This->msaaheight, 0, 0, width, height,
+		mask, filter);
+	else ext->glBlitFramebuffer(0, 0, width, height, 0, 0, This->msaawidth, This->msaaheight,
+		mask, filter);
+	glUtil_DepthWrite(util, depthwrite);
+	if (util->scissorenabled) glEnable(GL_SCISSOR_TEST);
+	ext->glFramebufferTexture2D(GL_FRAMEBUFFER, attachment, This->target, 0, 0);
+	ext->glBindFramebuffer(GL_FRAMEBUFFER, util->resolvefbo[0]);
+	ext->glFramebufferRenderbuffer(GL_FRAMEBUFFER, attachment, GL_RENDERBUFFER, 0);
+	ext->glBindFramebuffer(GL_FRAMEBUFFER, util->currentfbo ? util->currentfbo->fbo : 0);
+}
+
+/**
+  * Creates the multisampled or scaled renderbuffer 3D rendering to a texture
+  * draws into, or recreates it if the surface size, sample count or scale
+  * changed.
+  * @param This
+  *  Pointer to texture object
+  * @param samples
+  *  Number of samples per pixel, 0 if the renderbuffer is only scaled
+  * @param scale
+  *  Size of the renderbuffer as a multiple of the surface size
+  * @return
+  *  TRUE if the texture has a usable renderbuffer
+  */
+BOOL glTexture__InitMSAA(glTexture *This, GLsizei samples, GLsizei scale)
+{
+	glExtensions *ext = This->renderer->ext;
+	MIPLEVEL *mip = &This->levels[0];
+	GLenum error;
+	if (This->msaastate == MSAA_FAILED) return FALSE;
+	// Converted and packed formats don't store the surface format in the texture
+	if ((This->target != GL_TEXTURE_2D) || This->useconv || (This->packsize > 1)) return FALSE;
+	if (This->msaarb && (This->msaasamples == samples) && (This->msaascale == scale) &&
+		(This->msaawidth == (GLsizei)mip->ddsd.dwWidth * scale) && (This->msaaheight == (GLsizei)mip->ddsd.dwHeight * scale)) return TRUE;
+	if (This->msaarb)
+	{
+		glTexture__ResolveMSAA(This);
+		glTexture__DeleteMSAA(This);
+	}
+	if (This->atlas) glTexture__LeaveAtlas(This);
+	ext->glGenRenderbuffers(1, &This->msaarb);
+	ext->glBindRenderbuffer(GL_RENDERBUFFER, This->msaarb);
+	ClearError();
+	ext->glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, This->internalformats[0],
+		mip->ddsd.dwWidth * scale, mip->ddsd.dwHeight * scale);
+	error = glGetError();
+	ext->glBindRenderbuffer(GL_RENDERBUFFER, 0);
+	if (error != GL_NO_ERROR)
+	{
+		glTexture__DeleteMSAA(This);
+		This->msaastate = MSAA_FAILED;
+		return FALSE;
+	}
+	This->msaasamples = samples;
+	This->msaascale = scale;
+	This->msaawidth = mip->ddsd.dwWidth * scale;
+	This->msaaheight = mip->ddsd.dwHeight * scale;
+	This->msaastate = MSAA_RELOAD;
+	return TRUE;
+}
+
+/**
+  * Resolves or scales down the renderbuffer into the texture if it was drawn
+  * to since the last resolve.  Called before the texture is read.
+  * @param This
+  *  Pointer to texture object
+  */
+void glTexture__ResolveMSAA(glTexture *This)
+{
+	if (!This->msaarb || (This->msaastate != MSAA_RESOLVE)) return;
+	glTexture__BlitMSAA(This, TRUE);
+	This->msaastate = MSAA_SYNCED;
+}
+
+/**
+  * Copies the texture into the renderbuffer if the texture was
+  * written since the renderbuffer was last drawn to.  Called before 3D
+  * rendering draws into the renderbuffer.
+  * @param This
+  *  Pointer to texture object
+  */
+void glTexture__LoadMSAA(glTexture *This)
+{
+	if (!This->msaarb || (This->msaastate != MSAA_RELOAD)) return;
+	glTexture__BlitMSAA(This, FALSE);
+	This->msaastate = MSAA_SYNCED;
+}
+
+/**
+  * Resolves the multisampled renderbuffer and marks it stale.  Called before
+  * the texture is written by anything other than 3D rendering.
+  * @param This
+  *  Pointer to texture object
+  */
+void glTexture__InvalidateMSAA(glTexture *This)
+{
+	if (!This->msaarb) return;
+	glTexture__ResolveMSAA(This);
+	This->msaastate = MSAA_RELOAD;
+}
+
+/**
+  * Deletes the multisampled renderbuffer of a texture without resolving it.
+  * @param This
+  *  Pointer to texture object
+  */
+void glTexture__DeleteMSAA(glTexture *This)
+{
+	if (!This->msaarb) return;
+	glUtil_InvalidateFBOs(This->renderer->util, This);
+	This->renderer->ext->glDeleteRenderbuffers(1, &This->msaarb);
+	This->msaarb = 0;
+	This->msaasamples = This->msaascale = This->msaawidth = This->msaaheight = 0;
+}
+
+/**
+  * Drops the contents of a mipmap level that the renderer is about to replace
+  * whole.  CPU writes that were not uploaded yet are discarded instead of
+  * uploaded, and the driver doesn't have to keep or load the old texels.
+  * @param This
+  *  Pointer to texture object
+  * @param level
+  *  Mipmap level to discard
+  */
+void glTexture__Discard(glTexture *This, GLint level)
+{
+	MIPLEVEL *mip = &This->levels[level];
+	glExtensions *ext = This->renderer->ext;
+	// The application may still be writing to the surface buffer
+	if (mip->locked || mip->lockmapped || mip->writewatch || (mip->gdi && mip->gdi->dcout)) return;
+	mip->dirty &= ~1;
+	mip->dirtyrectcount = 0;
+	// Atlas pages are shared, multisampled contents are resolved into the texture first
+	if (ext->GLEXT_ARB_invalidate_subdata && This->id && !This->evicted && !This->atlas && !This->msaarb)
+		ext->glInvalidateTexImage(This->id, level);
+}
+
+/**
+  * Checks whether a texture's GL storage can be deleted and recreated later
+  * from the surface buffers.
+  * @param This
+  *  Pointer to texture object
+  * @return
+  *  TRUE if the texture can be evicted now
+  */
+BOOL glTexture__CanEvict(glTexture *This)
+{
+	int i;
+	if (This->evicted || This->atlas || This->msaarb || !This->id) return FALSE;
+	if (This->levels[0].ddsd.ddsCaps.dwCaps & DDSCAPS_3DDEVICE) return FALSE;
+	if ((This->renderer->readbacktexture == This) || (This->renderer->scenetexture == This)) return FALSE;
+	for (i = 0; i < This->miplevel; i++)
+	{
+		// Locked levels and contents held only in a lock buffer stay on the GPU side
+		if (This->levels[i].locked || (This->levels[i].dirty & 16)) return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+  * Moves a texture out of video memory.  Levels last written by the GPU are
+  * read back into their buffers, then the GL texture and the framebuffers
+  * of its levels are deleted.  Generated sub-levels are not read back, they
+  * are generated again when the texture is restored.
+  * @param This
+  *  Pointer to texture object
+  */
+void glTexture__Evict(glTexture *This)
+{
+	int i;
+	for (i = 0; i < This->miplevel; i++)
+	{
+		if (i && This->automipmap) break;
+		if (This->levels[i].dirty & 2) glTexture__Download(This, i);
+	}
+	glUtil_InvalidateFBOs(This->renderer->util, This);
+	for (i = 0; i < This->levelcount; i++)
+	{
+		if (!This->levels[i].fbo.fbo) continue;
+		if (This->renderer->util->currentfbo == &This->levels[i].fbo)
+			glUtil_SetFBO(This->renderer->util, NULL);
+		glUtil_DeleteFBO(This->renderer->util, &This->levels[i].fbo);
+		This->levels[i].fbz = NULL;
+	}
+	glTexture__DeleteIntegerView(This);
+	glTexture__ReleaseHandles(This);
+	glDeleteTextures(1, &This->id);
+	This->id = 0;
+	This->immutable = FALSE;
+	This->droppedlevels = 0;
+	This->evicted = TRUE;
+}
+
+/**
+  * Recreates the GL texture of an evicted texture and uploads its levels
+  * from the surface buffers.  Levels more detailed than the LOD set with
+  * SetLOD are not allocated, they stay CPU-dirty in their buffers until
+  * glTexture__AllocateDropped is called for them.
+  * @param This
+  *  Pointer to evicted texture object
+  */
+void glTexture__Restore(glTexture *This)
+{
+	DWORD x = This->levels[0].ddsd.dwWidth;
+	DWORD y = This->levels[0].ddsd.dwHeight;
+	int i;
+	if (!This->evicted) return;
+	if (This->blockid)
+	{
+		glDeleteTextures(1, &This->blockid);
+		This->blockid = 0;
+	}
+	This->evicted = FALSE;
+	glGenTextures(1, &This->id);
+	glUtil_SetActiveTexture(This->renderer->util, 0);
+	glUtil_SetTexture(This->renderer->util, 0, This);
+	glTexParameteri(This->target, GL_TEXTURE_MIN_FILTER, This->minfilter);
+	glTexParameteri(This->target, GL_TEXTURE_MAG_FILTER, This->magfilter);
+	glTexParameteri(This->target, GL_TEXTURE_WRAP_S, This->wraps);
+	glTexParameteri(This->target, GL_TEXTURE_WRAP_T, This->wrapt);
+	glTexParameteri(This->target, GL_TEXTURE_MAX_LEVEL, This->miplevel - 1);
+	if (This->appliedlod) glTexParameteri(This->target, GL_TEXTURE_BASE_LEVEL, This->appliedlod);
+	// Immutable storage always holds the whole chain, dropping levels needs mutable storage
+	if (This->appliedlod && !This->automipmap) This->droppedlevels = This->appliedlod;
+	if (This->renderer->ext->GLEXT_ARB_texture_storage && !This->droppedlevels)
+	{
+		ClearError();
+		This->renderer->ext->glTexStorage2D(This->target, This->miplevel, This->internalformats[0],
+			DivCeiling(x, This->packsize), y);
+		if (glGetError() == GL_NO_ERROR) This->immutable = TRUE;
+	}
+	for (i = 0; i < This->miplevel; i++)
+	{
+		if (!This->immutable && ((DWORD)i >= This->droppedlevels))
+			glTexImage2D(This->target, i, This->internalformats[0],
+				DivCeiling(x, This->packsize), y, 0, This->format, This->type, NULL);
+		ShrinkMip(&x, &y);
+		This->levels[i].dirty &= ~2;
+	}
+	for (i = 0; i < This->miplevel; i++)
+	{
+		if (i && This->automipmap) break;
+		if (!This->levels[i].buffer) continue;
+		This->levels[i].dirty |= 1;
+		This->levels[i].dirtyrectcount = 0;
+		if ((DWORD)i >= This->droppedlevels) glTexture__Upload(This, i);
+	}
+}
+
+/**
+  * Allocates the levels left out by glTexture__Restore because they were
+  * more detailed than the LOD, and uploads them from their buffers.  Called
+  * before a dropped level is uploaded to, drawn to or sampled.
+  * @param This
+  *  Pointer to texture object
+  */
+void glTexture__AllocateDropped(glTexture *This)
+{
+	DWORD x = This->levels[0].ddsd.dwWidth;
+	DWORD y = This->levels[0].ddsd.dwHeight;
+	DWORD dropped = This->droppedlevels;
+	DWORD i;
+	if (!dropped || This->evicted) return;
+	This->droppedlevels = 0;
+	glUtil_SetActiveTexture(This->renderer->util, 0);
+	glUtil_SetTexture(This->renderer->util, 0, This);
+	for (i = 0; i < dropped; i++)
+	{
+		glTexImage2D(This->target, i, This->internalformats[0],
+			DivCeiling(x, This->packsize), y, 0, This->format, This->type, NULL);
+		ShrinkMip(&x, &y);
+	}
+	if (This->residency) TextureResidency_Resize(This->residency, This);
+	for (i = 0; i < dropped; i++)
+	{
+		if (!This->levels[i].buffer) continue;
+		This->levels[i].dirty |= 1;
+		This->levels[i].dirtyrectcount = 0;
+		glTexture__Upload(This, i);
+	}
+}
+
+/**
+  * Restores a texture if it was evicted, through its residency manager so
+  * the manager's accounting stays correct.
+  * @param This
+  *  Pointer to texture object
+  */
+void glTexture__MakeResident(glTexture *This)
+{
+	if (!This->evicted) return;
+	if (This->residency) TextureResidency_Restore(This->residency, This);
+	else glTexture__Restore(This);
+}
+
+/**
+  * Evicts a texture and replaces it with a block compressed copy of its
+  * levels, which is drawn with until the texture is restored.
+  * @param This
+  *  Pointer to texture object that can be evicted
+  * @param job
+  *  Finished compression job of the texture
+  */
+void glTexture__Compress(glTexture *This, BlockCompressJob *job)
+{
+	GLenum format = job->alpha ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+	int i;
+	glTexture__Evict(This);
+	glGenTextures(1, &This->blockid);
+	This->blocksize = job->size;
+	// Evicted textures bind their compressed copy
+	glUtil_SetActiveTexture(This->renderer->util, 0);
+	glUtil_SetTexture(This->renderer->util, 0, This);
+	glTexParameteri(This->target, GL_TEXTURE_MIN_FILTER, This->minfilter);
+	glTexParameteri(This->target, GL_TEXTURE_MAG_FILTER, This->magfilter);
+	glTexParameteri(This->target, GL_TEXTURE_WRAP_S, This->wraps);
+	glTexParameteri(This->target, GL_TEXTURE_WRAP_T, This->wrapt);
+	glTexParameteri(This->target, GL_TEXTURE_MAX_LEVEL, This->miplevel - 1);
+	if (This->appliedlod) glTexParameteri(This->target, GL_TEXTURE_BASE_LEVEL, This->appliedlod);
+	for (i = 0; i < job->levels; i++)
+		glCompressedTexImage2D(This->target, i, format, job->width[i], job->height[i], 0,
+			job->blocksize[i], job->blocks[i]);
+}
+
+/**
+  * Checks at the first use of a texture whether its larger levels should
+  * stream in over the next frames, and if so sets the level drawn with
+  * until they do to the largest level of at most STREAM_FIRSTSIZE bytes.
+  * @param This
+  *  Pointer to texture object
+  */
+static void glTexture__StartStream(glTexture *This)
+{
+	int i;
+	This->streamchecked = TRUE;
+	if (!dxglcfg.StreamMipmaps || (This->miplevel < 2) || This->automipmap || This->bindless) return;
+	if (!(This->levels[0].ddsd.ddsCaps.dwCaps & DDSCAPS_TEXTURE) || (This->target != GL_TEXTURE_2D)) return;
+	if (glTexture__LevelSize(This, 0) < STREAM_MINSIZE) return;
+	// Nothing to stream if the application has not written the top level
+	if (!glTexture__CPUDirty(This, 0)) return;
+	for (i = 1; i < This->miplevel - 1; i++)
+		if (glTexture__LevelSize(This, i) <= STREAM_FIRSTSIZE) break;
+	This->streamlod = i;
+	This->streamframe = This->renderer->perf.frame.dwFrame;
+}
+
+/**
+  * Moves the level drawn with of a streaming texture past the levels that
+  * have arrived, and uploads the next larger level unless a level was
+  * streamed this frame already or the frame's upload budget is spent.
+  * @param This
+  *  Pointer to streaming texture object
+  */
+static void glTexture__StreamLevel(glTexture *This)
+{
+	GLsizeiptr budget = (GLsizeiptr)dxglcfg.TextureUploadBudget * 1024;
+	DWORD frame = This->renderer->perf.frame.dwFrame;
+	// Levels may have been uploaded from the pending uploads or for a blit
+	while (This->streamlod && !glTexture__CPUDirty(This, This->streamlod - 1)) This->streamlod--;
+	if (!This->streamlod || (This->streamframe == frame)) return;
+	if (budget && (This->renderer->uploadbytes >= budget)) return;
+	This->streamlod--;
+	This->streamframe = frame;
+	glTexture__Upload(This, This->streamlod);
+}
+
+/**
+  * Sets the most detailed level sampled to the level requested with SetLOD
+  * and uploads the levels written by the CPU.  Levels more detailed than the
+  * LOD stay in their buffers until the LOD is lowered or they are uploaded
+  * for another use.  With StreamMipmaps the base level is also held at the
+  * most detailed level streamed in so far.  Called before the texture is
+  * bound for drawing.
+  * @param This
+  *  Pointer to texture object
+  */
+void glTexture__ApplyLOD(glTexture *This)
+{
+	DWORD base;
+	int i;
+	if (!This->streamchecked) glTexture__StartStream(This);
+	if (This->streamlod) glTexture__StreamLevel(This);
+	base = max(This->lod, This->streamlod);
+	// Levels dropped when the texture was restored come back with a lower LOD
+	if (base < This->droppedlevels) glTexture__AllocateDropped(This);
+	// Bindless handles freeze the base level, GetHandle refuses textures with a LOD
+	if ((This->appliedlod != base) && !This->bindless)
+	{
+		glUtil_SetActiveTexture(This->renderer->util, 0);
+		glUtil_SetTexture(This->renderer->util, 0, This);
+		glTexParameteri(This->target, GL_TEXTURE_BASE_LEVEL, base);
+		This->appliedlod = base;
+	}
+	for (i = 0; i < This->miplevel; i++)
+	{
+		if (!glTexture__CPUDirty(This, i)) continue;
+		// Generated sub-levels come from the top level
+		if ((DWORD)i < base && !This->automipmap) continue;
+		glTexture__Upload(This, i);
+	}
+}
+
+/**
+  * Gets an R8UI view of the storage of an 8-bit palette texture, so integer
+  * ROPs can read the raw palette indices.  The view shares the storage of the
+  * texture, so uploads and drawing to either are seen by both.
+  * @param This
+  *  Pointer to texture object
+  * @return
+  *  Name of the view, or 0 if the texture can't be viewed as an integer texture
+  */
+GLuint glTexture__GetIntegerView(glTexture *This)
+{
+	if (This->intview) return This->intview;
+	if (!This->renderer->ext->GLEXT_ARB_texture_view || !This->immutable || This->atlas || This->evicted)
+		return 0;
+	if ((This->blttype != 0x10) || (This->internalformats[0] != GL_R8) || (This->target != GL_TEXTURE_2D))
+		return 0;
+	glGenTextures(1, &This->intview);
+	ClearError();
+	This->renderer->ext->glTextureView(This->intview, GL_TEXTURE_2D, This->id, GL_R8UI, 0, This->miplevel, 0, 1);
+	if (glGetError() != GL_NO_ERROR)
+	{
+		glDeleteTextures(1, &This->intview);
+		This->intview = 0;
+		return 0;
 	}
+	// Integer textures can only be sampled without filtering
+	glUtil_SetActiveTexture(This->renderer->util, 0);
+	glBindTexture(GL_TEXTURE_2D, This->intview);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	return This->intview;
+}
+
+/**
+  * Gets a resident bindless handle for sampling a texture with a sampler
+  * object.  Once a texture has handles its parameters, including the base
+  * level set by SetLOD, can't change until the GL texture is replaced.
+  * @param This
+  *  Pointer to texture object
+  * @param sampler
+  *  Name of the sampler object to sample the texture with
+  * @return
+  *  Handle of the texture and sampler, or 0 if the texture has to be bound
+  */
+GLuint64 glTexture__GetHandle(glTexture *This, GLuint sampler)
+{
+	GLuint64 handle;
+	int i;
+	if (!This->renderer->ext->GLEXT_ARB_bindless_texture || !sampler) return 0;
+	if (This->msaastate == MSAA_RESOLVE) glTexture__ResolveMSAA(This);
+	if (!This->immutable || This->evicted || This->atlas || (This->target != GL_TEXTURE_2D))
+		return 0;
+	// A nonzero base level would be frozen by the handle
+	if (This->appliedlod || This->lod) return 0;
+	for (i = 0; i < 4; i++)
+		if (This->handles[i] && (This->handlesamplers[i] == sampler)) return This->handles[i];
+	handle = This->renderer->ext->glGetTextureSamplerHandleARB(This->id, sampler);
+	if (!handle) return 0;
+	This->renderer->ext->glMakeTextureHandleResidentARB(handle);
+	i = This->nexthandle;
+	if (This->handles[i]) This->renderer->ext->glMakeTextureHandleNonResidentARB(This->handles[i]);
+	This->handles[i] = handle;
+	This->handlesamplers[i] = sampler;
+	This->nexthandle = (i + 1) & 3;
+	This->bindless = TRUE;
+	return handle;
+}
+
+/**
+  * Forgets the bindless handles of a texture.  Must be called when the GL
+  * texture is deleted, which also deletes its handles.
+  * @param This
+  *  Pointer to texture object
+  */
+void glTexture__ReleaseHandles(glTexture *This)
+{
+	ZeroMemory(This->handles, sizeof(This->handles));
+	ZeroMemory(This->handlesamplers, sizeof(This->handlesamplers));
+	This->nexthandle = 0;
+	This->bindless = FALSE;
 }
+
+/**
+  * Deletes the integer view of a texture.  Must be called before the
+  * storage of the texture is deleted or replaced.
+  * @param This
+  *  Pointer to texture object
+  */
+void glTexture__DeleteIntegerView(glTexture *This)
+{
+	if (!This->intview) return;
+	glDeleteTextures(1, &This->intview);
+	This->intview = 0;
+}
+
 void glTexture__Destroy(glTexture *This)
 {
+	GLuint fbo[17];
+	BOOL pooled = FALSE;
+	int i;
 	glRenderer__RemoveTextureFromD3D(This->renderer, This);
-	glDeleteTextures(1, &This->id);
+	if (This->renderer->readbacktexture == This) This->renderer->readbacktexture = NULL;
+	if (This->renderer->scenetexture == This) This->renderer->scenetexture = NULL;
+	glUtil_InvalidateFBOs(This->renderer->util, This);
+	glTexture__DeleteMSAA(This);
+	glTexture__DeleteIntegerView(This);
+	if (This->residency) TextureResidency_Remove(This->residency, This);
+	if (This->atlas)
+	{
+		// The page texture is shared with other surfaces
+		if (This->renderer->atlas) TextureAtlas_Free(This->renderer->atlas, This->atlas);
+		This->atlas = NULL;
+		This->id = 0;
+	}
+	ZeroMemory(fbo, 17 * sizeof(GLuint));
+	for (i = 0; i < This->levelcount; i++)
+	{
+		if (!This->levels[i].fbo.fbo) continue;
+		if (This->renderer->util->currentfbo == &This->levels[i].fbo)
+			glUtil_SetFBO(This->renderer->util, NULL);
+		// A framebuffer that still references a depth buffer can't be handed out again
+		if (This->levels[i].fbo.fbz) This->renderer->ext->glDeleteFramebuffers(1, &This->levels[i].fbo.fbo);
+		else fbo[i] = This->levels[i].fbo.fbo;
+	}
+	// Depth buffers may still be attached to live framebuffers, so they aren't pooled,
+	// textures with bindless handles can't have their parameters reset, and levels
+	// dropped by SetLOD have no storage
+	if (This->renderer->texpool && This->id && This->initialized && !This->bindless &&
+		!This->droppedlevels && !(This->levels[0].ddsd.ddsCaps.dwCaps & DDSCAPS_ZBUFFER))
+	{
+		// The next surface samples from level 0, SetLOD and streaming raise the base level
+		if (This->appliedlod || This->streamlod)
+		{
+			glUtil_SetTexture(This->renderer->util, 0, This);
+			glTexParameteri(This->target, GL_TEXTURE_BASE_LEVEL, 0);
+			This->appliedlod = 0;
+			This->streamlod = 0;
+		}
+		pooled = TexturePool_Put(This->renderer->texpool, This->target, This->internalformats[0],
+			DivCeiling(This->levels[0].ddsd.dwWidth, This->packsize), This->levels[0].ddsd.dwHeight,
+			This->miplevel, This->id, fbo, glTexture__StorageSize(This));
+	}
+	if (!pooled)
+	{
+		glDeleteTextures(1, &This->id);
+		for (i = 0; i < This->levelcount; i++)
+			if (fbo[i]) This->renderer->ext->glDeleteFramebuffers(1, &fbo[i]);
+	}
+	if (This->rawid) glDeleteTextures(1, &This->rawid);
+	if (This->blockid) glDeleteTextures(1, &This->blockid);
+	if (This->rawplanes[0]) glDeleteTextures(2, This->rawplanes);
+	if (This->rawfbo) This->renderer->ext->glDeleteFramebuffers(1, &This->rawfbo);
+	for (i = 0; i < This->levelcount; i++)
+	{
+		if (This->levels[i].packfence) This->renderer->ext->glDeleteSync(This->levels[i].packfence);
+		if (This->levels[i].pboPack) BufferObject_Release(This->levels[i].pboPack);
+		if (This->levels[i].lockfence) This->renderer->ext->glDeleteSync(This->levels[i].lockfence);
+		if (This->levels[i].pboLock) BufferObject_Release(This->levels[i].pboLock);
+	}
 	if (This->pboPack) BufferObject_Release(This->pboPack);
 	if (This->pboUnpack) BufferObject_Release(This->pboUnpack);
+	free(This->levels);
 	if (This->freeonrelease) free(This);
 	else ZeroMemory(This, sizeof(glTexture));
 }
 
-void glTexture__SetFilter(glTexture *This, int level, GLint mag, GLint min, glRenderer *renderer)
+// Replaces the filters with the ones forced by the TextureFilter setting
+void glTexture__ConfigFilter(GLint *mag, GLint *min)
 {
-	// 'This' pointer may be set to NULL to set a sampler level when ARB_sampler_objects is available
 	switch (dxglcfg.texfilter)
 	{
 	default:
 		break;
 	case 1:
-		mag = min = GL_NEAREST;
+		*mag = *min = GL_NEAREST;
 		break;
 	case 2:
-		mag = min = GL_LINEAR;
+		*mag = *min = GL_LINEAR;
 		break;
 	case 3:
-		mag = GL_NEAREST;
-		min = GL_NEAREST_MIPMAP_NEAREST;
+		*mag = GL_NEAREST;
+		*min = GL_NEAREST_MIPMAP_NEAREST;
 		break;
 	case 4:
-		mag = GL_NEAREST;
-		min = GL_NEAREST_MIPMAP_LINEAR;
+		*mag = GL_NEAREST;
+		*min = GL_NEAREST_MIPMAP_LINEAR;
 		break;
 	case 5:
-		mag = GL_LINEAR;
-		min = GL_LINEAR_MIPMAP_NEAREST;
+		*mag = GL_LINEAR;
+		*min = GL_LINEAR_MIPMAP_NEAREST;
 		break;
 	case 6:
-		mag = GL_LINEAR;
-		min = GL_LINEAR_MIPMAP_LINEAR;
+		*mag = GL_LINEAR;
+		*min = GL_LINEAR_MIPMAP_LINEAR;
 		break;
 	}
+}
+
+void glTexture__SetFilter(glTexture *This, int level, GLint mag, GLint min, glRenderer *renderer)
+{
+	// 'This' pointer may be set to NULL to set a sampler level when ARB_sampler_objects is available
+	glTexture__ConfigFilter(&mag, &min);
 	if (renderer->ext->GLEXT_ARB_sampler_objects)
-	{
-		renderer->ext->glSamplerParameteri(renderer->util->samplers[level].id, GL_TEXTURE_MAG_FILTER, mag);
-		renderer->ext->glSamplerParameteri(renderer->util->samplers[level].id, GL_TEXTURE_MIN_FILTER, min);
-	}
+		glUtil_SetSampler(renderer->util, level, renderer->util->samplers[level].wraps,
+			renderer->util->samplers[level].wrapt, min, mag);
 	else
 	{
 		if (This)
@@ -30,13 +30,22 @@ extern int numtexformats;
 
 struct glUtil;
 
+// State of the multisampled renderbuffer of a texture, in glTexture.msaastate
+#define MSAA_SYNCED 0  // Renderbuffer and texture hold the same image
+#define MSAA_RESOLVE 1  // Renderbuffer was drawn to and must be resolved before the texture is read
+#define MSAA_RELOAD 2  // Texture was written and must be copied before the renderbuffer is drawn to
+#define MSAA_FAILED 3  // Renderbuffer could not be created for the texture format
+
 DWORD CalculateMipLevels(DWORD width, DWORD height);
 
 HRESULT glTexture_Create(const DDSURFACEDESC2 *ddsd, glTexture *texture, struct glRenderer *renderer, BOOL backend, GLenum targetoverride);
+HRESULT glTexture_CreateBatch(const DDSURFACEDESC2 **ddsd, glTexture *textures, DWORD count, struct glRenderer *renderer);
 ULONG glTexture_AddRef(glTexture *This);
 ULONG glTexture_Release(glTexture *This, BOOL backend);
 HRESULT glTexture_Lock(glTexture *This, GLint level, LPRECT r, LPDDSURFACEDESC2 ddsd, DWORD flags, BOOL backend);
 HRESULT glTexture_Unlock(glTexture *This, GLint level, LPRECT r, BOOL backend);
+void glTexture_ChangeVersion(glTexture *This, GLint level);
+BOOL glTexture_SoftBlt(BltCommand *cmd);
 HRESULT glTexture_GetDC(glTexture *This, GLint level, HDC *hdc, glDirectDrawPalette *palette);
 HRESULT glTexture_ReleaseDC(glTexture *This, GLint level, HDC hdc);
 void glTexture_SetPalette(glTexture *This, glTexture *palette, BOOL backend);
@@ -44,15 +53,41 @@ void glTexture_SetStencil(glTexture *This, glTexture *stencil, BOOL backend);
 void glTexture_CreateDummyColor(glTexture *This, BOOL backend);
 void glTexture_DeleteDummyColor(glTexture *This, BOOL backend);
 BOOL glTexture_ValidatePixelFormat(DDPIXELFORMAT *pixelformat);
+void glTexture__ConfigFilter(GLint *mag, GLint *min);
 void glTexture__SetFilter(glTexture *This, int level, GLint mag, GLint min, struct glRenderer *renderer);
 HRESULT glTexture__SetSurfaceDesc(glTexture *This, LPDDSURFACEDESC2 ddsd);
 void glTexture__Download(glTexture *This, GLint level);
+BOOL glTexture__DownloadRect(glTexture *This, GLint level, LPRECT r);
+void glTexture__SetAlphaKey(glTexture *This);
+void glTexture__BeginDownload(glTexture *This, GLint level);
+char *glTexture__MapLock(glTexture *This, GLint level);
 void glTexture__Upload(glTexture *This, GLint level);
+DWORD glTexture__LevelSize(glTexture *This, int level);
+BOOL glTexture__CPUDirty(glTexture *This, GLint level);
 void glTexture__Upload2(glTexture *This, int level, int width, int height, BOOL checkerror, BOOL dorealloc, glUtil *util);
 BOOL glTexture__Repair(glTexture *This, BOOL preserve);
 //void glTexture__SetPrimaryScale(glTexture *This, GLint bigwidth, GLint bigheight, BOOL scaling);
 void glTexture__FinishCreate(glTexture *This);
+void glTexture__LeaveAtlas(glTexture *This);
+GLuint glTexture__GetIntegerView(glTexture *This);
+GLuint64 glTexture__GetHandle(glTexture *This, GLuint sampler);
+void glTexture__ReleaseHandles(glTexture *This);
+void glTexture__DeleteIntegerView(glTexture *This);
 void glTexture__Destroy(glTexture *This);
+BOOL glTexture__InitMSAA(glTexture *This, GLsizei samples, GLsizei scale);
+void glTexture__ResolveMSAA(glTexture *This);
+void glTexture__LoadMSAA(glTexture *This);
+void glTexture__InvalidateMSAA(glTexture *This);
+void glTexture__DeleteMSAA(glTexture *This);
+void glTexture__Discard(glTexture *This, GLint level);
+GLsizeiptr glTexture__StorageSize(glTexture *This);
+BOOL glTexture__CanEvict(glTexture *This);
+void glTexture__Evict(glTexture *This);
+void glTexture__Restore(glTexture *This);
+void glTexture__MakeResident(glTexture *This);
+void glTexture__Compress(glTexture *This, struct BlockCompressJob *job);
+void glTexture__ApplyLOD(glTexture *This);
+void glTexture__AllocateDropped(glTexture *This);
 
 #ifdef __cplusplus
 }
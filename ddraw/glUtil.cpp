@@ -20,6 +20,7 @@
 #include "glUtil.h"
 #include "BufferObject.h"
 #include "dxglDirectDrawSurface.h"
+#include "SurfaceProfile.h"
 
 extern "C" {
 
@@ -62,6 +63,15 @@ void glUtil_Create(glExtensions *glext, glUtil **out)
 	util->blendsrc = GL_ONE;
 	util->blenddest = GL_ZERO;
 	util->blendenabled = FALSE;
+	util->colormask[0] = util->colormask[1] = util->colormask[2] = util->colormask[3] = GL_TRUE;
+	util->stenciltest = FALSE;
+	util->stencilfunc = GL_ALWAYS;
+	util->stencilref = 0;
+	util->stencilmask = 0xFFFFFFFF;
+	util->stencilwritemask = 0xFFFFFFFF;
+	util->stencilfail = util->stencilzfail = util->stencilpass = GL_KEEP;
+	util->polyoffsetfactor = 0.0f;
+	util->polyoffsetunits = 0.0f;
 	util->arrays[42];
 	util->cullmode = D3DCULL_NONE;
 	util->cullenabled = FALSE;
@@ -76,14 +86,7 @@ void glUtil_Create(glExtensions *glext, glUtil **out)
 	{
 		memset(util->samplers, 0, 12 * sizeof(SAMPLER));
 		for (i = 0; i < 12; i++)
-		{
-			glext->glGenSamplers(1, &util->samplers[i].id);
-			glext->glBindSampler(i, util->samplers[i].id);
-			glext->glSamplerParameteri(util->samplers[i].id, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-			glext->glSamplerParameteri(util->samplers[i].id, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-			glext->glSamplerParameteri(util->samplers[i].id, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-			glext->glSamplerParameteri(util->samplers[i].id, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-		}
+			glUtil_SetSampler(util, i, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_LINEAR, GL_LINEAR);
 	}
 	util->texlevel = 0;
 	ZeroMemory(util->textures, 16 * sizeof(GLuint));
@@ -105,10 +108,15 @@ void glUtil_Release(glUtil *This)
 			for (i = 0; i < 12; i++)
 			{
 				This->ext->glBindSampler(i, 0);
-				This->ext->glDeleteSamplers(1, &This->samplers[i].id);
 				This->samplers[i].id = 0;
 			}
+			for (i = 0; i < This->samplercachecount; i++)
+				This->ext->glDeleteSamplers(1, &This->samplercache[i].id);
+			if (This->samplercache) free(This->samplercache);
 		}
+		for (i = 0; i < FBOCACHE_SIZE; i++)
+			if (This->fbocache[i].fbo.fbo) This->ext->glDeleteFramebuffers(1, &This->fbocache[i].fbo.fbo);
+		if (This->resolvefbo[0]) This->ext->glDeleteFramebuffers(2, This->resolvefbo);
 		free(This);
 	}
 }
@@ -137,11 +145,18 @@ void glUtil_DeleteFBO(glUtil *This, FBO *fbo)
 
 void glUtil_SetFBOTexture(glUtil *This, FBO *fbo, glTexture *color, glTexture *z, GLint level, GLint zlevel, BOOL stencil)
 {
+	LONGLONG profilestart;
 	if(!color) return;
 	if(!fbo->fbo) return;
+	if((DWORD)level < color->droppedlevels) glTexture__AllocateDropped(color);
 	if(This->ext->GLEXT_ARB_framebuffer_object)
 	{
-		if(This->currentfbo != fbo) This->ext->glBindFramebuffer(GL_FRAMEBUFFER,fbo->fbo);
+		profilestart = SurfaceProfile_Begin(color->profile);
+		if(This->currentfbo != fbo)
+		{
+			This->ext->glBindFramebuffer(GL_FRAMEBUFFER,fbo->fbo);
+			This->fboswitches++;
+		}
 		This->currentfbo = fbo;
 		This->ext->glFramebufferTexture2D(GL_FRAMEBUFFER,GL_COLOR_ATTACHMENT0,color->target,color->id,level);
 		fbo->fbcolor = color;
@@ -160,26 +175,246 @@ void glUtil_SetFBOTexture(glUtil *This, FBO *fbo, glTexture *color, glTexture *z
 		fbo->stencil = stencil;
 		fbo->fbz = z;
 		fbo->status = This->ext->glCheckFramebufferStatus(GL_FRAMEBUFFER);
+		SurfaceProfile_End(color->profile, SURFACEPROFILE_FBO, profilestart, 0);
+	}
+}
+
+/**
+  * Attaches the multisampled renderbuffers of a color and depth buffer pair
+  * to a framebuffer.
+  * @param This
+  *  Pointer to glUtil object
+  * @param fbo
+  *  Framebuffer to attach the renderbuffers to
+  * @param color
+  *  Color buffer texture with a multisampled renderbuffer
+  * @param z
+  *  Depth buffer texture with a multisampled renderbuffer
+  * @param stencil
+  *  TRUE to attach the depth buffer as depth and stencil
+  */
+static void glUtil__SetFBORenderbuffers(glUtil *This, FBO *fbo, glTexture *color, glTexture *z, BOOL stencil)
+{
+	if (This->currentfbo != fbo)
+	{
+		This->ext->glBindFramebuffer(GL_FRAMEBUFFER, fbo->fbo);
+		This->fboswitches++;
+	}
+	This->currentfbo = fbo;
+	This->ext->glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color->msaarb);
+	This->ext->glFramebufferRenderbuffer(GL_FRAMEBUFFER, stencil ? GL_DEPTH_STENCIL_ATTACHMENT : GL_DEPTH_ATTACHMENT,
+		GL_RENDERBUFFER, z->msaarb);
+	fbo->fbcolor = color;
+	fbo->fbz = z;
+	fbo->stencil = stencil;
+	fbo->status = This->ext->glCheckFramebufferStatus(GL_FRAMEBUFFER);
+}
+
+/**
+  * Finds the cached framebuffer for a color and depth buffer pair, attaching
+  * them to the least recently used entry if the pair is not cached.
+  * @param This
+  *  Pointer to glUtil object
+  * @param color
+  *  Color buffer texture
+  * @param z
+  *  Depth buffer texture
+  * @param level
+  *  Mipmap level of the color buffer
+  * @param zlevel
+  *  Mipmap level of the depth buffer
+  * @param stencil
+  *  TRUE to attach the depth buffer as depth and stencil
+  * @param multisample
+  *  TRUE to attach the multisampled renderbuffers of the textures
+  * @return
+  *  Cached framebuffer, or NULL if framebuffer objects are not available
+  */
+static FBOCacheEntry *glUtil__GetCachedFBO(glUtil *This, glTexture *color, glTexture *z, GLint level,
+	GLint zlevel, BOOL stencil, BOOL multisample)
+{
+	FBOCacheEntry *entry = NULL;
+	int i;
+	if (!This->ext->GLEXT_ARB_framebuffer_object) return NULL;
+	This->fbocacheclock++;
+	for (i = 0; i < FBOCACHE_SIZE; i++)
+	{
+		if (!This->fbocache[i].fbo.fbo) continue;
+		if ((This->fbocache[i].fbo.fbcolor == color) && (This->fbocache[i].fbo.fbz == z) &&
+			(This->fbocache[i].level == level) && (This->fbocache[i].zlevel == zlevel) &&
+			(This->fbocache[i].fbo.stencil == stencil) && (This->fbocache[i].multisample == multisample))
+		{
+			This->fbocache[i].lastused = This->fbocacheclock;
+			return &This->fbocache[i];
+		}
+	}
+	for (i = 0; i < FBOCACHE_SIZE; i++)
+	{
+		if (!This->fbocache[i].fbo.fbo)
+		{
+			entry = &This->fbocache[i];
+			break;
+		}
+		if (!entry || (This->fbocache[i].lastused < entry->lastused)) entry = &This->fbocache[i];
+	}
+	// The framebuffer name of a replaced entry is reused unless the attachment type changes
+	if (entry->fbo.fbo && (entry->multisample != multisample))
+	{
+		if (This->currentfbo == &entry->fbo)
+		{
+			This->ext->glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			This->currentfbo = NULL;
+		}
+		This->ext->glDeleteFramebuffers(1, &entry->fbo.fbo);
+		entry->fbo.fbo = 0;
+	}
+	if (!entry->fbo.fbo) glUtil_InitFBO(This, &entry->fbo);
+	entry->level = level;
+	entry->zlevel = zlevel;
+	entry->multisample = multisample;
+	entry->lastused = This->fbocacheclock;
+	if (multisample) glUtil__SetFBORenderbuffers(This, &entry->fbo, color, z, stencil);
+	else glUtil_SetFBOTexture(This, &entry->fbo, color, z, level, zlevel, stencil);
+	return entry;
+}
+
+/**
+  * Deletes the cached framebuffers that have a texture attached.  Must be
+  * called when the texture is destroyed or its storage is replaced.
+  * @param This
+  *  Pointer to glUtil object
+  * @param texture
+  *  Texture whose framebuffers are no longer valid
+  */
+void glUtil_InvalidateFBOs(glUtil *This, glTexture *texture)
+{
+	FBOCacheEntry *entry;
+	int i;
+	for (i = 0; i < FBOCACHE_SIZE; i++)
+	{
+		entry = &This->fbocache[i];
+		if (!entry->fbo.fbo) continue;
+		if ((entry->fbo.fbcolor != texture) && (entry->fbo.fbz != texture)) continue;
+		if ((entry->fbo.fbz == texture) && (entry->fbo.fbcolor->levels[entry->level].fbz == texture))
+			entry->fbo.fbcolor->levels[entry->level].fbz = NULL;
+		if (This->currentfbo == &entry->fbo)
+		{
+			This->ext->glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			This->currentfbo = NULL;
+		}
+		This->ext->glDeleteFramebuffers(1, &entry->fbo.fbo);
+		ZeroMemory(entry, sizeof(FBOCacheEntry));
 	}
 }
 
 // Transitions away from using surface objects and adds miplevel
 GLenum glUtil_SetFBOSurface(glUtil *This, glTexture *surface, glTexture *zbuffer, GLint level, GLint zlevel, BOOL skipz)
 {
+	FBOCacheEntry *entry;
+	glTexture *z;
 	if (!surface) return glUtil_SetFBO(This, (FBO*)NULL);
-	if (skipz)
+	if (surface->evicted) glTexture__MakeResident(surface);
+	// With skipz the depth buffer the level was last drawn with stays attached
+	if (skipz) z = surface->levels[level].fbz;
+	else z = surface->levels[level].fbz = zbuffer;
+	// Drawing to the textures leaves their multisampled renderbuffers stale
+	if (!level) glTexture__InvalidateMSAA(surface);
+	if (!z) return glUtil_SetFBOTextures(This, &surface->levels[level].fbo, surface, NULL, level, 0, FALSE);
+	if (!zlevel) glTexture__InvalidateMSAA(z);
+	// Surfaces that are drawn to need a texture of their own
+	if (surface->atlas) glTexture__LeaveAtlas(surface);
+	entry = glUtil__GetCachedFBO(This, surface, z, level, zlevel, z->zhasstencil, FALSE);
+	if (!entry) return GL_INVALID_ENUM;
+	if (This->currentfbo != &entry->fbo)
 	{
-		if (surface->levels[level].fbo.fbz)
-			return glUtil_SetFBOTextures(This, &surface->levels[level].fbo, surface,
-				surface->levels[level].fbo.fbz, level, zlevel, surface->levels[level].fbo.fbz->zhasstencil);
-		else return glUtil_SetFBOTextures(This, &surface->levels[level].fbo, surface, NULL, level, zlevel, FALSE);
+		This->ext->glBindFramebuffer(GL_FRAMEBUFFER, entry->fbo.fbo);
+		This->currentfbo = &entry->fbo;
+		This->fboswitches++;
 	}
-	else
+	return entry->fbo.status;
+}
+
+/**
+  * Binds a framebuffer with the multisampled renderbuffers of a render
+  * target and depth buffer for 3D rendering.  Textures written since the
+  * renderbuffers were last drawn to are copied into them first, and both
+  * are marked to be resolved before they are next read.
+  * @param This
+  *  Pointer to glUtil object
+  * @param surface
+  *  Render target texture, set up with glTexture__InitMSAA
+  * @param zbuffer
+  *  Depth buffer texture, set up with glTexture__InitMSAA
+  * @return
+  *  Completeness status of the framebuffer
+  */
+GLenum glUtil_SetFBOMultisample(glUtil *This, glTexture *surface, glTexture *zbuffer)
+{
+	FBOCacheEntry *entry;
+	glTexture__LoadMSAA(surface);
+	glTexture__LoadMSAA(zbuffer);
+	surface->levels[0].fbz = zbuffer;
+	entry = glUtil__GetCachedFBO(This, surface, zbuffer, 0, 0, zbuffer->zhasstencil, TRUE);
+	if (!entry) return GL_INVALID_ENUM;
+	if (This->currentfbo != &entry->fbo)
 	{
-		if (zbuffer) return glUtil_SetFBOTextures(This, &surface->levels[level].fbo, surface,
-			zbuffer, level, zlevel, zbuffer->zhasstencil);
-		else return glUtil_SetFBOTextures(This, &surface->levels[level].fbo, surface, NULL, 0, 0, FALSE);
+		This->ext->glBindFramebuffer(GL_FRAMEBUFFER, entry->fbo.fbo);
+		This->currentfbo = &entry->fbo;
+		This->fboswitches++;
 	}
+	surface->msaastate = zbuffer->msaastate = MSAA_RESOLVE;
+	return entry->fbo.status;
+}
+
+/**
+  * Binds one of the scratch framebuffers of glUtil with only a depth buffer
+  * attached, for depth fills and copies that have no color buffer to use.
+  * glUtil_EndFBODepth must be called when done to detach the depth buffer.
+  * @param This
+  *  Pointer to glUtil object
+  * @param index
+  *  Scratch framebuffer to use, 0 or 1
+  * @param target
+  *  GL_FRAMEBUFFER, or GL_READ_FRAMEBUFFER or GL_DRAW_FRAMEBUFFER for blits
+  * @param z
+  *  Depth buffer texture to attach
+  * @param zlevel
+  *  Mipmap level of the depth buffer
+  * @return
+  *  Completeness status of the framebuffer
+  */
+GLenum glUtil_SetFBODepth(glUtil *This, int index, GLenum target, glTexture *z, GLint zlevel)
+{
+	if (!This->resolvefbo[0]) This->ext->glGenFramebuffers(2, This->resolvefbo);
+	This->ext->glBindFramebuffer(target, This->resolvefbo[index]);
+	This->fboswitches++;
+	This->ext->glFramebufferTexture2D(target, z->zhasstencil ? GL_DEPTH_STENCIL_ATTACHMENT : GL_DEPTH_ATTACHMENT,
+		z->target, z->id, zlevel);
+	// Without a color buffer the framebuffer is only complete with no draw or read buffer selected
+	if (target != GL_READ_FRAMEBUFFER) glDrawBuffer(GL_NONE);
+	if (target != GL_DRAW_FRAMEBUFFER) glReadBuffer(GL_NONE);
+	return This->ext->glCheckFramebufferStatus(target);
+}
+
+/**
+  * Detaches the depth buffer attached by glUtil_SetFBODepth and binds the
+  * current framebuffer again.
+  * @param This
+  *  Pointer to glUtil object
+  * @param index
+  *  Scratch framebuffer passed to glUtil_SetFBODepth
+  * @param target
+  *  Target passed to glUtil_SetFBODepth
+  */
+void glUtil_EndFBODepth(glUtil *This, int index, GLenum target)
+{
+	This->ext->glBindFramebuffer(target, This->resolvefbo[index]);
+	// Detaching the depth and stencil attachment detaches both
+	This->ext->glFramebufferTexture2D(target, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, 0, 0);
+	// Multisample resolves share the framebuffer with color attachments
+	if (target != GL_READ_FRAMEBUFFER) glDrawBuffer(GL_COLOR_ATTACHMENT0);
+	if (target != GL_DRAW_FRAMEBUFFER) glReadBuffer(GL_COLOR_ATTACHMENT0);
+	This->ext->glBindFramebuffer(target, This->currentfbo ? This->currentfbo->fbo : 0);
 }
 
 GLenum glUtil_SetFBO(glUtil *This, FBO *fbo)
@@ -189,6 +424,7 @@ GLenum glUtil_SetFBO(glUtil *This, FBO *fbo)
 		if (fbo) return fbo->status;
 		else return GL_FRAMEBUFFER_COMPLETE;
 	}
+	This->fboswitches++;
 	if(!fbo)
 	{
 		if (This->ext->GLEXT_ARB_framebuffer_object) This->ext->glBindFramebuffer(GL_FRAMEBUFFER, 0);
@@ -218,6 +454,8 @@ GLenum glUtil_SetFBOTextures(glUtil *This, FBO *fbo, glTexture *color, glTexture
 	}
 	if(!fbo->fbo) glUtil_InitFBO(This, fbo);
 	if (!color) return GL_INVALID_ENUM;
+	// Surfaces that are drawn to need a texture of their own
+	if (color->atlas) glTexture__LeaveAtlas(color);
 	if((color != fbo->fbcolor) || (z != fbo->fbz) || (stencil != fbo->stencil))
 		glUtil_SetFBOTexture(This, fbo,color,z,level,zlevel,stencil);
 	if(fbo != This->currentfbo) return glUtil_SetFBO(This, fbo);
@@ -234,24 +472,8 @@ void glUtil_SetWrap(glUtil *This, int level, DWORD coord, DWORD address)
 	if(coord > 1) return;
 	if(level > 7) return;
 	if(level < 0) return;
-	GLint wrapmode;
-	switch(address)
-	{
-	case D3DTADDRESS_WRAP:
-		wrapmode = GL_REPEAT;
-		break;
-	case D3DTADDRESS_MIRROR:
-		wrapmode = GL_MIRRORED_REPEAT;
-		break;
-	case D3DTADDRESS_CLAMP:
-		wrapmode = GL_CLAMP_TO_EDGE;
-		break;
-	case D3DTADDRESS_BORDER:
-		wrapmode = GL_CLAMP_TO_BORDER;
-		break;
-	default:
-		return;
-	}
+	GLint wrapmode = glUtil_GetWrapMode(address);
+	if (!wrapmode) return;
 	//if(texwrap[level*2+coord] == wrapmode) return;
 	//else
 	{
@@ -259,22 +481,10 @@ void glUtil_SetWrap(glUtil *This, int level, DWORD coord, DWORD address)
 		//int currtexture = texlevel;
 		if (This->ext->GLEXT_ARB_sampler_objects)
 		{
-			if(coord)
-			{
-				if(This->samplers[level].wrapt != wrapmode)
-				{
-					This->ext->glSamplerParameteri(This->samplers[level].id, GL_TEXTURE_WRAP_T, wrapmode);
-					This->samplers[level].wrapt = wrapmode;
-				}
-			}
-			else
-			{
-				if(This->samplers[level].wraps != wrapmode)
-				{
-					This->ext->glSamplerParameteri(This->samplers[level].id, GL_TEXTURE_WRAP_S, wrapmode);
-					This->samplers[level].wraps = wrapmode;
-				}
-			}
+			if(coord) glUtil_SetSampler(This, level, This->samplers[level].wraps, wrapmode,
+				This->samplers[level].minfilter, This->samplers[level].magfilter);
+			else glUtil_SetSampler(This, level, wrapmode, This->samplers[level].wrapt,
+				This->samplers[level].minfilter, This->samplers[level].magfilter);
 		}
 		else
 		{
@@ -286,6 +496,160 @@ void glUtil_SetWrap(glUtil *This, int level, DWORD coord, DWORD address)
 	}
 }
 
+/**
+  * Converts a D3D texture address mode to a GL wrap mode.
+  * @param address
+  *  D3DTEXTUREADDRESS value to convert
+  * @return
+  *  GL wrap mode, or 0 if the address mode is invalid
+  */
+GLint glUtil_GetWrapMode(DWORD address)
+{
+	switch(address)
+	{
+	case D3DTADDRESS_WRAP:
+		return GL_REPEAT;
+	case D3DTADDRESS_MIRROR:
+		return GL_MIRRORED_REPEAT;
+	case D3DTADDRESS_CLAMP:
+		return GL_CLAMP_TO_EDGE;
+	case D3DTADDRESS_BORDER:
+		return GL_CLAMP_TO_BORDER;
+	default:
+		return 0;
+	}
+}
+
+/**
+  * Binds a sampler object with the given state to a texture unit.  Sampler
+  * objects are shared between units and only created once per distinct state.
+  * Requires ARB_sampler_objects.
+  * @param This
+  *  Pointer to glUtil object
+  * @param level
+  *  Texture unit to bind the sampler to
+  * @param wraps,wrapt
+  *  Wrap modes for the S and T coordinates
+  * @param minfilter,magfilter
+  *  Minification and magnification filters
+  */
+void glUtil_SetSampler(glUtil *This, int level, GLint wraps, GLint wrapt, GLint minfilter, GLint magfilter)
+{
+	SAMPLER state;
+	state.id = 0;
+	state.wraps = wraps;
+	state.wrapt = wrapt;
+	state.minfilter = minfilter;
+	state.magfilter = magfilter;
+	state.bordercolor = 0;
+	state.lodbias = 0.0f;
+	state.anisotropy = 1;
+	glUtil_BindSampler(This, level, &state);
+}
+
+static BOOL glUtil__SamplerMatch(const SAMPLER *a, const SAMPLER *b)
+{
+	return (a->wraps == b->wraps) && (a->wrapt == b->wrapt) && (a->minfilter == b->minfilter)
+		&& (a->magfilter == b->magfilter) && (a->bordercolor == b->bordercolor)
+		&& (a->lodbias == b->lodbias) && (a->anisotropy == b->anisotropy);
+}
+
+/**
+  * Gets the cached sampler object for a D3D texture stage sampler state,
+  * creating it if the state was not used before.  Requires
+  * ARB_sampler_objects.
+  * @param This
+  *  Pointer to glUtil object
+  * @param state
+  *  Sampler state to look up, the id member is ignored
+  * @return
+  *  Cached sampler with its id set, or NULL if the cache couldn't grow
+  */
+static SAMPLER *glUtil__GetSampler(glUtil *This, const SAMPLER *state)
+{
+	SAMPLER *sampler = NULL;
+	SAMPLER *newcache;
+	GLfloat border[4];
+	int i;
+	for (i = 0; i < This->samplercachecount; i++)
+	{
+		if (glUtil__SamplerMatch(&This->samplercache[i], state))
+		{
+			sampler = &This->samplercache[i];
+			break;
+		}
+	}
+	if (!sampler)
+	{
+		if (This->samplercachecount == This->samplercachesize)
+		{
+			newcache = (SAMPLER*)realloc(This->samplercache, (This->samplercachesize + 16) * sizeof(SAMPLER));
+			if (!newcache) return NULL;
+			This->samplercache = newcache;
+			This->samplercachesize += 16;
+		}
+		sampler = &This->samplercache[This->samplercachecount++];
+		*sampler = *state;
+		This->ext->glGenSamplers(1, &sampler->id);
+		This->ext->glSamplerParameteri(sampler->id, GL_TEXTURE_WRAP_S, state->wraps);
+		This->ext->glSamplerParameteri(sampler->id, GL_TEXTURE_WRAP_T, state->wrapt);
+		This->ext->glSamplerParameteri(sampler->id, GL_TEXTURE_MIN_FILTER, state->minfilter);
+		This->ext->glSamplerParameteri(sampler->id, GL_TEXTURE_MAG_FILTER, state->magfilter);
+		// The GL defaults match a zero border color and bias and disabled anisotropy
+		if (state->bordercolor)
+		{
+			border[0] = (GLfloat)((state->bordercolor >> 16) & 0xFF) / 255.0f;
+			border[1] = (GLfloat)((state->bordercolor >> 8) & 0xFF) / 255.0f;
+			border[2] = (GLfloat)(state->bordercolor & 0xFF) / 255.0f;
+			border[3] = (GLfloat)((state->bordercolor >> 24) & 0xFF) / 255.0f;
+			This->ext->glSamplerParameterfv(sampler->id, GL_TEXTURE_BORDER_COLOR, border);
+		}
+		if (state->lodbias != 0.0f)
+			This->ext->glSamplerParameterf(sampler->id, GL_TEXTURE_LOD_BIAS, state->lodbias);
+		if ((state->anisotropy > 1) && This->ext->GLEXT_EXT_texture_filter_anisotropic)
+			This->ext->glSamplerParameterf(sampler->id, GL_TEXTURE_MAX_ANISOTROPY_EXT, (GLfloat)state->anisotropy);
+	}
+	return sampler;
+}
+
+/**
+  * Gets the name of the cached sampler object for a sampler state, for
+  * making bindless texture handles.  Requires ARB_sampler_objects.
+  * @param This
+  *  Pointer to glUtil object
+  * @param state
+  *  Sampler state to look up, the id member is ignored
+  * @return
+  *  Sampler object name, or 0 if it couldn't be created
+  */
+GLuint glUtil_GetSampler(glUtil *This, const SAMPLER *state)
+{
+	SAMPLER *sampler = glUtil__GetSampler(This, state);
+	return sampler ? sampler->id : 0;
+}
+
+/**
+  * Binds a sampler object with the full D3D texture stage sampler state to a
+  * texture unit.  The sampler is taken from the same cache as glUtil_SetSampler.
+  * Requires ARB_sampler_objects.
+  * @param This
+  *  Pointer to glUtil object
+  * @param level
+  *  Texture unit to bind the sampler to
+  * @param state
+  *  Sampler state to bind, the id member is ignored
+  */
+void glUtil_BindSampler(glUtil *This, int level, const SAMPLER *state)
+{
+	SAMPLER *sampler;
+	if ((level < 0) || (level >= 16)) return;
+	if (This->samplers[level].id && glUtil__SamplerMatch(&This->samplers[level], state)) return;
+	sampler = glUtil__GetSampler(This, state);
+	if (!sampler) return;
+	if (sampler->id != This->samplers[level].id) This->ext->glBindSampler(level, sampler->id);
+	This->samplers[level] = *sampler;
+}
+
 void glUtil_DepthWrite(glUtil *This, DWORD enabled)
 {
 	BOOL enabled_bool;
@@ -453,6 +817,75 @@ void glUtil_BlendEnable(glUtil *This, BOOL enabled)
 	}
 }
 
+void glUtil_ColorMask(glUtil *This, GLboolean r, GLboolean g, GLboolean b, GLboolean a)
+{
+	if ((r != This->colormask[0]) || (g != This->colormask[1]) ||
+		(b != This->colormask[2]) || (a != This->colormask[3]))
+	{
+		This->colormask[0] = r;
+		This->colormask[1] = g;
+		This->colormask[2] = b;
+		This->colormask[3] = a;
+		glColorMask(r, g, b, a);
+	}
+}
+
+void glUtil_StencilTest(glUtil *This, BOOL enabled)
+{
+	if (enabled != This->stenciltest)
+	{
+		This->stenciltest = enabled;
+		if (enabled) glEnable(GL_STENCIL_TEST);
+		else glDisable(GL_STENCIL_TEST);
+	}
+}
+
+void glUtil_StencilFunc(glUtil *This, GLenum func, GLint ref, GLuint mask)
+{
+	if ((func != This->stencilfunc) || (ref != This->stencilref) || (mask != This->stencilmask))
+	{
+		This->stencilfunc = func;
+		This->stencilref = ref;
+		This->stencilmask = mask;
+		glStencilFunc(func, ref, mask);
+	}
+}
+
+void glUtil_StencilOp(glUtil *This, GLenum fail, GLenum zfail, GLenum pass)
+{
+	if ((fail != This->stencilfail) || (zfail != This->stencilzfail) || (pass != This->stencilpass))
+	{
+		This->stencilfail = fail;
+		This->stencilzfail = zfail;
+		This->stencilpass = pass;
+		glStencilOp(fail, zfail, pass);
+	}
+}
+
+void glUtil_StencilMask(glUtil *This, GLuint mask)
+{
+	if (mask != This->stencilwritemask)
+	{
+		This->stencilwritemask = mask;
+		glStencilMask(mask);
+	}
+}
+
+void glUtil_PolygonOffset(glUtil *This, GLfloat factor, GLfloat units)
+{
+	BOOL wasenabled = (This->polyoffsetfactor != 0.0f) || (This->polyoffsetunits != 0.0f);
+	BOOL enabled = (factor != 0.0f) || (units != 0.0f);
+	if ((factor == This->polyoffsetfactor) && (units == This->polyoffsetunits)) return;
+	This->polyoffsetfactor = factor;
+	This->polyoffsetunits = units;
+	if (enabled)
+	{
+		if (!wasenabled) glEnable(GL_POLYGON_OFFSET_FILL);
+		glPolygonOffset(factor, units);
+	}
+	else glDisable(GL_POLYGON_OFFSET_FILL);
+}
+
 void glUtil_EnableCull(glUtil *This, BOOL enabled)
 {
 	if (This->cullenabled != enabled)
@@ -584,7 +1017,11 @@ void glUtil_SetTexture(glUtil *This, unsigned int level, glTexture *texture)
 	}
 	else
 	{
-		texname = texture->id;
+		// Sampling reads the texture, not what 3D rendering drew since
+		if (texture->msaastate == MSAA_RESOLVE) glTexture__ResolveMSAA(texture);
+		// Block compressed copies stand in for evicted textures that aren't written
+		if (texture->evicted && !texture->blockid) glTexture__MakeResident(texture);
+		texname = texture->evicted ? texture->blockid : texture->id;
 		target = texture->target;
 	}
 	if (texname != This->textures[level])
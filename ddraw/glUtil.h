@@ -34,9 +34,17 @@ void glUtil_InitFBO(glUtil *This, FBO *fbo);
 void glUtil_DeleteFBO(glUtil *This, FBO *fbo);
 void glUtil_SetFBOTexture(glUtil *This, FBO *fbo, glTexture *color, glTexture *z, GLint level, GLint zlevel, BOOL stencil);
 void glUtil_SetWrap(glUtil *This, int level, DWORD coord, DWORD address);
+void glUtil_SetSampler(glUtil *This, int level, GLint wraps, GLint wrapt, GLint minfilter, GLint magfilter);
+void glUtil_BindSampler(glUtil *This, int level, const SAMPLER *state);
+GLuint glUtil_GetSampler(glUtil *This, const SAMPLER *state);
+GLint glUtil_GetWrapMode(DWORD address);
 GLenum glUtil_SetFBOSurface(glUtil *This, glTexture *surface, glTexture *zbuffer, GLint level, GLint zlevel, BOOL skipz);
 GLenum glUtil_SetFBO(glUtil *This, FBO *fbo);
 GLenum glUtil_SetFBOTextures(glUtil *This, FBO *fbo, glTexture *color, glTexture *z, GLint level, GLint zlevel, BOOL stencil);
+void glUtil_InvalidateFBOs(glUtil *This, struct glTexture *texture);
+GLenum glUtil_SetFBOMultisample(glUtil *This, struct glTexture *surface, struct glTexture *zbuffer);
+GLenum glUtil_SetFBODepth(glUtil *This, int index, GLenum target, struct glTexture *z, GLint zlevel);
+void glUtil_EndFBODepth(glUtil *This, int index, GLenum target);
 void glUtil_SetDepthComp(glUtil *This, GLenum comp);
 void glUtil_DepthWrite(glUtil *This, DWORD enabled);
 void glUtil_DepthTest(glUtil *This, DWORD enabled);
@@ -50,6 +58,12 @@ void glUtil_ClearStencil(glUtil *This, GLint stencil);
 void glUtil_EnableArray(glUtil *This, int index, BOOL enabled);
 void glUtil_BlendFunc(glUtil *This, GLenum src, GLenum dest);
 void glUtil_BlendEnable(glUtil *This, BOOL enabled);
+void glUtil_ColorMask(glUtil *This, GLboolean r, GLboolean g, GLboolean b, GLboolean a);
+void glUtil_StencilTest(glUtil *This, BOOL enabled);
+void glUtil_StencilFunc(glUtil *This, GLenum func, GLint ref, GLuint mask);
+void glUtil_StencilOp(glUtil *This, GLenum fail, GLenum zfail, GLenum pass);
+void glUtil_StencilMask(glUtil *This, GLuint mask);
+void glUtil_PolygonOffset(glUtil *This, GLfloat factor, GLfloat units);
 void glUtil_EnableCull(glUtil *This, BOOL enabled);
 void glUtil_SetCull(glUtil *This, D3DCULL mode);
 void glUtil_SetPolyMode(glUtil *This, D3DFILLMODE mode);
@@ -284,13 +284,10 @@ static void setupStderrDebugCallback()
 	glDebugMessageCallback(callback, nullptr);
 }
 
+// Debug group around a scope; a NULL message, as passed when markers are disabled, skips the group
 struct GLScopedDebugMarker
 {
-	#ifndef NDEBUG
-	explicit GLScopedDebugMarker(const char* msg) { glPushDebugGroup(GL_DEBUG_SOURCE_APPLICATION, 0, -1, msg); }
-	~GLScopedDebugMarker() { glPopDebugGroup(); }
-	#else
-	explicit GLScopedDebugMarker(const char* msg) {}
-	~GLScopedDebugMarker() {}
-#endif
+	explicit GLScopedDebugMarker(const char* msg) : active(msg != NULL) { if (active) glPushDebugGroup(GL_DEBUG_SOURCE_APPLICATION, 0, -1, msg); }
+	~GLScopedDebugMarker() { if (active) glPopDebugGroup(); }
+	bool active;
 };
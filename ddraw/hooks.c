@@ -18,6 +18,10 @@
 
 #include "common.h"
 #include "hooks.h"
+#include "util.h"
+#include "RuntimePolicy.h"
+#include "FrameCapture.h"
+#include "LatencyMeter.h"
 #include <tlhelp32.h>
 #include "../minhook/include/MinHook.h"
 
@@ -30,15 +34,25 @@ void glDirectDraw7_UnrestoreDisplayMode(LPDIRECTDRAW7 lpDD7);
 void glDirectDraw7_SetWindowSize(LPDIRECTDRAW7 lpDD7, DWORD dwWidth, DWORD dwHeight);
 void glDirectDraw7_GetSizes(LPDIRECTDRAW7 lpDD7, LONG *sizes);
 BOOL glDirectDraw7_GetFullscreen(LPDIRECTDRAW7 lpDD7);
+void glDirectDraw7_WindowChanged(LPDIRECTDRAW7 lpDD7);
 extern DXGLCFG dxglcfg;
 
 const TCHAR *wndprop = _T("DXGLWndProc");
 const TCHAR *wndpropdd7 = _T("DXGLWndDD7");
-static HWND_HOOK *hwndhooks = NULL;
+// Hooked windows are kept in an open-addressed hash table.  Entries never
+// move, so pointers returned by GetWndHook stay valid until the window is
+// unhooked, and lookups can run without taking a lock.
+#define HWNDHOOK_TABLEBITS 8
+#define HWNDHOOK_TABLESIZE (1 << HWNDHOOK_TABLEBITS)
+// Marks a removed entry so lookups keep probing past it
+#define HWNDHOOK_DELETED ((HWND)(LONG_PTR)-1)
+static HWND_HOOK hwndhooks[HWNDHOOK_TABLESIZE];
 static int hwndhook_count = 0;
-static int hwndhook_max = 0;
+static DWORD hwndhooklock = 0;  // Serializes changes to hwndhooks
+static DWORD hwndhook_tls = TLS_OUT_OF_INDEXES;  // Last entry found by each thread
 CRITICAL_SECTION hook_cs = { NULL, 0, 0, NULL, NULL, 0 };
 static BOOL hooks_init = FALSE;
+static volatile LONG clipserial = 0;  // Changed when a window may have moved or changed Z order
 
 // Window management
 LONG(WINAPI *_SetWindowLongA)(HWND hWnd, int nIndex, LONG dwNewLong) = NULL;
@@ -84,58 +98,132 @@ static RECT rcClip;
 static RECT rcWindow;
 static BOOL windowscalehook = FALSE;
 
-int hwndhookcmp(const HWND_HOOK *key, const HWND_HOOK *cmp)
+// Display metrics returned by the window scale hooks, valid while their serial matches displayserial
+typedef struct DISPLAYCACHE
 {
-	if (!cmp->hwnd) return 1; // Put blanks at end for cleanup
-	if (key->hwnd < cmp->hwnd) return -1;
-	else if (key->hwnd == cmp->hwnd) return 0;
-	else return 1;
+	LONG metricserial[4];
+	int metrics[4];  // SM_CXSCREEN, SM_CYSCREEN, SM_CXVIRTUALSCREEN and SM_CYVIRTUALSCREEN
+	LONG modeserialA;
+	DEVMODEA modeA;  // Current settings of the primary display, dmSize as requested
+	LONG modeserialW;
+	DEVMODEW modeW;
+} DISPLAYCACHE;
+static volatile LONG displayserial = 1;  // Changed when the display mode or window scaling may have changed
+static DISPLAYCACHE displaycache;
+
+static DWORD HashHWND(HWND hWnd)
+{
+	DWORD key = (DWORD)((ULONG_PTR)hWnd ^ ((ULONG_PTR)hWnd >> 16));
+	return (key * 0x9E3779B1) >> (32 - HWNDHOOK_TABLEBITS);
 }
 
-void SetHookWndProc(HWND hWnd, WNDPROC wndproc, LPDIRECTDRAW7 lpDD7, BOOL proconly, BOOL delete)
+static HWND_HOOK *FindWndHook(HWND hWnd)
 {
-	HWND_HOOK cmphook;
-	HWND_HOOK *hook;
-	cmphook.hwnd = hWnd;
-	if (!hwndhooks)
+	DWORD slot = HashHWND(hWnd);
+	HWND cmp;
+	int i;
+	for (i = 0; i < HWNDHOOK_TABLESIZE; i++)
 	{
-		hwndhooks = (HWND_HOOK*)malloc(16 * sizeof(HWND_HOOK));
-		hwndhook_count = 0;
-		hwndhook_max = 16;
+		cmp = *(HWND volatile*)&hwndhooks[slot].hwnd;
+		if (cmp == hWnd) return &hwndhooks[slot];
+		if (!cmp) return NULL;
+		slot = (slot + 1) & (HWNDHOOK_TABLESIZE - 1);
 	}
-	hook = bsearch(&cmphook, hwndhooks, hwndhook_count, sizeof(HWND_HOOK), hwndhookcmp);
+	return NULL;
+}
+
+/**
+  * Adds, changes or removes the hook entry of a window.
+  * @param hWnd
+  *  Window to change the entry of
+  * @param wndproc
+  *  Window procedure of the application to call from the hook
+  * @param lpDD7
+  *  DirectDraw object the window belongs to
+  * @param proconly
+  *  If TRUE, lpDD7 is ignored and an existing entry keeps its DirectDraw object
+  * @param delete
+  *  If TRUE, the entry is removed
+  * @return
+  *  FALSE if the table is full and the window could not be added
+  */
+BOOL SetHookWndProc(HWND hWnd, WNDPROC wndproc, LPDIRECTDRAW7 lpDD7, BOOL proconly, BOOL delete)
+{
+	HWND_HOOK *hook;
+	DWORD slot;
+	int i;
+	if (!hWnd || (hWnd == HWNDHOOK_DELETED)) return FALSE;
+	EnterSpinlock(&hwndhooklock);
+	hook = FindWndHook(hWnd);
 	if (delete)
 	{
-		if (!hook) return;
-		hook->hwnd = NULL;
-		hook->wndproc = NULL;
-		hook->lpDD7 = NULL;
-		qsort(hwndhooks, hwndhook_count, sizeof(HWND_HOOK), hwndhookcmp);
-		hwndhook_count--;
-		return;
+		if (hook)
+		{
+			InterlockedExchangePointer((PVOID volatile*)&hook->hwnd, HWNDHOOK_DELETED);
+			hook->wndproc = NULL;
+			hook->lpDD7 = NULL;
+			hwndhook_count--;
+			// Clear out removed entries once no window is hooked
+			if (!hwndhook_count) ZeroMemory(hwndhooks, sizeof(hwndhooks));
+		}
+		ExitSpinlock(&hwndhooklock);
+		return TRUE;
 	}
 	if (!hook)
 	{
-		hwndhook_count++;
-		if (hwndhook_count >= hwndhook_max)
+		slot = HashHWND(hWnd);
+		for (i = 0; i < HWNDHOOK_TABLESIZE; i++)
+		{
+			if (!hwndhooks[slot].hwnd || (hwndhooks[slot].hwnd == HWNDHOOK_DELETED)) break;
+			slot = (slot + 1) & (HWNDHOOK_TABLESIZE - 1);
+		}
+		if (i == HWNDHOOK_TABLESIZE)
 		{
-			hwndhook_max += 16;
-			hwndhooks = (HWND_HOOK*)realloc(hwndhooks, hwndhook_max*sizeof(HWND_HOOK));
+			ExitSpinlock(&hwndhooklock);
+			return FALSE;
 		}
-		hook = &hwndhooks[hwndhook_count - 1];
+		hook = &hwndhooks[slot];
+		hook->wndproc = wndproc;
+		if (proconly) hook->lpDD7 = NULL;
+		else hook->lpDD7 = lpDD7;
+		hwndhook_count++;
+		// Publish the entry to lookups only after it is filled in
+		InterlockedExchangePointer((PVOID volatile*)&hook->hwnd, hWnd);
 	}
-	hook->hwnd = hWnd;
-	hook->wndproc = wndproc;
-	if (!proconly) hook->lpDD7 = lpDD7;
-	qsort(hwndhooks, hwndhook_count, sizeof(HWND_HOOK), hwndhookcmp);
+	else
+	{
+		hook->wndproc = wndproc;
+		if (!proconly) hook->lpDD7 = lpDD7;
+	}
+	ExitSpinlock(&hwndhooklock);
+	return TRUE;
 }
 
+/**
+  * Gets the hook entry of a window.  The entry found last by the calling
+  * thread is checked first, since most lookups come from the window
+  * procedure of the same window.
+  * @param hWnd
+  *  Window to look up
+  * @return
+  *  Pointer to the hook entry, or NULL if the window is not hooked
+  */
 HWND_HOOK *GetWndHook(HWND hWnd)
 {
-	HWND_HOOK cmphook;
-	cmphook.hwnd = hWnd;
-	if (!hwndhooks) return NULL;
-	return bsearch(&cmphook, hwndhooks, hwndhook_count, sizeof(HWND_HOOK), hwndhookcmp);
+	HWND_HOOK *hook;
+	DWORD error;
+	if (!hWnd) return NULL;
+	if (hwndhook_tls == TLS_OUT_OF_INDEXES) return FindWndHook(hWnd);
+	// TlsGetValue clears the last error, which the hooked functions must preserve
+	error = GetLastError();
+	hook = (HWND_HOOK*)TlsGetValue(hwndhook_tls);
+	if (!hook || (hook->hwnd != hWnd))
+	{
+		hook = FindWndHook(hWnd);
+		if (hook) TlsSetValue(hwndhook_tls, hook);
+	}
+	SetLastError(error);
+	return hook;
 }
 
 /**
@@ -183,6 +271,7 @@ void InitHooks()
 	if (hooks_init) return;
 	EnterCriticalSection(&hook_cs);
 	wndhook_count = 0;
+	if (hwndhook_tls == TLS_OUT_OF_INDEXES) hwndhook_tls = TlsAlloc();
 	MH_Initialize();
 	MH_CreateHook(&SetWindowLongA, HookSetWindowLongA, (LPVOID*)&_SetWindowLongA);
 	MH_CreateHook(&SetWindowLongW, HookSetWindowLongW, (LPVOID*)&_SetWindowLongW);
@@ -248,6 +337,11 @@ void ShutdownHooks()
 
 	MH_Uninitialize();
 	wndhook_count = 0;
+	if (hwndhook_tls != TLS_OUT_OF_INDEXES)
+	{
+		TlsFree(hwndhook_tls);
+		hwndhook_tls = TLS_OUT_OF_INDEXES;
+	}
 	hooks_init = FALSE;
 	LeaveCriticalSection(&hook_cs);
 }
@@ -258,32 +352,34 @@ void EnableDXGLHooks()
 	wndhook_count++;
 	if (wndhook_count == 1)
 	{
-		MH_EnableHook(&SetWindowLongA);
-		MH_EnableHook(&SetWindowLongW);
-		MH_EnableHook(&GetWindowLongA);
-		MH_EnableHook(&GetWindowLongW);
+		// Queued so all threads are suspended once for the whole set
+		MH_QueueEnableHook(&SetWindowLongA);
+		MH_QueueEnableHook(&SetWindowLongW);
+		MH_QueueEnableHook(&GetWindowLongA);
+		MH_QueueEnableHook(&GetWindowLongW);
 #ifdef _M_X64
-		MH_EnableHook(&SetWindowLongPtrA);
-		MH_EnableHook(&SetWindowLongPtrW);
-		MH_EnableHook(&GetWindowLongPtrA);
-		MH_EnableHook(&GetWindowLongPtrW);
+		MH_QueueEnableHook(&SetWindowLongPtrA);
+		MH_QueueEnableHook(&SetWindowLongPtrW);
+		MH_QueueEnableHook(&GetWindowLongPtrA);
+		MH_QueueEnableHook(&GetWindowLongPtrW);
 #endif
 
-		MH_EnableHook(&GetCursorPos);
-		MH_EnableHook(&SetCursorPos);
-		MH_EnableHook(&SetCursor);
+		MH_QueueEnableHook(&GetCursorPos);
+		MH_QueueEnableHook(&SetCursorPos);
+		MH_QueueEnableHook(&SetCursor);
 
-		MH_EnableHook(&EnumDisplaySettingsA);
-		MH_EnableHook(&EnumDisplaySettingsW);
-		MH_EnableHook(&EnumDisplaySettingsExA);
-		MH_EnableHook(&EnumDisplaySettingsExW);
-		MH_EnableHook(&GetSystemMetrics);
+		MH_QueueEnableHook(&EnumDisplaySettingsA);
+		MH_QueueEnableHook(&EnumDisplaySettingsW);
+		MH_QueueEnableHook(&EnumDisplaySettingsExA);
+		MH_QueueEnableHook(&EnumDisplaySettingsExW);
+		MH_QueueEnableHook(&GetSystemMetrics);
 
-		MH_EnableHook(&GetClientRect);
-		MH_EnableHook(&GetWindowRect);
-		MH_EnableHook(&ClientToScreen);
-		MH_EnableHook(&MoveWindow);
-		MH_EnableHook(&SetWindowPos);
+		MH_QueueEnableHook(&GetClientRect);
+		MH_QueueEnableHook(&GetWindowRect);
+		MH_QueueEnableHook(&ClientToScreen);
+		MH_QueueEnableHook(&MoveWindow);
+		MH_QueueEnableHook(&SetWindowPos);
+		MH_ApplyQueued();
 	}
 	LeaveCriticalSection(&hook_cs);
 }
@@ -296,32 +392,33 @@ void DisableDXGLHooks(BOOL force)
 	if (force) wndhook_count = 0;
 	if (!wndhook_count)
 	{
-		MH_DisableHook(&SetWindowLongA);
-		MH_DisableHook(&SetWindowLongW);
-		MH_DisableHook(&GetWindowLongA);
-		MH_DisableHook(&GetWindowLongW);
+		MH_QueueDisableHook(&SetWindowLongA);
+		MH_QueueDisableHook(&SetWindowLongW);
+		MH_QueueDisableHook(&GetWindowLongA);
+		MH_QueueDisableHook(&GetWindowLongW);
 #ifdef _M_X64
-		MH_DisableHook(&SetWindowLongPtrA);
-		MH_DisableHook(&SetWindowLongPtrW);
-		MH_DisableHook(&GetWindowLongPtrA);
-		MH_DisableHook(&GetWindowLongPtrW);
+		MH_QueueDisableHook(&SetWindowLongPtrA);
+		MH_QueueDisableHook(&SetWindowLongPtrW);
+		MH_QueueDisableHook(&GetWindowLongPtrA);
+		MH_QueueDisableHook(&GetWindowLongPtrW);
 #endif
 
-		MH_DisableHook(&GetCursorPos);
-		MH_DisableHook(&SetCursorPos);
-		MH_DisableHook(&SetCursor);
+		MH_QueueDisableHook(&GetCursorPos);
+		MH_QueueDisableHook(&SetCursorPos);
+		MH_QueueDisableHook(&SetCursor);
 
-		MH_DisableHook(&EnumDisplaySettingsA);
-		MH_DisableHook(&EnumDisplaySettingsW);
-		MH_DisableHook(&EnumDisplaySettingsExA);
-		MH_DisableHook(&EnumDisplaySettingsExW);
-		MH_DisableHook(&GetSystemMetrics);
+		MH_QueueDisableHook(&EnumDisplaySettingsA);
+		MH_QueueDisableHook(&EnumDisplaySettingsW);
+		MH_QueueDisableHook(&EnumDisplaySettingsExA);
+		MH_QueueDisableHook(&EnumDisplaySettingsExW);
+		MH_QueueDisableHook(&GetSystemMetrics);
 
-		MH_DisableHook(&GetClientRect);
-		MH_DisableHook(&GetWindowRect);
-		MH_DisableHook(&ClientToScreen);
-		MH_DisableHook(&MoveWindow);
-		MH_DisableHook(&SetWindowPos);
+		MH_QueueDisableHook(&GetClientRect);
+		MH_QueueDisableHook(&GetWindowRect);
+		MH_QueueDisableHook(&ClientToScreen);
+		MH_QueueDisableHook(&MoveWindow);
+		MH_QueueDisableHook(&SetWindowPos);
+		MH_ApplyQueued();
 	}
 	LeaveCriticalSection(&hook_cs);
 }
@@ -329,6 +426,34 @@ void DisableDXGLHooks(BOOL force)
 void EnableWindowScaleHook(BOOL enable)
 {
 	windowscalehook = enable;
+	InvalidateDisplayCache();
+}
+
+/**
+  * Marks the display metrics and current display mode cached by the window
+  * scale hooks as out of date.  Called when the display mode is changed.
+  */
+void InvalidateDisplayCache()
+{
+	InterlockedIncrement(&displayserial);
+}
+
+/**
+  * Marks the clip lists clippers read from their windows as out of date.
+  */
+void InvalidateWindowClipLists()
+{
+	InterlockedIncrement(&clipserial);
+}
+
+/**
+  * Gets a number that changes whenever InvalidateWindowClipLists is called.
+  * @return
+  *  Current clip list serial number
+  */
+LONG GetWindowClipSerial()
+{
+	return clipserial;
 }
 
 void InstallDXGLHook(HWND hWnd, LPDIRECTDRAW7 lpDD7)
@@ -341,7 +466,7 @@ void InstallDXGLHook(HWND hWnd, LPDIRECTDRAW7 lpDD7)
 		return;
 	}
 	wndproc = (WNDPROC)_GetWindowLongPtrA(hWnd, GWLP_WNDPROC);
-	SetHookWndProc(hWnd, wndproc, lpDD7, FALSE, FALSE);
+	if (!SetHookWndProc(hWnd, wndproc, lpDD7, FALSE, FALSE)) return;
 	_SetWindowLongPtrA(hWnd, GWLP_WNDPROC, (LONG_PTR)DXGLWndHookProc);
 	EnableDXGLHooks();
 }
@@ -369,6 +494,12 @@ LRESULT CALLBACK DXGLWndHookProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lPa
 	int translatex, translatey;
 	LPARAM newpos;
 	wndhook = GetWndHook(hWnd);
+	if (((uMsg >= WM_KEYFIRST) && (uMsg <= WM_KEYLAST)) || ((uMsg >= WM_MOUSEFIRST) && (uMsg <= WM_MOUSELAST)))
+		LatencyMeter_MarkInput();
+	// Covers moves, resizes and Z order changes, and other windows covering this one on activation
+	if ((uMsg == WM_WINDOWPOSCHANGED) || (uMsg == WM_ACTIVATEAPP) || (uMsg == WM_DISPLAYCHANGE))
+		InvalidateWindowClipLists();
+	if (uMsg == WM_DISPLAYCHANGE) InvalidateDisplayCache();
 	if (!wndhook)
 	{
 		parentproc = nullwndproc;
@@ -392,9 +523,10 @@ LRESULT CALLBACK DXGLWndHookProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lPa
 			ClipCursor(NULL);
 			cursorclipped = FALSE;
 		}
+		if (lpDD7) glDirectDraw7_WindowChanged(lpDD7);
 		if (lpDD7)
 		{
-			if (!glDirectDraw7_GetFullscreen(lpDD7) && ((dxglcfg.WindowScaleX != 1.0f) || (dxglcfg.WindowScaleY != 1.0f)))
+			if (!glDirectDraw7_GetFullscreen(lpDD7) && dxglpolicy.windowscaled)
 			{
 				pt.x = (LONG)((float)(LOWORD(lParam)) / dxglcfg.WindowScaleX);
 				pt.y = (LONG)((float)(HIWORD(lParam)) / dxglcfg.WindowScaleY);
@@ -402,6 +534,10 @@ LRESULT CALLBACK DXGLWndHookProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lPa
 			}
 		}
 		break;
+	case WM_WINDOWPOSCHANGED:
+		// Sent even if the application handles it without sending WM_MOVE and WM_SIZE
+		if (lpDD7) glDirectDraw7_WindowChanged(lpDD7);
+		break;
 	case WM_KILLFOCUS:
 		if (cursorclipped)
 		{
@@ -574,7 +710,7 @@ LRESULT CALLBACK DXGLWndHookProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lPa
 				newpos = oldx + (oldy << 16);
 				return CallWindowProc(parentproc, hWnd, uMsg, wParam, newpos);
 			}
-			else if (!glDirectDraw7_GetFullscreen(lpDD7) && ((dxglcfg.WindowScaleX != 1.0f) || (dxglcfg.WindowScaleY != 1.0f)))
+			else if (!glDirectDraw7_GetFullscreen(lpDD7) && dxglpolicy.windowscaled)
 			{
 				oldx = LOWORD(lParam);
 				oldy = HIWORD(lParam);
@@ -588,6 +724,12 @@ LRESULT CALLBACK DXGLWndHookProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lPa
 		else return CallWindowProc(parentproc, hWnd, uMsg, wParam, lParam);
 	case WM_KEYDOWN:
 	case WM_SYSKEYDOWN:
+		// Bit 30 is set when the key repeats
+		if (!(lParam & 0x40000000))
+		{
+			if (dxglcfg.ScreenshotKey && (wParam == dxglcfg.ScreenshotKey)) FrameCapture_RequestScreenshot();
+			if (dxglcfg.RecordKey && (wParam == dxglcfg.RecordKey)) FrameCapture_ToggleRecording();
+		}
 		if (dxglcfg.CaptureMouse)
 		{
 			if (wParam == VK_CONTROL)
@@ -653,7 +795,7 @@ LRESULT CALLBACK DXGLWndHookProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lPa
 				newpos = oldx + (oldy << 16);
 				return CallWindowProc(parentproc, hWnd, uMsg, wParam, newpos);
 			}
-			else if (!glDirectDraw7_GetFullscreen(lpDD7) && ((dxglcfg.WindowScaleX != 1.0f) || (dxglcfg.WindowScaleY != 1.0f)))
+			else if (!glDirectDraw7_GetFullscreen(lpDD7) && dxglpolicy.windowscaled)
 			{
 				oldx = LOWORD(lParam);
 				oldy = HIWORD(lParam);
@@ -695,7 +837,7 @@ LRESULT CALLBACK DXGLWndHookProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lPa
 				newpos = oldx + (oldy << 16);
 				return CallWindowProc(parentproc, hWnd, uMsg, wParam, newpos);
 			}
-			else if (!glDirectDraw7_GetFullscreen(lpDD7) && ((dxglcfg.WindowScaleX != 1.0f) || (dxglcfg.WindowScaleY != 1.0f)))
+			else if (!glDirectDraw7_GetFullscreen(lpDD7) && dxglpolicy.windowscaled)
 			{
 				oldx = LOWORD(lParam);
 				oldy = HIWORD(lParam);
@@ -713,6 +855,7 @@ LRESULT CALLBACK DXGLWndHookProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lPa
 			ClipCursor(NULL);
 			cursorclipped = FALSE;
 		}
+		if (lpDD7) glDirectDraw7_WindowChanged(lpDD7);
 		if (wParam != SIZE_MINIMIZED)
 		{
 			if (glDirectDraw7_GetFullscreen(lpDD7))
@@ -732,7 +875,7 @@ LRESULT CALLBACK DXGLWndHookProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lPa
 		}
 		if (lpDD7)
 		{
-			if (!glDirectDraw7_GetFullscreen(lpDD7) && ((dxglcfg.WindowScaleX != 1.0f) || (dxglcfg.WindowScaleY != 1.0f)))
+			if (!glDirectDraw7_GetFullscreen(lpDD7) && dxglpolicy.windowscaled)
 			{
 				pt.x = (LONG)((float)(LOWORD(lParam)) / dxglcfg.WindowScaleX);
 				pt.y = (LONG)((float)(HIWORD(lParam)) / dxglcfg.WindowScaleY);
@@ -836,6 +979,7 @@ BOOL WINAPI HookGetCursorPos(LPPOINT point)
 	float mulx, muly;
 	int translatex, translatey;
 
+	LatencyMeter_MarkInput();
 	if (dxglcfg.DebugNoMouseHooks)
 		return _GetCursorPos(point);
 
@@ -889,7 +1033,7 @@ BOOL WINAPI HookGetCursorPos(LPPOINT point)
 		}
 		else
 		{
-			if ((dxglcfg.WindowScaleX != 1.0f) || (dxglcfg.WindowScaleY != 1.0f))
+			if (dxglpolicy.windowscaled)
 			{
 				error = _GetCursorPos(&pt);
 				if (!error) return error;
@@ -945,7 +1089,7 @@ BOOL WINAPI HookSetCursorPos(int x, int y)
 	}
 	else
 	{
-		if ((dxglcfg.WindowScaleX != 1.0f) || (dxglcfg.WindowScaleY != 1.0f))
+		if (dxglpolicy.windowscaled)
 			return _SetCursorPos((int)((float)x * dxglcfg.WindowScaleX), (int)((float)y * dxglcfg.WindowScaleY));
 		else return _SetCursorPos(x, y);
 	}
@@ -971,68 +1115,147 @@ HCURSOR WINAPI HookSetCursor(HCURSOR hCursor)
 	return prevCursor;
 }
 
-BOOL WINAPI HookEnumDisplaySettingsA(LPCSTR lpszDeviceName, DWORD iModeNum, LPDEVMODEA lpDevMode)
+/**
+  * Gets the scaled current settings of the primary display from the cache.
+  * Requests with driver data are not cached.
+  * @param lpDevMode
+  *  Structure to fill in, with dmSize and dmDriverExtra set by the caller
+  * @return
+  *  TRUE if lpDevMode was filled in from the cache
+  */
+static BOOL GetCachedDisplayModeA(LPDEVMODEA lpDevMode)
 {
-	BOOL ret = _EnumDisplaySettingsA(lpszDeviceName, iModeNum, lpDevMode);
-	if (!ret) return ret;
-	if (windowscalehook && (iModeNum == ENUM_CURRENT_SETTINGS))
+	BOOL ret = FALSE;
+	if (lpDevMode->dmDriverExtra || (lpDevMode->dmSize > sizeof(DEVMODEA))) return FALSE;
+	EnterCriticalSection(&hook_cs);
+	if ((displaycache.modeserialA == displayserial) && (displaycache.modeA.dmSize == lpDevMode->dmSize))
 	{
-		lpDevMode->dmPelsWidth = (DWORD)((float)lpDevMode->dmPelsWidth / dxglcfg.WindowScaleX);
-		lpDevMode->dmPelsHeight = (DWORD)((float)lpDevMode->dmPelsHeight / dxglcfg.WindowScaleY);
+		memcpy(lpDevMode, &displaycache.modeA, lpDevMode->dmSize);
+		ret = TRUE;
 	}
+	LeaveCriticalSection(&hook_cs);
 	return ret;
 }
-BOOL WINAPI HookEnumDisplaySettingsW(LPCWSTR lpszDeviceName, DWORD iModeNum, LPDEVMODEW lpDevMode)
+static BOOL GetCachedDisplayModeW(LPDEVMODEW lpDevMode)
 {
-	BOOL ret = _EnumDisplaySettingsW(lpszDeviceName, iModeNum, lpDevMode);
-	if (!ret) return ret;
-	if (windowscalehook && (iModeNum == ENUM_CURRENT_SETTINGS))
+	BOOL ret = FALSE;
+	if (lpDevMode->dmDriverExtra || (lpDevMode->dmSize > sizeof(DEVMODEW))) return FALSE;
+	EnterCriticalSection(&hook_cs);
+	if ((displaycache.modeserialW == displayserial) && (displaycache.modeW.dmSize == lpDevMode->dmSize))
 	{
-		lpDevMode->dmPelsWidth = (DWORD)((float)lpDevMode->dmPelsWidth / dxglcfg.WindowScaleX);
-		lpDevMode->dmPelsHeight = (DWORD)((float)lpDevMode->dmPelsHeight / dxglcfg.WindowScaleY);
+		memcpy(lpDevMode, &displaycache.modeW, lpDevMode->dmSize);
+		ret = TRUE;
 	}
+	LeaveCriticalSection(&hook_cs);
 	return ret;
 }
+
+/**
+  * Stores the scaled current settings of the primary display in the cache.
+  * @param lpDevMode
+  *  Settings returned to the application
+  * @param serial
+  *  Value of displayserial before the settings were read, so a mode change
+  *  while reading leaves the cache out of date
+  */
+static void SetCachedDisplayModeA(const DEVMODEA *lpDevMode, LONG serial)
+{
+	if (lpDevMode->dmDriverExtra || (lpDevMode->dmSize > sizeof(DEVMODEA))) return;
+	EnterCriticalSection(&hook_cs);
+	memcpy(&displaycache.modeA, lpDevMode, lpDevMode->dmSize);
+	displaycache.modeserialA = serial;
+	LeaveCriticalSection(&hook_cs);
+}
+static void SetCachedDisplayModeW(const DEVMODEW *lpDevMode, LONG serial)
+{
+	if (lpDevMode->dmDriverExtra || (lpDevMode->dmSize > sizeof(DEVMODEW))) return;
+	EnterCriticalSection(&hook_cs);
+	memcpy(&displaycache.modeW, lpDevMode, lpDevMode->dmSize);
+	displaycache.modeserialW = serial;
+	LeaveCriticalSection(&hook_cs);
+}
+
+BOOL WINAPI HookEnumDisplaySettingsA(LPCSTR lpszDeviceName, DWORD iModeNum, LPDEVMODEA lpDevMode)
+{
+	return HookEnumDisplaySettingsExA(lpszDeviceName, iModeNum, lpDevMode, 0);
+}
+BOOL WINAPI HookEnumDisplaySettingsW(LPCWSTR lpszDeviceName, DWORD iModeNum, LPDEVMODEW lpDevMode)
+{
+	return HookEnumDisplaySettingsExW(lpszDeviceName, iModeNum, lpDevMode, 0);
+}
 BOOL WINAPI HookEnumDisplaySettingsExA(LPCSTR lpszDeviceName, DWORD iModeNum, LPDEVMODEA lpDevMode, DWORD dwFlags)
 {
-	BOOL ret = _EnumDisplaySettingsExA(lpszDeviceName, iModeNum, lpDevMode, dwFlags);
+	BOOL ret;
+	LONG serial = displayserial;
+	BOOL cache = windowscalehook && !lpszDeviceName && (iModeNum == ENUM_CURRENT_SETTINGS) && !dwFlags && lpDevMode;
+	if (cache && GetCachedDisplayModeA(lpDevMode)) return TRUE;
+	ret = _EnumDisplaySettingsExA(lpszDeviceName, iModeNum, lpDevMode, dwFlags);
 	if (!ret) return ret;
 	if (windowscalehook && (iModeNum == ENUM_CURRENT_SETTINGS))
 	{
 		lpDevMode->dmPelsWidth = (DWORD)((float)lpDevMode->dmPelsWidth / dxglcfg.WindowScaleX);
 		lpDevMode->dmPelsHeight = (DWORD)((float)lpDevMode->dmPelsHeight / dxglcfg.WindowScaleY);
 	}
+	if (cache) SetCachedDisplayModeA(lpDevMode, serial);
 	return ret;
 }
 BOOL WINAPI HookEnumDisplaySettingsExW(LPCWSTR lpszDeviceName, DWORD iModeNum, LPDEVMODEW lpDevMode, DWORD dwFlags)
 {
-	BOOL ret = _EnumDisplaySettingsExW(lpszDeviceName, iModeNum, lpDevMode, dwFlags);
+	BOOL ret;
+	LONG serial = displayserial;
+	BOOL cache = windowscalehook && !lpszDeviceName && (iModeNum == ENUM_CURRENT_SETTINGS) && !dwFlags && lpDevMode;
+	if (cache && GetCachedDisplayModeW(lpDevMode)) return TRUE;
+	ret = _EnumDisplaySettingsExW(lpszDeviceName, iModeNum, lpDevMode, dwFlags);
 	if (!ret) return ret;
 	if (windowscalehook && (iModeNum == ENUM_CURRENT_SETTINGS))
 	{
 		lpDevMode->dmPelsWidth = (DWORD)((float)lpDevMode->dmPelsWidth / dxglcfg.WindowScaleX);
 		lpDevMode->dmPelsHeight = (DWORD)((float)lpDevMode->dmPelsHeight / dxglcfg.WindowScaleY);
 	}
+	if (cache) SetCachedDisplayModeW(lpDevMode, serial);
 	return ret;
 }
 int WINAPI HookGetSystemMetrics(int nIndex)
 {
-	int ret = _GetSystemMetrics(nIndex);
-	if (windowscalehook)
+	int ret;
+	int slot;
+	LONG serial;
+	if (!windowscalehook) return _GetSystemMetrics(nIndex);
+	switch (nIndex)
 	{
-		switch (nIndex)
-		{
-		default:
-			return ret;
-		case SM_CXSCREEN:
-		case SM_CXVIRTUALSCREEN:
-			return (int)((float)ret / dxglcfg.WindowScaleX);
-		case SM_CYSCREEN:
-		case SM_CYVIRTUALSCREEN:
-			return (int)((float)ret / dxglcfg.WindowScaleY);
-		}
+	default:
+		return _GetSystemMetrics(nIndex);
+	case SM_CXSCREEN:
+		slot = 0;
+		break;
+	case SM_CYSCREEN:
+		slot = 1;
+		break;
+	case SM_CXVIRTUALSCREEN:
+		slot = 2;
+		break;
+	case SM_CYVIRTUALSCREEN:
+		slot = 3;
+		break;
+	}
+	serial = displayserial;
+	EnterCriticalSection(&hook_cs);
+	if (displaycache.metricserial[slot] == serial)
+	{
+		ret = displaycache.metrics[slot];
+		LeaveCriticalSection(&hook_cs);
+		return ret;
 	}
-	else return ret;
+	LeaveCriticalSection(&hook_cs);
+	ret = _GetSystemMetrics(nIndex);
+	// Even slots are widths
+	if (slot & 1) ret = (int)((float)ret / dxglcfg.WindowScaleY);
+	else ret = (int)((float)ret / dxglcfg.WindowScaleX);
+	EnterCriticalSection(&hook_cs);
+	displaycache.metrics[slot] = ret;
+	displaycache.metricserial[slot] = serial;
+	LeaveCriticalSection(&hook_cs);
+	return ret;
 }
 
 BOOL WINAPI HookGetClientRect(HWND hWnd, LPRECT lpRect)
@@ -1102,6 +1325,8 @@ BOOL WINAPI HookMoveWindow(HWND hWnd, int X, int Y, int nWidth, int nHeight, BOO
 	HMENU menu;
 	BOOL ret;
 	HWND_HOOK *wndhook;
+	// The window may not be hooked, or may be a child of a clipper's window
+	InvalidateWindowClipLists();
 	if (!windowscalehook) return _MoveWindow(hWnd, X, Y, nWidth, nHeight, bRepaint);
 	wndhook = GetWndHook(hWnd);
 	if (!wndhook) return _MoveWindow(hWnd, X, Y, nWidth, nHeight, bRepaint);
@@ -1136,6 +1361,7 @@ BOOL WINAPI HookSetWindowPos(HWND hWnd, HWND hWndInsertAfter, int X, int Y, int
 	HMENU menu;
 	BOOL ret;
 	HWND_HOOK *wndhook;
+	InvalidateWindowClipLists();
 	if (!windowscalehook) return _SetWindowPos(hWnd, hWndInsertAfter, X, Y, cx, cy, uFlags);
 	wndhook = GetWndHook(hWnd);
 	if (!wndhook) return  _SetWindowPos(hWnd, hWndInsertAfter, X, Y, cx, cy, uFlags);
@@ -38,7 +38,11 @@ void ShutdownHooks();
 LRESULT CALLBACK DXGLWndHookProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
 void InstallDXGLHook(HWND hWnd, LPDIRECTDRAW7 lpDD7);
 void UninstallDXGLHook(HWND hWnd);
+HWND_HOOK *GetWndHook(HWND hWnd);
 void EnableWindowScaleHook(BOOL enable);
+void InvalidateWindowClipLists();
+void InvalidateDisplayCache();
+LONG GetWindowClipSerial();
 
 // Window management
 extern LONG(WINAPI *_SetWindowLongA)(HWND hWnd, int nIndex, LONG dwNewLong);
@@ -48,6 +48,8 @@
  */
 #include "common.h"
 #include "matrix.h"
+#include <emmintrin.h>
+#include <math.h>
 
 // From project.c:
 /*
@@ -105,22 +107,27 @@ int __gluInvertMatrixf(const GLfloat m[16], GLfloat invOut[16])
     return GL_TRUE;
 }
 
+// Rewritten with SSE, each row of the result is a linear combination of the
+// rows of b.  r may alias a or b.
 void __gluMultMatricesf(const GLfloat a[16], const GLfloat b[16],
 				GLfloat r[16])
 {
-    int i, j;
-	GLfloat out[16];
-
-    for (i = 0; i < 4; i++) {
-	for (j = 0; j < 4; j++) {
-	    out[i*4+j] = 
-		a[i*4+0]*b[0*4+j] +
-		a[i*4+1]*b[1*4+j] +
-		a[i*4+2]*b[2*4+j] +
-		a[i*4+3]*b[3*4+j];
+	__m128 b0 = _mm_loadu_ps(&b[0]);
+	__m128 b1 = _mm_loadu_ps(&b[4]);
+	__m128 b2 = _mm_loadu_ps(&b[8]);
+	__m128 b3 = _mm_loadu_ps(&b[12]);
+	__m128 out[4];
+	int i;
+
+	for (i = 0; i < 4; i++)
+	{
+		out[i] = _mm_mul_ps(_mm_set1_ps(a[i*4+0]), b0);
+		out[i] = _mm_add_ps(out[i], _mm_mul_ps(_mm_set1_ps(a[i*4+1]), b1));
+		out[i] = _mm_add_ps(out[i], _mm_mul_ps(_mm_set1_ps(a[i*4+2]), b2));
+		out[i] = _mm_add_ps(out[i], _mm_mul_ps(_mm_set1_ps(a[i*4+3]), b3));
 	}
-    }
-	memcpy(r, out, 16 * sizeof(GLfloat));
+	for (i = 0; i < 4; i++)
+		_mm_storeu_ps(&r[i*4], out[i]);
 }
 
 void __gluMakeIdentityf(GLfloat m[16])
@@ -131,17 +138,14 @@ void __gluMakeIdentityf(GLfloat m[16])
     m[3+4*0] = 0; m[3+4*1] = 0; m[3+4*2] = 0; m[3+4*3] = 1;
 }
 
+// Rewritten with SSE
 void __gluMultMatrixVecf(const GLfloat matrix[16], const GLfloat in[4], GLfloat out[4])
 {
-    int i;
-
-    for (i=0; i<4; i++) {
-	out[i] = 
-	    in[0] * matrix[0*4+i] +
-	    in[1] * matrix[1*4+i] +
-	    in[2] * matrix[2*4+i] +
-	    in[3] * matrix[3*4+i];
-    }
+	__m128 r = _mm_mul_ps(_mm_set1_ps(in[0]), _mm_loadu_ps(&matrix[0]));
+	r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(in[1]), _mm_loadu_ps(&matrix[4])));
+	r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(in[2]), _mm_loadu_ps(&matrix[8])));
+	r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(in[3]), _mm_loadu_ps(&matrix[12])));
+	_mm_storeu_ps(out, r);
 }
 
 
@@ -171,30 +175,411 @@ void __gluMultMatrixVecf(const GLfloat matrix[16], const GLfloat in[4], GLfloat
 void multiply_matrix(struct wined3d_matrix *dest, const struct wined3d_matrix *src1,
 	const struct wined3d_matrix *src2)
 {
-	struct wined3d_matrix temp;
-
-	/* Now do the multiplication 'by hand'.
-	I know that all this could be optimised, but this will be done later :-) */
-	temp._11 = (src1->_11 * src2->_11) + (src1->_21 * src2->_12) + (src1->_31 * src2->_13) + (src1->_41 * src2->_14);
-	temp._21 = (src1->_11 * src2->_21) + (src1->_21 * src2->_22) + (src1->_31 * src2->_23) + (src1->_41 * src2->_24);
-	temp._31 = (src1->_11 * src2->_31) + (src1->_21 * src2->_32) + (src1->_31 * src2->_33) + (src1->_41 * src2->_34);
-	temp._41 = (src1->_11 * src2->_41) + (src1->_21 * src2->_42) + (src1->_31 * src2->_43) + (src1->_41 * src2->_44);
-
-	temp._12 = (src1->_12 * src2->_11) + (src1->_22 * src2->_12) + (src1->_32 * src2->_13) + (src1->_42 * src2->_14);
-	temp._22 = (src1->_12 * src2->_21) + (src1->_22 * src2->_22) + (src1->_32 * src2->_23) + (src1->_42 * src2->_24);
-	temp._32 = (src1->_12 * src2->_31) + (src1->_22 * src2->_32) + (src1->_32 * src2->_33) + (src1->_42 * src2->_34);
-	temp._42 = (src1->_12 * src2->_41) + (src1->_22 * src2->_42) + (src1->_32 * src2->_43) + (src1->_42 * src2->_44);
-
-	temp._13 = (src1->_13 * src2->_11) + (src1->_23 * src2->_12) + (src1->_33 * src2->_13) + (src1->_43 * src2->_14);
-	temp._23 = (src1->_13 * src2->_21) + (src1->_23 * src2->_22) + (src1->_33 * src2->_23) + (src1->_43 * src2->_24);
-	temp._33 = (src1->_13 * src2->_31) + (src1->_23 * src2->_32) + (src1->_33 * src2->_33) + (src1->_43 * src2->_34);
-	temp._43 = (src1->_13 * src2->_41) + (src1->_23 * src2->_42) + (src1->_33 * src2->_43) + (src1->_43 * src2->_44);
-
-	temp._14 = (src1->_14 * src2->_11) + (src1->_24 * src2->_12) + (src1->_34 * src2->_13) + (src1->_44 * src2->_14);
-	temp._24 = (src1->_14 * src2->_21) + (src1->_24 * src2->_22) + (src1->_34 * src2->_23) + (src1->_44 * src2->_24);
-	temp._34 = (src1->_14 * src2->_31) + (src1->_24 * src2->_32) + (src1->_34 * src2->_33) + (src1->_44 * src2->_34);
-	temp._44 = (src1->_14 * src2->_41) + (src1->_24 * src2->_42) + (src1->_34 * src2->_43) + (src1->_44 * src2->_44);
-
-	/* And copy the new matrix in the good storage.. */
-	memcpy(dest, &temp, 16 * sizeof(float));
+	// Same product as __gluMultMatricesf with the operands swapped
+	__gluMultMatricesf((const GLfloat*)src2, (const GLfloat*)src1, (GLfloat*)dest);
+}
+
+static __inline __m128 Matrix_Cross(__m128 a, __m128 b)
+{
+	__m128 a1 = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1));
+	__m128 b1 = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1));
+	__m128 r = _mm_sub_ps(_mm_mul_ps(a, b1), _mm_mul_ps(a1, b));
+	return _mm_shuffle_ps(r, r, _MM_SHUFFLE(3, 0, 2, 1));
+}
+
+/**
+  * Computes the transpose of the inverse of the upper 3x3 part of a matrix,
+  * as used to transform normals.
+  * @param m
+  *  Matrix to invert; rows containing projection terms fall back to a full
+  *  4x4 inverse
+  * @param out
+  *  Receives the three rows of the result, each padded to four floats
+  * @return
+  *  GL_TRUE if the matrix could be inverted, otherwise GL_FALSE and out
+  *  receives the identity
+  */
+int Matrix_InverseTranspose3x3(const GLfloat m[16], GLfloat out[12])
+{
+	GLfloat inverse[16];
+	__m128 mask, r0, r1, r2, c0, c1, c2, det;
+	int ret, y;
+	if ((m[3] != 0.0f) || (m[7] != 0.0f) || (m[11] != 0.0f))
+	{
+		ret = __gluInvertMatrixf(m, inverse);
+		if (!ret) __gluMakeIdentityf(inverse);
+		for (y = 0; y < 3; y++)
+		{
+			out[0 + (y * 4)] = inverse[y + 0];
+			out[1 + (y * 4)] = inverse[y + 4];
+			out[2 + (y * 4)] = inverse[y + 8];
+			out[3 + (y * 4)] = 0.0f;
+		}
+		return ret;
+	}
+	mask = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+	r0 = _mm_and_ps(_mm_loadu_ps(&m[0]), mask);
+	r1 = _mm_and_ps(_mm_loadu_ps(&m[4]), mask);
+	r2 = _mm_and_ps(_mm_loadu_ps(&m[8]), mask);
+	// The rows of the inverse transpose are the cross products of the rows
+	c0 = Matrix_Cross(r1, r2);
+	c1 = Matrix_Cross(r2, r0);
+	c2 = Matrix_Cross(r0, r1);
+	det = _mm_mul_ps(r0, c0);
+	det = _mm_add_ps(det, _mm_shuffle_ps(det, det, _MM_SHUFFLE(2, 3, 0, 1)));
+	det = _mm_add_ps(det, _mm_shuffle_ps(det, det, _MM_SHUFFLE(1, 0, 3, 2)));
+	if (_mm_cvtss_f32(det) == 0.0f)
+	{
+		memset(out, 0, 12 * sizeof(GLfloat));
+		out[0] = out[5] = out[10] = 1.0f;
+		return GL_FALSE;
+	}
+	det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+	_mm_storeu_ps(&out[0], _mm_mul_ps(c0, det));
+	_mm_storeu_ps(&out[4], _mm_mul_ps(c1, det));
+	_mm_storeu_ps(&out[8], _mm_mul_ps(c2, det));
+	return GL_TRUE;
+}
+
+/**
+  * Transforms an array of positions by a matrix, with w taken as 1.
+  * @param m
+  *  Matrix to transform by
+  * @param in
+  *  Pointer to the x, y and z of the first input position
+  * @param instride
+  *  Distance in bytes between input positions
+  * @param out
+  *  Pointer to receive the x, y, z and w of the first output position
+  * @param outstride
+  *  Distance in bytes between output positions
+  * @param count
+  *  Number of positions to transform
+  */
+void Matrix_TransformPoints(const GLfloat m[16], const GLfloat *in, DWORD instride,
+	GLfloat *out, DWORD outstride, DWORD count)
+{
+	__m128 m0 = _mm_loadu_ps(&m[0]);
+	__m128 m1 = _mm_loadu_ps(&m[4]);
+	__m128 m2 = _mm_loadu_ps(&m[8]);
+	__m128 m3 = _mm_loadu_ps(&m[12]);
+	__m128 r;
+	const BYTE *src = (const BYTE*)in;
+	BYTE *dest = (BYTE*)out;
+	DWORD i;
+	for (i = 0; i < count; i++)
+	{
+		const GLfloat *v = (const GLfloat*)src;
+		r = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(v[0]), m0), m3);
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(v[1]), m1));
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(v[2]), m2));
+		_mm_storeu_ps((GLfloat*)dest, r);
+		src += instride;
+		dest += outstride;
+	}
+}
+
+/**
+  * Extracts the six clipping planes of the view frustum from a combined
+  * world, view and projection matrix.
+  * @param m
+  *  World * view * projection matrix
+  * @param planes
+  *  Receives the left, right, top, bottom, front and back planes as a, b, c
+  *  and d, normalized so a sphere center gives its distance from the plane
+  */
+void Matrix_ExtractFrustum(const GLfloat m[16], GLfloat planes[24])
+{
+	__m128 c0 = _mm_set_ps(m[12], m[8], m[4], m[0]);
+	__m128 c1 = _mm_set_ps(m[13], m[9], m[5], m[1]);
+	__m128 c2 = _mm_set_ps(m[14], m[10], m[6], m[2]);
+	__m128 c3 = _mm_set_ps(m[15], m[11], m[7], m[3]);
+	__m128 plane[6];
+	float norm;
+	int i;
+	plane[0] = _mm_add_ps(c3, c0);  // Left
+	plane[1] = _mm_sub_ps(c3, c0);  // Right
+	plane[2] = _mm_sub_ps(c3, c1);  // Top
+	plane[3] = _mm_add_ps(c3, c1);  // Bottom
+	plane[4] = c2;  // Front
+	plane[5] = _mm_sub_ps(c3, c2);  // Back
+	for (i = 0; i < 6; i++)
+	{
+		_mm_storeu_ps(&planes[i * 4], plane[i]);
+		norm = sqrtf(planes[(i * 4) + 0] * planes[(i * 4) + 0] + planes[(i * 4) + 1] * planes[(i * 4) + 1]
+			+ planes[(i * 4) + 2] * planes[(i * 4) + 2]);
+		if (norm != 0.0f) _mm_storeu_ps(&planes[i * 4], _mm_mul_ps(plane[i], _mm_set1_ps(1.0f / norm)));
+	}
+}
+
+/**
+  * Tests spheres against the planes from Matrix_ExtractFrustum, four at a
+  * time.
+  * @param planes
+  *  Frustum planes from Matrix_ExtractFrustum
+  * @param centers
+  *  Pointer to the centers of the spheres
+  * @param radii
+  *  Pointer to the radii of the spheres
+  * @param count
+  *  Number of spheres to test
+  * @param out
+  *  Receives the D3DSTATUS_CLIPUNION* and D3DSTATUS_CLIPINTERSECTION* flags
+  *  of each sphere
+  */
+void Matrix_SphereVisibility(const GLfloat planes[24], const D3DVECTOR *centers, const D3DVALUE *radii,
+	DWORD count, LPDWORD out)
+{
+	__m128 absmask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+	__m128 x, y, z, r, negr, dist;
+	__m128i result;
+	D3DVECTOR tailcenters[4];
+	D3DVALUE tailradii[4];
+	DWORD tailout[4];
+	const D3DVECTOR *c;
+	const D3DVALUE *rad;
+	DWORD i, j, n;
+	for (i = 0; i < count; i += 4)
+	{
+		n = count - i;
+		if (n >= 4)
+		{
+			c = &centers[i];
+			rad = &radii[i];
+		}
+		else
+		{
+			// Pad the last group by repeating its final sphere
+			for (j = 0; j < 4; j++)
+			{
+				tailcenters[j] = centers[i + ((j < n) ? j : (n - 1))];
+				tailradii[j] = radii[i + ((j < n) ? j : (n - 1))];
+			}
+			c = tailcenters;
+			rad = tailradii;
+		}
+		x = _mm_set_ps(c[3].x, c[2].x, c[1].x, c[0].x);
+		y = _mm_set_ps(c[3].y, c[2].y, c[1].y, c[0].y);
+		z = _mm_set_ps(c[3].z, c[2].z, c[1].z, c[0].z);
+		r = _mm_loadu_ps(rad);
+		negr = _mm_sub_ps(_mm_setzero_ps(), r);
+		result = _mm_setzero_si128();
+		for (j = 0; j < 6; j++)
+		{
+			dist = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(planes[(j * 4) + 0])), _mm_set1_ps(planes[(j * 4) + 3]));
+			dist = _mm_add_ps(dist, _mm_mul_ps(y, _mm_set1_ps(planes[(j * 4) + 1])));
+			dist = _mm_add_ps(dist, _mm_mul_ps(z, _mm_set1_ps(planes[(j * 4) + 2])));
+			// Spheres crossing the plane and spheres entirely outside of it
+			result = _mm_or_si128(result, _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(_mm_and_ps(dist, absmask), r)),
+				_mm_set1_epi32(D3DSTATUS_CLIPUNIONLEFT << j)));
+			result = _mm_or_si128(result, _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(dist, negr)),
+				_mm_set1_epi32((D3DSTATUS_CLIPUNIONLEFT | D3DSTATUS_CLIPINTERSECTIONLEFT) << j)));
+		}
+		if (n >= 4) _mm_storeu_si128((__m128i*)&out[i], result);
+		else
+		{
+			_mm_storeu_si128((__m128i*)tailout, result);
+			memcpy(&out[i], tailout, n * sizeof(DWORD));
+		}
+	}
+}
+
+/**
+  * Computes a sphere around transformed positions, from the box around them
+  * before the transform.  The radius is scaled by the largest factor the
+  * matrix can stretch by, so the sphere always encloses the positions.
+  * @param m
+  *  Matrix to transform by
+  * @param in
+  *  Pointer to the x, y and z of the first position
+  * @param instride
+  *  Distance in bytes between positions
+  * @param count
+  *  Number of positions, at least 1
+  * @param center
+  *  Receives the transformed center of the sphere
+  * @param radius
+  *  Receives the radius of the sphere after the transform
+  */
+void Matrix_BoundingSphere(const GLfloat m[16], const GLfloat *in, DWORD instride, DWORD count,
+	D3DVECTOR *center, D3DVALUE *radius)
+{
+	const BYTE *src = (const BYTE*)in;
+	const GLfloat *v = in;
+	__m128 lo = _mm_set_ps(0.0f, v[2], v[1], v[0]);
+	__m128 hi = lo;
+	__m128 p, c, e;
+	GLfloat box[4];
+	GLfloat out[4];
+	GLfloat scale;
+	DWORD i;
+	for (i = 1; i < count; i++)
+	{
+		src += instride;
+		v = (const GLfloat*)src;
+		p = _mm_set_ps(0.0f, v[2], v[1], v[0]);
+		lo = _mm_min_ps(lo, p);
+		hi = _mm_max_ps(hi, p);
+	}
+	c = _mm_mul_ps(_mm_add_ps(lo, hi), _mm_set1_ps(0.5f));
+	e = _mm_sub_ps(hi, c);
+	_mm_storeu_ps(box, c);
+	Matrix_TransformPoints(m, box, 0, out, 0, 1);
+	center->x = out[0];
+	center->y = out[1];
+	center->z = out[2];
+	_mm_storeu_ps(box, _mm_mul_ps(e, e));
+	// The Frobenius norm of the upper 3x3 bounds how far it stretches any vector
+	scale = (m[0] * m[0]) + (m[1] * m[1]) + (m[2] * m[2])
+		+ (m[4] * m[4]) + (m[5] * m[5]) + (m[6] * m[6])
+		+ (m[8] * m[8]) + (m[9] * m[9]) + (m[10] * m[10]);
+	*radius = sqrtf((box[0] + box[1] + box[2]) * scale);
+}
+
+/**
+  * Transforms positions to the screen four at a time, computing the
+  * D3DCLIP_* flags of each position against the clip volume.
+  * @param m
+  *  World * view * projection matrix
+  * @param vp
+  *  Clip volume and mapping of clip space to the screen
+  * @param in
+  *  Pointer to the x, y and z of the first input position
+  * @param instride
+  *  Distance in bytes between input positions
+  * @param out
+  *  Pointer to receive the sx, sy, sz and rhw of the first output position
+  * @param outstride
+  *  Distance in bytes between output positions
+  * @param hout
+  *  Receives the clip flags and the clip space x, y and z of each position,
+  *  may be NULL
+  * @param count
+  *  Number of positions to transform
+  * @param clip
+  *  FALSE if the positions are known to be inside the clip volume, so no
+  *  clip flags are computed
+  * @param clipunion
+  *  Receives the clip flags set for any position
+  * @param clipintersection
+  *  Receives the clip flags set for all positions
+  * @param extent
+  *  Receives the screen rectangle around the positions inside the clip
+  *  volume, all zero if there are none
+  */
+void Matrix_ProjectPoints(const GLfloat m[16], const MATRIXVIEWPORT *vp, const GLfloat *in, DWORD instride,
+	GLfloat *out, DWORD outstride, D3DHVERTEX *hout, DWORD count, BOOL clip, LPDWORD clipunion, LPDWORD clipintersection,
+	D3DRECT *extent)
+{
+	__m128 inf = _mm_set1_ps(HUGE_VALF);
+	__m128 neginf = _mm_set1_ps(-HUGE_VALF);
+	__m128 lo = inf;
+	__m128 hi = neginf;
+	__m128 x, y, z, cx, cy, cz, cw, rhw, sx, sy, sz, inside;
+	__m128i flags;
+	__m128i unionflags = _mm_setzero_si128();
+	__m128i intersectionflags = _mm_set1_epi32(-1);
+	GLfloat gather[3][4];
+	GLfloat scatter[8][4];
+	DWORD flagout[4];
+	DWORD i, j, n;
+	const GLfloat *v;
+	GLfloat *dest;
+	for (i = 0; i < count; i += 4)
+	{
+		// Pad the last group by repeating its final position, which leaves
+		// the union, intersection and extent unchanged
+		n = count - i;
+		if (n > 4) n = 4;
+		for (j = 0; j < 4; j++)
+		{
+			v = (const GLfloat*)((const BYTE*)in + ((i + ((j < n) ? j : (n - 1))) * instride));
+			gather[0][j] = v[0];
+			gather[1][j] = v[1];
+			gather[2][j] = v[2];
+		}
+		x = _mm_loadu_ps(gather[0]);
+		y = _mm_loadu_ps(gather[1]);
+		z = _mm_loadu_ps(gather[2]);
+		cx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(m[0])), _mm_mul_ps(y, _mm_set1_ps(m[4]))),
+			_mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(m[8])), _mm_set1_ps(m[12])));
+		cy = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(m[1])), _mm_mul_ps(y, _mm_set1_ps(m[5]))),
+			_mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(m[9])), _mm_set1_ps(m[13])));
+		cz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(m[2])), _mm_mul_ps(y, _mm_set1_ps(m[6]))),
+			_mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(m[10])), _mm_set1_ps(m[14])));
+		cw = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(m[3])), _mm_mul_ps(y, _mm_set1_ps(m[7]))),
+			_mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(m[11])), _mm_set1_ps(m[15])));
+		flags = _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(cx, _mm_mul_ps(cw, _mm_set1_ps(vp->minx)))),
+			_mm_set1_epi32(D3DCLIP_LEFT));
+		flags = _mm_or_si128(flags, _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(cx, _mm_mul_ps(cw, _mm_set1_ps(vp->maxx)))),
+			_mm_set1_epi32(D3DCLIP_RIGHT)));
+		flags = _mm_or_si128(flags, _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(cy, _mm_mul_ps(cw, _mm_set1_ps(vp->maxy)))),
+			_mm_set1_epi32(D3DCLIP_TOP)));
+		flags = _mm_or_si128(flags, _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(cy, _mm_mul_ps(cw, _mm_set1_ps(vp->miny)))),
+			_mm_set1_epi32(D3DCLIP_BOTTOM)));
+		flags = _mm_or_si128(flags, _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(cz, _mm_setzero_ps())),
+			_mm_set1_epi32(D3DCLIP_FRONT)));
+		flags = _mm_or_si128(flags, _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(cz, cw)),
+			_mm_set1_epi32(D3DCLIP_BACK)));
+		if (!clip) flags = _mm_setzero_si128();
+		unionflags = _mm_or_si128(unionflags, flags);
+		intersectionflags = _mm_and_si128(intersectionflags, flags);
+		rhw = _mm_div_ps(_mm_set1_ps(1.0f), cw);
+		sx = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(cx, rhw), _mm_set1_ps(vp->scalex)), _mm_set1_ps(vp->offsetx));
+		sy = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(cy, rhw), _mm_set1_ps(vp->scaley)), _mm_set1_ps(vp->offsety));
+		sz = _mm_mul_ps(cz, rhw);
+		// Only positions inside the clip volume count towards the extent
+		inside = _mm_castsi128_ps(_mm_cmpeq_epi32(flags, _mm_setzero_si128()));
+		lo = _mm_min_ps(lo, _mm_or_ps(_mm_and_ps(_mm_unpacklo_ps(inside, inside), _mm_unpacklo_ps(sx, sy)),
+			_mm_andnot_ps(_mm_unpacklo_ps(inside, inside), inf)));
+		lo = _mm_min_ps(lo, _mm_or_ps(_mm_and_ps(_mm_unpackhi_ps(inside, inside), _mm_unpackhi_ps(sx, sy)),
+			_mm_andnot_ps(_mm_unpackhi_ps(inside, inside), inf)));
+		hi = _mm_max_ps(hi, _mm_or_ps(_mm_and_ps(_mm_unpacklo_ps(inside, inside), _mm_unpacklo_ps(sx, sy)),
+			_mm_andnot_ps(_mm_unpacklo_ps(inside, inside), neginf)));
+		hi = _mm_max_ps(hi, _mm_or_ps(_mm_and_ps(_mm_unpackhi_ps(inside, inside), _mm_unpackhi_ps(sx, sy)),
+			_mm_andnot_ps(_mm_unpackhi_ps(inside, inside), neginf)));
+		_mm_storeu_ps(scatter[0], sx);
+		_mm_storeu_ps(scatter[1], sy);
+		_mm_storeu_ps(scatter[2], sz);
+		_mm_storeu_ps(scatter[3], rhw);
+		_mm_storeu_ps(scatter[4], cx);
+		_mm_storeu_ps(scatter[5], cy);
+		_mm_storeu_ps(scatter[6], cz);
+		_mm_storeu_si128((__m128i*)flagout, flags);
+		for (j = 0; j < n; j++)
+		{
+			dest = (GLfloat*)((BYTE*)out + ((i + j) * outstride));
+			dest[0] = scatter[0][j];
+			dest[1] = scatter[1][j];
+			dest[2] = scatter[2][j];
+			dest[3] = scatter[3][j];
+			if (hout)
+			{
+				hout[i + j].dwFlags = flagout[j];
+				hout[i + j].hx = scatter[4][j];
+				hout[i + j].hy = scatter[5][j];
+				hout[i + j].hz = scatter[6][j];
+			}
+		}
+	}
+	_mm_storeu_si128((__m128i*)flagout, unionflags);
+	*clipunion = flagout[0] | flagout[1] | flagout[2] | flagout[3];
+	_mm_storeu_si128((__m128i*)flagout, intersectionflags);
+	*clipintersection = count ? (flagout[0] & flagout[1] & flagout[2] & flagout[3]) : 0;
+	// lo and hi hold x, y, x, y
+	_mm_storeu_ps(scatter[0], lo);
+	_mm_storeu_ps(scatter[1], hi);
+	scatter[0][0] = min(scatter[0][0], scatter[0][2]);
+	scatter[0][1] = min(scatter[0][1], scatter[0][3]);
+	scatter[1][0] = max(scatter[1][0], scatter[1][2]);
+	scatter[1][1] = max(scatter[1][1], scatter[1][3]);
+	if (scatter[0][0] > scatter[1][0])
+	{
+		extent->x1 = extent->y1 = extent->x2 = extent->y2 = 0;
+		return;
+	}
+	extent->x1 = (LONG)floorf(scatter[0][0]);
+	extent->y1 = (LONG)floorf(scatter[0][1]);
+	extent->x2 = (LONG)ceilf(scatter[1][0]);
+	extent->y2 = (LONG)ceilf(scatter[1][1]);
 }
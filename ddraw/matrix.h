@@ -59,6 +59,25 @@ void __gluMultMatricesf(const GLfloat a[16], const GLfloat b[16],
 				GLfloat r[16]);
 void __gluMakeIdentityf(GLfloat m[16]);
 void __gluMultMatrixVecf(const GLfloat matrix[16], const GLfloat in[4], GLfloat out[4]);
+int Matrix_InverseTranspose3x3(const GLfloat m[16], GLfloat out[12]);
+void Matrix_TransformPoints(const GLfloat m[16], const GLfloat *in, DWORD instride,
+	GLfloat *out, DWORD outstride, DWORD count);
+void Matrix_ExtractFrustum(const GLfloat m[16], GLfloat planes[24]);
+void Matrix_SphereVisibility(const GLfloat planes[24], const D3DVECTOR *centers, const D3DVALUE *radii,
+	DWORD count, LPDWORD out);
+void Matrix_BoundingSphere(const GLfloat m[16], const GLfloat *in, DWORD instride, DWORD count,
+	D3DVECTOR *center, D3DVALUE *radius);
+
+// Clip volume and screen mapping for Matrix_ProjectPoints
+typedef struct MATRIXVIEWPORT
+{
+	GLfloat minx, maxx, miny, maxy;  // Clip volume edges, compared against clip space x and y divided by w
+	GLfloat scalex, offsetx, scaley, offsety;  // Screen position is offset + (coordinate / w) * scale
+} MATRIXVIEWPORT;
+
+void Matrix_ProjectPoints(const GLfloat m[16], const MATRIXVIEWPORT *vp, const GLfloat *in, DWORD instride,
+	GLfloat *out, DWORD outstride, D3DHVERTEX *hout, DWORD count, BOOL clip, LPDWORD clipunion,
+	LPDWORD clipintersection, D3DRECT *extent);
 
 // Portions of this file are from the Wine project, distributed under the
 // following license:
@@ -18,95 +18,389 @@
 #include "common.h"
 #include "scalers.h"
 #include <WinDef.h>
+#include <intrin.h>
+#include <emmintrin.h>
+#include <immintrin.h>
 
+// Widens one row by a whole number of pixels per source pixel
+typedef void(*SCALEROWPROC)(BYTE *dest, const BYTE *src, int sw);
 
-void ScaleNearest8(void *dest, void *src, int dw, int dh, int sw, int sh, int inpitch, int outpitch)
+typedef struct SCALEJOB
+{
+	int bytes;  // Bytes per pixel
+	BYTE *dest;
+	const BYTE *src;
+	int dw, dh, sw, sh;
+	int inpitch, outpitch;  // Row pitches in bytes
+	int rx, ry;
+	SCALEROWPROC rowproc;  // Fast path for the row ratio, NULL to step each pixel
+	int ystart, yend;
+	volatile LONG *pending;
+	HANDLE done;
+} SCALEJOB;
+
+static int simdlevel = -1;  // 0 = none, 1 = SSE2, 2 = AVX2
+static DWORD cpucount = 0;
+
+static void Scale_Init()
 {
-	BYTE *d = (BYTE *)dest;
-	BYTE *s = (BYTE *)src;
-	int rx = (int)((sw<<16)/dw)+1;
-	int ry = (int)((sh<<16)/dh)+1;
-	int x,y;
-	int x2,y2;
-	int b1,b2;
-	for(y = 0; y < dh; y++)
+	int info[4];
+	int maxleaf;
+	SYSTEM_INFO sysinfo;
+	simdlevel = 0;
+	__cpuid(info, 0);
+	maxleaf = info[0];
+	__cpuid(info, 1);
+	if (info[3] & (1 << 26)) simdlevel = 1;
+	// AVX2 also needs the OS to save YMM registers
+	if ((maxleaf >= 7) && (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && ((_xgetbv(0) & 6) == 6))
 	{
-		b1 = y*outpitch;
-		y2 = ((y*ry)>>16);
-		b2 = y2*inpitch;
-		for(x = 0; x < dw; x++)
-		{
-			x2 = ((x*rx)>>16);
-			y2 = ((y*ry)>>16);
-			d[b1+x] = s[b2+x2];
-		}
+		__cpuidex(info, 7, 0);
+		if (info[1] & (1 << 5)) simdlevel = 2;
 	}
+	GetSystemInfo(&sysinfo);
+	cpucount = sysinfo.dwNumberOfProcessors;
+	if (!cpucount) cpucount = 1;
 }
-void ScaleNearest16(void *dest, void *src, int dw, int dh, int sw, int sh, int inpitch, int outpitch)
+
+static void ScaleRow2x8_sse2(BYTE *dest, const BYTE *src, int sw)
 {
-	WORD *d = (WORD *)dest;
-	WORD *s = (WORD *)src;
-	int rx = (int)((sw<<16)/dw)+1;
-	int ry = (int)((sh<<16)/dh)+1;
-	int x,y;
-	int x2,y2;
-	int b1,b2;
-	for(y = 0; y < dh; y++)
+	int x = 0;
+	__m128i v;
+	for (; x + 16 <= sw; x += 16)
 	{
-		b1 = y*outpitch;
-		y2 = ((y*ry)>>16);
-		b2 = y2*inpitch;
-		for(x = 0; x < dw; x++)
-		{
-			x2 = ((x*rx)>>16);
-			y2 = ((y*ry)>>16);
-			d[b1+x] = s[b2+x2];
-		}
+		v = _mm_loadu_si128((const __m128i*)(src + x));
+		_mm_storeu_si128((__m128i*)(dest + (x * 2)), _mm_unpacklo_epi8(v, v));
+		_mm_storeu_si128((__m128i*)(dest + (x * 2) + 16), _mm_unpackhi_epi8(v, v));
 	}
+	for (; x < sw; x++) dest[x * 2] = dest[(x * 2) + 1] = src[x];
 }
-void ScaleNearest24(void *dest, void *src, int dw, int dh, int sw, int sh, int inpitch, int outpitch)
+
+static void ScaleRow2x16_sse2(BYTE *dest, const BYTE *src, int sw)
 {
-	RGBTRIPLE *d = (RGBTRIPLE *)dest;
-	RGBTRIPLE *s = (RGBTRIPLE *)src;
-	char *d8 = (char*)dest;
-	char *s8 = (char*)src;
-	int rx = (int)((sw<<16)/dw)+1;
-	int ry = (int)((sh<<16)/dh)+1;
-	int x,y;
-	int x2,y2;
-	for(y = 0; y < dh; y++)
+	WORD *d = (WORD*)dest;
+	const WORD *s = (const WORD*)src;
+	int x = 0;
+	__m128i v;
+	for (; x + 8 <= sw; x += 8)
 	{
-		d8 = (y*outpitch)+(char*)dest;
-		y2 = ((y*ry)>>16);
-		s8 = (y2*inpitch)+(char*)src;
-		d = (RGBTRIPLE*)d8;
-		s = (RGBTRIPLE*)s8;
-		for(x = 0; x < dw; x++)
-		{
-			x2 = ((x*rx)>>16);
-			y2 = ((y*ry)>>16);
-			d[x] = s[x2];
-		}
+		v = _mm_loadu_si128((const __m128i*)(s + x));
+		_mm_storeu_si128((__m128i*)(d + (x * 2)), _mm_unpacklo_epi16(v, v));
+		_mm_storeu_si128((__m128i*)(d + (x * 2) + 8), _mm_unpackhi_epi16(v, v));
 	}
+	for (; x < sw; x++) d[x * 2] = d[(x * 2) + 1] = s[x];
 }
-void ScaleNearest32(void *dest, void *src, int dw, int dh, int sw, int sh, int inpitch, int outpitch)
+
+static void ScaleRow2x32_sse2(BYTE *dest, const BYTE *src, int sw)
+{
+	DWORD *d = (DWORD*)dest;
+	const DWORD *s = (const DWORD*)src;
+	int x = 0;
+	__m128i v;
+	for (; x + 4 <= sw; x += 4)
+	{
+		v = _mm_loadu_si128((const __m128i*)(s + x));
+		_mm_storeu_si128((__m128i*)(d + (x * 2)), _mm_unpacklo_epi32(v, v));
+		_mm_storeu_si128((__m128i*)(d + (x * 2) + 4), _mm_unpackhi_epi32(v, v));
+	}
+	for (; x < sw; x++) d[x * 2] = d[(x * 2) + 1] = s[x];
+}
+
+static void ScaleRow4x8_sse2(BYTE *dest, const BYTE *src, int sw)
 {
-	DWORD *d = (DWORD *)dest;
-	DWORD *s = (DWORD *)src;
-	int rx = (int)((sw<<16)/dw)+1;
-	int ry = (int)((sh<<16)/dh)+1;
-	int x,y;
-	int x2,y2;
-	int b1,b2;
-	for(y = 0; y < dh; y++)
+	int x = 0;
+	__m128i v, lo, hi;
+	for (; x + 16 <= sw; x += 16)
 	{
-		b1 = y*outpitch;
-		y2 = ((y*ry)>>16);
-		b2 = y2*inpitch;
-		for(x = 0; x < dw; x++)
+		v = _mm_loadu_si128((const __m128i*)(src + x));
+		lo = _mm_unpacklo_epi8(v, v);
+		hi = _mm_unpackhi_epi8(v, v);
+		_mm_storeu_si128((__m128i*)(dest + (x * 4)), _mm_unpacklo_epi16(lo, lo));
+		_mm_storeu_si128((__m128i*)(dest + (x * 4) + 16), _mm_unpackhi_epi16(lo, lo));
+		_mm_storeu_si128((__m128i*)(dest + (x * 4) + 32), _mm_unpacklo_epi16(hi, hi));
+		_mm_storeu_si128((__m128i*)(dest + (x * 4) + 48), _mm_unpackhi_epi16(hi, hi));
+	}
+	for (; x < sw; x++) memset(dest + (x * 4), src[x], 4);
+}
+
+static void ScaleRow4x16_sse2(BYTE *dest, const BYTE *src, int sw)
+{
+	WORD *d = (WORD*)dest;
+	const WORD *s = (const WORD*)src;
+	int x = 0;
+	__m128i v, lo, hi;
+	for (; x + 8 <= sw; x += 8)
+	{
+		v = _mm_loadu_si128((const __m128i*)(s + x));
+		lo = _mm_unpacklo_epi16(v, v);
+		hi = _mm_unpackhi_epi16(v, v);
+		_mm_storeu_si128((__m128i*)(d + (x * 4)), _mm_unpacklo_epi32(lo, lo));
+		_mm_storeu_si128((__m128i*)(d + (x * 4) + 8), _mm_unpackhi_epi32(lo, lo));
+		_mm_storeu_si128((__m128i*)(d + (x * 4) + 16), _mm_unpacklo_epi32(hi, hi));
+		_mm_storeu_si128((__m128i*)(d + (x * 4) + 24), _mm_unpackhi_epi32(hi, hi));
+	}
+	for (; x < sw; x++) d[x * 4] = d[(x * 4) + 1] = d[(x * 4) + 2] = d[(x * 4) + 3] = s[x];
+}
+
+static void ScaleRow4x32_sse2(BYTE *dest, const BYTE *src, int sw)
+{
+	DWORD *d = (DWORD*)dest;
+	const DWORD *s = (const DWORD*)src;
+	int x = 0;
+	__m128i v, lo, hi;
+	for (; x + 4 <= sw; x += 4)
+	{
+		v = _mm_loadu_si128((const __m128i*)(s + x));
+		lo = _mm_unpacklo_epi32(v, v);
+		hi = _mm_unpackhi_epi32(v, v);
+		_mm_storeu_si128((__m128i*)(d + (x * 4)), _mm_unpacklo_epi64(lo, lo));
+		_mm_storeu_si128((__m128i*)(d + (x * 4) + 4), _mm_unpackhi_epi64(lo, lo));
+		_mm_storeu_si128((__m128i*)(d + (x * 4) + 8), _mm_unpacklo_epi64(hi, hi));
+		_mm_storeu_si128((__m128i*)(d + (x * 4) + 12), _mm_unpackhi_epi64(hi, hi));
+	}
+	for (; x < sw; x++) d[x * 4] = d[(x * 4) + 1] = d[(x * 4) + 2] = d[(x * 4) + 3] = s[x];
+}
+
+// Zero extending each element to twice its size and ORing in a shifted copy
+// doubles it without crossing the 128-bit lanes of _mm256_unpack*.
+static void ScaleRow2x8_avx2(BYTE *dest, const BYTE *src, int sw)
+{
+	int x = 0;
+	__m256i v;
+	for (; x + 16 <= sw; x += 16)
+	{
+		v = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(src + x)));
+		_mm256_storeu_si256((__m256i*)(dest + (x * 2)), _mm256_or_si256(v, _mm256_slli_epi16(v, 8)));
+	}
+	for (; x < sw; x++) dest[x * 2] = dest[(x * 2) + 1] = src[x];
+}
+
+static void ScaleRow2x16_avx2(BYTE *dest, const BYTE *src, int sw)
+{
+	WORD *d = (WORD*)dest;
+	const WORD *s = (const WORD*)src;
+	int x = 0;
+	__m256i v;
+	for (; x + 8 <= sw; x += 8)
+	{
+		v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(s + x)));
+		_mm256_storeu_si256((__m256i*)(d + (x * 2)), _mm256_or_si256(v, _mm256_slli_epi32(v, 16)));
+	}
+	for (; x < sw; x++) d[x * 2] = d[(x * 2) + 1] = s[x];
+}
+
+static void ScaleRow2x32_avx2(BYTE *dest, const BYTE *src, int sw)
+{
+	DWORD *d = (DWORD*)dest;
+	const DWORD *s = (const DWORD*)src;
+	int x = 0;
+	__m256i v;
+	for (; x + 4 <= sw; x += 4)
+	{
+		v = _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i*)(s + x)));
+		_mm256_storeu_si256((__m256i*)(d + (x * 2)), _mm256_or_si256(v, _mm256_slli_epi64(v, 32)));
+	}
+	for (; x < sw; x++) d[x * 2] = d[(x * 2) + 1] = s[x];
+}
+
+static void ScaleRow3x8(BYTE *dest, const BYTE *src, int sw)
+{
+	int x;
+	for (x = 0; x < sw; x++) dest[x * 3] = dest[(x * 3) + 1] = dest[(x * 3) + 2] = src[x];
+}
+
+static void ScaleRow3x16(BYTE *dest, const BYTE *src, int sw)
+{
+	WORD *d = (WORD*)dest;
+	const WORD *s = (const WORD*)src;
+	int x;
+	for (x = 0; x < sw; x++) d[x * 3] = d[(x * 3) + 1] = d[(x * 3) + 2] = s[x];
+}
+
+static void ScaleRow3x32(BYTE *dest, const BYTE *src, int sw)
+{
+	DWORD *d = (DWORD*)dest;
+	const DWORD *s = (const DWORD*)src;
+	int x;
+	for (x = 0; x < sw; x++) d[x * 3] = d[(x * 3) + 1] = d[(x * 3) + 2] = s[x];
+}
+
+/**
+  * Gets a row function for scaling by a whole number of pixels.
+  * @param bytes
+  *  Bytes per pixel
+  * @param dw,sw
+  *  Destination and source widths
+  * @return
+  *  Row function, or NULL if the widths have no fast path
+  */
+static SCALEROWPROC Scale_GetRowProc(int bytes, int dw, int sw)
+{
+	if (!sw || (dw % sw)) return NULL;
+	switch (dw / sw)
+	{
+	case 2:
+		if (simdlevel >= 2)
+		{
+			if (bytes == 1) return ScaleRow2x8_avx2;
+			if (bytes == 2) return ScaleRow2x16_avx2;
+			if (bytes == 4) return ScaleRow2x32_avx2;
+		}
+		if (simdlevel >= 1)
+		{
+			if (bytes == 1) return ScaleRow2x8_sse2;
+			if (bytes == 2) return ScaleRow2x16_sse2;
+			if (bytes == 4) return ScaleRow2x32_sse2;
+		}
+		return NULL;
+	case 3:
+		if (bytes == 1) return ScaleRow3x8;
+		if (bytes == 2) return ScaleRow3x16;
+		if (bytes == 4) return ScaleRow3x32;
+		return NULL;
+	case 4:
+		if (simdlevel >= 1)
 		{
-			x2 = ((x*rx)>>16);
-			d[b1+x] = s[b2+x2];
+			if (bytes == 1) return ScaleRow4x8_sse2;
+			if (bytes == 2) return ScaleRow4x16_sse2;
+			if (bytes == 4) return ScaleRow4x32_sse2;
 		}
+		return NULL;
+	default:
+		return NULL;
+	}
+}
+
+static void Scale_StepRow(const SCALEJOB *job, BYTE *d, const BYTE *s)
+{
+	int x;
+	switch (job->bytes)
+	{
+	case 1:
+		for (x = 0; x < job->dw; x++)
+			d[x] = s[(x * job->rx) >> 16];
+		break;
+	case 2:
+		for (x = 0; x < job->dw; x++)
+			((WORD*)d)[x] = ((const WORD*)s)[(x * job->rx) >> 16];
+		break;
+	case 3:
+		for (x = 0; x < job->dw; x++)
+			((RGBTRIPLE*)d)[x] = ((const RGBTRIPLE*)s)[(x * job->rx) >> 16];
+		break;
+	case 4:
+		for (x = 0; x < job->dw; x++)
+			((DWORD*)d)[x] = ((const DWORD*)s)[(x * job->rx) >> 16];
+		break;
+	}
+}
+
+static void Scale_Band(SCALEJOB *job)
+{
+	int y, y2;
+	int lasty2 = -1;
+	BYTE *d;
+	for (y = job->ystart; y < job->yend; y++)
+	{
+		d = job->dest + (y * job->outpitch);
+		y2 = (y * job->ry) >> 16;
+		// Rows repeated from the same source row are copied from the last one
+		if (y2 == lasty2) memcpy(d, d - job->outpitch, job->dw * job->bytes);
+		else if (job->rowproc) job->rowproc(d, job->src + (y2 * job->inpitch), job->sw);
+		else Scale_StepRow(job, d, job->src + (y2 * job->inpitch));
+		lasty2 = y2;
+	}
+}
+
+static DWORD WINAPI Scale_Worker(LPVOID param)
+{
+	SCALEJOB *job = (SCALEJOB*)param;
+	Scale_Band(job);
+	if (!InterlockedDecrement(job->pending)) SetEvent(job->done);
+	return 0;
+}
+
+/**
+  * Scales an image with nearest neighbor sampling.  Images of
+  * SCALER_THREADPIXELS or more are split into bands of rows across the
+  * system thread pool, and widths scaled by 2, 3 or 4 replicate each pixel
+  * with SIMD code where available.
+  * @param bytes
+  *  Bytes per pixel
+  * @param dest
+  *  Pointer to the destination image
+  * @param src
+  *  Pointer to the source image
+  * @param dw,dh
+  *  Size of the destination image
+  * @param sw,sh
+  *  Size of the source image
+  * @param inpitch,outpitch
+  *  Source and destination row pitches in bytes
+  */
+static void Scale(int bytes, void *dest, void *src, int dw, int dh, int sw, int sh, int inpitch, int outpitch)
+{
+	SCALEJOB jobs[SCALER_MAXTHREADS];
+	volatile LONG pending;
+	DWORD jobcount;
+	int band;
+	DWORD i;
+	if ((dw <= 0) || (dh <= 0)) return;
+	if (simdlevel < 0) Scale_Init();
+	jobs[0].bytes = bytes;
+	jobs[0].dest = (BYTE*)dest;
+	jobs[0].src = (const BYTE*)src;
+	jobs[0].dw = dw;
+	jobs[0].dh = dh;
+	jobs[0].sw = sw;
+	jobs[0].sh = sh;
+	jobs[0].inpitch = inpitch;
+	jobs[0].outpitch = outpitch;
+	jobs[0].rx = (int)((sw << 16) / dw) + 1;
+	jobs[0].ry = (int)((sh << 16) / dh) + 1;
+	jobs[0].rowproc = Scale_GetRowProc(bytes, dw, sw);
+	jobs[0].ystart = 0;
+	jobs[0].yend = dh;
+	if (dw * dh < SCALER_THREADPIXELS) jobcount = 1;
+	else jobcount = dh / SCALER_MINBANDROWS;
+	if (jobcount > cpucount) jobcount = cpucount;
+	if (jobcount > SCALER_MAXTHREADS) jobcount = SCALER_MAXTHREADS;
+	if (jobcount > 1) jobs[0].done = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if ((jobcount <= 1) || !jobs[0].done)
+	{
+		Scale_Band(&jobs[0]);
+		return;
 	}
+	band = dh / jobcount;
+	pending = (LONG)jobcount - 1;
+	for (i = 0; i < jobcount; i++)
+	{
+		jobs[i] = jobs[0];
+		jobs[i].ystart = i * band;
+		if (i == jobcount - 1) jobs[i].yend = dh;
+		else jobs[i].yend = (i + 1) * band;
+		jobs[i].pending = &pending;
+		if (i && !QueueUserWorkItem(Scale_Worker, &jobs[i], WT_EXECUTEDEFAULT))
+			Scale_Worker(&jobs[i]);
+	}
+	Scale_Band(&jobs[0]);
+	WaitForSingleObject(jobs[0].done, INFINITE);
+	CloseHandle(jobs[0].done);
+}
+
+void ScaleNearest8(void *dest, void *src, int dw, int dh, int sw, int sh, int inpitch, int outpitch)
+{
+	Scale(1, dest, src, dw, dh, sw, sh, inpitch, outpitch);
+}
+void ScaleNearest16(void *dest, void *src, int dw, int dh, int sw, int sh, int inpitch, int outpitch)
+{
+	Scale(2, dest, src, dw, dh, sw, sh, inpitch * 2, outpitch * 2);
+}
+void ScaleNearest24(void *dest, void *src, int dw, int dh, int sw, int sh, int inpitch, int outpitch)
+{
+	Scale(3, dest, src, dw, dh, sw, sh, inpitch, outpitch);
+}
+void ScaleNearest32(void *dest, void *src, int dw, int dh, int sw, int sh, int inpitch, int outpitch)
+{
+	Scale(4, dest, src, dw, dh, sw, sh, inpitch * 4, outpitch * 4);
 }
@@ -23,6 +23,13 @@
 extern "C" {
 #endif
 
+// Images with at least this many pixels are scaled on multiple threads
+#define SCALER_THREADPIXELS (1024 * 1024)
+// Maximum number of threads a scale is split across
+#define SCALER_MAXTHREADS 8
+// Minimum number of rows in each thread's band
+#define SCALER_MINBANDROWS 64
+
 void ScaleNearest8(void *dest, void *src, int dw, int dh, int sw, int sh, int inpitch, int outpitch);
 void ScaleNearest16(void *dest, void *src, int dw, int dh, int sw, int sh, int inpitch, int outpitch);
 void ScaleNearest24(void *dest, void *src, int dw, int dh, int sw, int sh, int inpitch, int outpitch);
@@ -18,43 +18,60 @@
 #include "common.h"
 #include "string.h"
 
+/**
+  * Makes room for at least a number of characters in a string.  The room
+  * grows by doubling, so building a string by appending takes linear time.
+  * @param str
+  *  String to grow
+  * @param size
+  *  Number of characters, not counting the terminator
+  */
+void String_Reserve(STRING *str, size_t size)
+{
+	size_t newsize;
+	char *ptr;
+	if (!str->ptr) str->size = str->length = 0;
+	if (str->ptr && (size <= str->size)) return;
+	newsize = str->size ? str->size : 128;
+	while (newsize < size) newsize *= 2;
+	ptr = (char*)realloc(str->ptr, newsize + 1);
+	if (!ptr) return;
+	if (!str->ptr) ptr[0] = 0;
+	str->ptr = ptr;
+	str->size = newsize;
+}
+
+/**
+  * Appends characters of known length to a string.
+  * @param str
+  *  String to append to
+  * @param str2
+  *  Characters to append, need not be terminated
+  * @param len
+  *  Number of characters to append
+  */
+void String_AppendN(STRING *str, const char *str2, size_t len)
+{
+	String_Reserve(str, (str->ptr ? str->length : 0) + len);
+	if (!str->ptr || (str->length + len > str->size)) return;
+	memcpy(str->ptr + str->length, str2, len);
+	str->length += len;
+	str->ptr[str->length] = 0;
+}
+
 void String_Append(STRING *str, const char *str2)
 {
-	if (!str->ptr)
-	{
-		str->ptr = malloc(strlen(str2)+129);
-		str->size = strlen(str2)+128;
-		strcpy(str->ptr, str2);
-		return;
-	}
-	else
-	{
-		if (str->size < strlen(str->ptr) + strlen(str2))
-		{
-			str->ptr = realloc(str->ptr, str->size + strlen(str2)+129);
-			str->size += strlen(str2) + 128;
-		}
-		strcat(str->ptr, str2);
-	}
+	String_AppendN(str, str2, strlen(str2));
 }
+
 void String_Assign(STRING *str, const char *str2)
 {
-	if (!str->ptr)
-	{
-		str->ptr = malloc(strlen(str2) + 129);
-		str->size = strlen(str2) + 128;
-		strcpy(str->ptr, str2);
-		return;
-	}
-	else
+	if (str->ptr)
 	{
-		if (str->size > strlen(str2))
-		{
-			str->ptr = realloc(str->ptr, strlen(str2) + 129);
-			str->size = strlen(str2) + 128;
-		}
-		strcpy(str->ptr, str2);
+		str->ptr[0] = 0;
+		str->length = 0;
 	}
+	String_Append(str, str2);
 }
 
 void String_Free(STRING *str)
@@ -64,4 +81,4 @@ void String_Free(STRING *str)
 		free(str->ptr);
 		ZeroMemory(str, sizeof(STRING));
 	}
-}
\ No newline at end of file
+}
@@ -23,16 +23,23 @@
 extern "C" {
 #endif
 
+// A STRING with a NULL ptr is empty, whatever its other members hold
 typedef struct STRING
 {
 	char *ptr;
-	size_t size;
+	size_t size;  // Room for characters, not counting the terminator
+	size_t length;
 }STRING;
 
 void String_Append(STRING *str, const char *str2);
+void String_AppendN(STRING *str, const char *str2, size_t len);
 void String_Assign(STRING *str, const char *str2);
+void String_Reserve(STRING *str, size_t size);
 void String_Free(STRING *str);
 
+// Appends a char array, such as a shader snippet, without measuring it
+#define String_AppendConst(str, array) String_AppendN(str, array, sizeof(array) - 1)
+
 #ifdef __cplusplus
 }
 #endif
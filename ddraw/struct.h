@@ -36,8 +36,14 @@ typedef struct SAMPLER
 	GLint wrapt;
 	GLint minfilter;
 	GLint magfilter;
+	DWORD bordercolor;  // D3DCOLOR
+	GLfloat lodbias;
+	DWORD anisotropy;  // 1 disables anisotropic filtering
 } SAMPLER;
 
+// Frame time histogram buckets of DXGLTimer, one millisecond wide
+#define DXGLTIMER_HISTOGRAM 100
+
 // Timer used to simulate display timing
 typedef struct DXGLTimer
 {
@@ -49,10 +55,45 @@ typedef struct DXGLTimer
 	LARGE_INTEGER timer_base;
 	LARGE_INTEGER lastdraw;
 	BOOL lastdrawmeasured;
+	HANDLE waittimer;  // Waitable timer for the frame limiter, NULL if unavailable
+	BOOL hiresolution;  // TRUE if waittimer is a high resolution timer
+	LARGE_INTEGER nextframe;  // Time the next limited frame is due, 0 before the first
+	LARGE_INTEGER lastpresent;  // Time of the last frame drawn to the screen
+	BOOL lastpresentmeasured;
+	UINT kmtadapter;  // D3DKMT adapter handle of the display, 0 to use the timer
+	UINT kmtsource;  // Video present source of the display on kmtadapter
+	BOOL kmtscanline;  // TRUE if the display driver reports the scanline
+	LONGLONG lastframe;  // Time DXGLTimer_EndFrame was last called, 0 before the first frame
+	LONGLONG frameparts[2];  // Time of the current frame spent idle and presenting
+	DWORD histogram[DXGLTIMER_HISTOGRAM];  // Present to present times, the last bucket holds longer frames
+	DWORD frames;  // Frames counted in histogram
+	DWORD stutters;  // Frames reported by DXGLTimer_EndFrame as stutters
 } DXGLTimer;
 
 struct BufferObject;
 
+// Number of fenced regions the streaming vertex, index and unpack buffers are split into
+#define STREAMBUFFER_SEGMENTS 4
+
+// Maximum number of separate CPU-dirty rectangles tracked per mipmap level
+#define DIRTYRECT_MAX 8
+
+// Consecutive frames a level must be locked after GPU writes before it is
+// read back ahead of the next lock
+#define READBACK_LOCKFRAMES 2
+
+// Textures with StreamMipmaps: top levels of at least this many bytes stream
+// in, and levels of at most this many bytes are uploaded at first use
+#define STREAM_MINSIZE 1048576
+#define STREAM_FIRSTSIZE 65536
+
+// Alignment in bytes of the system memory buffers of surfaces, one cache line
+#define BUFFER_ALIGNMENT 64
+
+// Maximum number of simultaneously enabled lights with uniform buffer objects,
+// without them lights are passed as separate uniforms and limited to 8
+#define LIGHTS_MAX 32
+
 typedef struct CmdBuffer
 {
 	struct BufferObject *vertices;
@@ -63,7 +104,25 @@ typedef struct CmdBuffer
 	size_t vertexptr;
 	size_t indexptr;
 	size_t unpackptr;
-	size_t cmdptr;
+	volatile size_t cmdptr;
+	volatile size_t readptr;
+	// End of the written commands.  Runs ahead of cmdptr while blts are held
+	// back for coalescing; heldblt then points to the last of them.
+	size_t writeptr;
+	struct BltCommand *heldblt;
+	// Number of commands written and executed, so callers can tell whether the
+	// commands using a texture have run without waiting for the whole ring
+	DWORD cmdseq;
+	volatile DWORD doneseq;
+	int vertexsegment;
+	int indexsegment;
+	int unpacksegment;
+	GLsync vertexfences[STREAMBUFFER_SEGMENTS];
+	GLsync indexfences[STREAMBUFFER_SEGMENTS];
+	GLsync unpackfences[STREAMBUFFER_SEGMENTS];
+	BOOL streaming;
+	// Texture uploads are staged in pixelunpack instead of per-texture buffers
+	BOOL unpackstreaming;
 } CmdBuffer;
 
 // OpenGL Extensions structure
@@ -93,9 +152,17 @@ typedef struct glExtensions
 	void (APIENTRY *glBindFramebuffer) (GLenum target, GLuint framebuffer);
 	void (APIENTRY *glGenRenderbuffers) (GLsizei n, GLuint* renderbuffers);
 	void (APIENTRY *glBindRenderbuffer) (GLenum target, GLuint renderbuffer);
+	void (APIENTRY *glDeleteRenderbuffers) (GLsizei n, const GLuint *renderbuffers);
+	void (APIENTRY *glRenderbufferStorageMultisample) (GLenum target, GLsizei samples, GLenum internalformat,
+		GLsizei width, GLsizei height);
+	void (APIENTRY *glFramebufferRenderbuffer) (GLenum target, GLenum attachment, GLenum renderbuffertarget,
+		GLuint renderbuffer);
 	void (APIENTRY *glFramebufferTexture2D) (GLenum target, GLenum attachment, GLenum textarget, GLuint texture, GLint level);
 	GLenum(APIENTRY *glCheckFramebufferStatus) (GLenum target);
 	void (APIENTRY *glDeleteFramebuffers) (GLsizei n, const GLuint *framebuffers);
+	void (APIENTRY *glGenerateMipmap) (GLenum target);
+	void (APIENTRY *glBlitFramebuffer) (GLint srcX0, GLint srcY0, GLint srcX1, GLint srcY1,
+		GLint dstX0, GLint dstY0, GLint dstX1, GLint dstY1, GLbitfield mask, GLenum filter);
 
 	GLint(APIENTRY *glGetUniformLocation) (GLuint program, const GLchar* name);
 	void (APIENTRY *glUniform1i) (GLint location, GLint v0);
@@ -124,9 +191,41 @@ typedef struct glExtensions
 	void (APIENTRY *glBufferData)(GLenum target, GLsizeiptr size, const GLvoid* data, GLenum usage);
 	void* (APIENTRY *glMapBuffer)(GLenum target, GLenum access);
 	GLboolean(APIENTRY *glUnmapBuffer)(GLenum target);
+	void* (APIENTRY *glMapBufferRange)(GLenum target, GLintptr offset, GLsizeiptr length, GLbitfield access);
+	void (APIENTRY *glBufferStorage)(GLenum target, GLsizeiptr size, const void *data, GLbitfield flags);
+
+	GLsync (APIENTRY *glFenceSync)(GLenum condition, GLbitfield flags);
+	GLenum (APIENTRY *glClientWaitSync)(GLsync sync, GLbitfield flags, GLuint64 timeout);
+	void (APIENTRY *glWaitSync)(GLsync sync, GLbitfield flags, GLuint64 timeout);
+	void (APIENTRY *glDeleteSync)(GLsync sync);
+
+	void (APIENTRY *glGetProgramBinary)(GLuint program, GLsizei bufSize, GLsizei *length,
+		GLenum *binaryFormat, void *binary);
+	void (APIENTRY *glProgramBinary)(GLuint program, GLenum binaryFormat, const void *binary, GLsizei length);
+	void (APIENTRY *glProgramParameteri)(GLuint program, GLenum pname, GLint value);
+	void (APIENTRY *glMaxShaderCompilerThreadsKHR)(GLuint count);
+	void (APIENTRY *glGenVertexArrays)(GLsizei n, GLuint *arrays);
+	void (APIENTRY *glBindVertexArray)(GLuint array);
+	void (APIENTRY *glDeleteVertexArrays)(GLsizei n, const GLuint *arrays);
+	void (APIENTRY *glTexStorage2D)(GLenum target, GLsizei levels, GLenum internalformat, GLsizei width, GLsizei height);
+	void (APIENTRY *glTextureView)(GLuint texture, GLenum target, GLuint origtexture, GLenum internalformat,
+		GLuint minlevel, GLuint numlevels, GLuint minlayer, GLuint numlayers);
+	void (APIENTRY *glCopyImageSubData)(GLuint srcName, GLenum srcTarget, GLint srcLevel, GLint srcX, GLint srcY,
+		GLint srcZ, GLuint dstName, GLenum dstTarget, GLint dstLevel, GLint dstX, GLint dstY, GLint dstZ,
+		GLsizei srcWidth, GLsizei srcHeight, GLsizei srcDepth);
+	void (APIENTRY *glInvalidateTexImage)(GLuint texture, GLint level);
+	void (APIENTRY *glInvalidateFramebuffer)(GLenum target, GLsizei numAttachments, const GLenum *attachments);
+	void (APIENTRY *glTextureBarrier)(void);  // ARB_texture_barrier or NV_texture_barrier, NULL if neither
+	void (APIENTRY *glGenQueries)(GLsizei n, GLuint *ids);
+	void (APIENTRY *glDeleteQueries)(GLsizei n, const GLuint *ids);
+	void (APIENTRY *glBeginQuery)(GLenum target, GLuint id);
+	void (APIENTRY *glEndQuery)(GLenum target);
+	void (APIENTRY *glGetQueryObjectiv)(GLuint id, GLenum pname, GLint *params);
+	void (APIENTRY *glGetQueryObjectui64v)(GLuint id, GLenum pname, GLuint64 *params);
 
 	BOOL(APIENTRY *wglSwapIntervalEXT)(int interval);
 	int (APIENTRY *wglGetSwapIntervalEXT)();
+	const char *(APIENTRY *wglGetExtensionsStringARB)(HDC hdc);
 
 	void (APIENTRY *glTextureParameterfEXT)(GLuint texture, GLenum target, GLenum pname, GLfloat param);
 	void (APIENTRY *glTextureParameterfvEXT)(GLuint texture, GLenum target, GLenum pname, const GLfloat *params);
@@ -151,6 +250,16 @@ typedef struct glExtensions
 	void (APIENTRY *glNamedBufferData)(GLuint buffer, GLsizei size, const void *data, GLenum usage);
 	void* (APIENTRY *glMapNamedBuffer)(GLuint buffer, GLenum access);
 	GLboolean(APIENTRY *glUnmapNamedBuffer)(GLuint buffer);
+	void (APIENTRY *glCreateBuffers)(GLsizei n, GLuint *buffers);
+	void (APIENTRY *glNamedBufferStorage)(GLuint buffer, GLsizeiptr size, const void *data, GLbitfield flags);
+	void* (APIENTRY *glMapNamedBufferRange)(GLuint buffer, GLintptr offset, GLsizeiptr length, GLbitfield access);
+	void (APIENTRY *glCreateVertexArrays)(GLsizei n, GLuint *arrays);
+	void (APIENTRY *glEnableVertexArrayAttrib)(GLuint vaobj, GLuint index);
+	void (APIENTRY *glVertexArrayAttribFormat)(GLuint vaobj, GLuint attribindex, GLint size, GLenum type,
+		GLboolean normalized, GLuint relativeoffset);
+	void (APIENTRY *glVertexArrayAttribBinding)(GLuint vaobj, GLuint attribindex, GLuint bindingindex);
+	void (APIENTRY *glVertexArrayVertexBuffer)(GLuint vaobj, GLuint bindingindex, GLuint buffer, GLintptr offset, GLsizei stride);
+	void (APIENTRY *glVertexArrayElementBuffer)(GLuint vaobj, GLuint buffer);
 
 	void (APIENTRY *glBindSampler)(GLuint unit, GLuint sampler);
 	void (APIENTRY *glDeleteSamplers)(GLsizei n, const GLuint *samplers);
@@ -159,6 +268,17 @@ typedef struct glExtensions
 	void (APIENTRY *glSamplerParameteri)(GLuint sampler, GLenum pname, GLint param);
 	void (APIENTRY *glSamplerParameterfv)(GLuint sampler, GLenum pname, const GLfloat *params);
 	void (APIENTRY *glSamplerParameteriv)(GLuint sampler, GLenum pname, const GLint *params);
+	GLuint (APIENTRY *glGetUniformBlockIndex)(GLuint program, const GLchar *uniformBlockName);
+	void (APIENTRY *glUniformBlockBinding)(GLuint program, GLuint uniformBlockIndex, GLuint uniformBlockBinding);
+	void (APIENTRY *glBindBufferBase)(GLenum target, GLuint index, GLuint buffer);
+	void (APIENTRY *glDrawElementsBaseVertex)(GLenum mode, GLsizei count, GLenum type, const GLvoid *indices, GLint basevertex);
+	void (APIENTRY *glDrawArraysInstanced)(GLenum mode, GLint first, GLsizei count, GLsizei instancecount);
+	void (APIENTRY *glVertexAttribDivisor)(GLuint index, GLuint divisor);
+	GLuint64 (APIENTRY *glGetTextureSamplerHandleARB)(GLuint texture, GLuint sampler);
+	void (APIENTRY *glMakeTextureHandleResidentARB)(GLuint64 handle);
+	void (APIENTRY *glMakeTextureHandleNonResidentARB)(GLuint64 handle);
+	void (APIENTRY *glUniformHandleui64ARB)(GLint location, GLuint64 value);
+	void (APIENTRY *glMultiDrawElementsIndirect)(GLenum mode, GLenum type, const void *indirect, GLsizei drawcount, GLsizei stride);
 
 	int GLEXT_ARB_framebuffer_object;
 	int GLEXT_ARB_texture_rectangle;
@@ -172,7 +292,29 @@ typedef struct glExtensions
 	int GLEXT_EXT_direct_state_access;
 	int GLEXT_ARB_direct_state_access;
 	int GLEXT_ARB_sampler_objects;
+	int GLEXT_EXT_texture_filter_anisotropic;
 	int GLEXT_EXT_gpu_shader4;
+	int GLEXT_EXT_shader_framebuffer_fetch;
+	int GLEXT_ARB_map_buffer_range;
+	int GLEXT_ARB_buffer_storage;
+	int GLEXT_ARB_sync;
+	int GLEXT_ARB_get_program_binary;
+	int GLEXT_KHR_parallel_shader_compile;
+	int GLEXT_ARB_bindless_texture;  // Only set if enabled in the configuration
+	int GLEXT_ARB_multi_draw_indirect;
+	int GLEXT_ARB_shader_draw_parameters;
+	int GLEXT_ARB_vertex_array_object;
+	int GLEXT_ARB_texture_storage;
+	int GLEXT_ARB_copy_image;
+	int GLEXT_ARB_invalidate_subdata;
+	int GLEXT_ARB_texture_view;
+	int GLEXT_ARB_timer_query;
+	int GLEXT_ARB_uniform_buffer_object;  // Only set with GLSL 1.40, which generated shaders need for blocks
+	int GLEXT_ARB_draw_elements_base_vertex;
+	int GLEXT_ARB_instanced_arrays;
+	int GLEXT_ARB_ES3_compatibility;  // Only used for GL_PRIMITIVE_RESTART_FIXED_INDEX
+	int GLEXT_EXT_texture_compression_s3tc;
+	int WGLEXT_EXT_swap_control_tear;
 	DWORD glver_major;
 	DWORD glver_minor;
 	BOOL atimem;
@@ -205,6 +347,20 @@ typedef struct FBO
 	GLenum status;
 } FBO;
 
+// Number of framebuffers kept for color and depth buffer pairs
+#define FBOCACHE_SIZE 32
+
+// Framebuffer with a color and depth buffer attached, completeness checked
+// once when the attachments are made
+typedef struct FBOCacheEntry
+{
+	FBO fbo;
+	GLint level;
+	GLint zlevel;
+	BOOL multisample;  // Multisampled renderbuffers of the textures are attached
+	DWORD lastused;
+} FBOCacheEntry;
+
 // Various OpenGL state items
 typedef struct glUtil
 {
@@ -247,15 +403,33 @@ typedef struct glUtil
 	GLenum blendsrc;
 	GLenum blenddest;
 	BOOL blendenabled;
+	GLboolean colormask[4];
+	BOOL stenciltest;
+	GLenum stencilfunc;
+	GLint stencilref;
+	GLuint stencilmask;
+	GLuint stencilwritemask;
+	GLenum stencilfail;
+	GLenum stencilzfail;
+	GLenum stencilpass;
+	GLfloat polyoffsetfactor;
+	GLfloat polyoffsetunits;
 	BOOL arrays[42];
 	D3DCULL cullmode;
 	BOOL cullenabled;
 	D3DFILLMODE polymode;
 	D3DSHADEMODE shademode;
 	BufferObject *LastBoundBuffer;
-	SAMPLER samplers[16];
+	SAMPLER samplers[16];  // Sampler state bound to each texture unit
+	SAMPLER *samplercache;  // Sampler objects shared by all units, one per distinct state
+	int samplercachecount;
+	int samplercachesize;
 	GLint texlevel;
 	GLuint textures[16];
+	FBOCacheEntry fbocache[FBOCACHE_SIZE];  // Least recently used entry is replaced when full
+	DWORD fbocacheclock;
+	GLuint resolvefbo[2];  // Scratch framebuffers for multisample resolves and depth-only copies, 0 until needed
+	DWORD fboswitches;  // Framebuffer binding changes, read by the performance counters
 } glUtil;
 
 // Storage for DIB info
@@ -271,22 +445,56 @@ typedef struct DIB
 	BYTE *pixels;
 } DIB;
 
+// GDI objects of a mipmap level, allocated the first time a DC is requested
+typedef struct MIPLEVELGDI
+{
+	HDC hdc;
+	HBITMAP hbitmap;
+	BITMAPINFO *bitmapinfo;
+	BOOL dibbuffer;  // buffer is the bits of hbitmap, which stays selected into hdc
+	BOOL dcout;  // hdc was handed out by glTexture_GetDC and not released yet
+} MIPLEVELGDI;
+
 // Texture object mipmap level
 typedef struct MIPLEVEL
 {
 	DDSURFACEDESC2 ddsd;
 	char *buffer;
-	HDC hdc;
-	HBITMAP hbitmap;
-	BITMAPINFO *bitmapinfo;
+	BOOL writewatch;  // buffer was allocated with MEM_WRITE_WATCH
+	BOOL largepage;  // buffer was allocated with MEM_LARGE_PAGES
+	MIPLEVELGDI *gdi;  // NULL until glTexture_GetDC is first called on the level
 	BufferObject *pboPack;
 	BufferObject *pboUnpack;
 	DWORD dirty;
 	// dirty bits:
 	// 1 - Surface buffer was locked and may have been written to by CPU
 	// 2 - Texture was written to by GPU
+	// 4 - pboPack holds a readback of the current GPU contents, guarded by packfence
+	// 8 - Level is locked after GPU writes every frame; read it back asynchronously
+	// 16 - pboLock holds the current contents of the level
+	// 32 - Level is in the renderer's pending uploads
+	// 64 - Texture alpha holds the source color key stored by the last upload
 	DWORD locked;
-	FBO fbo;
+	GLsync packfence;
+	// Persistently mapped buffer handed out by write-only locks
+	BufferObject *pboLock;
+	GLsync lockfence;
+	BOOL lockmapped;
+	// Regions written by the CPU since the last upload.  An empty list while
+	// dirty bit 1 is set means the whole level must be uploaded.
+	RECT dirtyrects[DIRTYRECT_MAX];
+	DWORD dirtyrectcount;
+	FBO fbo;  // Color only, depth buffer pairs use the FBO cache of glUtil
+	struct glTexture *fbz;  // Depth buffer the level was last drawn with, NULL if none
+	// Command ring sequence numbers of the last queued command that reads
+	// the level and the last one that writes it
+	DWORD readseq;
+	DWORD writeseq;
+	volatile LONG version;  // Changed by every write to the level, never 0
+	// Lock pattern that arms dirty bit 8
+	DWORD lockframe;  // Frame of the last full lock of GPU-written contents
+	DWORD lockstreak;  // Consecutive frames with such a lock, 0 after a wasted readback
+	DWORD readbackframe;  // Frame + 1 an asynchronous readback was started in, 0 once locked
 } MIPLEVEL;
 
 // Surface texture object
@@ -294,7 +502,8 @@ typedef struct glTexture
 {
 	UINT refcount;
 	GLuint id;
-	MIPLEVEL levels[17];  // Future proof to 64k
+	MIPLEVEL *levels;  // One per mipmap level of the surface chain, allocated by glTexture_Create
+	GLint levelcount;  // Entries in levels, at most 17
 	GLint minfilter;
 	GLint magfilter;
 	GLint wraps;
@@ -309,11 +518,16 @@ typedef struct glTexture
 	GLenum type;
 	GLenum target;
 	BOOL zhasstencil;
+	BOOL immutable;  // Storage was allocated with glTexStorage2D
+	BOOL automipmap;  // Sub-levels are generated from level 0 on the GPU
 	BOOL useconv;
 	int convfunctionupload;
 	int convfunctiondownload;
 	int internalsize;
 	int packsize;
+	BOOL keyalpha;  // Uploads store the source color key in the alpha channel
+	BOOL alphakeyset;  // Source color key that uploads store, changed by SetColorKey
+	DWORD alphakey;
 	unsigned char blttype;
 	struct glTexture *palette;
 	struct glTexture *stencil;
@@ -321,11 +535,51 @@ typedef struct glTexture
 	struct glRenderer *renderer;
 	BufferObject *pboPack;
 	BufferObject *pboUnpack;
+	struct TextureAtlasPage *atlas;  // Page shared with other small surfaces, id is the page texture
+	GLint atlasx;
+	GLint atlasy;
+	GLuint rawid;  // Integer texture holding surface data for GPU format conversion
+	GLuint rawfbo;
+	GLsizei rawwidth;
+	GLsizei rawheight;
+	int planar;  // PLANAR_* layout of planar YUV surfaces, 0 for other formats
+	GLuint rawplanes[2];  // Chroma plane textures of planar YUV surfaces, U or UV then V
+	int compressed;  // COMPRESSED_* block format of DXT surfaces, 0 for other formats
+	GLsizei rawplanewidth;
+	GLsizei rawplaneheight;
+	GLuint intview;  // R8UI view of an 8-bit palette texture for integer ROPs, 0 if not created
+	GLuint msaarb;  // Multisampled or scaled renderbuffer 3D rendering draws into, 0 if none
+	GLsizei msaasamples;
+	GLsizei msaascale;  // Size of the renderbuffer as a multiple of the top level
+	GLsizei msaawidth;
+	GLsizei msaaheight;
+	int msaastate;  // MSAA_* state of the renderbuffer relative to the texture
+	struct TextureResidency *residency;  // Manager that may evict the texture, NULL if it stays resident
+	struct glTexture *residentprev;
+	struct glTexture *residentnext;
+	GLsizeiptr residentsize;
+	DWORD lastused;  // Frame the texture was last drawn with
+	DWORD priority;  // Set by IDirectDrawSurface7::SetPriority, lower is evicted first
+	DWORD lod;  // Most detailed mipmap level set by IDirectDrawSurface7::SetLOD
+	DWORD appliedlod;  // Base level currently set on the GL texture
+	DWORD droppedlevels;  // Levels above the LOD with no GL storage since the texture was restored
+	DWORD streamlod;  // Most detailed level sampled while finer levels stream in, 0 when done
+	DWORD streamframe;  // Frame the last streamed level was uploaded in
+	BOOL streamchecked;  // Texture was checked for streaming at its first use
+	BOOL evicted;  // GL texture was deleted, levels are kept in their buffers
+	GLuint blockid;  // Block compressed copy drawn with while evicted, 0 if none
+	GLsizeiptr blocksize;
+	DWORD uploads;  // Number of uploads, tells whether the texture changed while being compressed
+	DWORD lastwritten;  // Frame the texture was last uploaded to
+	BOOL contentlost;  // GL storage was replaced while it held newer data than the buffers, cleared by Restore
+	GLuint64 handles[4];  // Resident bindless handles of the texture with the samplers in handlesamplers
+	GLuint handlesamplers[4];
+	int nexthandle;  // Entry replaced when a fifth sampler is used
+	BOOL bindless;  // Handles were made, so the texture parameters can't be changed anymore
 	BOOL freeonrelease;
 	BOOL initialized;
-#ifdef _M_IX86
-	DWORD padding[3];
-#endif
+	DWORD captureid;  // ID of the texture in the capture file, 0 if not captured
+	struct SurfaceProfileEntry *profile;  // Costs of the surface if DebugSurfaceProfile is set, NULL otherwise
 } glTexture;
 // Color orders:
 // 0 - ABGR
@@ -363,6 +617,8 @@ typedef struct SHADER
 	GLint colorsize;
 	GLint pal;
 	GLint view;
+	GLint tex2;
+	GLint color;
 } SHADER;
 
 struct ShaderGen3D;
@@ -373,6 +629,9 @@ typedef struct ShaderManager
 	SHADER *shaders;
 	struct ShaderGen3D *gen3d;
 	struct ShaderGen2D *gen2d;
+	struct ShaderCache *cache;
+	struct ShaderCompiler *compiler;  // NULL if shaders are compiled synchronously
+	GLuint convvao;  // Empty vertex array for the attribute-less conversion shaders
 	glExtensions *ext;
 } ShaderManager;
 
@@ -387,6 +646,8 @@ typedef struct SetWndCommand
 	BOOL devwnd;
 } SetWndCommand;
 
+#define BLTCLIP_MAXRECTS 4
+
 typedef struct BltCommand
 {
 	//DWORD opcode;
@@ -411,6 +672,8 @@ typedef struct BltCommand
 	GLint patternlevel;
 	DDCOLORKEY srckey;
 	DDCOLORKEY destkey;
+	DWORD clipcount;  // Number of scissor rectangles in cliprects, 0 if not clipped
+	RECT cliprects[BLTCLIP_MAXRECTS];  // Clip list applied with the scissor test
 }BltCommand;
 
 typedef struct ClearCommand
@@ -468,11 +731,34 @@ typedef struct RenderTarget
 	GLfloat muly;
 } RenderTarget;
 
+// Contents of a Direct3D vertex buffer, uploaded to a buffer object on draw
+typedef struct VertexBuffer
+{
+	struct BufferObject *vbo;
+	unsigned char *data;
+	DWORD size;
+	BOOL dirty;
+	BOOL nooverwrite;
+	BOOL isstatic;
+	BOOL hasbounds;  // Set by Optimize for untransformed vertices, the contents can't change afterwards
+	float boundsmin[3];
+	float boundsmax[3];
+	struct BufferObject *ibo;  // Index list last drawn from an optimized buffer, owned by the renderer thread
+	WORD *indexcache;
+	DWORD indexcount;
+	DWORD indexmax;
+	BOOL indexuploaded;
+} VertexBuffer;
+
 typedef struct GLCAPS
 {
 	float Version;
 	float ShaderVer;
 	GLint TextureMax;
+	int VersionMajor;
+	BOOL GpuShader4;
+	BOOL PackedDepthStencil;
+	DWORD MaxLights;
 } GLCAPS;
 
 typedef struct GLVERTEX
@@ -495,4 +781,4 @@ typedef struct VIEWPORT
 	GLsizei hieght;
 } VIEWPORT;
 
-#endif //__STRUCT_H
\ No newline at end of file
+#endif //__STRUCT_H
\ No newline at end of file
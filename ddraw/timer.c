@@ -19,12 +19,92 @@
 #include <math.h>
 #include "timer.h"
 
+extern DXGLCFG dxglcfg;
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+typedef HANDLE(WINAPI *CREATEWAITABLETIMEREXWPROC)(LPSECURITY_ATTRIBUTES lpTimerAttributes,
+	LPCWSTR lpTimerName, DWORD dwFlags, DWORD dwDesiredAccess);
+
+// Display driver thunks from d3dkmthk.h, exported by gdi32.dll on Vista and later
+typedef UINT D3DKMT_HANDLE;
+typedef struct _D3DKMT_OPENADAPTERFROMHDC
+{
+	HDC hDc;
+	D3DKMT_HANDLE hAdapter;
+	LUID AdapterLuid;
+	UINT VidPnSourceId;
+} D3DKMT_OPENADAPTERFROMHDC;
+typedef struct _D3DKMT_CLOSEADAPTER
+{
+	D3DKMT_HANDLE hAdapter;
+} D3DKMT_CLOSEADAPTER;
+typedef struct _D3DKMT_GETSCANLINE
+{
+	D3DKMT_HANDLE hAdapter;
+	UINT VidPnSourceId;
+	BOOLEAN InVerticalBlank;
+	UINT ScanLine;
+} D3DKMT_GETSCANLINE;
+typedef struct _D3DKMT_WAITFORVERTICALBLANKEVENT
+{
+	D3DKMT_HANDLE hAdapter;
+	D3DKMT_HANDLE hDevice;
+	UINT VidPnSourceId;
+} D3DKMT_WAITFORVERTICALBLANKEVENT;
+typedef LONG(APIENTRY *D3DKMTOPENADAPTERFROMHDCPROC)(D3DKMT_OPENADAPTERFROMHDC *pData);
+typedef LONG(APIENTRY *D3DKMTCLOSEADAPTERPROC)(const D3DKMT_CLOSEADAPTER *pData);
+typedef LONG(APIENTRY *D3DKMTGETSCANLINEPROC)(D3DKMT_GETSCANLINE *pData);
+typedef LONG(APIENTRY *D3DKMTWAITFORVERTICALBLANKEVENTPROC)(const D3DKMT_WAITFORVERTICALBLANKEVENT *pData);
+
+static D3DKMTOPENADAPTERFROMHDCPROC _D3DKMTOpenAdapterFromHdc = NULL;
+static D3DKMTCLOSEADAPTERPROC _D3DKMTCloseAdapter = NULL;
+static D3DKMTGETSCANLINEPROC _D3DKMTGetScanLine = NULL;
+static D3DKMTWAITFORVERTICALBLANKEVENTPROC _D3DKMTWaitForVerticalBlankEvent = NULL;
+
+// Number of refresh intervals measured by DXGLTimer_CalibrateVBlank
+#define VBLANK_CALIBRATE_FRAMES 2
+// Frames counted before DXGLTimer_EndFrame reports stutters
+#define STUTTER_MINFRAMES 30
+
 void DXGLTimer_Init(DXGLTimer *timer)
 {
 	TIMECAPS mmcaps;
 	LARGE_INTEGER freq;
+	HMODULE kernel32;
+	HMODULE gdi32;
+	CREATEWAITABLETIMEREXWPROC _CreateWaitableTimerExW = NULL;
 	timer->timertype = 0;
 	timer->lastdrawmeasured = FALSE;
+	timer->lastpresentmeasured = FALSE;
+	timer->nextframe.QuadPart = 0;
+	timer->kmtadapter = 0;
+	timer->kmtsource = 0;
+	timer->kmtscanline = FALSE;
+	timer->lastframe = 0;
+	timer->frameparts[DXGLTIMER_IDLE] = timer->frameparts[DXGLTIMER_PRESENT] = 0;
+	ZeroMemory(timer->histogram, sizeof(timer->histogram));
+	timer->frames = 0;
+	timer->stutters = 0;
+	gdi32 = GetModuleHandle(_T("gdi32.dll"));
+	if (gdi32 && !_D3DKMTOpenAdapterFromHdc)
+	{
+		_D3DKMTCloseAdapter = (D3DKMTCLOSEADAPTERPROC)GetProcAddress(gdi32, "D3DKMTCloseAdapter");
+		_D3DKMTGetScanLine = (D3DKMTGETSCANLINEPROC)GetProcAddress(gdi32, "D3DKMTGetScanLine");
+		_D3DKMTWaitForVerticalBlankEvent = (D3DKMTWAITFORVERTICALBLANKEVENTPROC)
+			GetProcAddress(gdi32, "D3DKMTWaitForVerticalBlankEvent");
+		_D3DKMTOpenAdapterFromHdc = (D3DKMTOPENADAPTERFROMHDCPROC)GetProcAddress(gdi32, "D3DKMTOpenAdapterFromHdc");
+	}
+	// High resolution waitable timers need Windows 10 1803, CreateWaitableTimerExW needs Vista
+	kernel32 = GetModuleHandle(_T("kernel32.dll"));
+	if (kernel32) _CreateWaitableTimerExW = (CREATEWAITABLETIMEREXWPROC)GetProcAddress(kernel32, "CreateWaitableTimerExW");
+	timer->waittimer = NULL;
+	if (_CreateWaitableTimerExW)
+		timer->waittimer = _CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+	timer->hiresolution = timer->waittimer ? TRUE : FALSE;
+	if (!timer->waittimer) timer->waittimer = CreateWaitableTimer(NULL, TRUE, NULL);
 	freq.QuadPart = 0;
 	QueryPerformanceFrequency(&freq);
 	if (!freq.QuadPart)
@@ -44,7 +124,8 @@ void DXGLTimer_Init(DXGLTimer *timer)
 void DXGLTimer_Calibrate(DXGLTimer *timer, unsigned int lines, unsigned int frequency)
 {
 	double linesperms;
-	timer->monitor_period = (double) frequency / 1000.0;
+	if (!frequency) frequency = 60;
+	timer->monitor_period = 1000.0 / (double) frequency;
 	if (timer->timertype == 1)
 	{
 		QueryPerformanceCounter(&timer->timer_base);
@@ -60,11 +141,288 @@ void DXGLTimer_Calibrate(DXGLTimer *timer, unsigned int lines, unsigned int freq
 	}
 }
 
+/**
+  * Reads the timer.
+  * @param timer
+  *  Pointer to DXGLTimer structure
+  * @return
+  *  Current time in performance counter ticks, or milliseconds if the
+  *  performance counter is unavailable
+  */
+static LONGLONG DXGLTimer__Now(DXGLTimer *timer)
+{
+	LARGE_INTEGER now;
+	if (timer->timertype == 1) QueryPerformanceCounter(&now);
+	else now.QuadPart = timeGetTime();
+	return now.QuadPart;
+}
+
+/**
+  * Converts milliseconds to timer ticks.
+  * @param timer
+  *  Pointer to DXGLTimer structure
+  * @param milliseconds
+  *  Time to convert
+  * @return
+  *  Time in the units returned by DXGLTimer__Now
+  */
+static LONGLONG DXGLTimer__ToTicks(DXGLTimer *timer, double milliseconds)
+{
+	if (timer->timertype == 1) return (LONGLONG)(milliseconds * timer->timer_frequency / 1000.0);
+	else return (LONGLONG)milliseconds;
+}
+
+/**
+  * Converts timer ticks to milliseconds.
+  * @param timer
+  *  Pointer to DXGLTimer structure
+  * @param ticks
+  *  Time in the units returned by DXGLTimer__Now
+  * @return
+  *  Time in milliseconds
+  */
+static double DXGLTimer__ToMilliseconds(DXGLTimer *timer, LONGLONG ticks)
+{
+	if (timer->timertype == 1) return ((double)ticks * 1000.0) / timer->timer_frequency;
+	else return (double)ticks;
+}
+
+/**
+  * Waits until a point in time.  The thread sleeps on a waitable timer for
+  * most of the wait.  Without a high resolution timer it wakes up two
+  * milliseconds early, and spins for up to MaxSpinCount iterations before
+  * yielding its time slice for the rest so it is not late.
+  * @param timer
+  *  Pointer to DXGLTimer structure
+  * @param due
+  *  Time to wait for, in performance counter ticks or milliseconds like
+  *  timer_base
+  */
+void DXGLTimer_WaitUntil(DXGLTimer *timer, LONGLONG due)
+{
+	LARGE_INTEGER duetime;
+	LONGLONG now = DXGLTimer__Now(timer);
+	LONGLONG margin = timer->hiresolution ? 0 : DXGLTimer__ToTicks(timer, 2.0);
+	DWORD spincount = dxglcfg.MaxSpinCount;
+	if (timer->waittimer && ((due - now) > margin))
+	{
+		// Relative due time in 100 nanosecond units
+		if (timer->timertype == 1) duetime.QuadPart = -(LONGLONG)((double)(due - now - margin)
+			* 10000000.0 / timer->timer_frequency);
+		else duetime.QuadPart = -(due - now - margin) * 10000;
+		if (SetWaitableTimer(timer->waittimer, &duetime, 0, NULL, NULL, FALSE))
+			WaitForSingleObject(timer->waittimer, INFINITE);
+	}
+	while (DXGLTimer__Now(timer) < due)
+	{
+		if (!spincount) Sleep(0);
+		else
+		{
+			spincount--;
+			YieldProcessor();
+		}
+	}
+}
+
+/**
+  * Opens the display driver adapter showing a window, so the scanline and
+  * vertical blank can be read from the driver instead of estimated with the
+  * timer.  Does nothing before Windows Vista or if VBlankSource is set to
+  * the timer.
+  * @param timer
+  *  Pointer to DXGLTimer structure
+  * @param hwnd
+  *  Window on the display to follow
+  * @return
+  *  TRUE if the vertical blank of the display can be waited for
+  */
+BOOL DXGLTimer_OpenVBlank(DXGLTimer *timer, HWND hwnd)
+{
+	MONITORINFOEX info;
+	D3DKMT_OPENADAPTERFROMHDC open;
+	D3DKMT_GETSCANLINE scanline;
+	HDC hdc;
+	if (dxglcfg.VBlankSource == 1) return FALSE;
+	if (!_D3DKMTOpenAdapterFromHdc || !_D3DKMTCloseAdapter || !_D3DKMTWaitForVerticalBlankEvent) return FALSE;
+	info.cbSize = sizeof(MONITORINFOEX);
+	if (!GetMonitorInfo(MonitorFromWindow(hwnd, MONITOR_DEFAULTTOPRIMARY), (LPMONITORINFO)&info)) return FALSE;
+	hdc = CreateDC(NULL, info.szDevice, NULL, NULL);
+	if (!hdc) return FALSE;
+	ZeroMemory(&open, sizeof(D3DKMT_OPENADAPTERFROMHDC));
+	open.hDc = hdc;
+	if (_D3DKMTOpenAdapterFromHdc(&open) < 0) open.hAdapter = 0;
+	DeleteDC(hdc);
+	if (!open.hAdapter) return FALSE;
+	timer->kmtadapter = open.hAdapter;
+	timer->kmtsource = open.VidPnSourceId;
+	// Remote and basic display drivers may have vertical blank events but no scanline
+	timer->kmtscanline = FALSE;
+	if (_D3DKMTGetScanLine)
+	{
+		scanline.hAdapter = timer->kmtadapter;
+		scanline.VidPnSourceId = timer->kmtsource;
+		if (_D3DKMTGetScanLine(&scanline) >= 0) timer->kmtscanline = TRUE;
+	}
+	return TRUE;
+}
+
+/**
+  * Waits for the start of a vertical blank from the display driver and
+  * re-bases the scanline timer on it.
+  * @param timer
+  *  Pointer to DXGLTimer structure
+  * @return
+  *  TRUE if a vertical blank was waited for, FALSE if the driver does not
+  *  report them
+  */
+static BOOL DXGLTimer__WaitVBlankEvent(DXGLTimer *timer)
+{
+	D3DKMT_WAITFORVERTICALBLANKEVENT wait;
+	LARGE_INTEGER now;
+	double offset;
+	if (!timer->kmtadapter) return FALSE;
+	wait.hAdapter = timer->kmtadapter;
+	wait.hDevice = 0;
+	wait.VidPnSourceId = timer->kmtsource;
+	if (_D3DKMTWaitForVerticalBlankEvent(&wait) < 0) return FALSE;
+	if (timer->timertype == 1) QueryPerformanceCounter(&now);
+	else now.QuadPart = timeGetTime();
+	// The simulated scanline reaches the vertical blank this far into the period
+	offset = timer->monitor_period * (double)(timer->lines - timer->vsync_lines) / (double)timer->lines;
+	if (timer->timertype == 1) offset = offset * timer->timer_frequency / 1000.0;
+	timer->timer_base.QuadPart = now.QuadPart - (LONGLONG)offset;
+	return TRUE;
+}
+
+/**
+  * Measures the refresh interval from the vertical blank events of the
+  * display driver, and aligns the simulated scanline with the real one.
+  * Should be called after DXGLTimer_Calibrate and DXGLTimer_OpenVBlank.
+  * Skipped if the display driver reports the scanline itself.
+  * @param timer
+  *  Pointer to DXGLTimer structure
+  */
+void DXGLTimer_CalibrateVBlank(DXGLTimer *timer)
+{
+	LARGE_INTEGER start, end;
+	double milliseconds;
+	int i;
+	if (timer->kmtscanline) return;
+	if (!DXGLTimer__WaitVBlankEvent(timer)) return;
+	if (timer->timertype == 1) QueryPerformanceCounter(&start);
+	else start.QuadPart = timeGetTime();
+	for (i = 0; i < VBLANK_CALIBRATE_FRAMES; i++)
+		if (!DXGLTimer__WaitVBlankEvent(timer)) return;
+	if (timer->timertype == 1) QueryPerformanceCounter(&end);
+	else end.QuadPart = timeGetTime();
+	if (timer->timertype == 1) milliseconds = ((double)(end.QuadPart - start.QuadPart) / timer->timer_frequency) * 1000.0;
+	else milliseconds = (double)(end.QuadPart - start.QuadPart);
+	milliseconds /= (double)VBLANK_CALIBRATE_FRAMES;
+	// Ignore intervals from a missed event or a display that is not refreshing
+	if ((milliseconds > timer->monitor_period * 0.5) && (milliseconds < timer->monitor_period * 1.5))
+		timer->monitor_period = milliseconds;
+	DXGLTimer__WaitVBlankEvent(timer);
+}
+
+/**
+  * Waits for the next vertical blank estimated with the timer.
+  * @param timer
+  *  Pointer to DXGLTimer structure
+  * @param end
+  *  TRUE to wait for the end of the vertical blank instead of the start
+  */
+static void DXGLTimer__WaitEmulatedVBlank(DXGLTimer *timer, BOOL end)
+{
+	LONGLONG now = DXGLTimer__Now(timer);
+	LONGLONG period = DXGLTimer__ToTicks(timer, timer->monitor_period);
+	LONGLONG target, phase;
+	if (period <= 0) return;
+	// The simulated scanline passes the display height at the vertical blank
+	if (end) target = period;
+	else target = (LONGLONG)((double)period * (double)(timer->lines - timer->vsync_lines) / (double)timer->lines);
+	phase = (now - timer->timer_base.QuadPart) % period;
+	if (phase < 0) phase += period;
+	if (phase >= target) target += period;
+	DXGLTimer_WaitUntil(timer, now + (target - phase));
+}
+
+/**
+  * Waits for a vertical blank from the display driver, or from the timer
+  * if the driver does not report them.
+  * @param timer
+  *  Pointer to DXGLTimer structure
+  * @param end
+  *  TRUE to return at the end of the vertical blank instead of the start
+  * @param emulate
+  *  TRUE to wait for the vertical blank estimated with the timer if the
+  *  display driver does not report them
+  * @return
+  *  TRUE if a vertical blank was waited for, FALSE if emulate is FALSE and
+  *  the caller should fall back to waiting for a buffer swap
+  */
+BOOL DXGLTimer_WaitVBlank(DXGLTimer *timer, BOOL end, BOOL emulate)
+{
+	D3DKMT_GETSCANLINE scanline;
+	DWORD spincount = dxglcfg.MaxSpinCount;
+	if (!DXGLTimer__WaitVBlankEvent(timer))
+	{
+		if (!emulate) return FALSE;
+		DXGLTimer__WaitEmulatedVBlank(timer, end);
+		return TRUE;
+	}
+	if (!end) return TRUE;
+	// Without the scanline, the timer was just re-based on the vertical blank
+	if (!timer->kmtscanline)
+	{
+		DXGLTimer__WaitEmulatedVBlank(timer, TRUE);
+		return TRUE;
+	}
+	scanline.hAdapter = timer->kmtadapter;
+	scanline.VidPnSourceId = timer->kmtsource;
+	// The vertical blank only lasts a few scanlines, so spin through it
+	do
+	{
+		if (_D3DKMTGetScanLine(&scanline) < 0) break;
+		if (!scanline.InVerticalBlank) break;
+		if (!spincount) Sleep(0);
+		else
+		{
+			spincount--;
+			YieldProcessor();
+		}
+	} while (1);
+	return TRUE;
+}
+
+/**
+  * Gets the scanline being sent to the display.  Uses the display driver if
+  * it reports the scanline, otherwise it is estimated with the timer.
+  * @param timer
+  *  Pointer to DXGLTimer structure
+  * @return
+  *  Current scanline, at or past the display height during the vertical blank
+  */
 unsigned int DXGLTimer_GetScanLine(DXGLTimer *timer)
 {
 	LARGE_INTEGER timerpos;
+	D3DKMT_GETSCANLINE scanline;
+	unsigned int height;
 	double sync_pos;
 	double milliseconds;
+	if (timer->kmtscanline)
+	{
+		scanline.hAdapter = timer->kmtadapter;
+		scanline.VidPnSourceId = timer->kmtsource;
+		if (_D3DKMTGetScanLine(&scanline) >= 0)
+		{
+			height = timer->lines - timer->vsync_lines;
+			// Some drivers report line 0 for the whole vertical blank
+			if (scanline.InVerticalBlank && (scanline.ScanLine < height))
+				return height + scanline.ScanLine;
+			return scanline.ScanLine;
+		}
+		timer->kmtscanline = FALSE;
+	}
 	if (timer->timertype == 1)	QueryPerformanceCounter(&timerpos);
 	else timerpos.QuadPart = timeGetTime();
 	timerpos.QuadPart -= timer->timer_base.QuadPart;
@@ -96,4 +454,205 @@ BOOL DXGLTimer_CheckLastDraw(DXGLTimer *timer, DWORD ms)
 	else milliseconds = (double)timerpos.QuadPart;
 	if (milliseconds < ms) return FALSE;
 	else return TRUE;
-}
\ No newline at end of file
+}
+
+/**
+  * Records that a frame was drawn to the screen, for DXGLTimer_GetPresentWait.
+  * @param timer
+  *  Pointer to DXGLTimer structure
+  */
+void DXGLTimer_SetLastPresent(DXGLTimer *timer)
+{
+	if (timer->timertype == 1) QueryPerformanceCounter(&timer->lastpresent);
+	else timer->lastpresent.QuadPart = timeGetTime();
+	timer->lastpresentmeasured = TRUE;
+}
+
+/**
+  * Gets the time left in the refresh interval that began with the last frame
+  * drawn to the screen.
+  * @param timer
+  *  Pointer to DXGLTimer structure
+  * @param frequency
+  *  Display refresh rate in Hz, or 0 to assume 60Hz
+  * @return
+  *  Milliseconds to wait before the next frame, 0 if it can be drawn now
+  */
+DWORD DXGLTimer_GetPresentWait(DXGLTimer *timer, unsigned int frequency)
+{
+	LARGE_INTEGER timerpos;
+	double milliseconds;
+	double period;
+	if (!timer->lastpresentmeasured) return 0;
+	if (!frequency) frequency = 60;
+	period = 1000.0 / (double)frequency;
+	if (timer->timertype == 1)	QueryPerformanceCounter(&timerpos);
+	else timerpos.QuadPart = timeGetTime();
+	timerpos.QuadPart -= timer->lastpresent.QuadPart;
+	if (timer->timertype == 1) milliseconds = ((double)timerpos.QuadPart / (double)timer->timer_frequency) * 1000.0;
+	else milliseconds = (double)timerpos.QuadPart;
+	if (milliseconds >= period) return 0;
+	return (DWORD)ceil(period - milliseconds);
+}
+
+/**
+  * Gets a frame time from the histogram.
+  * @param timer
+  *  Pointer to DXGLTimer structure
+  * @param percent
+  *  Percentage of frames that are as fast or faster than the returned time
+  * @return
+  *  Frame time in milliseconds, to the middle of its histogram bucket, or 0
+  *  if no frames were counted
+  */
+static double DXGLTimer__Percentile(DXGLTimer *timer, DWORD percent)
+{
+	DWORD i;
+	DWORD count = 0;
+	if (!timer->frames) return 0.0;
+	for (i = 0; i < DXGLTIMER_HISTOGRAM - 1; i++)
+	{
+		count += timer->histogram[i];
+		if ((ULONGLONG)count * 100 >= (ULONGLONG)timer->frames * percent) return (double)i + 0.5;
+	}
+	return (double)(DXGLTIMER_HISTOGRAM - 1);
+}
+
+/**
+  * Logs the frame time histogram, if tracing is enabled.
+  * @param timer
+  *  Pointer to DXGLTimer structure
+  */
+static void DXGLTimer__LogHistogram(DXGLTimer *timer)
+{
+	char str[256];
+	DWORD i;
+	if (!dxglcfg.DebugTraceLevel || !timer->frames) return;
+	sprintf(str, "Frame times: %u frames, median %.1f ms, 95%% %.1f ms, 99%% %.1f ms, %u stutters\n",
+		timer->frames, DXGLTimer__Percentile(timer, 50), DXGLTimer__Percentile(timer, 95),
+		DXGLTimer__Percentile(timer, 99), timer->stutters);
+	TRACE_STRING(str);
+	for (i = 0; i < DXGLTIMER_HISTOGRAM; i++)
+	{
+		if (!timer->histogram[i]) continue;
+		if (i == DXGLTIMER_HISTOGRAM - 1) sprintf(str, "  %u+ ms: %u frames\n", i, timer->histogram[i]);
+		else sprintf(str, "  %u ms: %u frames\n", i, timer->histogram[i]);
+		TRACE_STRING(str);
+	}
+}
+
+/**
+  * Closes the frame limiter timer and the display driver adapter, and logs
+  * the frame time histogram.
+  * @param timer
+  *  Pointer to DXGLTimer structure
+  */
+void DXGLTimer_Delete(DXGLTimer *timer)
+{
+	D3DKMT_CLOSEADAPTER close;
+	DXGLTimer__LogHistogram(timer);
+	timer->frames = 0;
+	if (timer->waittimer) CloseHandle(timer->waittimer);
+	timer->waittimer = NULL;
+	if (timer->kmtadapter)
+	{
+		close.hAdapter = timer->kmtadapter;
+		_D3DKMTCloseAdapter(&close);
+	}
+	timer->kmtadapter = 0;
+	timer->kmtscanline = FALSE;
+}
+
+/**
+  * Waits until the next frame is due for a frame rate limit, using
+  * DXGLTimer_WaitUntil.  A frame that is already late starts a new schedule
+  * instead of being followed by a burst of frames.
+  * @param timer
+  *  Pointer to DXGLTimer structure
+  * @param fps
+  *  Frames per second to limit to, or 0 to not limit
+  */
+void DXGLTimer_WaitFrame(DXGLTimer *timer, DWORD fps)
+{
+	LONGLONG now, period;
+	if (!fps) return;
+	period = DXGLTimer__ToTicks(timer, 1000.0 / (double)fps);
+	now = DXGLTimer__Now(timer);
+	if (!timer->nextframe.QuadPart || (now >= timer->nextframe.QuadPart))
+	{
+		timer->nextframe.QuadPart = now + period;
+		return;
+	}
+	DXGLTimer_WaitUntil(timer, timer->nextframe.QuadPart);
+	timer->nextframe.QuadPart += period;
+}
+
+/**
+  * Reads the timer, for measuring parts of a frame with
+  * DXGLTimer_AddFrameTime.
+  * @param timer
+  *  Pointer to DXGLTimer structure
+  * @return
+  *  Current time in the units of the timer
+  */
+LONGLONG DXGLTimer_GetTime(DXGLTimer *timer)
+{
+	return DXGLTimer__Now(timer);
+}
+
+/**
+  * Adds the time since start to a part of the current frame.  Called by the
+  * render thread.
+  * @param timer
+  *  Pointer to DXGLTimer structure
+  * @param part
+  *  DXGLTIMER_IDLE or DXGLTIMER_PRESENT
+  * @param start
+  *  Time returned by DXGLTimer_GetTime when the part started
+  */
+void DXGLTimer_AddFrameTime(DXGLTimer *timer, int part, LONGLONG start)
+{
+	timer->frameparts[part] += DXGLTimer__Now(timer) - start;
+}
+
+/**
+  * Counts the time since the previous frame in the frame time histogram and
+  * starts measuring the next frame.  Called by the render thread after each
+  * frame is presented.
+  * @param timer
+  *  Pointer to DXGLTimer structure
+  * @param times
+  *  Receives how the frame was spent
+  * @return
+  *  TRUE if the frame took longer than DebugStutterThreshold percent of the
+  *  median frame time
+  */
+BOOL DXGLTimer_EndFrame(DXGLTimer *timer, DXGLFRAMETIMES *times)
+{
+	LONGLONG now = DXGLTimer__Now(timer);
+	DWORD bucket;
+	BOOL stutter = FALSE;
+	if (timer->lastframe)
+	{
+		times->frame = DXGLTimer__ToMilliseconds(timer, now - timer->lastframe);
+		times->idle = DXGLTimer__ToMilliseconds(timer, timer->frameparts[DXGLTIMER_IDLE]);
+		times->present = DXGLTimer__ToMilliseconds(timer, timer->frameparts[DXGLTIMER_PRESENT]);
+		times->execute = times->frame - times->idle - times->present;
+		if (times->execute < 0.0) times->execute = 0.0;
+		times->median = DXGLTimer__Percentile(timer, 50);
+		// Wait for enough frames that the median is not thrown off by loading
+		if (dxglcfg.DebugStutterThreshold && (timer->frames >= STUTTER_MINFRAMES)
+			&& (times->frame * 100.0 > times->median * (double)dxglcfg.DebugStutterThreshold))
+		{
+			stutter = TRUE;
+			timer->stutters++;
+		}
+		bucket = (DWORD)times->frame;
+		if (bucket >= DXGLTIMER_HISTOGRAM) bucket = DXGLTIMER_HISTOGRAM - 1;
+		timer->histogram[bucket]++;
+		timer->frames++;
+	}
+	timer->lastframe = now;
+	timer->frameparts[DXGLTIMER_IDLE] = timer->frameparts[DXGLTIMER_PRESENT] = 0;
+	return stutter;
+}
@@ -23,11 +23,36 @@
 extern "C" {
 #endif
 
+// Parts of a frame added up with DXGLTimer_AddFrameTime
+#define DXGLTIMER_IDLE 0  // Render thread waiting for commands from the application
+#define DXGLTIMER_PRESENT 1  // Frame limiter, SwapBuffers and waiting for frames in flight
+
+// How a frame was spent, in milliseconds
+typedef struct DXGLFRAMETIMES
+{
+	double frame;  // Time since the previous frame
+	double idle;  // Render thread waiting for the application
+	double execute;  // Render thread running commands
+	double present;  // Render thread presenting the frame
+	double median;  // Median frame time before this frame
+} DXGLFRAMETIMES;
+
 void DXGLTimer_Init(DXGLTimer *timer);
 void DXGLTimer_Calibrate(DXGLTimer *timer, unsigned int lines, unsigned int frequency);
+BOOL DXGLTimer_OpenVBlank(DXGLTimer *timer, HWND hwnd);
+void DXGLTimer_CalibrateVBlank(DXGLTimer *timer);
+BOOL DXGLTimer_WaitVBlank(DXGLTimer *timer, BOOL end, BOOL emulate);
+void DXGLTimer_WaitUntil(DXGLTimer *timer, LONGLONG due);
 unsigned int DXGLTimer_GetScanLine(DXGLTimer *timer);
 void DXGLTimer_SetLastDraw(DXGLTimer *timer);
 BOOL DXGLTimer_CheckLastDraw(DXGLTimer *timer, DWORD ms);
+void DXGLTimer_SetLastPresent(DXGLTimer *timer);
+DWORD DXGLTimer_GetPresentWait(DXGLTimer *timer, unsigned int frequency);
+void DXGLTimer_WaitFrame(DXGLTimer *timer, DWORD fps);
+LONGLONG DXGLTimer_GetTime(DXGLTimer *timer);
+void DXGLTimer_AddFrameTime(DXGLTimer *timer, int part, LONGLONG start);
+BOOL DXGLTimer_EndFrame(DXGLTimer *timer, DXGLFRAMETIMES *times);
+void DXGLTimer_Delete(DXGLTimer *timer);
 
 #ifdef __cplusplus
 }
@@ -17,41 +17,7 @@
 
 #include "common.h"
 #include "trace.h"
-
-/* Data types:
--1 - C++ constructor/destructor
-0 - void
-1 - 8-bit signed
-2 - 8-bit unsigned
-3 - 8-bit hex
-4 - 16 bit signed
-5 - 16 bit unsigned
-6 - 16 bit hex
-7 - 32 bit signed
-8 - 32 bit unsigned
-9 - 32 bit hex
-10 - pointer to 64 bit hex
-11 - native signed
-12 - native unsigned
-13 - native hex
-14 - generic pointer
-15 - ASCII string
-16 - Unicode string
-17 - TCHAR string
-18 - ASCII character
-19 - pointer to 32 bit float
-20 - pointer to 64 bit float
-21 - c++ bool
-22 - int BOOL
-23 - HRESULT
-24 - GUID pointer
-25 - SIZE or POINT pointer
-26 - RECT pointer
-27 - D3DRENDERSTATETYPE
-28 - D3DTEXTURESTAGESTATETYPE
-29 - D3DTRANSFORMSTATETYPE
-30 - D3DLIGHTSTATETYPE
-*/
+#include "tracedecode.h"
 
 static CRITICAL_SECTION trace_cs;
 static BOOL trace_ready = FALSE;
@@ -59,783 +25,493 @@ static BOOL trace_fail = FALSE;
 BOOL trace_end = FALSE;
 static HANDLE outfile = INVALID_HANDLE_VALUE;
 unsigned int trace_depth = 0;
-static void trace_decode_hresult(HRESULT hr)
+
+// Binary tracing, enabled by DebugTraceBinary
+#define TRACE_RINGSIZE 262144  // Bytes of events buffered per thread, must be a power of two
+#define TRACE_FLUSHINTERVAL 50  // Milliseconds between writes by the writer thread
+#define TRACE_OUTSIZE 1048576  // Bytes collected before each write to the trace file
+#define TRACE_MAXCOPY 256  // Bytes copied from string arguments
+#define TRACE_MAXSTRING (TRACE_RINGSIZE / 4)  // Bytes kept from TRACE_STRING text
+#define TRACE_MAXARGS 32
+
+// Events recorded by one thread and read by the writer thread
+typedef struct TraceRing
+{
+	volatile LONG head;  // Bytes recorded, only written by the owning thread
+	volatile LONG tail;  // Bytes written out, only written by the writer thread
+	volatile LONG dropped;  // Events lost because the buffer was full
+	volatile LONG released;  // The owning thread exited, the buffer can be reused once written out
+	DWORD threadid;
+	struct TraceRing *next;
+	BYTE data[TRACE_RINGSIZE];
+} TraceRing;
+
+static BOOL trace_binary = FALSE;
+static DWORD trace_tls = TLS_OUT_OF_INDEXES;
+static TraceRing *volatile trace_rings = NULL;
+static HANDLE trace_thread = NULL;
+static HANDLE trace_wake = NULL;
+static volatile BOOL trace_stop = FALSE;
+static CRITICAL_SECTION trace_flush_cs;
+static BYTE *trace_out = NULL;
+static DWORD trace_outused = 0;
+static unsigned __int64 *trace_names = NULL;
+static DWORD trace_namecount = 0;
+static DWORD trace_namesize = 0;
+
+static void end_trace();
+
+static void trace_bin_writeout()
+{
+	DWORD byteswritten;
+	if (trace_outused) WriteFile(outfile, trace_out, trace_outused, &byteswritten, NULL);
+	trace_outused = 0;
+}
+
+static void trace_bin_write(const void *data, DWORD size)
 {
 	DWORD byteswritten;
-	char str[64];
-	switch(hr)
+	if (trace_outused + size > TRACE_OUTSIZE) trace_bin_writeout();
+	if (size > TRACE_OUTSIZE) WriteFile(outfile, data, size, &byteswritten, NULL);
+	else
 	{
-	case DD_OK:
-		strcpy(str,"DD_OK");
-		break;
-	case DD_FALSE:
-		strcpy(str,"DD_FALSE");
-		break;
-	case DDERR_ALREADYINITIALIZED:
-		strcpy(str,"DDERR_ALREADYINITIALIZED");
-		break;
-	case DDERR_CANNOTATTACHSURFACE:
-		strcpy(str,"DDERR_CANNOTATTACHSURFACE");
-		break;
-	case DDERR_CANNOTDETACHSURFACE:
-		strcpy(str,"DDERR_CANNOTDETACHSURFACE");
-		break;
-	case DDERR_CURRENTLYNOTAVAIL:
-		strcpy(str,"DDERR_CURRENTLYNOTAVAIL");
-		break;
-	case DDERR_EXCEPTION:
-		strcpy(str,"DDERR_EXCEPTION");
-		break;
-	case DDERR_GENERIC:
-		strcpy(str,"DDERR_GENERIC");
-		break;
-	case DDERR_INCOMPATIBLEPRIMARY:
-		strcpy(str,"DDERR_INCOMPATIBLEPRIMARY");
-		break;
-	case DDERR_INVALIDCAPS:
-		strcpy(str,"DDERR_INVALIDCAPS");
-		break;
-	case DDERR_INVALIDCLIPLIST:
-		strcpy(str,"DDERR_INVALIDCLIPLIST");
-		break;
-	case DDERR_INVALIDMODE:
-		strcpy(str,"DDERR_INVALIDMODE");
-		break;
-	case DDERR_INVALIDPARAMS:
-		strcpy(str,"DDERR_INVALIDPARAMS");
-		break;
-	case DDERR_INVALIDPIXELFORMAT:
-		strcpy(str,"DDERR_INVALIDPIXELFORMAT");
-		break;
-	case DDERR_INVALIDRECT:
-		strcpy(str,"DDERR_INVALIDRECT");
-		break;
-	case DDERR_NOTFOUND:
-		strcpy(str,"DDERR_NOTFOUND");
-		break;
-	case DDERR_OUTOFMEMORY:
-		strcpy(str,"DDERR_OUTOFMEMORY");
-		break;
-	case DDERR_OUTOFVIDEOMEMORY:
-		strcpy(str,"DDERR_OUTOFVIDEOMEMORY");
-		break;
-	case DDERR_SURFACEALREADYATTACHED:
-		strcpy(str,"DDERR_SURFACEALREADYATTACHED");
-		break;
-	case DDERR_SURFACEBUSY:
-		strcpy(str,"DDERR_SURFACEBUSY");
-		break;
-	case DDERR_CANTLOCKSURFACE:
-		strcpy(str,"DDERR_CANTLOCKSURFACE");
-		break;
-	case DDERR_SURFACELOST:
-		strcpy(str,"DDERR_SURFACELOST");
-		break;
-	case DDERR_SURFACENOTATTACHED:
-		strcpy(str,"DDERR_SURFACENOTATTACHED");
-		break;
-	case DDERR_UNSUPPORTED:
-		strcpy(str,"DDERR_UNSUPPORTED");
-		break;
-	case DDERR_UNSUPPORTEDFORMAT:
-		strcpy(str,"DDERR_UNSUPPORTEDFORMAT");
-		break;
-	case DDERR_UNSUPPORTEDMASK:
-		strcpy(str,"DDERR_UNSUPPORTEDMASK");
-		break;
-	case DDERR_WASSTILLDRAWING:
-		strcpy(str,"DDERR_WASSTILLDRAWING");
-		break;
-	case DDERR_INVALIDDIRECTDRAWGUID:
-		strcpy(str,"DDERR_INVALIDDIRECTDRAWGUID");
-		break;
-	case DDERR_DIRECTDRAWALREADYCREATED:
-		strcpy(str,"DDERR_DIRECTDRAWALREADYCREATED");
-		break;
-	case DDERR_NODIRECTDRAWHW:
-		strcpy(str,"DDERR_NODIRECTDRAWHW");
-		break;
-	case DDERR_PRIMARYSURFACEALREADYEXISTS:
-		strcpy(str,"DDERR_PRIMARYSURFACEALREADYEXISTS");
-		break;
-	case DDERR_CLIPPERISUSINGHWND:
-		strcpy(str,"DDERR_CLIPPERISUSINGHWND");
-		break;
-	case DDERR_NOCLIPPERATTACHED:
-		strcpy(str,"DDERR_NOCLIPPERATTACHED");
-		break;
-	case DDERR_NOHWND:
-		strcpy(str,"DDERR_NOHWND");
-		break;
-	case DDERR_HWNDSUBCLASSED:
-		strcpy(str,"DDERR_HWNDSUBCLASSED");
-		break;
-	case DDERR_HWNDALREADYSET:
-		strcpy(str,"DDERR_HWNDALREADYSET");
-		break;
-	case DDERR_NOPALETTEATTACHED:
-		strcpy(str,"DDERR_NOPALETTEATTACHED");
-		break;
-	case DDERR_NOPALETTEHW:
-		strcpy(str,"DDERR_NOPALETTEHW");
-		break;
-	case DDERR_BLTFASTCANTCLIP:
-		strcpy(str,"DDERR_BLTFASTCANTCLIP");
-		break;
-	case DDERR_OVERLAYNOTVISIBLE:
-		strcpy(str,"DDERR_OVERLAYNOTVISIBLE");
-		break;
-	case DDERR_NOOVERLAYDEST:
-		strcpy(str,"DDERR_NOOVERLAYDEST");
-		break;
-	case DDERR_EXCLUSIVEMODEALREADYSET:
-		strcpy(str,"DDERR_EXCLUSIVEMODEALREADYSET");
-		break;
-	case DDERR_NOTFLIPPABLE:
-		strcpy(str,"DDERR_NOTFLIPPABLE");
-		break;
-	case DDERR_CANTDUPLICATE:
-		strcpy(str,"DDERR_CANTDUPLICATE");
-		break;
-	case DDERR_NOTLOCKED:
-		strcpy(str,"DDERR_NOTLOCKED");
-		break;
-	case DDERR_CANTCREATEDC:
-		strcpy(str,"DDERR_CANTCREATEDC");
-		break;
-	case DDERR_NODC:
-		strcpy(str,"DDERR_NODC");
-		break;
-	case DDERR_WRONGMODE:
-		strcpy(str,"DDERR_WRONGMODE");
-		break;
-	case DDERR_IMPLICITLYCREATED:
-		strcpy(str,"DDERR_IMPLICITLYCREATED");
-		break;
-	case DDERR_NOTPALETTIZED:
-		strcpy(str,"DDERR_NOTPALETTIZED");
-		break;
-	case DDERR_UNSUPPORTEDMODE:
-		strcpy(str,"DDERR_UNSUPPORTEDMODE");
-		break;
-	case DDERR_INVALIDSURFACETYPE:
-		strcpy(str,"DDERR_INVALIDSURFACETYPE");
-		break;
-	case DDERR_NOTONMIPMAPSUBLEVEL:
-		strcpy(str,"DDERR_NOTONMIPMAPSUBLEVEL");
-		break;
-	case DDERR_DCALREADYCREATED:
-		strcpy(str,"DDERR_DCALREADYCREATED");
-		break;
-	case DDERR_CANTPAGELOCK:
-		strcpy(str,"DDERR_CANTPAGELOCK");
-		break;
-	case DDERR_CANTPAGEUNLOCK:
-		strcpy(str,"DDERR_CANTPAGEUNLOCK");
-		break;
-	case DDERR_NOTPAGELOCKED:
-		strcpy(str,"DDERR_NOTPAGELOCKED");
-		break;
-	case DDERR_MOREDATA:
-		strcpy(str,"DDERR_MOREDATA");
-		break;
-	case DDERR_NOTINITIALIZED:
-		strcpy(str,"DDERR_NOTINITIALIZED");
-		break;
-	case E_NOINTERFACE:
-		strcpy(str,"E_NOINTERFACE");
-		break;
-	case CLASS_E_NOAGGREGATION:
-		strcpy(str,"CLASS_E_NOAGGREGATION");
-		break;
-	default:
-		sprintf(str,"(HRESULT)0x%08X",hr);
-		break;
+		memcpy(trace_out + trace_outused, data, size);
+		trace_outused += size;
 	}
-	WriteFile(outfile,str,strlen(str),&byteswritten,NULL);
 }
 
-static void trace_decode_d3drenderstate(DWORD rs)
+static DWORD trace_bin_hash(unsigned __int64 address)
 {
-	DWORD byteswritten;
-	char str[64];
-	switch(rs)
+	return (DWORD)(address >> 3) * 2654435761U;
+}
+
+/**
+  * Writes a name record the first time a function or variable name is seen,
+  * events only store the address of the name.
+  * @param name
+  *  Name string in the traced module, or NULL
+  */
+static void trace_bin_name(const char *name)
+{
+	static const BYTE zero[8] = { 0,0,0,0,0,0,0,0 };
+	unsigned __int64 address = (ULONG_PTR)name;
+	unsigned __int64 *newnames;
+	TRACEBIN_NAMEREC rec;
+	DWORD len;
+	DWORD i, j;
+	DWORD newsize;
+	if (!name) return;
+	if (trace_namecount * 2 >= trace_namesize)
 	{
-	case D3DRENDERSTATE_TEXTUREHANDLE:
-		strcpy(str,"D3DRENDERSTATE_TEXTUREHANDLE");
-		break;
-	case D3DRENDERSTATE_ANTIALIAS:
-		strcpy(str,"D3DRENDERSTATE_ANTIALIAS");
-		break;
-	case D3DRENDERSTATE_TEXTUREADDRESS:
-		strcpy(str,"D3DRENDERSTATE_TEXTUREADDRESS");
-		break;
-	case D3DRENDERSTATE_TEXTUREPERSPECTIVE:
-		strcpy(str,"D3DRENDERSTATE_TEXTUREPERSPECTIVE");
-		break;
-	case D3DRENDERSTATE_WRAPU:
-		strcpy(str,"D3DRENDERSTATE_WRAPU");
-		break;
-	case D3DRENDERSTATE_WRAPV:
-		strcpy(str,"D3DRENDERSTATE_WRAPV");
-		break;
-	case D3DRENDERSTATE_ZENABLE:
-		strcpy(str,"D3DRENDERSTATE_ZENABLE");
-		break;
-	case D3DRENDERSTATE_FILLMODE:
-		strcpy(str,"D3DRENDERSTATE_FILLMODE");
-		break;
-	case D3DRENDERSTATE_SHADEMODE:
-		strcpy(str,"D3DRENDERSTATE_SHADEMODE");
-		break;
-	case D3DRENDERSTATE_LINEPATTERN:
-		strcpy(str,"D3DRENDERSTATE_LINEPATTERN");
-		break;
-	case D3DRENDERSTATE_MONOENABLE:
-		strcpy(str,"D3DRENDERSTATE_MONOENABLE");
-		break;
-	case D3DRENDERSTATE_ROP2:
-		strcpy(str,"D3DRENDERSTATE_ROP2");
-		break;
-	case D3DRENDERSTATE_PLANEMASK:
-		strcpy(str,"D3DRENDERSTATE_PLANEMASK");
-		break;
-	case D3DRENDERSTATE_ZWRITEENABLE:
-		strcpy(str,"D3DRENDERSTATE_ZWRITEENABLE");
-		break;
-	case D3DRENDERSTATE_ALPHATESTENABLE:
-		strcpy(str,"D3DRENDERSTATE_ALPHATESTENABLE");
-		break;
-	case D3DRENDERSTATE_LASTPIXEL:
-		strcpy(str,"D3DRENDERSTATE_LASTPIXEL");
-		break;
-	case D3DRENDERSTATE_TEXTUREMAG:
-		strcpy(str,"D3DRENDERSTATE_TEXTUREMAG");
-		break;
-	case D3DRENDERSTATE_TEXTUREMIN:
-		strcpy(str,"D3DRENDERSTATE_TEXTUREMIN");
-		break;
-	case D3DRENDERSTATE_SRCBLEND:
-		strcpy(str,"D3DRENDERSTATE_SRCBLEND");
-		break;
-	case D3DRENDERSTATE_DESTBLEND:
-		strcpy(str,"D3DRENDERSTATE_DESTBLEND");
-		break;
-	case D3DRENDERSTATE_TEXTUREMAPBLEND:
-		strcpy(str,"D3DRENDERSTATE_TEXTUREMAPBLEND");
-		break;
-	case D3DRENDERSTATE_CULLMODE:
-		strcpy(str,"D3DRENDERSTATE_CULLMODE");
-		break;
-	case D3DRENDERSTATE_ZFUNC:
-		strcpy(str,"D3DRENDERSTATE_ZFUNC");
-		break;
-	case D3DRENDERSTATE_ALPHAREF:
-		strcpy(str,"D3DRENDERSTATE_ALPHAREF");
-		break;
-	case D3DRENDERSTATE_ALPHAFUNC:
-		strcpy(str,"D3DRENDERSTATE_ALPHAFUNC");
-		break;
-	case D3DRENDERSTATE_DITHERENABLE:
-		strcpy(str,"D3DRENDERSTATE_DITHERENABLE");
-		break;
-	case D3DRENDERSTATE_ALPHABLENDENABLE:
-		strcpy(str,"D3DRENDERSTATE_ALPHABLENDENABLE");
-		break;
-	case D3DRENDERSTATE_FOGENABLE:
-		strcpy(str,"D3DRENDERSTATE_FOGENABLE");
-		break;
-	case D3DRENDERSTATE_SPECULARENABLE:
-		strcpy(str,"D3DRENDERSTATE_SPECULARENABLE");
-		break;
-	case D3DRENDERSTATE_ZVISIBLE:
-		strcpy(str,"D3DRENDERSTATE_ZVISIBLE");
-		break;
-	case D3DRENDERSTATE_SUBPIXEL:
-		strcpy(str,"D3DRENDERSTATE_SUBPIXEL");
-		break;
-	case D3DRENDERSTATE_SUBPIXELX:
-		strcpy(str,"D3DRENDERSTATE_SUBPIXELX");
-		break;
-	case D3DRENDERSTATE_STIPPLEDALPHA:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEDALPHA");
-		break;
-	case D3DRENDERSTATE_FOGCOLOR:
-		strcpy(str,"D3DRENDERSTATE_FOGCOLOR");
-		break;
-	case D3DRENDERSTATE_FOGTABLEMODE:
-		strcpy(str,"D3DRENDERSTATE_FOGTABLEMODE");
-		break;
-	case D3DRENDERSTATE_FOGSTART:
-		strcpy(str,"D3DRENDERSTATE_FOGSTART");
-		break;
-	case D3DRENDERSTATE_FOGEND:
-		strcpy(str,"D3DRENDERSTATE_FOGEND");
-		break;
-	case D3DRENDERSTATE_FOGDENSITY:
-		strcpy(str,"D3DRENDERSTATE_FOGDENSITY");
-		break;
-	case D3DRENDERSTATE_STIPPLEENABLE:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEENABLE");
-		break;
-	case D3DRENDERSTATE_EDGEANTIALIAS:
-		strcpy(str,"D3DRENDERSTATE_EDGEANTIALIAS");
-		break;
-	case D3DRENDERSTATE_COLORKEYENABLE:
-		strcpy(str,"D3DRENDERSTATE_COLORKEYENABLE");
-		break;
-	case 42: // DX5 D3DRENDERSTATE_ALPHABLENDENABLE
-		strcpy(str,"D3DRENDERSTATE_ALPHABLENDENABLE(DX5)");
-		break;
-	case D3DRENDERSTATE_BORDERCOLOR:
-		strcpy(str,"D3DRENDERSTATE_BORDERCOLOR");
-		break;
-	case D3DRENDERSTATE_TEXTUREADDRESSU:
-		strcpy(str,"D3DRENDERSTATE_TEXTUREADDRESSU");
-		break;
-	case D3DRENDERSTATE_TEXTUREADDRESSV:
-		strcpy(str,"D3DRENDERSTATE_TEXTUREADDRESSV");
-		break;
-	case D3DRENDERSTATE_MIPMAPLODBIAS:
-		strcpy(str,"D3DRENDERSTATE_MIPMAPLODBIAS");
-		break;
-	case D3DRENDERSTATE_ZBIAS:
-		strcpy(str,"D3DRENDERSTATE_ZBIAS");
-		break;
-	case D3DRENDERSTATE_RANGEFOGENABLE:
-		strcpy(str,"D3DRENDERSTATE_RANGEFOGENABLE");
-		break;
-	case D3DRENDERSTATE_ANISOTROPY:
-		strcpy(str,"D3DRENDERSTATE_ANISOTROPY");
-		break;
-	case D3DRENDERSTATE_FLUSHBATCH:
-		strcpy(str,"D3DRENDERSTATE_FLUSHBATCH");
-		break;
-	case D3DRENDERSTATE_TRANSLUCENTSORTINDEPENDENT:
-		strcpy(str,"D3DRENDERSTATE_TRANSLUCENTSORTINDEPENDENT");
-		break;
-	case D3DRENDERSTATE_STENCILENABLE:
-		strcpy(str,"D3DRENDERSTATE_STENCILENABLE");
-		break;
-	case D3DRENDERSTATE_STENCILFAIL:
-		strcpy(str,"D3DRENDERSTATE_STENCILFAIL");
-		break;
-	case D3DRENDERSTATE_STENCILZFAIL:
-		strcpy(str,"D3DRENDERSTATE_STENCILZFAIL");
-		break;
-	case D3DRENDERSTATE_STENCILPASS:
-		strcpy(str,"D3DRENDERSTATE_STENCILPASS");
-		break;
-	case D3DRENDERSTATE_STENCILFUNC:
-		strcpy(str,"D3DRENDERSTATE_STENCILFUNC");
-		break;
-	case D3DRENDERSTATE_STENCILREF:
-		strcpy(str,"D3DRENDERSTATE_STENCILREF");
-		break;
-	case D3DRENDERSTATE_STENCILMASK:
-		strcpy(str,"D3DRENDERSTATE_STENCILMASK");
-		break;
-	case D3DRENDERSTATE_STENCILWRITEMASK:
-		strcpy(str,"D3DRENDERSTATE_STENCILWRITEMASK");
-		break;
-	case D3DRENDERSTATE_TEXTUREFACTOR:
-		strcpy(str,"D3DRENDERSTATE_TEXTUREFACTOR");
-		break;
-	case D3DRENDERSTATE_STIPPLEPATTERN00:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEPATTERN00");
-		break;
-	case D3DRENDERSTATE_STIPPLEPATTERN01:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEPATTERN01");
-		break;
-	case D3DRENDERSTATE_STIPPLEPATTERN02:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEPATTERN02");
-		break;
-	case D3DRENDERSTATE_STIPPLEPATTERN03:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEPATTERN03");
-		break;
-	case D3DRENDERSTATE_STIPPLEPATTERN04:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEPATTERN04");
-		break;
-	case D3DRENDERSTATE_STIPPLEPATTERN05:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEPATTERN05");
-		break;
-	case D3DRENDERSTATE_STIPPLEPATTERN06:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEPATTERN06");
-		break;
-	case D3DRENDERSTATE_STIPPLEPATTERN07:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEPATTERN07");
-		break;
-	case D3DRENDERSTATE_STIPPLEPATTERN08:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEPATTERN08");
-		break;
-	case D3DRENDERSTATE_STIPPLEPATTERN09:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEPATTERN09");
-		break;
-	case D3DRENDERSTATE_STIPPLEPATTERN10:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEPATTERN10");
-		break;
-	case D3DRENDERSTATE_STIPPLEPATTERN11:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEPATTERN11");
-		break;
-	case D3DRENDERSTATE_STIPPLEPATTERN12:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEPATTERN12");
-		break;
-	case D3DRENDERSTATE_STIPPLEPATTERN13:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEPATTERN13");
-		break;
-	case D3DRENDERSTATE_STIPPLEPATTERN14:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEPATTERN14");
-		break;
-	case D3DRENDERSTATE_STIPPLEPATTERN15:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEPATTERN15");
-		break;
-	case D3DRENDERSTATE_STIPPLEPATTERN16:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEPATTERN16");
-		break;
-	case D3DRENDERSTATE_STIPPLEPATTERN17:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEPATTERN17");
-		break;
-	case D3DRENDERSTATE_STIPPLEPATTERN18:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEPATTERN18");
-		break;
-	case D3DRENDERSTATE_STIPPLEPATTERN19:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEPATTERN19");
-		break;
-	case D3DRENDERSTATE_STIPPLEPATTERN20:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEPATTERN20");
-		break;
-	case D3DRENDERSTATE_STIPPLEPATTERN21:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEPATTERN21");
-		break;
-	case D3DRENDERSTATE_STIPPLEPATTERN22:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEPATTERN22");
-		break;
-	case D3DRENDERSTATE_STIPPLEPATTERN23:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEPATTERN23");
-		break;
-	case D3DRENDERSTATE_STIPPLEPATTERN24:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEPATTERN24");
-		break;
-	case D3DRENDERSTATE_STIPPLEPATTERN25:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEPATTERN25");
-		break;
-	case D3DRENDERSTATE_STIPPLEPATTERN26:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEPATTERN26");
-		break;
-	case D3DRENDERSTATE_STIPPLEPATTERN27:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEPATTERN27");
-		break;
-	case D3DRENDERSTATE_STIPPLEPATTERN28:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEPATTERN28");
-		break;
-	case D3DRENDERSTATE_STIPPLEPATTERN29:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEPATTERN29");
-		break;
-	case D3DRENDERSTATE_STIPPLEPATTERN30:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEPATTERN30");
-		break;
-	case D3DRENDERSTATE_STIPPLEPATTERN31:
-		strcpy(str,"D3DRENDERSTATE_STIPPLEPATTERN31");
-		break;
-	case D3DRENDERSTATE_WRAP0:
-		strcpy(str,"D3DRENDERSTATE_WRAP0");
-		break;
-	case D3DRENDERSTATE_WRAP1:
-		strcpy(str,"D3DRENDERSTATE_WRAP1");
-		break;
-	case D3DRENDERSTATE_WRAP2:
-		strcpy(str,"D3DRENDERSTATE_WRAP2");
-		break;
-	case D3DRENDERSTATE_WRAP3:
-		strcpy(str,"D3DRENDERSTATE_WRAP3");
-		break;
-	case D3DRENDERSTATE_WRAP4:
-		strcpy(str,"D3DRENDERSTATE_WRAP4");
-		break;
-	case D3DRENDERSTATE_WRAP5:
-		strcpy(str,"D3DRENDERSTATE_WRAP5");
-		break;
-	case D3DRENDERSTATE_WRAP6:
-		strcpy(str,"D3DRENDERSTATE_WRAP6");
-		break;
-	case D3DRENDERSTATE_WRAP7:
-		strcpy(str,"D3DRENDERSTATE_WRAP7");
-		break;
-	case D3DRENDERSTATE_CLIPPING:
-		strcpy(str,"D3DRENDERSTATE_CLIPPING");
-		break;
-	case D3DRENDERSTATE_LIGHTING:
-		strcpy(str,"D3DRENDERSTATE_LIGHTING");
-		break;
-	case D3DRENDERSTATE_EXTENTS:
-		strcpy(str,"D3DRENDERSTATE_EXTENTS");
-		break;
-	case D3DRENDERSTATE_AMBIENT:
-		strcpy(str,"D3DRENDERSTATE_AMBIENT");
-		break;
-	case D3DRENDERSTATE_FOGVERTEXMODE:
-		strcpy(str,"D3DRENDERSTATE_FOGVERTEXMODE");
-		break;
-	case D3DRENDERSTATE_COLORVERTEX:
-		strcpy(str,"D3DRENDERSTATE_COLORVERTEX");
-		break;
-	case D3DRENDERSTATE_LOCALVIEWER:
-		strcpy(str,"D3DRENDERSTATE_LOCALVIEWER");
-		break;
-	case D3DRENDERSTATE_NORMALIZENORMALS:
-		strcpy(str,"D3DRENDERSTATE_NORMALIZENORMALS");
-		break;
-	case D3DRENDERSTATE_COLORKEYBLENDENABLE:
-		strcpy(str,"D3DRENDERSTATE_COLORKEYBLENDENABLE");
-		break;
-	case D3DRENDERSTATE_DIFFUSEMATERIALSOURCE:
-		strcpy(str,"D3DRENDERSTATE_DIFFUSEMATERIALSOURCE");
-		break;
-	case D3DRENDERSTATE_SPECULARMATERIALSOURCE:
-		strcpy(str,"D3DRENDERSTATE_SPECULARMATERIALSOURCE");
-		break;
-	case D3DRENDERSTATE_AMBIENTMATERIALSOURCE:
-		strcpy(str,"D3DRENDERSTATE_AMBIENTMATERIALSOURCE");
-		break;
-	case D3DRENDERSTATE_EMISSIVEMATERIALSOURCE:
-		strcpy(str,"D3DRENDERSTATE_EMISSIVEMATERIALSOURCE");
-		break;
-	case D3DRENDERSTATE_VERTEXBLEND:
-		strcpy(str,"D3DRENDERSTATE_VERTEXBLEND");
-		break;
-	case D3DRENDERSTATE_CLIPPLANEENABLE:
-		strcpy(str,"D3DRENDERSTATE_CLIPPLANEENABLE");
-		break;
-	default:
-		sprintf(str,"(D3DRENDERSTATETYPE)%u",rs);
-		break;
+		newsize = trace_namesize ? trace_namesize * 2 : 1024;
+		newnames = (unsigned __int64*)calloc(newsize, sizeof(unsigned __int64));
+		if (newnames)
+		{
+			for (i = 0; i < trace_namesize; i++)
+			{
+				if (!trace_names[i]) continue;
+				j = trace_bin_hash(trace_names[i]) & (newsize - 1);
+				while (newnames[j]) j = (j + 1) & (newsize - 1);
+				newnames[j] = trace_names[i];
+			}
+			if (trace_names) free(trace_names);
+			trace_names = newnames;
+			trace_namesize = newsize;
+		}
+	}
+	// Without a table every occurrence writes its name record, duplicates are harmless
+	if (trace_names && (trace_namecount < trace_namesize - 1))
+	{
+		i = trace_bin_hash(address) & (trace_namesize - 1);
+		while (trace_names[i])
+		{
+			if (trace_names[i] == address) return;
+			i = (i + 1) & (trace_namesize - 1);
+		}
+		trace_names[i] = address;
+		trace_namecount++;
 	}
-	WriteFile(outfile,str,strlen(str),&byteswritten,NULL);
+	len = strlen(name) + 1;
+	rec.rec.type = TRACEBIN_NAME;
+	rec.rec.size = sizeof(TRACEBIN_NAMEREC) + TRACEBIN_ALIGN(len);
+	rec.address = address;
+	trace_bin_write(&rec, sizeof(TRACEBIN_NAMEREC));
+	trace_bin_write(name, len);
+	trace_bin_write(zero, TRACEBIN_ALIGN(len) - len);
 }
 
-static void trace_decode_d3dtexturestagestate(DWORD ts)
+/**
+  * Moves everything recorded by all threads to the trace file.
+  */
+static void trace_bin_flush()
 {
-	DWORD byteswritten;
-	char str[64];
-	switch(ts)
+	TraceRing *ring;
+	TRACEBIN_CHUNKREC chunk;
+	TRACEBIN_EVENT *event;
+	DWORD head, tail, pos, offset, length;
+	EnterCriticalSection(&trace_flush_cs);
+	for (ring = trace_rings; ring; ring = ring->next)
 	{
-	case D3DTSS_COLOROP:
-		strcpy(str,"D3DTSS_COLOROP");
-		break;
-	case D3DTSS_COLORARG1:
-		strcpy(str,"D3DTSS_COLORARG1");
-		break;
-	case D3DTSS_COLORARG2:
-		strcpy(str,"D3DTSS_COLORARG2");
-		break;
-	case D3DTSS_ALPHAOP:
-		strcpy(str,"D3DTSS_ALPHAOP");
-		break;
-	case D3DTSS_ALPHAARG1:
-		strcpy(str,"D3DTSS_ALPHAARG1");
-		break;
-	case D3DTSS_ALPHAARG2:
-		strcpy(str,"D3DTSS_ALPHAARG2");
-		break;
-	case D3DTSS_BUMPENVMAT00:
-		strcpy(str,"D3DTSS_BUMPENVMAT00");
-		break;
-	case D3DTSS_BUMPENVMAT01:
-		strcpy(str,"D3DTSS_BUMPENVMAT01");
-		break;
-	case D3DTSS_BUMPENVMAT10:
-		strcpy(str,"D3DTSS_BUMPENVMAT10");
-		break;
-	case D3DTSS_BUMPENVMAT11:
-		strcpy(str,"D3DTSS_BUMPENVMAT11");
-		break;
-	case D3DTSS_TEXCOORDINDEX:
-		strcpy(str,"D3DTSS_TEXCOORDINDEX");
-		break;
-	case D3DTSS_ADDRESS:
-		strcpy(str,"D3DTSS_ADDRESS");
-		break;
-	case D3DTSS_ADDRESSU:
-		strcpy(str,"D3DTSS_ADDRESSU");
-		break;
-	case D3DTSS_ADDRESSV:
-		strcpy(str,"D3DTSS_ADDRESSV");
-		break;
-	case D3DTSS_BORDERCOLOR:
-		strcpy(str,"D3DTSS_BORDERCOLOR");
-		break;
-	case D3DTSS_MAGFILTER:
-		strcpy(str,"D3DTSS_MAGFILTER");
-		break;
-	case D3DTSS_MINFILTER:
-		strcpy(str,"D3DTSS_MINFILTER");
-		break;
-	case D3DTSS_MIPFILTER:
-		strcpy(str,"D3DTSS_MIPFILTER");
-		break;
-	case D3DTSS_MIPMAPLODBIAS:
-		strcpy(str,"D3DTSS_MIPMAPLODBIAS");
-		break;
-	case D3DTSS_MAXMIPLEVEL:
-		strcpy(str,"D3DTSS_MAXMIPLEVEL");
-		break;
-	case D3DTSS_MAXANISOTROPY:
-		strcpy(str,"D3DTSS_MAXANISOTROPY");
-		break;
-	case D3DTSS_BUMPENVLSCALE:
-		strcpy(str,"D3DTSS_BUMPENVLSCALE");
-		break;
-	case D3DTSS_BUMPENVLOFFSET:
-		strcpy(str,"D3DTSS_BUMPENVLOFFSET");
-		break;
-	case D3DTSS_TEXTURETRANSFORMFLAGS:
-		strcpy(str,"D3DTSS_TEXTURETRANSFORMFLAGS");
-		break;
-	default:
-		sprintf(str,"(D3DTEXTURESTAGESTATETYPE)%u",ts);
-		break;
+		head = (DWORD)ring->head;
+		tail = (DWORD)ring->tail;
+		chunk.dropped = (DWORD)InterlockedExchange(&ring->dropped, 0);
+		if ((head == tail) && !chunk.dropped) continue;
+		// Names go first so they are known before the events using them
+		for (pos = tail; pos != head; pos += event->rec.size)
+		{
+			event = (TRACEBIN_EVENT*)(ring->data + (pos & (TRACE_RINGSIZE - 1)));
+			if ((event->rec.type == TRACEBIN_ENTER) || (event->rec.type == TRACEBIN_EXIT)
+				|| (event->rec.type == TRACEBIN_VAR))
+			{
+				trace_bin_name((const char*)(ULONG_PTR)event->function);
+				trace_bin_name((const char*)(ULONG_PTR)event->var);
+			}
+		}
+		chunk.rec.type = TRACEBIN_CHUNK;
+		chunk.rec.size = sizeof(TRACEBIN_CHUNKREC) + (head - tail);
+		chunk.threadid = ring->threadid;
+		trace_bin_write(&chunk, sizeof(TRACEBIN_CHUNKREC));
+		offset = tail & (TRACE_RINGSIZE - 1);
+		length = head - tail;
+		if (offset + length > TRACE_RINGSIZE)
+		{
+			trace_bin_write(ring->data + offset, TRACE_RINGSIZE - offset);
+			length -= TRACE_RINGSIZE - offset;
+			offset = 0;
+		}
+		trace_bin_write(ring->data + offset, length);
+		InterlockedExchange(&ring->tail, (LONG)head);
 	}
-	WriteFile(outfile,str,strlen(str),&byteswritten,NULL);
+	trace_bin_writeout();
+	LeaveCriticalSection(&trace_flush_cs);
 }
 
-static void trace_decode_d3dtransformstate(DWORD ts)
+static DWORD WINAPI trace_bin_thread(LPVOID module)
 {
-	DWORD byteswritten;
-	char str[64];
-	switch(ts)
+	while (!trace_stop)
 	{
-	case D3DTRANSFORMSTATE_WORLD:
-		strcpy(str,"D3DTRANSFORMSTATE_WORLD");
-		break;
-	case D3DTRANSFORMSTATE_VIEW:
-		strcpy(str,"D3DTRANSFORMSTATE_VIEW");
-		break;
-	case D3DTRANSFORMSTATE_PROJECTION:
-		strcpy(str,"D3DTRANSFORMSTATE_PROJECTION");
-		break;
-	case D3DTRANSFORMSTATE_WORLD1:
-		strcpy(str,"D3DTRANSFORMSTATE_WORLD1");
-		break;
-	case D3DTRANSFORMSTATE_WORLD2:
-		strcpy(str,"D3DTRANSFORMSTATE_WORLD2");
-		break;
-	case D3DTRANSFORMSTATE_WORLD3:
-		strcpy(str,"D3DTRANSFORMSTATE_WORLD3");
-		break;
-	case D3DTRANSFORMSTATE_TEXTURE0:
-		strcpy(str,"D3DTRANSFORMSTATE_TEXTURE0");
-		break;
-	case D3DTRANSFORMSTATE_TEXTURE1:
-		strcpy(str,"D3DTRANSFORMSTATE_TEXTURE1");
-		break;
-	case D3DTRANSFORMSTATE_TEXTURE2:
-		strcpy(str,"D3DTRANSFORMSTATE_TEXTURE2");
-		break;
-	case D3DTRANSFORMSTATE_TEXTURE3:
-		strcpy(str,"D3DTRANSFORMSTATE_TEXTURE3");
-		break;
-	case D3DTRANSFORMSTATE_TEXTURE4:
-		strcpy(str,"D3DTRANSFORMSTATE_TEXTURE4");
-		break;
-	case D3DTRANSFORMSTATE_TEXTURE5:
-		strcpy(str,"D3DTRANSFORMSTATE_TEXTURE5");
-		break;
-	case D3DTRANSFORMSTATE_TEXTURE6:
-		strcpy(str,"D3DTRANSFORMSTATE_TEXTURE6");
-		break;
-	case D3DTRANSFORMSTATE_TEXTURE7:
-		strcpy(str,"D3DTRANSFORMSTATE_TEXTURE7");
-		break;
-	default:
-		sprintf(str,"(D3DTRANSFORMSTATETYPE)%u",ts);
-		break;
+		WaitForSingleObject(trace_wake, TRACE_FLUSHINTERVAL);
+		if (!trace_stop) trace_bin_flush();
 	}
-	WriteFile(outfile,str,strlen(str),&byteswritten,NULL);
+	// The thread holds a reference to the DLL so it cannot be unloaded under it
+	FreeLibraryAndExitThread((HMODULE)module, 0);
+	return 0;
 }
 
-static void trace_decode_d3dlightstate(DWORD ls)
+static BOOL trace_bin_init()
 {
+	TRACEBIN_HEADER header;
+	LARGE_INTEGER frequency;
+	MEMORY_BASIC_INFORMATION mbi;
+	TCHAR path[MAX_PATH + 1];
+	HMODULE module;
 	DWORD byteswritten;
-	char str[64];
-	switch(ls)
+	InitializeCriticalSection(&trace_flush_cs);
+	trace_tls = TlsAlloc();
+	if (trace_tls == TLS_OUT_OF_INDEXES) return FALSE;
+	trace_out = (BYTE*)malloc(TRACE_OUTSIZE);
+	if (!trace_out) return FALSE;
+	trace_wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (!trace_wake) return FALSE;
+	memcpy(header.magic, TRACEBIN_MAGIC, 8);
+	header.version = TRACEBIN_VERSION;
+	header.pointersize = sizeof(void*);
+	QueryPerformanceFrequency(&frequency);
+	header.frequency = frequency.QuadPart;
+	if (!WriteFile(outfile, &header, sizeof(TRACEBIN_HEADER), &byteswritten, NULL)) return FALSE;
+	if (!VirtualQuery(trace_bin_init, &mbi, sizeof(MEMORY_BASIC_INFORMATION))) return FALSE;
+	if (!GetModuleFileName((HMODULE)mbi.AllocationBase, path, MAX_PATH)) return FALSE;
+	module = LoadLibrary(path);
+	if (!module) return FALSE;
+	trace_binary = TRUE;
+	trace_thread = CreateThread(NULL, 0, trace_bin_thread, module, 0, NULL);
+	if (!trace_thread)
+	{
+		FreeLibrary(module);
+		trace_binary = FALSE;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+  * Stops binary tracing and writes out what is left in the buffers.
+  * @param message
+  *  Text to append to the trace, or NULL
+  * @param wait
+  *  TRUE to wait for the writer thread to finish, FALSE if called from DllMain
+  *  where the thread may already be gone
+  */
+static void trace_bin_end(const char *message, BOOL wait)
+{
+	struct
+	{
+		TRACEBIN_CHUNKREC chunk;
+		TRACEBIN_EVENT event;
+	} rec;
+	static const BYTE zero[8] = { 0,0,0,0,0,0,0,0 };
+	LARGE_INTEGER time;
+	DWORD len;
+	trace_stop = TRUE;
+	SetEvent(trace_wake);
+	if (wait) WaitForSingleObject(trace_thread, INFINITE);
+	if (TryEnterCriticalSection(&trace_flush_cs))
+	{
+		trace_bin_flush();
+		if (message)
+		{
+			len = strlen(message) + 1;
+			QueryPerformanceCounter(&time);
+			ZeroMemory(&rec, sizeof(rec));
+			rec.event.rec.type = TRACEBIN_STRING;
+			rec.event.rec.size = sizeof(TRACEBIN_EVENT) + TRACEBIN_ALIGN(len);
+			rec.event.time = time.QuadPart;
+			rec.chunk.rec.type = TRACEBIN_CHUNK;
+			rec.chunk.rec.size = sizeof(TRACEBIN_CHUNKREC) + rec.event.rec.size;
+			rec.chunk.threadid = GetCurrentThreadId();
+			trace_bin_write(&rec, sizeof(rec));
+			trace_bin_write(message, len);
+			trace_bin_write(zero, TRACEBIN_ALIGN(len) - len);
+			trace_bin_writeout();
+		}
+		LeaveCriticalSection(&trace_flush_cs);
+	}
+	CloseHandle(trace_thread);
+	trace_thread = NULL;
+}
+
+static TraceRing *trace_bin_ring()
+{
+	TraceRing *ring = (TraceRing*)TlsGetValue(trace_tls);
+	if (ring) return ring;
+	EnterCriticalSection(&trace_cs);
+	// Take over the buffer of an exited thread once the writer has emptied it
+	for (ring = trace_rings; ring; ring = ring->next)
+	{
+		if (ring->released && (ring->head == ring->tail) && !ring->dropped)
+		{
+			ring->threadid = GetCurrentThreadId();
+			InterlockedExchange(&ring->released, FALSE);
+			break;
+		}
+	}
+	if (!ring)
+	{
+		ring = (TraceRing*)malloc(sizeof(TraceRing));
+		if (!ring)
+		{
+			LeaveCriticalSection(&trace_cs);
+			return NULL;
+		}
+		ring->head = ring->tail = ring->dropped = ring->released = 0;
+		ring->threadid = GetCurrentThreadId();
+		ring->next = trace_rings;
+		trace_rings = ring;
+	}
+	LeaveCriticalSection(&trace_cs);
+	TlsSetValue(trace_tls, ring);
+	return ring;
+}
+
+/**
+  * Reserves contiguous space for a record in the calling thread's buffer.
+  * @param ring
+  *  Buffer of the calling thread
+  * @param size
+  *  Size of the record, a multiple of 8 bytes
+  * @param head
+  *  Receives the value to pass to trace_bin_commit once the record is filled
+  * @return
+  *  Pointer to the record, or NULL if the buffer is full and the event is dropped
+  */
+static BYTE *trace_bin_reserve(TraceRing *ring, DWORD size, DWORD *head)
+{
+	DWORD start = (DWORD)ring->head;
+	DWORD offset = start & (TRACE_RINGSIZE - 1);
+	DWORD skip = 0;
+	TRACEBIN_RECORD *pad;
+	if (TRACE_RINGSIZE - offset < size) skip = TRACE_RINGSIZE - offset;
+	if ((start - (DWORD)ring->tail) + skip + size > TRACE_RINGSIZE)
+	{
+		InterlockedIncrement(&ring->dropped);
+		return NULL;
+	}
+	if (skip)
+	{
+		pad = (TRACEBIN_RECORD*)(ring->data + offset);
+		pad->type = TRACEBIN_PAD;
+		pad->size = skip;
+		offset = 0;
+	}
+	*head = start + skip + size;
+	return ring->data + offset;
+}
+
+static void trace_bin_commit(TraceRing *ring, DWORD head)
+{
+	DWORD tail = (DWORD)ring->tail;
+	DWORD before = (DWORD)ring->head - tail;
+	InterlockedExchange(&ring->head, (LONG)head);
+	// Wake the writer early when the buffer passes half full
+	if ((before < TRACE_RINGSIZE / 2) && (head - tail >= TRACE_RINGSIZE / 2)) SetEvent(trace_wake);
+}
+
+static TraceRing *trace_bin_begin()
+{
+	if (trace_end)
+	{
+		EnterCriticalSection(&trace_cs);
+		if (!trace_fail) end_trace();
+		LeaveCriticalSection(&trace_cs);
+		return NULL;
+	}
+	return trace_bin_ring();
+}
+
+static DWORD trace_bin_strsize(const void *str, DWORD charsize)
+{
+	DWORD len;
+	for (len = 0; len < (TRACE_MAXCOPY / charsize) - 1; len++)
 	{
-	case D3DLIGHTSTATE_MATERIAL:
-		strcpy(str,"D3DLIGHTSTATE_MATERIAL");
-		break;
-	case D3DLIGHTSTATE_AMBIENT:
-		strcpy(str,"D3DLIGHTSTATE_AMBIENT");
-		break;
-	case D3DLIGHTSTATE_COLORMODEL:
-		strcpy(str,"D3DLIGHTSTATE_COLORMODEL");
-		break;
-	case D3DLIGHTSTATE_FOGMODE:
-		strcpy(str,"D3DLIGHTSTATE_FOGMODE");
-		break;
-	case D3DLIGHTSTATE_FOGSTART:
-		strcpy(str,"D3DLIGHTSTATE_FOGSTART");
-		break;
-	case D3DLIGHTSTATE_FOGEND:
-		strcpy(str,"D3DLIGHTSTATE_FOGEND");
-		break;
-	case D3DLIGHTSTATE_FOGDENSITY:
-		strcpy(str,"D3DLIGHTSTATE_FOGDENSITY");
-		break;
-	case D3DLIGHTSTATE_COLORVERTEX:
-		strcpy(str,"D3DLIGHTSTATE_COLORVERTEX");
-		break;
+		if (charsize == 1)
+		{
+			if (!((const char*)str)[len]) break;
+		}
+		else if (!((const WCHAR*)str)[len]) break;
+	}
+	return (len + 1) * charsize;
+}
+
+// Bytes copied from the data an argument points to
+static DWORD trace_bin_argsize(int type, void *arg)
+{
+	if (!arg) return 0;
+	switch (type)
+	{
+	case 10:
+		return sizeof(unsigned __int64);
+	case 15:
+		return trace_bin_strsize(arg, 1);
+	case 16:
+		return trace_bin_strsize(arg, sizeof(WCHAR));
+	case 17:
+		return trace_bin_strsize(arg, sizeof(TCHAR));
+	case 24:
+		if ((arg == (void*)DDCREATE_HARDWAREONLY) || (arg == (void*)DDCREATE_EMULATIONONLY)) return 0;
+		return sizeof(GUID);
+	case 25:
+		return sizeof(SIZE);
+	case 26:
+		return sizeof(RECT);
 	default:
-		sprintf(str,"(D3DTRANSFORMSTATETYPE)%u",ls);
-		break;
+		return 0;
 	}
-	WriteFile(outfile,str,strlen(str),&byteswritten,NULL);
 }
 
-static void trace_decode_guid(GUID *guid)
+static void trace_bin_copyarg(BYTE *dest, int type, void *arg, DWORD size)
 {
-	DWORD byteswritten;
-	char str[64];
-	if(!memcmp(guid,&CLSID_DirectDraw,sizeof(GUID))) strcpy(str,"CLSID_DirectDraw");
-	else if(!memcmp(guid,&CLSID_DirectDraw7,sizeof(GUID))) strcpy(str,"CLSID_DirectDraw7");
-	else if(!memcmp(guid,&CLSID_DirectDrawClipper,sizeof(GUID))) strcpy(str,"CLSID_DirectDrawClipper");
-	else if(!memcmp(guid,&IID_IDirectDraw,sizeof(GUID))) strcpy(str,"IID_IDirectDraw");
-	else if(!memcmp(guid,&IID_IDirectDraw2,sizeof(GUID))) strcpy(str,"IID_IDirectDraw2");
-	else if(!memcmp(guid,&IID_IDirectDraw4,sizeof(GUID))) strcpy(str,"IID_IDirectDraw4");
-	else if(!memcmp(guid,&IID_IDirectDraw7,sizeof(GUID))) strcpy(str,"IID_IDirectDraw7");
-	else if(!memcmp(guid,&IID_IDirectDrawSurface,sizeof(GUID))) strcpy(str,"IID_IDirectDrawSurface");
-	else if(!memcmp(guid,&IID_IDirectDrawSurface2,sizeof(GUID))) strcpy(str,"IID_IDirectDrawSurface2");
-	else if(!memcmp(guid,&IID_IDirectDrawSurface3,sizeof(GUID))) strcpy(str,"IID_IDirectDrawSurface3");
-	else if(!memcmp(guid,&IID_IDirectDrawSurface4,sizeof(GUID))) strcpy(str,"IID_IDirectDrawSurface4");
-	else if(!memcmp(guid,&IID_IDirectDrawSurface7,sizeof(GUID))) strcpy(str,"IID_IDirectDrawSurface7");
-	else if(!memcmp(guid,&IID_IDirectDrawPalette,sizeof(GUID))) strcpy(str,"IID_IDirectDrawPalette");
-	else if(!memcmp(guid,&IID_IDirectDrawClipper,sizeof(GUID))) strcpy(str,"IID_IDirectDrawClipper");
-	else if(!memcmp(guid,&IID_IDirectDrawColorControl,sizeof(GUID))) strcpy(str,"IID_IDirectDrawColorControl");
-	else if(!memcmp(guid,&IID_IDirectDrawGammaControl,sizeof(GUID))) strcpy(str,"IID_IDirectDrawGammaControl");
-	else if(!memcmp(guid,&IID_IDirect3D,sizeof(GUID))) strcpy(str,"IID_IDirect3D");
-	else if(!memcmp(guid,&IID_IDirect3D2,sizeof(GUID))) strcpy(str,"IID_IDirect3D2");
-	else if(!memcmp(guid,&IID_IDirect3D3,sizeof(GUID))) strcpy(str,"IID_IDirect3D3");
-	else if(!memcmp(guid,&IID_IDirect3D7,sizeof(GUID))) strcpy(str,"IID_IDirect3D7");
-	else
+	DWORD charsize = 0;
+	if (type == 15) charsize = 1;
+	else if (type == 16) charsize = sizeof(WCHAR);
+	else if (type == 17) charsize = sizeof(TCHAR);
+	memcpy(dest, arg, size - charsize);
+	ZeroMemory(dest + size - charsize, TRACEBIN_ALIGN(size) - size + charsize);
+}
+
+static void trace_bin_event(DWORD kind, const char *function, const char *var, int count,
+	const int *types, void *const *args)
+{
+	TraceRing *ring;
+	TRACEBIN_EVENT *event;
+	TRACEBIN_ARG *out;
+	DWORD sizes[TRACE_MAXARGS];
+	DWORD size = sizeof(TRACEBIN_EVENT);
+	DWORD head;
+	LARGE_INTEGER time;
+	BYTE *ptr;
+	int i;
+	QueryPerformanceCounter(&time);
+	ring = trace_bin_begin();
+	if (!ring) return;
+	for (i = 0; i < count; i++)
 	{
-		OLECHAR guidstr[41] = {0}; 
-		StringFromGUID2(guid,guidstr,40);
-		WideCharToMultiByte(CP_UTF8,0,guidstr,-1,str,64,NULL,NULL);
+		sizes[i] = trace_bin_argsize(types[i], args[i]);
+		size += sizeof(TRACEBIN_ARG) + TRACEBIN_ALIGN(sizes[i]);
 	}
-	WriteFile(outfile,str,strlen(str),&byteswritten,NULL);
+	ptr = trace_bin_reserve(ring, size, &head);
+	if (!ptr) return;
+	event = (TRACEBIN_EVENT*)ptr;
+	event->rec.type = kind;
+	event->rec.size = size;
+	event->time = time.QuadPart;
+	event->function = (ULONG_PTR)function;
+	event->var = (ULONG_PTR)var;
+	event->count = count;
+	event->reserved = 0;
+	ptr += sizeof(TRACEBIN_EVENT);
+	for (i = 0; i < count; i++)
+	{
+		out = (TRACEBIN_ARG*)ptr;
+		out->type = types[i];
+		out->size = sizes[i];
+		out->value = (ULONG_PTR)args[i];
+		ptr += sizeof(TRACEBIN_ARG);
+		if (sizes[i]) trace_bin_copyarg(ptr, types[i], args[i], sizes[i]);
+		ptr += TRACEBIN_ALIGN(sizes[i]);
+	}
+	trace_bin_commit(ring, head);
 }
-static void trace_decode_size(SIZE *size)
+
+static void trace_bin_string(const char *str)
 {
-	DWORD byteswritten;
-	char str[64];
-	sprintf(str,"{%d,%d}",size->cx,size->cy);
-	WriteFile(outfile,str,strlen(str),&byteswritten,NULL);
+	TraceRing *ring;
+	TRACEBIN_EVENT *event;
+	DWORD len = strlen(str);
+	DWORD size;
+	DWORD head;
+	LARGE_INTEGER time;
+	QueryPerformanceCounter(&time);
+	ring = trace_bin_begin();
+	if (!ring) return;
+	if (len > TRACE_MAXSTRING - 1) len = TRACE_MAXSTRING - 1;
+	size = sizeof(TRACEBIN_EVENT) + TRACEBIN_ALIGN(len + 1);
+	event = (TRACEBIN_EVENT*)trace_bin_reserve(ring, size, &head);
+	if (!event) return;
+	ZeroMemory(event, size);
+	event->rec.type = TRACEBIN_STRING;
+	event->rec.size = size;
+	event->time = time.QuadPart;
+	memcpy(event + 1, str, len);
+	trace_bin_commit(ring, head);
 }
-static void trace_decode_rect(RECT *rect)
+
+/**
+  * Writes out the binary trace when the DLL is unloaded.  Other threads have
+  * already been terminated if the process is exiting.
+  */
+/**
+  * Releases the binary trace buffer of the calling thread so a new thread can
+  * reuse it, called from DllMain when a thread exits.
+  */
+void trace_thread_detach()
 {
-	DWORD byteswritten;
-	char str[64];
-	sprintf(str,"{%d,%d,%d,%d}",rect->left,rect->top,rect->right,rect->bottom);
-	WriteFile(outfile,str,strlen(str),&byteswritten,NULL);
+	TraceRing *ring;
+	if (!trace_binary || (trace_tls == TLS_OUT_OF_INDEXES)) return;
+	ring = (TraceRing*)TlsGetValue(trace_tls);
+	if (!ring) return;
+	TlsSetValue(trace_tls, NULL);
+	InterlockedExchange(&ring->released, TRUE);
+}
+
+void trace_shutdown()
+{
+	if (!trace_binary || trace_fail) return;
+	trace_fail = TRUE;
+	trace_bin_end(NULL, FALSE);
+	CloseHandle(outfile);
+	outfile = INVALID_HANDLE_VALUE;
 }
+
 static void init_trace()
 {
 	TCHAR path[MAX_PATH+1];
@@ -844,210 +520,34 @@ static void init_trace()
 	GetModuleFileName(NULL,path,MAX_PATH);
 	path_truncate = _tcsrchr(path,_T('\\'));
 	if(path_truncate) *(path_truncate+1) = 0;
-	_tcscat(path,_T("dxgl.log"));
+	if (dxglcfg.DebugTraceBinary) _tcscat(path,_T("dxgl.trc"));
+	else _tcscat(path,_T("dxgl.log"));
 	outfile = CreateFile(path,GENERIC_WRITE,FILE_SHARE_READ,NULL,CREATE_ALWAYS,FILE_ATTRIBUTE_NORMAL,NULL);
 	if(outfile == INVALID_HANDLE_VALUE)
 	{
 		trace_fail = TRUE;
 		return;
 	}
-	trace_ready = TRUE;
-}
-static void trace_decode_arg(int type, void *arg)
-{
-	DWORD byteswritten;
-	char str[128];
-	char *mbcsbuffer;
-	int buffersize;
-	str[0] = 0;
-	switch(type)
+	if (dxglcfg.DebugTraceBinary && !trace_bin_init())
 	{
-	case -1: // C++ constructor/destructor
-		// No return type in a constructor or destructor.
-		break;
-	case 0: // void
-		WriteFile(outfile,"void",4,&byteswritten,NULL);
-		break;
-	case 1: // 8-bit signed
-		sprintf(str,"%d",(signed char)arg);
-		WriteFile(outfile,str,strlen(str),&byteswritten,NULL);
-		break;
-	case 2: // 8-bit unsigned
-		sprintf(str,"%u",(unsigned char)arg);
-		WriteFile(outfile,str,strlen(str),&byteswritten,NULL);
-		break;
-	case 3: // 8-bit hex
-		sprintf(str,"0x%02X",(unsigned char)arg);
-		WriteFile(outfile,str,strlen(str),&byteswritten,NULL);
-		break;
-	case 4: // 16-bit signed
-		sprintf(str,"%d",(signed short)arg);
-		WriteFile(outfile,str,strlen(str),&byteswritten,NULL);
-		break;
-	case 5: // 16-bit unsigned
-		sprintf(str,"%u",(unsigned short)arg);
-		WriteFile(outfile,str,strlen(str),&byteswritten,NULL);
-		break;
-	case 6: // 16-bit hex
-		sprintf(str,"0x%04X",(unsigned short)arg);
-		WriteFile(outfile,str,strlen(str),&byteswritten,NULL);
-		break;
-	case 7: // 32-bit signed
-		sprintf(str,"%d",(signed long)arg);
-		WriteFile(outfile,str,strlen(str),&byteswritten,NULL);
-		break;
-	case 8: // 32-bit unsigned
-		sprintf(str,"%u",(unsigned long)arg);
-		WriteFile(outfile,str,strlen(str),&byteswritten,NULL);
-		break;
-	case 9: // 32-bit hex
-		sprintf(str,"0x%08X",(unsigned long)arg);
-		WriteFile(outfile,str,strlen(str),&byteswritten,NULL);
-		break;
-	case 10: // pointer to 64-bit hex
-		sprintf(str,"0x%016I64X",(unsigned __int64)*(unsigned __int64*)arg);
-		WriteFile(outfile,str,strlen(str),&byteswritten,NULL);
-		break;
-	case 11: // native signed
-		sprintf(str,"%d",(signed int)arg);
-		WriteFile(outfile,str,strlen(str),&byteswritten,NULL);
-		break;
-	case 12: // native unsigned
-		sprintf(str,"%u",(unsigned int)arg);
-		WriteFile(outfile,str,strlen(str),&byteswritten,NULL);
-		break;
-	case 13: // native hex
-		sprintf(str,"0x%08X",(unsigned int)arg);
-		WriteFile(outfile,str,strlen(str),&byteswritten,NULL);
-		break;
-	case 14: // generic pointer
-		if(!arg) WriteFile(outfile,"NULL",4,&byteswritten,NULL);
-		else
-		{
-#ifdef _M_X64
-			sprintf(str,"0x%016I64X",arg);
-			WriteFile(outfile,str,strlen(str),&byteswritten,NULL);
-#else
-			sprintf(str,"0x%08X",arg);
-			WriteFile(outfile,str,strlen(str),&byteswritten,NULL);
-#endif
-		}
-		break;
-	case 15: // ASCII string
-		if(!arg) WriteFile(outfile,"NULL",4,&byteswritten,NULL);
-		else
-		{
-			WriteFile(outfile,"\"",1,&byteswritten,NULL);
-			WriteFile(outfile,arg,strlen((char*)arg),&byteswritten,NULL);
-			WriteFile(outfile,"\"",1,&byteswritten,NULL);
-		}
-		break;
-	case 16: // Unicode string
-		if(!arg) WriteFile(outfile,"NULL",4,&byteswritten,NULL);
-		else
-		{
-			WriteFile(outfile,"L\"",2,&byteswritten,NULL);
-			buffersize = WideCharToMultiByte(CP_UTF8,0,(wchar_t*)arg,-1,NULL,0,NULL,NULL);
-			mbcsbuffer = (char*)malloc(buffersize);
-			if(!mbcsbuffer) WriteFile(outfile,"OUT OF MEMORY",13,&byteswritten,NULL);
-			else
-			{
-				WideCharToMultiByte(CP_UTF8,0,(wchar_t*)arg,-1,mbcsbuffer,buffersize,NULL,NULL);
-				WriteFile(outfile,mbcsbuffer,strlen(mbcsbuffer),&byteswritten,NULL);
-				free(mbcsbuffer);
-			}
-			WriteFile(outfile,"\"",1,&byteswritten,NULL);
-		}
-		break;
-	case 17: // TCHAR string
-		if(!arg) WriteFile(outfile,"NULL",4,&byteswritten,NULL);
-#ifdef _UNICODE
-		else
-		{
-			WriteFile(outfile,"_T(\"",1,&byteswritten,NULL);
-			buffersize = WideCharToMultiByte(CP_UTF8,0,(wchar_t*)arg,-1,NULL,0,NULL,NULL);
-			mbcsbuffer = (char*)malloc(buffersize);
-			if(!mbcsbuffer) WriteFile(outfile,"OUT OF MEMORY",13,&byteswritten,NULL);
-			else
-			{
-				WideCharToMultiByte(CP_UTF8,0,(wchar_t*)arg,-1,mbcsbuffer,buffersize,NULL,NULL);
-				WriteFile(outfile,mbcsbuffer,strlen(mbcsbuffer),&byteswritten,NULL);
-				free(mbcsbuffer);
-			}
-			WriteFile(outfile,"\")",1,&byteswritten,NULL);
-		}
-#else
-		else
-		{
-			WriteFile(outfile,"_T(\"",1,&byteswritten,NULL);
-			WriteFile(outfile,arg,strlen((char*)arg),&byteswritten,NULL);
-			WriteFile(outfile,"\")",1,&byteswritten,NULL);
-		}
-#endif
-		break;
-	case 18: // ASCII character
-		if(!(unsigned char)arg) WriteFile(outfile,"\'\\0\'",4,&byteswritten,NULL);
-		else
-		{
-			str[0] = str[2] = '\'';
-			str[1] = (unsigned char)arg;
-			str[3] = 0;
-			WriteFile(outfile,str,3,&byteswritten,NULL);
-		}
-		break;
-	case 19: // pointer to 32 bit float
-		sprintf(str,"%f",arg);
-		WriteFile(outfile,str,strlen(str),&byteswritten,NULL);
-		break;
-	case 20: // pointer to 64 bit float
-		sprintf(str,"%lf",arg);
-		WriteFile(outfile,str,strlen(str),&byteswritten,NULL);
-		break;
-	case 21: // c++ bool
-		if((unsigned char)arg) WriteFile(outfile,"true",4,&byteswritten,NULL);
-		else WriteFile(outfile,"false",5,&byteswritten,NULL);
-		break;
-	case 22: // c++ bool
-		if(arg) WriteFile(outfile,"TRUE",4,&byteswritten,NULL);
-		else WriteFile(outfile,"FALSE",5,&byteswritten,NULL);
-		break;
-	case 23: // HRESULT
-		trace_decode_hresult((HRESULT)arg);
-		break;
-	case 24: // GUID pointer
-		if(!arg) WriteFile(outfile,"NULL",4,&byteswritten,NULL);
-		else if(arg == (void*)DDCREATE_HARDWAREONLY) WriteFile(outfile,"DDCREATE_HARDWAREONLY",21,&byteswritten,NULL);
-		else if(arg == (void*)DDCREATE_EMULATIONONLY) WriteFile(outfile,"DDCREATE_EMULATIONONLY",22,&byteswritten,NULL);
-		else trace_decode_guid((GUID*)arg);
-		break;
-	case 25: // SIZE or POINT pointer
-		if(!arg) WriteFile(outfile,"NULL",4,&byteswritten,NULL);
-		else trace_decode_size((SIZE*)arg);
-		break;
-	case 26: // RECT pointer
-		if(!arg) WriteFile(outfile,"NULL",4,&byteswritten,NULL);
-		else trace_decode_rect((RECT*)arg);
-		break;
-	case 27: // D3DRENDERSTATETYPE
-		trace_decode_d3drenderstate((DWORD)arg);
-		break;
-	case 28: // D3DTEXTURESTAGESTATETYPE
-		trace_decode_d3dtexturestagestate((DWORD)arg);
-		break;
-	case 29: // D3DTRANSFORMSTATETYPE
-		trace_decode_d3dtransformstate((DWORD)arg);
-		break;
-	case 30: // D3DLIGHTSTATETYPE
-		trace_decode_d3dlightstate((DWORD)arg);
-		break;
-	default:
-		WriteFile(outfile,"Unknown type",12,&byteswritten,NULL);
-		break;
+		CloseHandle(outfile);
+		outfile = INVALID_HANDLE_VALUE;
+		trace_fail = TRUE;
+		return;
 	}
+	trace_ready = TRUE;
 }
 static void end_trace()
 {
 	DWORD byteswritten;
+	if (trace_binary)
+	{
+		trace_fail = TRUE;
+		trace_bin_end("Trace cancelled by CTRL+Break\r\n",TRUE);
+		CloseHandle(outfile);
+		outfile = INVALID_HANDLE_VALUE;
+		return;
+	}
 	WriteFile(outfile,"Trace cancelled by CTRL+Break\r\n",31,&byteswritten,NULL);
 	CloseHandle(outfile);
 	outfile = INVALID_HANDLE_VALUE;
@@ -1059,8 +559,23 @@ void trace_enter(const char *function, int paramcount, ...)
 	DWORD byteswritten;
 	unsigned int i;
 	int argtype;
+	int types[TRACE_MAXARGS];
+	void *values[TRACE_MAXARGS];
 	if (trace_fail) return;
 	if(!trace_ready) init_trace();
+	if (trace_binary)
+	{
+		if (paramcount > TRACE_MAXARGS) paramcount = TRACE_MAXARGS;
+		va_start(args,paramcount);
+		for(i = 0; i < (unsigned)paramcount; i++)
+		{
+			types[i] = va_arg(args,int);
+			values[i] = va_arg(args,void*);
+		}
+		va_end(args);
+		trace_bin_event(TRACEBIN_ENTER,function,NULL,paramcount,types,values);
+		return;
+	}
 	EnterCriticalSection(&trace_cs);
 	if(trace_end)
 	{
@@ -1077,7 +592,7 @@ void trace_enter(const char *function, int paramcount, ...)
 	{
 		if(i != 0) WriteFile(outfile,", ",2,&byteswritten,NULL);
 		argtype = va_arg(args,int);
-		trace_decode_arg(argtype,va_arg(args,void*));
+		trace_decode_arg(outfile,argtype,va_arg(args,void*));
 	}
 	WriteFile(outfile,");\r\n",4,&byteswritten,NULL);
 	trace_depth++;
@@ -1090,6 +605,11 @@ void trace_exit(const char *function, int argtype, void *arg)
 	unsigned int i;
 	if (trace_fail) return;
 	if(!trace_ready) init_trace();
+	if (trace_binary)
+	{
+		trace_bin_event(TRACEBIN_EXIT,function,NULL,1,&argtype,&arg);
+		return;
+	}
 	EnterCriticalSection(&trace_cs);
 	if(trace_end)
 	{
@@ -1102,7 +622,7 @@ void trace_exit(const char *function, int argtype, void *arg)
 		WriteFile(outfile,"    ",4,&byteswritten,NULL);
 	WriteFile(outfile,function,strlen(function),&byteswritten,NULL);
 	WriteFile(outfile," returned ",10,&byteswritten,NULL);
-	trace_decode_arg(argtype,arg);
+	trace_decode_arg(outfile,argtype,arg);
 	WriteFile(outfile,"\r\n",2,&byteswritten,NULL);
 	LeaveCriticalSection(&trace_cs);
 }
@@ -1117,6 +637,11 @@ void trace_var(const char *function, const char *var, int argtype, void *arg)
 	unsigned int i;
 	if (trace_fail) return;
 	if(!trace_ready) init_trace();
+	if (trace_binary)
+	{
+		trace_bin_event(TRACEBIN_VAR,function,var,1,&argtype,&arg);
+		return;
+	}
 	EnterCriticalSection(&trace_cs);
 	if(trace_end)
 	{
@@ -1130,7 +655,7 @@ void trace_var(const char *function, const char *var, int argtype, void *arg)
 	WriteFile(outfile,": ",2,&byteswritten,NULL);
 	WriteFile(outfile,var,strlen(var),&byteswritten,NULL);
 	WriteFile(outfile," set to ",8,&byteswritten,NULL);
-	trace_decode_arg(argtype,arg);
+	trace_decode_arg(outfile,argtype,arg);
 	WriteFile(outfile,"\r\n",2,&byteswritten,NULL);
 	LeaveCriticalSection(&trace_cs);
 }
@@ -1141,6 +666,11 @@ void trace_string(const char *str)
 	unsigned int i;
 	if (trace_fail) return;
 	if (!trace_ready) init_trace();
+	if (trace_binary)
+	{
+		trace_bin_string(str);
+		return;
+	}
 	EnterCriticalSection(&trace_cs);
 	if (trace_end)
 	{
@@ -1154,25 +684,49 @@ void trace_string(const char *str)
 	LeaveCriticalSection(&trace_cs);
 }
 
-void trace_sysinfo()
+static void trace_sysinfo_line(const char *name, const char *value)
 {
 	DWORD byteswritten;
+	char *line;
+	unsigned int i;
+	if (trace_binary)
+	{
+		line = (char*)malloc(strlen(name) + strlen(value) + 3);
+		if (!line) return;
+		strcpy(line,name);
+		strcat(line,value);
+		strcat(line,"\r\n");
+		trace_bin_string(line);
+		free(line);
+		return;
+	}
+	for(i = 0; i < trace_depth-1; i++)
+		WriteFile(outfile,"    ",4,&byteswritten,NULL);
+	WriteFile(outfile,name,strlen(name),&byteswritten,NULL);
+	WriteFile(outfile,value,strlen(value),&byteswritten,NULL);
+	WriteFile(outfile,"\r\n",2,&byteswritten,NULL);
+}
+
+void trace_sysinfo()
+{
 	OSVERSIONINFOA osver;
 	DWORD buildver;
 	char osstring[256];
 	HMODULE hKernel32;
 	BOOL(WINAPI *iswow64)(HANDLE, PBOOL);
 	BOOL is64;
-	unsigned int i;
 	const GLubyte *glstring;
 	if (trace_fail) return;
 	if(!trace_ready) init_trace();
-	EnterCriticalSection(&trace_cs);
-	if(trace_end)
+	if (!trace_binary)
 	{
-		end_trace();
-		LeaveCriticalSection(&trace_cs);
-		return;
+		EnterCriticalSection(&trace_cs);
+		if(trace_end)
+		{
+			end_trace();
+			LeaveCriticalSection(&trace_cs);
+			return;
+		}
 	}
 	osver.dwOSVersionInfoSize = sizeof(OSVERSIONINFOA);
 	GetVersionExA(&osver);
@@ -1198,40 +752,16 @@ void trace_sysinfo()
 		if(is64) strcat(osstring,"64-bit");
 		else strcat(osstring,"32-bit");
 	}
-	strcat(osstring,"\r\n");
-	for(i = 0; i < trace_depth-1; i++)
-		WriteFile(outfile,"    ",4,&byteswritten,NULL);
-	WriteFile(outfile,"Windows version:  ",18,&byteswritten,NULL);
-	WriteFile(outfile,osstring,strlen(osstring),&byteswritten,NULL);
-	for(i = 0; i < trace_depth-1; i++)
-		WriteFile(outfile,"    ",4,&byteswritten,NULL);
-	WriteFile(outfile,"GL_VENDOR:  ",12,&byteswritten,NULL);
+	trace_sysinfo_line("Windows version:  ",osstring);
 	glstring = glGetString(GL_VENDOR);
-	if(glstring) WriteFile(outfile,glstring,strlen((const char*)glstring),&byteswritten,NULL);
-	WriteFile(outfile,"\r\n",2,&byteswritten,NULL);
-	for(i = 0; i < trace_depth-1; i++)
-		WriteFile(outfile,"    ",4,&byteswritten,NULL);
-	WriteFile(outfile,"GL_RENDERER:  ",14,&byteswritten,NULL);
+	trace_sysinfo_line("GL_VENDOR:  ",glstring ? (const char*)glstring : "");
 	glstring = glGetString(GL_RENDERER);
-	if(glstring) WriteFile(outfile,glstring,strlen((const char*)glstring),&byteswritten,NULL);
-	WriteFile(outfile,"\r\n",2,&byteswritten,NULL);
-	for(i = 0; i < trace_depth-1; i++)
-		WriteFile(outfile,"    ",4,&byteswritten,NULL);
-	WriteFile(outfile,"GL_VERSION:  ",13,&byteswritten,NULL);
+	trace_sysinfo_line("GL_RENDERER:  ",glstring ? (const char*)glstring : "");
 	glstring = glGetString(GL_VERSION);
-	if(glstring) WriteFile(outfile,glstring,strlen((const char*)glstring),&byteswritten,NULL);
-	WriteFile(outfile,"\r\n",2,&byteswritten,NULL);
-	for(i = 0; i < trace_depth-1; i++)
-		WriteFile(outfile,"    ",4,&byteswritten,NULL);
-	WriteFile(outfile,"GL_SHADING_LANGUAGE_VERSION:  ",30,&byteswritten,NULL);
+	trace_sysinfo_line("GL_VERSION:  ",glstring ? (const char*)glstring : "");
 	glstring = glGetString(GL_SHADING_LANGUAGE_VERSION);
-	if(glstring) WriteFile(outfile,glstring,strlen((const char*)glstring),&byteswritten,NULL);
-	WriteFile(outfile,"\r\n",2,&byteswritten,NULL);
-	for(i = 0; i < trace_depth-1; i++)
-		WriteFile(outfile,"    ",4,&byteswritten,NULL);
-	WriteFile(outfile,"GL_EXTENSIONS:  ",16,&byteswritten,NULL);
+	trace_sysinfo_line("GL_SHADING_LANGUAGE_VERSION:  ",glstring ? (const char*)glstring : "");
 	glstring = glGetString(GL_EXTENSIONS);
-	if(glstring) WriteFile(outfile,glstring,strlen((const char*)glstring),&byteswritten,NULL);
-	WriteFile(outfile,"\r\n",2,&byteswritten,NULL);
-	LeaveCriticalSection(&trace_cs);
+	trace_sysinfo_line("GL_EXTENSIONS:  ",glstring ? (const char*)glstring : "");
+	if (!trace_binary) LeaveCriticalSection(&trace_cs);
 }
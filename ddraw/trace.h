@@ -36,6 +36,8 @@ void *trace_ret(const char *function, int argtype, void *arg);
 void trace_var(const char *function, const char *var, int argtype, void *arg);
 void trace_string(const char *str);
 void trace_sysinfo();
+void trace_thread_detach();
+void trace_shutdown();
 #define TRACE_RET(type, argtype, arg) if(dxglcfg.DebugTraceLevel >= 3) \
 return (type)trace_ret(__FUNCTION__,argtype,(void*)arg); \
 else return arg;
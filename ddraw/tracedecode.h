@@ -0,0 +1,131 @@
+// DXGL
+// Copyright (C) 2013-2014 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#pragma once
+#ifndef _TRACEDECODE_H
+#define _TRACEDECODE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Data types:
+-1 - C++ constructor/destructor
+0 - void
+1 - 8-bit signed
+2 - 8-bit unsigned
+3 - 8-bit hex
+4 - 16 bit signed
+5 - 16 bit unsigned
+6 - 16 bit hex
+7 - 32 bit signed
+8 - 32 bit unsigned
+9 - 32 bit hex
+10 - pointer to 64 bit hex
+11 - native signed
+12 - native unsigned
+13 - native hex
+14 - generic pointer
+15 - ASCII string
+16 - Unicode string
+17 - TCHAR string
+18 - ASCII character
+19 - pointer to 32 bit float
+20 - pointer to 64 bit float
+21 - c++ bool
+22 - int BOOL
+23 - HRESULT
+24 - GUID pointer
+25 - SIZE or POINT pointer
+26 - RECT pointer
+27 - D3DRENDERSTATETYPE
+28 - D3DTEXTURESTAGESTATETYPE
+29 - D3DTRANSFORMSTATETYPE
+30 - D3DLIGHTSTATETYPE
+*/
+
+// Binary trace file written when DebugTraceBinary is set, converted to text by tracedec.
+// The file starts with a TRACEBIN_HEADER followed by records padded to 8 bytes.
+#define TRACEBIN_MAGIC "DXGLTRC"
+#define TRACEBIN_VERSION 1
+
+// Record types
+#define TRACEBIN_PAD 0  // Unused space at the end of a thread's ring buffer
+#define TRACEBIN_NAME 1  // Text of a function or variable name, before its first use
+#define TRACEBIN_CHUNK 2  // Events recorded by one thread, in order
+#define TRACEBIN_ENTER 3
+#define TRACEBIN_EXIT 4
+#define TRACEBIN_VAR 5
+#define TRACEBIN_STRING 6
+
+#define TRACEBIN_ALIGN(x) (((x) + 7) & ~7)
+
+typedef struct TRACEBIN_HEADER
+{
+	char magic[8];
+	DWORD version;
+	DWORD pointersize;  // sizeof(void*) in the traced process
+	LONGLONG frequency;  // QueryPerformanceFrequency in the traced process
+} TRACEBIN_HEADER;
+
+typedef struct TRACEBIN_RECORD
+{
+	DWORD type;
+	DWORD size;  // Bytes in the record including this header
+} TRACEBIN_RECORD;
+
+// Followed by the null-terminated name
+typedef struct TRACEBIN_NAMEREC
+{
+	TRACEBIN_RECORD rec;
+	unsigned __int64 address;
+} TRACEBIN_NAMEREC;
+
+// Followed by event records, rec.size includes them
+typedef struct TRACEBIN_CHUNKREC
+{
+	TRACEBIN_RECORD rec;
+	DWORD threadid;
+	DWORD dropped;  // Events lost before this chunk because the ring buffer was full
+} TRACEBIN_CHUNKREC;
+
+// Followed by count TRACEBIN_ARG, or the null-terminated text of a TRACEBIN_STRING
+typedef struct TRACEBIN_EVENT
+{
+	TRACEBIN_RECORD rec;
+	LONGLONG time;  // QueryPerformanceCounter
+	unsigned __int64 function;  // Address of the function name
+	unsigned __int64 var;  // Address of the variable name for TRACEBIN_VAR
+	DWORD count;
+	DWORD reserved;
+} TRACEBIN_EVENT;
+
+// Followed by size bytes copied from a pointer argument, padded to 8
+typedef struct TRACEBIN_ARG
+{
+	int type;
+	DWORD size;
+	unsigned __int64 value;
+} TRACEBIN_ARG;
+
+void trace_decode_arg(HANDLE file, int type, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_TRACEDECODE_H
@@ -23,9 +23,105 @@
 #pragma optimize("g", off)
 #endif
 extern DXGLCFG dxglcfg;
+
+// Number of memory regions remembered by the PointerValidation region check
+#define POINTERCACHE_SIZE 16
+
+// Memory region found with VirtualQuery
+typedef struct POINTERREGION
+{
+	ULONG_PTR start;
+	ULONG_PTR end;  // 0 for an unused entry
+	BOOL readable;
+	BOOL writable;
+} POINTERREGION;
+
+static POINTERREGION pointercache[POINTERCACHE_SIZE];
+static DWORD pointercachenext = 0;
+static DWORD pointercachelock = 0;
+
+/**
+  * Finds the memory region holding an address, from the cache or with
+  * VirtualQuery.
+  * @param address
+  *  Address to look up
+  * @param region
+  *  Receives the region
+  * @return
+  *  TRUE if the region was found
+  */
+static BOOL PointerRegion_Get(ULONG_PTR address, POINTERREGION *region)
+{
+	MEMORY_BASIC_INFORMATION info;
+	DWORD protect;
+	DWORD i;
+	BOOL found = FALSE;
+	EnterSpinlock(&pointercachelock);
+	for (i = 0; i < POINTERCACHE_SIZE; i++)
+	{
+		if ((address >= pointercache[i].start) && (address < pointercache[i].end))
+		{
+			*region = pointercache[i];
+			found = TRUE;
+			break;
+		}
+	}
+	ExitSpinlock(&pointercachelock);
+	if (found) return TRUE;
+	if (!VirtualQuery((LPCVOID)address, &info, sizeof(MEMORY_BASIC_INFORMATION))) return FALSE;
+	region->start = (ULONG_PTR)info.BaseAddress;
+	region->end = region->start + info.RegionSize;
+	region->readable = region->writable = FALSE;
+	if ((info.State == MEM_COMMIT) && !(info.Protect & (PAGE_GUARD | PAGE_NOACCESS)))
+	{
+		protect = info.Protect & 0xFF;
+		if (protect & (PAGE_READWRITE | PAGE_WRITECOPY | PAGE_EXECUTE_READWRITE | PAGE_EXECUTE_WRITECOPY))
+			region->readable = region->writable = TRUE;
+		else if (protect & (PAGE_READONLY | PAGE_EXECUTE_READ)) region->readable = TRUE;
+	}
+	// Guard pages change on first touch, so only remember plain regions
+	if (info.Protect & PAGE_GUARD) return TRUE;
+	EnterSpinlock(&pointercachelock);
+	pointercache[pointercachenext] = *region;
+	pointercachenext = (pointercachenext + 1) % POINTERCACHE_SIZE;
+	ExitSpinlock(&pointercachelock);
+	return TRUE;
+}
+
+/**
+  * Tests if a block of memory is committed with the needed access, using
+  * VirtualQuery and remembering the regions it finds.  Memory freed after
+  * its region was remembered still passes, so this only catches pointers
+  * that were never valid.
+  * @param ptr
+  *  Pointer to test for validity.
+  * @param size
+  *  Size of block to check
+  * @param write
+  *  TRUE if the block must be writable
+  * @return
+  *  TRUE if the whole block can be accessed
+  */
+static BOOL PointerRegion_Check(void *ptr, LONG_PTR size, BOOL write)
+{
+	POINTERREGION region;
+	ULONG_PTR address = (ULONG_PTR)ptr;
+	ULONG_PTR end = address + ((size > 1) ? size : 1);
+	if (end < address) return FALSE;
+	while (address < end)
+	{
+		if (!PointerRegion_Get(address, &region)) return FALSE;
+		if (write ? !region.writable : !region.readable) return FALSE;
+		address = region.end;
+	}
+	return TRUE;
+}
+
 /**
-  * Tests if a pointer is valid for reading from.  Uses SEH on Visual C++,
-  * non-recommended Windows API on other systems.
+  * Tests if a pointer is valid for reading from.  Depending on
+  * PointerValidation, checks the memory region the pointer is in, or probes
+  * it with SEH on Visual C++ and non-recommended Windows API on other
+  * systems.
   * @param ptr
   *  Pointer to test for validity.
   * @param size
@@ -38,6 +134,8 @@ char IsReadablePointer(void *ptr, LONG_PTR size)
 	char a;
 	char *ptr2 = ptr;
 	if(!ptr) return 0;
+	if (dxglcfg.PointerValidation == 2) return 1;
+	if (!dxglcfg.PointerValidation) return (char)PointerRegion_Check(ptr, size, FALSE);
 #ifdef _MSC_VER
 	__try
 	{
@@ -58,8 +156,9 @@ char IsReadablePointer(void *ptr, LONG_PTR size)
 }
 
 /**
-* Tests if a pointer is valid for writing to.  Uses SEH on Visual C++,
-* non-recommended Windows API on other systems.
+* Tests if a pointer is valid for writing to.  Depending on PointerValidation,
+* checks the memory region the pointer is in, or probes it with SEH on Visual
+* C++ and non-recommended Windows API on other systems.
 * @param ptr
 *  Pointer to test for validity.
 * @param size
@@ -74,6 +173,8 @@ char IsWritablePointer(void *ptr, LONG_PTR size, BOOL preserve)
 	char a;
 	char *ptr2 = ptr;
 	if (!ptr) return 0;
+	if (dxglcfg.PointerValidation == 2) return 1;
+	if (!dxglcfg.PointerValidation) return (char)PointerRegion_Check(ptr, size, TRUE);
 #ifdef _MSC_VER
 	__try
 	{
@@ -0,0 +1,535 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#include "common.h"
+#include "vertexproc.h"
+#include <emmintrin.h>
+#include <math.h>
+
+typedef struct VERTEXPROCJOB
+{
+	const VERTEXPROCSTATE *state;
+	const VERTEXSTREAMS *src;
+	const VERTEXSTREAMS *dest;
+	DWORD start;
+	DWORD count;
+	BOOL copydata;
+	volatile LONG *pending;
+	HANDLE done;
+} VERTEXPROCJOB;
+
+static DWORD cpucount = 0;
+
+static DWORD VertexProc_TexCoordSize(DWORD fvf, DWORD index)
+{
+	switch ((fvf >> (16 + (2 * index))) & 3)
+	{
+	case 0: // st
+	default:
+		return 2;
+	case 1: // str
+		return 3;
+	case 2: // strq
+		return 4;
+	case 3: // s
+		return 1;
+	}
+}
+
+/**
+  * Fills in stream pointers for an interleaved vertex buffer.
+  * @param fvf
+  *  Flexible vertex format of the buffer
+  * @param base
+  *  Pointer to the first vertex
+  * @param stride
+  *  Size of one vertex in bytes
+  * @param streams
+  *  Structure to receive the stream pointers
+  */
+void VertexProc_SetupStreams(DWORD fvf, BYTE *base, DWORD stride, VERTEXSTREAMS *streams)
+{
+	DWORD offset = 0;
+	DWORD numtex;
+	DWORD i;
+	ZeroMemory(streams, sizeof(VERTEXSTREAMS));
+	for (i = 0; i < VERTEXSTREAM_COUNT; i++)
+		streams->stride[i] = stride;
+	streams->data[VERTEXSTREAM_POSITION] = base;
+	switch (fvf & D3DFVF_POSITION_MASK)
+	{
+	case D3DFVF_XYZRHW:
+		streams->size[VERTEXSTREAM_POSITION] = 4;
+		offset = 4;
+		break;
+	case D3DFVF_XYZB1:
+	case D3DFVF_XYZB2:
+	case D3DFVF_XYZB3:
+	case D3DFVF_XYZB4:
+	case D3DFVF_XYZB5:
+		streams->size[VERTEXSTREAM_POSITION] = 3;
+		offset = 3 + ((fvf >> 1) & 7) - 2;
+		break;
+	case D3DFVF_XYZ:
+	default:
+		streams->size[VERTEXSTREAM_POSITION] = 3;
+		offset = 3;
+		if (fvf & D3DFVF_RESERVED1) offset++;
+		break;
+	}
+	offset *= 4;
+	if (fvf & D3DFVF_NORMAL)
+	{
+		streams->data[VERTEXSTREAM_NORMAL] = base + offset;
+		streams->size[VERTEXSTREAM_NORMAL] = 3;
+		offset += 12;
+	}
+	if (fvf & D3DFVF_DIFFUSE)
+	{
+		streams->data[VERTEXSTREAM_DIFFUSE] = base + offset;
+		streams->size[VERTEXSTREAM_DIFFUSE] = 1;
+		offset += 4;
+	}
+	if (fvf & D3DFVF_SPECULAR)
+	{
+		streams->data[VERTEXSTREAM_SPECULAR] = base + offset;
+		streams->size[VERTEXSTREAM_SPECULAR] = 1;
+		offset += 4;
+	}
+	numtex = (fvf & D3DFVF_TEXCOUNT_MASK) >> D3DFVF_TEXCOUNT_SHIFT;
+	if (numtex > 8) numtex = 8;
+	for (i = 0; i < numtex; i++)
+	{
+		streams->data[VERTEXSTREAM_TEXCOORD + i] = base + offset;
+		streams->size[VERTEXSTREAM_TEXCOORD + i] = VertexProc_TexCoordSize(fvf, i);
+		offset += streams->size[VERTEXSTREAM_TEXCOORD + i] * 4;
+	}
+}
+
+/**
+  * Fills in stream pointers for strided vertex data.
+  * @param fvf
+  *  Flexible vertex format describing which streams are present
+  * @param data
+  *  Pointer to the strided vertex data
+  * @param streams
+  *  Structure to receive the stream pointers
+  */
+void VertexProc_SetupStridedStreams(DWORD fvf, D3DDRAWPRIMITIVESTRIDEDDATA *data, VERTEXSTREAMS *streams)
+{
+	DWORD numtex;
+	DWORD i;
+	ZeroMemory(streams, sizeof(VERTEXSTREAMS));
+	streams->data[VERTEXSTREAM_POSITION] = (BYTE*)data->position.lpvData;
+	streams->stride[VERTEXSTREAM_POSITION] = data->position.dwStride;
+	if ((fvf & D3DFVF_POSITION_MASK) == D3DFVF_XYZRHW) streams->size[VERTEXSTREAM_POSITION] = 4;
+	else streams->size[VERTEXSTREAM_POSITION] = 3;
+	if (fvf & D3DFVF_NORMAL)
+	{
+		streams->data[VERTEXSTREAM_NORMAL] = (BYTE*)data->normal.lpvData;
+		streams->stride[VERTEXSTREAM_NORMAL] = data->normal.dwStride;
+		streams->size[VERTEXSTREAM_NORMAL] = 3;
+	}
+	if (fvf & D3DFVF_DIFFUSE)
+	{
+		streams->data[VERTEXSTREAM_DIFFUSE] = (BYTE*)data->diffuse.lpvData;
+		streams->stride[VERTEXSTREAM_DIFFUSE] = data->diffuse.dwStride;
+		streams->size[VERTEXSTREAM_DIFFUSE] = 1;
+	}
+	if (fvf & D3DFVF_SPECULAR)
+	{
+		streams->data[VERTEXSTREAM_SPECULAR] = (BYTE*)data->specular.lpvData;
+		streams->stride[VERTEXSTREAM_SPECULAR] = data->specular.dwStride;
+		streams->size[VERTEXSTREAM_SPECULAR] = 1;
+	}
+	numtex = (fvf & D3DFVF_TEXCOUNT_MASK) >> D3DFVF_TEXCOUNT_SHIFT;
+	if (numtex > 8) numtex = 8;
+	for (i = 0; i < numtex; i++)
+	{
+		streams->data[VERTEXSTREAM_TEXCOORD + i] = (BYTE*)data->textureCoords[i].lpvData;
+		streams->stride[VERTEXSTREAM_TEXCOORD + i] = data->textureCoords[i].dwStride;
+		streams->size[VERTEXSTREAM_TEXCOORD + i] = VertexProc_TexCoordSize(fvf, i);
+	}
+}
+
+/**
+  * Advances all present streams by a number of vertices.
+  * @param streams
+  *  Streams to offset
+  * @param index
+  *  Number of vertices to skip
+  */
+void VertexProc_OffsetStreams(VERTEXSTREAMS *streams, DWORD index)
+{
+	DWORD i;
+	for (i = 0; i < VERTEXSTREAM_COUNT; i++)
+		if (streams->data[i]) streams->data[i] += streams->stride[i] * index;
+}
+
+/**
+  * Computes the axis aligned bounding box of the untransformed positions in
+  * a set of streams.
+  * @param streams
+  *  Streams holding the positions
+  * @param count
+  *  Number of vertices
+  * @param min
+  *  Array of three floats to receive the lowest coordinates
+  * @param max
+  *  Array of three floats to receive the highest coordinates
+  * @return
+  *  FALSE if there are no vertices or the positions are already transformed
+  */
+BOOL VertexProc_GetBounds(const VERTEXSTREAMS *streams, DWORD count, float *min, float *max)
+{
+	const BYTE *ptr = streams->data[VERTEXSTREAM_POSITION];
+	const float *pos;
+	DWORD i, j;
+	if (!count || !ptr || (streams->size[VERTEXSTREAM_POSITION] != 3)) return FALSE;
+	pos = (const float*)ptr;
+	for (j = 0; j < 3; j++)
+		min[j] = max[j] = pos[j];
+	for (i = 1; i < count; i++)
+	{
+		ptr += streams->stride[VERTEXSTREAM_POSITION];
+		pos = (const float*)ptr;
+		for (j = 0; j < 3; j++)
+		{
+			if (pos[j] < min[j]) min[j] = pos[j];
+			if (pos[j] > max[j]) max[j] = pos[j];
+		}
+	}
+	return TRUE;
+}
+
+static void VertexProc_CopyColor(float *out, const D3DCOLORVALUE *color)
+{
+	out[0] = color->r;
+	out[1] = color->g;
+	out[2] = color->b;
+	out[3] = color->a;
+}
+
+/**
+  * Converts a Direct3D light into the form used by the vertex pipeline.
+  * @param out
+  *  Pointer to the structure to receive the light
+  * @param light
+  *  Pointer to the Direct3D light
+  */
+void VertexProc_SetLight(VERTEXPROCLIGHT *out, const D3DLIGHT7 *light)
+{
+	float length;
+	out->type = light->dltType;
+	VertexProc_CopyColor(out->diffuse, &light->dcvDiffuse);
+	VertexProc_CopyColor(out->specular, &light->dcvSpecular);
+	VertexProc_CopyColor(out->ambient, &light->dcvAmbient);
+	out->position[0] = light->dvPosition.x;
+	out->position[1] = light->dvPosition.y;
+	out->position[2] = light->dvPosition.z;
+	out->position[3] = 1.0f;
+	length = sqrtf(light->dvDirection.x * light->dvDirection.x + light->dvDirection.y * light->dvDirection.y
+		+ light->dvDirection.z * light->dvDirection.z);
+	if (length == 0.0f) length = 1.0f;
+	out->direction[0] = -light->dvDirection.x / length;
+	out->direction[1] = -light->dvDirection.y / length;
+	out->direction[2] = -light->dvDirection.z / length;
+	out->direction[3] = 0.0f;
+	out->range = light->dvRange;
+	out->attenuation[0] = light->dvAttenuation0;
+	out->attenuation[1] = light->dvAttenuation1;
+	out->attenuation[2] = light->dvAttenuation2;
+	out->costheta = cosf(light->dvTheta * 0.5f);
+	out->cosphi = cosf(light->dvPhi * 0.5f);
+	out->falloff = light->dvFalloff;
+}
+
+static __inline __m128 VertexProc_Transform(const __m128 *m, const float *v)
+{
+	__m128 r = _mm_mul_ps(m[0], _mm_set1_ps(v[0]));
+	r = _mm_add_ps(r, _mm_mul_ps(m[1], _mm_set1_ps(v[1])));
+	r = _mm_add_ps(r, _mm_mul_ps(m[2], _mm_set1_ps(v[2])));
+	return _mm_add_ps(r, m[3]);
+}
+
+static __inline __m128 VertexProc_TransformNormal(const __m128 *m, const float *v)
+{
+	__m128 r = _mm_mul_ps(m[0], _mm_set1_ps(v[0]));
+	r = _mm_add_ps(r, _mm_mul_ps(m[1], _mm_set1_ps(v[1])));
+	return _mm_add_ps(r, _mm_mul_ps(m[2], _mm_set1_ps(v[2])));
+}
+
+static __inline float VertexProc_Dot3(__m128 a, __m128 b)
+{
+	__m128 r = _mm_mul_ps(a, b);
+	r = _mm_add_ss(_mm_add_ss(r, _mm_shuffle_ps(r, r, _MM_SHUFFLE(1, 1, 1, 1))),
+		_mm_shuffle_ps(r, r, _MM_SHUFFLE(2, 2, 2, 2)));
+	return _mm_cvtss_f32(r);
+}
+
+static __inline __m128 VertexProc_Normalize(__m128 v)
+{
+	float length = VertexProc_Dot3(v, v);
+	if (length == 0.0f) return v;
+	return _mm_mul_ps(v, _mm_set1_ps(1.0f / sqrtf(length)));
+}
+
+// Loads a D3DCOLOR as r, g, b, a floats
+static __inline __m128 VertexProc_LoadColor(DWORD color)
+{
+	__m128i c = _mm_cvtsi32_si128(color);
+	c = _mm_unpacklo_epi8(c, _mm_setzero_si128());
+	c = _mm_unpacklo_epi16(c, _mm_setzero_si128());
+	return _mm_mul_ps(_mm_shuffle_ps(_mm_cvtepi32_ps(c), _mm_cvtepi32_ps(c), _MM_SHUFFLE(3, 0, 1, 2)),
+		_mm_set1_ps(1.0f / 255.0f));
+}
+
+// Stores r, g, b, a floats as a D3DCOLOR
+static __inline DWORD VertexProc_StoreColor(__m128 color)
+{
+	__m128i c;
+	color = _mm_min_ps(_mm_max_ps(color, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+	color = _mm_shuffle_ps(color, color, _MM_SHUFFLE(3, 0, 1, 2));
+	c = _mm_cvtps_epi32(_mm_mul_ps(color, _mm_set1_ps(255.0f)));
+	c = _mm_packs_epi32(c, c);
+	c = _mm_packus_epi16(c, c);
+	return (DWORD)_mm_cvtsi128_si32(c);
+}
+
+static __inline __m128 VertexProc_MaterialSource(DWORD source, const float *material, BOOL hasdiffuse,
+	__m128 diffuse, BOOL hasspecular, __m128 specular)
+{
+	if ((source == D3DMCS_COLOR1) && hasdiffuse) return diffuse;
+	if ((source == D3DMCS_COLOR2) && hasspecular) return specular;
+	return _mm_loadu_ps(material);
+}
+
+static void VertexProc_ProcessRange(const VERTEXPROCSTATE *state, const VERTEXSTREAMS *src,
+	const VERTEXSTREAMS *dest, DWORD start, DWORD count, BOOL copydata)
+{
+	__m128 transform[4];
+	__m128 world[4];
+	__m128 normalmatrix[3];
+	__m128 viewscale, viewoffset;
+	__m128 eye;
+	__m128 srcdiffuse, srcspecular;
+	__m128 ambient, diffuse, specular;
+	__m128 position, normal, view, L, H;
+	__m128 mdiffuse, mambient, mspecular, memissive;
+	__m128 one = _mm_set1_ps(1.0f);
+	float clip[4];
+	float *out;
+	float rhw;
+	float distance, atten, spot, rho;
+	float NdotL, NdotH;
+	BOOL hasdiffuse, hasspecular;
+	BOOL lighting = state->lighting && src->data[VERTEXSTREAM_NORMAL];
+	BOOL writediffuse = dest->data[VERTEXSTREAM_DIFFUSE] && (lighting || copydata);
+	BOOL writespecular = dest->data[VERTEXSTREAM_SPECULAR] && (lighting || copydata);
+	const VERTEXPROCLIGHT *light;
+	DWORD i, j, k, size;
+	for (i = 0; i < 4; i++)
+	{
+		transform[i] = _mm_loadu_ps(&state->transform[i * 4]);
+		world[i] = _mm_loadu_ps(&state->world[i * 4]);
+	}
+	for (i = 0; i < 3; i++)
+		normalmatrix[i] = _mm_loadu_ps(&state->normalmatrix[i * 4]);
+	viewscale = _mm_loadu_ps(state->viewscale);
+	viewoffset = _mm_loadu_ps(state->viewoffset);
+	eye = _mm_loadu_ps(state->eye);
+	for (i = start; i < start + count; i++)
+	{
+		const float *pos = (const float*)(src->data[VERTEXSTREAM_POSITION] + i * src->stride[VERTEXSTREAM_POSITION]);
+		out = (float*)(dest->data[VERTEXSTREAM_POSITION] + i * dest->stride[VERTEXSTREAM_POSITION]);
+		_mm_storeu_ps(clip, VertexProc_Transform(transform, pos));
+		if (clip[3] != 0.0f) rhw = 1.0f / clip[3];
+		else rhw = 1.0f;
+		_mm_storeu_ps(clip, _mm_add_ps(_mm_mul_ps(_mm_mul_ps(_mm_loadu_ps(clip), _mm_set1_ps(rhw)), viewscale), viewoffset));
+		out[0] = clip[0];
+		out[1] = clip[1];
+		out[2] = clip[2];
+		out[3] = rhw;
+		hasdiffuse = src->data[VERTEXSTREAM_DIFFUSE] != NULL;
+		hasspecular = src->data[VERTEXSTREAM_SPECULAR] != NULL;
+		if (hasdiffuse) srcdiffuse = VertexProc_LoadColor(*(DWORD*)(src->data[VERTEXSTREAM_DIFFUSE]
+			+ i * src->stride[VERTEXSTREAM_DIFFUSE]));
+		else srcdiffuse = one;
+		if (hasspecular) srcspecular = VertexProc_LoadColor(*(DWORD*)(src->data[VERTEXSTREAM_SPECULAR]
+			+ i * src->stride[VERTEXSTREAM_SPECULAR]));
+		else srcspecular = _mm_setzero_ps();
+		if (lighting)
+		{
+			position = VertexProc_Transform(world, pos);
+			normal = VertexProc_Normalize(VertexProc_TransformNormal(normalmatrix, (const float*)(src->data[VERTEXSTREAM_NORMAL]
+				+ i * src->stride[VERTEXSTREAM_NORMAL])));
+			if (state->localviewer) view = VertexProc_Normalize(_mm_sub_ps(eye, position));
+			else view = _mm_loadu_ps(state->eyedir);
+			ambient = _mm_setzero_ps();
+			diffuse = _mm_setzero_ps();
+			specular = _mm_setzero_ps();
+			for (j = 0; j < state->lightcount; j++)
+			{
+				light = &state->lights[j];
+				atten = 1.0f;
+				if (light->type == D3DLIGHT_DIRECTIONAL) L = _mm_loadu_ps(light->direction);
+				else
+				{
+					L = _mm_sub_ps(_mm_loadu_ps(light->position), position);
+					distance = sqrtf(VertexProc_Dot3(L, L));
+					if ((light->range > 0.0f) && (distance > light->range)) continue;
+					if (distance > 0.0f) L = _mm_mul_ps(L, _mm_set1_ps(1.0f / distance));
+					atten = light->attenuation[0] + light->attenuation[1] * distance
+						+ light->attenuation[2] * distance * distance;
+					if (atten > 0.0f) atten = 1.0f / atten;
+					else atten = 1.0f;
+					if (light->type == D3DLIGHT_SPOT)
+					{
+						rho = VertexProc_Dot3(L, _mm_loadu_ps(light->direction));
+						if (rho <= light->cosphi) continue;
+						if (rho < light->costheta)
+						{
+							spot = (rho - light->cosphi) / (light->costheta - light->cosphi);
+							if (light->falloff != 1.0f) spot = powf(spot, light->falloff);
+							atten *= spot;
+						}
+					}
+				}
+				ambient = _mm_add_ps(ambient, _mm_mul_ps(_mm_loadu_ps(light->ambient), _mm_set1_ps(atten)));
+				NdotL = VertexProc_Dot3(normal, L);
+				if (NdotL <= 0.0f) continue;
+				diffuse = _mm_add_ps(diffuse, _mm_mul_ps(_mm_loadu_ps(light->diffuse), _mm_set1_ps(NdotL * atten)));
+				if (state->specular && (state->power > 0.0f))
+				{
+					H = VertexProc_Normalize(_mm_add_ps(L, view));
+					NdotH = VertexProc_Dot3(normal, H);
+					if (NdotH > 0.0f) specular = _mm_add_ps(specular, _mm_mul_ps(_mm_loadu_ps(light->specular),
+						_mm_set1_ps(powf(NdotH, state->power) * atten)));
+				}
+			}
+			mdiffuse = VertexProc_MaterialSource(state->diffusesource, state->diffuse,
+				hasdiffuse, srcdiffuse, hasspecular, srcspecular);
+			mambient = VertexProc_MaterialSource(state->ambientsource, state->ambient,
+				hasdiffuse, srcdiffuse, hasspecular, srcspecular);
+			mspecular = VertexProc_MaterialSource(state->specularsource, state->specularcolor,
+				hasdiffuse, srcdiffuse, hasspecular, srcspecular);
+			memissive = VertexProc_MaterialSource(state->emissivesource, state->emissive,
+				hasdiffuse, srcdiffuse, hasspecular, srcspecular);
+			ambient = _mm_add_ps(ambient, _mm_loadu_ps(state->globalambient));
+			srcdiffuse = _mm_add_ps(_mm_add_ps(memissive, _mm_mul_ps(ambient, mambient)), _mm_mul_ps(diffuse, mdiffuse));
+			// Alpha comes from the diffuse material source only
+			srcdiffuse = _mm_shuffle_ps(srcdiffuse, _mm_unpackhi_ps(srcdiffuse, mdiffuse), _MM_SHUFFLE(3, 0, 1, 0));
+			if (state->specular) srcspecular = _mm_mul_ps(specular, mspecular);
+			else srcspecular = _mm_setzero_ps();
+		}
+		if (writediffuse)
+		{
+			if (lighting || hasdiffuse) *(DWORD*)(dest->data[VERTEXSTREAM_DIFFUSE] + i * dest->stride[VERTEXSTREAM_DIFFUSE])
+				= VertexProc_StoreColor(srcdiffuse);
+			else *(DWORD*)(dest->data[VERTEXSTREAM_DIFFUSE] + i * dest->stride[VERTEXSTREAM_DIFFUSE]) = 0xFFFFFFFF;
+		}
+		if (writespecular) *(DWORD*)(dest->data[VERTEXSTREAM_SPECULAR] + i * dest->stride[VERTEXSTREAM_SPECULAR])
+			= VertexProc_StoreColor(srcspecular);
+		if (copydata)
+		{
+			for (j = 0; j < 8; j++)
+			{
+				if (!dest->data[VERTEXSTREAM_TEXCOORD + j]) break;
+				out = (float*)(dest->data[VERTEXSTREAM_TEXCOORD + j] + i * dest->stride[VERTEXSTREAM_TEXCOORD + j]);
+				size = src->size[VERTEXSTREAM_TEXCOORD + j];
+				if (size > dest->size[VERTEXSTREAM_TEXCOORD + j]) size = dest->size[VERTEXSTREAM_TEXCOORD + j];
+				if (size) memcpy(out, src->data[VERTEXSTREAM_TEXCOORD + j] + i * src->stride[VERTEXSTREAM_TEXCOORD + j],
+					size * sizeof(float));
+				for (k = size; k < dest->size[VERTEXSTREAM_TEXCOORD + j]; k++)
+					out[k] = 0.0f;
+			}
+		}
+	}
+}
+
+static DWORD WINAPI VertexProc_Worker(LPVOID param)
+{
+	VERTEXPROCJOB *job = (VERTEXPROCJOB*)param;
+	VertexProc_ProcessRange(job->state, job->src, job->dest, job->start, job->count, job->copydata);
+	if (!InterlockedDecrement(job->pending)) SetEvent(job->done);
+	return 0;
+}
+
+/**
+  * Transforms and optionally lights vertices on the CPU.  Large batches are
+  * split across the system thread pool with the calling thread taking the first
+  * batch, and the call returns once every batch is finished.
+  * @param state
+  *  Pointer to the transform and lighting state to apply
+  * @param src
+  *  Source vertex streams, starting at the first vertex to process
+  * @param dest
+  *  Destination vertex streams, starting at the first vertex to write
+  * @param count
+  *  Number of vertices to process
+  * @param copydata
+  *  TRUE to copy colors and texture coordinates not produced by lighting
+  */
+void VertexProc_Process(const VERTEXPROCSTATE *state, const VERTEXSTREAMS *src, const VERTEXSTREAMS *dest,
+	DWORD count, BOOL copydata)
+{
+	VERTEXPROCJOB jobs[VERTEXPROC_MAXTHREADS];
+	SYSTEM_INFO info;
+	volatile LONG pending;
+	DWORD jobcount;
+	DWORD batch;
+	DWORD i;
+	if (!cpucount)
+	{
+		GetSystemInfo(&info);
+		cpucount = info.dwNumberOfProcessors;
+		if (!cpucount) cpucount = 1;
+	}
+	jobcount = count / VERTEXPROC_BATCHSIZE;
+	if (jobcount > cpucount) jobcount = cpucount;
+	if (jobcount > VERTEXPROC_MAXTHREADS) jobcount = VERTEXPROC_MAXTHREADS;
+	if (jobcount <= 1)
+	{
+		VertexProc_ProcessRange(state, src, dest, 0, count, copydata);
+		return;
+	}
+	batch = count / jobcount;
+	pending = jobcount - 1;
+	jobs[0].done = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (!jobs[0].done)
+	{
+		VertexProc_ProcessRange(state, src, dest, 0, count, copydata);
+		return;
+	}
+	for (i = 0; i < jobcount; i++)
+	{
+		jobs[i].state = state;
+		jobs[i].src = src;
+		jobs[i].dest = dest;
+		jobs[i].start = i * batch;
+		if (i == jobcount - 1) jobs[i].count = count - jobs[i].start;
+		else jobs[i].count = batch;
+		jobs[i].copydata = copydata;
+		jobs[i].pending = &pending;
+		jobs[i].done = jobs[0].done;
+		if (i && !QueueUserWorkItem(VertexProc_Worker, &jobs[i], WT_EXECUTEDEFAULT))
+			VertexProc_Worker(&jobs[i]);
+	}
+	VertexProc_ProcessRange(state, src, dest, jobs[0].start, jobs[0].count, copydata);
+	WaitForSingleObject(jobs[0].done, INFINITE);
+	CloseHandle(jobs[0].done);
+}
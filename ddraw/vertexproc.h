@@ -0,0 +1,98 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#pragma once
+#ifndef _VERTEXPROC_H
+#define _VERTEXPROC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Streams used by the CPU vertex pipeline
+#define VERTEXSTREAM_POSITION 0
+#define VERTEXSTREAM_NORMAL 1
+#define VERTEXSTREAM_DIFFUSE 2
+#define VERTEXSTREAM_SPECULAR 3
+#define VERTEXSTREAM_TEXCOORD 4
+#define VERTEXSTREAM_COUNT 12
+
+// Minimum number of vertices handed to each worker thread
+#define VERTEXPROC_BATCHSIZE 8192
+#define VERTEXPROC_MAXTHREADS 16
+
+typedef struct VERTEXSTREAMS
+{
+	BYTE *data[VERTEXSTREAM_COUNT];
+	DWORD stride[VERTEXSTREAM_COUNT];
+	DWORD size[VERTEXSTREAM_COUNT];  // Number of floats, 1 for colors, 0 if not present
+} VERTEXSTREAMS;
+
+typedef struct VERTEXPROCLIGHT
+{
+	D3DLIGHTTYPE type;
+	float diffuse[4];
+	float specular[4];
+	float ambient[4];
+	float position[4];
+	float direction[4];  // Normalized, pointing towards the light
+	float range;
+	float attenuation[3];
+	float costheta;  // Cosine of half the inner cone angle
+	float cosphi;  // Cosine of half the outer cone angle
+	float falloff;
+} VERTEXPROCLIGHT;
+
+typedef struct VERTEXPROCSTATE
+{
+	float transform[16];  // World * view * projection
+	float world[16];
+	float normalmatrix[12];  // Inverse transpose of the world matrix, rows padded to four floats
+	float eye[4];  // Viewer position in world space
+	float eyedir[4];  // Direction towards a non-local viewer
+	BOOL localviewer;
+	float viewscale[4];
+	float viewoffset[4];
+	BOOL lighting;
+	BOOL specular;
+	DWORD diffusesource;
+	DWORD specularsource;
+	DWORD ambientsource;
+	DWORD emissivesource;
+	float diffuse[4];
+	float ambient[4];
+	float specularcolor[4];
+	float emissive[4];
+	float power;
+	float globalambient[4];
+	DWORD lightcount;
+	VERTEXPROCLIGHT lights[LIGHTS_MAX];
+} VERTEXPROCSTATE;
+
+void VertexProc_SetupStreams(DWORD fvf, BYTE *base, DWORD stride, VERTEXSTREAMS *streams);
+void VertexProc_SetupStridedStreams(DWORD fvf, D3DDRAWPRIMITIVESTRIDEDDATA *data, VERTEXSTREAMS *streams);
+void VertexProc_OffsetStreams(VERTEXSTREAMS *streams, DWORD index);
+BOOL VertexProc_GetBounds(const VERTEXSTREAMS *streams, DWORD count, float *min, float *max);
+void VertexProc_SetLight(VERTEXPROCLIGHT *out, const D3DLIGHT7 *light);
+void VertexProc_Process(const VERTEXPROCSTATE *state, const VERTEXSTREAMS *src, const VERTEXSTREAMS *dest,
+	DWORD count, BOOL copydata);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_VERTEXPROC_H
@@ -0,0 +1,378 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+// Times the CPU pixel kernels of DXGL and surface Lock/Unlock round trips
+
+#define _CRT_SECURE_NO_DEPRECATE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+#include "../ddraw/include/ddraw.h"
+#include "../ddraw/colorconv.h"
+#include "../ddraw/scalers.h"
+
+// Minimum time each measurement runs for
+#define BENCH_MINTIME 0.25
+
+typedef struct
+{
+	const char *name;
+	int srcbits;  // Bits per pixel read
+	int destbits;  // Bits per pixel written
+} CONVERSION;
+
+// Same order as colorconvproc
+static const CONVERSION conversions[] =
+{
+	{ "rgba8332torgba8888", 16, 32 },
+	{ "rgba8888torgba8332", 32, 16 },
+	{ "rgb565torgba8888", 16, 32 },
+	{ "rgb565torgbx8888", 16, 32 },
+	{ "rgbx8888torgb565", 32, 16 },
+	{ "rgba1555torgba8888", 16, 32 },
+	{ "rgba8888torgba1555", 32, 16 },
+	{ "rgba4444torgba8888", 16, 32 },
+	{ "rgba8888torgba4444", 32, 16 },
+	{ "unpackrg88", 16, 32 },
+	{ "packrg88", 32, 16 },
+	{ "pal1topal8", 1, 8 },
+	{ "pal2topal8", 2, 8 },
+	{ "pal4topal8", 4, 8 },
+	{ "pal8topal1", 8, 1 },
+	{ "pal8topal2", 8, 2 },
+	{ "pal8topal4", 8, 4 },
+	{ "bpp24tobpp32", 24, 32 },
+	{ "bpp32tobpp24", 32, 24 }
+};
+#define CONVERSIONCOUNT (int)(sizeof(conversions) / sizeof(CONVERSION))
+
+typedef struct
+{
+	int width;
+	int height;
+} SIZE2D;
+
+static const SIZE2D sizes[] = { { 640, 480 }, { 1024, 768 }, { 1920, 1080 } };
+#define SIZECOUNT (int)(sizeof(sizes) / sizeof(SIZE2D))
+
+typedef struct
+{
+	int sw, sh, dw, dh;
+} SCALECASE;
+
+static const SCALECASE scalecases[] =
+{
+	{ 320, 240, 640, 480 },  // 2x, row fast path
+	{ 640, 480, 2560, 1920 },  // 4x, row fast path
+	{ 640, 480, 1920, 1080 }  // Uneven ratio, pixel stepping
+};
+#define SCALECASECOUNT (int)(sizeof(scalecases) / sizeof(SCALECASE))
+
+static LONGLONG frequency;
+
+static LONGLONG Now()
+{
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return counter.QuadPart;
+}
+
+static double Seconds(LONGLONG start, LONGLONG end)
+{
+	return (double)(end - start) / (double)frequency;
+}
+
+static void PrintResult(const char *name, const char *variant, const char *size, double seconds,
+	DWORD ops, double bytes)
+{
+	printf("%-22s %-10s %-10s %14.0f ns/op %9.3f GB/s\n", name, variant, size,
+		seconds * 1.0e9 / (double)ops, bytes * (double)ops / seconds / 1.0e9);
+}
+
+/**
+  * Converts a whole surface row by row on the calling thread.
+  */
+static void ConvertSurface(COLORCONVPROC proc, int width, int height, BYTE *dest, size_t destpitch,
+	BYTE *src, size_t srcpitch)
+{
+	int y;
+	for (y = 0; y < height; y++)
+		proc(width, dest + (y * destpitch), src + (y * srcpitch));
+}
+
+/**
+  * Times each color conversion over each surface size with the scalar
+  * kernels, the kernels chosen for the CPU, and ColorConv_ConvertRows,
+  * which splits large surfaces across threads.
+  */
+static void BenchColorConv(BYTE *src, BYTE *dest)
+{
+	COLORCONVPROC scalar[CONVERSIONCOUNT];
+	static const char *const variants[3] = { "scalar", "simd", "threaded" };
+	char sizename[32];
+	COLORCONVPROC proc;
+	size_t srcpitch, destpitch;
+	LONGLONG start, end;
+	DWORD ops;
+	int i, j, k;
+	memcpy(scalar, colorconvproc, sizeof(scalar));
+	ColorConv_Init();
+	printf("Color conversion\n");
+	for (i = 0; i < CONVERSIONCOUNT; i++)
+	{
+		for (j = 0; j < SIZECOUNT; j++)
+		{
+			sprintf(sizename, "%dx%d", sizes[j].width, sizes[j].height);
+			// Rows are padded to 4 bytes as on surfaces
+			srcpitch = (((sizes[j].width * conversions[i].srcbits) + 31) / 32) * 4;
+			destpitch = (((sizes[j].width * conversions[i].destbits) + 31) / 32) * 4;
+			for (k = 0; k < 3; k++)
+			{
+				proc = k ? colorconvproc[i] : scalar[i];
+				if ((k == 1) && (proc == scalar[i])) continue;
+				ops = 0;
+				start = end = Now();
+				while (Seconds(start, end) < BENCH_MINTIME)
+				{
+					if (k == 2) ColorConv_ConvertRows(proc, sizes[j].width, sizes[j].height,
+						dest, destpitch, src, srcpitch);
+					else ConvertSurface(proc, sizes[j].width, sizes[j].height, dest, destpitch, src, srcpitch);
+					ops++;
+					end = Now();
+				}
+				PrintResult(conversions[i].name, variants[k], sizename, Seconds(start, end), ops,
+					(double)((srcpitch + destpitch) * sizes[j].height));
+			}
+		}
+	}
+	printf("\n");
+}
+
+/**
+  * Times the nearest neighbor scalers at each pixel size.
+  */
+static void BenchScalers(BYTE *src, BYTE *dest)
+{
+	static const char *const names[4] = { "ScaleNearest8", "ScaleNearest16", "ScaleNearest24", "ScaleNearest32" };
+	char sizename[32];
+	int inpitch, outpitch;
+	LONGLONG start, end;
+	DWORD ops;
+	int bytes;
+	int i;
+	const SCALECASE *c;
+	printf("Scaling\n");
+	for (bytes = 1; bytes <= 4; bytes++)
+	{
+		for (i = 0; i < SCALECASECOUNT; i++)
+		{
+			c = &scalecases[i];
+			sprintf(sizename, "%dx%d", c->dw, c->dh);
+			inpitch = ((c->sw * bytes) + 3) & ~3;
+			outpitch = ((c->dw * bytes) + 3) & ~3;
+			ops = 0;
+			start = end = Now();
+			while (Seconds(start, end) < BENCH_MINTIME)
+			{
+				// 16 and 32 bit scalers take pitches in pixels
+				switch (bytes)
+				{
+				case 1:
+					ScaleNearest8(dest, src, c->dw, c->dh, c->sw, c->sh, inpitch, outpitch);
+					break;
+				case 2:
+					ScaleNearest16(dest, src, c->dw, c->dh, c->sw, c->sh, inpitch / 2, outpitch / 2);
+					break;
+				case 3:
+					ScaleNearest24(dest, src, c->dw, c->dh, c->sw, c->sh, inpitch, outpitch);
+					break;
+				case 4:
+					ScaleNearest32(dest, src, c->dw, c->dh, c->sw, c->sh, inpitch / 4, outpitch / 4);
+					break;
+				}
+				ops++;
+				end = Now();
+			}
+			PrintResult(names[bytes - 1], "", sizename, Seconds(start, end), ops,
+				(double)(inpitch * c->sh) + (double)(outpitch * c->dh));
+		}
+	}
+	printf("\n");
+}
+
+/**
+  * Creates an offscreen surface with an RGB pixel format.
+  */
+static LPDIRECTDRAWSURFACE7 CreateBenchSurface(LPDIRECTDRAW7 dd, int width, int height, int bpp, DWORD memory)
+{
+	DDSURFACEDESC2 ddsd;
+	LPDIRECTDRAWSURFACE7 surface = NULL;
+	ZeroMemory(&ddsd, sizeof(DDSURFACEDESC2));
+	ddsd.dwSize = sizeof(DDSURFACEDESC2);
+	ddsd.dwFlags = DDSD_CAPS | DDSD_WIDTH | DDSD_HEIGHT | DDSD_PIXELFORMAT;
+	ddsd.ddsCaps.dwCaps = DDSCAPS_OFFSCREENPLAIN | memory;
+	ddsd.dwWidth = width;
+	ddsd.dwHeight = height;
+	ddsd.ddpfPixelFormat.dwSize = sizeof(DDPIXELFORMAT);
+	ddsd.ddpfPixelFormat.dwFlags = DDPF_RGB;
+	ddsd.ddpfPixelFormat.dwRGBBitCount = bpp;
+	if (bpp == 16)
+	{
+		ddsd.ddpfPixelFormat.dwRBitMask = 0xF800;
+		ddsd.ddpfPixelFormat.dwGBitMask = 0x7E0;
+		ddsd.ddpfPixelFormat.dwBBitMask = 0x1F;
+	}
+	else
+	{
+		ddsd.ddpfPixelFormat.dwRBitMask = 0xFF0000;
+		ddsd.ddpfPixelFormat.dwGBitMask = 0xFF00;
+		ddsd.ddpfPixelFormat.dwBBitMask = 0xFF;
+	}
+	if (FAILED(IDirectDraw7_CreateSurface(dd, &ddsd, &surface, NULL))) return NULL;
+	return surface;
+}
+
+/**
+  * Times Lock/Unlock round trips of system memory surfaces, video memory
+  * surfaces only written by the CPU, and video memory surfaces drawn to by
+  * the GPU before each lock, which have to be read back.  The color fills
+  * that dirty the surfaces are timed on their own for reference.
+  */
+static BOOL BenchLock()
+{
+	static const char *const variants[4] = { "sysmem", "video", "fill", "gpudirty" };
+	static const int bpps[2] = { 16, 32 };
+	HRESULT(WINAPI *_DirectDrawCreateEx)(GUID *lpGuid, LPVOID *lplpDD, REFIID iid, IUnknown *pUnkOuter);
+	HMODULE ddraw;
+	HWND hWnd;
+	LPDIRECTDRAW7 dd;
+	LPDIRECTDRAWSURFACE7 surface;
+	DDSURFACEDESC2 ddsd;
+	DDBLTFX bltfx;
+	char name[32];
+	char sizename[32];
+	LONGLONG start, end;
+	DWORD ops;
+	int i, j, k;
+	ddraw = LoadLibraryA("ddraw.dll");
+	if (!ddraw) return FALSE;
+	_DirectDrawCreateEx = (HRESULT(WINAPI*)(GUID*, LPVOID*, REFIID, IUnknown*))
+		GetProcAddress(ddraw, "DirectDrawCreateEx");
+	if (!_DirectDrawCreateEx || FAILED(_DirectDrawCreateEx(NULL, (LPVOID*)&dd, &IID_IDirectDraw7, NULL)))
+	{
+		FreeLibrary(ddraw);
+		return FALSE;
+	}
+	hWnd = CreateWindowA("STATIC", NULL, WS_POPUP, 0, 0, 16, 16, NULL, NULL, NULL, NULL);
+	IDirectDraw7_SetCooperativeLevel(dd, hWnd, DDSCL_NORMAL);
+	printf("Surface Lock/Unlock (%s)\n", GetProcAddress(ddraw, "IsDXGLDDraw") ? "DXGL" : "system DirectDraw");
+	ZeroMemory(&bltfx, sizeof(DDBLTFX));
+	bltfx.dwSize = sizeof(DDBLTFX);
+	for (i = 0; i < 2; i++)
+	{
+		sprintf(name, "Lock/Unlock %dbpp", bpps[i]);
+		for (j = 0; j < SIZECOUNT; j++)
+		{
+			sprintf(sizename, "%dx%d", sizes[j].width, sizes[j].height);
+			for (k = 0; k < 4; k++)
+			{
+				surface = CreateBenchSurface(dd, sizes[j].width, sizes[j].height, bpps[i],
+					k ? DDSCAPS_VIDEOMEMORY : DDSCAPS_SYSTEMMEMORY);
+				if (!surface)
+				{
+					printf("%-22s %-10s %-10s failed to create surface\n", name, variants[k], sizename);
+					continue;
+				}
+				ops = 0;
+				start = end = Now();
+				while (Seconds(start, end) < BENCH_MINTIME)
+				{
+					if (k >= 2)
+					{
+						bltfx.dwFillColor = ops;
+						IDirectDrawSurface7_Blt(surface, NULL, NULL, NULL, DDBLT_COLORFILL | DDBLT_WAIT, &bltfx);
+					}
+					if (k != 2)
+					{
+						ZeroMemory(&ddsd, sizeof(DDSURFACEDESC2));
+						ddsd.dwSize = sizeof(DDSURFACEDESC2);
+						if (FAILED(IDirectDrawSurface7_Lock(surface, NULL, &ddsd, DDLOCK_WAIT, NULL))) break;
+						// Touch the surface so the unlock has something to upload
+						*(DWORD*)ddsd.lpSurface = ops;
+						IDirectDrawSurface7_Unlock(surface, NULL);
+					}
+					ops++;
+					end = Now();
+				}
+				if (ops) PrintResult(name, variants[k], sizename, Seconds(start, end), ops,
+					(double)(sizes[j].width * sizes[j].height * (bpps[i] / 8)));
+				IDirectDrawSurface7_Release(surface);
+			}
+		}
+	}
+	IDirectDraw7_Release(dd);
+	DestroyWindow(hWnd);
+	FreeLibrary(ddraw);
+	return TRUE;
+}
+
+int main(int argc, char *argv[])
+{
+	LARGE_INTEGER counter;
+	BOOL colorconv = FALSE, scale = FALSE, lock = FALSE;
+	BYTE *src, *dest;
+	size_t buffersize;
+	int i;
+	for (i = 1; i < argc; i++)
+	{
+		if (!_stricmp(argv[i], "colorconv")) colorconv = TRUE;
+		else if (!_stricmp(argv[i], "scale")) scale = TRUE;
+		else if (!_stricmp(argv[i], "lock")) lock = TRUE;
+		else
+		{
+			printf("Usage: dxglbench [colorconv] [scale] [lock]\n");
+			printf("Runs the selected benchmarks, or all of them if none are given.\n");
+			return 1;
+		}
+	}
+	if (!colorconv && !scale && !lock) colorconv = scale = lock = TRUE;
+	QueryPerformanceFrequency(&counter);
+	frequency = counter.QuadPart;
+	// Large enough for the biggest surface and scaler output at 4 bytes per pixel
+	buffersize = 2560 * 1920 * 4;
+	src = (BYTE*)malloc(buffersize);
+	dest = (BYTE*)malloc(buffersize);
+	if (!src || !dest)
+	{
+		printf("Out of memory\n");
+		return 1;
+	}
+	srand(1);
+	for (i = 0; i < (int)buffersize; i++)
+		src[i] = (BYTE)rand();
+	if (colorconv) BenchColorConv(src, dest);
+	if (scale) BenchScalers(src, dest);
+	free(src);
+	free(dest);
+	if (lock && !BenchLock())
+	{
+		printf("Could not create a DirectDraw object\n");
+		return 1;
+	}
+	return 0;
+}
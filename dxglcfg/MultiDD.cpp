@@ -569,6 +569,24 @@ HRESULT MultiDirectDrawSurface::Blt(LPRECT lpDestRect, MultiDirectDrawSurface *l
 	return DDERR_GENERIC;
 }
 
+HRESULT MultiDirectDrawSurface::BltBatch(LPDDBLTBATCH lpDDBltBatch, DWORD dwCount, DWORD dwFlags)
+{
+	switch(version)
+	{
+	case 1:
+		return dds1->BltBatch(lpDDBltBatch,dwCount,dwFlags);
+	case 2:
+		return dds2->BltBatch(lpDDBltBatch,dwCount,dwFlags);
+	case 3:
+		return dds3->BltBatch(lpDDBltBatch,dwCount,dwFlags);
+	case 4:
+		return dds4->BltBatch(lpDDBltBatch,dwCount,dwFlags);
+	case 7:
+		return dds7->BltBatch(lpDDBltBatch,dwCount,dwFlags);
+	}
+	return DDERR_GENERIC;
+}
+
 HRESULT MultiDirectDrawSurface::BltFast(DWORD dwX, DWORD dwY, MultiDirectDrawSurface *lpDDSrcSurface, LPRECT lpSrcRect, DWORD dwTrans)
 {
 	if(lpDDSrcSurface)
@@ -3901,6 +3901,10 @@ LRESULT CALLBACK DXGLCfgCallback(HWND hWnd, UINT Msg, WPARAM wParam, LPARAM lPar
 		// Texture upload
 		_tcscpy(buffer,_T("Automatic"));
 		SendDlgItemMessage(hTabs[3],IDC_TEXUPLOAD,CB_ADDSTRING,0,(LPARAM)buffer);
+		_tcscpy(buffer,_T("Shared pixel buffer"));
+		SendDlgItemMessage(hTabs[3],IDC_TEXUPLOAD,CB_ADDSTRING,0,(LPARAM)buffer);
+		_tcscpy(buffer,_T("Per-texture upload"));
+		SendDlgItemMessage(hTabs[3],IDC_TEXUPLOAD,CB_ADDSTRING,0,(LPARAM)buffer);
 		SendDlgItemMessage(hTabs[3],IDC_TEXUPLOAD,CB_SETCURSEL,cfg->TexUpload,0);
 		// Default window position
 		_tcscpy(buffer, _T("Centered"));
@@ -4807,6 +4811,10 @@ int APIENTRY _tWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPTSTR    l
 	{
 		return DelApp(lpCmdLine+7,TRUE,NULL);
 	}
+	if (!_tcsnicmp(lpCmdLine, _T("benchmark"), 9))
+	{
+		return RunDXGLBenchmark(lpCmdLine + 9);
+	}
 	if (!_tcsnicmp(lpCmdLine, _T("profile_install"), 15))
 	{
 		// FIXME:  Remove DXGL Config profile
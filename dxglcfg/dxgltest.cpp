@@ -16,6 +16,8 @@
 // Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include "common.h"
+#include <stddef.h>
+#include <gl/GL.h>
 #include "dxgltest.h"
 #include "MultiDD.h"
 #include "tests.h"
@@ -225,7 +227,9 @@ const TEST_ITEM Tests[] =
 	{1,		7,		0,		1,		TRUE,		60.0,		FALSE,	FALSE,		FALSE,		_T("SetCursorPos Test")},
 	{1,		7,		0,		1,		TRUE,		60.0,		FALSE,	FALSE,		FALSE,		_T("Blt Background, Raster operation Blt sprites")},
 	{7,		7,		1,		1,		FALSE,		0.0,		TRUE,	TRUE,		FALSE,		_T("Surface/Texture format test")},
-	{7,		7,		0,		0,		FALSE,		0.0,		FALSE,	FALSE,		FALSE,		_T("Window API test (Interactive)")}
+	{7,		7,		0,		0,		FALSE,		0.0,		FALSE,	FALSE,		FALSE,		_T("Window API test (Interactive)")},
+	{1,		7,		0,		1,		FALSE,		0.0,		FALSE,	FALSE,		FALSE,		_T("Blt stress test (Up/Down changes blts per frame)")},
+	{7,		7,		0,		2,		FALSE,		0.0,		TRUE,	TRUE,		FALSE,		_T("Draw call scaling (Interactive, DX7)")}
 };
 const int END_TESTS = __LINE__ - 4;
 const int numtests = END_TESTS - START_TESTS;
@@ -383,7 +387,7 @@ SaveChanges(hDialog);
 				SendDlgItemMessage(hWnd, IDC_VIDMODES, LB_GETTEXT, i, (LPARAM)tmpstring);
 				TranslateResolutionString(tmpstring, width, height, bpp, refresh);
 				RunDXGLTest(currenttest, width, height, bpp, refresh, buffer, api,
-					filter, msaa, framerate, fullscreen, resizable, Tests[currenttest].is3d, softd3d, hDialog);
+					filter, msaa, framerate, fullscreen, resizable, Tests[currenttest].is3d, softd3d, hDialog, NULL);
 				break;
 			}
 			break;
@@ -455,7 +459,7 @@ Do you want to apply them before running this test?"),
 			SendDlgItemMessage(hWnd,IDC_VIDMODES,LB_GETTEXT,i,(LPARAM)tmpstring);
 			TranslateResolutionString(tmpstring,width,height,bpp,refresh);
 			RunDXGLTest(currenttest, width, height, bpp, refresh, buffer, api,
-				filter, msaa, framerate, fullscreen, resizable, Tests[currenttest].is3d, softd3d, hDialog);
+				filter, msaa, framerate, fullscreen, resizable, Tests[currenttest].is3d, softd3d, hDialog, NULL);
 			break;
 		case IDC_WINDOWED:
 			SendDlgItemMessage(hWnd,IDC_FULLSCREEN,BM_SETCHECK,0,0);
@@ -550,3 +554,330 @@ Do you want to apply them before running this test?"),
 	}
 	return TRUE;
 }
+
+typedef struct
+{
+	const char *name;
+	DWORD index;  // Index of the counter in DXGL_PERFCOUNTERS counted as an array of DWORDs
+} BENCHMARK_COUNTER;
+
+#define BENCHMARK_COUNTER_ENTRY(name, member) { name, offsetof(DXGL_PERFCOUNTERS, member) / sizeof(DWORD) }
+static const BENCHMARK_COUNTER BenchmarkCounters[] =
+{
+	BENCHMARK_COUNTER_ENTRY("frametime_us", dwFrameTime),
+	BENCHMARK_COUNTER_ENTRY("presenttime_us", dwPresentTime),
+	BENCHMARK_COUNTER_ENTRY("commands", dwCommands),
+	BENCHMARK_COUNTER_ENTRY("handoffs", dwHandoffs),
+	BENCHMARK_COUNTER_ENTRY("handoffwait_us", dwHandoffWait),
+	BENCHMARK_COUNTER_ENTRY("draws", dwDraws),
+	BENCHMARK_COUNTER_ENTRY("blts", dwBlts),
+	BENCHMARK_COUNTER_ENTRY("shaderswitches", dwShaderSwitches),
+	BENCHMARK_COUNTER_ENTRY("shadercompiles", dwShaderCompiles),
+	BENCHMARK_COUNTER_ENTRY("fboswitches", dwFBOSwitches),
+	BENCHMARK_COUNTER_ENTRY("readbackstalls", dwReadbackStalls),
+	BENCHMARK_COUNTER_ENTRY("uploads", dwUploads),
+	BENCHMARK_COUNTER_ENTRY("uploadbytes", dwUploadBytes),
+	BENCHMARK_COUNTER_ENTRY("downloadbytes", dwDownloadBytes),
+	BENCHMARK_COUNTER_ENTRY("texturesset", dwTexturesSet),
+	BENCHMARK_COUNTER_ENTRY("preloads", dwPreloads),
+	BENCHMARK_COUNTER_ENTRY("texturecreates", dwTextureCreates),
+	BENCHMARK_COUNTER_ENTRY("texturedeletes", dwTextureDeletes),
+	BENCHMARK_COUNTER_ENTRY("evictions", dwEvictions),
+	BENCHMARK_COUNTER_ENTRY("restores", dwRestores),
+	BENCHMARK_COUNTER_ENTRY("inputlatency_us", dwInputLatency)
+};
+
+/**
+  * Writes a string as a quoted JSON string.
+  * @param file
+  *  File to write to
+  * @param str
+  *  UTF-8 string to write
+  */
+static void WriteJSONString(FILE *file, const char *str)
+{
+	fputc('"', file);
+	for (; *str; str++)
+	{
+		if ((*str == '"') || (*str == '\\')) fprintf(file, "\\%c", *str);
+		else if ((unsigned char)*str < 0x20) fprintf(file, "\\u%04x", (unsigned char)*str);
+		else fputc(*str, file);
+	}
+	fputc('"', file);
+}
+
+/**
+  * Reads the renderer, vendor and version strings of the OpenGL driver the
+  * benchmark runs on, using a temporary context.
+  * @param strings
+  *  Array of three strings of 256 characters to receive the renderer, vendor
+  *  and version, set to empty strings if no context can be created
+  */
+static void GetGLStrings(char strings[3][256])
+{
+	static const GLenum names[3] = { GL_RENDERER, GL_VENDOR, GL_VERSION };
+	PIXELFORMATDESCRIPTOR pfd;
+	HWND hGLWnd;
+	HDC dc;
+	HGLRC rc;
+	const char *str;
+	int i;
+	for (i = 0; i < 3; i++) strings[i][0] = 0;
+	ZeroMemory(&pfd, sizeof(PIXELFORMATDESCRIPTOR));
+	pfd.nSize = sizeof(PIXELFORMATDESCRIPTOR);
+	pfd.nVersion = 1;
+	pfd.dwFlags = PFD_DRAW_TO_WINDOW | PFD_SUPPORT_OPENGL | PFD_DOUBLEBUFFER;
+	pfd.iPixelType = PFD_TYPE_RGBA;
+	pfd.iLayerType = PFD_MAIN_PLANE;
+	hGLWnd = CreateWindow(_T("STATIC"), NULL, WS_POPUP, 0, 0, 16, 16, NULL, NULL, NULL, NULL);
+	if (!hGLWnd) return;
+	dc = GetDC(hGLWnd);
+	SetPixelFormat(dc, ChoosePixelFormat(dc, &pfd), &pfd);
+	rc = wglCreateContext(dc);
+	if (rc)
+	{
+		wglMakeCurrent(dc, rc);
+		for (i = 0; i < 3; i++)
+		{
+			str = (const char*)glGetString(names[i]);
+			if (str)
+			{
+				strncpy(strings[i], str, 255);
+				strings[i][255] = 0;
+			}
+		}
+		wglMakeCurrent(dc, NULL);
+		wglDeleteContext(rc);
+	}
+	ReleaseDC(hGLWnd, dc);
+	DestroyWindow(hGLWnd);
+}
+
+/**
+  * Orders frame times from fastest to slowest.
+  */
+static int __cdecl CompareFrameTimes(const void *a, const void *b)
+{
+	double time1 = *(const double*)a;
+	double time2 = *(const double*)b;
+	if (time1 < time2) return -1;
+	if (time1 > time2) return 1;
+	return 0;
+}
+
+/**
+  * Writes the results of a benchmark to a JSON file.
+  * @param path
+  *  File to write
+  * @param testnum
+  *  Number of the test that was run
+  * @param width, height, bpp, backbuffers, apiver, fullscreen
+  *  Settings the test was run with
+  * @param benchmark
+  *  Results of the run
+  * @return
+  *  TRUE if the file was written
+  */
+static BOOL WriteBenchmarkResults(LPCTSTR path, int testnum, int width, int height, int bpp, int backbuffers,
+	int apiver, bool fullscreen, DXGLBENCHMARK *benchmark)
+{
+	static const double percentiles[] = { 50.0, 90.0, 95.0, 99.0 };
+	char glstrings[3][256];
+	char name[256];
+	FILE *file;
+	double total = 0.0;
+	DWORD index;
+	DWORD i;
+	GetGLStrings(glstrings);
+#ifdef _UNICODE
+	WideCharToMultiByte(CP_UTF8, 0, Tests[testnum].name, -1, name, 256, NULL, NULL);
+	name[255] = 0;
+#else
+	strncpy(name, Tests[testnum].name, 255);
+	name[255] = 0;
+#endif
+	file = _tfopen(path, _T("w"));
+	if (!file) return FALSE;
+	fprintf(file, "{\n\t\"test\": %d,\n\t\"name\": ", testnum);
+	WriteJSONString(file, name);
+	fprintf(file, ",\n\t\"width\": %d,\n\t\"height\": %d,\n\t\"bpp\": %d,\n\t\"fullscreen\": %s,\n"
+		"\t\"backbuffers\": %d,\n\t\"api\": %d,\n\t\"dxgl\": %s,\n\t\"renderer\": ", width, height, bpp,
+		fullscreen ? "true" : "false", backbuffers, apiver, IsDXGLDDraw ? "true" : "false");
+	WriteJSONString(file, glstrings[0]);
+	fprintf(file, ",\n\t\"vendor\": ");
+	WriteJSONString(file, glstrings[1]);
+	fprintf(file, ",\n\t\"version\": ");
+	WriteJSONString(file, glstrings[2]);
+	fprintf(file, ",\n\t\"frames\": %u", benchmark->framesdrawn);
+	if (benchmark->framesdrawn)
+	{
+		for (i = 0; i < benchmark->framesdrawn; i++) total += benchmark->frametimes[i];
+		qsort(benchmark->frametimes, benchmark->framesdrawn, sizeof(double), CompareFrameTimes);
+		fprintf(file, ",\n\t\"fps\": %.3f,\n\t\"frametime_ms\": {\n\t\t\"average\": %.4f,\n\t\t\"min\": %.4f",
+			(double)benchmark->framesdrawn * 1000.0 / total, total / (double)benchmark->framesdrawn,
+			benchmark->frametimes[0]);
+		// Nearest-rank percentiles
+		for (i = 0; i < sizeof(percentiles) / sizeof(double); i++)
+		{
+			index = (DWORD)ceil(percentiles[i] * (double)benchmark->framesdrawn / 100.0);
+			if (index) index--;
+			fprintf(file, ",\n\t\t\"p%.0f\": %.4f", percentiles[i], benchmark->frametimes[index]);
+		}
+		fprintf(file, ",\n\t\t\"max\": %.4f\n\t}", benchmark->frametimes[benchmark->framesdrawn - 1]);
+		if (testnum == 20)
+			fprintf(file, ",\n\t\"blts_per_frame\": %u,\n\t\"blts_per_second\": %.0f", benchmark->stressblts,
+				(double)benchmark->stressblts * (double)benchmark->framesdrawn * 1000.0 / total);
+		if ((testnum == 21) && benchmark->scaledraws)
+		{
+			fprintf(file, ",\n\t\"draw_path\": \"%s\",\n\t\"vertex_format\": \"%s\",\n\t\"lights\": %u,\n"
+				"\t\"texture_stages\": %u,\n\t\"fog\": \"%s\",\n\t\"draws_per_frame\": %u,\n"
+				"\t\"draws_per_second\": %.0f,\n\t\"cpu_us_per_draw\": %.4f", ScalePathNames[benchmark->scalepath % SCALE_PATHS],
+				ScaleFormatNames[benchmark->scalefvf % SCALE_FORMATS], benchmark->scalelights, benchmark->scalestages,
+				ScaleFogNames[benchmark->scalefog % SCALE_FOGMODES], benchmark->scalecubes,
+				(double)benchmark->scaledraws * 1000.0 / total, benchmark->scalecpums * 1000.0 / (double)benchmark->scaledraws);
+		}
+	}
+	if (benchmark->hascounters && benchmark->framespresented)
+	{
+		fprintf(file, ",\n\t\"counters\": {\n\t\t\"framessampled\": %u,\n\t\t\"residentbytes\": %u,\n\t\t\"perframe\": {",
+			benchmark->framespresented, benchmark->last.dwResidentBytes);
+		for (i = 0; i < sizeof(BenchmarkCounters) / sizeof(BENCHMARK_COUNTER); i++)
+			fprintf(file, "%s\n\t\t\t\"%s\": %.3f", i ? "," : "", BenchmarkCounters[i].name,
+				(double)benchmark->totals[BenchmarkCounters[i].index] / (double)benchmark->framespresented);
+		fprintf(file, "\n\t\t},\n\t\t\"total\": {");
+		for (i = 0; i < sizeof(BenchmarkCounters) / sizeof(BENCHMARK_COUNTER); i++)
+			fprintf(file, "%s\n\t\t\t\"%s\": %I64u", i ? "," : "", BenchmarkCounters[i].name,
+				benchmark->totals[BenchmarkCounters[i].index]);
+		fprintf(file, "\n\t\t}\n\t}");
+	}
+	else fprintf(file, ",\n\t\"counters\": null");
+	if (benchmark->refdir)
+	{
+#ifdef _UNICODE
+		WideCharToMultiByte(CP_UTF8, 0, benchmark->refdir, -1, name, 256, NULL, NULL);
+		name[255] = 0;
+#else
+		strncpy(name, benchmark->refdir, 255);
+		name[255] = 0;
+#endif
+		fprintf(file, ",\n\t\"reference\": {\n\t\t\"directory\": ");
+		WriteJSONString(file, name);
+		fprintf(file, ",\n\t\t\"mode\": \"%s\",\n\t\t\"tolerance\": %u,\n\t\t\"checked\": %u,\n"
+			"\t\t\"failed\": %u,\n\t\t\"first_failed\": %u,\n\t\t\"max_difference\": %u\n\t}",
+			benchmark->record ? "record" : "compare", benchmark->tolerance, benchmark->frameschecked,
+			benchmark->framesfailed, benchmark->firstfailed, benchmark->maxdifference);
+	}
+	fprintf(file, "\n}\n");
+	fclose(file);
+	return TRUE;
+}
+
+/**
+  * Runs a test as a benchmark from the command line and writes the results
+  * to a JSON file.  The arguments are name=value pairs separated by spaces:
+  * test (required), frames (default 1000), width, height and bpp (default
+  * 640x480x32), api (default the highest the test supports), buffers
+  * (default 1 in fullscreen), fullscreen (flag), blts (blts per frame of
+  * the Blt stress test, default 1000), cubes, path, fvf, lights, stages and
+  * fog (settings of the draw call scaling test, default 1024 cubes and 0 for
+  * the rest) and output (default dxgl-benchmark.json in the directory of
+  * dxglcfg).
+  * To check the output, reference names a directory of reference images.
+  * Every check-th frame (default 60, 0 for only the last frame) is compared
+  * to its image, and matches if no color channel differs by more than
+  * tolerance (default 2).  With the record flag the frames are written to
+  * the directory as the new reference images instead.  Animations and random
+  * patterns are then the same on every run.
+  * @param args
+  *  Command line after the benchmark command
+  * @return
+  *  0 if the benchmark ran, 1 if the arguments are invalid, 2 if the
+  *  results could not be written, 3 if a frame did not match its reference
+  */
+int RunDXGLBenchmark(LPCTSTR args)
+{
+	TCHAR *argcopy;
+	TCHAR *token;
+	TCHAR *value;
+	TCHAR output[MAX_PATH + 1];
+	TCHAR *path_truncate;
+	DXGLBENCHMARK benchmark;
+	int testnum = -1;
+	int width = 640;
+	int height = 480;
+	int bpp = 32;
+	int apiver = 0;
+	int backbuffers = -1;
+	bool fullscreen = false;
+	HMODULE mod_ddraw;
+	int ret;
+	TCHAR refdir[MAX_PATH + 1];
+	ZeroMemory(&benchmark, sizeof(DXGLBENCHMARK));
+	benchmark.frames = 1000;
+	benchmark.checkinterval = 60;
+	benchmark.tolerance = 2;
+	GetModuleFileName(NULL, output, MAX_PATH);
+	output[MAX_PATH] = 0;
+	path_truncate = _tcsrchr(output, _T('\\'));
+	if (path_truncate) *(path_truncate + 1) = 0;
+	_tcscat(output, _T("dxgl-benchmark.json"));
+	argcopy = _tcsdup(args);
+	if (!argcopy) return 1;
+	for (token = _tcstok(argcopy, _T(" \t")); token; token = _tcstok(NULL, _T(" \t")))
+	{
+		value = _tcschr(token, _T('='));
+		if (value) *value++ = 0;
+		if (!_tcsicmp(token, _T("fullscreen"))) fullscreen = true;
+		else if (!_tcsicmp(token, _T("record"))) benchmark.record = TRUE;
+		else if (!value) continue;
+		else if (!_tcsicmp(token, _T("test"))) testnum = _ttoi(value);
+		else if (!_tcsicmp(token, _T("frames"))) benchmark.frames = _ttoi(value);
+		else if (!_tcsicmp(token, _T("width"))) width = _ttoi(value);
+		else if (!_tcsicmp(token, _T("height"))) height = _ttoi(value);
+		else if (!_tcsicmp(token, _T("bpp"))) bpp = _ttoi(value);
+		else if (!_tcsicmp(token, _T("api"))) apiver = _ttoi(value);
+		else if (!_tcsicmp(token, _T("buffers"))) backbuffers = _ttoi(value);
+		else if (!_tcsicmp(token, _T("blts"))) benchmark.stressblts = _ttoi(value);
+		else if (!_tcsicmp(token, _T("cubes"))) benchmark.scalecubes = _ttoi(value);
+		else if (!_tcsicmp(token, _T("path"))) benchmark.scalepath = _ttoi(value);
+		else if (!_tcsicmp(token, _T("fvf"))) benchmark.scalefvf = _ttoi(value);
+		else if (!_tcsicmp(token, _T("lights"))) benchmark.scalelights = _ttoi(value);
+		else if (!_tcsicmp(token, _T("stages"))) benchmark.scalestages = _ttoi(value);
+		else if (!_tcsicmp(token, _T("fog"))) benchmark.scalefog = _ttoi(value);
+		else if (!_tcsicmp(token, _T("check"))) benchmark.checkinterval = _ttoi(value);
+		else if (!_tcsicmp(token, _T("tolerance"))) benchmark.tolerance = _ttoi(value);
+		else if (!_tcsicmp(token, _T("reference")))
+		{
+			_tcsncpy(refdir, value, MAX_PATH);
+			refdir[MAX_PATH] = 0;
+			benchmark.refdir = refdir;
+		}
+		else if (!_tcsicmp(token, _T("output")))
+		{
+			_tcsncpy(output, value, MAX_PATH);
+			output[MAX_PATH] = 0;
+		}
+	}
+	free(argcopy);
+	if ((testnum < 0) || (testnum >= numtests) || !CanBenchmarkTest(testnum)) return 1;
+	if (!benchmark.frames || (width <= 0) || (height <= 0)) return 1;
+	if (benchmark.record && !benchmark.refdir) return 1;
+	if (benchmark.record) CreateDirectory(refdir, NULL);
+	if ((apiver < Tests[testnum].minver) || (apiver > Tests[testnum].maxver)) apiver = Tests[testnum].maxver;
+	if (backbuffers < 0) backbuffers = 1;
+	if (backbuffers < Tests[testnum].buffermin) backbuffers = Tests[testnum].buffermin;
+	if (backbuffers > Tests[testnum].buffermax) backbuffers = Tests[testnum].buffermax;
+	if (!fullscreen) backbuffers = 0;
+	benchmark.frametimes = (double*)malloc(benchmark.frames * sizeof(double));
+	if (!benchmark.frametimes) return 1;
+	mod_ddraw = LoadLibrary(_T("ddraw.dll"));
+	if (mod_ddraw) IsDXGLDDraw = (BOOL(WINAPI*)())GetProcAddress(mod_ddraw, "IsDXGLDDraw");
+	RunDXGLTest(testnum, width, height, bpp, 0, backbuffers, apiver, 0, 0, Tests[testnum].defaultfps,
+		fullscreen, false, Tests[testnum].is3d, FALSE, NULL, &benchmark);
+	if (!WriteBenchmarkResults(output, testnum, width, height, bpp, backbuffers, apiver, fullscreen, &benchmark)) ret = 2;
+	else if (benchmark.framesfailed) ret = 3;
+	else ret = 0;
+	if (mod_ddraw) FreeLibrary(mod_ddraw);
+	free(benchmark.frametimes);
+	return ret;
+}
@@ -22,3 +22,4 @@
 void ResetModeList(HWND hWnd);
 INT_PTR CALLBACK TestTabCallback(HWND hWnd, UINT Msg, WPARAM wParam, LPARAM lParam);
 INT_PTR CALLBACK AboutTabCallback(HWND hWnd, UINT Msg, WPARAM wParam, LPARAM lParam);
+int RunDXGLBenchmark(LPCTSTR args);
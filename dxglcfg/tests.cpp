@@ -54,7 +54,7 @@ static HWND hWnd;
 static HWND hDlg = NULL;
 static int testnum;
 static unsigned int randnum;
-static int testtypes[] = {0,1,0,1,0,1,0,0,-1,1,0,0,0,0,0,0,0,0,2,0};
+static int testtypes[] = {0,1,0,1,0,1,0,0,-1,1,0,0,0,0,0,0,0,0,2,0,1,1};
 static DWORD counter;
 static DWORD hotspotx,hotspoty;
 static int srcformat = 0;
@@ -73,6 +73,45 @@ static LONG_PTR exstyle;
 static HANDLE testthread;
 static HMENU hmenu = NULL;
 static LPARAM windowpos, windowsize;
+static DWORD flipflags = DDFLIP_WAIT;
+static DXGLBENCHMARK *currentbenchmark = NULL;
+
+// Blt stress test
+#define STRESS_MINBLTS 100
+#define STRESS_MAXBLTS 100000
+#define STRESS_DEFAULTBLTS 1000
+#define STRESS_BATCHSIZE 64
+static DWORD stressblts = STRESS_DEFAULTBLTS;
+static POINT *stresspos = NULL;
+static LPDIRECTDRAWCLIPPER stressclipper = NULL;
+static BOOL stressbatch = TRUE;  // Cleared if BltBatch is not supported
+static LONGLONG stressstart;
+static DWORD stressframes;
+static ULONGLONG stressdone;
+static TCHAR stressstatus[128];
+
+// Draw call scaling test
+#define SCALE_MINCUBES 16
+#define SCALE_MAXCUBES 16384
+#define SCALE_DEFAULTCUBES 1024
+const char *const ScalePathNames[SCALE_PATHS] = { "DrawPrimitive", "DrawIndexedPrimitive",
+	"DrawIndexedPrimitiveStrided", "DrawIndexedPrimitiveVB", "ApplyStateBlock+DrawIndexedPrimitiveVB" };
+const char *const ScaleFormatNames[SCALE_FORMATS] = { "D3DVERTEX", "D3DLVERTEX", "XYZ|NORMAL|DIFFUSE|SPECULAR|TEX1" };
+const char *const ScaleFogNames[SCALE_FOGMODES] = { "none", "vertex linear", "table linear", "table exp", "table exp2" };
+static DWORD scalecubes = SCALE_DEFAULTCUBES;
+static DWORD scalepath, scalefvf, scalelights, scalestages, scalefog;
+static BOOL scaledirty;  // Settings changed since they were last applied to the device
+static LPDIRECT3DVERTEXBUFFER7 scalevb[SCALE_FORMATS] = { NULL,NULL,NULL };
+static BYTE *scalelist[SCALE_FORMATS] = { NULL,NULL,NULL };  // Cube expanded to a triangle list for DrawPrimitive
+static DWORD scaleblocks[2];
+static D3DMATERIAL7 scalematerials[2];
+static LONGLONG scalestart;
+static DWORD scaleframes;
+static DWORD scaledraws;  // Draws and CPU time since the status was last updated
+static LONGLONG scaletime;
+static ULONGLONG scaletotaldraws;  // Draws and CPU time since the test started
+static LONGLONG scaletotaltime;
+static TCHAR scalestatus[2][160];
 
 #define FVF_COLORVERTEX (D3DFVF_VERTEX | D3DFVF_DIFFUSE | D3DFVF_SPECULAR)
 struct COLORVERTEX
@@ -261,8 +300,37 @@ LRESULT CALLBACK DDWndProc(HWND hWnd, UINT Msg, WPARAM wParam, LPARAM lParam)
 				textures[i] = NULL;
 			}
 		}
+		if (stressclipper)
+		{
+			stressclipper->Release();
+			stressclipper = NULL;
+		}
+		if (stresspos)
+		{
+			free(stresspos);
+			stresspos = NULL;
+		}
+		for (int i = 0; i < SCALE_FORMATS; i++)
+		{
+			if (scalevb[i])
+			{
+				scalevb[i]->Release();
+				scalevb[i] = NULL;
+			}
+			if (scalelist[i])
+			{
+				free(scalelist[i]);
+				scalelist[i] = NULL;
+			}
+		}
 		if (d3d7dev)
 		{
+			if (testnum == 21)
+			{
+				if (scaleblocks[0]) d3d7dev->DeleteStateBlock(scaleblocks[0]);
+				if (scaleblocks[1]) d3d7dev->DeleteStateBlock(scaleblocks[1]);
+				scaleblocks[0] = scaleblocks[1] = 0;
+			}
 			d3d7dev->Release();
 			d3d7dev = NULL;
 		}
@@ -339,6 +407,56 @@ LRESULT CALLBACK DDWndProc(HWND hWnd, UINT Msg, WPARAM wParam, LPARAM lParam)
 			DestroyWindow(hWnd);
 			break;
 		}
+		if (testnum == 20)
+		{
+			switch (wParam)
+			{
+			case VK_SPACE:  // Show/hide HUD
+				showhud = !showhud;
+				break;
+			case VK_UP:  // Double blts per frame
+				if (stressblts < STRESS_MAXBLTS) stressblts *= 2;
+				if (stressblts > STRESS_MAXBLTS) stressblts = STRESS_MAXBLTS;
+				break;
+			case VK_DOWN:  // Halve blts per frame
+				if (stressblts > STRESS_MINBLTS) stressblts /= 2;
+				if (stressblts < STRESS_MINBLTS) stressblts = STRESS_MINBLTS;
+				break;
+			}
+		}
+		if (testnum == 21)
+		{
+			switch (wParam)
+			{
+			case VK_SPACE:  // Show/hide HUD
+				showhud = !showhud;
+				break;
+			case VK_UP:  // Double cubes
+				if (scalecubes < SCALE_MAXCUBES) scalecubes *= 2;
+				if (scalecubes > SCALE_MAXCUBES) scalecubes = SCALE_MAXCUBES;
+				break;
+			case VK_DOWN:  // Halve cubes
+				if (scalecubes > SCALE_MINCUBES) scalecubes /= 2;
+				if (scalecubes < SCALE_MINCUBES) scalecubes = SCALE_MINCUBES;
+				break;
+			case 'P':  // Next draw path
+				scalepath = (scalepath + 1) % SCALE_PATHS;
+				break;
+			case 'F':  // Next vertex format
+				scalefvf = (scalefvf + 1) % SCALE_FORMATS;
+				break;
+			case 'L':  // Next light count
+				scalelights = (scalelights + 1) % 9;
+				break;
+			case 'T':  // Next texture stage count
+				scalestages = (scalestages + 1) % 9;
+				break;
+			case 'G':  // Next fog mode
+				scalefog = (scalefog + 1) % SCALE_FOGMODES;
+				break;
+			}
+			scaledirty = TRUE;
+		}
 		if (testtypes[testnum] == 2)
 		{
 			if (testnum == 18)
@@ -487,14 +605,384 @@ INT_PTR CALLBACK VertexShader7Proc(HWND hWnd, UINT Msg, WPARAM wParam, LPARAM lP
 INT_PTR CALLBACK WindowStyleProc(HWND hWnd, UINT Msg, WPARAM wParam, LPARAM lParam);
 DWORD WINAPI WindowStyleTestThread(LPVOID param);
 
+/**
+  * Gets the time the animations of 3D tests are based on.  Benchmarks that
+  * check their output step it by one frame at the test's frame rate, so
+  * each frame looks the same on every run.
+  * @return
+  *  Time in seconds
+  */
+static float GetTestTime()
+{
+	if (currentbenchmark && currentbenchmark->refdir)
+		return (float)currentbenchmark->framesdrawn / (float)fps;
+	return (float)clock() / (float)CLOCKS_PER_SEC;
+}
+
+/**
+  * Scales the bits of a pixel selected by a mask to a byte.
+  */
+static BYTE MaskToByte(DWORD pixel, DWORD mask)
+{
+	DWORD shift = 0;
+	DWORD max;
+	if (!mask) return 0;
+	while (!(mask & 1))
+	{
+		mask >>= 1;
+		shift++;
+	}
+	max = mask;
+	return (BYTE)((((pixel >> shift) & mask) * 255 + (max / 2)) / max);
+}
+
+/**
+  * Reads the frame a test last showed, from the front buffer in fullscreen
+  * and from the surface the test draws to in a window.
+  * @param outwidth, outheight
+  *  Receive the size of the frame
+  * @return
+  *  Top-down 24-bit BGR rows padded to four bytes like a BMP, to be freed
+  *  with free, or NULL if the frame could not be read
+  */
+static BYTE *ReadTestFrame(DWORD *outwidth, DWORD *outheight)
+{
+	MultiDirectDrawSurface *surface = fullscreen ? ddsurface : ddsrender;
+	DDSURFACEDESC2 ddsd;
+	PALETTEENTRY entries[256];
+	DWORD x, y, pixel, pitch;
+	DWORD bits, pixelmask;
+	BYTE *row;
+	BYTE *out;
+	BYTE *dest;
+	if (!surface) return NULL;
+	ZeroMemory(&ddsd, sizeof(DDSURFACEDESC2));
+	if (ddver > 3) ddsd.dwSize = sizeof(DDSURFACEDESC2);
+	else ddsd.dwSize = sizeof(DDSURFACEDESC);
+	if (FAILED(surface->Lock(NULL, &ddsd, DDLOCK_READONLY | DDLOCK_WAIT, NULL))) return NULL;
+	bits = ddsd.ddpfPixelFormat.dwRGBBitCount;
+	if (bits <= 8)
+	{
+		// Without a palette the indices are shown as shades of gray
+		if (!pal || FAILED(pal->GetEntries(0, 0, 1 << bits, entries)))
+		{
+			for (x = 0; x < (DWORD)(1 << bits); x++)
+				entries[x].peRed = entries[x].peGreen = entries[x].peBlue = (BYTE)(x * 255 / ((1 << bits) - 1));
+		}
+	}
+	pitch = (ddsd.dwWidth * 3 + 3) & ~3;
+	out = (BYTE*)malloc(pitch * ddsd.dwHeight);
+	if (!out)
+	{
+		surface->Unlock(NULL);
+		return NULL;
+	}
+	ZeroMemory(out, pitch * ddsd.dwHeight);
+	pixelmask = (bits >= 32) ? 0xFFFFFFFF : ((1 << bits) - 1);
+	for (y = 0; y < ddsd.dwHeight; y++)
+	{
+		row = (BYTE*)ddsd.lpSurface + (y * ddsd.lPitch);
+		dest = out + (y * pitch);
+		for (x = 0; x < ddsd.dwWidth; x++)
+		{
+			if (bits < 8) pixel = (row[(x * bits) / 8] >> (8 - bits - ((x * bits) & 7))) & pixelmask;
+			else if (bits == 24) pixel = row[x * 3] | (row[x * 3 + 1] << 8) | (row[x * 3 + 2] << 16);
+			else pixel = (*(DWORD*)(row + (x * (bits / 8)))) & pixelmask;
+			if (bits <= 8)
+			{
+				dest[x * 3] = entries[pixel].peBlue;
+				dest[x * 3 + 1] = entries[pixel].peGreen;
+				dest[x * 3 + 2] = entries[pixel].peRed;
+			}
+			else
+			{
+				dest[x * 3] = MaskToByte(pixel, ddsd.ddpfPixelFormat.dwBBitMask);
+				dest[x * 3 + 1] = MaskToByte(pixel, ddsd.ddpfPixelFormat.dwGBitMask);
+				dest[x * 3 + 2] = MaskToByte(pixel, ddsd.ddpfPixelFormat.dwRBitMask);
+			}
+		}
+	}
+	surface->Unlock(NULL);
+	*outwidth = ddsd.dwWidth;
+	*outheight = ddsd.dwHeight;
+	return out;
+}
+
+/**
+  * Writes a frame read by ReadTestFrame to a top-down 24-bit BMP file.
+  * @return
+  *  TRUE if the file was written
+  */
+static BOOL WriteTestFrame(LPCTSTR path, const BYTE *frame, DWORD width, DWORD height)
+{
+	BITMAPFILEHEADER file;
+	BITMAPINFOHEADER info;
+	DWORD size = ((width * 3 + 3) & ~3) * height;
+	DWORD written;
+	HANDLE handle;
+	BOOL ret;
+	ZeroMemory(&file, sizeof(BITMAPFILEHEADER));
+	ZeroMemory(&info, sizeof(BITMAPINFOHEADER));
+	file.bfType = 0x4D42;  // BM
+	file.bfOffBits = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER);
+	file.bfSize = file.bfOffBits + size;
+	info.biSize = sizeof(BITMAPINFOHEADER);
+	info.biWidth = width;
+	info.biHeight = -(LONG)height;
+	info.biPlanes = 1;
+	info.biBitCount = 24;
+	info.biCompression = BI_RGB;
+	info.biSizeImage = size;
+	handle = CreateFile(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (handle == INVALID_HANDLE_VALUE) return FALSE;
+	ret = WriteFile(handle, &file, sizeof(BITMAPFILEHEADER), &written, NULL) &&
+		WriteFile(handle, &info, sizeof(BITMAPINFOHEADER), &written, NULL) &&
+		WriteFile(handle, frame, size, &written, NULL);
+	CloseHandle(handle);
+	return ret;
+}
+
+/**
+  * Compares a frame read by ReadTestFrame to a 24-bit BMP file.
+  * @return
+  *  Largest difference of a color channel, or 256 if the file can't be read
+  *  or has a different size
+  */
+static DWORD CompareTestFrame(LPCTSTR path, const BYTE *frame, DWORD width, DWORD height)
+{
+	BITMAPFILEHEADER file;
+	BITMAPINFOHEADER info;
+	DWORD pitch = (width * 3 + 3) & ~3;
+	DWORD read;
+	DWORD x, y, diff;
+	DWORD maxdiff = 0;
+	LONG row;
+	BYTE *ref;
+	const BYTE *src;
+	HANDLE handle = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (handle == INVALID_HANDLE_VALUE) return 256;
+	if (!ReadFile(handle, &file, sizeof(BITMAPFILEHEADER), &read, NULL) || (read != sizeof(BITMAPFILEHEADER)) ||
+		!ReadFile(handle, &info, sizeof(BITMAPINFOHEADER), &read, NULL) || (read != sizeof(BITMAPINFOHEADER)) ||
+		(file.bfType != 0x4D42) || (info.biBitCount != 24) || (info.biCompression != BI_RGB) ||
+		(info.biWidth != (LONG)width) || ((DWORD)abs(info.biHeight) != height))
+	{
+		CloseHandle(handle);
+		return 256;
+	}
+	ref = (BYTE*)malloc(pitch * height);
+	if (!ref)
+	{
+		CloseHandle(handle);
+		return 256;
+	}
+	SetFilePointer(handle, file.bfOffBits, NULL, FILE_BEGIN);
+	if (!ReadFile(handle, ref, pitch * height, &read, NULL) || (read != pitch * height)) maxdiff = 256;
+	CloseHandle(handle);
+	for (y = 0; (y < height) && (maxdiff < 256); y++)
+	{
+		// Bitmaps with a positive height are stored bottom-up
+		row = (info.biHeight < 0) ? y : (height - 1 - y);
+		src = frame + (y * pitch);
+		for (x = 0; x < width * 3; x++)
+		{
+			diff = abs((int)src[x] - (int)ref[(row * pitch) + x]);
+			if (diff > maxdiff) maxdiff = diff;
+		}
+	}
+	free(ref);
+	return maxdiff;
+}
+
+/**
+  * Records or checks the frame a benchmark just drew against its reference
+  * image in benchmark->refdir.
+  * @param benchmark
+  *  Benchmark being run, with framesdrawn not yet counting the frame
+  */
+static void CheckBenchmarkFrame(DXGLBENCHMARK *benchmark)
+{
+	TCHAR path[MAX_PATH + 1];
+	BYTE *frame;
+	DWORD framewidth, frameheight;
+	DWORD diff = 256;
+	_sntprintf(path, MAX_PATH, _T("%s\\test%d_api%d_%dx%dx%d_%05u.bmp"), benchmark->refdir, testnum, d3dver,
+		width, height, bpp, benchmark->framesdrawn + 1);
+	path[MAX_PATH] = 0;
+	benchmark->frameschecked++;
+	frame = ReadTestFrame(&framewidth, &frameheight);
+	if (frame)
+	{
+		if (benchmark->record) diff = WriteTestFrame(path, frame, framewidth, frameheight) ? 0 : 256;
+		else diff = CompareTestFrame(path, frame, framewidth, frameheight);
+		free(frame);
+	}
+	if ((diff < 256) && (diff > benchmark->maxdifference)) benchmark->maxdifference = diff;
+	if (diff > benchmark->tolerance)
+	{
+		if (!benchmark->framesfailed) benchmark->firstfailed = benchmark->framesdrawn + 1;
+		benchmark->framesfailed++;
+	}
+}
+
+/**
+  * Checks if a test can be run as a benchmark.  Interactive tests and tests
+  * driven by the mouse can't.
+  * @param testnum
+  *  Number of the test
+  * @return
+  *  TRUE if the test draws frames on its own
+  */
+BOOL CanBenchmarkTest(int testnum)
+{
+	if ((testnum < 0) || (testnum >= (int)(sizeof(testtypes) / sizeof(int)))) return FALSE;
+	switch (testnum)
+	{
+	case 6: // Mouse pointer test
+	case 14: // Texture Stage shaders
+	case 15: // Vertex shaders
+	case 16: // SetCursorPos test
+	case 19: // Window API test
+		return FALSE;
+	default:
+		return (testtypes[testnum] == 0) || (testtypes[testnum] == 1);
+	}
+}
+
+/**
+  * Reads the DXGL performance counters of the last presented frame.
+  * @param shared
+  *  Shared memory of the counters, or NULL to ask the Direct3D device
+  * @param counters
+  *  Structure to receive the counters
+  * @return
+  *  TRUE if the counters were read
+  */
+static BOOL ReadBenchmarkCounters(const DXGL_PERFSHARED *shared, DXGL_PERFCOUNTERS *counters)
+{
+	LONG sequence;
+	if (shared)
+	{
+		// The view is read-only, so the sequence is read without interlocked operations
+		do
+		{
+			sequence = shared->sequence;
+			MemoryBarrier();
+			memcpy(counters, (const void*)&shared->last, sizeof(DXGL_PERFCOUNTERS));
+			MemoryBarrier();
+		} while ((sequence & 1) || (shared->sequence != sequence));
+		return TRUE;
+	}
+	if (!d3d7dev) return FALSE;
+	counters->dwSize = sizeof(DXGL_PERFCOUNTERS);
+	return d3d7dev->GetInfo(D3DDEVINFOID_DXGLPERF, counters, sizeof(DXGL_PERFCOUNTERS)) == D3D_OK;
+}
+
+/**
+  * Adds the counters of a presented frame to the totals of a benchmark.
+  * @param benchmark
+  *  Benchmark being run
+  * @param counters
+  *  Counters of the frame
+  */
+static void AddBenchmarkCounters(DXGLBENCHMARK *benchmark, const DXGL_PERFCOUNTERS *counters)
+{
+	const DWORD *values = (const DWORD*)counters;
+	DWORD i;
+	for (i = 0; i < sizeof(DXGL_PERFCOUNTERS) / sizeof(DWORD); i++)
+		benchmark->totals[i] += values[i];
+	memcpy(&benchmark->last, counters, sizeof(DXGL_PERFCOUNTERS));
+	benchmark->framespresented++;
+}
+
+/**
+  * Draws the frames of a benchmark as fast as possible, without waiting for
+  * vertical sync, and times each one.
+  * @param benchmark
+  *  Benchmark to run
+  * @return
+  *  TRUE if the test window was closed during the run
+  */
+static BOOL RunBenchmarkFrames(DXGLBENCHMARK *benchmark)
+{
+	TCHAR name[64];
+	HANDLE mapping;
+	const DXGL_PERFSHARED *shared = NULL;
+	DXGL_PERFCOUNTERS counters;
+	DWORD lastframe;
+	LARGE_INTEGER frequency, start, end;
+	MSG Msg;
+	BOOL quit = FALSE;
+	_sntprintf(name, 63, DXGLPERF_SHAREDNAME, GetCurrentProcessId());
+	name[63] = 0;
+	mapping = OpenFileMapping(FILE_MAP_READ, FALSE, name);
+	if (mapping)
+	{
+		shared = (const DXGL_PERFSHARED*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, sizeof(DXGL_PERFSHARED));
+		if (shared && ((shared->dwSize < sizeof(DXGL_PERFSHARED)) || (shared->dwVersion != DXGLPERF_VERSION)))
+		{
+			UnmapViewOfFile(shared);
+			shared = NULL;
+		}
+	}
+	ZeroMemory(&counters, sizeof(DXGL_PERFCOUNTERS));
+	benchmark->hascounters = ReadBenchmarkCounters(shared, &counters);
+	lastframe = counters.dwFrame;
+	// RunTestTimed does nothing while the timer is stopped
+	stoptimer = false;
+	flipflags = DDFLIP_WAIT | DDFLIP_NOVSYNC;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+	for (benchmark->framesdrawn = 0; benchmark->framesdrawn < benchmark->frames; benchmark->framesdrawn++)
+	{
+		while (PeekMessage(&Msg, NULL, 0, 0, PM_REMOVE))
+		{
+			if (Msg.message == WM_QUIT)
+			{
+				quit = TRUE;
+				break;
+			}
+			TranslateMessage(&Msg);
+			DispatchMessage(&Msg);
+		}
+		if (quit) break;
+		if (testtypes[testnum] == 1) RunTestLooped(testnum);
+		else RunTestTimed(testnum);
+		QueryPerformanceCounter(&end);
+		benchmark->frametimes[benchmark->framesdrawn] =
+			(double)(end.QuadPart - start.QuadPart) * 1000.0 / (double)frequency.QuadPart;
+		// Reading back the frame is left out of the frame times
+		if (benchmark->refdir && (benchmark->checkinterval ? !((benchmark->framesdrawn + 1) % benchmark->checkinterval) :
+			(benchmark->framesdrawn + 1 == benchmark->frames)))
+		{
+			CheckBenchmarkFrame(benchmark);
+			QueryPerformanceCounter(&end);
+		}
+		start = end;
+		// Frames presented between two reads are missed; the totals cover the frames that were read
+		if (benchmark->hascounters && ReadBenchmarkCounters(shared, &counters) && (counters.dwFrame != lastframe))
+		{
+			lastframe = counters.dwFrame;
+			AddBenchmarkCounters(benchmark, &counters);
+		}
+	}
+	stoptimer = true;
+	flipflags = DDFLIP_WAIT;
+	if (shared) UnmapViewOfFile(shared);
+	if (mapping) CloseHandle(mapping);
+	return quit;
+}
+
 void RunDXGLTest(int testnum, int width, int height, int bpp, int refresh, int backbuffers, int apiver,
-	int filter, int msaa, double fps, bool fullscreen, bool resizable, BOOL is3d, BOOL softd3d, HWND parent)
+	int filter, int msaa, double fps, bool fullscreen, bool resizable, BOOL is3d, BOOL softd3d, HWND parent,
+	DXGLBENCHMARK *benchmark)
 {
 	if (in_dxgltest)
 	{
 		MessageBox(parent, _T("Please close the current test before beginning a new one."), _T("Test already running"), MB_OK | MB_ICONWARNING);
 		return;
 	}
+	if (benchmark && !CanBenchmarkTest(testnum)) return;
+	currentbenchmark = benchmark;
 	in_dxgltest = TRUE;
 	ZeroMemory(sprites,16*sizeof(DDSPRITE));
 	if(testnum == 14)
@@ -513,7 +1001,13 @@ void RunDXGLTest(int testnum, int width, int height, int bpp, int refresh, int b
 	DDPIXELFORMAT ddpfz;
 	BOOL done = false;
 	::testnum = testnum;
-	randnum = (unsigned int)time(NULL);
+	// Checked frames must have the same random patterns on every run
+	if (benchmark && benchmark->refdir)
+	{
+		randnum = 1;
+		srand(1);
+	}
+	else randnum = (unsigned int)time(NULL);
 	ZeroMemory(&ddsd,sizeof(DDSURFACEDESC2));
 	ZeroMemory(textures,8*sizeof(MultiDirectDrawSurface*));
 	if(apiver > 3) ddsd.dwSize = sizeof(DDSURFACEDESC2);
@@ -697,7 +1191,19 @@ void RunDXGLTest(int testnum, int width, int height, int bpp, int refresh, int b
 	}
 	InitTest(testnum);
 	if(!fullscreen) SendMessage(hWnd,WM_PAINT,0,0);
-	if(testtypes[testnum] == 1)
+	if (benchmark)
+	{
+		if (!RunBenchmarkFrames(benchmark))
+		{
+			DestroyWindow(hWnd);
+			while (GetMessage(&Msg, NULL, 0, 0) > 0)
+			{
+				TranslateMessage(&Msg);
+				DispatchMessage(&Msg);
+			}
+		}
+	}
+	else if(testtypes[testnum] == 1)
 	{
 		while(!done)
 		{
@@ -736,6 +1242,21 @@ void RunDXGLTest(int testnum, int width, int height, int bpp, int refresh, int b
 	}
 	UnregisterClass(wndclassname,hinstance);
 	StopTimer();
+	if (benchmark && (testnum == 20)) benchmark->stressblts = stressblts;
+	if (benchmark && (testnum == 21))
+	{
+		LARGE_INTEGER frequency;
+		QueryPerformanceFrequency(&frequency);
+		benchmark->scalecubes = scalecubes;
+		benchmark->scalepath = scalepath;
+		benchmark->scalefvf = scalefvf;
+		benchmark->scalelights = scalelights;
+		benchmark->scalestages = scalestages;
+		benchmark->scalefog = scalefog;
+		benchmark->scaledraws = scaletotaldraws;
+		benchmark->scalecpums = (double)scaletotaltime * 1000.0 / (double)frequency.QuadPart;
+	}
+	currentbenchmark = NULL;
 	in_dxgltest = FALSE;
 }
 
@@ -988,6 +1509,96 @@ void MakeLights()
 	lights[7].dvDirection = D3DVECTOR(-1, -1, -1);
 }
 
+/**
+  * Gets the cube vertices of a vertex format of the draw call scaling test.
+  * @param format
+  *  Index into ScaleFormatNames
+  * @param fvf
+  *  Receives the flexible vertex format code
+  * @param stride
+  *  Receives the size of a vertex in bytes
+  * @return
+  *  Pointer to the vertices made by MakeCube3D
+  */
+static BYTE *ScaleVertexData(DWORD format, DWORD *fvf, DWORD *stride)
+{
+	switch (format)
+	{
+	case 0:
+	default:
+		*fvf = D3DFVF_VERTEX;
+		*stride = sizeof(D3DVERTEX);
+		return (BYTE*)vertices;
+	case 1:
+		*fvf = D3DFVF_LVERTEX;
+		*stride = sizeof(D3DLVERTEX);
+		return (BYTE*)litvertices;
+	case 2:
+		*fvf = FVF_COLORVERTEX;
+		*stride = sizeof(COLORVERTEX);
+		return (BYTE*)colorvertices;
+	}
+}
+
+/**
+  * Sets the lights, texture stages and fog of the draw call scaling test
+  * on the device and restarts its statistics.
+  */
+static void ScaleApplySettings()
+{
+	static const D3DFOGMODE tablemodes[SCALE_FOGMODES] = { D3DFOG_NONE, D3DFOG_NONE, D3DFOG_LINEAR, D3DFOG_EXP, D3DFOG_EXP2 };
+	float fogstart = 9.0f;
+	float fogend = 11.0f;
+	float fogdensity = 0.1f;
+	LARGE_INTEGER now;
+	DWORD i;
+	// D3DLVERTEX has no normals to light
+	d3d7dev->SetRenderState(D3DRENDERSTATE_LIGHTING, (scalelights && (scalefvf != 1)) ? TRUE : FALSE);
+	for (i = 0; i < 8; i++)
+	{
+		d3d7dev->SetLight(i, &lights[i]);
+		d3d7dev->LightEnable(i, (i < scalelights) ? TRUE : FALSE);
+	}
+	for (i = 0; i < 8; i++)
+	{
+		if (i < scalestages)
+		{
+			d3d7dev->SetTexture(i, textures[i & 3] ? (LPDIRECTDRAWSURFACE7)textures[i & 3]->GetSurface() : NULL);
+			d3d7dev->SetTextureStageState(i, D3DTSS_COLOROP, D3DTOP_MODULATE);
+			d3d7dev->SetTextureStageState(i, D3DTSS_COLORARG1, D3DTA_TEXTURE);
+			d3d7dev->SetTextureStageState(i, D3DTSS_COLORARG2, D3DTA_CURRENT);
+			d3d7dev->SetTextureStageState(i, D3DTSS_TEXCOORDINDEX, 0);
+		}
+		else
+		{
+			d3d7dev->SetTexture(i, NULL);
+			if (i) d3d7dev->SetTextureStageState(i, D3DTSS_COLOROP, D3DTOP_DISABLE);
+			else
+			{
+				// Pass the vertex color through when no stage is textured
+				d3d7dev->SetTextureStageState(i, D3DTSS_COLOROP, D3DTOP_SELECTARG2);
+				d3d7dev->SetTextureStageState(i, D3DTSS_COLORARG2, D3DTA_DIFFUSE);
+			}
+		}
+	}
+	d3d7dev->SetRenderState(D3DRENDERSTATE_FOGENABLE, scalefog ? TRUE : FALSE);
+	d3d7dev->SetRenderState(D3DRENDERSTATE_FOGCOLOR, bgcolor);
+	d3d7dev->SetRenderState(D3DRENDERSTATE_FOGVERTEXMODE, (scalefog == 1) ? D3DFOG_LINEAR : D3DFOG_NONE);
+	d3d7dev->SetRenderState(D3DRENDERSTATE_FOGTABLEMODE, tablemodes[scalefog]);
+	d3d7dev->SetRenderState(D3DRENDERSTATE_FOGSTART, *((LPDWORD)(&fogstart)));
+	d3d7dev->SetRenderState(D3DRENDERSTATE_FOGEND, *((LPDWORD)(&fogend)));
+	d3d7dev->SetRenderState(D3DRENDERSTATE_FOGDENSITY, *((LPDWORD)(&fogdensity)));
+	_stprintf(scalestatus[1], _T("%hs, %hs, %u lights, %u stages, fog %hs"), ScalePathNames[scalepath],
+		ScaleFormatNames[scalefvf], scalelights, scalestages, ScaleFogNames[scalefog]);
+	scalestatus[0][0] = 0;
+	scaleframes = 0;
+	scaledraws = 0;
+	scaletime = 0;
+	QueryPerformanceCounter(&now);
+	scalestart = now.QuadPart;
+	scaledirty = FALSE;
+}
+
 static const DDPIXELFORMAT fmt_rgba4444 = { sizeof(DDPIXELFORMAT),DDPF_RGB | DDPF_ALPHAPIXELS,0,16,0xF00,0xF0,0xF,0xF000 };
 static const DDPIXELFORMAT fmt_rgba1555 = { sizeof(DDPIXELFORMAT),DDPF_RGB | DDPF_ALPHAPIXELS,0,16,0x7C00,0x3E0,0x1F,0x8000 };
 static const DDPIXELFORMAT fmt_rgb565 = { sizeof(DDPIXELFORMAT),DDPF_RGB,0,16,0xF800,0x7E0,0x1F,0 };
@@ -1616,6 +2227,147 @@ void InitTest(int test)
 			}
 		}
 		break;
+	case 20: // Blt stress test
+		ddsrender->GetSurfaceDesc(&ddsd);
+		sprites[0].width = sprites[0].height = 64.f;
+		sprites[0].ddsd.dwWidth = sprites[0].ddsd.dwHeight =
+			sprites[0].rect.right = sprites[0].rect.bottom = 64;
+		sprites[0].ddsd.dwFlags = DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH;
+		sprites[0].ddsd.ddsCaps.dwCaps = DDSCAPS_OFFSCREENPLAIN;
+		if (ddver > 3) sprites[0].ddsd.dwSize = sizeof(DDSURFACEDESC2);
+		else sprites[0].ddsd.dwSize = sizeof(DDSURFACEDESC);
+		ddinterface->CreateSurface(&sprites[0].ddsd, &sprites[0].surface, NULL);
+		error = sprites[0].surface->Lock(NULL, &sprites[0].ddsd, DDLOCK_WAIT, NULL);
+		DrawPalette(sprites[0].ddsd, (unsigned char *)sprites[0].ddsd.lpSurface);
+		sprites[0].surface->Unlock(NULL);
+		sprites[0].surface->SetColorKey(DDCKEY_SRCBLT, &ckey);
+		if (backbuffers) ddsrender->GetAttachedSurface(&ddscaps, &temp1);
+		else temp1 = ddsrender;
+		temp1->SetColorKey(DDCKEY_DESTBLT, &ckey);
+		if (backbuffers) temp1->Release();
+		temp1 = NULL;
+		// Clip list with a band down the middle of the surface cut out
+		ddinterface->CreateClipper(0, &stressclipper, NULL);
+		if (stressclipper)
+		{
+			RGNDATA *region = (RGNDATA*)malloc(sizeof(RGNDATAHEADER) + 2 * sizeof(RECT));
+			RECT *cliprects = (RECT*)region->Buffer;
+			region->rdh.dwSize = sizeof(RGNDATAHEADER);
+			region->rdh.iType = RDH_RECTANGLES;
+			region->rdh.nCount = 2;
+			region->rdh.nRgnSize = 2 * sizeof(RECT);
+			SetRect(&region->rdh.rcBound, 0, 0, ddsd.dwWidth, ddsd.dwHeight);
+			SetRect(&cliprects[0], 0, 0, (ddsd.dwWidth / 2) - 16, ddsd.dwHeight);
+			SetRect(&cliprects[1], (ddsd.dwWidth / 2) + 16, 0, ddsd.dwWidth, ddsd.dwHeight);
+			stressclipper->SetClipList(region, 0);
+			free(region);
+		}
+		stresspos = (POINT*)malloc(STRESS_MAXBLTS * sizeof(POINT));
+		for (i = 0; i < STRESS_MAXBLTS; i++)
+		{
+			stresspos[i].x = rand32(randnum) % ((ddsd.dwWidth > 128) ? ddsd.dwWidth - 128 : 1);
+			stresspos[i].y = rand32(randnum) % ((ddsd.dwHeight > 128) ? ddsd.dwHeight - 128 : 1);
+		}
+		if (currentbenchmark && currentbenchmark->stressblts) stressblts = currentbenchmark->stressblts;
+		else stressblts = STRESS_DEFAULTBLTS;
+		if (stressblts < STRESS_MINBLTS) stressblts = STRESS_MINBLTS;
+		if (stressblts > STRESS_MAXBLTS) stressblts = STRESS_MAXBLTS;
+		// The HUD is drawn with GDI, which would skew benchmark results
+		showhud = currentbenchmark ? 0 : 1;
+		stressbatch = TRUE;
+		stressframes = 0;
+		stressdone = 0;
+		stressstatus[0] = 0;
+		QueryPerformanceCounter((LARGE_INTEGER*)&stressstart);
+		counter = 0;
+		break;
+	case 21: // Draw call scaling test
+		if (!d3d7dev) break;
+		MakeCube3D(1.0f, 2);
+		MakeLights();
+		gentexture(fmt_rgba4444, &textures[0], 64, 64, 0);
+		gentexture(fmt_rgba1555, &textures[1], 64, 64, 0);
+		gentexture(fmt_rgb565, &textures[2], 64, 64, 0);
+		gentexture(fmt_rgba8888, &textures[3], 64, 64, 0);
+		// Each vertex format as a triangle list for DrawPrimitive and in a vertex buffer
+		for (i = 0; i < SCALE_FORMATS; i++)
+		{
+			D3DVERTEXBUFFERDESC vbdesc;
+			LPVOID vbdata;
+			DWORD fvf, stride;
+			BYTE *data = ScaleVertexData(i, &fvf, &stride);
+			scalelist[i] = (BYTE*)malloc(numindices * stride);
+			if (scalelist[i])
+			{
+				for (int j = 0; j < numindices; j++)
+					memcpy(scalelist[i] + (j * stride), data + (mesh[j] * stride), stride);
+			}
+			ZeroMemory(&vbdesc, sizeof(D3DVERTEXBUFFERDESC));
+			vbdesc.dwSize = sizeof(D3DVERTEXBUFFERDESC);
+			vbdesc.dwCaps = D3DVBCAPS_WRITEONLY;
+			if (softd3d) vbdesc.dwCaps |= D3DVBCAPS_SYSTEMMEMORY;
+			vbdesc.dwFVF = fvf;
+			vbdesc.dwNumVertices = numpoints;
+			if (SUCCEEDED(d3d7->CreateVertexBuffer(&vbdesc, &scalevb[i], 0)))
+			{
+				if (SUCCEEDED(scalevb[i]->Lock(DDLOCK_WAIT | DDLOCK_WRITEONLY, &vbdata, NULL)))
+				{
+					memcpy(vbdata, data, numpoints * stride);
+					scalevb[i]->Unlock();
+				}
+			}
+		}
+		// Cubes alternate between two materials, set directly or with a state block
+		ZeroMemory(scalematerials, 2 * sizeof(D3DMATERIAL7));
+		for (i = 0; i < 2; i++)
+		{
+			scalematerials[i].ambient.r = scalematerials[i].ambient.g = scalematerials[i].ambient.b = 1.0f;
+			scalematerials[i].diffuse.r = scalematerials[i].diffuse.a = 1.0f;
+			scalematerials[i].diffuse.g = i ? 0.5f : 1.0f;
+			scalematerials[i].diffuse.b = i ? 0.25f : 1.0f;
+			scaleblocks[i] = 0;
+			d3d7dev->BeginStateBlock();
+			d3d7dev->SetMaterial(&scalematerials[i]);
+			if (FAILED(d3d7dev->EndStateBlock(&scaleblocks[i]))) scaleblocks[i] = 0;
+		}
+		error = d3d7dev->SetRenderState(D3DRENDERSTATE_AMBIENT, 0x40404040);
+		mat._11 = mat._22 = mat._33 = mat._44 = 1.0f;
+		mat._12 = mat._13 = mat._14 = mat._41 = 0.0f;
+		mat._21 = mat._23 = mat._24 = mat._42 = 0.0f;
+		mat._31 = mat._32 = mat._34 = mat._43 = 0.0f;
+		matView = mat;
+		matView._43 = 10.0f;
+		error = d3d7dev->SetTransform(D3DTRANSFORMSTATE_VIEW, &matView);
+		matProj = mat;
+		matProj._11 = 2.0f;
+		matProj._22 = 2.0f;
+		matProj._34 = 1.0f;
+		matProj._43 = -1.0f;
+		matProj._44 = 0.0f;
+		error = d3d7dev->SetTransform(D3DTRANSFORMSTATE_PROJECTION, &matProj);
+		bgcolor = 0x000040;
+		if (currentbenchmark)
+		{
+			scalecubes = currentbenchmark->scalecubes ? currentbenchmark->scalecubes : SCALE_DEFAULTCUBES;
+			scalepath = currentbenchmark->scalepath % SCALE_PATHS;
+			scalefvf = currentbenchmark->scalefvf % SCALE_FORMATS;
+			scalelights = (currentbenchmark->scalelights > 8) ? 8 : currentbenchmark->scalelights;
+			scalestages = (currentbenchmark->scalestages > 8) ? 8 : currentbenchmark->scalestages;
+			scalefog = currentbenchmark->scalefog % SCALE_FOGMODES;
+		}
+		else
+		{
+			scalecubes = SCALE_DEFAULTCUBES;
+			scalepath = scalefvf = scalelights = scalestages = scalefog = 0;
+		}
+		if (scalecubes < SCALE_MINCUBES) scalecubes = SCALE_MINCUBES;
+		if (scalecubes > SCALE_MAXCUBES) scalecubes = SCALE_MAXCUBES;
+		// The HUD is drawn with GDI, which would skew benchmark results
+		showhud = currentbenchmark ? 0 : 1;
+		scaletotaldraws = 0;
+		scaletotaltime = 0;
+		ScaleApplySettings();
+		break;
 	case 18: // Surface format test
 		ddsrender->GetSurfaceDesc(&ddsd);
 		ddsd.dwFlags = DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH;
@@ -1676,7 +2428,7 @@ void RunTestTimed(int test)
 	case 2: // GDI patterns
 	case 7: // ROP patterns
 	default:
-		if(fullscreen)	ddsurface->Flip(NULL,DDFLIP_WAIT);
+		if(fullscreen)	ddsurface->Flip(NULL,flipflags);
 		break;
 	case 4: // BltFast sprites
 		if (backbuffers) ddsrender->GetAttachedSurface(&ddscaps, &temp1);
@@ -1704,7 +2456,7 @@ void RunTestTimed(int test)
 		}
 		if (fullscreen)
 		{
-			if (backbuffers && ddsrender) ddsrender->Flip(NULL, DDFLIP_WAIT);
+			if (backbuffers && ddsrender) ddsrender->Flip(NULL, flipflags);
 		}
 		else
 		{
@@ -1899,7 +2651,7 @@ void RunTestTimed(int test)
 		if (backbuffers) temp1->Release();
 		if (fullscreen)
 		{
-			if (backbuffers && ddsrender) ddsrender->Flip(NULL, DDFLIP_WAIT);
+			if (backbuffers && ddsrender) ddsrender->Flip(NULL, flipflags);
 		}
 		else
 		{
@@ -2095,7 +2847,7 @@ void RunTestTimed(int test)
 		if (backbuffers) temp1->Release();
 		if (fullscreen)
 		{
-			if (backbuffers && ddsrender) ddsrender->Flip(NULL, DDFLIP_WAIT);
+			if (backbuffers && ddsrender) ddsrender->Flip(NULL, flipflags);
 		}
 		else
 		{
@@ -2110,7 +2862,7 @@ void RunTestTimed(int test)
 		break;
 	case 12: // Solid cube
 		error = d3d7dev->Clear(0, NULL, D3DCLEAR_TARGET | D3DCLEAR_ZBUFFER, bgcolor, 1.0, 0);
-		time = (float)clock() / (float)CLOCKS_PER_SEC;
+		time = GetTestTime();
 		mat._11 = mat._22 = mat._33 = mat._44 = 1.0f;
 		mat._12 = mat._13 = mat._14 = mat._41 = 0.0f;
 		mat._21 = mat._23 = mat._24 = mat._42 = 0.0f;
@@ -2125,7 +2877,7 @@ void RunTestTimed(int test)
 		error = d3d7dev->EndScene();
 		if (fullscreen)
 		{
-			if (backbuffers) ddsurface->Flip(NULL, DDFLIP_WAIT);
+			if (backbuffers) ddsurface->Flip(NULL, flipflags);
 		}
 		else
 		{
@@ -2140,7 +2892,7 @@ void RunTestTimed(int test)
 		break;
 	case 13: // Textured cube
 		error = d3d7dev->Clear(0, NULL, D3DCLEAR_TARGET | D3DCLEAR_ZBUFFER, bgcolor, 1.0, 0);
-		time = (float)clock() / (float)CLOCKS_PER_SEC;
+		time = GetTestTime();
 		mat._11 = mat._22 = mat._33 = mat._44 = 1.0f;
 		mat._12 = mat._13 = mat._14 = mat._41 = 0.0f;
 		mat._21 = mat._23 = mat._24 = mat._42 = 0.0f;
@@ -2162,7 +2914,7 @@ void RunTestTimed(int test)
 		error = d3d7dev->EndScene();
 		if (fullscreen)
 		{
-			if (backbuffers) ddsurface->Flip(NULL, DDFLIP_WAIT);
+			if (backbuffers) ddsurface->Flip(NULL, flipflags);
 		}
 		else
 		{
@@ -2177,7 +2929,7 @@ void RunTestTimed(int test)
 		break;
 	case 14: // Pixel pipeline test
 		error = d3d7dev->Clear(0, NULL, D3DCLEAR_TARGET | D3DCLEAR_ZBUFFER, bgcolor, 1.0, 0);
-		time = (float)clock() / (float)CLOCKS_PER_SEC;
+		time = GetTestTime();
 		mat._11 = mat._22 = mat._33 = mat._44 = 1.0f;
 		mat._12 = mat._13 = mat._14 = mat._41 = 0.0f;
 		mat._21 = mat._23 = mat._24 = mat._42 = 0.0f;
@@ -2192,7 +2944,7 @@ void RunTestTimed(int test)
 		error = d3d7dev->EndScene();
 		if (fullscreen)
 		{
-			if (backbuffers) ddsurface->Flip(NULL, DDFLIP_WAIT);
+			if (backbuffers) ddsurface->Flip(NULL, flipflags);
 		}
 		else
 		{
@@ -2207,7 +2959,7 @@ void RunTestTimed(int test)
 		break;
 	case 15: // Vertex pipeline test
 		error = d3d7dev->Clear(0, NULL, D3DCLEAR_TARGET | D3DCLEAR_ZBUFFER, bgcolor, 1.0, 0);
-		time = (float)clock() / (float)CLOCKS_PER_SEC;
+		time = GetTestTime();
 		mat._11 = mat._22 = mat._33 = mat._44 = 1.0f;
 		mat._12 = mat._13 = mat._14 = mat._41 = 0.0f;
 		mat._21 = mat._23 = mat._24 = mat._42 = 0.0f;
@@ -2222,7 +2974,7 @@ void RunTestTimed(int test)
 		error = d3d7dev->EndScene();
 		if (fullscreen)
 		{
-			if (backbuffers) ddsurface->Flip(NULL, DDFLIP_WAIT);
+			if (backbuffers) ddsurface->Flip(NULL, flipflags);
 		}
 		else
 		{
@@ -2350,7 +3102,7 @@ void RunTestTimed(int test)
 		}
 		if (fullscreen)
 		{
-			if (backbuffers && ddsrender) ddsrender->Flip(NULL, DDFLIP_WAIT);
+			if (backbuffers && ddsrender) ddsrender->Flip(NULL, flipflags);
 		}
 		else
 		{
@@ -2395,7 +3147,7 @@ void RunTestTimed(int test)
 		}
 		if (fullscreen)
 		{
-			if (backbuffers && ddsrender) ddsrender->Flip(NULL, DDFLIP_WAIT);
+			if (backbuffers && ddsrender) ddsrender->Flip(NULL, flipflags);
 		}
 		else
 		{
@@ -2919,6 +3671,272 @@ void RunWindowAPITest()
 	DrawWindowAPITest(ddsrender, hWnd, hmenu, windowpos, windowsize);
 }
 
+/**
+  * Draws one frame of the Blt stress test.  Each frame does stressblts blts
+  * that cycle through BltFast with and without color keys, stretched,
+  * mirrored, color key override, ROP and color fill blts.  Frames alternate
+  * between having the clipper attached to the target or not, and between
+  * submitting the Blt calls one at a time or with BltBatch.  BltFast can't
+  * clip, so it is replaced by Blt while the clipper is attached.
+  * @param target
+  *  Surface to draw to
+  */
+static void DrawBltStress(MultiDirectDrawSurface *target)
+{
+	static const DWORD fastflags[3] = { DDBLTFAST_NOCOLORKEY, DDBLTFAST_SRCCOLORKEY, DDBLTFAST_DESTCOLORKEY };
+	static const DWORD clipflags[3] = { 0, DDBLT_KEYSRC, DDBLT_KEYDEST };
+	DDBLTBATCH batch[STRESS_BATCHSIZE];
+	RECT destrects[STRESS_BATCHSIZE];
+	DDBLTFX bltfx[8];
+	RECT srcrect;
+	RECT destrect;
+	LARGE_INTEGER now;
+	LARGE_INTEGER frequency;
+	HDC hdc;
+	DWORD batchcount = 0;
+	DWORD i, j;
+	DWORD kind;
+	LONG x, y;
+	LONG xrange, yrange;
+	BOOL clip = (counter & 1) ? TRUE : FALSE;
+	BOOL usebatch = ((counter & 2) && stressbatch) ? TRUE : FALSE;
+	DDSURFACEDESC2 ddsd;
+	if (!stresspos || !sprites[0].surface) return;
+	if (ddver > 3) ddsd.dwSize = sizeof(DDSURFACEDESC2);
+	else ddsd.dwSize = sizeof(DDSURFACEDESC);
+	target->GetSurfaceDesc(&ddsd);
+	xrange = (ddsd.dwWidth > 128) ? ddsd.dwWidth - 128 : 1;
+	yrange = (ddsd.dwHeight > 128) ? ddsd.dwHeight - 128 : 1;
+	for (i = 0; i < 8; i++)
+	{
+		ZeroMemory(&bltfx[i], sizeof(DDBLTFX));
+		bltfx[i].dwSize = sizeof(DDBLTFX);
+	}
+	bltfx[4].dwDDFX = DDBLTFX_MIRRORLEFTRIGHT | DDBLTFX_MIRRORUPDOWN;
+	bltfx[5].ddckSrcColorkey.dwColorSpaceLowValue = bltfx[5].ddckSrcColorkey.dwColorSpaceHighValue = counter & 0xFF;
+	bltfx[6].dwROP = SRCINVERT;
+	bltfx[7].dwFillColor = rand32(randnum);
+	bltfx[0].dwFillColor = 0;
+	target->SetClipper(clip ? stressclipper : NULL);
+	target->Blt(NULL, NULL, NULL, DDBLT_COLORFILL | DDBLT_WAIT, &bltfx[0]);
+	SetRect(&srcrect, 0, 0, 64, 64);
+	for (i = 0; i < stressblts; i++)
+	{
+		x = (stresspos[i].x + (LONG)counter * 2) % xrange;
+		y = (stresspos[i].y + (LONG)counter) % yrange;
+		kind = i & 7;
+		if ((kind < 3) && !clip)
+		{
+			target->BltFast(x, y, sprites[0].surface, &srcrect, fastflags[kind] | DDBLTFAST_WAIT);
+			continue;
+		}
+		// Stretched blts are drawn at twice the size of the sprite
+		if (kind == 3) SetRect(&destrect, x, y, x + 128, y + 128);
+		else SetRect(&destrect, x, y, x + 64, y + 64);
+		switch (kind)
+		{
+		case 0:
+		case 1:
+		case 2:
+			batch[batchcount].dwFlags = DDBLT_WAIT | clipflags[kind];
+			break;
+		case 3:
+			batch[batchcount].dwFlags = DDBLT_WAIT;
+			break;
+		case 4:
+			batch[batchcount].dwFlags = DDBLT_WAIT | DDBLT_DDFX;
+			break;
+		case 5:
+			batch[batchcount].dwFlags = DDBLT_WAIT | DDBLT_KEYSRCOVERRIDE;
+			break;
+		case 6:
+			batch[batchcount].dwFlags = DDBLT_WAIT | DDBLT_ROP;
+			break;
+		case 7:
+			batch[batchcount].dwFlags = DDBLT_WAIT | DDBLT_COLORFILL;
+			break;
+		}
+		if (!usebatch)
+		{
+			target->Blt(&destrect, (kind == 7) ? NULL : sprites[0].surface, (kind == 7) ? NULL : &srcrect,
+				batch[batchcount].dwFlags, &bltfx[kind]);
+			continue;
+		}
+		destrects[batchcount] = destrect;
+		batch[batchcount].lprDest = &destrects[batchcount];
+		batch[batchcount].lpDDSSrc = (kind == 7) ? NULL : (LPDIRECTDRAWSURFACE)sprites[0].surface->GetSurface();
+		batch[batchcount].lprSrc = (kind == 7) ? NULL : &srcrect;
+		batch[batchcount].lpDDBltFx = &bltfx[kind];
+		batchcount++;
+		if ((batchcount == STRESS_BATCHSIZE) || (i == stressblts - 1))
+		{
+			// System DirectDraw doesn't implement BltBatch
+			if (FAILED(target->BltBatch(batch, batchcount, 0)))
+			{
+				stressbatch = FALSE;
+				for (j = 0; j < batchcount; j++)
+					target->Blt(batch[j].lprDest, batch[j].lpDDSSrc ? sprites[0].surface : NULL, batch[j].lprSrc,
+						batch[j].dwFlags, batch[j].lpDDBltFx);
+			}
+			batchcount = 0;
+		}
+	}
+	if (batchcount)
+	{
+		if (FAILED(target->BltBatch(batch, batchcount, 0)))
+		{
+			stressbatch = FALSE;
+			for (j = 0; j < batchcount; j++)
+				target->Blt(batch[j].lprDest, batch[j].lpDDSSrc ? sprites[0].surface : NULL, batch[j].lprSrc,
+					batch[j].dwFlags, batch[j].lpDDBltFx);
+		}
+	}
+	stressframes++;
+	stressdone += stressblts + 1;
+	QueryPerformanceCounter(&now);
+	QueryPerformanceFrequency(&frequency);
+	if ((now.QuadPart - stressstart) >= frequency.QuadPart)
+	{
+		_stprintf(stressstatus, _T("%u blts/frame, %.0f blts/s, %.1f fps%s"), stressblts,
+			(double)stressdone * (double)frequency.QuadPart / (double)(now.QuadPart - stressstart),
+			(double)stressframes * (double)frequency.QuadPart / (double)(now.QuadPart - stressstart),
+			stressbatch ? _T("") : _T(", BltBatch unsupported"));
+		if (!fullscreen) SetWindowText(hWnd, stressstatus);
+		stressstart = now.QuadPart;
+		stressframes = 0;
+		stressdone = 0;
+	}
+	if (showhud && stressstatus[0])
+	{
+		target->SetClipper(NULL);
+		if (SUCCEEDED(target->GetDC(&hdc)))
+		{
+			SetBkColor(hdc, RGB(0, 0, 255));
+			SetTextColor(hdc, RGB(255, 255, 255));
+			TextOut(hdc, 0, 0, stressstatus, _tcslen(stressstatus));
+			TextOut(hdc, 0, 16, _T("Up/Down: blts per frame, Space: hide text"), 41);
+			target->ReleaseDC(hdc);
+		}
+	}
+	counter++;
+}
+
+/**
+  * Draws one frame of the draw call scaling test.  Each cube of the grid is
+  * a draw call of its own, preceded by its world transform and its material,
+  * which is set with SetMaterial or, on the state block path, with
+  * ApplyStateBlock.  The CPU time from BeginScene to EndScene is counted as
+  * the time spent submitting the draws.
+  */
+static void DrawScaleScene()
+{
+	static const TCHAR keyhelp[] = _T("Up/Down: cubes, P: path, F: format, L: lights, T: stages, G: fog, Space: hide text");
+	D3DDRAWPRIMITIVESTRIDEDDATA strided;
+	D3DMATRIX mat;
+	LARGE_INTEGER start, end, frequency;
+	HDC hdc;
+	BYTE *data;
+	DWORD fvf, stride;
+	DWORD side;
+	DWORD i;
+	float scale, offset, time;
+	if (!d3d7dev || !mesh) return;
+	if (scaledirty) ScaleApplySettings();
+	data = ScaleVertexData(scalefvf, &fvf, &stride);
+	if ((scalepath == 0) && !scalelist[scalefvf]) return;
+	if ((scalepath >= 3) && !scalevb[scalefvf]) return;
+	ZeroMemory(&strided, sizeof(D3DDRAWPRIMITIVESTRIDEDDATA));
+	strided.position.lpvData = data;
+	strided.position.dwStride = stride;
+	switch (scalefvf)
+	{
+	case 0:
+		strided.normal.lpvData = data + offsetof(D3DVERTEX, nx);
+		strided.textureCoords[0].lpvData = data + offsetof(D3DVERTEX, tu);
+		break;
+	case 1:
+		strided.diffuse.lpvData = data + offsetof(D3DLVERTEX, color);
+		strided.specular.lpvData = data + offsetof(D3DLVERTEX, specular);
+		strided.textureCoords[0].lpvData = data + offsetof(D3DLVERTEX, tu);
+		break;
+	case 2:
+		strided.normal.lpvData = data + offsetof(COLORVERTEX, nx);
+		strided.diffuse.lpvData = data + offsetof(COLORVERTEX, color);
+		strided.specular.lpvData = data + offsetof(COLORVERTEX, specular);
+		strided.textureCoords[0].lpvData = data + offsetof(COLORVERTEX, tu);
+		break;
+	}
+	strided.normal.dwStride = strided.diffuse.dwStride = strided.specular.dwStride =
+		strided.textureCoords[0].dwStride = stride;
+	// Square grid filling the view, spinning around the Y axis
+	side = (DWORD)ceil(sqrt((double)scalecubes));
+	scale = 8.0f / ((float)side * 1.5f);
+	offset = ((float)side - 1.0f) * 0.75f * scale;
+	time = GetTestTime();
+	mat._12 = mat._14 = mat._21 = mat._23 = mat._24 = mat._32 = mat._34 = mat._43 = 0.0f;
+	mat._44 = 1.0f;
+	mat._11 = mat._33 = (FLOAT)cos(time) * scale;
+	mat._13 = -(FLOAT)sin(time) * scale;
+	mat._31 = (FLOAT)sin(time) * scale;
+	mat._22 = scale;
+	d3d7dev->Clear(0, NULL, D3DCLEAR_TARGET | D3DCLEAR_ZBUFFER, bgcolor, 1.0, 0);
+	QueryPerformanceCounter(&start);
+	d3d7dev->BeginScene();
+	for (i = 0; i < scalecubes; i++)
+	{
+		mat._41 = ((float)(i % side) * 1.5f * scale) - offset;
+		mat._42 = ((float)(i / side) * 1.5f * scale) - offset;
+		d3d7dev->SetTransform(D3DTRANSFORMSTATE_WORLD, &mat);
+		if ((scalepath == 4) && scaleblocks[i & 1]) d3d7dev->ApplyStateBlock(scaleblocks[i & 1]);
+		else d3d7dev->SetMaterial(&scalematerials[i & 1]);
+		switch (scalepath)
+		{
+		case 0:
+			d3d7dev->DrawPrimitive(D3DPT_TRIANGLELIST, fvf, scalelist[scalefvf], numindices, 0);
+			break;
+		case 1:
+			d3d7dev->DrawIndexedPrimitive(D3DPT_TRIANGLELIST, fvf, data, numpoints, mesh, numindices, 0);
+			break;
+		case 2:
+			d3d7dev->DrawIndexedPrimitiveStrided(D3DPT_TRIANGLELIST, fvf, &strided, numpoints, mesh, numindices, 0);
+			break;
+		case 3:
+		case 4:
+			d3d7dev->DrawIndexedPrimitiveVB(D3DPT_TRIANGLELIST, scalevb[scalefvf], 0, numpoints, mesh, numindices, 0);
+			break;
+		}
+	}
+	d3d7dev->EndScene();
+	QueryPerformanceCounter(&end);
+	QueryPerformanceFrequency(&frequency);
+	scaletime += end.QuadPart - start.QuadPart;
+	scaletotaltime += end.QuadPart - start.QuadPart;
+	scaledraws += scalecubes;
+	scaletotaldraws += scalecubes;
+	scaleframes++;
+	if ((end.QuadPart - scalestart) >= frequency.QuadPart)
+	{
+		_stprintf(scalestatus[0], _T("%u draws/frame, %.0f draws/s, %.3f us CPU/draw, %.1f fps"), scalecubes,
+			(double)scaledraws * (double)frequency.QuadPart / (double)(end.QuadPart - scalestart),
+			(double)scaletime * 1000000.0 / (double)frequency.QuadPart / (double)scaledraws,
+			(double)scaleframes * (double)frequency.QuadPart / (double)(end.QuadPart - scalestart));
+		if (!fullscreen) SetWindowText(hWnd, scalestatus[0]);
+		scalestart = end.QuadPart;
+		scaleframes = 0;
+		scaledraws = 0;
+		scaletime = 0;
+	}
+	if (showhud && SUCCEEDED(ddsrender->GetDC(&hdc)))
+	{
+		SetBkColor(hdc, RGB(0, 0, 255));
+		SetTextColor(hdc, RGB(255, 255, 255));
+		if (scalestatus[0][0]) TextOut(hdc, 0, 0, scalestatus[0], _tcslen(scalestatus[0]));
+		TextOut(hdc, 0, 16, scalestatus[1], _tcslen(scalestatus[1]));
+		TextOut(hdc, 0, 32, keyhelp, _tcslen(keyhelp));
+		ddsrender->ReleaseDC(hdc);
+	}
+}
+
 void RunTestLooped(int test)
 {
 	randnum += rand(); // Improves randomness of "snow" patterns at certain resolutions
@@ -2958,7 +3976,7 @@ void RunTestLooped(int test)
 		if(backbuffers)
 		{
 			temp1->Unlock(NULL);
-			ddsrender->Flip(NULL,DDFLIP_WAIT);
+			ddsrender->Flip(NULL,flipflags);
 		}
 		else ddsrender->Unlock(NULL);
 		if(!fullscreen)
@@ -3053,6 +4071,38 @@ void RunTestLooped(int test)
 			if(ddsurface && ddsrender)error = ddsurface->Blt(&destrect,ddsrender,&srcrect,DDBLT_WAIT,NULL);
 		}
 		break;
+	case 21: // Draw call scaling test
+		DrawScaleScene();
+		if (fullscreen)
+		{
+			if (backbuffers) ddsurface->Flip(NULL, flipflags);
+		}
+		else
+		{
+			p.x = 0;
+			p.y = 0;
+			ClientToScreen(hWnd, &p);
+			GetClientRect(hWnd, &destrect);
+			OffsetRect(&destrect, p.x, p.y);
+			SetRect(&srcrect, 0, 0, width, height);
+			if (ddsurface && ddsrender) error = ddsurface->Blt(&destrect, ddsrender, &srcrect, DDBLT_WAIT, NULL);
+		}
+		break;
+	case 20: // Blt stress test
+		if (backbuffers) ddsrender->GetAttachedSurface(&ddscaps, &temp1);
+		DrawBltStress(backbuffers ? temp1 : ddsrender);
+		if (backbuffers) ddsrender->Flip(NULL, flipflags);
+		if (!fullscreen)
+		{
+			p.x = 0;
+			p.y = 0;
+			ClientToScreen(hWnd, &p);
+			GetClientRect(hWnd, &destrect);
+			OffsetRect(&destrect, p.x, p.y);
+			SetRect(&srcrect, 0, 0, width, height);
+			if (ddsurface && ddsrender) error = ddsurface->Blt(&destrect, ddsrender, &srcrect, DDBLT_WAIT, NULL);
+		}
+		break;
 	case 9: // Large batch color fill
 		bltfx.dwSize = sizeof(DDBLTFX);
 		switch (bpp)
@@ -19,6 +19,8 @@
 #ifndef _TESTS_H
 #define _TESTS_H
 
+#include "../ddraw/PerfCounters.h"
+
 typedef struct
 {
 	MultiDirectDrawSurface *surface;
@@ -35,7 +37,46 @@ typedef struct
 	DDBLTFX bltfx;
 } DDSPRITE;
 
+// Settings of the draw call scaling test
+#define SCALE_PATHS 5
+#define SCALE_FORMATS 3
+#define SCALE_FOGMODES 5
+extern const char *const ScalePathNames[SCALE_PATHS];
+extern const char *const ScaleFormatNames[SCALE_FORMATS];
+extern const char *const ScaleFogNames[SCALE_FOGMODES];
+
+// Frames to draw in benchmark mode and the results of the run
+typedef struct
+{
+	DWORD frames;  // Frames to draw
+	double *frametimes;  // Receives the time of each frame, in milliseconds
+	DWORD framesdrawn;  // Less than frames if the window was closed
+	BOOL hascounters;  // TRUE if DXGL performance counters were read
+	DWORD framespresented;  // Presented frames whose counters were read
+	ULONGLONG totals[sizeof(DXGL_PERFCOUNTERS) / sizeof(DWORD)];  // Sum of each member of DXGL_PERFCOUNTERS over those frames
+	DXGL_PERFCOUNTERS last;  // Counters of the last presented frame
+	DWORD stressblts;  // Blts per frame of the Blt stress test, 0 for the default
+	DWORD scalecubes;  // Cubes per frame of the draw call scaling test, 0 for the default
+	DWORD scalepath;  // Index into ScalePathNames
+	DWORD scalefvf;  // Index into ScaleFormatNames
+	DWORD scalelights;  // Directional lights, 0 to 8
+	DWORD scalestages;  // Textured stages, 0 to 8
+	DWORD scalefog;  // Index into ScaleFogNames
+	ULONGLONG scaledraws;  // Draw calls made by the draw call scaling test
+	double scalecpums;  // CPU time spent submitting them, in milliseconds
+	LPCTSTR refdir;  // Directory of the reference images, NULL to not check the output
+	BOOL record;  // Write the checked frames to refdir instead of comparing them
+	DWORD checkinterval;  // Check every checkinterval-th frame, 0 to check only the last one
+	DWORD tolerance;  // Largest difference of a color channel that still matches
+	DWORD frameschecked;
+	DWORD framesfailed;  // Checked frames that differ from or have no reference image
+	DWORD firstfailed;  // Number of the first frame that failed, counting from 1
+	DWORD maxdifference;  // Largest channel difference of the compared frames
+} DXGLBENCHMARK;
+
 void RunDXGLTest(int testnum, int width, int height, int bpp, int refresh, int backbuffers, int apiver,
-	int filter, int msaa, double fps, bool fullscreen, bool resizable, BOOL is3d, BOOL softd3d, HWND parent);
+	int filter, int msaa, double fps, bool fullscreen, bool resizable, BOOL is3d, BOOL softd3d, HWND parent,
+	DXGLBENCHMARK *benchmark);
+BOOL CanBenchmarkTest(int testnum);
 
 #endif //_TESTS_H
@@ -0,0 +1,74 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+// Plays back a DXGL capture file and reports the frame rate
+
+#define _CRT_SECURE_NO_DEPRECATE
+#include <stdio.h>
+#include <stdlib.h>
+#include <windows.h>
+#include "../ddraw/include/ddraw.h"
+
+int main(int argc, char *argv[])
+{
+	HMODULE ddraw;
+	HRESULT(*_DXGLReplay)(LPCSTR filename, DWORD loops, DWORD *frames, double *seconds);
+	HRESULT error;
+	DWORD loops = 1;
+	DWORD frames;
+	double seconds;
+	if ((argc < 2) || (argc > 3) || ((argc == 3) && !(loops = strtoul(argv[2], NULL, 10))))
+	{
+		printf("Usage: dxglreplay capturefile [loops]\n");
+		printf("Plays back a capture written with DebugCapture.  The ddraw.dll next to this\n");
+		printf("program must be the DXGL build that wrote the capture.  Press Escape to stop.\n");
+		return 1;
+	}
+	ddraw = LoadLibraryA("ddraw.dll");
+	if (!ddraw)
+	{
+		printf("Could not load ddraw.dll\n");
+		return 1;
+	}
+	_DXGLReplay = (HRESULT(*)(LPCSTR, DWORD, DWORD*, double*))GetProcAddress(ddraw, "DXGLReplay");
+	if (!_DXGLReplay)
+	{
+		printf("ddraw.dll is not a DXGL build that can play back captures\n");
+		FreeLibrary(ddraw);
+		return 1;
+	}
+	error = _DXGLReplay(argv[1], loops, &frames, &seconds);
+	FreeLibrary(ddraw);
+	switch (error)
+	{
+	case DD_OK:
+		break;
+	case DDERR_NOTFOUND:
+		printf("Could not read %s\n", argv[1]);
+		return 1;
+	case DDERR_UNSUPPORTED:
+		printf("%s was written by a different build of DXGL\n", argv[1]);
+		return 1;
+	default:
+		printf("Playback failed, error 0x%08X\n", (unsigned int)error);
+		return 1;
+	}
+	printf("%u frames in %.3f seconds\n", frames, seconds);
+	if (frames && (seconds > 0.0))
+		printf("%.2f fps, %.3f ms per frame\n", (double)frames / seconds, seconds * 1000.0 / (double)frames);
+	return 0;
+}
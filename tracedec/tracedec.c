@@ -0,0 +1,371 @@
+// DXGL
+// Copyright (C) 2021 William Feely
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+// Converts a binary trace written with DebugTraceBinary to the text format of dxgl.log
+
+#define _CRT_SECURE_NO_DEPRECATE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+#include "../ddraw/tracedecode.h"
+
+typedef struct
+{
+	unsigned __int64 address;
+	const char *name;
+} TRACENAME;
+
+typedef struct
+{
+	LONGLONG time;
+	DWORD index;  // Position in the file, keeps events of one thread in order
+	DWORD threadid;
+	DWORD dropped;  // Events lost by the thread, for markers without an event
+	TRACEBIN_EVENT *event;
+} TRACEITEM;
+
+typedef struct
+{
+	DWORD threadid;
+	unsigned int depth;
+	LONGLONG time;  // Time of the last event read
+} TRACETHREAD;
+
+static TRACENAME *names = NULL;
+static DWORD namecount = 0;
+static DWORD namemax = 0;
+static TRACEITEM *items = NULL;
+static DWORD itemcount = 0;
+static DWORD itemmax = 0;
+static TRACETHREAD *threads = NULL;
+static DWORD threadcount = 0;
+
+static BOOL AddName(unsigned __int64 address, const char *name)
+{
+	TRACENAME *newnames;
+	if (namecount >= namemax)
+	{
+		newnames = (TRACENAME*)realloc(names, (namemax ? namemax * 2 : 1024) * sizeof(TRACENAME));
+		if (!newnames) return FALSE;
+		names = newnames;
+		namemax = namemax ? namemax * 2 : 1024;
+	}
+	names[namecount].address = address;
+	names[namecount].name = name;
+	namecount++;
+	return TRUE;
+}
+
+static BOOL AddItem(LONGLONG time, DWORD threadid, DWORD dropped, TRACEBIN_EVENT *event)
+{
+	TRACEITEM *newitems;
+	if (itemcount >= itemmax)
+	{
+		newitems = (TRACEITEM*)realloc(items, (itemmax ? itemmax * 2 : 65536) * sizeof(TRACEITEM));
+		if (!newitems) return FALSE;
+		items = newitems;
+		itemmax = itemmax ? itemmax * 2 : 65536;
+	}
+	items[itemcount].time = time;
+	items[itemcount].index = itemcount;
+	items[itemcount].threadid = threadid;
+	items[itemcount].dropped = dropped;
+	items[itemcount].event = event;
+	itemcount++;
+	return TRUE;
+}
+
+static int CompareNames(const void *a, const void *b)
+{
+	if (((const TRACENAME*)a)->address < ((const TRACENAME*)b)->address) return -1;
+	if (((const TRACENAME*)a)->address > ((const TRACENAME*)b)->address) return 1;
+	return 0;
+}
+
+static int CompareItems(const void *a, const void *b)
+{
+	const TRACEITEM *x = (const TRACEITEM*)a;
+	const TRACEITEM *y = (const TRACEITEM*)b;
+	if (x->time < y->time) return -1;
+	if (x->time > y->time) return 1;
+	if (x->index < y->index) return -1;
+	if (x->index > y->index) return 1;
+	return 0;
+}
+
+static const char *FindName(unsigned __int64 address)
+{
+	TRACENAME key;
+	TRACENAME *found;
+	static char unknown[32];
+	key.address = address;
+	found = (TRACENAME*)bsearch(&key, names, namecount, sizeof(TRACENAME), CompareNames);
+	if (found) return found->name;
+	sprintf(unknown, "0x%I64X", address);
+	return unknown;
+}
+
+static TRACETHREAD *FindThread(DWORD threadid)
+{
+	DWORD i;
+	TRACETHREAD *newthreads;
+	for (i = 0; i < threadcount; i++)
+		if (threads[i].threadid == threadid) return &threads[i];
+	newthreads = (TRACETHREAD*)realloc(threads, (threadcount + 1) * sizeof(TRACETHREAD));
+	if (!newthreads) return NULL;
+	threads = newthreads;
+	threads[threadcount].threadid = threadid;
+	threads[threadcount].depth = 0;
+	threads[threadcount].time = 0;
+	return &threads[threadcount++];
+}
+
+/**
+  * Reads the records of a trace file into the name and event lists.
+  * @param data
+  *  Contents of the file after the header
+  * @param size
+  *  Size of data in bytes
+  * @return
+  *  FALSE if the file is damaged or out of memory
+  */
+static BOOL ReadRecords(BYTE *data, DWORD size)
+{
+	DWORD pos = 0;
+	DWORD chunkpos;
+	TRACEBIN_RECORD *rec;
+	TRACEBIN_CHUNKREC *chunk;
+	TRACEBIN_EVENT *event;
+	TRACETHREAD *thread;
+	while (pos + sizeof(TRACEBIN_RECORD) <= size)
+	{
+		rec = (TRACEBIN_RECORD*)(data + pos);
+		if ((rec->size < sizeof(TRACEBIN_RECORD)) || (rec->size > size - pos)) return FALSE;
+		switch (rec->type)
+		{
+		case TRACEBIN_NAME:
+			data[pos + rec->size - 1] = 0;
+			if (!AddName(((TRACEBIN_NAMEREC*)rec)->address, (const char*)(data + pos + sizeof(TRACEBIN_NAMEREC))))
+				return FALSE;
+			break;
+		case TRACEBIN_CHUNK:
+			chunk = (TRACEBIN_CHUNKREC*)rec;
+			chunkpos = pos + sizeof(TRACEBIN_CHUNKREC);
+			thread = FindThread(chunk->threadid);
+			if (!thread) return FALSE;
+			while (chunkpos + sizeof(TRACEBIN_RECORD) <= pos + rec->size)
+			{
+				event = (TRACEBIN_EVENT*)(data + chunkpos);
+				if ((event->rec.size < sizeof(TRACEBIN_RECORD)) || (event->rec.size > pos + rec->size - chunkpos))
+					return FALSE;
+				if ((event->rec.type != TRACEBIN_PAD) && (event->rec.size >= sizeof(TRACEBIN_EVENT)))
+				{
+					if (event->rec.type == TRACEBIN_STRING) data[chunkpos + event->rec.size - 1] = 0;
+					if (!AddItem(event->time, chunk->threadid, 0, event)) return FALSE;
+					thread->time = event->time;
+				}
+				chunkpos += event->rec.size;
+			}
+			// Events are only lost while the buffer is full, after the events already in it
+			if (chunk->dropped && !AddItem(thread->time, chunk->threadid, chunk->dropped, NULL)) return FALSE;
+			break;
+		default:
+			break;
+		}
+		pos += rec->size;
+	}
+	return TRUE;
+}
+
+static void WriteString(HANDLE file, const char *str)
+{
+	DWORD byteswritten;
+	WriteFile(file, str, strlen(str), &byteswritten, NULL);
+}
+
+static void WriteIndent(HANDLE file, unsigned int depth)
+{
+	unsigned int i;
+	for (i = 0; i < depth; i++)
+		WriteString(file, "    ");
+}
+
+// Returns the next argument, or NULL if the argument runs past the end of the event
+static TRACEBIN_ARG *WriteArg(HANDLE file, TRACEBIN_ARG *arg, BYTE *end)
+{
+	if (!arg || ((BYTE*)(arg + 1) > end) || (arg->size > (DWORD)(end - (BYTE*)(arg + 1))))
+	{
+		WriteString(file, "<corrupt>");
+		return NULL;
+	}
+	if (arg->size) trace_decode_arg(file, arg->type, arg + 1);
+	else if ((arg->type == 10) && !arg->value) WriteString(file, "NULL");
+	else trace_decode_arg(file, arg->type, (void*)(ULONG_PTR)arg->value);
+	return (TRACEBIN_ARG*)((BYTE*)(arg + 1) + TRACEBIN_ALIGN(arg->size));
+}
+
+static void WriteItem(HANDLE file, TRACEITEM *item, LONGLONG start, LONGLONG frequency, BOOL timestamps)
+{
+	TRACETHREAD *thread = FindThread(item->threadid);
+	TRACEBIN_EVENT *event = item->event;
+	TRACEBIN_ARG *arg;
+	BYTE *end;
+	char str[64];
+	DWORD i;
+	if (!thread) return;
+	if (timestamps)
+	{
+		sprintf(str, "[%u %.6f] ", item->threadid, (double)(item->time - start) / (double)frequency);
+		WriteString(file, str);
+	}
+	if (!event)
+	{
+		WriteIndent(file, thread->depth);
+		sprintf(str, "%u events dropped by thread %u\r\n", item->dropped, item->threadid);
+		WriteString(file, str);
+		return;
+	}
+	arg = (TRACEBIN_ARG*)(event + 1);
+	end = (BYTE*)event + event->rec.size;
+	switch (event->rec.type)
+	{
+	case TRACEBIN_ENTER:
+		WriteIndent(file, thread->depth);
+		WriteString(file, FindName(event->function));
+		WriteString(file, "(");
+		for (i = 0; i < event->count; i++)
+		{
+			if (i != 0) WriteString(file, ", ");
+			arg = WriteArg(file, arg, end);
+			if (!arg) break;
+		}
+		WriteString(file, ");\r\n");
+		thread->depth++;
+		break;
+	case TRACEBIN_EXIT:
+		if (thread->depth) thread->depth--;
+		WriteIndent(file, thread->depth);
+		WriteString(file, FindName(event->function));
+		WriteString(file, " returned ");
+		WriteArg(file, arg, end);
+		WriteString(file, "\r\n");
+		break;
+	case TRACEBIN_VAR:
+		if (thread->depth) WriteIndent(file, thread->depth - 1);
+		WriteString(file, FindName(event->function));
+		WriteString(file, ": ");
+		WriteString(file, FindName(event->var));
+		WriteString(file, " set to ");
+		WriteArg(file, arg, end);
+		WriteString(file, "\r\n");
+		break;
+	case TRACEBIN_STRING:
+		if (thread->depth) WriteIndent(file, thread->depth - 1);
+		WriteString(file, (const char*)(event + 1));
+		break;
+	default:
+		break;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	char outpath[MAX_PATH + 1];
+	char *extension;
+	const char *inpath = NULL;
+	BOOL timestamps = FALSE;
+	HANDLE infile, outfile;
+	DWORD size, bytesread;
+	BYTE *data;
+	TRACEBIN_HEADER *header;
+	LONGLONG start = 0;
+	DWORD i;
+	outpath[0] = 0;
+	for (i = 1; i < (DWORD)argc; i++)
+	{
+		if (!strcmp(argv[i], "-t") || !strcmp(argv[i], "/t")) timestamps = TRUE;
+		else if (!inpath) inpath = argv[i];
+		else if (!outpath[0])
+		{
+			strncpy(outpath, argv[i], MAX_PATH);
+			outpath[MAX_PATH] = 0;
+		}
+	}
+	if (!inpath)
+	{
+		puts("Usage: tracedec [-t] dxgl.trc [output.log]");
+		puts("  -t  Prefix each line with the thread ID and seconds since the first event");
+		return 1;
+	}
+	if (!outpath[0])
+	{
+		strncpy(outpath, inpath, MAX_PATH - 4);
+		outpath[MAX_PATH - 4] = 0;
+		extension = strrchr(outpath, '.');
+		if (extension && !strchr(extension, '\\')) *extension = 0;
+		strcat(outpath, ".log");
+	}
+	infile = CreateFileA(inpath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL, NULL);
+	if (infile == INVALID_HANDLE_VALUE)
+	{
+		printf("Cannot open %s\n", inpath);
+		return 1;
+	}
+	size = GetFileSize(infile, NULL);
+	data = (BYTE*)malloc(size ? size : 1);
+	if (!data || !ReadFile(infile, data, size, &bytesread, NULL) || (bytesread != size))
+	{
+		printf("Cannot read %s\n", inpath);
+		CloseHandle(infile);
+		return 1;
+	}
+	CloseHandle(infile);
+	header = (TRACEBIN_HEADER*)data;
+	if ((size < sizeof(TRACEBIN_HEADER)) || memcmp(header->magic, TRACEBIN_MAGIC, 8)
+		|| (header->version != TRACEBIN_VERSION))
+	{
+		printf("%s is not a DXGL binary trace\n", inpath);
+		return 1;
+	}
+	if (header->pointersize > sizeof(void*))
+		puts("Warning: trace is from a 64-bit process, pointers may be truncated");
+	if (!ReadRecords(data + sizeof(TRACEBIN_HEADER), size - sizeof(TRACEBIN_HEADER)))
+		puts("Warning: trace is damaged or incomplete, decoding what could be read");
+	qsort(names, namecount, sizeof(TRACENAME), CompareNames);
+	qsort(items, itemcount, sizeof(TRACEITEM), CompareItems);
+	outfile = CreateFileA(outpath, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (outfile == INVALID_HANDLE_VALUE)
+	{
+		printf("Cannot create %s\n", outpath);
+		return 1;
+	}
+	for (i = 0; i < itemcount; i++)
+	{
+		if (items[i].event)
+		{
+			start = items[i].time;
+			break;
+		}
+	}
+	for (i = 0; i < itemcount; i++)
+		WriteItem(outfile, &items[i], start, header->frequency ? header->frequency : 1, timestamps);
+	CloseHandle(outfile);
+	printf("Wrote %u events to %s\n", itemcount, outpath);
+	return 0;
+}